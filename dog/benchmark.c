@@ -17,6 +17,7 @@
 #include "dog.h"
 #include "sheep.h"
 #include "work.h"
+#include "option.h"
 
 static struct sd_option benchmark_options[] = {
 	{'w', "workqueue", true, "specify workqueue type"},
@@ -24,10 +25,18 @@ static struct sd_option benchmark_options[] = {
 	{'t', "total", true, "a number of total operation (e.g. I/O request)"},
 	{'n', "nr-threads", true, "a number of worker threads"
 	 " (only used for fixed workqueue)"},
+	{'b', "block-size", true, "specify the I/O size (default: 4K)"},
+	{'m', "read-mix", true, "specify the percentage of reads"
+	 " (default: 0)"},
+	{'q', "queue-depth", true, "a number of requests in flight"
+	 " (default: 1)"},
+	{'R', "random", false, "access the blocks at random instead of"
+	 " sequentially"},
 	{ 0, NULL, false, NULL },
 };
 
 #define DEFAULT_TOTAL 1000
+#define DEFAULT_BLOCK_SIZE (4 * 1024)
 #define WQ_TYPE_LEN 32
 
 static struct benchmark_cmd_data {
@@ -35,6 +44,10 @@ static struct benchmark_cmd_data {
 	bool force;
 	int total;
 	int nr_threads;
+	uint64_t block_size;
+	int read_mix;
+	int queue_depth;
+	bool random;
 } benchmark_cmd_data;
 
 struct benchmark_io_work {
@@ -170,6 +183,264 @@ static int benchmark_io(int argc, char **argv)
 	return 0;
 }
 
+struct latency_histogram {
+	uint64_t nr;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[SD_NR_LATENCY_BUCKETS];
+};
+
+static void latency_add(struct latency_histogram *h, uint64_t us)
+{
+	uint64_t max;
+
+	uatomic_inc(&h->nr);
+	uatomic_add(&h->sum, us);
+	uatomic_inc(&h->buckets[latency_to_bucket(us)]);
+	while ((max = uatomic_read(&h->max)) < us)
+		uatomic_cmpxchg(&h->max, max, us);
+}
+
+static uint64_t histogram_percentile(const struct latency_histogram *h,
+				     double percentile)
+{
+	return latency_percentile(h->buckets, h->nr, h->max, percentile);
+}
+
+struct benchmark_vdi {
+	const char *name;
+	uint32_t vid;
+	uint64_t nr_blocks;
+	uint8_t block_size_shift;
+	uint8_t nr_copies, copy_policy;
+};
+
+static struct benchmark_run_data {
+	struct benchmark_vdi *vdis;
+	int nr_vdis;
+	uint64_t block_size;
+	int total;
+	int issued;
+	struct latency_histogram reads, writes;
+	bool failed;
+} run_data;
+
+/* One stream of synchronous requests, queue_depth of them run at once */
+struct benchmark_stream_work {
+	struct work work;
+	unsigned int seed;
+	char *buf;
+};
+
+/* Pick the vdi and the block of the n-th request */
+static void pick_block(struct benchmark_stream_work *w, int n,
+		       const struct benchmark_vdi **vdi, uint64_t *block)
+{
+	if (benchmark_cmd_data.random) {
+		*vdi = run_data.vdis + rand_r(&w->seed) % run_data.nr_vdis;
+		*block = (((uint64_t)rand_r(&w->seed) << 31) ^
+			  rand_r(&w->seed)) % (*vdi)->nr_blocks;
+	} else {
+		*vdi = run_data.vdis + n % run_data.nr_vdis;
+		*block = (n / run_data.nr_vdis) % (*vdi)->nr_blocks;
+	}
+}
+
+static void benchmark_stream_worker(struct work *work)
+{
+	struct benchmark_stream_work *w =
+		container_of(work, struct benchmark_stream_work, work);
+	uint64_t bs = run_data.block_size;
+	int n, ret;
+
+	while ((n = uatomic_add_return(&run_data.issued, 1) - 1) <
+	       run_data.total) {
+		const struct benchmark_vdi *vdi;
+		struct timespec start, end;
+		uint64_t block, offset, oid;
+		bool read;
+
+		if (uatomic_read(&run_data.failed))
+			return;
+
+		pick_block(w, n, &vdi, &block);
+		offset = block * bs;
+		oid = vid_to_data_oid(vdi->vid,
+				      offset >> vdi->block_size_shift);
+		offset &= (UINT64_C(1) << vdi->block_size_shift) - 1;
+		read = rand_r(&w->seed) % 100 < benchmark_cmd_data.read_mix;
+
+		start = get_time_tick();
+		if (read)
+			ret = dog_read_object(oid, w->buf, bs, offset, false);
+		else
+			ret = dog_write_object(oid, 0, w->buf, bs, offset, 0,
+					       vdi->nr_copies,
+					       vdi->copy_policy, false, false);
+		end = get_time_tick();
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to %s object %016"PRIx64", %s",
+			       read ? "read" : "write", oid, sd_strerror(ret));
+			uatomic_set(&run_data.failed, true);
+			return;
+		}
+
+		latency_add(read ? &run_data.reads : &run_data.writes,
+			    get_time_interval(&start, &end) * 1000000);
+	}
+}
+
+static void benchmark_stream_main(struct work *work)
+{
+	struct benchmark_stream_work *w =
+		container_of(work, struct benchmark_stream_work, work);
+
+	free(w->buf);
+	free(w);
+}
+
+static int load_benchmark_vdi(const char *name, struct benchmark_vdi *vdi)
+{
+	struct sd_inode *inode = xzalloc(sizeof(*inode));
+	uint64_t nr_objects;
+	int ret;
+
+	ret = read_vdi_obj(name, 0, "", &vdi->vid, inode, sizeof(*inode));
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to lookup VDI %s: %s", name, sd_strerror(ret));
+		goto out;
+	}
+
+	ret = SD_RES_INVALID_PARMS;
+	if (run_data.block_size > (UINT64_C(1) << inode->block_size_shift)) {
+		sd_err("block size is larger than the objects of VDI %s",
+		       name);
+		goto out;
+	}
+
+	/* Writes to shared or unallocated objects would measure COW */
+	nr_objects = count_data_objs(inode);
+	for (uint64_t i = 0; i < nr_objects; i++) {
+		if (inode->data_vdi_id[i] != vdi->vid) {
+			sd_err("VDI %s has unallocated data", name);
+			goto out;
+		}
+	}
+
+	vdi->name = name;
+	vdi->block_size_shift = inode->block_size_shift;
+	vdi->nr_blocks = (nr_objects << inode->block_size_shift) /
+		run_data.block_size;
+	vdi->nr_copies = inode->nr_copies;
+	vdi->copy_policy = inode->copy_policy;
+	if (!vdi->nr_blocks) {
+		sd_err("VDI %s is empty", name);
+		goto out;
+	}
+	ret = SD_RES_SUCCESS;
+out:
+	free(inode);
+	return ret;
+}
+
+static void print_latency(const char *op, const struct latency_histogram *h,
+			  double elapsed)
+{
+	uint64_t p50, p99, p999;
+
+	if (!h->nr)
+		return;
+
+	p50 = histogram_percentile(h, 50);
+	p99 = histogram_percentile(h, 99);
+	p999 = histogram_percentile(h, 99.9);
+	if (raw_output) {
+		printf("%s %"PRIu64" %.0f %.0f %"PRIu64" %"PRIu64" %"PRIu64
+		       " %"PRIu64" %"PRIu64"\n", op, h->nr, h->nr / elapsed,
+		       h->nr * run_data.block_size / elapsed, h->sum / h->nr,
+		       p50, p99, p999, h->max);
+		return;
+	}
+
+	printf("%-6s %10"PRIu64" %10.0f %10s/s %8"PRIu64" %8"PRIu64
+	       " %8"PRIu64" %8"PRIu64" %8"PRIu64"\n", op, h->nr,
+	       h->nr / elapsed,
+	       strnumber(h->nr * run_data.block_size / elapsed),
+	       h->sum / h->nr, p50, p99, p999, h->max);
+}
+
+static int benchmark_run(int argc, char **argv)
+{
+	int nr_streams = benchmark_cmd_data.queue_depth ?: 1;
+	struct work_queue *wq;
+	struct timespec start, end;
+	double elapsed;
+
+	if (benchmark_cmd_data.read_mix < 100 && !benchmark_cmd_data.force)
+		confirm("Caution! benchmark run command will erase all data of"
+			" target VDIs.\n Are you sure you want to continue?"
+			" [yes/no]");
+
+	run_data.block_size = benchmark_cmd_data.block_size ?:
+		DEFAULT_BLOCK_SIZE;
+	run_data.total = benchmark_cmd_data.total ?: DEFAULT_TOTAL;
+	run_data.nr_vdis = argc - optind;
+	run_data.vdis = xcalloc(run_data.nr_vdis, sizeof(*run_data.vdis));
+	for (int i = 0; i < run_data.nr_vdis; i++)
+		if (load_benchmark_vdi(argv[optind + i], run_data.vdis + i) !=
+		    SD_RES_SUCCESS)
+			return EXIT_SYSFAIL;
+
+	wq = create_fixed_work_queue("benchmark", nr_streams);
+	if (!wq) {
+		sd_err("failed to create work queue");
+		return EXIT_SYSFAIL;
+	}
+
+	if (!raw_output) {
+		for (int i = 0; i < run_data.nr_vdis; i++) {
+			const struct benchmark_vdi *vdi = run_data.vdis + i;
+
+			if (vdi->copy_policy)
+				printf("%s: erasure coded %s\n", vdi->name,
+				       ec_policy_to_str(vdi->copy_policy));
+			else
+				printf("%s: %d copies\n", vdi->name,
+				       vdi->nr_copies);
+		}
+		printf("%s %s, %d%% reads, queue depth %d, %d requests\n",
+		       strnumber(run_data.block_size),
+		       benchmark_cmd_data.random ? "random" : "sequential",
+		       benchmark_cmd_data.read_mix, nr_streams, run_data.total);
+	}
+
+	start = get_time_tick();
+	for (int i = 0; i < nr_streams; i++) {
+		struct benchmark_stream_work *w = xzalloc(sizeof(*w));
+
+		w->seed = time(NULL) ^ i;
+		w->buf = xzalloc(run_data.block_size);
+		w->work.fn = benchmark_stream_worker;
+		w->work.done = benchmark_stream_main;
+		queue_work(wq, &w->work);
+	}
+	work_queue_wait(wq);
+	end = get_time_tick();
+
+	if (run_data.failed)
+		return EXIT_SYSFAIL;
+
+	elapsed = get_time_interval(&start, &end);
+	if (!raw_output)
+		printf("%-6s %10s %10s %12s %8s %8s %8s %8s %8s\n", "", "ops",
+		       "iops", "bandwidth", "avg(us)", "p50", "p99", "p999",
+		       "max");
+	print_latency("read", &run_data.reads, elapsed);
+	print_latency("write", &run_data.writes, elapsed);
+
+	return EXIT_SUCCESS;
+}
+
 static int benchmark_parser(int ch, const char *opt)
 {
 	switch (ch) {
@@ -186,6 +457,31 @@ static int benchmark_parser(int ch, const char *opt)
 	case 'n':
 		benchmark_cmd_data.nr_threads = atoi(opt);
 		break;
+	case 'b':
+		if (option_parse_size(opt, &benchmark_cmd_data.block_size) < 0
+		    || !benchmark_cmd_data.block_size) {
+			sd_err("invalid block size: %s", opt);
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 'm':
+		benchmark_cmd_data.read_mix = atoi(opt);
+		if (benchmark_cmd_data.read_mix < 0 ||
+		    100 < benchmark_cmd_data.read_mix) {
+			sd_err("read mix must be between 0 and 100");
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 'q':
+		benchmark_cmd_data.queue_depth = atoi(opt);
+		if (benchmark_cmd_data.queue_depth < 1) {
+			sd_err("invalid queue depth: %s", opt);
+			exit(EXIT_USAGE);
+		}
+		break;
+	case 'R':
+		benchmark_cmd_data.random = true;
+		break;
 	default:
 		sd_err("unknown option: %c", ch);
 		return -1;
@@ -197,6 +493,10 @@ static int benchmark_parser(int ch, const char *opt)
 static struct subcommand benchmark_cmd[] = {
 	{"io", "<vdiname>", "aprhTfwtn", "benchmark I/O performance",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG, benchmark_io, benchmark_options},
+	{"run", "<vdiname>...", "aprhTfbmqRt",
+	 "benchmark a mix of reads and writes over VDIs",
+	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG, benchmark_run,
+	 benchmark_options},
 	{NULL,},
 };
 
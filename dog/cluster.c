@@ -24,6 +24,8 @@ static struct sd_option cluster_options[] = {
 	{'f', "force", false, "do not prompt for confirmation"},
 	{'F', "avoid-diskfull", false, "skip recovery if recovery process can"
 	 " cause disk full"},
+	{'k', "checksum", false, "keep the CRC32C of the objects to verify"
+	 " the reads"},
 	{'l', "lock", false, "Lock vdi to exclude multiple users"},
 	{'m', "multithread", false,
 	 "use multi-thread for 'cluster snapshot save'"},
@@ -33,6 +35,10 @@ static struct sd_option cluster_options[] = {
 	{'z', "block_size_shift", true, "specify the shift num of default"
 	      " data object size"},
 	{'V', "fixedvnodes", false, "disable automatic vnodes calculation"},
+	{'P', "probes", true, "specify the number of hashes (1 to 256) probed"
+	      " per object for placement"},
+	{'D', "distributed", false, "let every node verify and repair the"
+	 " replicas it owns"},
 	{'d', "diff", false,
 	 "just output the changes between the two adjacent epoches"
 		"for cluster info"},
@@ -52,6 +58,9 @@ static struct cluster_cmd_data {
 	bool use_lock;
 	bool recycle_vid;
 	bool avoid_diskfull;
+	bool checksum;
+	bool distributed;
+	int nr_probes;
 } cluster_cmd_data;
 
 #define DEFAULT_STORE	"plain"
@@ -93,6 +102,52 @@ static bool no_vdi(const unsigned long *vdis)
 	"  /  |   Caution! The cluster is not empty.\n" \
 	"(/_)_|_  Are you sure you want to continue? [yes/no]: "
 
+/* Check that the vnode strategy of every node agrees with '-V' */
+static int check_vnode_strategy(void)
+{
+	struct node_reply *replies;
+	struct sd_req req;
+	int ret = EXIT_SUCCESS;
+
+	sd_init_req(&req, SD_OP_CLUSTER_INFO);
+	req.data_length = sizeof(struct cluster_info);
+	replies = query_nodes(&req);
+
+	for (int i = 0; i < sd_nodes_nr; i++) {
+		const struct sd_node *n = replies[i].node;
+		const struct cluster_info *cinfo = replies[i].data;
+		const char *err = node_reply_error(replies + i);
+
+		if (err) {
+			sd_err("%s: %s", addr_to_str(n->nid.addr, n->nid.port),
+			       err);
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		if (n->nr_vnodes == 0)
+			continue;
+		if ((cinfo->flags & SD_CLUSTER_FLAG_AUTO_VNODES)
+			&& cluster_cmd_data.fixed_vnodes) {
+			sd_err("Can not apply the option of '-V', "
+				"because there are vnode strategy of sheep "
+				"is auto in the cluster");
+			ret = EXIT_FAILURE;
+			break;
+		} else if (!(cinfo->flags & SD_CLUSTER_FLAG_AUTO_VNODES)
+			&& !cluster_cmd_data.fixed_vnodes) {
+			sd_err("Need to specify the option of '-V', "
+				"because there are vnode strategy of sheep "
+				"is fixed in the cluster");
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	free_node_replies(replies);
+
+	return ret;
+}
+
 static int cluster_format(int argc, char **argv)
 {
 	int ret;
@@ -101,41 +156,10 @@ static int cluster_format(int argc, char **argv)
 	struct timeval tv;
 	char store_name[STORE_LEN];
 	static DECLARE_BITMAP(vdi_inuse, SD_NR_VDIS);
-	struct sd_node *n;
-
-	rb_for_each_entry(n, &sd_nroot, rb) {
-		struct sd_req info_req;
-		struct sd_rsp *info_rsp = (struct sd_rsp *)&info_req;
-		struct cluster_info cinfo;
-
-		sd_init_req(&info_req, SD_OP_CLUSTER_INFO);
-		info_req.data_length = sizeof(cinfo);
-		ret = dog_exec_req(&n->nid, &info_req, &cinfo);
-		if (ret < 0) {
-			sd_err("Fail to execute request");
-			return EXIT_FAILURE;
-		}
-		if (info_rsp->result != SD_RES_SUCCESS) {
-			sd_err("%s", sd_strerror(info_rsp->result));
-			return EXIT_FAILURE;
-		}
 
-		if (n->nr_vnodes != 0) {
-			if ((cinfo.flags & SD_CLUSTER_FLAG_AUTO_VNODES)
-				&& cluster_cmd_data.fixed_vnodes) {
-				sd_err("Can not apply the option of '-V', "
-					"because there are vnode strategy of sheep "
-					"is auto in the cluster");
-				return EXIT_FAILURE;
-			} else if (!(cinfo.flags & SD_CLUSTER_FLAG_AUTO_VNODES)
-				&& !cluster_cmd_data.fixed_vnodes) {
-				sd_err("Need to specify the option of '-V', "
-					"because there are vnode strategy of sheep "
-					"is fixed in the cluster");
-				return EXIT_FAILURE;
-			}
-		}
-	}
+	ret = check_vnode_strategy();
+	if (ret != EXIT_SUCCESS)
+		return ret;
 
 	if (cluster_cmd_data.copies > sd_zones_nr) {
 		char info[1024];
@@ -193,6 +217,13 @@ static int cluster_format(int argc, char **argv)
 	if (cluster_cmd_data.avoid_diskfull)
 		hdr.cluster.flags |= SD_CLUSTER_FLAG_AVOID_DISKFULL;
 
+	if (cluster_cmd_data.checksum)
+		hdr.cluster.flags |= SD_CLUSTER_FLAG_CHECKSUM;
+
+	if (cluster_cmd_data.nr_probes > 1)
+		hdr.cluster.flags |= (cluster_cmd_data.nr_probes - 1) <<
+			SD_CLUSTER_PROBES_SHIFT;
+
 	printf("using backend %s store\n", store_name);
 	ret = dog_exec_req(&sd_nid, &hdr, store_name);
 	if (ret < 0)
@@ -337,17 +368,13 @@ retry:
 		if (!raw_output)
 			printf("Cluster store: ");
 		if (rsp->result == SD_RES_SUCCESS) {
-			char copy[10];
-			int data, parity;
+			char copy[16];
 			if (!logs->copy_policy)
 				snprintf(copy, sizeof(copy), "%d",
 					 logs->nr_copies);
-			else {
-				ec_policy_to_dp(logs->copy_policy,
-						&data, &parity);
-				snprintf(copy, sizeof(copy), "%d:%d",
-					 data, parity);
-			}
+			else
+				pstrcpy(copy, sizeof(copy),
+					ec_policy_to_str(logs->copy_policy));
 			printf("%s with %s redundancy policy\n",
 			       logs->drv_name, copy);
 
@@ -359,6 +386,24 @@ retry:
 			else
 				printf("fixed\n");
 
+			if (sd_placement_probes(logs->flags) > 1) {
+				if (!raw_output)
+					printf("Cluster placement: ");
+				printf("multi-probe with %d probes\n",
+				       sd_placement_probes(logs->flags));
+			}
+
+			/* of the node we asked, see 'sheep -n' and '-N' */
+			if (!raw_output)
+				printf("Node write sync: ");
+			if (logs->nosync)
+				printf("disabled\n");
+			else if (logs->writeback_window)
+				printf("write-back within %d msec\n",
+				       logs->writeback_window);
+			else
+				printf("every write\n");
+
 		} else
 			printf("%s\n", sd_strerror(rsp->result));
 
@@ -806,8 +851,85 @@ static void cluster_check_cb(uint32_t vid, const char *name, const char *tag,
 	do_vdi_check(inode);
 }
 
+struct check_objects_work {
+	const struct sd_node *node;
+	struct sd_req hdr;
+	int ret;
+	struct work work;
+};
+
+static void check_objects_work(struct work *work)
+{
+	struct check_objects_work *cw =
+		container_of(work, struct check_objects_work, work);
+
+	sd_init_req(&cw->hdr, SD_OP_CHECK_OBJECTS);
+	cw->ret = dog_exec_req(&cw->node->nid, &cw->hdr, NULL);
+}
+
+static void check_objects_main(struct work *work)
+{
+}
+
+/*
+ * Let every node check the replicated objects it is the first holder of, see
+ * sheep/check.c.  The nodes run concurrently and only report their counts.
+ */
+static int cluster_check_distributed(void)
+{
+	struct check_objects_work *works;
+	struct work_queue *wq;
+	struct sd_node *n;
+	uint64_t nr_checked = 0;
+	uint32_t nr_repaired = 0, nr_failed = 0;
+	int i = 0, ret = EXIT_SUCCESS;
+
+	works = xzalloc(sizeof(*works) * sd_nodes_nr);
+	wq = create_work_queue("cluster check", WQ_DYNAMIC);
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		works[i].node = n;
+		works[i].work.fn = check_objects_work;
+		works[i].work.done = check_objects_main;
+		queue_work(wq, &works[i].work);
+		i++;
+	}
+	work_queue_wait(wq);
+
+	for (i = 0; i < sd_nodes_nr; i++) {
+		struct sd_rsp *rsp = (struct sd_rsp *)&works[i].hdr;
+		const struct node_id *nid = &works[i].node->nid;
+
+		if (works[i].ret < 0 || rsp->result != SD_RES_SUCCESS) {
+			sd_err("%s failed to check its objects: %s",
+			       addr_to_str(nid->addr, nid->port),
+			       works[i].ret < 0 ? "network error" :
+			       sd_strerror(rsp->result));
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		printf("%s: checked %"PRIu64" objects, repaired %"PRIu32
+		       " replicas, %"PRIu32" failures\n",
+		       addr_to_str(nid->addr, nid->port),
+		       rsp->check.nr_checked, rsp->check.nr_repaired,
+		       rsp->check.nr_failed);
+		nr_checked += rsp->check.nr_checked;
+		nr_repaired += rsp->check.nr_repaired;
+		nr_failed += rsp->check.nr_failed;
+	}
+	free(works);
+
+	printf("checked %"PRIu64" objects, repaired %"PRIu32" replicas, %"
+	       PRIu32" failures\n", nr_checked, nr_repaired, nr_failed);
+	if (nr_failed)
+		ret = EXIT_FAILURE;
+	return ret;
+}
+
 static int cluster_check(int argc, char **argv)
 {
+	if (cluster_cmd_data.distributed)
+		return cluster_check_distributed();
+
 	if (parse_vdi(cluster_check_cb, SD_INODE_SIZE, NULL, true) < 0)
 		return EXIT_SYSFAIL;
 
@@ -899,7 +1021,7 @@ failure:
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprhvTd", "show cluster information",
 	 NULL, CMD_NEED_NODELIST, cluster_info, cluster_options},
-	{"format", NULL, "bcltaphzTVRfF", "create a Sheepdog store",
+	{"format", NULL, "bcltaphzTVRfFPk", "create a Sheepdog store",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_NODELIST, cluster_format, cluster_options},
 	{"shutdown", NULL, "aphT", "stop Sheepdog",
 	 NULL, CMD_NEED_ROOT, cluster_shutdown, cluster_options},
@@ -913,7 +1035,7 @@ static struct subcommand cluster_cmd[] = {
 	 cluster_recover, cluster_options},
 	{"reweight", NULL, "aphT", "reweight the cluster", NULL, CMD_NEED_ROOT,
 	 cluster_reweight, cluster_options},
-	{"check", NULL, "aphT", "check and repair cluster", NULL,
+	{"check", NULL, "aphTD", "check and repair cluster", NULL,
 	 CMD_NEED_ROOT|CMD_NEED_NODELIST, cluster_check, cluster_options},
 	{"alter-copy", NULL, "aphTcf", "set the cluster's redundancy level",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_NODELIST, cluster_alter_copy, cluster_options},
@@ -937,7 +1059,11 @@ static int cluster_parser(int ch, const char *opt)
 			       "  x(1 to %d)   - number of replicated copies\n"
 			       "To create erasure coded vdi, set -c x:y\n"
 			       "  x(2,4,8,16)  - number of data strips\n"
-			       "  y(1 to 15)   - number of parity strips",
+			       "  y(1 to 15)   - number of parity strips\n"
+			       "To create LRC coded vdi, set -c x:y:z\n"
+			       "  x(4,8,16)    - number of data strips\n"
+			       "  y(1 to 3)    - number of global parity strips\n"
+			       "  z(1,2,4,8)   - number of local groups, up to x/2",
 			       opt, SD_MAX_COPIES);
 			exit(EXIT_FAILURE);
 		}
@@ -975,9 +1101,24 @@ static int cluster_parser(int ch, const char *opt)
 	case 'd':
 		cluster_cmd_data.diff = true;
 		break;
+	case 'D':
+		cluster_cmd_data.distributed = true;
+		break;
 	case 'F':
 		cluster_cmd_data.avoid_diskfull = true;
 		break;
+	case 'k':
+		cluster_cmd_data.checksum = true;
+		break;
+	case 'P':
+		cluster_cmd_data.nr_probes = atoi(opt);
+		if (cluster_cmd_data.nr_probes < 1 ||
+		    cluster_cmd_data.nr_probes > SD_MAX_PLACEMENT_PROBES) {
+			sd_err("Invalid number of probes %s, it must be between"
+			       " 1 and %d", opt, SD_MAX_PLACEMENT_PROBES);
+			exit(EXIT_FAILURE);
+		}
+		break;
 	}
 
 	return 0;
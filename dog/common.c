@@ -12,6 +12,7 @@
 #include "dog.h"
 #include "sha1.h"
 #include "sockfd_cache.h"
+#include "shm_ring.h"
 #include "fec.h"
 
 struct timespec get_time_tick(void)
@@ -82,6 +83,14 @@ char *strnumber(uint64_t size)
 
 int dog_read_object(uint64_t oid, void *data, unsigned int datalen,
 		    uint64_t offset, bool direct)
+{
+	return dog_read_object_from(&sd_nid, oid, data, datalen, offset,
+				    direct);
+}
+
+/* Read the object through the given sheep as a gateway */
+int dog_read_object_from(const struct node_id *nid, uint64_t oid, void *data,
+			 unsigned int datalen, uint64_t offset, bool direct)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -95,7 +104,8 @@ int dog_read_object(uint64_t oid, void *data, unsigned int datalen,
 	if (direct)
 		hdr.flags |= SD_FLAG_CMD_DIRECT;
 
-	ret = dog_exec_req(&sd_nid, &hdr, data);
+	sd_inode_invalidate_cache_oid(oid, false);
+	ret = dog_exec_req(nid, &hdr, data);
 	if (ret < 0) {
 		sd_err("Failed to read object %016" PRIx64, oid);
 		return SD_RES_EIO;
@@ -114,6 +124,17 @@ int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 		     unsigned int datalen, uint64_t offset, uint32_t flags,
 		     uint8_t copies, uint8_t copy_policy, bool create,
 		     bool direct)
+{
+	return dog_write_object_to(&sd_nid, oid, cow_oid, data, datalen,
+				   offset, flags, copies, copy_policy, create,
+				   direct);
+}
+
+/* Write the object through the given sheep as a gateway */
+int dog_write_object_to(const struct node_id *nid, uint64_t oid,
+			uint64_t cow_oid, void *data, unsigned int datalen,
+			uint64_t offset, uint32_t flags, uint8_t copies,
+			uint8_t copy_policy, bool create, bool direct)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -137,7 +158,8 @@ int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 	hdr.obj.cow_oid = cow_oid;
 	hdr.obj.offset = offset;
 
-	ret = dog_exec_req(&sd_nid, &hdr, data);
+	sd_inode_invalidate_cache_oid(oid, true);
+	ret = dog_exec_req(nid, &hdr, data);
 	if (ret < 0) {
 		sd_err("Failed to write object %016" PRIx64, oid);
 		return SD_RES_EIO;
@@ -153,8 +175,8 @@ int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 
 #define FOR_EACH_VDI(nr, vdis) FOR_EACH_BIT(nr, vdis, SD_NR_VDIS)
 
-int parse_vdi(vdi_parser_func_t func, size_t size, void *data,
-		bool no_deleted)
+static int parse_vdi_objects(vdi_parser_func_t func, size_t size, void *data,
+			     bool no_deleted)
 {
 	int ret;
 	unsigned long nr;
@@ -229,11 +251,166 @@ out:
 	return ret;
 }
 
+#define SUMMARIES_PER_REQ 1024
+
+/*
+ * Call func for the summaries of the live vdis, asking the sheep for a page
+ * of SUMMARIES_PER_REQ at a time.  Returns 1 if the sheep doesn't know
+ * SD_OP_GET_INODE_SUMMARIES.
+ */
+static int walk_summaries(vdi_summary_func_t func, bool usage, void *data,
+			  bool no_deleted)
+{
+	struct sd_inode_summary *s = xmalloc(sizeof(*s) * SUMMARIES_PER_REQ);
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint32_t start = 0, nr;
+	int ret = 0;
+
+	while (start < SD_NR_VDIS) {
+		sd_init_req(&hdr, SD_OP_GET_INODE_SUMMARIES);
+		hdr.data_length = sizeof(*s) * SUMMARIES_PER_REQ;
+		hdr.summary.start = start;
+		hdr.summary.usage = usage;
+
+		ret = dog_exec_req(&sd_nid, &hdr, s);
+		if (ret < 0)
+			break;
+		if (rsp->result == SD_RES_INVALID_PARMS && start == 0) {
+			ret = 1;
+			break;
+		}
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_err("%s", sd_strerror(rsp->result));
+			ret = -1;
+			break;
+		}
+
+		nr = rsp->data_length / sizeof(*s);
+		for (uint32_t n = 0; n < nr; n++) {
+			/* this VDI has been deleted, and no need to handle it */
+			if (no_deleted && s[n].name[0] == '\0')
+				continue;
+			func(s + n, data);
+		}
+
+		if (rsp->summary.next <= start)
+			break;
+		start = rsp->summary.next;
+	}
+
+	free(s);
+	return ret;
+}
+
+struct summary_walk {
+	vdi_summary_func_t func;
+	bool usage;
+	void *data;
+};
+
+static void summarize_vdi(uint32_t vid, const char *name, const char *tag,
+			  uint32_t snapid, uint32_t flags,
+			  const struct sd_inode *i, void *data)
+{
+	struct summary_walk *w = data;
+	struct sd_inode_summary s;
+
+	sd_inode_summarize(i, &s);
+	if (w->usage)
+		sd_inode_stat(i, &s.my_objs, &s.cow_objs);
+	w->func(&s, w->data);
+}
+
+/*
+ * Call func for the summary of every live vdi, with the object counts if
+ * usage is set
+ */
+int parse_vdi_summary(vdi_summary_func_t func, bool usage, void *data)
+{
+	struct summary_walk w = {
+		.func = func,
+		.usage = usage,
+		.data = data,
+	};
+	int ret;
+
+	ret = walk_summaries(func, usage, data, true);
+	if (ret != 1)
+		return ret;
+
+	/* an older sheep, read the inodes one by one */
+	return parse_vdi_objects(summarize_vdi, usage ? SD_INODE_SIZE :
+				 SD_INODE_HEADER_SIZE, &w, true);
+}
+
+struct parse_walk {
+	vdi_parser_func_t func;
+	struct sd_inode *inode;
+	void *data;
+};
+
+static void parse_summary(const struct sd_inode_summary *s, void *data)
+{
+	struct parse_walk *w = data;
+	struct sd_inode *i = w->inode;
+
+	memset(i, 0, SD_INODE_HEADER_SIZE);
+	memcpy(i->name, s->name, sizeof(i->name));
+	memcpy(i->tag, s->tag, sizeof(i->tag));
+	i->create_time = s->create_time;
+	i->snap_ctime = s->snap_ctime;
+	i->vm_clock_nsec = s->vm_clock_nsec;
+	i->vdi_size = s->vdi_size;
+	i->vm_state_size = s->vm_state_size;
+	i->copy_policy = s->copy_policy;
+	i->store_policy = s->store_policy;
+	i->nr_copies = s->nr_copies;
+	i->block_size_shift = s->block_size_shift;
+	i->snap_id = s->snap_id;
+	i->vdi_id = s->vdi_id;
+	i->parent_vdi_id = s->parent_vdi_id;
+	i->btree_counter = s->btree_counter;
+	i->flags = s->flags;
+
+	w->func(i->vdi_id, i->name, i->tag,
+		vdi_is_snapshot(i) ? i->snap_id : 0, 0, i, w->data);
+}
+
+/*
+ * Call func for every live vdi with its inode read up to size bytes.  The
+ * callers which need only the header get it from the summaries in bulk.
+ */
+int parse_vdi(vdi_parser_func_t func, size_t size, void *data,
+	      bool no_deleted)
+{
+	struct parse_walk w = {
+		.func = func,
+		.data = data,
+	};
+	int ret;
+
+	if (size > SD_INODE_HEADER_SIZE)
+		return parse_vdi_objects(func, size, data, no_deleted);
+
+	w.inode = xmalloc(sizeof(*w.inode));
+	ret = walk_summaries(parse_summary, false, &w, no_deleted);
+	free(w.inode);
+	if (ret != 1)
+		return ret;
+
+	return parse_vdi_objects(func, size, data, no_deleted);
+}
+
 int dog_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
 {
 	struct sockfd *sfd;
 	int ret;
 
+	if (sd_shm && node_id_cmp(nid, &sd_nid) == 0 &&
+	    shm_client_fits(sd_shm, hdr))
+		return shm_client_exec(sd_shm, hdr, buf);
+
 	init_to_connect_list();
 	sfd = sockfd_cache_get(nid);
 	if (!sfd)
@@ -251,6 +428,103 @@ int dog_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
 	return ret ? -1 : 0;
 }
 
+/*
+ * Like dog_exec_req(), but give up on a node which doesn't reply within
+ * 'timeout' seconds, rounded up to the receive timeout of the socket.  The
+ * connection is dropped then, its response would be left unread.
+ */
+int dog_exec_req_timeout(const struct node_id *nid, struct sd_req *hdr,
+			 void *buf, unsigned int timeout)
+{
+	struct sockfd *sfd;
+	uint32_t max_count = DIV_ROUND_UP(timeout, MAX_POLLTIME);
+	int ret;
+
+	if (sd_shm && node_id_cmp(nid, &sd_nid) == 0 &&
+	    shm_client_fits(sd_shm, hdr))
+		return shm_client_exec(sd_shm, hdr, buf);
+
+	init_to_connect_list();
+	sfd = sockfd_cache_get(nid);
+	if (!sfd)
+		return -1;
+
+	ret = exec_req(sfd->fd, hdr, buf, NULL, 0,
+		       max_count > 0 ? max_count - 1 : 0);
+	if (ret) {
+		sockfd_cache_drop(nid, sfd);
+		return -1;
+	}
+	sockfd_cache_put(nid, sfd);
+
+	return 0;
+}
+
+static void query_node_work(struct work *work)
+{
+	struct node_reply *r = container_of(work, struct node_reply, work);
+
+	r->ret = dog_exec_req_timeout(&r->node->nid, &r->hdr, r->data,
+				      NODE_QUERY_TIMEOUT);
+}
+
+static void query_node_main(struct work *work)
+{
+}
+
+/*
+ * Send a copy of 'hdr' to every node on at most NR_NODE_QUERY_THREADS threads
+ * and wait for all the replies.  The replies are in the order of sd_nroot,
+ * each with 'data_length' bytes of data.  A node which failed or didn't reply
+ * in time has a negative ret, so the callers can show the rest.
+ */
+struct node_reply *query_nodes(const struct sd_req *hdr)
+{
+	static struct work_queue *wq;
+	struct node_reply *replies;
+	struct sd_node *n;
+	int i = 0;
+
+	if (!wq)
+		wq = create_fixed_work_queue("node query",
+					     NR_NODE_QUERY_THREADS);
+
+	replies = xzalloc(sizeof(*replies) * sd_nodes_nr);
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		struct node_reply *r = replies + i++;
+
+		r->node = n;
+		r->hdr = *hdr;
+		if (hdr->data_length)
+			r->data = xzalloc(hdr->data_length);
+		r->work.fn = query_node_work;
+		r->work.done = query_node_main;
+		queue_work(wq, &r->work);
+	}
+	work_queue_wait(wq);
+
+	return replies;
+}
+
+void free_node_replies(struct node_reply *replies)
+{
+	for (int i = 0; i < sd_nodes_nr; i++)
+		free(replies[i].data);
+	free(replies);
+}
+
+/* Return the error of a node reply of query_nodes(), NULL if it succeeded */
+const char *node_reply_error(const struct node_reply *r)
+{
+	const struct sd_rsp *rsp = (const struct sd_rsp *)&r->hdr;
+
+	if (r->ret < 0)
+		return "no reply";
+	if (rsp->result != SD_RES_SUCCESS)
+		return sd_strerror(rsp->result);
+	return NULL;
+}
+
 /* Light request only contains header, without body content. */
 int send_light_req(const struct node_id *nid, struct sd_req *hdr)
 {
@@ -507,15 +781,17 @@ void dump_loglevels(bool err)
 /* Return 0 to indicate ill str */
 uint8_t parse_copy(const char *str, uint8_t *copy_policy)
 {
-	char *n1, *n2;
-	uint8_t copy, parity;
+	char *n1, *n2, *n3;
+	uint8_t copy, parity, local;
 	char p[10];
 
-	strcpy(p, str);
+	pstrcpy(p, sizeof(p), str);
 	n1 = strtok(p, ":");
 	n2 = strtok(NULL, ":");
+	n3 = strtok(NULL, ":");
 
-	if ((!n1 || !is_numeric(n1)) || (n2 && !is_numeric(n2)))
+	if ((!n1 || !is_numeric(n1)) || (n2 && !is_numeric(n2)) ||
+	    (n3 && !is_numeric(n3)))
 		return 0;
 
 	copy = strtol(n1, NULL, 10);
@@ -526,6 +802,23 @@ uint8_t parse_copy(const char *str, uint8_t *copy_policy)
 		return copy;
 	}
 
+	if (n3) {
+		/* LRC d:g:l, see ec_policy_is_lrc() */
+		parity = strtol(n2, NULL, 10);
+		local = strtol(n3, NULL, 10);
+		if (copy != 4 && copy != 8 && copy != 16)
+			return 0;
+		if (parity < 1 || parity > 3)
+			return 0;
+		if (local != 1 && local != 2 && local != 4 && local != 8)
+			return 0;
+		if (local * 2 > copy)
+			return 0;
+
+		*copy_policy = ec_lrc_policy(copy, parity, local);
+		return copy + parity + local;
+	}
+
 	if (copy != 2 && copy != 4 && copy != 8 && copy != 16)
 		return 0;
 
@@ -542,6 +835,22 @@ uint8_t parse_copy(const char *str, uint8_t *copy_policy)
 	return copy;
 }
 
+/* "d:p", or "d:g:l" for LRC */
+const char *ec_policy_to_str(uint8_t policy)
+{
+	static char str[16];
+	int d, g, l;
+
+	if (ec_policy_is_lrc(policy)) {
+		ec_policy_to_lrc(policy, &d, &g, &l);
+		snprintf(str, sizeof(str), "%d:%d:%d", d, g, l);
+	} else {
+		ec_policy_to_dp(policy, &d, &g);
+		snprintf(str, sizeof(str), "%d:%d", d, g);
+	}
+	return str;
+}
+
 bool is_root(void)
 {
 	if (geteuid() != 0)
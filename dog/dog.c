@@ -20,8 +20,10 @@
 #include "dog.h"
 #include "util.h"
 #include "sockfd_cache.h"
+#include "shm_ring.h"
 
 #define EPOLL_SIZE 4096
+#define DOG_SHM_SLOTS 16
 
 static const char program_name[] = "dog";
 struct node_id sd_nid = {
@@ -29,6 +31,8 @@ struct node_id sd_nid = {
 	.addr = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 127, 0, 0, 1 },
 	.port = SD_LISTEN_PORT,
 };
+/* the ring to sd_nid given with SHEEPDOG_DOG_SOCK, NULL if none */
+struct shm_client *sd_shm;
 bool highlight = true;
 bool raw_output;
 bool verbose;
@@ -56,6 +60,7 @@ int sd_nodes_nr;
 struct rb_root sd_vroot = RB_ROOT;
 struct rb_root sd_nroot = RB_ROOT;
 int sd_zones_nr;
+int sd_nr_probes = 1;
 /* a number of zones never exceeds a number of nodes */
 static uint32_t sd_zones[SD_MAX_NODES];
 
@@ -131,6 +136,7 @@ int update_node_list(int max_nodes)
 		disks_to_vnodes(&sd_nroot, &sd_vroot);
 	else
 		nodes_to_vnodes(&sd_nroot, &sd_vroot);
+	sd_nr_probes = sd_placement_probes(logs->flags);
 
 	sd_epoch = hdr.epoch;
 out:
@@ -181,6 +187,9 @@ static void init_commands(const struct command **commands)
 #endif
 #ifdef HAVE_NFS
 		nfs_command,
+#endif
+#ifdef HAVE_VHOST
+		vhost_command,
 #endif
 		upgrade_command,
 		benchmark_command,
@@ -542,6 +551,18 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * The unix domain socket of the sheep at sd_nid, if it runs on this
+	 * host, to pass the requests through a shared memory ring
+	 */
+	env = getenv("SHEEPDOG_DOG_SOCK");
+	if (env) {
+		sd_shm = shm_client_attach(env, DOG_SHM_SLOTS,
+					   SD_DATA_OBJ_SIZE);
+		if (!sd_shm)
+			sd_err("failed to attach to %s, %m", env);
+	}
+
 	if (sd_inode_actor_init(dog_bnode_writer, dog_bnode_reader) < 0)
 		exit(EXIT_SYSFAIL);
 
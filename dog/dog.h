@@ -61,6 +61,7 @@ extern int subcmd_depth;
 extern struct subcommand *subcmd_stack[MAX_SUBCMD_DEPTH];
 
 extern struct node_id sd_nid;
+extern struct shm_client *sd_shm;
 extern bool highlight;
 extern bool raw_output;
 extern bool verbose;
@@ -70,6 +71,7 @@ extern struct rb_root sd_vroot;
 extern struct rb_root sd_nroot;
 extern int sd_nodes_nr;
 extern int sd_zones_nr;
+extern int sd_nr_probes;
 
 bool is_root(void);
 bool is_current(const struct sd_inode *i);
@@ -81,13 +83,41 @@ typedef void (*vdi_parser_func_t)(uint32_t vid, const char *name,
 				  const struct sd_inode *i, void *data);
 int parse_vdi(vdi_parser_func_t func, size_t size, void *data,
 			bool no_deleted);
+typedef void (*vdi_summary_func_t)(const struct sd_inode_summary *s,
+				   void *data);
+int parse_vdi_summary(vdi_summary_func_t func, bool usage, void *data);
 int dog_read_object(uint64_t oid, void *data, unsigned int datalen,
 		    uint64_t offset, bool direct);
+int dog_read_object_from(const struct node_id *nid, uint64_t oid, void *data,
+			 unsigned int datalen, uint64_t offset, bool direct);
 int dog_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 		     unsigned int datalen, uint64_t offset, uint32_t flags,
 		     uint8_t copies, uint8_t, bool create, bool direct);
+int dog_write_object_to(const struct node_id *nid, uint64_t oid,
+			uint64_t cow_oid, void *data, unsigned int datalen,
+			uint64_t offset, uint32_t flags, uint8_t copies,
+			uint8_t copy_policy, bool create, bool direct);
 int dog_exec_req(const struct node_id *, struct sd_req *hdr, void *data);
 int send_light_req(const struct node_id *, struct sd_req *hdr);
+int dog_exec_req_timeout(const struct node_id *nid, struct sd_req *hdr,
+			 void *buf, unsigned int timeout);
+
+/* bound the threads and the wait of the per-node queries, in seconds */
+#define NR_NODE_QUERY_THREADS 32
+#define NODE_QUERY_TIMEOUT MAX_POLLTIME
+
+/* The reply of a node to query_nodes() */
+struct node_reply {
+	const struct sd_node *node;
+	struct sd_req hdr;	/* the response after the reply */
+	void *data;
+	int ret;
+	struct work work;
+};
+
+struct node_reply *query_nodes(const struct sd_req *hdr);
+void free_node_replies(struct node_reply *replies);
+const char *node_reply_error(const struct node_reply *r);
 int do_generic_subcommand(struct subcommand *sub, int argc, char **argv);
 int update_node_list(int max_nodes);
 void confirm(const char *message);
@@ -95,13 +125,15 @@ void work_queue_wait(struct work_queue *q);
 int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
 		  uint8_t nr_copies, uint8_t copy_policy,
-		  uint8_t store_policy, uint8_t block_size_shift);
+		  uint8_t store_policy, uint8_t block_size_shift,
+		  uint32_t flags);
 int do_vdi_check(const struct sd_inode *inode);
 void show_progress(uint64_t done, uint64_t total, bool raw);
 size_t get_store_objsize(uint8_t copy_policy, uint8_t block_size_shift,
 			 uint64_t oid);
 bool is_erasure_oid(uint64_t oid, uint8_t policy);
 uint8_t parse_copy(const char *str, uint8_t *copy_policy);
+const char *ec_policy_to_str(uint8_t policy);
 
 int dog_bnode_writer(uint64_t oid, void *mem, unsigned int len, uint64_t offset,
 		     uint32_t flags, int copies, int copy_policy, bool create,
@@ -131,6 +163,10 @@ extern struct command trace_command;
 extern struct command nfs_command;
 #endif /* HAVE_NFS */
 
+#ifdef HAVE_VHOST
+extern struct command vhost_command;
+#endif /* HAVE_VHOST */
+
 int do_loglevel_set(const struct node_id *nid, const char *loglevel_str);
 int do_loglevel_get(const struct node_id *nid, int32_t *ret_loglevel);
 const char *loglevel_to_str(int loglevel);
@@ -39,6 +39,7 @@ struct active_vdi_entry {
 	uint8_t copy_policy;
 	uint8_t store_policy;
 	uint8_t block_size_shift;
+	uint32_t flags;
 };
 
 struct registered_obj_entry {
@@ -62,6 +63,22 @@ struct snapshot_work {
 static struct work_queue *wq;
 static uatomic_bool work_error;
 
+/*
+ * The objects are queued as the workers make progress rather than all at
+ * once, so that the memory of a save or load doesn't grow with the size of
+ * the cluster.  Each worker reads, slices, hashes and packs its object, and
+ * the pack is written in parallel, see sha1_buffer_write().
+ */
+#define SNAPSHOT_MAX_INFLIGHT 64
+static int nr_inflight;
+
+static void snapshot_wait_slot(void)
+{
+	while (nr_inflight >= SNAPSHOT_MAX_INFLIGHT)
+		event_loop(-1);
+	nr_inflight++;
+}
+
 static int vdi_cmp(const struct active_vdi_entry *e1,
 		   const struct active_vdi_entry *e2)
 {
@@ -79,6 +96,7 @@ static void update_active_vdi_entry(struct active_vdi_entry *vdi,
 	vdi->copy_policy = new->copy_policy;
 	vdi->store_policy = new->store_policy;
 	vdi->block_size_shift = new->block_size_shift;
+	vdi->flags = new->flags;
 }
 
 static void add_active_vdi(struct sd_inode *new)
@@ -134,7 +152,8 @@ static int create_active_vdis(void)
 				  false, vdi->nr_copies,
 				  vdi->copy_policy,
 				  vdi->store_policy,
-				  vdi->block_size_shift) < 0)
+				  vdi->block_size_shift,
+				  vdi->flags) < 0)
 			return -1;
 	}
 	return 0;
@@ -294,6 +313,7 @@ static void save_object_done(struct work *work)
 						work);
 	static unsigned long saved;
 
+	nr_inflight--;
 	if (uatomic_is_true(&work_error))
 		goto out;
 
@@ -307,9 +327,14 @@ static int queue_save_snapshot_work(uint64_t oid, uint32_t nr_copies,
 				    uint8_t copy_policy,
 				    uint8_t block_size_shift, void *data)
 {
-	struct snapshot_work *sw = xzalloc(sizeof(struct snapshot_work));
+	struct snapshot_work *sw;
 	struct strbuf *trunk_buf = data;
 
+	if (uatomic_is_true(&work_error))
+		return 0;
+
+	snapshot_wait_slot();
+	sw = xzalloc(sizeof(struct snapshot_work));
 	sw->entry.oid = oid;
 	sw->entry.nr_copies = nr_copies;
 	sw->entry.copy_policy = copy_policy;
@@ -385,6 +410,11 @@ int farm_save_snapshot(const char *tag, bool multithread)
 		goto out;
 	}
 
+	if (sha1_file_flush() < 0) {
+		ret = -1;
+		goto out;
+	}
+
 	if (snap_log_append(idx, tag, trunk_sha1) < 0) {
 		ret = -1;
 		goto out;
@@ -446,6 +476,7 @@ static void load_object_done(struct work *work)
 	struct snapshot_work *sw = container_of(work, struct snapshot_work,
 						work);
 
+	nr_inflight--;
 	free(sw);
 }
 
@@ -467,6 +498,10 @@ static int queue_load_snapshot_work(struct trunk_entry *entry, void *data)
 			return 0;
 	}
 
+	if (uatomic_is_true(&work_error))
+		return 0;
+
+	snapshot_wait_slot();
 	sw = xzalloc(sizeof(struct snapshot_work));
 
 	memcpy(&sw->entry, entry, sizeof(struct trunk_entry));
@@ -87,6 +87,7 @@ int snap_log_write_hdr(struct snap_log_hdr *);
 /* sha1_file.c */
 int sha1_file_write(void *buf, size_t len, unsigned char *sha1);
 void *sha1_file_read(const unsigned char *sha1, size_t *size);
+int sha1_file_flush(void);
 
 /* object_tree.c */
 int object_tree_size(void);
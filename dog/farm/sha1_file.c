@@ -23,10 +23,138 @@
  *     by verifying that their hashes match the content of the file.
  */
 #include <sys/types.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "farm.h"
 #include "util.h"
 
+/*
+ * New objects are appended to a single packfile, objects/pack, as a
+ * struct pack_hdr followed by the data.  objects/pack.idx lists the records
+ * of the pack and is appended by sha1_file_flush().  Records written after
+ * the last flush are recovered by scanning the tail of the pack.
+ *
+ * The room of a record is reserved under sha1_lock and the record is written
+ * outside of it, so that the workers of a snapshot save fill the pack in
+ * parallel.  A crash can thus leave holes in the tail, and pack_scan_tail()
+ * verifies the records it recovers and drops the tail from the first broken
+ * one.
+ *
+ * Farms made by older versions keep one file per sha1 under a two-level
+ * directory.  Those loose files are still read, and they are indexed too
+ * before the first write so that they are not stored again.
+ */
+struct pack_hdr {
+	unsigned char sha1[SHA1_DIGEST_SIZE];
+	uint32_t len;
+};
+
+struct sha1_entry {
+	unsigned char sha1[SHA1_DIGEST_SIZE];
+	uint32_t len;
+	uint64_t offset; /* of the pack_hdr, LOOSE_OFFSET for a loose file */
+};
+
+#define LOOSE_OFFSET UINT64_MAX
+
+/* open addressing hash table of sha1_entry; a zero sha1 is a free slot */
+struct sha1_index {
+	uint64_t nr;
+	uint64_t size; /* power of two */
+	struct sha1_entry *slots;
+};
+
+static struct sha1_index sha1_index;
+static struct sd_mutex sha1_lock = SD_MUTEX_INITIALIZER;
+static pthread_once_t pack_once = PTHREAD_ONCE_INIT;
+static pthread_once_t loose_once = PTHREAD_ONCE_INIT;
+
+static int pack_fd = -1, pack_idx_fd = -1;
+static uint64_t pack_size;
+/* index entries which are not yet in pack.idx */
+static struct strbuf pack_idx_pending = STRBUF_INIT;
+
+static const unsigned char null_sha1[SHA1_DIGEST_SIZE];
+
+static uint64_t sha1_index_slot(const unsigned char *sha1, uint64_t size)
+{
+	uint64_t h;
+
+	/* sha1 is uniformly distributed, so its prefix is a fine hash */
+	memcpy(&h, sha1, sizeof(h));
+	return h & (size - 1);
+}
+
+static struct sha1_entry *__sha1_index_lookup(struct sha1_index *index,
+					      const unsigned char *sha1)
+{
+	uint64_t i;
+
+	if (!index->size)
+		return NULL;
+
+	i = sha1_index_slot(sha1, index->size);
+	while (memcmp(index->slots[i].sha1, null_sha1, SHA1_DIGEST_SIZE)) {
+		if (memcmp(index->slots[i].sha1, sha1, SHA1_DIGEST_SIZE) == 0)
+			return index->slots + i;
+		i = (i + 1) & (index->size - 1);
+	}
+	return NULL;
+}
+
+static void __sha1_index_add(struct sha1_index *index,
+			     const struct sha1_entry *entry)
+{
+	uint64_t i = sha1_index_slot(entry->sha1, index->size);
+
+	while (memcmp(index->slots[i].sha1, null_sha1, SHA1_DIGEST_SIZE)) {
+		if (memcmp(index->slots[i].sha1, entry->sha1,
+			   SHA1_DIGEST_SIZE) == 0)
+			return;
+		i = (i + 1) & (index->size - 1);
+	}
+	index->slots[i] = *entry;
+	index->nr++;
+}
+
+static void sha1_index_grow(struct sha1_index *index)
+{
+	struct sha1_index new = {
+		.size = index->size ? index->size * 2 : 1024,
+	};
+
+	new.slots = xzalloc(new.size * sizeof(new.slots[0]));
+	for (uint64_t i = 0; i < index->size; i++)
+		if (memcmp(index->slots[i].sha1, null_sha1, SHA1_DIGEST_SIZE))
+			__sha1_index_add(&new, index->slots + i);
+	free(index->slots);
+	*index = new;
+}
+
+/* called with sha1_lock held */
+static void sha1_index_add(const struct sha1_entry *entry)
+{
+	/* keep the load factor below 3/4 */
+	if ((sha1_index.nr + 1) * 4 > sha1_index.size * 3)
+		sha1_index_grow(&sha1_index);
+	__sha1_index_add(&sha1_index, entry);
+}
+
+static bool sha1_index_lookup(const unsigned char *sha1,
+			      struct sha1_entry *entry)
+{
+	struct sha1_entry *e;
+
+	sd_mutex_lock(&sha1_lock);
+	e = __sha1_index_lookup(&sha1_index, sha1);
+	if (e)
+		*entry = *e;
+	sd_mutex_unlock(&sha1_lock);
+
+	return e != NULL;
+}
+
 static void fill_sha1_path(char *pathbuf, const unsigned char *sha1)
 {
 	int i;
@@ -57,31 +185,221 @@ static char *sha1_to_path(const unsigned char *sha1)
 	return buf;
 }
 
-static int sha1_buffer_write(const unsigned char *sha1,
-			     void *buf, unsigned int size)
+static bool pack_record_valid(const struct pack_hdr *hdr, uint64_t offset)
 {
-	char *filename = sha1_to_path(sha1);
-	int fd, ret = 0, len;
+	unsigned char sha1[SHA1_DIGEST_SIZE];
+	void *buf = xmalloc(hdr->len);
+	bool ret = false;
 
-	fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
-	if (fd < 0) {
-		if (errno != EEXIST) {
-			sd_err("failed to open file %s with error: %m",
-			       filename);
-			ret = -1;
+	if (xpread(pack_fd, buf, hdr->len, offset + sizeof(*hdr)) != hdr->len)
+		goto out;
+	get_buffer_sha1(buf, hdr->len, sha1);
+	ret = memcmp(sha1, hdr->sha1, SHA1_DIGEST_SIZE) == 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/* Index the valid records between pack_size and the end of the pack */
+static int pack_scan_tail(void)
+{
+	struct stat st;
+
+	if (fstat(pack_fd, &st) < 0) {
+		sd_err("failed to stat the pack, %m");
+		return -1;
+	}
+
+	while (pack_size + sizeof(struct pack_hdr) <= (uint64_t)st.st_size) {
+		struct pack_hdr hdr;
+		struct sha1_entry entry;
+
+		if (xpread(pack_fd, &hdr, sizeof(hdr), pack_size)
+		    != sizeof(hdr)) {
+			sd_err("failed to read the pack, %m");
+			return -1;
 		}
-		goto err_open;
+		if (pack_size + sizeof(hdr) + hdr.len > (uint64_t)st.st_size ||
+		    !pack_record_valid(&hdr, pack_size))
+			break;
+
+		memcpy(entry.sha1, hdr.sha1, SHA1_DIGEST_SIZE);
+		entry.len = hdr.len;
+		entry.offset = pack_size;
+		sha1_index_add(&entry);
+		strbuf_add(&pack_idx_pending, &entry, sizeof(entry));
+		pack_size += sizeof(hdr) + hdr.len;
 	}
-	len = xwrite(fd, buf, size);
-	if (len != size) {
-		sd_err("%m");
-		close(fd);
+
+	/* drop the records which were cut short by a crash */
+	if (pack_size < (uint64_t)st.st_size) {
+		sd_info("truncate the pack from %jd to %"PRIu64" bytes",
+			(intmax_t)st.st_size, pack_size);
+		if (xftruncate(pack_fd, pack_size) < 0) {
+			sd_err("failed to truncate the pack, %m");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int pack_load_index(void)
+{
+	struct sha1_entry entry;
+	ssize_t ret;
+
+	while ((ret = xread(pack_idx_fd, &entry, sizeof(entry)))
+	       == sizeof(entry)) {
+		sha1_index_add(&entry);
+		pack_size = max(pack_size,
+				entry.offset + sizeof(struct pack_hdr) +
+				entry.len);
+	}
+	if (ret < 0) {
+		sd_err("failed to read the pack index, %m");
 		return -1;
 	}
+	/* a torn entry at the end is recovered from the pack */
+	if (ret > 0 && lseek(pack_idx_fd, -ret, SEEK_END) < 0) {
+		sd_err("failed to seek the pack index, %m");
+		return -1;
+	}
+	return 0;
+}
 
-	close(fd);
-err_open:
-	return ret;
+static void pack_init(void)
+{
+	const char *objdir = get_object_directory();
+	char path[PATH_MAX];
+
+	sd_mutex_lock(&sha1_lock);
+	snprintf(path, sizeof(path), "%s/pack", objdir);
+	pack_fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (pack_fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%s/pack.idx", objdir);
+	pack_idx_fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (pack_idx_fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		goto err;
+	}
+
+	if (pack_load_index() < 0 || pack_scan_tail() < 0)
+		goto err;
+	goto out;
+err:
+	if (pack_idx_fd >= 0) {
+		close(pack_idx_fd);
+		pack_idx_fd = -1;
+	}
+	close(pack_fd);
+	pack_fd = -1;
+out:
+	sd_mutex_unlock(&sha1_lock);
+}
+
+static int hex_to_val(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* A loose file is named by 2 hex digits of the directory and 38 of the file */
+static bool hex_to_sha1(const char *dir, const char *name, unsigned char *sha1)
+{
+	char hex[SHA1_DIGEST_SIZE * 2];
+
+	if (strlen(name) != sizeof(hex) - 2)
+		return false;
+	memcpy(hex, dir, 2);
+	memcpy(hex + 2, name, sizeof(hex) - 2);
+
+	for (int i = 0; i < SHA1_DIGEST_SIZE; i++) {
+		int hi = hex_to_val(hex[i * 2]);
+		int lo = hex_to_val(hex[i * 2 + 1]);
+
+		if (hi < 0 || lo < 0)
+			return false;
+		sha1[i] = hi << 4 | lo;
+	}
+	return true;
+}
+
+/* Index the loose files with one readdir pass over the subdirectories */
+static void loose_init(void)
+{
+	const char *objdir = get_object_directory();
+	char path[PATH_MAX];
+
+	sd_mutex_lock(&sha1_lock);
+	for (int i = 0; i < 256; i++) {
+		char dname[3];
+		struct dirent *d;
+		DIR *dir;
+
+		snprintf(dname, sizeof(dname), "%02x", i);
+		snprintf(path, sizeof(path), "%s/%s", objdir, dname);
+		dir = opendir(path);
+		if (!dir)
+			continue;
+
+		while ((d = readdir(dir))) {
+			struct sha1_entry entry = {
+				.offset = LOOSE_OFFSET,
+			};
+
+			if (hex_to_sha1(dname, d->d_name, entry.sha1))
+				sha1_index_add(&entry);
+		}
+		closedir(dir);
+	}
+	sd_debug("%"PRIu64" sha1 files are indexed", sha1_index.nr);
+	sd_mutex_unlock(&sha1_lock);
+}
+
+static int sha1_buffer_write(const unsigned char *sha1,
+			     void *buf, unsigned int size)
+{
+	struct pack_hdr hdr;
+	struct sha1_entry entry;
+
+	pthread_once(&pack_once, pack_init);
+	pthread_once(&loose_once, loose_init);
+	if (pack_fd < 0)
+		return -1;
+
+	/*
+	 * Index the record before it is written, so that a concurrent write of
+	 * the same sha1 is deduplicated.  The snapshot fails if the write
+	 * below does, and then pack.idx isn't appended.
+	 */
+	sd_mutex_lock(&sha1_lock);
+	if (__sha1_index_lookup(&sha1_index, sha1)) {
+		sd_mutex_unlock(&sha1_lock);
+		return 0;
+	}
+	memcpy(entry.sha1, sha1, SHA1_DIGEST_SIZE);
+	entry.len = size;
+	entry.offset = pack_size;
+	sha1_index_add(&entry);
+	strbuf_add(&pack_idx_pending, &entry, sizeof(entry));
+	pack_size += sizeof(hdr) + size;
+	sd_mutex_unlock(&sha1_lock);
+
+	memcpy(hdr.sha1, sha1, SHA1_DIGEST_SIZE);
+	hdr.len = size;
+	if (xpwrite(pack_fd, &hdr, sizeof(hdr), entry.offset) != sizeof(hdr) ||
+	    xpwrite(pack_fd, buf, size, entry.offset + sizeof(hdr)) != size) {
+		sd_err("failed to write the pack, %m");
+		return -1;
+	}
+	return 0;
 }
 
 int sha1_file_write(void *buf, size_t len, unsigned char *outsha1)
@@ -96,6 +414,32 @@ int sha1_file_write(void *buf, size_t len, unsigned char *outsha1)
 	return 0;
 }
 
+/* Make the pack durable and append the new records to pack.idx */
+int sha1_file_flush(void)
+{
+	int ret = -1;
+
+	pthread_once(&pack_once, pack_init);
+	if (pack_fd < 0)
+		return -1;
+
+	sd_mutex_lock(&sha1_lock);
+	if (fdatasync(pack_fd) < 0) {
+		sd_err("failed to sync the pack, %m");
+		goto out;
+	}
+	if (xwrite(pack_idx_fd, pack_idx_pending.buf, pack_idx_pending.len)
+	    != pack_idx_pending.len || fdatasync(pack_idx_fd) < 0) {
+		sd_err("failed to write the pack index, %m");
+		goto out;
+	}
+	strbuf_reset(&pack_idx_pending);
+	ret = 0;
+out:
+	sd_mutex_unlock(&sha1_lock);
+	return ret;
+}
+
 static int verify_sha1_file(const unsigned char *sha1,
 			    void *buf, unsigned long len)
 {
@@ -109,7 +453,7 @@ static int verify_sha1_file(const unsigned char *sha1,
 	return 0;
 }
 
-void *sha1_file_read(const unsigned char *sha1, size_t *size)
+static void *loose_file_read(const unsigned char *sha1, size_t *size)
 {
 	char *filename = sha1_to_path(sha1);
 	int fd = open(filename, O_RDONLY);
@@ -135,14 +479,45 @@ void *sha1_file_read(const unsigned char *sha1, size_t *size)
 		goto out;
 	}
 
-	if (verify_sha1_file(sha1, buf, st.st_size) < 0) {
-		free(buf);
-		buf = NULL;
-		goto out;
-	}
-
 	*size = st.st_size;
 out:
 	close(fd);
 	return buf;
 }
+
+static void *pack_file_read(const struct sha1_entry *entry, size_t *size)
+{
+	void *buf = xmalloc(entry->len);
+
+	if (xpread(pack_fd, buf, entry->len,
+		   entry->offset + sizeof(struct pack_hdr)) != entry->len) {
+		sd_err("failed to read %s from the pack, %m",
+		       sha1_to_hex(entry->sha1));
+		free(buf);
+		return NULL;
+	}
+
+	*size = entry->len;
+	return buf;
+}
+
+void *sha1_file_read(const unsigned char *sha1, size_t *size)
+{
+	struct sha1_entry entry;
+	void *buf;
+
+	pthread_once(&pack_once, pack_init);
+	if (pack_fd >= 0 && sha1_index_lookup(sha1, &entry) &&
+	    entry.offset != LOOSE_OFFSET)
+		buf = pack_file_read(&entry, size);
+	else
+		buf = loose_file_read(sha1, size);
+	if (!buf)
+		return NULL;
+
+	if (verify_sha1_file(sha1, buf, *size) < 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
@@ -81,12 +81,13 @@ static struct slice_file *slice_file_read(const unsigned char *sha1)
 void *slice_read(const unsigned char *sha1, size_t *outsize)
 {
 	struct slice_file *file = slice_file_read(sha1);
-	struct strbuf buf = STRBUF_INIT;
+	struct strbuf buf;
 	void *object;
 
 	if (!file)
-		goto err;
+		return NULL;
 
+	strbuf_init(&buf, file->nr_slices * SLICE_SIZE);
 	*outsize = 0;
 	for (uint32_t i = 0; i < file->nr_slices; i++) {
 		size_t size;
@@ -100,11 +101,9 @@ void *slice_read(const unsigned char *sha1, size_t *outsize)
 		*outsize += size;
 	}
 
-	object = xmalloc(*outsize);
-	strbuf_copyout(&buf, object, *outsize);
+	object = strbuf_detach(&buf);
 	free(file->slices);
 	free(file);
-	strbuf_release(&buf);
 	return object;
 err:
 	free(file->slices);
@@ -17,6 +17,8 @@ static struct node_cmd_data {
 	bool watch;
 	bool local;
 	bool force;
+	bool queues;
+	bool memory;
 } node_cmd_data;
 
 static void cal_total_vdi_size(uint32_t vid, const char *name, const char *tag,
@@ -48,38 +50,45 @@ static int node_list(int argc, char **argv)
 
 static int node_info(int argc, char **argv)
 {
-	int ret, success = 0, i = 0;
+	int success = 0;
 	uint64_t total_size = 0, total_avail = 0, total_vdi_size = 0;
-	struct sd_node *n;
+	struct node_reply *replies;
+	struct sd_req req;
+
+	sd_init_req(&req, SD_OP_STAT_SHEEP);
+	replies = query_nodes(&req);
 
 	if (!raw_output)
 		printf("Id\tSize\tUsed\tAvail\tUse%%\n");
 
-	rb_for_each_entry(n, &sd_nroot, rb) {
-		struct sd_req req;
-		struct sd_rsp *rsp = (struct sd_rsp *)&req;
-
-		sd_init_req(&req, SD_OP_STAT_SHEEP);
-
-		ret = send_light_req(&n->nid, &req);
-		if (!ret) {
-			int ratio = (int)(((double)(rsp->node.store_size -
-						    rsp->node.store_free) /
-					   rsp->node.store_size) * 100);
-			printf(raw_output ? "%d %s %s %s %d%%\n" :
-					"%2d\t%s\t%s\t%s\t%3d%%\n",
-			       i++,
-			       strnumber(rsp->node.store_size),
-			       strnumber(rsp->node.store_size -
-					   rsp->node.store_free),
-			       strnumber(rsp->node.store_free),
-			       rsp->node.store_size == 0 ? 0 : ratio);
-			success++;
+	for (int i = 0; i < sd_nodes_nr; i++) {
+		struct sd_rsp *rsp = (struct sd_rsp *)&replies[i].hdr;
+		const struct node_id *nid = &replies[i].node->nid;
+		const char *err = node_reply_error(replies + i);
+		int ratio;
+
+		if (err) {
+			sd_err("%s: %s", addr_to_str(nid->addr, nid->port),
+			       err);
+			continue;
 		}
 
+		ratio = (int)(((double)(rsp->node.store_size -
+					rsp->node.store_free) /
+			       rsp->node.store_size) * 100);
+		printf(raw_output ? "%d %s %s %s %d%%\n" :
+				"%2d\t%s\t%s\t%s\t%3d%%\n",
+		       i,
+		       strnumber(rsp->node.store_size),
+		       strnumber(rsp->node.store_size - rsp->node.store_free),
+		       strnumber(rsp->node.store_free),
+		       rsp->node.store_size == 0 ? 0 : ratio);
+		success++;
+
 		total_size += rsp->node.store_size;
 		total_avail += rsp->node.store_free;
 	}
+	free_node_replies(replies);
 
 	if (success == 0) {
 		sd_err("Cannot get information from any nodes");
@@ -185,54 +194,89 @@ static int node_recovery_progress(void)
 
 static int node_recovery_info(int argc, char **argv)
 {
-	struct sd_node *n;
-	int ret, i = 0;
+	struct node_reply *replies;
+	struct sd_req req;
+	int ret = EXIT_SUCCESS;
 
 	if (node_cmd_data.recovery_progress)
 		return node_recovery_progress();
 
+	sd_init_req(&req, SD_OP_STAT_RECOVERY);
+	req.data_length = sizeof(struct recovery_state);
+	replies = query_nodes(&req);
+
 	if (!raw_output) {
 		printf("Nodes In Recovery:\n");
 		printf("  Id   Host:Port         V-Nodes       Zone"
 		       "       Progress\n");
 	}
 
-	rb_for_each_entry(n, &sd_nroot, rb) {
-		struct sd_req req;
-		struct sd_rsp *rsp = (struct sd_rsp *)&req;
-		struct recovery_state state;
+	for (int i = 0; i < sd_nodes_nr; i++) {
+		const struct sd_node *n = replies[i].node;
+		const struct recovery_state *state = replies[i].data;
+		const char *host = addr_to_str(n->nid.addr, n->nid.port);
+		const char *err = node_reply_error(replies + i);
 
-		memset(&state, 0, sizeof(state));
+		if (err) {
+			sd_err("%s: %s", host, err);
+			ret = EXIT_FAILURE;
+			continue;
+		}
 
-		sd_init_req(&req, SD_OP_STAT_RECOVERY);
-		req.data_length = sizeof(state);
+		if (!state->in_recovery)
+			continue;
+		if (raw_output)
+			printf("%d %s %d %d %"PRIu64" %"PRIu64"\n", i, host,
+			       n->nr_vnodes, n->zone, state->nr_finished,
+			       state->nr_total);
+		else
+			printf("%4d   %-20s%5d%11d%11.1f%%\n", i, host,
+			       n->nr_vnodes, n->zone,
+			       100 * (float)state->nr_finished
+			       / state->nr_total);
+	}
+	free_node_replies(replies);
 
-		ret = dog_exec_req(&n->nid, &req, &state);
-		if (ret < 0)
-			return EXIT_SYSFAIL;
-		if (rsp->result != SD_RES_SUCCESS) {
-			sd_err("%s", sd_strerror(rsp->result));
-			return EXIT_FAILURE;
-		}
+	return ret;
+}
 
-		if (state.in_recovery) {
-			const char *host = addr_to_str(n->nid.addr,
-						       n->nid.port);
-			if (raw_output)
-				printf("%d %s %d %d %"PRIu64" %"PRIu64"\n", i,
-				       host, n->nr_vnodes,
-				       n->zone, state.nr_finished,
-				       state.nr_total);
-			else
-				printf("%4d   %-20s%5d%11d%11.1f%%\n", i, host,
-				       n->nr_vnodes, n->zone,
-				       100 * (float)state.nr_finished
-				       / state.nr_total);
-		}
-		i++;
+/* Old sheep reply only the fields they know, the rest is left zero */
+static int fetch_recovery_throttling(struct recovery_throttling *rthrottling)
+{
+	struct sd_req req;
+	struct sd_rsp *rsp = (struct sd_rsp *)&req;
+	int ret;
+
+	memset(rthrottling, 0, sizeof(*rthrottling));
+	sd_init_req(&req, SD_OP_GET_RECOVERY);
+	req.data_length = sizeof(*rthrottling);
+
+	ret = dog_exec_req(&sd_nid, &req, rthrottling);
+	if (ret < 0 || rsp->result != SD_RES_SUCCESS) {
+		sd_err("Failed to execute request");
+		return -1;
 	}
 
-	return EXIT_SUCCESS;
+	return 0;
+}
+
+static int store_recovery_throttling(struct recovery_throttling *rthrottling)
+{
+	struct sd_req req;
+	struct sd_rsp *rsp = (struct sd_rsp *)&req;
+	int ret;
+
+	sd_init_req(&req, SD_OP_SET_RECOVERY);
+	req.flags = SD_FLAG_CMD_WRITE;
+	req.data_length = sizeof(*rthrottling);
+
+	ret = dog_exec_req(&sd_nid, &req, rthrottling);
+	if (ret < 0 || rsp->result != SD_RES_SUCCESS) {
+		sd_err("Failed to execute request");
+		return -1;
+	}
+
+	return 0;
 }
 
 static int node_recovery_set(int argc, char **argv)
@@ -240,7 +284,7 @@ static int node_recovery_set(int argc, char **argv)
 	char *p;
 	struct recovery_throttling *rthrottling;
 
-	rthrottling = xmalloc(sizeof(struct recovery_throttling));
+	rthrottling = xzalloc(sizeof(struct recovery_throttling));
 
 	if (!argv[optind] || !argv[optind + 1]) {
 		sd_err("Invalid interval max (%s), interval (%s)",
@@ -277,78 +321,79 @@ static int node_recovery_set(int argc, char **argv)
 		exit(EXIT_USAGE);
 	}
 
-	int ret = 0;
-	struct sd_req req;
-	struct sd_rsp *rsp = (struct sd_rsp *)&req;
-
-	sd_init_req(&req, SD_OP_SET_RECOVERY);
-	req.flags = SD_FLAG_CMD_WRITE;
-	req.data_length = sizeof(struct recovery_throttling);
-	ret = dog_exec_req(&sd_nid, &req, rthrottling);
-
-	if (ret < 0)
-		ret = EXIT_SYSFAIL;
-
-	if (rsp->result == SD_RES_SUCCESS)
-		ret = EXIT_SUCCESS;
-	else
-		ret = EXIT_FAILURE;
+	struct recovery_throttling cur;
+	int ret;
 
-	switch (ret) {
-	case EXIT_FAILURE:
-	case EXIT_SYSFAIL:
-		sd_err("Failed to execute request");
-		ret = -1;
-		break;
-	case EXIT_SUCCESS:
-		/* do nothing */
-		break;
-	default:
-		sd_err("unknown return code: %d", ret);
-		ret = -1;
-		break;
+	/* keep the bandwidth settings */
+	ret = fetch_recovery_throttling(&cur);
+	if (ret == 0) {
+		rthrottling->bandwidth = cur.bandwidth;
+		rthrottling->link_bandwidth = cur.link_bandwidth;
+		rthrottling->latency_target = cur.latency_target;
+		ret = store_recovery_throttling(rthrottling);
 	}
 
 	free(rthrottling);
 	return ret;
 }
 
-static int node_recovery_get(int argc, char **argv)
+static int node_recovery_set_bandwidth(int argc, char **argv)
 {
 	struct recovery_throttling rthrottling;
-	int ret = 0;
+	uint64_t bandwidth, link = 0;
+	long latency = 0;
+	char *p;
 
-	struct sd_req req;
-	struct sd_rsp *rsp = (struct sd_rsp *)&req;
+	if (option_parse_size(argv[optind], &bandwidth) < 0) {
+		sd_err("Invalid bandwidth (%s)", argv[optind]);
+		exit(EXIT_USAGE);
+	}
 
-	sd_init_req(&req, SD_OP_GET_RECOVERY);
-	req.data_length = sizeof(rthrottling);
+	if (argv[++optind] && option_parse_size(argv[optind], &link) < 0) {
+		sd_err("Invalid link bandwidth (%s)", argv[optind]);
+		exit(EXIT_USAGE);
+	}
 
-	ret = dog_exec_req(&sd_nid, &req, &rthrottling);
-	if (ret < 0)
-		ret = EXIT_SYSFAIL;
+	if (argv[optind] && argv[++optind]) {
+		errno = 0;
+		latency = strtol(argv[optind], &p, 10);
+		if (argv[optind] == p || errno != 0 || *p != '\0' ||
+		    latency < 0L || (int64_t)UINT32_MAX < (int64_t)latency) {
+			sd_err("Invalid latency (%s)", argv[optind]);
+			exit(EXIT_USAGE);
+		}
+	}
 
-	if (rsp->result == SD_RES_SUCCESS)
-		ret = EXIT_SUCCESS;
-	else
-		ret = EXIT_FAILURE;
+	if (fetch_recovery_throttling(&rthrottling) < 0)
+		return -1;
 
-	switch (ret) {
-	case EXIT_FAILURE:
-	case EXIT_SYSFAIL:
-		sd_err("Failed to execute request");
-		ret = -1;
-		break;
-	case EXIT_SUCCESS:
-		sd_info("max (%"PRIu32"), interval (%"PRIu64")",
-		 rthrottling.max_exec_count, rthrottling.queue_work_interval);
-		break;
-	default:
-		sd_err("unknown return code: %d", ret);
-		ret = -1;
-		break;
-	}
-	return ret;
+	rthrottling.bandwidth = bandwidth;
+	rthrottling.link_bandwidth = link;
+	rthrottling.latency_target = (uint32_t)latency;
+
+	return store_recovery_throttling(&rthrottling);
+}
+
+static int node_recovery_get(int argc, char **argv)
+{
+	struct recovery_throttling rthrottling;
+
+	if (fetch_recovery_throttling(&rthrottling) < 0)
+		return -1;
+
+	sd_info("max (%"PRIu32"), interval (%"PRIu64")",
+		rthrottling.max_exec_count, rthrottling.queue_work_interval);
+	if (!rthrottling.bandwidth && !rthrottling.link_bandwidth)
+		return 0;
+	sd_info("bandwidth (%s/s), link bandwidth (%s/s), latency (%"PRIu32
+		" usec)",
+		rthrottling.bandwidth ?
+		strnumber(rthrottling.bandwidth) : "unlimited",
+		rthrottling.link_bandwidth ?
+		strnumber(rthrottling.link_bandwidth) : "unlimited",
+		rthrottling.latency_target);
+
+	return 0;
 }
 
 static struct sd_node *idx_to_node(struct rb_root *nroot, int idx)
@@ -410,6 +455,234 @@ static int node_kill(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int node_sockfd_stat(void)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_sockfd_stat *sstat;
+	size_t len = sizeof(struct sd_stat) +
+		sizeof(*sstat) * SD_MAX_NODES;
+	char *buf = xzalloc(len);
+	int ret, nr, i;
+
+	sd_init_req(&hdr, SD_OP_STAT);
+	hdr.data_length = len;
+	ret = dog_exec_req(&sd_nid, &hdr, buf);
+	if (ret < 0) {
+		free(buf);
+		return EXIT_SYSFAIL;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get stat information: %s",
+		       sd_strerror(rsp->result));
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	/* old sheep doesn't report the sockfd cache */
+	if (rsp->data_length <= sizeof(struct sd_stat)) {
+		free(buf);
+		return EXIT_SUCCESS;
+	}
+
+	sstat = (struct sd_sockfd_stat *)(buf + sizeof(struct sd_stat));
+	nr = (rsp->data_length - sizeof(struct sd_stat)) / sizeof(*sstat);
+	if (!raw_output)
+		printf("\nSockfd\tIO\tIO used\tNIO\tNIO used\tShort\n");
+	for (i = 0; i < nr; i++)
+		printf("%s\t%"PRIu32"\t%"PRIu32"\t%"PRIu32"\t%"PRIu32
+		       "\t%"PRIu64"\n",
+		       addr_to_str(sstat[i].nid.addr, sstat[i].nid.port),
+		       sstat[i].nr_fds_io, sstat[i].nr_io_in_use,
+		       sstat[i].nr_fds_nio, sstat[i].nr_nio_in_use,
+		       sstat[i].nr_short);
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
+static int node_latency_stat(void)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_latency_stat *lat;
+	size_t len = sizeof(struct sd_stat) +
+		sizeof(*lat) * SD_MAX_LATENCY_STATS;
+	char *buf = xzalloc(len);
+	int ret, nr, i;
+
+	sd_init_req(&hdr, SD_OP_STAT);
+	hdr.data_length = len;
+	hdr.stat.flags = SD_STAT_LATENCY;
+	ret = dog_exec_req(&sd_nid, &hdr, buf);
+	if (ret < 0) {
+		free(buf);
+		return EXIT_SYSFAIL;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get stat information: %s",
+		       sd_strerror(rsp->result));
+		free(buf);
+		return EXIT_FAILURE;
+	}
+
+	/* old sheep doesn't know SD_STAT_LATENCY and reports the sockfds */
+	lat = (struct sd_latency_stat *)(buf + sizeof(struct sd_stat));
+	nr = (rsp->data_length - sizeof(struct sd_stat)) / sizeof(*lat);
+	if (!nr || rsp->data_length - sizeof(struct sd_stat) !=
+	    nr * sizeof(*lat)) {
+		free(buf);
+		return EXIT_SUCCESS;
+	}
+
+	if (!raw_output)
+		printf("\nLatency(us)\t\tPath\tTotal\tAvg\tp50\tp99\tp999"
+		       "\tMax\n");
+	for (i = 0; i < nr; i++)
+		printf("%-20s\t%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%"PRIu64
+		       "\t%"PRIu64"\t%"PRIu64"\n", lat[i].name,
+		       lat[i].peer ? "Peer" : "Client", lat[i].nr,
+		       lat[i].total / lat[i].nr,
+		       latency_percentile(lat[i].buckets, lat[i].nr,
+					  lat[i].max, 50),
+		       latency_percentile(lat[i].buckets, lat[i].nr,
+					  lat[i].max, 99),
+		       latency_percentile(lat[i].buckets, lat[i].nr,
+					  lat[i].max, 99.9),
+		       lat[i].max);
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
+#define MAX_MEM_STAT 32
+
+/* Show the memory of the subsystems of the node */
+static int node_mem_stat(void)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_mem_stat st[MAX_MEM_STAT];
+	int ret, nr;
+
+	sd_init_req(&hdr, SD_OP_GET_MEM_STAT);
+	hdr.data_length = sizeof(st);
+
+	ret = dog_exec_req(&sd_nid, &hdr, st);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get the memory stat: %s",
+		       sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	nr = rsp->data_length / sizeof(st[0]);
+	if (!raw_output)
+		printf("Subsystem\tIn use\tLive\tAllocs\n");
+	for (int i = 0; i < nr; i++)
+		printf("%s\t%s\t%"PRId64"\t%"PRIu64"\n", st[i].name,
+		       strnumber(st[i].bytes), st[i].nr, st[i].nr_alloc);
+
+	return EXIT_SUCCESS;
+}
+
+#define MAX_WQ_STAT 64
+
+static int get_wq_stat(struct sd_wq_stat *st)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_GET_WQ_STAT);
+	hdr.data_length = MAX_WQ_STAT * sizeof(*st);
+
+	ret = dog_exec_req(&sd_nid, &hdr, st);
+	if (ret < 0)
+		return -1;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get the work queues: %s",
+		       sd_strerror(rsp->result));
+		return -1;
+	}
+
+	return rsp->data_length / sizeof(*st);
+}
+
+/* Subtract the works counted in 'last' from 'st' */
+static void wq_stat_sub(struct sd_wq_stat *st, const struct sd_wq_stat *last)
+{
+	st->nr_done -= last->nr_done;
+	st->wait_total -= last->wait_total;
+	st->run_total -= last->run_total;
+	for (int i = 0; i < SD_NR_LATENCY_BUCKETS; i++) {
+		st->wait_buckets[i] -= last->wait_buckets[i];
+		st->run_buckets[i] -= last->run_buckets[i];
+	}
+}
+
+/*
+ * Show the works of the work queues, of the last second with -w.  The maximum
+ * is since the start of the sheep.
+ */
+static int node_wq_stat(void)
+{
+	struct sd_wq_stat *st, *last = NULL;
+	int nr, nr_last = 0;
+
+	st = xcalloc(MAX_WQ_STAT, sizeof(*st));
+	if (node_cmd_data.watch) {
+		last = xcalloc(MAX_WQ_STAT, sizeof(*last));
+		nr_last = get_wq_stat(last);
+		if (nr_last < 0)
+			goto err;
+	}
+again:
+	if (last)
+		sleep(1);
+	nr = get_wq_stat(st);
+	if (nr < 0)
+		goto err;
+
+	if (!raw_output)
+		printf("Queue           Threads  Waiting  Running  %s"
+		       "  Wait avg  p99(us)   Run avg  p99(us)\n",
+		       last ? "  Done/s" : "    Done");
+	for (int i = 0; i < nr; i++) {
+		struct sd_wq_stat d = st[i];
+		uint64_t n;
+
+		if (i < nr_last && !strcmp(last[i].name, d.name))
+			wq_stat_sub(&d, last + i);
+		n = d.nr_done;
+		printf(raw_output ?
+		       "%s %"PRIu32" %"PRIu32" %"PRIu32" %"PRIu64" %"PRIu64
+		       " %"PRIu64" %"PRIu64" %"PRIu64"\n" :
+		       "%-15s %7"PRIu32"  %7"PRIu32"  %7"PRIu32"  %8"PRIu64
+		       "  %8"PRIu64" %8"PRIu64"  %8"PRIu64" %8"PRIu64"\n",
+		       d.name, d.nr_threads, d.nr_waiting, d.nr_running, n,
+		       n ? d.wait_total / n : 0,
+		       latency_percentile(d.wait_buckets, n, d.wait_max, 99),
+		       n ? d.run_total / n : 0,
+		       latency_percentile(d.run_buckets, n, d.run_max, 99));
+	}
+
+	if (last) {
+		memcpy(last, st, sizeof(*st) * nr);
+		nr_last = nr;
+		goto again;
+	}
+	free(st);
+	return EXIT_SUCCESS;
+err:
+	free(st);
+	free(last);
+	return EXIT_FAILURE;
+}
+
 static int node_stat(int argc, char **argv)
 {
 	struct sd_req hdr;
@@ -418,6 +691,11 @@ static int node_stat(int argc, char **argv)
 	int ret;
 	bool watch = node_cmd_data.watch ? true : false, first = true;
 
+	if (node_cmd_data.queues)
+		return node_wq_stat();
+	if (node_cmd_data.memory)
+		return node_mem_stat();
+
 again:
 	sd_init_req(&hdr, SD_OP_STAT);
 	hdr.data_length = sizeof(stat);
@@ -484,17 +762,61 @@ again:
 		       stat.r.peer_total_remove_nr, 0UL,
 		       strnumber(stat.r.peer_total_rx),
 		       strnumber(stat.r.peer_total_tx));
+
+		if (!raw_output)
+			printf("\nPool\tTotal\tFree\tAllocs\n");
+		for (int i = 0; i <= SD_NR_POOL_CLASSES; i++)
+			printf("%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\n",
+			       i < SD_NR_POOL_CLASSES ?
+			       strnumber(stat.pool[i].size) : "Other",
+			       stat.pool[i].nr_total, stat.pool[i].nr_free,
+			       stat.pool[i].nr_alloc);
+
+		ret = node_latency_stat();
+		if (ret != EXIT_SUCCESS)
+			return ret;
+
+		return node_sockfd_stat();
 	}
 
 	return EXIT_SUCCESS;
 }
 
+static void print_md_info(const struct node_id *nid,
+			  const struct sd_md_info *info)
+{
+	for (int i = 0; i < info->nr; i++) {
+		uint64_t size = info->disk[i].free + info->disk[i].used;
+		int ratio = (int)(((double)info->disk[i].used / size) * 100);
+
+		if (raw_output)
+			fprintf(stdout, "%s %d %s %s %s %d%% %s\n",
+				addr_to_str(nid->addr, nid->port),
+				info->disk[i].idx, strnumber(size),
+				strnumber(info->disk[i].used),
+				strnumber(info->disk[i].free),
+				ratio, info->disk[i].path);
+		else
+			fprintf(stdout, "%2d\t%s\t%s\t%s\t%3d%%\t%s\n",
+				info->disk[i].idx, strnumber(size),
+				strnumber(info->disk[i].used),
+				strnumber(info->disk[i].free),
+				ratio, info->disk[i].path);
+	}
+
+	if (!raw_output && info->rebalance.in_rebalance)
+		fprintf(stdout, "Rebalancing: %"PRIu64"/%"PRIu64" objects "
+			"scanned, %"PRIu64" moved\n",
+			info->rebalance.nr_scanned, info->rebalance.nr_total,
+			info->rebalance.nr_moved);
+}
+
 static int node_md_info(struct node_id *nid)
 {
 	struct sd_md_info info = {};
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	int ret, i;
+	int ret;
 
 	sd_init_req(&hdr, SD_OP_MD_INFO);
 	hdr.data_length = sizeof(info);
@@ -509,31 +831,15 @@ static int node_md_info(struct node_id *nid)
 		return EXIT_FAILURE;
 	}
 
-	for (i = 0; i < info.nr; i++) {
-		uint64_t size = info.disk[i].free + info.disk[i].used;
-		int ratio = (int)(((double)info.disk[i].used / size) * 100);
-
-		if (raw_output)
-			fprintf(stdout, "%s %d %s %s %s %d%% %s\n",
-				addr_to_str(nid->addr, nid->port),
-				info.disk[i].idx, strnumber(size),
-				strnumber(info.disk[i].used),
-				strnumber(info.disk[i].free),
-				ratio, info.disk[i].path);
-		else
-			fprintf(stdout, "%2d\t%s\t%s\t%s\t%3d%%\t%s\n",
-				info.disk[i].idx, strnumber(size),
-				strnumber(info.disk[i].used),
-				strnumber(info.disk[i].free),
-				ratio, info.disk[i].path);
-	}
+	print_md_info(nid, &info);
 	return EXIT_SUCCESS;
 }
 
 static int md_info(int argc, char **argv)
 {
-	struct sd_node *n;
-	int ret, i = 0;
+	struct node_reply *replies;
+	struct sd_req hdr;
+	int ret = EXIT_SUCCESS;
 
 	if (!raw_output)
 		fprintf(stdout, "Id\tSize\tUsed\tAvail\tUse%%\tPath\n");
@@ -541,14 +847,27 @@ static int md_info(int argc, char **argv)
 	if (!node_cmd_data.all_nodes)
 		return node_md_info(&sd_nid);
 
-	rb_for_each_entry(n, &sd_nroot, rb) {
+	sd_init_req(&hdr, SD_OP_MD_INFO);
+	hdr.data_length = sizeof(struct sd_md_info);
+	replies = query_nodes(&hdr);
+
+	for (int i = 0; i < sd_nodes_nr; i++) {
+		const struct node_id *nid = &replies[i].node->nid;
+		const char *err = node_reply_error(replies + i);
+
 		if (!raw_output)
-			fprintf(stdout, "Node %d:\n", i++);
-		ret = node_md_info(&n->nid);
-		if (ret != EXIT_SUCCESS)
-			return EXIT_FAILURE;
+			fprintf(stdout, "Node %d:\n", i);
+		if (err) {
+			sd_err("failed to get multi-disk information of %s: "
+			       "%s", addr_to_str(nid->addr, nid->port), err);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		print_md_info(nid, replies[i].data);
 	}
-	return EXIT_SUCCESS;
+	free_node_replies(replies);
+
+	return ret;
 }
 
 static int do_plug_unplug(char *disks, bool plug)
@@ -607,6 +926,69 @@ static int md_unplug(int argc, char **argv)
 	return do_plug_unplug(argv[optind], false);
 }
 
+#define HEAT_BUF_LEN (MD_MAX_DISK * (sizeof(struct sd_heat_disk) + \
+				   SD_HEAT_TOP * sizeof(struct sd_hot_obj)))
+
+static int md_heat(int argc, char **argv)
+{
+	struct sd_md_info *info = xzalloc(sizeof(*info));
+	char *buf = xzalloc(HEAT_BUF_LEN), *p;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret = EXIT_FAILURE;
+
+	sd_init_req(&hdr, SD_OP_MD_INFO);
+	hdr.data_length = sizeof(*info);
+	if (dog_exec_req(&sd_nid, &hdr, info) < 0) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
+	sd_init_req(&hdr, SD_OP_GET_HEAT);
+	hdr.data_length = HEAT_BUF_LEN;
+	if (dog_exec_req(&sd_nid, &hdr, buf) < 0) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get the heat of the objects: %s",
+		       sd_strerror(rsp->result));
+		goto out;
+	}
+
+	for (p = buf; p < buf + rsp->data_length;) {
+		const struct sd_heat_disk *hd = (struct sd_heat_disk *)p;
+		const struct sd_hot_obj *objs = (struct sd_hot_obj *)(hd + 1);
+		const char *path = "-";
+		uint64_t top = 0;
+
+		if (hd->idx < info->nr)
+			path = info->disk[hd->idx].path;
+		for (uint32_t i = 0; i < hd->nr_hot; i++)
+			top += objs[i].hits;
+
+		if (!raw_output)
+			printf("%s: %"PRIu64" accesses, %.1f%% to the hottest "
+			       "%"PRIu32" objects\n  Object\t\t\tAccesses\n",
+			       path, hd->nr_accesses, hd->nr_accesses ?
+			       min(top * 100.0 / hd->nr_accesses, 100.0) : 0,
+			       hd->nr_hot);
+		for (uint32_t i = 0; i < hd->nr_hot; i++) {
+			if (raw_output)
+				printf("%s ", path);
+			printf(raw_output ? "%016"PRIx64" %"PRIu64"\n" :
+			       "  %016"PRIx64"\t%"PRIu64"\n", objs[i].oid,
+			       objs[i].hits);
+		}
+		p = (char *)(objs + hd->nr_hot);
+	}
+	ret = EXIT_SUCCESS;
+out:
+	free(buf);
+	free(info);
+	return ret;
+}
+
 static struct subcommand node_md_cmd[] = {
 	{"info", NULL, NULL, "show multi-disk information",
 	 NULL, CMD_NEED_NODELIST, md_info},
@@ -614,6 +996,8 @@ static struct subcommand node_md_cmd[] = {
 	 NULL, CMD_NEED_ARG, md_plug},
 	{"unplug", NULL, NULL, "unplug disk(s) from node",
 	 NULL, CMD_NEED_ARG, md_unplug},
+	{"heat", NULL, NULL, "show the most accessed objects of each disk",
+	 NULL, 0, md_heat},
 	{NULL},
 };
 
@@ -640,6 +1024,12 @@ static int node_parser(int ch, const char *opt)
 	case 'f':
 		node_cmd_data.force = true;
 		break;
+	case 'q':
+		node_cmd_data.queues = true;
+		break;
+	case 'm':
+		node_cmd_data.memory = true;
+		break;
 	}
 
 	return 0;
@@ -651,6 +1041,8 @@ static struct sd_option node_options[] = {
 	{'w', "watch", false, "watch the stat every second"},
 	{'l', "local", false, "issue request to local node"},
 	{'f', "force", false, "ignore the confirmation"},
+	{'q', "queues", false, "show the works of the work queues"},
+	{'m', "memory", false, "show the memory of the subsystems"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -659,6 +1051,11 @@ static struct subcommand node_recovery_cmd[] = {
 	 NULL, CMD_NEED_NODELIST, node_recovery_info, node_options},
 	{"set-throttle", "<max> <interval>", NULL, "set new throttling", NULL,
 	 CMD_NEED_ARG|CMD_NEED_NODELIST, node_recovery_set, node_options},
+	{"set-bandwidth", "<bandwidth> [<link bandwidth> [<latency>]]", NULL,
+	 "set the recovery bandwidth per second (0 means unlimited), adapted to"
+	 " the gateway latency in usec", NULL,
+	 CMD_NEED_ARG|CMD_NEED_NODELIST, node_recovery_set_bandwidth,
+	 node_options},
 	{"get-throttle", NULL, NULL, "get current throttling", NULL,
 	 CMD_NEED_NODELIST, node_recovery_get, node_options},
 	{NULL},
@@ -766,6 +1163,106 @@ static int node_log(int argc, char **argv)
 	return do_generic_subcommand(node_log_cmd, argc, argv);
 }
 
+#define MAX_WQ_INFO 256
+
+static int node_wq_info(int argc, char **argv)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_wq_info *info;
+	int ret, nr;
+
+	info = xcalloc(MAX_WQ_INFO, sizeof(*info));
+	sd_init_req(&hdr, SD_OP_GET_WQ_INFO);
+	hdr.data_length = MAX_WQ_INFO * sizeof(*info);
+
+	ret = dog_exec_req(&sd_nid, &hdr, info);
+	if (ret < 0) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to get the work queues: %s",
+		       sd_strerror(rsp->result));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (!raw_output)
+		printf("Name            Threads  Target  Min  Max  Queued"
+		       "   Rate/s  Service(us)  Wait(us)\n");
+	nr = rsp->data_length / sizeof(*info);
+	for (int i = 0; i < nr; i++) {
+		const struct sd_wq_info *wi = info + i;
+		char max[16];
+
+		if (wi->max_threads)
+			snprintf(max, sizeof(max), "%"PRIu32, wi->max_threads);
+		else
+			pstrcpy(max, sizeof(max), "-");
+
+		printf(raw_output ?
+		       "%s %"PRIu32" %"PRIu32" %"PRIu32" %s %"PRIu32
+		       " %"PRIu64" %"PRIu64" %"PRIu64"\n" :
+		       "%-15s %7"PRIu32"  %6"PRIu32"  %3"PRIu32"  %3s  %6"PRIu32
+		       "  %7"PRIu64"  %11"PRIu64"  %8"PRIu64"\n",
+		       wi->name, wi->nr_threads,
+		       wi->dynamic ? wi->target : wi->nr_threads,
+		       wi->min_threads, max, wi->nr_queued, wi->rate,
+		       wi->service_time / 1000, wi->wait_time / 1000);
+	}
+	ret = EXIT_SUCCESS;
+out:
+	free(info);
+	return ret;
+}
+
+static int node_wq_set(int argc, char **argv)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_wq_info info = {};
+	int ret;
+
+	if (argc - optind < 3) {
+		sd_err("usage: dog node wq set <name> <min> <max>");
+		return EXIT_USAGE;
+	}
+
+	pstrcpy(info.name, sizeof(info.name), argv[optind++]);
+	info.min_threads = strtoul(argv[optind++], NULL, 10);
+	info.max_threads = strtoul(argv[optind++], NULL, 10);
+
+	sd_init_req(&hdr, SD_OP_SET_WQ_LIMITS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(info);
+
+	ret = dog_exec_req(&sd_nid, &hdr, &info);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to set the limits of %s: %s", info.name,
+		       sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static struct subcommand node_wq_cmd[] = {
+	{"info", NULL, NULL, "show the work queues and their sizing",
+	 NULL, 0, node_wq_info},
+	{"set", "<name> <min> <max>", NULL,
+	 "bound the threads of a dynamic work queue, 0 for the default",
+	 NULL, CMD_NEED_ARG, node_wq_set},
+	{NULL},
+};
+
+static int node_wq(int argc, char **argv)
+{
+	return do_generic_subcommand(node_wq_cmd, argc, argv);
+}
+
 static int do_vnodes_set(const struct node_id *nid, int *nr_vnodes)
 {
 	int ret = 0;
@@ -902,10 +1399,12 @@ static struct subcommand node_cmd[] = {
 	 node_recovery_cmd, 0, node_recovery, node_options},
 	{"md", "[disks]", "aprAfhT", "See 'dog node md' for more information",
 	 node_md_cmd, CMD_NEED_ROOT|CMD_NEED_ARG, node_md, node_options},
-	{"stat", NULL, "aprwhT", "show stat information about the node", NULL,
+	{"stat", NULL, "aprwqmhT", "show stat information about the node", NULL,
 	 0, node_stat, node_options},
 	{"log", NULL, "aphT", "show or set log level of the node", node_log_cmd,
 	 CMD_NEED_ROOT|CMD_NEED_ARG, node_log},
+	{"wq", NULL, "aprhT", "show or bound the work queues of the node",
+	 node_wq_cmd, CMD_NEED_ROOT|CMD_NEED_ARG, node_wq},
 	{"vnodes", "<num of vnodes>", "aph", "set new vnodes", node_vnodes_cmd,
 	 CMD_NEED_ROOT|CMD_NEED_ARG, node_vnodes},
 	{"format", "<directory of sheep> <a name of store format>",
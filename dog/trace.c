@@ -120,16 +120,26 @@ out:
 
 static int trace_enable(int argc, char **argv)
 {
-	const char *tracer = argv[optind];
+	const char *tracer = argv[optind++];
+	const char *opts = optind < argc ? argv[optind] : "";
+	char buf[4096];
 	int ret;
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 
+	/* the tracer name and its options, both terminated by NUL */
+	if (strlen(tracer) + strlen(opts) + 2 > sizeof(buf)) {
+		sd_err("too long tracer options");
+		return EXIT_USAGE;
+	}
+	strcpy(buf, tracer);
+	strcpy(buf + strlen(tracer) + 1, opts);
+
 	sd_init_req(&hdr, SD_OP_TRACE_ENABLE);
 	hdr.flags = SD_FLAG_CMD_WRITE;
-	hdr.data_length = strlen(tracer) + 1;
+	hdr.data_length = strlen(tracer) + strlen(opts) + 2;
 
-	ret = dog_exec_req(&sd_nid, &hdr, (void *)tracer);
+	ret = dog_exec_req(&sd_nid, &hdr, buf);
 	if (ret < 0)
 		return EXIT_SYSFAIL;
 
@@ -140,7 +150,8 @@ static int trace_enable(int argc, char **argv)
 		sd_err("no such tracer %s", tracer);
 		return EXIT_FAILURE;
 	case SD_RES_INVALID_PARMS:
-		sd_err("tracer %s is already enabled", tracer);
+		sd_err("tracer %s is already enabled or the options are "
+		       "invalid", tracer);
 		return EXIT_FAILURE;
 	default:
 		sd_err("unknown error (%s)", sd_strerror(rsp->result));
@@ -333,10 +344,66 @@ static void stat_trace_file(void *buf, size_t size)
 	stat_list_print();
 }
 
+static int profile_item_cmp(const struct trace_profile_item *a,
+			    const struct trace_profile_item *b)
+{
+	uint64_t ta = a->nr_sampled ?
+		a->sampled_time / a->nr_sampled * a->nr_calls : 0;
+	uint64_t tb = b->nr_sampled ?
+		b->sampled_time / b->nr_sampled * b->nr_calls : 0;
+
+	/* largest first */
+	return -intcmp(ta, tb);
+}
+
+/*
+ * The time of the functions is estimated from the sampled calls.  Return the
+ * number of the printed functions, 0 if the profile tracer has not run.
+ */
+static int print_profile(void)
+{
+#define MAX_PROFILE_ITEMS 8192
+	struct trace_profile_item *items;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret, nr;
+
+	items = xmalloc(sizeof(*items) * MAX_PROFILE_ITEMS);
+	sd_init_req(&hdr, SD_OP_TRACE_PROFILE);
+	hdr.data_length = sizeof(*items) * MAX_PROFILE_ITEMS;
+
+	ret = dog_exec_req(&sd_nid, &hdr, items);
+	if (ret < 0 || rsp->result != SD_RES_SUCCESS) {
+		free(items);
+		return 0;
+	}
+
+	nr = rsp->data_length / sizeof(*items);
+	xqsort(items, nr, profile_item_cmp);
+	if (nr)
+		printf("   Total (s)   Per Call (ms)        Calls   Name\n");
+	for (int i = 0; i < nr; i++) {
+		double per = items[i].nr_sampled ?
+			(double)items[i].sampled_time / items[i].nr_sampled : 0;
+
+		printf("%10.3f   %10.3f     %12"PRIu64"   %-*s\n",
+		       per * items[i].nr_calls / 1000000000, per / 1000000,
+		       items[i].nr_calls, TRACE_FNAME_LEN, items[i].fname);
+	}
+
+	free(items);
+	return nr;
+}
+
 static int graph_stat(int argc, char **argv)
 {
 	struct stat st;
-	void *map = map_trace_file(&st);
+	void *map;
+
+	if (print_profile() > 0)
+		return EXIT_SUCCESS;
+
+	map = map_trace_file(&st);
 
 	if (!map)
 		return EXIT_FAILURE;
@@ -354,7 +421,8 @@ static int trace_parser(int ch, const char *opt)
 static struct subcommand graph_cmd[] = {
 	{"cat", NULL, NULL, "cat the output of graph tracer",
 	 NULL, 0, graph_cat},
-	{"stat", NULL, NULL, "get the stat of the graph calls",
+	{"stat", NULL, NULL,
+	 "get the stat of the profile tracer, or of the graph calls",
 	 NULL, 0, graph_stat},
 	{NULL,},
 };
@@ -366,7 +434,7 @@ static int trace_graph(int argc, char **argv)
 
 /* Subcommand list of trace */
 static struct subcommand trace_cmd[] = {
-	{"enable", "<tracer>", "aph", "enable tracer", NULL,
+	{"enable", "<tracer> [<options>]", "aph", "enable tracer", NULL,
 	 CMD_NEED_ARG, trace_enable},
 	{"disable", "<tracer>", "aph", "disable tracer", NULL,
 	 CMD_NEED_ARG, trace_disable},
@@ -125,6 +125,7 @@ close_fd:
 
 /*
  * caution: currently upgrade_object_location() doesn't assume disk vnodes mode
+ * nor multi-probe placement
  */
 static int upgrade_object_location(int argc, char **argv)
 {
@@ -150,7 +151,7 @@ static int upgrade_object_location(int argc, char **argv)
 
 
 	/* TODO: erasure coded objects */
-	sd_info("%s", node_to_str(oid_to_node(oid, &vinfo->vroot, 0)));
+	sd_info("%s", node_to_str(oid_to_node(oid, &vinfo->vroot, 1, 0)));
 
 	return EXIT_SUCCESS;
 }
@@ -22,6 +22,7 @@
 #include "treeview.h"
 #include "sha1.h"
 #include "fec.h"
+#include "memscan.h"
 
 struct rb_root oid_tree = RB_ROOT;
 
@@ -30,6 +31,7 @@ struct rb_root oid_tree = RB_ROOT;
 static struct sd_option vdi_options[] = {
 	{'P', "prealloc", false, "preallocate all the data objects"},
 	{'n', "no-share", false, "share nothing with its parent"},
+	{'l', "lazy", false, "copy the objects of its parent later"},
 	{'i', "index", true, "specify the index of data objects"},
 	{'s', "snapshot", true, "specify a snapshot id or tag name"},
 	{'x', "exclusive", false, "write in an exclusive mode"},
@@ -39,9 +41,13 @@ static struct sd_option vdi_options[] = {
 	{'F', "from", true, "create a differential backup from the snapshot"},
 	{'f', "force", false, "do operation forcibly"},
 	{'y', "hyper", false, "create a hyper volume"},
+	{'C', "compress", false, "store the data objects compressed"},
+	{'Q', "quorum", true, "acknowledge the writes after this many "
+	 "replicas"},
 	{'o', "oid", true, "specify the object id of the tracking object"},
 	{'e', "exist", false, "only check objects exist or not,\n"
 	 "                          neither comparing nor repairing"},
+	{'k', "crc", false, "compare the replicas by CRC32C instead of SHA1"},
 	{'z', "block_size_shift", true, "specify the bit shift num for"
 			       " data object size"},
 	{'R', "reduce-identical-snapshots", false, "do not create snapshot if "
@@ -52,6 +58,12 @@ static struct sd_option vdi_options[] = {
 	 "in reclamation loop during VDI deletion"},
 	{'m', "max-reclaim", true, "specify the maximum number of reclaimed objects "
 	 "(if this option is specified, an inode object won't be reclaimed)"},
+	{'L', "max-inflight", true, "specify the maximum number of in-flight"
+	 " requests (default: twice the number of nodes)"},
+	{'A', "all", false, "show the placement of all the objects"},
+	{'b', "bandwidth", true, "limit the conversion to this many MB/s"},
+	{'t', "top", true, "show this many of the busiest vdis (default: 20)"},
+	{'N', "updates", true, "stop after this many updates (default: never)"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -70,14 +82,23 @@ static struct vdi_cmd_data {
 	bool force;
 	uint8_t copy_policy;
 	uint8_t store_policy;
+	bool compress;
+	uint8_t write_quorum;
 	uint64_t oid;
 	bool no_share;
+	bool lazy;
 	bool exist;
+	bool crc;
 	bool reduce_identical_snapshots;
 	int nr_batched_reclamation;
 	int reclamation_interval;
 	int nr_max_reclaim;
-} vdi_cmd_data = { ~0, };
+	int nr_inflight;
+	bool all;
+	uint32_t convert_rate;
+	int nr_top;
+	int nr_updates;
+} vdi_cmd_data = { ~0, .nr_top = 20, };
 
 struct get_vdi_info {
 	const char *name;
@@ -150,32 +171,57 @@ static void vdi_show_progress(uint64_t done, uint64_t total)
 
 static char *redundancy_scheme(uint8_t copy_nr, uint8_t policy)
 {
-	static char str[10];
+	static char str[16];
 
-	if (policy > 0) {
-		int d, p;
-		ec_policy_to_dp(policy, &d, &p);
-		snprintf(str, sizeof(str), "%d:%d", d, p);
-	} else {
+	if (policy > 0)
+		pstrcpy(str, sizeof(str), ec_policy_to_str(policy));
+	else
 		snprintf(str, sizeof(str), "%d", copy_nr);
-	}
 	return str;
 }
 
-static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
-			   uint32_t snapid, uint32_t flags,
-			   const struct sd_inode *i, void *data)
+/* Count the objects of the vdi from its whole inode */
+static void vdi_usage(uint32_t vid, uint64_t *my_objs, uint64_t *cow_objs)
+{
+	struct sd_inode *inode = xmalloc(sizeof(*inode));
+	uint32_t rlen;
+	int ret;
+
+	ret = dog_read_object(vid_to_vdi_oid(vid), inode, SD_INODE_HEADER_SIZE +
+			      sizeof(struct sd_index_header), 0, true);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	rlen = sd_inode_get_meta_size(inode, SD_INODE_SIZE);
+	ret = dog_read_object(vid_to_vdi_oid(vid),
+			      (char *)inode + SD_INODE_HEADER_SIZE, rlen,
+			      SD_INODE_HEADER_SIZE, true);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	sd_inode_stat(inode, my_objs, cow_objs);
+out:
+	if (ret != SD_RES_SUCCESS)
+		sd_err("Failed to read inode");
+	free(inode);
+}
+
+static void print_vdi_list(const struct sd_inode_summary *i, void *data)
 {
 	bool is_clone = false;
-	uint64_t my_objs = 0, cow_objs = 0;
+	uint64_t my_objs = i->my_objs, cow_objs = i->cow_objs;
 	time_t ti;
 	struct tm tm;
 	char dbuf[128];
 	struct get_vdi_info *info = data;
 	uint32_t object_size = (UINT32_C(1) << i->block_size_shift);
-
-	if (info && strcmp(name, info->name) != 0)
-		return;
+	uint32_t vid = i->vdi_id, snapid = i->snap_ctime ? i->snap_id : 0;
+	const char *name = i->name;
+
+	if (info) {
+		if (strcmp(name, info->name) != 0)
+			return;
+		/* only the matching vdis are counted */
+		vdi_usage(vid, &my_objs, &cow_objs);
+	}
 
 	ti = i->create_time >> 32;
 	if (raw_output) {
@@ -186,13 +232,11 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 			 "%Y-%m-%d %H:%M", &tm);
 	}
 
-	sd_inode_stat(i, &my_objs, &cow_objs);
-
 	if (i->snap_id == 1 && i->parent_vdi_id != 0)
 		is_clone = true;
 
 	if (raw_output) {
-		printf("%c ", vdi_is_snapshot(i) ? 's' : (is_clone ? 'c' : '='));
+		printf("%c ", i->snap_ctime ? 's' : (is_clone ? 'c' : '='));
 		while (*name) {
 			if (isspace(*name) || *name == '\\')
 				putchar('\\');
@@ -208,7 +252,7 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 	} else {
 		printf("%c %-8s %5d %7s %7s %7s %s  %7" PRIx32
 		       " %6s %13s %3" PRIu8 "\n",
-		       vdi_is_snapshot(i) ? 's' : (is_clone ? 'c' : ' '),
+		       i->snap_ctime ? 's' : (is_clone ? 'c' : ' '),
 		       name, snapid,
 		       strnumber(i->vdi_size),
 		       strnumber(my_objs * object_size),
@@ -323,13 +367,13 @@ static void print_obj_ref(uint32_t vid, const char *name, const char *tag,
 {
 	uint64_t oid = *(uint64_t *)data;
 	uint64_t idx = data_oid_to_idx(oid);
-	struct get_vdi_info info;
+	struct sd_inode_summary s;
 
 	if (i->data_vdi_id[idx] != 0 &&
 			i->data_vdi_id[idx] == oid_to_vid(oid)) {
-		memset(&info, 0, sizeof(info));
-		info.name = name;
-		print_vdi_list(vid, name, tag, snapid, flags, i, &info);
+		sd_inode_summarize(i, &s);
+		sd_inode_stat(i, &s.my_objs, &s.cow_objs);
+		print_vdi_list(&s, NULL);
 	}
 }
 
@@ -407,7 +451,7 @@ static int vdi_list(int argc, char **argv)
 		struct get_vdi_info info;
 		memset(&info, 0, sizeof(info));
 		info.name = vdiname;
-		if (parse_vdi(print_vdi_list, SD_INODE_SIZE, &info, true) < 0)
+		if (parse_vdi_summary(print_vdi_list, false, &info) < 0)
 			return EXIT_SYSFAIL;
 		return EXIT_SUCCESS;
 	}
@@ -421,7 +465,7 @@ static int vdi_list(int argc, char **argv)
 		return EXIT_SUCCESS;
 	}
 
-	if (parse_vdi(print_vdi_list, SD_INODE_SIZE, NULL, true) < 0)
+	if (parse_vdi_summary(print_vdi_list, true, NULL) < 0)
 		return EXIT_SYSFAIL;
 	return EXIT_SUCCESS;
 }
@@ -516,7 +560,8 @@ int read_vdi_obj(const char *vdiname, int snapid, const char *tag,
 int do_vdi_create(const char *vdiname, int64_t vdi_size,
 		  uint32_t base_vid, uint32_t *vdi_id, bool snapshot,
 		  uint8_t nr_copies, uint8_t copy_policy,
-		  uint8_t store_policy, uint8_t block_size_shift)
+		  uint8_t store_policy, uint8_t block_size_shift,
+		  uint32_t flags)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -537,6 +582,7 @@ int do_vdi_create(const char *vdiname, int64_t vdi_size,
 	hdr.vdi.copy_policy = copy_policy;
 	hdr.vdi.store_policy = store_policy;
 	hdr.vdi.block_size_shift = block_size_shift;
+	hdr.vdi.flags = flags;
 
 	ret = dog_exec_req(&sd_nid, &hdr, buf);
 	if (ret < 0)
@@ -627,7 +673,9 @@ static int vdi_create(int argc, char **argv)
 	ret = do_vdi_create(vdiname, size, 0, &vid, false,
 			    vdi_cmd_data.nr_copies, vdi_cmd_data.copy_policy,
 			    vdi_cmd_data.store_policy,
-			    vdi_cmd_data.block_size_shift);
+			    vdi_cmd_data.block_size_shift,
+			    (vdi_cmd_data.compress ? SD_INODE_COMPRESS : 0) |
+			    vdi_cmd_data.write_quorum << SD_INODE_QUORUM_SHIFT);
 	if (ret != EXIT_SUCCESS || !vdi_cmd_data.prealloc)
 		goto out;
 
@@ -825,7 +873,8 @@ static int vdi_snapshot(int argc, char **argv)
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, vid, &new_vid, true,
 			    inode->nr_copies, inode->copy_policy,
-			    inode->store_policy, inode->block_size_shift);
+			    inode->store_policy, inode->block_size_shift,
+			    inode->flags);
 
 	if (ret == EXIT_SUCCESS && verbose) {
 		if (raw_output)
@@ -839,6 +888,25 @@ out:
 	return ret;
 }
 
+/*
+ * The new vdi is usable at once, and the sheep copies the objects which it
+ * shares with the parent in the background.  The progress is shown by the
+ * used and shared sizes of 'dog vdi list'.
+ */
+static int hydrate_vdi(uint32_t vid)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_HYDRATE_VDI);
+	hdr.obj.oid = vid_to_vdi_oid(vid);
+	if (send_light_req(&sd_nid, &hdr)) {
+		sd_err("Failed to start copying the objects of the clone");
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static int vdi_clone(int argc, char **argv)
 {
 	const char *src_vdi = argv[optind++], *dst_vdi;
@@ -864,6 +932,13 @@ static int vdi_clone(int argc, char **argv)
 		goto out;
 	}
 
+	if (vdi_cmd_data.lazy &&
+	    (vdi_cmd_data.no_share || vdi_cmd_data.prealloc)) {
+		sd_err("A lazy clone can't be preallocated or share nothing");
+		ret = EXIT_USAGE;
+		goto out;
+	}
+
 	inode = xmalloc(sizeof(*inode));
 
 	ret = read_vdi_obj(src_vdi, vdi_cmd_data.snapshot_id,
@@ -878,7 +953,12 @@ static int vdi_clone(int argc, char **argv)
 	object_size = (UINT32_C(1) << inode->block_size_shift);
 	ret = do_vdi_create(dst_vdi, inode->vdi_size, base_vid, &new_vid, false,
 			    inode->nr_copies, inode->copy_policy,
-			    inode->store_policy, inode->block_size_shift);
+			    inode->store_policy, inode->block_size_shift,
+			    inode->flags);
+	if (ret == EXIT_SUCCESS && vdi_cmd_data.lazy) {
+		ret = hydrate_vdi(new_vid);
+		goto out;
+	}
 	if (ret != EXIT_SUCCESS ||
 			(!vdi_cmd_data.prealloc && !vdi_cmd_data.no_share))
 		goto out;
@@ -1154,7 +1234,8 @@ static int vdi_rollback(int argc, char **argv)
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, base_vid, &new_vid,
 			     false, inode->nr_copies, inode->copy_policy,
-			     inode->store_policy, inode->block_size_shift);
+			     inode->store_policy, inode->block_size_shift,
+			     inode->flags);
 
 	if (ret == EXIT_SUCCESS && verbose) {
 		if (raw_output)
@@ -1166,6 +1247,7 @@ static int vdi_rollback(int argc, char **argv)
 	return ret;
 }
 
+static int do_vdi_placement_report(const struct sd_inode *inode);
 
 static int vdi_object_map(int argc, char **argv)
 {
@@ -1183,6 +1265,11 @@ static int vdi_object_map(int argc, char **argv)
 		goto out;
 	}
 
+	if (vdi_cmd_data.all) {
+		ret = do_vdi_placement_report(inode);
+		goto out;
+	}
+
 	printf("Index       VID\n");
 	if (idx != ~0) {
 		vid = sd_inode_get_vid(inode, idx);
@@ -1215,7 +1302,7 @@ static void print_expected_location(uint64_t oid, int copies)
 
 	printf("\nAccording to sheepdog algorithm, "
 		   "the object should be located at:\n");
-	oid_to_vnodes(oid, &sd_vroot, copies, vnodes);
+	oid_to_vnodes(oid, &sd_vroot, sd_nr_probes, copies, vnodes);
 	for (int i = 0; i < copies; i++)
 		printf((i < copies - 1) ? "%s " : "%s",
 			addr_to_str(vnodes[i]->node->nid.addr,
@@ -1240,6 +1327,11 @@ static int vdi_object_location(int argc, char **argv)
 	}
 	vid = inode->vdi_id;
 
+	if (vdi_cmd_data.all) {
+		ret = do_vdi_placement_report(inode);
+		goto out;
+	}
+
 	if (idx == ~0) {
 		printf("Looking for the inode object 0x%" PRIx32 " with %d"
 		       " nodes\n\n",
@@ -1283,7 +1375,7 @@ static void save_oid(uint64_t oid, int copies)
 	const struct sd_vnode *vnodes[SD_MAX_COPIES];
 	struct oid_entry *entry;
 
-	oid_to_vnodes(oid, &sd_vroot, copies, vnodes);
+	oid_to_vnodes(oid, &sd_vroot, sd_nr_probes, copies, vnodes);
 	for (int i = 0; i < copies; i++) {
 		struct oid_entry key = {
 			.node = (struct sd_node *) vnodes[i]->node
@@ -1376,6 +1468,155 @@ static int do_vdi_check_exist(const struct sd_inode *inode)
 	}
 }
 
+/*
+ * Whole-VDI placement report.  The locations are computed locally from the
+ * vnode list and each node is asked once (in OIDS_EXIST_BATCH sized chunks)
+ * which of its expected objects are missing.  The nodes are queried
+ * concurrently, so the report costs one round trip per node rather than one
+ * per object and node.
+ */
+#define OIDS_EXIST_BATCH 65536
+
+struct oids_exist_work {
+	struct oid_entry *entry;
+	uint64_t *missing;
+	int nr_missing;
+	int ret;
+	struct work work;
+};
+
+static void oids_exist_work(struct work *work)
+{
+	struct oids_exist_work *ew =
+		container_of(work, struct oids_exist_work, work);
+	struct oid_entry *entry = ew->entry;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint64_t *buf = xmalloc(sizeof(uint64_t) * OIDS_EXIST_BATCH);
+
+	ew->missing = xmalloc(sizeof(uint64_t) * max(entry->last, 1));
+	for (int i = 0; i < entry->last; i += OIDS_EXIST_BATCH) {
+		int nr = min(entry->last - i, OIDS_EXIST_BATCH);
+
+		memcpy(buf, entry->oids + i, sizeof(uint64_t) * nr);
+		sd_init_req(&hdr, SD_OP_OIDS_EXIST);
+		hdr.data_length = sizeof(uint64_t) * nr;
+		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+		ew->ret = dog_exec_req(&entry->node->nid, &hdr, buf);
+		if (ew->ret < 0)
+			break;
+
+		nr = rsp->data_length / sizeof(uint64_t);
+		memcpy(ew->missing + ew->nr_missing, buf,
+		       sizeof(uint64_t) * nr);
+		ew->nr_missing += nr;
+	}
+	free(buf);
+}
+
+static void oids_exist_main(struct work *work)
+{
+	struct oids_exist_work *ew =
+		container_of(work, struct oids_exist_work, work);
+
+	if (ew->ret < 0)
+		sd_err("failed to query %s",
+		       addr_to_str(ew->entry->node->nid.addr,
+				   ew->entry->node->nid.port));
+	else
+		xqsort(ew->missing, ew->nr_missing, oid_cmp);
+}
+
+static bool oid_is_missing(struct oids_exist_work *works, int nr_works,
+			   const struct sd_node *node, uint64_t oid)
+{
+	for (int i = 0; i < nr_works; i++) {
+		if (works[i].entry->node != node)
+			continue;
+		if (works[i].ret < 0)
+			return true;
+		return xbsearch(&oid, works[i].missing, works[i].nr_missing,
+				oid_cmp) != NULL;
+	}
+	return true;
+}
+
+static int print_object_placement(struct oids_exist_work *works, int nr_works,
+				  uint64_t idx, uint64_t oid, int copies)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	int nr_missing = 0;
+
+	oid_to_vnodes(oid, &sd_vroot, sd_nr_probes, copies, vnodes);
+	if (is_vdi_obj(oid))
+		printf("   inode %8"PRIx32" ", oid_to_vid(oid));
+	else
+		printf("%08"PRIu64" %8"PRIx32" ", idx, oid_to_vid(oid));
+	for (int i = 0; i < copies; i++) {
+		const struct sd_node *n = vnodes[i]->node;
+		bool missing = oid_is_missing(works, nr_works, n, oid);
+
+		printf(" %s%s", addr_to_str(n->nid.addr, n->nid.port),
+		       missing ? "(missing)" : "");
+		nr_missing += missing;
+	}
+	printf("\n");
+
+	return nr_missing;
+}
+
+static int do_vdi_placement_report(const struct sd_inode *inode)
+{
+	struct oids_exist_work *works;
+	struct oid_entry *entry;
+	struct work_queue *wq;
+	int nr_works = 0, nr_objs = 0, nr_missing = 0, i = 0;
+	int copies = min((int)inode->nr_copies, sd_zones_nr);
+	uint32_t max_idx, vid;
+
+	build_oid_tree(inode);
+
+	rb_for_each_entry(entry, &oid_tree, rb)
+		nr_works++;
+	works = xzalloc(sizeof(*works) * nr_works);
+
+	wq = create_work_queue("vdi placement", WQ_DYNAMIC);
+	rb_for_each_entry(entry, &oid_tree, rb) {
+		works[i].entry = entry;
+		works[i].work.fn = oids_exist_work;
+		works[i].work.done = oids_exist_main;
+		queue_work(wq, &works[i].work);
+		i++;
+	}
+	work_queue_wait(wq);
+
+	printf("Index       VID  Locations\n");
+	nr_missing += print_object_placement(works, nr_works, 0,
+					     vid_to_vdi_oid(inode->vdi_id),
+					     copies);
+	nr_objs++;
+	max_idx = count_data_objs(inode);
+	for (uint32_t idx = 0; idx < max_idx; idx++) {
+		vid = sd_inode_get_vid(inode, idx);
+		if (vid == 0)
+			continue;
+		nr_missing += print_object_placement(works, nr_works, idx,
+						     vid_to_data_oid(vid, idx),
+						     copies);
+		nr_objs++;
+	}
+
+	printf("\n%d object(s) with %d copies on %d nodes, %d replica(s) "
+	       "missing\n", nr_objs, copies, sd_nodes_nr, nr_missing);
+
+	for (i = 0; i < nr_works; i++)
+		free(works[i].missing);
+	free(works);
+	destroy_oid_tree();
+
+	return nr_missing ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 static int do_track_object(uint64_t oid, uint8_t nr_copies)
 {
 	int i, j, ret;
@@ -1443,7 +1684,8 @@ retry:
 			disks_to_vnodes(&nroot, &vroot);
 		else
 			nodes_to_vnodes(&nroot, &vroot);
-		oid_to_vnodes(oid, &vroot, nr_copies, vnode_buf);
+		oid_to_vnodes(oid, &vroot, sd_placement_probes(logs->flags),
+			      nr_copies, vnode_buf);
 		for (j = 0; j < nr_copies; j++) {
 			const struct node_id *n = &vnode_buf[j]->node->nid;
 
@@ -1669,16 +1911,138 @@ static int vdi_getattr(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+/*
+ * vdi read and vdi write stream the objects through a work queue, so that up
+ * to vdi_cmd_data.nr_inflight of them are in flight at a time, spread over the
+ * sheep of the cluster as gateways.  The reads are written to stdout in order
+ * as they complete, and the writes are sent while the next objects are read
+ * from stdin.
+ */
+struct vdi_io_work {
+	const struct node_id *nid;
+	struct sd_inode *inode;
+	uint32_t vid;
+	uint32_t idx;
+	uint64_t oid;
+	uint64_t cow_oid;
+	uint32_t flags;
+	bool create;
+	char *buf;
+	uint32_t len;
+	uint32_t offset;
+	bool done;
+	int ret;
+	struct list_node list;
+	struct work work;
+};
+
+static LIST_HEAD(vdi_io_list);	/* in the order of the stream */
+static int nr_vdi_io;
+static int vdi_io_result = SD_RES_SUCCESS;
+static struct node_id *vdi_io_nids;
+static int nr_vdi_io_nids, vdi_io_next_nid;
+
+static struct work_queue *vdi_io_init(void)
+{
+	struct sd_node *n;
+
+	if (!vdi_cmd_data.nr_inflight)
+		vdi_cmd_data.nr_inflight = sd_nodes_nr * 2;
+
+	vdi_io_nids = xcalloc(sd_nodes_nr, sizeof(*vdi_io_nids));
+	rb_for_each_entry(n, &sd_nroot, rb)
+		vdi_io_nids[nr_vdi_io_nids++] = n->nid;
+
+	return create_work_queue("vdi io", WQ_DYNAMIC);
+}
+
+static struct vdi_io_work *alloc_vdi_io(struct sd_inode *inode, uint32_t idx,
+					uint32_t len, uint32_t offset)
+{
+	struct vdi_io_work *vw = xzalloc(sizeof(*vw));
+
+	vw->inode = inode;
+	vw->idx = idx;
+	vw->len = len;
+	vw->offset = offset;
+	vw->buf = xmalloc(len);
+	vw->nid = &vdi_io_nids[vdi_io_next_nid++ % nr_vdi_io_nids];
+
+	list_add_tail(&vw->list, &vdi_io_list);
+	nr_vdi_io++;
+	return vw;
+}
+
+static void free_vdi_io(struct vdi_io_work *vw)
+{
+	list_del(&vw->list);
+	nr_vdi_io--;
+	free(vw->buf);
+	free(vw);
+}
+
+static void vdi_io_wait_slot(void)
+{
+	while (nr_vdi_io >= vdi_cmd_data.nr_inflight)
+		event_loop(-1);
+}
+
+static void vdi_read_work(struct work *work)
+{
+	struct vdi_io_work *vw = container_of(work, struct vdi_io_work, work);
+
+	vw->ret = dog_read_object_from(vw->nid, vw->oid, vw->buf, vw->len,
+				       vw->offset, false);
+}
+
+static void vdi_read_main(struct work *work)
+{
+	struct vdi_io_work *vw = container_of(work, struct vdi_io_work, work);
+
+	vw->done = true;
+}
+
+static void vdi_write_work(struct work *work)
+{
+	struct vdi_io_work *vw = container_of(work, struct vdi_io_work, work);
+	struct sd_inode *inode = vw->inode;
+
+	vw->ret = dog_write_object_to(vw->nid, vw->oid, vw->cow_oid, vw->buf,
+				      vw->len, vw->offset, vw->flags,
+				      inode->nr_copies, inode->copy_policy,
+				      vw->create, false);
+	/* the index of a B-tree inode is written by the main thread */
+	if (vw->ret == SD_RES_SUCCESS && vw->create && !inode->store_policy)
+		vw->ret = sd_inode_write_vid(inode, vw->idx, vw->vid, vw->vid,
+					     vw->flags, false, false);
+}
+
+static void vdi_write_main(struct work *work)
+{
+	struct vdi_io_work *vw = container_of(work, struct vdi_io_work, work);
+	struct sd_inode *inode = vw->inode;
+
+	if (vw->ret == SD_RES_SUCCESS && vw->create && inode->store_policy)
+		vw->ret = sd_inode_write_vid(inode, vw->idx, vw->vid, vw->vid,
+					     vw->flags, false, false);
+
+	if (vw->ret != SD_RES_SUCCESS && vdi_io_result == SD_RES_SUCCESS)
+		vdi_io_result = vw->ret;
+
+	free_vdi_io(vw);
+}
+
 static int vdi_read(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
 	int ret;
 	struct sd_inode *inode = NULL;
-	uint64_t offset = 0, oid, done = 0, total = (uint64_t) -1;
+	uint64_t offset = 0, done = 0, total = (uint64_t) -1;
 	uint32_t vdi_id, idx;
 	uint32_t object_size;
 	uint64_t len;
-	char *buf = NULL;
+	struct vdi_io_work *vw;
+	struct work_queue *wq;
 
 	if (argv[optind]) {
 		ret = option_parse_size(argv[optind++], &offset);
@@ -1706,40 +2070,60 @@ static int vdi_read(int argc, char **argv)
 	}
 
 	object_size = (UINT32_C(1) << inode->block_size_shift);
-	buf = xmalloc(object_size);
+	wq = vdi_io_init();
 
 	total = min(total, inode->vdi_size - offset);
 	idx = offset / object_size;
 	offset %= object_size;
-	while (done < total) {
-		len = min(total - done, object_size - offset);
-		vdi_id = sd_inode_get_vid(inode, idx);
-		if (vdi_id) {
-			oid = vid_to_data_oid(vdi_id, idx);
-			ret = dog_read_object(oid, buf, len, offset, false);
-			if (ret != SD_RES_SUCCESS) {
-				sd_err("Failed to read VDI");
-				ret = EXIT_FAILURE;
-				goto out;
+	while (done < total || !list_empty(&vdi_io_list)) {
+		/* read ahead */
+		if (done < total && nr_vdi_io < vdi_cmd_data.nr_inflight) {
+			len = min(total - done, object_size - offset);
+			vw = alloc_vdi_io(inode, idx, len, offset);
+			vdi_id = sd_inode_get_vid(inode, idx);
+			if (vdi_id) {
+				vw->oid = vid_to_data_oid(vdi_id, idx);
+				vw->work.fn = vdi_read_work;
+				vw->work.done = vdi_read_main;
+				queue_work(wq, &vw->work);
+			} else {
+				memset(vw->buf, 0, len);
+				vw->done = true;
 			}
-		} else
-			memset(buf, 0, len);
 
-		ret = xwrite(STDOUT_FILENO, buf, len);
+			offset = 0;
+			idx++;
+			done += len;
+			continue;
+		}
+
+		vw = list_first_entry(&vdi_io_list, struct vdi_io_work, list);
+		if (!vw->done) {
+			event_loop(-1);
+			continue;
+		}
+
+		if (vw->ret != SD_RES_SUCCESS) {
+			sd_err("Failed to read VDI");
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		ret = xwrite(STDOUT_FILENO, vw->buf, vw->len);
 		if (ret < 0) {
 			sd_err("Failed to write to stdout: %m");
 			ret = EXIT_SYSFAIL;
 			goto out;
 		}
-
-		offset = 0;
-		idx++;
-		done += len;
+		free_vdi_io(vw);
 	}
 	fsync(STDOUT_FILENO);
 	ret = EXIT_SUCCESS;
 out:
-	free(buf);
+	work_queue_wait(wq);
+	list_for_each_entry(vw, &vdi_io_list, list)
+		free_vdi_io(vw);
+	free(vdi_io_nids);
 load_inode_err:
 	free(inode);
 
@@ -1753,10 +2137,11 @@ static int vdi_write(int argc, char **argv)
 	uint32_t object_size;
 	int ret;
 	struct sd_inode *inode = NULL;
-	uint64_t offset = 0, oid, old_oid, done = 0, total = (uint64_t) -1;
+	uint64_t offset = 0, old_oid, done = 0, total = (uint64_t) -1;
 	unsigned int len;
-	char *buf = NULL;
 	bool create;
+	struct vdi_io_work *vw;
+	struct work_queue *wq;
 
 	if (argv[optind]) {
 		ret = option_parse_size(argv[optind++], &offset);
@@ -1782,12 +2167,13 @@ static int vdi_write(int argc, char **argv)
 	}
 
 	object_size = (UINT32_C(1) << inode->block_size_shift);
-	buf = xmalloc(object_size);
+	wq = vdi_io_init();
 
 	total = min(total, inode->vdi_size - offset);
 	idx = offset / object_size;
 	offset %= object_size;
-	while (done < total) {
+	ret = EXIT_SUCCESS;
+	while (done < total && vdi_io_result == SD_RES_SUCCESS) {
 		create = false;
 		old_oid = 0;
 		flags = 0;
@@ -1804,36 +2190,32 @@ static int vdi_write(int argc, char **argv)
 		if (vdi_cmd_data.writeback)
 			flags |= SD_FLAG_CMD_CACHE;
 
-		ret = xread(STDIN_FILENO, buf, len);
+		/* write behind */
+		vdi_io_wait_slot();
+		vw = alloc_vdi_io(inode, idx, len, offset);
+
+		ret = xread(STDIN_FILENO, vw->buf, len);
 		if (ret < 0) {
 			sd_err("Failed to read from stdin: %m");
+			free_vdi_io(vw);
 			ret = EXIT_SYSFAIL;
-			goto out;
+			break;
 		} else if (ret < len) {
 			/* exit after this buffer is sent */
-			memset(buf + ret, 0, len - ret);
+			memset(vw->buf + ret, 0, len - ret);
 			total = done + len;
 		}
+		ret = EXIT_SUCCESS;
 
 		sd_inode_set_vid(inode, idx, inode->vdi_id);
-		oid = vid_to_data_oid(inode->vdi_id, idx);
-		ret = dog_write_object(oid, old_oid, buf, len, offset, flags,
-				      inode->nr_copies, inode->copy_policy,
-				      create, false);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("Failed to write VDI");
-			ret = EXIT_FAILURE;
-			goto out;
-		}
-
-		if (create) {
-			ret = sd_inode_write_vid(inode, idx, vid, vid, flags,
-						 false, false);
-			if (ret) {
-				ret = EXIT_FAILURE;
-				goto out;
-			}
-		}
+		vw->oid = vid_to_data_oid(inode->vdi_id, idx);
+		vw->cow_oid = old_oid;
+		vw->flags = flags;
+		vw->create = create;
+		vw->vid = vid;
+		vw->work.fn = vdi_write_work;
+		vw->work.done = vdi_write_main;
+		queue_work(wq, &vw->work);
 
 		offset += len;
 		if (offset == object_size) {
@@ -1842,9 +2224,13 @@ static int vdi_write(int argc, char **argv)
 		}
 		done += len;
 	}
-	ret = EXIT_SUCCESS;
-out:
-	free(buf);
+	work_queue_wait(wq);
+
+	if (vdi_io_result != SD_RES_SUCCESS) {
+		sd_err("Failed to write VDI");
+		ret = EXIT_FAILURE;
+	}
+	free(vdi_io_nids);
 load_inode_err:
 	free(inode);
 
@@ -1909,6 +2295,9 @@ struct vdi_check_info {
 	struct vdi_check_work vcw[0];
 };
 
+/* Number of the batched hash requests and repairs being processed */
+static int nr_check_inflight;
+
 static void free_vdi_check_info(struct vdi_check_info *info)
 {
 	uint32_t object_size = (UINT32_C(1) << info->block_size_shift);
@@ -1953,6 +2342,7 @@ static void vdi_repair_main(struct work *work)
 						  work);
 	struct vdi_check_info *info = vcw->info;
 
+	nr_check_inflight--;
 	if (vcw->object_found)
 		fprintf(stdout, "fixed replica %016"PRIx64"\n", info->oid);
 	else
@@ -2037,6 +2427,7 @@ static void check_replicatoin_object(struct vdi_check_info *info)
 			info->vcw[i].work.fn = vdi_repair_work;
 			info->vcw[i].work.done = vdi_repair_main;
 			info->refcnt++;
+			nr_check_inflight++;
 			queue_work(info->wq, &info->vcw[i].work);
 		}
 	}
@@ -2046,7 +2437,7 @@ static void check_erasure_object(struct vdi_check_info *info)
 {
 	int d = 0, p = 0, i, j, k;
 	int dp = ec_policy_to_dp(info->copy_policy, &d, &p);
-	struct fec *ctx = ec_init(d, dp);
+	struct fec *ctx = ec_init_policy(info->copy_policy);
 	int miss_idx[dp], input_idx[dp];
 	uint64_t oid = info->oid;
 	uint32_t object_size = (UINT32_C(1) << info->block_size_shift);
@@ -2090,14 +2481,17 @@ static void check_erasure_object(struct vdi_check_info *info)
 		       "lost, more than %d", oid, j, p);
 		goto out;
 	} else {
+		int nr_in = info->nr_copies - j;
+
 		for (k = 0; k < j; k++) {
 			int m = miss_idx[k];
-			uint8_t *ds[d];
 
-			for (i = 0; i < d; i++)
-				ds[i] = input[i];
-			ec_decode_buffer(ctx, ds, input_idx, obj, m,
-					 object_size);
+			if (ec_repair_buffer(ctx, input, input_idx, nr_in, obj,
+					     m, object_size) < 0) {
+				sd_err("failed to rebuild object %016"PRIx64
+				       ", copy index %d", oid, m);
+				goto out;
+			}
 			write_object_to(info->vcw[m].vnode, oid, obj,
 					len, true, info->vcw[m].ec_index);
 			fprintf(stdout, "fixed missing %016"PRIx64", "
@@ -2188,9 +2582,9 @@ static void vdi_check_object_main(struct work *work)
 		free_vdi_check_info(info);
 }
 
-static void queue_vdi_check_work(const struct sd_inode *inode, uint64_t oid,
-				 uint64_t *done, struct work_queue *wq,
-				 int nr_copies)
+static struct vdi_check_info *
+alloc_vdi_check_info(const struct sd_inode *inode, uint64_t oid, uint64_t *done,
+		     struct work_queue *wq, int nr_copies)
 {
 	struct vdi_check_info *info;
 	const struct sd_vnode *tgt_vnodes[SD_MAX_COPIES];
@@ -2204,18 +2598,224 @@ static void queue_vdi_check_work(const struct sd_inode *inode, uint64_t oid,
 	info->copy_policy = inode->copy_policy;
 	info->block_size_shift = inode->block_size_shift;
 
-	oid_to_vnodes(oid, &sd_vroot, nr_copies, tgt_vnodes);
+	oid_to_vnodes(oid, &sd_vroot, sd_nr_probes, nr_copies, tgt_vnodes);
 	for (int i = 0; i < nr_copies; i++) {
 		info->vcw[i].info = info;
 		info->vcw[i].ec_index = i;
 		info->vcw[i].vnode = tgt_vnodes[i];
+		info->refcnt++;
+	}
+
+	return info;
+}
+
+static void queue_vdi_check_work(const struct sd_inode *inode, uint64_t oid,
+				 uint64_t *done, struct work_queue *wq,
+				 int nr_copies)
+{
+	struct vdi_check_info *info;
+
+	info = alloc_vdi_check_info(inode, oid, done, wq, nr_copies);
+	for (int i = 0; i < nr_copies; i++) {
 		info->vcw[i].work.fn = vdi_check_object_work;
 		info->vcw[i].work.done = vdi_check_object_main;
-		info->refcnt++;
 		queue_work(info->wq, &info->vcw[i].work);
 	}
 }
 
+/*
+ * Replicated vdis are checked in batches: the hashes of the objects held by a
+ * node are fetched with one SD_OP_GET_HASHES request per CHECK_BATCH_SIZE
+ * objects and the requests to the different nodes run in parallel.  Repairs
+ * are queued as soon as all the replicas of an object are known.  At most
+ * vdi_cmd_data.nr_inflight requests and repairs are processed at a time.
+ */
+#define CHECK_BATCH_SIZE 512
+
+struct check_batch {
+	const struct sd_node *node;
+	int nr;
+	struct vdi_check_work *vcw[CHECK_BATCH_SIZE];
+	struct sd_obj_hash hashes[CHECK_BATCH_SIZE];
+	struct work work;
+};
+
+struct check_node {
+	struct rb_node rb;
+	const struct sd_node *node; /* key */
+	struct check_batch *batch;
+};
+
+static struct rb_root check_nodes = RB_ROOT;
+
+static int check_node_cmp(const struct check_node *a,
+			  const struct check_node *b)
+{
+	return node_cmp(a->node, b->node);
+}
+
+static void check_batch_work(struct work *work)
+{
+	struct check_batch *batch = container_of(work, struct check_batch,
+						 work);
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_GET_HASHES);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	if (vdi_cmd_data.crc)
+		hdr.flags |= SD_FLAG_CMD_CRC32C;
+	hdr.data_length = sizeof(batch->hashes[0]) * batch->nr;
+	hdr.obj.tgt_epoch = sd_epoch;
+
+	ret = dog_exec_req(&batch->node->nid, &hdr, batch->hashes);
+	if (ret < 0)
+		exit(EXIT_SYSFAIL);
+
+	/* SHA1 digests can't be compared with the CRC32C of the others */
+	if (vdi_cmd_data.crc && (rsp->result != SD_RES_SUCCESS ||
+				 !(rsp->flags & SD_FLAG_CMD_CRC32C))) {
+		sd_err("%s can't compute CRC32C, check without --crc",
+		       addr_to_str(batch->node->nid.addr,
+				   batch->node->nid.port));
+		exit(EXIT_FAILURE);
+	}
+	if (rsp->result == SD_RES_SUCCESS)
+		return;
+
+	/* the node doesn't support SD_OP_GET_HASHES, ask one by one */
+	for (int i = 0; i < batch->nr; i++) {
+		sd_init_req(&hdr, SD_OP_GET_HASH);
+		hdr.obj.oid = batch->hashes[i].oid;
+		hdr.obj.tgt_epoch = sd_epoch;
+
+		ret = dog_exec_req(&batch->node->nid, &hdr, NULL);
+		if (ret < 0)
+			exit(EXIT_SYSFAIL);
+		batch->hashes[i].result = rsp->result;
+		memcpy(batch->hashes[i].digest, rsp->hash.digest,
+		       sizeof(batch->hashes[i].digest));
+	}
+}
+
+static void check_batch_main(struct work *work)
+{
+	struct check_batch *batch = container_of(work, struct check_batch,
+						 work);
+
+	nr_check_inflight--;
+	for (int i = 0; i < batch->nr; i++) {
+		struct vdi_check_work *vcw = batch->vcw[i];
+		struct vdi_check_info *info = vcw->info;
+		struct sd_obj_hash *h = batch->hashes + i;
+
+		switch (h->result) {
+		case SD_RES_SUCCESS:
+			vcw->object_found = true;
+			memcpy(vcw->hash, h->digest, sizeof(vcw->hash));
+			break;
+		case SD_RES_NO_OBJ:
+			vcw->object_found = false;
+			break;
+		default:
+			sd_err("failed to read %016" PRIx64 " from %s, %s",
+			       h->oid, addr_to_str(batch->node->nid.addr,
+						   batch->node->nid.port),
+			       sd_strerror(h->result));
+			exit(EXIT_FAILURE);
+		}
+
+		if (--info->refcnt > 0)
+			continue;
+		vote_majority_object(info);
+		check_replicatoin_object(info);
+		if (info->refcnt == 0)
+			free_vdi_check_info(info);
+	}
+	free(batch);
+}
+
+static void queue_check_batch(struct check_node *cn, struct work_queue *wq)
+{
+	while (nr_check_inflight >= vdi_cmd_data.nr_inflight)
+		event_loop(-1);
+
+	nr_check_inflight++;
+	queue_work(wq, &cn->batch->work);
+	cn->batch = NULL;
+}
+
+static void queue_vdi_check_batch(const struct sd_inode *inode, uint64_t oid,
+				  uint64_t *done, struct work_queue *wq,
+				  int nr_copies)
+{
+	struct vdi_check_info *info;
+
+	info = alloc_vdi_check_info(inode, oid, done, wq, nr_copies);
+	for (int i = 0; i < nr_copies; i++) {
+		struct check_node key = { .node = info->vcw[i].vnode->node };
+		struct check_node *cn;
+		struct check_batch *batch;
+
+		cn = rb_search(&check_nodes, &key, rb, check_node_cmp);
+		if (!cn)
+			panic("rb_search() failure.");
+		if (!cn->batch) {
+			cn->batch = xmalloc(sizeof(*cn->batch));
+			cn->batch->node = cn->node;
+			cn->batch->nr = 0;
+			cn->batch->work.fn = check_batch_work;
+			cn->batch->work.done = check_batch_main;
+		}
+
+		batch = cn->batch;
+		batch->vcw[batch->nr] = &info->vcw[i];
+		memset(&batch->hashes[batch->nr], 0, sizeof(batch->hashes[0]));
+		batch->hashes[batch->nr].oid = oid;
+		if (++batch->nr == CHECK_BATCH_SIZE)
+			queue_check_batch(cn, wq);
+	}
+}
+
+static void init_check_nodes(void)
+{
+	struct sd_node *node;
+
+	rb_for_each_entry(node, &sd_nroot, rb) {
+		struct check_node *cn = xzalloc(sizeof(*cn));
+
+		cn->node = node;
+		rb_insert(&check_nodes, cn, rb, check_node_cmp);
+	}
+
+	if (!vdi_cmd_data.nr_inflight)
+		vdi_cmd_data.nr_inflight = sd_nodes_nr * 2;
+}
+
+/* Send the partially filled batches and wait for all of them */
+static void finish_check_nodes(struct work_queue *wq)
+{
+	struct check_node *cn;
+
+	rb_for_each_entry(cn, &check_nodes, rb) {
+		if (cn->batch)
+			queue_check_batch(cn, wq);
+	}
+	work_queue_wait(wq);
+	rb_destroy(&check_nodes, struct check_node, rb);
+	INIT_RB_ROOT(&check_nodes);
+}
+
+static void check_object(const struct sd_inode *inode, uint64_t oid,
+			 uint64_t *done, struct work_queue *wq, int nr_copies)
+{
+	if (inode->copy_policy)
+		queue_vdi_check_work(inode, oid, done, wq, nr_copies);
+	else
+		queue_vdi_check_batch(inode, oid, done, wq, nr_copies);
+}
+
 struct check_arg {
 	const struct sd_inode *inode;
 	uint64_t *done;
@@ -2233,8 +2833,8 @@ static void check_cb(struct sd_index *idx, void *arg, int ignore)
 		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
 		*(carg->done) = (uint64_t)idx->idx * object_size;
 		vdi_show_progress(*(carg->done), carg->inode->vdi_size);
-		queue_vdi_check_work(carg->inode, oid, NULL, carg->wq,
-				     carg->nr_copies);
+		check_object(carg->inode, oid, NULL, carg->wq,
+			     carg->nr_copies);
 	}
 }
 
@@ -2256,9 +2856,10 @@ int do_vdi_check(const struct sd_inode *inode)
 	wq = create_work_queue("vdi check", WQ_DYNAMIC);
 
 	init_fec();
+	if (!inode->copy_policy)
+		init_check_nodes();
 
-	queue_vdi_check_work(inode, vid_to_vdi_oid(inode->vdi_id), NULL, wq,
-			     nr_copies);
+	check_object(inode, vid_to_vdi_oid(inode->vdi_id), NULL, wq, nr_copies);
 
 	if (inode->store_policy == 0) {
 		max_idx = count_data_objs(inode);
@@ -2267,8 +2868,7 @@ int do_vdi_check(const struct sd_inode *inode)
 			vid = sd_inode_get_vid(inode, idx);
 			if (vid) {
 				oid = vid_to_data_oid(vid, idx);
-				queue_vdi_check_work(inode, oid, &done, wq,
-						     nr_copies);
+				check_object(inode, oid, &done, wq, nr_copies);
 			} else {
 				done += object_size;
 				vdi_show_progress(done, inode->vdi_size);
@@ -2280,6 +2880,8 @@ int do_vdi_check(const struct sd_inode *inode)
 		vdi_show_progress(inode->vdi_size, inode->vdi_size);
 	}
 
+	if (!inode->copy_policy)
+		finish_check_nodes(wq);
 	work_queue_wait(wq);
 
 	fprintf(stdout, "finish check&repair %s\n", inode->name);
@@ -2332,24 +2934,19 @@ struct obj_backup {
 static void compact_obj_backup(struct obj_backup *backup, uint8_t *from_data,
 			       uint32_t object_size)
 {
-	uint8_t *p1, *p2;
-
-	p1 = backup->data;
-	p2 = from_data;
-	while (backup->length > 0 && memcmp(p1, p2, SECTOR_SIZE) == 0) {
-		p1 += SECTOR_SIZE;
-		p2 += SECTOR_SIZE;
-		backup->offset += SECTOR_SIZE;
-		backup->length -= SECTOR_SIZE;
-	}
+	size_t head, tail;
+
+	/* the sectors before the first difference and after the last one */
+	head = round_down(find_mismatch(backup->data, from_data, object_size),
+			  SECTOR_SIZE);
+	backup->offset += head;
+	backup->length -= head;
+	if (!backup->length)
+		return;
 
-	p1 = backup->data + object_size - SECTOR_SIZE;
-	p2 = from_data + object_size - SECTOR_SIZE;
-	while (backup->length > 0 && memcmp(p1, p2, SECTOR_SIZE) == 0) {
-		p1 -= SECTOR_SIZE;
-		p2 -= SECTOR_SIZE;
-		backup->length -= SECTOR_SIZE;
-	}
+	tail = round_up(find_last_mismatch(backup->data, from_data,
+					   object_size), SECTOR_SIZE);
+	backup->length -= object_size - tail;
 }
 
 static int get_obj_backup(uint32_t idx, uint32_t from_vid, uint32_t to_vid,
@@ -2440,7 +3037,12 @@ static int vdi_backup(int argc, char **argv)
 		uint32_t from_vid = sd_inode_get_vid(from_inode, idx);
 		uint32_t to_vid = sd_inode_get_vid(to_inode, idx);
 
-		if (to_vid == 0 && from_vid == 0)
+		/*
+		 * Snapshots are read-only and any write to a shared object
+		 * allocates a new one, so an object which both snapshots
+		 * point to hasn't changed and doesn't need to be read.
+		 */
+		if (to_vid == from_vid)
 			continue;
 
 		ret = get_obj_backup(idx, from_vid, to_vid,
@@ -2515,6 +3117,72 @@ static int restore_obj(struct obj_backup *backup, uint32_t vid,
 				parent_inode->copy_policy, false, true);
 }
 
+/*
+ * Objects are restored by a work queue so that up to
+ * vdi_cmd_data.nr_inflight of them are written at a time.  Only the writes
+ * to the same object are serialized to keep the order of the stream.
+ */
+struct restore_work {
+	struct obj_backup backup;
+	uint32_t vid;
+	struct sd_inode *parent_inode;
+	int ret;
+	struct list_node list;
+	struct work work;
+};
+
+static LIST_HEAD(restore_inflight_list);
+static int nr_restore_inflight;
+static int restore_result = SD_RES_SUCCESS;
+
+static void restore_obj_work(struct work *work)
+{
+	struct restore_work *rw = container_of(work, struct restore_work, work);
+
+	rw->ret = restore_obj(&rw->backup, rw->vid, rw->parent_inode);
+}
+
+static void restore_obj_main(struct work *work)
+{
+	struct restore_work *rw = container_of(work, struct restore_work, work);
+
+	if (rw->ret != SD_RES_SUCCESS) {
+		sd_err("failed to restore object %"PRIu32", %s",
+		       rw->backup.idx, sd_strerror(rw->ret));
+		if (restore_result == SD_RES_SUCCESS)
+			restore_result = rw->ret;
+	}
+
+	list_del(&rw->list);
+	nr_restore_inflight--;
+	free(rw->backup.data);
+	free(rw);
+}
+
+static bool restore_obj_inflight(uint32_t idx)
+{
+	struct restore_work *rw;
+
+	list_for_each_entry(rw, &restore_inflight_list, list) {
+		if (rw->backup.idx == idx)
+			return true;
+	}
+	return false;
+}
+
+static void queue_restore_work(struct restore_work *rw, struct work_queue *wq)
+{
+	while (nr_restore_inflight >= vdi_cmd_data.nr_inflight ||
+	       restore_obj_inflight(rw->backup.idx))
+		event_loop(-1);
+
+	rw->work.fn = restore_obj_work;
+	rw->work.done = restore_obj_main;
+	list_add_tail(&rw->list, &restore_inflight_list);
+	nr_restore_inflight++;
+	queue_work(wq, &rw->work);
+}
+
 static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 {
 	int ret;
@@ -2523,6 +3191,7 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 	struct backup_hdr hdr;
 	struct obj_backup *backup = xzalloc(sizeof(*backup));
 	struct sd_inode *inode = xzalloc(sizeof(*inode));
+	struct work_queue *wq;
 
 	ret = xread(STDIN_FILENO, &hdr, sizeof(hdr));
 	if (ret != sizeof(hdr))
@@ -2541,16 +3210,21 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, inode->vdi_id, &vid,
 			    false, inode->nr_copies, inode->copy_policy,
-			    inode->store_policy, inode->block_size_shift);
+			    inode->store_policy, inode->block_size_shift,
+			    inode->flags);
 	if (ret != EXIT_SUCCESS) {
 		sd_err("Failed to read VDI");
 		goto out;
 	}
 
 	object_size = (UINT32_C(1) << inode->block_size_shift);
-	backup->data = xzalloc(sizeof(uint8_t) * object_size);
+	if (!vdi_cmd_data.nr_inflight)
+		vdi_cmd_data.nr_inflight = sd_nodes_nr * 2;
+	wq = create_work_queue("vdi restore", WQ_DYNAMIC);
+
+	while (restore_result == SD_RES_SUCCESS) {
+		struct restore_work *rw;
 
-	while (true) {
 		ret = xread(STDIN_FILENO, backup,
 			    sizeof(*backup) - sizeof(backup->data));
 		if (ret != sizeof(*backup) - sizeof(backup->data)) {
@@ -2564,24 +3238,38 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 			break;
 		}
 
-		ret = xread(STDIN_FILENO, backup->data, backup->length);
-		if (ret != backup->length) {
-			sd_err("failed to read backup data");
+		if (backup->offset + backup->length > object_size) {
+			sd_err("The backup file is corrupted");
 			ret = EXIT_SYSFAIL;
 			break;
 		}
 
-		ret = restore_obj(backup, vid, inode);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("failed to restore backup");
-			do_vdi_delete(vdiname, 0, NULL,
-				      vdi_cmd_data.nr_batched_reclamation,
-				      vdi_cmd_data.reclamation_interval);
-			ret = EXIT_FAILURE;
+		rw = xzalloc(sizeof(*rw));
+		rw->backup = *backup;
+		rw->backup.data = xmalloc(backup->length);
+		rw->vid = vid;
+		rw->parent_inode = inode;
+
+		ret = xread(STDIN_FILENO, rw->backup.data, backup->length);
+		if (ret != backup->length) {
+			sd_err("failed to read backup data");
+			free(rw->backup.data);
+			free(rw);
+			ret = EXIT_SYSFAIL;
 			break;
 		}
+
+		queue_restore_work(rw, wq);
+	}
+	work_queue_wait(wq);
+
+	if (restore_result != SD_RES_SUCCESS) {
+		sd_err("failed to restore backup");
+		do_vdi_delete(vdiname, 0, NULL,
+			      vdi_cmd_data.nr_batched_reclamation,
+			      vdi_cmd_data.reclamation_interval);
+		ret = EXIT_FAILURE;
 	}
-	free(backup->data);
 out:
 	free(backup);
 	free(inode);
@@ -2659,7 +3347,8 @@ out:
 					     true, current_inode->nr_copies,
 					     current_inode->copy_policy,
 					     current_inode->store_policy,
-					     current_inode->block_size_shift);
+					     current_inode->block_size_shift,
+					     current_inode->flags);
 		if (recovery_ret != EXIT_SUCCESS) {
 			sd_err("failed to resume the current vdi");
 			ret = recovery_ret;
@@ -2703,6 +3392,7 @@ static int vdi_object_dump_inode(int argc, char **argv)
 	printf("vdi_id: %"PRIx32"\n", inode->vdi_id);
 	printf("parent_vdi_id: %"PRIx32"\n", inode->parent_vdi_id);
 	printf("btree_counter: %"PRIu32"\n", inode->btree_counter);
+	printf("flags: %"PRIx32"\n", inode->flags);
 
 	printf("data_vdi_id:\n");
 	for (int i = 0; i < SD_INODE_DATA_INDEX; i++) {
@@ -2736,7 +3426,7 @@ static struct subcommand vdi_object_cmd[] = {
 	{"location", NULL, NULL, "show object location information",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG, vdi_object_location},
 	{"map", NULL, NULL, "show object map information",
-	 NULL, CMD_NEED_ARG, vdi_object_map},
+	 NULL, CMD_NEED_NODELIST|CMD_NEED_ARG, vdi_object_map},
 	{"dump-inode", NULL, NULL, "dump inode information",
 	 NULL, CMD_NEED_ARG, vdi_object_dump_inode},
 	{NULL},
@@ -2864,6 +3554,94 @@ static int vdi_alter_copy(int argc, char **argv)
 	return EXIT_FAILURE;
 }
 
+/*
+ * The vdi is snapshotted with SD_CONVERT_TAG and its new working vdi gets the
+ * erasure code at once.  The gateway then copies the objects of the snapshot
+ * into it in the background and deletes the snapshot, see vdi_convert() of
+ * the sheep.  Running it again resumes a conversion which stopped.
+ */
+static int vdi_convert(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	char tag[SD_MAX_VDI_TAG_LEN] = {};
+	struct sd_inode *inode;
+	uint32_t vid, new_vid;
+	struct sd_req hdr;
+	int ret;
+
+	if (!vdi_cmd_data.copy_policy) {
+		sd_err("Please specify the erasure code with -c, e.g. -c 4:2");
+		return EXIT_USAGE;
+	}
+
+	/* only the header is read, but it's accessed as a whole inode */
+	inode = xzalloc(sizeof(*inode));
+	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_HEADER_SIZE);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	if (inode->store_policy) {
+		sd_err("converting a hypervolume is not supported");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (inode->copy_policy == vdi_cmd_data.copy_policy) {
+		new_vid = vid;
+		goto convert;
+	}
+	if (inode->copy_policy) {
+		sd_err("%s is erasure coded already", vdiname);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (!vdi_cmd_data.force && vdi_cmd_data.nr_copies > sd_nodes_nr) {
+		char info[1024];
+
+		snprintf(info, sizeof(info), "Number of copies (%d) is larger "
+			 "than number of nodes (%d).\n"
+			 "Are you sure you want to continue? [yes/no]: ",
+			 vdi_cmd_data.nr_copies, sd_nodes_nr);
+		confirm(info);
+	}
+
+	pstrcpy(tag, sizeof(tag), SD_CONVERT_TAG);
+	ret = dog_write_object(vid_to_vdi_oid(vid), 0, tag, sizeof(tag),
+			       offsetof(struct sd_inode, tag), 0,
+			       inode->nr_copies, inode->copy_policy, false,
+			       false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to snapshot %s", vdiname);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	ret = do_vdi_create(vdiname, inode->vdi_size, vid, &new_vid, true,
+			    vdi_cmd_data.nr_copies, vdi_cmd_data.copy_policy,
+			    inode->store_policy, inode->block_size_shift,
+			    inode->flags);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+convert:
+	sd_init_req(&hdr, SD_OP_CONVERT_VDI);
+	hdr.convert.oid = vid_to_vdi_oid(new_vid);
+	hdr.convert.rate = vdi_cmd_data.convert_rate;
+	if (send_light_req(&sd_nid, &hdr)) {
+		sd_err("Failed to start converting %s", vdiname);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	if (verbose)
+		printf("converting %s to %s, new VID %x\n", vdiname,
+		       ec_policy_to_str(vdi_cmd_data.copy_policy), new_vid);
+	ret = EXIT_SUCCESS;
+out:
+	free(inode);
+	return ret;
+}
+
 static int lock_list(int argc, char **argv)
 {
 	int ret = 0;
@@ -2982,17 +3760,211 @@ static int vdi_lock(int argc, char **argv)
 	return do_generic_subcommand(vdi_lock_cmd, argc, argv);
 }
 
+struct vdi_top_name {
+	uint32_t vid;
+	char name[SD_MAX_VDI_LEN + 16];	/* with the snapshot id */
+};
+
+struct vdi_top_names {
+	struct vdi_top_name *names;
+	int nr;
+};
+
+static int vdi_top_name_cmp(const struct vdi_top_name *a,
+			    const struct vdi_top_name *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static int vdi_io_stat_cmp(const struct sd_vdi_io_stat *a,
+			   const struct sd_vdi_io_stat *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static void collect_vdi_top_name(const struct sd_inode_summary *i, void *data)
+{
+	struct vdi_top_names *names = data;
+	struct vdi_top_name *n;
+
+	names->names = xrealloc(names->names,
+				sizeof(*n) * (names->nr + 1));
+	n = names->names + names->nr++;
+	n->vid = i->vdi_id;
+	if (i->snap_ctime)
+		snprintf(n->name, sizeof(n->name), "%s@%"PRIu32, i->name,
+			 i->snap_id);
+	else
+		pstrcpy(n->name, sizeof(n->name), i->name);
+}
+
+static const char *vdi_top_name(struct vdi_top_names *names, uint32_t vid)
+{
+	struct vdi_top_name key = { .vid = vid }, *n;
+
+	n = xbsearch(&key, names->names, names->nr, vdi_top_name_cmp);
+	if (n)
+		return n->name;
+
+	/* a vdi created since the last lookup */
+	free(names->names);
+	names->names = NULL;
+	names->nr = 0;
+	parse_vdi_summary(collect_vdi_top_name, false, names);
+	xqsort(names->names, names->nr, vdi_top_name_cmp);
+	n = xbsearch(&key, names->names, names->nr, vdi_top_name_cmp);
+
+	return n ? n->name : "-";
+}
+
+/*
+ * Sum the I/O of the vdis through the gateways of all the nodes, sorted by
+ * vid.  Returns the number of the vdis.
+ */
+static int collect_vdi_io(struct sd_vdi_io_stat **ret)
+{
+	size_t len = sizeof(struct sd_stat) +
+		sizeof(struct sd_vdi_io_stat) * SD_MAX_VDI_IO_STATS;
+	char *buf = xmalloc(len);
+	struct sd_vdi_io_stat *all = NULL, *st;
+	struct sd_node *n;
+	int nr_all = 0, nr, i, j;
+
+	rb_for_each_entry(n, &sd_nroot, rb) {
+		struct sd_req hdr;
+		struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+		size_t rlen;
+
+		sd_init_req(&hdr, SD_OP_STAT);
+		hdr.data_length = len;
+		hdr.stat.flags = SD_STAT_VDI;
+		if (dog_exec_req(&n->nid, &hdr, buf) < 0 ||
+		    rsp->result != SD_RES_SUCCESS)
+			continue;
+
+		/* old sheep doesn't know SD_STAT_VDI and reports the sockfds */
+		rlen = rsp->data_length - sizeof(struct sd_stat);
+		if (rsp->data_length < sizeof(struct sd_stat) ||
+		    rlen % sizeof(*st))
+			continue;
+		nr = rlen / sizeof(*st);
+		st = (struct sd_vdi_io_stat *)(buf + sizeof(struct sd_stat));
+
+		all = xrealloc(all, sizeof(*all) * (nr_all + nr));
+		memcpy(all + nr_all, st, sizeof(*st) * nr);
+		nr_all += nr;
+	}
+	free(buf);
+
+	xqsort(all, nr_all, vdi_io_stat_cmp);
+	for (i = 0, j = 0; i < nr_all; i++) {
+		if (j && all[j - 1].vid == all[i].vid) {
+			all[j - 1].nr_read += all[i].nr_read;
+			all[j - 1].nr_write += all[i].nr_write;
+			all[j - 1].read_bytes += all[i].read_bytes;
+			all[j - 1].write_bytes += all[i].write_bytes;
+			all[j - 1].read_latency += all[i].read_latency;
+			all[j - 1].write_latency += all[i].write_latency;
+		} else
+			all[j++] = all[i];
+	}
+
+	*ret = all;
+	return j;
+}
+
+/* the busiest first */
+static int vdi_top_load_cmp(const struct sd_vdi_io_stat *a,
+			    const struct sd_vdi_io_stat *b)
+{
+	return intcmp(b->nr_read + b->nr_write, a->nr_read + a->nr_write);
+}
+
+static void print_vdi_top(struct vdi_top_names *names,
+			  const struct sd_vdi_io_stat *cur, int nr_cur,
+			  const struct sd_vdi_io_stat *last, int nr_last)
+{
+	struct sd_vdi_io_stat *delta = xcalloc(nr_cur, sizeof(*delta));
+	int nr = 0;
+
+	for (int i = 0; i < nr_cur; i++) {
+		const struct sd_vdi_io_stat *l;
+		struct sd_vdi_io_stat *d = delta + nr;
+
+		*d = cur[i];
+		l = xbsearch(cur + i, last, nr_last, vdi_io_stat_cmp);
+		if (l) {
+			/* the counters restart with the sheep */
+			if (l->nr_read > d->nr_read ||
+			    l->nr_write > d->nr_write)
+				continue;
+			d->nr_read -= l->nr_read;
+			d->nr_write -= l->nr_write;
+			d->read_bytes -= l->read_bytes;
+			d->write_bytes -= l->write_bytes;
+			d->read_latency -= l->read_latency;
+			d->write_latency -= l->write_latency;
+		}
+		if (d->nr_read || d->nr_write)
+			nr++;
+	}
+	xqsort(delta, nr, vdi_top_load_cmp);
+
+	if (!raw_output)
+		printf("\033[H\033[2J  Name                VDI id      RD/s"
+		       "      WR/s      RDBW      WRBW  RD lat(us)"
+		       "  WR lat(us)\n");
+	for (int i = 0; i < min(nr, vdi_cmd_data.nr_top); i++) {
+		const struct sd_vdi_io_stat *d = delta + i;
+
+		printf(raw_output ? "%s %"PRIx32" %"PRIu64" %"PRIu64
+		       " %s %s %"PRIu64" %"PRIu64"\n" :
+		       "  %-18s %8"PRIx32" %9"PRIu64" %9"PRIu64" %9s %9s"
+		       " %11"PRIu64" %11"PRIu64"\n",
+		       vdi_top_name(names, d->vid), d->vid, d->nr_read,
+		       d->nr_write, strnumber(d->read_bytes),
+		       strnumber(d->write_bytes),
+		       d->nr_read ? d->read_latency / d->nr_read : 0,
+		       d->nr_write ? d->write_latency / d->nr_write : 0);
+	}
+	fflush(stdout);
+	free(delta);
+}
+
+static int vdi_top(int argc, char **argv)
+{
+	struct vdi_top_names names = {};
+	struct sd_vdi_io_stat *cur, *last;
+	int nr_cur, nr_last;
+
+	nr_last = collect_vdi_io(&last);
+	for (int i = 0; !vdi_cmd_data.nr_updates ||
+		     i < vdi_cmd_data.nr_updates; i++) {
+		sleep(1);
+		nr_cur = collect_vdi_io(&cur);
+		print_vdi_top(&names, cur, nr_cur, last, nr_last);
+		free(last);
+		last = cur;
+		nr_last = nr_cur;
+	}
+	free(last);
+	free(names.names);
+
+	return EXIT_SUCCESS;
+}
+
 static struct subcommand vdi_cmd[] = {
-	{"check", "<vdiname>", "seaphT", "check and repair image's consistency",
+	{"check", "<vdiname>", "seaphTLk",
+	 "check and repair image's consistency",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_check, vdi_options},
-	{"create", "<vdiname> <size>", "PycaphrvzT", "create an image",
+	{"create", "<vdiname> <size>", "PycaphrvzCQT", "create an image",
 	 NULL, CMD_NEED_NODELIST|CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_create, vdi_options},
 	{"snapshot", "<vdiname>", "saphrvTR", "create a snapshot",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_snapshot, vdi_options},
-	{"clone", "<src vdi> <dst vdi>", "sPnaphrvT", "clone an image",
+	{"clone", "<src vdi> <dst vdi>", "sPnlaphrvT", "clone an image",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_clone, vdi_options},
 	{"delete", "<vdiname>", "saphTBIm", "delete an image",
@@ -3007,7 +3979,7 @@ static struct subcommand vdi_cmd[] = {
 	 NULL, 0, vdi_tree, vdi_options},
 	{"graph", NULL, "aphT", "show images in Graphviz dot format",
 	 NULL, 0, vdi_graph, vdi_options},
-	{"object", "<vdiname>", "isaphT",
+	{"object", "<vdiname>", "isaphAT",
 	 "show object information in the image",
 	 vdi_object_cmd, CMD_NEED_ARG,
 	 vdi_object, vdi_options},
@@ -3024,24 +3996,31 @@ static struct subcommand vdi_cmd[] = {
 	{"resize", "<vdiname> <new size>", "aphT", "resize an image",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG,
 	 vdi_resize, vdi_options},
-	{"read", "<vdiname> [<offset> [<len>]]", "saphT",
+	{"read", "<vdiname> [<offset> [<len>]]", "saphTL",
 	 "read data from an image",
-	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG,
+	 NULL, CMD_NEED_ROOT|CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_read, vdi_options},
-	{"write", "<vdiname> [<offset> [<len>]]", "apwhT",
+	{"write", "<vdiname> [<offset> [<len>]]", "apwhTL",
 	 "write data to an image",
-	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG,
+	 NULL, CMD_NEED_ROOT|CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_write, vdi_options},
 	{"backup", "<vdiname>", "sFaphT",
 	 "create an incremental backup between two snapshots and outputs to STDOUT",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_backup, vdi_options},
-	{"restore", "<vdiname>", "saphTBI",
+	{"restore", "<vdiname>", "saphTBIL",
 	 "restore snapshot images from a backup provided in STDIN",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_NODELIST|CMD_NEED_ARG,
 	 vdi_restore, vdi_options},
 	{"alter-copy", "<vdiname>", "caphTf", "set the vdi's redundancy level",
 	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG|CMD_NEED_NODELIST, vdi_alter_copy, vdi_options},
+	{"convert", "<vdiname>", "cbaphTf",
+	 "convert a replicated vdi to erasure coding in the background",
+	 NULL, CMD_NEED_ROOT|CMD_NEED_ARG|CMD_NEED_NODELIST, vdi_convert,
+	 vdi_options},
+	{"top", NULL, "tNaprhT",
+	 "show the vdis with the most I/O per second, refreshed every second",
+	 NULL, CMD_NEED_NODELIST, vdi_top, vdi_options},
 	{"lock", NULL, "saphT", "See 'dog vdi lock' for more information",
 	 vdi_lock_cmd, CMD_NEED_ROOT|CMD_NEED_ARG, vdi_lock, vdi_options},
 	{NULL,},
@@ -3051,6 +4030,7 @@ static int vdi_parser(int ch, const char *opt)
 {
 	char *p;
 	uint8_t block_size_shift;
+	long quorum;
 
 	switch (ch) {
 	case 'P':
@@ -3059,6 +4039,9 @@ static int vdi_parser(int ch, const char *opt)
 	case 'n':
 		vdi_cmd_data.no_share = true;
 		break;
+	case 'l':
+		vdi_cmd_data.lazy = true;
+		break;
 	case 'i':
 		if (strncmp(opt, "0x", 2) == 0)
 			vdi_cmd_data.index = strtol(opt, &p, 16);
@@ -3100,7 +4083,11 @@ static int vdi_parser(int ch, const char *opt)
 			       "  x(1 to %d)   - number of replicated copies\n"
 			       "To create erasure coded vdi, set -c x:y\n"
 			       "  x(2,4,8,16)  - number of data strips\n"
-			       "  y(1 to 15)   - number of parity strips",
+			       "  y(1 to 15)   - number of parity strips\n"
+			       "To create LRC coded vdi, set -c x:y:z\n"
+			       "  x(4,8,16)    - number of data strips\n"
+			       "  y(1 to 3)    - number of global parity strips\n"
+			       "  z(1,2,4,8)   - number of local groups, up to x/2",
 			       opt, SD_MAX_COPIES);
 			exit(EXIT_FAILURE);
 		}
@@ -3123,6 +4110,19 @@ static int vdi_parser(int ch, const char *opt)
 			exit(EXIT_FAILURE);
 		}
 		break;
+	case 'C':
+		vdi_cmd_data.compress = true;
+		break;
+	case 'Q':
+		quorum = strtol(opt, &p, 10);
+		if (opt == p || *p != '\0' || quorum < 1 ||
+		    quorum > SD_MAX_COPIES) {
+			sd_err("Invalid write quorum %s, must be 1 to %d", opt,
+			       SD_MAX_COPIES);
+			exit(EXIT_FAILURE);
+		}
+		vdi_cmd_data.write_quorum = quorum;
+		break;
 	case 'o':
 		vdi_cmd_data.oid = strtoull(opt, &p, 16);
 		if (opt == p) {
@@ -3133,6 +4133,12 @@ static int vdi_parser(int ch, const char *opt)
 	case 'e':
 		vdi_cmd_data.exist = true;
 		break;
+	case 'A':
+		vdi_cmd_data.all = true;
+		break;
+	case 'k':
+		vdi_cmd_data.crc = true;
+		break;
 	case 'z':
 		block_size_shift = (uint8_t)atoi(opt);
 		if (block_size_shift > 31) {
@@ -3192,6 +4198,37 @@ static int vdi_parser(int ch, const char *opt)
 			exit(EXIT_FAILURE);
 		}
 		break;
+	case 'L':
+		vdi_cmd_data.nr_inflight = strtol(opt, &p, 10);
+		if (opt == p || vdi_cmd_data.nr_inflight <= 0) {
+			sd_err("The maximum number of in-flight requests must"
+			       " be a positive integer: %s", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 't':
+		vdi_cmd_data.nr_top = strtol(opt, &p, 10);
+		if (opt == p || *p != '\0' || vdi_cmd_data.nr_top < 1) {
+			sd_err("The number of vdis must be positive: %s", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 'N':
+		vdi_cmd_data.nr_updates = strtol(opt, &p, 10);
+		if (opt == p || *p != '\0' || vdi_cmd_data.nr_updates < 1) {
+			sd_err("The number of updates must be positive: %s",
+			       opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 'b':
+		vdi_cmd_data.convert_rate = strtoul(opt, &p, 10);
+		if (opt == p || *p != '\0' || !vdi_cmd_data.convert_rate) {
+			sd_err("The bandwidth must be a positive number of "
+			       "MB/s: %s", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
 	}
 
 	return 0;
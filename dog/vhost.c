@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dog.h"
+
+static int vhost_lookup_vdi(const char *name, uint32_t *vid)
+{
+	char buf[SD_MAX_VDI_LEN + SD_MAX_VDI_TAG_LEN] = {};
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	pstrcpy(buf, SD_MAX_VDI_LEN, name);
+	sd_init_req(&hdr, SD_OP_GET_VDI_INFO);
+	hdr.data_length = sizeof(buf);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+
+	ret = dog_exec_req(&sd_nid, &hdr, buf);
+	if (ret < 0)
+		return SD_RES_EIO;
+
+	if (rsp->result == SD_RES_SUCCESS)
+		*vid = rsp->vdi.vdi_id;
+
+	return rsp->result;
+}
+
+static int vhost_create_delete(char *name, bool create)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint32_t vid = 0;
+	int ret;
+
+	if (create) {
+		ret = vhost_lookup_vdi(name, &vid);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to find vdi %s, %s", name,
+			       sd_strerror(ret));
+			return EXIT_MISSING;
+		}
+		sd_init_req(&hdr, SD_OP_VHOST_CREATE);
+	} else
+		sd_init_req(&hdr, SD_OP_VHOST_DELETE);
+
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = strlen(name) + 1;
+	hdr.vdi.base_vdi_id = vid;
+	ret = dog_exec_req(&sd_nid, &hdr, name);
+	if (ret < 0)
+		return EXIT_SYSFAIL;
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		sd_err("failed to %s vhost %s, %s",
+		       create ? "create" : "delete", name,
+		       sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int vhost_create(int argc, char **argv)
+{
+	return vhost_create_delete(argv[optind], true);
+}
+
+static int vhost_delete(int argc, char **argv)
+{
+	return vhost_create_delete(argv[optind], false);
+}
+
+static int vhost_parser(int ch, const char *opt)
+{
+	return 0;
+}
+
+static struct subcommand vhost_cmd[] = {
+	{"create", "<vdiname>", "aph",
+	 "serve a vdi to the local QEMU with vhost-user-blk", NULL,
+	 CMD_NEED_ARG, vhost_create},
+	{"delete", "<vdiname>", "aph", "stop serving a vdi with vhost-user-blk",
+	 NULL, CMD_NEED_ARG, vhost_delete},
+	{NULL},
+};
+
+struct command vhost_command = {
+	"vhost",
+	vhost_cmd,
+	vhost_parser,
+};
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * The buffers of a short-lived task, all freed at once by arena_destroy().
+ * A zeroed struct arena is an empty one.
+ */
+struct arena {
+	struct arena_chunk *chunks;
+	char *pos, *end;	/* the free room of the current chunk */
+};
+
+#define ARENA_INIT { NULL, NULL, NULL }
+
+void *arena_alloc(struct arena *a, size_t len);
+void *arena_zalloc(struct arena *a, size_t len);
+void arena_destroy(struct arena *a);
+
+#endif /* __ARENA_H__ */
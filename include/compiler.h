@@ -18,6 +18,7 @@
 #include <time.h>
 #include <signal.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "config.h"
 
@@ -72,6 +73,7 @@ static inline int signalfd(int __fd, const sigset_t *__mask, int __flags)
 #else
 #define EFD_SEMAPHORE	(1)
 #define EFD_NONBLOCK	(04000)
+#define EFD_CLOEXEC	(02000000)
 #define eventfd_t	uint64_t
 static inline int eventfd_write(int fd, eventfd_t value)
 {
@@ -95,6 +97,7 @@ static inline int eventfd(unsigned int initval, int flags)
 #include <sys/timerfd.h>
 #else
 #define TFD_NONBLOCK (04000)
+#define TFD_TIMER_ABSTIME (1 << 0)
 static inline int timerfd_create(clockid_t __clock_id, int __flags)
 {
 	return syscall(__NR_timerfd_create, __clock_id, __flags);
@@ -117,8 +120,11 @@ static inline int fallocate(int fd, int mode, __off_t offset, __off_t len)
 #ifdef __x86_64__
 
 #define X86_FEATURE_SSSE3	(4 * 32 + 9) /* Supplemental SSE-3 */
+#define X86_FEATURE_XMM4_2	(4 * 32 + 20) /* "sse4_2" SSE-4.2 */
 #define X86_FEATURE_OSXSAVE	(4 * 32 + 27) /* "" XSAVE enabled in the OS */
 #define X86_FEATURE_AVX	(4 * 32 + 28) /* Advanced Vector Extensions */
+#define X86_FEATURE_AVX2	(9 * 32 + 5) /* AVX2 instructions */
+#define X86_FEATURE_SHA_NI	(9 * 32 + 29) /* SHA extensions */
 
 #define XSTATE_FP	0x1
 #define XSTATE_SSE	0x2
@@ -152,14 +158,46 @@ static inline uint64_t xgetbv(uint32_t idx)
 }
 
 #define cpu_has_ssse3           cpu_has(X86_FEATURE_SSSE3)
+#define cpu_has_sse4_2		cpu_has(X86_FEATURE_XMM4_2)
 #define cpu_has_avx		cpu_has(X86_FEATURE_AVX)
 #define cpu_has_osxsave		cpu_has(X86_FEATURE_OSXSAVE)
+#define cpu_has_avx2		cpu_has(X86_FEATURE_AVX2)
+#define cpu_has_sha_ni		cpu_has(X86_FEATURE_SHA_NI)
+
+/* whether the OS saves the YMM registers, which AVX and AVX2 need */
+static inline bool avx_usable(void)
+{
+	uint64_t xcr0;
+
+	if (!cpu_has_avx || !cpu_has_osxsave)
+		return false;
+
+	xcr0 = xgetbv(XCR_XFEATURE_ENABLED_MASK);
+	if ((xcr0 & (XSTATE_SSE | XSTATE_YMM)) != (XSTATE_SSE | XSTATE_YMM))
+		return false;
+
+	return true;
+}
+
+/* hint for the busy-wait loops */
+static inline void cpu_relax(void)
+{
+	asm volatile("pause" ::: "memory");
+}
 
 #else  /* __x86_64__ */
 
 #define cpu_has_ssse3   0
+#define cpu_has_sse4_2  0
 #define cpu_has_avx     0
 #define cpu_has_osxsave 0
+#define cpu_has_avx2    0
+#define cpu_has_sha_ni  0
+
+static inline void cpu_relax(void)
+{
+	asm volatile("" ::: "memory");
+}
 
 #endif /* __x86_64__ */
 
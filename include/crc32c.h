@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI and ext4.  Pass the result of the
+ * previous call as 'crc' to checksum discontiguous buffers, starting from 0.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+/* the CRC32C of two buffers from theirs, len2 being the length of the second */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "list.h"
 #include <limits.h>
+#include <stdint.h>
+#include <sys/epoll.h>
 
 struct event_info;
 
@@ -15,13 +17,23 @@ int modify_event(int fd, unsigned int events);
 void event_loop(int timeout);
 void event_loop_prio(int timeout);
 void event_force_refresh(void);
+void set_busy_poll(unsigned int usec);
+unsigned int get_busy_poll(void);
+int event_wait(int epfd, struct epoll_event *evs, int maxevents,
+	       int timeout);
 
 struct timer {
 	void (*callback)(void *);
 	void *data;
+
+	/* used by the timer wheel */
+	struct list_node list;
+	uint64_t expires;
+	int level;
 };
 
 void add_timer(struct timer *t, unsigned int mseconds);
+void del_timer(struct timer *t);
 
 #define EVENT_PRIO_MAX     INT_MAX
 #define EVENT_PRIO_DEFAULT 0
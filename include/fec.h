@@ -70,6 +70,7 @@
 struct fec {
 	unsigned long magic;
 	unsigned short d, dp;                     /* parameters of the code */
+	unsigned short nr_local;                  /* local groups of LRC */
 	uint8_t *enc_matrix;
 	unsigned char *ec_tbl;                    /* for isa-l */
 };
@@ -80,6 +81,12 @@ void init_fec(void);
  * param dp the total number of blocks created
  */
 struct fec *fec_new(unsigned short d, unsigned short dp);
+/*
+ * param d the number of data blocks
+ * param g the number of global parity blocks
+ * param l the number of local groups, each with one XOR parity block
+ */
+struct fec *lrc_new(unsigned short d, unsigned short g, unsigned short l);
 void fec_free(struct fec *p);
 
 /*
@@ -106,6 +113,13 @@ void isa_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 		       char *buf, int idx, uint32_t object_size);
 #endif
 
+void lrc_encode_local(struct fec *ctx, const uint8_t *ds[], uint8_t *ls[],
+		      size_t len);
+int ec_repair_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
+		     int nr, char *buf, int idx, uint32_t object_size);
+int ec_repair_set(const struct fec *ctx, int idx, const bool lost[],
+		  int set[]);
+
 /*
  * @param inpkts an array of packets (size k); If a primary block, i, is present
  * then it must be at index i. Secondary blocks can appear anywhere.
@@ -124,22 +138,59 @@ void fec_decode(const struct fec *code,
 #define SD_EC_DATA_STRIPE_SIZE (512) /* 512 Byte */
 #define SD_EC_MAX_STRIP (16)
 
+/*
+ * The policy of the locally repairable codes (LRC) d:g:l has both top bits
+ * set, which no d:p policy has, then log2(d / 4) in the bits 4-5, g in the
+ * bits 2-3 and log2(l) in the bits 0-1.  The d data strips are split into l
+ * local groups, each protected by the XOR of its strips, and the g global
+ * parities of Reed-Solomon cover all of them.  A strip lost in a group is
+ * rebuilt from the d / l other strips of the group instead of d strips.
+ */
+#define SD_EC_LRC_MASK 0b11000000
+
+static inline bool ec_policy_is_lrc(uint8_t policy)
+{
+	return (policy & SD_EC_LRC_MASK) == SD_EC_LRC_MASK;
+}
+
+static inline uint8_t ec_lrc_policy(int d, int g, int l)
+{
+	return SD_EC_LRC_MASK | (__builtin_ctz(d / 4) << 4) | (g << 2) |
+		__builtin_ctz(l);
+}
+
+static inline void ec_policy_to_lrc(uint8_t policy, int *d, int *g, int *l)
+{
+	*d = 4 << ((policy >> 4) & 0b11);
+	*g = (policy >> 2) & 0b11;
+	*l = 1 << (policy & 0b11);
+}
+
+/* For LRC, 'p' is the number of the global and the local parities */
 static inline int ec_policy_to_dp(uint8_t policy, int *d, int *p)
 {
 	int ed = 0, ep = 0;
 
-	ep = policy & 0b1111;
-	ed = policy >> 4;
+	if (ec_policy_is_lrc(policy)) {
+		int g, l;
+
+		ec_policy_to_lrc(policy, &ed, &g, &l);
+		ep = g + l;
+		goto out;
+	}
 
+	ep = policy & 0b1111;
+	ed = (policy >> 4) * 2;
+out:
 	if (unlikely(!ep))
 		panic("invalid policy %d", policy);
 
 	if (d)
-		*d = ed * 2;
+		*d = ed;
 	if (p)
 		*p = ep;
 
-	return ed * 2 + ep;
+	return ed + ep;
 }
 
 /*
@@ -164,14 +215,33 @@ static inline struct fec *ec_init(int d, int dp)
 	return fec_new(d, dp);
 }
 
+static inline struct fec *ec_init_policy(uint8_t policy)
+{
+	int d, g, l;
+
+	if (!ec_policy_is_lrc(policy)) {
+		int dp = ec_policy_to_dp(policy, &d, NULL);
+
+		return ec_init(d, dp);
+	}
+
+	ec_policy_to_lrc(policy, &d, &g, &l);
+	return lrc_new(d, g, l);
+}
+
 /*
- * This function decodes the data strips and return the parity strips
+ * This function encodes 'len' bytes of each data strip buffer at once
  *
- * @ds: data strips to generate parity strips
- * @ps: parity strips to return
+ * The buffers hold the strips of consecutive stripes back to back, as they are
+ * stored in the erasure objects, so a whole request can be encoded with one
+ * call.  isa-l picks the SSE, AVX or AVX2 kernels by CPUID at the first call.
+ *
+ * @ds: data strip buffers to generate parity strip buffers
+ * @ps: parity strip buffers to return, the local parities of LRC follow the
+ *      global ones
  */
-static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
-			     uint8_t *ps[])
+static inline void ec_encode_buffer(struct fec *ctx, const uint8_t *ds[],
+				    uint8_t *ps[], size_t len)
 {
 	int p = ctx->dp - ctx->d;
 
@@ -183,12 +253,25 @@ static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
 #endif
 
 #if defined __x86_64__ && defined(ENABLE_ISAL)
-		ec_encode_data(SD_EC_DATA_STRIPE_SIZE / ctx->d, ctx->d, p,
-				   ctx->ec_tbl, (unsigned char **)ds, ps);
+		ec_encode_data(len, ctx->d, p, ctx->ec_tbl,
+			       (unsigned char **)ds, ps);
 #else
-		fec_encode(ctx, ds, ps, pidx, p, SD_EC_DATA_STRIPE_SIZE /
-			   ctx->d);
+		fec_encode(ctx, ds, ps, pidx, p, len);
 #endif
+	if (ctx->nr_local)
+		lrc_encode_local(ctx, ds, ps + p, len);
+}
+
+/*
+ * This function decodes the data strips and return the parity strips
+ *
+ * @ds: data strips to generate parity strips
+ * @ps: parity strips to return
+ */
+static inline void ec_encode(struct fec *ctx, const uint8_t *ds[],
+			     uint8_t *ps[])
+{
+	ec_encode_buffer(ctx, ds, ps, SD_EC_DATA_STRIPE_SIZE / ctx->d);
 }
 
 /*
@@ -210,14 +293,12 @@ static inline void ec_destroy(struct fec *ctx)
 	fec_free(ctx);
 }
 
-static inline void ec_decode_buffer(struct fec *ctx, uint8_t *input[],
-				    const int in_idx[], char *buf,
-				    int idx, uint32_t object_size)
+/* Rebuild the strip 'idx' from 'd' strips of the stripe */
+static inline int ec_decode_buffer(struct fec *ctx, uint8_t *input[],
+				   const int in_idx[], char *buf,
+				   int idx, uint32_t object_size)
 {
-#if defined __x86_64__ && defined(ENABLE_ISAL)
-		isa_decode_buffer(ctx, input, in_idx, buf, idx, object_size);
-#else
-		fec_decode_buffer(ctx, input, in_idx, buf, idx, object_size);
-#endif
+	return ec_repair_buffer(ctx, input, in_idx, ctx->d, buf, idx,
+				object_size);
 }
 #endif
@@ -24,7 +24,7 @@
 #include "rbtree.h"
 #include "fec.h"
 
-#define SD_SHEEP_PROTO_VER 0x0a
+#define SD_SHEEP_PROTO_VER 0x0e
 
 #define SD_DEFAULT_COPIES 3
 /*
@@ -44,6 +44,12 @@
  */
 #define SD_DEFAULT_VNODES 128
 
+/*
+ * SD_OP_GET_BLOCK_HASH returns the SHA1 digest of each SD_HASH_BLOCK_SIZE
+ * bytes of the object, so that recovery can copy only the changed blocks
+ */
+#define SD_HASH_BLOCK_SIZE (UINT32_C(1) << 16)
+
 /*
  * Operations with opcodes above 0x80 are considered part of the inter-sheep
  * include sheep-dog protocol and are versioned using SD_SHEEP_PROTO_VER
@@ -115,6 +121,33 @@
 #define SD_OP_SET_RECOVERY      0xCB
 #define SD_OP_SET_VNODES 0xCC
 #define SD_OP_GET_VNODES 0xCD
+#define SD_OP_READ_PEERS	0xCF
+#define SD_OP_WRITE_PEER_BATCH	0xD0
+#define SD_OP_GET_BLOCK_HASH	0xD1
+#define SD_OP_GET_OBJ_LIST_DELTA	0xD2
+#define SD_OP_GET_HASHES	0xD3
+#define SD_OP_TRACE_PROFILE	0xD4
+#define SD_OP_REMOVE_OBJS	0xD5
+#define SD_OP_REMOVE_PEERS	0xD6
+#define SD_OP_HYDRATE_VDI	0xD7
+#define SD_OP_CLUSTER_BATCH	0xD8 /* several cluster ops in one message */
+#define SD_OP_GET_VDI_STATE_DELTA	0xD9
+#define SD_OP_CHECK_OBJECTS	0xDA
+#define SD_OP_GET_WQ_INFO	0xDB
+#define SD_OP_SET_WQ_LIMITS	0xDC
+#define SD_OP_CONVERT_VDI	0xDD
+#define SD_OP_VHOST_CREATE	0xDE
+#define SD_OP_VHOST_DELETE	0xDF
+#define SD_OP_SHM_ATTACH	0xE0
+#define SD_OP_HEARTBEAT		0xE1 /* answered by the main loop of the peer */
+#define SD_OP_GET_INODE_SUMMARIES	0xE2
+#define SD_OP_GET_WQ_STAT	0xE3
+#define SD_OP_GET_HEAT		0xE4
+#define SD_OP_SYNC_PEER		0xE5 /* sync the writes of 'sheep -N' */
+#define SD_OP_GET_MEM_STAT	0xE6
+
+/* the tag of the snapshot which 'dog vdi convert' leaves to the gateway */
+#define SD_CONVERT_TAG "converting"
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
@@ -122,9 +155,26 @@
 
 /* flags for VDI attribute operations */
 #define SD_FLAG_CMD_CREAT    0x0100
-#define SD_FLAG_CMD_EXCL     0x0200
+#define SD_FLAG_CMD_EXCL     0x0200 /* also a create of a missing object */
 #define SD_FLAG_CMD_DEL      0x0400
 
+/* SD_OP_GET_HASHES by CRC32C, echoed back in the response if supported */
+#define SD_FLAG_CMD_CRC32C   0x0800
+
+/*
+ * The sender takes zstd data, echoed back in the response if supported, and
+ * the data of the request or the response is a zstd frame (sheep/wire.c)
+ */
+#define SD_FLAG_CMD_ZSTD      0x1000
+#define SD_FLAG_CMD_ZSTD_DATA 0x2000
+
+/*
+ * SD_OP_READ_PEER can be answered with only the data extents of the range,
+ * marked with the flag in the response: struct sd_extents with nr extents in
+ * order, followed by their data.  The rest of the range reads as zeros.
+ */
+#define SD_FLAG_CMD_SPARSE    0x4000
+
 /* internal error return values, must be above 0x80 */
 #define SD_RES_OLD_NODE_VER  0x81 /* Request has an old epoch */
 #define SD_RES_NEW_NODE_VER  0x82 /* Request has a new epoch */
@@ -159,6 +209,11 @@
 #define SD_CLUSTER_FLAG_USE_LOCK	0x0008 /* Lock/Unlock vdi */
 #define SD_CLUSTER_FLAG_RECYCLE_VID	0x0010 /* Enable recycling of VID */
 #define SD_CLUSTER_FLAG_AVOID_DISKFULL	0x0020 /* Avoid disk full by recovery */
+#define SD_CLUSTER_FLAG_CHECKSUM	0x0040 /* Keep checksums of objects */
+/* The high byte of the flags is the number of placement probes minus one */
+#define SD_CLUSTER_PROBES_SHIFT		8
+#define SD_CLUSTER_PROBES_MASK		0xff00
+#define SD_MAX_PLACEMENT_PROBES		256
 
 enum sd_status {
 	SD_STATUS_OK = 1,
@@ -291,7 +346,8 @@ struct epoch_log {
 	uint8_t  disable_recovery;
 	uint8_t  nr_copies;
 	uint8_t  copy_policy;
-	uint8_t  __pad[3];
+	uint8_t  nosync;	/* of the node answering */
+	uint16_t writeback_window;	/* msec, of the node answering */
 	uint16_t flags;
 	char drv_name[STORE_LEN];
 	struct sd_node nodes[0];
@@ -311,9 +367,20 @@ struct md_info {
 };
 
 #define MD_MAX_DISK 64 /* FIXME remove roof and make it dynamic */
+
+/* Progress of moving the objects to their disks after plugging disks */
+struct md_rebalance_state {
+	uint8_t in_rebalance;
+	uint8_t __pad[7];
+	uint64_t nr_total;
+	uint64_t nr_scanned;
+	uint64_t nr_moved;
+};
+
 struct sd_md_info {
 	struct md_info disk[MD_MAX_DISK];
 	int nr;
+	struct md_rebalance_state rebalance;
 };
 
 static inline __attribute__((used)) void __sd_epoch_format_build_bug_ons(void)
@@ -350,6 +417,8 @@ struct object_cache_info {
 	uint8_t directio;
 };
 
+#define SD_NR_POOL_CLASSES 5
+
 struct sd_stat {
 	struct s_request {
 		uint64_t gway_active_nr; /* nr of running request */
@@ -367,11 +436,172 @@ struct sd_stat {
 		uint64_t peer_total_remove_nr;
 		uint64_t peer_total_read_nr;
 		uint64_t peer_total_write_nr;
+		uint64_t gway_total_latency; /* usec of the finished requests */
 	} r;
+	/* the size classes of the buffer pool and the oversized buffers */
+	struct s_pool {
+		uint64_t size;
+		uint64_t nr_total; /* buffers allocated from the system */
+		uint64_t nr_free; /* buffers cached in the pool */
+		uint64_t nr_alloc; /* allocation requests */
+	} pool[SD_NR_POOL_CLASSES + 1];
+};
+
+/* Flags of SD_OP_STAT */
+#define SD_STAT_LATENCY 0x01 /* append latencies instead of the sockfd cache */
+#define SD_STAT_VDI 0x02 /* append the I/O of the vdis instead */
+
+/*
+ * Latencies in microseconds are counted in log-linear buckets, 16 per power
+ * of two, so the percentiles are accurate to about 6%
+ */
+#define SD_LATENCY_SUB_BITS 4
+#define SD_LATENCY_SUB (1 << SD_LATENCY_SUB_BITS)
+#define SD_NR_LATENCY_BUCKETS ((33 - SD_LATENCY_SUB_BITS) * SD_LATENCY_SUB)
+#define SD_MAX_LATENCY_STATS 64
+
+/*
+ * Latencies of the requests of one opcode, appended to struct sd_stat in the
+ * response of SD_OP_STAT with SD_STAT_LATENCY
+ */
+struct sd_latency_stat {
+	char name[32];
+	uint8_t opcode;
+	uint8_t peer; /* 1 for the peer requests, 0 for the gateway ones */
+	uint8_t __pad[6];
+	uint64_t nr;
+	uint64_t total; /* usec */
+	uint64_t max;
+	uint64_t buckets[SD_NR_LATENCY_BUCKETS];
+};
+
+#define SD_MAX_VDI_IO_STATS 4096
+
+/*
+ * I/O of a vdi through the gateway of a node since it started, appended to
+ * struct sd_stat in the response of SD_OP_STAT with SD_STAT_VDI.  The objects
+ * shared with the parent of a clone are counted to the parent.
+ */
+struct sd_vdi_io_stat {
+	uint32_t vid;
+	uint32_t idle; /* sec since the last I/O, 0 from old sheep */
+	uint64_t nr_read;
+	uint64_t nr_write;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t read_latency; /* usec, total */
+	uint64_t write_latency;
+};
+
+/*
+ * Per node usage of the sockfd cache, appended to struct sd_stat in the
+ * response of SD_OP_STAT if the requester has room for it
+ */
+struct sd_sockfd_stat {
+	struct node_id nid;
+	uint32_t nr_fds_io;
+	uint32_t nr_fds_nio;
+	uint32_t nr_io_in_use;
+	uint32_t nr_nio_in_use;
+	uint64_t nr_short; /* times we fell back on a short connection */
+};
+
+/*
+ * A work queue of a node, in the response of SD_OP_GET_WQ_INFO.
+ * SD_OP_SET_WQ_LIMITS takes one with the name and the limits set.
+ */
+struct sd_wq_info {
+	char name[32];
+	uint32_t nr_threads;
+	uint32_t min_threads;
+	uint32_t max_threads; /* 0 for the default */
+	uint32_t target; /* the threads the queue is sized to */
+	uint32_t nr_queued;
+	uint8_t dynamic;
+	uint8_t stealing;
+	uint8_t __pad[2];
+	uint64_t rate; /* works per second */
+	uint64_t service_time; /* nsec */
+	uint64_t wait_time; /* nsec */
+};
+
+/*
+ * The works of a work queue since the start of the sheep, in the response of
+ * SD_OP_GET_WQ_STAT.  The wait is from queue_work() to the start of the work
+ * and the run is of its work function.
+ */
+struct sd_wq_stat {
+	char name[32];
+	uint32_t nr_threads;
+	uint32_t nr_waiting;
+	uint32_t nr_running;
+	uint32_t __pad;
+	uint64_t nr_done;
+	uint64_t wait_total; /* usec */
+	uint64_t wait_max;
+	uint64_t run_total;
+	uint64_t run_max;
+	uint64_t wait_buckets[SD_NR_LATENCY_BUCKETS];
+	uint64_t run_buckets[SD_NR_LATENCY_BUCKETS];
+};
+
+/*
+ * The memory accounted to a subsystem of a node, in the response of
+ * SD_OP_GET_MEM_STAT.  One per enum sd_mem_tag, in its order.
+ */
+struct sd_mem_stat {
+	char name[32];
+	int64_t bytes;		/* in use, as malloc_usable_size() sees them */
+	int64_t nr;		/* the live allocations */
+	uint64_t nr_alloc;	/* since the start of the sheep */
+};
+
+/*
+ * The heat of the objects of a disk, in the response of SD_OP_GET_HEAT.
+ * nr_hot struct sd_hot_obj follow, the hottest first.  The accesses are
+ * estimated from samples, roughly of the last two minutes.
+ */
+#define SD_HEAT_TOP 32
+
+struct sd_heat_disk {
+	uint32_t idx; /* of SD_OP_MD_INFO, UINT32_MAX if unplugged */
+	uint32_t nr_hot;
+	uint64_t nr_accesses;
+};
+
+struct sd_hot_obj {
+	uint64_t oid;
+	uint64_t hits;
 };
 
 void sd_inode_stat(const struct sd_inode *inode, uint64_t *, uint64_t *);
 
+/* The header of an inode as reported by SD_OP_GET_INODE_SUMMARIES */
+struct sd_inode_summary {
+	char name[SD_MAX_VDI_LEN];
+	char tag[SD_MAX_VDI_TAG_LEN];
+	uint64_t create_time;
+	uint64_t snap_ctime;
+	uint64_t vm_clock_nsec;
+	uint64_t vdi_size;
+	uint64_t vm_state_size;
+	uint8_t  copy_policy;
+	uint8_t  store_policy;
+	uint8_t  nr_copies;
+	uint8_t  block_size_shift;
+	uint32_t snap_id;
+	uint32_t vdi_id;
+	uint32_t parent_vdi_id;
+	uint32_t btree_counter;
+	uint32_t flags;
+	/* of sd_inode_stat(), zero unless hdr->summary.usage is set */
+	uint64_t my_objs;
+	uint64_t cow_objs;
+};
+
+void sd_inode_summarize(const struct sd_inode *inode,
+			struct sd_inode_summary *s);
+
 #ifdef HAVE_TRACE
 
 #define TRACE_GRAPH_ENTRY  0x01
@@ -389,6 +619,14 @@ struct trace_graph_item {
 	uint64_t return_time;
 };
 
+/* Per-function counters of the profile tracer */
+struct trace_profile_item {
+	char fname[TRACE_FNAME_LEN];
+	uint64_t nr_calls;
+	uint64_t nr_sampled;	/* calls whose time was measured */
+	uint64_t sampled_time;	/* nsec spent in the sampled calls */
+};
+
 #else
 
 /*
@@ -397,6 +635,7 @@ struct trace_graph_item {
  * declaration.
  */
 struct trace_graph_item;
+struct trace_profile_item;
 
 #endif	/* HAVE_TRACE */
 
@@ -414,6 +653,37 @@ enum shared_lock_state {
 	SHARED_LOCK_STATE_INVALIDATED,
 };
 
+/*
+ * SD_OP_GET_HASHES takes an array of these with the oids set and fills in the
+ * result and, on success, the SHA1 digest of each object, or its CRC32C in the
+ * first four bytes with SD_FLAG_CMD_CRC32C
+ */
+struct sd_obj_hash {
+	uint64_t oid;
+	uint32_t result;
+	uint8_t digest[20];
+};
+
+/* The data extents of a sparse response of SD_FLAG_CMD_SPARSE */
+#define SD_MAX_EXTENTS 128
+
+struct sd_extent {
+	uint32_t offset;	/* from the start of the range */
+	uint32_t length;
+};
+
+struct sd_extents {
+	uint32_t length;	/* of the whole range */
+	uint32_t nr;
+	struct sd_extent ext[SD_MAX_EXTENTS];
+};
+
+/* The bytes of struct sd_extents with nr extents on the wire */
+static inline uint32_t sd_extents_size(uint32_t nr)
+{
+	return offsetof(struct sd_extents, ext) + nr * sizeof(struct sd_extent);
+}
+
 struct vdi_state {
 	uint32_t vid;
 	uint8_t nr_copies;
@@ -421,7 +691,8 @@ struct vdi_state {
 	uint8_t deleted;
 	uint8_t copy_policy;
 	uint8_t block_size_shift;
-	uint8_t __pad[3];
+	uint8_t flags; /* SD_INODE_* */
+	uint8_t __pad[2];
 	uint32_t parent_vid;
 
 	uint32_t lock_state;
@@ -441,4 +712,21 @@ struct vdi_state {
 	struct node_id participants[SD_MAX_COPIES];
 };
 
+/*
+ * The leading part of struct vdi_state, without the lock state.  Joining nodes
+ * sync only these with SD_OP_GET_VDI_STATE_DELTA, the locks are recovered from
+ * the checkpoints.
+ */
+struct vdi_state_compact {
+	uint32_t vid;
+	uint8_t nr_copies;
+	uint8_t snapshot;
+	uint8_t deleted;
+	uint8_t copy_policy;
+	uint8_t block_size_shift;
+	uint8_t flags; /* SD_INODE_* */
+	uint8_t __pad[2];
+	uint32_t parent_vid;
+};
+
 #endif /* __INTERNAL_PROTO_H__ */
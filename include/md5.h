@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* MD5 Message-Digest Algorithm (RFC 1321), used for the ETag of the objects */
+
+#ifndef MD5_H
+#define MD5_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#define MD5_DIGEST_SIZE		16
+#define MD5_BLOCK_SIZE		64
+
+struct md5_ctx {
+	uint64_t count;
+	uint32_t state[MD5_DIGEST_SIZE / 4];
+	uint8_t buffer[MD5_BLOCK_SIZE];
+};
+
+void md5_init(struct md5_ctx *ctx);
+void md5_update(struct md5_ctx *ctx, const uint8_t *data, size_t len);
+void md5_final(struct md5_ctx *ctx, uint8_t *out);
+const char *md5_to_hex(const uint8_t *md5);
+
+#endif
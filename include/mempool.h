@@ -0,0 +1,31 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include "internal_proto.h"
+#include "logger.h"
+
+void *pool_alloc(size_t len);
+void *pool_zalloc(size_t len);
+void pool_free(void *buf, size_t len);
+void mempool_stat(struct s_pool *stat);
+int mempool_init_hugepages(size_t size, bool prefault);
+
+static inline void *xpool_alloc(size_t len)
+{
+	void *buf = pool_alloc(len);
+
+	if (unlikely(!buf))
+		panic("Out of memory");
+	return buf;
+}
+
+static inline void *xpool_zalloc(size_t len)
+{
+	void *buf = pool_zalloc(len);
+
+	if (unlikely(!buf))
+		panic("Out of memory");
+	return buf;
+}
+
+#endif	/* MEMPOOL_H */
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MEMSCAN_H__
+#define __MEMSCAN_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Scans of buffers for zeros and for differences, with SSE2 or AVX2 when the
+ * CPU has them.  The forward scans return the offset of the first byte found,
+ * or 'len' if there is none, and the backward scans return the offset just
+ * past the last byte found, or 0 if there is none.
+ */
+size_t find_nonzero(const void *buf, size_t len);
+size_t find_last_nonzero(const void *buf, size_t len);
+size_t find_mismatch(const void *a, const void *b, size_t len);
+size_t find_last_mismatch(const void *a, const void *b, size_t len);
+
+static inline bool is_zero_buffer(const void *buf, size_t len)
+{
+	return find_nonzero(buf, len) == len;
+}
+
+#endif
@@ -34,6 +34,13 @@ struct connection {
 	char ipstr[INET6_ADDRSTRLEN];
 
 	bool dead;
+	/* send the large payloads with MSG_ZEROCOPY */
+	bool zerocopy;
+	/* the MSG_ZEROCOPY sends and their completions, see wait_zerocopy() */
+	uint32_t zc_sent;
+	uint32_t zc_done;
+	/* a unix domain socket, which can pass fds */
+	bool unix_sock;
 
 #ifdef HAVE_ACCELIO
 	/* session: the session this connection belongs to */
@@ -52,6 +59,18 @@ struct sd_xio_session {
 
 #endif
 
+/*
+ * The socket calls of the data path (send_req(), exec_req(), do_read() and
+ * friends), to be replaced by a kernel-bypass stack
+ */
+struct net_transport {
+	const char *name;
+	ssize_t (*sendmsg)(int sockfd, const struct msghdr *msg, int flags);
+	ssize_t (*recvmsg)(int sockfd, struct msghdr *msg, int flags);
+};
+
+void set_net_transport(const struct net_transport *t);
+
 int conn_tx_off(struct connection *conn);
 int conn_tx_on(struct connection *conn);
 int conn_rx_off(struct connection *conn);
@@ -59,12 +78,20 @@ int conn_rx_on(struct connection *conn);
 int rx(struct connection *conn, enum conn_state next_state);
 int tx(struct connection *conn, enum conn_state next_state);
 int connect_to(const char *name, int port);
+int connect_to_nonblock(const char *name, int port);
 int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	     bool (*need_retry)(uint32_t), uint32_t, uint32_t);
+int send_reqs(int sockfd, struct iovec *iov, int iovcnt, bool more);
+int send_req_zerocopy(struct connection *conn, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool *copied);
+bool conn_error(struct connection *conn);
 int exec_req(int sockfd, struct sd_req *hdr, void *,
 	     bool (*need_retry)(uint32_t), uint32_t, uint32_t);
+int recv_rsp(int sockfd, struct sd_rsp *rsp, void *data, uint32_t rlen,
+	     bool (*need_retry)(uint32_t), uint32_t, uint32_t);
 int do_read(int sockfd, void *buf, uint32_t len,
 	    bool (*need_retry)(uint32_t), uint32_t, uint32_t);
+int do_read_fds(int sockfd, void *buf, uint32_t len, int *fds, int max_fds);
 int create_listen_ports(const char *bindaddr, int port,
 			int (*callback)(int fd, void *), void *data);
 int create_unix_domain_socket(const char *unix_path,
@@ -74,6 +101,8 @@ const char *addr_to_str(const uint8_t *addr, uint16_t port);
 uint8_t *str_to_addr(const char *ipstr, uint8_t *addr);
 char *sockaddr_in_to_str(struct sockaddr_in *sockaddr);
 int set_nodelay(int fd);
+int set_busy_poll_sock(int fd);
+int set_zerocopy(int fd);
 int set_keepalive(int fd);
 int set_snd_timeout(int fd);
 int set_rcv_timeout(int fd);
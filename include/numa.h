@@ -0,0 +1,16 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stdint.h>
+
+#define MAX_NUMA_NODES 64
+
+int numa_nodes(void);
+int numa_node_of_cpu(int cpu);
+int numa_current_node(void);
+int numa_node_of_path(const char *path);
+int numa_node_of_netdev(const char *ifname);
+int numa_node_of_addr(const uint8_t *addr);
+int numa_bind_thread(int node);
+
+#endif	/* __NUMA_H__ */
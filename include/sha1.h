@@ -33,5 +33,7 @@ sha1_final_func_t sha1_final;
 
 const char *sha1_to_hex(const unsigned char *sha1);
 void get_buffer_sha1(unsigned char *buf, unsigned len, unsigned char *sha1);
+void get_buffer_block_sha1(unsigned char *buf, unsigned len,
+			   unsigned block_size, unsigned char *sha1);
 
 #endif
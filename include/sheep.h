@@ -32,9 +32,33 @@ struct vnode_info {
 	struct rb_root nroot;
 	int nr_nodes;
 	int nr_zones;
-	refcnt_t refcnt;
+	int nr_probes; /* see oid_to_first_vnode() */
+
+	/*
+	 * Flat table built by the sheep daemon instead of vroot: the vnodes
+	 * sorted by hash, their hashes alone for the searches, and for each
+	 * of them the indexes of the other nr_vnode_set - 1 vnodes of the
+	 * replica set starting there, the first one being the vnode itself.
+	 * NULL when not built, in which case the lookups walk vroot.
+	 */
+	int nr_vnodes;
+	int nr_vnode_set;
+	bool diskmode; /* vnodes were made by node_vnode_hashes(n, true) */
+	struct sd_vnode *vnode_buf;
+	uint64_t *vnode_hashes;
+	uint32_t *vnode_sets;
+
+	/*
+	 * Written on every request, so kept off the cache line of the fields
+	 * above which the worker threads read for each lookup
+	 */
+	refcnt_t refcnt __attribute__((aligned(64)));
+	int nr_req_refs; /* main thread only, see get_req_vnode_info() */
 };
 
+/* Number of replica set members precomputed per vnode */
+#define SD_VNODE_SET_SIZE 8
+
 static inline void sd_init_req(struct sd_req *req, uint8_t opcode)
 {
 	memset(req, 0, sizeof(*req));
@@ -42,6 +66,22 @@ static inline void sd_init_req(struct sd_req *req, uint8_t opcode)
 	req->proto_ver = opcode < 0x80 ? SD_PROTO_VER : SD_SHEEP_PROTO_VER;
 }
 
+/* the request data is a vector of struct sd_obj_vec */
+static inline bool is_obj_vec_req(const struct sd_req *req)
+{
+	switch (req->opcode) {
+	case SD_OP_READ_OBJS:
+	case SD_OP_WRITE_OBJS:
+	case SD_OP_READ_PEERS:
+	case SD_OP_WRITE_PEER_BATCH:
+	case SD_OP_REMOVE_OBJS:
+	case SD_OP_REMOVE_PEERS:
+		return true;
+	default:
+		return false;
+	}
+}
+
 static inline int same_zone(const struct sd_vnode *v1,
 			    const struct sd_vnode *v2)
 {
@@ -54,22 +94,54 @@ static inline int vnode_cmp(const struct sd_vnode *node1,
 	return intcmp(node1->hash, node2->hash);
 }
 
-/* If v1_hash < oid_hash <= v2_hash, then oid is resident on v2 */
+/* Number of hashes probed per oid, 1 for the plain consistent hashing */
+static inline int sd_placement_probes(uint16_t cluster_flags)
+{
+	return ((cluster_flags & SD_CLUSTER_PROBES_MASK) >>
+		SD_CLUSTER_PROBES_SHIFT) + 1;
+}
+
+/*
+ * If v1_hash < oid_hash <= v2_hash, then oid is resident on v2.
+ *
+ * With multi-probe placement, the oid is hashed nr_probes times and resides on
+ * the vnode which is the closest to one of these hashes.  This evens out the
+ * share of the ring owned by each vnode, so the per-node object counts are
+ * much closer to their vnode count ratio than with a single hash.
+ */
 static inline struct sd_vnode *
-oid_to_first_vnode(uint64_t oid, struct rb_root *root)
+oid_to_first_vnode(uint64_t oid, struct rb_root *root, int nr_probes)
 {
 	struct sd_vnode dummy = {
 		.hash = sd_hash_oid(oid),
 	};
-	return rb_nsearch(root, &dummy, rb, vnode_cmp);
+	struct sd_vnode *best = rb_nsearch(root, &dummy, rb, vnode_cmp);
+	uint64_t best_dist;
+
+	if (nr_probes <= 1 || !best)
+		return best;
+
+	best_dist = best->hash - dummy.hash;
+	for (int i = 1; i < nr_probes; i++) {
+		struct sd_vnode *v;
+
+		dummy.hash = sd_hash_next(dummy.hash);
+		v = rb_nsearch(root, &dummy, rb, vnode_cmp);
+		if (v->hash - dummy.hash < best_dist) {
+			best = v;
+			best_dist = v->hash - dummy.hash;
+		}
+	}
+
+	return best;
 }
 
 /* Replica are placed along the ring one by one with different zones */
 static inline void oid_to_vnodes(uint64_t oid, struct rb_root *root,
-				 int nr_copies,
+				 int nr_probes, int nr_copies,
 				 const struct sd_vnode **vnodes)
 {
-	const struct sd_vnode *next = oid_to_first_vnode(oid, root);
+	const struct sd_vnode *next = oid_to_first_vnode(oid, root, nr_probes);
 
 	vnodes[0] = next;
 	for (int i = 1; i < nr_copies; i++) {
@@ -87,36 +159,172 @@ next:
 }
 
 static inline const struct sd_vnode *
-oid_to_vnode(uint64_t oid, struct rb_root *root, int copy_idx)
+oid_to_vnode(uint64_t oid, struct rb_root *root, int nr_probes, int copy_idx)
 {
 	const struct sd_vnode *vnodes[SD_MAX_COPIES];
 
-	oid_to_vnodes(oid, root, copy_idx + 1, vnodes);
+	oid_to_vnodes(oid, root, nr_probes, copy_idx + 1, vnodes);
 
 	return vnodes[copy_idx];
 }
 
 static inline const struct sd_node *
-oid_to_node(uint64_t oid, struct rb_root *root, int copy_idx)
+oid_to_node(uint64_t oid, struct rb_root *root, int nr_probes, int copy_idx)
 {
 	const struct sd_vnode *vnode;
 
-	vnode = oid_to_vnode(oid, root, copy_idx);
+	vnode = oid_to_vnode(oid, root, nr_probes, copy_idx);
 
 	return vnode->node;
 }
 
 static inline void oid_to_nodes(uint64_t oid, struct rb_root *root,
-				int nr_copies,
+				int nr_probes, int nr_copies,
 				const struct sd_node **nodes)
 {
 	const struct sd_vnode *vnodes[SD_MAX_COPIES];
 
-	oid_to_vnodes(oid, root, nr_copies, vnodes);
+	oid_to_vnodes(oid, root, nr_probes, nr_copies, vnodes);
+	for (int i = 0; i < nr_copies; i++)
+		nodes[i] = vnodes[i]->node;
+}
+
+/* Index of the first vnode whose hash is not smaller than hval */
+static inline int vnode_table_search(const struct vnode_info *vinfo,
+				     uint64_t hval)
+{
+	int start = 0, end = vinfo->nr_vnodes;
+
+	while (start < end) {
+		int mid = start + (end - start) / 2;
+
+		if (vinfo->vnode_hashes[mid] < hval)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+
+	return start == vinfo->nr_vnodes ? 0 : start;
+}
+
+/* The flat table version of oid_to_first_vnode() */
+static inline int vnode_table_first(const struct vnode_info *vinfo,
+				    uint64_t oid)
+{
+	uint64_t hval = sd_hash_oid(oid), best_dist;
+	int best = vnode_table_search(vinfo, hval);
+
+	best_dist = vinfo->vnode_hashes[best] - hval;
+	for (int i = 1; i < vinfo->nr_probes; i++) {
+		int idx;
+
+		hval = sd_hash_next(hval);
+		idx = vnode_table_search(vinfo, hval);
+		if (vinfo->vnode_hashes[idx] - hval < best_dist) {
+			best = idx;
+			best_dist = vinfo->vnode_hashes[idx] - hval;
+		}
+	}
+
+	return best;
+}
+
+/* The same as oid_to_vnodes() but uses the flat table of vinfo if it has one */
+static inline void vinfo_oid_to_vnodes(struct vnode_info *vinfo, uint64_t oid,
+				       int nr_copies,
+				       const struct sd_vnode **vnodes)
+{
+	const uint32_t *set;
+	int i, n, idx;
+
+	if (!vinfo->vnode_hashes) {
+		oid_to_vnodes(oid, &vinfo->vroot, vinfo->nr_probes, nr_copies,
+			      vnodes);
+		return;
+	}
+
+	idx = vnode_table_first(vinfo, oid);
+	set = vinfo->vnode_sets + idx * (vinfo->nr_vnode_set - 1);
+	n = min(nr_copies, vinfo->nr_vnode_set);
+	vnodes[0] = vinfo->vnode_buf + idx;
+	for (i = 1; i < n; i++)
+		vnodes[i] = vinfo->vnode_buf + set[i - 1];
+
+	/* Longer replica sets than precomputed, continue along the ring */
+	if (n > 1)
+		idx = set[n - 2];
+	for (; i < nr_copies; i++) {
+next:
+		if (++idx == vinfo->nr_vnodes)
+			idx = 0;
+		if (unlikely(vinfo->vnode_buf + idx == vnodes[0]))
+			panic("can't find a valid vnode");
+		for (int j = 0; j < i; j++)
+			if (same_zone(vnodes[j], vinfo->vnode_buf + idx))
+				goto next;
+		vnodes[i] = vinfo->vnode_buf + idx;
+	}
+}
+
+static inline const struct sd_node *
+vinfo_oid_to_node(struct vnode_info *vinfo, uint64_t oid, int copy_idx)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(vinfo, oid, copy_idx + 1, vnodes);
+
+	return vnodes[copy_idx]->node;
+}
+
+static inline void vinfo_oid_to_nodes(struct vnode_info *vinfo, uint64_t oid,
+				      int nr_copies,
+				      const struct sd_node **nodes)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, vnodes);
 	for (int i = 0; i < nr_copies; i++)
 		nodes[i] = vnodes[i]->node;
 }
 
+static inline int latency_to_bucket(uint64_t usec)
+{
+	int shift;
+
+	if (usec < SD_LATENCY_SUB)
+		return usec;
+
+	shift = 63 - __builtin_clzll(usec) - SD_LATENCY_SUB_BITS;
+	return min((shift + 1) * SD_LATENCY_SUB +
+		   (int)((usec >> shift) & (SD_LATENCY_SUB - 1)),
+		   SD_NR_LATENCY_BUCKETS - 1);
+}
+
+/* The lowest latency counted in the bucket */
+static inline uint64_t bucket_to_latency(int idx)
+{
+	if (idx < SD_LATENCY_SUB)
+		return idx;
+
+	return (uint64_t)(SD_LATENCY_SUB + idx % SD_LATENCY_SUB) <<
+		(idx / SD_LATENCY_SUB - 1);
+}
+
+static inline uint64_t latency_percentile(const uint64_t *buckets,
+					  uint64_t nr, uint64_t max,
+					  double percentile)
+{
+	uint64_t rank = nr * percentile / 100, n = 0;
+
+	for (int i = 0; i < SD_NR_LATENCY_BUCKETS; i++) {
+		n += buckets[i];
+		if (n > rank)
+			return min(bucket_to_latency(i), max);
+	}
+
+	return max;
+}
+
 static inline const char *sd_strerror(int err)
 {
 	static const char *descs[256] = {
@@ -267,6 +475,53 @@ node_to_vnodes(const struct sd_node *n, struct rb_root *vroot)
 	}
 }
 
+/* The number of vnodes node_vnode_hashes() makes for n */
+static inline uint64_t node_nr_vnodes(const struct sd_node *n, bool diskmode)
+{
+	uint64_t total = 0;
+
+	if (!diskmode)
+		return n->nr_vnodes;
+
+	for (int j = 0; j < DISK_MAX; j++)
+		if (n->disks[j].disk_id)
+			total += DIV_ROUND_UP(n->disks[j].disk_space,
+					      WEIGHT_MIN);
+	return total;
+}
+
+/*
+ * Store the vnode hashes of n into hashes without building a vroot.  The
+ * hashes are the same as the ones node_to_vnodes() or node_disk_to_vnodes()
+ * inserts, in no particular order.
+ */
+static inline void node_vnode_hashes(const struct sd_node *n, bool diskmode,
+				     uint64_t *hashes)
+{
+	uint64_t node_hval = sd_hash(&n->nid, offsetof(typeof(n->nid),
+						       io_addr));
+	uint64_t hval = node_hval, disk_vnodes;
+
+	if (!diskmode) {
+		for (int i = 0; i < n->nr_vnodes; i++) {
+			hval = sd_hash_next(hval);
+			*hashes++ = hval;
+		}
+		return;
+	}
+
+	for (int j = 0; j < DISK_MAX; j++) {
+		if (!n->disks[j].disk_id)
+			continue;
+		hval = fnv_64a_64(node_hval, n->disks[j].disk_id);
+		disk_vnodes = DIV_ROUND_UP(n->disks[j].disk_space, WEIGHT_MIN);
+		for (int k = 0; k < disk_vnodes; k++) {
+			hval = sd_hash_next(hval);
+			*hashes++ = hval;
+		}
+	}
+}
+
 static inline void
 nodes_to_vnodes(struct rb_root *nroot, struct rb_root *vroot)
 {
@@ -36,6 +36,8 @@
 #define SD_OP_WRITE_OBJ      0x03
 #define SD_OP_REMOVE_OBJ     0x04
 #define SD_OP_DISCARD_OBJ    0x05
+#define SD_OP_READ_OBJS      0x06
+#define SD_OP_WRITE_OBJS     0x07
 
 #define SD_OP_NEW_VDI        0x11
 #define SD_OP_LOCK_VDI       0x12
@@ -118,6 +120,9 @@
 #define SD_MAX_VDI_SIZE (SD_DATA_OBJ_SIZE * MAX_DATA_OBJS)
 #define SD_DEFAULT_BLOCK_SIZE_SHIFT 22
 
+/* the max number of the entries of a SD_OP_READ_OBJS/WRITE_OBJS request */
+#define SD_MAX_OBJ_VEC 64
+
 #define SD_INODE_SIZE (sizeof(struct sd_inode))
 #define SD_INODE_INDEX_SIZE (sizeof(uint32_t) * MAX_DATA_OBJS)
 #define SD_INODE_DATA_INDEX (1ULL << 20)
@@ -152,7 +157,8 @@ struct sd_req {
 			uint8_t		reserved;
 			uint32_t	tgt_epoch;
 			uint32_t	offset;
-			uint32_t	__pad;
+			/* of the reference to cow_oid, sheep internal */
+			uint32_t	cow_generation;
 		} obj;
 		struct {
 			uint64_t	vdi_size;
@@ -163,6 +169,7 @@ struct sd_req {
 			uint8_t		block_size_shift;
 			uint32_t	snapid;
 			uint32_t        type;
+			uint32_t	flags; /* SD_INODE_* of a new vdi */
 		} vdi;
 
 		/* sheepdog-internal */
@@ -185,17 +192,32 @@ struct sd_req {
 						    /* others mean true */
 			uint8_t		copy_policy;
 			uint8_t		block_size_shift;
+			uint32_t	flags;
 		} vdi_state;
 		struct {
 			uint64_t	oid;
 			uint32_t	generation;
 			uint32_t	count;
+			/* number of the decrements, zero means one */
+			uint32_t	nr;
 		} ref;
 		struct {
 			uint64_t	oid;
 			uint8_t		addr[16];
 			uint16_t	port;
 		} forw;
+		/*
+		 * SD_OP_READ_OBJS: the request data is 'nr' struct sd_obj_vec
+		 * and the response data is the concatenation of the ranges
+		 *
+		 * SD_OP_WRITE_OBJS: the request data is 'nr' struct sd_obj_vec
+		 * followed by the concatenation of the ranges, 'rlen' is zero
+		 */
+		struct {
+			uint64_t	__reserved; /* must be zero */
+			uint32_t	nr;
+			uint32_t	rlen; /* total length of the ranges */
+		} vec;
 		struct {
 			uint32_t        get; /* 0 means free, 1 means get */
 			uint32_t        tgt_epoch;
@@ -206,7 +228,34 @@ struct sd_req {
 			/* 1 means validate, 0 means invalidate */
 			uint32_t        vid;
 			uint32_t        validate;
+			/* the participant which sends the request */
+			uint8_t		addr[16];
+			uint16_t	port;
 		} inode_coherence;
+		/* SD_OP_GET_OBJ_LIST_DELTA, zero means no list is cached */
+		struct {
+			uint64_t	generation;
+			uint64_t	version;
+		} objlist;
+		/* SD_OP_GET_VDI_STATE_DELTA, zero means no state is synced */
+		struct {
+			uint64_t	generation;
+			uint64_t	version;
+		} vdi_state_delta;
+		/* SD_OP_STAT */
+		struct {
+			uint32_t	flags;
+		} stat;
+		/* SD_OP_CONVERT_VDI */
+		struct {
+			uint64_t	oid;	/* the inode of the new vdi */
+			uint32_t	rate;	/* MB/s, zero means no limit */
+		} convert;
+		/* SD_OP_GET_INODE_SUMMARIES */
+		struct {
+			uint32_t	start;	/* the first vid to report */
+			uint32_t	usage;	/* non-zero to count the objects */
+		} summary;
 
 
 		uint32_t		__pad[8];
@@ -258,6 +307,44 @@ struct sd_rsp {
 			uint8_t		block_size_shift;
 			uint8_t		__pad2;
 		} cluster_default;
+		/*
+		 * SD_OP_GET_OBJ_LIST_DELTA: the data is the inserted oids
+		 * followed by 'nr_removed' removed oids, or the whole list if
+		 * 'full' is set
+		 */
+		struct {
+			uint32_t	__pad;
+			uint32_t	nr_removed;
+			uint64_t	generation;
+			uint64_t	version;
+			uint32_t	full;
+		} objlist;
+		/*
+		 * SD_OP_GET_VDI_STATE_DELTA: the data is the vdi states changed
+		 * since the requested version, or all of them if 'full' is set
+		 */
+		struct {
+			uint32_t	__pad;
+			uint32_t	full;
+			uint64_t	generation;
+			uint64_t	version;
+		} vdi_state_delta;
+		/*
+		 * SD_OP_GET_INODE_SUMMARIES: the data is struct sd_inode_summary
+		 * of the vdis, 'next' is the vid to go on from, SD_NR_VDIS after
+		 * the last one
+		 */
+		struct {
+			uint32_t	__pad;
+			uint32_t	next;
+		} summary;
+		/* SD_OP_CHECK_OBJECTS: what the node verified and repaired */
+		struct {
+			uint32_t	__pad;
+			uint32_t	nr_repaired;
+			uint64_t	nr_checked;
+			uint32_t	nr_failed;
+		} check;
 
 		uint32_t		__pad[8];
 	};
@@ -321,18 +408,34 @@ struct sd_inode_0_8 {
  *
  * users of the released area:
  * - uint32_t btree_counter
+ * - uint32_t flags
  */
 #define OLD_MAX_CHILDREN 1024U
 
+/* flags of struct sd_inode */
+#define SD_INODE_COMPRESS	0x01 /* store the data objects compressed */
+/* acknowledge the data writes after this many replicas, 0 for all */
+#define SD_INODE_QUORUM_SHIFT	3
+#define SD_INODE_QUORUM_MASK	0xf8
+#define SD_INODE_QUORUM(flags)	\
+	(((flags) & SD_INODE_QUORUM_MASK) >> SD_INODE_QUORUM_SHIFT)
+
 struct generation_reference {
 	int32_t generation;
 	int32_t count;
 };
 
+/*
+ * The bandwidth fields were appended later, the peers copy only as much of the
+ * structure as the other side sends.
+ */
 struct recovery_throttling {
 	uint32_t max_exec_count;
 	uint64_t queue_work_interval;
 	bool throttling;
+	uint64_t bandwidth;		/* bytes per second, 0 means unlimited */
+	uint64_t link_bandwidth;	/* of each source node */
+	uint32_t latency_target;	/* usec of gateway requests, 0: off */
 };
 
 struct sd_inode {
@@ -352,7 +455,8 @@ struct sd_inode {
 	uint32_t parent_vdi_id;
 
 	uint32_t btree_counter;
-	uint32_t __unused[OLD_MAX_CHILDREN - 1];
+	uint32_t flags;
+	uint32_t __unused[OLD_MAX_CHILDREN - 2];
 
 	uint32_t data_vdi_id[SD_INODE_DATA_INDEX];
 	struct generation_reference gref[SD_INODE_DATA_INDEX];
@@ -386,6 +490,12 @@ typedef int (*write_node_fn)(uint64_t id, void *mem, unsigned int len,
 typedef int (*read_node_fn)(uint64_t id, void **mem, unsigned int len,
 				uint64_t offset);
 
+struct sd_obj_vec {
+	uint64_t oid;
+	uint32_t offset;
+	uint32_t length;
+};
+
 struct sheepdog_vdi_attr {
 	char name[SD_MAX_VDI_LEN];
 	char tag[SD_MAX_VDI_TAG_LEN];
@@ -399,7 +509,11 @@ struct sheepdog_vdi_attr {
 extern void sd_inode_init(void *data, int depth);
 extern int sd_inode_actor_init(write_node_fn writer, read_node_fn reader);
 extern uint32_t sd_inode_get_vid(const struct sd_inode *inode, uint32_t idx);
+extern void sd_inode_invalidate_cache(uint32_t vid);
+extern void sd_inode_invalidate_cache_oid(uint64_t oid, bool write);
 extern int sd_inode_set_vid(struct sd_inode *inode, uint32_t idx, uint32_t);
+extern int sd_inode_set_vids(struct sd_inode *inode, struct sd_index *vids,
+			     int nr);
 extern int sd_inode_set_vid_range(struct sd_inode *inode, uint32_t idx_start,
 				  uint32_t idx_end, uint32_t vdi_id);
 extern int sd_inode_write(struct sd_inode *inode, int flags, bool create, bool);
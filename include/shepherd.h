@@ -36,25 +36,31 @@ struct sph_msg {
 
 #include "internal_proto.h"
 
+/*
+ * Membership messages carry only what the receiver doesn't know yet.  Joined
+ * sheep keep their own copy of the member list and apply each join and leave
+ * in the order shepherd sends them, so only the joining sheep needs the full
+ * list, in its join reply.
+ */
 struct sph_msg_join {
 	struct sd_node new_node;
-
-	struct sd_node nodes[SD_MAX_NODES];
-	uint32_t nr_nodes;
 	uint8_t opaque[0];
 };
 
 struct sph_msg_join_reply {
-	struct sd_node nodes[SD_MAX_NODES];
 	uint32_t nr_nodes;
-	uint8_t opaque[0];
+	uint32_t __pad;
+	struct sd_node nodes[0];
+	/* followed by opaque */
 };
 
+static inline uint8_t *sph_join_reply_opaque(struct sph_msg_join_reply *r)
+{
+	return (uint8_t *)(r->nodes + r->nr_nodes);
+}
+
 struct sph_msg_join_node_finish {
 	struct sd_node new_node;
-
-	struct sd_node nodes[SD_MAX_NODES];
-	uint32_t nr_nodes;
 	uint8_t opaque[0];
 };
 
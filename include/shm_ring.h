@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+/*
+ * Shared memory ring of a local client
+ *
+ * A client on the host of the sheep creates the ring in a memfd, connects to
+ * the unix domain socket of the sheep (<dir>/sock) and sends SD_OP_SHM_ATTACH
+ * with the memfd, the eventfd it kicks the sheep with and the one the sheep
+ * kicks it back with.  From then on the socket carries no requests, only its
+ * hangup tells either side that the other went away.
+ *
+ * The ring has one slot per request in flight, holding the request, its
+ * response and its data.  The client fills a free slot and pushes its index
+ * to the submission queue, the sheep serves the request on the data in place
+ * and pushes the index to the completion queue.  Both queues have room for
+ * all the slots, so they never overflow.
+ */
+
+#include <fcntl.h>
+
+#include "sheepdog_proto.h"
+
+#define SD_SHM_MAGIC		0x53444d52	/* "SDMR" */
+#define SD_SHM_MAX_SLOTS	64
+/* the memfd, the submission eventfd and the completion eventfd */
+#define SD_SHM_NR_FDS		3
+/* the memfd can't be resized while the sheep maps it */
+#define SD_SHM_SEALS		(F_SEAL_SHRINK | F_SEAL_GROW)
+
+struct sd_shm_slot {
+	struct sd_req req;
+	struct sd_rsp rsp;
+};
+
+struct sd_shm_ring {
+	uint32_t magic;
+	uint32_t nr_slots;
+	uint32_t slot_size;	/* the bytes of data of a slot */
+	uint32_t __pad;
+
+	/* the tails are written by the producers, the heads by the consumers */
+	uint32_t sq_tail __attribute__((aligned(64)));
+	uint32_t sq_head __attribute__((aligned(64)));
+	uint32_t cq_tail __attribute__((aligned(64)));
+	uint32_t cq_head __attribute__((aligned(64)));
+
+	uint32_t sq[SD_SHM_MAX_SLOTS];
+	uint32_t cq[SD_SHM_MAX_SLOTS];
+	struct sd_shm_slot slots[SD_SHM_MAX_SLOTS];
+};
+
+/* the data of the slots follows the ring, page aligned */
+#define SD_SHM_DATA_OFFSET	((sizeof(struct sd_shm_ring) + 4095) & ~4095UL)
+
+static inline size_t sd_shm_size(uint32_t nr_slots, uint32_t slot_size)
+{
+	return SD_SHM_DATA_OFFSET + (size_t)nr_slots * slot_size;
+}
+
+static inline void *sd_shm_slot_data(struct sd_shm_ring *ring, uint32_t slot,
+				     uint32_t slot_size)
+{
+	return (char *)ring + SD_SHM_DATA_OFFSET + (size_t)slot * slot_size;
+}
+
+struct shm_client;
+
+struct shm_client *shm_client_attach(const char *path, uint32_t nr_slots,
+				     uint32_t slot_size);
+bool shm_client_fits(const struct shm_client *c, const struct sd_req *hdr);
+int shm_client_exec(struct shm_client *c, struct sd_req *hdr, void *data);
+void shm_client_detach(struct shm_client *c);
+
+#endif	/* __SHM_RING_H__ */
@@ -12,9 +12,24 @@ struct sockfd *sockfd_cache_get(const struct node_id *nid);
 void sockfd_cache_put(const struct node_id *nid, struct sockfd *sfd);
 void sockfd_cache_del_node(const struct node_id *nid);
 void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd);
+void sockfd_cache_drop(const struct node_id *nid, struct sockfd *sfd);
 void sockfd_cache_add(const struct node_id *nid);
 void sockfd_cache_add_group(const struct rb_root *nroot);
 void init_to_connect_list(void);
+int sockfd_cache_stat(struct sd_sockfd_stat *stat, int max);
+
+struct sockfd_load {
+	uint32_t nr_in_flight;
+	uint64_t srtt;		/* usec */
+	uint64_t rttvar;	/* usec */
+};
+
+void sockfd_cache_rtt(const struct node_id *nid, uint64_t usec);
+bool sockfd_cache_load(const struct node_id *nid, struct sockfd_load *load);
+void sockfd_cache_set_zstd(const struct node_id *nid, bool zstd);
+bool sockfd_cache_zstd(const struct node_id *nid);
+bool sockfd_cache_suspect(const struct node_id *nid);
+void sockfd_cache_forget(const struct node_id *nid);
 
 int sockfd_init(void);
 int start_node_connectivity_monitor(void);
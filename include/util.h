@@ -121,6 +121,25 @@ void *xzalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
 void *xcalloc(size_t nmemb, size_t size);
 void *xvalloc(size_t size);
+
+/* The subsystems whose allocations are accounted, see xmalloc_tag() */
+enum sd_mem_tag {
+	MEM_OBJLIST,		/* the object list cache */
+	MEM_VNODE_INFO,		/* the vnode_info of the epochs */
+	MEM_REQUEST,		/* the requests and their data buffers */
+	MEM_RECOVERY,		/* the object lists of the recovery */
+	SD_NR_MEM_TAGS,
+};
+
+struct sd_mem_stat;
+
+void *xmalloc_tag(size_t size, enum sd_mem_tag tag);
+void *xzalloc_tag(size_t size, enum sd_mem_tag tag);
+void *realloc_tag(void *ptr, size_t size, enum sd_mem_tag tag);
+void *xrealloc_tag(void *ptr, size_t size, enum sd_mem_tag tag);
+void free_tag(void *ptr, enum sd_mem_tag tag);
+void memtag_account(enum sd_mem_tag tag, ssize_t len);
+void memtag_stat(struct sd_mem_stat *st);
 int prealloc(int fd, uint64_t size);
 ssize_t xread(int fd, void *buf, size_t len);
 ssize_t xwrite(int fd, const void *buf, size_t len);
@@ -574,6 +593,15 @@ static inline uint64_t clock_get_time(void)
 	return (uint64_t)ts.tv_sec * 1000000000LL + (uint64_t)ts.tv_nsec;
 }
 
+/* For the intervals, which mustn't jump with the wall clock */
+static inline uint64_t clock_get_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000LL + (uint64_t)ts.tv_nsec;
+}
+
 char *xstrdup(const char *s);
 uint32_t str_to_u32(const char *nptr);
 uint16_t str_to_u16(const char *nptr);
@@ -15,6 +15,12 @@ struct work {
 	struct list_node w_list;
 	work_func_t fn;
 	work_func_t done;
+	/* the queue the work is queued on */
+	struct work_queue *wq;
+	/* link in the stack of the finished works */
+	struct work *next_done;
+	/* nsec, when the work was queued */
+	uint64_t queued;
 };
 
 struct work_queue {
@@ -28,6 +34,33 @@ enum wq_thread_control {
 	WQ_FIXED, /* Fixed # of threads created */
 };
 
+/*
+ * Priority of the work in the work-stealing pool.  The pool threads always
+ * take the highest priority work available, so the background queues don't
+ * delay the I/O requests.  Has no effect on the queues with own threads.
+ */
+enum wq_priority {
+	WQ_PRIO_HIGH,
+	WQ_PRIO_NORMAL,
+	WQ_PRIO_LOW,
+	NR_WQ_PRIO,
+};
+
+/* The sizing of a work queue, see work_queue_stat() */
+struct work_queue_stat {
+	const char *name;
+	enum wq_thread_control tc;
+	bool stealing;
+	size_t nr_threads;
+	size_t min_threads;
+	size_t max_threads;	/* 0 for the default */
+	size_t target;		/* the threads the controller aims at */
+	size_t nr_queued;
+	uint64_t rate;		/* works per second */
+	uint64_t service_time;	/* nsec, average */
+	uint64_t wait_time;	/* nsec, average */
+};
+
 static inline bool is_main_thread(void)
 {
 	return gettid() == getpid();
@@ -67,6 +100,18 @@ void queue_work(struct work_queue *q, struct work *work);
 bool work_queue_empty(struct work_queue *q);
 int wq_trace_init(void);
 void set_max_dynamic_threads(size_t nr_max);
+void set_work_stealing(size_t nr_threads);
+void set_work_queue_blocking(struct work_queue *q);
+void set_work_queue_priority(struct work_queue *q, enum wq_priority prio);
+void set_work_queue_io_class(struct work_queue *q, int io_class);
+int get_io_class(void);
+void set_io_class(int io_class);
+void set_work_queue_numa_node(struct work_queue *q, int node);
+int work_queue_stat(struct work_queue_stat *st, int nr);
+struct sd_wq_stat;
+int work_queue_hist(struct sd_wq_stat *st, int nr);
+int set_work_queue_limits(const char *name, size_t min_threads,
+			  size_t max_threads);
 
 #ifdef HAVE_TRACE
 void suspend_worker_threads(void);
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Arena
+ *
+ * The buffers of a short-lived task, e.g. the messages of a cluster operation
+ * or of an event of the cluster driver, are carved out of a few chunks one
+ * after another and freed all at once by arena_destroy(), instead of being
+ * malloc()ed and freed one by one.  The chunks come from the buffer pool, so
+ * an arena reuses the chunks of the previous ones and the mix of the sizes of
+ * the messages doesn't fragment the heap.  A buffer larger than a chunk gets a
+ * chunk of its own.
+ *
+ * An arena is used by one thread at a time.
+ */
+
+#include <string.h>
+
+#include "arena.h"
+#include "mempool.h"
+#include "util.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;		/* passed to pool_alloc() */
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void *arena_alloc(struct arena *a, size_t len)
+{
+	struct arena_chunk *c;
+	size_t size;
+	void *buf;
+
+	len = round_up(len ?: 1, ARENA_ALIGN);
+	if (a->pos && len <= (size_t)(a->end - a->pos)) {
+		buf = a->pos;
+		a->pos += len;
+		return buf;
+	}
+
+	size = max(sizeof(*c) + len, (size_t)ARENA_CHUNK_SIZE);
+	c = xpool_alloc(size);
+	c->size = size;
+	c->next = a->chunks;
+	a->chunks = c;
+
+	/* keep carving the current chunk after a large buffer */
+	if (size == ARENA_CHUNK_SIZE) {
+		a->pos = c->data + len;
+		a->end = (char *)c + size;
+	}
+	return c->data;
+}
+
+void *arena_zalloc(struct arena *a, size_t len)
+{
+	return memset(arena_alloc(a, len), 0, len);
+}
+
+void arena_destroy(struct arena *a)
+{
+	struct arena_chunk *c, *next;
+
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		pool_free(c, c->size);
+	}
+	a->chunks = NULL;
+	a->pos = a->end = NULL;
+}
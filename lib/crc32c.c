@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CRC32C with the SSE4.2 crc32 instruction when the CPU has it, or a table
+ * driven implementation otherwise.
+ */
+
+#include <string.h>
+
+#include "compiler.h"
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78 /* reversed 0x1edc6f41 */
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_x2n_table[32]; /* x^(2^n) mod P */
+
+static uint32_t (*crc32c_update)(uint32_t, const uint8_t *, size_t);
+
+static uint32_t generic_crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef __x86_64__
+static uint32_t sse42_crc32c(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc, v;
+
+	for (; len && ((uintptr_t)p & 7); len--, p++)
+		asm("crc32b %1, %k0" : "+r" (c) : "rm" (*p));
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		asm("crc32q %1, %0" : "+r" (c) : "rm" (v));
+	}
+
+	for (; len; len--, p++)
+		asm("crc32b %1, %k0" : "+r" (c) : "rm" (*p));
+
+	return c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return ~crc32c_update(~crc, buf, len);
+}
+
+/* a * b mod P, in the bit reflected order of the CRC */
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = UINT32_C(1) << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+/* like zlib's crc32_combine(), shift crc1 over len2 bytes and add crc2 */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	uint32_t p = UINT32_C(1) << 31; /* x^0 */
+
+	/* x^(8 * len2) mod P */
+	for (int k = 3; len2; len2 >>= 1, k++)
+		if (len2 & 1)
+			p = multmodp(crc32c_x2n_table[k & 31], p);
+
+	return multmodp(p, crc1) ^ crc2;
+}
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[i] = crc;
+	}
+
+	crc32c_x2n_table[0] = UINT32_C(1) << 30; /* x^1 */
+	for (i = 1; i < 32; i++)
+		crc32c_x2n_table[i] = multmodp(crc32c_x2n_table[i - 1],
+					       crc32c_x2n_table[i - 1]);
+
+	crc32c_update = generic_crc32c;
+#ifdef __x86_64__
+	if (cpu_has_sse4_2)
+		crc32c_update = sse42_crc32c;
+#endif
+}
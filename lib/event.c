@@ -26,42 +26,253 @@
 static int efd;
 static struct rb_root events_tree = RB_ROOT;
 
+/*
+ * Timer wheel
+ *
+ * The timers are kept in a hierarchical wheel with a tick of one msec, the
+ * first level has a slot per tick for the next 256 msec and each of the four
+ * next ones has 64 slots which cover 64 times the range of the previous
+ * level.  A timer is added to the level its expiry falls in, and the slots of
+ * the upper levels are cascaded down when the lower level wraps, so adding and
+ * deleting a timer is O(1).
+ *
+ * The wheel is driven by a single timerfd, armed for the first non-empty slot
+ * of the first level or for the next cascade, and is run every time
+ * do_event_loop() wakes up.
+ */
+#define TVR_BITS	8
+#define TVN_BITS	6
+#define TVR_SIZE	(1 << TVR_BITS)
+#define TVN_SIZE	(1 << TVN_BITS)
+#define TVR_MASK	(TVR_SIZE - 1)
+#define TVN_MASK	(TVN_SIZE - 1)
+#define TVN_LEVELS	4
+
+static struct timer_wheel {
+	uint64_t jiffies;	/* the next tick to run */
+	uint64_t armed;		/* the tick the timerfd is armed for */
+	int nr_timers;
+	int nr_tv1;		/* the timers in the first level */
+	struct list_head tv1[TVR_SIZE];
+	struct list_head tvn[TVN_LEVELS][TVN_SIZE];
+	int tfd;
+} wheel = { .tfd = -1 };
+
+static uint64_t now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wheel_add(struct timer *t)
+{
+	uint64_t expires = t->expires, idx = expires - wheel.jiffies;
+	struct list_head *slot;
+	int level;
+
+	if ((int64_t)idx < 0) {
+		/* already expired, run it at the next tick */
+		slot = &wheel.tv1[wheel.jiffies & TVR_MASK];
+		level = 0;
+	} else if (idx < TVR_SIZE) {
+		slot = &wheel.tv1[expires & TVR_MASK];
+		level = 0;
+	} else {
+		for (level = 1; level < TVN_LEVELS; level++)
+			if (idx < 1ULL << (TVR_BITS + level * TVN_BITS))
+				break;
+		if (idx >= 1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS))
+			expires = wheel.jiffies +
+				(1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1;
+		slot = &wheel.tvn[level - 1][(expires >>
+					      (TVR_BITS + (level - 1) *
+					       TVN_BITS)) & TVN_MASK];
+	}
+	t->level = level;
+	if (!level)
+		wheel.nr_tv1++;
+	list_add_tail(&t->list, slot);
+}
+
+static void wheel_del(struct timer *t)
+{
+	if (!t->level)
+		wheel.nr_tv1--;
+	list_del(&t->list);
+}
+
+/* Move the timers of the current slot of 'level' down, returns its index */
+static int wheel_cascade(int level)
+{
+	int idx = (wheel.jiffies >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+	struct list_head *slot = &wheel.tvn[level][idx];
+	struct timer *t;
+	LIST_HEAD(list);
+
+	list_splice_init(slot, &list);
+	list_for_each_entry(t, &list, list) {
+		list_del(&t->list);
+		wheel_add(t);
+	}
+
+	return idx;
+}
+
+/* The next tick the upper levels are cascaded at, which may be this one */
+static uint64_t wheel_next_cascade(void)
+{
+	return round_up(wheel.jiffies, TVR_SIZE);
+}
+
+static void wheel_arm(uint64_t tick)
+{
+	struct itimerspec it;
+
+	memset(&it, 0, sizeof(it));
+	if (tick) {
+		it.it_value.tv_sec = tick / 1000;
+		it.it_value.tv_nsec = (tick % 1000) * 1000000;
+	}
+	if (timerfd_settime(wheel.tfd, TFD_TIMER_ABSTIME, &it, NULL) < 0)
+		sd_err("timerfd_settime: %m");
+	wheel.armed = tick;
+}
+
+/* Arm the timerfd for the first tick which has something to do */
+static void wheel_rearm(void)
+{
+	uint64_t next = UINT64_MAX;
+
+	if (!wheel.nr_timers) {
+		if (wheel.armed)
+			wheel_arm(0);
+		return;
+	}
+
+	/* the timers of the upper levels expire after their cascade */
+	if (wheel.nr_timers > wheel.nr_tv1)
+		next = wheel_next_cascade();
+
+	if (wheel.nr_tv1)
+		for (uint64_t j = wheel.jiffies;
+		     j < wheel.jiffies + TVR_SIZE && j < next; j++)
+			if (!list_empty(&wheel.tv1[j & TVR_MASK])) {
+				next = j;
+				break;
+			}
+
+	if (next != wheel.armed)
+		wheel_arm(next);
+}
+
+static void run_timers(void)
+{
+	uint64_t now;
+
+	if (!wheel.nr_timers) {
+		/* the timerfd is disarmed once it fired */
+		wheel.armed = 0;
+		return;
+	}
+
+	now = now_msec();
+	while (wheel.jiffies <= now) {
+		int idx = wheel.jiffies & TVR_MASK;
+		struct timer *t;
+		LIST_HEAD(list);
+
+		if (!idx)
+			for (int level = 0; level < TVN_LEVELS; level++)
+				if (wheel_cascade(level))
+					break;
+
+		if (!wheel.nr_tv1) {
+			/* skip the empty slots up to the next cascade */
+			wheel.jiffies = min(now, wheel.jiffies | TVR_MASK) + 1;
+			continue;
+		}
+
+		list_splice_init(&wheel.tv1[idx], &list);
+		wheel.jiffies++;
+		while (!list_empty(&list)) {
+			t = list_first_entry(&list, struct timer, list);
+			list_del(&t->list);
+			wheel.nr_tv1--;
+			wheel.nr_timers--;
+			t->callback(t->data);
+		}
+	}
+
+	wheel_rearm();
+}
+
 static void timer_handler(int fd, int events, void *data)
 {
-	struct timer *t = data;
 	uint64_t val;
 
-	if (read(fd, &val, sizeof(val)) < 0)
-		return;
+	/* the timers are run by do_event_loop() */
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		sd_err("failed to read timerfd: %m");
+}
 
-	t->callback(t->data);
+static int init_timer_wheel(void)
+{
+	for (int i = 0; i < TVR_SIZE; i++)
+		INIT_LIST_HEAD(&wheel.tv1[i]);
+	for (int level = 0; level < TVN_LEVELS; level++)
+		for (int i = 0; i < TVN_SIZE; i++)
+			INIT_LIST_HEAD(&wheel.tvn[level][i]);
+	wheel.jiffies = now_msec();
+
+	wheel.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (wheel.tfd < 0) {
+		sd_err("timerfd_create: %m");
+		return -1;
+	}
 
-	unregister_event(fd);
-	close(fd);
+	return register_event(wheel.tfd, timer_handler, NULL);
 }
 
+/*
+ * Run 't' after 'mseconds'.  Adding a timer which is already pending
+ * reschedules it.
+ */
 void add_timer(struct timer *t, unsigned int mseconds)
 {
-	struct itimerspec it;
-	int tfd;
+	uint64_t now, wake;
 
-	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-	if (tfd < 0) {
-		sd_err("timerfd_create: %m");
+	if (wheel.tfd < 0) {
+		sd_err("the event loop isn't initialized");
 		return;
 	}
 
-	memset(&it, 0, sizeof(it));
-	it.it_value.tv_sec = mseconds / 1000;
-	it.it_value.tv_nsec = (mseconds % 1000) * 1000000;
+	if (list_linked(&t->list))
+		del_timer(t);
 
-	if (timerfd_settime(tfd, 0, &it, NULL) < 0) {
-		sd_err("timerfd_settime: %m");
+	now = now_msec();
+	/* the wheel doesn't tick while it's empty */
+	if (!wheel.nr_timers)
+		wheel.jiffies = now;
+
+	t->expires = now + mseconds;
+	wheel_add(t);
+	wheel.nr_timers++;
+
+	/* the upper levels need the wheel to run at the next cascade */
+	wake = t->level ? wheel_next_cascade() : t->expires;
+	if (!wheel.armed || wake < wheel.armed)
+		wheel_rearm();
+}
+
+void del_timer(struct timer *t)
+{
+	if (!list_linked(&t->list))
 		return;
-	}
 
-	if (register_event(tfd, timer_handler, t) < 0)
-		sd_err("failed to register timer fd");
+	wheel_del(t);
+	wheel.nr_timers--;
 }
 
 struct event_info {
@@ -90,7 +301,7 @@ int init_event(int nr)
 		sd_err("failed to create epoll fd");
 		return -1;
 	}
-	return 0;
+	return init_timer_wheel();
 }
 
 static struct event_info *lookup_event(int fd)
@@ -195,13 +406,55 @@ static int epoll_event_cmp(const struct epoll_event *_a, struct epoll_event *_b)
 	return intcmp(b->prio, a->prio);
 }
 
+/*
+ * Busy polling
+ *
+ * When enabled with set_busy_poll(), event_wait() polls the epoll fd for up
+ * to the given usec before sleeping in epoll_wait(), so an event which comes
+ * soon after the previous one is handled without a sleep and a wakeup.  If
+ * nothing comes within the window it falls back to the blocking wait, so an
+ * idle loop costs one window per wakeup.  The worker threads and the sockets
+ * use the same window, see worker_routine() and set_busy_poll_sock().
+ */
+static unsigned int busy_poll_usec;
+
+void set_busy_poll(unsigned int usec)
+{
+	busy_poll_usec = usec;
+}
+
+unsigned int get_busy_poll(void)
+{
+	return busy_poll_usec;
+}
+
+int event_wait(int epfd, struct epoll_event *evs, int maxevents,
+	       int timeout)
+{
+	uint64_t end;
+	int nr;
+
+	if (!busy_poll_usec || !timeout)
+		return epoll_wait(epfd, evs, maxevents, timeout);
+
+	end = clock_get_time() + busy_poll_usec * 1000ULL;
+	do {
+		nr = epoll_wait(epfd, evs, maxevents, 0);
+		if (nr)
+			return nr;
+		cpu_relax();
+	} while (clock_get_time() < end);
+
+	return epoll_wait(epfd, evs, maxevents, timeout);
+}
+
 static void do_event_loop(int timeout, bool sort_with_prio)
 {
 	int i, nr;
 
 refresh:
 	event_loop_refresh = false;
-	nr = epoll_wait(efd, events, nr_events, timeout);
+	nr = event_wait(efd, events, nr_events, timeout);
 	if (sort_with_prio)
 		xqsort(events, nr, epoll_event_cmp);
 
@@ -210,7 +463,13 @@ refresh:
 			return;
 		sd_err("epoll_wait failed: %m");
 		exit(1);
-	} else if (nr) {
+	}
+
+	run_timers();
+	if (event_loop_refresh)
+		goto refresh;
+
+	if (nr) {
 		tracepoint(event, loop_start, nr_events);
 
 		for (i = 0; i < nr; i++) {
@@ -471,6 +471,7 @@ struct fec *fec_new(unsigned short d, unsigned short dp)
 	retval = (struct fec *)xmalloc(sizeof(struct fec));
 	retval->d = d;
 	retval->dp = dp;
+	retval->nr_local = 0;
 	retval->enc_matrix = NEW_GF_MATRIX(dp, d);
 	retval->magic = ((FEC_MAGIC^d)^dp)^(unsigned long)(retval->enc_matrix);
 	tmp_m = NEW_GF_MATRIX(dp, d);
@@ -508,6 +509,15 @@ struct fec *fec_new(unsigned short d, unsigned short dp)
 	return retval;
 }
 
+/* The global parities are the Reed-Solomon ones of d:g */
+struct fec *lrc_new(unsigned short d, unsigned short g, unsigned short l)
+{
+	struct fec *retval = fec_new(d, d + g);
+
+	retval->nr_local = l;
+	return retval;
+}
+
 /*
  * To make sure that we stay within cache in the inner loops of fec_encode().
  * (It would probably help to also do this for fec_decode().
@@ -698,22 +708,46 @@ out:
 	memcpy(output, dp[idx], strip_size);
 }
 
+/*
+ * Same as ec_decode() but for whole strip buffers of 'object_size / d' bytes,
+ * so that the matrices are set up only once for the object.
+ */
 void fec_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 		      char *buf, int idx, uint32_t object_size)
 {
-	int i, j, d = ctx->d;
-	size_t strip_size = SD_EC_DATA_STRIPE_SIZE / d;
-	uint32_t nr_stripe_per_object = object_size / SD_EC_DATA_STRIPE_SIZE;
-
-	for (i = 0; i < nr_stripe_per_object; i++) {
-		const uint8_t *in[d];
-		uint8_t out[strip_size];
-
-		for (j = 0; j < d; j++)
-			in[j] = input[j] + strip_size * i;
-		ec_decode(ctx, in, in_idx, out, idx);
-		memcpy(buf + strip_size * i, out, strip_size);
+	int i, m = 0, d = ctx->d;
+	size_t len = object_size / d;
+	const uint8_t *dp[ctx->dp];
+	const uint8_t *oin[d];
+	int oidx[d];
+	uint8_t *missing[d];
+
+	for (i = 0; i < ctx->dp; i++)
+		dp[i] = NULL;
+	for (i = 0; i < d; i++)
+		dp[in_idx[i]] = input[i];
+
+	decode_prepare(ctx, dp, oin, oidx);
+
+	/* Fill the data strips if missing */
+	if (data_is_missing(dp, d)) {
+		for (i = 0; i < d; i++)
+			if (!dp[i])
+				missing[m++] = xmalloc(len);
+		fec_decode(ctx, oin, missing, oidx, len);
+		for (i = 0, m = 0; i < d; i++)
+			if (!dp[i])
+				dp[i] = missing[m++];
 	}
+
+	if (idx < d)
+		memcpy(buf, dp[idx], len);
+	else
+		/* Fill the parity strip */
+		fec_encode(ctx, dp, (uint8_t **)&buf, &idx, 1, len);
+
+	for (i = 0; i < m; i++)
+		free(missing[i]);
 }
 
 #if defined __x86_64__ && defined(ENABLE_ISAL)
@@ -745,3 +779,191 @@ void isa_decode_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
 	ec_encode_data(len, ed, 1, ec_tbl, input, lost);
 }
 #endif
+
+static void xor_into(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+/* Compute the XOR parity of each local group of the data strips */
+void lrc_encode_local(struct fec *ctx, const uint8_t *ds[], uint8_t *ls[],
+		      size_t len)
+{
+	int gs = ctx->d / ctx->nr_local;
+
+	for (int i = 0; i < ctx->nr_local; i++) {
+		memcpy(ls[i], ds[i * gs], len);
+		for (int j = 1; j < gs; j++)
+			xor_into(ls[i], ds[i * gs + j], len);
+	}
+}
+
+/* The local group of the strip 'idx', -1 for a global parity */
+static int lrc_group(const struct fec *ctx, int idx)
+{
+	if (idx < ctx->d)
+		return idx / (ctx->d / ctx->nr_local);
+	if (idx < ctx->dp)
+		return -1;
+	return idx - ctx->dp;
+}
+
+/*
+ * Rebuild the strip 'idx' of the group 'grp' as the XOR of the other strips of
+ * the group, returns false if one of them isn't in 'st'
+ */
+static bool lrc_repair_local(const struct fec *ctx, const uint8_t *st[],
+			     int grp, int idx, uint8_t *buf, size_t len)
+{
+	int gs = ctx->d / ctx->nr_local, members[gs + 1], i;
+	bool first = true;
+
+	for (i = 0; i < gs; i++)
+		members[i] = grp * gs + i;
+	members[gs] = ctx->dp + grp;
+
+	for (i = 0; i <= gs; i++)
+		if (members[i] != idx && !st[members[i]])
+			return false;
+
+	for (i = 0; i <= gs; i++) {
+		if (members[i] == idx)
+			continue;
+		if (first)
+			memcpy(buf, st[members[i]], len);
+		else
+			xor_into(buf, st[members[i]], len);
+		first = false;
+	}
+	return true;
+}
+
+static void rs_decode_buffer(struct fec *ctx, uint8_t *input[],
+			     const int in_idx[], char *buf, int idx,
+			     uint32_t object_size)
+{
+#if defined __x86_64__ && defined(ENABLE_ISAL)
+		isa_decode_buffer(ctx, input, in_idx, buf, idx, object_size);
+#else
+		fec_decode_buffer(ctx, input, in_idx, buf, idx, object_size);
+#endif
+}
+
+/*
+ * The lost data strips are rebuilt in their local groups, or by the global
+ * parities if their groups lost more, then 'idx' is computed from them
+ */
+static int lrc_repair_buffer(struct fec *ctx, uint8_t *input[],
+			     const int in_idx[], int nr, char *buf, int idx,
+			     uint32_t object_size)
+{
+	int d = ctx->d, n = ctx->dp + ctx->nr_local, nr_rs = 0, ret = -1, i;
+	size_t len = object_size / d;
+	const uint8_t *st[n];
+	uint8_t *rs_in[d], *own[d];
+	int rs_idx[d], grp = lrc_group(ctx, idx);
+
+	memset(st, 0, sizeof(st));
+	memset(own, 0, sizeof(own));
+	/* filled up to d below, but gcc can't tell */
+	memset(rs_idx, 0, sizeof(rs_idx));
+	for (i = 0; i < nr; i++)
+		st[in_idx[i]] = input[i];
+
+	if (grp >= 0 &&
+	    lrc_repair_local(ctx, st, grp, idx, (uint8_t *)buf, len))
+		return 0;
+
+	for (i = 0; i < d; i++) {
+		if (st[i])
+			continue;
+		own[i] = xmalloc(len);
+		if (lrc_repair_local(ctx, st, lrc_group(ctx, i), i, own[i],
+				     len))
+			st[i] = own[i];
+	}
+
+	for (i = 0; i < ctx->dp && nr_rs < d; i++) {
+		if (!st[i])
+			continue;
+		rs_in[nr_rs] = (uint8_t *)st[i];
+		rs_idx[nr_rs++] = i;
+	}
+	if (nr_rs < d)
+		goto out;
+	for (i = 0; i < d; i++) {
+		if (st[i])
+			continue;
+		rs_decode_buffer(ctx, rs_in, rs_idx, (char *)own[i], i,
+				 object_size);
+		st[i] = own[i];
+	}
+
+	if (idx < d)
+		memcpy(buf, st[idx], len);
+	else if (grp < 0) {
+		for (i = 0; i < d; i++) {
+			rs_in[i] = (uint8_t *)st[i];
+			rs_idx[i] = i;
+		}
+		rs_decode_buffer(ctx, rs_in, rs_idx, buf, idx, object_size);
+	} else
+		lrc_repair_local(ctx, st, grp, idx, (uint8_t *)buf, len);
+	ret = 0;
+out:
+	for (i = 0; i < d; i++)
+		free(own[i]);
+	return ret;
+}
+
+/*
+ * Rebuild the strip 'idx' from the 'nr' strips of 'input', which must be at
+ * least 'd' but for a local repair of LRC.  Returns -1 if they aren't enough.
+ */
+int ec_repair_buffer(struct fec *ctx, uint8_t *input[], const int in_idx[],
+		     int nr, char *buf, int idx, uint32_t object_size)
+{
+	if (ctx->nr_local)
+		return lrc_repair_buffer(ctx, input, in_idx, nr, buf, idx,
+					 object_size);
+	if (nr < ctx->d)
+		return -1;
+
+	rs_decode_buffer(ctx, input, in_idx, buf, idx, object_size);
+	return 0;
+}
+
+/*
+ * The strips of LRC to read to rebuild the strip 'idx' when none of them is in
+ * 'lost', if given: the rest of its local group, or the data strips for a
+ * global parity.  Returns their number, or 0 if 'd' strips of any kind are
+ * needed.
+ */
+int ec_repair_set(const struct fec *ctx, int idx, const bool lost[],
+		  int set[])
+{
+	int grp, gs, nr = 0, i;
+
+	if (!ctx->nr_local)
+		return 0;
+
+	grp = lrc_group(ctx, idx);
+	if (grp < 0) {
+		for (i = 0; i < ctx->d; i++)
+			set[nr++] = i;
+	} else {
+		gs = ctx->d / ctx->nr_local;
+		for (i = grp * gs; i < (grp + 1) * gs; i++)
+			if (i != idx)
+				set[nr++] = i;
+		if (ctx->dp + grp != idx)
+			set[nr++] = ctx->dp + grp;
+	}
+
+	if (lost)
+		for (i = 0; i < nr; i++)
+			if (lost[set[i]])
+				return 0;
+	return nr;
+}
@@ -74,6 +74,22 @@ union semun {
 	struct seminfo *__buf;
 };
 
+/*
+ * Each thread of the sheep process owns one of the log rings in the shared
+ * memory, which only it writes and only the logger process reads, so logging
+ * needs no lock.  The threads which get no ring, e.g. when there are more
+ * threads than rings, or whose ring is full fall back on the log area shared
+ * by all of them and protected by the semaphore.
+ */
+#define LOG_NR_RINGS 64
+
+struct log_ring {
+	int in_use;
+	unsigned long head;	/* bytes written, updated by the owner */
+	unsigned long tail;	/* bytes read, updated by the logger */
+	char data[];
+};
+
 struct logarea {
 	bool active;
 	char *tail;
@@ -82,6 +98,8 @@ struct logarea {
 	int semid;
 	union semun semarg;
 	int fd;
+	char *rings;
+	size_t ring_size;
 };
 
 #define FUNC_NAME_SIZE 32 /* according to C89, including '\0' */
@@ -111,6 +129,10 @@ static struct log_format *format;
 static int log_fd = -1;
 static __thread const char *worker_name;
 static __thread int worker_idx;
+static __thread struct log_ring *my_ring;
+static __thread bool no_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
 static struct logarea *la;
 static const char *log_name;
 static char *log_nowname;
@@ -288,9 +310,18 @@ init_log_formatter(void)
 	exit(1);
 }
 
+static struct log_ring *get_ring(int idx)
+{
+	return (struct log_ring *)(la->rings +
+				   (sizeof(struct log_ring) + la->ring_size) *
+				   idx);
+}
+
+/* A quarter of 'size' is the shared log area and the rest is the rings */
 static int logarea_init(int size)
 {
 	int shmid;
+	size_t rings_size;
 
 	shmid = shmget(IPC_PRIVATE, sizeof(struct logarea),
 		       0644 | IPC_CREAT | IPC_EXCL);
@@ -310,6 +341,10 @@ static int logarea_init(int size)
 	if (size < MAX_MSG_SIZE)
 		size = LOG_SPACE_SIZE;
 
+	la->ring_size = round_down(size / 4 * 3 / LOG_NR_RINGS, 8);
+	rings_size = (sizeof(struct log_ring) + la->ring_size) * LOG_NR_RINGS;
+	size /= 4;
+
 	shmid = shmget(IPC_PRIVATE, size, 0644 | IPC_CREAT | IPC_EXCL);
 	if (shmid == -1) {
 		syslog(LOG_ERR, "shmget msg failed: %m");
@@ -330,9 +365,29 @@ static int logarea_init(int size)
 	la->end = la->start + size;
 	la->tail = la->start;
 
+	shmid = shmget(IPC_PRIVATE, rings_size, 0644 | IPC_CREAT | IPC_EXCL);
+	if (shmid == -1) {
+		syslog(LOG_ERR, "shmget rings failed: %m");
+		shmdt(la->start);
+		shmdt(la);
+		return 1;
+	}
+
+	la->rings = shmat(shmid, NULL, 0);
+	if (!la->rings) {
+		syslog(LOG_ERR, "shmat rings failed: %m");
+		shmdt(la->start);
+		shmdt(la);
+		return 1;
+	}
+	memset(la->rings, 0, rings_size);
+
+	shmctl(shmid, IPC_RMID, NULL);
+
 	la->semid = semget(semkey, 1, 0666 | IPC_CREAT);
 	if (la->semid < 0) {
 		syslog(LOG_ERR, "semget failed: %m");
+		shmdt(la->rings);
 		shmdt(la->start);
 		shmdt(la);
 		return 1;
@@ -341,6 +396,7 @@ static int logarea_init(int size)
 	la->semarg.val = 1;
 	if (semctl(la->semid, 0, SETVAL, la->semarg) < 0) {
 		syslog(LOG_ERR, "semctl failed: %m");
+		shmdt(la->rings);
 		shmdt(la->start);
 		shmdt(la);
 		return 1;
@@ -354,6 +410,7 @@ static void free_logarea(void)
 	if (log_fd >= 0)
 		close(log_fd);
 	semctl(la->semid, 0, IPC_RMID, la->semarg);
+	shmdt(la->rings);
 	shmdt(la->start);
 	shmdt(la);
 }
@@ -394,6 +451,169 @@ static void init_logmsg(struct logmsg *msg, struct timeval *tv,
 	msg->worker_idx = worker_idx;
 }
 
+/* The records are 8 bytes aligned so that they can be read in place */
+static size_t logmsg_size(const struct logmsg *msg)
+{
+	return round_up(sizeof(*msg) + msg->str_len + 1, 8);
+}
+
+static void ring_destructor(void *arg)
+{
+	struct log_ring *ring = arg;
+
+	cmm_smp_mb();
+	uatomic_set(&ring->in_use, 0);
+	my_ring = NULL;
+}
+
+static void init_ring_key(void)
+{
+	if (pthread_key_create(&ring_key, ring_destructor))
+		syslog(LOG_ERR, "failed to create the key of the log rings");
+}
+
+static struct log_ring *get_my_ring(void)
+{
+	if (likely(my_ring) || no_ring)
+		return my_ring;
+
+	pthread_once(&ring_once, init_ring_key);
+	for (int i = 0; i < LOG_NR_RINGS; i++) {
+		struct log_ring *ring = get_ring(i);
+
+		if (uatomic_cmpxchg(&ring->in_use, 0, 1) == 0) {
+			pthread_setspecific(ring_key, ring);
+			my_ring = ring;
+			return ring;
+		}
+	}
+	no_ring = true;
+
+	return NULL;
+}
+
+static bool ring_enqueue(const struct logmsg *msg)
+{
+	struct log_ring *ring = get_my_ring();
+	size_t len = logmsg_size(msg), off, first;
+	unsigned long head;
+
+	if (!ring)
+		return false;
+
+	head = ring->head;
+	if (len > la->ring_size - (head - uatomic_read(&ring->tail)))
+		return false;
+
+	off = head % la->ring_size;
+	first = min(len, la->ring_size - off);
+	memcpy(ring->data + off, msg, first);
+	memcpy(ring->data, (const char *)msg + first, len - first);
+
+	/* the logger must see the record before the new head */
+	cmm_smp_wmb();
+	uatomic_set(&ring->head, head + len);
+
+	return true;
+}
+
+static void shared_enqueue(const struct logmsg *msg)
+{
+	struct sembuf ops;
+	size_t len = logmsg_size(msg);
+
+	ops.sem_num = 0;
+	ops.sem_flg = SEM_UNDO;
+	ops.sem_op = -1;
+	if (semop(la->semid, &ops, 1) < 0) {
+		syslog(LOG_ERR, "semop up failed: %m");
+		return;
+	}
+
+	/* not enough space: drop msg */
+	if (len > la->end - la->tail)
+		syslog(LOG_ERR, "enqueue: log area overrun, "
+		       "dropping message\n");
+	else {
+		/* ok, we can stage the msg in the area */
+		memcpy(la->tail, msg, sizeof(*msg) + msg->str_len + 1);
+		la->tail += len;
+	}
+
+	ops.sem_op = 1;
+	if (semop(la->semid, &ops, 1) < 0) {
+		syslog(LOG_ERR, "semop down failed: %m");
+		return;
+	}
+}
+
+static void enqueue_msg(const struct logmsg *msg)
+{
+	if (!ring_enqueue(msg))
+		shared_enqueue(msg);
+}
+
+/*
+ * Errors and warnings are limited to LOG_RATELIMIT_BURST messages per call
+ * site and thread in LOG_RATELIMIT_INTERVAL seconds, so that error storms,
+ * e.g. during network partitions, don't flood the logger.  The number of the
+ * suppressed messages is reported when the call site logs again after the
+ * interval.
+ */
+#define LOG_RATELIMIT_INTERVAL 5
+#define LOG_RATELIMIT_BURST 10
+#define LOG_RATELIMIT_SLOTS 32
+
+static __thread struct log_ratelimit {
+	const char *func;
+	int line;
+	unsigned int nr;
+	unsigned int nr_suppressed;
+	time_t start;
+} ratelimits[LOG_RATELIMIT_SLOTS];
+
+static bool log_ratelimited(const struct logmsg *msg, const char *func)
+{
+	struct log_ratelimit *rl;
+	char buf[sizeof(struct logmsg) + MAX_MSG_SIZE];
+	struct logmsg *note = (struct logmsg *)buf;
+	int len;
+
+	if (msg->prio != SDOG_ERR && msg->prio != SDOG_WARNING)
+		return false;
+
+	/* func is __func__, so its address identifies the function */
+	rl = ratelimits + ((uintptr_t)func / 8 + msg->line) %
+		LOG_RATELIMIT_SLOTS;
+	if (rl->func != func || rl->line != msg->line) {
+		rl->func = func;
+		rl->line = msg->line;
+		rl->nr = 0;
+		rl->nr_suppressed = 0;
+		rl->start = msg->tv.tv_sec;
+	}
+
+	if (msg->tv.tv_sec - rl->start >= LOG_RATELIMIT_INTERVAL) {
+		if (rl->nr_suppressed) {
+			*note = *msg;
+			len = snprintf(note->str, MAX_MSG_SIZE,
+				       "%u similar messages were "
+				       "suppressed", rl->nr_suppressed);
+			note->str_len = min(len, MAX_MSG_SIZE - 1);
+			enqueue_msg(note);
+		}
+		rl->nr = 0;
+		rl->nr_suppressed = 0;
+		rl->start = msg->tv.tv_sec;
+	}
+
+	if (rl->nr++ < LOG_RATELIMIT_BURST)
+		return false;
+
+	rl->nr_suppressed++;
+	return true;
+}
+
 static void dolog(int prio, const char *func, int line,
 		const char *fmt, va_list ap)
 {
@@ -411,39 +631,17 @@ static void dolog(int prio, const char *func, int line,
 	}
 	msg->str_len = min(len, MAX_MSG_SIZE - 1);
 
+	/*
+	 * Only the message is formatted here.  The time, the thread name and
+	 * so on are kept in binary and formatted by the logger process.
+	 */
+	init_logmsg(msg, &tv, prio, func, line);
 	if (la) {
-		struct sembuf ops;
-
-		ops.sem_num = 0;
-		ops.sem_flg = SEM_UNDO;
-		ops.sem_op = -1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop up failed: %m");
-			return;
-		}
-
-		/* not enough space: drop msg */
-		if (len + sizeof(struct logmsg) + 1 > la->end - la->tail)
-			syslog(LOG_ERR, "enqueue: log area overrun, "
-			       "dropping message\n");
-		else {
-			/* ok, we can stage the msg in the area */
-			msg = (struct logmsg *)la->tail;
-			init_logmsg(msg, &tv, prio, func, line);
-			memcpy(msg->str, str, len + 1);
-			msg->str_len = len;
-			la->tail += sizeof(struct logmsg) + len + 1;
-		}
-
-		ops.sem_op = 1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop down failed: %m");
-			return;
-		}
+		if (!log_ratelimited(msg, func))
+			enqueue_msg(msg);
 	} else {
 		char str_final[MAX_MSG_SIZE];
 
-		init_logmsg(msg, &tv, prio, func, line);
 		len = format->formatter(str_final, sizeof(str_final) - 1, msg,
 					true);
 		str_final[len++] = '\n';
@@ -493,14 +691,37 @@ void log_write(int prio, const char *func, int line, const char *fmt, ...)
 	va_end(ap);
 }
 
-static void log_flush(void)
+struct log_stream {
+	const char *buf;
+	size_t len;
+	size_t done;
+};
+
+/* Copy the pending records of the ring to 'buf' */
+static size_t drain_ring(struct log_ring *ring, char *buf)
+{
+	unsigned long tail = ring->tail, head = uatomic_read(&ring->head);
+	size_t len = head - tail, off = tail % la->ring_size;
+	size_t first = min(len, la->ring_size - off);
+
+	/* read the records after the head, see ring_enqueue() */
+	cmm_smp_rmb();
+	memcpy(buf, ring->data + off, first);
+	memcpy(buf + first, ring->data, len - first);
+
+	cmm_smp_mb();
+	uatomic_set(&ring->tail, head);
+
+	return len;
+}
+
+static size_t drain_shared_area(char *buf)
 {
 	struct sembuf ops;
-	size_t size, done = 0;
-	const struct logmsg *msg;
+	size_t size;
 
 	if (la->tail == la->start)
-		return;
+		return 0;
 
 	ops.sem_num = 0;
 	ops.sem_flg = SEM_UNDO;
@@ -511,7 +732,7 @@ static void log_flush(void)
 	}
 
 	size = la->tail - la->start;
-	memcpy(log_buff, la->start, size);
+	memcpy(buf, la->start, size);
 	memset(la->start, 0, size);
 	la->tail = la->start;
 
@@ -521,10 +742,50 @@ static void log_flush(void)
 		exit(1);
 	}
 
-	while (done < size) {
-		msg = (const struct logmsg *)(log_buff + done);
+	return size;
+}
+
+/*
+ * Write out the records of all the rings and the shared area.  Each of them
+ * is in time order, so we merge them by time.
+ */
+static void log_flush(void)
+{
+	struct log_stream streams[LOG_NR_RINGS + 1];
+	char *p = log_buff;
+
+	for (int i = 0; i < LOG_NR_RINGS; i++) {
+		streams[i].buf = p;
+		streams[i].len = drain_ring(get_ring(i), p);
+		streams[i].done = 0;
+		p += la->ring_size;
+	}
+	streams[LOG_NR_RINGS].buf = p;
+	streams[LOG_NR_RINGS].len = drain_shared_area(p);
+	streams[LOG_NR_RINGS].done = 0;
+
+	while (true) {
+		const struct logmsg *msg = NULL;
+		struct log_stream *next = NULL;
+
+		for (int i = 0; i < ARRAY_SIZE(streams); i++) {
+			struct log_stream *s = streams + i;
+			const struct logmsg *m;
+
+			if (s->done == s->len)
+				continue;
+
+			m = (const struct logmsg *)(s->buf + s->done);
+			if (!msg || timercmp(&m->tv, &msg->tv, <)) {
+				msg = m;
+				next = s;
+			}
+		}
+		if (!msg)
+			break;
+
 		log_syslog(msg);
-		done += sizeof(*msg) + msg->str_len + 1;
+		next->done += logmsg_size(msg);
 	}
 }
 
@@ -563,7 +824,11 @@ static void logger(char *log_dir, char *outfile)
 {
 	int fd;
 
-	log_buff = xzalloc(la->end - la->start);
+	/* the rings belong to the threads of the sheep process */
+	my_ring = NULL;
+	no_ring = true;
+	log_buff = xzalloc(la->ring_size * LOG_NR_RINGS +
+			   (la->end - la->start));
 
 	if (dst_type == LOG_DST_DEFAULT) {
 		log_fd = open(outfile, O_CREAT | O_RDWR | O_APPEND, 0644);
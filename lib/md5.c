@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* MD5 Message-Digest Algorithm, a straightforward implementation of RFC 1321 */
+
+#include <string.h>
+
+#include "md5.h"
+#include "util.h"
+
+#define F(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)	((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z)	((x) ^ (y) ^ (z))
+#define I(x, y, z)	((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s)				\
+	do {							\
+		(a) += f((b), (c), (d)) + (x) + (t);		\
+		(a) = ((a) << (s)) | ((a) >> (32 - (s)));	\
+		(a) += (b);					\
+	} while (0)
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void md5_transform(uint32_t *state, const uint8_t *block)
+{
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t x[16];
+
+	for (int i = 0; i < 16; i++)
+		x[i] = get_le32(block + i * 4);
+
+	STEP(F, a, b, c, d, x[0], 0xd76aa478, 7);
+	STEP(F, d, a, b, c, x[1], 0xe8c7b756, 12);
+	STEP(F, c, d, a, b, x[2], 0x242070db, 17);
+	STEP(F, b, c, d, a, x[3], 0xc1bdceee, 22);
+	STEP(F, a, b, c, d, x[4], 0xf57c0faf, 7);
+	STEP(F, d, a, b, c, x[5], 0x4787c62a, 12);
+	STEP(F, c, d, a, b, x[6], 0xa8304613, 17);
+	STEP(F, b, c, d, a, x[7], 0xfd469501, 22);
+	STEP(F, a, b, c, d, x[8], 0x698098d8, 7);
+	STEP(F, d, a, b, c, x[9], 0x8b44f7af, 12);
+	STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17);
+	STEP(F, b, c, d, a, x[11], 0x895cd7be, 22);
+	STEP(F, a, b, c, d, x[12], 0x6b901122, 7);
+	STEP(F, d, a, b, c, x[13], 0xfd987193, 12);
+	STEP(F, c, d, a, b, x[14], 0xa679438e, 17);
+	STEP(F, b, c, d, a, x[15], 0x49b40821, 22);
+
+	STEP(G, a, b, c, d, x[1], 0xf61e2562, 5);
+	STEP(G, d, a, b, c, x[6], 0xc040b340, 9);
+	STEP(G, c, d, a, b, x[11], 0x265e5a51, 14);
+	STEP(G, b, c, d, a, x[0], 0xe9b6c7aa, 20);
+	STEP(G, a, b, c, d, x[5], 0xd62f105d, 5);
+	STEP(G, d, a, b, c, x[10], 0x02441453, 9);
+	STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14);
+	STEP(G, b, c, d, a, x[4], 0xe7d3fbc8, 20);
+	STEP(G, a, b, c, d, x[9], 0x21e1cde6, 5);
+	STEP(G, d, a, b, c, x[14], 0xc33707d6, 9);
+	STEP(G, c, d, a, b, x[3], 0xf4d50d87, 14);
+	STEP(G, b, c, d, a, x[8], 0x455a14ed, 20);
+	STEP(G, a, b, c, d, x[13], 0xa9e3e905, 5);
+	STEP(G, d, a, b, c, x[2], 0xfcefa3f8, 9);
+	STEP(G, c, d, a, b, x[7], 0x676f02d9, 14);
+	STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20);
+
+	STEP(H, a, b, c, d, x[5], 0xfffa3942, 4);
+	STEP(H, d, a, b, c, x[8], 0x8771f681, 11);
+	STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16);
+	STEP(H, b, c, d, a, x[14], 0xfde5380c, 23);
+	STEP(H, a, b, c, d, x[1], 0xa4beea44, 4);
+	STEP(H, d, a, b, c, x[4], 0x4bdecfa9, 11);
+	STEP(H, c, d, a, b, x[7], 0xf6bb4b60, 16);
+	STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23);
+	STEP(H, a, b, c, d, x[13], 0x289b7ec6, 4);
+	STEP(H, d, a, b, c, x[0], 0xeaa127fa, 11);
+	STEP(H, c, d, a, b, x[3], 0xd4ef3085, 16);
+	STEP(H, b, c, d, a, x[6], 0x04881d05, 23);
+	STEP(H, a, b, c, d, x[9], 0xd9d4d039, 4);
+	STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11);
+	STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16);
+	STEP(H, b, c, d, a, x[2], 0xc4ac5665, 23);
+
+	STEP(I, a, b, c, d, x[0], 0xf4292244, 6);
+	STEP(I, d, a, b, c, x[7], 0x432aff97, 10);
+	STEP(I, c, d, a, b, x[14], 0xab9423a7, 15);
+	STEP(I, b, c, d, a, x[5], 0xfc93a039, 21);
+	STEP(I, a, b, c, d, x[12], 0x655b59c3, 6);
+	STEP(I, d, a, b, c, x[3], 0x8f0ccc92, 10);
+	STEP(I, c, d, a, b, x[10], 0xffeff47d, 15);
+	STEP(I, b, c, d, a, x[1], 0x85845dd1, 21);
+	STEP(I, a, b, c, d, x[8], 0x6fa87e4f, 6);
+	STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10);
+	STEP(I, c, d, a, b, x[6], 0xa3014314, 15);
+	STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21);
+	STEP(I, a, b, c, d, x[4], 0xf7537e82, 6);
+	STEP(I, d, a, b, c, x[11], 0xbd3af235, 10);
+	STEP(I, c, d, a, b, x[2], 0x2ad7d2bb, 15);
+	STEP(I, b, c, d, a, x[9], 0xeb86d391, 21);
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+void md5_init(struct md5_ctx *ctx)
+{
+	ctx->count = 0;
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+}
+
+void md5_update(struct md5_ctx *ctx, const uint8_t *data, size_t len)
+{
+	size_t partial = ctx->count % MD5_BLOCK_SIZE, n;
+
+	ctx->count += len;
+
+	if (partial) {
+		n = min(len, MD5_BLOCK_SIZE - partial);
+		memcpy(ctx->buffer + partial, data, n);
+		data += n;
+		len -= n;
+		if (partial + n < MD5_BLOCK_SIZE)
+			return;
+		md5_transform(ctx->state, ctx->buffer);
+	}
+
+	for (; len >= MD5_BLOCK_SIZE; len -= MD5_BLOCK_SIZE) {
+		md5_transform(ctx->state, data);
+		data += MD5_BLOCK_SIZE;
+	}
+
+	memcpy(ctx->buffer, data, len);
+}
+
+void md5_final(struct md5_ctx *ctx, uint8_t *out)
+{
+	static const uint8_t padding[MD5_BLOCK_SIZE] = { 0x80 };
+	uint64_t bits = ctx->count << 3;
+	size_t partial = ctx->count % MD5_BLOCK_SIZE;
+	uint8_t len[8];
+
+	for (int i = 0; i < 8; i++)
+		len[i] = bits >> (i * 8);
+
+	/* pad to 56 mod 64 and append the length in bits */
+	md5_update(ctx, padding, partial < 56 ? 56 - partial : 120 - partial);
+	md5_update(ctx, len, sizeof(len));
+
+	for (int i = 0; i < 4; i++)
+		put_le32(out + i * 4, ctx->state[i]);
+
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+const char *md5_to_hex(const uint8_t *md5)
+{
+	static __thread char buffer[MD5_DIGEST_SIZE * 2 + 1];
+	static const char hex[] = "0123456789abcdef";
+	char *buf = buffer;
+
+	for (int i = 0; i < MD5_DIGEST_SIZE; i++) {
+		*buf++ = hex[md5[i] >> 4];
+		*buf++ = hex[md5[i] & 0xf];
+	}
+	*buf = '\0';
+
+	return buffer;
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Buffer pool
+ *
+ * The requests and the object data buffers are allocated and freed at a high
+ * rate, and often by different threads: a request is allocated by a net
+ * worker and freed by the main thread.  Going through malloc() for them costs
+ * the allocator locks and, with the mix of sizes up to the object size,
+ * fragmentation which bloats the RSS.
+ *
+ * Instead, the buffers are rounded up to a few size classes and kept on free
+ * lists after use.  Each thread has a small cache per class which is refilled
+ * from and drained to a global depot of the class in batches, so most of the
+ * allocations touch no shared state.  The depot is bounded and the surplus
+ * goes back to the system.  Buffers larger than the largest class aren't
+ * pooled.
+ *
+ * On a NUMA machine each node has its own depots, which the threads running
+ * on it drain to and refill from, so the buffers freed there are reused there
+ * and the new ones are first touched there.  A thread refills from the other
+ * nodes only when the depot of its own is empty.
+ *
+ * The large buffers can be carved out of an arena of huge pages instead of
+ * malloc(), see mempool_init_hugepages().  The arena is never given back: the
+ * surplus buffers of it go to a free list of their class, which the class
+ * takes from before it carves new ones.
+ *
+ * The caller must pass pool_free() the length it passed pool_alloc().
+ */
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mempool.h"
+#include "util.h"
+#include "list.h"
+#include "numa.h"
+
+struct pool_depot {
+	struct sd_mutex lock;
+	/* free buffers are linked through their first word */
+	void *bufs;
+	int nr_bufs;
+};
+
+struct pool_class {
+	size_t size;
+	int nr_local;	/* max buffers in a thread cache */
+	int nr_depot;	/* max buffers in the depot of a node */
+
+	struct pool_depot depot[MAX_NUMA_NODES];
+
+	/* protected by uatomic primitives */
+	uint64_t nr_total;
+	uint64_t nr_retired_alloc; /* allocations done by the exited threads */
+};
+
+#define POOL_CLASS(sz, local, depot)		\
+	{					\
+		.size = (sz),			\
+		.nr_local = (local),		\
+		.nr_depot = (depot),		\
+	}
+
+static struct pool_class classes[SD_NR_POOL_CLASSES] = {
+	POOL_CLASS(1024, 64, 8192),		/* struct request etc. */
+	POOL_CLASS(4096, 64, 4096),
+	POOL_CLASS(64 * 1024, 16, 512),
+	POOL_CLASS(512 * 1024, 4, 64),
+	POOL_CLASS(SD_DATA_OBJ_SIZE, 2, 16),
+};
+
+static uint64_t nr_oversize;
+
+/* the classes from this size on are backed by the arena */
+#define ARENA_MIN_SIZE (512 * 1024)
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static char *arena, *arena_end;
+static struct sd_mutex arena_lock = SD_MUTEX_INITIALIZER;
+static char *arena_next;			/* not carved yet */
+static void *arena_bufs[SD_NR_POOL_CLASSES];	/* given back */
+
+struct pool_cache {
+	struct list_node list;
+	int node;	/* the NUMA node of the depots */
+	void *bufs[SD_NR_POOL_CLASSES];
+	int nr_bufs[SD_NR_POOL_CLASSES];
+	uint64_t nr_alloc[SD_NR_POOL_CLASSES];
+};
+
+static LIST_HEAD(cache_list);
+static struct sd_mutex cache_lock = SD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread struct pool_cache *my_cache;
+
+static inline void buf_push(void **head, void *buf)
+{
+	*(void **)buf = *head;
+	*head = buf;
+}
+
+static inline void *buf_pop(void **head)
+{
+	void *buf = *head;
+
+	*head = *(void **)buf;
+	return buf;
+}
+
+static int size_to_class(size_t len)
+{
+	int i;
+
+	for (i = 0; i < SD_NR_POOL_CLASSES; i++)
+		if (len <= classes[i].size)
+			return i;
+	return -1;
+}
+
+static inline bool in_arena(const void *buf)
+{
+	return (const char *)buf >= arena && (const char *)buf < arena_end;
+}
+
+static void *alloc_arena(struct pool_class *c)
+{
+	int idx = c - classes;
+	void *buf = NULL;
+	char *p;
+
+	if (!arena || c->size < ARENA_MIN_SIZE)
+		return NULL;
+
+	sd_mutex_lock(&arena_lock);
+	if (arena_bufs[idx])
+		buf = buf_pop(&arena_bufs[idx]);
+	else {
+		/* don't let a huge page hold more than one buffer partially */
+		p = (char *)round_up((uintptr_t)arena_next,
+				     min(c->size, (size_t)HUGEPAGE_SIZE));
+		if (p + c->size <= arena_end) {
+			buf = p;
+			arena_next = p + c->size;
+		}
+	}
+	sd_mutex_unlock(&arena_lock);
+
+	return buf;
+}
+
+static void *alloc_system(struct pool_class *c)
+{
+	size_t align = c->size >= 4096 ? getpagesize() : 64;
+	void *buf = alloc_arena(c);
+
+	if (!buf && posix_memalign(&buf, align, c->size))
+		return NULL;
+	uatomic_inc(&c->nr_total);
+
+	return buf;
+}
+
+static void free_system(struct pool_class *c, void *buf)
+{
+	if (in_arena(buf)) {
+		sd_mutex_lock(&arena_lock);
+		buf_push(&arena_bufs[c - classes], buf);
+		sd_mutex_unlock(&arena_lock);
+	} else
+		free(buf);
+	uatomic_dec(&c->nr_total);
+}
+
+static void __attribute__((constructor)) init_depots(void)
+{
+	for (int i = 0; i < SD_NR_POOL_CLASSES; i++)
+		for (int j = 0; j < MAX_NUMA_NODES; j++)
+			sd_init_mutex(&classes[i].depot[j].lock);
+}
+
+/* Move 'nr' buffers from the thread cache to the depot of its node */
+static void drain_cache(struct pool_cache *pc, int idx, int nr)
+{
+	struct pool_class *c = classes + idx;
+	struct pool_depot *d = c->depot + pc->node;
+	void *buf, *surplus = NULL;
+
+	sd_mutex_lock(&d->lock);
+	while (nr-- > 0 && pc->bufs[idx]) {
+		buf = buf_pop(&pc->bufs[idx]);
+		pc->nr_bufs[idx]--;
+		if (d->nr_bufs < c->nr_depot) {
+			buf_push(&d->bufs, buf);
+			d->nr_bufs++;
+		} else
+			buf_push(&surplus, buf);
+	}
+	sd_mutex_unlock(&d->lock);
+
+	while (surplus)
+		free_system(c, buf_pop(&surplus));
+}
+
+static int refill_from(struct pool_cache *pc, int idx, struct pool_depot *d,
+		       int nr)
+{
+	/* peek without the lock, the depots of the other nodes are rarely used */
+	if (!d->bufs)
+		return nr;
+
+	sd_mutex_lock(&d->lock);
+	while (nr > 0 && d->bufs) {
+		buf_push(&pc->bufs[idx], buf_pop(&d->bufs));
+		d->nr_bufs--;
+		pc->nr_bufs[idx]++;
+		nr--;
+	}
+	sd_mutex_unlock(&d->lock);
+
+	return nr;
+}
+
+/* Refill from the depot of the node, or from the others if it's empty */
+static void refill_cache(struct pool_cache *pc, int idx)
+{
+	struct pool_class *c = classes + idx;
+	int nr = max(c->nr_local / 2, 1), nr_nodes = numa_nodes();
+
+	/* the thread may have moved to another node */
+	pc->node = numa_current_node();
+
+	nr = refill_from(pc, idx, c->depot + pc->node, nr);
+	for (int i = 1; i < nr_nodes && nr == max(c->nr_local / 2, 1); i++)
+		nr = refill_from(pc, idx,
+				 c->depot + (pc->node + i) % nr_nodes, nr);
+}
+
+static void cache_destructor(void *arg)
+{
+	struct pool_cache *pc = arg;
+	int i;
+
+	sd_mutex_lock(&cache_lock);
+	list_del(&pc->list);
+	sd_mutex_unlock(&cache_lock);
+
+	for (i = 0; i < SD_NR_POOL_CLASSES; i++) {
+		drain_cache(pc, i, pc->nr_bufs[i]);
+		uatomic_add(&classes[i].nr_retired_alloc, pc->nr_alloc[i]);
+	}
+	free(pc);
+	my_cache = NULL;
+}
+
+static void init_cache_key(void)
+{
+	if (pthread_key_create(&cache_key, cache_destructor))
+		panic("failed to create the key of the buffer pool");
+}
+
+static struct pool_cache *get_cache(void)
+{
+	if (likely(my_cache))
+		return my_cache;
+
+	pthread_once(&cache_once, init_cache_key);
+	my_cache = xzalloc(sizeof(*my_cache));
+	my_cache->node = numa_current_node();
+	pthread_setspecific(cache_key, my_cache);
+
+	sd_mutex_lock(&cache_lock);
+	list_add(&my_cache->list, &cache_list);
+	sd_mutex_unlock(&cache_lock);
+
+	return my_cache;
+}
+
+/* Returns a buffer of 'len' bytes, page aligned if 'len' is 4KB or larger */
+void *pool_alloc(size_t len)
+{
+	int idx = size_to_class(len);
+	struct pool_cache *pc;
+	void *buf;
+
+	if (idx < 0) {
+		uatomic_inc(&nr_oversize);
+		if (posix_memalign(&buf, getpagesize(), len))
+			return NULL;
+		return buf;
+	}
+
+	pc = get_cache();
+	pc->nr_alloc[idx]++;
+	if (!pc->bufs[idx])
+		refill_cache(pc, idx);
+	if (!pc->bufs[idx])
+		return alloc_system(classes + idx);
+
+	pc->nr_bufs[idx]--;
+	return buf_pop(&pc->bufs[idx]);
+}
+
+void *pool_zalloc(size_t len)
+{
+	void *buf = pool_alloc(len);
+
+	if (buf)
+		memset(buf, 0, len);
+	return buf;
+}
+
+void pool_free(void *buf, size_t len)
+{
+	int idx = size_to_class(len);
+	struct pool_cache *pc;
+
+	if (!buf)
+		return;
+
+	if (idx < 0) {
+		free(buf);
+		return;
+	}
+
+	pc = get_cache();
+	if (pc->nr_bufs[idx] >= classes[idx].nr_local)
+		drain_cache(pc, idx, max(classes[idx].nr_local / 2, 1));
+	buf_push(&pc->bufs[idx], buf);
+	pc->nr_bufs[idx]++;
+}
+
+/*
+ * Back the buffers of ARENA_MIN_SIZE and larger with an arena of size bytes of
+ * huge pages, from hugetlbfs if enough of them are reserved, or else of the
+ * transparent ones.  With prefault, the whole arena is faulted in now rather
+ * than by the first I/O of each buffer.  Called before the other threads are
+ * started.
+ */
+int mempool_init_hugepages(size_t size, bool prefault)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	const char *kind = "hugetlbfs";
+	char *p;
+
+	size = round_up(size, HUGEPAGE_SIZE);
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 flags | MAP_HUGETLB | (prefault ? MAP_POPULATE : 0), -1, 0);
+	if (p == MAP_FAILED) {
+		sd_info("no hugetlbfs pages for the buffer pool, %m");
+		kind = "transparent";
+
+		/* map one more huge page to align the arena to it */
+		p = mmap(NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+			 flags, -1, 0);
+		if (p == MAP_FAILED) {
+			sd_err("failed to map the buffer pool arena, %m");
+			return -1;
+		}
+		arena = (char *)round_up((uintptr_t)p, HUGEPAGE_SIZE);
+		if (arena != p)
+			munmap(p, arena - p);
+		munmap(arena + size, p + HUGEPAGE_SIZE - arena);
+		p = arena;
+
+		if (madvise(p, size, MADV_HUGEPAGE) < 0)
+			sd_warn("no transparent huge pages, %m");
+		if (prefault)
+			for (size_t off = 0; off < size; off += getpagesize())
+				p[off] = 0;
+	}
+
+	arena = arena_next = p;
+	arena_end = p + size;
+	sd_info("the buffer pool has an arena of %zu bytes of %s huge pages",
+		size, kind);
+
+	return 0;
+}
+
+/*
+ * Fill SD_NR_POOL_CLASSES entries of the size classes and the last entry,
+ * with zero size, of the oversized buffers.  The thread caches are read
+ * without their lock, so the numbers are approximate.
+ */
+void mempool_stat(struct s_pool *stat)
+{
+	struct pool_cache *pc;
+	int i;
+
+	for (i = 0; i < SD_NR_POOL_CLASSES; i++) {
+		struct pool_class *c = classes + i;
+
+		stat[i].size = c->size;
+		stat[i].nr_total = uatomic_read(&c->nr_total);
+		stat[i].nr_alloc = uatomic_read(&c->nr_retired_alloc);
+		stat[i].nr_free = 0;
+		for (int j = 0; j < numa_nodes(); j++) {
+			sd_mutex_lock(&c->depot[j].lock);
+			stat[i].nr_free += c->depot[j].nr_bufs;
+			sd_mutex_unlock(&c->depot[j].lock);
+		}
+	}
+
+	sd_mutex_lock(&cache_lock);
+	list_for_each_entry(pc, &cache_list, list) {
+		for (i = 0; i < SD_NR_POOL_CLASSES; i++) {
+			stat[i].nr_free += pc->nr_bufs[i];
+			stat[i].nr_alloc += pc->nr_alloc[i];
+		}
+	}
+	sd_mutex_unlock(&cache_lock);
+
+	memset(stat + SD_NR_POOL_CLASSES, 0, sizeof(*stat));
+	stat[SD_NR_POOL_CLASSES].nr_alloc = uatomic_read(&nr_oversize);
+}
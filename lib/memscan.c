@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The scans compare 'a' with 'b', or with zeros if 'b' is NULL.  The vector
+ * versions OR a block of vectors together to test them at once, and leave
+ * the block where they stopped, and the ends up to the cache line boundaries
+ * of 'a', to the word-wise version.  Loads which cross the cache lines would
+ * halve the speed of the scans.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memscan.h"
+
+typedef size_t (*scan_fn)(const uint8_t *a, const uint8_t *b, size_t len);
+
+static scan_fn scan_forward, scan_backward;
+
+static inline uint64_t load64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static size_t generic_scan_forward(const uint8_t *a, const uint8_t *b,
+				   size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8)
+		if (load64(a + i) != (b ? load64(b + i) : 0))
+			break;
+	for (; i < len; i++)
+		if (a[i] != (b ? b[i] : 0))
+			break;
+
+	return i;
+}
+
+static size_t generic_scan_backward(const uint8_t *a, const uint8_t *b,
+				    size_t len)
+{
+	size_t i = len;
+
+	for (; i >= 8; i -= 8)
+		if (load64(a + i - 8) != (b ? load64(b + i - 8) : 0))
+			break;
+	for (; i > 0; i--)
+		if (a[i - 1] != (b ? b[i - 1] : 0))
+			break;
+
+	return i;
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+#define SCAN_ALIGN 64
+
+/* the bytes of the buffer before the first cache line boundary */
+static inline size_t unaligned_head(const uint8_t *a, size_t len)
+{
+	size_t head = -(uintptr_t)a % SCAN_ALIGN;
+
+	return head < len ? head : len;
+}
+
+/* the bytes of the buffer after the last cache line boundary */
+static inline size_t unaligned_tail(const uint8_t *a, size_t len)
+{
+	size_t tail = (uintptr_t)(a + len) % SCAN_ALIGN;
+
+	return tail < len ? tail : len;
+}
+
+#define SSE2_BLOCK 64
+
+static inline __m128i sse2_load(const uint8_t *a, const uint8_t *b, int off)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)(a + off));
+
+	if (!b)
+		return v;
+	return _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)(b + off)));
+}
+
+/* whether a block differs, every x86_64 CPU has SSE2 */
+static inline bool sse2_block_differs(const uint8_t *a, const uint8_t *b)
+{
+	__m128i x = _mm_or_si128(_mm_or_si128(sse2_load(a, b, 0),
+					      sse2_load(a, b, 16)),
+				 _mm_or_si128(sse2_load(a, b, 32),
+					      sse2_load(a, b, 48)));
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) !=
+		0xffff;
+}
+
+/* the loops are split on 'b' so that the zero scans load only once */
+static size_t sse2_scan_forward(const uint8_t *a, const uint8_t *b,
+				size_t len)
+{
+	size_t head = unaligned_head(a, len);
+	size_t i = generic_scan_forward(a, b, head);
+
+	if (i < head)
+		return i;
+	if (b) {
+		for (; i + SSE2_BLOCK <= len; i += SSE2_BLOCK)
+			if (sse2_block_differs(a + i, b + i))
+				break;
+	} else {
+		for (; i + SSE2_BLOCK <= len; i += SSE2_BLOCK)
+			if (sse2_block_differs(a + i, NULL))
+				break;
+	}
+
+	return i + generic_scan_forward(a + i, b ? b + i : NULL, len - i);
+}
+
+static size_t sse2_scan_backward(const uint8_t *a, const uint8_t *b,
+				 size_t len)
+{
+	size_t tail = unaligned_tail(a, len);
+	size_t i = len - tail;
+
+	if (tail) {
+		size_t found = generic_scan_backward(a + i, b ? b + i : NULL,
+						     tail);
+		if (found)
+			return i + found;
+	}
+	if (b) {
+		for (; i >= SSE2_BLOCK; i -= SSE2_BLOCK)
+			if (sse2_block_differs(a + i - SSE2_BLOCK,
+					       b + i - SSE2_BLOCK))
+				break;
+	} else {
+		for (; i >= SSE2_BLOCK; i -= SSE2_BLOCK)
+			if (sse2_block_differs(a + i - SSE2_BLOCK, NULL))
+				break;
+	}
+
+	return generic_scan_backward(a, b, i);
+}
+
+#ifdef HAVE_AVX2
+
+#define AVX2_BLOCK 128
+
+static inline __attribute__((target("avx2"))) __m256i
+avx2_load(const uint8_t *a, const uint8_t *b, int off)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)(a + off));
+
+	if (!b)
+		return v;
+	return _mm256_xor_si256(v, _mm256_loadu_si256(
+					(const __m256i *)(b + off)));
+}
+
+static inline __attribute__((target("avx2"))) bool
+avx2_block_differs(const uint8_t *a, const uint8_t *b)
+{
+	__m256i x = _mm256_or_si256(_mm256_or_si256(avx2_load(a, b, 0),
+						    avx2_load(a, b, 32)),
+				    _mm256_or_si256(avx2_load(a, b, 64),
+						    avx2_load(a, b, 96)));
+
+	return !_mm256_testz_si256(x, x);
+}
+
+static __attribute__((target("avx2"))) size_t
+avx2_scan_forward(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t head = unaligned_head(a, len);
+	size_t i = generic_scan_forward(a, b, head);
+
+	if (i < head)
+		return i;
+	if (b) {
+		for (; i + AVX2_BLOCK <= len; i += AVX2_BLOCK)
+			if (avx2_block_differs(a + i, b + i))
+				break;
+	} else {
+		for (; i + AVX2_BLOCK <= len; i += AVX2_BLOCK)
+			if (avx2_block_differs(a + i, NULL))
+				break;
+	}
+
+	return i + generic_scan_forward(a + i, b ? b + i : NULL, len - i);
+}
+
+static __attribute__((target("avx2"))) size_t
+avx2_scan_backward(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t tail = unaligned_tail(a, len);
+	size_t i = len - tail;
+
+	if (tail) {
+		size_t found = generic_scan_backward(a + i, b ? b + i : NULL,
+						     tail);
+		if (found)
+			return i + found;
+	}
+	if (b) {
+		for (; i >= AVX2_BLOCK; i -= AVX2_BLOCK)
+			if (avx2_block_differs(a + i - AVX2_BLOCK,
+					       b + i - AVX2_BLOCK))
+				break;
+	} else {
+		for (; i >= AVX2_BLOCK; i -= AVX2_BLOCK)
+			if (avx2_block_differs(a + i - AVX2_BLOCK, NULL))
+				break;
+	}
+
+	return generic_scan_backward(a, b, i);
+}
+
+#endif /* HAVE_AVX2 */
+#endif /* __x86_64__ */
+
+size_t find_nonzero(const void *buf, size_t len)
+{
+	return scan_forward(buf, NULL, len);
+}
+
+size_t find_last_nonzero(const void *buf, size_t len)
+{
+	return scan_backward(buf, NULL, len);
+}
+
+size_t find_mismatch(const void *a, const void *b, size_t len)
+{
+	return scan_forward(a, b, len);
+}
+
+size_t find_last_mismatch(const void *a, const void *b, size_t len)
+{
+	return scan_backward(a, b, len);
+}
+
+static void __attribute__((constructor)) __memscan_init(void)
+{
+	scan_forward = generic_scan_forward;
+	scan_backward = generic_scan_backward;
+#ifdef __x86_64__
+	scan_forward = sse2_scan_forward;
+	scan_backward = sse2_scan_backward;
+#ifdef HAVE_AVX2
+	if (cpu_has_avx2 && avx_usable()) {
+		scan_forward = avx2_scan_forward;
+		scan_backward = avx2_scan_backward;
+	}
+#endif
+#endif
+}
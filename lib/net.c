@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +27,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <linux/errqueue.h>
 
 #include "sheepdog_proto.h"
 #include "sheep.h"
@@ -200,8 +202,10 @@ reconnect:
 			sd_err("%m");
 			close(fd);
 			break;
-		} else
+		} else {
+			set_busy_poll_sock(fd);
 			goto success;
+		}
 	}
 	fd = -1;
 success:
@@ -210,13 +214,94 @@ success:
 	return fd;
 }
 
-int do_read(int sockfd, void *buf, uint32_t len,
-	    bool (*need_retry)(uint32_t epoch),
-	    uint32_t epoch, uint32_t max_count)
+/*
+ * Start connecting to the numeric address name:port without waiting for it.
+ * The connection is up once the returned nonblocking fd gets writable with no
+ * SO_ERROR.
+ */
+int connect_to_nonblock(const char *name, int port)
+{
+	char buf[64];
+	struct addrinfo hints = {
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV,
+	}, *res;
+	int fd, ret;
+
+	snprintf(buf, sizeof(buf), "%d", port);
+	ret = getaddrinfo(name, buf, &hints, &res);
+	if (ret) {
+		sd_err("failed to get address info of %s, %s", name,
+		       gai_strerror(ret));
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK |
+		    SOCK_CLOEXEC, res->ai_protocol);
+	if (fd < 0) {
+		sd_err("failed to create socket, %m");
+		goto out;
+	}
+	set_nodelay(fd);
+
+	ret = connect(fd, res->ai_addr, res->ai_addrlen);
+	if (ret < 0 && errno != EINPROGRESS) {
+		sd_debug("failed to connect to %s:%d, %m", name, port);
+		close(fd);
+		fd = -1;
+	}
+out:
+	freeaddrinfo(res);
+	return fd;
+}
+
+static ssize_t libc_sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+	return sendmsg(sockfd, msg, flags);
+}
+
+static ssize_t libc_recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+	return recvmsg(sockfd, msg, flags);
+}
+
+static const struct net_transport libc_transport = {
+	.name = "libc",
+	.sendmsg = libc_sendmsg,
+	.recvmsg = libc_recvmsg,
+};
+
+static const struct net_transport *transport = &libc_transport;
+
+/*
+ * Replace the socket calls of the data path, e.g. with the ones of a
+ * user-space TCP stack.  Must be called before any connection is set up.
+ */
+void set_net_transport(const struct net_transport *t)
+{
+	transport = t ? t : &libc_transport;
+	sd_debug("%s", transport->name);
+}
+
+static void forward_iov(struct msghdr *msg, int len)
+{
+	while (msg->msg_iov->iov_len <= len) {
+		len -= msg->msg_iov->iov_len;
+		msg->msg_iov++;
+		msg->msg_iovlen--;
+	}
+
+	msg->msg_iov->iov_base = (char *) msg->msg_iov->iov_base + len;
+	msg->msg_iov->iov_len -= len;
+}
+
+static int do_readv(int sockfd, struct msghdr *msg, uint32_t len,
+		    bool (*need_retry)(uint32_t epoch),
+		    uint32_t epoch, uint32_t max_count)
 {
 	int ret, repeat = max_count;
 reread:
-	ret = read(sockfd, buf, len);
+	ret = transport->recvmsg(sockfd, msg, 0);
 	if (ret == 0) {
 		sd_debug("connection is closed (%d bytes left)", len);
 		return 1;
@@ -239,33 +324,88 @@ reread:
 	}
 
 	len -= ret;
-	buf = (char *)buf + ret;
-	if (len)
+	if (len) {
+		forward_iov(msg, ret);
 		goto reread;
+	}
 
 	return 0;
 }
 
-static void forward_iov(struct msghdr *msg, int len)
+int do_read(int sockfd, void *buf, uint32_t len,
+	    bool (*need_retry)(uint32_t epoch),
+	    uint32_t epoch, uint32_t max_count)
 {
-	while (msg->msg_iov->iov_len <= len) {
-		len -= msg->msg_iov->iov_len;
-		msg->msg_iov++;
-		msg->msg_iovlen--;
-	}
+	struct msghdr msg;
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
 
-	msg->msg_iov->iov_base = (char *) msg->msg_iov->iov_base + len;
-	msg->msg_iov->iov_len -= len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	return do_readv(sockfd, &msg, len, need_retry, epoch, max_count);
 }
 
+/*
+ * do_read() which also takes the fds passed with the data on a unix domain
+ * socket, up to 'max_fds' of them and the others are closed.  Returns the
+ * number of the fds, or -1 on failure.
+ */
+int do_read_fds(int sockfd, void *buf, uint32_t len, int *fds, int max_fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * 8)];
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	int ret, nr = 0;
+
+	do {
+		ret = transport->recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+	if (ret <= 0) {
+		sd_debug("failed to read from socket: %d, %m", ret);
+		return -1;
+	}
+
+	/* the fds come with the first byte */
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *p = (int *)CMSG_DATA(cmsg);
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		for (int i = 0; i < n; i++) {
+			if (nr < max_fds)
+				fds[nr++] = p[i];
+			else
+				close(p[i]);
+		}
+	}
+
+	if (ret < len && do_read(sockfd, (char *)buf + ret, len - ret, NULL, 0,
+				 UINT32_MAX)) {
+		for (int i = 0; i < nr; i++)
+			close(fds[i]);
+		return -1;
+	}
+
+	return nr;
+}
 
-static int do_write(int sockfd, struct msghdr *msg, int len,
+/* 'nr_sent' is set to the number of the successful sendmsg() calls if given */
+static int do_write(int sockfd, struct msghdr *msg, int len, int flags,
 		    bool (*need_retry)(uint32_t), uint32_t epoch,
-		    uint32_t max_count)
+		    uint32_t max_count, uint32_t *nr_sent)
 {
 	int ret, repeat = max_count;
 rewrite:
-	ret = sendmsg(sockfd, msg, 0);
+	ret = transport->sendmsg(sockfd, msg, flags);
 	if (ret < 0) {
 		if (errno == EINTR)
 			goto rewrite;
@@ -283,6 +423,8 @@ rewrite:
 		return 1;
 	}
 
+	if (nr_sent)
+		(*nr_sent)++;
 	len -= ret;
 	if (len) {
 		forward_iov(msg, ret);
@@ -314,8 +456,8 @@ int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 		iov[1].iov_len = wlen;
 	}
 
-	ret = do_write(sockfd, &msg, sizeof(*hdr) + wlen, need_retry, epoch,
-		       max_count);
+	ret = do_write(sockfd, &msg, sizeof(*hdr) + wlen, 0, need_retry, epoch,
+		       max_count, NULL);
 	if (ret) {
 		sd_err("failed to send request %x, %d: %m", hdr->opcode, wlen);
 		ret = -1;
@@ -324,17 +466,276 @@ int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	return ret;
 }
 
+/*
+ * Send the messages of several requests (or responses) on one socket with a
+ * single sendmsg() call, 'iov' holding the header and the data of each in
+ * turn.  MSG_MORE tells the kernel that more follows shortly, so it doesn't
+ * push out a partial segment, e.g. before a zerocopy send.
+ */
+int send_reqs(int sockfd, struct iovec *iov, int iovcnt, bool more)
+{
+	struct msghdr msg;
+	int i, len = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (do_write(sockfd, &msg, len, more ? MSG_MORE : 0, NULL, 0,
+		     UINT32_MAX, NULL)) {
+		sd_err("failed to send %d bytes: %m", len);
+		return -1;
+	}
+
+	return 0;
+}
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+
+/*
+ * Collect the MSG_ZEROCOPY completions on the error queue of the connection
+ *
+ * The queue raises EPOLLERR, so both the event handler of the connection and
+ * the sender waiting for its completions read it, and the completions are
+ * counted in the connection.  Returns -1 if the queue holds a real error.
+ */
+static int recv_zerocopy(struct connection *conn, bool *copied)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	int ret;
+
+	while (true) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ret = recvmsg(conn->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			sd_err("failed to read the error queue: %m");
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP &&
+			       cm->cmsg_type == IP_RECVERR) ||
+			      (cm->cmsg_level == SOL_IPV6 &&
+			       cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+			    serr->ee_errno != 0) {
+				sd_err("error on the socket: %s",
+				       strerror(serr->ee_errno));
+				return -1;
+			}
+
+			uatomic_add(&conn->zc_done,
+				    serr->ee_data - serr->ee_info + 1);
+			if (copied && (serr->ee_code &
+				       SO_EE_CODE_ZEROCOPY_COPIED))
+				*copied = true;
+		}
+	}
+}
+
+/*
+ * Wait for the kernel to release the pages of the MSG_ZEROCOPY sends of the
+ * connection
+ *
+ * 'copied' is set if the kernel fell back on copying the data (e.g. for the
+ * loopback device), in which case MSG_ZEROCOPY is pure overhead.  The event
+ * handler may take the completions off the queue before us, so poll in short
+ * slices rather than for the whole timeout.
+ */
+static int wait_zerocopy(struct connection *conn, bool *copied)
+{
+	struct pollfd pfd = { .fd = conn->fd };
+	int ret, slices = MAX_POLLTIME * 100;
+
+	while ((int32_t)(uatomic_read(&conn->zc_done) - conn->zc_sent) < 0) {
+		if (recv_zerocopy(conn, copied) < 0)
+			return -1;
+		if ((int32_t)(uatomic_read(&conn->zc_done) -
+			      conn->zc_sent) >= 0)
+			break;
+		if (slices-- == 0) {
+			sd_err("zerocopy completion timed out");
+			return -1;
+		}
+		/* the error queue is reported as POLLERR */
+		ret = poll(&pfd, 1, 10);
+		if (ret < 0 && errno != EINTR) {
+			sd_err("failed to poll the error queue: %m");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Send a request (or a response) without copying 'data' into the socket
+ * buffer
+ *
+ * Returns after the kernel doesn't reference 'data' anymore, so the caller
+ * can free it as usual.  The socket must have been set up by set_zerocopy(),
+ * and only one thread may send on the connection at a time.
+ */
+int send_req_zerocopy(struct connection *conn, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool *copied)
+{
+	struct msghdr msg;
+	struct iovec iov[2];
+	uint32_t nr_sent = 0;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(*hdr);
+	iov[1].iov_base = data;
+	iov[1].iov_len = wlen;
+
+	ret = do_write(conn->fd, &msg, sizeof(*hdr) + wlen, MSG_ZEROCOPY,
+		       NULL, 0, UINT32_MAX, &nr_sent);
+	uatomic_add(&conn->zc_sent, nr_sent);
+	/* wait even on failure, the pages of the partial sends are pinned */
+	if (wait_zerocopy(conn, copied) < 0 || ret) {
+		sd_err("failed to send request %x, %d: %m", hdr->opcode, wlen);
+		return -1;
+	}
+
+	return 0;
+}
+
+int set_zerocopy(int fd)
+{
+	int opt = 1;
+
+	return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt));
+}
+
+#else
+
+static int recv_zerocopy(struct connection *conn, bool *copied)
+{
+	return -1;
+}
+
+int send_req_zerocopy(struct connection *conn, struct sd_req *hdr, void *data,
+		      unsigned int wlen, bool *copied)
+{
+	return send_req(conn->fd, hdr, data, wlen, NULL, 0, UINT32_MAX);
+}
+
+int set_zerocopy(int fd)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+#endif
+
+/*
+ * Tell whether EPOLLERR on the connection is a real error
+ *
+ * The MSG_ZEROCOPY completions raise EPOLLERR on a healthy connection too.
+ * Those are taken off the error queue here, so the event doesn't fire again.
+ */
+bool conn_error(struct connection *conn)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+		return true;
+	/* no zerocopy send, nothing but an error raises EPOLLERR */
+	if (uatomic_read(&conn->zc_sent) == 0)
+		return true;
+
+	return recv_zerocopy(conn, NULL) < 0;
+}
+
+/*
+ * Read the response header and its data with the same recvmsg() calls
+ *
+ * The socket must not be shared with other requests, so nothing but the
+ * response can follow.  The data can be shorter than 'rlen', so the length to
+ * wait for is adjusted once the header has arrived.
+ */
+int recv_rsp(int sockfd, struct sd_rsp *rsp, void *data, uint32_t rlen,
+	     bool (*need_retry)(uint32_t epoch), uint32_t epoch,
+	     uint32_t max_count)
+{
+	int ret, repeat = max_count;
+	uint32_t done = 0, len = sizeof(*rsp) + rlen;
+	bool hdr_done = false;
+	struct msghdr msg;
+	struct iovec iov[2];
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = rlen ? 2 : 1;
+	iov[0].iov_base = rsp;
+	iov[0].iov_len = sizeof(*rsp);
+	iov[1].iov_base = data;
+	iov[1].iov_len = rlen;
+reread:
+	ret = transport->recvmsg(sockfd, &msg, 0);
+	if (ret == 0) {
+		sd_debug("connection is closed (%d bytes left)", len - done);
+		return 1;
+	}
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto reread;
+		if (errno == EAGAIN && repeat &&
+		    (need_retry == NULL || need_retry(epoch))) {
+			repeat--;
+			goto reread;
+		}
+
+		sd_err("failed to read from socket: %d, %m", ret);
+		return 1;
+	}
+
+	done += ret;
+	if (!hdr_done && done >= sizeof(*rsp)) {
+		hdr_done = true;
+		if (rlen > rsp->data_length)
+			len = sizeof(*rsp) + rsp->data_length;
+	}
+	if (done < len) {
+		forward_iov(&msg, ret);
+		goto reread;
+	}
+
+	return 0;
+}
+
 int exec_req(int sockfd, struct sd_req *hdr, void *data,
 	     bool (*need_retry)(uint32_t epoch), uint32_t epoch,
 	     uint32_t max_count)
 {
-	int ret;
 	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
 	unsigned int wlen, rlen;
 
 	if (hdr->flags & SD_FLAG_CMD_WRITE) {
 		wlen = hdr->data_length;
-		if (hdr->flags & SD_FLAG_CMD_PIGGYBACK)
+		if (is_obj_vec_req(hdr))
+			rlen = hdr->vec.rlen;
+		else if (hdr->flags & SD_FLAG_CMD_PIGGYBACK)
 			rlen = hdr->data_length;
 		else
 			rlen = 0;
@@ -346,23 +747,11 @@ int exec_req(int sockfd, struct sd_req *hdr, void *data,
 	if (send_req(sockfd, hdr, data, wlen, need_retry, epoch, max_count))
 		return 1;
 
-	ret = do_read(sockfd, rsp, sizeof(*rsp), need_retry, epoch, max_count);
-	if (ret) {
+	if (recv_rsp(sockfd, rsp, data, rlen, need_retry, epoch, max_count)) {
 		sd_err("failed to read a response");
 		return 1;
 	}
 
-	if (rlen > rsp->data_length)
-		rlen = rsp->data_length;
-
-	if (rlen) {
-		ret = do_read(sockfd, data, rlen, need_retry, epoch, max_count);
-		if (ret) {
-			sd_err("failed to read the response data");
-			return 1;
-		}
-	}
-
 	return 0;
 }
 
@@ -491,6 +880,24 @@ int set_nodelay(int fd)
 	return ret;
 }
 
+/* Busy-poll the socket for the window of set_busy_poll() if there is one */
+int set_busy_poll_sock(int fd)
+{
+#ifdef SO_BUSY_POLL
+	int usec = get_busy_poll();
+
+	if (!usec)
+		return 0;
+
+	/* raising it over net.core.busy_read needs CAP_NET_ADMIN */
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0) {
+		sd_debug("%m");
+		return -1;
+	}
+#endif
+	return 0;
+}
+
 /*
  * Timeout after request is issued after 5s.
  *
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NUMA topology
+ *
+ * The nodes and their CPUs are read from sysfs at startup, so no libnuma is
+ * needed.  Without sysfs, or on a machine with a single node, everything is
+ * node 0.  The node of a device is the one sysfs reports for the closest of
+ * its ancestors which has one, e.g. the PCI function of a NIC or an NVMe
+ * controller, and -1 if there is none, e.g. for a virtual device.
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "numa.h"
+#include "util.h"
+#include "logger.h"
+
+static int nr_numa_nodes = 1;
+static cpu_set_t node_cpus[MAX_NUMA_NODES];
+static uint8_t cpu_node[CPU_SETSIZE];
+
+/* Parse a cpulist of sysfs like "0-3,8-11" */
+static void parse_cpulist(const char *list, int node)
+{
+	const char *p = list;
+
+	while (*p && *p != '\n') {
+		char *end;
+		long first = strtol(p, &end, 10), last = first;
+
+		if (end == p)
+			break;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &node_cpus[node]);
+			cpu_node[cpu] = node;
+		}
+		p = *end == ',' ? end + 1 : end;
+	}
+}
+
+static void __attribute__((constructor)) init_numa(void)
+{
+	char path[PATH_MAX], buf[4096];
+	int node, fd;
+	ssize_t len;
+
+	for (node = 0; node < MAX_NUMA_NODES; node++) {
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			break;
+		len = xread(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			break;
+		buf[len] = '\0';
+		parse_cpulist(buf, node);
+	}
+	nr_numa_nodes = max(node, 1);
+	if (node == 0)
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &node_cpus[0]);
+}
+
+int numa_nodes(void)
+{
+	return nr_numa_nodes;
+}
+
+int numa_node_of_cpu(int cpu)
+{
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return 0;
+	return cpu_node[cpu];
+}
+
+/* The node the calling thread runs on now */
+int numa_current_node(void)
+{
+	if (nr_numa_nodes == 1)
+		return 0;
+	return numa_node_of_cpu(sched_getcpu());
+}
+
+/* Walk up the sysfs directory 'dir' to the first numa_node */
+static int numa_node_of_sysfs(const char *dir)
+{
+	char path[PATH_MAX], *slash;
+	int node = -1, fd;
+
+	if (!realpath(dir, path))
+		return -1;
+
+	while (strncmp(path, "/sys/devices/", strlen("/sys/devices/")) == 0) {
+		char file[PATH_MAX + 16], buf[16];
+		ssize_t len;
+
+		snprintf(file, sizeof(file), "%s/numa_node", path);
+		fd = open(file, O_RDONLY);
+		if (fd >= 0) {
+			len = xread(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			if (len > 0) {
+				buf[len] = '\0';
+				node = atoi(buf);
+			}
+			break;
+		}
+
+		slash = strrchr(path, '/');
+		if (!slash)
+			break;
+		*slash = '\0';
+	}
+
+	return node < nr_numa_nodes ? node : -1;
+}
+
+/* The node of the block device holding 'path' */
+int numa_node_of_path(const char *path)
+{
+	char dir[PATH_MAX];
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+
+	snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u", major(st.st_dev),
+		 minor(st.st_dev));
+	return numa_node_of_sysfs(dir);
+}
+
+int numa_node_of_netdev(const char *ifname)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "/sys/class/net/%s", ifname);
+	return numa_node_of_sysfs(dir);
+}
+
+/*
+ * The node of the NIC with the address 'addr', in the 16 bytes form of struct
+ * node_id
+ */
+int numa_node_of_addr(const uint8_t *addr)
+{
+	static const uint8_t v4_prefix[12];
+	struct ifaddrs *ifaddr, *ifa;
+	int node = -1;
+
+	if (getifaddrs(&ifaddr) < 0)
+		return -1;
+
+	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+		const void *a;
+
+		if (!ifa->ifa_addr)
+			continue;
+
+		switch (ifa->ifa_addr->sa_family) {
+		case AF_INET:
+			if (memcmp(addr, v4_prefix, sizeof(v4_prefix)))
+				continue;
+			a = &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+			if (memcmp(addr + 12, a, 4))
+				continue;
+			break;
+		case AF_INET6:
+			a = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+			if (memcmp(addr, a, 16))
+				continue;
+			break;
+		default:
+			continue;
+		}
+
+		node = numa_node_of_netdev(ifa->ifa_name);
+		break;
+	}
+
+	freeifaddrs(ifaddr);
+	return node;
+}
+
+/* Run the calling thread on the CPUs of 'node', or on all of them if -1 */
+int numa_bind_thread(int node)
+{
+	cpu_set_t all;
+
+	if (node < 0 || node >= nr_numa_nodes) {
+		CPU_ZERO(&all);
+		for (int i = 0; i < nr_numa_nodes; i++)
+			CPU_OR(&all, &all, &node_cpus[i]);
+		return sched_setaffinity(0, sizeof(all), &all);
+	}
+
+	return sched_setaffinity(0, sizeof(node_cpus[node]), &node_cpus[node]);
+}
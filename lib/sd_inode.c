@@ -107,6 +107,7 @@ struct find_path {
 	struct sd_index *p_index;
 	struct sd_index_header *p_index_header;
 	int depth;
+	bool borrowed; /* p_index_header belongs to the reader */
 };
 
 struct sd_inode_actor {
@@ -235,96 +236,242 @@ static void dump_btree(struct sd_inode *inode)
 }
 
 /*
- * This is the cache for inode and ext-node (B-tree), so we name it 'icache'.
+ * This is the write-back cache for ext-node (B-tree) used while setting a batch
+ * of indexes, so we name it 'icache'.  The B-tree functions modify the cached
+ * nodes in place and every dirty node is written out once, at the end of the
+ * batch or when the cache grows over ICACHE_SIZE between two indexes.
+ *
  * Cache of the same inode and ext-node dose not support concurrent operations
- * so it could only be used in sd_inode_set_vid() which will be protected by
- * distributed lock and should be released in the end of sd_inode_set_vid().
+ * so it could only be used in sd_inode_set_vid_range() and sd_inode_set_vids()
+ * which will be protected by distributed lock.
  */
-
-/* no rationale */
-#define NUMBER_OF_CACHE	4
+#define ICACHE_SIZE	32
+/* setting an index may read one node and create up to two */
+#define ICACHE_SLACK	4
 
 struct inode_cache {
 	uint64_t oid;
-	unsigned char mem[SD_INODE_DATA_INDEX_SIZE];
-} cache_array[NUMBER_OF_CACHE];
-static int cache_idx;
+	bool dirty;
+	bool create;
+	void *mem;
+};
 
-static void icache_writeout(int copies, int policy)
+static __thread struct inode_cache cache_array[ICACHE_SIZE + ICACHE_SLACK];
+static __thread int cache_idx;
+
+static void icache_release(int copies, int policy)
 {
 	int i;
 	for (i = 0; i < cache_idx; i++) {
-		inode_actor.writer(cache_array[i].oid, cache_array[i].mem,
-				   SD_INODE_DATA_INDEX_SIZE, 0, 0, copies,
-				   policy, false, false);
+		if (cache_array[i].dirty)
+			inode_actor.writer(cache_array[i].oid,
+					   cache_array[i].mem,
+					   SD_INODE_DATA_INDEX_SIZE, 0, 0,
+					   copies, policy,
+					   cache_array[i].create, false);
+		free(cache_array[i].mem);
 	}
-}
-
-static void icache_release(int copies, int policy)
-{
-	icache_writeout(copies, policy);
 	cache_idx = 0; /* reset icache */
 }
 
-static void icache_insert(int copies, int policy,
-			  uint64_t oid, void *mem)
+static struct inode_cache *icache_find(uint64_t oid)
 {
 	int i;
 	for (i = 0; i < cache_idx; i++) {
-		if (oid == cache_array[i].oid) {
-			memcpy(cache_array[i].mem, mem,
-			       SD_INODE_DATA_INDEX_SIZE);
-			return;
-		}
+		if (cache_array[i].oid == oid)
+			return cache_array + i;
 	}
+	return NULL;
+}
 
-	if (cache_idx == (NUMBER_OF_CACHE - 1)) {
-		sd_debug("cache for B-tree is full, so write all out");
-		icache_release(copies, policy);
-	}
+/* Takes the ownership of mem which must be an entire ext-node */
+static struct inode_cache *icache_insert(uint64_t oid, void *mem)
+{
+	struct inode_cache *cache;
+
+	if (cache_idx == ICACHE_SIZE + ICACHE_SLACK)
+		panic("cache for B-tree is full");
 
-	/* insert new cache */
-	cache_array[cache_idx].oid = oid;
-	memcpy(cache_array[cache_idx].mem, mem, SD_INODE_DATA_INDEX_SIZE);
-	cache_idx++;
+	cache = cache_array + cache_idx++;
+	cache->oid = oid;
+	cache->dirty = false;
+	cache->create = false;
+	cache->mem = mem;
+
+	return cache;
 }
 
-static void *icache_find(uint64_t oid)
+static struct inode_cache *icache_read(uint64_t oid, int *ret)
 {
-	int i;
-	for (i = 0; i < cache_idx; i++) {
-		if (cache_array[i].oid == oid)
-			return cache_array[i].mem;
+	void *mem = xvalloc(SD_INODE_DATA_INDEX_SIZE), *tmp = mem;
+
+	*ret = inode_actor.reader(oid, &tmp, SD_INODE_DATA_INDEX_SIZE, 0);
+	if (*ret != SD_RES_SUCCESS) {
+		free(mem);
+		return NULL;
 	}
-	return NULL;
+
+	return icache_insert(oid, mem);
 }
 
 static int icache_writer(uint64_t id, void *mem, unsigned int len,
 			 uint64_t offset, uint32_t flags, int copies,
 			 int copy_policy, bool create, bool direct)
 {
-	/* Only try to cache entire ext-node */
-	if (!offset && !create && !direct && len == SD_INODE_DATA_INDEX_SIZE) {
-		icache_insert(copies, copy_policy, id, mem);
-		return SD_RES_SUCCESS;
+	struct inode_cache *cache = icache_find(id);
+	int ret;
+
+	if (direct)
+		goto out;
+
+	if (!cache && !offset && len == SD_INODE_DATA_INDEX_SIZE) {
+		cache = icache_insert(id, xvalloc(len));
+		cache->create = create;
+		memcpy(cache->mem, mem, len);
+	} else {
+		if (!cache) {
+			cache = icache_read(id, &ret);
+			if (!cache)
+				goto out;
+		}
+		if (cache->mem != mem)
+			memcpy((char *)cache->mem + offset, mem, len);
 	}
+
+	cache->dirty = true;
+	return SD_RES_SUCCESS;
+out:
 	return inode_actor.writer(id, mem, len, offset, flags, copies,
 				  copy_policy, create, direct);
 }
 
+/*
+ * An entire ext-node is not copied but lent: *mem is replaced with the cached
+ * node, which stays valid until icache_release().
+ */
 static int icache_reader(uint64_t id, void **mem, unsigned int len,
 			 uint64_t offset)
 {
-	void *data;
+	struct inode_cache *cache = icache_find(id);
+	int ret;
+
+	if (!cache) {
+		if (offset || len != SD_INODE_DATA_INDEX_SIZE)
+			return inode_actor.reader(id, mem, len, offset);
+		cache = icache_read(id, &ret);
+		if (!cache)
+			return ret;
+	}
+
+	if (!offset && len == SD_INODE_DATA_INDEX_SIZE)
+		*mem = cache->mem;
+	else
+		memcpy(*mem, (char *)cache->mem + offset, len);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Read cache of the B-tree ext-nodes for sd_inode_get_vid(), so that lookups in
+ * a hypervolume don't read a whole ext-node for every index.  Unlike icache it
+ * persists across calls and is shared by all threads, so it is bounded and
+ * evicts the least recently used node.
+ *
+ * Other gateways, dog and qemu update the B-trees too, so the nodes of a vdi
+ * are only trusted until its inode is loaded again: they are dropped when the
+ * inode is read or written, when one of its ext-nodes is written (see
+ * sd_inode_invalidate_cache_oid()), when the B-tree is modified through this
+ * process and on inode coherence messages.  The generation keeps a lookup
+ * which raced with an invalidation from inserting the node it read before.
+ */
+#define BNODE_CACHE_SIZE	8
+
+struct bnode_cache_entry {
+	struct rb_node rb;
+	struct list_node lru;
+	uint64_t oid;
+	struct sd_index_header *node;
+};
+
+static struct rb_root bnode_cache_root = RB_ROOT;
+static LIST_HEAD(bnode_cache_lru);
+static int nr_bnode_cache;
+static uint64_t bnode_cache_generation;
+static struct sd_mutex bnode_cache_lock = SD_MUTEX_INITIALIZER;
+
+static int bnode_cache_cmp(const struct bnode_cache_entry *a,
+			   const struct bnode_cache_entry *b)
+{
+	return intcmp(a->oid, b->oid);
+}
 
-	if (!offset && len == SD_INODE_DATA_INDEX_SIZE) {
-		data = icache_find(id);
-		if (data) {
-			memcpy(*mem, data, len);
-			return SD_RES_SUCCESS;
-		}
+static void bnode_cache_remove(struct bnode_cache_entry *entry)
+{
+	rb_erase(&entry->rb, &bnode_cache_root);
+	list_del(&entry->lru);
+	nr_bnode_cache--;
+	free(entry->node);
+	free(entry);
+}
+
+static uint64_t bnode_cache_get_generation(void)
+{
+	uint64_t gen;
+
+	sd_mutex_lock(&bnode_cache_lock);
+	gen = bnode_cache_generation;
+	sd_mutex_unlock(&bnode_cache_lock);
+
+	return gen;
+}
+
+/* Takes the ownership of node when it returns true */
+static bool bnode_cache_insert(uint64_t oid, struct sd_index_header *node,
+			       uint64_t gen)
+{
+	struct bnode_cache_entry *entry = xmalloc(sizeof(*entry));
+
+	entry->oid = oid;
+	entry->node = node;
+
+	sd_mutex_lock(&bnode_cache_lock);
+	if (gen != bnode_cache_generation ||
+	    rb_insert(&bnode_cache_root, entry, rb, bnode_cache_cmp)) {
+		sd_mutex_unlock(&bnode_cache_lock);
+		free(entry);
+		return false;
+	}
+	list_add_tail(&entry->lru, &bnode_cache_lru);
+	if (++nr_bnode_cache > BNODE_CACHE_SIZE)
+		bnode_cache_remove(list_first_entry(&bnode_cache_lru,
+						    struct bnode_cache_entry,
+						    lru));
+	sd_mutex_unlock(&bnode_cache_lock);
+
+	return true;
+}
+
+void sd_inode_invalidate_cache(uint32_t vid)
+{
+	struct bnode_cache_entry *entry;
+
+	sd_mutex_lock(&bnode_cache_lock);
+	bnode_cache_generation++;
+	rb_for_each_entry(entry, &bnode_cache_root, rb) {
+		if (oid_to_vid(entry->oid) == vid)
+			bnode_cache_remove(entry);
 	}
-	return inode_actor.reader(id, mem, len, offset);
+	sd_mutex_unlock(&bnode_cache_lock);
+}
+
+/*
+ * Called by the object readers and writers of the users of this library for
+ * every object they read or write.  The reads of the ext-nodes don't drop
+ * anything, they are what fills the cache.
+ */
+void sd_inode_invalidate_cache_oid(uint64_t oid, bool write)
+{
+	if (is_vdi_obj(oid) || (write && is_vdi_btree_obj(oid)))
+		sd_inode_invalidate_cache(oid_to_vid(oid));
 }
 
 void sd_inode_init(void *data, int depth)
@@ -469,6 +616,64 @@ static void transfer_to_idx_root(write_node_fn writer, struct sd_inode *inode)
 	free(right);
 }
 
+/*
+ * Look up 'idx' of a two level B-tree in the cache.  Returns false if the
+ * ext-node which would hold it is not cached.
+ */
+static bool bnode_cache_get_vid(const struct sd_inode *inode, uint32_t idx,
+				uint32_t *vid)
+{
+	struct sd_index_header *header = INDEX_HEADER(inode->data_vdi_id);
+	struct sd_indirect_idx *indirect;
+	struct bnode_cache_entry *entry, key;
+	struct sd_index *index;
+
+	if (header->depth != 2)
+		return false;
+
+	indirect = search_indirect_entry(header, idx);
+	if (!indirect_in_range(header, indirect)) {
+		/* beyond the last ext-node */
+		*vid = 0;
+		return true;
+	}
+
+	key.oid = indirect->oid;
+	sd_mutex_lock(&bnode_cache_lock);
+	entry = rb_search(&bnode_cache_root, &key, rb, bnode_cache_cmp);
+	if (!entry) {
+		sd_mutex_unlock(&bnode_cache_lock);
+		return false;
+	}
+	list_move_tail(&entry->lru, &bnode_cache_lru);
+	index = search_index_entry(entry->node, idx);
+	if (index_in_range(entry->node, index) && index->idx == idx)
+		*vid = index->vdi_id;
+	else
+		*vid = 0;
+	sd_mutex_unlock(&bnode_cache_lock);
+
+	return true;
+}
+
+/* The reader may lend its own copy of the node instead of filling buf */
+static struct sd_index_header *read_leaf_node(struct find_path *path,
+					      void *buf, void *mem)
+{
+	if (mem != buf) {
+		free(buf);
+		path->borrowed = true;
+	}
+	return mem;
+}
+
+static void release_path(struct find_path *path)
+{
+	if (path->p_index_header && !path->borrowed)
+		free(path->p_index_header);
+	path->p_index_header = NULL;
+}
+
 /*
  * Search whole btree for 'idx'.
  * Return available position (could insert new sd_index) if can't find 'idx'.
@@ -487,7 +692,11 @@ static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
 	if (header->depth == 2) {
 		path->depth = 2;
 		path->p_indirect_idx = search_indirect_entry(header, idx);
-		leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
+		/* icache_reader() lends its nodes, no need for a buffer */
+		if (reader == icache_reader)
+			leaf_node = NULL;
+		else
+			leaf_node = xvalloc(SD_INODE_DATA_INDEX_SIZE);
 		tmp = (void *)leaf_node;
 
 		if (indirect_in_range(header, path->p_indirect_idx)) {
@@ -495,8 +704,10 @@ static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
 			ret = reader(oid, &tmp, SD_INODE_DATA_INDEX_SIZE, 0);
 			if (ret != SD_RES_SUCCESS) {
 				sd_err("read oid %"PRIu64" fail", oid);
+				free(leaf_node);
 				goto out;
 			}
+			leaf_node = read_leaf_node(path, leaf_node, tmp);
 			path->p_index = search_index_entry(leaf_node, idx);
 			path->p_index_header = leaf_node;
 			if (index_in_range(leaf_node, path->p_index) &&
@@ -510,8 +721,10 @@ static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
 			ret = reader(oid, &tmp, SD_INODE_DATA_INDEX_SIZE, 0);
 			if (ret != SD_RES_SUCCESS) {
 				sd_err("read oid %"PRIu64" fail", oid);
+				free(leaf_node);
 				goto out;
 			}
+			leaf_node = read_leaf_node(path, leaf_node, tmp);
 			if (leaf_node->entries < MAX_INDEX) {
 				path->p_index = search_index_entry(leaf_node,
 								 idx);
@@ -519,7 +732,8 @@ static int search_whole_btree(read_node_fn reader, const struct sd_inode *inode,
 			} else {
 				sd_debug("last ext-node is full (oid: %016"
 					 PRIx64")", oid);
-				free(leaf_node);
+				if (!path->borrowed)
+					free(leaf_node);
 			}
 			ret = SD_RES_NOT_FOUND;
 		}
@@ -539,6 +753,8 @@ out:
 uint32_t sd_inode_get_vid(const struct sd_inode *inode, uint32_t idx)
 {
 	struct find_path path;
+	uint32_t vid = 0;
+	uint64_t gen;
 	int ret;
 
 	if (inode->store_policy == 0)
@@ -548,15 +764,22 @@ uint32_t sd_inode_get_vid(const struct sd_inode *inode, uint32_t idx)
 		if (inode->data_vdi_id[0] == 0)
 			return 0;
 
+		if (bnode_cache_get_vid(inode, idx, &vid))
+			return vid;
+
+		gen = bnode_cache_get_generation();
 		memset(&path, 0, sizeof(path));
 		ret = search_whole_btree(inode_actor.reader, inode, idx, &path);
 		if (ret == SD_RES_SUCCESS)
-			return path.p_index->vdi_id;
-		if (path.p_index_header)
+			vid = path.p_index->vdi_id;
+		if (path.p_index_header &&
+		    !(path.depth == 2 &&
+		      bnode_cache_insert(path.p_indirect_idx->oid,
+					 path.p_index_header, gen)))
 			free(path.p_index_header);
 	}
 
-	return 0;
+	return vid;
 }
 
 /*
@@ -690,8 +913,7 @@ static void set_vid_for_btree(write_node_fn writer, read_node_fn reader,
 			ret = insert_new_node(writer, reader, inode,
 					      &path, idx, vdi_id);
 			if (SD_RES_AGAIN == ret) {
-				if (path.p_index_header)
-					free(path.p_index_header);
+				release_path(&path);
 				continue;
 			} else
 				goto out;
@@ -699,39 +921,50 @@ static void set_vid_for_btree(write_node_fn writer, read_node_fn reader,
 			panic("ret: %d", ret);
 	}
 out:
-	if (path.p_index_header)
-		free(path.p_index_header);
+	release_path(&path);
 }
 
-int sd_inode_set_vid_range(struct sd_inode *inode, uint32_t idx_start,
-			   uint32_t idx_end, uint32_t vdi_id)
+static void set_vid(struct sd_inode *inode, uint32_t idx, uint32_t vdi_id)
 {
 	struct sd_index_header *header;
-	int idx;
-
-	for (idx = idx_start; idx <= idx_end; idx++) {
-		if (inode->store_policy == 0)
-			inode->data_vdi_id[idx] = vdi_id;
-		else {
-			if (inode->data_vdi_id[0] == 0)
-				sd_inode_init(inode->data_vdi_id, 1);
-			header = INDEX_HEADER(inode->data_vdi_id);
-			if (header->magic != INODE_BTREE_MAGIC)
-				panic("%s() B-tree in inode is corrupt!",
-				      __func__);
-			/*
-			 * use icache(write buffer) to accelerate batch set
-			 * operation. icache will be released after this
-			 * transaction to assure consistency.
-			 */
-			set_vid_for_btree(icache_writer, icache_reader, inode,
-					  idx, vdi_id);
-		}
+
+	if (inode->store_policy == 0) {
+		inode->data_vdi_id[idx] = vdi_id;
+		return;
 	}
-	if (inode->store_policy != 0)
-		dump_btree(inode);
 
+	if (inode->data_vdi_id[0] == 0)
+		sd_inode_init(inode->data_vdi_id, 1);
+	header = INDEX_HEADER(inode->data_vdi_id);
+	if (header->magic != INODE_BTREE_MAGIC)
+		panic("%s() B-tree in inode is corrupt!", __func__);
+	/*
+	 * use icache(write buffer) to accelerate batch set operation. icache
+	 * will be released after this transaction to assure consistency.
+	 */
+	set_vid_for_btree(icache_writer, icache_reader, inode, idx, vdi_id);
+	if (cache_idx >= ICACHE_SIZE)
+		icache_release(inode->nr_copies, inode->copy_policy);
+}
+
+static void set_vid_done(struct sd_inode *inode)
+{
 	icache_release(inode->nr_copies, inode->copy_policy);
+	if (inode->store_policy != 0) {
+		dump_btree(inode);
+		sd_inode_invalidate_cache(inode->vdi_id);
+	}
+}
+
+int sd_inode_set_vid_range(struct sd_inode *inode, uint32_t idx_start,
+			   uint32_t idx_end, uint32_t vdi_id)
+{
+	uint32_t idx;
+
+	for (idx = idx_start; idx <= idx_end; idx++)
+		set_vid(inode, idx, vdi_id);
+	set_vid_done(inode);
+
 	/* XXX: return error code */
 	return 0;
 }
@@ -741,6 +974,28 @@ int sd_inode_set_vid(struct sd_inode *inode, uint32_t idx, uint32_t vdi_id)
 	return sd_inode_set_vid_range(inode, idx, idx, vdi_id);
 }
 
+static int vid_update_cmp(const void *a, const void *b)
+{
+	return index_compare((struct sd_index *)a, (struct sd_index *)b);
+}
+
+/*
+ * Set the vdi id of many indexes at once.  The updates are sorted by index so
+ * that the consecutive ones land in the same ext-nodes, which are modified in
+ * memory and written out once.  'vids' is reordered and must not contain the
+ * same index twice.
+ */
+int sd_inode_set_vids(struct sd_inode *inode, struct sd_index *vids, int nr)
+{
+	qsort(vids, nr, sizeof(*vids), vid_update_cmp);
+	for (int i = 0; i < nr; i++)
+		set_vid(inode, vids[i].idx, vids[i].vdi_id);
+	set_vid_done(inode);
+
+	/* XXX: return error code */
+	return 0;
+}
+
 /*
  * Return the size of meta-data in inode->data_vdi_id. When leaf-node of B-tree
  * is not full, we don't need to read out all sizeof(sd_inode).
@@ -857,6 +1112,7 @@ void sd_inode_copy_vdis(write_node_fn writer, read_node_fn reader,
 			new_iter_idx++;
 		}
 		free(leaf_node);
+		sd_inode_invalidate_cache(newi->vdi_id);
 	}
 }
 
@@ -951,6 +1207,29 @@ void sd_inode_stat(const struct sd_inode *inode, uint64_t *my_objs,
 		hypver_volume_stat(inode, my_objs, cow_objs);
 }
 
+/* Fill the summary of the header of the inode, without the object counts */
+void sd_inode_summarize(const struct sd_inode *inode,
+			struct sd_inode_summary *s)
+{
+	memset(s, 0, sizeof(*s));
+	memcpy(s->name, inode->name, sizeof(s->name));
+	memcpy(s->tag, inode->tag, sizeof(s->tag));
+	s->create_time = inode->create_time;
+	s->snap_ctime = inode->snap_ctime;
+	s->vm_clock_nsec = inode->vm_clock_nsec;
+	s->vdi_size = inode->vdi_size;
+	s->vm_state_size = inode->vm_state_size;
+	s->copy_policy = inode->copy_policy;
+	s->store_policy = inode->store_policy;
+	s->nr_copies = inode->nr_copies;
+	s->block_size_shift = inode->block_size_shift;
+	s->snap_id = inode->snap_id;
+	s->vdi_id = inode->vdi_id;
+	s->parent_vdi_id = inode->parent_vdi_id;
+	s->btree_counter = inode->btree_counter;
+	s->flags = inode->flags;
+}
+
 int sd_inode_actor_init(write_node_fn writer, read_node_fn reader)
 {
 	if (!writer || !reader) {
@@ -303,19 +303,190 @@ static void ssse3_sha1_final(void *ctx, uint8_t *out)
 	return;
 }
 
-static bool avx_usable(void)
-{
-	uint64_t xcr0;
-
-	if (!cpu_has_avx || !cpu_has_osxsave)
-		return false;
+#ifdef HAVE_SHA_NI
+#include <immintrin.h>
 
-	xcr0 = xgetbv(XCR_XFEATURE_ENABLED_MASK);
-	if ((xcr0 & (XSTATE_SSE | XSTATE_YMM)) != (XSTATE_SSE | XSTATE_YMM))
-		return false;
+/* SHA1 with the SHA extensions, derived from Intel's reference code */
+static __attribute__((target("sha,ssse3"))) void
+sha1_transform_shani(uint32_t *state, const uint8_t *data, unsigned int blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+					    0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0, e0_save, e1;
+	__m128i msg0, msg1, msg2, msg3;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+	e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; blocks; blocks--, data += SHA1_BLOCK_SIZE) {
+		abcd_save = abcd;
+		e0_save = e0;
+
+		msg0 = _mm_loadu_si128((const __m128i *)data);
+		msg0 = _mm_shuffle_epi8(msg0, mask);
+		msg1 = _mm_loadu_si128((const __m128i *)(data + 16));
+		msg1 = _mm_shuffle_epi8(msg1, mask);
+		msg2 = _mm_loadu_si128((const __m128i *)(data + 32));
+		msg2 = _mm_shuffle_epi8(msg2, mask);
+		msg3 = _mm_loadu_si128((const __m128i *)(data + 48));
+		msg3 = _mm_shuffle_epi8(msg3, mask);
+
+		/* rounds 0-3 */
+		e0 = _mm_add_epi32(e0, msg0);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+		/* rounds 4-7 */
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+		/* rounds 8-11 */
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		/* rounds 12-15 */
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+		msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+		msg1 = _mm_xor_si128(msg1, msg3);
+
+		/* rounds 16-19 */
+		e0 = _mm_sha1nexte_epu32(e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+		msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+		msg2 = _mm_xor_si128(msg2, msg0);
+
+		/* rounds 20-23 */
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		/* rounds 24-27 */
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		/* rounds 28-31 */
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+		msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+		msg1 = _mm_xor_si128(msg1, msg3);
+
+		/* rounds 32-35 */
+		e0 = _mm_sha1nexte_epu32(e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 1);
+		msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+		msg2 = _mm_xor_si128(msg2, msg0);
+
+		/* rounds 36-39 */
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 1);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		/* rounds 40-43 */
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		/* rounds 44-47 */
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+		msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+		msg1 = _mm_xor_si128(msg1, msg3);
+
+		/* rounds 48-51 */
+		e0 = _mm_sha1nexte_epu32(e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+		msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+		msg2 = _mm_xor_si128(msg2, msg0);
+
+		/* rounds 52-55 */
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 2);
+		msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		/* rounds 56-59 */
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 2);
+		msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+		msg0 = _mm_xor_si128(msg0, msg2);
+
+		/* rounds 60-63 */
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+		msg1 = _mm_xor_si128(msg1, msg3);
+
+		/* rounds 64-67 */
+		e0 = _mm_sha1nexte_epu32(e0, msg0);
+		e1 = abcd;
+		msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+		msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+		msg2 = _mm_xor_si128(msg2, msg0);
+
+		/* rounds 68-71 */
+		e1 = _mm_sha1nexte_epu32(e1, msg1);
+		e0 = abcd;
+		msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+		msg3 = _mm_xor_si128(msg3, msg1);
+
+		/* rounds 72-75 */
+		e0 = _mm_sha1nexte_epu32(e0, msg2);
+		e1 = abcd;
+		msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+		abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+		/* rounds 76-79 */
+		e1 = _mm_sha1nexte_epu32(e1, msg3);
+		e0 = abcd;
+		abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+		e0 = _mm_sha1nexte_epu32(e0, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
 
-	return true;
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_cvtsi128_si32(_mm_srli_si128(e0, 12));
 }
+#endif
 
 #endif
 
@@ -343,6 +514,21 @@ void get_buffer_sha1(unsigned char *buf, unsigned len, unsigned char *sha1)
 	sha1_final(&c, sha1);
 }
 
+/*
+ * Calculate the digest of each block_size bytes of buf into the array sha1.
+ * The last block can be shorter.
+ */
+void get_buffer_block_sha1(unsigned char *buf, unsigned len,
+			   unsigned block_size, unsigned char *sha1)
+{
+	for (unsigned off = 0; off < len; off += block_size) {
+		unsigned n = len - off < block_size ? len - off : block_size;
+
+		get_buffer_sha1(buf + off, n, sha1);
+		sha1 += SHA1_DIGEST_SIZE;
+	}
+}
+
 static void __attribute__((constructor)) __sha1_init(void)
 {
 	sha1_init = generic_sha1_init;
@@ -357,6 +543,10 @@ static void __attribute__((constructor)) __sha1_init(void)
 
 	if (avx_usable())
 		sha1_transform_asm = sha1_transform_avx;
+#ifdef HAVE_SHA_NI
+	if (cpu_has_sha_ni)
+		sha1_transform_asm = sha1_transform_shani;
+#endif
 
 	sha1_update = ssse3_sha1_update;
 	sha1_final = ssse3_sha1_final;
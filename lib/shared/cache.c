@@ -0,0 +1,601 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Client side cache
+ *
+ * sd_enable_cache() keeps whole data objects in slots of a local file, so
+ * that sd_vdi_read() serves them without asking the cluster, and they are
+ * still there the next time the application runs.  A slot is tagged with the
+ * oid the inode points to and the generation of its reference, so it's not
+ * used any more once the inode points elsewhere, e.g. after a copy-on-write.
+ *
+ * An object is admitted on its second miss within a while, remembered by a
+ * direct mapped table of the missed oids, so that a single scan doesn't push
+ * out the objects read again and again.  The least recently used slot is
+ * evicted for it.
+ *
+ * The writes go to the cluster and update the cached objects, unless the
+ * cache is write-back and every object the write touches is cached and owned
+ * by the vdi.  Then the write only goes to the slots and the written range of
+ * each is remembered, until it's written to the cluster when the slot is
+ * evicted, the vdi is closed, the cluster disconnected, or before a read
+ * which is not fully cached and an asynchronous request go to the cluster.
+ * The ranges left by a crash are written when the cache is enabled again.
+ *
+ * The objects of a vdi may be written by other clients while it's not opened
+ * here, which the cache can't see, so it's meant for the vdis only written
+ * through it or not at all.
+ */
+
+#include "sheepdog.h"
+#include "internal.h"
+#include "sheep.h"
+
+#include <fcntl.h>
+
+#define CACHE_MAGIC	0x73646363	/* "sdcc" */
+#define CACHE_INDEX_OFF	BLOCK_SIZE
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t nr_slots;
+	uint64_t slot_size;
+};
+
+/* The index in the file, one for each slot */
+struct cache_entry {
+	uint64_t oid;		/* zero if the slot is free */
+	uint32_t generation;
+	uint32_t dirty_start;	/* the range not in the cluster yet */
+	uint32_t dirty_end;
+	uint32_t __pad;
+	uint64_t stamp;		/* of the last use */
+};
+
+struct cache_slot {
+	struct rb_node rb;
+	struct list_node lru;
+	uint32_t idx;
+	struct cache_entry e;
+};
+
+struct sd_cache {
+	int fd;
+	bool writeback;
+	uint32_t nr_slots;
+	off_t data_off;
+	struct cache_slot *slots;
+	struct rb_root root;
+	/* the free slots first, then from the least recently used */
+	struct list_head lru;
+	uint64_t stamp;
+	uint64_t *ghosts;	/* the missed oids, hashed */
+	/* bumped by the writes, a fill which raced with one is discarded */
+	uint64_t nr_writes;
+	struct sd_mutex lock;
+};
+
+static int slot_cmp(const struct cache_slot *a, const struct cache_slot *b)
+{
+	return intcmp(a->e.oid, b->e.oid);
+}
+
+static off_t slot_off(struct sd_cache *cache, struct cache_slot *s)
+{
+	return cache->data_off + (off_t)s->idx * SD_DATA_OBJ_SIZE;
+}
+
+static int write_entry(struct sd_cache *cache, struct cache_slot *s)
+{
+	if (xpwrite(cache->fd, &s->e, sizeof(s->e), CACHE_INDEX_OFF +
+		    (off_t)s->idx * sizeof(s->e)) != sizeof(s->e))
+		return SD_RES_EIO;
+	return SD_RES_SUCCESS;
+}
+
+static int object_rw(struct sd_cluster *c, uint64_t oid, void *buf,
+		     uint32_t len, uint32_t offset, bool write)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, write ? SD_OP_WRITE_OBJ : SD_OP_READ_OBJ);
+	hdr.data_length = len;
+	if (write)
+		hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+
+	return sd_run_sdreq(c, &hdr, buf);
+}
+
+/* Write the dirty range of the slot to the cluster, called with the lock */
+static int flush_slot(struct sd_cluster *c, struct cache_slot *s)
+{
+	struct sd_cache *cache = c->cache;
+	uint32_t len = s->e.dirty_end - s->e.dirty_start;
+	char *buf;
+	int ret;
+
+	if (!len)
+		return SD_RES_SUCCESS;
+
+	buf = xmalloc(len);
+	if (xpread(cache->fd, buf, len, slot_off(cache, s) +
+		   s->e.dirty_start) != len) {
+		ret = SD_RES_EIO;
+		goto out;
+	}
+	ret = object_rw(c, s->e.oid, buf, len, s->e.dirty_start, true);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	s->e.dirty_start = s->e.dirty_end = 0;
+	ret = write_entry(cache, s);
+out:
+	free(buf);
+	return ret;
+}
+
+/* Free the slot, called with the lock */
+static int drop_slot(struct sd_cluster *c, struct cache_slot *s)
+{
+	struct sd_cache *cache = c->cache;
+	int ret;
+
+	ret = flush_slot(c, s);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	rb_erase(&s->rb, &cache->root);
+	s->e.oid = 0;
+	s->e.stamp = 0;
+	list_move(&s->lru, &cache->lru);
+	cache->nr_writes++;
+
+	return write_entry(cache, s);
+}
+
+static void touch_slot(struct sd_cache *cache, struct cache_slot *s)
+{
+	s->e.stamp = ++cache->stamp;
+	list_move_tail(&s->lru, &cache->lru);
+}
+
+static struct cache_slot *lookup_slot(struct sd_cache *cache, uint64_t oid,
+				      uint32_t generation)
+{
+	struct cache_slot key = { .e.oid = oid }, *s;
+
+	s = rb_search(&cache->root, &key, rb, slot_cmp);
+	if (s && s->e.generation != generation)
+		return NULL;
+	return s;
+}
+
+/* Where the data of the idx-th object of the vdi is, zero oid for a hole */
+static void object_tag(struct sd_vdi *vdi, uint32_t idx, uint64_t *oid,
+		       uint32_t *generation)
+{
+	uint32_t vid;
+
+	sd_read_lock(&vdi->lock);
+	vid = vdi->inode->data_vdi_id[idx];
+	*generation = vdi->inode->gref[idx].generation;
+	sd_rw_unlock(&vdi->lock);
+
+	*oid = vid ? vid_to_data_oid(vid, idx) : 0;
+}
+
+#define for_each_piece(idx, start, len, count, offset)			\
+	for (idx = (offset) / SD_DATA_OBJ_SIZE,				\
+	     start = (offset) % SD_DATA_OBJ_SIZE,			\
+	     len = min(count, (size_t)(SD_DATA_OBJ_SIZE - start));	\
+	     len > 0; idx++, count -= len, start = 0,			\
+	     len = min(count, (size_t)SD_DATA_OBJ_SIZE))
+
+/*
+ * Read from the cache.  Returns SD_RES_NO_OBJ if an object isn't cached, in
+ * which case the cached ones in the range are flushed for the read to go to
+ * the cluster.
+ */
+int cache_read(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
+	       size_t count, off_t offset)
+{
+	struct sd_cache *cache = c->cache;
+	size_t len, left = count;
+	uint32_t idx, start, generation;
+	struct cache_slot *s;
+	uint64_t oid;
+	char *p = buf;
+	bool miss = false;
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(&cache->lock);
+	for_each_piece(idx, start, len, left, offset) {
+		object_tag(vdi, idx, &oid, &generation);
+		if (!oid) {
+			memset(p, 0, len);
+		} else if ((s = lookup_slot(cache, oid, generation))) {
+			if (xpread(cache->fd, p, len,
+				   slot_off(cache, s) + start) != len) {
+				ret = SD_RES_EIO;
+				goto out;
+			}
+			touch_slot(cache, s);
+		} else
+			miss = true;
+		p += len;
+	}
+	if (!miss)
+		goto out;
+
+	ret = SD_RES_NO_OBJ;
+	left = count;
+	for_each_piece(idx, start, len, left, offset) {
+		object_tag(vdi, idx, &oid, &generation);
+		s = oid ? lookup_slot(cache, oid, generation) : NULL;
+		if (s && flush_slot(c, s) != SD_RES_SUCCESS) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+	}
+out:
+	sd_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/* Take the least recently used slot out of the lists, called with the lock */
+static struct cache_slot *get_victim(struct sd_cluster *c)
+{
+	struct sd_cache *cache = c->cache;
+	struct cache_slot *s;
+
+	if (list_empty(&cache->lru))
+		return NULL;
+	s = list_first_entry(&cache->lru, struct cache_slot, lru);
+	if (s->e.oid && drop_slot(c, s) != SD_RES_SUCCESS)
+		return NULL;
+	list_del(&s->lru);
+	return s;
+}
+
+/* Fill a slot with the object, data is NULL if we have to read it */
+static void fill_slot(struct sd_cluster *c, uint64_t oid, uint32_t generation,
+		      const char *data)
+{
+	struct sd_cache *cache = c->cache;
+	struct cache_slot *s;
+	uint64_t nr_writes;
+	char *buf = NULL;
+	int ret;
+
+	sd_mutex_lock(&cache->lock);
+	s = get_victim(c);
+	nr_writes = cache->nr_writes;
+	sd_mutex_unlock(&cache->lock);
+	if (!s)
+		return;
+
+	if (!data) {
+		buf = xmalloc(SD_DATA_OBJ_SIZE);
+		ret = object_rw(c, oid, buf, SD_DATA_OBJ_SIZE, 0, false);
+		data = buf;
+	} else
+		ret = SD_RES_SUCCESS;
+	if (ret == SD_RES_SUCCESS &&
+	    xpwrite(cache->fd, data, SD_DATA_OBJ_SIZE, slot_off(cache, s)) !=
+	    SD_DATA_OBJ_SIZE)
+		ret = SD_RES_EIO;
+	free(buf);
+
+	sd_mutex_lock(&cache->lock);
+	if (ret == SD_RES_SUCCESS && nr_writes == cache->nr_writes &&
+	    !lookup_slot(cache, oid, generation)) {
+		s->e.oid = oid;
+		s->e.generation = generation;
+		rb_insert(&cache->root, s, rb, slot_cmp);
+		list_add_tail(&s->lru, &cache->lru);
+		touch_slot(cache, s);
+		if (write_entry(cache, s) != SD_RES_SUCCESS)
+			drop_slot(c, s);
+	} else
+		list_add(&s->lru, &cache->lru);
+	sd_mutex_unlock(&cache->lock);
+}
+
+/* Admit the objects read from the cluster which were missed recently */
+void cache_admit(struct sd_cluster *c, struct sd_vdi *vdi, const void *buf,
+		 size_t count, off_t offset)
+{
+	struct sd_cache *cache = c->cache;
+	uint32_t idx, start, generation, h;
+	const char *p = buf;
+	uint64_t oid;
+	size_t len;
+	bool admit;
+
+	for_each_piece(idx, start, len, count, offset) {
+		object_tag(vdi, idx, &oid, &generation);
+		if (!oid)
+			goto next;
+
+		h = sd_hash_64(oid) % cache->nr_slots;
+		sd_mutex_lock(&cache->lock);
+		admit = cache->ghosts[h] == oid &&
+			!lookup_slot(cache, oid, generation);
+		cache->ghosts[h] = oid;
+		sd_mutex_unlock(&cache->lock);
+
+		if (admit)
+			fill_slot(c, oid, generation,
+				  len == SD_DATA_OBJ_SIZE ? p : NULL);
+next:
+		p += len;
+	}
+}
+
+/*
+ * Write to the cache only, if it's write-back and all the objects are cached.
+ * Returns SD_RES_NO_OBJ otherwise.
+ */
+int cache_write(struct sd_cluster *c, struct sd_vdi *vdi, const void *buf,
+		size_t count, off_t offset)
+{
+	struct sd_cache *cache = c->cache;
+	uint32_t idx, start, generation;
+	struct cache_slot *s;
+	const char *p = buf;
+	size_t len, left = count;
+	uint64_t oid;
+	int ret = SD_RES_SUCCESS;
+
+	if (!cache->writeback)
+		return SD_RES_NO_OBJ;
+
+	sd_mutex_lock(&cache->lock);
+	for_each_piece(idx, start, len, left, offset) {
+		object_tag(vdi, idx, &oid, &generation);
+		/* the others need a copy-on-write or a creation first */
+		if (!oid || oid_to_vid(oid) != vdi->vid ||
+		    !lookup_slot(cache, oid, generation)) {
+			ret = SD_RES_NO_OBJ;
+			goto out;
+		}
+	}
+
+	cache->nr_writes++;
+	left = count;
+	for_each_piece(idx, start, len, left, offset) {
+		object_tag(vdi, idx, &oid, &generation);
+		s = lookup_slot(cache, oid, generation);
+		if (xpwrite(cache->fd, p, len, slot_off(cache, s) + start) !=
+		    len) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+		if (s->e.dirty_end == s->e.dirty_start) {
+			s->e.dirty_start = start;
+			s->e.dirty_end = start + len;
+		} else {
+			s->e.dirty_start = min(s->e.dirty_start, start);
+			s->e.dirty_end = max(s->e.dirty_end,
+					     (uint32_t)(start + len));
+		}
+		touch_slot(cache, s);
+		ret = write_entry(cache, s);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		p += len;
+	}
+out:
+	sd_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/* Bring the cached objects up to date after a write to the cluster */
+void cache_update(struct sd_cluster *c, struct sd_vdi *vdi, const void *buf,
+		  size_t count, off_t offset)
+{
+	struct sd_cache *cache = c->cache;
+	uint32_t idx, start, generation;
+	struct cache_slot *s;
+	const char *p = buf;
+	uint64_t oid;
+	size_t len;
+
+	sd_mutex_lock(&cache->lock);
+	cache->nr_writes++;
+	for_each_piece(idx, start, len, count, offset) {
+		object_tag(vdi, idx, &oid, &generation);
+		s = oid ? lookup_slot(cache, oid, generation) : NULL;
+		if (s && xpwrite(cache->fd, p, len, slot_off(cache, s) +
+				 start) != len)
+			drop_slot(c, s);
+		p += len;
+	}
+	sd_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Make the cluster up to date for an asynchronous request, which bypasses the
+ * cache, and drop the cached objects it's going to write.
+ */
+int cache_bypass(struct sd_cluster *c, struct sd_vdi *vdi, size_t count,
+		 off_t offset, bool write)
+{
+	struct sd_cache *cache = c->cache;
+	uint32_t idx, start, generation;
+	struct cache_slot *s;
+	uint64_t oid;
+	size_t len;
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(&cache->lock);
+	cache->nr_writes++;
+	for_each_piece(idx, start, len, count, offset) {
+		object_tag(vdi, idx, &oid, &generation);
+		s = oid ? lookup_slot(cache, oid, generation) : NULL;
+		if (!s)
+			continue;
+		ret = write ? drop_slot(c, s) : flush_slot(c, s);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+	sd_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/* Write the dirty ranges of the vdi, or of all if vid is zero */
+int cache_flush(struct sd_cluster *c, uint32_t vid)
+{
+	struct sd_cache *cache = c->cache;
+	int ret = SD_RES_SUCCESS;
+
+	sd_mutex_lock(&cache->lock);
+	for (uint32_t i = 0; i < cache->nr_slots; i++) {
+		struct cache_slot *s = cache->slots + i;
+
+		if (!s->e.oid || (vid && oid_to_vid(s->e.oid) != vid))
+			continue;
+		if (flush_slot(c, s) != SD_RES_SUCCESS)
+			ret = SD_RES_EIO;
+	}
+	sd_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+static int stamp_cmp(const void *a, const void *b)
+{
+	const struct cache_slot *x = *(const struct cache_slot **)a;
+	const struct cache_slot *y = *(const struct cache_slot **)b;
+
+	return intcmp(x->e.stamp, y->e.stamp);
+}
+
+/* Load the index, or start over if the file is of another size */
+static int load_cache(struct sd_cache *cache, uint64_t size)
+{
+	struct cache_header hdr;
+	struct cache_entry *entries;
+	struct cache_slot **sorted;
+	size_t index_len;
+	uint32_t nr_slots = max(size / SD_DATA_OBJ_SIZE, (uint64_t)1);
+	int ret = SD_RES_SUCCESS;
+
+	index_len = sizeof(*entries) * nr_slots;
+	cache->nr_slots = nr_slots;
+	cache->data_off = round_up(CACHE_INDEX_OFF + index_len, BLOCK_SIZE);
+	entries = xzalloc(index_len);
+
+	if (xpread(cache->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    hdr.magic != CACHE_MAGIC || hdr.nr_slots != nr_slots ||
+	    hdr.slot_size != SD_DATA_OBJ_SIZE ||
+	    xpread(cache->fd, entries, index_len, CACHE_INDEX_OFF) !=
+	    index_len) {
+		hdr.magic = CACHE_MAGIC;
+		hdr.nr_slots = nr_slots;
+		hdr.slot_size = SD_DATA_OBJ_SIZE;
+		memset(entries, 0, index_len);
+		if (ftruncate(cache->fd, 0) < 0 ||
+		    ftruncate(cache->fd, cache->data_off +
+			      (off_t)nr_slots * SD_DATA_OBJ_SIZE) < 0 ||
+		    xpwrite(cache->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+	}
+
+	cache->slots = xcalloc(nr_slots, sizeof(*cache->slots));
+	cache->ghosts = xcalloc(nr_slots, sizeof(*cache->ghosts));
+	sorted = xmalloc(sizeof(*sorted) * nr_slots);
+	for (uint32_t i = 0; i < nr_slots; i++) {
+		struct cache_slot *s = cache->slots + i;
+
+		s->idx = i;
+		s->e = entries[i];
+		if (!s->e.oid || rb_insert(&cache->root, s, rb, slot_cmp))
+			s->e.oid = s->e.stamp = 0;
+		cache->stamp = max(cache->stamp, s->e.stamp);
+		sorted[i] = s;
+	}
+	/* the free slots have no stamp, so they come first */
+	qsort(sorted, nr_slots, sizeof(*sorted), stamp_cmp);
+	for (uint32_t i = 0; i < nr_slots; i++)
+		list_add_tail(&sorted[i]->lru, &cache->lru);
+	free(sorted);
+out:
+	free(entries);
+	return ret;
+}
+
+int sd_enable_cache(struct sd_cluster *c, const char *path, uint64_t size,
+		    bool writeback)
+{
+	struct sd_cache *cache;
+	int ret;
+
+	if (c->cache || size < SD_DATA_OBJ_SIZE)
+		return SD_RES_INVALID_PARMS;
+
+	cache = xzalloc(sizeof(*cache));
+	cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (cache->fd < 0) {
+		free(cache);
+		return SD_RES_EIO;
+	}
+	cache->writeback = writeback;
+	INIT_RB_ROOT(&cache->root);
+	INIT_LIST_HEAD(&cache->lru);
+	sd_init_mutex(&cache->lock);
+
+	ret = load_cache(cache, size);
+	if (ret != SD_RES_SUCCESS) {
+		free_cache(cache);
+		return ret;
+	}
+	c->cache = cache;
+
+	/* what a crash left behind */
+	ret = cache_flush(c, 0);
+	if (ret != SD_RES_SUCCESS) {
+		c->cache = NULL;
+		free_cache(cache);
+	}
+	return ret;
+}
+
+/* Called on disconnect, while the cluster can still be talked to */
+void disable_cache(struct sd_cluster *c)
+{
+	struct sd_cache *cache = c->cache;
+
+	if (!cache)
+		return;
+
+	cache_flush(c, 0);
+	/* save the order of the slots for the next time */
+	for (uint32_t i = 0; i < cache->nr_slots; i++)
+		if (cache->slots[i].e.oid)
+			write_entry(cache, cache->slots + i);
+	fdatasync(cache->fd);
+	c->cache = NULL;
+	free_cache(cache);
+}
+
+void free_cache(struct sd_cache *cache)
+{
+	close(cache->fd);
+	sd_destroy_mutex(&cache->lock);
+	free(cache->slots);
+	free(cache->ghosts);
+	free(cache);
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Direct reads
+ *
+ * Normally every request is sent to the connected sheep, which forwards it
+ * to the sheep holding the object.  For reads of replicated vdis without a
+ * write quorum we can save this hop: we fetch the node list of the cluster,
+ * compute the placement of the object on our own and read it from one of its
+ * replicas by SD_OP_READ_PEER.
+ *
+ * The placement is tagged with the epoch it was computed for, so a replica
+ * answers SD_RES_OLD/NEW_NODE_VER after a membership change, in which case we
+ * reload it and retry once.  Any other failure makes sd_vdi_read() fall back
+ * to the normal path through the connected sheep, which handles recovery,
+ * missing objects and so on.
+ */
+
+#include "sheepdog.h"
+#include "internal.h"
+#include "sheep.h"
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+struct sd_peer {
+	struct sd_node node;
+	int fd;
+	struct sd_mutex lock; /* one request at a time on fd */
+};
+
+struct sd_placement {
+	uint32_t epoch;
+	int nr_nodes;
+	int nr_zones;
+	int nr_probes;
+	struct sd_peer *peers;
+	struct rb_root nroot;
+	struct rb_root vroot;
+};
+
+static void free_placement(struct sd_placement *p)
+{
+	if (!p)
+		return;
+
+	rb_destroy(&p->vroot, struct sd_vnode, rb);
+	for (int i = 0; i < p->nr_nodes; i++) {
+		if (p->peers[i].fd >= 0)
+			close(p->peers[i].fd);
+		sd_destroy_mutex(&p->peers[i].lock);
+	}
+	free(p->peers);
+	free(p);
+}
+
+static struct sd_placement *load_placement(struct sd_cluster *c)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_placement *p;
+	struct sd_node *buf;
+	struct epoch_log *log;
+	uint32_t zones[SD_MAX_NODES];
+	int ret, nr;
+
+	buf = xmalloc(sizeof(*buf) * SD_MAX_NODES);
+	sd_init_req(&hdr, SD_OP_GET_NODE_LIST);
+	hdr.data_length = sizeof(*buf) * SD_MAX_NODES;
+	ret = sd_run_sdreq(c, &hdr, buf);
+	if (ret != SD_RES_SUCCESS) {
+		free(buf);
+		errno = ret;
+		return NULL;
+	}
+
+	nr = rsp->data_length / sizeof(*buf);
+	if (nr == 0) {
+		free(buf);
+		errno = SD_RES_SYSTEM_ERROR;
+		return NULL;
+	}
+
+	p = xzalloc(sizeof(*p));
+	p->epoch = rsp->epoch;
+	p->nr_nodes = nr;
+	p->peers = xzalloc(sizeof(*p->peers) * nr);
+	INIT_RB_ROOT(&p->nroot);
+	INIT_RB_ROOT(&p->vroot);
+	for (int i = 0; i < nr; i++) {
+		struct sd_peer *peer = p->peers + i;
+		int j;
+
+		peer->node = buf[i];
+		peer->fd = -1;
+		sd_init_mutex(&peer->lock);
+		rb_insert(&p->nroot, &peer->node, rb, node_cmp);
+
+		for (j = 0; j < p->nr_zones; j++)
+			if (zones[j] == peer->node.zone)
+				break;
+		if (j == p->nr_zones)
+			zones[p->nr_zones++] = peer->node.zone;
+	}
+	free(buf);
+
+	/* The placement flags are in the latest epoch log */
+	log = xzalloc(sizeof(*log));
+	sd_init_req(&hdr, SD_OP_STAT_CLUSTER);
+	hdr.data_length = sizeof(*log);
+	ret = sd_run_sdreq(c, &hdr, log);
+	if (ret != SD_RES_SUCCESS) {
+		free(log);
+		free_placement(p);
+		errno = ret;
+		return NULL;
+	}
+
+	if (log->flags & SD_CLUSTER_FLAG_DISKMODE)
+		disks_to_vnodes(&p->nroot, &p->vroot);
+	else
+		nodes_to_vnodes(&p->nroot, &p->vroot);
+	p->nr_probes = sd_placement_probes(log->flags);
+	free(log);
+
+	return p;
+}
+
+int sd_enable_direct_read(struct sd_cluster *c)
+{
+	struct sd_placement *p = load_placement(c);
+
+	if (!p)
+		return errno;
+
+	sd_write_lock(&c->placement_lock);
+	free_placement(c->placement);
+	c->placement = p;
+	sd_rw_unlock(&c->placement_lock);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Replace the placement unless somebody already did it for a newer epoch */
+static int reload_placement(struct sd_cluster *c, uint32_t epoch)
+{
+	struct sd_placement *p;
+	int ret = SD_RES_SUCCESS;
+
+	sd_write_lock(&c->placement_lock);
+	if (c->placement->epoch != epoch)
+		goto out;
+
+	p = load_placement(c);
+	if (!p) {
+		ret = errno;
+		goto out;
+	}
+	free_placement(c->placement);
+	c->placement = p;
+out:
+	sd_rw_unlock(&c->placement_lock);
+	return ret;
+}
+
+/* Only IPv4 sheep are supported, the same as sd_connect() */
+static int peer_connect(const struct sd_peer *peer)
+{
+	const struct node_id *nid = &peer->node.nid;
+	const uint8_t *addr = nid->io_port ? nid->io_addr : nid->addr;
+	uint16_t port = nid->io_port ? nid->io_port : nid->port;
+	struct sockaddr_in sin = {};
+	int fd, value = 1;
+
+	for (int i = 0; i < 12; i++)
+		if (addr[i])
+			return -1;
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	memcpy(&sin.sin_addr, addr + 12, sizeof(sin.sin_addr));
+
+	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0)
+		return -1;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value,
+		       sizeof(value)) < 0 ||
+	    connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int peer_read(struct sd_placement *p, struct sd_peer *peer,
+		     uint64_t oid, void *buf, uint32_t len, uint32_t offset)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_READ_PEER);
+	hdr.epoch = p->epoch;
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+
+	sd_mutex_lock(&peer->lock);
+	if (peer->fd < 0)
+		peer->fd = peer_connect(peer);
+	if (peer->fd < 0) {
+		ret = SD_RES_NETWORK_ERROR;
+		goto out;
+	}
+
+	if (xwrite(peer->fd, &hdr, sizeof(hdr)) < 0 ||
+	    xread(peer->fd, rsp, sizeof(*rsp)) < 0)
+		goto err_close;
+
+	ret = rsp->result;
+	if (rsp->data_length > len)
+		goto err_close;
+	if (rsp->data_length && xread(peer->fd, buf, rsp->data_length) < 0)
+		goto err_close;
+	if (ret == SD_RES_SUCCESS && rsp->data_length != len)
+		ret = SD_RES_EIO;
+	goto out;
+err_close:
+	close(peer->fd);
+	peer->fd = -1;
+	ret = SD_RES_NETWORK_ERROR;
+out:
+	sd_mutex_unlock(&peer->lock);
+	return ret;
+}
+
+/* Pick the replica living on the connected sheep if any, else the first */
+static struct sd_peer *pick_peer(struct sd_cluster *c, struct sd_placement *p,
+				 uint64_t oid, int nr_copies)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	int nr = min(nr_copies, p->nr_zones);
+
+	oid_to_vnodes(oid, &p->vroot, p->nr_probes, nr, vnodes);
+	for (int i = 0; i < nr; i++) {
+		const struct node_id *nid = &vnodes[i]->node->nid;
+
+		if (nid->port == c->port && !memcmp(nid->addr + 12, c->addr, 4))
+			return container_of(vnodes[i]->node, struct sd_peer,
+					    node);
+	}
+
+	return container_of(vnodes[0]->node, struct sd_peer, node);
+}
+
+static int direct_read_obj(struct sd_cluster *c, uint64_t oid, int nr_copies,
+			   void *buf, uint32_t len, uint32_t offset)
+{
+	struct sd_placement *p;
+	uint32_t epoch;
+	int ret;
+
+	for (int retry = 0;; retry++) {
+		sd_read_lock(&c->placement_lock);
+		p = c->placement;
+		ret = peer_read(p, pick_peer(c, p, oid, nr_copies), oid, buf,
+				len, offset);
+		epoch = p->epoch;
+		sd_rw_unlock(&c->placement_lock);
+
+		if (retry || (ret != SD_RES_OLD_NODE_VER &&
+			      ret != SD_RES_NEW_NODE_VER))
+			return ret;
+
+		ret = reload_placement(c, epoch);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+}
+
+/*
+ * Read the range from the replicas directly.  Return SD_RES_SUCCESS if the
+ * whole range was read, otherwise the caller has to read it from the
+ * connected sheep.
+ */
+int vdi_direct_read(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
+		    size_t count, off_t offset)
+{
+	uint32_t idx = offset / SD_DATA_OBJ_SIZE;
+	uint32_t start = offset % SD_DATA_OBJ_SIZE;
+	size_t len = min(count, (size_t)(SD_DATA_OBJ_SIZE - start));
+	char *p = buf;
+	int ret;
+
+	/*
+	 * The writes of a quorum vdi are acked before all the replicas have
+	 * them, so only the gateway knows which ones are up to date.
+	 */
+	if (!c->placement || vdi->inode->copy_policy ||
+	    SD_INODE_QUORUM(vdi->inode->flags))
+		return SD_RES_INVALID_PARMS;
+
+	while (count > 0) {
+		uint32_t vid;
+
+		sd_read_lock(&vdi->lock);
+		vid = vdi->inode->data_vdi_id[idx];
+		sd_rw_unlock(&vdi->lock);
+
+		if (vid) {
+			ret = direct_read_obj(c, vid_to_data_oid(vid, idx),
+					      vdi->inode->nr_copies, p, len,
+					      start);
+			if (ret != SD_RES_SUCCESS)
+				return ret;
+		} else
+			memset(p, 0, len);
+
+		idx++;
+		p += len;
+		count -= len;
+		start = 0;
+		len = min(count, (size_t)SD_DATA_OBJ_SIZE);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+void free_direct_read(struct sd_cluster *c)
+{
+	free_placement(c->placement);
+	c->placement = NULL;
+}
@@ -34,6 +34,8 @@ struct sd_request {
 	uint8_t opcode;
 	int efd;
 	int ret;
+	/* non-NULL for a request of sd_aio_submit(), efd is unused then */
+	struct sd_aio *aio;
 };
 
 struct sheep_aiocb {
@@ -50,7 +52,9 @@ struct sheep_aiocb {
 
 struct sheep_request {
 	struct list_node list;
+	struct hlist_node hash;
 	struct sheep_aiocb *aiocb;
+	struct sd_conn *conn;
 	uint64_t oid;
 	uint64_t cow_oid;
 	uint32_t seq_num;
@@ -58,6 +62,15 @@ struct sheep_request {
 	uint32_t offset;
 	uint32_t length;
 	char *buf;
+	/* non-NULL for a SD_OP_READ/WRITE_OBJS of adjacent objects */
+	struct sd_obj_vec *vec;
+	uint32_t nr_vec;
+	/* for VDI_CREATE, the writes waiting for the object to be created */
+	struct hlist_node create_hash;
+	struct list_head blocked;
+	/* the writes coalesced into this one, 'bounce' holds their data */
+	struct sheep_request *merged;
+	char *bounce;
 };
 
 struct sd_op_template {
@@ -66,18 +79,17 @@ struct sd_op_template {
 	int (*response_process)(struct sheep_request *req, struct sd_rsp *rsp);
 };
 
-struct sheep_request *find_inflight_request_oid(struct sd_cluster *c,
-						       uint64_t oid);
 struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
 						 uint64_t oid, uint64_t cow_oid,
 						 int len, int offset);
 int end_sheep_request(struct sheep_request *req);
-int sheep_submit_sdreq(struct sd_cluster *c, struct sd_req *hdr,
+void add_inflight_request(struct sheep_request *req);
+int sheep_submit_sdreq(struct sd_conn *conn, struct sd_req *hdr,
 			      void *data, uint32_t wlen);
 int submit_sheep_request(struct sheep_request *req);
 
 const struct sd_op_template *get_sd_op(uint8_t opcode);
-void submit_blocking_sheep_request(struct sd_cluster *c, uint64_t oid);
+bool prepare_create_request(struct sheep_request *req, uint32_t idx);
 
 uint32_t sheep_inode_get_vid(struct sd_request *req, uint32_t idx);
 
@@ -86,4 +98,22 @@ struct sd_request *alloc_request(struct sd_cluster *c, void *data,
 void queue_request(struct sd_request *req);
 void free_request(struct sd_request *req);
 
+int vdi_direct_read(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
+		    size_t count, off_t offset);
+void free_direct_read(struct sd_cluster *c);
+
+int cache_read(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
+	       size_t count, off_t offset);
+void cache_admit(struct sd_cluster *c, struct sd_vdi *vdi, const void *buf,
+		 size_t count, off_t offset);
+int cache_write(struct sd_cluster *c, struct sd_vdi *vdi, const void *buf,
+		size_t count, off_t offset);
+void cache_update(struct sd_cluster *c, struct sd_vdi *vdi, const void *buf,
+		  size_t count, off_t offset);
+int cache_bypass(struct sd_cluster *c, struct sd_vdi *vdi, size_t count,
+		 off_t offset, bool write);
+int cache_flush(struct sd_cluster *c, uint32_t vid);
+void disable_cache(struct sd_cluster *c);
+void free_cache(struct sd_cache *cache);
+
 #endif
@@ -14,6 +14,35 @@
 #include "sheepdog.h"
 #include "internal.h"
 
+/*
+ * Send the accumulated I/O of adjacent objects as one request.  'vec' is
+ * reused by the caller.
+ */
+static void flush_obj_vec(struct sheep_aiocb *aiocb, struct sd_obj_vec *vec,
+			   uint32_t *nr)
+{
+	struct sheep_request *req;
+	uint32_t len = 0;
+
+	if (!*nr)
+		return;
+
+	if (*nr == 1) {
+		req = alloc_sheep_request(aiocb, vec->oid, 0, vec->length,
+					  vec->offset);
+	} else {
+		for (uint32_t i = 0; i < *nr; i++)
+			len += vec[i].length;
+		req = alloc_sheep_request(aiocb, 0, 0, len, 0);
+		req->vec = xmalloc(sizeof(*vec) * *nr);
+		memcpy(req->vec, vec, sizeof(*vec) * *nr);
+		req->nr_vec = *nr;
+	}
+
+	submit_sheep_request(req);
+	*nr = 0;
+}
+
 static int vdi_rw_request(struct sheep_aiocb *aiocb)
 {
 	struct sd_request *request = aiocb->request;
@@ -23,6 +52,9 @@ static int vdi_rw_request(struct sheep_aiocb *aiocb)
 	uint32_t idx = offset / SD_DATA_OBJ_SIZE;
 	int len = SD_DATA_OBJ_SIZE - start;
 	struct sd_cluster *c = request->cluster;
+	struct sd_obj_vec vec[SD_MAX_OBJ_VEC];
+	uint32_t nr_vec = 0;
+	bool use_vec = !uatomic_is_true(&c->no_obj_vec);
 
 	if (total < len)
 		len = total;
@@ -51,35 +83,31 @@ static int vdi_rw_request(struct sheep_aiocb *aiocb)
 				oid = vid_to_data_oid(vid, idx);
 		}
 
+		/*
+		 * Read the adjacent allocated objects, or write the adjacent
+		 * objects which need neither creation nor COW, with one request
+		 */
+		if (use_vec) {
+			if (request->opcode == VDI_READ ? vid :
+			    vid == request->vdi->vid) {
+				vec[nr_vec].oid = oid;
+				vec[nr_vec].offset = start;
+				vec[nr_vec].length = len;
+				if (++nr_vec == SD_MAX_OBJ_VEC)
+					flush_obj_vec(aiocb, vec, &nr_vec);
+				goto done;
+			}
+			flush_obj_vec(aiocb, vec, &nr_vec);
+		}
+
 		req = alloc_sheep_request(aiocb, oid, cow_oid, len, start);
 		if (vid && !cow_oid)
 			goto submit;
 
 		switch (req->opcode) {
 		case VDI_WRITE:
-			/*
-			 * Sheepdog can't handle concurrent creation on the same
-			 * object. We send one create req first and then send
-			 * write reqs in next.
-			 */
-			if (find_inflight_request_oid(c, oid)) {
-				uint32_t tmp_vid;
-
-				sd_write_lock(&c->blocking_lock);
-				/*
-				 * There are slim chance object was created
-				 * before we grab blocking_lock
-				 */
-				tmp_vid = sheep_inode_get_vid(request, idx);
-				if (tmp_vid && tmp_vid == request->vdi->vid) {
-					sd_rw_unlock(&c->blocking_lock);
-					goto submit;
-				}
-				list_add_tail(&req->list, &c->blocking_list);
-				sd_rw_unlock(&c->blocking_lock);
+			if (!prepare_create_request(req, idx))
 				goto done;
-			}
-			req->opcode = VDI_CREATE;
 			break;
 		case VDI_READ:
 			end_sheep_request(req);
@@ -94,6 +122,8 @@ done:
 		len = total > SD_DATA_OBJ_SIZE ? SD_DATA_OBJ_SIZE : total;
 	} while (total > 0);
 
+	flush_obj_vec(aiocb, vec, &nr_vec);
+
 	if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
 		aiocb->aio_done_func(aiocb);
 
@@ -111,7 +141,7 @@ static int vdi_create_response(struct sheep_request *req, struct sd_rsp *rsp)
 	vdi = req->aiocb->request->vdi;
 
 	/* We need to update inode for create */
-	new = xmalloc(sizeof(*new));
+	new = xzalloc(sizeof(*new));
 	vid = vdi->vid;
 	oid = vid_to_vdi_oid(vid);
 	idx = data_oid_to_idx(req->oid);
@@ -131,8 +161,38 @@ static int vdi_create_response(struct sheep_request *req, struct sd_rsp *rsp)
 	vdi->inode->data_vdi_id[idx] = vid;
 	sd_rw_unlock(&vdi->lock);
 
+	/* The blocked writes are sent by end_sheep_request() */
 	submit_sheep_request(new);
-	submit_blocking_sheep_request(c, req->oid);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Old sheep doesn't know SD_OP_READ/WRITE_OBJS, retry object by object */
+static int vdi_rw_response(struct sheep_request *req, struct sd_rsp *rsp)
+{
+	struct sd_cluster *c = req->aiocb->request->cluster;
+	char *buf = req->buf;
+
+	if (!req->vec || rsp->result != SD_RES_INVALID_PARMS)
+		return SD_RES_SUCCESS;
+
+	uatomic_set_true(&c->no_obj_vec);
+	for (uint32_t i = 0; i < req->nr_vec; i++) {
+		struct sheep_request *new = xzalloc(sizeof(*new));
+
+		new->oid = req->vec[i].oid;
+		new->offset = req->vec[i].offset;
+		new->length = req->vec[i].length;
+		new->aiocb = req->aiocb;
+		new->buf = buf;
+		new->seq_num = uatomic_add_return(&c->seq_num, 1);
+		new->opcode = req->opcode;
+		uatomic_inc(&req->aiocb->nr_requests);
+		INIT_LIST_NODE(&new->list);
+
+		submit_sheep_request(new);
+		buf += new->length;
+	}
 
 	return SD_RES_SUCCESS;
 }
@@ -154,9 +214,7 @@ static int sheep_ctl_request(struct sheep_aiocb *aiocb)
 	request->opcode = SHEEP_CTL;
 	hdr->id = request->seq_num;
 
-	sd_write_lock(&c->inflight_lock);
-	list_add_tail(&request->list, &c->inflight_list);
-	sd_rw_unlock(&c->inflight_lock);
+	add_inflight_request(request);
 
 	uint32_t wlen = 0;
 
@@ -164,8 +222,8 @@ static int sheep_ctl_request(struct sheep_aiocb *aiocb)
 		wlen = hdr->data_length;
 
 	uatomic_inc(&aiocb->nr_requests);
-	int ret = sheep_submit_sdreq(c, hdr, aiocb->buf, wlen);
-	eventfd_xwrite(c->reply_fd, 1);
+	int ret = sheep_submit_sdreq(request->conn, hdr, aiocb->buf, wlen);
+	eventfd_xwrite(request->conn->reply_fd, 1);
 
 	return ret;
 }
@@ -181,10 +239,12 @@ static struct sd_op_template sd_ops[] = {
 	[VDI_READ] = {
 		.name = "VDI READ",
 		.request_process = vdi_rw_request,
+		.response_process = vdi_rw_response,
 	},
 	[VDI_WRITE] = {
 		.name = "VDI WRITE",
 		.request_process = vdi_rw_request,
+		.response_process = vdi_rw_response,
 	},
 	[VDI_CREATE] = {
 		.name = "VDI CREATE",
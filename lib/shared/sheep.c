@@ -13,6 +13,7 @@
 
 #include "sheepdog.h"
 #include "internal.h"
+#include "shm_ring.h"
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -20,33 +21,73 @@
 #include <netinet/tcp.h>
 #include <pthread.h>
 
-int sheep_submit_sdreq(struct sd_cluster *c, struct sd_req *hdr,
-			      void *data, uint32_t wlen)
+/* Send the header, the object vector (if any) and the data at once */
+static int sheep_submit_sdreq_vec(struct sd_conn *conn, struct sd_req *hdr,
+				  void *vec, uint32_t vlen, void *data,
+				  uint32_t wlen)
 {
 	int ret;
 
-	sd_mutex_lock(&c->submit_mutex);
-	ret = xwrite(c->sockfd, hdr, sizeof(*hdr));
+	sd_mutex_lock(&conn->submit_mutex);
+	ret = xwrite(conn->sockfd, hdr, sizeof(*hdr));
 	if (ret < 0)
 		goto out;
 
+	if (vlen) {
+		ret = xwrite(conn->sockfd, vec, vlen);
+		if (ret < 0)
+			goto out;
+	}
+
 	if (wlen)
-		ret = xwrite(c->sockfd, data, wlen);
+		ret = xwrite(conn->sockfd, data, wlen);
 out:
-	sd_mutex_unlock(&c->submit_mutex);
+	sd_mutex_unlock(&conn->submit_mutex);
 	if (unlikely(ret < 0))
 		return -SD_RES_EIO;
 
 	return ret;
 }
 
+int sheep_submit_sdreq(struct sd_conn *conn, struct sd_req *hdr,
+			      void *data, uint32_t wlen)
+{
+	return sheep_submit_sdreq_vec(conn, hdr, NULL, 0, data, wlen);
+}
+
+/* The slots of the ring, each holds a request of up to an object */
+#define SD_SHM_SLOTS 16
+
+int sd_attach_shm(struct sd_cluster *c, const char *path)
+{
+	struct shm_client *shm;
+
+	if (c->shm)
+		return SD_RES_SUCCESS;
+
+	shm = shm_client_attach(path, SD_SHM_SLOTS, SD_DATA_OBJ_SIZE);
+	if (!shm)
+		return SD_RES_SYSTEM_ERROR;
+	c->shm = shm;
+
+	return SD_RES_SUCCESS;
+}
+
 /* Run the request synchronously */
 int sd_run_sdreq(struct sd_cluster *c, struct sd_req *hdr, void *data)
 {
-	struct sd_request *req = alloc_request(c, data,
-		hdr->data_length, SHEEP_CTL);
+	struct sd_request *req;
 	int ret;
 
+	if (c->shm && shm_client_fits(c->shm, hdr)) {
+		struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+
+		if (shm_client_exec(c->shm, hdr, data) < 0)
+			return SD_RES_EIO;
+		return rsp->result;
+	}
+
+	req = alloc_request(c, data, hdr->data_length, SHEEP_CTL);
 	if (!req)
 		return SD_RES_SYSTEM_ERROR;
 
@@ -62,8 +103,50 @@ int sd_run_sdreq(struct sd_cluster *c, struct sd_req *hdr, void *data)
 
 static void aio_end_request(struct sd_request *req, int ret)
 {
-	req->ret = ret;
-	eventfd_xwrite(req->efd, 1);
+	struct sd_cluster *c = req->cluster;
+	struct sd_aio *aio = req->aio;
+
+	if (!aio) {
+		req->ret = ret;
+		eventfd_xwrite(req->efd, 1);
+		return;
+	}
+
+	free_request(req);
+	aio->ret = ret;
+	if (aio->done) {
+		aio->done(aio);
+		return;
+	}
+
+	/* aio_fd is readable as long as aio_list is not empty */
+	sd_mutex_lock(&c->aio_lock);
+	if (list_empty(&c->aio_list))
+		eventfd_xwrite(c->aio_fd, 1);
+	list_add_tail(&aio->list, &c->aio_list);
+	sd_mutex_unlock(&c->aio_lock);
+}
+
+int sd_aio_fd(struct sd_cluster *c)
+{
+	return c->aio_fd;
+}
+
+int sd_aio_reap(struct sd_cluster *c, struct sd_aio **aios, int max)
+{
+	int nr = 0;
+
+	sd_mutex_lock(&c->aio_lock);
+	while (nr < max && !list_empty(&c->aio_list)) {
+		aios[nr] = list_first_entry(&c->aio_list, struct sd_aio, list);
+		list_del(&aios[nr]->list);
+		nr++;
+	}
+	if (nr && list_empty(&c->aio_list))
+		eventfd_xread(c->aio_fd);
+	sd_mutex_unlock(&c->aio_lock);
+
+	return nr;
 }
 
 static void aio_rw_done(struct sheep_aiocb *aiocb)
@@ -122,10 +205,24 @@ uint32_t sheep_inode_get_vid(struct sd_request *req, uint32_t idx)
 	return vid;
 }
 
+/* Bind the request to a connection, where its reply will come from */
+void add_inflight_request(struct sheep_request *req)
+{
+	struct sd_cluster *c = req->aiocb->request->cluster;
+	struct sd_conn *conn = c->conns + req->seq_num % c->nr_conns;
+
+	req->conn = conn;
+	sd_write_lock(&conn->inflight_lock);
+	list_add_tail(&req->list, &conn->inflight_list);
+	hlist_add_head(&req->hash, conn->inflight_hash +
+		       req->seq_num % SD_INFLIGHT_HASH_SIZE);
+	sd_rw_unlock(&conn->inflight_lock);
+}
+
 int submit_sheep_request(struct sheep_request *req)
 {
 	struct sd_req hdr = {};
-	struct sd_cluster *c = req->aiocb->request->cluster;
+	struct sd_conn *conn;
 	int ret = 0;
 
 	hdr.id = req->seq_num;
@@ -134,13 +231,25 @@ int submit_sheep_request(struct sheep_request *req)
 	hdr.obj.cow_oid = req->cow_oid;
 	hdr.obj.offset = req->offset;
 
-	sd_write_lock(&c->inflight_lock);
-	list_add_tail(&req->list, &c->inflight_list);
-	sd_rw_unlock(&c->inflight_lock);
+	add_inflight_request(req);
+	conn = req->conn;
 
 	switch (req->opcode) {
 	case VDI_CREATE:
 	case VDI_WRITE:
+		if (req->vec) {
+			uint32_t vlen = sizeof(*req->vec) * req->nr_vec;
+
+			hdr.opcode = SD_OP_WRITE_OBJS;
+			hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_DIRECT;
+			hdr.data_length = vlen + req->length;
+			hdr.vec.nr = req->nr_vec;
+			ret = sheep_submit_sdreq_vec(conn, &hdr, req->vec, vlen,
+						     req->buf, req->length);
+			if (ret < 0)
+				goto err;
+			break;
+		}
 		if (req->opcode == VDI_CREATE)
 			hdr.opcode = SD_OP_CREATE_AND_WRITE_OBJ;
 		else
@@ -148,50 +257,139 @@ int submit_sheep_request(struct sheep_request *req)
 		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_DIRECT;
 		if (req->cow_oid)
 			hdr.flags |= SD_FLAG_CMD_COW;
-		ret = sheep_submit_sdreq(c, &hdr, req->buf, req->length);
+		ret = sheep_submit_sdreq(conn, &hdr, req->buf, req->length);
 		if (ret < 0)
 			goto err;
 		break;
 	case VDI_READ:
+		if (req->vec) {
+			hdr.opcode = SD_OP_READ_OBJS;
+			hdr.flags = SD_FLAG_CMD_WRITE;
+			hdr.data_length = sizeof(*req->vec) * req->nr_vec;
+			hdr.vec.nr = req->nr_vec;
+			hdr.vec.rlen = req->length;
+			ret = sheep_submit_sdreq(conn, &hdr, req->vec,
+						 hdr.data_length);
+			if (ret < 0)
+				goto err;
+			break;
+		}
 		hdr.opcode = SD_OP_READ_OBJ;
-		ret = sheep_submit_sdreq(c, &hdr, NULL, 0);
+		ret = sheep_submit_sdreq(conn, &hdr, NULL, 0);
 		if (ret < 0)
 			goto err;
 		break;
 	}
 err:
-	eventfd_xwrite(c->reply_fd, 1);
+	eventfd_xwrite(conn->reply_fd, 1);
 	return ret;
 }
 
-void submit_blocking_sheep_request(struct sd_cluster *c, uint64_t oid)
+static struct hlist_head *create_hash_head(struct sd_cluster *c, uint64_t oid)
 {
-	struct sheep_request *req;
+	return c->create_hash + hash_64(oid, SD_CREATE_HASH_BITS);
+}
+
+/*
+ * Sheepdog can't handle concurrent creation on the same object, so only the
+ * first write to an unallocated object creates it and the later ones wait on
+ * the creating request.  Return true if 'req' is to be submitted now.
+ */
+bool prepare_create_request(struct sheep_request *req, uint32_t idx)
+{
+	struct sd_request *request = req->aiocb->request;
+	struct sd_cluster *c = request->cluster;
+	struct hlist_head *head = create_hash_head(c, req->oid);
+	struct sheep_request *creating;
+	struct hlist_node *node;
+	uint32_t vid;
 
 	sd_write_lock(&c->blocking_lock);
-	list_for_each_entry(req, &c->blocking_list, list) {
-		if (req->oid != oid)
-			continue;
-		list_del(&req->list);
-		submit_sheep_request(req);
+	/* The object might have been created before we grab blocking_lock */
+	vid = sheep_inode_get_vid(request, idx);
+	if (vid && vid == request->vdi->vid)
+		goto out;
+
+	hlist_for_each_entry(creating, node, head, create_hash) {
+		if (creating->oid == req->oid) {
+			list_add_tail(&req->list, &creating->blocked);
+			sd_rw_unlock(&c->blocking_lock);
+			return false;
+		}
 	}
+
+	req->opcode = VDI_CREATE;
+	INIT_LIST_HEAD(&req->blocked);
+	hlist_add_head(&req->create_hash, head);
+out:
 	sd_rw_unlock(&c->blocking_lock);
+	return true;
 }
 
-struct sheep_request *find_inflight_request_oid(struct sd_cluster *c,
-						       uint64_t oid)
+static int blocked_cmp(const void *a, const void *b)
 {
-	struct sheep_request *req;
+	const struct sheep_request *ra = *(struct sheep_request **)a;
+	const struct sheep_request *rb = *(struct sheep_request **)b;
+
+	return intcmp(ra->offset, rb->offset);
+}
 
-	sd_read_lock(&c->inflight_lock);
-	list_for_each_entry(req, &c->inflight_list, list) {
-		if (req->oid == oid) {
-			sd_rw_unlock(&c->inflight_lock);
-			return req;
+/*
+ * Send the writes which waited for the creation.  They target the same object,
+ * so the ones of adjacent ranges are coalesced into one request.
+ */
+static void submit_blocked_requests(struct sheep_request *create)
+{
+	struct sd_cluster *c = create->aiocb->request->cluster;
+	struct sheep_request *req, **reqs;
+	LIST_HEAD(blocked);
+	int nr = 0, i, j;
+
+	sd_write_lock(&c->blocking_lock);
+	hlist_del(&create->create_hash);
+	list_splice_init(&create->blocked, &blocked);
+	sd_rw_unlock(&c->blocking_lock);
+
+	list_for_each_entry(req, &blocked, list)
+		nr++;
+	if (!nr)
+		return;
+
+	reqs = xmalloc(sizeof(*reqs) * nr);
+	nr = 0;
+	list_for_each_entry(req, &blocked, list) {
+		list_del(&req->list);
+		reqs[nr++] = req;
+	}
+	qsort(reqs, nr, sizeof(*reqs), blocked_cmp);
+
+	for (i = 0; i < nr; i = j) {
+		struct sheep_request *first = reqs[i];
+		uint32_t end = first->offset + first->length;
+		char *p;
+
+		for (j = i + 1; j < nr; j++) {
+			if (reqs[j]->offset != end ||
+			    reqs[j]->cow_oid != first->cow_oid)
+				break;
+			end += reqs[j]->length;
 		}
+
+		if (j - i > 1) {
+			first->bounce = xmalloc(end - first->offset);
+			p = first->bounce;
+			for (int k = i; k < j; k++) {
+				memcpy(p, reqs[k]->buf, reqs[k]->length);
+				p += reqs[k]->length;
+				if (k > i)
+					reqs[k - 1]->merged = reqs[k];
+			}
+			first->buf = first->bounce;
+			first->length = end - first->offset;
+		}
+		submit_sheep_request(first);
 	}
-	sd_rw_unlock(&c->inflight_lock);
-	return NULL;
+	free(reqs);
 }
 
 static int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
@@ -246,79 +444,100 @@ static void *request_handler(void *data)
 	pthread_exit(NULL);
 }
 
-static struct sheep_request *fetch_first_inflight_request(struct sd_cluster *c)
+static struct sheep_request *fetch_first_inflight_request(struct sd_conn *conn)
 {
 	struct sheep_request *req;
 
-	sd_write_lock(&c->inflight_lock);
-	if (!list_empty(&c->inflight_list)) {
-		req = list_first_entry(&c->inflight_list, struct sheep_request,
-				       list);
+	sd_write_lock(&conn->inflight_lock);
+	if (!list_empty(&conn->inflight_list)) {
+		req = list_first_entry(&conn->inflight_list,
+				       struct sheep_request, list);
 		list_del(&req->list);
+		hlist_del(&req->hash);
 	} else {
 		req = NULL;
 	}
-	sd_rw_unlock(&c->inflight_lock);
+	sd_rw_unlock(&conn->inflight_lock);
 	return req;
 }
 
-static struct sheep_request *fetch_inflight_request(struct sd_cluster *c,
+static struct sheep_request *fetch_inflight_request(struct sd_conn *conn,
 						    uint32_t seq_num)
 {
+	struct hlist_head *head = conn->inflight_hash +
+		seq_num % SD_INFLIGHT_HASH_SIZE;
 	struct sheep_request *req;
+	struct hlist_node *node;
 
-	sd_write_lock(&c->inflight_lock);
-	list_for_each_entry(req, &c->inflight_list, list) {
+	sd_write_lock(&conn->inflight_lock);
+	hlist_for_each_entry(req, node, head, hash) {
 		if (req->seq_num == seq_num) {
 			list_del(&req->list);
+			hlist_del(&req->hash);
 			goto out;
 		}
 	}
 	req = NULL;
 out:
-	sd_rw_unlock(&c->inflight_lock);
+	sd_rw_unlock(&conn->inflight_lock);
 	return req;
 }
 
 int end_sheep_request(struct sheep_request *req)
 {
-	struct sheep_aiocb *aiocb = req->aiocb;
+	struct sheep_request *next;
+
+	/* The inode is updated by now if the creation succeeded */
+	if (req->opcode == VDI_CREATE)
+		submit_blocked_requests(req);
 
-	if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
-		aiocb->aio_done_func(aiocb);
+	for (; req; req = next) {
+		struct sheep_aiocb *aiocb = req->aiocb;
 
-	free(req);
+		next = req->merged;
+		if (uatomic_sub_return(&aiocb->nr_requests, 1) <= 0)
+			aiocb->aio_done_func(aiocb);
+
+		free(req->vec);
+		free(req->bounce);
+		free(req);
+	}
 
 	return 0;
 }
 
+static void fail_sheep_request(struct sheep_request *req)
+{
+	for (; req; req = req->merged)
+		req->aiocb->ret = SD_RES_EIO;
+}
 
 /* FIXME: add auto-reconnect support */
-static int sheep_handle_reply(struct sd_cluster *c)
+static int sheep_handle_reply(struct sd_conn *conn)
 {
 	struct sd_rsp rsp = {};
 	struct sheep_request *req;
 	struct sheep_aiocb *aiocb;
 	int ret;
 
-	ret = xread(c->sockfd, (char *)&rsp, sizeof(rsp));
+	ret = xread(conn->sockfd, (char *)&rsp, sizeof(rsp));
 	if (ret < 0) {
-		req = fetch_first_inflight_request(c);
+		req = fetch_first_inflight_request(conn);
 		if (req != NULL) {
-			req->aiocb->ret = SD_RES_EIO;
+			fail_sheep_request(req);
 			goto end_request;
 		}
 		goto err;
 	}
 
-	req = fetch_inflight_request(c, rsp.id);
+	req = fetch_inflight_request(conn, rsp.id);
 	if (!req)
 		return 0;
 
 	if (rsp.data_length > 0) {
-		ret = xread(c->sockfd, req->buf, req->length);
+		ret = xread(conn->sockfd, req->buf, req->length);
 		if (ret < 0) {
-			req->aiocb->ret = SD_RES_EIO;
+			fail_sheep_request(req);
 			goto end_request;
 		}
 	}
@@ -336,72 +555,132 @@ err:
 
 static void *reply_handler(void *data)
 {
-	struct sd_cluster *c = data;
+	struct sd_conn *conn = data;
+	struct sd_cluster *c = conn->cluster;
 
-	while (!uatomic_is_true(&c->stop_request_handler) ||
-	       !list_empty(&c->inflight_list)) {
+	while (!uatomic_is_true(&c->stop_reply_handler) ||
+	       !list_empty(&conn->inflight_list)) {
 		bool empty;
 
 		uint64_t events;
-		events = eventfd_xread(c->reply_fd);
+		events = eventfd_xread(conn->reply_fd);
 
-		sd_read_lock(&c->inflight_lock);
-		empty = list_empty(&c->inflight_list);
-		sd_rw_unlock(&c->inflight_lock);
+		sd_read_lock(&conn->inflight_lock);
+		empty = list_empty(&conn->inflight_list);
+		sd_rw_unlock(&conn->inflight_lock);
 
 		if (empty)
 			continue;
 
 		for (uint64_t i = 0; i < events; i++)
-			sheep_handle_reply(c);
+			sheep_handle_reply(conn);
 
 	}
 	pthread_exit(NULL);
 }
 
-static int init_cluster_handlers(struct sd_cluster *c)
+static int connect_to_sheep(const struct sockaddr_in *addr)
+{
+	struct linger linger_opt = {1, 0};
+	int fd, ret, value = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0) {
+		errno = SD_RES_SYSTEM_ERROR;
+		return -1;
+	}
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger_opt,
+			 sizeof(linger_opt));
+	if (ret < 0)
+		goto err;
+
+	ret = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+	if (ret < 0)
+		goto err;
+
+	ret = connect(fd, (const struct sockaddr *)addr, sizeof(*addr));
+	if (ret < 0)
+		goto err;
+
+	return fd;
+err:
+	close(fd);
+	errno = SD_RES_SYSTEM_ERROR;
+	return -1;
+}
+
+static int init_conn(struct sd_cluster *c, struct sd_conn *conn,
+		     const struct sockaddr_in *addr)
 {
-	pthread_t thread;
 	int ret;
 
-	c->request_fd = eventfd(0, 0);
-	if (c->request_fd < 0)
-		return -SD_RES_SYSTEM_ERROR;
+	conn->cluster = c;
+	INIT_LIST_HEAD(&conn->inflight_list);
+	conn->sockfd = connect_to_sheep(addr);
+	if (conn->sockfd < 0)
+		return errno;
 
-	c->reply_fd = eventfd(0, 0);
-	if (c->reply_fd < 0) {
-		close(c->request_fd);
-		return -SD_RES_SYSTEM_ERROR;
+	conn->reply_fd = eventfd(0, 0);
+	if (conn->reply_fd < 0) {
+		close(conn->sockfd);
+		return SD_RES_SYSTEM_ERROR;
 	}
 
-	ret = pthread_create(&thread, NULL, request_handler, c);
-	if (ret < 0) {
-		close(c->request_fd);
-		close(c->reply_fd);
-		return ret;
-	}
-	c->request_thread = thread;
-	ret = pthread_create(&thread, NULL, reply_handler, c);
-	if (ret < 0) {
-		close(c->reply_fd);
-		uatomic_set_true(&c->stop_request_handler);
-		eventfd_xwrite(c->request_fd, 1);
-		pthread_join(c->request_thread, NULL);
-		return ret;
+	sd_init_rw_lock(&conn->inflight_lock);
+	sd_init_mutex(&conn->submit_mutex);
+	ret = pthread_create(&conn->reply_thread, NULL, reply_handler, conn);
+	if (ret != 0) {
+		sd_destroy_rw_lock(&conn->inflight_lock);
+		sd_destroy_mutex(&conn->submit_mutex);
+		close(conn->reply_fd);
+		close(conn->sockfd);
+		return SD_RES_SYSTEM_ERROR;
 	}
-	c->reply_thread = thread;
 
 	return SD_RES_SUCCESS;
 }
 
-struct sd_cluster *sd_connect(char *host)
+/* The caller must set stop_reply_handler beforehand */
+static void destroy_conn(struct sd_conn *conn)
+{
+	eventfd_xwrite(conn->reply_fd, 1);
+	pthread_join(conn->reply_thread, NULL);
+	sd_destroy_rw_lock(&conn->inflight_lock);
+	sd_destroy_mutex(&conn->submit_mutex);
+	close(conn->reply_fd);
+	close(conn->sockfd);
+}
+
+static void free_cluster(struct sd_cluster *c)
+{
+	uatomic_set_true(&c->stop_reply_handler);
+	for (int i = 0; i < c->nr_conns; i++)
+		destroy_conn(c->conns + i);
+	sd_destroy_rw_lock(&c->request_lock);
+	sd_destroy_rw_lock(&c->blocking_lock);
+	sd_destroy_rw_lock(&c->placement_lock);
+	sd_destroy_mutex(&c->aio_lock);
+	if (c->request_fd >= 0)
+		close(c->request_fd);
+	if (c->aio_fd >= 0)
+		close(c->aio_fd);
+	free(c->conns);
+	free(c);
+}
+
+struct sd_cluster *sd_connect_multi(char *host, int nr_conns)
 {
 	char *ip, *pt, *h = xstrdup(host);
 	unsigned port;
 	struct sockaddr_in addr;
-	struct linger linger_opt = {1, 0};
-	int fd, ret, value = 1;
 	struct sd_cluster *c;
+	int ret;
+
+	if (nr_conns < 1) {
+		errno = SD_RES_INVALID_PARMS;
+		goto err;
+	}
 
 	ip = strtok(h, ":");
 	if (!ip) {
@@ -420,25 +699,6 @@ struct sd_cluster *sd_connect(char *host)
 		goto err;
 	}
 
-	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (fd < 0) {
-		errno = SD_RES_SYSTEM_ERROR;
-		goto err;
-	}
-
-	ret = setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger_opt,
-			 sizeof(linger_opt));
-	if (ret < 0) {
-		errno = SD_RES_SYSTEM_ERROR;
-		goto err_close;
-	}
-
-	ret = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
-	if (ret < 0) {
-		errno = SD_RES_SYSTEM_ERROR;
-		goto err_close;
-	}
-
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	ret = inet_pton(AF_INET, ip, &addr.sin_addr);
@@ -447,58 +707,64 @@ struct sd_cluster *sd_connect(char *host)
 		break;
 	default:
 		errno = SD_RES_INVALID_PARMS;
-		goto err_close;
-	}
-
-	ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-	if (ret < 0) {
-		errno = SD_RES_SYSTEM_ERROR;
-		goto err_close;
+		goto err;
 	}
 
 	c = xzalloc(sizeof(*c));
-	c->sockfd = fd;
 	c->port = port;
-	memcpy(c->addr, &addr.sin_addr, INET_ADDRSTRLEN);
-	ret = init_cluster_handlers(c);
-	if (ret < 0) {
-		free(c);
-		errno = -ret;
-		goto err_close;
-	};
+	memcpy(c->addr, &addr.sin_addr, sizeof(addr.sin_addr));
 	INIT_LIST_HEAD(&c->request_list);
-	INIT_LIST_HEAD(&c->inflight_list);
-	INIT_LIST_HEAD(&c->blocking_list);
+	INIT_LIST_HEAD(&c->aio_list);
 	sd_init_rw_lock(&c->request_lock);
-	sd_init_rw_lock(&c->inflight_lock);
 	sd_init_rw_lock(&c->blocking_lock);
-	sd_init_mutex(&c->submit_mutex);
+	sd_init_rw_lock(&c->placement_lock);
+	sd_init_mutex(&c->aio_lock);
+	c->request_fd = eventfd(0, 0);
+	c->aio_fd = eventfd(0, EFD_NONBLOCK);
+	if (c->request_fd < 0 || c->aio_fd < 0) {
+		errno = SD_RES_SYSTEM_ERROR;
+		goto err_free;
+	}
+
+	c->conns = xzalloc(sizeof(*c->conns) * nr_conns);
+	for (; c->nr_conns < nr_conns; c->nr_conns++) {
+		ret = init_conn(c, c->conns + c->nr_conns, &addr);
+		if (ret != SD_RES_SUCCESS) {
+			errno = ret;
+			goto err_free;
+		}
+	}
+
+	ret = pthread_create(&c->request_thread, NULL, request_handler, c);
+	if (ret != 0) {
+		errno = SD_RES_SYSTEM_ERROR;
+		goto err_free;
+	}
 
 	free(h);
 	return c;
-err_close:
-	close(fd);
+err_free:
+	free_cluster(c);
 err:
 	free(h);
 	return NULL;
 }
 
+struct sd_cluster *sd_connect(char *host)
+{
+	return sd_connect_multi(host, 1);
+}
+
 int sd_disconnect(struct sd_cluster *c)
 {
+	/* the dirty objects are written through the request handler */
+	disable_cache(c);
 	uatomic_set_true(&c->stop_request_handler);
-	uatomic_set_true(&c->stop_reply_handler);
 	eventfd_xwrite(c->request_fd, 1);
-	eventfd_xwrite(c->reply_fd, 1);
 	pthread_join(c->request_thread, NULL);
-	pthread_join(c->reply_thread, NULL);
-	sd_destroy_rw_lock(&c->request_lock);
-	sd_destroy_rw_lock(&c->inflight_lock);
-	sd_destroy_rw_lock(&c->blocking_lock);
-	sd_destroy_mutex(&c->submit_mutex);
-	close(c->request_fd);
-	close(c->reply_fd);
-	close(c->sockfd);
-	free(c);
+	free_direct_read(c);
+	shm_client_detach(c->shm);
+	free_cluster(c);
 
 	return SD_RES_SUCCESS;
 }
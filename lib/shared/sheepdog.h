@@ -25,23 +25,53 @@
 #include <arpa/inet.h>
 #include <sys/eventfd.h>
 
-struct sd_cluster {
+#define SD_INFLIGHT_HASH_BITS	8
+#define SD_INFLIGHT_HASH_SIZE	(1U << SD_INFLIGHT_HASH_BITS)
+#define SD_CREATE_HASH_BITS	8
+#define SD_CREATE_HASH_SIZE	(1U << SD_CREATE_HASH_BITS)
+
+/* One connection to the sheep, with its own reply thread */
+struct sd_conn {
+	struct sd_cluster *cluster;
 	int sockfd;
+	pthread_t reply_thread;
+	int reply_fd;
+	/* in submission order, and hashed by seq_num for the replies */
+	struct list_head inflight_list;
+	struct hlist_head inflight_hash[SD_INFLIGHT_HASH_SIZE];
+	struct sd_rw_lock inflight_lock;
+	struct sd_mutex submit_mutex;
+};
+
+struct sd_cluster {
 	uint8_t addr[INET_ADDRSTRLEN];
 	unsigned int port;
 	uint32_t seq_num;
 	pthread_t request_thread;
-	pthread_t reply_thread;
-	int request_fd, reply_fd;
+	int request_fd;
 	struct list_head request_list;
-	struct list_head inflight_list;
-	struct list_head blocking_list;
+	/* requests creating an object, hashed by oid, see blocking_lock */
+	struct hlist_head create_hash[SD_CREATE_HASH_SIZE];
 	uatomic_bool stop_request_handler;
 	uatomic_bool stop_reply_handler;
 	struct sd_rw_lock request_lock;
-	struct sd_rw_lock inflight_lock;
 	struct sd_rw_lock blocking_lock;
-	struct sd_mutex submit_mutex;
+	/* requests are spread over the connections by their seq_num */
+	struct sd_conn *conns;
+	int nr_conns;
+	/* completed sd_aio without a done callback, see sd_aio_reap() */
+	struct list_head aio_list;
+	struct sd_mutex aio_lock;
+	int aio_fd;
+	/* the sheep doesn't support SD_OP_READ_OBJS and SD_OP_WRITE_OBJS */
+	uatomic_bool no_obj_vec;
+	/* object placement for direct reads, NULL if not enabled */
+	struct sd_placement *placement;
+	struct sd_rw_lock placement_lock;
+	/* the local cache of the data objects, NULL if not enabled */
+	struct sd_cache *cache;
+	/* the shared memory ring to the local sheep, NULL if not attached */
+	struct shm_client *shm;
 };
 
 struct sd_vdi {
@@ -51,6 +81,34 @@ struct sd_vdi {
 	char *name;
 };
 
+enum sd_aio_op {
+	SD_AIO_READ,
+	SD_AIO_WRITE,
+};
+
+/*
+ * Asynchronous vdi I/O, see sd_aio_submit().  The caller owns the structure
+ * and must keep it and the buffer valid until the request completes.
+ */
+struct sd_aio {
+	enum sd_aio_op op;
+	struct sd_vdi *vdi;
+	void *buf;
+	size_t count;
+	off_t offset;
+	/*
+	 * Called on completion from the threads of libsheepdog, so it must
+	 * not block nor issue a synchronous request on the same cluster.  If
+	 * it is NULL, the request is queued for sd_aio_reap() instead.
+	 */
+	void (*done)(struct sd_aio *aio);
+	void *opaque;
+	/* error code defined in sheepdog_proto.h, set on completion */
+	int ret;
+	/* used by libsheepdog */
+	struct list_node list;
+};
+
 /*
  * Connect to the specified Sheepdog cluster.
  *
@@ -61,6 +119,21 @@ struct sd_vdi {
  */
 struct sd_cluster *sd_connect(char *host);
 
+/*
+ * Connect to the specified Sheepdog cluster with several connections.
+ *
+ * @host: string in the form of IP:PORT that identify a valid Sheepdog cluster.
+ * @nr_conns: how many connections to open to the sheep.
+ *
+ * Requests are spread over the connections, each of which has its own reply
+ * thread, so that many requests in flight are not serialized on one socket.
+ * sd_connect() is the same as sd_connect_multi(host, 1).
+ *
+ * Return a cluster descriptor on success. Otherwise, return NULL in case of
+ * error and set errno as error code defined in sheepdog_proto.h.
+ */
+struct sd_cluster *sd_connect_multi(char *host, int nr_conns);
+
 /*
  * Disconnect to the specified sheepdog cluster.
  *
@@ -70,6 +143,53 @@ struct sd_cluster *sd_connect(char *host);
  */
 int sd_disconnect(struct sd_cluster *c);
 
+/*
+ * Enable direct reads on the specified cluster.
+ *
+ * @c: pointer to the cluster descriptor.
+ *
+ * Once enabled, sd_vdi_read() of a replicated vdi reads the data objects from
+ * one of their replicas directly, preferring the one on the connected sheep,
+ * instead of having the connected sheep forward the requests.  Writes still
+ * go through the connected sheep.
+ *
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_enable_direct_read(struct sd_cluster *c);
+
+/*
+ * Cache the data objects in a local file, e.g. on a SSD.
+ *
+ * @c: pointer to the cluster descriptor.
+ * @path: the file, created if it doesn't exist.
+ * @size: the size of the file, at least one object.
+ * @writeback: keep the writes to the cached objects in the file until the
+ *             vdi is closed or the cluster disconnected.
+ *
+ * Once enabled, sd_vdi_read() serves the objects read twice recently from the
+ * file, which keeps them for the next time it's enabled with the same size.
+ * It must be called before any vdi is opened, and the vdis must not be written
+ * by other clients in the meantime.
+ *
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_enable_cache(struct sd_cluster *c, const char *path, uint64_t size,
+		    bool writeback);
+
+/*
+ * Talk to the connected sheep through a shared memory ring.
+ *
+ * @c: pointer to the cluster descriptor.
+ * @path: the unix domain socket of the sheep, <dir>/sock of its store.
+ *
+ * The sheep must run on the same host.  Once attached, sd_run_sdreq() passes
+ * the requests and their data through the ring instead of the socket, except
+ * the ones larger than an object.
+ *
+ * Return error code defined in sheepdog_proto.h.
+ */
+int sd_attach_shm(struct sd_cluster *c, const char *path);
+
 /*
  * Run the Sheepdog request on the specified cluster synchronously.
  *
@@ -118,6 +238,48 @@ int sd_vdi_read(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
 int sd_vdi_write(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
 		size_t count, off_t offset);
 
+/*
+ * Submit asynchronous reads and writes to the specified cluster.
+ *
+ * @c: pointer to the cluster descriptor.
+ * @aios: array of requests to submit.
+ * @nr: number of requests in @aios.
+ *
+ * The requests are queued at once and this returns without waiting for them.
+ * On completion ->ret is set and ->done is called, or the request is queued
+ * for sd_aio_reap() if ->done is NULL.  The requests may complete in any
+ * order.
+ *
+ * Return SD_RES_SUCCESS if all the requests were queued. Otherwise, none of
+ * them was queued and error code defined in sheepdog_proto.h is returned.
+ */
+int sd_aio_submit(struct sd_cluster *c, struct sd_aio **aios, int nr);
+
+/*
+ * Get the completion file descriptor of the specified cluster.
+ *
+ * @c: pointer to the cluster descriptor.
+ *
+ * The descriptor is readable by poll() and friends as long as there are
+ * completed requests to be reaped by sd_aio_reap().  Don't read or close it.
+ *
+ * Return the file descriptor.
+ */
+int sd_aio_fd(struct sd_cluster *c);
+
+/*
+ * Reap completed asynchronous requests which have no done callback.
+ *
+ * @c: pointer to the cluster descriptor.
+ * @aios: array to hold the completed requests.
+ * @max: size of @aios.
+ *
+ * Doesn't block.
+ *
+ * Return the number of requests stored in @aios.
+ */
+int sd_aio_reap(struct sd_cluster *c, struct sd_aio **aios, int max);
+
 /*
  * Close a vdi descriptor.
  *
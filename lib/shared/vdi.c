@@ -114,7 +114,8 @@ void queue_request(struct sd_request *req)
 
 void free_request(struct sd_request *req)
 {
-	close(req->efd);
+	if (req->efd >= 0)
+		close(req->efd);
 	free(req);
 }
 
@@ -143,10 +144,22 @@ struct sd_request *alloc_request(struct sd_cluster *c,
 int sd_vdi_read(struct sd_cluster *c, struct sd_vdi *vdi,
 			void *buf, size_t count, off_t offset)
 {
-	struct sd_request *req = alloc_request(c, buf,
-					count, VDI_READ);
+	struct sd_request *req;
 	int ret;
 
+	if (c->cache) {
+		ret = cache_read(c, vdi, buf, count, offset);
+		if (ret != SD_RES_NO_OBJ)
+			return ret;
+	}
+
+	if (c->placement &&
+	    vdi_direct_read(c, vdi, buf, count, offset) == SD_RES_SUCCESS) {
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+
+	req = alloc_request(c, buf, count, VDI_READ);
 	if (!req)
 		return errno;
 
@@ -157,6 +170,9 @@ int sd_vdi_read(struct sd_cluster *c, struct sd_vdi *vdi,
 	eventfd_xread(req->efd);
 	ret = req->ret;
 	free_request(req);
+out:
+	if (c->cache && ret == SD_RES_SUCCESS)
+		cache_admit(c, vdi, buf, count, offset);
 
 	return ret;
 }
@@ -164,10 +180,16 @@ int sd_vdi_read(struct sd_cluster *c, struct sd_vdi *vdi,
 int sd_vdi_write(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
 			size_t count, off_t offset)
 {
-	struct sd_request *req = alloc_request(c, buf,
-					count, VDI_WRITE);
+	struct sd_request *req;
 	int ret;
 
+	if (c->cache) {
+		ret = cache_write(c, vdi, buf, count, offset);
+		if (ret != SD_RES_NO_OBJ)
+			return ret;
+	}
+
+	req = alloc_request(c, buf, count, VDI_WRITE);
 	if (!req)
 		return errno;
 
@@ -179,13 +201,68 @@ int sd_vdi_write(struct sd_cluster *c, struct sd_vdi *vdi, void *buf,
 	ret = req->ret;
 	free_request(req);
 
+	if (c->cache && ret == SD_RES_SUCCESS)
+		cache_update(c, vdi, buf, count, offset);
+
 	return ret;
 }
 
+int sd_aio_submit(struct sd_cluster *c, struct sd_aio **aios, int nr)
+{
+	static const uint8_t opcodes[] = {
+		[SD_AIO_READ] = VDI_READ,
+		[SD_AIO_WRITE] = VDI_WRITE,
+	};
+	struct sd_request *req;
+
+	for (int i = 0; i < nr; i++)
+		if (!aios[i]->vdi || aios[i]->op >= ARRAY_SIZE(opcodes))
+			return SD_RES_INVALID_PARMS;
+
+	if (nr <= 0)
+		return SD_RES_SUCCESS;
+
+	/* the requests bypass the cache */
+	for (int i = 0; c->cache && i < nr; i++) {
+		int ret = cache_bypass(c, aios[i]->vdi, aios[i]->count,
+				       aios[i]->offset,
+				       aios[i]->op == SD_AIO_WRITE);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	/* Queue the whole batch at once and wake the request handler once */
+	sd_write_lock(&c->request_lock);
+	for (int i = 0; i < nr; i++) {
+		req = xzalloc(sizeof(*req));
+		req->efd = -1;
+		req->cluster = c;
+		req->aio = aios[i];
+		req->vdi = aios[i]->vdi;
+		req->data = aios[i]->buf;
+		req->length = aios[i]->count;
+		req->offset = aios[i]->offset;
+		req->opcode = opcodes[aios[i]->op];
+		INIT_LIST_NODE(&req->list);
+		list_add_tail(&req->list, &c->request_list);
+	}
+	sd_rw_unlock(&c->request_lock);
+
+	eventfd_xwrite(c->request_fd, nr);
+
+	return SD_RES_SUCCESS;
+}
+
 int sd_vdi_close(struct sd_cluster *c, struct sd_vdi *vdi)
 {
 	int ret;
 
+	if (c->cache) {
+		ret = cache_flush(c, vdi->vid);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
 	ret = unlock_vdi(c, vdi);
 	if (ret != SD_RES_SUCCESS) {
 		fprintf(stderr, "failed to unlock %s\n", vdi->name);
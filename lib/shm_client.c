@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The client side of the shared memory ring, see shm_ring.h
+ *
+ * It's linked into both dog and libsheepdog, so it doesn't log; the callers
+ * fall back to their sockets if it fails.  Any number of threads can run
+ * requests at once, the one which waits first reaps the completions for all.
+ */
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "sheep.h"
+#include "shm_ring.h"
+#include "util.h"
+
+struct shm_client {
+	int sockfd;
+	int sq_efd;
+	int cq_efd;
+	struct sd_shm_ring *ring;
+	size_t size;
+	uint32_t nr_slots;
+	uint32_t slot_size;
+
+	struct sd_mutex lock;
+	struct sd_cond cond;
+	uint32_t sq_tail;
+	uint32_t cq_head;
+	uint32_t free_slots[SD_SHM_MAX_SLOTS];
+	uint32_t nr_free;
+	bool done[SD_SHM_MAX_SLOTS];
+	bool reaping;
+	bool broken;	/* the sheep went away */
+};
+
+static int create_memfd(size_t size)
+{
+#ifdef __NR_memfd_create
+	int fd = syscall(__NR_memfd_create, "sheepdog-ring",
+			 1 /* CLOEXEC */ | 2 /* ALLOW_SEALING */);
+
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, size) < 0 ||
+	    fcntl(fd, F_ADD_SEALS, SD_SHM_SEALS) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int connect_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Send SD_OP_SHM_ATTACH with the fds of the ring */
+static int send_attach(struct shm_client *c, int memfd)
+{
+	int fds[SD_SHM_NR_FDS] = { memfd, c->sq_efd, c->cq_efd };
+	char control[CMSG_SPACE(sizeof(fds))] = {};
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	ssize_t ret;
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	sd_init_req(&hdr, SD_OP_SHM_ATTACH);
+	do {
+		ret = sendmsg(c->sockfd, &msg, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret != sizeof(hdr))
+		return -1;
+
+	if (xread(c->sockfd, rsp, sizeof(*rsp)) != sizeof(*rsp))
+		return -1;
+	if (rsp->result != SD_RES_SUCCESS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void free_client(struct shm_client *c)
+{
+	if (c->ring)
+		munmap(c->ring, c->size);
+	if (c->sockfd >= 0)
+		close(c->sockfd);
+	if (c->sq_efd >= 0)
+		close(c->sq_efd);
+	if (c->cq_efd >= 0)
+		close(c->cq_efd);
+	sd_destroy_cond(&c->cond);
+	sd_destroy_mutex(&c->lock);
+	free(c);
+}
+
+/*
+ * Attach a ring of 'nr_slots' slots of 'slot_size' bytes to the sheep
+ * listening on the unix domain socket 'path'.  Returns NULL and sets errno on
+ * failure.
+ */
+struct shm_client *shm_client_attach(const char *path, uint32_t nr_slots,
+				     uint32_t slot_size)
+{
+	struct shm_client *c;
+	int memfd = -1, err;
+
+	if (!nr_slots || nr_slots > SD_SHM_MAX_SLOTS || !slot_size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	c = xzalloc(sizeof(*c));
+	c->sq_efd = c->cq_efd = -1;
+	c->nr_slots = nr_slots;
+	c->slot_size = slot_size;
+	c->size = sd_shm_size(nr_slots, slot_size);
+	sd_init_mutex(&c->lock);
+	sd_cond_init(&c->cond);
+	for (uint32_t i = 0; i < nr_slots; i++)
+		c->free_slots[c->nr_free++] = i;
+
+	c->sockfd = connect_unix(path);
+	if (c->sockfd < 0)
+		goto err;
+
+	memfd = create_memfd(c->size);
+	if (memfd < 0)
+		goto err;
+	c->ring = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       memfd, 0);
+	if (c->ring == MAP_FAILED) {
+		c->ring = NULL;
+		goto err;
+	}
+	c->ring->magic = SD_SHM_MAGIC;
+	c->ring->nr_slots = nr_slots;
+	c->ring->slot_size = slot_size;
+
+	c->sq_efd = eventfd(0, EFD_CLOEXEC);
+	c->cq_efd = eventfd(0, EFD_CLOEXEC);
+	if (c->sq_efd < 0 || c->cq_efd < 0)
+		goto err;
+
+	if (send_attach(c, memfd) < 0)
+		goto err;
+	close(memfd);
+
+	return c;
+err:
+	err = errno;
+	if (memfd >= 0)
+		close(memfd);
+	free_client(c);
+	errno = err;
+	return NULL;
+}
+
+/* The length of the data the response of 'hdr' carries back */
+static uint32_t rsp_data_length(const struct sd_req *hdr)
+{
+	if (!(hdr->flags & SD_FLAG_CMD_WRITE))
+		return hdr->data_length;
+	if (hdr->flags & SD_FLAG_CMD_PIGGYBACK)
+		return hdr->data_length;
+	return 0;
+}
+
+/* Whether 'hdr' can go through the ring, the others need the socket */
+bool shm_client_fits(const struct shm_client *c, const struct sd_req *hdr)
+{
+	return !c->broken && !is_obj_vec_req(hdr) &&
+		hdr->data_length <= c->slot_size;
+}
+
+/* Called with the lock held, drops it while waiting for the sheep */
+static void reap_completions(struct shm_client *c)
+{
+	struct sd_shm_ring *ring = c->ring;
+	struct pollfd pfd[2] = {
+		{ .fd = c->cq_efd, .events = POLLIN },
+		{ .fd = c->sockfd, .events = POLLIN },
+	};
+	eventfd_t val;
+	uint32_t tail;
+	int ret;
+
+	c->reaping = true;
+	sd_mutex_unlock(&c->lock);
+	do {
+		ret = poll(pfd, ARRAY_SIZE(pfd), -1);
+	} while (ret < 0 && errno == EINTR);
+	if (pfd[0].revents & POLLIN)
+		eventfd_read(c->cq_efd, &val);
+	sd_mutex_lock(&c->lock);
+	c->reaping = false;
+
+	/* nothing comes on the socket but its hangup */
+	if (ret < 0 || pfd[1].revents)
+		c->broken = true;
+
+	tail = uatomic_read(&ring->cq_tail);
+	cmm_smp_rmb();
+	while (c->cq_head != tail) {
+		uint32_t slot = ring->cq[c->cq_head++ % c->nr_slots];
+
+		if (slot < c->nr_slots)
+			c->done[slot] = true;
+	}
+	uatomic_set(&ring->cq_head, c->cq_head);
+	sd_cond_broadcast(&c->cond);
+}
+
+/*
+ * Run 'hdr' like exec_req(), the response is written back to 'hdr'.  Returns
+ * 0 on success and -1 if the sheep went away.
+ */
+int shm_client_exec(struct shm_client *c, struct sd_req *hdr, void *data)
+{
+	struct sd_shm_ring *ring = c->ring;
+	struct sd_shm_slot *s;
+	uint32_t slot, rlen = rsp_data_length(hdr);
+	void *buf;
+
+	sd_mutex_lock(&c->lock);
+	while (!c->nr_free && !c->broken)
+		sd_cond_wait(&c->cond, &c->lock);
+	if (c->broken) {
+		sd_mutex_unlock(&c->lock);
+		return -1;
+	}
+	slot = c->free_slots[--c->nr_free];
+	c->done[slot] = false;
+	sd_mutex_unlock(&c->lock);
+
+	s = ring->slots + slot;
+	buf = sd_shm_slot_data(ring, slot, c->slot_size);
+	memcpy(&s->req, hdr, sizeof(*hdr));
+	if ((hdr->flags & SD_FLAG_CMD_WRITE) && hdr->data_length)
+		memcpy(buf, data, hdr->data_length);
+
+	sd_mutex_lock(&c->lock);
+	ring->sq[c->sq_tail % c->nr_slots] = slot;
+	cmm_smp_wmb();
+	uatomic_set(&ring->sq_tail, ++c->sq_tail);
+	sd_mutex_unlock(&c->lock);
+	eventfd_write(c->sq_efd, 1);
+
+	sd_mutex_lock(&c->lock);
+	while (!c->done[slot]) {
+		if (c->broken) {
+			/* the slot may still be in use, don't reuse it */
+			sd_mutex_unlock(&c->lock);
+			return -1;
+		}
+		if (c->reaping)
+			sd_cond_wait(&c->cond, &c->lock);
+		else
+			reap_completions(c);
+	}
+	sd_mutex_unlock(&c->lock);
+
+	memcpy(hdr, &s->rsp, sizeof(s->rsp));
+	if (rlen && ((struct sd_rsp *)hdr)->data_length)
+		memcpy(data, buf, min(rlen, ((struct sd_rsp *)hdr)->data_length));
+
+	sd_mutex_lock(&c->lock);
+	c->free_slots[c->nr_free++] = slot;
+	sd_cond_broadcast(&c->cond);
+	sd_mutex_unlock(&c->lock);
+
+	return 0;
+}
+
+void shm_client_detach(struct shm_client *c)
+{
+	if (c)
+		free_client(c);
+}
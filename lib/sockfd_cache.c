@@ -27,6 +27,7 @@
  *    7 support dual connections to a single node.
  */
 
+#include <poll.h>
 #include <pthread.h>
 
 #include "sockfd_cache.h"
@@ -40,6 +41,17 @@
 #include "sockfd_cache_tp.h"
 #define MONITOR_INTERVAL 5
 
+static void hb_add(const struct node_id *nid);
+
+/* msec of the clock of the failure detector */
+static inline uint64_t hb_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 struct nid_test_work {
 	struct list_node w_list;
 	struct node_id nid;
@@ -62,18 +74,20 @@ static struct sockfd_cache sockfd_cache = {
  * assumption, '8' would be efficient for servers that only host 2~4
  * Guests.
  *
- * This fd count will be dynamically grown when the idx reaches watermark which
- * is calculated by FDS_WATERMARK
+ * The IO and non-IO channels of each node are sized separately.  A channel is
+ * grown when its in-flight connections reach the watermark calculated by
+ * FDS_WATERMARK, and shrunk back by the connectivity monitor when the upper
+ * half of it has been idle for FDS_IDLE_TIMEOUT seconds.
  */
 #define FDS_WATERMARK(x) ((x) * 3 / 4)
 #define DEFAULT_FDS_COUNT	8
-
-/* How many FDs we cache for one node */
-static int fds_count = DEFAULT_FDS_COUNT;
+#define MAX_FDS_COUNT		128
+#define FDS_IDLE_TIMEOUT	60 /* seconds */
 
 struct sockfd_cache_fd {
 	int fd;
 	uatomic_bool in_use;
+	time_t last_used;
 };
 
 struct sockfd_cache_entry {
@@ -81,9 +95,34 @@ struct sockfd_cache_entry {
 	struct node_id nid;
 	struct sockfd_cache_fd *fds_io;
 	struct sockfd_cache_fd *fds_nio;
+	int nr_fds_io;
+	int nr_fds_nio;
 	enum channel_status channel_status;
+	/* number of slots handed out, for growing and stat */
+	int nr_io_in_use;
+	int nr_nio_in_use;
+	uint64_t nr_short;
+	/*
+	 * Smoothed round trip time of the reads from the node and its mean
+	 * deviation in usec, like TCP's.  Updated without a lock, so
+	 * concurrent samples can get lost, which doesn't matter for a hint.
+	 */
+	uint64_t srtt;
+	uint64_t rttvar;
+	/* the node echoed SD_FLAG_CMD_ZSTD, it takes zstd data */
+	bool zstd;
+	/* msec, the last response on a long connection, by the clock of hb */
+	uint64_t last_heard;
+	/* the failure detector suspects the node, don't connect to it */
+	bool suspect;
 };
 
+/*
+ * Slot index where the last search of this thread succeeded.  Starting the
+ * search from here makes a worker keep reusing the same long connection.
+ */
+static __thread int slot_hint;
+
 static int sockfd_cache_cmp(const struct sockfd_cache_entry *a,
 			    const struct sockfd_cache_entry *b)
 {
@@ -103,33 +142,47 @@ static struct sockfd_cache_entry *sockfd_cache_search(const struct node_id *nid)
 	return rb_search(&sockfd_cache.root, &key, rb, sockfd_cache_cmp);
 }
 
+static int grab_slot(struct sockfd_cache_fd *fds, int nr)
+{
+	int i, idx;
+
+	for (i = 0; i < nr; i++) {
+		idx = (slot_hint + i) % nr;
+		if (fds[idx].fd == -1 ||
+		    !uatomic_set_true(&fds[idx].in_use))
+			continue;
+		slot_hint = idx;
+		return idx;
+	}
+
+	return -1;
+}
+
 static inline int get_free_slot(struct sockfd_cache_entry *entry, bool *isIO)
 {
-	int idx = -1, i;
+	int idx;
 
 	if (entry->nid.io_port && entry->channel_status == IO) {
-		for (i = 0; i < fds_count; i++) {
-			if (entry->fds_io[i].fd == -1 ||
-				!uatomic_set_true(&entry->fds_io[i].in_use))
-				continue;
-			idx = i;
+		idx = grab_slot(entry->fds_io, entry->nr_fds_io);
+		if (idx != -1) {
+			uatomic_inc(&entry->nr_io_in_use);
 			*isIO = true;
-			goto out;
+			return idx;
 		}
 	}
-	for (i = 0; i < fds_count; i++) {
-		if (entry->fds_nio[i].fd == -1 ||
-			!uatomic_set_true(&entry->fds_nio[i].in_use))
-			continue;
+
+	idx = grab_slot(entry->fds_nio, entry->nr_fds_nio);
+	if (idx != -1) {
+		uatomic_inc(&entry->nr_nio_in_use);
 		/*let caller know if this is an IO or NonIO port*/
-		idx = i;
 		*isIO = false;
-		goto out;
 	}
-out:
+
 	return idx;
 }
 
+static void check_in_use(struct sockfd_cache_entry *entry, bool isIO);
+
 /*
  * Grab a free slot of the node and inc the refcount of the slot
  *
@@ -148,8 +201,11 @@ static struct sockfd_cache_entry *sockfd_cache_grab(const struct node_id *nid,
 	}
 
 	*ret_idx = get_free_slot(entry, isIO);
-	if (*ret_idx == -1)
+	if (*ret_idx == -1) {
+		uatomic_inc(&entry->nr_short);
 		entry = NULL;
+	} else
+		check_in_use(entry, *isIO);
 out:
 	sd_rw_unlock(&sockfd_cache.lock);
 	return entry;
@@ -158,26 +214,34 @@ out:
 static inline bool slots_all_free(struct sockfd_cache_entry *entry)
 {
 	int i;
-	for (i = 0; i < fds_count; i++) {
-		if (uatomic_is_true(&entry->fds_io[i].in_use) ||
-			uatomic_is_true(&entry->fds_nio[i].in_use))
+
+	for (i = 0; i < entry->nr_fds_io; i++)
+		if (uatomic_is_true(&entry->fds_io[i].in_use))
+			return false;
+	for (i = 0; i < entry->nr_fds_nio; i++)
+		if (uatomic_is_true(&entry->fds_nio[i].in_use))
 			return false;
-	}
 	return true;
 }
 
-static inline void destroy_all_slots(struct sockfd_cache_entry *entry)
+static inline void destroy_slots(struct sockfd_cache_fd *fds, int start,
+				 int end)
 {
 	int i;
-	for (i = 0; i < fds_count; i++)
-		if (entry->fds_io[i].fd != -1) {
-			close(entry->fds_io[i].fd);
-			entry->fds_io[i].fd = -1;
-			close(entry->fds_nio[i].fd);
-			entry->fds_nio[i].fd = -1;
+
+	for (i = start; i < end; i++)
+		if (fds[i].fd != -1) {
+			close(fds[i].fd);
+			fds[i].fd = -1;
 		}
 }
 
+static inline void destroy_all_slots(struct sockfd_cache_entry *entry)
+{
+	destroy_slots(entry->fds_io, 0, entry->nr_fds_io);
+	destroy_slots(entry->fds_nio, 0, entry->nr_fds_nio);
+}
+
 static void free_cache_entry(struct sockfd_cache_entry *entry)
 {
 	free(entry->fds_io);
@@ -187,6 +251,243 @@ static void free_cache_entry(struct sockfd_cache_entry *entry)
 	free(entry);
 }
 
+/*
+ * Parked connections
+ *
+ * sockfd_cache_put() doesn't give a long connection back but parks it in a
+ * small cache of the thread, where its slot stays taken, and the next
+ * sockfd_cache_get() of the thread for the same node takes it again without
+ * the lock and the search of the tree.  A worker talks to the same few nodes
+ * over and over, so most of its connections come from there.
+ *
+ * The shared cache takes the parked connections back with the lock held for
+ * write: all of them before the connectivity monitor shrinks and reconnects
+ * the slots, and those of a node before it's destroyed, so an idle thread
+ * doesn't keep them.  The owner fills a parked connection only under the
+ * read lock, so it doesn't change while the lock is held for write.
+ */
+#define PARKED_MAX 4
+
+enum parked_state {
+	PARKED_EMPTY,
+	PARKED_IDLE,		/* parked, may be taken back */
+	PARKED_BUSY,		/* handed out by the owner again */
+	PARKED_STOLEN,		/* taken back, as good as empty */
+};
+
+struct parked_fd {
+	int state;
+	struct node_id nid;
+	struct sockfd_cache_entry *entry;
+	int idx;
+	bool isIO;
+	int fd;
+	time_t last_used;
+};
+
+struct parked_cache {
+	struct list_node list;
+	struct parked_fd fds[PARKED_MAX];
+};
+
+static LIST_HEAD(parked_caches);
+static struct sd_mutex parked_lock = SD_MUTEX_INITIALIZER;
+static pthread_key_t parked_key;
+static pthread_once_t parked_once = PTHREAD_ONCE_INIT;
+static __thread struct parked_cache *parked;
+
+/* Give the slot back, called with sockfd_cache.lock held */
+static void release_slot(struct sockfd_cache_entry *entry, int idx, bool isIO,
+			 time_t last_used)
+{
+	struct sockfd_cache_fd *fds = isIO ? entry->fds_io : entry->fds_nio;
+
+	fds[idx].last_used = last_used;
+	uatomic_set_false(&fds[idx].in_use);
+}
+
+/*
+ * Take the parked connections to entry back, or all of them if entry is NULL
+ *
+ * Called with sockfd_cache.lock held for write.
+ */
+static void steal_parked(struct sockfd_cache_entry *entry)
+{
+	struct parked_cache *pc;
+
+	sd_mutex_lock(&parked_lock);
+	list_for_each_entry(pc, &parked_caches, list) {
+		for (int i = 0; i < PARKED_MAX; i++) {
+			struct parked_fd *p = pc->fds + i;
+
+			if (uatomic_read(&p->state) != PARKED_IDLE ||
+			    (entry && p->entry != entry))
+				continue;
+			if (uatomic_cmpxchg(&p->state, PARKED_IDLE,
+					    PARKED_STOLEN) != PARKED_IDLE)
+				continue;
+			release_slot(p->entry, p->idx, p->isIO, p->last_used);
+		}
+	}
+	sd_mutex_unlock(&parked_lock);
+}
+
+static void free_parked(void *data)
+{
+	struct parked_cache *pc = data;
+
+	sd_write_lock(&sockfd_cache.lock);
+	for (int i = 0; i < PARKED_MAX; i++) {
+		struct parked_fd *p = pc->fds + i;
+
+		if (p->state == PARKED_IDLE)
+			release_slot(p->entry, p->idx, p->isIO, p->last_used);
+	}
+	sd_mutex_lock(&parked_lock);
+	list_del(&pc->list);
+	sd_mutex_unlock(&parked_lock);
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	free(pc);
+}
+
+static void init_parked_key(void)
+{
+	if (pthread_key_create(&parked_key, free_parked))
+		panic("failed to create the key of parked connections");
+}
+
+/* Called with sockfd_cache.lock held */
+static struct parked_cache *get_parked_cache(void)
+{
+	if (likely(parked))
+		return parked;
+
+	pthread_once(&parked_once, init_parked_key);
+	parked = xzalloc(sizeof(*parked));
+	pthread_setspecific(parked_key, parked);
+	sd_mutex_lock(&parked_lock);
+	list_add(&parked->list, &parked_caches);
+	sd_mutex_unlock(&parked_lock);
+
+	return parked;
+}
+
+/* Mark the taken slot p parked, it isn't counted as in use any more */
+static void park_slot(struct parked_fd *p)
+{
+	if (p->isIO)
+		uatomic_dec(&p->entry->nr_io_in_use);
+	else
+		uatomic_dec(&p->entry->nr_nio_in_use);
+	p->last_used = time(NULL);
+	cmm_smp_wmb();
+	uatomic_set(&p->state, PARKED_IDLE);
+}
+
+/*
+ * Park the slot idx of entry instead of giving it back, evicting the
+ * connection parked the longest if the thread has no room.  Returns false if
+ * another connection to the node is parked or handed out already.
+ *
+ * Called with sockfd_cache.lock held for read.
+ */
+static bool park_new(struct sockfd_cache_entry *entry, int idx, bool isIO)
+{
+	struct parked_cache *pc = get_parked_cache();
+	struct parked_fd *p, *victim = NULL;
+
+	for (int i = 0; i < PARKED_MAX; i++) {
+		p = pc->fds + i;
+		switch (uatomic_read(&p->state)) {
+		case PARKED_EMPTY:
+		case PARKED_STOLEN:
+			if (!victim || victim->state == PARKED_IDLE)
+				victim = p;
+			break;
+		case PARKED_IDLE:
+		case PARKED_BUSY:
+			if (!node_id_cmp(&p->nid, &entry->nid))
+				return false;
+			if (p->state == PARKED_IDLE &&
+			    (!victim || (victim->state == PARKED_IDLE &&
+					 p->last_used < victim->last_used)))
+				victim = p;
+			break;
+		}
+	}
+	if (!victim)
+		return false;
+
+	/* nobody steals it while the lock is held for read */
+	if (victim->state == PARKED_IDLE)
+		release_slot(victim->entry, victim->idx, victim->isIO,
+			     victim->last_used);
+
+	victim->nid = entry->nid;
+	victim->entry = entry;
+	victim->idx = idx;
+	victim->isIO = isIO;
+	victim->fd = isIO ? entry->fds_io[idx].fd : entry->fds_nio[idx].fd;
+	park_slot(victim);
+
+	return true;
+}
+
+/* Find the connection to nid handed out from the parked ones */
+static struct parked_fd *find_busy(const struct node_id *nid,
+				   const struct sockfd *sfd)
+{
+	if (!parked)
+		return NULL;
+
+	for (int i = 0; i < PARKED_MAX; i++) {
+		struct parked_fd *p = parked->fds + i;
+
+		if (p->state == PARKED_BUSY && p->idx == sfd->idx &&
+		    p->isIO == sfd->isIO && !node_id_cmp(&p->nid, nid))
+			return p;
+	}
+
+	return NULL;
+}
+
+/* Take the connection to nid parked by this thread, without the lock */
+static struct sockfd *unpark(const struct node_id *nid)
+{
+	struct sockfd *sfd;
+
+	if (!parked)
+		return NULL;
+
+	for (int i = 0; i < PARKED_MAX; i++) {
+		struct parked_fd *p = parked->fds + i;
+
+		if (uatomic_read(&p->state) != PARKED_IDLE ||
+		    node_id_cmp(&p->nid, nid))
+			continue;
+		if (uatomic_cmpxchg(&p->state, PARKED_IDLE,
+				    PARKED_BUSY) != PARKED_IDLE)
+			return NULL;
+
+		/* the slot is still taken, so the entry stays */
+		if (p->isIO)
+			uatomic_inc(&p->entry->nr_io_in_use);
+		else
+			uatomic_inc(&p->entry->nr_nio_in_use);
+
+		sfd = xmalloc(sizeof(*sfd));
+		sfd->fd = p->fd;
+		sfd->idx = p->idx;
+		sfd->isIO = p->isIO;
+
+		tracepoint(sockfd_cache, cache_get, 0);
+		return sfd;
+	}
+
+	return NULL;
+}
+
 /*
  * Destroy all the Cached FDs of the node
  *
@@ -205,6 +506,7 @@ static bool sockfd_cache_destroy(const struct node_id *nid)
 		goto false_out;
 	}
 
+	steal_parked(entry);
 	if (!slots_all_free(entry)) {
 		sd_debug("Some victim still holds it");
 		goto false_out;
@@ -222,27 +524,43 @@ false_out:
 	return false;
 }
 
-static void sockfd_cache_add_nolock(const struct node_id *nid)
+static struct sockfd_cache_fd *alloc_slots(int nr)
 {
-	struct sockfd_cache_entry *new = xmalloc(sizeof(*new));
+	struct sockfd_cache_fd *fds = xzalloc(sizeof(*fds) * nr);
 	int i;
 
-	new->fds_io = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
-	new->fds_nio = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
-	for (i = 0; i < fds_count; i++) {
-		new->fds_io[i].fd = -1;
-		new->fds_nio[i].fd = -1;
-	}
+	for (i = 0; i < nr; i++)
+		fds[i].fd = -1;
+
+	return fds;
+}
+
+static struct sockfd_cache_entry *alloc_cache_entry(const struct node_id *nid)
+{
+	struct sockfd_cache_entry *new = xzalloc(sizeof(*new));
+
+	new->fds_io = alloc_slots(DEFAULT_FDS_COUNT);
+	new->fds_nio = alloc_slots(DEFAULT_FDS_COUNT);
+	new->nr_fds_io = DEFAULT_FDS_COUNT;
+	new->nr_fds_nio = DEFAULT_FDS_COUNT;
 
 	memcpy(&new->nid, nid, sizeof(struct node_id));
 	new->channel_status = nid->io_port ? IO : NonIO;
+
+	return new;
+}
+
+static void sockfd_cache_add_nolock(const struct node_id *nid)
+{
+	struct sockfd_cache_entry *new = alloc_cache_entry(nid);
+
 	if (sockfd_cache_insert(new)) {
 		free_cache_entry(new);
 		return;
 	}
 	sockfd_cache.count++;
 
-	tracepoint(sockfd_cache, new_sockfd_entry, new, fds_count);
+	tracepoint(sockfd_cache, new_sockfd_entry, new, DEFAULT_FDS_COUNT);
 }
 
 /* Add group of nodes to the cache */
@@ -255,25 +573,19 @@ void sockfd_cache_add_group(const struct rb_root *nroot)
 		sockfd_cache_add_nolock(&n->nid);
 	}
 	sd_rw_unlock(&sockfd_cache.lock);
+
+	rb_for_each_entry(n, nroot, rb) {
+		hb_add(&n->nid);
+	}
 }
 
-/* Add one node to the cache means we can do caching tricks on this node */
-void sockfd_cache_add(const struct node_id *nid)
+static void sockfd_cache_add_entry(const struct node_id *nid)
 {
 	struct sockfd_cache_entry *new;
-	int n, i;
+	int n;
 
 	sd_write_lock(&sockfd_cache.lock);
-	new = xmalloc(sizeof(*new));
-	new->fds_io = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
-	new->fds_nio = xzalloc(sizeof(struct sockfd_cache_fd) * fds_count);
-	for (i = 0; i < fds_count; i++) {
-		new->fds_io[i].fd = -1;
-		new->fds_nio[i].fd = -1;
-	}
-
-	memcpy(&new->nid, nid, sizeof(struct node_id));
-	new->channel_status = nid->io_port ? IO : NonIO;
+	new = alloc_cache_entry(nid);
 	if (sockfd_cache_insert(new)) {
 		free_cache_entry(new);
 		sd_rw_unlock(&sockfd_cache.lock);
@@ -283,62 +595,246 @@ void sockfd_cache_add(const struct node_id *nid)
 	n = uatomic_add_return(&sockfd_cache.count, 1);
 	sd_debug("%s, count %d", addr_to_str(nid->addr, nid->port), n);
 
-	tracepoint(sockfd_cache, new_sockfd_entry, new, fds_count);
+	tracepoint(sockfd_cache, new_sockfd_entry, new, DEFAULT_FDS_COUNT);
+}
+
+/* Add one node to the cache means we can do caching tricks on this node */
+void sockfd_cache_add(const struct node_id *nid)
+{
+	sockfd_cache_add_entry(nid);
+	hb_add(nid);
 }
 
+struct grow_fds_work {
+	struct work work;
+	struct node_id nid;
+	bool isIO;
+};
+
 static uatomic_bool fds_in_grow;
-static int fds_high_watermark = FDS_WATERMARK(DEFAULT_FDS_COUNT);
 
 static struct work_queue *grow_wq;
 
+static struct sockfd_cache_fd *resize_slots(struct sockfd_cache_fd *fds,
+					    int old_nr, int new_nr)
+{
+	int i;
+
+	fds = xrealloc(fds, sizeof(*fds) * new_nr);
+	for (i = old_nr; i < new_nr; i++) {
+		fds[i].fd = -1;
+		uatomic_set_false(&fds[i].in_use);
+		fds[i].last_used = 0;
+	}
+
+	return fds;
+}
+
 static void do_grow_fds(struct work *work)
 {
+	struct grow_fds_work *gw = container_of(work, struct grow_fds_work,
+						work);
 	struct sockfd_cache_entry *entry;
-	int old_fds_count, new_fds_count, new_size, i;
+	int *nr, new_nr;
 
-	sd_debug("%d", fds_count);
 	sd_write_lock(&sockfd_cache.lock);
-	old_fds_count = fds_count;
-	new_fds_count = fds_count * 2;
-	new_size = sizeof(struct sockfd_cache_fd) * fds_count * 2;
-	rb_for_each_entry(entry, &sockfd_cache.root, rb) {
-		entry->fds_io = xrealloc(entry->fds_io, new_size);
-		entry->fds_nio = xrealloc(entry->fds_nio, new_size);
-		for (i = old_fds_count; i < new_fds_count; i++) {
-			entry->fds_io[i].fd = -1;
-			uatomic_set_false(&entry->fds_io[i].in_use);
-			entry->fds_nio[i].fd = -1;
-			uatomic_set_false(&entry->fds_nio[i].in_use);
-		}
-	}
+	entry = sockfd_cache_search(&gw->nid);
+	if (!entry)
+		goto out;
 
-	fds_count *= 2;
-	fds_high_watermark = FDS_WATERMARK(fds_count);
-	sd_rw_unlock(&sockfd_cache.lock);
+	nr = gw->isIO ? &entry->nr_fds_io : &entry->nr_fds_nio;
+	new_nr = min(*nr * 2, MAX_FDS_COUNT);
+	if (new_nr == *nr)
+		goto out;
+
+	sd_debug("%s, %s channel %d -> %d",
+		 addr_to_str(gw->nid.addr, gw->nid.port),
+		 gw->isIO ? "io" : "non-io", *nr, new_nr);
+	if (gw->isIO)
+		entry->fds_io = resize_slots(entry->fds_io, *nr, new_nr);
+	else
+		entry->fds_nio = resize_slots(entry->fds_nio, *nr, new_nr);
+	*nr = new_nr;
 
-	tracepoint(sockfd_cache, grow_fd_count, new_fds_count);
+	tracepoint(sockfd_cache, grow_fd_count, new_nr);
+out:
+	sd_rw_unlock(&sockfd_cache.lock);
 }
 
 static void grow_fds_done(struct work *work)
 {
-	sd_debug("fd count has been grown into %d", fds_count);
+	struct grow_fds_work *gw = container_of(work, struct grow_fds_work,
+						work);
+
 	uatomic_set_false(&fds_in_grow);
-	free(work);
+	free(gw);
 }
 
-static inline void check_idx(int idx)
+/* Called with sockfd_cache.lock held */
+static void check_in_use(struct sockfd_cache_entry *entry, bool isIO)
 {
-	struct work *w;
+	struct grow_fds_work *gw;
+	int in_use, nr;
 
-	if (idx <= fds_high_watermark)
+	if (isIO) {
+		in_use = uatomic_read(&entry->nr_io_in_use);
+		nr = entry->nr_fds_io;
+	} else {
+		in_use = uatomic_read(&entry->nr_nio_in_use);
+		nr = entry->nr_fds_nio;
+	}
+
+	if (in_use <= FDS_WATERMARK(nr) || nr >= MAX_FDS_COUNT)
+		return;
+	/* grow_wq is ready only after sockfd_init() */
+	if (!grow_wq)
 		return;
 	if (!uatomic_set_true(&fds_in_grow))
 		return;
 
-	w = xmalloc(sizeof(*w));
-	w->fn = do_grow_fds;
-	w->done = grow_fds_done;
-	queue_work(grow_wq, w);
+	gw = xzalloc(sizeof(*gw));
+	gw->nid = entry->nid;
+	gw->isIO = isIO;
+	gw->work.fn = do_grow_fds;
+	gw->work.done = grow_fds_done;
+	queue_work(grow_wq, &gw->work);
+}
+
+/*
+ * Close the upper half of the channel if nobody has used it recently
+ *
+ * Called with sockfd_cache.lock held for write.
+ */
+static void shrink_slots(struct sockfd_cache_fd **fds, int *nr,
+			 time_t now)
+{
+	int i, half = *nr / 2;
+
+	if (half < DEFAULT_FDS_COUNT)
+		return;
+
+	for (i = half; i < *nr; i++) {
+		if (uatomic_is_true(&(*fds)[i].in_use))
+			return;
+		if ((*fds)[i].fd != -1 &&
+		    now - (*fds)[i].last_used < FDS_IDLE_TIMEOUT)
+			return;
+	}
+
+	destroy_slots(*fds, half, *nr);
+	*fds = xrealloc(*fds, sizeof(**fds) * half);
+	*nr = half;
+}
+
+static void shrink_idle_fds(struct sockfd_cache_entry *entry, time_t now)
+{
+	int old_io = entry->nr_fds_io, old_nio = entry->nr_fds_nio;
+
+	shrink_slots(&entry->fds_io, &entry->nr_fds_io, now);
+	shrink_slots(&entry->fds_nio, &entry->nr_fds_nio, now);
+
+	if (old_io != entry->nr_fds_io || old_nio != entry->nr_fds_nio)
+		sd_debug("%s, io %d -> %d, non-io %d -> %d",
+			 addr_to_str(entry->nid.addr, entry->nid.port),
+			 old_io, entry->nr_fds_io, old_nio, entry->nr_fds_nio);
+}
+
+/* Fill per node usage of the cache, return the number of filled entries */
+int sockfd_cache_stat(struct sd_sockfd_stat *stat, int max)
+{
+	struct sockfd_cache_entry *entry;
+	int nr = 0;
+
+	sd_read_lock(&sockfd_cache.lock);
+	rb_for_each_entry(entry, &sockfd_cache.root, rb) {
+		if (nr >= max)
+			break;
+
+		stat[nr].nid = entry->nid;
+		stat[nr].nr_fds_io = entry->nr_fds_io;
+		stat[nr].nr_fds_nio = entry->nr_fds_nio;
+		stat[nr].nr_io_in_use = uatomic_read(&entry->nr_io_in_use);
+		stat[nr].nr_nio_in_use = uatomic_read(&entry->nr_nio_in_use);
+		stat[nr].nr_short = uatomic_read(&entry->nr_short);
+		nr++;
+	}
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	return nr;
+}
+
+/* Record a round trip time sample of a request to the node */
+void sockfd_cache_rtt(const struct node_id *nid, uint64_t usec)
+{
+	struct sockfd_cache_entry *entry;
+	uint64_t srtt, delta;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (!entry)
+		goto out;
+
+	srtt = entry->srtt;
+	if (!srtt) {
+		entry->rttvar = usec / 2;
+		entry->srtt = usec ? usec : 1;
+		goto out;
+	}
+	delta = srtt > usec ? srtt - usec : usec - srtt;
+	entry->rttvar = (entry->rttvar * 3 + delta) / 4;
+	entry->srtt = (srtt * 7 + usec) / 8;
+out:
+	sd_rw_unlock(&sockfd_cache.lock);
+}
+
+/*
+ * Get the number of our requests in flight to the node and its round trip
+ * time, which is zero until the first sample is recorded
+ */
+bool sockfd_cache_load(const struct node_id *nid, struct sockfd_load *load)
+{
+	struct sockfd_cache_entry *entry;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry) {
+		load->nr_in_flight = uatomic_read(&entry->nr_io_in_use) +
+			uatomic_read(&entry->nr_nio_in_use);
+		load->srtt = entry->srtt;
+		load->rttvar = entry->rttvar;
+	}
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	return entry != NULL;
+}
+
+/*
+ * Record whether the node takes zstd data from its last response to a request
+ * which offered it.  Forgotten when a connection to the node is closed.
+ */
+void sockfd_cache_set_zstd(const struct node_id *nid, bool zstd)
+{
+	struct sockfd_cache_entry *entry;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry)
+		entry->zstd = zstd;
+	sd_rw_unlock(&sockfd_cache.lock);
+}
+
+bool sockfd_cache_zstd(const struct node_id *nid)
+{
+	struct sockfd_cache_entry *entry;
+	bool zstd = false;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry)
+		zstd = entry->zstd;
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	return zstd;
 }
 
 /* Add the node back if it is still alive */
@@ -357,7 +853,7 @@ static inline int revalidate_node(const struct node_id *nid)
 		return false;
 alive:
 	close(fd);
-	sockfd_cache_add(nid);
+	sockfd_cache_add_entry(nid);
 	return true;
 }
 
@@ -366,7 +862,7 @@ static void prepare_conns(struct sockfd_cache_entry *entry, bool first_only)
 	int idx;
 	struct node_id *nid = &entry->nid;
 	if (entry->channel_status == IO) {
-		for (idx = 0; idx < fds_count; idx++) {
+		for (idx = 0; idx < entry->nr_fds_io; idx++) {
 			/*
 			 * IO channel recovered or fds_count increased,
 			 * connect fds
@@ -396,7 +892,7 @@ static void prepare_conns(struct sockfd_cache_entry *entry, bool first_only)
 			}
 		}
 	} else {
-		for (idx = 0; idx < fds_count; idx++) {
+		for (idx = 0; idx < entry->nr_fds_io; idx++) {
 			if (entry->fds_io[idx].fd != -1 &&
 				uatomic_set_true(&entry->fds_io[idx].in_use)) {
 				close(entry->fds_io[idx].fd);
@@ -406,7 +902,7 @@ static void prepare_conns(struct sockfd_cache_entry *entry, bool first_only)
 		}
 	}
 
-	for (idx = 0; idx < fds_count; idx++) {
+	for (idx = 0; idx < entry->nr_fds_nio; idx++) {
 		if (entry->fds_nio[idx].fd != -1)
 			continue;
 		int fd = connect_to_addr(nid->addr, nid->port);
@@ -465,7 +961,6 @@ grab:
 		goto grab;
 	}
 
-	check_idx(idx);
 	if (!isIO)
 		fd = entry->fds_nio[idx].fd;
 	else
@@ -501,11 +996,19 @@ static void sockfd_cache_put_long(const struct node_id *nid, int idx, bool isIO)
 		sd_rw_unlock(&sockfd_cache.lock);
 		return;
 	}
-	if (!isIO)
+	entry->last_heard = hb_now();
+	if (park_new(entry, idx, isIO))
+		goto out;
+	if (!isIO) {
+		entry->fds_nio[idx].last_used = time(NULL);
+		uatomic_dec(&entry->nr_nio_in_use);
 		uatomic_set_false(&entry->fds_nio[idx].in_use);
-	else
+	} else {
+		entry->fds_io[idx].last_used = time(NULL);
+		uatomic_dec(&entry->nr_io_in_use);
 		uatomic_set_false(&entry->fds_io[idx].in_use);
-
+	}
+out:
 	sd_rw_unlock(&sockfd_cache.lock);
 }
 
@@ -527,12 +1030,16 @@ static void sockfd_cache_close(const struct node_id *nid, int idx, bool isIO)
 	if (!isIO) {
 		close(entry->fds_nio[idx].fd);
 		entry->fds_nio[idx].fd = -1;
+		uatomic_dec(&entry->nr_nio_in_use);
 		uatomic_set_false(&entry->fds_nio[idx].in_use);
 	} else {
 		close(entry->fds_io[idx].fd);
 		entry->fds_io[idx].fd = -1;
+		uatomic_dec(&entry->nr_io_in_use);
 		uatomic_set_false(&entry->fds_io[idx].in_use);
 	}
+	/* the node may have been restarted, ask it again */
+	entry->zstd = false;
 	sd_rw_unlock(&sockfd_cache.lock);
 }
 
@@ -566,6 +1073,10 @@ struct sockfd *sockfd_cache_get(const struct node_id *nid)
 	struct sockfd *sfd;
 	int fd;
 
+	sfd = unpark(nid);
+	if (sfd)
+		return sfd;
+
 	sfd = sockfd_cache_get_long(nid);
 	if (sfd)
 		return sfd;
@@ -592,6 +1103,8 @@ struct sockfd *sockfd_cache_get(const struct node_id *nid)
  */
 void sockfd_cache_put(const struct node_id *nid, struct sockfd *sfd)
 {
+	struct parked_fd *p;
+
 	if (sfd->idx == -1) {
 		assert(!isIO);
 		sd_debug("%d", sfd->fd);
@@ -602,12 +1115,40 @@ void sockfd_cache_put(const struct node_id *nid, struct sockfd *sfd)
 		return;
 	}
 
-	sockfd_cache_put_long(nid, sfd->idx, sfd->isIO);
+	p = find_busy(nid, sfd);
+	if (p) {
+		p->entry->last_heard = hb_now();
+		park_slot(p);
+	} else
+		sockfd_cache_put_long(nid, sfd->idx, sfd->isIO);
 	free(sfd);
 
 	tracepoint(sockfd_cache, cache_put, 1);
 }
 
+/*
+ * Close a sockfd whose connection can't be reused, e.g. with a response
+ * left unread, without giving up the other connections to the node
+ *
+ * The connectivity monitor connects the slot again.
+ */
+void sockfd_cache_drop(const struct node_id *nid, struct sockfd *sfd)
+{
+	struct parked_fd *p;
+
+	if (sfd->idx == -1) {
+		close(sfd->fd);
+		free(sfd);
+		return;
+	}
+
+	p = find_busy(nid, sfd);
+	if (p)
+		p->state = PARKED_EMPTY;
+	sockfd_cache_close(nid, sfd->idx, sfd->isIO);
+	free(sfd);
+}
+
 /* Delete all sockfd connected to the node, when node is crashed. */
 void sockfd_cache_del_node(const struct node_id *nid)
 {
@@ -629,6 +1170,8 @@ void sockfd_cache_del_node(const struct node_id *nid)
  */
 void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd)
 {
+	struct parked_fd *p;
+
 	if (sfd->idx == -1) {
 		assert(!isIO);
 		sd_debug("%d", sfd->fd);
@@ -637,6 +1180,9 @@ void sockfd_cache_del(const struct node_id *nid, struct sockfd *sfd)
 		return;
 	}
 
+	p = find_busy(nid, sfd);
+	if (p)
+		p->state = PARKED_EMPTY;
 	sockfd_cache_close(nid, sfd->idx, sfd->isIO);
 	sockfd_cache_del_node(nid);
 	free(sfd);
@@ -647,8 +1193,362 @@ void init_to_connect_list()
 	INIT_LIST_HEAD(&to_connect_list);
 }
 
+/*
+ * Failure detector
+ *
+ * The monitor sends SD_OP_HEARTBEAT every HB_INTERVAL msec over a connection
+ * of its own to each member which hasn't answered anything since the last
+ * tick, so the responses on the long connections of a busy node stand in for
+ * its heartbeats.  The main loop of the node answers it, so a node whose
+ * main loop is stuck is as good as dead.
+ *
+ * The gaps between the answers are smoothed into a mean and a mean deviation
+ * like the round trip times, and the node is suspected once its silence is
+ * longer than
+ *
+ *   mean + HB_PAUSE + HB_PHI_DEVS * max(deviation, HB_MIN_DEV)
+ *
+ * which is about where the phi of an accrual detector reaches 8 for gaps of a
+ * normal distribution.  The long connections of a suspected node which are in
+ * use are shut down on every tick, so the requests waiting on them fail at
+ * once and are sent to another replica or retried instead of waiting for the
+ * socket timeouts, and the replica reads try the suspects last.
+ */
+
+#define HB_INTERVAL		500	/* msec */
+#define HB_PAUSE		1000	/* msec of silence always tolerated */
+#define HB_MIN_DEV		50	/* msec */
+#define HB_PHI_DEVS		7
+#define HB_MIN_SAMPLES		3
+#define HB_CONNECT_TIMEOUT	2000	/* msec */
+#define HB_RSP_TIMEOUT		10000	/* msec before reconnecting */
+
+struct hb_node {
+	struct rb_node rb;
+	struct node_id nid;
+	int fd;
+	bool connected;
+	bool waiting;		/* for the answer to a heartbeat */
+	bool left;		/* the cluster, freed by the monitor */
+	bool suspect;
+	uint32_t rsp_len;	/* of the answer read so far */
+	struct sd_rsp rsp;
+	uint64_t sent;		/* msec, the heartbeat or the connect */
+	uint64_t heard;		/* msec, zero until the first answer */
+	uint64_t mean;		/* msec, of the gaps between the answers */
+	uint64_t dev;
+	uint32_t nr_samples;
+};
+
+static struct rb_root hb_root = RB_ROOT;
+static struct sd_mutex hb_lock = SD_MUTEX_INITIALIZER;
+
+static int hb_cmp(const struct hb_node *a, const struct hb_node *b)
+{
+	return node_id_cmp(&a->nid, &b->nid);
+}
+
+static struct hb_node *hb_search(const struct node_id *nid)
+{
+	struct hb_node key = { .nid = *nid };
+
+	return rb_search(&hb_root, &key, rb, hb_cmp);
+}
+
+/* Watch the member nid */
+static void hb_add(const struct node_id *nid)
+{
+	struct hb_node *n;
+
+	sd_mutex_lock(&hb_lock);
+	n = hb_search(nid);
+	if (n) {
+		n->left = false;
+		goto out;
+	}
+	n = xzalloc(sizeof(*n));
+	n->nid = *nid;
+	n->fd = -1;
+	rb_insert(&hb_root, n, rb, hb_cmp);
+out:
+	sd_mutex_unlock(&hb_lock);
+}
+
+/* Stop watching the node, which left the cluster */
+void sockfd_cache_forget(const struct node_id *nid)
+{
+	struct hb_node *n;
+
+	sd_mutex_lock(&hb_lock);
+	n = hb_search(nid);
+	if (n)
+		n->left = true;
+	sd_mutex_unlock(&hb_lock);
+}
+
+/* Whether the failure detector suspects that the node is dead */
+bool sockfd_cache_suspect(const struct node_id *nid)
+{
+	struct hb_node *n;
+	bool suspect = false;
+
+	sd_mutex_lock(&hb_lock);
+	n = hb_search(nid);
+	if (n)
+		suspect = n->suspect;
+	sd_mutex_unlock(&hb_lock);
+
+	return suspect;
+}
+
+static void hb_close(struct hb_node *n)
+{
+	if (n->fd >= 0)
+		close(n->fd);
+	n->fd = -1;
+	n->connected = false;
+	n->waiting = false;
+	n->rsp_len = 0;
+}
+
+/* Record that the node was heard at t */
+static void hb_heard(struct hb_node *n, uint64_t t)
+{
+	uint64_t gap, delta;
+
+	if (t <= n->heard)
+		return;
+	if (!n->heard) {
+		n->heard = t;
+		return;
+	}
+
+	gap = t - n->heard;
+	n->heard = t;
+	if (!n->nr_samples++) {
+		n->mean = gap;
+		n->dev = gap / 2;
+		return;
+	}
+	delta = n->mean > gap ? n->mean - gap : gap - n->mean;
+	n->dev = (n->dev * 3 + delta) / 4;
+	n->mean = (n->mean * 7 + gap) / 8;
+}
+
+/* Connect to the node or send it a heartbeat if it's due */
+static void hb_send(struct hb_node *n, uint64_t now)
+{
+	struct sd_req hdr;
+
+	if (n->fd < 0) {
+		n->fd = connect_to_nonblock(addr_to_str(n->nid.addr, 0),
+					    n->nid.port);
+		n->sent = now;
+		return;
+	}
+
+	if (!n->connected) {
+		if (now - n->sent > HB_CONNECT_TIMEOUT)
+			hb_close(n);
+		return;
+	}
+
+	if (n->waiting) {
+		/* the node may be back behind a connection which isn't */
+		if (now - n->sent > HB_RSP_TIMEOUT)
+			hb_close(n);
+		return;
+	}
+
+	if (n->heard && now - n->heard < HB_INTERVAL)
+		return;
+
+	sd_init_req(&hdr, SD_OP_HEARTBEAT);
+	if (send(n->fd, &hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_DONTWAIT) !=
+	    sizeof(hdr)) {
+		hb_close(n);
+		return;
+	}
+	n->waiting = true;
+	n->sent = now;
+}
+
+static void hb_recv(struct hb_node *n, int revents, uint64_t now)
+{
+	ssize_t ret;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (!n->connected) {
+		if (getsockopt(n->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+		    err) {
+			hb_close(n);
+			return;
+		}
+		n->connected = true;
+		return;
+	}
+
+	if (!(revents & POLLIN)) {
+		hb_close(n);
+		return;
+	}
+
+	ret = read(n->fd, (char *)&n->rsp + n->rsp_len,
+		   sizeof(n->rsp) - n->rsp_len);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret <= 0 || !n->waiting) {
+		hb_close(n);
+		return;
+	}
+
+	n->rsp_len += ret;
+	if (n->rsp_len < sizeof(n->rsp))
+		return;
+	/* any answer does, even the one of a node which doesn't know it */
+	n->rsp_len = 0;
+	n->waiting = false;
+	hb_heard(n, now);
+}
+
+/*
+ * Mark the node suspected or not in the cache, and shut the long connections
+ * in use of a suspected one down
+ */
+static void hb_mark(const struct node_id *nid, bool suspect)
+{
+	struct sockfd_cache_entry *entry;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (!entry)
+		goto out;
+
+	entry->suspect = suspect;
+	if (!suspect)
+		goto out;
+	for (int i = 0; i < entry->nr_fds_io; i++)
+		if (entry->fds_io[i].fd >= 0 &&
+		    uatomic_is_true(&entry->fds_io[i].in_use))
+			shutdown(entry->fds_io[i].fd, SHUT_RDWR);
+	for (int i = 0; i < entry->nr_fds_nio; i++)
+		if (entry->fds_nio[i].fd >= 0 &&
+		    uatomic_is_true(&entry->fds_nio[i].in_use))
+			shutdown(entry->fds_nio[i].fd, SHUT_RDWR);
+out:
+	sd_rw_unlock(&sockfd_cache.lock);
+}
+
+static uint64_t cache_last_heard(const struct node_id *nid)
+{
+	struct sockfd_cache_entry *entry;
+	uint64_t t = 0;
+
+	sd_read_lock(&sockfd_cache.lock);
+	entry = sockfd_cache_search(nid);
+	if (entry)
+		t = entry->last_heard;
+	sd_rw_unlock(&sockfd_cache.lock);
+
+	return t;
+}
+
+static void hb_check(struct hb_node *n, uint64_t now)
+{
+	uint64_t silence, limit;
+	bool suspect;
+
+	hb_heard(n, cache_last_heard(&n->nid));
+	if (!n->heard)
+		return;
+
+	silence = now - n->heard;
+	limit = HB_PHI_DEVS * max(n->dev, (uint64_t)HB_MIN_DEV);
+	limit += n->mean + HB_PAUSE;
+	suspect = n->nr_samples >= HB_MIN_SAMPLES && silence > limit;
+
+	if (suspect && !n->suspect)
+		sd_warn("%s silent for %"PRIu64" msec, suspected",
+			addr_to_str(n->nid.addr, n->nid.port), silence);
+	else if (!suspect && n->suspect)
+		sd_info("%s is back", addr_to_str(n->nid.addr, n->nid.port));
+
+	if (suspect || n->suspect)
+		hb_mark(&n->nid, suspect);
+	n->suspect = suspect;
+}
+
+/* Send the heartbeats and read the answers for HB_INTERVAL msec */
+static void hb_tick(void)
+{
+	static struct pollfd *pfds;
+	static struct hb_node **nodes;
+	static int nr_alloc;
+	static uint64_t last_tick;
+	uint64_t now = hb_now(), deadline = now + HB_INTERVAL;
+	struct hb_node *n;
+	int nr = 0, ret;
+
+	sd_mutex_lock(&hb_lock);
+	rb_for_each_entry(n, &hb_root, rb) {
+		if (n->left) {
+			hb_close(n);
+			rb_erase(&n->rb, &hb_root);
+			free(n);
+			continue;
+		}
+
+		/* we didn't listen, don't blame the node */
+		if (last_tick && now - last_tick > HB_INTERVAL * 4 && n->heard)
+			n->heard = now;
+
+		hb_send(n, now);
+		if (n->fd < 0)
+			continue;
+		if (nr == nr_alloc) {
+			nr_alloc = nr_alloc ? nr_alloc * 2 : 16;
+			pfds = xrealloc(pfds, sizeof(*pfds) * nr_alloc);
+			nodes = xrealloc(nodes, sizeof(*nodes) * nr_alloc);
+		}
+		pfds[nr].fd = n->fd;
+		pfds[nr].events = n->connected ? POLLIN : POLLOUT;
+		nodes[nr++] = n;
+	}
+	sd_mutex_unlock(&hb_lock);
+
+	while ((now = hb_now()) < deadline) {
+		ret = poll(pfds, nr, deadline - now);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		now = hb_now();
+		sd_mutex_lock(&hb_lock);
+		for (int i = 0; i < nr; i++) {
+			if (!pfds[i].revents)
+				continue;
+			hb_recv(nodes[i], pfds[i].revents, now);
+			pfds[i].fd = nodes[i]->fd;
+			pfds[i].events = nodes[i]->connected ? POLLIN : POLLOUT;
+		}
+		sd_mutex_unlock(&hb_lock);
+	}
+
+	now = hb_now();
+	sd_mutex_lock(&hb_lock);
+	rb_for_each_entry(n, &hb_root, rb) {
+		if (!n->left)
+			hb_check(n, now);
+	}
+	sd_mutex_unlock(&hb_lock);
+	last_tick = now;
+}
+
 static void *monitor_sd_node_connectivity(void *ignored)
 {
+	time_t last_check = 0;
 	int err;
 
 	sd_info("node connectivity monitor main loop");
@@ -657,9 +1557,12 @@ static void *monitor_sd_node_connectivity(void *ignored)
 	for (;;) {
 		struct sockfd_cache_entry *entry;
 
-		if (list_empty(&to_connect_list))
-			sleep(MONITOR_INTERVAL);
-		else {
+		hb_tick();
+		if (time(NULL) - last_check < MONITOR_INTERVAL)
+			continue;
+		last_check = time(NULL);
+
+		if (!list_empty(&to_connect_list)) {
 			struct nid_test_work *work =
 				list_first_entry(&to_connect_list,
 					struct nid_test_work, w_list);
@@ -694,8 +1597,11 @@ static void *monitor_sd_node_connectivity(void *ignored)
 			}
 		}
 		sd_write_lock(&sockfd_cache.lock);
+		steal_parked(NULL);
 		rb_for_each_entry(entry, &sockfd_cache.root, rb) {
-			if (entry->fds_io)
+			shrink_idle_fds(entry, time(NULL));
+			/* connecting to a dead node blocks for long */
+			if (entry->fds_io && !entry->suspect)
 				prepare_conns(entry, false);
 		}
 		sd_rw_unlock(&sockfd_cache.lock);
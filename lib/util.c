@@ -21,9 +21,12 @@
 #include <fcntl.h>
 #include <sys/eventfd.h>
 #include <sys/syscall.h>
+#include <malloc.h>
 
 
 #include "util.h"
+#include "internal_proto.h"
+#include "memscan.h"
 
 mode_t sd_def_dmode = S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP;
 mode_t sd_def_fmode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
@@ -69,6 +72,166 @@ void *xvalloc(size_t size)
 	return ret;
 }
 
+/*
+ * Memory accounting
+ *
+ * The allocations of the subsystems which can hold a lot of memory are made
+ * with the tagged variants of the allocators and freed with free_tag(), so
+ * that 'dog node stat --memory' tells where the memory of a sheep goes.  The
+ * size of a buffer is taken from malloc_usable_size(), so the callers don't
+ * have to remember it.  memtag_account() accounts the buffers which don't
+ * come from malloc(), e.g. those of the buffer pool.
+ *
+ * The counters are per thread to stay off the cache lines of the others.  A
+ * buffer is often freed by another thread than the one which allocated it,
+ * so the counters of a thread can be negative and only their sum is
+ * meaningful.  The counters of the exited threads are folded into the
+ * retired ones.
+ */
+struct memtag_counter {
+	struct list_node list;
+	int64_t bytes[SD_NR_MEM_TAGS];
+	int64_t nr[SD_NR_MEM_TAGS];
+	uint64_t nr_alloc[SD_NR_MEM_TAGS];
+};
+
+static const char * const memtag_names[SD_NR_MEM_TAGS] = {
+	[MEM_OBJLIST] = "Object list",
+	[MEM_VNODE_INFO] = "Vnode info",
+	[MEM_REQUEST] = "Request",
+	[MEM_RECOVERY] = "Recovery",
+};
+
+static LIST_HEAD(memtag_list);
+static struct memtag_counter memtag_retired; /* protected by memtag_lock */
+static struct sd_mutex memtag_lock = SD_MUTEX_INITIALIZER;
+static pthread_key_t memtag_key;
+static pthread_once_t memtag_once = PTHREAD_ONCE_INIT;
+static __thread struct memtag_counter *my_memtag;
+
+static void memtag_destructor(void *arg)
+{
+	struct memtag_counter *mc = arg;
+
+	sd_mutex_lock(&memtag_lock);
+	list_del(&mc->list);
+	for (int i = 0; i < SD_NR_MEM_TAGS; i++) {
+		memtag_retired.bytes[i] += mc->bytes[i];
+		memtag_retired.nr[i] += mc->nr[i];
+		memtag_retired.nr_alloc[i] += mc->nr_alloc[i];
+	}
+	sd_mutex_unlock(&memtag_lock);
+
+	free(mc);
+	my_memtag = NULL;
+}
+
+static void init_memtag_key(void)
+{
+	if (pthread_key_create(&memtag_key, memtag_destructor))
+		panic("failed to create the key of the memory accounting");
+}
+
+static struct memtag_counter *get_memtag(void)
+{
+	if (likely(my_memtag))
+		return my_memtag;
+
+	pthread_once(&memtag_once, init_memtag_key);
+	my_memtag = xzalloc(sizeof(*my_memtag));
+	pthread_setspecific(memtag_key, my_memtag);
+
+	sd_mutex_lock(&memtag_lock);
+	list_add(&my_memtag->list, &memtag_list);
+	sd_mutex_unlock(&memtag_lock);
+
+	return my_memtag;
+}
+
+/* Account 'len' bytes to 'tag', a negative 'len' for a buffer freed */
+void memtag_account(enum sd_mem_tag tag, ssize_t len)
+{
+	struct memtag_counter *mc = get_memtag();
+
+	mc->bytes[tag] += len;
+	if (len > 0) {
+		mc->nr[tag]++;
+		mc->nr_alloc[tag]++;
+	} else if (len < 0)
+		mc->nr[tag]--;
+}
+
+void *xmalloc_tag(size_t size, enum sd_mem_tag tag)
+{
+	void *ret = xmalloc(size);
+
+	memtag_account(tag, malloc_usable_size(ret));
+	return ret;
+}
+
+void *xzalloc_tag(size_t size, enum sd_mem_tag tag)
+{
+	void *ret = xzalloc(size);
+
+	memtag_account(tag, malloc_usable_size(ret));
+	return ret;
+}
+
+/* Like realloc(), the buffer is still accounted to 'tag' if this fails */
+void *realloc_tag(void *ptr, size_t size, enum sd_mem_tag tag)
+{
+	size_t old = malloc_usable_size(ptr);
+	void *ret = realloc(ptr, size);
+
+	if (!ret && size)
+		return NULL;
+
+	memtag_account(tag, -(ssize_t)old);
+	memtag_account(tag, malloc_usable_size(ret));
+	return ret;
+}
+
+void *xrealloc_tag(void *ptr, size_t size, enum sd_mem_tag tag)
+{
+	void *ret = realloc_tag(ptr, size, tag);
+
+	if (unlikely(!ret && size))
+		panic("Out of memory");
+	return ret;
+}
+
+void free_tag(void *ptr, enum sd_mem_tag tag)
+{
+	if (!ptr)
+		return;
+
+	memtag_account(tag, -(ssize_t)malloc_usable_size(ptr));
+	free(ptr);
+}
+
+/* Fill 'st', which has room for SD_NR_MEM_TAGS entries */
+void memtag_stat(struct sd_mem_stat *st)
+{
+	struct memtag_counter *mc;
+
+	memset(st, 0, sizeof(*st) * SD_NR_MEM_TAGS);
+	sd_mutex_lock(&memtag_lock);
+	for (int i = 0; i < SD_NR_MEM_TAGS; i++) {
+		pstrcpy(st[i].name, sizeof(st[i].name), memtag_names[i]);
+		st[i].bytes = memtag_retired.bytes[i];
+		st[i].nr = memtag_retired.nr[i];
+		st[i].nr_alloc = memtag_retired.nr_alloc[i];
+	}
+	list_for_each_entry(mc, &memtag_list, list) {
+		for (int i = 0; i < SD_NR_MEM_TAGS; i++) {
+			st[i].bytes += mc->bytes[i];
+			st[i].nr += mc->nr[i];
+			st[i].nr_alloc += mc->nr_alloc[i];
+		}
+	}
+	sd_mutex_unlock(&memtag_lock);
+}
+
 /* preallocate the whole object */
 int prealloc(int fd, uint64_t size)
 {
@@ -590,17 +753,18 @@ void list_sort(void *priv, struct list_head *head,
  */
 void find_zero_blocks(const void *buf, uint64_t *poffset, uint32_t *plen)
 {
-	const uint8_t zero[BLOCK_SIZE] = {0};
-	const uint8_t *p = buf;
 	uint64_t start = *poffset;
 	uint64_t offset = 0;
 	uint32_t len = *plen;
+	/* the zeros before 'head' and after 'tail' are the ones to trim */
+	size_t head = find_nonzero(buf, len);
+	size_t tail = head == len ? 0 : find_last_nonzero(buf, len);
 
 	/* trim zero blocks from the beginning of buffer */
 	while (len >= BLOCK_SIZE) {
 		size_t size = BLOCK_SIZE - (start + offset) % BLOCK_SIZE;
 
-		if (memcmp(p + offset, zero, size) != 0)
+		if (offset + size > head)
 			break;
 
 		offset += size;
@@ -613,7 +777,7 @@ void find_zero_blocks(const void *buf, uint64_t *poffset, uint32_t *plen)
 		if (size == 0)
 			size = BLOCK_SIZE;
 
-		if (memcmp(p + offset + len - size, zero, size) != 0)
+		if (offset + len - size < tail)
 			break;
 
 		len -= size;
@@ -28,11 +28,13 @@
 #include <signal.h>
 
 #include "common.h"
+#include "sheep.h"
 #include "list.h"
 #include "util.h"
 #include "bitops.h"
 #include "work.h"
 #include "event.h"
+#include "numa.h"
 
 #define TRACEPOINT_DEFINE
 #include "work_tp.h"
@@ -47,14 +49,14 @@ static size_t max_dynamic_threads = 0;
  */
 #define WQ_PROTECTION_PERIOD 1000 /* ms */
 
+/* the period over which the controller measures a dynamic queue */
+#define WQ_SAMPLE_PERIOD 100 /* ms */
+
 struct wq_info {
 	const char *name;
 
-	struct list_head finished_list;
 	struct list_node list;
 
-	struct sd_mutex finished_lock;
-
 	/* workers sleep on this and signaled by work producer */
 	struct sd_cond pending_cond;
 	/* locked by work producer and workers */
@@ -69,10 +71,102 @@ struct wq_info {
 	/* we cannot shrink work queue till this time */
 	uint64_t tm_end_of_protection;
 	enum wq_thread_control tc;
+
+	/* the works are run by the work-stealing pool */
+	bool stealing;
+	enum wq_priority prio;
+
+	int io_class;
+	int numa_node;	/* the node the threads run on, -1 for any */
+
+	/* the limits of a dynamic queue, 0 for the defaults */
+	size_t min_threads;
+	size_t max_threads;
+
+	/* the controller, protected by pending_lock, see wq_update_target() */
+	size_t target;
+	uint64_t tm_sample;	/* ms, the start of the sample */
+	uint64_t nr_arrived;
+	uint64_t nr_started;
+	uint64_t wait_sum;	/* nsec */
+	uint64_t avg_rate;	/* works per second */
+	uint64_t avg_service;	/* nsec */
+	uint64_t avg_wait;	/* nsec */
+
+	/* protected by uatomic primitives */
+	uint64_t nr_serviced;
+	uint64_t service_sum;	/* nsec */
+
+	/* since the start, protected by uatomic primitives */
+	size_t nr_running;
+	uint64_t nr_done;
+	uint64_t wait_total;	/* usec */
+	uint64_t wait_max;
+	uint64_t run_total;
+	uint64_t run_max;
+	uint64_t wait_buckets[SD_NR_LATENCY_BUCKETS];
+	uint64_t run_buckets[SD_NR_LATENCY_BUCKETS];
 };
 
+/*
+ * Work-stealing pool
+ *
+ * When enabled by set_work_stealing(), the dynamic work queues don't have their
+ * own threads.  Their works are run by one pool of threads, each of which has
+ * its own run queue per priority.  queue_work() from a pool thread pushes the
+ * work to its own run queue, and the other callers spread the works over the
+ * run queues in round robin.  The pool threads take the works from their own
+ * run queue first and steal from the others when it's empty, higher priority
+ * first.
+ *
+ * This removes the contention on the single pending_list of a busy queue and
+ * lets the threads idle on a queue serve the backlog of another one.  The
+ * ordered and fixed work queues keep their own threads, and so do the queues
+ * marked by set_work_queue_blocking(): a work which waits for the works of
+ * other queues, like a gateway request waiting for its peer I/O, would
+ * deadlock the pool once such works take all its threads.
+ */
+struct steal_rq {
+	struct sd_mutex lock;
+	struct list_head list[NR_WQ_PRIO];
+};
+
+static bool steal_enabled;
+static size_t nr_steal_threads;
+static struct steal_rq *steal_rqs;
+static __thread struct steal_rq *my_steal_rq;
+
+/* the I/O class of the work being run by this thread */
+static __thread int cur_io_class;
+
+/* protected by uatomic primitives */
+static unsigned long steal_next_rq;
+static unsigned long nr_steal_pending;
+static unsigned long nr_steal_idle;
+
+/* idle pool threads sleep on this */
+static struct sd_mutex steal_idle_lock = SD_MUTEX_INITIALIZER;
+static struct sd_cond steal_idle_cond = SD_COND_INITIALIZER;
+
 static int efd;
 static LIST_HEAD(wq_info_list);
+
+/*
+ * Finished works are handed to the main thread through a lock-free stack
+ * which the workers push onto with cmpxchg and the main thread takes as a
+ * whole with xchg.  Only the worker which finds the stack empty signals the
+ * eventfd, so a burst of completions costs a single wakeup.  After draining
+ * it, the main thread polls the stack for a while before going back to
+ * epoll; while it polls the workers don't signal at all.  The poll period
+ * adapts between DONE_SPIN_MIN and DONE_SPIN_MAX iterations, doubling when
+ * the poll finds more work and halving when it doesn't.
+ */
+#define DONE_SPIN_MIN 16
+#define DONE_SPIN_MAX 1024
+
+static struct work *done_head;
+static unsigned long done_polling;
+static int done_spin = DONE_SPIN_MIN;
 static size_t nr_nodes = 1;
 static size_t (*wq_get_nr_nodes)(void);
 static size_t nr_cores = 1;
@@ -210,7 +304,9 @@ static inline uint64_t wq_get_roof(struct wq_info *wi)
 	case WQ_ORDERED:
 		break;
 	case WQ_DYNAMIC:
-		if (max_dynamic_threads > 0) {
+		if (wi->max_threads > 0) {
+			nr = (uint64_t)wi->max_threads;
+		} else if (max_dynamic_threads > 0) {
 			nr = (uint64_t)max_dynamic_threads;
 		} else {
 			/* max(#nodes,#cores,16)*2 threads */
@@ -227,6 +323,60 @@ static inline uint64_t wq_get_roof(struct wq_info *wi)
 	return nr;
 }
 
+static inline size_t wq_get_floor(struct wq_info *wi)
+{
+	return max(wi->min_threads, (size_t)1);
+}
+
+/* Keep the target between the floor and the roof of the queue */
+static void wq_clamp_target(struct wq_info *wi)
+{
+	size_t target = max(wi->target, wq_get_floor(wi));
+
+	wi->target = min(target, (size_t)wq_get_roof(wi));
+}
+
+static void update_avg(uint64_t *avg, uint64_t val)
+{
+	*avg = (*avg * 3 + val) / 4;
+}
+
+/*
+ * Size a dynamic queue by Little's law: the threads busy on average are the
+ * arrival rate of the works times their service time.  The target is that
+ * with a quarter of headroom, so that the works rarely wait, but no more;
+ * the I/O bound queues then don't pile up threads which only contend for
+ * the same disks.  A queue whose works wait longer than they run is behind
+ * the estimate, e.g. at the start of a burst, and gets one more thread per
+ * sample.  Until the first works finish, it doubles as before.
+ *
+ * Called with pending_lock held.
+ */
+static void wq_update_target(struct wq_info *wi)
+{
+	uint64_t now = get_msec_time(), span = now - wi->tm_sample, nr;
+	uint64_t busy;
+
+	if (span < WQ_SAMPLE_PERIOD)
+		return;
+
+	nr = uatomic_xchg(&wi->nr_serviced, 0);
+	if (nr)
+		update_avg(&wi->avg_service,
+			   uatomic_xchg(&wi->service_sum, 0) / nr);
+	if (wi->nr_started)
+		update_avg(&wi->avg_wait, wi->wait_sum / wi->nr_started);
+	update_avg(&wi->avg_rate, wi->nr_arrived * 1000 / span);
+	wi->nr_arrived = wi->nr_started = wi->wait_sum = 0;
+	wi->tm_sample = now;
+
+	busy = wi->avg_rate * wi->avg_service / 1000000000;
+	wi->target = busy + busy / 4 + 1;
+	if (wi->avg_wait > wi->avg_service)
+		wi->target = max(wi->target, wi->nr_threads + 1);
+	wq_clamp_target(wi);
+}
+
 /*
  * Return non-zero if a given workqueue need to grow.
  * The return value is the new number of threads.
@@ -235,13 +385,17 @@ static inline uint64_t wq_get_roof(struct wq_info *wi)
  */
 static size_t wq_need_grow(struct wq_info *wi)
 {
-	size_t roof = 0;
+	size_t roof = 0, nr_queued;
 
 	if (wi->tc == WQ_FIXED)
 		return 0;
 
+	wi->nr_arrived++;
+	wq_update_target(wi);
+
 	/* do not need to grow if there are enough threads */
-	if (wi->nr_threads >= uatomic_read(&wi->nr_queued_work))
+	nr_queued = uatomic_read(&wi->nr_queued_work);
+	if (wi->nr_threads >= nr_queued)
 		return 0;
 
 	/* cannot grow if # threads already reaches maximum */
@@ -249,20 +403,36 @@ static size_t wq_need_grow(struct wq_info *wi)
 	if (wi->nr_threads >= roof)
 		return 0;
 
+	if (!wi->avg_service) {
+		wi->tm_end_of_protection = get_msec_time() +
+			WQ_PROTECTION_PERIOD;
+		return min(wi->nr_threads * 2, roof);
+	}
+
+	if (wi->nr_threads >= wi->target)
+		return 0;
+
 	wi->tm_end_of_protection = get_msec_time() + WQ_PROTECTION_PERIOD;
-	return min(wi->nr_threads * 2, roof);
+	return min(wi->target, nr_queued);
 }
 
 /*
- * Return true if more than half of threads are not used more than
- * WQ_PROTECTION_PERIOD seconds
+ * Return true if the queue has more threads than the controller aims at and
+ * not all of them have been used for WQ_PROTECTION_PERIOD
  */
 static bool wq_need_shrink(struct wq_info *wi)
 {
+	size_t target;
+
 	if (wi->tc == WQ_FIXED)
 		return false;
 
-	if (uatomic_read(&wi->nr_queued_work) < wi->nr_threads / 2)
+	wq_update_target(wi);
+	target = wi->avg_service ? wi->target : wi->nr_threads / 2;
+	target = max(target, wq_get_floor(wi));
+
+	if (wi->nr_threads > target &&
+	    uatomic_read(&wi->nr_queued_work) < wi->nr_threads)
 		/* we cannot shrink work queue during protection period. */
 		return wi->tm_end_of_protection <= get_msec_time();
 
@@ -271,6 +441,197 @@ static bool wq_need_shrink(struct wq_info *wi)
 	return false;
 }
 
+static void work_finished(struct work *work)
+{
+	struct work *head = uatomic_read(&done_head), *old;
+
+	do {
+		old = head;
+		work->next_done = old;
+		head = uatomic_cmpxchg(&done_head, old, work);
+	} while (head != old);
+
+	/* cmpxchg is a full barrier, pairs with the one in poll_done() */
+	if (!old && !uatomic_read(&done_polling))
+		eventfd_xwrite(efd, 1);
+}
+
+static void steal_queue_work(struct wq_info *wi, struct work *work)
+{
+	struct steal_rq *rq = my_steal_rq;
+
+	if (!rq)
+		rq = steal_rqs + uatomic_add_return(&steal_next_rq, 1) %
+			nr_steal_threads;
+
+	sd_mutex_lock(&rq->lock);
+	list_add_tail(&work->w_list, &rq->list[wi->prio]);
+	sd_mutex_unlock(&rq->lock);
+
+	/*
+	 * Pairs with the increment of nr_steal_idle in steal_worker_routine();
+	 * either we see the idle thread or it sees the pending work.
+	 */
+	uatomic_add_return(&nr_steal_pending, 1);
+	if (uatomic_read(&nr_steal_idle)) {
+		sd_mutex_lock(&steal_idle_lock);
+		sd_cond_signal(&steal_idle_cond);
+		sd_mutex_unlock(&steal_idle_lock);
+	}
+}
+
+static struct work *steal_rq_pop(struct steal_rq *rq, int prio)
+{
+	struct work *work = NULL;
+
+	/* peek without the lock, most of the run queues are empty */
+	if (list_empty(&rq->list[prio]))
+		return NULL;
+
+	sd_mutex_lock(&rq->lock);
+	if (!list_empty(&rq->list[prio])) {
+		work = list_first_entry(&rq->list[prio], struct work, w_list);
+		list_del(&work->w_list);
+	}
+	sd_mutex_unlock(&rq->lock);
+
+	return work;
+}
+
+static struct work *steal_find_work(struct steal_rq *my)
+{
+	struct work *work;
+	size_t me = my - steal_rqs, i;
+	int prio;
+
+	for (prio = 0; prio < NR_WQ_PRIO; prio++) {
+		for (i = 0; i < nr_steal_threads; i++) {
+			work = steal_rq_pop(steal_rqs +
+					    (me + i) % nr_steal_threads, prio);
+			if (work)
+				return work;
+		}
+	}
+
+	return NULL;
+}
+
+static void wq_hist_add(uint64_t *buckets, uint64_t *total, uint64_t *max,
+			uint64_t nsec)
+{
+	uint64_t usec = nsec / 1000, old;
+
+	uatomic_inc(&buckets[latency_to_bucket(usec)]);
+	uatomic_add(total, usec);
+	while ((old = uatomic_read(max)) < usec &&
+	       uatomic_cmpxchg(max, old, usec) != old)
+		;
+}
+
+/* Run the work taken at 'start', return the nsec it ran */
+static uint64_t run_work(struct wq_info *wi, struct work *work, uint64_t start)
+{
+	uint64_t run;
+
+	uatomic_inc(&wi->nr_running);
+	cur_io_class = wi->io_class;
+	if (work->fn)
+		work->fn(work);
+	run = clock_get_time() - start;
+	uatomic_dec(&wi->nr_running);
+
+	wq_hist_add(wi->wait_buckets, &wi->wait_total, &wi->wait_max,
+		    start - work->queued);
+	wq_hist_add(wi->run_buckets, &wi->run_total, &wi->run_max, run);
+	uatomic_inc(&wi->nr_done);
+
+	return run;
+}
+
+/* Spin for the busy-poll window until a work is pending in the pool */
+static void steal_busy_poll(void)
+{
+	uint64_t end = clock_get_time() + get_busy_poll() * 1000ULL;
+
+	while (!uatomic_read(&nr_steal_pending) && clock_get_time() < end)
+		cpu_relax();
+}
+
+static void *steal_worker_routine(void *arg)
+{
+	struct steal_rq *rq = arg;
+	struct work *work;
+	struct wq_info *wi;
+	bool spun = false;
+
+	my_steal_rq = rq;
+	set_thread_name("steal", true);
+
+	trace_set_tid_map(gettid());
+	while (true) {
+		work = steal_find_work(rq);
+		if (!work && get_busy_poll() && !spun) {
+			steal_busy_poll();
+			spun = true;
+			continue;
+		}
+		spun = false;
+		if (!work) {
+			sd_mutex_lock(&steal_idle_lock);
+			uatomic_add_return(&nr_steal_idle, 1);
+			while (!uatomic_read(&nr_steal_pending))
+				sd_cond_wait(&steal_idle_cond,
+					     &steal_idle_lock);
+			uatomic_dec(&nr_steal_idle);
+			sd_mutex_unlock(&steal_idle_lock);
+			continue;
+		}
+		uatomic_dec(&nr_steal_pending);
+
+		wi = container_of(work->wq, struct wq_info, q);
+		tracepoint(work, do_work, wi, work);
+
+		run_work(wi, work, clock_get_time());
+
+		work_finished(work);
+	}
+
+	pthread_exit(NULL);
+}
+
+static int create_steal_pool(void)
+{
+	pthread_t thread;
+	size_t i;
+	int j, ret;
+
+	if (!nr_steal_threads) {
+		/* the same as the maximum of a dynamic work queue */
+		nr_steal_threads = max(nr_nodes, nr_cores);
+		nr_steal_threads = max_dynamic_threads ?:
+			max(nr_steal_threads, (size_t)16) * 2;
+	}
+
+	steal_rqs = xzalloc(sizeof(*steal_rqs) * nr_steal_threads);
+	for (i = 0; i < nr_steal_threads; i++) {
+		sd_init_mutex(&steal_rqs[i].lock);
+		for (j = 0; j < NR_WQ_PRIO; j++)
+			INIT_LIST_HEAD(&steal_rqs[i].list[j]);
+	}
+
+	for (i = 0; i < nr_steal_threads; i++) {
+		ret = pthread_create(&thread, NULL, steal_worker_routine,
+				     steal_rqs + i);
+		if (ret != 0) {
+			sd_err("failed to create work-stealing thread: %m");
+			return -1;
+		}
+	}
+	sd_info("work-stealing pool with %zu threads", nr_steal_threads);
+
+	return 0;
+}
+
 static int create_worker_threads(struct wq_info *wi, size_t nr_threads)
 {
 	pthread_t thread;
@@ -296,7 +657,14 @@ void queue_work(struct work_queue *q, struct work *work)
 
 	tracepoint(work, queue_work, wi, work);
 
+	work->wq = q;
+	work->queued = clock_get_time();
 	uatomic_inc(&wi->nr_queued_work);
+	if (wi->stealing) {
+		steal_queue_work(wi, work);
+		return;
+	}
+
 	sd_mutex_lock(&wi->pending_lock);
 
 	new_nr_threads = wq_need_grow(wi);
@@ -309,39 +677,82 @@ void queue_work(struct work_queue *q, struct work *work)
 	sd_cond_signal(&wi->pending_cond);
 }
 
-static void worker_thread_request_done(int fd, int events, void *data)
+/* Run the done callbacks of the finished works in the order of completion */
+static void run_done_works(struct work *stack)
 {
+	struct work *work, *next, *list = NULL;
 	struct wq_info *wi;
-	struct work *work;
-	LIST_HEAD(list);
 
-	if (wq_get_nr_nodes)
-		nr_nodes = wq_get_nr_nodes();
+	while (stack) {
+		next = stack->next_done;
+		stack->next_done = list;
+		list = stack;
+		stack = next;
+	}
 
-	eventfd_xread(fd);
+	for (work = list; work; work = next) {
+		next = work->next_done;
+		wi = container_of(work->wq, struct wq_info, q);
 
-	list_for_each_entry(wi, &wq_info_list, list) {
-		sd_mutex_lock(&wi->finished_lock);
-		list_splice_init(&wi->finished_list, &list);
-		sd_mutex_unlock(&wi->finished_lock);
+		tracepoint(work, request_done, wi, work);
 
-		while (!list_empty(&list)) {
-			work = list_first_entry(&list, struct work, w_list);
-			list_del(&work->w_list);
+		work->done(work);
+		uatomic_dec(&wi->nr_queued_work);
+	}
+}
 
-			tracepoint(work, request_done, wi, work);
+/* Return true if more works finished while we were polling */
+static bool poll_done(void)
+{
+	int i;
 
-			work->done(work);
-			uatomic_dec(&wi->nr_queued_work);
+	uatomic_set(&done_polling, 1);
+	for (i = 0; i < done_spin; i++) {
+		if (uatomic_read(&done_head)) {
+			done_spin = min(done_spin * 2, DONE_SPIN_MAX);
+			return true;
 		}
+		cpu_relax();
 	}
+	uatomic_set(&done_polling, 0);
+	cmm_smp_mb();
+
+	done_spin = max(done_spin / 2, DONE_SPIN_MIN);
+	return uatomic_read(&done_head) != NULL;
+}
+
+static void worker_thread_request_done(int fd, int events, void *data)
+{
+	if (wq_get_nr_nodes)
+		nr_nodes = wq_get_nr_nodes();
+
+	eventfd_xread(fd);
+
+	do {
+		run_done_works(uatomic_xchg_ptr(&done_head, NULL));
+	} while (poll_done());
+}
+
+/*
+ * Spin for the busy-poll window until 'list' has a work, before the worker
+ * sleeps on the pending_cond.  Only the head is peeked, without the lock.
+ */
+static void wq_busy_poll(struct list_head *list)
+{
+	uint64_t end = clock_get_time() + get_busy_poll() * 1000ULL;
+
+	while (uatomic_read(&list->n.next) == &list->n &&
+	       clock_get_time() < end)
+		cpu_relax();
 }
 
 static void *worker_routine(void *arg)
 {
 	struct wq_info *wi = arg;
 	struct work *work;
-	int tid = gettid();
+	int tid = gettid(), node = -1;
+	uint64_t start;
+	bool spun = false;
 
 	set_thread_name(wi->name, (wi->tc != WQ_ORDERED));
 
@@ -361,26 +772,37 @@ static void *worker_routine(void *arg)
 		}
 retest:
 		if (list_empty(&wi->q.pending_list)) {
+			if (get_busy_poll() && !spun) {
+				sd_mutex_unlock(&wi->pending_lock);
+				wq_busy_poll(&wi->q.pending_list);
+				sd_mutex_lock(&wi->pending_lock);
+				spun = true;
+				goto retest;
+			}
 			sd_cond_wait(&wi->pending_cond, &wi->pending_lock);
 			goto retest;
 		}
+		spun = false;
 
 		work = list_first_entry(&wi->q.pending_list,
 				       struct work, w_list);
 
 		list_del(&work->w_list);
+		start = clock_get_time();
+		wi->nr_started++;
+		wi->wait_sum += start - work->queued;
 		sd_mutex_unlock(&wi->pending_lock);
 
 		tracepoint(work, do_work, wi, work);
 
-		if (work->fn)
-			work->fn(work);
-
-		sd_mutex_lock(&wi->finished_lock);
-		list_add_tail(&work->w_list, &wi->finished_list);
-		sd_mutex_unlock(&wi->finished_lock);
+		if (unlikely(uatomic_read(&wi->numa_node) != node)) {
+			node = uatomic_read(&wi->numa_node);
+			numa_bind_thread(node);
+		}
+		uatomic_add(&wi->service_sum, run_work(wi, work, start));
+		uatomic_inc(&wi->nr_serviced);
 
-		eventfd_xwrite(efd, 1);
+		work_finished(work);
 	}
 
 	pthread_exit(NULL);
@@ -408,6 +830,9 @@ int init_work_queue(size_t (*get_nr_nodes)(void))
 		return -1;
 	}
 
+	if (steal_enabled && create_steal_pool() < 0)
+		return -1;
+
 	return 0;
 }
 
@@ -420,16 +845,18 @@ struct work_queue *create_work_queue(const char *name,
 	wi = xzalloc(sizeof(*wi));
 	wi->name = name;
 	wi->tc = tc;
+	wi->stealing = tc == WQ_DYNAMIC && steal_rqs;
+	wi->prio = WQ_PRIO_NORMAL;
+	wi->tm_sample = get_msec_time();
+	wi->numa_node = -1;
 
 	INIT_LIST_HEAD(&wi->q.pending_list);
-	INIT_LIST_HEAD(&wi->finished_list);
 
 	sd_cond_init(&wi->pending_cond);
 
-	sd_init_mutex(&wi->finished_lock);
 	sd_init_mutex(&wi->pending_lock);
 
-	if (tc != WQ_FIXED) {
+	if (tc != WQ_FIXED && !wi->stealing) {
 		ret = create_worker_threads(wi, 1);
 		if (ret < 0)
 			goto destroy_threads;
@@ -442,7 +869,6 @@ struct work_queue *create_work_queue(const char *name,
 destroy_threads:
 	sd_destroy_cond(&wi->pending_cond);
 	sd_destroy_mutex(&wi->pending_lock);
-	sd_destroy_mutex(&wi->finished_lock);
 	free(wi);
 
 	return NULL;
@@ -484,6 +910,178 @@ void set_max_dynamic_threads(size_t nr_max)
 	max_dynamic_threads = nr_max;
 }
 
+/*
+ * Run the dynamic work queues on a shared work-stealing pool of 'nr_threads'
+ * threads, or of the default size if it's zero.  Must be called before
+ * init_work_queue().
+ */
+void set_work_stealing(size_t nr_threads)
+{
+	steal_enabled = true;
+	nr_steal_threads = nr_threads;
+}
+
+/*
+ * Run the dynamic queue on its own threads even with the work-stealing pool,
+ * because its works block waiting for the works of other queues.  Must be
+ * called before the first work is queued.
+ */
+void set_work_queue_blocking(struct work_queue *q)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	if (!wi->stealing)
+		return;
+
+	wi->stealing = false;
+	if (create_worker_threads(wi, 1) < 0)
+		panic("failed to create a worker thread: %s", wi->name);
+}
+
+void set_work_queue_priority(struct work_queue *q, enum wq_priority prio)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	wi->prio = prio;
+}
+
+/*
+ * Tag the works of the queue with an I/O class, which the code run by them can
+ * read by get_io_class().  The meaning of the classes is up to the user, 0 is
+ * the default.
+ */
+void set_work_queue_io_class(struct work_queue *q, int io_class)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	wi->io_class = io_class;
+}
+
+int get_io_class(void)
+{
+	return cur_io_class;
+}
+
+/* Override the I/O class of the current work until it returns */
+void set_io_class(int io_class)
+{
+	cur_io_class = io_class;
+}
+
+/*
+ * Run the threads of the queue on the CPUs of the NUMA node.  The threads move
+ * over before their next work.  With -1, the default, they keep the affinity
+ * they inherit from the thread creating them.  Has no effect on the queues run
+ * by the work-stealing pool.
+ */
+void set_work_queue_numa_node(struct work_queue *q, int node)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	uatomic_set(&wi->numa_node, node);
+}
+
+/* Fill in the stats of up to 'nr' work queues, return the number filled */
+int work_queue_stat(struct work_queue_stat *st, int nr)
+{
+	struct wq_info *wi;
+	int i = 0;
+
+	list_for_each_entry(wi, &wq_info_list, list) {
+		if (i >= nr)
+			break;
+
+		sd_mutex_lock(&wi->pending_lock);
+		st[i].name = wi->name;
+		st[i].tc = wi->tc;
+		st[i].stealing = wi->stealing;
+		st[i].nr_threads = wi->nr_threads;
+		st[i].min_threads = wi->min_threads;
+		st[i].max_threads = wi->max_threads;
+		st[i].target = wi->target;
+		st[i].nr_queued = uatomic_read(&wi->nr_queued_work);
+		st[i].rate = wi->avg_rate;
+		st[i].service_time = wi->avg_service;
+		st[i].wait_time = wi->avg_wait;
+		sd_mutex_unlock(&wi->pending_lock);
+		i++;
+	}
+
+	return i;
+}
+
+/* Fill in the works of up to 'nr' work queues, return the number filled */
+int work_queue_hist(struct sd_wq_stat *st, int nr)
+{
+	struct wq_info *wi;
+	size_t queued, running;
+	int i = 0;
+
+	list_for_each_entry(wi, &wq_info_list, list) {
+		if (i >= nr)
+			break;
+
+		memset(st + i, 0, sizeof(st[i]));
+		pstrcpy(st[i].name, sizeof(st[i].name), wi->name);
+		sd_mutex_lock(&wi->pending_lock);
+		st[i].nr_threads = wi->nr_threads;
+		sd_mutex_unlock(&wi->pending_lock);
+		/* the queued works include the running ones */
+		queued = uatomic_read(&wi->nr_queued_work);
+		running = uatomic_read(&wi->nr_running);
+		st[i].nr_running = running;
+		st[i].nr_waiting = queued > running ? queued - running : 0;
+		st[i].nr_done = uatomic_read(&wi->nr_done);
+		st[i].wait_total = uatomic_read(&wi->wait_total);
+		st[i].wait_max = uatomic_read(&wi->wait_max);
+		st[i].run_total = uatomic_read(&wi->run_total);
+		st[i].run_max = uatomic_read(&wi->run_max);
+		for (int j = 0; j < SD_NR_LATENCY_BUCKETS; j++) {
+			st[i].wait_buckets[j] =
+				uatomic_read(&wi->wait_buckets[j]);
+			st[i].run_buckets[j] =
+				uatomic_read(&wi->run_buckets[j]);
+		}
+		i++;
+	}
+
+	return i;
+}
+
+/*
+ * Bound the number of threads of the dynamic work queue 'name', 0 for the
+ * default.  Returns -1 if there is no such queue or the limits are invalid.
+ */
+int set_work_queue_limits(const char *name, size_t min_threads,
+			  size_t max_threads)
+{
+	struct wq_info *wi;
+
+	if (max_threads && min_threads > max_threads)
+		return -1;
+
+	list_for_each_entry(wi, &wq_info_list, list) {
+		if (strcmp(wi->name, name) != 0)
+			continue;
+		if (wi->tc != WQ_DYNAMIC)
+			return -1;
+
+		sd_mutex_lock(&wi->pending_lock);
+		wi->min_threads = min_threads;
+		wi->max_threads = max_threads;
+		wq_clamp_target(wi);
+		if (!wi->stealing && wi->nr_threads < min_threads)
+			create_worker_threads(wi, min_threads);
+		sd_mutex_unlock(&wi->pending_lock);
+
+		sd_info("%s: %zu - %zu threads", name, min_threads,
+			max_threads);
+		return 0;
+	}
+
+	return -1;
+}
+
 struct thread_args {
 	const char *name;
 	void *(*start_routine)(void *);
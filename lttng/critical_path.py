@@ -0,0 +1,179 @@
+#! /usr/bin/env python3.4
+
+# Copyright (C) 2015 China Mobile Inc.
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License version
+# 2 as published by the Free Software Foundation.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Critical path of the requests across the nodes
+#
+# A gateway forwards the oid, the epoch and the id of a request to the peers,
+# and each node records them with the stages of its requests in the
+# request:stages event.  This joins the gateway requests with their peer
+# requests by (oid, epoch, id) and splits the latency of each gateway request
+# into its stages.  The forward stage, from the forward to the replies of all
+# the peers, is split along its critical path, the slowest peer: the stages
+# of the peer, and the network, which is the rest of the forward stage.  Only
+# the stages within a node are subtracted, so the clocks of the nodes need
+# not agree.
+#
+# It prints a table of the percentiles of each stage per opcode, and with
+# --folded, writes the stages as folded stacks, the input of flamegraph.pl
+# (https://github.com/brendangregg/FlameGraph), weighted in usec.
+#
+# how to use:
+# critical_path.py [--folded FILE] <trace path of a node>...
+#
+# example:
+# critical_path.py --folded req.folded ~/lttng-traces/node*/ust/uid/0/64-bit/
+# flamegraph.pl req.folded > req.svg
+
+import argparse
+import collections
+import copy
+import babeltrace
+
+# the stages of request:stages, in the order of enum request_stage
+stages = ["rx", "queue", "work", "forward", "reply", "work_end", "done", "tx"]
+RX, REPLY, TX = 0, 4, 7
+
+gateway_ops = {
+    0x01: "create_and_write",
+    0x02: "read",
+    0x03: "write",
+    0x04: "remove",
+    0x05: "discard",
+}
+
+peer_ops = {
+    0xA3: "create_and_write_peer",
+    0xA4: "read_peer",
+    0xA5: "write_peer",
+    0xA6: "remove_peer",
+}
+
+
+class Request:
+    def __init__(self, event):
+        self.opcode = event['opcode']
+        self.oid = event['oid']
+        self.epoch = event['epoch']
+        self.id = event['id']
+        self.port = event['port']
+        self.times = list(event['stages'])
+
+    def key(self):
+        return (self.oid, self.epoch, self.id)
+
+    def latency(self):
+        return self.times[TX] - self.times[RX]
+
+    def breakdown(self, first=RX, last=TX):
+        """Yield the name and the nsec of each stage between first and last
+
+        A stage lasts until the next stage which was reached.
+        """
+        prev = first
+        for i in range(first + 1, last + 1):
+            if self.times[i] == 0:
+                continue
+            yield (stages[prev], self.times[i] - self.times[prev])
+            prev = i
+
+
+def critical_path(gw, peers):
+    """Return the stages of gw as a list of (stack, nsec)"""
+    path = []
+    for name, nsec in gw.breakdown():
+        if name != "forward" or not peers or not gw.times[REPLY]:
+            path.append(((name,), nsec))
+            continue
+
+        slowest = max(peers, key=Request.latency)
+        peer = "peer:%d" % slowest.port
+        for pname, pnsec in slowest.breakdown():
+            path.append(((name, peer, pname), pnsec))
+        path.append(((name, "network"), max(0, nsec - slowest.latency())))
+    return path
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def read_requests(paths):
+    gateways = []
+    peers = collections.defaultdict(list)
+
+    for path in paths:
+        col = babeltrace.TraceCollection()
+        if col.add_trace(path, 'ctf') is None:
+            raise RuntimeError('Cannot add trace %s' % path)
+
+        for _event in col.events:
+            if _event.name != "request:stages":
+                continue
+            event = copy.copy(_event)
+            req = Request(event)
+            if not req.times[RX] or not req.times[TX]:
+                continue
+            if req.opcode in gateway_ops:
+                gateways.append(req)
+            elif req.opcode in peer_ops:
+                peers[req.key()].append(req)
+
+    return (gateways, peers)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='critical path of the requests across the nodes')
+    parser.add_argument('--folded', metavar='FILE',
+                        help='write folded stacks for flamegraph.pl')
+    parser.add_argument('traces', nargs='+',
+                        help='the trace of each node')
+    args = parser.parse_args()
+
+    (gateways, peers) = read_requests(args.traces)
+
+    # {opcode: {stage: [nsec]}}, the stages in the order of the path
+    table = collections.defaultdict(collections.OrderedDict)
+    folded = collections.Counter()
+    nr_joined = 0
+    for gw in gateways:
+        op = gateway_ops[gw.opcode]
+        replicas = peers.get(gw.key(), [])
+        if replicas:
+            nr_joined += 1
+
+        table[op].setdefault("total", []).append(gw.latency())
+        for stack, nsec in critical_path(gw, replicas):
+            table[op].setdefault("/".join(stack), []).append(nsec)
+            folded[";".join((op,) + stack)] += nsec // 1000
+
+    print("critical path of gateway requests "
+          "(%d requests, %d joined with their peers)" %
+          (len(gateways), nr_joined))
+    print("%-14s %-32s %8s %10s %10s %10s %10s" %
+          ("op", "stage", "nr", "p50(us)", "p99(us)", "p999(us)",
+           "max(us)"))
+    for op in sorted(table):
+        for stage, values in table[op].items():
+            values = sorted(values)
+            print("%-14s %-32s %8d %10d %10d %10d %10d" %
+                  (op, stage, len(values), percentile(values, 50) // 1000,
+                   percentile(values, 99) // 1000,
+                   percentile(values, 99.9) // 1000, values[-1] // 1000))
+
+    if args.folded:
+        with open(args.folded, 'w') as f:
+            for stack in sorted(folded):
+                f.write("%s %d\n" % (stack, folded[stack]))
+
+
+if __name__ == '__main__':
+    main()
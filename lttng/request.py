@@ -104,6 +104,22 @@ class Request:
             
 clients = {}
 
+# the stages of request:stages, in the order of enum request_stage
+stages = ["rx", "queue", "work", "forward", "reply", "work_end", "done", "tx"]
+stage_total_time = [0] * len(stages)
+stage_nr_reqs = [0] * len(stages)
+
+def feed_stages(event):
+    times = event['stages']
+    if times[0] == 0:
+        return
+
+    for i in range(1, len(stages)):
+        if times[i] == 0:
+            continue
+        stage_total_time[i] += times[i] - times[0]
+        stage_nr_reqs[i] += 1
+
 class Client:
     def __init__(self, id_fd):
         self.id_fd = id_fd
@@ -134,6 +150,8 @@ def is_focusing_events(event):
         return True
     if event.name == "request:tx_main":
         return True
+    if event.name == "request:stages":
+        return True
     return False
 
 def req_stat():
@@ -163,6 +181,9 @@ def req_stat():
             if event['fd'] in clients:
                 clients.pop(event['fd'])
             continue
+        if event.name == "request:stages":
+            feed_stages(event)
+            continue
 
         # events of rx/tx
         if not event['fd'] in clients:
@@ -176,5 +197,13 @@ def req_stat():
     print("worst latency: %s ns" % "{0:,d}".format(worst_latency))
     print("best latency: %s ns" % "{0:,d}".format(best_latency))
 
+    print("average time to reach each stage since rx")
+    for i in range(1, len(stages)):
+        if stage_nr_reqs[i] == 0:
+            continue
+        print("%-10s %s ns (%d requests)" % (stages[i],
+              "{0:,d}".format(int(stage_total_time[i] / stage_nr_reqs[i])),
+              stage_nr_reqs[i]))
+
 if __name__ == '__main__':
     req_stat()
@@ -17,6 +17,7 @@
 #include <linux/gfp.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
+#include <linux/hash.h>
 
 #include "sheepdog_proto.h"
 
@@ -44,8 +45,26 @@ struct sheep_vdi {
 	char name[SD_MAX_VDI_LEN];
 };
 
-struct sbd_device {
+#define SBD_MAX_QUEUES 16
+#define SBD_HASH_BITS 8
+#define SBD_HASH_SIZE (1 << SBD_HASH_BITS)
+
+/*
+ * Each queue has its own connection to the sheep daemon, served by its own
+ * submiter and reaper kthreads, so that a device isn't capped by one socket.
+ */
+struct sbd_queue {
+	struct sbd_device *dev;
 	struct socket *sock;
+	struct mutex sock_mutex; /* serialize requests sent on sock */
+	atomic_t nr_inflight;
+
+	struct task_struct *reaper;
+	struct task_struct *submiter;
+	wait_queue_head_t reaper_wq;
+};
+
+struct sbd_device {
 	int id;		/* blkdev unique id */
 	atomic_t seq_num;
 
@@ -58,28 +77,38 @@ struct sbd_device {
 	struct sheep_vdi vdi;		/* Associated sheep image */
 	spinlock_t vdi_lock;
 
+	int nr_queues;
+	struct sbd_queue queues[SBD_MAX_QUEUES];
+
 	struct list_head request_head; /* protected by queue lock */
-	struct list_head inflight_head; /* for inflight sheep requests */
+	/* inflight sheep requests, hashed by seq_num and by oid */
+	struct list_head inflight_hash[SBD_HASH_SIZE];
+	struct list_head oid_hash[SBD_HASH_SIZE];
 	struct list_head blocking_head; /* for blocking sheep requests */
+	struct mutex create_mutex; /* serialize object creation */
 	rwlock_t inflight_lock;
 	rwlock_t blocking_lock;
 
 	struct list_head list;
-	struct task_struct *reaper;
-	struct task_struct *submiter;
-	wait_queue_head_t reaper_wq;
 	wait_queue_head_t submiter_wq;
 };
 
+/* at most this many adjacent block requests are merged into an aiocb */
+#define SBD_MAX_MERGE 16
+
+/*
+ * The data is sent from and received into the pages of the block requests
+ * directly, buf_iter is the offset of the next sheep request in them.
+ */
 struct sheep_aiocb {
-	struct request *request;
+	struct request *requests[SBD_MAX_MERGE];
+	int nr_rqs;
+	bool write;
 	u64 offset;
 	u64 length;
 	int ret;
 	atomic_t nr_requests;
-	char *buf;
 	int buf_iter;
-	void (*aio_done_func)(struct sheep_aiocb *);
 };
 
 enum sheep_request_type {
@@ -90,21 +119,25 @@ enum sheep_request_type {
 
 struct sheep_request {
 	struct list_head list;
+	struct list_head oid_list;
 	struct sheep_aiocb *aiocb;
+	struct sbd_queue *queue;
 	u64 oid;
 	u64 cow_oid;
 	u32 seq_num;
 	int type;
 	int offset;
 	int length;
-	char *buf;
+	char *buf;	/* NULL if the data is in the pages of aiocb */
+	int data_off;	/* of the data in the pages of aiocb */
 };
 
 void socket_shutdown(struct socket *sock);
 int sheep_setup_vdi(struct sbd_device *dev);
-struct sheep_aiocb *sheep_aiocb_setup(struct request *req);
-int sheep_aiocb_submit(struct sheep_aiocb *aiocb);
-int sheep_handle_reply(struct sbd_device *dev);
+void sheep_shutdown_vdi(struct sbd_device *dev);
+struct sheep_aiocb *sheep_aiocb_setup(struct request **reqs, int nr);
+int sheep_aiocb_submit(struct sbd_queue *q, struct sheep_aiocb *aiocb);
+int sheep_handle_reply(struct sbd_queue *q);
 int sheep_slab_create(void);
 void sheep_slab_destroy(void);
 
@@ -11,7 +11,6 @@
 
 #include "sbd.h"
 
-static DEFINE_MUTEX(socket_mutex);
 static struct kmem_cache *sheep_aiocb_pool;
 static struct kmem_cache *sheep_request_pool;
 
@@ -23,14 +22,28 @@ void socket_shutdown(struct socket *sock)
 
 static struct sbd_device *sheep_request_to_device(struct sheep_request *req)
 {
-	return req->aiocb->request->q->queuedata;
+	return req->aiocb->requests[0]->q->queuedata;
 }
 
 static struct sbd_device *sheep_aiocb_to_device(struct sheep_aiocb *aiocb)
 {
-	return aiocb->request->q->queuedata;
+	return aiocb->requests[0]->q->queuedata;
 }
 
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(3, 14, 0)
+
+# define DEFINE_BVEC(x) struct bio_vec *x
+# define BVEC_ADDR(x) x
+# define BVEC_FIELD(x, y) x->y
+
+#else
+
+# define DEFINE_BVEC(x) struct bio_vec x
+# define BVEC_ADDR(x) &x
+# define BVEC_FIELD(x, y) x.y
+
+#endif
+
 static int socket_create(struct socket **sock, const char *ip_addr, int port)
 {
 	struct sockaddr_in addr;
@@ -131,27 +144,142 @@ static int socket_write(struct socket *sock, void *buf, int len)
 	return socket_xmit(sock, buf, len, true, 0);
 }
 
-static int sheep_submit_sdreq(struct socket *sock, struct sd_req *hdr,
+/* Send the page without copying it, if the network stack may hold it */
+static int socket_send_page(struct socket *sock, struct page *page,
+			    int offset, int size, int msg_flags)
+{
+	int result;
+	sigset_t blocked, oldset;
+
+	if (unlikely(!sock))
+		return -EINVAL;
+
+	if (PageSlab(page) || page_count(page) < 1) {
+		void *addr = kmap(page);
+
+		result = socket_xmit(sock, addr + offset, size, true,
+				     msg_flags);
+		kunmap(page);
+		return result;
+	}
+
+	/* Don't allow signals to interrupt the transmission */
+	siginitsetinv(&blocked, 0);
+	sigprocmask(SIG_SETMASK, &blocked, &oldset);
+
+	do {
+		result = kernel_sendpage(sock, page, offset, size,
+					 msg_flags | MSG_NOSIGNAL);
+		if (result <= 0) {
+			if (result == 0)
+				result = -EPIPE;
+			break;
+		}
+		size -= result;
+		offset += result;
+	} while (size > 0);
+
+	sigprocmask(SIG_SETMASK, &oldset, NULL);
+
+	return result;
+}
+
+enum aiocb_xmit_op {
+	AIOCB_SEND,
+	AIOCB_RECV,
+	AIOCB_ZERO,
+};
+
+/*
+ * Send, receive or zero len bytes of the pages of the block requests of
+ * @aiocb, starting at byte off of them.
+ */
+static int sheep_aiocb_xmit(struct socket *sock, struct sheep_aiocb *aiocb,
+			    int off, int len, enum aiocb_xmit_op op)
+{
+	struct req_iterator iter;
+	DEFINE_BVEC(bvec);
+	int i, n, ret = 0;
+
+	for (i = 0; i < aiocb->nr_rqs; i++) {
+		rq_for_each_segment(bvec, aiocb->requests[i], iter) {
+			struct page *page = BVEC_FIELD(bvec, bv_page);
+			int bv_len = BVEC_FIELD(bvec, bv_len);
+			int page_off = BVEC_FIELD(bvec, bv_offset) + off;
+			void *addr;
+
+			if (off >= bv_len) {
+				off -= bv_len;
+				continue;
+			}
+			n = min(len, bv_len - off);
+			off = 0;
+
+			switch (op) {
+			case AIOCB_SEND:
+				ret = socket_send_page(sock, page, page_off, n,
+						       n < len ? MSG_MORE : 0);
+				break;
+			case AIOCB_RECV:
+				addr = kmap(page);
+				ret = socket_read(sock, addr + page_off, n);
+				flush_dcache_page(page);
+				kunmap(page);
+				break;
+			case AIOCB_ZERO:
+				zero_user(page, page_off, n);
+				break;
+			}
+			if (ret < 0)
+				return ret;
+			len -= n;
+			if (!len)
+				return 0;
+		}
+	}
+	return 0;
+}
+
+static int sheep_submit_sdreq(struct sbd_queue *q, struct sd_req *hdr,
 			      void *data, unsigned int wlen)
 {
 	int ret;
 
 	/* Make sheep_submit_sdreq thread safe */
-	mutex_lock(&socket_mutex);
+	mutex_lock(&q->sock_mutex);
 
-	ret = socket_write(sock, hdr, sizeof(*hdr));
+	ret = socket_write(q->sock, hdr, sizeof(*hdr));
 	if (ret < 0)
 		goto out;
 
 	if (wlen)
-		ret = socket_write(sock, data, wlen);
+		ret = socket_write(q->sock, data, wlen);
 out:
-	mutex_unlock(&socket_mutex);
+	mutex_unlock(&q->sock_mutex);
+	return ret;
+}
+
+/* Like sheep_submit_sdreq(), with the data in the pages of the aiocb */
+static int sheep_submit_sdreq_pages(struct sbd_queue *q, struct sd_req *hdr,
+				    struct sheep_request *req)
+{
+	int ret;
+
+	mutex_lock(&q->sock_mutex);
+
+	ret = socket_xmit(q->sock, hdr, sizeof(*hdr), true, MSG_MORE);
+	if (ret < 0)
+		goto out;
+
+	ret = sheep_aiocb_xmit(q->sock, req->aiocb, req->data_off,
+			       req->length, AIOCB_SEND);
+out:
+	mutex_unlock(&q->sock_mutex);
 	return ret;
 }
 
 /* Run the request synchronously */
-static int sheep_run_sdreq(struct socket *sock, struct sd_req *hdr,
+static int sheep_run_sdreq(struct sbd_queue *q, struct sd_req *hdr,
 			   void *data)
 {
 	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
@@ -166,13 +294,13 @@ static int sheep_run_sdreq(struct socket *sock, struct sd_req *hdr,
 		rlen = hdr->data_length;
 	}
 
-	ret = sheep_submit_sdreq(sock, hdr, data, wlen);
+	ret = sheep_submit_sdreq(q, hdr, data, wlen);
 	if (ret < 0) {
 		pr_err("failed to sbumit the request\n");
 		return ret;
 	}
 
-	ret = socket_read(sock, (char *)rsp, sizeof(*rsp));
+	ret = socket_read(q->sock, (char *)rsp, sizeof(*rsp));
 	if (ret < 0) {
 		pr_err("failed to read a response hdr\n");
 		return ret;
@@ -182,7 +310,7 @@ static int sheep_run_sdreq(struct socket *sock, struct sd_req *hdr,
 		rlen = rsp->data_length;
 
 	if (rlen) {
-		ret = socket_read(sock, data, rlen);
+		ret = socket_read(q->sock, data, rlen);
 		if (ret < 0) {
 			pr_err("failed to read the response data\n");
 			return ret;
@@ -211,7 +339,7 @@ static int lookup_sheep_vdi(struct sbd_device *dev)
 	hdr.opcode = SD_OP_LOCK_VDI;
 	hdr.data_length = SD_MAX_VDI_LEN;
 	hdr.flags = SD_FLAG_CMD_WRITE;
-	ret = sheep_run_sdreq(dev->sock, &hdr, dev->vdi.name);
+	ret = sheep_run_sdreq(&dev->queues[0], &hdr, dev->vdi.name);
 	if (ret < 0)
 		return ret;
 
@@ -220,20 +348,33 @@ static int lookup_sheep_vdi(struct sbd_device *dev)
 	return 0;
 }
 
+void sheep_shutdown_vdi(struct sbd_device *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->nr_queues; i++) {
+		socket_shutdown(dev->queues[i].sock);
+		dev->queues[i].sock = NULL;
+	}
+}
+
 int sheep_setup_vdi(struct sbd_device *dev)
 {
 	struct sd_req hdr = {};
 	struct sd_inode *inode;
-	int ret;
+	int ret, i;
 
 	inode = vmalloc(sizeof(*inode));
 	if (!inode)
 		return -ENOMEM;
 	memset(inode, 0 , sizeof(*inode));
 
-	ret = socket_create(&dev->sock, dev->vdi.ip, dev->vdi.port);
-	if (ret < 0)
-		goto out;
+	for (i = 0; i < dev->nr_queues; i++) {
+		ret = socket_create(&dev->queues[i].sock, dev->vdi.ip,
+				    dev->vdi.port);
+		if (ret < 0)
+			goto out_release;
+	}
 
 	ret = lookup_sheep_vdi(dev);
 	if (ret < 0) {
@@ -245,7 +386,7 @@ int sheep_setup_vdi(struct sbd_device *dev)
 	hdr.data_length = SD_INODE_SIZE;
 	hdr.obj.oid = vid_to_vdi_oid(dev->vdi.vid);
 	hdr.obj.offset = 0;
-	ret = sheep_run_sdreq(dev->sock, &hdr, inode);
+	ret = sheep_run_sdreq(&dev->queues[0], &hdr, inode);
 	if (ret < 0) {
 		pr_err("Cannot read inode for %s, %d\n", dev->vdi.name, ret);
 		goto out_release;
@@ -262,18 +403,29 @@ int sheep_setup_vdi(struct sbd_device *dev)
 	pr_info("%s: Associated to %s\n", DRV_NAME, inode->name);
 	return 0;
 out_release:
-	socket_shutdown(dev->sock);
-	dev->sock = NULL;
-out:
+	sheep_shutdown_vdi(dev);
 	vfree(inode);
 	return ret;
 }
 
+static inline struct list_head *inflight_seq_head(struct sbd_device *dev,
+						  u32 seq_num)
+{
+	return &dev->inflight_hash[hash_32(seq_num, SBD_HASH_BITS)];
+}
+
+static inline struct list_head *inflight_oid_head(struct sbd_device *dev,
+						  u64 oid)
+{
+	return &dev->oid_hash[hash_64(oid, SBD_HASH_BITS)];
+}
+
 /* FIXME: handle submit failure */
 static int submit_sheep_request(struct sheep_request *req)
 {
 	struct sd_req hdr = {};
 	struct sbd_device *dev = sheep_request_to_device(req);
+	struct sbd_queue *q = req->queue;
 	int ret = 0;
 
 	hdr.id = req->seq_num;
@@ -284,8 +436,10 @@ static int submit_sheep_request(struct sheep_request *req)
 
 	write_lock(&dev->inflight_lock);
 	BUG_ON(!list_empty(&req->list));
-	list_add_tail(&req->list, &dev->inflight_head);
+	list_add_tail(&req->list, inflight_seq_head(dev, req->seq_num));
+	list_add_tail(&req->oid_list, inflight_oid_head(dev, req->oid));
 	write_unlock(&dev->inflight_lock);
+	atomic_inc(&q->nr_inflight);
 
 	switch (req->type) {
 	case SHEEP_CREATE:
@@ -297,14 +451,17 @@ static int submit_sheep_request(struct sheep_request *req)
 		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_DIRECT;
 		if (req->cow_oid)
 			hdr.flags |= SD_FLAG_CMD_COW;
-		ret = sheep_submit_sdreq(dev->sock, &hdr, req->buf,
-					 req->length);
+		if (req->buf)
+			ret = sheep_submit_sdreq(q, &hdr, req->buf,
+						 req->length);
+		else
+			ret = sheep_submit_sdreq_pages(q, &hdr, req);
 		if (ret < 0)
 			goto err;
 		break;
 	case SHEEP_READ:
 		hdr.opcode = SD_OP_READ_OBJ;
-		ret = sheep_submit_sdreq(dev->sock, &hdr, NULL, 0);
+		ret = sheep_submit_sdreq(q, &hdr, NULL, 0);
 		if (ret < 0)
 			goto err;
 		break;
@@ -312,120 +469,55 @@ static int submit_sheep_request(struct sheep_request *req)
 	sbd_debug("add oid %llx off %d, len %d, seq %u, type %d\n", req->oid,
 		  req->offset, req->length, req->seq_num, req->type);
 err:
-	wake_up(&dev->reaper_wq);
+	wake_up(&q->reaper_wq);
 	return ret;
 }
 
-static inline void free_sheep_aiocb(struct sheep_aiocb *aiocb)
-{
-	vfree(aiocb->buf);
-	kmem_cache_free(sheep_aiocb_pool, aiocb);
-}
-
-static void aio_write_done(struct sheep_aiocb *aiocb)
-{
-	sbd_debug("wdone off %llu, len %llu\n", aiocb->offset, aiocb->length);
-
-	blk_end_request_all(aiocb->request, aiocb->ret);
-	free_sheep_aiocb(aiocb);
-}
-
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(3, 14, 0)
-
-# define DEFINE_BVEC(x) struct bio_vec *x
-# define BVEC_ADDR(x) x
-# define BVEC_FIELD(x, y) x->y
-
-#else
-
-# define DEFINE_BVEC(x) struct bio_vec x
-# define BVEC_ADDR(x) &x
-# define BVEC_FIELD(x, y) x.y
-
-#endif
-
-static void aio_read_done(struct sheep_aiocb *aiocb)
+static void sheep_aiocb_done(struct sheep_aiocb *aiocb)
 {
-	struct req_iterator iter;
-	DEFINE_BVEC(bvec);
-	struct request *req = aiocb->request;
-	int len = 0;
-
-	sbd_debug("rdone off %llu, len %llu\n", aiocb->offset, aiocb->length);
+	int i;
 
-	rq_for_each_segment(bvec, req, iter) {
-		unsigned long flags;
-		void *addr = bvec_kmap_irq(BVEC_ADDR(bvec), &flags);
+	sbd_debug("%s off %llu, len %llu, %d requests\n",
+		  aiocb->write ? "wdone" : "rdone", aiocb->offset,
+		  aiocb->length, aiocb->nr_rqs);
 
-		memcpy(addr, aiocb->buf + len, BVEC_FIELD(bvec, bv_len));
-		flush_dcache_page(BVEC_FIELD(bvec, bv_page));
-		bvec_kunmap_irq(addr, &flags);
-
-		len += BVEC_FIELD(bvec, bv_len);
-	}
-
-	blk_end_request_all(aiocb->request, aiocb->ret);
-	free_sheep_aiocb(aiocb);
+	for (i = 0; i < aiocb->nr_rqs; i++)
+		blk_end_request_all(aiocb->requests[i], aiocb->ret);
+	kmem_cache_free(sheep_aiocb_pool, aiocb);
 }
 
-struct sheep_aiocb *sheep_aiocb_setup(struct request *req)
+/* @reqs are adjacent block requests of the same direction */
+struct sheep_aiocb *sheep_aiocb_setup(struct request **reqs, int nr)
 {
 	struct sheep_aiocb *aiocb = kmem_cache_alloc(sheep_aiocb_pool,
 						     SBD_GFP_FLAGS);
-	struct req_iterator iter;
-	DEFINE_BVEC(bvec);
-	int len = 0;
+	int i;
 
 	if (!aiocb)
 		return ERR_PTR(-ENOMEM);
 
-	aiocb->offset = blk_rq_pos(req) * SECTOR_SIZE;
-	aiocb->length = blk_rq_bytes(req);
+	aiocb->offset = blk_rq_pos(reqs[0]) * SECTOR_SIZE;
+	aiocb->length = 0;
+	for (i = 0; i < nr; i++) {
+		aiocb->requests[i] = reqs[i];
+		aiocb->length += blk_rq_bytes(reqs[i]);
+	}
+	aiocb->nr_rqs = nr;
+	aiocb->write = rq_data_dir(reqs[0]) == WRITE;
 	aiocb->ret = 0;
 	aiocb->buf_iter = 0;
-	aiocb->request = req;
-	aiocb->buf = vzalloc(aiocb->length);
 	atomic_set(&aiocb->nr_requests, 0);
 
-	if (!aiocb->buf) {
-		kmem_cache_free(sheep_aiocb_pool, aiocb);
-		return ERR_PTR(-ENOMEM);
-	}
-
-	switch (rq_data_dir(req)) {
-	case WRITE:
-		rq_for_each_segment(bvec, req, iter) {
-			unsigned long flags;
-			void *addr = bvec_kmap_irq(BVEC_ADDR(bvec), &flags);
-
-			memcpy(aiocb->buf + len, addr,
-			       BVEC_FIELD(bvec, bv_len));
-			flush_dcache_page(BVEC_FIELD(bvec, bv_page));
-			bvec_kunmap_irq(addr, &flags);
-
-			len += BVEC_FIELD(bvec, bv_len);
-		}
-		aiocb->aio_done_func = aio_write_done;
-		break;
-	case READ:
-		aiocb->aio_done_func = aio_read_done;
-		break;
-	default:
-		/* impossible case */
-		WARN_ON(1);
-		free_sheep_aiocb(aiocb);
-		return ERR_PTR(-EINVAL);
-	}
-
 	return aiocb;
 }
 
 static inline bool aiocb_is_write(struct sheep_aiocb *aiocb)
 {
-	return aiocb->aio_done_func == aio_write_done;
+	return aiocb->write;
 }
 
-static struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
+static struct sheep_request *alloc_sheep_request(struct sbd_queue *q,
+						 struct sheep_aiocb *aiocb,
 						 u64 oid, u64 cow_oid, int len,
 						 int offset)
 {
@@ -441,9 +533,12 @@ static struct sheep_request *alloc_sheep_request(struct sheep_aiocb *aiocb,
 	req->oid = oid;
 	req->cow_oid = cow_oid;
 	req->aiocb = aiocb;
-	req->buf = aiocb->buf + aiocb->buf_iter;
+	req->queue = q;
+	req->buf = NULL;
+	req->data_off = aiocb->buf_iter;
 	req->seq_num = atomic_inc_return(&dev->seq_num);
 	INIT_LIST_HEAD(&req->list);
+	INIT_LIST_HEAD(&req->oid_list);
 	if (aiocb_is_write(aiocb))
 		req->type = SHEEP_WRITE;
 	else
@@ -463,7 +558,7 @@ static void end_sheep_request(struct sheep_request *req)
 		  req->offset, req->length, req->seq_num);
 
 	if (atomic_dec_return(&aiocb->nr_requests) <= 0)
-		aiocb->aio_done_func(aiocb);
+		sheep_aiocb_done(aiocb);
 	BUG_ON(!list_empty(&req->list));
 	kmem_cache_free(sheep_request_pool, req);
 }
@@ -474,7 +569,7 @@ static struct sheep_request *find_inflight_request_oid(struct sbd_device *dev,
 	struct sheep_request *req;
 
 	read_lock(&dev->inflight_lock);
-	list_for_each_entry(req, &dev->inflight_head, list) {
+	list_for_each_entry(req, inflight_oid_head(dev, oid), oid_list) {
 		if (req->oid == oid) {
 			read_unlock(&dev->inflight_lock);
 			return req;
@@ -495,7 +590,7 @@ static uint32_t sheep_inode_get_idx(struct sbd_device *dev, u32 idx)
 	return vid;
 }
 
-int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
+int sheep_aiocb_submit(struct sbd_queue *q, struct sheep_aiocb *aiocb)
 {
 	struct sbd_device *dev = sheep_aiocb_to_device(aiocb);
 	u64 offset = aiocb->offset;
@@ -531,7 +626,7 @@ int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
 				oid = vid_to_data_oid(vid, idx);
 		}
 
-		req = alloc_sheep_request(aiocb, oid, cow_oid, len, start);
+		req = alloc_sheep_request(q, aiocb, oid, cow_oid, len, start);
 		if (IS_ERR(req))
 			return PTR_ERR(req);
 
@@ -543,8 +638,10 @@ int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
 			/*
 			 * Sheepdog can't handle concurrent creation on the same
 			 * object. We send one create req first and then send
-			 * write reqs in next.
+			 * write reqs in next. create_mutex makes the check and
+			 * the submission atomic against the other submiters.
 			 */
+			mutex_lock(&dev->create_mutex);
 			if (find_inflight_request_oid(dev, oid)) {
 				uint32_t tmp_vid;
 
@@ -557,6 +654,7 @@ int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
 				if (unlikely(tmp_vid && tmp_vid ==
 					     dev->vdi.vid)) {
 					write_unlock(&dev->blocking_lock);
+					mutex_unlock(&dev->create_mutex);
 					goto submit;
 				}
 				list_add_tail(&req->list, &dev->blocking_head);
@@ -564,11 +662,17 @@ int sheep_aiocb_submit(struct sheep_aiocb *aiocb)
 					  " seq %u\n", req->oid, req->offset,
 					  req->length, req->seq_num);
 				write_unlock(&dev->blocking_lock);
+				mutex_unlock(&dev->create_mutex);
 				goto done;
 			}
 			req->type = SHEEP_CREATE;
-			break;
+			submit_sheep_request(req);
+			mutex_unlock(&dev->create_mutex);
+			goto done;
 		case SHEEP_READ:
+			/* a hole reads as zeros */
+			sheep_aiocb_xmit(NULL, aiocb, req->data_off,
+					 req->length, AIOCB_ZERO);
 			end_sheep_request(req);
 			goto done;
 		}
@@ -582,20 +686,28 @@ done:
 	} while (total > 0);
 
 	if (atomic_dec_return(&aiocb->nr_requests) <= 0)
-		aiocb->aio_done_func(aiocb);
+		sheep_aiocb_done(aiocb);
 
 	return 0;
 }
 
+/* Caller must hold inflight_lock */
+static void __del_inflight_request(struct sheep_request *req)
+{
+	list_del_init(&req->list);
+	list_del_init(&req->oid_list);
+	atomic_dec(&req->queue->nr_inflight);
+}
+
 static struct sheep_request *fetch_inflight_request(struct sbd_device *dev,
 						    u32 seq_num)
 {
-	struct sheep_request *req, *t;
+	struct sheep_request *req;
 
 	write_lock(&dev->inflight_lock);
-	list_for_each_entry_safe(req, t, &dev->inflight_head, list) {
+	list_for_each_entry(req, inflight_seq_head(dev, seq_num), list) {
 		if (req->seq_num == seq_num) {
-			list_del_init(&req->list);
+			__del_inflight_request(req);
 			goto out;
 		}
 	}
@@ -605,18 +717,24 @@ out:
 	return req;
 }
 
-static struct sheep_request *fetch_first_inflight_request(
-	struct sbd_device *dev)
+/* Fetch any inflight request sent on @q, used when its socket is broken */
+static struct sheep_request *fetch_first_inflight_request(struct sbd_queue *q)
 {
+	struct sbd_device *dev = q->dev;
 	struct sheep_request *req;
+	int i;
 
 	write_lock(&dev->inflight_lock);
-	if (!list_empty(&dev->inflight_head)) {
-		req = list_first_entry(&dev->inflight_head,
-			struct sheep_request, list);
-		list_del_init(&req->list);
-	} else
-		req = NULL;
+	for (i = 0; i < SBD_HASH_SIZE; i++) {
+		list_for_each_entry(req, &dev->inflight_hash[i], list) {
+			if (req->queue == q) {
+				__del_inflight_request(req);
+				goto out;
+			}
+		}
+	}
+	req = NULL;
+out:
 	write_unlock(&dev->inflight_lock);
 	return req;
 }
@@ -636,18 +754,19 @@ static void submit_blocking_sheep_request(struct sbd_device *dev, uint64_t oid)
 }
 
 /* FIXME: add auto-reconnect support */
-int sheep_handle_reply(struct sbd_device *dev)
+int sheep_handle_reply(struct sbd_queue *q)
 {
+	struct sbd_device *dev = q->dev;
 	struct sd_rsp rsp = {};
 	struct sheep_request *req, *new;
 	uint32_t vid, idx;
 	uint64_t oid;
 	int ret;
 
-	ret = socket_read(dev->sock, (char *)&rsp, sizeof(rsp));
+	ret = socket_read(q->sock, (char *)&rsp, sizeof(rsp));
 	if (ret < 0) {
 		pr_err("failed to read reply header %d\n", ret);
-		req = fetch_first_inflight_request(dev);
+		req = fetch_first_inflight_request(q);
 		if (req != NULL) {
 			req->aiocb->ret = EIO;
 			goto end_request;
@@ -661,7 +780,12 @@ int sheep_handle_reply(struct sbd_device *dev)
 		return 0;
 	}
 	if (rsp.data_length > 0) {
-		ret = socket_read(dev->sock, req->buf, req->length);
+		if (req->buf)
+			ret = socket_read(q->sock, req->buf, req->length);
+		else
+			ret = sheep_aiocb_xmit(q->sock, req->aiocb,
+					       req->data_off, req->length,
+					       AIOCB_RECV);
 		if (ret < 0) {
 			pr_err("failed to read reply payload %d\n", ret);
 			req->aiocb->ret = EIO;
@@ -687,11 +811,14 @@ int sheep_handle_reply(struct sbd_device *dev)
 		new->oid = oid;
 		new->cow_oid = 0;
 		new->aiocb = req->aiocb;
+		new->queue = req->queue;
 		new->buf = (char *)&vid;
+		new->data_off = 0;
 		new->seq_num = atomic_inc_return(&dev->seq_num);
 		new->type = SHEEP_WRITE;
 		atomic_inc(&req->aiocb->nr_requests);
 		INIT_LIST_HEAD(&new->list);
+		INIT_LIST_HEAD(&new->oid_list);
 
 		/* Make sure no request is queued while we update inode */
 		spin_lock(&dev->vdi_lock);
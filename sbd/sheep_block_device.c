@@ -52,18 +52,23 @@ static DEFINE_MUTEX(dev_list_mutex);
 
 static int sbd_major;
 
+static unsigned int nr_queues = 4;
+module_param(nr_queues, uint, 0444);
+MODULE_PARM_DESC(nr_queues, "Number of connections per device (default 4)");
+
 static const struct block_device_operations sbd_bd_ops = {
 	.owner		= THIS_MODULE,
 };
 
-static int sbd_submit_request(struct request *req)
+static int sbd_submit_request(struct sbd_queue *q, struct request **reqs,
+			      int nr)
 {
-	struct sheep_aiocb *aiocb = sheep_aiocb_setup(req);
+	struct sheep_aiocb *aiocb = sheep_aiocb_setup(reqs, nr);
 
 	if (IS_ERR(aiocb))
 		return PTR_ERR(aiocb);
 
-	return sheep_aiocb_submit(aiocb);
+	return sheep_aiocb_submit(q, aiocb);
 }
 
 static void sbd_request_fn(struct request_queue *q)
@@ -128,37 +133,52 @@ static int sbd_add_disk(struct sbd_device *dev)
 
 static int sbd_request_reaper(void *data)
 {
-	struct sbd_device *dev = data;
+	struct sbd_queue *q = data;
 	int ret;
 
-	while (!kthread_should_stop() || !list_empty(&dev->inflight_head)) {
-		bool empty;
-
-		wait_event_interruptible(dev->reaper_wq,
+	while (!kthread_should_stop() || atomic_read(&q->nr_inflight)) {
+		wait_event_interruptible(q->reaper_wq,
 					 kthread_should_stop() ||
-					 !list_empty(&dev->inflight_head));
-
-		read_lock(&dev->inflight_lock);
-		empty = list_empty(&dev->inflight_head);
-		read_unlock(&dev->inflight_lock);
+					 atomic_read(&q->nr_inflight));
 
-		if (unlikely(empty))
+		if (unlikely(!atomic_read(&q->nr_inflight)))
 			continue;
 
-		ret = sheep_handle_reply(dev);
+		ret = sheep_handle_reply(q);
 		if (unlikely(ret < 0))
 			pr_err("reaper: failed to handle reply\n");
 	}
 	return 0;
 }
 
+/*
+ * Whether @next goes on right after @prev within an object, in which case
+ * merging them saves a sheep request for the object.
+ */
+static bool sbd_can_merge(struct request *prev, struct request *next)
+{
+	u64 end = (blk_rq_pos(prev) + blk_rq_sectors(prev)) * SECTOR_SIZE;
+
+	return rq_data_dir(prev) == rq_data_dir(next) &&
+	       blk_rq_pos(next) * SECTOR_SIZE == end &&
+	       end % SD_DATA_OBJ_SIZE != 0;
+}
+
+/*
+ * All the submiters of a device pull from the same request list, each sends
+ * the requests it picks on its own queue's socket.  The requests which go on
+ * right after the picked one are taken along, so that the pieces of an
+ * object are sent as one sheep request.
+ */
 static int sbd_request_submiter(void *data)
 {
-	struct sbd_device *dev = data;
-	int ret;
+	struct sbd_queue *q = data;
+	struct sbd_device *dev = q->dev;
+	struct request *reqs[SBD_MAX_MERGE];
+	int ret, nr;
 
 	while (!kthread_should_stop() || !list_empty(&dev->request_head)) {
-		struct request *req;
+		struct request *req, *next;
 
 		wait_event_interruptible(dev->submiter_wq,
 					 kthread_should_stop() ||
@@ -171,18 +191,72 @@ static int sbd_request_submiter(void *data)
 		}
 		req = list_entry_rq(dev->request_head.next);
 		list_del_init(&req->queuelist);
+		reqs[0] = req;
+		nr = 1;
+		while (nr < SBD_MAX_MERGE && !list_empty(&dev->request_head)) {
+			next = list_entry_rq(dev->request_head.next);
+			if (!sbd_can_merge(reqs[nr - 1], next))
+				break;
+			list_del_init(&next->queuelist);
+			reqs[nr++] = next;
+		}
 		spin_unlock_irq(&dev->queue_lock);
 
-		ret = sbd_submit_request(req);
+		ret = sbd_submit_request(q, reqs, nr);
 		if (unlikely(ret < 0))
 			pr_err("submiter: failed to submit request\n");
 	}
 	return 0;
 }
 
+static int sbd_start_kthreads(struct sbd_device *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->nr_queues; i++) {
+		struct sbd_queue *q = &dev->queues[i];
+		struct task_struct *t;
+
+		t = kthread_run(sbd_request_reaper, q, "sbd%d_reaper/%d",
+				dev->id, i);
+		if (IS_ERR(t))
+			return PTR_ERR(t);
+		q->reaper = t;
+		q->reaper->flags |= PF_MEMALLOC;
+
+		t = kthread_run(sbd_request_submiter, q, "sbd%d_submiter/%d",
+				dev->id, i);
+		if (IS_ERR(t))
+			return PTR_ERR(t);
+		q->submiter = t;
+		q->submiter->flags |= PF_MEMALLOC;
+	}
+	return 0;
+}
+
+/* Stop submiters first so that reapers can drain the inflight requests */
+static void sbd_stop_kthreads(struct sbd_device *dev)
+{
+	int i;
+
+	for (i = 0; i < dev->nr_queues; i++) {
+		if (dev->queues[i].submiter)
+			kthread_stop(dev->queues[i].submiter);
+		dev->queues[i].submiter = NULL;
+	}
+	wake_up(&dev->submiter_wq);
+
+	for (i = 0; i < dev->nr_queues; i++) {
+		if (dev->queues[i].reaper)
+			kthread_stop(dev->queues[i].reaper);
+		dev->queues[i].reaper = NULL;
+		wake_up(&dev->queues[i].reaper_wq);
+	}
+}
+
 static inline void free_sbd_device(struct sbd_device *dev)
 {
-	socket_shutdown(dev->sock);
+	sheep_shutdown_vdi(dev);
 	vfree(dev->vdi.inode);
 	kfree(dev);
 }
@@ -192,7 +266,7 @@ static ssize_t sbd_add(struct bus_type *bus, const char *buf,
 {
 	struct sbd_device *dev, *tmp;
 	ssize_t ret;
-	int new_id = 0;
+	int new_id = 0, i;
 	char name[DEV_NAME_LEN];
 
 	if (!try_module_get(THIS_MODULE))
@@ -212,14 +286,27 @@ static ssize_t sbd_add(struct bus_type *bus, const char *buf,
 
 	spin_lock_init(&dev->queue_lock);
 	spin_lock_init(&dev->vdi_lock);
-	INIT_LIST_HEAD(&dev->inflight_head);
+	for (i = 0; i < SBD_HASH_SIZE; i++) {
+		INIT_LIST_HEAD(&dev->inflight_hash[i]);
+		INIT_LIST_HEAD(&dev->oid_hash[i]);
+	}
 	INIT_LIST_HEAD(&dev->blocking_head);
 	INIT_LIST_HEAD(&dev->request_head);
-	init_waitqueue_head(&dev->reaper_wq);
 	init_waitqueue_head(&dev->submiter_wq);
+	mutex_init(&dev->create_mutex);
 	rwlock_init(&dev->inflight_lock);
 	rwlock_init(&dev->blocking_lock);
 
+	dev->nr_queues = clamp_t(unsigned int, nr_queues, 1, SBD_MAX_QUEUES);
+	for (i = 0; i < dev->nr_queues; i++) {
+		struct sbd_queue *q = &dev->queues[i];
+
+		q->dev = dev;
+		mutex_init(&q->sock_mutex);
+		atomic_set(&q->nr_inflight, 0);
+		init_waitqueue_head(&q->reaper_wq);
+	}
+
 	mutex_lock(&dev_list_mutex);
 	list_for_each_entry(tmp, &sbd_dev_list, list) {
 		if (tmp->id >= new_id)
@@ -235,14 +322,9 @@ static ssize_t sbd_add(struct bus_type *bus, const char *buf,
 	snprintf(name, DEV_NAME_LEN, DRV_NAME "%d", dev->id);
 	dev->major = sbd_major;
 	dev->minor = sbd_dev_id_to_minor(dev->id);
-	dev->reaper = kthread_run(sbd_request_reaper, dev, "sbd_reaper");
-	if (IS_ERR(dev->reaper))
-		goto err_free_dev;
-	dev->submiter = kthread_run(sbd_request_submiter, dev, "sbd_submiter");
-	if (IS_ERR(dev->submiter))
-		goto err_stop_reaper;
-	dev->reaper->flags |= PF_MEMALLOC;
-	dev->submiter->flags |= PF_MEMALLOC;
+	ret = sbd_start_kthreads(dev);
+	if (ret < 0)
+		goto err_stop_kthreads;
 
 	ret = sbd_add_disk(dev);
 	if (ret < 0)
@@ -254,11 +336,7 @@ static ssize_t sbd_add(struct bus_type *bus, const char *buf,
 
 	return count;
 err_stop_kthreads:
-	kthread_stop(dev->submiter);
-	wake_up(&dev->submiter_wq);
-err_stop_reaper:
-	kthread_stop(dev->reaper);
-	wake_up(&dev->reaper_wq);
+	sbd_stop_kthreads(dev);
 err_free_dev:
 	free_sbd_device(dev);
 err_put:
@@ -314,10 +392,7 @@ static ssize_t sbd_remove(struct bus_type *bus, const char *buf,
 	if (!dev)
 		return -ENOENT;
 
-	kthread_stop(dev->reaper);
-	kthread_stop(dev->submiter);
-	wake_up(&dev->reaper_wq);
-	wake_up(&dev->submiter_wq);
+	sbd_stop_kthreads(dev);
 
 	sbd_del_disk(dev);
 	free_sbd_device(dev);
@@ -0,0 +1,644 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Node-local verification of the replicated objects
+ *
+ * 'dog cluster check -D' sends SD_OP_CHECK_OBJECTS to all the nodes at once
+ * instead of comparing every replica of the cluster itself.  Each sheep
+ * checks the objects of its object list for which it is the first holder in
+ * the replica set: usually it is the primary, and otherwise it asks the
+ * earlier nodes of the set with one SD_OP_OIDS_EXIST per node whether they
+ * lack the object.  The SHA1 of its replica is compared with those of the
+ * peers, fetched by SD_OP_GET_HASHES per CHECK_BATCH objects, and the replicas
+ * which are missing or differ from the majority are repaired from a majority
+ * holder.  Every object is thus checked by one node, and the time of a check
+ * scales with the size of the cluster.
+ *
+ * The erasure coded objects are skipped, 'dog vdi check' handles them.
+ */
+
+#include "sheep_priv.h"
+
+#define CHECK_BATCH 512
+#define CHECK_EXIST_BATCH 4096
+
+struct check_node {
+	const struct sd_node *node;
+	struct sd_obj_hash *hashes;
+	uint64_t *oids;
+	int nr;
+	int end;
+};
+
+/* a replica of the object being checked, hashes[idx] of the node */
+struct check_replica {
+	struct check_node *cn;
+	int idx;
+};
+
+/* an object whose earlier holders, if any, are asked for it */
+struct check_candidate {
+	uint64_t oid;
+	int nr_lower;
+	int nr_missing;
+};
+
+struct check_info {
+	struct vnode_info *vinfo;
+	uint32_t epoch;
+	struct check_node *nodes;
+	int nr_nodes;
+	struct check_replica (*replicas)[SD_MAX_COPIES];
+	uint64_t nr_checked;
+	uint32_t nr_repaired;
+	uint32_t nr_failed;
+};
+
+static int check_node_cmp(const struct check_node *a,
+			  const struct check_node *b)
+{
+	return node_cmp(a->node, b->node);
+}
+
+static int check_candidate_cmp(const struct check_candidate *a,
+			       const struct check_candidate *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+static struct check_node *find_check_node(struct check_info *ci,
+					  const struct sd_node *node)
+{
+	struct check_node key = { .node = node };
+
+	return xbsearch(&key, ci->nodes, ci->nr_nodes, check_node_cmp);
+}
+
+static void check_node_add_oid(struct check_node *cn, uint64_t oid)
+{
+	if (cn->nr >= cn->end) {
+		cn->end = max(cn->end * 2, CHECK_EXIST_BATCH);
+		cn->oids = xrealloc(cn->oids, sizeof(uint64_t) * cn->end);
+	}
+	cn->oids[cn->nr++] = oid;
+}
+
+/* Copy the object from 'src' to this node */
+int repair_replica_from(const struct node_id *src, uint64_t oid,
+			uint32_t epoch)
+{
+	int ret;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct siocb iocb = { 0 };
+	size_t rlen = get_store_objsize(oid);
+	void *buf = xvalloc(rlen);
+
+	sd_init_req(&hdr, SD_OP_READ_PEER);
+	hdr.epoch = epoch;
+	hdr.data_length = rlen;
+	hdr.obj.oid = oid;
+
+	ret = sheep_exec_req(src, &hdr, buf);
+	if (ret == SD_RES_SUCCESS) {
+		sd_debug("read object %016"PRIx64" from %s successfully, "
+				"try saving to local", oid,
+				addr_to_str(src->addr, src->port));
+		iocb.epoch = epoch;
+		iocb.length = rsp->data_length;
+		iocb.offset = rsp->obj.offset;
+		iocb.buf = buf;
+		ret = sd_store->create_and_write(oid, &iocb);
+		if (ret != SD_RES_SUCCESS)
+			sd_err("failed to write object %016"PRIx64
+					" to local", oid);
+	} else {
+		sd_err("failed to read object %016"PRIx64
+				" from %s: %s", oid,
+				addr_to_str(src->addr, src->port),
+				sd_strerror(ret));
+	}
+
+	free(buf);
+	return ret;
+}
+
+static int repair_replica(struct check_info *ci, uint64_t oid,
+			  const struct sd_node *src, const struct sd_node *dst)
+{
+	struct sd_req hdr;
+
+	if (node_is_local(dst))
+		return repair_replica_from(&src->nid, oid, ci->epoch);
+
+	sd_init_req(&hdr, SD_OP_REPAIR_REPLICA);
+	hdr.epoch = ci->epoch;
+	memcpy(hdr.forw.addr, src->nid.addr, sizeof(hdr.forw.addr));
+	hdr.forw.port = src->nid.port;
+	hdr.forw.oid = oid;
+
+	return sheep_exec_req(&dst->nid, &hdr, NULL);
+}
+
+static void fetch_hashes(struct check_info *ci, struct check_node *cn)
+{
+	struct sd_req hdr;
+	int ret;
+
+	if (node_is_local(cn->node)) {
+		for (int i = 0; i < cn->nr; i++)
+			cn->hashes[i].result =
+				sd_store->get_hash(cn->hashes[i].oid,
+						   ci->epoch,
+						   cn->hashes[i].digest);
+		return;
+	}
+
+	sd_init_req(&hdr, SD_OP_GET_HASHES);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.epoch = ci->epoch;
+	hdr.data_length = sizeof(cn->hashes[0]) * cn->nr;
+	hdr.obj.tgt_epoch = ci->epoch;
+
+	ret = sheep_exec_req(&cn->node->nid, &hdr, cn->hashes);
+	if (ret == SD_RES_SUCCESS)
+		return;
+
+	for (int i = 0; i < cn->nr; i++)
+		cn->hashes[i].result = ret;
+}
+
+static void check_one(struct check_info *ci, uint64_t oid,
+		      struct check_replica *replicas)
+{
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	int copies = get_obj_copy_number(oid, ci->vinfo->nr_zones);
+	int votes[SD_MAX_COPIES] = {}, majority = -1;
+	struct sd_obj_hash *h[SD_MAX_COPIES];
+
+	vinfo_oid_to_nodes(ci->vinfo, oid, copies, nodes);
+	for (int i = 0; i < copies; i++)
+		h[i] = replicas[i].cn->hashes + replicas[i].idx;
+
+	for (int i = 0; i < copies; i++) {
+		if (h[i]->result != SD_RES_SUCCESS)
+			continue;
+		for (int j = 0; j < copies; j++)
+			if (h[j]->result == SD_RES_SUCCESS &&
+			    memcmp(h[i]->digest, h[j]->digest,
+				   sizeof(h[i]->digest)) == 0)
+				votes[i]++;
+		if (majority < 0 || votes[i] > votes[majority])
+			majority = i;
+	}
+
+	ci->nr_checked++;
+	if (majority < 0) {
+		sd_err("no replica of %016"PRIx64" is available", oid);
+		ci->nr_failed++;
+		return;
+	}
+
+	for (int i = 0; i < copies; i++) {
+		if (h[i]->result == SD_RES_SUCCESS &&
+		    memcmp(h[i]->digest, h[majority]->digest,
+			   sizeof(h[i]->digest)) == 0)
+			continue;
+
+		sd_info("repair %016"PRIx64" of %s", oid,
+			node_to_str(nodes[i]));
+		if (repair_replica(ci, oid, nodes[majority], nodes[i]) ==
+		    SD_RES_SUCCESS)
+			ci->nr_repaired++;
+		else
+			ci->nr_failed++;
+	}
+}
+
+/* Compare the replicas of up to CHECK_BATCH objects */
+static void check_batch(struct check_info *ci, const uint64_t *oids, int nr)
+{
+	const struct sd_node *nodes[SD_MAX_COPIES];
+
+	for (int i = 0; i < ci->nr_nodes; i++)
+		ci->nodes[i].nr = 0;
+
+	for (int i = 0; i < nr; i++) {
+		int copies = get_obj_copy_number(oids[i], ci->vinfo->nr_zones);
+
+		vinfo_oid_to_nodes(ci->vinfo, oids[i], copies, nodes);
+		for (int j = 0; j < copies; j++) {
+			struct check_node *cn = find_check_node(ci, nodes[j]);
+
+			cn->hashes[cn->nr].oid = oids[i];
+			ci->replicas[i][j].cn = cn;
+			ci->replicas[i][j].idx = cn->nr++;
+		}
+	}
+
+	for (int i = 0; i < ci->nr_nodes; i++)
+		if (ci->nodes[i].nr)
+			fetch_hashes(ci, ci->nodes + i);
+
+	for (int i = 0; i < nr; i++)
+		check_one(ci, oids[i], ci->replicas[i]);
+}
+
+/* Ask each node which of its oids it lacks, and count them in 'cands' */
+static void query_earlier_holders(struct check_info *ci,
+				  struct check_candidate *cands, int nr_cands)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint64_t *buf = xmalloc(sizeof(uint64_t) * CHECK_EXIST_BATCH);
+
+	for (int i = 0; i < ci->nr_nodes; i++) {
+		struct check_node *cn = ci->nodes + i;
+
+		for (int j = 0; j < cn->nr; j += CHECK_EXIST_BATCH) {
+			int n = min(cn->nr - j, CHECK_EXIST_BATCH), ret;
+
+			memcpy(buf, cn->oids + j, sizeof(uint64_t) * n);
+			sd_init_req(&hdr, SD_OP_OIDS_EXIST);
+			hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+			hdr.epoch = ci->epoch;
+			hdr.data_length = sizeof(uint64_t) * n;
+
+			ret = sheep_exec_req(&cn->node->nid, &hdr, buf);
+			if (ret == SD_RES_SUCCESS)
+				continue;
+			if (ret != SD_RES_NO_OBJ) {
+				/* treat the node as lacking all of them */
+				memcpy(buf, cn->oids + j, sizeof(uint64_t) * n);
+			} else
+				n = rsp->data_length / sizeof(uint64_t);
+
+			for (int k = 0; k < n; k++) {
+				struct check_candidate key = { .oid = buf[k] };
+				struct check_candidate *c;
+
+				c = xbsearch(&key, cands, nr_cands,
+					     check_candidate_cmp);
+				if (c)
+					c->nr_missing++;
+			}
+		}
+		cn->nr = 0;
+	}
+	free(buf);
+}
+
+static uint64_t *get_local_oids(int *nr)
+{
+	struct sd_req hdr;
+	struct sd_rsp rsp;
+	size_t len = SD_DATA_OBJ_SIZE;
+	uint64_t *oids = NULL;
+	int ret;
+
+	do {
+		len *= 2;
+		oids = xrealloc(oids, len);
+		sd_init_req(&hdr, SD_OP_GET_OBJ_LIST);
+		hdr.data_length = len;
+		ret = get_obj_list(&hdr, &rsp, oids);
+	} while (ret == SD_RES_BUFFER_SMALL);
+
+	if (ret != SD_RES_SUCCESS) {
+		free(oids);
+		return NULL;
+	}
+
+	*nr = rsp.data_length / sizeof(uint64_t);
+	return oids;
+}
+
+static void check_info_init(struct check_info *ci, struct vnode_info *vinfo,
+			    uint32_t epoch)
+{
+	struct sd_node *n;
+	int i = 0;
+
+	memset(ci, 0, sizeof(*ci));
+	ci->vinfo = vinfo;
+	ci->epoch = epoch;
+	ci->nodes = xzalloc(sizeof(*ci->nodes) * vinfo->nr_nodes);
+	rb_for_each_entry(n, &vinfo->nroot, rb) {
+		ci->nodes[i].node = n;
+		ci->nodes[i].hashes = xmalloc(sizeof(struct sd_obj_hash) *
+					      CHECK_BATCH);
+		i++;
+	}
+	ci->nr_nodes = i;
+	ci->replicas = xmalloc(sizeof(*ci->replicas) * CHECK_BATCH);
+}
+
+static void check_info_release(struct check_info *ci)
+{
+	for (int i = 0; i < ci->nr_nodes; i++) {
+		free(ci->nodes[i].hashes);
+		free(ci->nodes[i].oids);
+	}
+	free(ci->nodes);
+	free(ci->replicas);
+}
+
+int check_local_objects(struct request *req)
+{
+	struct check_info ci;
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	struct check_candidate *cands;
+	uint64_t *oids;
+	int nr_oids, nr_mine = 0, nr_cands = 0, i;
+
+	/* the check is a scrub, which yields the disks to the rest */
+	set_io_class(IO_CLASS_BACKGROUND);
+
+	if (node_in_recovery())
+		return SD_RES_NODE_IN_RECOVERY;
+
+	oids = get_local_oids(&nr_oids);
+	if (!oids)
+		return SD_RES_NO_MEM;
+
+	check_info_init(&ci, req->vinfo, req->rq.epoch);
+	cands = xmalloc(sizeof(*cands) * max(nr_oids, 1));
+
+	/* the oids this node is the primary of are moved to the front */
+	for (i = 0; i < nr_oids; i++) {
+		uint64_t oid = oids[i];
+		int copies, idx;
+
+		if (get_vdi_copy_policy(oid_to_vid(oid)))
+			continue;
+
+		copies = get_obj_copy_number(oid, ci.vinfo->nr_zones);
+		vinfo_oid_to_nodes(ci.vinfo, oid, copies, nodes);
+		for (idx = 0; idx < copies; idx++)
+			if (node_is_local(nodes[idx]))
+				break;
+		if (idx == copies)
+			continue;
+		if (idx == 0) {
+			oids[nr_mine++] = oid;
+			continue;
+		}
+
+		cands[nr_cands].oid = oid;
+		cands[nr_cands].nr_lower = idx;
+		cands[nr_cands].nr_missing = 0;
+		nr_cands++;
+		for (int j = 0; j < idx; j++)
+			check_node_add_oid(find_check_node(&ci, nodes[j]), oid);
+	}
+
+	xqsort(cands, nr_cands, check_candidate_cmp);
+	query_earlier_holders(&ci, cands, nr_cands);
+	for (i = 0; i < nr_cands; i++)
+		if (cands[i].nr_missing == cands[i].nr_lower)
+			oids[nr_mine++] = cands[i].oid;
+
+	sd_info("checking %d objects", nr_mine);
+	for (i = 0; i < nr_mine; i += CHECK_BATCH)
+		check_batch(&ci, oids + i, min(nr_mine - i, CHECK_BATCH));
+
+	sd_info("checked %"PRIu64" objects, repaired %"PRIu32" replicas, "
+		"%"PRIu32" failures", ci.nr_checked, ci.nr_repaired,
+		ci.nr_failed);
+	req->rp.check.nr_checked = ci.nr_checked;
+	req->rp.check.nr_repaired = ci.nr_repaired;
+	req->rp.check.nr_failed = ci.nr_failed;
+
+	check_info_release(&ci);
+	free(cands);
+	free(oids);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Background scrubbing
+ *
+ * With '-s', a low priority work walks the object list of this sheep
+ * SCRUB_BATCH objects at a time.  Each object is read in full, which makes
+ * the store verify the checksums of its blocks, and the SHA1 of a read-only
+ * object is compared with the digest cached in its xattr, which is what the
+ * peers are asked for.  A local replica which fails either is repaired from
+ * another holder.  The objects this node is the primary of are then checked
+ * against their replicas like SD_OP_CHECK_OBJECTS does.
+ *
+ * The batches are paced to 'bandwidth' bytes of reads per second, and spaced
+ * out further while the clients keep this sheep busy.  A pass starts
+ * 'interval' seconds after the previous one ended, and none runs during the
+ * recovery.
+ */
+
+#define SCRUB_BATCH 64
+/* requests per second above which the clients are considered busy */
+#define SCRUB_BUSY_RATE 100
+#define SCRUB_BUSY_DELAY 1000	/* ms */
+#define SCRUB_RETRY 10		/* sec */
+
+static struct work_queue *scrub_wq;
+static struct work scrub_work;
+static struct timer scrub_timer;
+static uint64_t scrub_bandwidth;
+static uint32_t scrub_interval;
+
+static struct {
+	struct vnode_info *vinfo;
+	uint32_t epoch;
+	uint64_t *oids;
+	int nr_oids;
+	int pos;
+	uint64_t bytes;		/* read by the current batch */
+	uint64_t start;		/* of the current batch */
+	uint64_t nr_reqs;	/* of the clients at its start */
+	uint64_t nr_scrubbed;
+	uint32_t nr_repaired;
+	uint32_t nr_failed;
+} scrub;
+
+static main_fn uint64_t nr_client_requests(void)
+{
+	return sys->stat.r.gway_total_nr + sys->stat.r.peer_total_nr;
+}
+
+/*
+ * Read the local replica of oid in full.  Returns false if it's corrupted,
+ * true otherwise, including when it's gone.
+ */
+static worker_fn bool scrub_verify(uint64_t oid, uint32_t epoch)
+{
+	uint8_t sha1[SHA1_DIGEST_SIZE], cached[SHA1_DIGEST_SIZE];
+	struct siocb iocb = {
+		.epoch = epoch,
+		.length = get_store_objsize(oid),
+	};
+	int ret;
+
+	iocb.buf = xvalloc(iocb.length);
+	ret = sd_store->read(oid, &iocb);
+	if (ret == SD_RES_SUCCESS)
+		scrub.bytes += iocb.length;
+
+	/* writable objects may change under the comparison */
+	if (ret == SD_RES_SUCCESS && oid_is_readonly(oid) &&
+	    sd_store->get_hash(oid, epoch, cached) == SD_RES_SUCCESS) {
+		get_buffer_sha1(iocb.buf, iocb.length, sha1);
+		if (memcmp(sha1, cached, sizeof(sha1)) != 0) {
+			sd_err("%016"PRIx64" doesn't match its digest %s", oid,
+			       sha1_to_hex(cached));
+			ret = SD_RES_EIO;
+		}
+	}
+	free(iocb.buf);
+
+	return ret != SD_RES_EIO;
+}
+
+static worker_fn void scrub_repair(uint64_t oid, const struct sd_node **nodes,
+				   int copies, uint32_t epoch)
+{
+	for (int i = 0; i < copies; i++) {
+		if (node_is_local(nodes[i]))
+			continue;
+		if (repair_replica_from(&nodes[i]->nid, oid, epoch) ==
+		    SD_RES_SUCCESS) {
+			sd_info("repaired %016"PRIx64" from %s", oid,
+				node_to_str(nodes[i]));
+			scrub.nr_repaired++;
+			return;
+		}
+	}
+	scrub.nr_failed++;
+}
+
+static worker_fn void scrub_worker(struct work *work)
+{
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	uint64_t mine[SCRUB_BATCH];
+	struct check_info ci;
+	int nr_mine = 0, end;
+
+	if (!scrub.oids) {
+		scrub.oids = get_local_oids(&scrub.nr_oids);
+		if (!scrub.oids)
+			return;
+		scrub.pos = 0;
+		scrub.nr_scrubbed = 0;
+		scrub.nr_repaired = 0;
+		scrub.nr_failed = 0;
+	}
+
+	end = min(scrub.pos + SCRUB_BATCH, scrub.nr_oids);
+	for (; scrub.pos < end; scrub.pos++) {
+		uint64_t oid = scrub.oids[scrub.pos];
+		int copies, idx;
+
+		/* 'dog vdi check' handles the erasure coded objects */
+		if (get_vdi_copy_policy(oid_to_vid(oid)))
+			continue;
+
+		copies = get_obj_copy_number(oid, scrub.vinfo->nr_zones);
+		vinfo_oid_to_nodes(scrub.vinfo, oid, copies, nodes);
+		for (idx = 0; idx < copies; idx++)
+			if (node_is_local(nodes[idx]))
+				break;
+		/* a stale object, the recovery deals with it */
+		if (idx == copies)
+			continue;
+
+		scrub.nr_scrubbed++;
+		if (!scrub_verify(oid, scrub.epoch))
+			scrub_repair(oid, nodes, copies, scrub.epoch);
+		if (idx == 0)
+			mine[nr_mine++] = oid;
+	}
+
+	if (!nr_mine)
+		return;
+	check_info_init(&ci, scrub.vinfo, scrub.epoch);
+	check_batch(&ci, mine, nr_mine);
+	scrub.nr_repaired += ci.nr_repaired;
+	scrub.nr_failed += ci.nr_failed;
+	check_info_release(&ci);
+}
+
+static main_fn void scrub_done(struct work *work)
+{
+	uint64_t elapsed = (clock_get_time() - scrub.start) / 1000000;
+	uint64_t delay = scrub.bytes * 1000 / scrub_bandwidth;
+	uint64_t nr_reqs = nr_client_requests() - scrub.nr_reqs;
+
+	put_vnode_info(scrub.vinfo);
+	scrub.vinfo = NULL;
+
+	if (!scrub.oids) {
+		sd_err("failed to get the object list");
+		add_timer(&scrub_timer, SCRUB_RETRY * 1000);
+		return;
+	}
+
+	if (scrub.pos >= scrub.nr_oids) {
+		sd_info("scrubbed %"PRIu64" objects, repaired %"PRIu32
+			" replicas, %"PRIu32" failures", scrub.nr_scrubbed,
+			scrub.nr_repaired, scrub.nr_failed);
+		free(scrub.oids);
+		scrub.oids = NULL;
+		add_timer(&scrub_timer, scrub_interval * 1000);
+		return;
+	}
+
+	/* the reads took some of the time already */
+	delay = delay > elapsed ? delay - elapsed : 0;
+	if (nr_reqs * 1000 > SCRUB_BUSY_RATE * max(elapsed, (uint64_t)1))
+		delay = max(delay * 4, (uint64_t)SCRUB_BUSY_DELAY);
+	add_timer(&scrub_timer, min(delay, (uint64_t)UINT32_MAX));
+}
+
+static main_fn void scrub_timer_fn(void *data)
+{
+	if (sys->cinfo.status != SD_STATUS_OK || node_in_recovery()) {
+		/* the pass goes on where it was after the recovery */
+		add_timer(&scrub_timer, SCRUB_RETRY * 1000);
+		return;
+	}
+
+	scrub.vinfo = get_vnode_info();
+	scrub.epoch = sys->cinfo.epoch;
+	scrub.bytes = 0;
+	scrub.start = clock_get_time();
+	scrub.nr_reqs = nr_client_requests();
+	queue_work(scrub_wq, &scrub_work);
+}
+
+/* Scrub the objects at 'bandwidth' bytes per sec, a pass every 'interval' */
+int scrub_init(uint64_t bandwidth, uint32_t interval)
+{
+	scrub_wq = create_ordered_work_queue("scrub");
+	if (!scrub_wq)
+		return -1;
+	set_work_queue_priority(scrub_wq, WQ_PRIO_LOW);
+	set_work_queue_io_class(scrub_wq, IO_CLASS_BACKGROUND);
+
+	scrub_bandwidth = bandwidth;
+	scrub_interval = interval;
+	scrub_work.fn = scrub_worker;
+	scrub_work.done = scrub_done;
+	scrub_timer.callback = scrub_timer_fn;
+	/* the first pass waits for the cluster to settle */
+	add_timer(&scrub_timer, SCRUB_RETRY * 1000);
+
+	sd_info("scrub the objects at %"PRIu64" bytes/sec every %"PRIu32" sec",
+		bandwidth, interval);
+	return 0;
+}
@@ -23,6 +23,7 @@
 #include "sheep.h"
 #include "config.h"
 #include "common.h"
+#include "arena.h"
 
 /*
  * maximum payload size sent in ->notify and ->unblock, it should be large
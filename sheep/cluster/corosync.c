@@ -441,8 +441,8 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		cevent->msg_len = cmsg->msg_len;
 		break;
 	case COROSYNC_MSG_TYPE_UNBLOCK:
-		cevent = update_event(COROSYNC_EVENT_TYPE_BLOCK, &cmsg->sender,
-				      cmsg->msg, cmsg->msg_len);
+		/* the message goes with the notify event below */
+		cevent = find_event(COROSYNC_EVENT_TYPE_BLOCK, &cmsg->sender);
 		if (cevent) {
 			list_del(&cevent->list);
 			free(cevent->msg);
@@ -30,8 +30,9 @@ static int sph_comm_fd;
 
 static struct sd_node this_node;
 
-static int nr_nodes;
-static struct sd_node nodes[SD_MAX_NODES];
+/* members of the cluster, kept up to date by the joins and leaves we see */
+static size_t nr_nodes;
+static struct rb_root sph_node_root = RB_ROOT;
 
 enum sph_driver_state {
 	STATE_PRE_JOIN,
@@ -43,6 +44,35 @@ static enum sph_driver_state state = STATE_PRE_JOIN;
 static char *kept_opaque;
 static size_t kept_opaque_len;
 
+/* the buffers of the message being handled, freed once it's done */
+static struct arena sph_arena;
+
+static void add_sph_node(const struct sd_node *node)
+{
+	struct sd_node *n = xmalloc(sizeof(*n));
+
+	*n = *node;
+	if (rb_insert(&sph_node_root, n, rb, node_cmp)) {
+		sd_err("duplicate node: %s", node_to_str(node));
+		free(n);
+		return;
+	}
+	nr_nodes++;
+}
+
+static bool del_sph_node(struct sd_node *node)
+{
+	struct sd_node *n = rb_search(&sph_node_root, node, rb, node_cmp);
+
+	if (!n)
+		return false;
+
+	rb_erase(&n->rb, &sph_node_root);
+	free(n);
+	nr_nodes--;
+	return true;
+}
+
 static int do_shepherd_join(void)
 {
 	int ret, msg_join_len;
@@ -55,19 +85,16 @@ static int do_shepherd_join(void)
 	msg.type = SPH_CLI_MSG_JOIN;
 	msg.body_len = msg_join_len;
 
-	msg_join = xzalloc(msg_join_len);
+	msg_join = arena_zalloc(&sph_arena, msg_join_len);
 	msg_join->new_node = this_node;
 	memcpy(msg_join->opaque, kept_opaque, kept_opaque_len);
 
 	ret = writev2(sph_comm_fd, &msg, msg_join, msg_join_len);
 	if (sizeof(msg) + msg_join_len != ret) {
 		sd_err("do_shepherd_join() failed, %m");
-		free(msg_join);
-
 		return -1;
 	}
 
-	free(msg_join);
 	return 0;
 }
 
@@ -101,7 +128,7 @@ retry:
 		int join_len;
 
 		join_len = rcv.body_len;
-		join = xzalloc(join_len);
+		join = arena_alloc(&sph_arena, join_len);
 		ret = xread(sph_comm_fd, join, join_len);
 		if (ret != join_len) {
 			sd_err("xread() failed: %m");
@@ -112,7 +139,8 @@ retry:
 		 * FIXME: member change events must be ordered with nonblocked
 		 *        events
 		 */
-		if (!sd_join_handler(&join->new_node, NULL, 0, join->opaque))
+		if (!sd_join_handler(&join->new_node, &sph_node_root, 0,
+				     join->opaque))
 			panic("sd_accept_handler() failed");
 
 		snd.type = SPH_CLI_MSG_ACCEPT;
@@ -124,8 +152,6 @@ retry:
 			exit(1);
 		}
 
-		free(join);
-
 		read_msg(&rcv);
 	}
 
@@ -141,7 +167,7 @@ retry:
 		exit(1);
 	}
 
-	join_reply = xzalloc(rcv.body_len);
+	join_reply = arena_alloc(&sph_arena, rcv.body_len);
 	ret = xread(sph_comm_fd, join_reply, rcv.body_len);
 	if (ret != rcv.body_len) {
 		sd_err("xread() failed: %m");
@@ -150,14 +176,14 @@ retry:
 
 	sd_info("join reply arrived, nr_nodes: %d", join_reply->nr_nodes);
 
-	memcpy(nodes, join_reply->nodes,
-	       join_reply->nr_nodes * sizeof(struct sd_node));
-	nr_nodes = join_reply->nr_nodes;
+	rb_destroy(&sph_node_root, struct sd_node, rb);
+	nr_nodes = 0;
+	for (int i = 0; i < join_reply->nr_nodes; i++)
+		add_sph_node(join_reply->nodes + i);
 
 	/* FIXME: member change events must be ordered with nonblocked events */
-	sd_accept_handler(&this_node, nodes, nr_nodes, join_reply->opaque);
-
-	free(join_reply);
+	sd_accept_handler(&this_node, &sph_node_root, nr_nodes,
+			  sph_join_reply_opaque(join_reply));
 
 	sd_info("shepherd_join() succeed");
 	state = STATE_JOINED;
@@ -172,6 +198,8 @@ struct sph_event {
 	bool callbacked, removed;
 
 	struct list_node event_list;
+	/* the message follows, freed together with the event */
+	char data[] __attribute__((aligned(8)));
 };
 
 static LIST_HEAD(nonblocked_event_list);
@@ -214,7 +242,6 @@ static bool sph_process_event(void)
 
 remove:
 	list_del(&ev->event_list);
-	free(ev->msg);
 	free(ev);
 
 	return true;
@@ -228,11 +255,11 @@ static void push_sph_event(bool nonblock, struct sd_node *sender,
 	sd_debug("push_sph_event() called, pushing %sblocking event",
 		 nonblock ? "non" : "");
 
-	ev = xzalloc(sizeof(*ev));
+	ev = xzalloc(sizeof(*ev) + msg_len);
 
 	ev->sender = *sender;
 	if (msg_len) {
-		ev->msg = xzalloc(msg_len);
+		ev->msg = ev->data;
 		memcpy(ev->msg, msg, msg_len);
 		ev->msg_len = msg_len;
 	}
@@ -286,7 +313,7 @@ static void msg_new_node(struct sph_msg *rcv)
 	struct sph_msg_join *join;
 	struct sph_msg snd;
 
-	join = xzalloc(rcv->body_len);
+	join = arena_alloc(&sph_arena, rcv->body_len);
 	ret = xread(sph_comm_fd, join, rcv->body_len);
 	if (ret != rcv->body_len) {
 		sd_err("xread() failed: %m");
@@ -294,7 +321,7 @@ static void msg_new_node(struct sph_msg *rcv)
 	}
 
 	/* FIXME: member change events must be ordered with nonblocked events */
-	if (!sd_join_handler(&join->new_node, join->nodes, join->nr_nodes,
+	if (!sd_join_handler(&join->new_node, &sph_node_root, nr_nodes,
 			     join->opaque))
 		/*
 		 * This should succeed always because shepherd should have sent
@@ -311,7 +338,6 @@ static void msg_new_node(struct sph_msg *rcv)
 		sd_err("writev() failed: %m");
 		exit(1);
 	}
-	free(join);
 }
 
 static void msg_new_node_finish(struct sph_msg *rcv)
@@ -319,24 +345,21 @@ static void msg_new_node_finish(struct sph_msg *rcv)
 	int ret;
 	struct sph_msg_join_node_finish *join_node_finish;
 
-	join_node_finish = xzalloc(rcv->body_len);
+	join_node_finish = arena_alloc(&sph_arena, rcv->body_len);
 	ret = xread(sph_comm_fd, join_node_finish, rcv->body_len);
 	if (ret != rcv->body_len) {
 		sd_err("xread() failed: %m");
 		exit(1);
 	}
 
-	memcpy(nodes, join_node_finish->nodes,
-	       join_node_finish->nr_nodes * sizeof(struct sd_node));
-	nr_nodes = join_node_finish->nr_nodes;
+	/* shepherd sends only the new node, the others are already known */
+	add_sph_node(&join_node_finish->new_node);
 
 	sd_info("new node: %s", node_to_str(&join_node_finish->new_node));
 
 	/* FIXME: member change events must be ordered with nonblocked events */
-	sd_accept_handler(&join_node_finish->new_node, nodes, nr_nodes,
-			  join_node_finish->opaque);
-
-	free(join_node_finish);
+	sd_accept_handler(&join_node_finish->new_node, &sph_node_root,
+			  nr_nodes, join_node_finish->opaque);
 }
 
 static void msg_notify_forward(struct sph_msg *rcv)
@@ -344,7 +367,7 @@ static void msg_notify_forward(struct sph_msg *rcv)
 	int ret;
 	struct sph_msg_notify_forward *notify_forward;
 
-	notify_forward = xzalloc(rcv->body_len);
+	notify_forward = arena_alloc(&sph_arena, rcv->body_len);
 	ret = xread(sph_comm_fd, notify_forward, rcv->body_len);
 	if (ret != rcv->body_len) {
 		sd_err("xread() failed: %m");
@@ -357,8 +380,6 @@ static void msg_notify_forward(struct sph_msg *rcv)
 	push_sph_event(true, &notify_forward->from_node,
 		notify_forward->notify_msg,
 		rcv->body_len - sizeof(*notify_forward));
-
-	free(notify_forward);
 }
 
 static void msg_block_forward(struct sph_msg *rcv)
@@ -388,7 +409,7 @@ static void do_leave_sheep(void)
 
 	sd_info("removing node: %s", node_to_str(&sender));
 
-	if (xlremove(&sender, nodes, &nr_nodes, node_cmp))
+	if (del_sph_node(&sender))
 		goto removed;
 
 	sd_info("leave message from unknown node: %s", node_to_str(&sender));
@@ -398,7 +419,7 @@ removed:
 	sd_debug("calling sd_leave_handler(), sender: %s",
 		 node_to_str(&sender));
 	/* FIXME: member change events must be ordered with nonblocked events */
-	sd_leave_handler(&sender, nodes, nr_nodes);
+	sd_leave_handler(&sender, &sph_node_root, nr_nodes);
 }
 
 static void msg_remove(struct sph_msg *rcv)
@@ -457,9 +478,10 @@ static void shepherd_comm_handler(int fd, int events, void *data)
 	sd_assert(fd == sph_comm_fd);
 	sd_assert(data == NULL);
 
-	if (events & EPOLLIN)
+	if (events & EPOLLIN) {
 		read_msg_from_shepherd();
-	else if (events & EPOLLHUP || events & EPOLLERR) {
+		arena_destroy(&sph_arena);
+	} else if (events & EPOLLHUP || events & EPOLLERR) {
 		sd_err("connection to shepherd caused an error: %m");
 		exit(1);
 	}
@@ -82,6 +82,7 @@ enum zk_event_type {
 	EVENT_UNBLOCK,
 	EVENT_NOTIFY,
 	EVENT_UPDATE_NODE,
+	EVENT_NOTIFY_BATCH,
 };
 
 struct zk_node {
@@ -104,6 +105,15 @@ struct zk_event {
 	uint8_t buf[ZK_MAX_BUF_SIZE];
 };
 
+/* One notification in the buffer of EVENT_NOTIFY_BATCH, 8-byte aligned */
+struct zk_notify_msg {
+	uint32_t len;
+	uint32_t __pad;
+	uint8_t msg[];
+};
+
+#define ZK_NOTIFY_BATCH_SIZE (64 * 1024)
+
 static struct rb_root sd_node_root = RB_ROOT;
 static size_t nr_sd_nodes;
 static struct rb_root zk_node_root = RB_ROOT;
@@ -116,6 +126,7 @@ static bool joined;
 static bool first_push = true;
 
 static void zk_compete_master(void);
+static int zk_flush_notify(void);
 
 static int zk_node_cmp(const struct zk_node *a, const struct zk_node *b)
 {
@@ -578,18 +589,12 @@ static int push_join_response(struct zk_event *ev)
 	return ZOK;
 }
 
-static int zk_queue_pop_advance(struct zk_event *ev)
+/* Account the event at queue_pos, which has been read into 'ev' */
+static int zk_queue_advance(const struct zk_event *ev, int len)
 {
-	int len;
-	char path[MAX_NODE_STR_LEN];
 	char queue_pos_path[MAX_NODE_STR_LEN];
 
-	len = sizeof(*ev);
-	snprintf(path, sizeof(path), QUEUE_ZNODE "/%010"PRId32, queue_pos);
-
-	RETURN_IF_ERROR(zk_get_data(path, ev, &len), "path %s", path);
-	sd_debug("%s, type:%d, len:%d, pos:%" PRId32, path, ev->type, len,
-		 queue_pos);
+	sd_debug("type:%d, len:%d, pos:%" PRId32, ev->type, len, queue_pos);
 
 	if (queue_pos % QUEUE_DEL_BATCH == 0 && ev->type != EVENT_JOIN
 		&& ev->type != EVENT_ACCEPT) {
@@ -605,6 +610,88 @@ static int zk_queue_pop_advance(struct zk_event *ev)
 	return ZOK;
 }
 
+/*
+ * Instead of reading the queue one event per round trip, we read the next
+ * ZK_QUEUE_PREFETCH znodes with pipelined asynchronous requests.  Only the
+ * main thread reads the queue, so one set of buffers is enough.
+ */
+#define ZK_QUEUE_PREFETCH 16
+
+static struct zk_prefetch {
+	int rc;
+	int len;
+	struct zk_event *ev;
+} zk_prefetch[ZK_QUEUE_PREFETCH];
+static int zk_prefetch_pending;
+static sem_t zk_prefetch_done;
+
+static void zk_prefetch_completion(int rc, const char *value, int value_len,
+				   const struct Stat *stat, const void *data)
+{
+	struct zk_prefetch *p = (struct zk_prefetch *)data;
+
+	p->rc = rc;
+	if (rc == ZOK) {
+		p->len = min((size_t)value_len, sizeof(*p->ev));
+		memcpy(p->ev, value, p->len);
+	}
+
+	if (uatomic_sub_return(&zk_prefetch_pending, 1) == 0)
+		sem_post(&zk_prefetch_done);
+}
+
+/*
+ * Read the events from queue_pos on.  Return how many of them were read in a
+ * row; the ones after a missing znode or an error are ignored.
+ */
+static int zk_queue_prefetch(void)
+{
+	char path[MAX_NODE_STR_LEN];
+	int i, rc, nr;
+
+	uatomic_set(&zk_prefetch_pending, ZK_QUEUE_PREFETCH);
+	for (i = 0; i < ZK_QUEUE_PREFETCH; i++) {
+		snprintf(path, sizeof(path), QUEUE_ZNODE "/%010"PRId32,
+			 queue_pos + i);
+		rc = zoo_aget(zhandle, path, 1, zk_prefetch_completion,
+			      zk_prefetch + i);
+		if (rc != ZOK) {
+			sd_err("failed, path %s, %s", path, zerror(rc));
+			break;
+		}
+	}
+
+	/* Drop the requests we didn't send and wait for the others */
+	if (uatomic_sub_return(&zk_prefetch_pending, ZK_QUEUE_PREFETCH - i))
+		sem_wait(&zk_prefetch_done);
+
+	for (nr = 0; nr < i; nr++) {
+		rc = zk_prefetch[nr].rc;
+		if (rc == ZOK)
+			continue;
+		/* we will peek the missing one and retry on lost connection */
+		if (rc != ZNONODE && rc != ZOPERATIONTIMEOUT &&
+		    rc != ZCONNECTIONLOSS)
+			sd_err("failed, pos %" PRId32 ", %s", queue_pos + nr,
+			       zerror(rc));
+		break;
+	}
+
+	return nr;
+}
+
+static int zk_prefetch_init(void)
+{
+	/* zk_init() is called again on reconnection */
+	if (zk_prefetch[0].ev)
+		return 0;
+
+	for (int i = 0; i < ZK_QUEUE_PREFETCH; i++)
+		zk_prefetch[i].ev = xmalloc(sizeof(struct zk_event));
+
+	return sem_init(&zk_prefetch_done, 0, 0);
+}
+
 static inline void zk_tree_add(struct zk_node *node)
 {
 	struct zk_node *zk = xzalloc(sizeof(*zk));
@@ -1044,24 +1131,107 @@ static int zk_leave(void)
 
 	snprintf(path, sizeof(path), MEMBER_ZNODE"/%s",
 		 node_to_str(&this_node.node));
+	zk_flush_notify();
 	add_event(EVENT_LEAVE, &this_node, NULL, 0);
 	lock_table_remove_znodes();
 	zk_delete_node(path, -1);
 	return 0;
 }
 
+/*
+ * Notifications are packed into one EVENT_NOTIFY_BATCH until the main thread
+ * goes back to the event loop, so that a storm of cluster requests (e.g. vdi
+ * locking at VM boot) costs one queue znode instead of one per request.  The
+ * other events of this node flush the batch first to keep the order.  Older
+ * sheep can't read the batch, so SD_SHEEP_PROTO_VER keeps them out.
+ */
+static int notify_efd = -1;
+static uint8_t notify_batch[ZK_NOTIFY_BATCH_SIZE];
+static size_t notify_batch_len;
+static int notify_batch_nr;
+
+static int zk_flush_notify(void)
+{
+	struct zk_notify_msg *m = (struct zk_notify_msg *)notify_batch;
+	int ret;
+
+	if (!notify_batch_nr)
+		return SD_RES_SUCCESS;
+
+	if (notify_batch_nr == 1)
+		ret = add_event(EVENT_NOTIFY, &this_node, m->msg, m->len);
+	else
+		ret = add_event(EVENT_NOTIFY_BATCH, &this_node, notify_batch,
+				notify_batch_len);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	notify_batch_len = 0;
+	notify_batch_nr = 0;
+	return SD_RES_SUCCESS;
+}
+
+static void zk_notify_retry(void *data)
+{
+	eventfd_xwrite(notify_efd, 1);
+}
+
+static struct timer notify_retry_timer = {
+	.callback = zk_notify_retry,
+};
+
+static void zk_notify_handler(int listen_fd, int events, void *data)
+{
+	eventfd_xread(notify_efd);
+
+	if (zk_flush_notify() != SD_RES_SUCCESS) {
+		sd_err("failed to flush %d notifications, retry later",
+		       notify_batch_nr);
+		add_timer(&notify_retry_timer, WAIT_TIME * 1000);
+	}
+}
+
 static int zk_notify(void *msg, size_t msg_len)
 {
-	return add_event(EVENT_NOTIFY, &this_node, msg, msg_len);
+	size_t len = round_up(sizeof(struct zk_notify_msg) + msg_len, 8);
+	struct zk_notify_msg *m;
+	int ret;
+
+	if (len > ZK_NOTIFY_BATCH_SIZE ||
+	    notify_batch_len + len > ZK_NOTIFY_BATCH_SIZE) {
+		ret = zk_flush_notify();
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		if (len > ZK_NOTIFY_BATCH_SIZE)
+			return add_event(EVENT_NOTIFY, &this_node, msg,
+					 msg_len);
+	}
+
+	m = (struct zk_notify_msg *)(notify_batch + notify_batch_len);
+	m->len = msg_len;
+	memcpy(m->msg, msg, msg_len);
+	notify_batch_len += len;
+	if (notify_batch_nr++ == 0)
+		eventfd_xwrite(notify_efd, 1);
+
+	return SD_RES_SUCCESS;
 }
 
 static int zk_block(void)
 {
+	int ret = zk_flush_notify();
+
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 	return add_event(EVENT_BLOCK, &this_node, NULL, 0);
 }
 
 static int zk_unblock(void *msg, size_t msg_len)
 {
+	int ret = zk_flush_notify();
+
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 	return add_event(EVENT_UNBLOCK, &this_node, msg, msg_len);
 }
 
@@ -1223,6 +1393,19 @@ static void zk_handle_notify(struct zk_event *ev)
 	sd_notify_handler(&ev->sender.node, ev->buf, ev->buf_len);
 }
 
+static void zk_handle_notify_batch(struct zk_event *ev)
+{
+	uint8_t *p = ev->buf, *end = ev->buf + ev->buf_len;
+
+	sd_debug("NOTIFY BATCH");
+	while (p < end) {
+		struct zk_notify_msg *m = (struct zk_notify_msg *)p;
+
+		sd_notify_handler(&ev->sender.node, m->msg, m->len);
+		p += round_up(sizeof(*m) + m->len, 8);
+	}
+}
+
 static void zk_handle_update_node(struct zk_event *ev)
 {
 	struct zk_node *t;
@@ -1250,6 +1433,7 @@ static void (*const zk_event_handlers[])(struct zk_event *ev) = {
 	[EVENT_UNBLOCK]		= zk_handle_unblock,
 	[EVENT_NOTIFY]		= zk_handle_notify,
 	[EVENT_UPDATE_NODE]	= zk_handle_update_node,
+	[EVENT_NOTIFY_BATCH]	= zk_handle_notify_batch,
 };
 
 static const int zk_max_event_handlers = ARRAY_SIZE(zk_event_handlers);
@@ -1272,6 +1456,11 @@ static inline void handle_session_expire(void)
 	INIT_RB_ROOT(&sd_node_root);
 	first_push = true;
 	joined = false;
+	if (notify_batch_nr)
+		sd_err("drop %d notifications of the expired session",
+		       notify_batch_nr);
+	notify_batch_len = 0;
+	notify_batch_nr = 0;
 
 	while (sd_reconnect_handler()) {
 		sd_err("failed to reconnect. sleep and retry...");
@@ -1281,8 +1470,9 @@ static inline void handle_session_expire(void)
 
 static void zk_event_handler(int listen_fd, int events, void *data)
 {
-	struct zk_event ev;
+	int32_t pos = queue_pos;
 	bool peek;
+	int nr;
 
 	sd_debug("%d, %d", events, queue_pos);
 	if (events & EPOLLHUP) {
@@ -1301,23 +1491,31 @@ static void zk_event_handler(int listen_fd, int events, void *data)
 		return;
 	}
 
-	RETURN_VOID_IF_ERROR(zk_queue_peek(&peek), "");
-	if (!peek)
-		goto kick_block_event;
+	nr = zk_queue_prefetch();
+	for (int i = 0; i < nr; i++) {
+		struct zk_event *ev = zk_prefetch[i].ev;
 
-	RETURN_VOID_IF_ERROR(zk_queue_pop_advance(&ev), "");
-	if (ev.type < zk_max_event_handlers && zk_event_handlers[ev.type])
-		zk_event_handlers[ev.type](&ev);
-	else
-		panic("unhandled type %d", ev.type);
+		/* A join handler moved queue_pos back, read the rest again */
+		if (queue_pos != pos + i)
+			break;
 
+		RETURN_VOID_IF_ERROR(zk_queue_advance(ev, zk_prefetch[i].len),
+				     "");
+		if (ev->type < zk_max_event_handlers &&
+		    zk_event_handlers[ev->type])
+			zk_event_handlers[ev->type](ev);
+		else
+			panic("unhandled type %d", ev->type);
+	}
+
+	/* This also watches the next znode if it doesn't exist yet */
 	RETURN_VOID_IF_ERROR(zk_queue_peek(&peek), "");
 	if (peek) {
 		/* Someone has created next event, go kick event handler. */
 		eventfd_xwrite(efd, 1);
 		return;
 	}
-kick_block_event:
+
 	/*
 	 * Kick block event only if there is no nonblock event. We prefer to
 	 * handle nonblock event because:
@@ -1519,6 +1717,28 @@ static int zk_init(const char *option)
 		return -1;
 	}
 
+	if (notify_efd < 0) {
+		notify_efd = eventfd(0, EFD_NONBLOCK);
+		if (notify_efd < 0) {
+			sd_err("failed to create an event fd: %m");
+			return -1;
+		}
+
+		ret = register_event(notify_efd, zk_notify_handler, NULL);
+		if (ret) {
+			sd_err("failed to register zookeeper notify handler"
+			       " (%d)", ret);
+			close(notify_efd);
+			notify_efd = -1;
+			return -1;
+		}
+	}
+
+	if (zk_prefetch_init() < 0) {
+		sd_err("failed to initialize the queue prefetch: %m");
+		return -1;
+	}
+
 	/* init distributed lock structures */
 	cluster_locks_table = xzalloc(sizeof(struct hlist_head) *
 				      HASH_BUCKET_NR);
@@ -1541,6 +1761,10 @@ static int zk_update_node(struct sd_node *node)
 	struct zk_node znode = {
 		.node = *node,
 	};
+	int ret = zk_flush_notify();
+
+	if (ret != SD_RES_SUCCESS)
+		return ret;
 	return add_event(EVENT_UPDATE_NODE, &znode, NULL, 0);
 }
 
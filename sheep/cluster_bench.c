@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the cluster drivers
+ *
+ * cluster_bench runs N nodes over a cluster driver and measures its events.
+ * The drivers keep their state in globals, so each node is a process of its
+ * own, forked from cluster_bench, and the group handlers of sheep are
+ * replaced with ones which only record what they see.  All the nodes join at
+ * once, and when a node sees all of them it sends its operations at the
+ * given rate: notify, or block followed by unblock for the given percent of
+ * them.  At last it notifies that it's done, and it reports when it has seen
+ * all the nodes done.
+ *
+ * These latencies are measured, as lines of the "key=value" form of the
+ * micro-benchmarks in tests/unit/bench:
+ *
+ *   join      from join() to the accept of the node itself
+ *   converge  from the start of the nodes until a node sees all of them
+ *   notify    from notify() to the delivery of the message to its sender
+ *   deliver   from notify() to the delivery to each node, the fan-out
+ *   block     from block() to sd_block_handler() on the node
+ *   unblock   from unblock() to the delivery of its message to its sender
+ *
+ * The CPU time spent by a node while sending its operations, divided by the
+ * events it handled, is reported as the cost of an event.  The nodes run on
+ * one host, so the clock of the latencies is shared.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "sheep_priv.h"
+#include "cluster.h"
+#include "event.h"
+#include "option.h"
+
+static const char program_name[] = "cluster_bench";
+
+/* sheep.c is not linked, these are the globals it would have defined */
+static struct system_info __sys;
+struct system_info *sys = &__sys;
+LIST_HEAD(cluster_drivers);
+
+#define BENCH_SEED 0x5eed5eed5eed5eedULL
+/* the operations are sent in bursts every tick */
+#define BENCH_TICK 10
+
+enum bench_lat {
+	LAT_JOIN,
+	LAT_CONVERGE,
+	LAT_NOTIFY,
+	LAT_DELIVER,
+	LAT_BLOCK,
+	LAT_UNBLOCK,
+	NR_BENCH_LATS,
+};
+
+static const char * const lat_names[NR_BENCH_LATS] = {
+	[LAT_JOIN] = "join",
+	[LAT_CONVERGE] = "converge",
+	[LAT_NOTIFY] = "notify",
+	[LAT_DELIVER] = "deliver",
+	[LAT_BLOCK] = "block",
+	[LAT_UNBLOCK] = "unblock",
+};
+
+struct bench_hist {
+	uint64_t nr;
+	uint64_t total;		/* usec */
+	uint64_t max;
+	uint64_t buckets[SD_NR_LATENCY_BUCKETS];
+};
+
+/* What a node reports to the parent through its pipe */
+struct bench_stat {
+	struct bench_hist lat[NR_BENCH_LATS];
+	uint64_t nr_events;	/* while sending the operations */
+	uint64_t cpu_usec;
+};
+
+enum bench_msg_type {
+	MSG_NOTIFY,
+	MSG_UNBLOCK,
+	MSG_DONE,
+};
+
+struct bench_msg {
+	uint32_t type;
+	uint32_t node;
+	uint64_t sent;		/* usec */
+	char payload[];
+};
+
+static struct cluster_driver *cdrv;
+static const char *cdrv_option;
+static int nr_nodes = 16, block_percent = 10;
+static uint64_t nr_ops = 1000, rate = 100, msg_size = 64;
+
+/* the state of the node of this process */
+static struct {
+	int idx;
+	struct sd_node node;
+	uint64_t start, join_start, ops_start;
+	bool joined, converged, blocking, unblock_queued, done;
+	uint64_t block_start, unblock_start;
+	uint64_t nr_sent, nr_done_seen, seed;
+	struct timer tick, unblock;
+	struct rusage ru;
+	struct bench_stat stat;
+} me;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t bench_rand(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+static void account(enum bench_lat lat, uint64_t start)
+{
+	struct bench_hist *h = me.stat.lat + lat;
+	uint64_t usec = now_usec() - start;
+
+	h->nr++;
+	h->total += usec;
+	h->max = max(h->max, usec);
+	h->buckets[latency_to_bucket(usec)]++;
+}
+
+static uint64_t cpu_usec(const struct rusage *ru)
+{
+	return (uint64_t)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000 +
+		ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+}
+
+static inline bool is_me(const struct sd_node *node)
+{
+	return node_id_cmp(&node->nid, &me.node.nid) == 0;
+}
+
+static void send_msg(enum bench_msg_type type)
+{
+	struct bench_msg *msg = xzalloc(msg_size);
+	int ret;
+
+	msg->type = type;
+	msg->node = me.idx;
+	msg->sent = now_usec();
+	if (type == MSG_UNBLOCK) {
+		me.unblock_start = msg->sent;
+		ret = cdrv->unblock(msg, msg_size);
+	} else
+		ret = cdrv->notify(msg, msg_size);
+	if (ret != SD_RES_SUCCESS)
+		panic("failed to send a message, %s", sd_strerror(ret));
+	free(msg);
+}
+
+static void bench_tick(void *arg)
+{
+	uint64_t due = rate * (now_usec() - me.ops_start) / 1000000;
+
+	for (; me.nr_sent < min(due, nr_ops) && !me.blocking; me.nr_sent++) {
+		if (bench_rand(&me.seed) % 100 < block_percent) {
+			me.blocking = true;
+			me.block_start = now_usec();
+			if (cdrv->block() != SD_RES_SUCCESS)
+				panic("failed to block");
+		} else
+			send_msg(MSG_NOTIFY);
+	}
+
+	if (me.nr_sent == nr_ops && !me.blocking) {
+		send_msg(MSG_DONE);
+		return;
+	}
+	add_timer(&me.tick, BENCH_TICK);
+}
+
+/* unblock() is called out of sd_block_handler(), as sheep does */
+static void bench_unblock(void *arg)
+{
+	send_msg(MSG_UNBLOCK);
+}
+
+static void start_ops(void)
+{
+	getrusage(RUSAGE_SELF, &me.ru);
+	me.stat.nr_events = 0;
+	me.ops_start = now_usec();
+	me.tick.callback = bench_tick;
+	me.unblock.callback = bench_unblock;
+	bench_tick(NULL);
+}
+
+bool sd_join_handler(const struct sd_node *joining,
+		     const struct rb_root *nroot, size_t nr_members,
+		     void *opaque)
+{
+	me.stat.nr_events++;
+	return true;
+}
+
+void sd_accept_handler(const struct sd_node *joined,
+		       const struct rb_root *nroot, size_t nr_members,
+		       const void *opaque)
+{
+	me.stat.nr_events++;
+	if (is_me(joined) && !me.joined) {
+		me.joined = true;
+		account(LAT_JOIN, me.join_start);
+	}
+	if (me.joined && !me.converged && nr_members == nr_nodes) {
+		me.converged = true;
+		account(LAT_CONVERGE, me.start);
+		start_ops();
+	}
+}
+
+void sd_leave_handler(const struct sd_node *left, const struct rb_root *nroot,
+		      size_t nr_members)
+{
+	me.stat.nr_events++;
+	sd_err("%s left during the benchmark", node_to_str(left));
+}
+
+void sd_notify_handler(const struct sd_node *sender, void *data,
+		       size_t msg_len)
+{
+	struct bench_msg *msg = data;
+
+	me.stat.nr_events++;
+	switch (msg->type) {
+	case MSG_NOTIFY:
+		account(LAT_DELIVER, msg->sent);
+		if (is_me(sender))
+			account(LAT_NOTIFY, msg->sent);
+		break;
+	case MSG_UNBLOCK:
+		if (is_me(sender)) {
+			account(LAT_UNBLOCK, msg->sent);
+			me.blocking = false;
+		}
+		break;
+	case MSG_DONE:
+		if (++me.nr_done_seen == nr_nodes)
+			me.done = true;
+		break;
+	}
+}
+
+bool sd_block_handler(const struct sd_node *sender)
+{
+	me.stat.nr_events++;
+	if (!is_me(sender) || !me.blocking)
+		return false;
+
+	account(LAT_BLOCK, me.block_start);
+	add_timer(&me.unblock, 0);
+	return true;
+}
+
+int sd_reconnect_handler(void)
+{
+	return 0;
+}
+
+void sd_update_node_handler(struct sd_node *node)
+{
+	me.stat.nr_events++;
+}
+
+/* No vnodes here, corosync checks the majority with them */
+struct vnode_info *get_vnode_info(void)
+{
+	return NULL;
+}
+
+void put_vnode_info(struct vnode_info *vinfo)
+{
+}
+
+static void run_node(int idx, int fd)
+{
+	struct rusage ru;
+	char dummy = 0;
+
+	me.idx = idx;
+	me.seed = BENCH_SEED + idx;
+	str_to_addr("127.0.0.1", me.node.nid.addr);
+	me.node.nid.port = SD_LISTEN_PORT + idx;
+	me.node.nr_vnodes = SD_DEFAULT_VNODES;
+	me.node.zone = idx;
+
+	if (init_event(4096) < 0 || cdrv->init(cdrv_option) < 0)
+		panic("failed to initialize the cluster driver");
+	me.join_start = now_usec();
+	if (cdrv->join(&me.node, &dummy, sizeof(dummy)) < 0)
+		panic("failed to join");
+
+	while (!me.done)
+		event_loop(-1);
+
+	getrusage(RUSAGE_SELF, &ru);
+	me.stat.cpu_usec = cpu_usec(&ru) - cpu_usec(&me.ru);
+	if (xwrite(fd, &me.stat, sizeof(me.stat)) != sizeof(me.stat))
+		panic("failed to report, %m");
+
+	/* stay in the cluster until all the nodes are done */
+	pause();
+	exit(0);
+}
+
+static void report(const struct bench_stat *sum)
+{
+	for (int i = 0; i < NR_BENCH_LATS; i++) {
+		const struct bench_hist *h = sum->lat + i;
+
+		if (!h->nr)
+			continue;
+		printf("name=%s nodes=%d ops=%"PRIu64" avg_us=%"PRIu64
+		       " p50_us=%"PRIu64" p99_us=%"PRIu64" p999_us=%"PRIu64
+		       " max_us=%"PRIu64"\n", lat_names[i], nr_nodes, h->nr,
+		       h->total / h->nr,
+		       latency_percentile(h->buckets, h->nr, h->max, 50),
+		       latency_percentile(h->buckets, h->nr, h->max, 99),
+		       latency_percentile(h->buckets, h->nr, h->max, 99.9),
+		       h->max);
+	}
+	printf("name=event nodes=%d events=%"PRIu64" cpu_us_per_event=%.2f\n",
+	       nr_nodes, sum->nr_events, sum->nr_events ?
+	       (double)sum->cpu_usec / sum->nr_events : 0);
+}
+
+static struct sd_option bench_options[] = {
+	{'b', "block", true, "the percent of the operations which are block "
+	 "and unblock (default: 10)"},
+	{'c', "cluster", true, "the cluster driver and its options, as of "
+	 "sheep (default: "DEFAULT_CLUSTER_DRIVER")"},
+	{'h', "help", false, "display this help and exit"},
+	{'n', "nodes", true, "the number of the nodes (default: 16)"},
+	{'o', "ops", true, "the operations of each node (default: 1000)"},
+	{'r', "rate", true, "the operations of a node per second "
+	 "(default: 100)"},
+	{'s', "size", true, "the size of the messages (default: 64)"},
+	{ 0, NULL, false, NULL },
+};
+
+static void usage(int status)
+{
+	struct sd_option *opt;
+
+	if (status) {
+		sd_err("Try '%s --help' for more information.", program_name);
+		exit(status);
+	}
+
+	printf("Benchmark of the cluster drivers of sheep\n"
+	       "Usage: %s [OPTION]...\n"
+	       "Options:\n", program_name);
+	sd_for_each_option(opt, bench_options) {
+		printf("  -%c, --%-18s%s\n", opt->ch, opt->name, opt->desc);
+	}
+	exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	const char *cdrv_name = DEFAULT_CLUSTER_DRIVER, *short_options;
+	struct option *long_options;
+	struct bench_stat *sum = xzalloc(sizeof(*sum)), stat;
+	pid_t *pids;
+	int ch, longindex, *fds, ret = 0;
+
+	long_options = build_long_options(bench_options);
+	short_options = build_short_options(bench_options);
+	while ((ch = getopt_long(argc, argv, short_options, long_options,
+				 &longindex)) >= 0) {
+		switch (ch) {
+		case 'b':
+			block_percent = atoi(optarg);
+			if (block_percent < 0 || block_percent > 100)
+				usage(1);
+			break;
+		case 'c':
+			cdrv_name = optarg;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		case 'n':
+			nr_nodes = atoi(optarg);
+			if (nr_nodes < 1)
+				usage(1);
+			break;
+		case 'o':
+			nr_ops = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			rate = strtoull(optarg, NULL, 10);
+			if (!rate)
+				usage(1);
+			break;
+		case 's':
+			msg_size = strtoull(optarg, NULL, 10);
+			if (msg_size < sizeof(struct bench_msg) ||
+			    msg_size > SD_MAX_EVENT_BUF_SIZE)
+				usage(1);
+			break;
+		default:
+			usage(1);
+			break;
+		}
+	}
+
+	cdrv = find_cdrv(cdrv_name);
+	if (!cdrv) {
+		sd_err("cluster driver %s not found", cdrv_name);
+		return 1;
+	}
+	if (!cdrv->block || !cdrv->unblock)
+		block_percent = 0;
+	cdrv_option = get_cdrv_option(cdrv, cdrv_name);
+
+	pids = xcalloc(nr_nodes, sizeof(*pids));
+	fds = xcalloc(nr_nodes, sizeof(*fds));
+	me.start = now_usec();
+	for (int i = 0; i < nr_nodes; i++) {
+		int p[2];
+
+		if (pipe(p) < 0)
+			panic("failed to create a pipe, %m");
+		pids[i] = fork();
+		if (pids[i] < 0)
+			panic("failed to fork, %m");
+		if (pids[i] == 0) {
+			close(p[0]);
+			run_node(i, p[1]);
+		}
+		close(p[1]);
+		fds[i] = p[0];
+	}
+
+	for (int i = 0; i < nr_nodes; i++) {
+		if (xread(fds[i], &stat, sizeof(stat)) != sizeof(stat)) {
+			sd_err("node %d failed", i);
+			ret = 1;
+			continue;
+		}
+		for (int j = 0; j < NR_BENCH_LATS; j++) {
+			struct bench_hist *h = sum->lat + j;
+
+			h->nr += stat.lat[j].nr;
+			h->total += stat.lat[j].total;
+			h->max = max(h->max, stat.lat[j].max);
+			for (int k = 0; k < SD_NR_LATENCY_BUCKETS; k++)
+				h->buckets[k] += stat.lat[j].buckets[k];
+		}
+		sum->nr_events += stat.nr_events;
+		sum->cpu_usec += stat.cpu_usec;
+	}
+
+	for (int i = 0; i < nr_nodes; i++) {
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+	if (!ret)
+		report(sum);
+
+	return ret;
+}
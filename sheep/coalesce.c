@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Coalescing of the adjacent peer writes to the same object
+ *
+ * While a small write to an object is being stored, the following writes to
+ * the same object which are contiguous with or overlap each other are
+ * collected into one pending batch, in the order of their arrival, so the
+ * later ones win where they overlap.  When the running write completes, the
+ * first writer of the batch stores the whole of it with one sd_store->write
+ * and all the writers of the batch get its result.  A write which can't join
+ * the pending batch is stored on its own as before.
+ *
+ * Nothing waits for more writes to come, so a lone write isn't delayed; the
+ * window of a batch is the time the previous write to the object takes, which
+ * is when a guest writing a log sequentially has the next writes in flight.
+ * Every writer still returns only after its data is stored, so the
+ * durability of the acknowledged writes is unchanged.
+ */
+
+#include "sheep_priv.h"
+
+#define WC_MAX_WRITE	(128 * 1024)	/* the larger writes go alone */
+#define WC_MAX_BATCH	(1024 * 1024)
+#define WC_HASH_SIZE	1024
+
+struct wc_batch {
+	struct siocb iocb;
+	int refcnt;
+	int nr_writes;
+	bool done;
+	int ret;
+	struct sd_cond cond;
+};
+
+/* An object with a write being stored */
+struct wc_object {
+	struct list_node list;
+	uint64_t oid;
+	/* the writes collected while the running one is stored */
+	struct wc_batch *pending;
+};
+
+static struct wc_bucket {
+	struct sd_mutex lock;
+	struct list_head objects;
+} buckets[WC_HASH_SIZE];
+
+static void __attribute__((constructor)) init_coalesce(void)
+{
+	for (int i = 0; i < WC_HASH_SIZE; i++) {
+		sd_init_mutex(&buckets[i].lock);
+		INIT_LIST_HEAD(&buckets[i].objects);
+	}
+}
+
+static struct wc_object *wc_lookup(struct wc_bucket *b, uint64_t oid)
+{
+	struct wc_object *obj;
+
+	list_for_each_entry(obj, &b->objects, list)
+		if (obj->oid == oid)
+			return obj;
+
+	return NULL;
+}
+
+static struct wc_batch *wc_new_batch(const struct siocb *iocb)
+{
+	struct wc_batch *batch = xzalloc(sizeof(*batch));
+
+	batch->iocb = *iocb;
+	batch->iocb.buf = xvalloc(iocb->length);
+	memcpy(batch->iocb.buf, iocb->buf, iocb->length);
+	batch->refcnt = 1;
+	batch->nr_writes = 1;
+	sd_cond_init(&batch->cond);
+
+	return batch;
+}
+
+static void wc_put_batch(struct wc_batch *batch)
+{
+	if (--batch->refcnt > 0)
+		return;
+
+	sd_destroy_cond(&batch->cond);
+	free(batch->iocb.buf);
+	free(batch);
+}
+
+/* Add the write 'iocb' to 'batch' if the result stays one contiguous range */
+static bool wc_merge(struct wc_batch *batch, const struct siocb *iocb)
+{
+	struct siocb *b = &batch->iocb;
+	uint64_t start, end;
+	char *buf;
+
+	if (iocb->epoch != b->epoch || iocb->ec_index != b->ec_index ||
+	    iocb->copy_policy != b->copy_policy)
+		return false;
+	if (iocb->offset > b->offset + b->length ||
+	    b->offset > iocb->offset + iocb->length)
+		return false;
+
+	start = min(b->offset, iocb->offset);
+	end = max(b->offset + b->length, iocb->offset + iocb->length);
+	if (end - start > WC_MAX_BATCH)
+		return false;
+
+	if (start != b->offset || end - start != b->length) {
+		buf = xvalloc(end - start);
+		memcpy(buf + (b->offset - start), b->buf, b->length);
+		free(b->buf);
+		b->buf = buf;
+		b->offset = start;
+		b->length = end - start;
+	}
+	memcpy((char *)b->buf + (iocb->offset - start), iocb->buf,
+	       iocb->length);
+	batch->nr_writes++;
+
+	return true;
+}
+
+/* Called with the lock of 'b' held when the write of 'obj' completes */
+static void wc_finish(struct wc_bucket *b, struct wc_object *obj)
+{
+	struct wc_batch *next = obj->pending;
+
+	if (next) {
+		/* the first writer of the batch stores it */
+		obj->pending = NULL;
+		sd_cond_broadcast(&next->cond);
+		return;
+	}
+
+	list_del(&obj->list);
+	free(obj);
+}
+
+int coalesce_write(uint64_t oid, const struct siocb *iocb,
+		   struct vnode_info *vinfo)
+{
+	struct wc_bucket *b = buckets + sd_hash_oid(oid) % WC_HASH_SIZE;
+	struct wc_object *obj;
+	struct wc_batch *batch;
+	int ret;
+
+	if (iocb->length > WC_MAX_WRITE)
+		return cow_write(oid, iocb, vinfo);
+
+	sd_mutex_lock(&b->lock);
+	obj = wc_lookup(b, oid);
+	if (!obj) {
+		obj = xzalloc(sizeof(*obj));
+		obj->oid = oid;
+		list_add(&obj->list, &b->objects);
+		sd_mutex_unlock(&b->lock);
+
+		ret = cow_write(oid, iocb, vinfo);
+
+		sd_mutex_lock(&b->lock);
+		wc_finish(b, obj);
+		sd_mutex_unlock(&b->lock);
+		return ret;
+	}
+
+	batch = obj->pending;
+	if (batch) {
+		if (!wc_merge(batch, iocb)) {
+			sd_mutex_unlock(&b->lock);
+			return cow_write(oid, iocb, vinfo);
+		}
+
+		batch->refcnt++;
+		while (!batch->done)
+			sd_cond_wait(&batch->cond, &b->lock);
+		ret = batch->ret;
+		wc_put_batch(batch);
+		sd_mutex_unlock(&b->lock);
+		return ret;
+	}
+
+	batch = wc_new_batch(iocb);
+	obj->pending = batch;
+	while (obj->pending == batch)
+		sd_cond_wait(&batch->cond, &b->lock);
+	sd_mutex_unlock(&b->lock);
+
+	/* nobody joins the batch any more */
+	ret = cow_write(oid, &batch->iocb, vinfo);
+	if (batch->nr_writes > 1)
+		sd_debug("%016"PRIx64", %d writes, %"PRIu32"@%"PRIu32, oid,
+			 batch->nr_writes, batch->iocb.length,
+			 batch->iocb.offset);
+
+	sd_mutex_lock(&b->lock);
+	batch->ret = ret;
+	batch->done = true;
+	sd_cond_broadcast(&batch->cond);
+	wc_finish(b, obj);
+	wc_put_batch(batch);
+	sd_mutex_unlock(&b->lock);
+
+	return ret;
+}
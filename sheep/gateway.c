@@ -21,6 +21,54 @@ static inline void gateway_init_fwd_hdr(struct sd_req *fwd, struct sd_req *hdr)
 	memcpy(fwd, hdr, sizeof(*fwd));
 	fwd->opcode = gateway_to_peer_opcode(hdr->opcode);
 	fwd->proto_ver = SD_SHEEP_PROTO_VER;
+	fwd->flags &= ~(SD_FLAG_CMD_ZSTD | SD_FLAG_CMD_ZSTD_DATA |
+			SD_FLAG_CMD_SPARSE);
+}
+
+static void wait_lagging_writes(uint64_t oid);
+
+/* The zstd frame of the payload of a forwarded write, made once */
+struct fwd_frame {
+	void *buf;
+	uint32_t len;
+	bool tried;
+};
+
+/*
+ * Offer zstd to the node n of another zone, and send it the payload buf of a
+ * replicated write as a zstd frame if it takes them, see wire.c.  Returns the
+ * payload to send and updates hdr and wlen for it.
+ */
+static void *fwd_payload(const struct sd_node *n, struct sd_req *hdr,
+			 void *buf, uint32_t *wlen, struct fwd_frame *f)
+{
+	hdr->flags &= ~(SD_FLAG_CMD_ZSTD | SD_FLAG_CMD_ZSTD_DATA);
+	if (!wire_compress_with(n))
+		return buf;
+
+	hdr->flags |= SD_FLAG_CMD_ZSTD;
+	if (!(hdr->flags & SD_FLAG_CMD_WRITE) || *wlen != hdr->data_length ||
+	    is_erasure_oid(hdr->obj.oid) || !sockfd_cache_zstd(&n->nid))
+		return buf;
+
+	if (!f->tried) {
+		f->tried = true;
+		f->buf = wire_compress(buf, *wlen, &f->len);
+	}
+	if (!f->buf)
+		return buf;
+
+	hdr->flags |= SD_FLAG_CMD_ZSTD_DATA;
+	hdr->data_length = *wlen = f->len;
+	return f->buf;
+}
+
+/* Remember the answer of the node to SD_FLAG_CMD_ZSTD */
+static void fwd_zstd_answer(const struct node_id *nid, struct sd_rsp *rsp)
+{
+	if (sys->wire_compress)
+		sockfd_cache_set_zstd(nid, rsp->flags & SD_FLAG_CMD_ZSTD);
+	rsp->flags &= ~SD_FLAG_CMD_ZSTD;
 }
 
 struct req_iter {
@@ -134,7 +182,7 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 	int ed = 0, ep = 0, edp;
 
 	edp = ec_policy_to_dp(policy, &ed, &ep);
-	ctx = ec_init(ed, edp);
+	ctx = ec_init_policy(policy);
 	*nr = nr_to_send = (opcode == SD_OP_READ_OBJ) ? ed : edp;
 	strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
 	reqs = zalloc(sizeof(*reqs) * nr_to_send);
@@ -183,20 +231,22 @@ static struct req_iter *prepare_erasure_requests(struct request *req, int *nr)
 		goto out;
 	}
 	for (i = 0; i < nr_stripe; i++) {
+		for (j = 0; j < ed; j++)
+			memcpy(reqs[j].buf + strip_size * i,
+			       p + j * strip_size, strip_size);
+		p += SD_EC_DATA_STRIPE_SIZE;
+	}
+
+	/* Encode all the stripes at once, the kernels prefer long strips */
+	{
 		const uint8_t *ds[ed];
 		uint8_t *ps[ep];
 
 		for (j = 0; j < ed; j++)
-			ds[j] = reqs[j].buf + strip_size * i;
-
+			ds[j] = reqs[j].buf;
 		for (j = 0; j < ep; j++)
-			ps[j] = reqs[ed + j].buf + strip_size * i;
-
-		for (j = 0; j < ed; j++)
-			memcpy((uint8_t *)ds[j], p + j * strip_size,
-			       strip_size);
-		ec_encode(ctx, ds, ps);
-		p += SD_EC_DATA_STRIPE_SIZE;
+			ps[j] = reqs[ed + j].buf;
+		ec_encode_buffer(ctx, ds, ps, strip_size * nr_stripe);
 	}
 out:
 	ec_destroy(ctx);
@@ -277,22 +327,220 @@ out:
  * Return success if any read succeed. We don't call gateway_forward_request()
  * because we only read once.
  */
+/*
+ * Replica selection of the reads
+ *
+ * The local copy is read if there is one.  Otherwise the replicas are ranked
+ * by the time they are expected to take, i.e. the smoothed round trip time of
+ * the node times our requests in flight to it plus one, both kept by the
+ * sockfd cache.  A replica in another zone than ours costs twice as much, so
+ * the reads stay within the zone while its nodes aren't much busier.  The
+ * nodes without an RTT sample yet come first so that they get measured, and
+ * the ties are broken randomly.
+ *
+ * With '-H', if the best replica doesn't answer within its 95th percentile
+ * latency, estimated as srtt + 2 * rttvar, the read is sent to the second
+ * best one as well and the first response is used.
+ */
+
+struct read_replica {
+	const struct sd_vnode *v;
+	struct sockfd_load load;
+	uint64_t cost;
+};
+
+static void rank_replicas(struct read_replica *r, int nr)
+{
+	struct read_replica tmp;
+	int i, j;
+
+	for (i = 0; i < nr; i++) {
+		if (!sockfd_cache_load(&r[i].v->node->nid, &r[i].load))
+			memset(&r[i].load, 0, sizeof(r[i].load));
+		r[i].cost = r[i].load.srtt * (r[i].load.nr_in_flight + 1);
+		if (r[i].v->node->zone != sys->this_node.zone)
+			r[i].cost *= 2;
+		/* a suspected node is tried only if all the others fail */
+		if (sockfd_cache_suspect(&r[i].v->node->nid))
+			r[i].cost = UINT64_MAX;
+	}
+
+	/* insertion sort, stable to keep the random order of the ties */
+	for (i = 1; i < nr; i++) {
+		tmp = r[i];
+		for (j = i; j > 0 && r[j - 1].cost > tmp.cost; j--)
+			r[j] = r[j - 1];
+		r[j] = tmp;
+	}
+}
+
+static int replica_read(struct request *req, const struct sd_vnode *v)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint64_t start = clock_get_time();
+	int ret;
+
+	/*
+	 * We need to re-init it because rsp and req share the same
+	 * structure.
+	 */
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	hdr.flags |= SD_FLAG_CMD_SPARSE;
+	if (wire_compress_with(v->node))
+		hdr.flags |= SD_FLAG_CMD_ZSTD;
+	ret = sheep_exec_req(&v->node->nid, &hdr, req->data);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	sockfd_cache_rtt(&v->node->nid, (clock_get_time() - start) / 1000);
+	memcpy(&req->rp, rsp, sizeof(*rsp));
+	return ret;
+}
+
+#ifndef HAVE_ACCELIO
+
+struct hedge {
+	const struct node_id *nid;
+	struct sockfd *sfd;
+	struct sd_req hdr;
+	uint64_t start;
+};
+
+static int hedge_send(struct request *req, struct hedge *h,
+		      const struct sd_vnode *v)
+{
+	h->nid = &v->node->nid;
+	h->sfd = sockfd_cache_get(h->nid);
+	if (!h->sfd)
+		return -1;
+
+	gateway_init_fwd_hdr(&h->hdr, &req->rq);
+	h->start = clock_get_time();
+	if (send_req(h->sfd->fd, &h->hdr, NULL, 0, sheep_need_retry,
+		     h->hdr.epoch, MAX_RETRY_COUNT)) {
+		sockfd_cache_del(h->nid, h->sfd);
+		h->sfd = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Return the index of the first hedge to respond, or -1 on timeout */
+static int hedge_wait(struct hedge *h, int nr, uint64_t timeout_us)
+{
+	struct pollfd pfd[2];
+	struct timespec ts = {
+		.tv_sec = timeout_us / 1000000,
+		.tv_nsec = timeout_us % 1000000 * 1000,
+	};
+	int i, ret;
+
+	for (i = 0; i < nr; i++) {
+		pfd[i].fd = h[i].sfd->fd;
+		pfd[i].events = POLLIN;
+	}
+again:
+	ret = ppoll(pfd, nr, &ts, NULL);
+	if (ret < 0 && errno == EINTR)
+		goto again;
+	if (ret <= 0)
+		return -1;
+
+	for (i = 0; i < nr; i++)
+		if (pfd[i].revents)
+			return i;
+	return -1;
+}
+
+static int hedge_recv(struct request *req, struct hedge *h)
+{
+	struct sd_rsp *rsp = (struct sd_rsp *)&h->hdr;
+	int ret;
+
+	ret = recv_rsp(h->sfd->fd, rsp, req->data, req->rq.data_length,
+		       sheep_need_retry, h->hdr.epoch, MAX_RETRY_COUNT);
+	if (ret) {
+		sd_debug("remote node might have gone away");
+		sockfd_cache_del(h->nid, h->sfd);
+		return SD_RES_NETWORK_ERROR;
+	}
+	sockfd_cache_put(h->nid, h->sfd);
+
+	ret = rsp->result;
+	if (ret != SD_RES_SUCCESS) {
+		sd_warn("failed %s, remote address: %s, op name: %s",
+			sd_strerror(ret), addr_to_str(h->nid->addr,
+						      h->nid->port),
+			op_name(get_sd_op(h->hdr.opcode)));
+		return ret;
+	}
+
+	sockfd_cache_rtt(h->nid, (clock_get_time() - h->start) / 1000);
+	memcpy(&req->rp, rsp, sizeof(*rsp));
+	return ret;
+}
+
+/*
+ * Read from r[0], and from r[1] too if r[0] is slower than usual
+ *
+ * The connection of the replica which loses the race is closed, because its
+ * response is left unread.
+ */
+static int hedged_read(struct request *req, struct read_replica *r,
+		       int *nr_sent)
+{
+	struct hedge h[2];
+	uint64_t delay = r[0].load.srtt + 2 * r[0].load.rttvar;
+	int nr = 1, i, ret;
+
+	*nr_sent = 1;
+	if (hedge_send(req, &h[0], r[0].v) < 0)
+		return SD_RES_NETWORK_ERROR;
+
+	i = hedge_wait(h, nr, delay);
+	if (i < 0) {
+		if (hedge_send(req, &h[1], r[1].v) == 0)
+			nr++;
+		i = hedge_wait(h, nr, MAX_POLLTIME * 1000000ULL);
+	}
+
+	if (i < 0) {
+		sd_err("no replica of %016"PRIx64" responded",
+		       req->rq.obj.oid);
+		ret = SD_RES_NETWORK_ERROR;
+	} else
+		ret = hedge_recv(req, &h[i]);
+
+	if (i != 0)
+		/* the response time of r[0] is at least this long */
+		sockfd_cache_rtt(h[0].nid,
+				 (clock_get_time() - h[0].start) / 1000);
+	for (int j = 0; j < nr; j++)
+		if (j != i)
+			sockfd_cache_drop(h[j].nid, h[j].sfd);
+
+	*nr_sent = nr;
+	return ret;
+}
+
+#endif
+
 static int gateway_replication_read(struct request *req)
 {
 	int i, ret = SD_RES_SUCCESS;
-	struct sd_req fwd_hdr;
-	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
-	const struct sd_vnode *v;
 	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	struct read_replica replicas[SD_MAX_COPIES];
 	uint64_t oid = req->rq.obj.oid;
-	int nr_copies, j;
+	int nr_copies, nr = 0, j;
 
 	nr_copies = get_req_copy_number(req);
+	wait_lagging_writes(oid);
 
-	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
-		v = obj_vnodes[i];
-		if (!vnode_is_local(v))
+		if (!vnode_is_local(obj_vnodes[i]))
 			continue;
 		ret = peer_read_obj(req);
 		if (ret == SD_RES_SUCCESS)
@@ -303,29 +551,28 @@ static int gateway_replication_read(struct request *req)
 		break;
 	}
 
-	/*
-	 * Read random copy from cluster for better load balance, useful for
-	 * reading base VM's COW objects
-	 */
 	j = random();
 	for (i = 0; i < nr_copies; i++) {
-		int idx = (i + j) % nr_copies;
+		const struct sd_vnode *v = obj_vnodes[(i + j) % nr_copies];
 
-		v = obj_vnodes[idx];
-		if (vnode_is_local(v))
-			continue;
-		/*
-		 * We need to re-init it because rsp and req share the same
-		 * structure.
-		 */
-		gateway_init_fwd_hdr(&fwd_hdr, &req->rq);
-		ret = sheep_exec_req(&v->node->nid, &fwd_hdr, req->data);
-		if (ret != SD_RES_SUCCESS)
-			continue;
+		if (!vnode_is_local(v))
+			replicas[nr++].v = v;
+	}
+	rank_replicas(replicas, nr);
 
-		/* Read success */
-		memcpy(&req->rp, rsp, sizeof(*rsp));
-		break;
+	i = 0;
+#ifndef HAVE_ACCELIO
+	if (sys->hedged_read && nr > 1 && replicas[0].load.srtt &&
+	    !(req->rq.flags & SD_FLAG_CMD_WRITE)) {
+		ret = hedged_read(req, replicas, &i);
+		if (ret == SD_RES_SUCCESS)
+			goto out;
+	}
+#endif
+	for (; i < nr; i++) {
+		ret = replica_read(req, replicas[i].v);
+		if (ret == SD_RES_SUCCESS)
+			break;
 	}
 out:
 	return ret;
@@ -333,115 +580,600 @@ out:
 
 #ifndef HAVE_ACCELIO
 
-struct forward_info_entry {
-	struct pollfd pfd;
-	const struct node_id *nid;
-	struct sockfd *sfd;
-	void *buf;
-};
+/*
+ * Range aware erasure read
+ *
+ * A stripe is spread over all the data strips, so reading a stripe needs all
+ * the data nodes.  But for the first and the last stripe of the request we
+ * fetch only the strips which intersect [offset, offset + len), so a read
+ * within a stripe goes only to the nodes holding it.  Parity strips are read
+ * and decoded only when some data strip can't be read.
+ */
 
-struct forward_info {
-	struct forward_info_entry ent[SD_MAX_NODES];
-	int nr_sent;
+struct strip_io {
+	int opcode;		/* peer opcode to send */
+	int idx;		/* ec_index of the strip */
+	int start;		/* the first stripe to read */
+	int nr_stripes;
+	uint8_t *buf;
+	int result;
 };
 
-static inline void forward_info_update(struct forward_info *fi, int pos)
+static inline bool strip_intersects(uint64_t off, uint32_t len, int stripe,
+				    int idx, int strip_size)
 {
-	sd_debug("%d, %d", fi->nr_sent, pos);
-	fi->nr_sent--;
-	memmove(fi->ent + pos, fi->ent + pos + 1,
-		sizeof(struct forward_info_entry) * (fi->nr_sent - pos));
-}
+	uint64_t s = (uint64_t)stripe * SD_EC_DATA_STRIPE_SIZE +
+		idx * strip_size;
 
-static inline void finish_one_entry(struct forward_info *fi, int i)
-{
-	sockfd_cache_put(fi->ent[i].nid, fi->ent[i].sfd);
-	forward_info_update(fi, i);
+	return s < off + len && s + strip_size > off;
 }
 
-static inline void finish_one_entry_err(struct forward_info *fi, int i)
+/* Get the stripes in which the data strip 'idx' intersects the range */
+static bool strip_range(uint64_t off, uint32_t len, int idx, int strip_size,
+			int *first, int *last)
 {
-	sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
-	forward_info_update(fi, i);
-}
+	int start = off / SD_EC_DATA_STRIPE_SIZE;
+	int end = DIV_ROUND_UP(off + len, SD_EC_DATA_STRIPE_SIZE) - 1;
 
-static inline struct forward_info_entry *
-forward_info_find(struct forward_info *fi, int fd)
-{
-	for (int i = 0; i < fi->nr_sent; i++)
-		if (fi->ent[i].pfd.fd == fd)
-			return &fi->ent[i];
+	*first = strip_intersects(off, len, start, idx, strip_size) ?
+		start : start + 1;
+	*last = strip_intersects(off, len, end, idx, strip_size) ?
+		end : end - 1;
 
-	panic("can't find entry for %d", fd);
-	return NULL;
+	return *first <= *last;
 }
 
-struct pfd_info {
-	struct pollfd pfds[SD_MAX_NODES];
-	int nr;
-};
-
-static inline void pfd_info_init(struct forward_info *fi, struct pfd_info *pi)
+/*
+ * Read or write the strips on the nodes in parallel and set the result of
+ * each.  Read data is stored in sr->buf, write data is taken from it.
+ */
+static void erasure_strips_io(struct request *req,
+			      const struct sd_node **target_nodes,
+			      struct strip_io *sr, int nr, int strip_size)
 {
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sockfd *sfd[SD_MAX_COPIES];
+	const struct node_id *nid;
+	uint32_t dlen, wlen;
 	int i;
-	for (i = 0; i < fi->nr_sent; i++)
-		pi->pfds[i] = fi->ent[i].pfd;
-	pi->nr = fi->nr_sent;
+
+	for (i = 0; i < nr; i++) {
+		nid = &target_nodes[sr[i].idx]->nid;
+		sr[i].result = SD_RES_NETWORK_ERROR;
+		sfd[i] = sockfd_cache_get(nid);
+		if (!sfd[i])
+			continue;
+
+		gateway_init_fwd_hdr(&hdr, &req->rq);
+		hdr.opcode = sr[i].opcode;
+		hdr.data_length = sr[i].nr_stripes * strip_size;
+		hdr.obj.offset = sr[i].start * strip_size;
+		hdr.obj.ec_index = sr[i].idx;
+		hdr.obj.copy_policy = req->rq.obj.copy_policy;
+		if (sr[i].opcode == SD_OP_READ_PEER) {
+			hdr.flags &= ~SD_FLAG_CMD_WRITE;
+			wlen = 0;
+		} else {
+			hdr.flags |= SD_FLAG_CMD_WRITE;
+			wlen = hdr.data_length;
+		}
+		if (send_req(sfd[i]->fd, &hdr, sr[i].buf, wlen,
+			     sheep_need_retry, req->rq.epoch,
+			     MAX_RETRY_COUNT)) {
+			sockfd_cache_del(nid, sfd[i]);
+			sfd[i] = NULL;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (!sfd[i])
+			continue;
+
+		nid = &target_nodes[sr[i].idx]->nid;
+		dlen = sr[i].opcode == SD_OP_READ_PEER ?
+			sr[i].nr_stripes * strip_size : 0;
+		if (do_read(sfd[i]->fd, rsp, sizeof(*rsp), sheep_need_retry,
+			    req->rq.epoch, MAX_RETRY_COUNT) ||
+		    rsp->data_length > dlen ||
+		    (rsp->data_length &&
+		     do_read(sfd[i]->fd, sr[i].buf, rsp->data_length,
+			     sheep_need_retry, req->rq.epoch,
+			     MAX_RETRY_COUNT))) {
+			sd_err("remote node might have gone away");
+			sockfd_cache_del(nid, sfd[i]);
+			continue;
+		}
+		sockfd_cache_put(nid, sfd[i]);
+
+		sr[i].result = rsp->result;
+		if (sr[i].result != SD_RES_SUCCESS)
+			sd_err("fail %016"PRIx64" strip %d, %s",
+			       req->rq.obj.oid, sr[i].idx,
+			       sd_strerror(sr[i].result));
+		else if (rsp->data_length < dlen)
+			memset(sr[i].buf + rsp->data_length, 0,
+			       dlen - rsp->data_length);
+	}
 }
 
 /*
- * Wait for all forward requests completion.
- *
- * Even if something goes wrong, we have to wait forward requests completion to
- * avoid interleaved requests.
- *
- * Return error code if any one request fails.
+ * Rebuild the data strips which failed to be read from the other data strips
+ * and the parity strips of the same stripes.  With LRC, if each failed strip
+ * can be rebuilt in its local group, only the rest of the groups are read.
  */
-static int wait_forward_request(struct forward_info *fi, struct request *req)
+static int erasure_read_degraded(struct request *req,
+				 const struct sd_node **target_nodes,
+				 int nr_copies, struct strip_io *sr, int nr,
+				 uint8_t policy, int strip_size)
 {
-	int nr_sent, err_ret = SD_RES_SUCCESS, ret, pollret, i,
-	    repeat = MAX_RETRY_COUNT;
-	struct pfd_info pi;
-	struct sd_rsp *rsp = &req->rp;
+	struct strip_io in[SD_MAX_COPIES];
+	bool failed[SD_MAX_COPIES] = {}, want[SD_MAX_COPIES] = {};
+	uint8_t *bufs[SD_MAX_COPIES];
+	int idxs[SD_MAX_COPIES], set[SD_MAX_COPIES];
+	int first = INT_MAX, last = -1, nr_in = 0, nr_ok, i, k, ed = 0, edp;
+	int ret = SD_RES_NETWORK_ERROR;
+	bool local = true;
+	size_t len;
+	char *lost = NULL;
+	struct fec *ctx;
+
+	edp = ec_policy_to_dp(policy, &ed, NULL);
+	ctx = ec_init_policy(policy);
+	for (i = 0; i < nr; i++) {
+		if (sr[i].result == SD_RES_SUCCESS)
+			continue;
+		failed[sr[i].idx] = true;
+		first = min(first, sr[i].start);
+		last = max(last, sr[i].start + sr[i].nr_stripes - 1);
+		ret = sr[i].result;
+	}
+	len = (last - first + 1) * strip_size;
+
+	for (i = 0; i < nr && local; i++) {
+		if (sr[i].result == SD_RES_SUCCESS)
+			continue;
+		k = ec_repair_set(ctx, sr[i].idx, failed, set);
+		if (!k)
+			local = false;
+		while (k--)
+			want[set[k]] = true;
+	}
+
+	sd_warn("%016"PRIx64", decode stripes %d-%d%s", req->rq.obj.oid,
+		first, last, local ? " locally" : "");
 again:
-	pfd_info_init(fi, &pi);
-	pollret = poll(pi.pfds, pi.nr, 1000 * POLL_TIMEOUT);
-	if (pollret < 0) {
-		if (errno == EINTR)
-			goto again;
+	for (i = 0; i < min(edp, nr_copies); i++) {
+		if (failed[i] || (local && !want[i]))
+			continue;
+		in[nr_in].opcode = SD_OP_READ_PEER;
+		in[nr_in].idx = i;
+		in[nr_in].start = first;
+		in[nr_in].nr_stripes = last - first + 1;
+		in[nr_in].buf = xmalloc(len);
+		nr_in++;
+	}
+	erasure_strips_io(req, target_nodes, in, nr_in, strip_size);
 
-		panic("%m");
-	} else if (pollret == 0) {
-		/*
-		 * If IO NIC is down, epoch isn't incremented, so we can't retry
-		 * for ever.
-		 */
-		if (sheep_need_retry(req->rq.epoch) && repeat) {
-			repeat--;
-			sd_warn("poll timeout %d, disks of some nodes or "
-				"network is busy. Going to poll-wait again",
-				fi->nr_sent);
-			goto again;
+	for (i = 0, nr_ok = 0; i < nr_in; i++) {
+		if (in[i].result != SD_RES_SUCCESS)
+			continue;
+		bufs[nr_ok] = in[i].buf;
+		idxs[nr_ok++] = in[i].idx;
+	}
+	if (local && nr_ok < nr_in) {
+		for (i = 0; i < nr_in; i++)
+			free(in[i].buf);
+		nr_in = 0;
+		local = false;
+		goto again;
+	}
+	if (!local && nr_ok < ed) {
+		sd_err("not enough strips to decode %016"PRIx64", %d/%d",
+		       req->rq.obj.oid, nr_ok, ed);
+		goto out;
+	}
+
+	lost = xmalloc(len);
+	for (i = 0; i < nr; i++) {
+		if (sr[i].result == SD_RES_SUCCESS)
+			continue;
+		if (ec_repair_buffer(ctx, bufs, idxs, nr_ok, lost, sr[i].idx,
+				     len * ed) < 0) {
+			sd_err("failed to decode %016"PRIx64" strip %d",
+			       req->rq.obj.oid, sr[i].idx);
+			goto out;
 		}
+		k = sr[i].start - first;
+		memcpy(sr[i].buf, lost + k * strip_size,
+		       sr[i].nr_stripes * strip_size);
+		sr[i].result = SD_RES_SUCCESS;
+	}
+	ret = SD_RES_SUCCESS;
+out:
+	free(lost);
+	ec_destroy(ctx);
+	for (i = 0; i < nr_in; i++)
+		free(in[i].buf);
+	return ret;
+}
 
-		nr_sent = fi->nr_sent;
-		/* XXX Blindly close all the connections */
-		for (i = 0; i < nr_sent; i++)
-			sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
+static int gateway_erasure_read(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	uint64_t off = req->rq.obj.offset;
+	uint32_t len = req->rq.data_length;
+	uint8_t policy = req->rq.obj.copy_policy ?:
+		get_vdi_copy_policy(oid_to_vid(oid));
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	int nr_copies = get_req_copy_number(req);
+	struct strip_io sr[SD_EC_MAX_STRIP];
+	int ed = 0, strip_size, first, last, nr = 0, i, s,
+	    ret = SD_RES_SUCCESS;
+
+	ec_policy_to_dp(policy, &ed, NULL);
+	if (nr_copies < ed) {
+		sd_err("There isn't enough copies(%d) to read (%d)",
+		       nr_copies, ed);
+		return SD_RES_SYSTEM_ERROR;
+	}
+	strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
+	vinfo_oid_to_nodes(req->vinfo, oid, nr_copies, target_nodes);
 
-		return SD_RES_NETWORK_ERROR;
+	for (i = 0; i < ed; i++) {
+		if (!strip_range(off, len, i, strip_size, &first, &last))
+			continue;
+		sr[nr].opcode = SD_OP_READ_PEER;
+		sr[nr].idx = i;
+		sr[nr].start = first;
+		sr[nr].nr_stripes = last - first + 1;
+		sr[nr].buf = xmalloc(sr[nr].nr_stripes * strip_size);
+		nr++;
 	}
+	sd_debug("%016"PRIx64", off %"PRIu64", len %"PRIu32", %d strips", oid,
+		 off, len, nr);
 
-	nr_sent = fi->nr_sent;
-	for (i = 0; i < nr_sent; i++)
-		if (pi.pfds[i].revents & POLLIN)
+	erasure_strips_io(req, target_nodes, sr, nr, strip_size);
+	for (i = 0; i < nr; i++)
+		if (sr[i].result != SD_RES_SUCCESS)
 			break;
-	if (i < nr_sent) {
-		int re = pi.pfds[i].revents;
-		sd_debug("%d, revents %x", i, re);
-		if (re & (POLLERR | POLLHUP | POLLNVAL)) {
-			err_ret = SD_RES_NETWORK_ERROR;
-			finish_one_entry_err(fi, i);
+	if (i < nr) {
+		ret = erasure_read_degraded(req, target_nodes, nr_copies, sr,
+					    nr, policy, strip_size);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	/* Copy the part of each strip which falls in the request */
+	for (i = 0; i < nr; i++) {
+		for (s = 0; s < sr[i].nr_stripes; s++) {
+			uint64_t a = (uint64_t)(sr[i].start + s) *
+				SD_EC_DATA_STRIPE_SIZE + sr[i].idx * strip_size;
+			uint64_t from = max(a, off);
+			uint64_t to = min(a + strip_size, off + len);
+
+			memcpy((char *)req->data + from - off,
+			       sr[i].buf + s * strip_size + from - a,
+			       to - from);
+		}
+	}
+	req->rp.data_length = len;
+out:
+	for (i = 0; i < nr; i++)
+		free(sr[i].buf);
+	return ret;
+}
+
+/*
+ * Parity update for the partial stripe write
+ *
+ * The parity is a linear function of the data strips, so for
+ * new = old ^ delta we have parity(new) = parity(old) ^ parity(delta).  When
+ * a write doesn't cover some data strips, instead of reading and rewriting the
+ * whole stripes we read the old content of the touched data strips and of the
+ * parity strips only, patch them and write them back in place.  The untouched
+ * strips have zero delta and are never accessed.
+ *
+ * Every strip is written with SD_OP_WRITE_PEER, so a resent write stores the
+ * same content again.  The read-modify-write of the parity must not interleave
+ * with another write of the stripes, so the erasure writes of an object are
+ * serialized on the gateway.  Any failure falls back on the full stripe write,
+ * which recomputes the parity from the data strips.
+ */
+static bool can_write_erasure_delta(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	uint8_t policy = req->rq.obj.copy_policy ?:
+		get_vdi_copy_policy(oid_to_vid(oid));
+	int ed = 0, edp, first, last, i;
+
+	if (req->rq.opcode != SD_OP_WRITE_OBJ)
+		return false;
+
+	edp = ec_policy_to_dp(policy, &ed, NULL);
+	if (get_req_copy_number(req) < edp)
+		return false;
+
+	for (i = 0; i < ed; i++)
+		if (!strip_range(req->rq.obj.offset, req->rq.data_length, i,
+				 SD_EC_DATA_STRIPE_SIZE / ed, &first, &last))
+			return true;
+
+	return false;
+}
+
+static int gateway_erasure_delta_write(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	uint64_t off = req->rq.obj.offset;
+	uint32_t len = req->rq.data_length;
+	uint8_t policy = req->rq.obj.copy_policy ?:
+		get_vdi_copy_policy(oid_to_vid(oid));
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	struct strip_io sr[SD_MAX_COPIES];
+	uint8_t *ds[SD_EC_MAX_STRIP] = {}, *ps[SD_EC_MAX_STRIP] = {};
+	bool touched[SD_EC_MAX_STRIP] = {};
+	int ed = 0, ep = 0, strip_size, first, last, nr = 0, nr_data, i, s,
+	    start = INT_MAX, end = -1, ret = SD_RES_SUCCESS;
+	size_t dlen;
+	struct fec *ctx;
+
+	ec_policy_to_dp(policy, &ed, &ep);
+	strip_size = SD_EC_DATA_STRIPE_SIZE / ed;
+	vinfo_oid_to_nodes(req->vinfo, oid, get_req_copy_number(req),
+			   target_nodes);
+
+	/* Read the old content of the data strips to be written */
+	for (i = 0; i < ed; i++) {
+		if (!strip_range(off, len, i, strip_size, &first, &last))
+			continue;
+		sr[nr].opcode = SD_OP_READ_PEER;
+		sr[nr].idx = i;
+		sr[nr].start = first;
+		sr[nr].nr_stripes = last - first + 1;
+		sr[nr].buf = xmalloc(sr[nr].nr_stripes * strip_size);
+		start = min(start, first);
+		end = max(end, last);
+		nr++;
+	}
+	nr_data = nr;
+	dlen = (end - start + 1) * strip_size;
+
+	/*
+	 * Read the old content of the parity strips over the same stripes too.
+	 * The local parities of LRC of the untouched groups don't change, so
+	 * they are skipped.
+	 */
+	ctx = ec_init_policy(policy);
+	for (i = 0; i < nr_data && ctx->nr_local; i++)
+		touched[sr[i].idx / (ed / ctx->nr_local)] = true;
+	for (i = 0; i < ep; i++) {
+		ps[i] = xmalloc(dlen);
+		if (ed + i >= ctx->dp && !touched[ed + i - ctx->dp])
+			continue;
+		sr[nr].opcode = SD_OP_READ_PEER;
+		sr[nr].idx = ed + i;
+		sr[nr].start = start;
+		sr[nr].nr_stripes = end - start + 1;
+		sr[nr].buf = xmalloc(dlen);
+		nr++;
+	}
+	sd_debug("%016"PRIx64", off %"PRIu64", len %"PRIu32", %d strips", oid,
+		 off, len, nr);
+
+	erasure_strips_io(req, target_nodes, sr, nr, strip_size);
+	for (i = 0; i < nr; i++)
+		if (sr[i].result != SD_RES_SUCCESS)
+			goto fallback;
+
+	/* Patch the new data into the strips and compute the data deltas */
+	for (i = 0; i < ed; i++)
+		ds[i] = xzalloc(dlen);
+	for (i = 0; i < nr_data; i++) {
+		uint8_t *delta = ds[sr[i].idx] + (sr[i].start - start) *
+			strip_size;
+
+		for (s = 0; s < sr[i].nr_stripes; s++) {
+			uint64_t a = (uint64_t)(sr[i].start + s) *
+				SD_EC_DATA_STRIPE_SIZE + sr[i].idx * strip_size;
+			uint64_t from = max(a, off);
+			uint64_t to = min(a + strip_size, off + len);
+			uint8_t *old = sr[i].buf + s * strip_size + from - a;
+			const uint8_t *new = (uint8_t *)req->data + from - off;
+			uint8_t *d = delta + s * strip_size + from - a;
+
+			for (uint64_t k = 0; k < to - from; k++) {
+				d[k] = old[k] ^ new[k];
+				old[k] = new[k];
+			}
+		}
+	}
+
+	/* Compute the parity of the deltas and add it to the parity strips */
+	ec_encode_buffer(ctx, (const uint8_t **)ds, ps, dlen);
+	for (i = nr_data; i < nr; i++) {
+		const uint8_t *p = ps[sr[i].idx - ed];
+
+		for (size_t k = 0; k < dlen; k++)
+			sr[i].buf[k] ^= p[k];
+	}
+
+	for (i = 0; i < nr; i++)
+		sr[i].opcode = SD_OP_WRITE_PEER;
+	erasure_strips_io(req, target_nodes, sr, nr, strip_size);
+	for (i = 0; i < nr; i++)
+		if (sr[i].result != SD_RES_SUCCESS)
+			goto fallback;
+	goto out;
+fallback:
+	/*
+	 * The full stripe write recomputes the parity from the data strips,
+	 * which also repairs the parity if only some strips were written.
+	 */
+	sd_warn("%016"PRIx64", fall back on the full stripe write", oid);
+	ret = gateway_forward_request(req);
+out:
+	ec_destroy(ctx);
+	for (i = 0; i < nr; i++)
+		free(sr[i].buf);
+	for (i = 0; i < ed; i++)
+		free(ds[i]);
+	for (i = 0; i < ep; i++)
+		free(ps[i]);
+	return ret;
+}
+
+#define NR_EC_WRITE_LOCKS 64
+
+static struct sd_mutex ec_write_locks[NR_EC_WRITE_LOCKS] = {
+	[0 ... NR_EC_WRITE_LOCKS - 1] = SD_MUTEX_INITIALIZER
+};
+
+/*
+ * Both the partial and the full stripe write read the old strips before
+ * writing them, so the erasure writes of an object don't run in parallel.
+ */
+static int gateway_erasure_write(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	struct sd_mutex *lock;
+	int ret;
+
+	lock = &ec_write_locks[sd_hash_oid(oid) % NR_EC_WRITE_LOCKS];
+	sd_mutex_lock(lock);
+	if (can_write_erasure_delta(req))
+		ret = gateway_erasure_delta_write(req);
+	else
+		ret = gateway_forward_request(req);
+	sd_mutex_unlock(lock);
+	return ret;
+}
+
+#else  /* HAVE_ACCELIO */
+
+static inline int gateway_erasure_read(struct request *req)
+{
+	return gateway_forward_request(req);
+}
+
+static inline int gateway_erasure_write(struct request *req)
+{
+	return gateway_forward_request(req);
+}
+
+#endif	/* HAVE_ACCELIO */
+
+#ifndef HAVE_ACCELIO
+
+struct forward_info_entry {
+	struct pollfd pfd;
+	const struct node_id *nid;
+	struct sockfd *sfd;
+	void *buf;
+};
+
+struct forward_info {
+	struct forward_info_entry ent[SD_MAX_NODES];
+	int nr_sent;
+};
+
+static inline void forward_info_update(struct forward_info *fi, int pos)
+{
+	sd_debug("%d, %d", fi->nr_sent, pos);
+	fi->nr_sent--;
+	memmove(fi->ent + pos, fi->ent + pos + 1,
+		sizeof(struct forward_info_entry) * (fi->nr_sent - pos));
+}
+
+static inline void finish_one_entry(struct forward_info *fi, int i)
+{
+	sockfd_cache_put(fi->ent[i].nid, fi->ent[i].sfd);
+	forward_info_update(fi, i);
+}
+
+static inline void finish_one_entry_err(struct forward_info *fi, int i)
+{
+	sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
+	forward_info_update(fi, i);
+}
+
+static inline struct forward_info_entry *
+forward_info_find(struct forward_info *fi, int fd)
+{
+	for (int i = 0; i < fi->nr_sent; i++)
+		if (fi->ent[i].pfd.fd == fd)
+			return &fi->ent[i];
+
+	panic("can't find entry for %d", fd);
+	return NULL;
+}
+
+struct pfd_info {
+	struct pollfd pfds[SD_MAX_NODES];
+	int nr;
+};
+
+static inline void pfd_info_init(struct forward_info *fi, struct pfd_info *pi)
+{
+	int i;
+	for (i = 0; i < fi->nr_sent; i++)
+		pi->pfds[i] = fi->ent[i].pfd;
+	pi->nr = fi->nr_sent;
+}
+
+/*
+ * Wait for all forward requests completion.
+ *
+ * Even if something goes wrong, we have to wait forward requests completion to
+ * avoid interleaved requests.
+ *
+ * Return error code if any one request fails.
+ */
+static int wait_forward_request(struct forward_info *fi, struct request *req)
+{
+	int nr_sent, err_ret = SD_RES_SUCCESS, ret, pollret, i,
+	    repeat = MAX_RETRY_COUNT;
+	struct pfd_info pi;
+	struct sd_rsp *rsp = &req->rp;
+again:
+	pfd_info_init(fi, &pi);
+	pollret = poll(pi.pfds, pi.nr, 1000 * POLL_TIMEOUT);
+	if (pollret < 0) {
+		if (errno == EINTR)
+			goto again;
+
+		panic("%m");
+	} else if (pollret == 0) {
+		/*
+		 * If IO NIC is down, epoch isn't incremented, so we can't retry
+		 * for ever.
+		 */
+		if (sheep_need_retry(req->rq.epoch) && repeat) {
+			repeat--;
+			sd_warn("poll timeout %d, disks of some nodes or "
+				"network is busy. Going to poll-wait again",
+				fi->nr_sent);
+			goto again;
+		}
+
+		nr_sent = fi->nr_sent;
+		/* XXX Blindly close all the connections */
+		for (i = 0; i < nr_sent; i++)
+			sockfd_cache_del(fi->ent[i].nid, fi->ent[i].sfd);
+
+		return SD_RES_NETWORK_ERROR;
+	}
+
+	nr_sent = fi->nr_sent;
+	for (i = 0; i < nr_sent; i++)
+		if (pi.pfds[i].revents & POLLIN)
+			break;
+	if (i < nr_sent) {
+		int re = pi.pfds[i].revents;
+		sd_debug("%d, revents %x", i, re);
+		if (re & (POLLERR | POLLHUP | POLLNVAL)) {
+			err_ret = SD_RES_NETWORK_ERROR;
+			finish_one_entry_err(fi, i);
 			goto out;
 		}
 		if (do_read(pi.pfds[i].fd, rsp, sizeof(*rsp), sheep_need_retry,
@@ -451,6 +1183,7 @@ again:
 			finish_one_entry_err(fi, i);
 			goto out;
 		}
+		fwd_zstd_answer(fi->ent[i].nid, rsp);
 
 		if (rsp->data_length) {
 			struct forward_info_entry *ent;
@@ -502,7 +1235,7 @@ forward_info_advance(struct forward_info *fi, const struct node_id *nid,
 
 #endif	/* HAVE_ACCELIO */
 
-static int gateway_forward_request(struct request *req)
+int gateway_forward_request(struct request *req)
 {
 	int i, err_ret = SD_RES_SUCCESS;
 	uint64_t oid = req->rq.obj.oid;
@@ -515,15 +1248,19 @@ static int gateway_forward_request(struct request *req)
 	struct xio_context *ctx;
 	struct xio_forward_info xio_fi;
 #else
-	unsigned wlen;
+	uint32_t wlen;
 	int ret;
 	struct forward_info fi;
+	struct fwd_frame frame = {};
 #endif
 
 	sd_debug("%016"PRIx64, oid);
 
+	wait_lagging_writes(oid);
+
+	request_stage(req, REQ_STAGE_FORWARD);
 	gateway_init_fwd_hdr(&hdr, &req->rq);
-	oid_to_nodes(oid, &req->vinfo->vroot, nr_copies, target_nodes);
+	vinfo_oid_to_nodes(req->vinfo, oid, nr_copies, target_nodes);
 #ifndef HAVE_ACCELIO
 	forward_info_init(&fi, nr_copies);
 #endif
@@ -558,6 +1295,7 @@ static int gateway_forward_request(struct request *req)
 	for (i = 0; i < nr_to_send; i++) {
 		struct sockfd *sfd;
 		const struct node_id *nid;
+		void *buf;
 
 		nid = &target_nodes[i]->nid;
 		sfd = sockfd_cache_get(nid);
@@ -571,9 +1309,10 @@ static int gateway_forward_request(struct request *req)
 		hdr.obj.offset = reqs[i].off;
 		hdr.obj.ec_index = i;
 		hdr.obj.copy_policy = req->rq.obj.copy_policy;
-		ret = send_req(sfd->fd, &hdr, reqs[i].buf, wlen,
-			       sheep_need_retry, req->rq.epoch,
-			       MAX_RETRY_COUNT);
+		buf = fwd_payload(target_nodes[i], &hdr, reqs[i].buf, &wlen,
+				  &frame);
+		ret = send_req(sfd->fd, &hdr, buf, wlen, sheep_need_retry,
+			       req->rq.epoch, MAX_RETRY_COUNT);
 		if (ret) {
 			sockfd_cache_del_node(nid);
 			err_ret = SD_RES_NETWORK_ERROR;
@@ -583,6 +1322,8 @@ static int gateway_forward_request(struct request *req)
 		forward_info_advance(&fi, nid, sfd, reqs[i].buf);
 	}
 
+	free(frame.buf);
+
 	sd_debug("nr_sent %d, err %x", fi.nr_sent, err_ret);
 	if (fi.nr_sent > 0) {
 		ret = wait_forward_request(&fi, req);
@@ -644,66 +1385,953 @@ static int gateway_forward_request(struct request *req)
 #endif	/* HAVE_ACCELIO */
 
 out:
+	request_stage(req, REQ_STAGE_REPLY);
 	finish_requests(req, reqs, nr_reqs);
 	return err_ret;
 }
 
-static int prepare_obj_refcnt(const struct sd_req *hdr, uint32_t *vids,
-			      struct generation_reference *refs)
+/*
+ * Vectored write of object ranges (SD_OP_WRITE_OBJS)
+ *
+ * Instead of forwarding every object to its replicas one by one, each node
+ * gets a single SD_OP_WRITE_PEER_BATCH carrying all the ranges it holds a
+ * replica of, and the batches are sent in parallel.  The objects which need
+ * more than a plain replicated write (erasure coded, cached and vdi objects)
+ * go through SD_OP_WRITE_OBJ.
+ */
+
+struct obj_vec_batch {
+	const struct sd_node *node;
+	uint32_t nr;
+	uint32_t wlen;
+	uint8_t idx[SD_MAX_OBJ_VEC];	/* entries of req->vec */
+	char *buf;
+};
+
+#ifndef HAVE_ACCELIO
+
+static bool obj_vec_write_fallback(struct request *req, uint64_t oid)
 {
-	int ret;
-	size_t nr_vids = hdr->data_length / sizeof(*vids);
-	uint64_t offset;
-	int start;
+	return is_erasure_oid(oid) || is_vdi_obj(oid) ||
+		!bypass_object_cache_oid(req, oid);
+}
 
-	offset = hdr->obj.offset - offsetof(struct sd_inode, data_vdi_id);
-	start = offset / sizeof(*vids);
+/* Group the replicas by node and copy the vector and ranges of each node */
+static int obj_vec_prepare_batches(struct request *req, const bool *fallback,
+				   const uint32_t *off,
+				   struct obj_vec_batch *batches)
+{
+	const struct sd_obj_vec *vec = req->vec;
+	const struct sd_node *target_nodes[SD_MAX_COPIES];
+	uint32_t nr_vec = req->rq.vec.nr;
+	char *data = (char *)req->data + sizeof(*vec) * nr_vec;
+	int nr_batches = 0, nr_copies, i, j;
+
+	for (uint32_t k = 0; k < nr_vec; k++) {
+		if (fallback[k])
+			continue;
 
-	ret = sd_read_object_fwd(hdr->obj.oid, (char *)vids,
-				 nr_vids * sizeof(vids[0]),
-				 offsetof(struct sd_inode, data_vdi_id[start]));
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read vdi, %016" PRIx64, hdr->obj.oid);
-		return ret;
+		nr_copies = get_obj_copy_number(vec[k].oid,
+						req->vinfo->nr_zones);
+		vinfo_oid_to_nodes(req->vinfo, vec[k].oid, nr_copies,
+				   target_nodes);
+		for (i = 0; i < nr_copies; i++) {
+			for (j = 0; j < nr_batches; j++)
+				if (node_eq(batches[j].node, target_nodes[i]))
+					break;
+			if (j == nr_batches)
+				batches[nr_batches++].node = target_nodes[i];
+			batches[j].idx[batches[j].nr++] = k;
+			batches[j].wlen += vec[k].length;
+		}
 	}
 
-	ret = sd_read_object_fwd(hdr->obj.oid, (char *)refs,
-				 nr_vids * sizeof(refs[0]),
-				 offsetof(struct sd_inode, gref[start]));
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read vdi, %016" PRIx64, hdr->obj.oid);
-		return ret;
+	for (i = 0; i < nr_batches; i++) {
+		struct obj_vec_batch *b = batches + i;
+		struct sd_obj_vec *bvec;
+		char *p;
+
+		b->buf = xvalloc(sizeof(*bvec) * b->nr + b->wlen);
+		bvec = (struct sd_obj_vec *)b->buf;
+		p = b->buf + sizeof(*bvec) * b->nr;
+		for (j = 0; j < b->nr; j++) {
+			const struct sd_obj_vec *v = vec + b->idx[j];
+
+			bvec[j] = *v;
+			memcpy(p, data + off[b->idx[j]], v->length);
+			p += v->length;
+		}
 	}
 
-	return ret;
+	return nr_batches;
 }
 
-/*
- * This function decreases a refcnt of vid_to_data_oid(old_vid, idx) and
- * increases one of vid_to_data_oid(new_vid, idx)
- */
-static void update_obj_refcnt(uint64_t offset, int start,
-			     size_t nr_vids, uint32_t *vids, uint32_t *new_vids,
-			     struct generation_reference *refs)
+static bool obj_vec_remove_fallback(uint64_t oid)
 {
-	int i, ret = SD_RES_SUCCESS;
-
-	for (i = 0; i < nr_vids; i++) {
-		if (vids[i] == 0 || vids[i] == new_vids[i])
-			continue;
-
-		ret = sd_dec_object_refcnt(vid_to_data_oid(vids[i], i + start),
-					   refs[i].generation, refs[i].count);
-		if (ret != SD_RES_SUCCESS)
-			sd_err("fail, %d", ret);
-	}
+	return is_erasure_oid(oid);
 }
 
-static bool is_inode_refresh_req(struct request *req)
+static int obj_vec_send_batches(struct request *req, uint8_t opcode,
+				struct obj_vec_batch *batches, int nr_batches)
 {
-	uint64_t oid = req->rq.obj.oid;
-	uint32_t data_length = req->rq.data_length;
-	uint32_t offset = req->rq.obj.offset;
+	int err_ret = SD_RES_SUCCESS, ret;
+	struct forward_info fi;
+	struct sd_req hdr;
+
+	forward_info_init(&fi, nr_batches);
+	for (int i = 0; i < nr_batches; i++) {
+		struct obj_vec_batch *b = batches + i;
+		const struct node_id *nid = &b->node->nid;
+		struct sockfd *sfd;
+
+		sfd = sockfd_cache_get(nid);
+		if (!sfd) {
+			err_ret = SD_RES_NETWORK_ERROR;
+			break;
+		}
+
+		sd_init_req(&hdr, opcode);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.epoch = req->rq.epoch;
+		hdr.data_length = sizeof(struct sd_obj_vec) * b->nr + b->wlen;
+		hdr.vec.nr = b->nr;
+		ret = send_req(sfd->fd, &hdr, b->buf, hdr.data_length,
+			       sheep_need_retry, req->rq.epoch,
+			       MAX_RETRY_COUNT);
+		if (ret) {
+			sockfd_cache_del_node(nid);
+			err_ret = SD_RES_NETWORK_ERROR;
+			sd_debug("fail %d", ret);
+			break;
+		}
+		forward_info_advance(&fi, nid, sfd, b->buf);
+	}
+
+	if (fi.nr_sent > 0) {
+		ret = wait_forward_request(&fi, req);
+		if (ret != SD_RES_SUCCESS)
+			err_ret = ret;
+	}
+
+	return err_ret;
+}
+
+#else
+
+static inline bool obj_vec_write_fallback(struct request *req, uint64_t oid)
+{
+	return true;
+}
+
+static inline int obj_vec_prepare_batches(struct request *req,
+					  const bool *fallback,
+					  const uint32_t *off,
+					  struct obj_vec_batch *batches)
+{
+	return 0;
+}
+
+static inline bool obj_vec_remove_fallback(uint64_t oid)
+{
+	return true;
+}
+
+static inline int obj_vec_send_batches(struct request *req, uint8_t opcode,
+				       struct obj_vec_batch *batches,
+				       int nr_batches)
+{
+	return SD_RES_SUCCESS;
+}
+
+#endif	/* HAVE_ACCELIO */
+
+int gateway_write_objs(struct request *req)
+{
+	const struct sd_obj_vec *vec = req->vec;
+	uint32_t nr_vec = req->rq.vec.nr, off[SD_MAX_OBJ_VEC], pos = 0, i;
+	char *data = (char *)req->data + sizeof(*vec) * nr_vec;
+	bool fallback[SD_MAX_OBJ_VEC];
+	struct obj_vec_batch *batches;
+	int nr_batches, max_batches = 0, ret;
+	struct sd_req hdr;
+
+	for (i = 0; i < nr_vec; i++) {
+		uint64_t oid = vec[i].oid;
+
+		if ((req->rq.flags & SD_FLAG_CMD_TGT) &&
+		    is_refresh_required(oid_to_vid(oid))) {
+			sd_debug("refresh is required: %016"PRIx64, oid);
+			return SD_RES_INODE_INVALIDATED;
+		}
+
+		if (oid_is_readonly(oid))
+			return SD_RES_READONLY;
+
+		wait_lagging_writes(oid);
+		off[i] = pos;
+		pos += vec[i].length;
+		fallback[i] = obj_vec_write_fallback(req, oid);
+		if (!fallback[i]) {
+			precopy_account(req, oid);
+			max_batches += get_obj_copy_number(oid,
+						req->vinfo->nr_zones);
+		}
+	}
+
+	batches = xzalloc(sizeof(*batches) * (max_batches ?: 1));
+	nr_batches = obj_vec_prepare_batches(req, fallback, off, batches);
+	ret = obj_vec_send_batches(req, SD_OP_WRITE_PEER_BATCH, batches,
+				   nr_batches);
+	for (int n = 0; n < nr_batches; n++)
+		free(batches[n].buf);
+	free(batches);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	for (i = 0; i < nr_vec; i++) {
+		if (!fallback[i])
+			continue;
+
+		sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+		hdr.flags = req->rq.flags;
+		hdr.data_length = vec[i].length;
+		hdr.obj.oid = vec[i].oid;
+		hdr.obj.offset = vec[i].offset;
+		ret = exec_local_req(&hdr, data + off[i]);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+#ifndef HAVE_ACCELIO
+
+/*
+ * Non-blocking forwarding of replicated writes
+ *
+ * gateway_forward_request() keeps the gateway worker in poll() until all the
+ * replicas respond, so the number of in-flight writes is capped by the number
+ * of gateway threads.  For replicated data object writes, we instead send the
+ * request to all the replicas and let the worker go.  The responses are
+ * collected by a completion thread with epoll and the request is finished in
+ * gateway_op_done() when both the worker and the completion thread are done
+ * with it.
+ *
+ * The writes of a vdi created with 'dog vdi create -Q n' are finished once n
+ * replicas succeed.  The pending replicas are then moved to a lagging
+ * fwd_async, which has no request and is left to the completion thread, and a
+ * replica which fails or times out there is repaired from one which succeeded
+ * with SD_OP_REPAIR_REPLICA.  Until then the object is busy: its next read or
+ * write through this gateway waits, so that the writes aren't reordered on the
+ * lagging replica and the replica isn't read stale.
+ */
+
+struct fwd_async_entry {
+	struct node_id nid;
+	struct sockfd *sfd;
+	struct fwd_async *fa;
+	int result;
+	bool done;
+};
+
+struct fwd_async {
+	struct request *req; /* NULL for the lagging replicas and the repairs */
+	uint64_t oid;
+	uint32_t epoch;
+	struct fwd_async_entry ent[SD_MAX_COPIES];
+	int nr_sent;
+	int nr_pending; /* only touched by the completion thread */
+	int nr_ok;
+	int quorum; /* zero to wait for all the replicas */
+	struct node_id src; /* a replica which has the data of the lagging */
+	int err_ret;
+	bool armed;
+	bool repair;
+	time_t start;
+	int refcnt; /* only touched by the main thread */
+	struct list_node pending_list;
+	struct list_node done_list;
+};
+
+static int fwd_epfd = -1, fwd_done_efd = -1;
+static LIST_HEAD(fwd_pending_list);
+static struct sd_mutex fwd_pending_lock = SD_MUTEX_INITIALIZER;
+static LIST_HEAD(fwd_done_list);
+static struct sd_mutex fwd_done_lock = SD_MUTEX_INITIALIZER;
+
+/* The lagging writes and repairs of the objects, counted by the oid hash */
+#define NR_LAGGING_HASH 1024
+
+static int nr_lagging[NR_LAGGING_HASH];
+static int nr_lagging_total;
+static struct sd_mutex lagging_lock = SD_MUTEX_INITIALIZER;
+static struct sd_cond lagging_cond = SD_COND_INITIALIZER;
+
+static void lagging_get(uint64_t oid)
+{
+	sd_mutex_lock(&lagging_lock);
+	nr_lagging[sd_hash_oid(oid) % NR_LAGGING_HASH]++;
+	uatomic_inc(&nr_lagging_total);
+	sd_mutex_unlock(&lagging_lock);
+}
+
+static void lagging_put(uint64_t oid)
+{
+	sd_mutex_lock(&lagging_lock);
+	nr_lagging[sd_hash_oid(oid) % NR_LAGGING_HASH]--;
+	uatomic_dec(&nr_lagging_total);
+	sd_cond_broadcast(&lagging_cond);
+	sd_mutex_unlock(&lagging_lock);
+}
+
+/* Wait until all the replicas of the object have caught up */
+static void wait_lagging_writes(uint64_t oid)
+{
+	int *nr = &nr_lagging[sd_hash_oid(oid) % NR_LAGGING_HASH];
+
+	if (!uatomic_read(&nr_lagging_total))
+		return;
+
+	sd_mutex_lock(&lagging_lock);
+	while (*nr)
+		sd_cond_wait(&lagging_cond, &lagging_lock);
+	sd_mutex_unlock(&lagging_lock);
+}
+
+static bool can_forward_async(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+
+	if (fwd_epfd < 0)
+		return false;
+
+	if (!is_data_obj(oid) || is_erasure_oid(oid))
+		return false;
+
+	switch (req->rq.opcode) {
+	case SD_OP_WRITE_OBJ:
+		return true;
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		return !(req->rq.flags & SD_FLAG_CMD_COW);
+	default:
+		return false;
+	}
+}
+
+/* Add the sent entries of 'fa' to the completion thread */
+static void fwd_async_arm(struct fwd_async *fa)
+{
+	fa->nr_pending = fa->nr_sent;
+	fa->start = time(NULL);
+
+	sd_mutex_lock(&fwd_pending_lock);
+	list_add_tail(&fa->pending_list, &fwd_pending_list);
+	sd_mutex_unlock(&fwd_pending_lock);
+
+	for (int i = 0; i < fa->nr_sent; i++) {
+		struct epoll_event ev = {
+			.events = EPOLLIN | EPOLLONESHOT,
+			.data.ptr = &fa->ent[i],
+		};
+
+		if (epoll_ctl(fwd_epfd, EPOLL_CTL_ADD, fa->ent[i].sfd->fd,
+			      &ev) < 0)
+			panic("failed to add %d, %m", fa->ent[i].sfd->fd);
+	}
+
+	/* the completion thread can time out the entries from now on */
+	sd_mutex_lock(&fwd_pending_lock);
+	fa->armed = true;
+	sd_mutex_unlock(&fwd_pending_lock);
+}
+
+static int gateway_forward_request_async(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	int nr_copies = get_req_copy_number(req), i, ret,
+	    err_ret = SD_RES_SUCCESS;
+	struct sd_req hdr;
+	struct fwd_async *fa;
+	struct fwd_frame frame = {};
+
+	sd_debug("%016"PRIx64, oid);
+
+	wait_lagging_writes(oid);
+
+	request_stage(req, REQ_STAGE_FORWARD);
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	vinfo_oid_to_nodes(req->vinfo, oid, nr_copies, target_nodes);
+
+	fa = xzalloc(sizeof(*fa));
+	fa->req = req;
+	fa->oid = oid;
+	fa->epoch = req->rq.epoch;
+	fa->refcnt = 2;
+
+	for (i = 0; i < nr_copies; i++) {
+		const struct node_id *nid = &target_nodes[i]->nid;
+		struct fwd_async_entry *ent;
+		struct sockfd *sfd;
+		uint32_t wlen = req->rq.data_length;
+		void *buf;
+
+		sfd = sockfd_cache_get(nid);
+		if (!sfd) {
+			err_ret = SD_RES_NETWORK_ERROR;
+			break;
+		}
+
+		hdr.data_length = wlen;
+		hdr.obj.ec_index = i;
+		hdr.obj.copy_policy = req->rq.obj.copy_policy;
+		buf = fwd_payload(target_nodes[i], &hdr, req->data, &wlen,
+				  &frame);
+		ret = send_req(sfd->fd, &hdr, buf, wlen, sheep_need_retry,
+			       req->rq.epoch, MAX_RETRY_COUNT);
+		if (ret) {
+			sockfd_cache_del_node(nid);
+			err_ret = SD_RES_NETWORK_ERROR;
+			sd_debug("fail %d", ret);
+			break;
+		}
+
+		ent = &fa->ent[fa->nr_sent++];
+		ent->nid = *nid;
+		ent->sfd = sfd;
+		ent->fa = fa;
+	}
+	free(frame.buf);
+
+	sd_debug("nr_sent %d, err %x", fa->nr_sent, err_ret);
+	if (!fa->nr_sent) {
+		free(fa);
+		return err_ret;
+	}
+
+	fa->err_ret = err_ret;
+	if (!(req->rq.flags & SD_FLAG_CMD_PIGGYBACK))
+		fa->quorum = get_vdi_write_quorum(oid_to_vid(oid));
+	req->fwd_async = fa;
+	fwd_async_arm(fa);
+
+	return SD_RES_SUCCESS;
+}
+
+static void fwd_async_finish_entry(struct fwd_async_entry *ent, int ret,
+				   bool broken)
+{
+	struct fwd_async *fa = ent->fa;
+
+	if (ent->done)
+		return;
+
+	epoll_ctl(fwd_epfd, EPOLL_CTL_DEL, ent->sfd->fd, NULL);
+	if (broken)
+		sockfd_cache_del(&ent->nid, ent->sfd);
+	else
+		sockfd_cache_put(&ent->nid, ent->sfd);
+
+	ent->result = ret;
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("fail %016"PRIx64", %s", fa->oid, sd_strerror(ret));
+		fa->err_ret = ret;
+	} else
+		fa->nr_ok++;
+
+	ent->done = true;
+	if (!--fa->nr_pending && fa->req)
+		request_stage(fa->req, REQ_STAGE_REPLY);
+}
+
+static void fwd_async_handle_event(struct fwd_async_entry *ent,
+				   uint32_t events)
+{
+	uint32_t epoch = ent->fa->epoch;
+	int fd = ent->sfd->fd;
+	struct sd_rsp rsp;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		fwd_async_finish_entry(ent, SD_RES_NETWORK_ERROR, true);
+		return;
+	}
+
+	if (do_read(fd, &rsp, sizeof(rsp), sheep_need_retry, epoch,
+		    MAX_RETRY_COUNT)) {
+		sd_err("remote node might have gone away");
+		fwd_async_finish_entry(ent, SD_RES_NETWORK_ERROR, true);
+		return;
+	}
+	fwd_zstd_answer(&ent->nid, &rsp);
+
+	if (rsp.data_length) {
+		/* write requests don't expect data, drain it */
+		char *buf = xmalloc(rsp.data_length);
+		int ret = do_read(fd, buf, rsp.data_length, sheep_need_retry,
+				  epoch, MAX_RETRY_COUNT);
+
+		free(buf);
+		if (ret) {
+			sd_err("remote node might have gone away");
+			fwd_async_finish_entry(ent, SD_RES_NETWORK_ERROR,
+					       true);
+			return;
+		}
+	}
+
+	fwd_async_finish_entry(ent, rsp.result, false);
+}
+
+static bool fwd_async_timed_out(struct fwd_async *fa, time_t now)
+{
+	if (!fa->armed || now - fa->start < POLL_TIMEOUT)
+		return false;
+
+	/* wait longer like wait_forward_request() if retry is allowed */
+	if (sheep_need_retry(fa->epoch) && now - fa->start < MAX_POLLTIME)
+		return false;
+
+	return true;
+}
+
+/*
+ * Move the pending entries of a write which has reached its quorum to a new
+ * lagging fwd_async, so that the write can be finished
+ */
+static void fwd_async_detach_lagging(struct fwd_async *fa)
+{
+	struct fwd_async *lag = xzalloc(sizeof(*lag));
+
+	lag->oid = fa->oid;
+	lag->epoch = fa->epoch;
+	lag->start = fa->start;
+	lag->armed = true;
+
+	for (int i = 0; i < fa->nr_sent; i++) {
+		struct fwd_async_entry *ent = &fa->ent[i], *new;
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+
+		if (ent->done) {
+			if (ent->result == SD_RES_SUCCESS)
+				lag->src = ent->nid;
+			continue;
+		}
+
+		new = &lag->ent[lag->nr_sent++];
+		new->nid = ent->nid;
+		new->sfd = ent->sfd;
+		new->fa = lag;
+		ev.data.ptr = new;
+		if (epoll_ctl(fwd_epfd, EPOLL_CTL_MOD, new->sfd->fd, &ev) < 0)
+			panic("failed to modify %d, %m", new->sfd->fd);
+
+		ent->done = true;
+		fa->nr_pending--;
+	}
+	lag->nr_pending = lag->nr_sent;
+
+	sd_debug("%016"PRIx64", %d replicas lagging", lag->oid, lag->nr_sent);
+	lagging_get(lag->oid);
+	list_add_tail(&lag->pending_list, &fwd_pending_list);
+}
+
+/* Have the failed lagging replicas copy the object from a good one */
+static void fwd_async_repair(struct fwd_async *lag)
+{
+	struct fwd_async *fa;
+	struct sd_req hdr;
+
+	fa = xzalloc(sizeof(*fa));
+	fa->oid = lag->oid;
+	fa->epoch = lag->epoch;
+	fa->repair = true;
+
+	for (int i = 0; i < lag->nr_sent; i++) {
+		const struct fwd_async_entry *ent = &lag->ent[i];
+		struct sockfd *sfd;
+
+		if (ent->result == SD_RES_SUCCESS)
+			continue;
+
+		sd_init_req(&hdr, SD_OP_REPAIR_REPLICA);
+		hdr.epoch = lag->epoch;
+		memcpy(hdr.forw.addr, lag->src.addr, sizeof(hdr.forw.addr));
+		hdr.forw.port = lag->src.port;
+		hdr.forw.oid = lag->oid;
+
+		sfd = sockfd_cache_get(&ent->nid);
+		if (!sfd || send_req(sfd->fd, &hdr, NULL, 0, NULL, 0,
+				     MAX_RETRY_COUNT)) {
+			sd_err("failed to repair %016"PRIx64" on %s",
+			       lag->oid, addr_to_str(ent->nid.addr,
+						     ent->nid.port));
+			if (sfd)
+				sockfd_cache_del(&ent->nid, sfd);
+			continue;
+		}
+
+		fa->ent[fa->nr_sent].nid = ent->nid;
+		fa->ent[fa->nr_sent].sfd = sfd;
+		fa->ent[fa->nr_sent].fa = fa;
+		fa->nr_sent++;
+	}
+
+	if (!fa->nr_sent) {
+		free(fa);
+		return;
+	}
+
+	lagging_get(fa->oid);
+	fwd_async_arm(fa);
+}
+
+/* Time out the stalled requests and hand the completed ones to main thread */
+static void fwd_async_reap(void)
+{
+	struct fwd_async *fa;
+	time_t now = time(NULL);
+	bool notify = false;
+	LIST_HEAD(lagging_done);
+
+	sd_mutex_lock(&fwd_pending_lock);
+	list_for_each_entry(fa, &fwd_pending_list, pending_list) {
+		if (fa->nr_pending && fwd_async_timed_out(fa, now)) {
+			sd_warn("forward timeout for %016"PRIx64", %d pending",
+				fa->oid, fa->nr_pending);
+			/* XXX Blindly close all the pending connections */
+			for (int i = 0; i < fa->nr_sent; i++)
+				fwd_async_finish_entry(&fa->ent[i],
+						       SD_RES_NETWORK_ERROR,
+						       true);
+		}
+
+		if (fa->nr_pending && fa->req && fa->armed && fa->quorum &&
+		    fa->nr_ok >= fa->quorum && fa->err_ret == SD_RES_SUCCESS)
+			fwd_async_detach_lagging(fa);
+
+		if (fa->nr_pending)
+			continue;
+
+		list_del(&fa->pending_list);
+		if (!fa->req) {
+			list_add_tail(&fa->done_list, &lagging_done);
+			continue;
+		}
+		sd_mutex_lock(&fwd_done_lock);
+		list_add_tail(&fa->done_list, &fwd_done_list);
+		sd_mutex_unlock(&fwd_done_lock);
+		notify = true;
+	}
+	sd_mutex_unlock(&fwd_pending_lock);
+
+	if (notify)
+		eventfd_xwrite(fwd_done_efd, 1);
+
+	list_for_each_entry(fa, &lagging_done, done_list) {
+		list_del(&fa->done_list);
+		if (fa->err_ret != SD_RES_SUCCESS) {
+			if (fa->repair)
+				sd_err("failed to repair %016"PRIx64", %s",
+				       fa->oid, sd_strerror(fa->err_ret));
+			else
+				fwd_async_repair(fa);
+		}
+		lagging_put(fa->oid);
+		free(fa);
+	}
+}
+
+static void *fwd_async_completion(void *arg)
+{
+	struct epoll_event events[128];
+	int nr, i;
+
+	for (;;) {
+		nr = epoll_wait(fwd_epfd, events, ARRAY_SIZE(events), 1000);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("%m");
+		}
+
+		for (i = 0; i < nr; i++)
+			fwd_async_handle_event(events[i].data.ptr,
+					       events[i].events);
+
+		fwd_async_reap();
+	}
+
+	return NULL;
+}
+
+static void fwd_async_done(int fd, int events, void *data)
+{
+	struct fwd_async *fa;
+	LIST_HEAD(list);
+
+	eventfd_xread(fd);
+
+	sd_mutex_lock(&fwd_done_lock);
+	list_splice_init(&fwd_done_list, &list);
+	sd_mutex_unlock(&fwd_done_lock);
+
+	list_for_each_entry(fa, &list, done_list) {
+		struct request *req = fa->req;
+
+		list_del(&fa->done_list);
+		req->work.done(&req->work);
+	}
+}
+
+/*
+ * Called by gateway_op_done() for the requests which are forwarded
+ * asynchronously.  Returns true if the request can be completed.
+ */
+main_fn bool gateway_forward_finish(struct request *req)
+{
+	struct fwd_async *fa = req->fwd_async;
+
+	if (--fa->refcnt)
+		return false;
+
+	req->rp.result = fa->err_ret;
+	req->fwd_async = NULL;
+	free(fa);
+
+	return true;
+}
+
+int gateway_forward_init(void)
+{
+	sd_thread_t t;
+	int ret;
+
+	fwd_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (fwd_epfd < 0) {
+		sd_err("failed to create epoll fd, %m");
+		return -1;
+	}
+
+	fwd_done_efd = eventfd(0, EFD_NONBLOCK);
+	if (fwd_done_efd < 0) {
+		sd_err("failed to create event fd, %m");
+		goto err;
+	}
+
+	ret = register_event(fwd_done_efd, fwd_async_done, NULL);
+	if (ret) {
+		sd_err("failed to register event fd");
+		goto err;
+	}
+
+	ret = sd_thread_create("fwd", &t, fwd_async_completion, NULL);
+	if (ret) {
+		sd_err("failed to create completion thread, %m");
+		unregister_event(fwd_done_efd);
+		goto err;
+	}
+
+	return 0;
+err:
+	if (fwd_done_efd >= 0)
+		close(fwd_done_efd);
+	close(fwd_epfd);
+	fwd_epfd = fwd_done_efd = -1;
+	return -1;
+}
+
+#else	/* HAVE_ACCELIO */
+
+static void wait_lagging_writes(uint64_t oid)
+{
+}
+
+static bool can_forward_async(struct request *req)
+{
+	return false;
+}
+
+static int gateway_forward_request_async(struct request *req)
+{
+	return gateway_forward_request(req);
+}
+
+main_fn bool gateway_forward_finish(struct request *req)
+{
+	return true;
+}
+
+int gateway_forward_init(void)
+{
+	return 0;
+}
+
+#endif	/* HAVE_ACCELIO */
+
+static int prepare_obj_refcnt(const struct sd_req *hdr, uint32_t *vids,
+			      struct generation_reference *refs)
+{
+	int ret;
+	size_t nr_vids = hdr->data_length / sizeof(*vids);
+	uint64_t offset;
+	int start;
+
+	offset = hdr->obj.offset - offsetof(struct sd_inode, data_vdi_id);
+	start = offset / sizeof(*vids);
+
+	ret = sd_read_object_fwd(hdr->obj.oid, (char *)vids,
+				 nr_vids * sizeof(vids[0]),
+				 offsetof(struct sd_inode, data_vdi_id[start]));
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read vdi, %016" PRIx64, hdr->obj.oid);
+		return ret;
+	}
+
+	ret = sd_read_object_fwd(hdr->obj.oid, (char *)refs,
+				 nr_vids * sizeof(refs[0]),
+				 offsetof(struct sd_inode, gref[start]));
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read vdi, %016" PRIx64, hdr->obj.oid);
+		return ret;
+	}
+
+	return ret;
+}
+
+/*
+ * Refcount update log
+ *
+ * With asynchronous ledger updates, the references dropped by the inode
+ * writes are not sent one by one but logged for DECREF_LOG_WINDOW.  The
+ * decrements of the same generation of a data object are coalesced into a
+ * single SD_OP_DECREF_OBJ carrying their number and the sum of their counts,
+ * which the ledger owner applies at once.  The log is flushed by a work on
+ * the low priority reclaim queue, so the storm of decrefs of snapshot heavy
+ * workloads doesn't compete with the client I/O.
+ */
+#define DECREF_LOG_WINDOW 100	/* msec */
+
+struct decref_entry {
+	struct rb_node rb;
+	uint64_t data_oid;
+	uint32_t generation;
+	uint32_t count;		/* sum of the counts of the references */
+	uint32_t nr;		/* number of the references */
+};
+
+static struct rb_root decref_log = RB_ROOT;
+static struct sd_mutex decref_log_lock = SD_MUTEX_INITIALIZER;
+static bool decref_flush_queued;
+static struct work decref_flush_work;
+
+static int decref_entry_cmp(const struct decref_entry *a,
+			    const struct decref_entry *b)
+{
+	return intcmp(a->data_oid, b->data_oid) ?:
+		intcmp(a->generation, b->generation);
+}
+
+static void decref_log_flush(struct work *work)
+{
+	struct rb_root root;
+	struct decref_entry *e;
+	int ret, nr = 0, nr_refs = 0;
+
+	/* let the decrefs pile up */
+	usleep(DECREF_LOG_WINDOW * 1000);
+
+	sd_mutex_lock(&decref_log_lock);
+	root = decref_log;
+	INIT_RB_ROOT(&decref_log);
+	sd_mutex_unlock(&decref_log_lock);
+
+	rb_for_each_entry(e, &root, rb) {
+		ret = sd_dec_object_refcnt(e->data_oid, e->generation,
+					   e->count, e->nr);
+		if (ret != SD_RES_SUCCESS)
+			sd_err("fail, %d", ret);
+		nr++;
+		nr_refs += e->nr;
+		rb_erase(&e->rb, &root);
+		free(e);
+	}
+	sd_debug("%d references dropped by %d decrefs", nr_refs, nr);
+}
+
+static void decref_log_flush_done(struct work *work)
+{
+	sd_mutex_lock(&decref_log_lock);
+	if (RB_EMPTY_ROOT(&decref_log))
+		decref_flush_queued = false;
+	else
+		queue_work(sys->reclaim_wqueue, &decref_flush_work);
+	sd_mutex_unlock(&decref_log_lock);
+}
+
+static void decref_log_add(uint64_t data_oid, uint32_t generation,
+			   uint32_t count)
+{
+	struct decref_entry key = {
+		.data_oid = data_oid,
+		.generation = generation,
+	}, *e;
+
+	sd_mutex_lock(&decref_log_lock);
+	e = rb_search(&decref_log, &key, rb, decref_entry_cmp);
+	if (!e) {
+		e = xzalloc(sizeof(*e));
+		*e = key;
+		rb_insert(&decref_log, e, rb, decref_entry_cmp);
+	}
+	e->count += count;
+	e->nr++;
+
+	/* only one flush at a time, the done callback queues the next one */
+	if (!decref_flush_queued) {
+		decref_flush_queued = true;
+		decref_flush_work.fn = decref_log_flush;
+		decref_flush_work.done = decref_log_flush_done;
+		queue_work(sys->reclaim_wqueue, &decref_flush_work);
+	}
+	sd_mutex_unlock(&decref_log_lock);
+}
+
+/*
+ * This function decreases a refcnt of vid_to_data_oid(old_vid, idx) and
+ * increases one of vid_to_data_oid(new_vid, idx).  With 'async', the
+ * decrements are logged and sent later.
+ */
+static void update_obj_refcnt(uint64_t offset, int start,
+			     size_t nr_vids, uint32_t *vids, uint32_t *new_vids,
+			     struct generation_reference *refs, bool async)
+{
+	int i, ret = SD_RES_SUCCESS;
+
+	for (i = 0; i < nr_vids; i++) {
+		uint64_t data_oid = vid_to_data_oid(vids[i], i + start);
+
+		if (vids[i] == 0 || vids[i] == new_vids[i])
+			continue;
+
+		if (async) {
+			decref_log_add(data_oid, refs[i].generation,
+				       refs[i].count);
+			continue;
+		}
+
+		ret = sd_dec_object_refcnt(data_oid, refs[i].generation,
+					   refs[i].count, 1);
+		if (ret != SD_RES_SUCCESS)
+			sd_err("fail, %d", ret);
+	}
+}
+
+static bool is_inode_refresh_req(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	uint32_t data_length = req->rq.data_length;
+	uint32_t offset = req->rq.obj.offset;
 
 	if (!is_vdi_obj(oid))
 		return false;
@@ -714,7 +2342,156 @@ static bool is_inode_refresh_req(struct request *req)
 	if (data_length != data_vid_offset(SD_INODE_DATA_INDEX))
 		return false;
 
-	return true;
+	return true;
+}
+
+/*
+ * Singleflight reads
+ *
+ * When many clients read the same range at once, e.g. the thin clones of a
+ * golden image booting together, the gateway forwards only the first read of
+ * the range and the identical ones which come while it is in flight wait for
+ * it and share its result.  The reads are keyed by (oid, offset, length,
+ * flags).
+ *
+ * A read must not get data older than the writes which were issued before
+ * it, so every request modifying an object bumps the generation of its hash
+ * bucket when it's queued and again when it completes, before it's acked, see
+ * gateway_note_write().  A read joins only a flight which started at the
+ * current generation, so it never shares a flight which may have raced with
+ * a write it must see.
+ */
+#define NR_READ_FLIGHT_HASH 256
+
+struct read_flight {
+	struct list_node list;
+	uint64_t oid;
+	uint32_t offset;
+	uint32_t length;
+	uint16_t flags;
+	uint32_t gen;
+
+	int refcnt;
+	int nr_followers;
+	bool done;
+	struct sd_rsp rsp;
+	void *buf;		/* the copy of the data for the followers */
+	struct sd_cond cond;
+};
+
+static struct read_flight_bucket {
+	struct sd_mutex lock;
+	struct list_head flights;
+	uint32_t gen;
+} read_flights[NR_READ_FLIGHT_HASH];
+
+static void __attribute__((constructor)) init_read_flights(void)
+{
+	for (int i = 0; i < NR_READ_FLIGHT_HASH; i++) {
+		sd_init_mutex(&read_flights[i].lock);
+		INIT_LIST_HEAD(&read_flights[i].flights);
+	}
+}
+
+static inline struct read_flight_bucket *read_flight_bucket(uint64_t oid)
+{
+	return read_flights + sd_hash_oid(oid) % NR_READ_FLIGHT_HASH;
+}
+
+main_fn void gateway_note_write(uint64_t oid)
+{
+	uatomic_inc(&read_flight_bucket(oid)->gen);
+}
+
+/* Changes when a write to the object is issued and done, see readahead.c */
+uint32_t gateway_write_gen(uint64_t oid)
+{
+	return uatomic_read(&read_flight_bucket(oid)->gen);
+}
+
+static void put_read_flight(struct read_flight *f)
+{
+	if (--f->refcnt > 0)
+		return;
+
+	sd_destroy_cond(&f->cond);
+	free(f->buf);
+	free(f);
+}
+
+static int __gateway_read_obj(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+
+	if (is_erasure_oid(oid))
+		return gateway_erasure_read(req);
+	else
+		return gateway_replication_read(req);
+}
+
+static int gateway_read_flight(struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	struct read_flight_bucket *b = read_flight_bucket(hdr->obj.oid);
+	struct read_flight *f;
+	uint32_t gen;
+	int ret;
+
+	sd_mutex_lock(&b->lock);
+	gen = uatomic_read(&b->gen);
+	list_for_each_entry(f, &b->flights, list) {
+		if (f->oid != hdr->obj.oid || f->offset != hdr->obj.offset ||
+		    f->length != hdr->data_length || f->flags != hdr->flags ||
+		    f->gen != gen)
+			continue;
+
+		f->refcnt++;
+		f->nr_followers++;
+		while (!f->done)
+			sd_cond_wait(&f->cond, &b->lock);
+		sd_mutex_unlock(&b->lock);
+
+		memcpy(&req->rp, &f->rsp, sizeof(req->rp));
+		if (f->rsp.result == SD_RES_SUCCESS)
+			memcpy(req->data, f->buf, f->rsp.data_length);
+
+		sd_mutex_lock(&b->lock);
+		put_read_flight(f);
+		sd_mutex_unlock(&b->lock);
+		return req->rp.result;
+	}
+
+	f = xzalloc(sizeof(*f));
+	f->oid = hdr->obj.oid;
+	f->offset = hdr->obj.offset;
+	f->length = hdr->data_length;
+	f->flags = hdr->flags;
+	f->gen = gen;
+	f->refcnt = 1;
+	sd_cond_init(&f->cond);
+	list_add(&f->list, &b->flights);
+	sd_mutex_unlock(&b->lock);
+
+	ret = __gateway_read_obj(req);
+
+	sd_mutex_lock(&b->lock);
+	list_del(&f->list);
+	if (f->nr_followers) {
+		f->rsp = req->rp;
+		f->rsp.result = ret;
+		if (ret == SD_RES_SUCCESS) {
+			f->buf = xmalloc(req->rp.data_length);
+			memcpy(f->buf, req->data, req->rp.data_length);
+		}
+		sd_debug("%016"PRIx64" shared by %d reads", f->oid,
+			 f->nr_followers);
+	}
+	f->done = true;
+	sd_cond_broadcast(&f->cond);
+	put_read_flight(f);
+	sd_mutex_unlock(&b->lock);
+
+	return ret;
 }
 
 int gateway_read_obj(struct request *req)
@@ -729,65 +2506,548 @@ int gateway_read_obj(struct request *req)
 		return SD_RES_INODE_INVALIDATED;
 	}
 
-	if (is_erasure_oid(oid))
-		ret = gateway_forward_request(req);
-	else
-		ret = gateway_replication_read(req);
+	/*
+	 * The clients read the objects of the parent with the redundancy of
+	 * their own vdi, which is another one after 'dog vdi convert'
+	 */
+	if (is_data_obj(oid) && req->rq.obj.copy_policy &&
+	    req->rq.obj.copy_policy != get_vdi_copy_policy(oid_to_vid(oid))) {
+		req->rq.obj.copies = 0;
+		req->rq.obj.copy_policy = 0;
+	}
+
+	if (!bypass_object_cache(req))
+		return object_cache_handle_request(req);
+
+	if (!req->local && is_data_obj(oid) && readahead_read(req))
+		return SD_RES_SUCCESS;
 
+	/* the refresh of the inode must read it by itself */
+	if (!is_inode_refresh_req(req))
+		return gateway_read_flight(req);
+
+	ret = __gateway_read_obj(req);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	if (is_inode_refresh_req(req))
-		validate_myself(oid_to_vid(oid));
+	validate_myself(oid_to_vid(oid));
 
 	return ret;
 }
 
-struct update_obj_refcnt_work {
-	struct work work;
+/*
+ * Vectored read of object ranges (SD_OP_READ_OBJS)
+ *
+ * The local replicas are read directly and the objects on the other nodes are
+ * grouped by node, so that each node gets a single SD_OP_READ_PEERS for all of
+ * them.  The objects which need more than a plain replica read (erasure coded,
+ * cached and vdi objects) and the objects of a failed batch fall back on
+ * SD_OP_READ_OBJ.
+ */
+
+enum { OBJ_VEC_FALLBACK = -2, OBJ_VEC_LOCAL = -1 };
+
+static int obj_vec_read_fallback(struct request *req,
+				 const struct sd_obj_vec *v, void *buf)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_READ_OBJ);
+	hdr.flags = req->rq.flags & ~SD_FLAG_CMD_WRITE;
+	hdr.data_length = v->length;
+	hdr.obj.oid = v->oid;
+	hdr.obj.offset = v->offset;
+
+	return exec_local_req(&hdr, buf);
+}
+
+static int obj_vec_read_local(struct request *req,
+			      const struct sd_obj_vec *v, void *buf)
+{
+	struct siocb iocb = { 0 };
+	int ret;
 
-	uint64_t offset;
-	int start;
+	iocb.epoch = req->rq.epoch;
+	iocb.buf = buf;
+	iocb.length = v->length;
+	iocb.offset = v->offset;
 
-	size_t nr_vids;
-	uint32_t *vids, *new_vids;
+	ret = sd_store->read(v->oid, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	return cow_fill(v->oid, &iocb);
+}
+
+/* Returns the index in 'nodes' to read 'oid' from, or OBJ_VEC_* */
+static int obj_vec_target(struct request *req, uint64_t oid,
+			  const struct sd_node **nodes, int *nr_nodes)
+{
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	int nr_copies, i, j;
+
+	if (is_erasure_oid(oid) || is_vdi_obj(oid) ||
+	    !bypass_object_cache_oid(req, oid))
+		return OBJ_VEC_FALLBACK;
+
+	nr_copies = get_obj_copy_number(oid, req->vinfo->nr_zones);
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
+	for (i = 0; i < nr_copies; i++)
+		if (vnode_is_local(obj_vnodes[i]))
+			return OBJ_VEC_LOCAL;
+
+	/* prefer the nodes we already read from to make the batches larger */
+	for (i = 0; i < nr_copies; i++)
+		for (j = 0; j < *nr_nodes; j++)
+			if (node_eq(obj_vnodes[i]->node, nodes[j]))
+				return j;
+
+	/* otherwise pick a random copy for better load balance */
+	nodes[*nr_nodes] = obj_vnodes[random() % nr_copies]->node;
+	return (*nr_nodes)++;
+}
+
+/* Read all the entries which target nodes[n] with one request */
+static int obj_vec_read_batch(struct request *req, const struct sd_node *n,
+			      const int *target, int idx, const uint32_t *off)
+{
+	const struct sd_obj_vec *vec = req->vec;
+	uint32_t nr_vec = req->rq.vec.nr, nr = 0, rlen = 0, len;
+	struct sd_obj_vec *batch;
+	struct sd_req hdr;
+	char *buf, *p;
+	int ret;
+
+	batch = xmalloc(sizeof(*batch) * nr_vec);
+	for (uint32_t i = 0; i < nr_vec; i++) {
+		if (target[i] != idx)
+			continue;
+		batch[nr++] = vec[i];
+		rlen += vec[i].length;
+	}
+
+	len = max(rlen, (uint32_t)(sizeof(*batch) * nr));
+	buf = xpool_alloc(len);
+	memcpy(buf, batch, sizeof(*batch) * nr);
+
+	sd_init_req(&hdr, SD_OP_READ_PEERS);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.epoch = req->rq.epoch;
+	hdr.data_length = sizeof(*batch) * nr;
+	hdr.vec.nr = nr;
+	hdr.vec.rlen = rlen;
+	ret = sheep_exec_req(&n->nid, &hdr, buf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	p = buf;
+	for (uint32_t i = 0; i < nr_vec; i++) {
+		if (target[i] != idx)
+			continue;
+		memcpy((char *)req->data + off[i], p, vec[i].length);
+		p += vec[i].length;
+	}
+out:
+	pool_free(buf, len);
+	free(batch);
+	return ret;
+}
+
+int gateway_read_objs(struct request *req)
+{
+	const struct sd_obj_vec *vec = req->vec;
+	uint32_t nr_vec = req->rq.vec.nr, off[SD_MAX_OBJ_VEC], pos = 0;
+	const struct sd_node *nodes[SD_MAX_OBJ_VEC];
+	int target[SD_MAX_OBJ_VEC], nr_nodes = 0, ret;
+	uint32_t i;
+
+	for (i = 0; i < nr_vec; i++) {
+		uint64_t oid = vec[i].oid;
+
+		if ((req->rq.flags & SD_FLAG_CMD_TGT) && !is_vdi_obj(oid) &&
+		    is_refresh_required(oid_to_vid(oid))) {
+			sd_debug("refresh is required: %016"PRIx64, oid);
+			return SD_RES_INODE_INVALIDATED;
+		}
+
+		wait_lagging_writes(oid);
+		off[i] = pos;
+		pos += vec[i].length;
+		target[i] = obj_vec_target(req, oid, nodes, &nr_nodes);
+	}
+
+	for (i = 0; i < nr_vec; i++) {
+		if (target[i] != OBJ_VEC_LOCAL)
+			continue;
+		ret = obj_vec_read_local(req, vec + i, (char *)req->data + off[i]);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("local read %016"PRIx64" failed, %s", vec[i].oid,
+			       sd_strerror(ret));
+			target[i] = OBJ_VEC_FALLBACK;
+		}
+	}
 
-	struct generation_reference *refs;
+	for (int n = 0; n < nr_nodes; n++) {
+		ret = obj_vec_read_batch(req, nodes[n], target, n, off);
+		if (ret == SD_RES_SUCCESS)
+			continue;
+
+		sd_debug("batch read from %s failed, %s",
+			 node_to_str(nodes[n]), sd_strerror(ret));
+		for (i = 0; i < nr_vec; i++)
+			if (target[i] == n)
+				target[i] = OBJ_VEC_FALLBACK;
+	}
+
+	for (i = 0; i < nr_vec; i++) {
+		if (target[i] != OBJ_VEC_FALLBACK)
+			continue;
+		ret = obj_vec_read_fallback(req, vec + i,
+					    (char *)req->data + off[i]);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	req->rp.data_length = req->rq.vec.rlen;
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * The data vdi ids of an inode are mostly updated by its client, but also by
+ * the discards and the hydration of the lazy clones (vdi.c) in sheep.  The
+ * read of the old ids, the write and the drop of the references they held
+ * are serialized per entry on this gateway, so that concurrent updates of an
+ * entry never drop the same reference twice.
+ */
+#define NR_VID_UPDATE_LOCKS 64	/* one bit of the mask per lock */
+
+static struct sd_mutex vid_update_locks[NR_VID_UPDATE_LOCKS] = {
+	[0 ... NR_VID_UPDATE_LOCKS - 1] = SD_MUTEX_INITIALIZER
 };
 
-static void async_update_obj_refcnt_work(struct work *work)
+static uint64_t vid_update_lock(uint32_t vid, uint32_t start, size_t nr)
 {
-	struct update_obj_refcnt_work *w =
-		container_of(work, struct update_obj_refcnt_work, work);
+	uint64_t mask = 0;
+
+	for (size_t i = 0; i < min(nr, (size_t)NR_VID_UPDATE_LOCKS); i++) {
+		int lock = (vid + start + i) % NR_VID_UPDATE_LOCKS;
+
+		mask |= UINT64_C(1) << lock;
+	}
+
+	/* in the ascending order not to deadlock */
+	for (int i = 0; i < NR_VID_UPDATE_LOCKS; i++)
+		if (mask & (UINT64_C(1) << i))
+			sd_mutex_lock(&vid_update_locks[i]);
 
-	sd_debug("async update of object reference count start: %p", w);
-	update_obj_refcnt(w->offset, w->start, w->nr_vids, w->vids,
-			  w->new_vids, w->refs);
+	return mask;
 }
 
-static void async_update_obj_refcnt_done(struct work *work)
+static void vid_update_unlock(uint64_t mask)
 {
-	struct update_obj_refcnt_work *w =
-		container_of(work, struct update_obj_refcnt_work, work);
+	for (int i = 0; i < NR_VID_UPDATE_LOCKS; i++)
+		if (mask & (UINT64_C(1) << i))
+			sd_mutex_unlock(&vid_update_locks[i]);
+}
 
-	sd_debug("async update of object reference count done: %p", w);
+/* SD_FLAG_CMD_EXCL switches the entries only if they are all still shared */
+static bool vids_shared(const struct sd_req *hdr, const uint32_t *vids)
+{
+	size_t nr_vids = hdr->data_length / sizeof(*vids);
 
-	free(w->vids);
-	free(w->new_vids);
-	free(w->refs);
+	for (size_t i = 0; i < nr_vids; i++)
+		if (!vids[i] || vids[i] == oid_to_vid(hdr->obj.oid))
+			return false;
 
-	free(w);
+	return true;
 }
 
-int gateway_write_obj(struct request *req)
+/*
+ * Batched data vid updates
+ *
+ * A burst of first-touch writes makes the client update the inode once per
+ * new object.  While a data vid update of an inode is in flight, the updates
+ * of the same inode which follow it are collected into one pending batch, as
+ * long as they all fit in a span of VID_BATCH_SPAN entries.  When the running
+ * update completes, the first updater of the batch writes the whole span at
+ * once, with the entries between the updated ones read back unchanged under
+ * their locks, and all the updaters of the batch get its result.  The
+ * exclusive updates (SD_FLAG_CMD_EXCL) depend on the entries they find, so
+ * they are never batched.
+ */
+#define VID_BATCH_SPAN 1024
+#define VID_BATCH_MAX 64
+#define NR_VID_BATCH_HASH 64
+
+struct vid_update {
+	uint32_t start;
+	uint32_t nr;
+	const uint32_t *vids;
+};
+
+struct vid_batch {
+	uint32_t start;
+	uint32_t end;
+	struct vid_update updates[VID_BATCH_MAX];
+	int nr_updates;
+
+	int refcnt;
+	bool done;
+	int ret;
+	struct sd_cond cond;
+};
+
+/* An inode with a data vid update in flight */
+struct vid_batch_inode {
+	struct list_node list;
+	uint64_t oid;
+	struct vid_batch *pending;
+};
+
+static struct vid_batch_bucket {
+	struct sd_mutex lock;
+	struct list_head inodes;
+} vid_batches[NR_VID_BATCH_HASH];
+
+static void __attribute__((constructor)) init_vid_batches(void)
+{
+	for (int i = 0; i < NR_VID_BATCH_HASH; i++) {
+		sd_init_mutex(&vid_batches[i].lock);
+		INIT_LIST_HEAD(&vid_batches[i].inodes);
+	}
+}
+
+static inline uint32_t vid_update_start(const struct sd_req *hdr)
+{
+	return (hdr->obj.offset - data_vid_offset(0)) / sizeof(uint32_t);
+}
+
+static bool vid_batch_add(struct vid_batch *b, struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	uint32_t start = vid_update_start(hdr);
+	uint32_t end = start + hdr->data_length / sizeof(uint32_t);
+
+	if (b->nr_updates == VID_BATCH_MAX)
+		return false;
+	if (b->nr_updates) {
+		if (max(b->end, end) - min(b->start, start) > VID_BATCH_SPAN)
+			return false;
+		b->start = min(b->start, start);
+		b->end = max(b->end, end);
+	} else {
+		b->start = start;
+		b->end = end;
+	}
+
+	b->updates[b->nr_updates].start = start;
+	b->updates[b->nr_updates].nr = end - start;
+	b->updates[b->nr_updates].vids = req->data;
+	b->nr_updates++;
+
+	return true;
+}
+
+static void put_vid_batch(struct vid_batch *b)
+{
+	if (--b->refcnt > 0)
+		return;
+
+	sd_destroy_cond(&b->cond);
+	free(b);
+}
+
+/*
+ * Write the data vids of 'req', or the span of the batch 'b' with 'req' as
+ * the carrier of the write, and update the references they hold
+ */
+static int gateway_write_vids(struct request *req, struct vid_batch *b)
+{
+	struct sd_req *hdr = &req->rq, range = *hdr;
+	uint64_t oid = hdr->obj.oid, locked = 0;
+	uint32_t *vids = NULL, *new_vids = req->data, start;
+	struct generation_reference *refs = NULL, *zeroed_refs = NULL;
+	size_t nr_vids;
+	int ret = SD_RES_NO_MEM;
+
+	if (b) {
+		range.obj.offset = data_vid_offset(b->start);
+		range.data_length = (b->end - b->start) * sizeof(*vids);
+	}
+	start = vid_update_start(&range);
+	nr_vids = range.data_length / sizeof(*vids);
+
+	invalidate_other_nodes(oid_to_vid(oid));
+
+	/* read the previous vids to discard their references later */
+	vids = calloc(nr_vids, sizeof(*vids));
+	refs = calloc(nr_vids, sizeof(*refs));
+	zeroed_refs = calloc(nr_vids, sizeof(*zeroed_refs));
+	if (b)
+		new_vids = calloc(nr_vids, sizeof(*new_vids));
+	if (!vids || !refs || !zeroed_refs || !new_vids)
+		goto out;
+
+	locked = vid_update_lock(oid_to_vid(oid), start, nr_vids);
+	ret = prepare_obj_refcnt(&range, vids, refs);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if ((hdr->flags & SD_FLAG_CMD_EXCL) && !vids_shared(hdr, vids))
+		goto out;
+
+	if (b) {
+		void *data = req->data;
+
+		/* the entries between the updated ones keep their references */
+		memcpy(new_vids, vids, nr_vids * sizeof(*vids));
+		memcpy(zeroed_refs, refs, nr_vids * sizeof(*refs));
+		for (int i = 0; i < b->nr_updates; i++) {
+			struct vid_update *u = b->updates + i;
+
+			memcpy(new_vids + u->start - start, u->vids,
+			       u->nr * sizeof(*vids));
+			memset(zeroed_refs + u->start - start, 0,
+			       u->nr * sizeof(*refs));
+		}
+
+		sd_debug("%016"PRIx64", %d updates of %zu entries", oid,
+			 b->nr_updates, nr_vids);
+		range.obj.offset = hdr->obj.offset;
+		range.data_length = hdr->data_length;
+		hdr->obj.offset = data_vid_offset(start);
+		hdr->data_length = nr_vids * sizeof(*vids);
+		req->data = new_vids;
+		ret = gateway_forward_request(req);
+		hdr->obj.offset = range.obj.offset;
+		hdr->data_length = range.data_length;
+		req->data = data;
+	} else
+		ret = gateway_forward_request(req);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	sd_debug("update reference counts, %016" PRIx64, oid);
+
+	ret = sd_write_object_fwd(oid, (char *)zeroed_refs,
+				  nr_vids * sizeof(*zeroed_refs),
+				  offsetof(struct sd_inode, gref[start]), false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("updating reference count of inode object %016"
+		       PRIx64 " failed: %s", oid, sd_strerror(ret));
+		goto out;
+	}
+
+	if (!(sys->cinfo.flags & SD_CLUSTER_FLAG_RECYCLE_VID)) {
+		sd_debug("update ledger objects of %016"PRIx64, oid);
+		update_obj_refcnt(data_vid_offset(start) - data_vid_offset(0),
+				  start, nr_vids, vids, new_vids, refs, true);
+	} else {
+		/*
+		 * async ledger update can cause invalid reference
+		 * counting and data loss:
+		 * https://github.com/sheepdog/sheepdog/issues/315
+		 */
+		update_obj_refcnt(data_vid_offset(start) - data_vid_offset(0),
+				  start, nr_vids, vids, new_vids, refs, false);
+	}
+out:
+	if (locked)
+		vid_update_unlock(locked);
+	if (b)
+		free(new_vids);
+	free(vids);
+	free(refs);
+	free(zeroed_refs);
+
+	return ret;
+}
+
+/* Called with the lock of the bucket held when the update of 'ino' is done */
+static void vid_batch_finish(struct vid_batch_inode *ino)
+{
+	struct vid_batch *next = ino->pending;
+
+	if (next) {
+		/* the first updater of the batch writes it */
+		ino->pending = NULL;
+		sd_cond_broadcast(&next->cond);
+		return;
+	}
+
+	list_del(&ino->list);
+	free(ino);
+}
+
+static int gateway_write_vids_batched(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
+	struct vid_batch_bucket *bucket =
+		vid_batches + sd_hash_oid(oid) % NR_VID_BATCH_HASH;
+	struct vid_batch_inode *ino;
+	struct vid_batch *b;
 	int ret;
+
+	sd_mutex_lock(&bucket->lock);
+	list_for_each_entry(ino, &bucket->inodes, list)
+		if (ino->oid == oid)
+			goto found;
+
+	ino = xzalloc(sizeof(*ino));
+	ino->oid = oid;
+	list_add(&ino->list, &bucket->inodes);
+	sd_mutex_unlock(&bucket->lock);
+
+	ret = gateway_write_vids(req, NULL);
+
+	sd_mutex_lock(&bucket->lock);
+	vid_batch_finish(ino);
+	sd_mutex_unlock(&bucket->lock);
+	return ret;
+found:
+	b = ino->pending;
+	if (b) {
+		if (!vid_batch_add(b, req)) {
+			sd_mutex_unlock(&bucket->lock);
+			return gateway_write_vids(req, NULL);
+		}
+
+		b->refcnt++;
+		while (!b->done)
+			sd_cond_wait(&b->cond, &bucket->lock);
+		ret = b->ret;
+		put_vid_batch(b);
+		sd_mutex_unlock(&bucket->lock);
+		return ret;
+	}
+
+	b = xzalloc(sizeof(*b));
+	b->refcnt = 1;
+	sd_cond_init(&b->cond);
+	vid_batch_add(b, req);
+	ino->pending = b;
+	while (ino->pending == b)
+		sd_cond_wait(&b->cond, &bucket->lock);
+	sd_mutex_unlock(&bucket->lock);
+
+	/* nobody joins the batch any more */
+	ret = gateway_write_vids(req, b->nr_updates > 1 ? b : NULL);
+
+	sd_mutex_lock(&bucket->lock);
+	b->ret = ret;
+	b->done = true;
+	sd_cond_broadcast(&b->cond);
+	vid_batch_finish(ino);
+	put_vid_batch(b);
+	sd_mutex_unlock(&bucket->lock);
+
+	return ret;
+}
+
+int gateway_write_obj(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
 	struct sd_req *hdr = &req->rq;
-	uint32_t *vids = NULL, *new_vids = req->data;
-	struct generation_reference *refs = NULL, *zeroed_refs = NULL;
-	struct update_obj_refcnt_work *refcnt_work;
-	size_t nr_vids = hdr->data_length / sizeof(*vids);
 
 	if ((req->rq.flags & SD_FLAG_CMD_TGT) &&
 	    is_refresh_required(oid_to_vid(oid))) {
@@ -798,109 +3058,115 @@ int gateway_write_obj(struct request *req)
 	if (oid_is_readonly(oid))
 		return SD_RES_READONLY;
 
-	if (is_data_vid_update(hdr)) {
-		invalidate_other_nodes(oid_to_vid(oid));
-
-		/* read the previous vids to discard their references later */
-		vids = calloc(nr_vids, sizeof(*vids));
-		if (!vids)
-			return SD_RES_NO_MEM;
-
-		refs = calloc(nr_vids, sizeof(*refs));
-		if (!refs) {
-			free(vids);
-			return SD_RES_NO_MEM;
-		}
+	if (!bypass_object_cache(req))
+		return object_cache_handle_request(req);
 
-		zeroed_refs = calloc(nr_vids, sizeof(*zeroed_refs));
-		if (!zeroed_refs) {
-			free(vids);
-			free(refs);
-			return SD_RES_NO_MEM;
-		}
+	precopy_account(req, oid);
 
-		ret = prepare_obj_refcnt(hdr, vids, refs);
-		if (ret != SD_RES_SUCCESS)
-			goto out;
-	}
+	if (can_forward_async(req))
+		return gateway_forward_request_async(req);
 
-	ret = gateway_forward_request(req);
-	if (ret != SD_RES_SUCCESS)
-		goto out;
+	if (is_erasure_oid(oid))
+		return gateway_erasure_write(req);
 
 	if (is_data_vid_update(hdr)) {
-		uint64_t offset;
-		int start;
-
-		offset = hdr->obj.offset
-			- offsetof(struct sd_inode, data_vdi_id);
-		start = offset / sizeof(*vids);
+		if (hdr->flags & SD_FLAG_CMD_EXCL)
+			return gateway_write_vids(req, NULL);
+		return gateway_write_vids_batched(req);
+	}
 
-		sd_debug("update reference counts, %016" PRIx64, hdr->obj.oid);
+	return gateway_forward_request(req);
+}
 
-		ret = sd_write_object_fwd(hdr->obj.oid, (char *)zeroed_refs,
-				      nr_vids * sizeof(*zeroed_refs),
-				      offsetof(struct sd_inode, gref)
-				      + start * sizeof(*zeroed_refs), false);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("updating reference count of inode object %016"
-			       PRIx64 " failed: %s", hdr->obj.oid,
-			       sd_strerror(ret));
+/*
+ * Take a reference to the parent object for a sparse copy, out of the one of
+ * the child inode, and return its generation.  The child inode must still
+ * refer to the parent, or its reference may be gone already.
+ */
+static int get_parent_ref(uint64_t oid, uint64_t cow_oid, uint32_t *generation)
+{
+	uint32_t vid = oid_to_vid(oid), idx = data_oid_to_idx(oid), data_vid;
+	uint32_t offset = offsetof(struct sd_inode, gref[idx]);
+	uint64_t vdi_oid = vid_to_vdi_oid(vid), locked;
+	struct generation_reference ref;
+	int ret;
 
-			goto out;
-		}
+	locked = vid_update_lock(vid, idx, 1);
+	ret = sd_read_object_fwd(vdi_oid, (char *)&data_vid, sizeof(data_vid),
+				 data_vid_offset(idx));
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (data_vid != oid_to_vid(cow_oid)) {
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
 
-		if (!(sys->cinfo.flags & SD_CLUSTER_FLAG_RECYCLE_VID)) {
-			sd_debug("update ledger objects of %016"PRIx64,
-				 hdr->obj.oid);
-			refcnt_work = zalloc(sizeof(*refcnt_work));
-			if (!refcnt_work)
-				goto free_bufs;
+	ret = sd_read_object_fwd(vdi_oid, (char *)&ref, sizeof(ref), offset);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
 
-			refcnt_work->vids = vids;
-			refcnt_work->refs = refs;
-			refcnt_work->nr_vids = nr_vids;
-			refcnt_work->new_vids = calloc(hdr->data_length,
-						       sizeof(uint32_t));
-			if (!refcnt_work->new_vids)
-				goto free_work;
-			memcpy(refcnt_work->new_vids, new_vids,
-			       hdr->data_length);
+	ref.count++;
+	ret = sd_write_object_fwd(vdi_oid, (char *)&ref, sizeof(ref), offset,
+				  false);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
 
-			refcnt_work->offset = offset;
-			refcnt_work->start = start;
+	*generation = ref.generation + 1;
+out:
+	vid_update_unlock(locked);
+	return ret;
+}
 
-			refcnt_work->work.fn = async_update_obj_refcnt_work;
-			refcnt_work->work.done = async_update_obj_refcnt_done;
+/*
+ * Create the child object with only the extents which the write touches,
+ * see store/cow.c.  The edges of partially written extents are read from the
+ * parent.
+ */
+static int gateway_sparse_cow(struct request *req)
+{
+	struct sd_req *req_hdr = &req->rq, hdr;
+	uint64_t oid = req_hdr->obj.oid, cow_oid = req_hdr->obj.cow_oid;
+	uint32_t ext = cow_extent_size(oid), generation = 0;
+	uint32_t start = round_down(req_hdr->obj.offset, ext);
+	uint32_t end = roundup(req_hdr->obj.offset + req_hdr->data_length, ext);
+	char *buf = xpool_alloc(end - start);
+	int ret;
 
-			queue_work(sys->reclaim_wqueue, &refcnt_work->work);
+	if (start != req_hdr->obj.offset ||
+	    end != req_hdr->obj.offset + req_hdr->data_length) {
+		ret = sd_read_object_fwd(cow_oid, buf, end - start, start);
+		if (ret != SD_RES_SUCCESS)
 			goto out;
+	}
+	memcpy(buf + req_hdr->obj.offset - start, req->data,
+	       req_hdr->data_length);
 
-		free_work:
-			free(refcnt_work);
-		free_bufs:
-			free(vids);
-			free(refs);
+	ret = get_parent_ref(oid, cow_oid, &generation);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
 
-			ret = SD_RES_NO_MEM;
-		} else {
-			/*
-			 * async ledger update can cause invalid reference
-			 * counting and data loss:
-			 * https://github.com/sheepdog/sheepdog/issues/315
-			 */
-			update_obj_refcnt(offset, start, nr_vids,
-					  vids, new_vids, refs);
-		}
+	sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_COW | SD_FLAG_CMD_FWD;
+	hdr.data_length = end - start;
+	hdr.obj.oid = oid;
+	hdr.obj.cow_oid = cow_oid;
+	hdr.obj.cow_generation = generation;
+	hdr.obj.offset = start;
+	ret = exec_local_req(&hdr, buf);
+	if (ret != SD_RES_SUCCESS) {
+		/* give the reference back, the caller makes a full copy */
+		sd_debug("failed to create the sparse %016"PRIx64", %s", oid,
+			 sd_strerror(ret));
+		if (sd_dec_object_refcnt(cow_oid, generation, 0, 1) !=
+		    SD_RES_SUCCESS)
+			sd_err("failed to put %016"PRIx64, cow_oid);
 	}
-
 out:
-	free(zeroed_refs);
-
+	pool_free(buf, end - start);
 	return ret;
 }
 
-static int gateway_handle_cow(struct request *req)
+int gateway_handle_cow(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
 	size_t len = get_objsize(oid, get_vdi_object_size(oid_to_vid(oid)));
@@ -908,6 +3174,27 @@ static int gateway_handle_cow(struct request *req)
 	char *buf = NULL;
 	int ret;
 
+	/* the sparse copy made by gateway_sparse_cow() */
+	if (req_hdr->flags & SD_FLAG_CMD_FWD)
+		return gateway_forward_request(req);
+
+	/* the copy made by the background pre-copy, see precopy.c */
+	if (req_hdr->data_length && precopy_consume(oid)) {
+		req_hdr->opcode = SD_OP_WRITE_OBJ;
+		req_hdr->flags &= ~SD_FLAG_CMD_COW;
+		ret = gateway_forward_request(req);
+		req_hdr->opcode = SD_OP_CREATE_AND_WRITE_OBJ;
+		req_hdr->flags |= SD_FLAG_CMD_COW;
+		if (ret == SD_RES_SUCCESS)
+			return ret;
+	}
+
+	if (req_hdr->data_length && req_hdr->data_length != len &&
+	    cow_supported(oid) &&
+	    cow_supported(req_hdr->obj.cow_oid) &&
+	    gateway_sparse_cow(req) == SD_RES_SUCCESS)
+		return SD_RES_SUCCESS;
+
 	ret = posix_memalign((void **)&buf, getpagesize(), len);
 	if(unlikely(ret)) {
 		ret = SD_RES_NO_MEM;
@@ -942,9 +3229,17 @@ int gateway_create_and_write_obj(struct request *req)
 	if (oid_is_readonly(oid))
 		return SD_RES_READONLY;
 
+	if (!bypass_object_cache(req))
+		return object_cache_handle_request(req);
+
+	precopy_account(req, oid);
+
 	if (req->rq.flags & SD_FLAG_CMD_COW)
 		return gateway_handle_cow(req);
 
+	if (can_forward_async(req))
+		return gateway_forward_request_async(req);
+
 	return gateway_forward_request(req);
 }
 
@@ -953,6 +3248,53 @@ int gateway_remove_obj(struct request *req)
 	return gateway_forward_request(req);
 }
 
+/*
+ * Vectored remove (SD_OP_REMOVE_OBJS)
+ *
+ * Like SD_OP_WRITE_OBJS, each node gets a single SD_OP_REMOVE_PEERS for all
+ * the objects it holds a replica of.  The erasure coded objects are removed
+ * one by one.  The objects which don't exist are not an error.
+ */
+int gateway_remove_objs(struct request *req)
+{
+	const struct sd_obj_vec *vec = req->vec;
+	uint32_t nr_vec = req->rq.vec.nr, off[SD_MAX_OBJ_VEC] = {}, i;
+	bool fallback[SD_MAX_OBJ_VEC];
+	struct obj_vec_batch *batches;
+	int nr_batches, max_batches = 0, ret;
+	struct sd_req hdr;
+
+	for (i = 0; i < nr_vec; i++) {
+		fallback[i] = obj_vec_remove_fallback(vec[i].oid);
+		if (!fallback[i])
+			max_batches += get_obj_copy_number(vec[i].oid,
+						req->vinfo->nr_zones);
+	}
+
+	batches = xzalloc(sizeof(*batches) * (max_batches ?: 1));
+	nr_batches = obj_vec_prepare_batches(req, fallback, off, batches);
+	ret = obj_vec_send_batches(req, SD_OP_REMOVE_PEERS, batches,
+				   nr_batches);
+	for (int n = 0; n < nr_batches; n++)
+		free(batches[n].buf);
+	free(batches);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	for (i = 0; i < nr_vec; i++) {
+		if (!fallback[i])
+			continue;
+
+		sd_init_req(&hdr, SD_OP_REMOVE_OBJ);
+		hdr.obj.oid = vec[i].oid;
+		ret = exec_local_req(&hdr, NULL);
+		if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ)
+			return ret;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
 int gateway_decref_object(struct request *req)
 {
 	return gateway_forward_request(req);
@@ -91,14 +91,51 @@ main_fn struct vnode_info *get_vnode_info(void)
 	return grab_vnode_info(cur_vinfo);
 }
 
+/*
+ * Replace the current vnode information, taking over the reference of vinfo.
+ * For the tools which drive the store without joining a cluster, and for a
+ * format which changes the placement of the same nodes.
+ */
+main_fn void set_vnode_info(struct vnode_info *vinfo)
+{
+	put_vnode_info(main_thread_get(current_vnode_info));
+	main_thread_set(current_vnode_info, vinfo);
+}
+
+/*
+ * Get a reference to the current vnode info for a request.  The requests are
+ * queued and freed in the main thread, so they share one reference of the
+ * vnode info among them, counted in nr_req_refs without atomics.  The worker
+ * threads can still grab their own references with grab_vnode_info().
+ */
+main_fn struct vnode_info *get_req_vnode_info(void)
+{
+	struct vnode_info *cur_vinfo = main_thread_get(current_vnode_info);
+
+	if (cur_vinfo == NULL)
+		return NULL;
+
+	if (cur_vinfo->nr_req_refs++ == 0)
+		grab_vnode_info(cur_vinfo);
+	return cur_vinfo;
+}
+
+main_fn void put_req_vnode_info(struct vnode_info *vnode_info)
+{
+	if (vnode_info && --vnode_info->nr_req_refs == 0)
+		put_vnode_info(vnode_info);
+}
+
 /* Release a reference to the current vnode information. */
 void put_vnode_info(struct vnode_info *vnode_info)
 {
 	if (vnode_info) {
 		if (refcount_dec(&vnode_info->refcnt) == 0) {
-			rb_destroy(&vnode_info->vroot, struct sd_vnode, rb);
 			rb_destroy(&vnode_info->nroot, struct sd_node, rb);
-			free(vnode_info);
+			free_tag(vnode_info->vnode_buf, MEM_VNODE_INFO);
+			free_tag(vnode_info->vnode_hashes, MEM_VNODE_INFO);
+			free_tag(vnode_info->vnode_sets, MEM_VNODE_INFO);
+			free_tag(vnode_info, MEM_VNODE_INFO);
 		}
 	}
 }
@@ -130,12 +167,190 @@ static void recalculate_vnodes(struct rb_root *nroot)
 	}
 }
 
-struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
+/* An unchanged node of the base vinfo and its copy in the new one */
+struct vnode_move {
+	const struct sd_node *from;
+	const struct sd_node *to;
+};
+
+static int vnode_move_cmp(const void *a, const void *b)
+{
+	const struct vnode_move *m1 = a, *m2 = b;
+
+	return intcmp((uintptr_t)m1->from, (uintptr_t)m2->from);
+}
+
+static int vnode_buf_cmp(const void *a, const void *b)
+{
+	return vnode_cmp(a, b);
+}
+
+/* Whether the vnodes of old can be reused for its new copy n */
+static bool same_vnodes(const struct sd_node *old, const struct sd_node *n,
+			bool diskmode)
+{
+	if (diskmode)
+		return !memcmp(old->disks, n->disks,
+			       sizeof(struct disk_info) * DISK_MAX);
+	return old->nr_vnodes == n->nr_vnodes;
+}
+
+/*
+ * Fill vinfo->vnode_buf with the vnodes of vinfo->nroot sorted by hash.
+ *
+ * A membership change touches only a few nodes, so instead of hashing every
+ * node again we take over the vnodes of the nodes which are unchanged since
+ * base, which are sorted already, and merge the vnodes of the new and
+ * changed nodes into them.  The vnodes of base must match its nodes, so a
+ * vinfo whose nodes were modified in place can't be a base.
+ */
+static void build_vnodes(struct vnode_info *vinfo,
+			 const struct vnode_info *base)
+{
+	bool diskmode = vinfo->diskmode;
+	struct vnode_move *moves = NULL, key, *m;
+	struct sd_vnode *fresh;
+	uint64_t *hashes, total = 0;
+	int nr_moves = 0, nr_fresh = 0, nr = 0, i = 0, j = 0;
+	struct sd_node *n;
+
+	if (base && (base->diskmode != diskmode || !base->vnode_buf))
+		base = NULL;
+
+	rb_for_each_entry(n, &vinfo->nroot, rb) {
+		if (diskmode)
+			n->nr_vnodes = node_nr_vnodes(n, true);
+		total += node_nr_vnodes(n, diskmode);
+	}
+	if (!total)
+		return;
+
+	if (base)
+		moves = xmalloc(sizeof(*moves) * vinfo->nr_nodes);
+	hashes = xmalloc(sizeof(*hashes) * total);
+	fresh = xmalloc(sizeof(*fresh) * total);
+	rb_for_each_entry(n, &vinfo->nroot, rb) {
+		const struct sd_node *old = NULL;
+		uint64_t nr_vnodes = node_nr_vnodes(n, diskmode);
+
+		if (base)
+			old = rb_search(&base->nroot, n, rb, node_cmp);
+		if (old && same_vnodes(old, n, diskmode)) {
+			moves[nr_moves].from = old;
+			moves[nr_moves++].to = n;
+			continue;
+		}
+
+		node_vnode_hashes(n, diskmode, hashes);
+		for (uint64_t k = 0; k < nr_vnodes; k++) {
+			fresh[nr_fresh].hash = hashes[k];
+			fresh[nr_fresh++].node = n;
+		}
+	}
+	free(hashes);
+	qsort(fresh, nr_fresh, sizeof(*fresh), vnode_buf_cmp);
+	qsort(moves, nr_moves, sizeof(*moves), vnode_move_cmp);
+
+	/* Merge the kept vnodes, in the order of base, with the fresh ones */
+	vinfo->vnode_buf = xmalloc_tag(sizeof(*vinfo->vnode_buf) * total,
+				       MEM_VNODE_INFO);
+	while (base && i < base->nr_vnodes) {
+		const struct sd_vnode *v = base->vnode_buf + i++;
+
+		key.from = v->node;
+		m = bsearch(&key, moves, nr_moves, sizeof(*moves),
+			    vnode_move_cmp);
+		if (!m)
+			continue;
+
+		while (j < nr_fresh && fresh[j].hash < v->hash)
+			vinfo->vnode_buf[nr++] = fresh[j++];
+		if (unlikely(j < nr_fresh && fresh[j].hash == v->hash))
+			panic("vnode hash collision");
+		vinfo->vnode_buf[nr].hash = v->hash;
+		vinfo->vnode_buf[nr++].node = m->to;
+	}
+	for (; j < nr_fresh; j++) {
+		if (unlikely(nr && vinfo->vnode_buf[nr - 1].hash ==
+			     fresh[j].hash))
+			panic("vnode hash collision");
+		vinfo->vnode_buf[nr++] = fresh[j];
+	}
+	vinfo->nr_vnodes = nr;
+
+	free(fresh);
+	free(moves);
+}
+
+/*
+ * Precompute the replica set of each vnode so that the placement lookups are
+ * a binary search instead of a ring walk which skips the vnodes of the zones
+ * already chosen.  The first member of the set of a vnode is itself, so it
+ * isn't stored, and the vnodes are found by their index in vnode_buf.
+ */
+static void build_vnode_table(struct vnode_info *vinfo)
+{
+	const struct sd_vnode *vnodes = vinfo->vnode_buf;
+	int nr = vinfo->nr_vnodes, nr_set, nr_zones = 0;
+	uint32_t zones[SD_VNODE_SET_SIZE];
+
+	if (!nr)
+		return;
+
+	vinfo->vnode_hashes = xmalloc_tag(sizeof(uint64_t) * nr, MEM_VNODE_INFO);
+	for (int i = 0; i < nr; i++)
+		vinfo->vnode_hashes[i] = vnodes[i].hash;
+
+	/* Every walk around the ring meets the same zones */
+	for (int i = 0; i < nr && nr_zones < SD_VNODE_SET_SIZE; i++) {
+		int j;
+
+		for (j = 0; j < nr_zones; j++)
+			if (zones[j] == vnodes[i].node->zone)
+				break;
+		if (j == nr_zones)
+			zones[nr_zones++] = vnodes[i].node->zone;
+	}
+	nr_set = nr_zones;
+	vinfo->nr_vnode_set = nr_set;
+	if (nr_set == 1)
+		return;
+
+	vinfo->vnode_sets = xmalloc_tag(sizeof(uint32_t) * nr * (nr_set - 1),
+					MEM_VNODE_INFO);
+	for (int i = 0; i < nr; i++) {
+		uint32_t *set = vinfo->vnode_sets + i * (nr_set - 1);
+		int found = 0, k = i;
+
+		while (found < nr_set - 1) {
+			const struct sd_vnode *next;
+			int j;
+
+			k = (k + 1) % nr;
+			next = vnodes + k;
+			if (same_zone(vnodes + i, next))
+				continue;
+			for (j = 0; j < found; j++)
+				if (same_zone(vnodes + set[j], next))
+					break;
+			if (j == found)
+				set[found++] = k;
+		}
+	}
+}
+
+/*
+ * Build the vnode info of nroot.  If base is not NULL, the vnodes of the nodes
+ * which didn't change since base are taken over from it instead of being
+ * computed again, see build_vnodes().
+ */
+struct vnode_info *alloc_vnode_info_from(const struct vnode_info *base,
+					 const struct rb_root *nroot)
 {
 	struct vnode_info *vnode_info;
 	struct sd_node *n;
 
-	vnode_info = xzalloc(sizeof(*vnode_info));
+	vnode_info = xzalloc_tag(sizeof(*vnode_info), MEM_VNODE_INFO);
 
 	INIT_RB_ROOT(&vnode_info->vroot);
 	INIT_RB_ROOT(&vnode_info->nroot);
@@ -150,15 +365,54 @@ struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
 	if (is_cluster_autovnodes(&sys->cinfo))
 		recalculate_vnodes(&vnode_info->nroot);
 
-	if (is_cluster_diskmode(&sys->cinfo))
-		disks_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
-	else
-		nodes_to_vnodes(&vnode_info->nroot, &vnode_info->vroot);
+	vnode_info->diskmode = is_cluster_diskmode(&sys->cinfo);
+	build_vnodes(vnode_info, base);
 	vnode_info->nr_zones = get_zones_nr_from(&vnode_info->nroot);
+	vnode_info->nr_probes = sd_placement_probes(sys->cinfo.flags);
+	build_vnode_table(vnode_info);
 	refcount_set(&vnode_info->refcnt, 1);
 	return vnode_info;
 }
 
+struct vnode_info *alloc_vnode_info(const struct rb_root *nroot)
+{
+	return alloc_vnode_info_from(NULL, nroot);
+}
+
+/* Whether vinfo has exactly the nodes of nroot */
+static bool vnode_info_has_nodes(const struct vnode_info *vinfo,
+				 const struct rb_root *nroot, int nr_nodes)
+{
+	struct sd_node *n, *old;
+
+	if (vinfo->nr_nodes != nr_nodes)
+		return false;
+
+	rb_for_each_entry(n, nroot, rb) {
+		old = rb_search(&vinfo->nroot, n, rb, node_cmp);
+		if (!old || memcmp(&old->nid, &n->nid,
+				   sizeof(*n) - offsetof(typeof(*n), nid)))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Get the vnode info of the nr_nodes nodes of nroot.  Most of the epochs have
+ * the same members as the one next to them, so if base has exactly these
+ * nodes, it's shared instead of being copied.  Otherwise a new vnode info is
+ * built from base.
+ */
+struct vnode_info *share_vnode_info_from(struct vnode_info *base,
+					 const struct rb_root *nroot,
+					 int nr_nodes)
+{
+	if (base && vnode_info_has_nodes(base, nroot, nr_nodes))
+		return grab_vnode_info(base);
+
+	return alloc_vnode_info_from(base, nroot);
+}
+
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 					struct vnode_info *cur_vinfo)
 {
@@ -176,7 +430,7 @@ struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 	for (int i = 0; i < nr_nodes; i++)
 		rb_insert(&nroot, &nodes[i], rb, node_cmp);
 
-	return alloc_vnode_info(&nroot);
+	return share_vnode_info_from(cur_vinfo, &nroot, nr_nodes);
 }
 
 int get_nodes_epoch(uint32_t epoch, struct vnode_info *cur_vinfo,
@@ -214,25 +468,53 @@ int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
 /* Indicator if a cluster operation is currently running. */
 static bool cluster_op_running;
 
-static struct vdi_op_message *prepare_cluster_msg(struct request *req,
-		size_t *sizep)
+/* Indicator if ->block() was called for the requests waiting to be blocked */
+static bool block_requested;
+
+/*
+ * The cluster requests issued while an earlier one of this node is still in
+ * flight are coalesced into one SD_OP_CLUSTER_BATCH message.  The cluster
+ * driver delivers it atomically and every node processes the operations in
+ * it in order, as if they were delivered one by one.
+ */
+#define CLUSTER_BATCH_MAX 64
+
+struct cluster_batch {
+	struct work work;
+	int nr;
+	struct request *reqs[CLUSTER_BATCH_MAX];
+	/* the messages of the operations, freed when they are done */
+	struct arena arena;
+};
+
+static main_thread(struct list_head *) held_notify_list;
+
+static size_t cluster_msg_size(const struct vdi_op_message *msg)
 {
-	struct vdi_op_message *msg;
-	size_t size;
+	const struct sd_op_template *op = get_sd_op(msg->req.opcode);
 
-	if (has_process_main(req->op) && req->rq.flags & SD_FLAG_CMD_WRITE)
+	if (has_process_main(op) && msg->req.flags & SD_FLAG_CMD_WRITE)
 		/* notify data that was received from the sender */
-		size = sizeof(*msg) + req->rq.data_length;
+		return sizeof(*msg) + msg->req.data_length;
 	else
 		/* notify data that was set in process_work */
-		size = sizeof(*msg) + req->rp.data_length;
+		return sizeof(*msg) + msg->rsp.data_length;
+}
 
-	sd_assert(size <= SD_MAX_EVENT_BUF_SIZE);
+static struct vdi_op_message *prepare_cluster_msg(struct request *req,
+		size_t *sizep, struct arena *arena)
+{
+	struct vdi_op_message hdr = {}, *msg;
+	size_t size;
+
+	memcpy(&hdr.req, &req->rq, sizeof(struct sd_req));
+	memcpy(&hdr.rsp, &req->rp, sizeof(struct sd_rsp));
 
-	msg = xzalloc(size);
-	memcpy(&msg->req, &req->rq, sizeof(struct sd_req));
-	memcpy(&msg->rsp, &req->rp, sizeof(struct sd_rsp));
+	size = cluster_msg_size(&hdr);
+	sd_assert(size <= SD_MAX_EVENT_BUF_SIZE);
 
+	msg = arena_alloc(arena, size);
+	memcpy(msg, &hdr, sizeof(hdr));
 	if (has_process_main(req->op) && size > sizeof(*msg))
 		memcpy(msg->data, req->data, size - sizeof(*msg));
 
@@ -240,19 +522,63 @@ static struct vdi_op_message *prepare_cluster_msg(struct request *req,
 	return msg;
 }
 
+/* The largest message that the request can produce */
+static size_t cluster_msg_max_size(const struct request *req)
+{
+	return round_up(sizeof(struct vdi_op_message) +
+			max(req->rq.data_length, req->rp.data_length), 8);
+}
+
+/* Pack the messages of the requests, a single one is sent as it is */
+static struct vdi_op_message *prepare_batch_msg(struct request **reqs,
+						int nr, size_t *sizep,
+						struct arena *arena)
+{
+	struct vdi_op_message *msg, *sub;
+	size_t size, len = 0;
+
+	if (nr == 1)
+		return prepare_cluster_msg(reqs[0], sizep, arena);
+
+	msg = arena_zalloc(arena, SD_MAX_EVENT_BUF_SIZE);
+	sd_init_req(&msg->req, SD_OP_CLUSTER_BATCH);
+
+	for (int i = 0; i < nr; i++) {
+		sub = prepare_cluster_msg(reqs[i], &size, arena);
+		sd_assert(sizeof(*msg) + len + size <= SD_MAX_EVENT_BUF_SIZE);
+		memcpy(msg->data + len, sub, size);
+		len += round_up(size, 8);
+	}
+	msg->req.data_length = len;
+
+	*sizep = sizeof(*msg) + len;
+	return msg;
+}
+
+static void cluster_batch_work(struct work *work)
+{
+	struct cluster_batch *batch =
+		container_of(work, struct cluster_batch, work);
+
+	for (int i = 0; i < batch->nr; i++)
+		do_process_work(&batch->reqs[i]->work);
+}
+
 static void cluster_op_done(struct work *work)
 {
-	struct request *req = container_of(work, struct request, work);
+	struct cluster_batch *batch =
+		container_of(work, struct cluster_batch, work);
 	struct vdi_op_message *msg;
 	size_t size;
 	int ret;
 
-	if (req->status == REQUEST_DROPPED)
+	if (batch->reqs[0]->status == REQUEST_DROPPED)
 		goto drop;
 
-	sd_debug("%s (%p)", op_name(req->op), req);
+	sd_debug("%s (%p), %d ops", op_name(batch->reqs[0]->op),
+		 batch->reqs[0], batch->nr);
 
-	msg = prepare_cluster_msg(req, &size);
+	msg = prepare_batch_msg(batch->reqs, batch->nr, &size, &batch->arena);
 
 	ret = sys->cdrv->unblock(msg, size);
 	if (ret != SD_RES_SUCCESS) {
@@ -265,19 +591,27 @@ static void cluster_op_done(struct work *work)
 		exit(1);
 	}
 
-	free(msg);
-	req->status = REQUEST_DONE;
+	for (int i = 0; i < batch->nr; i++)
+		batch->reqs[i]->status = REQUEST_DONE;
+	arena_destroy(&batch->arena);
+	free(batch);
 	return;
 drop:
-	list_del(&req->pending_list);
-	req->rp.result = SD_RES_CLUSTER_ERROR;
-	put_request(req);
+	for (int i = 0; i < batch->nr; i++) {
+		struct request *req = batch->reqs[i];
+
+		list_del(&req->pending_list);
+		req->rp.result = SD_RES_CLUSTER_ERROR;
+		put_request(req);
+	}
+	free(batch);
 	cluster_op_running = false;
 }
 
 /*
- * Perform a blocked cluster operation if we were the node requesting it
- * and do not have any other operation pending.
+ * Perform the blocked cluster operations if we were the node requesting them
+ * and do not have any other operation pending.  All the requests waiting for
+ * the block are executed in one batch.
  *
  * If this method returns false the caller must call the method again for
  * the same event once it gets notified again.
@@ -287,7 +621,10 @@ drop:
  */
 main_fn bool sd_block_handler(const struct sd_node *sender)
 {
+	struct cluster_batch *batch;
 	struct request *req;
+	size_t size = sizeof(struct vdi_op_message);
+	bool left = false;
 
 	if (!node_is_local(sender))
 		return false;
@@ -295,17 +632,127 @@ main_fn bool sd_block_handler(const struct sd_node *sender)
 		return false;
 
 	cluster_op_running = true;
+	block_requested = false;
 
-	req = list_first_entry(main_thread_get(pending_block_list),
-				struct request, pending_list);
-	req->work.fn = do_process_work;
-	req->work.done = cluster_op_done;
+	batch = xzalloc(sizeof(*batch));
+	list_for_each_entry(req, main_thread_get(pending_block_list),
+			    pending_list) {
+		if (req->status != REQUEST_INIT)
+			continue;
+
+		if (batch->nr > 0 && (batch->nr == CLUSTER_BATCH_MAX ||
+		    size + cluster_msg_max_size(req) > SD_MAX_EVENT_BUF_SIZE)) {
+			left = true;
+			break;
+		}
+
+		size += cluster_msg_max_size(req);
+		req->status = REQUEST_QUEUED;
+		batch->reqs[batch->nr++] = req;
+	}
+	sd_assert(batch->nr > 0);
+
+	/* the rest needs another block */
+	if (left) {
+		if (sys->cdrv->block() != SD_RES_SUCCESS)
+			sd_err("failed to broadcast block to cluster");
+		else
+			block_requested = true;
+	}
 
-	queue_work(sys->block_wqueue, &req->work);
-	req->status = REQUEST_QUEUED;
+	batch->work.fn = cluster_batch_work;
+	batch->work.done = cluster_op_done;
+	queue_work(sys->block_wqueue, &batch->work);
 	return true;
 }
 
+static int notify_cluster_requests(struct request **reqs, int nr)
+{
+	struct arena arena = ARENA_INIT;
+	struct vdi_op_message *msg;
+	size_t size;
+	int ret;
+
+	for (int i = 0; i < nr; i++)
+		reqs[i]->rp.result = SD_RES_SUCCESS;
+
+	msg = prepare_batch_msg(reqs, nr, &size, &arena);
+
+	ret = sys->cdrv->notify(msg, size);
+	arena_destroy(&arena);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to broadcast notify to cluster, %s",
+		       sd_strerror(ret));
+		return ret;
+	}
+
+	for (int i = 0; i < nr; i++)
+		list_add_tail(&reqs[i]->pending_list,
+			      main_thread_get(pending_notify_list));
+	return SD_RES_SUCCESS;
+}
+
+static int notify_cluster_request(struct request *req)
+{
+	/* wait for the notification in flight, and go with the next batch */
+	if (!list_empty(main_thread_get(pending_notify_list))) {
+		list_add_tail(&req->pending_list,
+			      main_thread_get(held_notify_list));
+		return SD_RES_SUCCESS;
+	}
+
+	return notify_cluster_requests(&req, 1);
+}
+
+/* Send the held requests once the notifications in flight are delivered */
+static void flush_held_notify(void)
+{
+	struct request *reqs[CLUSTER_BATCH_MAX], *req;
+	size_t size;
+	int nr, ret;
+
+	while (list_empty(main_thread_get(pending_notify_list)) &&
+	       !list_empty(main_thread_get(held_notify_list))) {
+		size = sizeof(struct vdi_op_message);
+		nr = 0;
+		list_for_each_entry(req, main_thread_get(held_notify_list),
+				    pending_list) {
+			if (nr > 0 && (nr == CLUSTER_BATCH_MAX ||
+			    size + cluster_msg_max_size(req) >
+			    SD_MAX_EVENT_BUF_SIZE))
+				break;
+
+			size += cluster_msg_max_size(req);
+			list_del(&req->pending_list);
+			reqs[nr++] = req;
+		}
+
+		ret = notify_cluster_requests(reqs, nr);
+		if (ret != SD_RES_SUCCESS)
+			for (int i = 0; i < nr; i++) {
+				reqs[i]->rp.result = ret;
+				put_request(reqs[i]);
+			}
+	}
+}
+
+/* process_prepare() is done, broadcast the operation with its result */
+static void cluster_op_prepared(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	int ret = req->rp.result;
+
+	if (ret == SD_RES_SUCCESS)
+		ret = notify_cluster_request(req);
+
+	if (ret != SD_RES_SUCCESS) {
+		req->rp.result = ret;
+		put_request(req);
+		return;
+	}
+	req->status = REQUEST_INIT;
+}
+
 /*
  * Execute a cluster operation by letting the cluster driver send it to all
  * nodes in the cluster.
@@ -318,33 +765,34 @@ main_fn void queue_cluster_request(struct request *req)
 	int ret;
 	sd_debug("%s (%p)", op_name(req->op), req);
 
+	if (sys->observer) {
+		observe_forward(req);
+		return;
+	}
+
 	if (has_process_work(req->op)) {
-		ret = sys->cdrv->block();
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("failed to broadcast block to cluster, %s",
-			       sd_strerror(ret));
-			goto error;
+		/* one block is enough for all the waiting requests */
+		if (!block_requested) {
+			ret = sys->cdrv->block();
+			if (ret != SD_RES_SUCCESS) {
+				sd_err("failed to broadcast block to cluster,"
+				       " %s", sd_strerror(ret));
+				goto error;
+			}
+			block_requested = true;
 		}
 		list_add_tail(&req->pending_list,
 			      main_thread_get(pending_block_list));
+	} else if (has_process_prepare(req->op)) {
+		/* Prepare locally without blocking the cluster, then notify */
+		req->work.fn = do_process_prepare;
+		req->work.done = cluster_op_prepared;
+		queue_work(sys->io_wqueue, &req->work);
+		return;
 	} else {
-		struct vdi_op_message *msg;
-		size_t size;
-
-		msg = prepare_cluster_msg(req, &size);
-		msg->rsp.result = SD_RES_SUCCESS;
-
-		ret = sys->cdrv->notify(msg, size);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("failed to broadcast notify to cluster, %s",
-			       sd_strerror(ret));
+		ret = notify_cluster_request(req);
+		if (ret != SD_RES_SUCCESS)
 			goto error;
-		}
-
-		list_add_tail(&req->pending_list,
-			      main_thread_get(pending_notify_list));
-
-		free(msg);
 	}
 	req->status = REQUEST_INIT;
 	return;
@@ -476,11 +924,48 @@ static enum sd_status cluster_wait_check(const struct sd_node *joining,
 	return sys->cinfo.status;
 }
 
+/*
+ * The vdi states of the other nodes as of their SD_OP_GET_VDI_STATE_DELTA
+ * version, so that only the changes are transferred on the next join.  Only
+ * the block work queue accesses them.
+ */
+struct vdi_state_peer {
+	struct node_id nid;
+	uint64_t generation;
+	uint64_t version;
+	uint64_t local_generation;	/* of our vdi states when synced */
+	struct rb_node rb;
+};
+
+static struct rb_root vdi_state_peer_root = RB_ROOT;
+
+static int vdi_state_peer_cmp(const struct vdi_state_peer *a,
+			      const struct vdi_state_peer *b)
+{
+	return node_id_cmp(&a->nid, &b->nid);
+}
+
+static struct vdi_state_peer *get_vdi_state_peer(const struct node_id *nid)
+{
+	struct vdi_state_peer *peer, key = { .nid = *nid };
+
+	peer = rb_search(&vdi_state_peer_root, &key, rb, vdi_state_peer_cmp);
+	if (peer)
+		return peer;
+
+	peer = xzalloc(sizeof(*peer));
+	peer->nid = *nid;
+	rb_insert(&vdi_state_peer_root, peer, rb, vdi_state_peer_cmp);
+	return peer;
+}
+
 static int get_vdis_from(struct sd_node *node)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	struct vdi_state *vs = NULL;
+	struct vdi_state_compact *vs = NULL;
+	struct vdi_state_peer *peer;
+	uint64_t local_generation = get_vdi_state_generation();
 	int i, ret;
 	unsigned int rlen;
 	int count;
@@ -488,13 +973,20 @@ static int get_vdis_from(struct sd_node *node)
 	if (node_is_local(node))
 		return SD_RES_SUCCESS;
 
+	peer = get_vdi_state_peer(&node->nid);
+	/* our states were cleaned after the last sync */
+	if (peer->local_generation != local_generation)
+		peer->generation = peer->version = 0;
+
 #define DEFAULT_VDI_STATE_COUNT 512
-	rlen = DEFAULT_VDI_STATE_COUNT * sizeof(struct vdi_state);
+	rlen = DEFAULT_VDI_STATE_COUNT * sizeof(*vs);
 	vs = xzalloc(rlen);
 retry:
-	sd_init_req(&hdr, SD_OP_GET_VDI_COPIES);
+	sd_init_req(&hdr, SD_OP_GET_VDI_STATE_DELTA);
 	hdr.data_length = rlen;
 	hdr.epoch = sys_epoch();
+	hdr.vdi_state_delta.generation = peer->generation;
+	hdr.vdi_state_delta.version = peer->version;
 	ret = sheep_exec_req(&node->nid, &hdr, (char *)vs);
 	switch (ret) {
 	case SD_RES_SUCCESS:
@@ -508,6 +1000,9 @@ retry:
 	}
 
 	count = rsp->data_length / sizeof(*vs);
+	sd_debug("%d %s vdi states from %s", count,
+		 rsp->vdi_state_delta.full ? "all" : "changed",
+		 node_to_str(node));
 	for (i = 0; i < count; i++) {
 		atomic_set_bit(vs[i].vid, sys->vdi_inuse);
 		if (vs[i].deleted)
@@ -515,8 +1010,13 @@ retry:
 		add_vdi_state_unordered(vs[i].vid, vs[i].nr_copies,
 					vs[i].snapshot, vs[i].copy_policy,
 					vs[i].block_size_shift,
-					vs[i].parent_vid);
+					vs[i].parent_vid, vs[i].flags);
 	}
+
+	peer->generation = rsp->vdi_state_delta.generation;
+	peer->version = rsp->vdi_state_delta.version;
+	/* adding the states above may have started our generation */
+	peer->local_generation = local_generation ?: get_vdi_state_generation();
 out:
 	free(vs);
 	return ret;
@@ -599,6 +1099,10 @@ static main_fn void get_vdis_done(struct work *work)
 		 */
 		collect_cinfo();
 
+	if (refcount_read(&nr_get_vdis_works) == 0 &&
+	    sys->cinfo.status == SD_STATUS_OK)
+		vdi_convert_resume();
+
 }
 
 int inc_and_log_epoch(void)
@@ -931,7 +1435,8 @@ static void update_cluster_info(const struct cluster_info *cinfo,
 	 * of this dereference is alloc_vnode_info().
 	 */
 	old_vnode_info = main_thread_get(current_vnode_info);
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	main_thread_set(current_vnode_info,
+			alloc_vnode_info_from(old_vnode_info, nroot));
 
 	if (node_is_local(joined)) {
 		sockfd_cache_add_group(nroot);
@@ -996,16 +1501,9 @@ static void update_cluster_info(const struct cluster_info *cinfo,
 	put_vnode_info(old_vnode_info);
 }
 
-/*
- * Pass on a notification message from the cluster driver.
- *
- * Must run in the main thread as it accesses unlocked state like
- * sys->pending_list.
- */
-main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
-			       size_t data_len)
+static void process_cluster_msg(const struct sd_node *sender,
+				struct vdi_op_message *msg, size_t data_len)
 {
-	struct vdi_op_message *msg = data;
 	const struct sd_op_template *op = get_sd_op(msg->req.opcode);
 	int ret = msg->rsp.result;
 	struct request *req = NULL;
@@ -1043,6 +1541,32 @@ main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
 		cluster_op_running = false;
 }
 
+/*
+ * Pass on a notification message from the cluster driver.
+ *
+ * Must run in the main thread as it accesses unlocked state like
+ * sys->pending_list.
+ */
+main_fn void sd_notify_handler(const struct sd_node *sender, void *data,
+			       size_t data_len)
+{
+	struct vdi_op_message *msg = data, *sub;
+	size_t size;
+
+	if (msg->req.opcode != SD_OP_CLUSTER_BATCH)
+		process_cluster_msg(sender, msg, data_len);
+	else
+		for (size_t off = 0; off < msg->req.data_length;
+		     off += round_up(size, 8)) {
+			sub = (struct vdi_op_message *)(msg->data + off);
+			size = cluster_msg_size(sub);
+			process_cluster_msg(sender, sub, size);
+		}
+
+	if (node_is_local(sender))
+		flush_held_notify();
+}
+
 /*
  * Accept the joining node and pass the cluster info to it.
  *
@@ -1096,10 +1620,14 @@ static int send_join_request(void)
 
 static void requeue_cluster_request(void)
 {
+	struct arena arena = ARENA_INIT;
 	struct request *req;
 	struct vdi_op_message *msg;
 	size_t size;
 
+	/* the block events were lost with the session */
+	block_requested = false;
+
 	list_for_each_entry(req, main_thread_get(pending_notify_list),
 			    pending_list) {
 		/*
@@ -1111,9 +1639,8 @@ static void requeue_cluster_request(void)
 		 */
 		sd_debug("finish pending notify request, op: %s",
 			 op_name(req->op));
-		msg = prepare_cluster_msg(req, &size);
+		msg = prepare_cluster_msg(req, &size, &arena);
 		sd_notify_handler(&sys->this_node, msg, size);
-		free(msg);
 	}
 
 	list_for_each_entry(req, main_thread_get(pending_block_list),
@@ -1149,14 +1676,14 @@ static void requeue_cluster_request(void)
 			 */
 			sd_debug("finish pending block request, op: %s",
 				 op_name(req->op));
-			msg = prepare_cluster_msg(req, &size);
+			msg = prepare_cluster_msg(req, &size, &arena);
 			sd_notify_handler(&sys->this_node, msg, size);
-			free(msg);
 			break;
 		default:
 			break;
 		}
 	}
+	arena_destroy(&arena);
 }
 
 main_fn int sd_reconnect_handler(void)
@@ -1294,7 +1821,8 @@ main_fn void sd_leave_handler(const struct sd_node *left,
 	 * because of the same reason of update_cluster_info()
 	 */
 	old_vnode_info = main_thread_get(current_vnode_info);
-	main_thread_set(current_vnode_info, alloc_vnode_info(nroot));
+	main_thread_set(current_vnode_info,
+			alloc_vnode_info_from(old_vnode_info, nroot));
 	if (sys->cinfo.status == SD_STATUS_OK) {
 		if (is_gateway_only_cluster(nroot)) {
 			sd_info("only gateway nodes are remaining, exiting");
@@ -1311,15 +1839,25 @@ main_fn void sd_leave_handler(const struct sd_node *left,
 	put_vnode_info(old_vnode_info);
 
 	sockfd_cache_del_node(&left->nid);
+	sockfd_cache_forget(&left->nid);
 
 	remove_node_from_participants(&left->nid);
 }
 
-static void update_node_info(struct sd_node *node)
+/*
+ * Update node in a copy of the current members.  The nodes of the current
+ * vinfo are left alone because its vnodes were made from them, see
+ * build_vnodes().
+ */
+static void update_node_info(struct rb_root *nroot, struct sd_node *node)
 {
 	struct vnode_info *cur_vinfo = get_vnode_info();
-	struct sd_node *n = rb_search(&cur_vinfo->nroot, node, rb, node_cmp);
+	struct sd_node *n;
+
+	rb_copy(&cur_vinfo->nroot, struct sd_node, rb, nroot, node_cmp);
+	put_vnode_info(cur_vinfo);
 
+	n = rb_search(nroot, node, rb, node_cmp);
 	if (unlikely(!n))
 		panic("can't find %s", node_to_str(node));
 	n->space = node->space;
@@ -1333,10 +1871,9 @@ static void update_node_info(struct sd_node *node)
 			if (node->disks[i].disk_id)
 				n->disks[i] = node->disks[i];
 	}
-	put_vnode_info(cur_vinfo);
 }
 
-static void kick_node_recover(void)
+static void kick_node_recover(const struct rb_root *nroot)
 {
 	/*
 	 * Using main_thread_get() instead of get_vnode_info() is allowed
@@ -1345,7 +1882,7 @@ static void kick_node_recover(void)
 	struct vnode_info *old = main_thread_get(current_vnode_info);
 	int ret;
 
-	main_thread_set(current_vnode_info, alloc_vnode_info(&old->nroot));
+	main_thread_set(current_vnode_info, alloc_vnode_info_from(old, nroot));
 	ret = inc_and_log_epoch();
 	if (ret != 0)
 		panic("cannot log current epoch %d", sys->cinfo.epoch);
@@ -1355,8 +1892,29 @@ static void kick_node_recover(void)
 
 main_fn void sd_update_node_handler(struct sd_node *node)
 {
-	update_node_info(node);
-	kick_node_recover();
+	struct rb_root nroot = RB_ROOT;
+
+	update_node_info(&nroot, node);
+	kick_node_recover(&nroot);
+	rb_destroy(&nroot, struct sd_node, rb);
+}
+
+static void init_request_lists(void)
+{
+	main_thread_set(pending_block_list,
+			  xzalloc(sizeof(struct list_head)));
+	INIT_LIST_HEAD(main_thread_get(pending_block_list));
+	main_thread_set(pending_notify_list,
+			  xzalloc(sizeof(struct list_head)));
+	INIT_LIST_HEAD(main_thread_get(pending_notify_list));
+	main_thread_set(held_notify_list,
+			  xzalloc(sizeof(struct list_head)));
+	INIT_LIST_HEAD(main_thread_get(held_notify_list));
+
+	INIT_LIST_HEAD(&sys->local_req_queue);
+	INIT_LIST_HEAD(&sys->req_wait_queue);
+	for (int i = 0; i < NR_REQ_WAIT_HASH; i++)
+		INIT_LIST_HEAD(&sys->req_oid_wait_queue[i]);
 }
 
 int create_cluster(int port, int64_t zone, int nr_vnodes,
@@ -1422,15 +1980,7 @@ int create_cluster(int port, int64_t zone, int nr_vnodes,
 
 	sys->cinfo.status = SD_STATUS_WAIT;
 
-	main_thread_set(pending_block_list,
-			  xzalloc(sizeof(struct list_head)));
-	INIT_LIST_HEAD(main_thread_get(pending_block_list));
-	main_thread_set(pending_notify_list,
-			  xzalloc(sizeof(struct list_head)));
-	INIT_LIST_HEAD(main_thread_get(pending_notify_list));
-
-	INIT_LIST_HEAD(&sys->local_req_queue);
-	INIT_LIST_HEAD(&sys->req_wait_queue);
+	init_request_lists();
 
 	ret = send_join_request();
 	if (ret != 0)
@@ -1448,9 +1998,281 @@ int leave_cluster(void)
 {
 	static bool left;
 
-	if (left)
+	/* an observer never joined */
+	if (left || sys->observer)
 		return 0;
 
 	left = true;
 	return sys->cdrv->leave();
 }
+
+/*
+ * Observer
+ *
+ * With 'sheep -o', the sheep is a gateway which doesn't join the cluster and
+ * doesn't use the cluster driver.  It follows the membership by polling
+ * SD_OP_CLUSTER_INFO of a member every interval msec, and soon after a peer
+ * answers that our epoch is old or can't be reached, and pulls the changed
+ * vdi states by SD_OP_GET_VDI_STATE_DELTA in the same round.  The vnodes are
+ * built from the nodes of the latest epoch like on the members, so the I/O
+ * requests are forwarded to the peers directly.
+ *
+ * The cluster operations are forwarded to the member we follow, which
+ * broadcasts them, and are answered after the next round, so that e.g. the
+ * state of a new vdi is known here before its first I/O.  A vdi created
+ * through another sheep is known after the next round at the latest.
+ *
+ * The observers take no part in the cluster events nor in the epochs, so any
+ * number of them can run without slowing the membership changes down.
+ */
+
+/* the delay of a round asked for by a failed request */
+#define OBSERVE_KICK_DELAY 100
+
+struct observe_work {
+	struct work work;
+	/* in: the member to ask first, out: the one which answered */
+	struct node_id source;
+	/* in: the last cluster info, out: the new one */
+	struct cluster_info *cinfo;
+	/* the cluster operations waiting for this round */
+	struct list_head reqs;
+	int ret;
+};
+
+struct observe_forward_work {
+	struct work work;
+	struct request *req;
+	struct node_id source;
+};
+
+static struct node_id observe_seed, observe_source;
+static uint32_t observe_interval;
+static struct work_queue *observe_wqueue;
+static struct timer observe_timer;
+static bool observe_running, observe_kicked;
+static LIST_HEAD(observe_waiting_reqs);
+
+static int observe_fetch(const struct node_id *nid, struct cluster_info *cinfo)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, SD_OP_CLUSTER_INFO);
+	hdr.data_length = sizeof(*cinfo);
+	return sheep_exec_req(nid, &hdr, cinfo);
+}
+
+static void observe_work_fn(struct work *work)
+{
+	struct observe_work *w = container_of(work, struct observe_work, work);
+	struct cluster_info *cinfo = xzalloc(sizeof(*cinfo));
+	int nr_nodes = w->cinfo->nr_nodes;
+	const struct node_id *nid;
+	struct sd_node source = {};
+
+	/* the last source, then the nodes of the last epoch, then the seed */
+	w->ret = SD_RES_NETWORK_ERROR;
+	for (int i = -1; i <= nr_nodes; i++) {
+		if (i < 0)
+			nid = &w->source;
+		else if (i < nr_nodes)
+			nid = &w->cinfo->nodes[i].nid;
+		else
+			nid = &observe_seed;
+
+		w->ret = observe_fetch(nid, cinfo);
+		if (w->ret == SD_RES_SUCCESS) {
+			w->source = *nid;
+			break;
+		}
+	}
+	if (w->ret != SD_RES_SUCCESS)
+		goto out;
+
+	memcpy(w->cinfo, cinfo, sizeof(*cinfo));
+	source.nid = w->source;
+	if (get_vdis_from(&source) != SD_RES_SUCCESS)
+		sd_warn("failed to get the vdi states from %s",
+			node_to_str(&source));
+out:
+	free(cinfo);
+}
+
+/* Take the membership of the cluster info over */
+static main_fn void observe_update(const struct cluster_info *cinfo)
+{
+	struct vnode_info *old_vinfo = main_thread_get(current_vnode_info);
+	struct rb_root nroot = RB_ROOT;
+	struct sd_node *n;
+
+	sys->cinfo.status = cinfo->status;
+	if (old_vinfo && cinfo->epoch == sys->cinfo.epoch &&
+	    cinfo->ctime == sys->cinfo.ctime)
+		return;
+
+	sd_info("epoch %"PRIu32", %d nodes", cinfo->epoch, cinfo->nr_nodes);
+	sys->cinfo.proto_ver = cinfo->proto_ver;
+	sys->cinfo.disable_recovery = cinfo->disable_recovery;
+	sys->cinfo.ctime = cinfo->ctime;
+	sys->cinfo.flags = cinfo->flags;
+	sys->cinfo.nr_copies = cinfo->nr_copies;
+	sys->cinfo.copy_policy = cinfo->copy_policy;
+	sys->cinfo.block_size_shift = cinfo->block_size_shift;
+	memcpy(sys->cinfo.default_store, cinfo->default_store,
+	       sizeof(sys->cinfo.default_store));
+	sys->cinfo.nr_nodes = cinfo->nr_nodes;
+	memcpy(sys->cinfo.nodes, cinfo->nodes,
+	       sizeof(cinfo->nodes[0]) * cinfo->nr_nodes);
+
+	for (int i = 0; i < sys->cinfo.nr_nodes; i++)
+		rb_insert(&nroot, &sys->cinfo.nodes[i], rb, node_cmp);
+
+	main_thread_set(current_vnode_info,
+			share_vnode_info_from(old_vinfo, &nroot,
+					      sys->cinfo.nr_nodes));
+	if (old_vinfo) {
+		rb_for_each_entry(n, &old_vinfo->nroot, rb) {
+			if (rb_search(&nroot, n, rb, node_cmp))
+				continue;
+			sockfd_cache_del_node(&n->nid);
+			sockfd_cache_forget(&n->nid);
+		}
+		put_vnode_info(old_vinfo);
+	}
+	sockfd_cache_add_group(&nroot);
+
+	uatomic_set(&sys->cinfo.epoch, cinfo->epoch);
+	wakeup_requests_on_epoch();
+}
+
+static void observe_start(void *arg);
+
+static main_fn void observe_done(struct work *work)
+{
+	struct observe_work *w = container_of(work, struct observe_work, work);
+	struct request *req;
+
+	if (w->ret == SD_RES_SUCCESS) {
+		observe_source = w->source;
+		observe_update(w->cinfo);
+	} else
+		sd_err("failed to get the cluster info, %s",
+		       sd_strerror(w->ret));
+
+	list_for_each_entry(req, &w->reqs, pending_list) {
+		list_del(&req->pending_list);
+		put_request(req);
+	}
+	free(w->cinfo);
+	free(w);
+
+	observe_running = false;
+	add_timer(&observe_timer, observe_kicked ? OBSERVE_KICK_DELAY :
+		  observe_interval);
+}
+
+static main_fn void observe_start(void *arg)
+{
+	struct observe_work *w;
+
+	if (!observe_wqueue) {
+		observe_wqueue = create_ordered_work_queue("observe");
+		if (!observe_wqueue)
+			panic("failed to create the observer queue");
+	}
+
+	w = xzalloc(sizeof(*w));
+	w->source = observe_source;
+	w->cinfo = xmalloc(sizeof(*w->cinfo));
+	memcpy(w->cinfo, &sys->cinfo, sizeof(*w->cinfo));
+	INIT_LIST_HEAD(&w->reqs);
+	list_splice_init(&observe_waiting_reqs, &w->reqs);
+	w->work.fn = observe_work_fn;
+	w->work.done = observe_done;
+
+	observe_running = true;
+	observe_kicked = false;
+	queue_work(observe_wqueue, &w->work);
+}
+
+/* Ask for a round soon, after a request found our membership stale */
+main_fn void observe_kick(void)
+{
+	if (!sys->observer || observe_kicked)
+		return;
+
+	observe_kicked = true;
+	if (!observe_running)
+		add_timer(&observe_timer, OBSERVE_KICK_DELAY);
+}
+
+static void observe_forward_work(struct work *work)
+{
+	struct observe_forward_work *f =
+		container_of(work, struct observe_forward_work, work);
+	struct request *req = f->req;
+	struct sd_req hdr = req->rq;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	ret = sheep_exec_req(&f->source, &hdr, req->data);
+	memcpy(&req->rp, rsp, sizeof(*rsp));
+	req->rp.result = ret;
+}
+
+static main_fn void observe_forward_done(struct work *work)
+{
+	struct observe_forward_work *f =
+		container_of(work, struct observe_forward_work, work);
+	struct request *req = f->req;
+
+	free(f);
+	if (req->rp.result != SD_RES_SUCCESS) {
+		if (req->rp.result == SD_RES_NETWORK_ERROR)
+			observe_kick();
+		put_request(req);
+		return;
+	}
+
+	/* answer once the next round brought the new state */
+	list_add_tail(&req->pending_list, &observe_waiting_reqs);
+	observe_kicked = true;
+	if (!observe_running)
+		add_timer(&observe_timer, 0);
+}
+
+/* Send a cluster operation to the member we follow */
+main_fn void observe_forward(struct request *req)
+{
+	struct observe_forward_work *f = xzalloc(sizeof(*f));
+
+	f->req = req;
+	f->source = observe_source;
+	f->work.fn = observe_forward_work;
+	f->work.done = observe_forward_done;
+	queue_work(sys->io_wqueue, &f->work);
+}
+
+int observe_cluster(const struct node_id *seed, uint32_t interval, int port,
+		    bool explicit_addr)
+{
+	if (!explicit_addr && get_local_addr(sys->this_node.nid.addr) < 0) {
+		sd_err("failed to get the local address");
+		return -1;
+	}
+	sys->this_node.nid.port = port;
+	sys->this_node.nr_vnodes = 0;
+	sys->cinfo.status = SD_STATUS_WAIT;
+
+	init_request_lists();
+
+	observe_seed = observe_source = *seed;
+	observe_interval = interval;
+	observe_timer.callback = observe_start;
+	/* the first round runs once the event loop does */
+	add_timer(&observe_timer, 0);
+
+	sd_info("observe the cluster of %s every %"PRIu32" msec",
+		addr_to_str(seed->addr, seed->port), interval);
+	return 0;
+}
@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Handover of the connections to a new sheep
+ *
+ * Every sheep listens on the unix domain socket 'handover' of its base
+ * directory.  A new sheep started with '-T' on the same directory connects
+ * to it before locking the directory, and the running sheep:
+ *
+ *  1. stops accepting and holds the receiving from all the connections after
+ *     their current requests, see freeze_clients()
+ *  2. waits until the requests read from them are answered
+ *  3. passes the listening sockets and the connections to the new sheep with
+ *     SCM_RIGHTS, HANDOVER_BATCH of them per message
+ *  4. exits as if it was killed, which saves the startup state
+ *
+ * The requests the clients send in the meantime wait in the socket buffers,
+ * so the clients see a pause instead of a broken connection.  The new sheep
+ * waits for the old one to exit, starts with the startup state saved by it
+ * instead of walking the objects, and polls the connections once it has
+ * joined the cluster.  The connections of the shared memory rings are closed,
+ * and if they aren't drained within HANDOVER_TIMEOUT, the old sheep resumes
+ * them and the new one gives up.
+ *
+ * The node leaves and joins the cluster again like a restart.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sheep_priv.h"
+
+#define HANDOVER_MAGIC 0x68616e64	/* "hand" */
+#define HANDOVER_BATCH 64
+#define HANDOVER_TIMEOUT 30		/* sec */
+#define HANDOVER_POLL 10		/* ms */
+#define HANDOVER_REQ_TIMEOUT 5000	/* ms */
+#define HANDOVER_MAX_FDS 65536
+
+#define HANDOVER_FD_LISTEN	0x01
+#define HANDOVER_FD_INET	0x02
+
+struct handover_msg {
+	uint32_t magic;
+	uint32_t nr;		/* of the fds passed with it, 0 for the last */
+	uint8_t flags[HANDOVER_BATCH];	/* HANDOVER_FD_* */
+};
+
+static char handover_path[PATH_MAX];
+static int handover_fd = -1;	/* of the new sheep */
+static uint64_t handover_deadline;
+static struct timer handover_timer;
+
+/* the new sheep which connected but hasn't sent its request yet */
+static int handover_req_fd = -1;
+static struct handover_msg handover_req;
+static size_t handover_req_len;
+static struct timer handover_req_timer;
+
+/* the fds taken over from the old sheep */
+static struct handover_fd *adopted_fds;
+static int nr_adopted_fds;
+static struct timer adopt_timer;
+
+static int send_batch(int fd, const struct handover_fd *fds, int nr)
+{
+	char control[CMSG_SPACE(sizeof(int) * HANDOVER_BATCH)] = {};
+	struct handover_msg m = { .magic = HANDOVER_MAGIC, .nr = nr };
+	struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	for (int i = 0; i < nr; i++)
+		m.flags[i] = (fds[i].listen ? HANDOVER_FD_LISTEN : 0) |
+			(fds[i].is_inet_socket ? HANDOVER_FD_INET : 0);
+
+	if (nr) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr);
+		for (int i = 0; i < nr; i++)
+			memcpy(CMSG_DATA(cmsg) + sizeof(int) * i, &fds[i].fd,
+			       sizeof(int));
+	}
+
+	do {
+		ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret != sizeof(m)) {
+		sd_err("failed to pass the fds, %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+static main_fn int send_fds(void)
+{
+	struct handover_fd *fds = xmalloc(sizeof(*fds) * HANDOVER_MAX_FDS);
+	int nr, ret = 0;
+
+	nr = get_handover_fds(fds, HANDOVER_MAX_FDS);
+	for (int i = 0; i < nr && ret == 0; i += HANDOVER_BATCH)
+		ret = send_batch(handover_fd, fds + i,
+				 min(nr - i, HANDOVER_BATCH));
+	if (ret == 0)
+		ret = send_batch(handover_fd, NULL, 0);
+	if (ret == 0)
+		sd_info("handed over %d fds", nr);
+
+	free(fds);
+	return ret;
+}
+
+static main_fn void abort_handover(void)
+{
+	thaw_clients();
+	close(handover_fd);
+	handover_fd = -1;
+}
+
+static main_fn void handover_poll(void *data)
+{
+	if (!clients_drained()) {
+		if (clock_get_time() < handover_deadline) {
+			add_timer(&handover_timer, HANDOVER_POLL);
+			return;
+		}
+		sd_err("the connections weren't drained in %d sec",
+		       HANDOVER_TIMEOUT);
+		abort_handover();
+		return;
+	}
+
+	if (send_fds() < 0) {
+		abort_handover();
+		return;
+	}
+
+	/*
+	 * The new sheep waits for handover_fd to be closed by the exit, which
+	 * releases the lock of the base directory as well
+	 */
+	sys->cinfo.status = SD_STATUS_KILLED;
+}
+
+static main_fn void drop_handover_req(void)
+{
+	unregister_event(handover_req_fd);
+	del_timer(&handover_req_timer);
+	close(handover_req_fd);
+	handover_req_fd = -1;
+}
+
+static main_fn void handover_req_expire(void *data)
+{
+	sd_err("the new sheep didn't send the handover request in %d ms",
+	       HANDOVER_REQ_TIMEOUT);
+	drop_handover_req();
+}
+
+static main_fn void handover_start(int fd)
+{
+	sd_info("handing over the connections to a new sheep");
+	handover_fd = fd;
+	handover_deadline = clock_get_time() +
+		HANDOVER_TIMEOUT * 1000000000ULL;
+	freeze_clients();
+	handover_timer.callback = handover_poll;
+	add_timer(&handover_timer, 0);
+}
+
+/* Read the request of the new sheep without blocking the main thread */
+static main_fn void handover_recv_req(int fd, int events, void *data)
+{
+	ssize_t ret;
+
+	ret = read(fd, (char *)&handover_req + handover_req_len,
+		   sizeof(handover_req) - handover_req_len);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret <= 0) {
+		sd_err("failed to read the handover request");
+		drop_handover_req();
+		return;
+	}
+
+	handover_req_len += ret;
+	if (handover_req_len < sizeof(handover_req))
+		return;
+
+	if (handover_req.magic != HANDOVER_MAGIC ||
+	    handover_fd >= 0 || sys->cinfo.status == SD_STATUS_KILLED ||
+	    sys->cinfo.status == SD_STATUS_SHUTDOWN) {
+		sd_err("invalid handover request");
+		drop_handover_req();
+		return;
+	}
+
+	unregister_event(fd);
+	del_timer(&handover_req_timer);
+	handover_req_fd = -1;
+	/* the fds are passed with blocking sends */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	handover_start(fd);
+}
+
+static main_fn void handover_accept(int listen_fd, int events, void *data)
+{
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		sd_err("failed to accept the new sheep, %m");
+		return;
+	}
+
+	if (handover_fd >= 0 || handover_req_fd >= 0 ||
+	    sys->cinfo.status == SD_STATUS_KILLED ||
+	    sys->cinfo.status == SD_STATUS_SHUTDOWN) {
+		sd_err("already handing over or exiting");
+		close(fd);
+		return;
+	}
+
+	/* the new sheep sends the request right after connecting */
+	if (register_event(fd, handover_recv_req, NULL) < 0) {
+		close(fd);
+		return;
+	}
+	handover_req_fd = fd;
+	handover_req_len = 0;
+	handover_req_timer.callback = handover_req_expire;
+	add_timer(&handover_req_timer, HANDOVER_REQ_TIMEOUT);
+}
+
+int handover_init(const char *dir)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	snprintf(handover_path, sizeof(handover_path), "%s/handover", dir);
+	if (strlen(handover_path) >= sizeof(addr.sun_path)) {
+		sd_err("too long path %s", handover_path);
+		return -1;
+	}
+	pstrcpy(addr.sun_path, sizeof(addr.sun_path), handover_path);
+	unlink(handover_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		sd_err("failed to create socket, %m");
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 1) < 0 ||
+	    register_event(fd, handover_accept, NULL) < 0) {
+		sd_err("failed to listen on %s, %m", handover_path);
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns the number of the fds, or -1 on failure */
+static int recv_batch(int fd, struct handover_fd *fds)
+{
+	char control[CMSG_SPACE(sizeof(int) * HANDOVER_BATCH)];
+	struct handover_msg m;
+	struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+	int nr = 0;
+
+	do {
+		ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		for (int i = 0; i < n; i++) {
+			int rfd;
+
+			memcpy(&rfd, CMSG_DATA(cmsg) + sizeof(int) * i,
+			       sizeof(int));
+			if (nr < HANDOVER_BATCH)
+				fds[nr++].fd = rfd;
+			else
+				close(rfd);
+		}
+	}
+
+	if (ret != sizeof(m) || m.magic != HANDOVER_MAGIC || m.nr != nr) {
+		for (int i = 0; i < nr; i++)
+			close(fds[i].fd);
+		return -1;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		/* the fds lose CLOEXEC, like the ones created by this sheep */
+		fcntl(fds[i].fd, F_SETFD, 0);
+		fds[i].listen = m.flags[i] & HANDOVER_FD_LISTEN;
+		fds[i].is_inet_socket = m.flags[i] & HANDOVER_FD_INET;
+	}
+
+	return nr;
+}
+
+/* Wait for the old sheep to release the lock of the base directory */
+static int wait_for_unlock(const char *dir)
+{
+	char path[PATH_MAX];
+	int fd, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/lock", dir);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return 0;
+
+	for (int i = 0; i < HANDOVER_TIMEOUT * 100; i++) {
+		if (lockf(fd, F_TEST, 1) == 0) {
+			ret = 0;
+			break;
+		}
+		usleep(10000);
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Take over the connections of the sheep running on dir.  Called before the
+ * base directory is locked.
+ */
+int handover_receive(const char *dir)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct handover_msg m = { .magic = HANDOVER_MAGIC };
+	char c;
+	int fd, nr;
+	ssize_t ret;
+
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/handover", dir);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		sd_err("failed to create socket, %m");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		sd_err("no sheep to take over on %s, %m", dir);
+		goto err;
+	}
+	if (xwrite(fd, &m, sizeof(m)) != sizeof(m)) {
+		sd_err("failed to request the handover, %m");
+		goto err;
+	}
+
+	adopted_fds = xmalloc(sizeof(*adopted_fds) * HANDOVER_MAX_FDS);
+	do {
+		if (nr_adopted_fds + HANDOVER_BATCH > HANDOVER_MAX_FDS) {
+			sd_err("too many fds");
+			goto err;
+		}
+		nr = recv_batch(fd, adopted_fds + nr_adopted_fds);
+		if (nr < 0) {
+			sd_err("the old sheep didn't hand over");
+			goto err;
+		}
+		nr_adopted_fds += nr;
+	} while (nr);
+
+	/* the old sheep closes the connection by exiting */
+	do {
+		ret = read(fd, &c, 1);
+	} while (ret > 0 || (ret < 0 && errno == EINTR));
+	close(fd);
+	if (wait_for_unlock(dir) < 0) {
+		sd_err("the old sheep didn't exit");
+		return -1;
+	}
+
+	sd_info("took over %d fds", nr_adopted_fds);
+	return 0;
+err:
+	close(fd);
+	for (int i = 0; i < nr_adopted_fds; i++)
+		close(adopted_fds[i].fd);
+	nr_adopted_fds = 0;
+	return -1;
+}
+
+/* Listen on the sockets taken over instead of creating them */
+int handover_adopt_listeners(void)
+{
+	int nr = 0;
+
+	for (int i = 0; i < nr_adopted_fds; i++) {
+		if (!adopted_fds[i].listen)
+			continue;
+		if (adopt_handover_fd(adopted_fds + i) < 0)
+			return -1;
+		nr++;
+	}
+	if (!nr) {
+		sd_err("no listening socket was handed over");
+		return -1;
+	}
+
+	return 0;
+}
+
+static main_fn void adopt_clients(void *data)
+{
+	int nr = 0;
+
+	/* the requests of the clients would fail until then */
+	if (sys->cinfo.status == SD_STATUS_WAIT) {
+		add_timer(&adopt_timer, HANDOVER_POLL * 10);
+		return;
+	}
+
+	for (int i = 0; i < nr_adopted_fds; i++) {
+		if (adopted_fds[i].listen)
+			continue;
+		if (adopt_handover_fd(adopted_fds + i) == 0)
+			nr++;
+	}
+	sd_info("resumed %d connections", nr);
+
+	free(adopted_fds);
+	adopted_fds = NULL;
+	nr_adopted_fds = 0;
+}
+
+/* Poll the connections taken over once the sheep has joined the cluster */
+void handover_adopt_clients(void)
+{
+	adopt_timer.callback = adopt_clients;
+	add_timer(&adopt_timer, 0);
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Heat of the objects
+ *
+ * One of HEAT_SAMPLE peer reads and writes, picked at random, is counted in
+ * a count-min sketch of the disk of the object: HEAT_DEPTH rows of
+ * HEAT_WIDTH counters, each row indexed by its own slice of the hash of the
+ * oid, and the estimate of an object is the least of its counters.  The
+ * sketch never underestimates, and overestimates by a few samples of the
+ * disk at most with a high probability, whatever the number of objects.
+ * Next to the sketch, each disk keeps the SD_HEAT_TOP objects with the
+ * highest estimates.
+ *
+ * Every HEAT_PERIOD, the counters and the estimates are halved, so the heat
+ * is about the accesses of the last two periods.  Everything is done in the
+ * main thread, which sees the requests first, so the counting takes no lock;
+ * heat_estimate() may be called from any thread and reads the counters as
+ * they are.
+ */
+
+#include "sheep_priv.h"
+
+#define HEAT_SAMPLE 16		/* power of two */
+#define HEAT_DEPTH 4
+#define HEAT_WIDTH_SHIFT 11
+#define HEAT_WIDTH (1U << HEAT_WIDTH_SHIFT)
+#define HEAT_PERIOD 60		/* sec */
+
+struct heat_disk {
+	char path[PATH_MAX];
+	uint64_t nr_samples;	/* halved like the counters */
+	uint32_t sketch[HEAT_DEPTH][HEAT_WIDTH];
+	struct sd_hot_obj top[SD_HEAT_TOP];	/* hits in samples */
+	int nr_top;
+};
+
+static struct heat_disk *heat_disks[MD_MAX_DISK];
+static uint32_t heat_rand = 2463534242U;
+static struct timer heat_timer;
+
+static inline uint32_t heat_slot(uint64_t hval, int row)
+{
+	return (hval >> (row * HEAT_WIDTH_SHIFT)) & (HEAT_WIDTH - 1);
+}
+
+static uint32_t sketch_estimate(const struct heat_disk *d, uint64_t hval)
+{
+	uint32_t est = UINT32_MAX;
+
+	for (int i = 0; i < HEAT_DEPTH; i++)
+		est = min(est, uatomic_read(&d->sketch[i][heat_slot(hval, i)]));
+
+	return est;
+}
+
+/* The disks are never freed, there are MD_MAX_DISK paths at most in practice */
+static struct heat_disk *find_heat_disk(const char *path, bool create)
+{
+	struct heat_disk *d;
+	int i, free_slot = -1;
+
+	for (i = 0; i < ARRAY_SIZE(heat_disks); i++) {
+		d = uatomic_read(&heat_disks[i]);
+		if (!d) {
+			if (free_slot < 0)
+				free_slot = i;
+			continue;
+		}
+		cmm_smp_read_barrier_depends();
+		if (!strcmp(d->path, path))
+			return d;
+	}
+	if (!create || free_slot < 0)
+		return NULL;
+
+	d = xzalloc(sizeof(*d));
+	pstrcpy(d->path, PATH_MAX, path);
+	/* heat_estimate() reads the disks without the main thread */
+	cmm_smp_wmb();
+	uatomic_set(&heat_disks[free_slot], d);
+
+	return d;
+}
+
+/* Keep oid among the objects with the highest estimates of the disk */
+static void update_top(struct heat_disk *d, uint64_t oid, uint32_t est)
+{
+	int i, least = 0;
+
+	for (i = 0; i < d->nr_top; i++) {
+		if (d->top[i].oid == oid) {
+			d->top[i].hits = est;
+			return;
+		}
+		if (d->top[i].hits < d->top[least].hits)
+			least = i;
+	}
+
+	if (d->nr_top < SD_HEAT_TOP)
+		least = d->nr_top++;
+	else if (d->top[least].hits >= est)
+		return;
+
+	d->top[least].oid = oid;
+	d->top[least].hits = est;
+}
+
+/* Called for the peer requests on the object oid */
+main_fn void heat_access(uint64_t oid)
+{
+	struct heat_disk *d;
+	uint64_t hval;
+
+	/* xorshift, striding would alias with the access patterns */
+	heat_rand ^= heat_rand << 13;
+	heat_rand ^= heat_rand >> 17;
+	heat_rand ^= heat_rand << 5;
+	if (heat_rand & (HEAT_SAMPLE - 1))
+		return;
+
+	d = find_heat_disk(md_get_object_dir(oid), true);
+	if (!d)
+		return;
+
+	hval = sd_hash_oid(oid);
+	for (int i = 0; i < HEAT_DEPTH; i++) {
+		uint32_t *c = &d->sketch[i][heat_slot(hval, i)];
+
+		if (*c < UINT32_MAX)
+			uatomic_set(c, *c + 1);
+	}
+	d->nr_samples++;
+	update_top(d, oid, sketch_estimate(d, hval));
+}
+
+/*
+ * The estimated accesses of the object oid in the last two periods or so,
+ * zero for the cold ones
+ */
+uint32_t heat_estimate(uint64_t oid)
+{
+	struct heat_disk *d;
+	uint64_t est;
+
+	d = find_heat_disk(md_get_object_dir(oid), false);
+	if (!d)
+		return 0;
+
+	est = (uint64_t)sketch_estimate(d, sd_hash_oid(oid)) * HEAT_SAMPLE;
+	return min(est, (uint64_t)UINT32_MAX);
+}
+
+static main_fn void heat_decay(void *data)
+{
+	for (int i = 0; i < ARRAY_SIZE(heat_disks); i++) {
+		struct heat_disk *d = heat_disks[i];
+		int nr = 0;
+
+		if (!d)
+			continue;
+
+		for (int j = 0; j < HEAT_DEPTH; j++)
+			for (int k = 0; k < HEAT_WIDTH; k++)
+				uatomic_set(&d->sketch[j][k],
+					    d->sketch[j][k] / 2);
+		d->nr_samples /= 2;
+
+		for (int j = 0; j < d->nr_top; j++) {
+			d->top[j].hits /= 2;
+			if (d->top[j].hits)
+				d->top[nr++] = d->top[j];
+		}
+		d->nr_top = nr;
+	}
+
+	add_timer(&heat_timer, HEAT_PERIOD * 1000);
+}
+
+static int hot_obj_cmp(const struct sd_hot_obj *a, const struct sd_hot_obj *b)
+{
+	/* the hottest first */
+	return intcmp(b->hits, a->hits);
+}
+
+/*
+ * Fill buf of len bytes with a struct sd_heat_disk for each disk, followed
+ * by its hottest objects.  Returns the length filled.
+ */
+main_fn uint32_t heat_get_info(void *buf, uint32_t len)
+{
+	struct sd_md_info *info = xzalloc(sizeof(*info));
+	char *p = buf;
+
+	md_get_info(info);
+	for (int i = 0; i < ARRAY_SIZE(heat_disks); i++) {
+		const struct heat_disk *d = heat_disks[i];
+		struct sd_heat_disk *hd = (struct sd_heat_disk *)p;
+		struct sd_hot_obj *objs;
+
+		/* the disk is idle or gone */
+		if (!d || !d->nr_samples)
+			continue;
+		if (p + sizeof(*hd) + sizeof(d->top) > (char *)buf + len)
+			break;
+
+		memset(hd, 0, sizeof(*hd));
+		hd->idx = UINT32_MAX;
+		for (int j = 0; j < info->nr; j++)
+			if (!strcmp(info->disk[j].path, d->path))
+				hd->idx = info->disk[j].idx;
+		hd->nr_hot = d->nr_top;
+		hd->nr_accesses = d->nr_samples * HEAT_SAMPLE;
+
+		objs = (struct sd_hot_obj *)(hd + 1);
+		for (int j = 0; j < d->nr_top; j++) {
+			objs[j].oid = d->top[j].oid;
+			objs[j].hits = d->top[j].hits * HEAT_SAMPLE;
+		}
+		xqsort(objs, hd->nr_hot, hot_obj_cmp);
+		p = (char *)(objs + hd->nr_hot);
+	}
+	free(info);
+
+	return p - (char *)buf;
+}
+
+void heat_init(void)
+{
+	heat_timer.callback = heat_decay;
+	add_timer(&heat_timer, HEAT_PERIOD * 1000);
+}
@@ -19,6 +19,7 @@
 
 static const char *http_host = "localhost";
 static const char *http_port = "8000";
+static bool http_native;
 
 LIST_HEAD(http_drivers);
 static LIST_HEAD(http_enabled_drivers);
@@ -56,6 +57,7 @@ static inline const char *strstatus(enum http_status status)
 		[NOT_FOUND] = "404 Not Found",
 		[METHOD_NOT_ALLOWED] = "405 Method Not Allowed",
 		[CONFLICT] = "409 Conflict",
+		[LENGTH_REQUIRED] = "411 Length Required",
 		[REQUEST_RANGE_NOT_SATISFIABLE] =
 			"416 Requested Range Not Satisfiable",
 		[INTERNAL_SERVER_ERROR] = "500 Internal Server Error",
@@ -102,7 +104,12 @@ static inline void http_request_error(struct http_request *req)
 
 int http_request_write(struct http_request *req, const void *buf, int len)
 {
-	int ret = FCGX_PutStr(buf, len, req->fcgx.out);
+	int ret;
+
+	if (req->conn)
+		return httpd_write(req->conn, buf, len);
+
+	ret = FCGX_PutStr(buf, len, req->fcgx.out);
 	if (ret < 0)
 		http_request_error(req);
 	return ret;
@@ -110,7 +117,19 @@ int http_request_write(struct http_request *req, const void *buf, int len)
 
 int http_request_read(struct http_request *req, void *buf, int len)
 {
-	int ret = FCGX_GetStr(buf, len, req->fcgx.in);
+	int ret;
+
+	if (req->body) {
+		ret = min((uint64_t)len, req->body_left);
+		memcpy(buf, req->body, ret);
+		req->body += ret;
+		req->body_left -= ret;
+		return ret;
+	}
+	if (req->conn)
+		return httpd_read(req->conn, buf, len);
+
+	ret = FCGX_GetStr(buf, len, req->fcgx.in);
 	if (ret < 0)
 		http_request_error(req);
 	return ret;
@@ -118,7 +137,12 @@ int http_request_read(struct http_request *req, void *buf, int len)
 
 int http_request_writes(struct http_request *req, const char *str)
 {
-	int ret = FCGX_PutS(str, req->fcgx.out);
+	int ret;
+
+	if (req->conn)
+		return httpd_write(req->conn, str, strlen(str));
+
+	ret = FCGX_PutS(str, req->fcgx.out);
 	if (ret < 0)
 		http_request_error(req);
 	return ret;
@@ -131,6 +155,17 @@ int http_request_writef(struct http_request *req, const char *fmt, ...)
 	int ret;
 
 	va_start(ap, fmt);
+	if (req->conn) {
+		char *str;
+
+		ret = vasprintf(&str, fmt, ap);
+		va_end(ap);
+		if (ret < 0)
+			return ret;
+		ret = httpd_write(req->conn, str, ret);
+		free(str);
+		return ret;
+	}
 	ret = FCGX_VFPrintF(req->fcgx.out, fmt, ap);
 	va_end(ap);
 	if (ret < 0)
@@ -169,34 +204,52 @@ static int request_init_operation(struct http_request *req)
 	req->uri = FCGX_GetParam("DOCUMENT_URI", env);
 	if (!req->uri)
 		return BAD_REQUEST;
+	req->query = FCGX_GetParam("QUERY_STRING", env);
 	p = FCGX_GetParam("HTTP_RANGE", env);
 	if (p && p[0] != '\0') {
 		const char prefix[] = "bytes=";
-		char *left, *right, num[64];
+		char *left, *right;
 		uint64_t max;
 		left = strstr(p, prefix);
 		if (!left)
 			goto invalid_range;
+		left += sizeof(prefix) - 1;
 		right = strchr(left, '-');
-		pstrcpy(num, right - left, left + sizeof(prefix) - 1);
-		req->offset = strtoll(num, &endp, 10);
-		if (num == endp)
+		if (!right)
 			goto invalid_range;
-		strcpy(num, right + 1);
+		req->range = true;
+		req->offset = 0;
+		req->data_length = 0;
+		if (right == left) {
+			/* "-num" asks for the last num bytes */
+			req->data_length = strtoull(right + 1, &endp, 10);
+			if (endp == right + 1 || !req->data_length)
+				goto invalid_range;
+			req->range_suffix = true;
+			sd_debug("HTTP_RANGE: last %"PRIu64, req->data_length);
+			goto range_done;
+		}
+		req->offset = strtoull(left, &endp, 10);
+		if (endp != right)
+			goto invalid_range;
+		/* "num-" asks for everything from num, data_length 0 */
+		if (right[1] == '\0' || right[1] == ',')
+			goto range_done;
 		/*
 		 * In swift spec, the second number of RANGE should be included
 		 * which means [num1, num2], but our common means for read and
 		 * write data by 'offset' and 'len' is [num1, num2), so we
 		 * should add 1 to num2.
 		 */
-		max = strtoll(num, &endp, 10) + 1;
-		if (num == endp)
+		max = strtoull(right + 1, &endp, 10) + 1;
+		if (endp == right + 1)
 			goto invalid_range;
 		if (max <= req->offset)
 			goto invalid_range;
 		req->data_length = max - req->offset;
 		sd_debug("HTTP_RANGE: %"PRIu64" %"PRIu64, req->offset, max);
 	}
+range_done:
 	p = FCGX_GetParam("FORCE", env);
 	if (p && p[0] != '\0') {
 		if (!strcmp("true", p))
@@ -219,7 +272,7 @@ invalid_range:
 	return REQUEST_RANGE_NOT_SATISFIABLE;
 }
 
-static int http_init_request(struct http_request *req)
+int http_init_request(struct http_request *req)
 {
 	char *p;
 
@@ -229,6 +282,56 @@ static int http_init_request(struct http_request *req)
 	return request_init_operation(req);
 }
 
+static int query_hex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Copy the decoded value of the query parameter 'key' to buf, truncating it
+ * to size. Returns false if the request has no such parameter.
+ */
+bool http_query_param(const struct http_request *req, const char *key,
+		      char *buf, size_t size)
+{
+	size_t klen = strlen(key), n = 0;
+	const char *p = req->query;
+	int hi, lo;
+
+	while (p && *p) {
+		if (!strncmp(p, key, klen) &&
+		    (p[klen] == '=' || p[klen] == '&' || p[klen] == '\0'))
+			break;
+		p = strchr(p, '&');
+		if (p)
+			p++;
+	}
+	if (!p || !*p)
+		return false;
+
+	p += klen;
+	if (*p == '=')
+		p++;
+	for (; *p && *p != '&' && n + 1 < size; p++) {
+		if (*p == '+') {
+			buf[n++] = ' ';
+		} else if (*p == '%' && (hi = query_hex(p[1])) >= 0 &&
+			   (lo = query_hex(p[2])) >= 0) {
+			buf[n++] = hi << 4 | lo;
+			p += 2;
+		} else
+			buf[n++] = *p;
+	}
+	buf[n] = '\0';
+	return true;
+}
+
 /* This function does nothing if we have already printed a status code. */
 void http_response_header(struct http_request *req, enum http_status status)
 {
@@ -236,6 +339,11 @@ void http_response_header(struct http_request *req, enum http_status status)
 		return;
 
 	req->status = status;
+	if (req->conn) {
+		httpd_response_header(req->conn, req, strstatus(status));
+		return;
+	}
+
 	http_request_writef(req, "Status: %s\r\n", strstatus(status));
 	if (req->opcode == HTTP_GET || req->opcode == HTTP_HEAD)
 		http_request_writef(req, "Content-Length: %"PRIu64"\r\n",
@@ -249,10 +357,9 @@ static void http_end_request(struct http_request *req)
 	free(req);
 }
 
-static void http_run_request(struct work *work)
+/* Run the request on the enabled drivers until one of them replies */
+void http_dispatch_request(struct http_request *req)
 {
-	struct http_work *hw = container_of(work, struct http_work, work);
-	struct http_request *req = hw->request;
 	int op = req->opcode;
 	struct http_driver *hdrv;
 
@@ -283,12 +390,19 @@ static void http_run_request(struct work *work)
 			method(req);
 			sd_debug("req->status %d", req->status);
 			if (req->status != UNKNOWN)
-				goto out;
+				return;
 		}
 	}
 
 	http_response_header(req, METHOD_NOT_ALLOWED);
-out:
+}
+
+static void http_run_request(struct work *work)
+{
+	struct http_work *hw = container_of(work, struct http_work, work);
+	struct http_request *req = hw->request;
+
+	http_dispatch_request(req);
 	http_end_request(req);
 }
 
@@ -379,6 +493,34 @@ static int http_opt_buffer_parser(const char *s)
 	return 0;
 }
 
+static int http_opt_depth_parser(const char *s)
+{
+	char *p;
+	long depth = strtol(s, &p, 10);
+
+	if (s == p || *p || depth < 1 || depth > KV_MAX_RW_DEPTH) {
+		sd_err("Invalid depth option '%s': depth must be between 1 and"
+		       " %d", s, KV_MAX_RW_DEPTH);
+		return -1;
+	}
+	kv_rw_depth = depth;
+	sd_info("kv_rw_depth: %d", kv_rw_depth);
+	return 0;
+}
+
+static int http_opt_mode_parser(const char *s)
+{
+	if (!strcmp(s, "native"))
+		http_native = true;
+	else if (!strcmp(s, "fastcgi"))
+		http_native = false;
+	else {
+		sd_err("Invalid mode option '%s'", s);
+		return -1;
+	}
+	return 0;
+}
+
 static int http_opt_default_parser(const char *s)
 {
 	struct http_driver *hdrv;
@@ -409,6 +551,8 @@ static struct option_parser http_opt_parsers[] = {
 	{ "host=", http_opt_host_parser },
 	{ "port=", http_opt_port_parser },
 	{ "buffer=", http_opt_buffer_parser },
+	{ "depth=", http_opt_depth_parser },
+	{ "mode=", http_opt_mode_parser },
 	{ "", http_opt_default_parser },
 	{ NULL, NULL },
 };
@@ -436,11 +580,21 @@ int http_init(const char *options)
 	sys->http_wqueue = create_work_queue("http", WQ_DYNAMIC);
 	if (!sys->http_wqueue)
 		return -1;
-
-	FCGX_Init();
+	/* the objects are read and written by gateway requests */
+	set_work_queue_blocking(sys->http_wqueue);
+	if (kv_init() < 0)
+		return -1;
 
 #define LISTEN_QUEUE_DEPTH 1024 /* No rationale */
 	snprintf(address, sizeof(address), "%s:%s", http_host, http_port);
+	if (http_native) {
+		if (httpd_init(http_host, http_port, LISTEN_QUEUE_DEPTH) < 0)
+			return -1;
+		sd_info("http server listen at %s", address);
+		return 0;
+	}
+
+	FCGX_Init();
 	http_sockfd = FCGX_OpenSocket(address, LISTEN_QUEUE_DEPTH);
 	if (http_sockfd < 0) {
 		sd_err("open socket failed, address %s", address);
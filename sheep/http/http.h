@@ -36,22 +36,31 @@ enum http_status {
 	NOT_FOUND,                      /* 404 */
 	METHOD_NOT_ALLOWED,             /* 405 */
 	CONFLICT,                       /* 409 */
+	LENGTH_REQUIRED,                /* 411 */
 	REQUEST_RANGE_NOT_SATISFIABLE,  /* 416 */
 	INTERNAL_SERVER_ERROR,          /* 500 */
 	NOT_IMPLEMENTED,                /* 501 */
 	SERVICE_UNAVAILABLE,            /* 503 */
 };
 
+struct httpd_conn;
+
 struct http_request {
 	FCGX_Request fcgx;
+	struct httpd_conn *conn; /* NULL unless served by httpd.c */
 	char *uri;
 	enum http_opcode opcode;
 	enum http_status status;
 	uint64_t data_length;
 	uint64_t offset;
+	bool range; /* a Range request for [offset, offset + data_length) */
+	bool range_suffix; /* the range is the last data_length bytes */
+	char *query; /* QUERY_STRING, may be NULL */
 	bool force;
 	bool append;
 	bool eof;
+	const char *body; /* read from memory instead if not NULL */
+	uint64_t body_left;
 };
 
 struct http_driver {
@@ -106,13 +115,24 @@ static inline const char *get_hdrv_option(const struct http_driver *hdrv,
 }
 
 const char *str_http_req(const struct http_request *req);
+int http_init_request(struct http_request *req);
+void http_dispatch_request(struct http_request *req);
 void http_response_header(struct http_request *req, enum http_status status);
+bool http_query_param(const struct http_request *req, const char *key,
+		      char *buf, size_t size);
 int http_request_read(struct http_request *req, void *buf, int len);
 int http_request_write(struct http_request *req, const void *buf, int len);
 int http_request_writes(struct http_request *req, const char *str);
 __printf(2, 3)
 int http_request_writef(struct http_request *req, const char *fmt, ...);
 
+/* httpd.c */
+int httpd_init(const char *host, const char *port, int backlog);
+int httpd_read(struct httpd_conn *conn, void *buf, int len);
+int httpd_write(struct httpd_conn *conn, const void *buf, int len);
+void httpd_response_header(struct httpd_conn *conn, struct http_request *req,
+			   const char *status);
+
 /* For kv.c */
 
 #define SD_MAX_BUCKET_NAME 256
@@ -121,6 +141,12 @@ int http_request_writef(struct http_request *req, const char *fmt, ...);
 /* This default value shows best performance in test */
 #define DEFAULT_KV_RW_BUFFER (SD_DATA_OBJ_SIZE * 8)
 extern uint64_t kv_rw_buffer;
+/* number of kv_rw_buffer sized chunks of an object in flight */
+#define DEFAULT_KV_RW_DEPTH 2
+#define KV_MAX_RW_DEPTH 16
+extern int kv_rw_depth;
+
+int kv_init(void);
 
 /* Account operations */
 int kv_create_account(const char *account);
@@ -159,10 +185,44 @@ int kv_iterate_object(const char *account, const char *bucket,
 		      void (*cb)(const char *object, void *opaque),
 		      void *opaque);
 
+struct kv_list_param {
+	const char *prefix;
+	const char *marker; /* list the names after this one */
+	const char *delimiter;
+	uint64_t limit; /* zero for no limit */
+};
+
+typedef void (*kv_list_cb)(const char *name, bool is_prefix, void *opaque);
+
+int kv_list_object(const char *account, const char *bucket,
+		   const struct kv_list_param *param, kv_list_cb cb,
+		   void *opaque, bool *truncated);
+
+/* Multipart upload operations */
+#define KV_UPLOAD_ID_LEN 32
+
+int kv_initiate_upload(const char *account, const char *bucket,
+		       const char *object, char *upload_id);
+int kv_upload_part(struct http_request *req, const char *account,
+		   const char *bucket, const char *upload_id, uint32_t part);
+int kv_complete_upload(const char *account, const char *bucket,
+		       const char *object, const char *upload_id,
+		       const uint32_t *parts, int nr_parts);
+int kv_abort_upload(const char *account, const char *bucket,
+		    const char *upload_id);
+
 /* http/oalloc.c */
 int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count);
 int oalloc_new_finish(uint32_t vid, uint64_t start, uint64_t count);
 int oalloc_free(uint32_t vid, uint64_t start, uint64_t count);
 int oalloc_init(uint32_t vid);
+void oalloc_drop_window(uint32_t vid);
+
+/* http/oindex.c */
+int oindex_init(uint32_t vid);
+int oindex_insert(uint32_t vid, const char *name);
+int oindex_delete(uint32_t vid, const char *name);
+int oindex_list(uint32_t vid, const struct kv_list_param *param,
+		kv_list_cb cb, void *opaque, bool *truncated);
 
 #endif /* __SHEEP_HTTP_H__ */
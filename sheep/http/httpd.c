@@ -0,0 +1,609 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Built-in HTTP/1.1 server
+ *
+ * With "mode=native", sheep serves the object gateway itself instead of
+ * talking FastCGI to a web server in front of it.  The listening socket and
+ * the idle keep-alive connections are watched by the main event loop.  When a
+ * connection becomes readable, it is handed to http_wqueue, where a worker
+ * parses the request into CGI style parameters, so that request parsing and
+ * the drivers are shared with the FastCGI mode, and runs it with blocking
+ * I/O.  The connection goes back to the event loop when the response is done.
+ *
+ * Responses to GET with a successful status and to HEAD carry a
+ * Content-Length, the others use the chunked transfer coding because the
+ * drivers don't know the size of what they write.  Large writes are sent
+ * directly from the caller's buffer.  Request bodies must have a
+ * Content-Length.
+ */
+
+#include <ctype.h>
+#include <netdb.h>
+#include <sys/uio.h>
+
+#include "sheep_priv.h"
+#include "http.h"
+#include "strbuf.h"
+
+#define HTTPD_RBUF_SIZE (16 * 1024) /* also the maximum size of a header */
+#define HTTPD_WBUF_SIZE (16 * 1024)
+#define HTTPD_MAX_PARAMS 64
+
+struct httpd_conn {
+	int fd;
+	bool keepalive;
+
+	/* input buffered beyond the request header */
+	char rbuf[HTTPD_RBUF_SIZE];
+	size_t rstart, rend;
+	uint64_t body_left;
+
+	/* CGI style request parameters */
+	struct strbuf params;
+	char *envp[HTTPD_MAX_PARAMS + 1];
+
+	/* header lines written by the drivers before the status */
+	struct strbuf hdrs;
+	bool header_sent;
+	bool no_body;
+	bool chunked;
+	uint64_t content_left;
+	struct strbuf wbuf;
+
+	struct work work;
+};
+
+static int httpd_sockfd = -1;
+
+static int httpd_sendv(struct httpd_conn *conn, struct iovec *iov, int cnt)
+{
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = cnt,
+	};
+
+	while (msg.msg_iovlen) {
+		ssize_t ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			sd_debug("failed to send, %m");
+			conn->keepalive = false;
+			return -1;
+		}
+
+		while (ret > 0) {
+			if ((size_t)ret < msg.msg_iov->iov_len) {
+				msg.msg_iov->iov_base =
+					(char *)msg.msg_iov->iov_base + ret;
+				msg.msg_iov->iov_len -= ret;
+				break;
+			}
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		/* skip the empty ones */
+		while (msg.msg_iovlen && !msg.msg_iov->iov_len) {
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+	}
+	return 0;
+}
+
+static int httpd_flush(struct httpd_conn *conn)
+{
+	struct iovec iov = {
+		.iov_base = conn->wbuf.buf,
+		.iov_len = conn->wbuf.len,
+	};
+	int ret = 0;
+
+	if (conn->wbuf.len)
+		ret = httpd_sendv(conn, &iov, 1);
+	strbuf_reset(&conn->wbuf);
+	return ret;
+}
+
+/* Queue the data after the buffered output, copying only small writes */
+static int httpd_send(struct httpd_conn *conn, const void *buf, size_t len)
+{
+	struct iovec iov[2];
+
+	if (conn->wbuf.len + len <= HTTPD_WBUF_SIZE) {
+		strbuf_add(&conn->wbuf, buf, len);
+		return 0;
+	}
+
+	iov[0].iov_base = conn->wbuf.buf;
+	iov[0].iov_len = conn->wbuf.len;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+	if (httpd_sendv(conn, iov, 2) < 0)
+		return -1;
+	strbuf_reset(&conn->wbuf);
+	return 0;
+}
+
+int httpd_write(struct httpd_conn *conn, const void *buf, int len)
+{
+	char size[32];
+
+	if (len <= 0)
+		return 0;
+
+	if (!conn->header_sent) {
+		strbuf_add(&conn->hdrs, buf, len);
+		return len;
+	}
+	if (conn->no_body)
+		return len;
+
+	if (conn->chunked) {
+		snprintf(size, sizeof(size), "%x\r\n", len);
+		strbuf_addstr(&conn->wbuf, size);
+		if (httpd_send(conn, buf, len) < 0)
+			return -1;
+		strbuf_addstr(&conn->wbuf, "\r\n");
+		return len;
+	}
+
+	if (len > conn->content_left) {
+		sd_err("response is longer than its Content-Length");
+		conn->keepalive = false;
+		return -1;
+	}
+	conn->content_left -= len;
+	return httpd_send(conn, buf, len) < 0 ? -1 : len;
+}
+
+/* Read the request body, up to 'len' bytes or its end */
+int httpd_read(struct httpd_conn *conn, void *buf, int len)
+{
+	size_t done = 0, n;
+
+	if (len <= 0)
+		return 0;
+	if ((uint64_t)len > conn->body_left)
+		len = conn->body_left;
+
+	n = min(conn->rend - conn->rstart, (size_t)len);
+	memcpy(buf, conn->rbuf + conn->rstart, n);
+	conn->rstart += n;
+	done = n;
+
+	while (done < (size_t)len) {
+		ssize_t ret = read(conn->fd, (char *)buf + done, len - done);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			sd_err("failed to read the request body, %m");
+			conn->keepalive = false;
+			conn->body_left -= done;
+			return -1;
+		}
+		done += ret;
+	}
+
+	conn->body_left -= done;
+	return done;
+}
+
+/* Header lines from the drivers may end with a bare LF */
+static void httpd_add_header_lines(struct httpd_conn *conn)
+{
+	char *p = conn->hdrs.buf, *end = p + conn->hdrs.len;
+
+	while (p < end) {
+		char *eol = memchr(p, '\n', end - p);
+		size_t len = (eol ? eol : end) - p;
+
+		if (len && p[len - 1] == '\r')
+			len--;
+		if (len) {
+			strbuf_add(&conn->wbuf, p, len);
+			strbuf_addstr(&conn->wbuf, "\r\n");
+		}
+		p = eol ? eol + 1 : end;
+	}
+	strbuf_reset(&conn->hdrs);
+}
+
+void httpd_response_header(struct httpd_conn *conn, struct http_request *req,
+			   const char *status)
+{
+	strbuf_addf(&conn->wbuf, "HTTP/1.1 %s\r\n", status);
+	httpd_add_header_lines(conn);
+
+	if (req->opcode == HTTP_HEAD) {
+		strbuf_addf(&conn->wbuf, "Content-Length: %"PRIu64"\r\n",
+			    req->data_length);
+		conn->no_body = true;
+	} else if (req->status == NO_CONTENT) {
+		conn->no_body = true;
+	} else if (req->opcode == HTTP_GET &&
+		   (req->status == OK || req->status == PARTIAL_CONTENT)) {
+		strbuf_addf(&conn->wbuf, "Content-Length: %"PRIu64"\r\n",
+			    req->data_length);
+		conn->content_left = req->data_length;
+	} else {
+		strbuf_addstr(&conn->wbuf, "Transfer-Encoding: chunked\r\n");
+		conn->chunked = true;
+	}
+
+	strbuf_addf(&conn->wbuf, "Connection: %s\r\n",
+		    conn->keepalive ? "keep-alive" : "close");
+	strbuf_addstr(&conn->wbuf, "Content-type: text/plain;\r\n\r\n");
+	conn->header_sent = true;
+}
+
+static void httpd_end_response(struct httpd_conn *conn)
+{
+	if (conn->chunked)
+		strbuf_addstr(&conn->wbuf, "0\r\n\r\n");
+	else if (conn->content_left) {
+		/* the client can only tell by the connection being closed */
+		sd_err("response is %"PRIu64" bytes shorter than its"
+		       " Content-Length", conn->content_left);
+		conn->keepalive = false;
+	}
+	httpd_flush(conn);
+
+	/* we don't skip an unread request body, close the connection */
+	if (conn->body_left)
+		conn->keepalive = false;
+
+	conn->header_sent = conn->no_body = conn->chunked = false;
+	conn->content_left = 0;
+	strbuf_reset(&conn->hdrs);
+}
+
+/* Returns the length of the header or 0 if the connection is closed */
+static size_t httpd_read_header(struct httpd_conn *conn)
+{
+	char *end;
+
+	/* move the pipelined data to the head of the buffer */
+	memmove(conn->rbuf, conn->rbuf + conn->rstart,
+		conn->rend - conn->rstart);
+	conn->rend -= conn->rstart;
+	conn->rstart = 0;
+
+	while (!(end = memmem(conn->rbuf, conn->rend, "\r\n\r\n", 4))) {
+		ssize_t ret;
+
+		if (conn->rend == sizeof(conn->rbuf)) {
+			sd_err("too large request header");
+			return 0;
+		}
+		ret = read(conn->fd, conn->rbuf + conn->rend,
+			   sizeof(conn->rbuf) - conn->rend);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			if (ret < 0 || conn->rend)
+				sd_debug("failed to read the request, %m");
+			return 0;
+		}
+		conn->rend += ret;
+	}
+
+	*end = '\0';
+	return end + 4 - conn->rbuf;
+}
+
+static void httpd_add_param(struct httpd_conn *conn, const char *name,
+			    const char *value, size_t len)
+{
+	strbuf_addstr(&conn->params, name);
+	strbuf_addch(&conn->params, '=');
+	strbuf_add(&conn->params, value, len);
+	strbuf_addch(&conn->params, '\0');
+}
+
+static int hex_val(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* DOCUMENT_URI is the decoded path of the request target */
+static void httpd_add_document_uri(struct httpd_conn *conn, const char *target,
+				   size_t len)
+{
+	strbuf_addstr(&conn->params, "DOCUMENT_URI=");
+	for (size_t i = 0; i < len; i++) {
+		int hi = i + 2 < len ? hex_val(target[i + 1]) : -1;
+		int lo = i + 2 < len ? hex_val(target[i + 2]) : -1;
+
+		if (target[i] == '%' && hi >= 0 && lo >= 0) {
+			strbuf_addch(&conn->params, hi << 4 | lo);
+			i += 2;
+		} else
+			strbuf_addch(&conn->params, target[i]);
+	}
+	strbuf_addch(&conn->params, '\0');
+}
+
+static void httpd_add_header_param(struct httpd_conn *conn, const char *name,
+				   size_t name_len, const char *value)
+{
+	char pname[128] = "HTTP_";
+	size_t i;
+
+	if (name_len + 6 > sizeof(pname))
+		return;
+	for (i = 0; i < name_len; i++)
+		pname[i + 5] = name[i] == '-' ? '_' : toupper(name[i]);
+	pname[i + 5] = '\0';
+
+	httpd_add_param(conn, pname, value, strlen(value));
+}
+
+/* The field name of 'name_len' bytes at 'line' is the whole of 'known' */
+static bool httpd_header_is(const char *line, size_t name_len,
+			    const char *known)
+{
+	return name_len == strlen(known) &&
+		!strncasecmp(line, known, name_len);
+}
+
+/*
+ * Parse the request line and the header fields into CGI style parameters.
+ * Returns OK, or the status to reply with.
+ */
+static int httpd_parse_header(struct httpd_conn *conn, char *header,
+			      bool *expect_continue)
+{
+	char *line, *savep, *lsavep, *method, *target, *version, *query;
+	const char *content_length = "";
+	bool http10, chunked = false;
+	int nr = 0;
+
+	strbuf_reset(&conn->params);
+
+	line = strtok_r(header, "\r\n", &savep);
+	if (!line)
+		return BAD_REQUEST;
+	method = strtok_r(line, " ", &lsavep);
+	target = strtok_r(NULL, " ", &lsavep);
+	version = strtok_r(NULL, " ", &lsavep);
+	if (!method || !target || !version ||
+	    strncmp(version, "HTTP/1.", strlen("HTTP/1.")))
+		return BAD_REQUEST;
+	http10 = !strcmp(version, "HTTP/1.0");
+	conn->keepalive = !http10;
+
+	httpd_add_param(conn, "REQUEST_METHOD", method, strlen(method));
+	httpd_add_param(conn, "REQUEST_URI", target, strlen(target));
+	query = strchr(target, '?');
+	httpd_add_document_uri(conn, target,
+			       query ? (size_t)(query - target) :
+			       strlen(target));
+	if (query)
+		httpd_add_param(conn, "QUERY_STRING", query + 1,
+				strlen(query + 1));
+
+	while ((line = strtok_r(NULL, "\r\n", &savep))) {
+		char *value = strchr(line, ':');
+		size_t name_len;
+
+		if (!value)
+			return BAD_REQUEST;
+		name_len = value - line;
+		for (value++; *value == ' ' || *value == '\t'; value++)
+			;
+
+		if (httpd_header_is(line, name_len, "Content-Length"))
+			content_length = value;
+		else if (httpd_header_is(line, name_len, "Connection")) {
+			if (!strcasecmp(value, "close"))
+				conn->keepalive = false;
+			else if (!strcasecmp(value, "keep-alive"))
+				conn->keepalive = true;
+		} else if (httpd_header_is(line, name_len, "Transfer-Encoding"))
+			chunked = !!strcasestr(value, "chunked");
+		else if (httpd_header_is(line, name_len, "Expect"))
+			*expect_continue = !strcasecmp(value, "100-continue");
+		else if (httpd_header_is(line, name_len, "Force"))
+			/* what the FastCGI setups pass as FORCE */
+			httpd_add_param(conn, "FORCE", value, strlen(value));
+
+		httpd_add_header_param(conn, line, name_len, value);
+	}
+	httpd_add_param(conn, "CONTENT_LENGTH", content_length,
+			strlen(content_length));
+
+	if (chunked)
+		return LENGTH_REQUIRED;
+	conn->body_left = strtoull(content_length, NULL, 10);
+
+	for (char *p = conn->params.buf; p < conn->params.buf +
+	     conn->params.len; p += strlen(p) + 1) {
+		if (nr == HTTPD_MAX_PARAMS)
+			return BAD_REQUEST;
+		conn->envp[nr++] = p;
+	}
+	conn->envp[nr] = NULL;
+	return OK;
+}
+
+/* Returns false if the connection should be closed */
+static bool httpd_serve_request(struct httpd_conn *conn)
+{
+	struct http_request *req;
+	bool expect_continue = false;
+	size_t len;
+	int ret;
+
+	len = httpd_read_header(conn);
+	if (!len)
+		return false;
+
+	req = xzalloc(sizeof(*req));
+	req->conn = conn;
+	conn->body_left = 0;
+	ret = httpd_parse_header(conn, conn->rbuf, &expect_continue);
+	conn->rstart = len;
+	if (ret != OK) {
+		conn->keepalive = false;
+		http_response_header(req, ret);
+		goto out;
+	}
+
+	req->fcgx.envp = conn->envp;
+	ret = http_init_request(req);
+	if (ret != OK) {
+		http_response_header(req, ret);
+		goto out;
+	}
+
+	if (expect_continue && conn->body_left) {
+		strbuf_addstr(&conn->wbuf, "HTTP/1.1 100 Continue\r\n\r\n");
+		httpd_flush(conn);
+	}
+	http_dispatch_request(req);
+out:
+	httpd_end_response(conn);
+	free(req);
+	return conn->keepalive;
+}
+
+static void httpd_conn_handler(int fd, int events, void *data);
+
+static void httpd_close_conn(struct httpd_conn *conn)
+{
+	close(conn->fd);
+	strbuf_release(&conn->params);
+	strbuf_release(&conn->hdrs);
+	strbuf_release(&conn->wbuf);
+	free(conn);
+}
+
+static void httpd_serve(struct work *work)
+{
+	struct httpd_conn *conn = container_of(work, struct httpd_conn, work);
+
+	/* serve the pipelined requests too, epoll won't tell us about them */
+	while (httpd_serve_request(conn) && conn->rend > conn->rstart)
+		;
+}
+
+static void httpd_serve_done(struct work *work)
+{
+	struct httpd_conn *conn = container_of(work, struct httpd_conn, work);
+
+	if (!conn->keepalive ||
+	    register_event(conn->fd, httpd_conn_handler, conn) < 0)
+		httpd_close_conn(conn);
+}
+
+static void httpd_conn_handler(int fd, int events, void *data)
+{
+	struct httpd_conn *conn = data;
+
+	unregister_event(fd);
+	if (!(events & EPOLLIN)) {
+		httpd_close_conn(conn);
+		return;
+	}
+
+	queue_work(sys->http_wqueue, &conn->work);
+}
+
+static void httpd_accept(int fd, int events, void *data)
+{
+	struct httpd_conn *conn;
+	int cfd;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	if (cfd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			sd_err("failed to accept a connection, %m");
+		return;
+	}
+
+	if (set_nodelay(cfd) < 0 || set_keepalive(cfd) < 0 ||
+	    set_rcv_timeout(cfd) < 0 || set_snd_timeout(cfd) < 0) {
+		sd_err("failed to set up a connection, %m");
+		close(cfd);
+		return;
+	}
+
+	conn = xzalloc(sizeof(*conn));
+	conn->fd = cfd;
+	strbuf_init(&conn->params, 0);
+	strbuf_init(&conn->hdrs, 0);
+	strbuf_init(&conn->wbuf, HTTPD_WBUF_SIZE);
+	conn->work.fn = httpd_serve;
+	conn->work.done = httpd_serve_done;
+
+	if (register_event(cfd, httpd_conn_handler, conn) < 0)
+		httpd_close_conn(conn);
+}
+
+int httpd_init(const char *host, const char *port, int backlog)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	}, *res, *ai;
+	int ret, opt = 1;
+
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret) {
+		sd_err("failed to resolve %s:%s, %s", host, port,
+		       gai_strerror(ret));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		httpd_sockfd = socket(ai->ai_family, ai->ai_socktype |
+				      SOCK_NONBLOCK | SOCK_CLOEXEC,
+				      ai->ai_protocol);
+		if (httpd_sockfd < 0)
+			continue;
+
+		if (setsockopt(httpd_sockfd, SOL_SOCKET, SO_REUSEADDR, &opt,
+			       sizeof(opt)) == 0 &&
+		    bind(httpd_sockfd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(httpd_sockfd, backlog) == 0)
+			break;
+
+		close(httpd_sockfd);
+		httpd_sockfd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (httpd_sockfd < 0) {
+		sd_err("failed to listen at %s:%s, %m", host, port);
+		return -1;
+	}
+
+	ret = register_event(httpd_sockfd, httpd_accept, NULL);
+	if (ret) {
+		close(httpd_sockfd);
+		httpd_sockfd = -1;
+		return -1;
+	}
+
+	return 0;
+}
@@ -15,8 +15,10 @@
 
 #include "sheep_priv.h"
 #include "http.h"
+#include "md5.h"
 
 uint64_t kv_rw_buffer = DEFAULT_KV_RW_BUFFER;
+int kv_rw_depth = DEFAULT_KV_RW_DEPTH;
 
 struct kv_bnode {
 	char name[SD_MAX_BUCKET_NAME];
@@ -61,8 +63,8 @@ struct kv_onode {
 	union {
 		struct {
 			char name[SD_MAX_OBJECT_NAME];
-			/* a hash value for etag */
-			uint8_t sha1[round_up(SHA1_DIGEST_SIZE, 8)];
+			/* MD5 of the data for etag, in the room of a SHA1 */
+			uint8_t md5[round_up(SHA1_DIGEST_SIZE, 8)];
 			uint64_t size;
 			uint64_t ctime;
 			uint64_t mtime;
@@ -324,6 +326,7 @@ static int bucket_create(const char *account, uint32_t account_vid,
 {
 	char onode_name[SD_MAX_VDI_LEN];
 	char alloc_name[SD_MAX_VDI_LEN];
+	char index_name[SD_MAX_VDI_LEN];
 	struct kv_bnode bnode;
 	uint32_t vid;
 	int ret;
@@ -347,13 +350,27 @@ static int bucket_create(const char *account, uint32_t account_vid,
 		sd_err("Failed to init allocator for bucket %s", bucket);
 		goto err;
 	}
+	snprintf(index_name, SD_MAX_VDI_LEN, "%s/%s/index", account, bucket);
+	ret = sd_create_hyper_volume(index_name, &vid);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to create bucket %s index vid", bucket);
+		goto err;
+	}
+	ret = oindex_init(vid);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to init index for bucket %s", bucket);
+		sd_delete_vdi(index_name);
+		goto err;
+	}
 
 	pstrcpy(bnode.name, sizeof(bnode.name), bucket);
 	bnode.bytes_used = 0;
 	bnode.object_count = 0;
 	ret = bnode_create(&bnode, account_vid);
-	if (ret != SD_RES_SUCCESS)
+	if (ret != SD_RES_SUCCESS) {
+		sd_delete_vdi(index_name);
 		goto err;
+	}
 
 	return SD_RES_SUCCESS;
 err:
@@ -452,18 +469,128 @@ static int bnode_update(const char *account, const char *bucket, uint64_t used,
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * Deleting the vdis of a bucket removes all their objects, which takes long
+ * for a bucket which held many objects.  bucket_delete() only zeroes the
+ * bnode, which hides the bucket, and queues the deletion of its vdis on
+ * kv_reap_wqueue, whose KV_REAP_THREADS threads bound how many buckets are
+ * reaped at once.  The bucket is missing for the object operations from then
+ * on, and creating it again waits until its vdis are gone.
+ */
+#define KV_REAP_THREADS 2
+
+struct bucket_reap {
+	struct work work;
+	struct list_node list;
+	char account[SD_MAX_VDI_LEN];
+	char bucket[SD_MAX_BUCKET_NAME];
+	char name[SD_MAX_VDI_LEN];	/* of the onode vdi */
+};
+
+static struct work_queue *kv_reap_wqueue;
+static LIST_HEAD(reap_list);
+static struct sd_mutex reap_lock = SD_MUTEX_INITIALIZER;
+static struct sd_cond reap_cond = SD_COND_INITIALIZER;
+
+/* Called with reap_lock held */
+static bool reap_pending(const char *name)
+{
+	struct bucket_reap *r;
+
+	list_for_each_entry(r, &reap_list, list)
+		if (!strcmp(r->name, name))
+			return true;
+	return false;
+}
+
+static void wait_reap(const char *name)
+{
+	sd_mutex_lock(&reap_lock);
+	while (reap_pending(name))
+		sd_cond_wait(&reap_cond, &reap_lock);
+	sd_mutex_unlock(&reap_lock);
+}
+
+static void bucket_delete_vdis(const char *account, const char *bucket)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	uint32_t vid;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
+	sd_delete_vdi(vdi_name);
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/allocator", account, bucket);
+	if (sd_lookup_vdi(vdi_name, &vid) == SD_RES_SUCCESS)
+		oalloc_drop_window(vid);
+	sd_delete_vdi(vdi_name);
+	/* Buckets created by older versions have no index */
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/index", account, bucket);
+	if (sd_lookup_vdi(vdi_name, &vid) == SD_RES_SUCCESS)
+		sd_delete_vdi(vdi_name);
+	/* Created by the first multipart upload, if any */
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/uploads", account, bucket);
+	if (sd_lookup_vdi(vdi_name, &vid) == SD_RES_SUCCESS)
+		sd_delete_vdi(vdi_name);
+}
+
+static void bucket_reap_work(struct work *work)
+{
+	struct bucket_reap *r = container_of(work, struct bucket_reap, work);
+
+	sd_info("reap bucket %s", r->name);
+	bucket_delete_vdis(r->account, r->bucket);
+
+	sd_mutex_lock(&reap_lock);
+	list_del(&r->list);
+	sd_cond_broadcast(&reap_cond);
+	sd_mutex_unlock(&reap_lock);
+}
+
+static void bucket_reap_done(struct work *work)
+{
+	struct bucket_reap *r = container_of(work, struct bucket_reap, work);
+
+	free(r);
+}
+
+static void queue_bucket_reap(const char *account, const char *bucket)
+{
+	struct bucket_reap *r = xzalloc(sizeof(*r));
+
+	pstrcpy(r->account, sizeof(r->account), account);
+	pstrcpy(r->bucket, sizeof(r->bucket), bucket);
+	snprintf(r->name, sizeof(r->name), "%s/%s", account, bucket);
+	r->work.fn = bucket_reap_work;
+	r->work.done = bucket_reap_done;
+
+	sd_mutex_lock(&reap_lock);
+	list_add_tail(&r->list, &reap_list);
+	sd_mutex_unlock(&reap_lock);
+	queue_work(kv_reap_wqueue, &r->work);
+}
+
+/* Look up the onode vdi of the bucket, which is missing while it's reaped */
+static int bucket_lookup(const char *account, const char *bucket,
+			 uint32_t *vid)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	bool pending;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
+	sd_mutex_lock(&reap_lock);
+	pending = reap_pending(vdi_name);
+	sd_mutex_unlock(&reap_lock);
+	if (pending)
+		return SD_RES_NO_VDI;
+
+	return sd_lookup_vdi(vdi_name, vid);
+}
+
 static int bucket_delete(const char *account, uint32_t avid, const char *bucket)
 {
 	struct kv_bnode bnode;
-	char onode_name[SD_MAX_VDI_LEN];
-	char alloc_name[SD_MAX_VDI_LEN];
 	char name[SD_MAX_BUCKET_NAME] = {};
 	int ret;
 
-	snprintf(onode_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-	snprintf(alloc_name, SD_MAX_VDI_LEN, "%s/%s/allocator", account,
-		 bucket);
-
 	ret = bnode_lookup(&bnode, avid, bucket);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
@@ -481,12 +608,19 @@ static int bucket_delete(const char *account, uint32_t avid, const char *bucket)
 		sd_err("failed to zero bnode for %s", bucket);
 		return ret;
 	}
-	sd_delete_vdi(onode_name);
-	sd_delete_vdi(alloc_name);
+	queue_bucket_reap(account, bucket);
 
 	return SD_RES_SUCCESS;
 }
 
+int kv_init(void)
+{
+	kv_reap_wqueue = create_fixed_work_queue("kv_reap", KV_REAP_THREADS);
+	if (!kv_reap_wqueue)
+		return -1;
+	return 0;
+}
+
 typedef void (*object_iter_cb)(const char *object, void *opaque);
 
 struct object_iterater_arg {
@@ -544,10 +678,77 @@ out:
 	return ret;
 }
 
+struct index_build_arg {
+	uint32_t vid;
+	int ret;
+};
+
+static void index_build_cb(const char *object, void *opaque)
+{
+	struct index_build_arg *arg = opaque;
+
+	if (arg->ret == SD_RES_SUCCESS)
+		arg->ret = oindex_insert(arg->vid, object);
+}
+
+/* Create the missing index of a bucket made by older versions */
+static int bucket_build_index(uint32_t bucket_vid, const char *index_name,
+			      uint32_t *vid)
+{
+	struct index_build_arg arg;
+	int ret;
+
+	sd_info("build index %s", index_name);
+	ret = sd_create_hyper_volume(index_name, &arg.vid);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to create index %s", index_name);
+		return ret;
+	}
+	arg.ret = oindex_init(arg.vid);
+	if (arg.ret == SD_RES_SUCCESS) {
+		ret = bucket_iterate_object(bucket_vid, index_build_cb, &arg);
+		if (ret != SD_RES_SUCCESS)
+			arg.ret = ret;
+	}
+	if (arg.ret != SD_RES_SUCCESS) {
+		sd_err("Failed to build index %s", index_name);
+		sd_delete_vdi(index_name);
+		return arg.ret;
+	}
+
+	*vid = arg.vid;
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Add or remove the object name in the bucket index. Called with the bucket
+ * lock held.
+ */
+static int bucket_update_index(const char *account, const char *bucket,
+			       const char *name, bool create)
+{
+	char index_name[SD_MAX_VDI_LEN];
+	uint32_t vid;
+	int ret;
+
+	snprintf(index_name, SD_MAX_VDI_LEN, "%s/%s/index", account, bucket);
+	ret = sd_lookup_vdi(index_name, &vid);
+	if (ret == SD_RES_NO_VDI)
+		/* Built by the first listing of the bucket */
+		return SD_RES_SUCCESS;
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (create)
+		return oindex_insert(vid, name);
+	return oindex_delete(vid, name);
+}
+
 int kv_create_bucket(const char *account, const char *bucket)
 {
 	uint32_t account_vid, vid;
 	char vdi_name[SD_MAX_VDI_LEN];
+	struct kv_bnode bnode;
 	int ret;
 
 	ret = sd_lookup_vdi(account, &account_vid);
@@ -556,9 +757,18 @@ int kv_create_bucket(const char *account, const char *bucket)
 		return ret;
 	}
 
-	sys->cdrv->lock(account_vid);
 	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
+	wait_reap(vdi_name);
+
+	sys->cdrv->lock(account_vid);
 	ret = sd_lookup_vdi(vdi_name, &vid);
+	if (ret == SD_RES_SUCCESS &&
+	    bnode_lookup(&bnode, account_vid, bucket) == SD_RES_NO_OBJ) {
+		/* left by a reap which a restart cut short */
+		sd_info("delete the leftovers of bucket %s", vdi_name);
+		bucket_delete_vdis(account, bucket);
+		ret = sd_lookup_vdi(vdi_name, &vid);
+	}
 	if (ret == SD_RES_SUCCESS) {
 		sd_err("bucket %s is exists.", bucket);
 		ret = SD_RES_VDI_EXIST;
@@ -608,7 +818,6 @@ int kv_update_bucket(const char *account, const char *bucket)
 int kv_delete_bucket(const char *account, const char *bucket)
 {
 	uint32_t account_vid, vid;
-	char vdi_name[SD_MAX_VDI_LEN];
 	int ret;
 
 	ret = sd_lookup_vdi(account, &account_vid);
@@ -618,9 +827,7 @@ int kv_delete_bucket(const char *account, const char *bucket)
 	}
 
 	sys->cdrv->lock(account_vid);
-	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-
-	ret = sd_lookup_vdi(vdi_name, &vid);
+	ret = bucket_lookup(account, bucket, &vid);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 	ret = bucket_delete(account, account_vid, bucket);
@@ -664,8 +871,10 @@ out:
 
 #define KV_ONODE_INLINE_SIZE (SD_DATA_OBJ_SIZE - ONODE_HDR_SIZE)
 
-static int vdi_read_write(uint32_t vid, char *data, size_t length,
-			  off_t offset, bool is_read, bool create)
+/* Issue the requests for the range and return the iocb to wait for them */
+static struct request_iocb *vdi_read_write_async(uint32_t vid, char *data,
+						 size_t length, off_t offset,
+						 bool is_read, bool create)
 {
 	struct sd_req hdr;
 	uint32_t idx = offset / SD_DATA_OBJ_SIZE;
@@ -675,7 +884,7 @@ static int vdi_read_write(uint32_t vid, char *data, size_t length,
 
 	iocb = local_req_init();
 	if (!iocb)
-		return SD_RES_SYSTEM_ERROR;
+		return NULL;
 
 	offset %= SD_DATA_OBJ_SIZE;
 	while (done < length) {
@@ -709,7 +918,68 @@ static int vdi_read_write(uint32_t vid, char *data, size_t length,
 		create = true;
 	}
 
-	return local_req_wait(iocb);
+	return iocb;
+}
+
+/*
+ * Large objects are transferred through a ring of kv_rw_depth buffers so
+ * that reading the next chunk from the FastCGI socket (or writing the
+ * previous one to it) overlaps with the object requests of the others.
+ */
+struct kv_rw_slot {
+	struct request_iocb *iocb;
+	char *buf;
+	uint64_t size;
+};
+
+struct kv_rw_ring {
+	int depth;
+	int next; /* the oldest slot in flight, or the free one */
+	struct kv_rw_slot slots[KV_MAX_RW_DEPTH];
+};
+
+static void kv_rw_ring_init(struct kv_rw_ring *ring, char *buf,
+			    uint64_t buffer_size)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->depth = kv_rw_depth;
+	for (int i = 0; i < ring->depth; i++)
+		ring->slots[i].buf = buf + i * buffer_size;
+}
+
+/*
+ * Wait for the oldest slot and pass its data to the client if it was read.
+ * Returns the slot, which is free for the next chunk.
+ */
+static struct kv_rw_slot *kv_rw_ring_get(struct kv_rw_ring *ring,
+					 struct http_request *req, int *ret)
+{
+	struct kv_rw_slot *slot = ring->slots + ring->next;
+	int err;
+
+	ring->next = (ring->next + 1) % ring->depth;
+	if (!slot->iocb)
+		return slot;
+
+	err = local_req_wait(slot->iocb);
+	slot->iocb = NULL;
+	if (err != SD_RES_SUCCESS) {
+		if (*ret == SD_RES_SUCCESS)
+			*ret = err;
+		return slot;
+	}
+	if (req && *ret == SD_RES_SUCCESS)
+		http_request_write(req, slot->buf, slot->size);
+	return slot;
+}
+
+/* Wait for all the slots in flight, in the order they were issued */
+static int kv_rw_ring_drain(struct kv_rw_ring *ring, struct http_request *req,
+			    int ret)
+{
+	for (int i = 0; i < ring->depth; i++)
+		kv_rw_ring_get(ring, req, &ret);
+	return ret;
 }
 
 static int onode_allocate_extents(struct kv_onode *onode,
@@ -734,9 +1004,7 @@ static int onode_allocate_extents(struct kv_onode *onode,
 			onode->o_extent[idx - 1].data_len += reserv_len;
 	}
 	count = DIV_ROUND_UP((req->data_length - reserv_len), SD_DATA_OBJ_SIZE);
-	sys->cdrv->lock(data_vid);
 	ret = oalloc_new_prepare(data_vid, &start, count);
-	sys->cdrv->unlock(data_vid);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("oalloc_new_prepare failed for %s, %s", onode->name,
 		       sd_strerror(ret));
@@ -760,40 +1028,72 @@ out:
 	return ret;
 }
 
+/*
+ * Write total bytes of the request body at offset of the data vdi.  If ctx is
+ * not NULL, the body is hashed into it as it's read, while the chunks are hot
+ * in the cache, so the ETag costs no second pass over the data.
+ */
 static int do_vdi_write(struct http_request *req, uint32_t data_vid,
 			uint64_t offset, uint64_t total, char *data_buf,
-			bool create)
+			uint64_t buffer_size, bool create,
+			struct md5_ctx *ctx)
 {
 	uint64_t done = 0, size;
 	int ret = SD_RES_SUCCESS;
+	struct kv_rw_ring ring;
 
+	kv_rw_ring_init(&ring, data_buf, buffer_size);
 	while (done < total) {
-		size = http_request_read(req, data_buf,
-					 MIN(kv_rw_buffer, total - done));
+		struct kv_rw_slot *slot = kv_rw_ring_get(&ring, NULL, &ret);
+
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("Failed to write data object for %" PRIx32
+			       ", %s", data_vid, sd_strerror(ret));
+			goto out;
+		}
+
+		/*
+		 * End the chunks at object boundaries so that no two chunks in
+		 * flight touch the same object.
+		 */
+		size = MIN(buffer_size, total - done);
+		if (done + size < total &&
+		    round_down(offset + size, SD_DATA_OBJ_SIZE) > offset)
+			size = round_down(offset + size, SD_DATA_OBJ_SIZE) -
+				offset;
+		size = http_request_read(req, slot->buf, size);
 		if (size <= 0) {
 			sd_err("Failed to read http request: %ld", size);
 			ret = SD_RES_EIO;
 			goto out;
 		}
-		ret = vdi_read_write(data_vid, data_buf, size, offset,
-				     false, create);
+		if (ctx)
+			md5_update(ctx, (uint8_t *)slot->buf, size);
+		slot->iocb = vdi_read_write_async(data_vid, slot->buf, size,
+						  offset, false, create);
 		sd_debug("vdi_write offset: %"PRIu64", size: %" PRIu64
-			 ", for %" PRIx32 "ret: %d", offset, size,
-			 data_vid, ret);
-		if (ret != SD_RES_SUCCESS) {
-			sd_err("Failed to write data object for %" PRIx32
-			       ", %s", data_vid, sd_strerror(ret));
+			 ", for %" PRIx32, offset, size, data_vid);
+		if (!slot->iocb) {
+			ret = SD_RES_SYSTEM_ERROR;
 			goto out;
 		}
 		done += size;
 		offset += size;
+		/* the following chunks start at new objects */
+		if (offset % SD_DATA_OBJ_SIZE == 0)
+			create = true;
 	}
 out:
+	ret = kv_rw_ring_drain(&ring, NULL, ret);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("Failed to write data object for %" PRIx32 ", %s",
+		       data_vid, sd_strerror(ret));
 	return ret;
 }
 
 static int onode_populate_extents(struct kv_onode *onode,
-				  struct http_request *req)
+				  struct http_request *req,
+				  struct md5_ctx *ctx)
 {
 	struct onode_extent *ext;
 	struct onode_extent *last_ext = onode->o_extent + onode->nr_extent - 1;
@@ -804,7 +1104,7 @@ static int onode_populate_extents(struct kv_onode *onode,
 	uint32_t data_vid = onode->data_vid;
 	bool create = true;
 
-	data_buf = xmalloc(write_buffer_size);
+	data_buf = xmalloc(write_buffer_size * kv_rw_depth);
 
 	if (last_ext->data_len < req->data_length) {
 		ext = last_ext - 1;
@@ -812,7 +1112,7 @@ static int onode_populate_extents(struct kv_onode *onode,
 		offset = (ext->start + ext->count) * SD_DATA_OBJ_SIZE -
 			 reserv_len;
 		ret = do_vdi_write(req, data_vid, offset, reserv_len,
-				   data_buf, false);
+				   data_buf, write_buffer_size, false, ctx);
 		if (ret != SD_RES_SUCCESS) {
 			sd_err("Failed to do_vdi_write data_vid: %" PRIx32
 			       ", offset: %" PRIx64 ", total: %" PRIx64
@@ -830,7 +1130,8 @@ static int onode_populate_extents(struct kv_onode *onode,
 			create = false;
 	}
 
-	ret = do_vdi_write(req, data_vid, offset, total, data_buf, create);
+	ret = do_vdi_write(req, data_vid, offset, total, data_buf,
+			   write_buffer_size, create, ctx);
 	if (ret != SD_RES_SUCCESS)
 		sd_err("Failed to do_vdi_write data_vid: %" PRIx32
 		       ", offset: %" PRIx64 ", total: %" PRIx64
@@ -882,6 +1183,107 @@ out:
 	return ret;
 }
 
+/*
+ * Onode cache
+ *
+ * Finding an onode by name reads the whole bucket inode and then the names of
+ * the adjacent slots, which is most of the cost of a HEAD or a GET.  The cache
+ * remembers where the recently looked up objects live, keyed by (bucket vid,
+ * name), and evicts the least recently used ones.
+ *
+ * Only the oid is cached, not the onode, because the other gateways update the
+ * onodes behind our back.  A hit still reads the onode and checks its name, so
+ * a stale entry costs a fall back to the scan.  The entries are dropped when
+ * the onodes are cleared and added when they are created.
+ */
+#define ONODE_CACHE_SIZE	4096
+
+struct onode_cache_entry {
+	struct rb_node rb;
+	struct list_node lru;
+	uint32_t vid;
+	uint64_t oid;
+	char name[SD_MAX_OBJECT_NAME];
+};
+
+static struct rb_root onode_cache_root = RB_ROOT;
+static LIST_HEAD(onode_cache_lru);
+static int nr_onode_cache;
+static struct sd_mutex onode_cache_lock = SD_MUTEX_INITIALIZER;
+
+static int onode_cache_cmp(const struct onode_cache_entry *a,
+			   const struct onode_cache_entry *b)
+{
+	int ret = intcmp(a->vid, b->vid);
+
+	if (ret)
+		return ret;
+	return strcmp(a->name, b->name);
+}
+
+static void onode_cache_remove(struct onode_cache_entry *entry)
+{
+	rb_erase(&entry->rb, &onode_cache_root);
+	list_del(&entry->lru);
+	nr_onode_cache--;
+	free(entry);
+}
+
+/* Return the oid of the cached onode, or 0 if not cached */
+static uint64_t onode_cache_get(uint32_t vid, const char *name)
+{
+	struct onode_cache_entry key = { .vid = vid }, *entry;
+	uint64_t oid = 0;
+
+	pstrcpy(key.name, sizeof(key.name), name);
+	sd_mutex_lock(&onode_cache_lock);
+	entry = rb_search(&onode_cache_root, &key, rb, onode_cache_cmp);
+	if (entry) {
+		list_move_tail(&entry->lru, &onode_cache_lru);
+		oid = entry->oid;
+	}
+	sd_mutex_unlock(&onode_cache_lock);
+
+	return oid;
+}
+
+static void onode_cache_put(uint64_t oid, const char *name)
+{
+	struct onode_cache_entry *entry = xmalloc(sizeof(*entry)), *old;
+
+	entry->vid = oid_to_vid(oid);
+	entry->oid = oid;
+	pstrcpy(entry->name, sizeof(entry->name), name);
+
+	sd_mutex_lock(&onode_cache_lock);
+	old = rb_insert(&onode_cache_root, entry, rb, onode_cache_cmp);
+	if (old) {
+		old->oid = oid;
+		list_move_tail(&old->lru, &onode_cache_lru);
+		sd_mutex_unlock(&onode_cache_lock);
+		free(entry);
+		return;
+	}
+	list_add_tail(&entry->lru, &onode_cache_lru);
+	if (++nr_onode_cache > ONODE_CACHE_SIZE)
+		onode_cache_remove(list_first_entry(&onode_cache_lru,
+						    struct onode_cache_entry,
+						    lru));
+	sd_mutex_unlock(&onode_cache_lock);
+}
+
+static void onode_cache_drop(uint64_t oid, const char *name)
+{
+	struct onode_cache_entry key = { .vid = oid_to_vid(oid) }, *entry;
+
+	pstrcpy(key.name, sizeof(key.name), name);
+	sd_mutex_lock(&onode_cache_lock);
+	entry = rb_search(&onode_cache_root, &key, rb, onode_cache_cmp);
+	if (entry)
+		onode_cache_remove(entry);
+	sd_mutex_unlock(&onode_cache_lock);
+}
+
 static int onode_do_update(struct kv_onode *onode)
 {
 	uint64_t len;
@@ -901,28 +1303,34 @@ static int onode_do_update(struct kv_onode *onode)
 
 static int onode_populate_data(struct kv_onode *onode, struct http_request *req)
 {
+	struct md5_ctx ctx;
 	ssize_t size;
 	int ret = SD_RES_SUCCESS;
 
 	onode->mtime = get_seconds();
 	onode->flags = ONODE_COMPLETE;
 
+	md5_init(&ctx);
 	if (req->data_length <= KV_ONODE_INLINE_SIZE) {
-		size = http_request_read(req, onode->data, sizeof(onode->data));
+		/* no more than the object, the body may go on with others */
+		size = http_request_read(req, onode->data, req->data_length);
 		if (size < 0 || req->data_length != size) {
 			sd_err("Failed to read from web server for %s",
 			       onode->name);
 			ret = SD_RES_SYSTEM_ERROR;
 			goto out;
 		}
+		md5_update(&ctx, onode->data, size);
+		md5_final(&ctx, onode->md5);
 		ret = sd_write_object(onode->oid, (char *)onode,
 				      ONODE_HDR_SIZE + size, 0, false);
 		if (ret != SD_RES_SUCCESS)
 			goto out;
 	} else {
-		ret = onode_populate_extents(onode, req);
+		ret = onode_populate_extents(onode, req, &ctx);
 		if (ret != SD_RES_SUCCESS)
 			goto out;
+		md5_final(&ctx, onode->md5);
 		/* write mtime and flag ONODE_COMPLETE to onode */
 		ret = onode_do_update(onode);
 		if (ret != SD_RES_SUCCESS) {
@@ -941,8 +1349,10 @@ static int onode_populate_append_data(struct kv_onode *onode,
 	int ret;
 
 	onode->mtime = get_seconds();
+	/* the hash of the old data can't be continued */
+	memset(onode->md5, 0, sizeof(onode->md5));
 
-	ret = onode_populate_extents(onode, req);
+	ret = onode_populate_extents(onode, req, NULL);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 	ret = onode_do_update(onode);
@@ -962,8 +1372,9 @@ static int onode_do_create(struct kv_onode *onode, struct sd_inode *inode,
 	int ret;
 
 	onode->oid = oid;
+	/* The inlined data is not read yet, onode_populate_data() writes it */
 	if (onode->inlined)
-		len = onode->size;
+		len = 0;
 	else
 		len = sizeof(struct onode_extent) * onode->nr_extent;
 
@@ -973,6 +1384,7 @@ static int onode_do_create(struct kv_onode *onode, struct sd_inode *inode,
 		sd_err("failed to create object, %016" PRIx64, oid);
 		goto out;
 	}
+	onode_cache_put(oid, onode->name);
 	if (!create)
 		goto out;
 
@@ -1062,9 +1474,12 @@ static int onode_read_extents(struct kv_onode *onode, struct http_request *req)
 	uint64_t off = req->offset, len = req->data_length;
 	int ret = SD_RES_SUCCESS;
 	char *data_buf = NULL;
-	uint64_t read_buffer_size = MIN(kv_rw_buffer, onode->size);
+	/* Size the buffers by the range, not by the whole object */
+	uint64_t read_buffer_size = MIN(kv_rw_buffer, len);
+	struct kv_rw_ring ring;
 
-	data_buf = xmalloc(read_buffer_size);
+	data_buf = xmalloc(read_buffer_size * kv_rw_depth);
+	kv_rw_ring_init(&ring, data_buf, read_buffer_size);
 	total_size = len;
 	for (i = 0; i < onode->nr_extent; i++) {
 		ext = onode->o_extent + i;
@@ -1078,27 +1493,63 @@ static int onode_read_extents(struct kv_onode *onode, struct http_request *req)
 		off = 0;
 		done = 0;
 		while (done < total) {
-			size = MIN(total - done, read_buffer_size);
-			ret = vdi_read_write(onode->data_vid, data_buf,
-					     size, offset, true, false);
-			sd_debug("vdi_read size: %"PRIu64", offset: %"
-				 PRIu64", ret:%d", size, offset, ret);
+			struct kv_rw_slot *slot;
+
+			slot = kv_rw_ring_get(&ring, req, &ret);
 			if (ret != SD_RES_SUCCESS) {
 				sd_err("Failed to read for vid %"PRIx32,
 				       onode->data_vid);
 				goto out;
 			}
-			http_request_write(req, data_buf, size);
+
+			size = MIN(total - done, read_buffer_size);
+			slot->iocb = vdi_read_write_async(onode->data_vid,
+							  slot->buf, size,
+							  offset, true, false);
+			sd_debug("vdi_read size: %"PRIu64", offset: %"
+				 PRIu64, size, offset);
+			if (!slot->iocb) {
+				ret = SD_RES_SYSTEM_ERROR;
+				goto out;
+			}
+			slot->size = size;
 			done += size;
 			offset += size;
 			total_size -= size;
 		}
 	}
 out:
+	ret = kv_rw_ring_drain(&ring, req, ret);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("Failed to read for vid %"PRIx32, onode->data_vid);
 	free(data_buf);
 	return ret;
 }
 
+/* Read the onode header and as much of the body as is in use */
+static int onode_read(uint64_t oid, struct kv_onode *onode)
+{
+	uint64_t len;
+	int ret;
+
+	ret = sd_read_object(oid, (char *)onode, ONODE_HDR_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (onode->inlined)
+		len = onode->size;
+	else
+		len = sizeof(struct onode_extent) * onode->nr_extent;
+	if (len > sizeof(onode->data)) {
+		sd_err("corrupted onode %016"PRIx64", %s", oid, onode->name);
+		return SD_RES_EIO;
+	}
+	if (!len)
+		return SD_RES_SUCCESS;
+
+	return sd_read_object(oid, (char *)onode->data, len, ONODE_HDR_SIZE);
+}
+
 /*
  * Check if object by name exists in a bucket and init 'onode' if it exists.
  *
@@ -1118,9 +1569,18 @@ static int onode_lookup_nolock(struct kv_onode *onode, uint32_t ovid,
 {
 	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
 	uint32_t tmp_vid, idx;
-	uint64_t hval, i;
+	uint64_t hval, i, oid;
 	int ret;
 
+	oid = onode_cache_get(ovid, name);
+	if (oid) {
+		ret = onode_read(oid, onode);
+		if (ret == SD_RES_SUCCESS && strcmp(onode->name, name) == 0)
+			goto out;
+		/* moved or deleted by someone else */
+		onode_cache_drop(oid, name);
+	}
+
 	ret = sd_read_object(vid_to_vdi_oid(ovid), (char *)inode,
 			     sizeof(*inode), 0);
 	if (ret != SD_RES_SUCCESS) {
@@ -1134,14 +1594,19 @@ static int onode_lookup_nolock(struct kv_onode *onode, uint32_t ovid,
 		idx = (hval + i) % MAX_DATA_OBJS;
 		tmp_vid = sd_inode_get_vid(inode, idx);
 		if (tmp_vid) {
-			uint64_t oid = vid_to_data_oid(ovid, idx);
+			oid = vid_to_data_oid(ovid, idx);
 
-			ret = sd_read_object(oid, (char *)onode,
-					     sizeof(*onode), 0);
+			/* Only the name to skip the other objects cheaply */
+			ret = sd_read_object(oid, onode->name,
+					     sizeof(onode->name), 0);
 			if (ret != SD_RES_SUCCESS)
 				goto out;
-			if (strcmp(onode->name, name) == 0)
+			if (strcmp(onode->name, name) == 0) {
+				ret = onode_read(oid, onode);
+				if (ret == SD_RES_SUCCESS)
+					onode_cache_put(oid, name);
 				break;
+			}
 		} else {
 			ret = SD_RES_NO_OBJ;
 			break;
@@ -1167,27 +1632,46 @@ static int onode_lookup(struct kv_onode *onode, uint32_t ovid, const char *name)
 	return ret;
 }
 
+/* The appended and the multipart objects have no hash */
+static void onode_write_etag(struct kv_onode *onode, struct http_request *req)
+{
+	static const uint8_t zero[MD5_DIGEST_SIZE];
+
+	if (memcmp(onode->md5, zero, sizeof(zero)))
+		http_request_writef(req, "ETag: \"%s\"\n",
+				    md5_to_hex(onode->md5));
+}
+
 static int onode_read_data(struct kv_onode *onode, struct http_request *req)
 {
 	int ret;
 	uint64_t off = 0, len = onode->size;
 
-	if (req->offset || req->data_length) {
-		off = req->offset;
-		len = req->data_length;
-		if ((off + len - 1) > onode->size) {
-			if (onode->size > off)
-				len = onode->size - off;
-			else
-				len = 0;
-		}
+	/* Map the range to the bytes of the object, see also RFC 7233 */
+	if (req->range) {
+		if (req->range_suffix) {
+			len = min(req->data_length, onode->size);
+			off = onode->size - len;
+		} else if (req->offset < onode->size) {
+			off = req->offset;
+			len = onode->size - off;
+			if (req->data_length)
+				len = min(req->data_length, len);
+		} else
+			len = 0;
+		if (!len)
+			return SD_RES_INVALID_PARMS;
+
+		http_request_writef(req, "Content-Range: bytes %"PRIu64"-%"
+				    PRIu64"/%"PRIu64"\n", off, off + len - 1,
+				    onode->size);
 	}
 
+	req->offset = off;
 	req->data_length = len;
+	http_response_header(req, req->range ? PARTIAL_CONTENT : OK);
 	if (!len)
-		return SD_RES_INVALID_PARMS;
-
-	http_response_header(req, OK);
+		return SD_RES_SUCCESS;
 
 	if (!onode->inlined)
 		return onode_read_extents(onode, req);
@@ -1212,16 +1696,25 @@ static int onode_read_data(struct kv_onode *onode, struct http_request *req)
  *
  * XXX: GC the orphans
  */
-static int onode_delete(struct kv_onode *onode)
+static int onode_clear(struct kv_onode *onode)
 {
 	char name[SD_MAX_OBJECT_NAME] = {};
 	int ret;
 
+	onode_cache_drop(onode->oid, onode->name);
 	ret = sd_write_object(onode->oid, name, sizeof(name), 0, 0);
-	if (ret != SD_RES_SUCCESS) {
+	if (ret != SD_RES_SUCCESS)
 		sd_err("failed to zero onode for %s", onode->name);
+	return ret;
+}
+
+static int onode_delete(struct kv_onode *onode)
+{
+	int ret;
+
+	ret = onode_clear(onode);
+	if (ret != SD_RES_SUCCESS)
 		return ret;
-	}
 
 	ret = onode_free_data(onode);
 	if (ret != SD_RES_SUCCESS)
@@ -1244,9 +1737,17 @@ onode_create_and_update_bnode(struct http_request *req, const char *account,
 		goto out;
 	}
 
+	ret = bucket_update_index(account, bucket, onode->name, true);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to index %s", onode->name);
+		onode_delete(onode);
+		goto out;
+	}
+
 	ret = bnode_update(account, bucket, req->data_length, true);
 	if (ret != SD_RES_SUCCESS) {
 		sd_err("failed to update bucket for %s", onode->name);
+		bucket_update_index(account, bucket, onode->name, false);
 		onode_delete(onode);
 		goto out;
 	}
@@ -1261,6 +1762,7 @@ static int onode_allocate_space(struct http_request *req, const char *account,
 {
 	char vdi_name[SD_MAX_VDI_LEN];
 	uint32_t data_vid;
+	bool overwrite = false;
 	int ret;
 
 	sys->cdrv->lock(bucket_vid);
@@ -1278,6 +1780,8 @@ static int onode_allocate_space(struct http_request *req, const char *account,
 			sd_err("Failed to delete exists object %s", name);
 			goto out;
 		}
+		/* The index entry is kept for the new object */
+		overwrite = true;
 		ret = bnode_update(account, bucket, onode->size, false);
 		if (ret != SD_RES_SUCCESS) {
 			sd_err("Failed to update bnode for %s", name);
@@ -1307,6 +1811,8 @@ static int onode_allocate_space(struct http_request *req, const char *account,
 	ret = onode_create_and_update_bnode(req, account, bucket_vid, bucket,
 					    data_vid, onode);
 out:
+	if (ret != SD_RES_SUCCESS && overwrite)
+		bucket_update_index(account, bucket, name, false);
 	sys->cdrv->unlock(bucket_vid);
 	return ret;
 }
@@ -1374,13 +1880,11 @@ out:
 int kv_complete_object(struct http_request *req, const char *account,
 		       const char *bucket, const char *object)
 {
-	char vdi_name[SD_MAX_VDI_LEN];
 	struct kv_onode *onode = NULL;
 	uint32_t bucket_vid;
 	int ret;
 
-	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	ret = bucket_lookup(account, bucket, &bucket_vid);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
@@ -1446,13 +1950,11 @@ out:
 int kv_create_object(struct http_request *req, const char *account,
 		     const char *bucket, const char *name)
 {
-	char vdi_name[SD_MAX_VDI_LEN];
 	struct kv_onode *onode = NULL;
 	uint32_t bucket_vid;
 	int ret;
 
-	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	ret = bucket_lookup(account, bucket, &bucket_vid);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
@@ -1486,13 +1988,11 @@ out:
 int kv_append_object(struct http_request *req, const char *account,
 		     const char *bucket, const char *name)
 {
-	char vdi_name[SD_MAX_VDI_LEN];
 	struct kv_onode *onode = NULL;
 	uint32_t bucket_vid;
 	int ret;
 
-	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	ret = bucket_lookup(account, bucket, &bucket_vid);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
@@ -1517,12 +2017,10 @@ int kv_read_object(struct http_request *req, const char *account,
 		   const char *bucket, const char *name)
 {
 	struct kv_onode *onode = NULL;
-	char vdi_name[SD_MAX_VDI_LEN];
 	uint32_t bucket_vid;
 	int ret;
 
-	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	ret = bucket_lookup(account, bucket, &bucket_vid);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -1537,6 +2035,7 @@ int kv_read_object(struct http_request *req, const char *account,
 		goto out;
 	}
 
+	onode_write_etag(onode, req);
 	ret = onode_read_data(onode, req);
 	if (ret != SD_RES_SUCCESS)
 		sd_err("failed to read data for %s ret %d", name, ret);
@@ -1566,18 +2065,21 @@ out:
 int kv_delete_object(const char *account, const char *bucket, const char *name,
 		     bool force)
 {
-	char vdi_name[SD_MAX_VDI_LEN];
 	uint32_t bucket_vid;
 	struct kv_onode *onode = NULL;
 	int ret;
 
-	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	ret = bucket_lookup(account, bucket, &bucket_vid);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
 	onode = xzalloc(sizeof(*onode));
-	ret = onode_lookup(onode, bucket_vid, name);
+	/*
+	 * Hold the bucket lock from the lookup to the index removal, or a
+	 * create of the same name in between would lose its index entry.
+	 */
+	sys->cdrv->lock(bucket_vid);
+	ret = onode_lookup_nolock(onode, bucket_vid, name);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
@@ -1597,7 +2099,12 @@ int kv_delete_object(const char *account, const char *bucket, const char *name,
 		sd_err("failed to update bnode for %s", name);
 		goto out;
 	}
+
+	ret = bucket_update_index(account, bucket, name, false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to remove %s from the index", name);
 out:
+	sys->cdrv->unlock(bucket_vid);
 	free(onode);
 	return ret;
 }
@@ -1605,12 +2112,10 @@ out:
 int kv_iterate_object(const char *account, const char *bucket,
 		      object_iter_cb cb, void *opaque)
 {
-	char vdi_name[SD_MAX_VDI_LEN];
 	uint32_t bucket_vid;
 	int ret;
 
-	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	ret = bucket_lookup(account, bucket, &bucket_vid);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -1621,6 +2126,370 @@ int kv_iterate_object(const char *account, const char *bucket,
 	return ret;
 }
 
+/*
+ * List the objects of the bucket in the order of their names. See
+ * oindex_list() for the parameters.
+ */
+int kv_list_object(const char *account, const char *bucket,
+		   const struct kv_list_param *param, kv_list_cb cb,
+		   void *opaque, bool *truncated)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	uint32_t bucket_vid, index_vid;
+	int ret;
+
+	ret = bucket_lookup(account, bucket, &bucket_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/index", account, bucket);
+	sys->cdrv->lock(bucket_vid);
+	ret = sd_lookup_vdi(vdi_name, &index_vid);
+	if (ret == SD_RES_NO_VDI)
+		ret = bucket_build_index(bucket_vid, vdi_name, &index_vid);
+	if (ret == SD_RES_SUCCESS)
+		ret = oindex_list(index_vid, param, cb, opaque, truncated);
+	sys->cdrv->unlock(bucket_vid);
+
+	return ret;
+}
+
+/*
+ * Multipart upload
+ *
+ * An upload is an onode named by its id in the "<account>/<bucket>/uploads"
+ * vdi, with the name of the target object inlined. Each part gets its own
+ * onode "<id>/<part number>" there, whose extents are allocated from the
+ * bucket allocator like any object, so parts are uploaded in parallel.
+ * Completion concatenates the extent lists of the parts into the onode of the
+ * target object and just forgets the part onodes, without copying any data.
+ */
+
+static int upload_vdi_lookup(const char *account, const char *bucket,
+			     uint32_t *vid)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/uploads", account, bucket);
+	return sd_lookup_vdi(vdi_name, vid);
+}
+
+static int upload_lookup(struct kv_onode *upload, uint32_t uploads_vid,
+			 const char *upload_id)
+{
+	int ret;
+
+	ret = onode_lookup_nolock(upload, uploads_vid, upload_id);
+	if (ret == SD_RES_SUCCESS && !upload->inlined)
+		ret = SD_RES_NO_OBJ;
+	return ret;
+}
+
+int kv_initiate_upload(const char *account, const char *bucket,
+		       const char *object, char *upload_id)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	struct kv_onode *upload = NULL;
+	uint32_t bucket_vid, uploads_vid;
+	struct timeval tv;
+	int ret;
+
+	ret = bucket_lookup(account, bucket, &bucket_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	sys->cdrv->lock(bucket_vid);
+	ret = upload_vdi_lookup(account, bucket, &uploads_vid);
+	if (ret == SD_RES_NO_VDI) {
+		snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/uploads", account,
+			 bucket);
+		ret = sd_create_hyper_volume(vdi_name, &uploads_vid);
+	}
+	sys->cdrv->unlock(bucket_vid);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to find uploads of bucket %s", bucket);
+		return ret;
+	}
+
+	gettimeofday(&tv, NULL);
+	snprintf(upload_id, KV_UPLOAD_ID_LEN, "%016"PRIx64"%08lx",
+		 (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec, random());
+
+	upload = xzalloc(sizeof(*upload));
+	pstrcpy(upload->name, sizeof(upload->name), upload_id);
+	upload->inlined = 1;
+	upload->size = strlen(object) + 1;
+	upload->ctime = upload->mtime = get_seconds();
+	upload->flags = ONODE_COMPLETE;
+	pstrcpy((char *)upload->data, SD_MAX_OBJECT_NAME, object);
+
+	sys->cdrv->lock(uploads_vid);
+	ret = onode_create(upload, uploads_vid);
+	if (ret == SD_RES_SUCCESS)
+		ret = onode_do_update(upload);
+	sys->cdrv->unlock(uploads_vid);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("Failed to create upload %s for %s", upload_id, object);
+
+	free(upload);
+	return ret;
+}
+
+int kv_upload_part(struct http_request *req, const char *account,
+		   const char *bucket, const char *upload_id, uint32_t part)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	struct kv_onode *onode = NULL;
+	uint32_t uploads_vid, data_vid;
+	int ret;
+
+	if (!req->data_length)
+		return SD_RES_INVALID_PARMS;
+
+	ret = upload_vdi_lookup(account, bucket, &uploads_vid);
+	if (ret == SD_RES_NO_VDI)
+		return SD_RES_NO_OBJ;
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/allocator", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &data_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	onode = xzalloc(sizeof(*onode));
+	sys->cdrv->lock(uploads_vid);
+	ret = upload_lookup(onode, uploads_vid, upload_id);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%"PRIu32, upload_id, part);
+	ret = onode_lookup_nolock(onode, uploads_vid, vdi_name);
+	if (ret == SD_RES_SUCCESS) {
+		/* The part is uploaded again */
+		if (onode->flags != ONODE_COMPLETE) {
+			ret = SD_RES_INCOMPLETE;
+			goto out;
+		}
+		ret = onode_delete(onode);
+	} else if (ret == SD_RES_NO_OBJ)
+		ret = SD_RES_SUCCESS;
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	memset(onode, 0, sizeof(*onode));
+	pstrcpy(onode->name, sizeof(onode->name), vdi_name);
+	onode->data_vid = data_vid;
+	onode->flags = ONODE_INIT;
+	ret = onode_allocate_extents(onode, req);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	onode->ctime = get_seconds();
+	onode->size = req->data_length;
+	ret = onode_create(onode, uploads_vid);
+	if (ret != SD_RES_SUCCESS) {
+		onode_free_data(onode);
+		goto out;
+	}
+	sys->cdrv->unlock(uploads_vid);
+
+	/* The data is written without the lock, in parallel with other parts */
+	ret = onode_populate_extents(onode, req, NULL);
+	if (ret == SD_RES_SUCCESS) {
+		onode->mtime = get_seconds();
+		onode->flags = ONODE_COMPLETE;
+		ret = onode_do_update(onode);
+	}
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("Failed to upload part %s", vdi_name);
+		/* An incomplete part couldn't be uploaded again */
+		sys->cdrv->lock(uploads_vid);
+		onode_delete(onode);
+		sys->cdrv->unlock(uploads_vid);
+	}
+	free(onode);
+	return ret;
+out:
+	sys->cdrv->unlock(uploads_vid);
+	free(onode);
+	return ret;
+}
+
+struct upload_parts_arg {
+	const char *upload_id;
+	struct strbuf names;
+};
+
+static void upload_parts_cb(const char *name, void *opaque)
+{
+	struct upload_parts_arg *arg = opaque;
+	size_t len = strlen(arg->upload_id);
+
+	if (!strncmp(name, arg->upload_id, len) && name[len] == '/')
+		strbuf_add(&arg->names, name, strlen(name) + 1);
+}
+
+/* Delete the upload and all its remaining parts with their data */
+static void upload_discard(uint32_t uploads_vid, const char *upload_id,
+			   struct kv_onode *onode)
+{
+	struct upload_parts_arg arg = { upload_id, STRBUF_INIT };
+	char *name;
+
+	bucket_iterate_object(uploads_vid, upload_parts_cb, &arg);
+	for (name = arg.names.buf; name < arg.names.buf + arg.names.len;
+	     name += strlen(name) + 1)
+		if (onode_lookup_nolock(onode, uploads_vid, name) ==
+		    SD_RES_SUCCESS)
+			onode_delete(onode);
+	strbuf_release(&arg.names);
+
+	if (upload_lookup(onode, uploads_vid, upload_id) == SD_RES_SUCCESS)
+		onode_delete(onode);
+}
+
+/*
+ * Create the object from the given parts of the upload, which must be in
+ * ascending order. The parts which are not given are discarded.
+ */
+int kv_complete_upload(const char *account, const char *bucket,
+		       const char *object, const char *upload_id,
+		       const uint32_t *parts, int nr_parts)
+{
+	char vdi_name[SD_MAX_VDI_LEN];
+	struct kv_onode *onode, *part;
+	uint32_t bucket_vid, uploads_vid, data_vid;
+	uint64_t max_extent = sizeof(onode->data) / sizeof(onode->o_extent[0]);
+	int ret, i;
+
+	ret = bucket_lookup(account, bucket, &bucket_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	ret = upload_vdi_lookup(account, bucket, &uploads_vid);
+	if (ret == SD_RES_NO_VDI)
+		return SD_RES_NO_OBJ;
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s/allocator", account, bucket);
+	ret = sd_lookup_vdi(vdi_name, &data_vid);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	onode = xzalloc(sizeof(*onode));
+	part = xzalloc(sizeof(*part));
+	sys->cdrv->lock(uploads_vid);
+	ret = upload_lookup(part, uploads_vid, upload_id);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (strcmp((char *)part->data, object)) {
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+
+	/* Stitch the extents of the parts */
+	pstrcpy(onode->name, sizeof(onode->name), object);
+	onode->data_vid = data_vid;
+	for (i = 0; i < nr_parts; i++) {
+		/* Each part may be used only once */
+		if (i > 0 && parts[i] <= parts[i - 1]) {
+			ret = SD_RES_INVALID_PARMS;
+			goto out;
+		}
+		snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%"PRIu32, upload_id,
+			 parts[i]);
+		ret = onode_lookup_nolock(part, uploads_vid, vdi_name);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		if (part->flags != ONODE_COMPLETE) {
+			ret = SD_RES_INCOMPLETE;
+			goto out;
+		}
+		if (onode->nr_extent + part->nr_extent > max_extent) {
+			ret = SD_RES_NO_SPACE;
+			goto out;
+		}
+		memcpy(onode->o_extent + onode->nr_extent, part->o_extent,
+		       sizeof(part->o_extent[0]) * part->nr_extent);
+		onode->nr_extent += part->nr_extent;
+		onode->size += part->size;
+	}
+	onode->ctime = onode->mtime = get_seconds();
+	onode->flags = ONODE_COMPLETE;
+
+	sys->cdrv->lock(bucket_vid);
+	ret = onode_lookup_nolock(part, bucket_vid, object);
+	if (ret == SD_RES_SUCCESS) {
+		if (part->flags != ONODE_COMPLETE) {
+			ret = SD_RES_INCOMPLETE;
+			goto out_unlock;
+		}
+		ret = onode_delete(part);
+		if (ret != SD_RES_SUCCESS)
+			goto out_unlock;
+		ret = bnode_update(account, bucket, part->size, false);
+	} else if (ret == SD_RES_NO_OBJ)
+		ret = SD_RES_SUCCESS;
+	if (ret != SD_RES_SUCCESS)
+		goto out_unlock;
+
+	ret = onode_create(onode, bucket_vid);
+	if (ret != SD_RES_SUCCESS)
+		goto out_unlock;
+	ret = bucket_update_index(account, bucket, object, true);
+	if (ret != SD_RES_SUCCESS) {
+		onode_clear(onode);
+		goto out_unlock;
+	}
+	ret = bnode_update(account, bucket, onode->size, true);
+	if (ret != SD_RES_SUCCESS) {
+		bucket_update_index(account, bucket, object, false);
+		onode_clear(onode);
+		goto out_unlock;
+	}
+
+	/* The data belongs to the object now */
+	for (i = 0; i < nr_parts; i++) {
+		snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%"PRIu32, upload_id,
+			 parts[i]);
+		if (onode_lookup_nolock(part, uploads_vid, vdi_name) ==
+		    SD_RES_SUCCESS)
+			onode_clear(part);
+	}
+	upload_discard(uploads_vid, upload_id, part);
+out_unlock:
+	sys->cdrv->unlock(bucket_vid);
+out:
+	sys->cdrv->unlock(uploads_vid);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("Failed to complete upload %s of %s, %s", upload_id,
+		       object, sd_strerror(ret));
+	free(onode);
+	free(part);
+	return ret;
+}
+
+int kv_abort_upload(const char *account, const char *bucket,
+		    const char *upload_id)
+{
+	struct kv_onode *onode;
+	uint32_t uploads_vid;
+	int ret;
+
+	ret = upload_vdi_lookup(account, bucket, &uploads_vid);
+	if (ret == SD_RES_NO_VDI)
+		return SD_RES_NO_OBJ;
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	onode = xzalloc(sizeof(*onode));
+	sys->cdrv->lock(uploads_vid);
+	ret = upload_lookup(onode, uploads_vid, upload_id);
+	if (ret == SD_RES_SUCCESS)
+		upload_discard(uploads_vid, upload_id, onode);
+	sys->cdrv->unlock(uploads_vid);
+	free(onode);
+	return ret;
+}
+
 static char *http_time(uint64_t time_sec)
 {
 	static __thread char time_str[128];
@@ -1634,12 +2503,10 @@ int kv_read_object_meta(struct http_request *req, const char *account,
 			const char *bucket, const char *name)
 {
 	struct kv_onode *onode = NULL;
-	char vdi_name[SD_MAX_VDI_LEN];
 	uint32_t bucket_vid;
 	int ret;
 
-	snprintf(vdi_name, SD_MAX_VDI_LEN, "%s/%s", account, bucket);
-	ret = sd_lookup_vdi(vdi_name, &bucket_vid);
+	ret = bucket_lookup(account, bucket, &bucket_vid);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -1653,6 +2520,7 @@ int kv_read_object_meta(struct http_request *req, const char *account,
 			    http_time(onode->ctime));
 	http_request_writef(req, "Last-Modified: %s\n",
 			    http_time(onode->mtime));
+	onode_write_etag(onode, req);
 
 	/* this object has not been uploaded complete */
 	if (onode->flags != ONODE_COMPLETE) {
@@ -103,17 +103,96 @@ out:
 	return ret;
 }
 
+static int free_desc_cmp(struct free_desc *a, struct free_desc *b)
+{
+	return -intcmp(a->start, b->start);
+}
+
+static inline int update_and_merge_free_desc(char *meta, uint64_t start,
+					     uint64_t count, uint32_t vid)
+{
+	struct header *hd = (struct header *)meta;
+	struct free_desc *tail, *fd = HEADER_TO_FREE_DESC(hd);
+	uint64_t i, j;
+
+	/* Try our best to merge it in place, or append it to tail */
+	for (i = 0; i < hd->nr_free; i++) {
+		if (start + count == fd->start) {
+			fd->start = start;
+			fd->count += count;
+			break;
+		} else if(fd->start + fd->count == start) {
+			fd->count +=count;
+			break;
+		}
+		fd++;
+	}
+
+	if (i == hd->nr_free) {
+		if (hd->nr_free >= MAX_FREE_DESC)
+			return SD_RES_NO_SPACE;
+
+		tail = (struct free_desc *)(meta + oalloc_meta_length(hd));
+		tail->start = start;
+		tail->count = count;
+		hd->nr_free++;
+	}
+
+	hd->used -= count;
+	xqsort(HEADER_TO_FREE_DESC(hd), hd->nr_free, free_desc_cmp);
+
+	/* Merge as hard as we can */
+	j = hd->nr_free - 1;
+	tail = (struct free_desc *)(meta + oalloc_meta_length(hd)) - 1;
+	for (i = 0; i < j; i++, tail--) {
+		struct free_desc *front = tail - 1;
+
+		sd_debug("start %"PRIu64", count %"PRIu64, tail->start,
+			 tail->count);
+		if (tail->start + tail->count > front->start)
+			sd_emerg("bad free descriptor found at %"PRIx32, vid);
+		if (tail->start + tail->count == front->start) {
+			front->start = tail->start;
+			front->count += tail->count;
+			memmove(tail, tail + 1, sizeof(*tail) * i);
+			hd->nr_free--;
+		}
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/* Read the header and the free list of the meta object */
+static int oalloc_read_meta(uint64_t oid, char *meta)
+{
+	struct header *hd = (struct header *)meta;
+	int ret;
+
+	ret = sd_read_object(oid, meta, sizeof(*hd), 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (hd->nr_free > MAX_FREE_DESC) {
+		sd_err("bad meta %016"PRIx64", nr_free %"PRIu64, oid,
+		       hd->nr_free);
+		return SD_RES_EIO;
+	}
+	if (!hd->nr_free)
+		return SD_RES_SUCCESS;
+	ret = sd_read_object(oid, meta + sizeof(*hd),
+			     oalloc_meta_length(hd) - sizeof(*hd), sizeof(*hd));
+out:
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to read meta %016" PRIx64 ", %s", oid,
+		       sd_strerror(ret));
+	return ret;
+}
+
 /*
- * Allocate the objects and update the free list.
- *
- * Callers are expected to call oalloc_new_finish() to update the inode bitmap
- * after filling up the data.
- *
- * @vid: the vdi where the allocator resides
- * @start: start index of the objects to allocate
- * @count: number of the objects to allocate
+ * Allocate the objects from the free list of the meta object, giving back
+ * 'ret_count' objects from 'ret_start' first if it is not zero.
  */
-int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count)
+static int oalloc_meta_alloc(uint32_t vid, uint64_t *start, uint64_t count,
+			     uint64_t ret_start, uint64_t ret_count)
 {
 	char *meta = xvalloc(SD_DATA_OBJ_SIZE);
 	struct header *hd;
@@ -121,14 +200,18 @@ int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count)
 	uint64_t oid = vid_to_data_oid(vid, 0), i;
 	int ret;
 
-	ret = sd_read_object(oid, meta, SD_DATA_OBJ_SIZE, 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read meta %016" PRIx64 ", %s", oid,
-		       sd_strerror(ret));
+	sys->cdrv->lock(vid);
+	ret = oalloc_read_meta(oid, meta);
+	if (ret != SD_RES_SUCCESS)
 		goto out;
-	}
 
 	hd = (struct header *)meta;
+	if (ret_count &&
+	    update_and_merge_free_desc(meta, ret_start, ret_count, vid) !=
+	    SD_RES_SUCCESS)
+		sd_err("failed to give back start %"PRIu64", count %"PRIu64
+		       " of %"PRIx32, ret_start, ret_count, vid);
+
 	fd = (struct free_desc *)(meta + oalloc_meta_length(hd)) - 1;
 	sd_debug("used %"PRIu64", nr_free %"PRIu64, hd->used, hd->nr_free);
 	for (i = 0; i < hd->nr_free; i++, fd--) {
@@ -153,10 +236,202 @@ int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count)
 		sd_err("failed to update meta %016"PRIx64 ", %s", oid,
 		       sd_strerror(ret));
 out:
+	sys->cdrv->unlock(vid);
 	free(meta);
 	return ret;
 }
 
+/*
+ * Allocation Window
+ *
+ * Allocating from the free list takes the cluster wide lock of the vdi and
+ * rewrites the meta object, which serializes all the uploads into a bucket.
+ * So each sheep reserves OALLOC_WINDOW objects at a time and carves the small
+ * allocations out of them locally. The unused rest of a window is given back
+ * when a new one is reserved.
+ *
+ * The window is saved in oalloc_path before any object is handed out of it,
+ * so that a restarted sheep goes on with the rest of its windows instead of
+ * leaking them. The saved window is removed before its rest is given back, so
+ * that no object is handed out twice even if the sheep goes down in between.
+ */
+#define OALLOC_WINDOW 64
+
+struct oalloc_window {
+	uint32_t vid;
+	uint64_t create_time; /* tells a vdi recreated with the same vid */
+	uint64_t start;
+	uint64_t count;
+	struct sd_mutex lock;
+	struct list_node list;
+};
+
+static LIST_HEAD(window_list);
+static struct sd_mutex window_list_lock = SD_MUTEX_INITIALIZER;
+
+/* The window as saved in oalloc_path */
+struct oalloc_window_record {
+	uint64_t create_time;
+	uint64_t start;
+	uint64_t count;
+};
+
+static void get_window_path(uint32_t vid, char *path)
+{
+	snprintf(path, PATH_MAX, "%s%08"PRIx32, oalloc_path, vid);
+}
+
+/* Go on with the window saved by the previous run of this sheep, if any */
+static void oalloc_load_window(struct oalloc_window *w)
+{
+	struct oalloc_window_record rec;
+	char path[PATH_MAX];
+	int fd;
+
+	get_window_path(w->vid, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (xread(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+		w->create_time = rec.create_time;
+		w->start = rec.start;
+		w->count = rec.count;
+		sd_info("window of %"PRIx32", start %"PRIu64", count %"PRIu64,
+			w->vid, w->start, w->count);
+	}
+	close(fd);
+}
+
+static int oalloc_save_window(const struct oalloc_window *w)
+{
+	struct oalloc_window_record rec = {
+		.create_time = w->create_time,
+		.start = w->start,
+		.count = w->count,
+	};
+	char path[PATH_MAX];
+
+	get_window_path(w->vid, path);
+	if (atomic_create_and_write(path, (char *)&rec, sizeof(rec), true,
+				    false) < 0) {
+		sd_err("failed to save the window of %"PRIx32, w->vid);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int oalloc_remove_window(uint32_t vid)
+{
+	char path[PATH_MAX];
+
+	get_window_path(vid, path);
+	if (unlink(path) < 0 && errno != ENOENT) {
+		sd_err("failed to remove %s, %m", path);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static struct oalloc_window *oalloc_get_window(uint32_t vid)
+{
+	struct oalloc_window *w;
+
+	sd_mutex_lock(&window_list_lock);
+	list_for_each_entry(w, &window_list, list) {
+		if (w->vid == vid)
+			goto out;
+	}
+	w = xzalloc(sizeof(*w));
+	w->vid = vid;
+	sd_init_mutex(&w->lock);
+	oalloc_load_window(w);
+	list_add(&w->list, &window_list);
+out:
+	sd_mutex_unlock(&window_list_lock);
+	return w;
+}
+
+/*
+ * Allocate the objects and update the free list.
+ *
+ * Callers are expected to call oalloc_new_finish() to update the inode bitmap
+ * after filling up the data. This takes the lock of the vdi by itself only when
+ * it has to update the meta object.
+ *
+ * @vid: the vdi where the allocator resides
+ * @start: start index of the objects to allocate
+ * @count: number of the objects to allocate
+ */
+int oalloc_new_prepare(uint32_t vid, uint64_t *start, uint64_t count)
+{
+	struct sd_inode *inode;
+	struct oalloc_window *w;
+	int ret;
+
+	if (count >= OALLOC_WINDOW)
+		return oalloc_meta_alloc(vid, start, count, 0, 0);
+
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read inode, %" PRIx32", %s", vid,
+		       sd_strerror(ret));
+		free(inode);
+		return ret;
+	}
+
+	w = oalloc_get_window(vid);
+	sd_mutex_lock(&w->lock);
+	if (w->create_time != inode->create_time) {
+		/* The window belongs to a deleted vdi */
+		w->create_time = inode->create_time;
+		w->count = 0;
+	}
+	if (w->count < count) {
+		if (w->count) {
+			ret = oalloc_remove_window(vid);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+		}
+		ret = oalloc_meta_alloc(vid, &w->start, OALLOC_WINDOW, w->start,
+					w->count);
+		if (ret != SD_RES_SUCCESS) {
+			w->count = 0;
+			goto out;
+		}
+		w->count = OALLOC_WINDOW;
+	}
+	w->start += count;
+	w->count -= count;
+	ret = oalloc_save_window(w);
+	if (ret != SD_RES_SUCCESS) {
+		w->start -= count;
+		w->count += count;
+		goto out;
+	}
+	*start = w->start - count;
+out:
+	sd_mutex_unlock(&w->lock);
+	free(inode);
+	return ret;
+}
+
+/* Forget the window of the data vdi which is being deleted */
+void oalloc_drop_window(uint32_t vid)
+{
+	struct oalloc_window *w;
+
+	w = oalloc_get_window(vid);
+	sd_mutex_lock(&w->lock);
+	w->count = 0;
+	oalloc_remove_window(vid);
+	sd_mutex_unlock(&w->lock);
+}
+
 /*
  * Update the inode map of the vid
  *
@@ -191,65 +466,6 @@ out:
 	return ret;
 }
 
-static int free_desc_cmp(struct free_desc *a, struct free_desc *b)
-{
-	return -intcmp(a->start, b->start);
-}
-
-static inline int update_and_merge_free_desc(char *meta, uint64_t start,
-					     uint64_t count, uint32_t vid)
-{
-	struct header *hd = (struct header *)meta;
-	struct free_desc *tail, *fd = HEADER_TO_FREE_DESC(hd);
-	uint64_t i, j;
-
-	/* Try our best to merge it in place, or append it to tail */
-	for (i = 0; i < hd->nr_free; i++) {
-		if (start + count == fd->start) {
-			fd->start = start;
-			fd->count += count;
-			break;
-		} else if(fd->start + fd->count == start) {
-			fd->count +=count;
-			break;
-		}
-		fd++;
-	}
-
-	if (i == hd->nr_free) {
-		if (hd->nr_free >= MAX_FREE_DESC)
-			return SD_RES_NO_SPACE;
-
-		tail = (struct free_desc *)(meta + oalloc_meta_length(hd));
-		tail->start = start;
-		tail->count = count;
-		hd->nr_free++;
-	}
-
-	hd->used -= count;
-	xqsort(HEADER_TO_FREE_DESC(hd), hd->nr_free, free_desc_cmp);
-
-	/* Merge as hard as we can */
-	j = hd->nr_free - 1;
-	tail = (struct free_desc *)(meta + oalloc_meta_length(hd)) - 1;
-	for (i = 0; i < j; i++, tail--) {
-		struct free_desc *front = tail - 1;
-
-		sd_debug("start %"PRIu64", count %"PRIu64, tail->start,
-			 tail->count);
-		if (tail->start + tail->count > front->start)
-			sd_emerg("bad free descriptor found at %"PRIx32, vid);
-		if (tail->start + tail->count == front->start) {
-			front->start = tail->start;
-			front->count += tail->count;
-			memmove(tail, tail + 1, sizeof(*tail) * i);
-			hd->nr_free--;
-		}
-	}
-
-	return SD_RES_SUCCESS;
-}
-
 /*
  * Discard the allocated objects and update the free list of the allocator
  *
@@ -286,12 +502,9 @@ int oalloc_free(uint32_t vid, uint64_t start, uint64_t count)
 		goto out;
 	}
 
-	ret = sd_read_object(oid, meta, SD_DATA_OBJ_SIZE, 0);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to read meta %016" PRIx64 ", %s", oid,
-		       sd_strerror(ret));
+	ret = oalloc_read_meta(oid, meta);
+	if (ret != SD_RES_SUCCESS)
 		goto out;
-	}
 
 	ret = update_and_merge_free_desc(meta, start, count, vid);
 	if (ret != SD_RES_SUCCESS)
@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sheep_priv.h"
+#include "http.h"
+
+/*
+ * Object Index keeps the names of the objects in a bucket sorted, so that the
+ * bucket can be listed in order and a page at a time without reading all the
+ * onodes.
+ *
+ * The index is a two level tree in its own vdi. The root lives in the first
+ * object and holds one entry per leaf, sorted by the lowest name the leaf may
+ * contain. Leaves are fixed size slots packed into the following objects and
+ * hold the sorted names themselves.
+ *
+ * +-----------------------------+   +--------+--------+-----+---------+
+ * | Header | ent1 | ... | entN  |   | leaf 0 | leaf 1 | ... | leaf 15 | ...
+ * +-----------------------------+   +--------+--------+-----+---------+
+ * |<--     root object      -->|    |<--       leaf object 1       -->|
+ *
+ * A full leaf is split in half and the upper half moves to a new slot. Leaves
+ * are never removed from the root, so an emptied leaf is refilled by later
+ * names falling into its range and the slot of a new leaf is always the number
+ * of the existing ones. Callers serialize the updates with the bucket lock.
+ */
+
+struct oindex_entry {
+	uint32_t leaf; /* leaf slot for the root entries, unused in leaves */
+	uint16_t len;
+	char name[];
+} __attribute__((packed));
+
+struct oindex_node {
+	uint32_t nr;
+	uint32_t used; /* length of the packed entries */
+	char entries[];
+};
+
+#define OINDEX_LEAF_SIZE (256 * 1024)
+#define OINDEX_LEAVES_PER_OBJ (SD_DATA_OBJ_SIZE / OINDEX_LEAF_SIZE)
+
+static inline struct oindex_entry *node_first(struct oindex_node *node)
+{
+	return (struct oindex_entry *)node->entries;
+}
+
+static inline struct oindex_entry *node_end(struct oindex_node *node)
+{
+	return (struct oindex_entry *)(node->entries + node->used);
+}
+
+static inline struct oindex_entry *entry_next(struct oindex_entry *e)
+{
+	return (struct oindex_entry *)(e->name + e->len);
+}
+
+static inline size_t entry_size(size_t len)
+{
+	return sizeof(struct oindex_entry) + len;
+}
+
+static int entry_cmp(const struct oindex_entry *e, const char *name,
+		     size_t len)
+{
+	int ret = memcmp(e->name, name, min((size_t)e->len, len));
+
+	if (ret)
+		return ret;
+	return (e->len > len) - (e->len < len);
+}
+
+/* Return the first entry not less than (or greater than) the name */
+static struct oindex_entry *node_lower_bound(struct oindex_node *node,
+					     const char *name, size_t len,
+					     bool exclusive)
+{
+	struct oindex_entry *e;
+	int cmp;
+
+	for (e = node_first(node); e < node_end(node); e = entry_next(e)) {
+		cmp = entry_cmp(e, name, len);
+		if (cmp > 0 || (cmp == 0 && !exclusive))
+			break;
+	}
+	return e;
+}
+
+/* Return the root entry of the leaf whose range covers the name */
+static struct oindex_entry *root_lookup(struct oindex_node *root,
+					const char *name, size_t len)
+{
+	struct oindex_entry *e, *prev = node_first(root);
+
+	for (e = node_first(root); e < node_end(root); e = entry_next(e)) {
+		if (entry_cmp(e, name, len) > 0)
+			break;
+		prev = e;
+	}
+	return prev;
+}
+
+static void node_insert(struct oindex_node *node, struct oindex_entry *pos,
+			const char *name, size_t len, uint32_t leaf)
+{
+	size_t size = entry_size(len);
+
+	memmove((char *)pos + size, pos, (char *)node_end(node) - (char *)pos);
+	pos->leaf = leaf;
+	pos->len = len;
+	memcpy(pos->name, name, len);
+	node->nr++;
+	node->used += size;
+}
+
+static void node_remove(struct oindex_node *node, struct oindex_entry *pos)
+{
+	struct oindex_entry *next = entry_next(pos);
+
+	memmove(pos, next, (char *)node_end(node) - (char *)next);
+	node->nr--;
+	node->used -= (char *)next - (char *)pos;
+}
+
+static inline uint64_t leaf_oid(uint32_t vid, uint32_t leaf)
+{
+	return vid_to_data_oid(vid, 1 + leaf / OINDEX_LEAVES_PER_OBJ);
+}
+
+static inline uint64_t leaf_offset(uint32_t leaf)
+{
+	return (uint64_t)(leaf % OINDEX_LEAVES_PER_OBJ) * OINDEX_LEAF_SIZE;
+}
+
+static int read_node(uint64_t oid, uint64_t offset, struct oindex_node *node,
+		     size_t size)
+{
+	int ret;
+
+	ret = sd_read_object(oid, (char *)node, sizeof(*node), offset);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read index %016"PRIx64", %s", oid,
+		       sd_strerror(ret));
+		return ret;
+	}
+	if (node->used > size - sizeof(*node)) {
+		sd_err("corrupted index %016"PRIx64", used %"PRIu32, oid,
+		       node->used);
+		return SD_RES_EIO;
+	}
+	if (!node->used)
+		return SD_RES_SUCCESS;
+
+	ret = sd_read_object(oid, node->entries, node->used,
+			     offset + sizeof(*node));
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to read index %016"PRIx64", %s", oid,
+		       sd_strerror(ret));
+	return ret;
+}
+
+static int write_node(uint64_t oid, uint64_t offset, struct oindex_node *node)
+{
+	int ret;
+
+	ret = sd_write_object(oid, (char *)node, sizeof(*node) + node->used,
+			      offset, false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to write index %016"PRIx64", %s", oid,
+		       sd_strerror(ret));
+	return ret;
+}
+
+static inline int read_leaf(uint32_t vid, uint32_t leaf,
+			    struct oindex_node *node)
+{
+	return read_node(leaf_oid(vid, leaf), leaf_offset(leaf), node,
+			 OINDEX_LEAF_SIZE);
+}
+
+/* Create the object idx with the node at its head and map it in the inode */
+static int create_node_object(uint32_t vid, uint32_t idx,
+			      struct oindex_node *node)
+{
+	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
+	uint64_t oid = vid_to_data_oid(vid, idx);
+	int ret;
+
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     sizeof(*inode), 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read inode, %" PRIx32", %s", vid,
+		       sd_strerror(ret));
+		goto out;
+	}
+	ret = sd_write_object(oid, (char *)node, sizeof(*node) + node->used,
+			      0, true);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to create index %016"PRIx64", %s", oid,
+		       sd_strerror(ret));
+		goto out;
+	}
+	sd_inode_set_vid(inode, idx, vid);
+	ret = sd_inode_write_vid(inode, idx, vid, vid, 0, false, false);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to update inode, %" PRIx32", %s", vid,
+		       sd_strerror(ret));
+out:
+	free(inode);
+	return ret;
+}
+
+/*
+ * Initialize the index vdi with a root and one empty leaf
+ *
+ * @vid: the vdi where the index resides
+ */
+int oindex_init(uint32_t vid)
+{
+	struct oindex_node *root = xzalloc(sizeof(*root) + entry_size(0));
+	struct oindex_node leaf = {};
+	int ret;
+
+	/* The first leaf covers everything from the empty name */
+	node_insert(root, node_first(root), "", 0, 0);
+	ret = create_node_object(vid, 0, root);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	ret = create_node_object(vid, 1, &leaf);
+out:
+	free(root);
+	return ret;
+}
+
+/*
+ * Move the upper half of the overflowed leaf into a new one
+ *
+ * @r: the root entry of the leaf
+ */
+static int split_leaf(uint32_t vid, struct oindex_node *root,
+		      struct oindex_entry *r, struct oindex_node *leaf)
+{
+	struct oindex_node *new = xvalloc(OINDEX_LEAF_SIZE);
+	struct oindex_entry *e;
+	uint32_t nr = 0, new_leaf = root->nr;
+	int ret;
+
+	for (e = node_first(leaf); (char *)e - leaf->entries < leaf->used / 2;
+	     e = entry_next(e))
+		nr++;
+
+	if (sizeof(*root) + root->used + entry_size(e->len) >
+	    SD_DATA_OBJ_SIZE) {
+		sd_err("no space in the index root of %" PRIx32, vid);
+		ret = SD_RES_NO_SPACE;
+		goto out;
+	}
+	node_insert(root, entry_next(r), e->name, e->len, new_leaf);
+
+	new->nr = leaf->nr - nr;
+	new->used = (char *)node_end(leaf) - (char *)e;
+	memcpy(new->entries, e, new->used);
+	leaf->nr = nr;
+	leaf->used = (char *)e - leaf->entries;
+
+	/*
+	 * Write the new leaf first and the shrunk one last, so a crash in
+	 * between leaves names which iter_next() skips but never loses one.
+	 */
+	if (new_leaf % OINDEX_LEAVES_PER_OBJ == 0)
+		ret = create_node_object(vid, 1 +
+					 new_leaf / OINDEX_LEAVES_PER_OBJ, new);
+	else
+		ret = write_node(leaf_oid(vid, new_leaf), leaf_offset(new_leaf),
+				 new);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	ret = write_node(vid_to_data_oid(vid, 0), 0, root);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	ret = write_node(leaf_oid(vid, r->leaf), leaf_offset(r->leaf), leaf);
+out:
+	free(new);
+	return ret;
+}
+
+/*
+ * Add the name to the index. Adding an existing name is a no-op.
+ *
+ * @vid: the vdi where the index resides
+ */
+int oindex_insert(uint32_t vid, const char *name)
+{
+	/* Twice the size so that the overflowed leaf fits before the split */
+	struct oindex_node *leaf = xvalloc(OINDEX_LEAF_SIZE * 2);
+	struct oindex_node *root = xvalloc(SD_DATA_OBJ_SIZE);
+	struct oindex_entry *r, *pos;
+	size_t len = strlen(name);
+	int ret;
+
+	ret = read_node(vid_to_data_oid(vid, 0), 0, root, SD_DATA_OBJ_SIZE);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	r = root_lookup(root, name, len);
+	ret = read_leaf(vid, r->leaf, leaf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	pos = node_lower_bound(leaf, name, len, false);
+	if (pos < node_end(leaf) && entry_cmp(pos, name, len) == 0)
+		goto out;
+
+	node_insert(leaf, pos, name, len, 0);
+	if (sizeof(*leaf) + leaf->used <= OINDEX_LEAF_SIZE)
+		ret = write_node(leaf_oid(vid, r->leaf), leaf_offset(r->leaf),
+				 leaf);
+	else
+		ret = split_leaf(vid, root, r, leaf);
+out:
+	free(root);
+	free(leaf);
+	return ret;
+}
+
+/*
+ * Remove the name from the index. Removing a missing name is a no-op.
+ *
+ * @vid: the vdi where the index resides
+ */
+int oindex_delete(uint32_t vid, const char *name)
+{
+	struct oindex_node *leaf = xvalloc(OINDEX_LEAF_SIZE);
+	struct oindex_node *root = xvalloc(SD_DATA_OBJ_SIZE);
+	struct oindex_entry *r, *pos;
+	size_t len = strlen(name);
+	int ret;
+
+	ret = read_node(vid_to_data_oid(vid, 0), 0, root, SD_DATA_OBJ_SIZE);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	r = root_lookup(root, name, len);
+	ret = read_leaf(vid, r->leaf, leaf);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	pos = node_lower_bound(leaf, name, len, false);
+	if (pos == node_end(leaf) || entry_cmp(pos, name, len) != 0)
+		goto out;
+
+	node_remove(leaf, pos);
+	ret = write_node(leaf_oid(vid, r->leaf), leaf_offset(r->leaf), leaf);
+out:
+	free(root);
+	free(leaf);
+	return ret;
+}
+
+struct oindex_iter {
+	uint32_t vid;
+	struct oindex_node *root;
+	struct oindex_node *leaf;
+	struct oindex_entry *r; /* root entry of the loaded leaf */
+	struct oindex_entry *e; /* next entry in the loaded leaf */
+	bool done;
+};
+
+static int iter_load(struct oindex_iter *it, struct oindex_entry *r)
+{
+	int ret;
+
+	ret = read_leaf(it->vid, r->leaf, it->leaf);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	it->r = r;
+	it->e = node_first(it->leaf);
+	return SD_RES_SUCCESS;
+}
+
+/* Position the iterator at the first name not less than the given one */
+static int iter_seek(struct oindex_iter *it, const char *name, size_t len,
+		     bool exclusive)
+{
+	struct oindex_entry *r = root_lookup(it->root, name, len);
+	int ret;
+
+	if (r != it->r) {
+		ret = iter_load(it, r);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	it->e = node_lower_bound(it->leaf, name, len, exclusive);
+	return SD_RES_SUCCESS;
+}
+
+/* Position the iterator past all the names beginning with the prefix */
+static int iter_skip_prefix(struct oindex_iter *it, const char *prefix)
+{
+	char next[SD_MAX_OBJECT_NAME];
+	size_t len = strlen(prefix);
+
+	memcpy(next, prefix, len);
+	while (len > 0 && (unsigned char)next[len - 1] == 0xff)
+		len--;
+	if (len == 0) {
+		it->done = true;
+		return SD_RES_SUCCESS;
+	}
+	next[len - 1]++;
+	return iter_seek(it, next, len, false);
+}
+
+/*
+ * Return the next name in *ep, or NULL at the end. An entry at or beyond the
+ * lowest name of the next leaf is stale and skipped.
+ */
+static int iter_next(struct oindex_iter *it, struct oindex_entry **ep)
+{
+	struct oindex_entry *next_r;
+	int ret;
+
+	while (!it->done) {
+		next_r = entry_next(it->r);
+		if (it->e < node_end(it->leaf) &&
+		    (next_r == node_end(it->root) ||
+		     entry_cmp(it->e, next_r->name, next_r->len) < 0)) {
+			*ep = it->e;
+			it->e = entry_next(it->e);
+			return SD_RES_SUCCESS;
+		}
+		if (next_r == node_end(it->root))
+			break;
+		ret = iter_load(it, next_r);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	*ep = NULL;
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * List the names after param->marker which begin with param->prefix, in order
+ *
+ * With param->delimiter, the names which contain it after the prefix are
+ * rolled up into one common prefix, reported once with is_prefix set. At most
+ * param->limit entries are reported if it is not zero, and *truncated tells
+ * whether there are more.
+ *
+ * @vid: the vdi where the index resides
+ */
+int oindex_list(uint32_t vid, const struct kv_list_param *param,
+		kv_list_cb cb, void *opaque, bool *truncated)
+{
+	const char *prefix = param->prefix ? param->prefix : "";
+	const char *delim = param->delimiter, *marker = param->marker;
+	size_t plen = strlen(prefix), dlen = delim ? strlen(delim) : 0;
+	struct oindex_iter it = { .vid = vid };
+	char name[SD_MAX_OBJECT_NAME], *p;
+	struct oindex_entry *e;
+	uint64_t count = 0;
+	bool is_prefix;
+	int ret;
+
+	*truncated = false;
+	it.root = xvalloc(SD_DATA_OBJ_SIZE);
+	it.leaf = xvalloc(OINDEX_LEAF_SIZE);
+	ret = read_node(vid_to_data_oid(vid, 0), 0, it.root, SD_DATA_OBJ_SIZE);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (marker && strcmp(marker, prefix) > 0) {
+		ret = iter_seek(&it, marker, strlen(marker), true);
+		/* The common prefix of the marker was reported in full */
+		pstrcpy(name, sizeof(name), marker);
+		if (ret == SD_RES_SUCCESS && dlen &&
+		    !strncmp(name, prefix, plen) &&
+		    (p = strstr(name + plen, delim))) {
+			p[dlen] = '\0';
+			ret = iter_skip_prefix(&it, name);
+		}
+	} else
+		ret = iter_seek(&it, prefix, plen, false);
+
+	while (ret == SD_RES_SUCCESS) {
+		ret = iter_next(&it, &e);
+		if (ret != SD_RES_SUCCESS || !e)
+			break;
+		/* Names are sorted, so we are past the prefix */
+		if (e->len < plen || memcmp(e->name, prefix, plen))
+			break;
+
+		if (param->limit && count == param->limit) {
+			*truncated = true;
+			break;
+		}
+		memcpy(name, e->name, e->len);
+		name[e->len] = '\0';
+		is_prefix = dlen && (p = strstr(name + plen, delim));
+		if (is_prefix)
+			p[dlen] = '\0';
+
+		cb(name, is_prefix, opaque);
+		count++;
+		if (is_prefix)
+			ret = iter_skip_prefix(&it, name);
+	}
+out:
+	free(it.root);
+	free(it.leaf);
+	return ret;
+}
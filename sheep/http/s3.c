@@ -13,6 +13,10 @@
 
 #define MAX_BUCKET_LISTING 1000
 
+/* Limits of multipart uploads */
+#define MAX_UPLOAD_PARTS 10000
+#define MAX_COMPLETE_BODY (1024 * 1024)
+
 static void s3_write_err_response(struct http_request *req, const char *code,
 				  const char *desc)
 {
@@ -23,6 +27,36 @@ static void s3_write_err_response(struct http_request *req, const char *code,
 		"</Error>\r\n", code, desc);
 }
 
+static void s3_write_err(struct http_request *req, enum http_status status,
+			 const char *code, const char *desc)
+{
+	http_response_header(req, status);
+	s3_write_err_response(req, code, desc);
+}
+
+/* Reply the common errors of the multipart upload operations */
+static void s3_upload_err(struct http_request *req, int ret)
+{
+	switch (ret) {
+	case SD_RES_NO_VDI:
+		s3_write_err(req, NOT_FOUND, "NoSuchBucket",
+			     "The specified bucket does not exist");
+		break;
+	case SD_RES_NO_OBJ:
+		s3_write_err(req, NOT_FOUND, "NoSuchUpload",
+			     "The specified upload does not exist");
+		break;
+	case SD_RES_INCOMPLETE:
+		s3_write_err(req, CONFLICT, "OperationAborted",
+			     "A conflicting operation is in progress");
+		break;
+	default:
+		s3_write_err(req, INTERNAL_SERVER_ERROR, "InternalError",
+			     "We encountered an internal error");
+		break;
+	}
+}
+
 /* Operations on the Service */
 
 static void s3_get_service_cb(const char *bucket, void *opaque)
@@ -118,9 +152,50 @@ static void s3_get_object(struct http_request *req, const char *bucket,
 			"The resource you requested does not exist");
 }
 
+static void s3_upload_part(struct http_request *req, const char *bucket,
+			   const char *upload_id, const char *part_number)
+{
+	unsigned long part;
+	char *endp;
+	int ret;
+
+	part = strtoul(part_number, &endp, 10);
+	if (endp == part_number || *endp != '\0' || part < 1 ||
+	    part > MAX_UPLOAD_PARTS) {
+		s3_write_err(req, BAD_REQUEST, "InvalidArgument",
+			     "Part number must be an integer between 1 and "
+			     "10000");
+		return;
+	}
+
+	ret = kv_upload_part(req, "s3", bucket, upload_id, part);
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		http_request_writef(req, "ETag: \"%s-%lu\"\n", upload_id,
+				    part);
+		http_response_header(req, OK);
+		break;
+	case SD_RES_INVALID_PARMS:
+		s3_write_err(req, BAD_REQUEST, "EntityTooSmall",
+			     "Your proposed upload is empty");
+		break;
+	default:
+		s3_upload_err(req, ret);
+		break;
+	}
+}
+
 static void s3_put_object(struct http_request *req, const char *bucket,
 			  const char *object)
 {
+	char upload_id[KV_UPLOAD_ID_LEN], part[16];
+
+	if (http_query_param(req, "uploadId", upload_id, sizeof(upload_id)) &&
+	    http_query_param(req, "partNumber", part, sizeof(part))) {
+		s3_upload_part(req, bucket, upload_id, part);
+		return;
+	}
+
 	kv_create_object(req, "s3", bucket, object);
 
 	if (req->status == NOT_FOUND)
@@ -128,15 +203,136 @@ static void s3_put_object(struct http_request *req, const char *bucket,
 			"The specified bucket does not exist");
 }
 
+static void s3_initiate_upload(struct http_request *req, const char *bucket,
+			       const char *object)
+{
+	char upload_id[KV_UPLOAD_ID_LEN];
+	int ret;
+
+	ret = kv_initiate_upload("s3", bucket, object, upload_id);
+	if (ret != SD_RES_SUCCESS) {
+		s3_upload_err(req, ret);
+		return;
+	}
+
+	http_response_header(req, OK);
+	http_request_writef(req,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+		"<InitiateMultipartUploadResult>\r\n"
+		"<Bucket>%s</Bucket>\r\n<Key>%s</Key>\r\n"
+		"<UploadId>%s</UploadId>\r\n"
+		"</InitiateMultipartUploadResult>\r\n",
+		bucket, object, upload_id);
+}
+
+/* Collect the part numbers of the CompleteMultipartUpload request body */
+static int s3_parse_parts(struct http_request *req, uint32_t *parts)
+{
+	const char tag[] = "<PartNumber>";
+	char *body, *p, *endp;
+	int nr = 0;
+
+	if (!req->data_length || req->data_length > MAX_COMPLETE_BODY)
+		return -1;
+
+	body = xmalloc(req->data_length + 1);
+	if (http_request_read(req, body, req->data_length) !=
+	    req->data_length) {
+		nr = -1;
+		goto out;
+	}
+	body[req->data_length] = '\0';
+
+	for (p = strstr(body, tag); p; p = strstr(p, tag)) {
+		p += sizeof(tag) - 1;
+		if (nr == MAX_UPLOAD_PARTS) {
+			nr = -1;
+			goto out;
+		}
+		parts[nr] = strtoul(p, &endp, 10);
+		if (endp == p || parts[nr] < 1 ||
+		    parts[nr] > MAX_UPLOAD_PARTS) {
+			nr = -1;
+			goto out;
+		}
+		nr++;
+	}
+out:
+	free(body);
+	return nr;
+}
+
+static void s3_complete_upload(struct http_request *req, const char *bucket,
+			       const char *object, const char *upload_id)
+{
+	uint32_t *parts = xmalloc(sizeof(*parts) * MAX_UPLOAD_PARTS);
+	int nr, ret;
+
+	nr = s3_parse_parts(req, parts);
+	if (nr <= 0) {
+		s3_write_err(req, BAD_REQUEST, "MalformedXML",
+			     "The XML you provided was not well-formed");
+		goto out;
+	}
+
+	ret = kv_complete_upload("s3", bucket, object, upload_id, parts, nr);
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		http_response_header(req, OK);
+		http_request_writef(req,
+			"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\r\n"
+			"<CompleteMultipartUploadResult>\r\n"
+			"<Bucket>%s</Bucket>\r\n<Key>%s</Key>\r\n"
+			"<ETag>\"%s-%d\"</ETag>\r\n"
+			"</CompleteMultipartUploadResult>\r\n",
+			bucket, object, upload_id, nr);
+		break;
+	case SD_RES_INVALID_PARMS:
+		s3_write_err(req, BAD_REQUEST, "InvalidPartOrder",
+			     "The list of parts was not in ascending order");
+		break;
+	case SD_RES_NO_SPACE:
+		s3_write_err(req, BAD_REQUEST, "EntityTooLarge",
+			     "Your proposed upload exceeds the maximum "
+			     "allowed object size");
+		break;
+	default:
+		s3_upload_err(req, ret);
+		break;
+	}
+out:
+	free(parts);
+}
+
 static void s3_post_object(struct http_request *req, const char *bucket,
 			   const char *object)
 {
-	http_response_header(req, NOT_IMPLEMENTED);
+	char upload_id[KV_UPLOAD_ID_LEN], buf[8];
+
+	if (http_query_param(req, "uploads", buf, sizeof(buf)))
+		s3_initiate_upload(req, bucket, object);
+	else if (http_query_param(req, "uploadId", upload_id,
+				  sizeof(upload_id)))
+		s3_complete_upload(req, bucket, object, upload_id);
+	else
+		http_response_header(req, NOT_IMPLEMENTED);
 }
 
 static void s3_delete_object(struct http_request *req, const char *bucket,
 			     const char *object)
 {
+	char upload_id[KV_UPLOAD_ID_LEN];
+	int ret;
+
+	if (http_query_param(req, "uploadId", upload_id, sizeof(upload_id))) {
+		ret = kv_abort_upload("s3", bucket, upload_id);
+		if (ret == SD_RES_SUCCESS)
+			http_response_header(req, NO_CONTENT);
+		else
+			s3_upload_err(req, ret);
+		return;
+	}
+
 	kv_delete_object("s3", bucket, object, 0);
 
 	if (req->status == NOT_FOUND)
@@ -10,8 +10,576 @@
  */
 
 #include "strbuf.h"
+#include "work.h"
 #include "http.h"
 
+/*
+ * Bulk operations
+ *
+ * Like the bulk middleware of Swift, a POST or a DELETE of an account with
+ * '?bulk-delete' deletes the objects and the containers listed in the body,
+ * one URL-encoded "/container[/object]" per line, and a PUT with
+ * '?extract-archive=tar' creates an object for every file of the tar archive
+ * in the body.  Both answer with a summary and the paths that failed.
+ *
+ * The objects are deleted in parallel by swift_bulk_wqueue, at most
+ * SWIFT_BULK_DEPTH of them at once for a request, and the containers after
+ * them, so that a list may empty a container and delete it.  The small files
+ * of an archive are read into memory and created in parallel in the same way,
+ * the larger ones are written straight from the body as they come.
+ */
+#define SWIFT_BULK_THREADS	8
+#define SWIFT_BULK_DEPTH	32
+/* max_deletes_per_request of Swift */
+#define SWIFT_BULK_MAX_DELETES	10000
+#define SWIFT_BULK_MAX_BODY	(SWIFT_BULK_MAX_DELETES * 3 * \
+				 (SD_MAX_BUCKET_NAME + SD_MAX_OBJECT_NAME))
+#define SWIFT_BULK_INLINE_SIZE	(1024 * 1024)
+
+static struct work_queue *swift_bulk_wqueue;
+
+struct swift_bulk {
+	const char *account;
+	bool delete;
+	struct sd_mutex lock;
+	struct sd_cond cond;
+	int nr_pending;
+	uint64_t nr_done;
+	uint64_t nr_not_found;
+	const char *status;	/* of the first error */
+	struct strbuf errors;
+};
+
+struct swift_bulk_op {
+	struct work work;
+	struct swift_bulk *bulk;
+	char container[SD_MAX_BUCKET_NAME];
+	char object[SD_MAX_OBJECT_NAME];
+	char *data;		/* of the file to create, NULL to delete */
+	uint64_t len;
+};
+
+static void swift_bulk_init(struct swift_bulk *bulk, const char *account,
+			    bool delete)
+{
+	memset(bulk, 0, sizeof(*bulk));
+	bulk->account = account;
+	bulk->delete = delete;
+	sd_init_mutex(&bulk->lock);
+	sd_cond_init(&bulk->cond);
+	strbuf_init(&bulk->errors, 0);
+}
+
+static void swift_bulk_destroy(struct swift_bulk *bulk)
+{
+	sd_destroy_cond(&bulk->cond);
+	sd_destroy_mutex(&bulk->lock);
+	strbuf_release(&bulk->errors);
+}
+
+static void swift_bulk_result(struct swift_bulk *bulk, const char *container,
+			      const char *object, int ret)
+{
+	const char *status;
+
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		status = NULL;
+		break;
+	case SD_RES_NO_VDI:
+	case SD_RES_NO_OBJ:
+		status = bulk->delete ? NULL : "404 Not Found";
+		break;
+	case SD_RES_INVALID_PARMS:
+		status = "400 Bad Request";
+		break;
+	case SD_RES_INCOMPLETE:
+	case SD_RES_VDI_NOT_EMPTY:
+		status = "409 Conflict";
+		break;
+	case SD_RES_NO_SPACE:
+		status = "503 Service Unavailable";
+		break;
+	default:
+		status = "500 Internal Server Error";
+		break;
+	}
+
+	sd_mutex_lock(&bulk->lock);
+	if (ret == SD_RES_SUCCESS)
+		bulk->nr_done++;
+	else if (!status)
+		bulk->nr_not_found++;
+	else {
+		if (!bulk->status)
+			bulk->status = status;
+		strbuf_addf(&bulk->errors, "/%s%s%s, %s\n", container,
+			    object[0] ? "/" : "", object, status);
+	}
+	sd_mutex_unlock(&bulk->lock);
+}
+
+static void swift_bulk_work(struct work *work)
+{
+	struct swift_bulk_op *op = container_of(work, struct swift_bulk_op,
+						work);
+	struct swift_bulk *bulk = op->bulk;
+	int ret;
+
+	if (op->data) {
+		struct http_request req = {
+			.opcode = HTTP_PUT,
+			.data_length = op->len,
+			.body = op->data,
+			.body_left = op->len,
+		};
+
+		ret = kv_create_object(&req, bulk->account, op->container,
+				       op->object);
+	} else
+		ret = kv_delete_object(bulk->account, op->container,
+				       op->object, false);
+	swift_bulk_result(bulk, op->container, op->object, ret);
+
+	/* the requester may go away once nr_pending drops */
+	sd_mutex_lock(&bulk->lock);
+	bulk->nr_pending--;
+	sd_cond_signal(&bulk->cond);
+	sd_mutex_unlock(&bulk->lock);
+}
+
+static void swift_bulk_done(struct work *work)
+{
+	struct swift_bulk_op *op = container_of(work, struct swift_bulk_op,
+						work);
+
+	free(op->data);
+	free(op);
+}
+
+/* Takes the ownership of data */
+static void swift_bulk_queue(struct swift_bulk *bulk, const char *container,
+			     const char *object, char *data, uint64_t len)
+{
+	struct swift_bulk_op *op = xzalloc(sizeof(*op));
+
+	op->bulk = bulk;
+	pstrcpy(op->container, sizeof(op->container), container);
+	pstrcpy(op->object, sizeof(op->object), object);
+	op->data = data;
+	op->len = len;
+	op->work.fn = swift_bulk_work;
+	op->work.done = swift_bulk_done;
+
+	sd_mutex_lock(&bulk->lock);
+	while (bulk->nr_pending >= SWIFT_BULK_DEPTH)
+		sd_cond_wait(&bulk->cond, &bulk->lock);
+	bulk->nr_pending++;
+	sd_mutex_unlock(&bulk->lock);
+
+	queue_work(swift_bulk_wqueue, &op->work);
+}
+
+static void swift_bulk_wait(struct swift_bulk *bulk)
+{
+	sd_mutex_lock(&bulk->lock);
+	while (bulk->nr_pending > 0)
+		sd_cond_wait(&bulk->cond, &bulk->lock);
+	sd_mutex_unlock(&bulk->lock);
+}
+
+/* msg is for the Response Body, status if no path failed */
+static void swift_bulk_response(struct http_request *req,
+				struct swift_bulk *bulk, const char *status,
+				const char *msg)
+{
+	struct strbuf buf = STRBUF_INIT;
+
+	if (bulk->delete) {
+		strbuf_addf(&buf, "Number Deleted: %"PRIu64"\n", bulk->nr_done);
+		strbuf_addf(&buf, "Number Not Found: %"PRIu64"\n",
+			    bulk->nr_not_found);
+	} else
+		strbuf_addf(&buf, "Number Files Created: %"PRIu64"\n",
+			    bulk->nr_done);
+	strbuf_addf(&buf, "Response Body: %s\nResponse Status: %s\n", msg,
+		    bulk->status ? bulk->status : status);
+	strbuf_addstr(&buf, "Errors:\n");
+	strbuf_addbuf(&buf, &bulk->errors);
+
+	req->data_length = buf.len;
+	http_response_header(req, OK);
+	http_request_write(req, buf.buf, buf.len);
+	strbuf_release(&buf);
+}
+
+static int swift_hex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Decode the %XX escapes of s in place */
+static void swift_unquote(char *s)
+{
+	char *d = s;
+	int hi, lo;
+
+	for (; *s; s++) {
+		if (*s == '%' && (hi = swift_hex(s[1])) >= 0 &&
+		    (lo = swift_hex(s[2])) >= 0) {
+			*d++ = hi << 4 | lo;
+			s += 2;
+		} else
+			*d++ = *s;
+	}
+	*d = '\0';
+}
+
+/*
+ * Split "container[/object]" of the account, returns false if either is too
+ * long.  The object is empty for a container.
+ */
+static bool swift_split_path(const char *path, char *container, char *object)
+{
+	const char *p;
+
+	while (*path == '/')
+		path++;
+	p = strchrnul(path, '/');
+	if (p - path >= SD_MAX_BUCKET_NAME)
+		return false;
+	memcpy(container, path, p - path);
+	container[p - path] = '\0';
+	if (*p == '/')
+		p++;
+	if (strlen(p) >= SD_MAX_OBJECT_NAME)
+		return false;
+	strcpy(object, p);
+	return true;
+}
+
+static void swift_bulk_delete(struct http_request *req, const char *account)
+{
+	char container[SD_MAX_BUCKET_NAME], object[SD_MAX_OBJECT_NAME];
+	char *body, *line, *next;
+	struct strbuf containers = STRBUF_INIT;
+	const char *status = "200 OK", *msg = "";
+	struct swift_bulk bulk;
+	int nr = 0;
+
+	if (!req->data_length || req->data_length > SWIFT_BULK_MAX_BODY) {
+		http_response_header(req, BAD_REQUEST);
+		return;
+	}
+	body = xmalloc(req->data_length + 1);
+	if (http_request_read(req, body, req->data_length) !=
+	    req->data_length) {
+		free(body);
+		http_response_header(req, BAD_REQUEST);
+		return;
+	}
+	body[req->data_length] = '\0';
+
+	swift_bulk_init(&bulk, account, true);
+	for (line = body; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		line[strcspn(line, "\r")] = '\0';
+		if (line[0] == '\0')
+			continue;
+		if (++nr > SWIFT_BULK_MAX_DELETES) {
+			status = "400 Bad Request";
+			msg = "Too many deletes";
+			break;
+		}
+
+		swift_unquote(line);
+		if (!swift_split_path(line, container, object) ||
+		    container[0] == '\0') {
+			swift_bulk_result(&bulk, line, "", SD_RES_INVALID_PARMS);
+			continue;
+		}
+		if (object[0] == '\0')
+			strbuf_add(&containers, container,
+				   strlen(container) + 1);
+		else
+			swift_bulk_queue(&bulk, container, object, NULL, 0);
+	}
+	swift_bulk_wait(&bulk);
+
+	for (size_t i = 0; i < containers.len;
+	     i += strlen(containers.buf + i) + 1)
+		swift_bulk_result(&bulk, containers.buf + i, "",
+				  kv_delete_bucket(account,
+						   containers.buf + i));
+
+	swift_bulk_response(req, &bulk, status, msg);
+	swift_bulk_destroy(&bulk);
+	strbuf_release(&containers);
+	free(body);
+}
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+#define TAR_BLOCK_SIZE	512
+/* of the GNU long names and the pax headers we read */
+#define TAR_MAX_META	(64 * 1024)
+
+/* Octal, or base-256 if the high bit of the first byte is set */
+static bool tar_number(const char *p, size_t len, uint64_t *val)
+{
+	const char *end = p + len;
+
+	*val = 0;
+	if (*p & 0x80) {
+		*val = *p++ & 0x7f;
+		while (p < end)
+			*val = *val << 8 | (uint8_t)*p++;
+		return true;
+	}
+	while (p < end && *p == ' ')
+		p++;
+	if (p == end || *p < '0' || *p > '7')
+		return false;
+	while (p < end && *p >= '0' && *p <= '7')
+		*val = *val << 3 | (*p++ - '0');
+	return p == end || *p == ' ' || *p == '\0';
+}
+
+static bool tar_header_valid(const struct tar_header *h)
+{
+	const uint8_t *p = (const uint8_t *)h;
+	uint64_t chksum, sum = 0;
+
+	if (!tar_number(h->chksum, sizeof(h->chksum), &chksum))
+		return false;
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+		if (i >= offsetof(struct tar_header, chksum) &&
+		    i < offsetof(struct tar_header, typeflag))
+			sum += ' ';
+		else
+			sum += p[i];
+	return sum == chksum;
+}
+
+static bool tar_read(struct http_request *req, void *buf, uint64_t len)
+{
+	return http_request_read(req, buf, len) == len;
+}
+
+static bool tar_skip(struct http_request *req, uint64_t len)
+{
+	char buf[TAR_BLOCK_SIZE * 8];
+	uint64_t n;
+
+	for (; len > 0; len -= n) {
+		n = min(len, sizeof(buf));
+		if (!tar_read(req, buf, n))
+			return false;
+	}
+	return true;
+}
+
+/* Find the path record of the pax header, "<len> path=<name>\n" */
+static void tar_pax_path(char *data, uint64_t size, char *name, size_t len)
+{
+	char *p = data, *end = data + size, *endp, *key;
+	uint64_t rlen;
+
+	while (p < end) {
+		rlen = strtoull(p, &endp, 10);
+		if (endp == p || *endp != ' ' || rlen > end - p ||
+		    p[rlen - 1] != '\n')
+			return;
+		key = endp + 1;
+		if (!strncmp(key, "path=", 5)) {
+			p[rlen - 1] = '\0';
+			pstrcpy(name, len, key + 5);
+			return;
+		}
+		p += rlen;
+	}
+}
+
+/* Where the file at path of the archive goes, false if nowhere */
+static bool swift_extract_dest(const char *path, const char *container,
+			       const char *prefix, char *dst_container,
+			       char *dst_object)
+{
+	if (!container)
+		return swift_split_path(path, dst_container, dst_object) &&
+		       dst_object[0] != '\0';
+
+	pstrcpy(dst_container, SD_MAX_BUCKET_NAME, container);
+	if (prefix)
+		return snprintf(dst_object, SD_MAX_OBJECT_NAME, "%s/%s",
+				prefix, path) < SD_MAX_OBJECT_NAME;
+	return snprintf(dst_object, SD_MAX_OBJECT_NAME, "%s",
+			path) < SD_MAX_OBJECT_NAME;
+}
+
+static void swift_extract_archive(struct http_request *req,
+				  const char *account, const char *container,
+				  const char *prefix)
+{
+	char path[SD_MAX_OBJECT_NAME + 256], long_name[SD_MAX_OBJECT_NAME];
+	char dst_container[SD_MAX_BUCKET_NAME], dst_object[SD_MAX_OBJECT_NAME];
+	char last_container[SD_MAX_BUCKET_NAME] = "", format[16];
+	const char *status = "201 Created", *msg = "", *name;
+	uint64_t body_length = req->data_length, size;
+	struct tar_header h;
+	struct swift_bulk bulk;
+	char *data;
+	int ret;
+
+	http_query_param(req, "extract-archive", format, sizeof(format));
+	if (strcmp(format, "tar")) {
+		/* the compressed archives are not supported */
+		http_response_header(req, BAD_REQUEST);
+		return;
+	}
+
+	swift_bulk_init(&bulk, account, false);
+	long_name[0] = '\0';
+	for (;;) {
+		if (!tar_read(req, &h, sizeof(h)))
+			goto invalid;
+		if (h.name[0] == '\0')
+			break;	/* the end of the archive */
+		if (!tar_header_valid(&h) ||
+		    !tar_number(h.size, sizeof(h.size), &size))
+			goto invalid;
+
+		switch (h.typeflag) {
+		case 'L':
+		case 'x':
+			if (size > TAR_MAX_META)
+				goto invalid;
+			data = xzalloc(round_up(size, TAR_BLOCK_SIZE) + 1);
+			if (!tar_read(req, data, round_up(size,
+							  TAR_BLOCK_SIZE))) {
+				free(data);
+				goto invalid;
+			}
+			if (h.typeflag == 'L')
+				pstrcpy(long_name, sizeof(long_name), data);
+			else
+				tar_pax_path(data, size, long_name,
+					     sizeof(long_name));
+			free(data);
+			continue;
+		case '0':
+		case '\0':
+			break;
+		default:
+			/* directories, links and the like have no objects */
+			if (!tar_skip(req, round_up(size, TAR_BLOCK_SIZE)))
+				goto invalid;
+			long_name[0] = '\0';
+			continue;
+		}
+
+		if (long_name[0])
+			snprintf(path, sizeof(path), "%s", long_name);
+		else if (h.prefix[0])
+			snprintf(path, sizeof(path), "%.*s/%.*s",
+				 (int)sizeof(h.prefix), h.prefix,
+				 (int)sizeof(h.name), h.name);
+		else
+			snprintf(path, sizeof(path), "%.*s",
+				 (int)sizeof(h.name), h.name);
+		long_name[0] = '\0';
+		for (name = path; *name == '/' || !strncmp(name, "./", 2);)
+			name += *name == '/' ? 1 : 2;
+
+		if (!swift_extract_dest(name, container, prefix,
+					dst_container, dst_object)) {
+			swift_bulk_result(&bulk, name, "",
+					  SD_RES_INVALID_PARMS);
+			if (!tar_skip(req, round_up(size, TAR_BLOCK_SIZE)))
+				goto invalid;
+			continue;
+		}
+		/* Swift creates the containers of the archive */
+		if (!container && strcmp(dst_container, last_container)) {
+			ret = kv_create_bucket(account, dst_container);
+			if (ret != SD_RES_SUCCESS && ret != SD_RES_VDI_EXIST) {
+				swift_bulk_result(&bulk, dst_container, "",
+						  ret);
+				if (!tar_skip(req, round_up(size,
+							    TAR_BLOCK_SIZE)))
+					goto invalid;
+				continue;
+			}
+			pstrcpy(last_container, sizeof(last_container),
+				dst_container);
+		}
+
+		if (size <= SWIFT_BULK_INLINE_SIZE) {
+			data = xmalloc(round_up(size, TAR_BLOCK_SIZE) + 1);
+			if (!tar_read(req, data, round_up(size,
+							  TAR_BLOCK_SIZE))) {
+				free(data);
+				goto invalid;
+			}
+			swift_bulk_queue(&bulk, dst_container, dst_object,
+					 data, size);
+			continue;
+		}
+
+		req->data_length = size;
+		ret = kv_create_object(req, account, dst_container, dst_object);
+		req->data_length = body_length;
+		swift_bulk_result(&bulk, dst_container, dst_object, ret);
+		/* we don't know how much of the body it took */
+		if (ret != SD_RES_SUCCESS)
+			goto abort;
+		if (!tar_skip(req, round_up(size, TAR_BLOCK_SIZE) - size))
+			goto invalid;
+	}
+	goto out;
+invalid:
+	msg = "Invalid Tar File";
+abort:
+	status = "400 Bad Request";
+out:
+	swift_bulk_wait(&bulk);
+	swift_bulk_response(req, &bulk, status, msg);
+	swift_bulk_destroy(&bulk);
+}
+
+static bool swift_bulk_request(struct http_request *req, const char *op)
+{
+	char buf[16];
+
+	return http_query_param(req, op, buf, sizeof(buf));
+}
+
 /* Operations on Accounts */
 
 static void swift_head_account(struct http_request *req, const char *account)
@@ -58,6 +626,10 @@ static void swift_put_account(struct http_request *req, const char *account)
 {
 	int ret;
 
+	if (swift_bulk_request(req, "extract-archive")) {
+		swift_extract_archive(req, account, NULL, NULL);
+		return;
+	}
 	ret = kv_create_account(account);
 	if (ret == SD_RES_SUCCESS)
 		http_response_header(req, CREATED);
@@ -69,13 +641,20 @@ static void swift_put_account(struct http_request *req, const char *account)
 
 static void swift_post_account(struct http_request *req, const char *account)
 {
-	http_response_header(req, NOT_IMPLEMENTED);
+	if (swift_bulk_request(req, "bulk-delete"))
+		swift_bulk_delete(req, account);
+	else
+		http_response_header(req, NOT_IMPLEMENTED);
 }
 
 static void swift_delete_account(struct http_request *req, const char *account)
 {
 	int ret;
 
+	if (swift_bulk_request(req, "bulk-delete")) {
+		swift_bulk_delete(req, account);
+		return;
+	}
 	ret = kv_delete_account(req, account);
 	switch (ret) {
 	case SD_RES_SUCCESS:
@@ -116,21 +695,46 @@ static void swift_head_container(struct http_request *req, const char *account,
 	}
 }
 
-static void swift_get_container_cb(const char *object, void *opaque)
+static void swift_get_container_cb(const char *object, bool is_prefix,
+				   void *opaque)
 {
 	struct strbuf *buf = (struct strbuf *)opaque;
 
 	strbuf_addf(buf, "%s\n", object);
 }
 
+/* Swift lists at most this many objects per request */
+#define SWIFT_LISTING_LIMIT 10000
+
 static void swift_get_container(struct http_request *req, const char *account,
 				const char *container)
 {
+	char prefix[SD_MAX_OBJECT_NAME], marker[SD_MAX_OBJECT_NAME];
+	char delimiter[SD_MAX_OBJECT_NAME], limit[32], *endp;
+	struct kv_list_param param = { .limit = SWIFT_LISTING_LIMIT };
 	struct strbuf buf = STRBUF_INIT;
+	bool truncated;
 	int ret;
 
-	ret = kv_iterate_object(account, container, swift_get_container_cb,
-				&buf);
+	if (http_query_param(req, "prefix", prefix, sizeof(prefix)))
+		param.prefix = prefix;
+	if (http_query_param(req, "marker", marker, sizeof(marker)))
+		param.marker = marker;
+	if (http_query_param(req, "delimiter", delimiter, sizeof(delimiter)) &&
+	    delimiter[0] != '\0')
+		param.delimiter = delimiter;
+	if (http_query_param(req, "limit", limit, sizeof(limit))) {
+		param.limit = strtoull(limit, &endp, 10);
+		if (limit == endp || *endp != '\0') {
+			http_response_header(req, BAD_REQUEST);
+			return;
+		}
+		if (!param.limit || param.limit > SWIFT_LISTING_LIMIT)
+			param.limit = SWIFT_LISTING_LIMIT;
+	}
+
+	ret = kv_list_object(account, container, &param,
+			     swift_get_container_cb, &buf, &truncated);
 	switch (ret) {
 	case SD_RES_SUCCESS:
 		req->data_length = buf.len;
@@ -151,6 +755,11 @@ static void swift_put_container(struct http_request *req, const char *account,
 				const char *container)
 {
 	int ret;
+
+	if (swift_bulk_request(req, "extract-archive")) {
+		swift_extract_archive(req, account, container, NULL);
+		return;
+	}
 	ret = kv_create_bucket(account, container);
 	switch (ret) {
 	case SD_RES_SUCCESS:
@@ -249,6 +858,10 @@ static void swift_put_object(struct http_request *req, const char *account,
 {
 	int ret;
 
+	if (swift_bulk_request(req, "extract-archive")) {
+		swift_extract_archive(req, account, container, object);
+		return;
+	}
 	if (req->eof)
 		ret = kv_complete_object(req, account, container, object);
 	else if (req->append)
@@ -308,6 +921,10 @@ static void swift_delete_object(struct http_request *req, const char *account,
 
 static int swift_init(const char *option)
 {
+	swift_bulk_wqueue = create_fixed_work_queue("swift_bulk",
+						    SWIFT_BULK_THREADS);
+	if (!swift_bulk_wqueue)
+		return -1;
 	return 0;
 }
 
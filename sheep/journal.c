@@ -11,21 +11,177 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Journal
+ *
+ * The journal is a single file mapped into memory and used as a circular log.
+ * The first JOURNAL_RING_START bytes hold the header and the rest is split
+ * into two halves.  Every record is sector aligned, carries a sequence number
+ * and a CRC32C of its header and data, and never crosses the end of a half.
+ *
+ * When the head moves to the other half, a checkpoint is queued: it sync()s
+ * the object store and then records the first sequence number of the new
+ * half in the header, meaning that all the older records have reached the
+ * disk and needn't be replayed.  The head can't enter a half again until its
+ * checkpoint has finished.
+ *
+ * At startup, the valid records newer than the checkpoint are sorted by
+ * sequence number and replayed by several threads, each of which owns a
+ * subset of the objects so that the writes to an object are applied in
+ * order.
+ */
+
 #include "sheep_priv.h"
+#include "crc32c.h"
 
-struct journal_file {
-	int fd;
-	off_t pos;
-	int commit_fd;
-	uatomic_bool in_commit;
-};
+#define JOURNAL_RING_NAME "journal_ring"
+#define JOURNAL_RING_MAGIC 0x6a726e67
+#define JOURNAL_RING_VERSION 1
+#define JOURNAL_RING_START 4096 /* the header takes the first page */
+
+#define JOURNAL_REC_MAGIC 0xfee1900e
+
+#define JF_STORE 0
+#define JF_REMOVE_OBJ 2
+
+#define JOURNAL_REPLAY_THREADS 8
+
+struct journal_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	/* records older than this have been committed to the store */
+	uint64_t checkpoint_seq;
+} __packed;
+
+struct journal_record {
+	uint32_t magic;
+	uint32_t crc; /* CRC32C of the rest of the record header and the data */
+	uint64_t seq;
+	uint64_t oid;
+	uint64_t offset;
+	uint32_t size;
+	uint16_t flag;
+	uint8_t create;
+	uint8_t pad[25];
+} __packed;
+
+#define JOURNAL_REC_SIZE sizeof(struct journal_record)
+
+static char *ring;
+static size_t ring_size;
+static size_t half_size;
+static struct journal_ring_header *ring_hdr;
+
+/* Protected by jfile_lock */
+static size_t head;
+static int cur_half;
+static uint64_t next_seq = 1;
+static bool checkpointing;
+static struct sd_mutex jfile_lock = SD_MUTEX_INITIALIZER;
+static struct sd_cond checkpoint_cond = SD_COND_INITIALIZER;
+
+static struct work_queue *commit_wq;
+
+/*
+ * Group commit
+ *
+ * Without group commit, every writer msync()s its own record, so N concurrent
+ * writers cost N device flushes.  With group commit, the writers only copy
+ * their records into the ring and sleep.  A single committer thread closes
+ * the batch, waits for the writers which are still copying, makes the whole
+ * batch durable with one msync() and wakes up all the writers of the batch.
+ */
+static bool group_commit;
+static int nr_copying; /* writers which haven't finished copying */
+static bool group_closing;
+static uint64_t batch_seq; /* the newest record copied into the ring */
+static size_t batch_start = SIZE_MAX, batch_end;
+static int batch_nr_writers;
+static uint64_t synced_seq;
+/* the records of a batch which failed, until all its writers have seen it */
+static uint64_t failed_seq_start, failed_seq_end;
+static int nr_failed_writers;
+static struct sd_mutex group_lock = SD_MUTEX_INITIALIZER;
+static struct sd_cond group_commit_cond = SD_COND_INITIALIZER;
+static struct sd_cond group_open_cond = SD_COND_INITIALIZER;
+static struct sd_cond group_done_cond = SD_COND_INITIALIZER;
+
+static inline size_t record_len(uint32_t size)
+{
+	return round_up(JOURNAL_REC_SIZE + size, SECTOR_SIZE);
+}
+
+static uint32_t record_crc(const struct journal_record *rec, const char *data)
+{
+	uint32_t crc;
+
+	crc = crc32c(0, &rec->seq, JOURNAL_REC_SIZE -
+		     offsetof(struct journal_record, seq));
+	return crc32c(crc, data, rec->size);
+}
+
+static int replay_object(uint64_t oid, uint16_t flag, bool create,
+			 uint64_t offset, uint64_t size, const char *data)
+{
+	char path[PATH_MAX];
+	ssize_t written;
+	uint32_t object_size = 0;
+	int fd, flags = O_RDWR, ret = 0;
+
+	snprintf(path, PATH_MAX, "%s/%016"PRIx64, md_get_object_dir(oid), oid);
+
+	if (flag == JF_REMOVE_OBJ) {
+		sd_info("%s (remove)", path);
+		unlink(path);
+
+		return 0;
+	}
+
+	if (flag != JF_STORE) {
+		sd_emerg("flag is not JF_STORE, the journaling file is broken."
+		      " please remove the journaling file and restart sheep daemon");
+		return -1;
+	}
+
+	sd_info("%s, size %" PRIu64 ", off %" PRIu64 ", %d", path, size,
+		offset, create);
+
+	if (create)
+		flags |= O_CREAT;
+
+	fd = open(path, flags, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("open %m");
+		return -1;
+	}
+	if (create) {
+		object_size = get_vdi_object_size(oid_to_vid(oid));
+		ret = prealloc(fd, object_size);
+		if (ret < 0)
+			goto out;
+	}
+	written = xpwrite(fd, data, size, offset);
+	if (written != size) {
+		sd_err("write %zd, size %" PRIu64 ", errno %m", written, size);
+		ret = -1;
+		goto out;
+	}
+	/* the partially written blocks are read again, hence O_RDWR */
+	if (csum_update(oid, fd, offset, size) < 0) {
+		sd_err("failed to update the checksums of %s, %m", path);
+		ret = -1;
+	}
+out:
+	close(fd);
+	return ret;
+}
 
 /*
- * CAUTION: This definition of struct journal_descriptor must be same
- * to the definition in tests/dynamorio/journaling/journaling.c. We
- * have to update the definition in the DR client definition if we
- * update the below definition because there's no technique for
- * keeping the consistency automatically.
+ * Legacy journal
+ *
+ * Older sheep wrote the journal to two files used alternately.  They are only
+ * replayed at startup and removed afterwards.
  */
 struct journal_descriptor {
 	uint32_t magic;
@@ -38,7 +194,6 @@ struct journal_descriptor {
 	uint8_t pad[475];
 } __packed;
 
-/* JOURNAL_DESC + JOURNAL_MARKER must be 512 aligned for DIO */
 #define JOURNAL_DESC_MAGIC 0xfee1900d
 #define JOURNAL_DESC_SIZE 508
 #define JOURNAL_MARKER_SIZE 4 /* Use marker to detect partial write */
@@ -46,36 +201,7 @@ struct journal_descriptor {
 
 #define JOURNAL_END_MARKER 0xdeadbeef
 
-#define JF_STORE 0
-#define JF_REMOVE_OBJ 2
-
 static const char *jfile_name[2] = { "journal_file0", "journal_file1", };
-static int jfile_fds[2];
-static size_t jfile_size;
-
-static struct journal_file jfile;
-static struct sd_mutex jfile_lock = SD_MUTEX_INITIALIZER;
-
-static struct work_queue *commit_wq;
-
-static int create_journal_file(const char *root, const char *name)
-{
-	int fd, flags = O_DSYNC | O_RDWR | O_TRUNC | O_CREAT | O_DIRECT;
-	char path[PATH_MAX];
-
-	snprintf(path, sizeof(path), "%s/%s", root, name);
-	fd = open(path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (fd < 0) {
-		sd_err("open %s %m", name);
-		return -1;
-	}
-	if (prealloc(fd, jfile_size) < 0) {
-		sd_err("prealloc %s %m", name);
-		return -1;
-	}
-
-	return fd;
-}
 
 /* We should have two valid FDs, otherwise something goes wrong */
 static int get_old_new_jfile(const char *p, int *old, int *new)
@@ -133,63 +259,6 @@ static bool journal_entry_full_write(struct journal_descriptor *jd)
 	return true;
 }
 
-static int replay_journal_entry(struct journal_descriptor *jd)
-{
-	char path[PATH_MAX];
-	ssize_t size;
-	uint32_t object_size = 0;
-	int fd, flags = O_WRONLY, ret = 0;
-	void *buf = NULL;
-	char *p = (char *)jd;
-
-	snprintf(path, PATH_MAX, "%s/%016"PRIx64,
-		 md_get_object_dir(jd->oid), jd->oid);
-
-	if (jd->flag == JF_REMOVE_OBJ) {
-		sd_info("%s (remove)", path);
-		unlink(path);
-
-		return 0;
-	}
-
-	if (jd->flag != JF_STORE) {
-		sd_emerg("flag is not JF_STORE, the journaling file is broken."
-		      " please remove the journaling file and restart sheep daemon");
-		return -1;
-	}
-
-	sd_info("%s, size %" PRIu64 ", off %" PRIu64 ", %d", path, jd->size,
-		jd->offset, jd->create);
-
-	if (jd->create)
-		flags |= O_CREAT;
-
-	fd = open(path, flags, sd_def_fmode);
-	if (fd < 0) {
-		sd_err("open %m");
-		return -1;
-	}
-	if (jd->create) {
-		object_size = get_vdi_object_size(oid_to_vid(jd->oid));
-		ret = prealloc(fd, object_size);
-		if (ret < 0)
-			goto out;
-	}
-	buf = xmalloc(jd->size);
-	p += JOURNAL_DESC_SIZE;
-	memcpy(buf, p, jd->size);
-	size = xpwrite(fd, buf, jd->size, jd->offset);
-	if (size != jd->size) {
-		sd_err("write %zd, size %" PRIu64 ", errno %m", size, jd->size);
-		ret = -1;
-		goto out;
-	}
-out:
-	free(buf);
-	close(fd);
-	return ret;
-}
-
 static int do_recover(int fd)
 {
 	struct journal_descriptor *jd;
@@ -231,7 +300,8 @@ static int do_recover(int fd)
 		if (!journal_entry_full_write(jd))
 			goto skip;
 
-		if (replay_journal_entry(jd) < 0)
+		if (replay_object(jd->oid, jd->flag, jd->create, jd->offset,
+				  jd->size, p + JOURNAL_DESC_SIZE) < 0)
 			return -1;
 skip:
 		p += JOURNAL_META_SIZE + round_up(jd->size, SECTOR_SIZE);
@@ -245,10 +315,9 @@ skip:
 /*
  * We recover the journal file in order of wall time in the corner case that
  * sheep crashes while in the middle of journal committing. For most of cases,
- * we actually only recover one jfile, the other would be empty. This process
- * is fast with buffered IO that only take several seconds at most.
+ * we actually only recover one jfile, the other would be empty.
  */
-static int check_recover_journal_file(const char *p)
+static int check_recover_legacy_journal(const char *p)
 {
 	int old = 0, new = 0;
 
@@ -271,23 +340,260 @@ static int check_recover_journal_file(const char *p)
 	return 0;
 }
 
-int journal_file_init(const char *path, size_t size, bool skip)
+static void remove_legacy_journal(const char *p)
 {
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(jfile_name); i++) {
+		snprintf(path, sizeof(path), "%s/%s", p, jfile_name[i]);
+		if (unlink(path) < 0 && errno != ENOENT)
+			sd_err("unlink(%s): %m", path);
+	}
+}
+
+struct replay_info {
+	struct journal_record **recs;
+	int nr_recs;
+	int nr_threads;
+	int idx;
+	uatomic_bool failed;
+};
+
+static int record_seq_cmp(const void *a, const void *b)
+{
+	const struct journal_record *ra = *(struct journal_record **)a;
+	const struct journal_record *rb = *(struct journal_record **)b;
+
+	return intcmp(ra->seq, rb->seq);
+}
+
+static void *replay_worker(void *arg)
+{
+	struct replay_info *ri = arg, *shared = ri - ri->idx;
+	struct journal_record *rec;
+	int i;
+
+	for (i = 0; i < shared->nr_recs; i++) {
+		rec = shared->recs[i];
+		if (sd_hash_oid(rec->oid) % shared->nr_threads != ri->idx)
+			continue;
+		if (uatomic_is_true(&shared->failed))
+			break;
+		if (replay_object(rec->oid, rec->flag, rec->create,
+				  rec->offset, rec->size,
+				  (char *)rec + JOURNAL_REC_SIZE) < 0) {
+			uatomic_set_true(&shared->failed);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Replay the records in 'recs', which are sorted by seq, in parallel */
+static int replay_records(struct journal_record **recs, int nr_recs)
+{
+	struct replay_info *ri;
+	sd_thread_t *threads;
+	int i, nr_threads, ret = 0;
+
+	nr_threads = min((int)sysconf(_SC_NPROCESSORS_ONLN),
+			 JOURNAL_REPLAY_THREADS);
+	nr_threads = min(nr_threads, nr_recs);
+	nr_threads = max(nr_threads, 1);
+
+	ri = xzalloc(sizeof(*ri) * nr_threads);
+	threads = xzalloc(sizeof(*threads) * nr_threads);
+	ri[0].recs = recs;
+	ri[0].nr_recs = nr_recs;
+	ri[0].nr_threads = nr_threads;
+
+	for (i = 0; i < nr_threads; i++) {
+		ri[i].idx = i;
+		if (sd_thread_create_with_idx("replay", &threads[i],
+					      replay_worker, &ri[i]) != 0) {
+			sd_err("failed to create a replay thread");
+			/* replay the rest in this thread */
+			for (; i < nr_threads; i++) {
+				ri[i].idx = i;
+				threads[i] = 0;
+				replay_worker(&ri[i]);
+			}
+			break;
+		}
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		if (threads[i])
+			sd_thread_join(threads[i], NULL);
+
+	if (uatomic_is_true(&ri[0].failed))
+		ret = -1;
+
+	free(threads);
+	free(ri);
+	return ret;
+}
+
+static int check_recover_journal_ring(const char *p)
+{
+	const struct journal_ring_header *hdr;
+	struct journal_record *rec, **recs = NULL;
+	int fd, nr_recs = 0, ret = 0;
+	char path[PATH_MAX], *map, *q, *end;
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", p, JOURNAL_RING_NAME);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		sd_err("open %s, %m", path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		sd_err("fstat %m");
+		close(fd);
+		return -1;
+	}
+
+	/* sheep crashed before the header was written, nothing to replay */
+	if (st.st_size < JOURNAL_RING_START) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		sd_err("%m");
+		return -1;
+	}
+
+	hdr = (struct journal_ring_header *)map;
+	if (hdr->magic != JOURNAL_RING_MAGIC) {
+		/* crashed in the middle of journal_ring_init() */
+		sd_info("no valid journal header, skip replaying");
+		goto out;
+	}
+	if (hdr->version != JOURNAL_RING_VERSION ||
+	    hdr->size != st.st_size) {
+		sd_emerg("unsupported journal version %"PRIu32" or size %"
+			 PRIu64, hdr->version, hdr->size);
+		ret = -1;
+		goto out;
+	}
+
+	end = map + st.st_size;
+	for (q = map + JOURNAL_RING_START; q + JOURNAL_REC_SIZE <= end;) {
+		rec = (struct journal_record *)q;
+		/*
+		 * We skip empty areas and partial writes (which don't match
+		 * the crc) because they were not acked back to VM
+		 */
+		if (rec->magic != JOURNAL_REC_MAGIC ||
+		    q + record_len(rec->size) > end ||
+		    rec->crc != record_crc(rec, q + JOURNAL_REC_SIZE)) {
+			q += SECTOR_SIZE;
+			continue;
+		}
+
+		/*
+		 * Only step over the records we replay, so that a bogus size
+		 * never makes us skip the acked records after it
+		 */
+		if (rec->seq < hdr->checkpoint_seq) {
+			q += SECTOR_SIZE;
+			continue;
+		}
+
+		if (!(nr_recs % 1024))
+			recs = xrealloc(recs, sizeof(*recs) * (nr_recs + 1024));
+		recs[nr_recs++] = rec;
+		q += record_len(rec->size);
+	}
+
+	sd_info("%d records to replay", nr_recs);
+	if (!nr_recs)
+		goto out;
+
+	qsort(recs, nr_recs, sizeof(*recs), record_seq_cmp);
+	ret = replay_records(recs, nr_recs);
+	if (ret < 0) {
+		sd_emerg("recovering from journal failed");
+		goto out;
+	}
+	/* Do a final sync() to assure data is reached to the disk */
+	sync();
+out:
+	free(recs);
+	munmap(map, st.st_size);
+	return ret;
+}
+
+static int journal_ring_init(const char *root, size_t size)
+{
+	char path[PATH_MAX];
 	int fd;
 
-	if (!skip)
-		if (check_recover_journal_file(path) != 0)
-			return -1;
+	snprintf(path, sizeof(path), "%s/%s", root, JOURNAL_RING_NAME);
+	fd = open(path, O_RDWR | O_TRUNC | O_CREAT,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		sd_err("open %s %m", path);
+		return -1;
+	}
+	if (prealloc(fd, size) < 0) {
+		sd_err("prealloc %s %m", path);
+		goto err;
+	}
 
-	jfile_size = size / 2;
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		sd_err("mmap %s %m", path);
+		goto err;
+	}
+	close(fd);
 
-	fd = create_journal_file(path, jfile_name[0]);
-	if (fd < 0)
+	ring_size = size;
+	half_size = round_down((size - JOURNAL_RING_START) / 2, SECTOR_SIZE);
+	head = JOURNAL_RING_START;
+
+	ring_hdr = (struct journal_ring_header *)ring;
+	ring_hdr->version = JOURNAL_RING_VERSION;
+	ring_hdr->size = size;
+	ring_hdr->checkpoint_seq = next_seq;
+	ring_hdr->magic = JOURNAL_RING_MAGIC;
+	if (msync(ring, JOURNAL_RING_START, MS_SYNC) < 0) {
+		sd_err("msync %m");
 		return -1;
-	jfile.fd = jfile_fds[0] = fd;
+	}
 
-	fd = create_journal_file(path, jfile_name[1]);
-	jfile_fds[1] = fd;
+	return 0;
+err:
+	close(fd);
+	return -1;
+}
+
+static void *journal_committer(void *arg);
+
+int journal_file_init(const char *path, size_t size, bool skip, bool group)
+{
+	sd_thread_t t;
+	int err;
+
+	if (!skip) {
+		if (check_recover_legacy_journal(path) != 0)
+			return -1;
+		if (check_recover_journal_ring(path) != 0)
+			return -1;
+	}
+	remove_legacy_journal(path);
+
+	if (journal_ring_init(path, size) < 0)
+		return -1;
 
 	commit_wq = create_ordered_work_queue("journal commit");
 	if (!commit_wq) {
@@ -295,6 +601,15 @@ int journal_file_init(const char *path, size_t size, bool skip)
 		return -1;
 	}
 
+	group_commit = group;
+	if (group_commit) {
+		err = sd_thread_create("journal", &t, journal_committer, NULL);
+		if (err) {
+			sd_err("%s", strerror(err));
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -305,122 +620,233 @@ void clean_journal_file(const char *p)
 
 	sync();
 
-	snprintf(path, sizeof(path), "%s/%s", p, jfile_name[0]);
-	ret = unlink(path);
-	if (ret < 0)
-		sd_err("unlink(%s): %m", path);
-
-	snprintf(path, sizeof(path), "%s/%s", p, jfile_name[1]);
+	snprintf(path, sizeof(path), "%s/%s", p, JOURNAL_RING_NAME);
 	ret = unlink(path);
 	if (ret < 0)
 		sd_err("unlink(%s): %m", path);
 }
 
-static inline bool jfile_enough_space(size_t size)
-{
-	return (jfile.pos + size) < jfile_size;
-}
-
-static struct sd_mutex journal_commit_mutex = SD_MUTEX_INITIALIZER;
+struct checkpoint_work {
+	struct work work;
+	uint64_t seq;
+};
 
 /*
  * We rely on the kernel's page cache to cache data objects to 1) boost read
  * performance 2) simplify read path so that data committing is simply a
  * sync() operation and We do it in a dedicated thread to avoid blocking
- * the writer by switch back and forth between two journal files.
+ * the writers while the other half of the ring is being checkpointed.
  */
-static void journal_commit_data_work(struct work *work)
+static void journal_checkpoint_work(struct work *work)
 {
+	struct checkpoint_work *cw =
+		container_of(work, struct checkpoint_work, work);
+
 	sync();
 
-	if (unlikely(xftruncate(jfile.commit_fd, 0) < 0))
-		panic("truncate %m");
-	if (unlikely(prealloc(jfile.commit_fd, jfile_size) < 0))
-		panic("prealloc %m");
+	ring_hdr->checkpoint_seq = cw->seq;
+	if (unlikely(msync(ring, JOURNAL_RING_START, MS_SYNC) < 0))
+		panic("msync %m");
 
-	sd_mutex_unlock(&journal_commit_mutex);
+	sd_mutex_lock(&jfile_lock);
+	checkpointing = false;
+	sd_cond_broadcast(&checkpoint_cond);
+	sd_mutex_unlock(&jfile_lock);
 }
 
-static void journal_commit_data_done(struct work *work)
+static void journal_checkpoint_done(struct work *work)
 {
-	free(work);
+	struct checkpoint_work *cw =
+		container_of(work, struct checkpoint_work, work);
+
+	free(cw);
 }
 
-static void switch_journal_file(void)
+/* Called with jfile_lock held */
+static void switch_journal_half(void)
 {
-	int old = jfile.fd;
-	struct work *w;
-
-	if (sd_mutex_trylock(&journal_commit_mutex) == EBUSY) {
-		sd_err("journal file in committing, you might need"
-		       " enlarge jfile size");
-		sd_mutex_lock(&journal_commit_mutex);
-	}
-
-	if (old == jfile_fds[0])
-		jfile.fd = jfile_fds[1];
-	else
-		jfile.fd = jfile_fds[0];
-	jfile.commit_fd = old;
-	jfile.pos = 0;
-
-	w = xzalloc(sizeof(*w));
-	w->fn = journal_commit_data_work;
-	w->done = journal_commit_data_done;
-	queue_work(commit_wq, w);
+	struct checkpoint_work *cw;
+
+	if (checkpointing) {
+		sd_err("journal in checkpointing, you might need"
+		       " enlarge journal size");
+		while (checkpointing)
+			sd_cond_wait(&checkpoint_cond, &jfile_lock);
+	}
+
+	cur_half ^= 1;
+	head = JOURNAL_RING_START + cur_half * half_size;
+	checkpointing = true;
+
+	cw = xzalloc(sizeof(*cw));
+	cw->seq = next_seq;
+	cw->work.fn = journal_checkpoint_work;
+	cw->work.done = journal_checkpoint_done;
+	queue_work(commit_wq, &cw->work);
 }
 
-static int journal_file_write(struct journal_descriptor *jd, const char *buf)
+/* Reserve 'len' bytes in the ring, returns the offset or -1 */
+static off_t reserve_record(size_t len, uint64_t *seq)
 {
-	uint32_t marker = JOURNAL_END_MARKER;
-	int ret = SD_RES_SUCCESS;
-	uint64_t size = jd->size;
-	ssize_t written, rusize = round_up(size, SECTOR_SIZE),
-		wsize = JOURNAL_META_SIZE + rusize;
-	off_t woff;
-	char *wbuffer, *p;
+	size_t half_end;
+	off_t off;
+
+	if (unlikely(len > half_size)) {
+		sd_err("too large record %zu, journal half size %zu", len,
+		       half_size);
+		return -1;
+	}
 
 	sd_mutex_lock(&jfile_lock);
-	if (!jfile_enough_space(wsize))
-		switch_journal_file();
-	woff = jfile.pos;
-	jfile.pos += wsize;
+	half_end = JOURNAL_RING_START + (cur_half + 1) * half_size;
+	if (head + len > half_end)
+		switch_journal_half();
+	off = head;
+	head += len;
+	*seq = next_seq++;
 	sd_mutex_unlock(&jfile_lock);
 
-	p = wbuffer = xvalloc(wsize);
-	memcpy(p, jd, JOURNAL_DESC_SIZE);
-	p += JOURNAL_DESC_SIZE;
-	memcpy(p, buf, size);
-	p += size;
-	if (size < rusize) {
-		memset(p, 0, rusize - size);
-		p += rusize - size;
+	return off;
+}
+
+static void fill_record(char *p, struct journal_record *rec, const char *buf)
+{
+	memcpy(p + JOURNAL_REC_SIZE, buf, rec->size);
+	rec->magic = JOURNAL_REC_MAGIC;
+	rec->crc = record_crc(rec, buf);
+	memcpy(p, rec, JOURNAL_REC_SIZE);
+}
+
+static int sync_ring(size_t start, size_t end)
+{
+	start = round_down(start, getpagesize());
+	if (unlikely(msync(ring + start, end - start, MS_SYNC) < 0)) {
+		sd_err("msync %m");
+		return SD_RES_EIO;
 	}
-	memcpy(p, &marker, JOURNAL_MARKER_SIZE);
-	/*
-	 * Concurrent writes with the same FD is okay because we don't have any
-	 * critical sections that need lock inside kernel write path, since we
-	 * a) bypass page cache, b) don't modify i_size of this inode.
-	 *
-	 * Feel free to correct me If I am wrong.
-	 */
-	written = xpwrite(jfile.fd, wbuffer, wsize, woff);
-	if (unlikely(written != wsize)) {
-		sd_err("failed, written %zd, len %zd", written, wsize);
-		/* FIXME: teach journal file handle EIO gracefully */
+	return SD_RES_SUCCESS;
+}
+
+static void *journal_committer(void *arg)
+{
+	size_t start, end;
+	uint64_t seq;
+	int ret, nr;
+
+	for (;;) {
+		sd_mutex_lock(&group_lock);
+		while (batch_seq <= synced_seq)
+			sd_cond_wait(&group_commit_cond, &group_lock);
+
+		/* close the batch and wait for the writers still copying */
+		group_closing = true;
+		while (nr_copying)
+			sd_cond_wait(&group_commit_cond, &group_lock);
+		seq = batch_seq;
+		start = batch_start;
+		end = batch_end;
+		nr = batch_nr_writers;
+		batch_start = SIZE_MAX;
+		batch_end = 0;
+		batch_nr_writers = 0;
+		group_closing = false;
+		sd_cond_broadcast(&group_open_cond);
+		sd_mutex_unlock(&group_lock);
+
+		ret = sync_ring(start, end);
+
+		sd_mutex_lock(&group_lock);
+		if (unlikely(ret != SD_RES_SUCCESS)) {
+			/* FIXME: teach journal file handle EIO gracefully */
+			failed_seq_start = synced_seq + 1;
+			failed_seq_end = seq;
+			nr_failed_writers = nr;
+		}
+		synced_seq = seq;
+		sd_cond_broadcast(&group_done_cond);
+		/* the next batch may succeed, once this one is reported */
+		while (nr_failed_writers)
+			sd_cond_wait(&group_commit_cond, &group_lock);
+		failed_seq_start = failed_seq_end = 0;
+		sd_mutex_unlock(&group_lock);
+	}
+
+	return NULL;
+}
+
+static int journal_group_write(struct journal_record *rec, const char *buf)
+{
+	size_t len = record_len(rec->size);
+	uint64_t seq;
+	off_t off;
+	int ret;
+
+	sd_mutex_lock(&group_lock);
+	while (group_closing)
+		sd_cond_wait(&group_open_cond, &group_lock);
+	nr_copying++;
+	sd_mutex_unlock(&group_lock);
+
+	off = reserve_record(len, &seq);
+	rec->seq = seq;
+	if (off >= 0)
+		fill_record(ring + off, rec, buf);
+
+	sd_mutex_lock(&group_lock);
+	if (off >= 0) {
+		batch_start = min(batch_start, (size_t)off);
+		batch_end = max(batch_end, (size_t)off + len);
+		batch_seq = max(batch_seq, seq);
+		batch_nr_writers++;
+	}
+	nr_copying--;
+	sd_cond_signal(&group_commit_cond);
+	if (off < 0) {
+		sd_mutex_unlock(&group_lock);
+		return SD_RES_EIO;
+	}
+	while (synced_seq < seq)
+		sd_cond_wait(&group_done_cond, &group_lock);
+	if (unlikely(failed_seq_start <= seq && seq <= failed_seq_end)) {
 		ret = SD_RES_EIO;
-		goto out;
+		if (--nr_failed_writers == 0)
+			sd_cond_signal(&group_commit_cond);
+	} else {
+		ret = SD_RES_SUCCESS;
 	}
-out:
-	free(wbuffer);
+	sd_mutex_unlock(&group_lock);
+
 	return ret;
 }
 
+static int journal_file_write(struct journal_record *rec, const char *buf)
+{
+	size_t len = record_len(rec->size);
+	uint64_t seq;
+	off_t off;
+
+	if (group_commit)
+		return journal_group_write(rec, buf);
+
+	off = reserve_record(len, &seq);
+	if (off < 0)
+		return SD_RES_EIO;
+	rec->seq = seq;
+
+	/*
+	 * Concurrent writers copy to the different area of the ring, and
+	 * msync() of a page shared with another record only writes back
+	 * whatever has been copied so far, which is rewritten by its owner.
+	 */
+	fill_record(ring + off, rec, buf);
+	/* FIXME: teach journal file handle EIO gracefully */
+	return sync_ring(off, off + len);
+}
+
 int journal_write_store(uint64_t oid, const char *buf, size_t size,
 			off_t offset, bool create)
 {
-	struct journal_descriptor jd = {
-		.magic = JOURNAL_DESC_MAGIC,
+	struct journal_record rec = {
 		.flag = JF_STORE,
 		.offset = offset,
 		.size = size,
@@ -428,23 +854,34 @@ int journal_write_store(uint64_t oid, const char *buf, size_t size,
 		.oid = oid,
 	};
 
-	return journal_file_write(&jd, buf);
+	return journal_file_write(&rec, buf);
 }
 
 int journal_remove_object(uint64_t oid)
 {
-	struct journal_descriptor jd = {
-		.magic = JOURNAL_DESC_MAGIC,
+	struct journal_record rec = {
 		.flag = JF_REMOVE_OBJ,
 		.size = 0,
 		.oid = oid,
 	};
 
-	return journal_file_write(&jd, NULL);
+	return journal_file_write(&rec, NULL);
+}
+
+void journal_get_state(struct journal_state *st)
+{
+	sd_mutex_lock(&jfile_lock);
+	st->half_size = half_size;
+	st->half_used = head - (JOURNAL_RING_START + cur_half * half_size);
+	st->next_seq = next_seq;
+	st->checkpointing = checkpointing;
+	sd_mutex_unlock(&jfile_lock);
 }
 
 static __attribute__((used)) void journal_c_build_bug_ons(void)
 {
 	/* never called, only for checking BUILD_BUG_ON()s */
 	BUILD_BUG_ON(sizeof(struct journal_descriptor) != JOURNAL_DESC_SIZE);
+	BUILD_BUG_ON(sizeof(struct journal_record) != 64);
+	BUILD_BUG_ON(sizeof(struct journal_ring_header) > JOURNAL_RING_START);
 }
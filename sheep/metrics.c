@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Prometheus metrics over HTTP
+ *
+ * With '-m', the sheep answers GET /metrics on its own port with the text
+ * exposition format.  The connections are served by the main loop, which owns
+ * the request counters and the latency histograms, so a scrape takes no lock
+ * on the I/O path; it reads the same state as SD_OP_STAT, SD_OP_GET_WQ_INFO,
+ * SD_OP_STAT_RECOVERY and SD_OP_MD_INFO.
+ *
+ * The log-linear latency buckets are folded into one bucket per power of two
+ * of usec, which is what a histogram_quantile() needs.
+ */
+
+#include "sheep_priv.h"
+#include "strbuf.h"
+#include "mempool.h"
+#include "option.h"
+
+#define METRICS_MAX_REQ 4096
+
+struct metrics_conn {
+	int fd;
+	char req[METRICS_MAX_REQ];
+	size_t rlen;
+	struct strbuf rsp;
+	size_t woff;
+};
+
+/* Add the label value s, escaped */
+static void add_label(struct strbuf *sb, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			strbuf_addch(sb, '\\');
+		if (*s == '\n') {
+			strbuf_addstr(sb, "\\n");
+			continue;
+		}
+		strbuf_addch(sb, *s);
+	}
+}
+
+static void add_meta(struct strbuf *sb, const char *name, const char *type,
+		     const char *help)
+{
+	strbuf_addf(sb, "# HELP sheepdog_%s %s\n", name, help);
+	strbuf_addf(sb, "# TYPE sheepdog_%s %s\n", name, type);
+}
+
+static void add_requests(struct strbuf *sb)
+{
+	const struct s_request *r = &sys->stat.r;
+
+	add_meta(sb, "requests_total", "counter",
+		 "Requests received, by role and kind.");
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"gateway\",kind=\"all\"}"
+		    " %"PRIu64"\n", r->gway_total_nr);
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"gateway\",kind=\"read\"}"
+		    " %"PRIu64"\n", r->gway_total_read_nr);
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"gateway\","
+		    "kind=\"write\"} %"PRIu64"\n", r->gway_total_write_nr);
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"gateway\","
+		    "kind=\"remove\"} %"PRIu64"\n", r->gway_total_remove_nr);
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"gateway\","
+		    "kind=\"flush\"} %"PRIu64"\n", r->gway_total_flush_nr);
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"peer\",kind=\"all\"}"
+		    " %"PRIu64"\n", r->peer_total_nr);
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"peer\",kind=\"read\"}"
+		    " %"PRIu64"\n", r->peer_total_read_nr);
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"peer\",kind=\"write\"}"
+		    " %"PRIu64"\n", r->peer_total_write_nr);
+	strbuf_addf(sb, "sheepdog_requests_total{role=\"peer\",kind=\"remove\"}"
+		    " %"PRIu64"\n", r->peer_total_remove_nr);
+
+	add_meta(sb, "requests_active", "gauge", "Requests being served.");
+	strbuf_addf(sb, "sheepdog_requests_active{role=\"gateway\"} %"PRIu64
+		    "\n", r->gway_active_nr);
+	strbuf_addf(sb, "sheepdog_requests_active{role=\"peer\"} %"PRIu64"\n",
+		    r->peer_active_nr);
+
+	add_meta(sb, "request_bytes_total", "counter",
+		 "Bytes of the request data, by role and direction.");
+	strbuf_addf(sb, "sheepdog_request_bytes_total{role=\"gateway\","
+		    "dir=\"rx\"} %"PRIu64"\n", r->gway_total_rx);
+	strbuf_addf(sb, "sheepdog_request_bytes_total{role=\"gateway\","
+		    "dir=\"tx\"} %"PRIu64"\n", r->gway_total_tx);
+	strbuf_addf(sb, "sheepdog_request_bytes_total{role=\"peer\","
+		    "dir=\"rx\"} %"PRIu64"\n", r->peer_total_rx);
+	strbuf_addf(sb, "sheepdog_request_bytes_total{role=\"peer\","
+		    "dir=\"tx\"} %"PRIu64"\n", r->peer_total_tx);
+}
+
+static void add_latencies(struct strbuf *sb)
+{
+	struct sd_latency_stat *lat;
+	int nr;
+
+	lat = xcalloc(SD_MAX_LATENCY_STATS, sizeof(*lat));
+	nr = latency_stat(lat, SD_MAX_LATENCY_STATS);
+
+	add_meta(sb, "request_latency_seconds", "histogram",
+		 "Latency of the finished requests, by role and opcode.");
+	for (int i = 0; i < nr; i++) {
+		const char *role = lat[i].peer ? "peer" : "gateway";
+		uint64_t count = 0;
+
+		for (int b = 0; b < SD_NR_LATENCY_BUCKETS; b++) {
+			count += lat[i].buckets[b];
+			/* the last of the buckets of a power of two */
+			if ((b + 1) % SD_LATENCY_SUB &&
+			    b != SD_NR_LATENCY_BUCKETS - 1)
+				continue;
+			strbuf_addf(sb, "sheepdog_request_latency_seconds_bucket"
+				    "{role=\"%s\",op=\"", role);
+			add_label(sb, lat[i].name);
+			strbuf_addf(sb, "\",le=\"%g\"} %"PRIu64"\n",
+				    bucket_to_latency(b + 1) / 1e6, count);
+		}
+		strbuf_addf(sb, "sheepdog_request_latency_seconds_bucket"
+			    "{role=\"%s\",op=\"", role);
+		add_label(sb, lat[i].name);
+		strbuf_addf(sb, "\",le=\"+Inf\"} %"PRIu64"\n", lat[i].nr);
+
+		strbuf_addf(sb, "sheepdog_request_latency_seconds_sum"
+			    "{role=\"%s\",op=\"", role);
+		add_label(sb, lat[i].name);
+		strbuf_addf(sb, "\"} %g\n", lat[i].total / 1e6);
+		strbuf_addf(sb, "sheepdog_request_latency_seconds_count"
+			    "{role=\"%s\",op=\"", role);
+		add_label(sb, lat[i].name);
+		strbuf_addf(sb, "\"} %"PRIu64"\n", lat[i].nr);
+	}
+	free(lat);
+}
+
+#define METRICS_MAX_WQS 64
+
+static void add_work_queues(struct strbuf *sb)
+{
+	struct work_queue_stat *st = xcalloc(METRICS_MAX_WQS, sizeof(*st));
+	int nr = work_queue_stat(st, METRICS_MAX_WQS);
+
+	add_meta(sb, "wq_threads", "gauge", "Threads of the work queue.");
+	for (int i = 0; i < nr; i++) {
+		strbuf_addstr(sb, "sheepdog_wq_threads{queue=\"");
+		add_label(sb, st[i].name);
+		strbuf_addf(sb, "\"} %zu\n", st[i].nr_threads);
+	}
+	add_meta(sb, "wq_queued", "gauge", "Works waiting in the work queue.");
+	for (int i = 0; i < nr; i++) {
+		strbuf_addstr(sb, "sheepdog_wq_queued{queue=\"");
+		add_label(sb, st[i].name);
+		strbuf_addf(sb, "\"} %zu\n", st[i].nr_queued);
+	}
+	add_meta(sb, "wq_works_per_second", "gauge",
+		 "Works done per second by the work queue.");
+	for (int i = 0; i < nr; i++) {
+		strbuf_addstr(sb, "sheepdog_wq_works_per_second{queue=\"");
+		add_label(sb, st[i].name);
+		strbuf_addf(sb, "\"} %"PRIu64"\n", st[i].rate);
+	}
+	free(st);
+}
+
+static void add_sockfd_cache(struct strbuf *sb)
+{
+	struct sd_sockfd_stat *st = xcalloc(SD_MAX_NODES, sizeof(*st));
+	int nr = sockfd_cache_stat(st, SD_MAX_NODES);
+
+	add_meta(sb, "sockfd_cache_fds", "gauge",
+		 "Cached connections to the node, by channel.");
+	for (int i = 0; i < nr; i++) {
+		const char *node = node_id_to_str(&st[i].nid);
+
+		strbuf_addf(sb, "sheepdog_sockfd_cache_fds{node=\"%s\","
+			    "channel=\"io\"} %"PRIu32"\n", node,
+			    st[i].nr_fds_io);
+		strbuf_addf(sb, "sheepdog_sockfd_cache_fds{node=\"%s\","
+			    "channel=\"nio\"} %"PRIu32"\n", node,
+			    st[i].nr_fds_nio);
+	}
+	add_meta(sb, "sockfd_cache_in_use", "gauge",
+		 "Cached connections to the node in use, by channel.");
+	for (int i = 0; i < nr; i++) {
+		const char *node = node_id_to_str(&st[i].nid);
+
+		strbuf_addf(sb, "sheepdog_sockfd_cache_in_use{node=\"%s\","
+			    "channel=\"io\"} %"PRIu32"\n", node,
+			    st[i].nr_io_in_use);
+		strbuf_addf(sb, "sheepdog_sockfd_cache_in_use{node=\"%s\","
+			    "channel=\"nio\"} %"PRIu32"\n", node,
+			    st[i].nr_nio_in_use);
+	}
+	add_meta(sb, "sockfd_cache_short_total", "counter",
+		 "Times a short connection to the node was used.");
+	for (int i = 0; i < nr; i++)
+		strbuf_addf(sb, "sheepdog_sockfd_cache_short_total{node=\"%s\"}"
+			    " %"PRIu64"\n", node_id_to_str(&st[i].nid),
+			    st[i].nr_short);
+	free(st);
+}
+
+static void add_recovery(struct strbuf *sb)
+{
+	struct recovery_state st;
+
+	get_recovery_state(&st);
+	add_meta(sb, "recovery_active", "gauge", "Whether a recovery runs.");
+	strbuf_addf(sb, "sheepdog_recovery_active %d\n", st.in_recovery);
+	add_meta(sb, "recovery_objects", "gauge",
+		 "Objects of the running recovery.");
+	strbuf_addf(sb, "sheepdog_recovery_objects %"PRIu64"\n", st.nr_total);
+	add_meta(sb, "recovery_objects_done", "gauge",
+		 "Objects recovered by the running recovery.");
+	strbuf_addf(sb, "sheepdog_recovery_objects_done %"PRIu64"\n",
+		    st.nr_finished);
+}
+
+static void add_disks(struct strbuf *sb)
+{
+	struct sd_md_info *info = xzalloc(sizeof(*info));
+
+	md_get_info(info);
+	add_meta(sb, "disk_used_bytes", "gauge", "Bytes used on the disk.");
+	for (int i = 0; i < info->nr; i++) {
+		strbuf_addstr(sb, "sheepdog_disk_used_bytes{path=\"");
+		add_label(sb, info->disk[i].path);
+		strbuf_addf(sb, "\"} %"PRIu64"\n", info->disk[i].used);
+	}
+	add_meta(sb, "disk_free_bytes", "gauge", "Bytes free on the disk.");
+	for (int i = 0; i < info->nr; i++) {
+		strbuf_addstr(sb, "sheepdog_disk_free_bytes{path=\"");
+		add_label(sb, info->disk[i].path);
+		strbuf_addf(sb, "\"} %"PRIu64"\n", info->disk[i].free);
+	}
+	add_meta(sb, "disk_rebalance_active", "gauge",
+		 "Whether the objects are moved after plugging disks.");
+	strbuf_addf(sb, "sheepdog_disk_rebalance_active %d\n",
+		    info->rebalance.in_rebalance);
+	add_meta(sb, "disk_rebalance_moved", "gauge",
+		 "Objects moved by the running rebalance.");
+	strbuf_addf(sb, "sheepdog_disk_rebalance_moved %"PRIu64"\n",
+		    info->rebalance.nr_moved);
+	free(info);
+}
+
+static void add_journal(struct strbuf *sb)
+{
+	struct journal_state st;
+
+	if (!uatomic_is_true(&sys->use_journal))
+		return;
+
+	journal_get_state(&st);
+	add_meta(sb, "journal_size_bytes", "gauge",
+		 "Size of a half of the journal ring.");
+	strbuf_addf(sb, "sheepdog_journal_size_bytes %zu\n", st.half_size);
+	add_meta(sb, "journal_used_bytes", "gauge",
+		 "Bytes used in the current half of the journal ring.");
+	strbuf_addf(sb, "sheepdog_journal_used_bytes %zu\n", st.half_used);
+	add_meta(sb, "journal_records_total", "counter",
+		 "Records written to the journal.");
+	strbuf_addf(sb, "sheepdog_journal_records_total %"PRIu64"\n",
+		    st.next_seq - 1);
+	add_meta(sb, "journal_checkpointing", "gauge",
+		 "Whether the other half of the journal ring is checkpointed.");
+	strbuf_addf(sb, "sheepdog_journal_checkpointing %d\n",
+		    st.checkpointing);
+}
+
+static void add_pool(struct strbuf *sb)
+{
+	struct s_pool pool[SD_NR_POOL_CLASSES + 1];
+
+	mempool_stat(pool);
+	add_meta(sb, "pool_buffers", "gauge",
+		 "Buffers of the pool allocated from the system, by size.");
+	for (int i = 0; i < ARRAY_SIZE(pool); i++)
+		strbuf_addf(sb, "sheepdog_pool_buffers{size=\"%"PRIu64"\"} %"
+			    PRIu64"\n", pool[i].size, pool[i].nr_total);
+	add_meta(sb, "pool_buffers_free", "gauge",
+		 "Buffers cached in the pool, by size.");
+	for (int i = 0; i < ARRAY_SIZE(pool); i++)
+		strbuf_addf(sb, "sheepdog_pool_buffers_free{size=\"%"PRIu64
+			    "\"} %"PRIu64"\n", pool[i].size, pool[i].nr_free);
+}
+
+static void build_metrics(struct strbuf *body)
+{
+	add_meta(body, "epoch", "gauge", "Epoch of the cluster.");
+	strbuf_addf(body, "sheepdog_epoch %"PRIu32"\n", sys->cinfo.epoch);
+	add_meta(body, "nodes", "gauge", "Members of the cluster.");
+	strbuf_addf(body, "sheepdog_nodes %"PRIu32"\n", sys->cinfo.nr_nodes);
+
+	add_requests(body);
+	add_latencies(body);
+	add_work_queues(body);
+	add_sockfd_cache(body);
+	add_recovery(body);
+	if (!sys->gateway_only)
+		add_disks(body);
+	add_journal(body);
+	add_pool(body);
+}
+
+static void build_response(struct metrics_conn *c)
+{
+	struct strbuf body = STRBUF_INIT;
+	const char *status = "200 OK";
+
+	if (strncmp(c->req, "GET /metrics ", 13) &&
+	    strncmp(c->req, "GET /metrics?", 13)) {
+		status = "404 Not Found";
+		strbuf_addstr(&body, "try /metrics\n");
+	} else
+		build_metrics(&body);
+
+	strbuf_addf(&c->rsp, "HTTP/1.1 %s\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %zu\r\n"
+		    "Connection: close\r\n\r\n", status, body.len);
+	strbuf_addbuf(&c->rsp, &body);
+	strbuf_release(&body);
+}
+
+static void close_conn(struct metrics_conn *c)
+{
+	unregister_event(c->fd);
+	close(c->fd);
+	strbuf_release(&c->rsp);
+	free(c);
+}
+
+static void conn_handler(int fd, int events, void *data)
+{
+	struct metrics_conn *c = data;
+	ssize_t ret;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		close_conn(c);
+		return;
+	}
+
+	if (!c->rsp.len) {
+		/* leave room for the terminating NUL */
+		ret = read(fd, c->req + c->rlen, sizeof(c->req) - c->rlen - 1);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (ret <= 0) {
+			close_conn(c);
+			return;
+		}
+		c->rlen += ret;
+		c->req[c->rlen] = '\0';
+		if (!strstr(c->req, "\r\n\r\n")) {
+			if (c->rlen == sizeof(c->req) - 1)
+				close_conn(c);
+			return;
+		}
+		build_response(c);
+		modify_event(fd, EPOLLOUT);
+		return;
+	}
+
+	ret = write(fd, c->rsp.buf + c->woff, c->rsp.len - c->woff);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret < 0) {
+		close_conn(c);
+		return;
+	}
+	c->woff += ret;
+	if (c->woff == c->rsp.len)
+		close_conn(c);
+}
+
+static void metrics_listen_handler(int listen_fd, int events, void *data)
+{
+	struct metrics_conn *c;
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		sd_err("failed to accept a new connection: %m");
+		return;
+	}
+
+	c = xzalloc(sizeof(*c));
+	c->fd = fd;
+	strbuf_init(&c->rsp, 0);
+	if (register_event(fd, conn_handler, c) < 0) {
+		close(fd);
+		free(c);
+	}
+}
+
+static int create_metrics_port_fn(int fd, void *data)
+{
+	return register_event(fd, metrics_listen_handler, data);
+}
+
+static char *metrics_host;
+static int metrics_port = 9180;
+
+static int metrics_host_parser(const char *s)
+{
+	metrics_host = xstrdup(s);
+	return 0;
+}
+
+static int metrics_port_parser(const char *s)
+{
+	metrics_port = str_to_u16(s);
+	if (errno != 0 || !metrics_port) {
+		sd_err("invalid metrics port: %s", s);
+		return -1;
+	}
+	return 0;
+}
+
+static struct option_parser metrics_parsers[] = {
+	{ "host=", metrics_host_parser },
+	{ "port=", metrics_port_parser },
+	{ NULL, NULL },
+};
+
+int metrics_init(char *options)
+{
+	if (option_parse(options, ",", metrics_parsers) < 0)
+		return -1;
+
+	if (create_listen_ports(metrics_host, metrics_port,
+				create_metrics_port_fn, NULL)) {
+		sd_err("failed to listen on the metrics port %d", metrics_port);
+		return -1;
+	}
+	sd_info("metrics on port %d", metrics_port);
+
+	return 0;
+}
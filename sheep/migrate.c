@@ -85,10 +85,11 @@ static size_t get_file_size(const char *path)
 	return stbuf.st_size;
 }
 
-static void for_each_epoch(int (*func)(uint32_t epoch))
+static int for_each_epoch(int (*func)(uint32_t epoch))
 {
 	DIR *dir;
 	struct dirent *d;
+	int ret = 0;
 
 	dir = opendir(epoch_path);
 	if (!dir)
@@ -104,10 +105,33 @@ static void for_each_epoch(int (*func)(uint32_t epoch))
 		if (strlen(d->d_name) != 8)
 			continue;
 
-		if (func(e) != 0)
-			return;
+		ret = func(e);
+		if (ret != 0)
+			break;
 	}
 	closedir(dir);
+	return ret;
+}
+
+/*
+ * Make the files written under 'path' durable with one syncfs() rather than
+ * a synchronous write per file, which dominates the time of a migration of
+ * many epochs
+ */
+static int sync_path(const char *path)
+{
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return -1;
+	}
+	ret = syncfs(fd);
+	if (ret < 0)
+		sd_err("failed to sync %s, %m", path);
+	close(fd);
+	return ret;
 }
 
 /* copy file from 'fname' to 'fname.suffix' */
@@ -143,7 +167,7 @@ static int backup_file(char *fname, char *suffix)
 
 	close(fd);
 
-	fd = open(dst_file, O_CREAT | O_WRONLY | O_DSYNC, 0644);
+	fd = open(dst_file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
 	if (fd < 0) {
 		sd_err("failed to create %s, %m", dst_file);
 		ret = -1;
@@ -195,11 +219,110 @@ static int backup_store(void)
 	if (ret < 0)
 		return ret;
 
-	for_each_epoch(backup_epoch);
+	ret = for_each_epoch(backup_epoch);
+	if (ret < 0)
+		return ret;
+
+	return sync_path(epoch_path);
+}
+
+/*
+ * The epoch logs are converted in two phases so that an interrupted
+ * migration can be resumed.  Each log is first converted into a '.tmp' file
+ * next to it, and when all of them are durable, the marker 'migrate_vN' is
+ * created and the '.tmp' files are renamed over the logs.  A migration which
+ * finds the marker only redoes the renames, since the logs may be converted
+ * already.  The marker is removed after the config is updated to version N.
+ */
+static void epoch_tmp_path(char *path, size_t len, uint32_t epoch)
+{
+	snprintf(path, len, "%s%08u.tmp", epoch_path, epoch);
+}
+
+static void epoch_marker_path(char *path, size_t len, int version)
+{
+	snprintf(path, len, "%smigrate_v%d", epoch_path, version);
+}
+
+static int write_epoch_tmp(uint32_t epoch, const void *nodes, size_t len,
+			   const time_t *t)
+{
+	char path[PATH_MAX];
+	int fd, ret = -1;
+
+	epoch_tmp_path(path, sizeof(path), epoch);
+	fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", path);
+		return -1;
+	}
 
+	if (xwrite(fd, nodes, len) != len) {
+		sd_err("failed to write epoch %"PRIu32" log", epoch);
+		goto out;
+	}
+	if (xwrite(fd, t, sizeof(*t)) != sizeof(*t)) {
+		sd_err("failed to write time to epoch %" PRIu32 " log", epoch);
+		goto out;
+	}
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int commit_epoch_tmp(uint32_t epoch)
+{
+	char tmp[PATH_MAX], path[PATH_MAX];
+
+	epoch_tmp_path(tmp, sizeof(tmp), epoch);
+	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
+	if (rename(tmp, path) < 0 && errno != ENOENT) {
+		sd_err("failed to rename %s to %s, %m", tmp, path);
+		return -1;
+	}
 	return 0;
 }
 
+static int convert_epochs(int version, int (*update)(uint32_t epoch))
+{
+	char marker[PATH_MAX];
+	int fd;
+
+	epoch_marker_path(marker, sizeof(marker), version);
+	if (access(marker, F_OK) == 0) {
+		sd_info("resume the conversion of the epoch logs to v%d",
+			version);
+		goto commit;
+	}
+
+	if (for_each_epoch(update) < 0 || sync_path(epoch_path) < 0)
+		return -1;
+
+	fd = open(marker, O_CREAT | O_WRONLY, 0644);
+	if (fd < 0) {
+		sd_err("failed to create %s, %m", marker);
+		return -1;
+	}
+	close(fd);
+	if (sync_path(epoch_path) < 0)
+		return -1;
+commit:
+	if (for_each_epoch(commit_epoch_tmp) < 0)
+		return -1;
+
+	return sync_path(epoch_path);
+}
+
+static void finish_epochs(int version)
+{
+	char marker[PATH_MAX];
+
+	epoch_marker_path(marker, sizeof(marker), version);
+	if (unlink(marker) < 0 && errno != ENOENT)
+		sd_err("failed to remove %s, %m", marker);
+}
+
 static int update_epoch_from_v0_to_v1(uint32_t epoch)
 {
 	char path[PATH_MAX];
@@ -207,10 +330,10 @@ static int update_epoch_from_v0_to_v1(uint32_t epoch)
 	struct sd_node_v1 nodes_v1[SD_MAX_NODES];
 	size_t nr_nodes;
 	time_t *t;
-	int len, fd, ret;
+	int fd, ret;
 
 	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
-	fd = open(path, O_RDWR | O_DSYNC);
+	fd = open(path, O_RDONLY);
 	if (fd < 0) {
 		if (errno == ENOENT)
 			return 0;
@@ -220,9 +343,9 @@ static int update_epoch_from_v0_to_v1(uint32_t epoch)
 	}
 
 	ret = xread(fd, nodes_v0, sizeof(nodes_v0));
+	close(fd);
 	if (ret < 0) {
 		sd_err("failed to read epoch %"PRIu32" log", epoch);
-		close(fd);
 		return ret;
 	}
 
@@ -235,26 +358,10 @@ static int update_epoch_from_v0_to_v1(uint32_t epoch)
 		nodes_v1[i].space = 0;
 	}
 
-	len = sizeof(nodes_v1[0]) * nr_nodes;
-	ret = xpwrite(fd, nodes_v1, len, 0);
-	if (ret != len) {
-		sd_err("failed to write epoch %"PRIu32" log", epoch);
-		close(fd);
-		return -1;
-	}
-
 	t = (time_t *)&nodes_v0[nr_nodes];
 
-	ret = xpwrite(fd, t, sizeof(*t), len);
-	if (ret != sizeof(*t)) {
-		sd_err("failed to write time to epoch %" PRIu32 " log", epoch);
-		close(fd);
-		return -1;
-	}
-
-	close(fd);
-
-	return 0;
+	return write_epoch_tmp(epoch, nodes_v1,
+			       sizeof(nodes_v1[0]) * nr_nodes, t);
 }
 
 static int migrate_from_v0_to_v1(void)
@@ -276,6 +383,17 @@ static int migrate_from_v0_to_v1(void)
 		return ret;
 	}
 
+	/*
+	 * If the config file contains a space field, the store layout
+	 * is compatible with v1.  In this case, what we need to do is
+	 * only adding version number to the config file.
+	 */
+	if (config.space == 0 &&
+	    convert_epochs(1, update_epoch_from_v0_to_v1) < 0) {
+		close(fd);
+		return -1;
+	}
+
 	config.version = 1;
 	ret = xpwrite(fd, &config, sizeof(config), 0);
 	if (ret != sizeof(config)) {
@@ -286,26 +404,16 @@ static int migrate_from_v0_to_v1(void)
 
 	/* 0.5.1 could wrongly extend the config file, so truncate it here */
 	ret = xftruncate(fd, sizeof(config));
-	if (ret != 0) {
+	if (ret != 0 || fdatasync(fd) != 0) {
 		sd_err("failed to truncate config data, %m");
 		close(fd);
 		return -1;
 	}
 
 	close(fd);
+	finish_epochs(1);
 
-	/*
-	 * If the config file contains a space field, the store layout
-	 * is compatible with v1.  In this case, what we need to do is
-	 * only adding version number to the config file.
-	 */
-	if (config.space > 0)
-		return 0;
-
-	/* upgrade epoch log */
-	for_each_epoch(update_epoch_from_v0_to_v1);
-
-	return ret;
+	return 0;
 }
 
 static int update_epoch_from_v1_to_v2(uint32_t epoch)
@@ -315,10 +423,10 @@ static int update_epoch_from_v1_to_v2(uint32_t epoch)
 	struct sd_node_v2 nodes_v2[SD_MAX_NODES];
 	size_t nr_nodes;
 	time_t *t;
-	int len, fd, ret;
+	int fd, ret;
 
 	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
-	fd = open(path, O_RDWR | O_DSYNC);
+	fd = open(path, O_RDONLY);
 	if (fd < 0) {
 		if (errno == ENOENT)
 			return 0;
@@ -339,9 +447,9 @@ static int update_epoch_from_v1_to_v2(uint32_t epoch)
 	}
 
 	ret = xread(fd, nodes_v1, sizeof(nodes_v1));
+	close(fd);
 	if (ret < 0) {
 		sd_err("failed to read epoch %"PRIu32" log", epoch);
-		close(fd);
 		return ret;
 	}
 
@@ -360,26 +468,10 @@ static int update_epoch_from_v1_to_v2(uint32_t epoch)
 		nodes_v2[i].space = nodes_v1[i].space;
 	}
 
-	len = sizeof(nodes_v2[0]) * nr_nodes;
-	ret = xpwrite(fd, nodes_v2, len, 0);
-	if (ret != len) {
-		sd_err("failed to write epoch %"PRIu32" log", epoch);
-		close(fd);
-		return -1;
-	}
-
 	t = (time_t *)&nodes_v1[nr_nodes];
 
-	ret = xpwrite(fd, t, sizeof(*t), len);
-	if (ret != sizeof(*t)) {
-		sd_err("failed to write time to epoch %" PRIu32 " log", epoch);
-		close(fd);
-		return -1;
-	}
-
-	close(fd);
-
-	return 0;
+	return write_epoch_tmp(epoch, nodes_v2,
+			       sizeof(nodes_v2[0]) * nr_nodes, t);
 }
 
 static int migrate_from_v1_to_v2(void)
@@ -388,6 +480,10 @@ static int migrate_from_v1_to_v2(void)
 	uint16_t version = 2;
 	char store[STORE_LEN] = "plain"; /* we have only the plain driver */
 
+	/* upgrade epoch log */
+	if (convert_epochs(2, update_epoch_from_v1_to_v2) < 0)
+		return -1;
+
 	fd = open(config_path, O_WRONLY | O_DSYNC);
 	if (fd < 0) {
 		sd_err("failed to open config file, %m");
@@ -411,11 +507,9 @@ static int migrate_from_v1_to_v2(void)
 	}
 
 	close(fd);
+	finish_epochs(2);
 
-	/* upgrade epoch log */
-	for_each_epoch(update_epoch_from_v1_to_v2);
-
-	return ret;
+	return 0;
 }
 
 static int migrate_from_v2_to_v3(void)
@@ -477,9 +571,14 @@ static int migrate_from_v3_to_v4(void)
 	bool is_stale = true;
 	int ret;
 
+	/*
+	 * Each disk is converted by its own threads.  An object already renamed
+	 * has no xattr anymore and is skipped, so an interrupted conversion is
+	 * simply run again.
+	 */
 	ret = for_each_object_in_stale(convert_ecidx_xattr2path,
 				       (void *)&is_stale);
-	if (ret < 0) {
+	if (ret != SD_RES_SUCCESS) {
 		sd_emerg("converting store format of stale object directory"
 			 "failed");
 		return ret;
@@ -139,13 +139,43 @@ static inline int inode_create(struct inode *inode, uint32_t vid,
 	return ret;
 }
 
-static void dentry_add(struct inode *parent, struct dentry *dentry)
+/*
+ * Directories are append only, so adding a dentry only writes the new entry
+ * and the header back instead of the whole directory inode.
+ *
+ * Caller must hold the vdi lock.
+ */
+static int dentry_append(uint64_t pino, const struct dentry *dentry, bool dir)
 {
-	uint8_t *tail = parent->data + parent->size;
+	struct inode *parent;
+	int ret;
+
+	parent = fs_read_inode_hdr(pino);
+	if (IS_ERR(parent))
+		return PTR_ERR(parent);
+
+	if (parent->size + sizeof(*dentry) > INODE_DATA_SIZE) {
+		sd_err("directory %016" PRIx64 " is full", pino);
+		ret = SD_RES_NO_SPACE;
+		goto out;
+	}
+
+	ret = sd_write_object(pino, (char *)dentry, sizeof(*dentry),
+			      INODE_META_SIZE + parent->size, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to write %016" PRIx64" %s", pino,
+		       sd_strerror(ret));
+		goto out;
+	}
 
-	parent->nlink++;
-	memcpy(tail, dentry, sizeof(*dentry));
+	if (dir)
+		parent->nlink++;
 	parent->size += sizeof(*dentry);
+	parent->mtime = time(NULL);
+	ret = fs_write_inode_hdr(parent);
+out:
+	free(parent);
+	return ret;
 }
 
 int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
@@ -153,7 +183,7 @@ int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
 	uint64_t myino, pino = parent->ino;
 	uint32_t vid = oid_to_vid(pino);
 	struct inode_data *id = prepare_inode_data(inode, vid, name);
-	struct dentry *entry;
+	struct dentry *entry, new = {};
 	int ret;
 
 	sys->cdrv->lock(vid);
@@ -180,19 +210,15 @@ int fs_create_dir(struct inode *inode, const char *name, struct inode *parent)
 
 	if (unlikely(inode == parent))
 		inode->nlink++; /* I'm root */
-	else {
-		struct dentry new = {
-			.ino = myino,
-			.nlen = strlen(name),
-		};
-		pstrcpy(new.name, NFS_MAXNAMLEN, name);
-		dentry_add(parent, &new);
-	}
 
 	ret = inode_do_create(id);
-	if (ret != SD_RES_SUCCESS)
+	if (ret != SD_RES_SUCCESS || inode == parent)
 		goto out;
-	ret = fs_write_inode_full(parent);
+
+	new.ino = myino;
+	new.nlen = strlen(name);
+	pstrcpy(new.name, NFS_MAXNAMLEN, name);
+	ret = dentry_append(pino, &new, true);
 out:
 	sys->cdrv->unlock(vid);
 	finish_inode_data(id);
@@ -239,9 +265,30 @@ struct inode *fs_read_inode_hdr(uint64_t ino)
 	return inode_read(ino, INODE_HDR_SIZE);
 }
 
+/* Only the used part of the data area is read, the rest is zeroed */
 struct inode *fs_read_inode_full(uint64_t ino)
 {
-	return inode_read(ino, sizeof(struct inode));
+	struct inode *inode;
+	uint64_t len;
+	int ret;
+
+	inode = fs_read_inode_hdr(ino);
+	if (IS_ERR(inode))
+		return inode;
+
+	inode = xrealloc(inode, sizeof(*inode));
+	len = min(inode->size, (uint64_t)INODE_DATA_SIZE);
+	ret = sd_read_object(ino, (char *)inode + INODE_HDR_SIZE,
+			     INODE_EXTENT_SIZE + len, INODE_HDR_SIZE);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read %016" PRIx64 " %s", ino,
+		       sd_strerror(ret));
+		free(inode);
+		return (struct inode *)(intptr_t)-ret;
+	}
+	memset(inode->data + len, 0, INODE_DATA_SIZE - len);
+
+	return inode;
 }
 
 static int inode_write(struct inode *inode, uint64_t size)
@@ -285,63 +332,201 @@ int fs_read_dir(struct inode *inode, uint64_t offset,
 	return ret;
 }
 
-static int dentry_compare(struct dentry *a, struct dentry *b)
+/*
+ * In-memory hashed index of directory entries.
+ *
+ * Lookups used to read the whole directory and scan it linearly, which gets
+ * slow for directories with tens of thousands of entries.  Because
+ * directories are append only, an index stays valid as long as the directory
+ * keeps its ctime; when it grows, only the new tail of dentries is read and
+ * hashed in.  So a lookup normally costs one header read plus a hash probe.
+ *
+ * All NFS requests are served from the single nfsd thread, no locking needed.
+ */
+#define DIR_HASH_BITS	12
+#define DIR_HASH_SIZE	(1 << DIR_HASH_BITS)
+#define DIR_INDEX_MAX	32
+
+struct dir_entry {
+	struct hlist_node hash;
+	uint64_t ino;
+	char name[NFS_MAXNAMLEN];
+};
+
+struct dir_index {
+	uint64_t ino;
+	uint64_t ctime;
+	uint64_t size; /* bytes of dentries already indexed */
+	struct list_node list;
+	struct hlist_head hash[DIR_HASH_SIZE];
+};
+
+static LIST_HEAD(dir_index_list);
+static int nr_dir_index;
+
+static inline struct hlist_head *dir_hash_head(struct dir_index *di,
+					       const char *name)
+{
+	uint64_t hval = sd_hash(name, strnlen(name, NFS_MAXNAMLEN));
+
+	return &di->hash[hval & (DIR_HASH_SIZE - 1)];
+}
+
+static void dir_index_reset(struct dir_index *di)
+{
+	struct dir_entry *de;
+	struct hlist_node *pos;
+	int i;
+
+	for (i = 0; i < DIR_HASH_SIZE; i++) {
+		hlist_for_each_entry(de, pos, &di->hash[i], hash) {
+			hlist_del(&de->hash);
+			free(de);
+		}
+	}
+	di->size = 0;
+}
+
+static struct dir_index *dir_index_get(struct inode *inode)
+{
+	struct dir_index *di;
+
+	list_for_each_entry(di, &dir_index_list, list) {
+		if (di->ino == inode->ino) {
+			list_move(&di->list, &dir_index_list);
+			goto found;
+		}
+	}
+
+	if (nr_dir_index < DIR_INDEX_MAX) {
+		di = xzalloc(sizeof(*di));
+		nr_dir_index++;
+	} else {
+		/* recycle the least recently used one */
+		di = list_entry(dir_index_list.n.prev, struct dir_index,
+				list);
+		list_del(&di->list);
+		dir_index_reset(di);
+	}
+	di->ino = inode->ino;
+	di->ctime = inode->ctime;
+	list_add(&di->list, &dir_index_list);
+found:
+	if (di->ctime != inode->ctime || di->size > inode->size) {
+		dir_index_reset(di);
+		di->ctime = inode->ctime;
+	}
+	return di;
+}
+
+static void dir_index_put(struct dir_index *di)
 {
-	return strcmp(a->name, b->name);
+	list_del(&di->list);
+	dir_index_reset(di);
+	free(di);
+	nr_dir_index--;
+}
+
+/* Hash in the dentries appended since the index was last brought up to date */
+static int dir_index_update(struct dir_index *di, struct inode *inode)
+{
+	uint64_t size = min(inode->size, (uint64_t)INODE_DATA_SIZE);
+	uint64_t len, i, nr;
+	struct dentry *entries;
+	int ret;
+
+	size -= size % sizeof(struct dentry);
+	if (di->size >= size)
+		return SD_RES_SUCCESS;
+
+	len = size - di->size;
+	entries = xmalloc(len);
+	ret = sd_read_object(inode->ino, (char *)entries, len,
+			     INODE_META_SIZE + di->size);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read %016" PRIx64 " %s", inode->ino,
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	nr = len / sizeof(struct dentry);
+	for (i = 0; i < nr; i++) {
+		struct dir_entry *de = xmalloc(sizeof(*de));
+
+		de->ino = entries[i].ino;
+		pstrcpy(de->name, NFS_MAXNAMLEN, entries[i].name);
+		hlist_add_head(&de->hash, dir_hash_head(di, de->name));
+	}
+	di->size = size;
+out:
+	free(entries);
+	return ret;
 }
 
+/* @inode only needs to have the header filled */
 struct dentry *fs_lookup_dir(struct inode *inode, const char *name)
 {
-	struct dentry *tmp, *base = (struct dentry *)inode->data;
-	struct dentry *key = xmalloc(sizeof(*key));
-	uint64_t dentry_count = inode->size / sizeof(struct dentry);
+	struct dentry *key = xzalloc(sizeof(*key));
+	struct dir_index *di;
+	struct dir_entry *de;
+	struct hlist_node *pos;
+	int ret;
 
 	sd_debug("%016"PRIx64", %s", inode->ino, name);
 
 	pstrcpy(key->name, NFS_MAXNAMLEN, name);
 
-	tmp = xlfind(key, base, dentry_count, dentry_compare);
-	if (tmp)
-		*key = *tmp;
-	else {
+	di = dir_index_get(inode);
+	ret = dir_index_update(di, inode);
+	if (ret != SD_RES_SUCCESS) {
+		dir_index_put(di);
 		free(key);
-		key = (struct dentry *)-SD_RES_NOT_FOUND;
+		return (struct dentry *)(intptr_t)-ret;
+	}
+
+	hlist_for_each_entry(de, pos, dir_hash_head(di, key->name), hash) {
+		if (strcmp(de->name, key->name) == 0) {
+			key->ino = de->ino;
+			key->nlen = strlen(de->name);
+			return key;
+		}
 	}
 
-	return key;
+	free(key);
+	return (struct dentry *)-SD_RES_NOT_FOUND;
 }
 
 int fs_create_file(uint64_t pino, struct inode *new, const char *name)
 {
 	uint32_t vid = oid_to_vid(pino);
-	struct inode *inode;
-	struct dentry *dentry;
+	struct dentry dentry = {};
 	int ret;
 
 	ret = inode_create(new, vid, name);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	inode = fs_read_inode_full(pino);
-	if (IS_ERR(inode))
-		return PTR_ERR(inode);
-
-	dentry = (struct dentry *)(inode->data + inode->size);
-	pstrcpy(dentry->name, NFS_MAXNAMLEN, name);
-	dentry->ino = new->ino;
-	inode->size += sizeof(*dentry);
+	dentry.ino = new->ino;
+	dentry.nlen = strlen(name);
+	pstrcpy(dentry.name, NFS_MAXNAMLEN, name);
 
-	ret = fs_write_inode_full(inode);
-	free(inode);
+	sys->cdrv->lock(vid);
+	ret = dentry_append(pino, &dentry, false);
+	sys->cdrv->unlock(vid);
 	return ret;
 }
 
 /* TODO: support extent */
+/*
+ * fs_read() and fs_write() only need the inode header.  File data is inlined
+ * right after the meta area of the inode object, so we read or write just the
+ * requested range instead of the whole 4MB inode on every NFS READ/WRITE.
+ */
 int64_t fs_read(struct inode *inode, void *buffer, uint64_t count,
 		uint64_t offset)
 {
-	uint8_t *start = inode->data + offset;
 	int64_t done = count;
+	int ret;
 
 	if (offset >= inode->size || count == 0)
 		return 0;
@@ -349,7 +534,10 @@ int64_t fs_read(struct inode *inode, void *buffer, uint64_t count,
 	if (offset + count > inode->size)
 		done = inode->size - offset;
 
-	memcpy(buffer, start, done);
+	ret = sd_read_object(inode->ino, buffer, done,
+			     INODE_META_SIZE + offset);
+	if (ret != SD_RES_SUCCESS)
+		return -1;
 
 	return done;
 }
@@ -357,21 +545,29 @@ int64_t fs_read(struct inode *inode, void *buffer, uint64_t count,
 int64_t fs_write(struct inode *inode, void *buffer, uint64_t count,
 		 uint64_t offset)
 {
-	uint8_t *start = inode->data + offset;
 	int64_t done = count;
 	int ret;
 
 	if (count == 0)
 		return 0;
 
-	memcpy(start, buffer, done);
+	if (offset > INODE_DATA_SIZE || count > INODE_DATA_SIZE - offset)
+		return -1;
+
+	ret = sd_write_object(inode->ino, buffer, done,
+			      INODE_META_SIZE + offset, false);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to write %016" PRIx64" %s", inode->ino,
+		       sd_strerror(ret));
+		return -1;
+	}
 
 	/* TODO: lock inode */
 	if ((offset + done) > inode->size)
 		inode->size = offset + done;
 
 	inode->mtime = time(NULL);
-	ret = fs_write_inode_full(inode);
+	ret = fs_write_inode_hdr(inode);
 	if (ret != SD_RES_SUCCESS)
 		done = -1;
 	return done;
@@ -167,7 +167,7 @@ void *nfs3_lookup(struct svc_req *req, struct nfs_arg *argp)
 
 	sd_debug("%016"PRIx64" %s", fh->ino, name);
 
-	inode = fs_read_inode_full(fh->ino);
+	inode = fs_read_inode_hdr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
@@ -250,7 +250,17 @@ void *nfs3_readlink(struct svc_req *req, struct nfs_arg *argp)
 	return NULL;
 }
 
+/*
+ * The data of a READ reply is read by the encoder straight into the send
+ * buffer of the transport, which XDR_INLINE() lends, instead of into
+ * nfs_read_buffer from which the XDR layer would copy it once more.
+ * nfs3_read() only looks up the inode and leaves it in read_inode for
+ * xdr_read_res_inline().  nfs_read_buffer is used only if the transport has
+ * no room for the whole reply, like UDP.
+ */
 static char nfs_read_buffer[RPCSVC_MAXPAYLOAD];
+static struct inode *read_inode;
+static uint64_t read_offset;
 
 void *nfs3_read(struct svc_req *req, struct nfs_arg *argp)
 {
@@ -262,12 +272,15 @@ void *nfs3_read(struct svc_req *req, struct nfs_arg *argp)
 		&result.READ3res_u.resok.file_attributes;
 	struct fattr3 *post = &poa->post_op_attr_u.attributes;
 	struct inode *inode;
-	int ret;
 
 	sd_debug("%016"PRIx64"count %"PRIu64" offset %"PRIu64, fh->ino,
 		 count, offset);
 
-	inode = fs_read_inode_full(fh->ino);
+	/* in case the last reply failed before its encoding */
+	free(read_inode);
+	read_inode = NULL;
+
+	inode = fs_read_inode_hdr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
@@ -279,24 +292,232 @@ void *nfs3_read(struct svc_req *req, struct nfs_arg *argp)
 		}
 	}
 
-	ret = fs_read(inode, nfs_read_buffer, count, offset);
-	if (ret < 0) {
-		result.status = NFS3ERR_IO;
-		goto out_free;
-	}
+	/* what fs_read() is going to read */
+	count = min(count, (uint64_t)RPCSVC_MAXPAYLOAD);
+	if (offset >= inode->size)
+		count = 0;
+	else
+		count = min(count, inode->size - offset);
+
 	result.status = NFS3_OK;
-	result.READ3res_u.resok.count = ret;
-	result.READ3res_u.resok.eof = ret < count;
-	result.READ3res_u.resok.data.data_val = nfs_read_buffer;
-	result.READ3res_u.resok.data.data_len = ret;
+	result.READ3res_u.resok.count = count;
+	result.READ3res_u.resok.eof = offset + count >= inode->size;
+	result.READ3res_u.resok.data.data_val = NULL;
+	result.READ3res_u.resok.data.data_len = count;
 	poa->attributes_follow = true;
 	update_post_attr(inode, post);
-out_free:
-	free(inode);
+	read_inode = inode;
+	read_offset = offset;
 out:
 	return &result;
 }
 
+/* Encode the reply up to the data of objp into buf, returns the length */
+static u_int encode_read_head(char *buf, u_int len, READ3res *objp)
+{
+	READ3resok *resok = &objp->READ3res_u.resok;
+	XDR mem;
+	u_int ret = 0;
+
+	xdrmem_create(&mem, buf, len, XDR_ENCODE);
+	if (!xdr_nfsstat3(&mem, &objp->status))
+		goto out;
+	if (objp->status != NFS3_OK) {
+		if (!xdr_read_resfail(&mem, &objp->READ3res_u.resfail))
+			goto out;
+		ret = xdr_getpos(&mem);
+		goto out;
+	}
+	if (!xdr_post_op_attr(&mem, &resok->file_attributes) ||
+	    !xdr_count3(&mem, &resok->count) ||
+	    !xdr_bool(&mem, &resok->eof) ||
+	    !xdr_u_int(&mem, &resok->data.data_len))
+		goto out;
+	ret = xdr_getpos(&mem);
+out:
+	xdr_destroy(&mem);
+	return ret;
+}
+
+/* The encoder of the READ replies, see nfs3_read() */
+bool_t xdr_read_res_inline(XDR *xdrs, READ3res *objp)
+{
+	READ3resok *resok = &objp->READ3res_u.resok;
+	struct inode *inode = read_inode;
+	u_int len = resok->data.data_len, pad = RNDUP(len) - len, head_len;
+	char head[256], *p;
+	bool_t ret = FALSE;
+
+	if (xdrs->x_op != XDR_ENCODE || objp->status != NFS3_OK || !inode)
+		return xdr_read_res(xdrs, objp);
+	read_inode = NULL;
+
+	head_len = encode_read_head(head, sizeof(head), objp);
+	if (!head_len)
+		goto out;
+
+	p = (char *)XDR_INLINE(xdrs, head_len + len + pad);
+	if (!p) {
+		if (fs_read(inode, nfs_read_buffer, len, read_offset) != len) {
+			objp->status = NFS3ERR_IO;
+			resok->file_attributes.attributes_follow = false;
+		}
+		resok->data.data_val = nfs_read_buffer;
+		ret = xdr_read_res(xdrs, objp);
+		goto out;
+	}
+
+	if (fs_read(inode, p + head_len, len, read_offset) != len) {
+		/*
+		 * The room is taken already, so the error goes with as many
+		 * zeros after it, which the clients don't look at
+		 */
+		objp->status = NFS3ERR_IO;
+		resok->file_attributes.attributes_follow = false;
+		memset(p, 0, head_len + len + pad);
+		ret = encode_read_head(p, head_len, objp) > 0;
+		goto out;
+	}
+	memcpy(p, head, head_len);
+	memset(p + head_len + len, 0, pad);
+	ret = TRUE;
+out:
+	free(inode);
+	return ret;
+}
+
+/*
+ * Write gathering
+ *
+ * The UNSTABLE writes are only copied into the gather buffer of their file
+ * and replied at once.  The writes which overlap or follow the gathered range
+ * are merged into it, and a gather is written out with fs_write(), which
+ * updates the inode once for all of them, when a write doesn't fit into it,
+ * when its slot is taken for another file, on COMMIT, and before the other
+ * requests which may see the file.  All of them run on the nfs thread, so
+ * nothing is locked.
+ *
+ * The write verifier is the boot time of the nfs service plus the number of
+ * the gathers which failed to be written, so it changes whenever gathered
+ * writes are lost, by a restart or by an error, and the clients write them
+ * again on COMMIT.
+ */
+#define NR_GATHERS 16
+#define GATHER_SIZE RPCSVC_MAXPAYLOAD
+
+struct write_gather {
+	struct inode *inode;	/* the header, NULL if the slot is free */
+	uint64_t offset;
+	uint32_t len;
+	uint64_t last_used;
+	char *buf;
+};
+
+static struct write_gather gathers[NR_GATHERS];
+static uint64_t gather_clock, nr_lost_gathers;
+
+static void get_write_verf(writeverf3 verf)
+{
+	uint64_t v = nfs_boot_time + nr_lost_gathers;
+
+	memcpy(verf, &v, sizeof(v));
+}
+
+static struct write_gather *find_gather(uint64_t ino)
+{
+	for (int i = 0; i < NR_GATHERS; i++)
+		if (gathers[i].inode && gathers[i].inode->ino == ino)
+			return gathers + i;
+	return NULL;
+}
+
+/* Write g out and free its slot, returns -1 if the writes are lost */
+static int flush_gather(struct write_gather *g)
+{
+	int ret = 0;
+
+	if (!g)
+		return 0;
+
+	if (g->len && fs_write(g->inode, g->buf, g->len, g->offset) != g->len) {
+		sd_err("lost %"PRIu32" gathered bytes of %016"PRIx64, g->len,
+		       g->inode->ino);
+		nr_lost_gathers++;
+		ret = -1;
+	}
+	free(g->inode);
+	g->inode = NULL;
+	g->len = 0;
+	return ret;
+}
+
+/* Called before the requests of proc other than WRITE and COMMIT */
+void nfs_flush_gathers(int proc, struct nfs_arg *argp)
+{
+	switch (proc) {
+	case NFSPROC3_NULL:
+	case NFSPROC3_WRITE:
+	case NFSPROC3_COMMIT:
+	case NFSPROC3_FSSTAT:
+	case NFSPROC3_FSINFO:
+	case NFSPROC3_PATHCONF:
+		return;
+	case NFSPROC3_GETATTR:
+	case NFSPROC3_SETATTR:
+	case NFSPROC3_ACCESS:
+	case NFSPROC3_READLINK:
+	case NFSPROC3_READ:
+		flush_gather(find_gather(get_svc_fh(argp)->ino));
+		return;
+	default:
+		/* they may see or remove any file */
+		for (int i = 0; i < NR_GATHERS; i++)
+			if (gathers[i].inode)
+				flush_gather(gathers + i);
+		return;
+	}
+}
+
+/* Returns the header of the file with the write applied */
+static struct inode *gather_write(uint64_t ino, const char *data,
+				  uint32_t count, uint64_t offset)
+{
+	struct write_gather *g = find_gather(ino), *victim = gathers;
+	struct inode *inode;
+
+	if (g && (offset < g->offset || offset > g->offset + g->len ||
+		  offset + count > g->offset + GATHER_SIZE)) {
+		flush_gather(g);
+		g = NULL;
+	}
+
+	if (!g) {
+		inode = fs_read_inode_hdr(ino);
+		if (IS_ERR(inode))
+			return inode;
+
+		for (int i = 0; i < NR_GATHERS && victim->inode; i++)
+			if (!gathers[i].inode ||
+			    gathers[i].last_used < victim->last_used)
+				victim = gathers + i;
+		flush_gather(victim);
+
+		g = victim;
+		if (!g->buf)
+			g->buf = xmalloc(GATHER_SIZE);
+		g->inode = inode;
+		g->offset = offset;
+	}
+
+	memcpy(g->buf + offset - g->offset, data, count);
+	g->len = max(g->len, (uint32_t)(offset + count - g->offset));
+	g->last_used = ++gather_clock;
+	g->inode->size = max(g->inode->size, offset + count);
+	g->inode->mtime = time(NULL);
+
+	return g->inode;
+}
+
 void *nfs3_write(struct svc_req *req, struct nfs_arg *argp)
 {
 	static WRITE3res result;
@@ -313,7 +534,31 @@ void *nfs3_write(struct svc_req *req, struct nfs_arg *argp)
 	sd_debug("%016"PRIx64" count %"PRIu64" offset %"PRIu64" stable %d",
 		 fh->ino, count, offset, arg->stable);
 
-	inode = fs_read_inode_full(fh->ino);
+	if (offset > INODE_DATA_SIZE || count > INODE_DATA_SIZE - offset) {
+		result.status = NFS3ERR_FBIG;
+		goto out;
+	}
+
+	if (arg->stable == UNSTABLE && count <= GATHER_SIZE) {
+		inode = gather_write(fh->ino, buffer, count, offset);
+		if (IS_ERR(inode)) {
+			result.status = PTR_ERR(inode) == SD_RES_NO_OBJ ?
+				NFS3ERR_NOENT : NFS3ERR_IO;
+			goto out;
+		}
+		result.status = NFS3_OK;
+		result.WRITE3res_u.resok.count = count;
+		result.WRITE3res_u.resok.committed = UNSTABLE;
+		get_write_verf(result.WRITE3res_u.resok.verf);
+		poa->attributes_follow = true;
+		update_post_attr(inode, post);
+		goto out;
+	}
+
+	/* the gathered writes go first, the verifier tells if they failed */
+	flush_gather(find_gather(fh->ino));
+
+	inode = fs_read_inode_hdr(fh->ino);
 	if (IS_ERR(inode)) {
 		switch (PTR_ERR(inode)) {
 		case SD_RES_NO_OBJ:
@@ -333,8 +578,7 @@ void *nfs3_write(struct svc_req *req, struct nfs_arg *argp)
 	result.status = NFS3_OK;
 	result.WRITE3res_u.resok.count = done;
 	result.WRITE3res_u.resok.committed = FILE_SYNC;
-	memcpy(&result.WRITE3res_u.resok.verf, &nfs_boot_time,
-	       sizeof(nfs_boot_time));
+	get_write_verf(result.WRITE3res_u.resok.verf);
 	poa->attributes_follow = true;
 	update_post_attr(inode, post);
 out_free:
@@ -401,7 +645,7 @@ void *nfs3_mkdir(struct svc_req *req, struct nfs_arg *argp)
 
 	sd_debug("%016"PRIx64" %s", fh->ino, name);
 
-	parent = fs_read_inode_full(fh->ino);
+	parent = fs_read_inode_hdr(fh->ino);
 	if (IS_ERR(parent)) {
 		switch (PTR_ERR(parent)) {
 		case SD_RES_NO_OBJ:
@@ -668,7 +912,7 @@ static uint32_t get_max_size(struct svc_req *req)
 		sd_info("unable to determine socket type, use udp size");
 		goto out;
 	}
-	if (ret == SOCK_STREAM)
+	if (v == SOCK_STREAM)
 		return RPCSVC_MAXPAYLOAD_TCP;
 out:
 	/* UDP is a safe value for all the transport */
@@ -713,11 +957,32 @@ void *nfs3_pathconf(struct svc_req *req, struct nfs_arg *argp)
 	return &result;
 }
 
+/*
+ * The gathered writes of the file are written out.  If they are lost, the
+ * changed verifier makes the client write them again.
+ */
 void *nfs3_commit(struct svc_req *req, struct nfs_arg *argp)
 {
 	static COMMIT3res result;
+	struct svc_fh *fh = get_svc_fh(argp);
+	struct sd_req hdr;
 
-	result.status = NFS3ERR_NOTSUPP;
+	sd_debug("%016"PRIx64, fh->ino);
+
+	flush_gather(find_gather(fh->ino));
+
+	/* the writes may be cached on the way to the disks */
+	if (sys->enable_object_cache || sys->writeback_window) {
+		sd_init_req(&hdr, SD_OP_FLUSH_VDI);
+		hdr.obj.oid = vid_to_vdi_oid(oid_to_vid(fh->ino));
+		if (exec_local_req(&hdr, NULL) != SD_RES_SUCCESS) {
+			result.status = NFS3ERR_IO;
+			goto out;
+		}
+	}
 
+	result.status = NFS3_OK;
+	get_write_verf(result.COMMIT3res_u.resok.verf);
+out:
 	return &result;
 }
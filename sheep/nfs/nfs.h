@@ -17,6 +17,8 @@
 
 #define NFS_PORT 2049
 #define NFS_MAXDATA 8192
+/* a READ reply of RPCSVC_MAXPAYLOAD_TCP and its headers, see nfs.c */
+#define NFS_TCP_SENDSIZE (1024 * 1024 + 4096)
 #define NFS_MAXPATHLEN 1024
 #define NFS_MAXNAMLEN 63
 #define NFS_FHSIZE 32
@@ -999,6 +1001,7 @@ extern void *nfs3_fsstat(struct svc_req *req, struct nfs_arg *argp);
 extern void *nfs3_fsinfo(struct svc_req *req, struct nfs_arg *argp);
 extern void *nfs3_pathconf(struct svc_req *req, struct nfs_arg *argp);
 extern void *nfs3_commit(struct svc_req *req, struct nfs_arg *argp);
+void nfs_flush_gathers(int proc, struct nfs_arg *argp);
 
 /* the xdr functions */
 
@@ -1063,6 +1066,7 @@ extern bool_t xdr_read_args(XDR *, READ3args*);
 extern bool_t xdr_read_resok(XDR *, READ3resok*);
 extern bool_t xdr_read_resfail(XDR *, READ3resfail*);
 extern bool_t xdr_read_res(XDR *, READ3res*);
+extern bool_t xdr_read_res_inline(XDR *, READ3res*);
 extern bool_t xdr_stable_how(XDR *, stable_how*);
 extern bool_t xdr_write_args(XDR *, WRITE3args*);
 extern bool_t xdr_write_resok(XDR *, WRITE3resok*);
@@ -41,7 +41,14 @@ static struct svc_handler nfs3_handlers[] = {
 	NFS_HANDLER(lookup),
 	NFS_HANDLER(access),
 	NFS_HANDLER(readlink),
-	NFS_HANDLER(read),
+	/* the data is encoded without a copy, see nfs3_read() */
+	{
+		(svc_func) nfs3_read,
+		(xdrproc_t) xdr_read_args,
+		(xdrproc_t) xdr_read_res_inline,
+		0,
+		"nfs3.read",
+	},
 	NFS_HANDLER(write),
 	NFS_HANDLER(create),
 	NFS_HANDLER(mkdir),
@@ -101,6 +108,9 @@ static void svc_dispatcher(struct svc_req *reg, SVCXPRT *transp)
 		return;
 	}
 
+	if (handlers == nfs3_handlers)
+		nfs_flush_gathers(proc, &arg);
+
 	handlers[proc].count++;
 	result = handlers[proc].func(reg, &arg);
 	if (result && !svc_sendreply(transp, handlers[proc].encoder,
@@ -135,7 +145,8 @@ static int nfs_init_transport(void)
 	}
 	sd_info("nfs service listen at %d, proto udp", nfs_trans->xp_port);
 
-	nfs_trans = svctcp_create(RPC_ANYSOCK, 0, 0);
+	/* room for the largest READ reply, see nfs3_read() */
+	nfs_trans = svctcp_create(RPC_ANYSOCK, NFS_TCP_SENDSIZE, 0);
 	if (!nfs_trans) {
 		sd_err("svctcp_create failed");
 		return -1;
@@ -0,0 +1,822 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Gateway side object cache
+ *
+ * Data objects of the VDIs which are accessed with SD_FLAG_CMD_CACHE are
+ * cached as whole objects in a local directory (typically on a SSD).  In
+ * writeback mode, writes are only applied to the cached copy and tracked with
+ * a per object dirty bitmap, then pushed to the replicas when the client
+ * sends SD_OP_FLUSH_VDI.  In writethrough mode, writes are forwarded to the
+ * replicas first and the cached copy is updated afterwards, so reads are the
+ * only thing we save.
+ *
+ * Requests which are issued by sheep itself (SD_FLAG_CMD_FWD) never touch the
+ * cache.  Requests from clients which don't use the cache drop any cached
+ * copy of the object after flushing it, so that they see the latest data.
+ *
+ * Unflushed data is volatile like a disk write cache, so the cache directory
+ * is purged at startup.
+ *
+ * The flushes of a VDI are run in rounds.  A flush which comes while a round
+ * is running waits for it and joins the next one, which a single waiter runs
+ * for all of them, so the guests which flush at once push the dirty objects
+ * once and a flush never returns while an object it covers is being pushed
+ * by another one.
+ */
+
+#include "sheep_priv.h"
+
+#define CACHE_NR_BLOCKS		(sizeof(uint64_t) * 8)
+
+/* start reclaiming above the high watermark until we are below the low one */
+#define CACHE_HIGH_WATERMARK	90 /* percent */
+#define CACHE_LOW_WATERMARK	80 /* percent */
+
+struct object_cache_entry {
+	uint64_t oid;
+	uint32_t size;
+	/* block i of the object is dirty if bit i is set */
+	uint64_t bmap;
+	/* the object doesn't exist on the replicas yet */
+	bool create;
+	bool populated;
+	bool deleted;
+	refcnt_t refcnt;
+
+	struct object_cache *oc;
+	struct rb_node node;
+	struct list_node lru_list;
+	struct list_node dirty_list;
+	/* protects the cached data, bmap, create and populated */
+	struct sd_rw_lock lock;
+};
+
+struct object_cache {
+	uint32_t vid;
+	struct rb_node node;
+	struct rb_root entries;
+	struct list_head lru_head;
+	struct list_head dirty_head;
+	/* protects entries, lru_head, dirty_head, deleted and nr_busy */
+	struct sd_rw_lock lock;
+	/* the vdi is deleted, freed with the last busy entry */
+	bool deleted;
+	int nr_busy;
+
+	/* the rounds of the flushes, protected by flush_lock */
+	struct sd_mutex flush_lock;
+	struct sd_cond flush_cond;
+	bool flushing;
+	uint64_t nr_flush_started;
+	uint64_t nr_flush_done;
+	int flush_ret;		/* of the last round done */
+};
+
+struct object_cache_reclaim_work {
+	struct work work;
+};
+
+/* leave room in PATH_MAX for the names of the objects, see get_cache_path() */
+static char cache_dir[PATH_MAX - sizeof("/0123456789abcdef")];
+static uint64_t cache_size;
+static bool cache_writethrough;
+static uint64_t cache_used;
+static uatomic_bool cache_in_reclaim;
+
+static struct rb_root cache_root = RB_ROOT;
+static struct sd_rw_lock cache_root_lock = SD_RW_LOCK_INITIALIZER;
+
+static int object_cache_cmp(const struct object_cache *a,
+			    const struct object_cache *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static int object_cache_entry_cmp(const struct object_cache_entry *a,
+				  const struct object_cache_entry *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+static void get_cache_path(uint64_t oid, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%016"PRIx64, cache_dir, oid);
+}
+
+static void free_object_cache(struct object_cache *oc)
+{
+	sd_destroy_rw_lock(&oc->lock);
+	sd_destroy_mutex(&oc->flush_lock);
+	sd_destroy_cond(&oc->flush_cond);
+	free(oc);
+}
+
+static struct object_cache *find_object_cache(uint32_t vid, bool create)
+{
+	struct object_cache *oc, *p, key = { .vid = vid };
+
+	sd_read_lock(&cache_root_lock);
+	oc = rb_search(&cache_root, &key, node, object_cache_cmp);
+	sd_rw_unlock(&cache_root_lock);
+	if (oc || !create)
+		return oc;
+
+	oc = xzalloc(sizeof(*oc));
+	oc->vid = vid;
+	INIT_RB_ROOT(&oc->entries);
+	INIT_LIST_HEAD(&oc->lru_head);
+	INIT_LIST_HEAD(&oc->dirty_head);
+	sd_init_rw_lock(&oc->lock);
+	sd_init_mutex(&oc->flush_lock);
+	sd_cond_init(&oc->flush_cond);
+
+	sd_write_lock(&cache_root_lock);
+	p = rb_insert(&cache_root, oc, node, object_cache_cmp);
+	sd_rw_unlock(&cache_root_lock);
+	if (p) {
+		/* somebody else created it */
+		free_object_cache(oc);
+		oc = p;
+	} else
+		sd_debug("object cache for %"PRIx32" is created", vid);
+
+	return oc;
+}
+
+static void free_cache_entry(struct object_cache_entry *entry)
+{
+	char path[PATH_MAX];
+
+	get_cache_path(entry->oid, path, sizeof(path));
+	if (unlink(path) < 0 && errno != ENOENT)
+		sd_err("failed to unlink %s, %m", path);
+	if (entry->populated)
+		uatomic_sub(&cache_used, entry->size);
+
+	sd_destroy_rw_lock(&entry->lock);
+	free(entry);
+}
+
+static struct object_cache_entry *get_cache_entry(struct object_cache *oc,
+						  uint64_t oid, bool create)
+{
+	struct object_cache_entry *entry, *p, key = { .oid = oid };
+
+	sd_write_lock(&oc->lock);
+	entry = rb_search(&oc->entries, &key, node, object_cache_entry_cmp);
+	if (entry) {
+		refcount_inc(&entry->refcnt);
+		list_move_tail(&entry->lru_list, &oc->lru_head);
+		goto out;
+	}
+
+	if (!create)
+		goto out;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->oid = oid;
+	entry->size = get_objsize(oid, get_vdi_object_size(oc->vid));
+	entry->oc = oc;
+	refcount_set(&entry->refcnt, 1);
+	INIT_LIST_NODE(&entry->dirty_list);
+	sd_init_rw_lock(&entry->lock);
+
+	p = rb_insert(&oc->entries, entry, node, object_cache_entry_cmp);
+	sd_assert(!p);
+	list_add_tail(&entry->lru_list, &oc->lru_head);
+out:
+	sd_rw_unlock(&oc->lock);
+
+	return entry;
+}
+
+static void put_cache_entry(struct object_cache_entry *entry)
+{
+	struct object_cache *oc = entry->oc;
+	bool release, release_oc = false;
+
+	/* refcnt and deleted are checked together with the eviction path */
+	sd_write_lock(&oc->lock);
+	release = refcount_dec(&entry->refcnt) == 0 && entry->deleted;
+	if (release && oc->deleted)
+		release_oc = --oc->nr_busy == 0;
+	sd_rw_unlock(&oc->lock);
+
+	if (release)
+		free_cache_entry(entry);
+	if (release_oc)
+		free_object_cache(oc);
+}
+
+/* Called with oc->lock held for write */
+static void unlink_cache_entry(struct object_cache_entry *entry)
+{
+	struct object_cache *oc = entry->oc;
+
+	rb_erase(&entry->node, &oc->entries);
+	list_del(&entry->lru_list);
+	if (list_linked(&entry->dirty_list))
+		list_del(&entry->dirty_list);
+	entry->deleted = true;
+}
+
+static void reclaim_work(struct work *work);
+static void reclaim_done(struct work *work);
+
+static void object_cache_try_reclaim(void)
+{
+	struct object_cache_reclaim_work *rw;
+
+	if (uatomic_read(&cache_used) <
+	    cache_size / 100 * CACHE_HIGH_WATERMARK)
+		return;
+
+	if (!uatomic_set_true(&cache_in_reclaim))
+		return;
+
+	rw = xzalloc(sizeof(*rw));
+	rw->work.fn = reclaim_work;
+	rw->work.done = reclaim_done;
+	queue_work(sys->reclaim_wqueue, &rw->work);
+}
+
+static int cache_pread(struct object_cache_entry *entry, void *buf,
+		       size_t len, off_t offset)
+{
+	char path[PATH_MAX];
+	int fd, ret = SD_RES_SUCCESS;
+
+	get_cache_path(entry->oid, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return SD_RES_EIO;
+	}
+
+	if (xpread(fd, buf, len, offset) != len) {
+		sd_err("failed to read %s, %m", path);
+		ret = SD_RES_EIO;
+	}
+	close(fd);
+
+	return ret;
+}
+
+static int cache_pwrite(struct object_cache_entry *entry, const void *buf,
+			size_t len, off_t offset, bool create)
+{
+	char path[PATH_MAX];
+	int fd, flags = O_WRONLY, ret = SD_RES_SUCCESS;
+
+	if (create)
+		flags |= O_CREAT | O_TRUNC;
+
+	get_cache_path(entry->oid, path, sizeof(path));
+	fd = open(path, flags, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		return SD_RES_EIO;
+	}
+
+	if (xpwrite(fd, buf, len, offset) != len) {
+		sd_err("failed to write %s, %m", path);
+		ret = SD_RES_EIO;
+	}
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Fill the cached copy with the whole object.  The object is read from 'src',
+ * which is the oid itself or the base object of a copy-on-write request.  If
+ * 'src' is zero, the object is newly created and starts zero-filled.
+ *
+ * Called with entry->lock held for write.
+ */
+static int populate_cache_entry(struct object_cache_entry *entry, uint64_t src)
+{
+	char *buf;
+	int ret;
+
+	buf = xvalloc(entry->size);
+	if (src) {
+		ret = sd_read_object_fwd(src, buf, entry->size, 0);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	} else
+		memset(buf, 0, entry->size);
+
+	ret = cache_pwrite(entry, buf, entry->size, 0, true);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	entry->populated = true;
+	uatomic_add(&cache_used, entry->size);
+out:
+	free(buf);
+	return ret;
+}
+
+static int push_cache_blocks(struct object_cache_entry *entry, int start,
+			     int end)
+{
+	size_t bsize = entry->size / CACHE_NR_BLOCKS;
+	size_t len = (end - start) * bsize;
+	off_t offset = start * bsize;
+	char *buf;
+	int ret;
+
+	buf = xvalloc(len);
+	ret = cache_pread(entry, buf, len, offset);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = sd_write_object_fwd(entry->oid, buf, len, offset, false);
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Push the dirty blocks of the entry to the replicas.  Contiguous dirty blocks
+ * are sent with a single request.
+ *
+ * Called with entry->lock held for write.
+ */
+static int push_cache_entry(struct object_cache_entry *entry)
+{
+	int start, end, ret = SD_RES_SUCCESS;
+
+	if (!entry->bmap)
+		return SD_RES_SUCCESS;
+
+	if (entry->create) {
+		char *buf = xvalloc(entry->size);
+
+		ret = cache_pread(entry, buf, entry->size, 0);
+		if (ret == SD_RES_SUCCESS)
+			ret = sd_write_object_fwd(entry->oid, buf, entry->size,
+						  0, true);
+		free(buf);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+
+		entry->create = false;
+		entry->bmap = 0;
+		return SD_RES_SUCCESS;
+	}
+
+	for (start = 0; start < CACHE_NR_BLOCKS; start = end) {
+		if (!(entry->bmap & (UINT64_C(1) << start))) {
+			end = start + 1;
+			continue;
+		}
+
+		for (end = start + 1; end < CACHE_NR_BLOCKS; end++)
+			if (!(entry->bmap & (UINT64_C(1) << end)))
+				break;
+
+		ret = push_cache_blocks(entry, start, end);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	entry->bmap = 0;
+
+	return ret;
+}
+
+static uint64_t calc_dirty_bmap(uint32_t objsize, uint64_t offset,
+				uint32_t len)
+{
+	uint32_t bsize = objsize / CACHE_NR_BLOCKS;
+	int start = offset / bsize, end = DIV_ROUND_UP(offset + len, bsize);
+	uint64_t bmap = 0;
+
+	while (start < end)
+		bmap |= UINT64_C(1) << start++;
+
+	return bmap;
+}
+
+static void mark_dirty(struct object_cache_entry *entry, uint64_t offset,
+		       uint32_t len)
+{
+	struct object_cache *oc = entry->oc;
+
+	entry->bmap |= calc_dirty_bmap(entry->size, offset, len);
+
+	sd_write_lock(&oc->lock);
+	if (!list_linked(&entry->dirty_list) && !entry->deleted)
+		list_add_tail(&entry->dirty_list, &oc->dirty_head);
+	sd_rw_unlock(&oc->lock);
+}
+
+static int object_cache_read(struct object_cache_entry *entry,
+			     struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	int ret;
+
+	sd_read_lock(&entry->lock);
+	if (!entry->populated) {
+		sd_rw_unlock(&entry->lock);
+		sd_write_lock(&entry->lock);
+		if (!entry->populated) {
+			ret = populate_cache_entry(entry, hdr->obj.oid);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+		}
+	}
+
+	ret = cache_pread(entry, req->data, hdr->data_length, hdr->obj.offset);
+	if (ret == SD_RES_SUCCESS)
+		req->rp.data_length = hdr->data_length;
+out:
+	sd_rw_unlock(&entry->lock);
+	return ret;
+}
+
+static int object_cache_write(struct object_cache_entry *entry,
+			      struct request *req, bool create)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t src = 0;
+	int ret;
+
+	sd_write_lock(&entry->lock);
+	if (!entry->populated) {
+		if (!create)
+			src = hdr->obj.oid;
+		else if (hdr->flags & SD_FLAG_CMD_COW)
+			src = hdr->obj.cow_oid;
+
+		ret = populate_cache_entry(entry, src);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		entry->create = create;
+	}
+
+	ret = cache_pwrite(entry, req->data, hdr->data_length, hdr->obj.offset,
+			   false);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (entry->create)
+		/* the whole object is pushed at flush time */
+		mark_dirty(entry, 0, entry->size);
+	else
+		mark_dirty(entry, hdr->obj.offset, hdr->data_length);
+out:
+	sd_rw_unlock(&entry->lock);
+	return ret;
+}
+
+/*
+ * In writethrough mode, the cached copy is only updated after the replicas
+ * accept the write.  We don't populate the cache with writes, the next read
+ * will do it.
+ */
+static int object_cache_writethrough(struct object_cache *oc,
+				     struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct object_cache_entry *entry;
+	int ret;
+
+	ret = gateway_forward_request(req);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	entry = get_cache_entry(oc, hdr->obj.oid, false);
+	if (!entry)
+		return ret;
+
+	sd_write_lock(&entry->lock);
+	if (entry->populated &&
+	    cache_pwrite(entry, req->data, hdr->data_length, hdr->obj.offset,
+			 false) != SD_RES_SUCCESS) {
+		/* the cached copy is stale, drop it */
+		sd_write_lock(&oc->lock);
+		if (!entry->deleted)
+			unlink_cache_entry(entry);
+		sd_rw_unlock(&oc->lock);
+	}
+	sd_rw_unlock(&entry->lock);
+	put_cache_entry(entry);
+
+	return ret;
+}
+
+bool bypass_object_cache_oid(const struct request *req, uint64_t oid)
+{
+	if (!sys->enable_object_cache)
+		return true;
+
+	/* requests from sheep itself must reach the replicas */
+	if (req->rq.flags & SD_FLAG_CMD_FWD)
+		return true;
+
+	if (!is_data_obj(oid) || is_erasure_oid(oid))
+		return true;
+
+	if (!(req->rq.flags & SD_FLAG_CMD_CACHE) ||
+	    (req->rq.flags & SD_FLAG_CMD_DIRECT)) {
+		/* make sure that the non-cached request sees the latest data */
+		object_cache_drop(oid);
+		return true;
+	}
+
+	return false;
+}
+
+bool bypass_object_cache(const struct request *req)
+{
+	return bypass_object_cache_oid(req, req->rq.obj.oid);
+}
+
+int object_cache_handle_request(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t oid = hdr->obj.oid;
+	struct object_cache *oc;
+	struct object_cache_entry *entry;
+	bool create = false;
+	int ret;
+
+	sd_debug("%08x, %016"PRIx64", len %"PRIu32", off %"PRIu32, hdr->opcode,
+		 oid, hdr->data_length, hdr->obj.offset);
+
+	oc = find_object_cache(oid_to_vid(oid), true);
+
+	switch (hdr->opcode) {
+	case SD_OP_READ_OBJ:
+		entry = get_cache_entry(oc, oid, true);
+		ret = object_cache_read(entry, req);
+		break;
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		create = true;
+		/* fall through */
+	case SD_OP_WRITE_OBJ:
+		if (cache_writethrough) {
+			if (create && (hdr->flags & SD_FLAG_CMD_COW))
+				return gateway_handle_cow(req);
+			return object_cache_writethrough(oc, req);
+		}
+		entry = get_cache_entry(oc, oid, true);
+		ret = object_cache_write(entry, req, create);
+		break;
+	default:
+		sd_err("unexpected operation %02x", hdr->opcode);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	if (ret != SD_RES_SUCCESS) {
+		sd_write_lock(&oc->lock);
+		if (!entry->populated && !entry->deleted)
+			unlink_cache_entry(entry);
+		sd_rw_unlock(&oc->lock);
+	}
+	put_cache_entry(entry);
+
+	object_cache_try_reclaim();
+
+	return ret;
+}
+
+static int push_dirty_entries(struct object_cache *oc)
+{
+	struct object_cache_entry *entry;
+	int ret = SD_RES_SUCCESS;
+
+	for (;;) {
+		sd_write_lock(&oc->lock);
+		if (list_empty(&oc->dirty_head)) {
+			sd_rw_unlock(&oc->lock);
+			break;
+		}
+		entry = list_first_entry(&oc->dirty_head,
+					 struct object_cache_entry, dirty_list);
+		list_del(&entry->dirty_list);
+		refcount_inc(&entry->refcnt);
+		sd_rw_unlock(&oc->lock);
+
+		sd_write_lock(&entry->lock);
+		ret = push_cache_entry(entry);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to flush %016"PRIx64", %s", entry->oid,
+			       sd_strerror(ret));
+			/* keep it dirty so that the next flush retries */
+			mark_dirty(entry, 0, 0);
+		}
+		sd_rw_unlock(&entry->lock);
+		put_cache_entry(entry);
+
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+
+	return ret;
+}
+
+int object_cache_flush_vdi(uint32_t vid)
+{
+	struct object_cache *oc;
+	uint64_t round;
+	int ret;
+
+	oc = find_object_cache(vid, false);
+	if (!oc)
+		return SD_RES_SUCCESS;
+
+	sd_mutex_lock(&oc->flush_lock);
+	/* the running round may have passed our writes already */
+	round = oc->nr_flush_started + 1;
+	while (oc->nr_flush_done < round) {
+		if (oc->flushing) {
+			sd_cond_wait(&oc->flush_cond, &oc->flush_lock);
+			continue;
+		}
+
+		oc->flushing = true;
+		oc->nr_flush_started++;
+		sd_mutex_unlock(&oc->flush_lock);
+
+		sd_debug("flush object cache of %"PRIx32, vid);
+		ret = push_dirty_entries(oc);
+
+		sd_mutex_lock(&oc->flush_lock);
+		oc->flushing = false;
+		oc->nr_flush_done = oc->nr_flush_started;
+		oc->flush_ret = ret;
+		sd_cond_broadcast(&oc->flush_cond);
+	}
+	/* a later round covers our writes as well */
+	ret = oc->flush_ret;
+	sd_mutex_unlock(&oc->flush_lock);
+
+	return ret;
+}
+
+/* Flush the cached copy of the object and remove it from the cache */
+void object_cache_drop(uint64_t oid)
+{
+	struct object_cache *oc;
+	struct object_cache_entry *entry;
+	int ret;
+
+	oc = find_object_cache(oid_to_vid(oid), false);
+	if (!oc)
+		return;
+
+	entry = get_cache_entry(oc, oid, false);
+	if (!entry)
+		return;
+
+	sd_write_lock(&entry->lock);
+	ret = push_cache_entry(entry);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to flush %016"PRIx64", %s", oid,
+		       sd_strerror(ret));
+
+	sd_write_lock(&oc->lock);
+	if (ret == SD_RES_SUCCESS && !entry->deleted)
+		unlink_cache_entry(entry);
+	sd_rw_unlock(&oc->lock);
+	sd_rw_unlock(&entry->lock);
+
+	put_cache_entry(entry);
+}
+
+/* Discard all the cached objects of the deleted VDI, including dirty ones */
+void object_cache_delete(uint32_t vid)
+{
+	struct object_cache *oc;
+	struct object_cache_entry *entry;
+	bool release;
+
+	oc = find_object_cache(vid, false);
+	if (!oc)
+		return;
+
+	sd_write_lock(&cache_root_lock);
+	rb_erase(&oc->node, &cache_root);
+	sd_rw_unlock(&cache_root_lock);
+
+	sd_write_lock(&oc->lock);
+	rb_for_each_entry(entry, &oc->entries, node) {
+		unlink_cache_entry(entry);
+		if (refcount_read(&entry->refcnt) == 0)
+			free_cache_entry(entry);
+		else
+			oc->nr_busy++;
+	}
+	/* the entries still in use free it when they are put */
+	oc->deleted = true;
+	release = oc->nr_busy == 0;
+	sd_rw_unlock(&oc->lock);
+
+	if (release)
+		free_object_cache(oc);
+
+	sd_debug("object cache of %"PRIx32" is deleted", vid);
+}
+
+/*
+ * Evict clean, unused objects in LRU order until the usage is below the low
+ * watermark.  Returns true if we reached the low watermark.
+ */
+static bool evict_clean_entries(void)
+{
+	struct object_cache *oc;
+	struct object_cache_entry *entry;
+	uint64_t low = cache_size / 100 * CACHE_LOW_WATERMARK;
+
+	sd_read_lock(&cache_root_lock);
+	rb_for_each_entry(oc, &cache_root, node) {
+		sd_write_lock(&oc->lock);
+		list_for_each_entry(entry, &oc->lru_head, lru_list) {
+			if (uatomic_read(&cache_used) < low)
+				break;
+			if (refcount_read(&entry->refcnt) ||
+			    list_linked(&entry->dirty_list))
+				continue;
+
+			unlink_cache_entry(entry);
+			free_cache_entry(entry);
+		}
+		sd_rw_unlock(&oc->lock);
+
+		if (uatomic_read(&cache_used) < low)
+			break;
+	}
+	sd_rw_unlock(&cache_root_lock);
+
+	return uatomic_read(&cache_used) < low;
+}
+
+static void reclaim_work(struct work *work)
+{
+	struct object_cache *oc;
+
+	if (evict_clean_entries())
+		return;
+
+	/* too many dirty objects, flush them and try again */
+	sd_read_lock(&cache_root_lock);
+	rb_for_each_entry(oc, &cache_root, node)
+		object_cache_flush_vdi(oc->vid);
+	sd_rw_unlock(&cache_root_lock);
+
+	if (!evict_clean_entries())
+		sd_warn("object cache is full, used %"PRIu64", size %"PRIu64,
+			uatomic_read(&cache_used), cache_size);
+}
+
+static void reclaim_done(struct work *work)
+{
+	struct object_cache_reclaim_work *rw =
+		container_of(work, struct object_cache_reclaim_work, work);
+
+	uatomic_set_false(&cache_in_reclaim);
+	free(rw);
+}
+
+int object_cache_init(const char *path, uint64_t size, bool writethrough)
+{
+	if (strlen(path) >= sizeof(cache_dir)) {
+		sd_err("%s is too long for the object cache", path);
+		return -1;
+	}
+
+	if (xmkdir(path, sd_def_dmode) < 0) {
+		sd_err("failed to create %s, %m", path);
+		return -1;
+	}
+
+	/* unflushed data of the previous run is meaningless */
+	if (purge_directory(path) < 0) {
+		sd_err("failed to purge %s", path);
+		return -1;
+	}
+
+	pstrcpy(cache_dir, sizeof(cache_dir), path);
+	cache_size = size;
+	cache_writethrough = writethrough;
+	sys->enable_object_cache = true;
+
+	sd_info("object cache is enabled, %s, size %"PRIu64", %s", cache_dir,
+		cache_size, writethrough ? "writethrough" : "writeback");
+
+	return 0;
+}
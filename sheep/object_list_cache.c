@@ -13,18 +13,50 @@
 
 #include "sheep_priv.h"
 
+/*
+ * Each entry remembers the tree_version which inserted it, and removed oids
+ * are kept as tombstones in removed_root, so that get_obj_list_delta() can tell
+ * the changes since any version newer than min_version.  The generation
+ * changes on every start and format, so deltas never span them.
+ *
+ * The oids are split into shards by oid range, each with its own lock, so that
+ * the object creations of different vdis don't contend on a single lock and an
+ * update rebuilds only the flat buffer of its own shard.  The data objects are
+ * spread by the high bits of their vid, the few vdi, attribute, btree and
+ * ledger objects share the last shard.  Walking the shards in order walks the
+ * oids in order, which the receivers of the lists rely on.
+ */
 struct objlist_cache_entry {
 	uint64_t oid;
+	uint64_t version;
 	struct rb_node node;
 };
 
-struct objlist_cache {
-	int tree_version;
-	int buf_version;
+#define OBJLIST_SHARD_BITS	8
+/* The oid bits above the vid, see SD_NR_VDIS */
+#define OBJLIST_FLAG_SHIFT	(VDI_SPACE_SHIFT + 24)
+#define NR_OBJLIST_SHARDS	((1 << OBJLIST_SHARD_BITS) + 1)
+
+/* Tombstones of a shard beyond this are dropped, and so are older deltas */
+#define MAX_OBJLIST_TOMBSTONES	(1 << (20 - OBJLIST_SHARD_BITS))
+
+struct objlist_shard {
+	struct sd_rw_lock lock;
+	struct rb_root root;
 	int cache_size;
+	uint64_t version; /* the last change to this shard */
+	uint64_t buf_version;
 	uint64_t *buf;
-	struct rb_root root;
-	struct sd_rw_lock lock;
+
+	uint64_t min_version;
+	int nr_removed;
+	struct rb_root removed_root;
+};
+
+struct objlist_cache {
+	uint64_t tree_version;
+	uint64_t generation;
+	struct objlist_shard shards[NR_OBJLIST_SHARDS];
 };
 
 struct objlist_deletion_work {
@@ -34,10 +66,48 @@ struct objlist_deletion_work {
 
 static struct objlist_cache obj_list_cache = {
 	.tree_version	= 1,
-	.root		= RB_ROOT,
-	.lock		= SD_RW_LOCK_INITIALIZER,
 };
 
+static uint64_t new_generation(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void __attribute__((constructor)) objlist_cache_init(void)
+{
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++) {
+		struct objlist_shard *shard = obj_list_cache.shards + i;
+
+		sd_init_rw_lock(&shard->lock);
+		INIT_RB_ROOT(&shard->root);
+		INIT_RB_ROOT(&shard->removed_root);
+	}
+	obj_list_cache.generation = new_generation();
+}
+
+/* Keep the order of oids: data objects first, sorted by vid */
+static struct objlist_shard *oid_to_shard(uint64_t oid)
+{
+	int idx;
+
+	if (oid >> OBJLIST_FLAG_SHIFT)
+		idx = NR_OBJLIST_SHARDS - 1;
+	else
+		idx = oid >> (OBJLIST_FLAG_SHIFT - OBJLIST_SHARD_BITS);
+
+	return obj_list_cache.shards + idx;
+}
+
+/* Take a new version, called with the write lock of the shard held */
+static uint64_t objlist_new_version(struct objlist_shard *shard)
+{
+	shard->version = uatomic_add_return(&obj_list_cache.tree_version, 1);
+	return shard->version;
+}
+
 static int objlist_cache_cmp(const struct objlist_cache_entry *a,
 			     const struct objlist_cache_entry *b)
 {
@@ -50,105 +120,307 @@ static struct objlist_cache_entry *objlist_cache_rb_insert(struct rb_root *root,
 	return rb_insert(root, new, node, objlist_cache_cmp);
 }
 
-static int objlist_cache_rb_remove(struct rb_root *root, uint64_t oid)
+static void objlist_cache_destroy(struct rb_root *root)
+{
+	struct objlist_cache_entry *entry;
+
+	rb_for_each_entry(entry, root, node) {
+		rb_erase(&entry->node, root);
+		free_tag(entry, MEM_OBJLIST);
+	}
+}
+
+/* Called with the write lock of the shard held */
+static void objlist_cache_drop_tombstones(struct objlist_shard *shard)
 {
-	struct objlist_cache_entry *entry,  key = { .oid = oid  };
+	objlist_cache_destroy(&shard->removed_root);
+	INIT_RB_ROOT(&shard->removed_root);
+	shard->nr_removed = 0;
+	shard->min_version = uatomic_read(&obj_list_cache.tree_version);
+}
 
-	entry = rb_search(root, &key, node, objlist_cache_cmp);
-	if (!entry)
-		return -1;
+/* Move the entry to the tombstones, called with the write lock held */
+static void objlist_cache_erase(struct objlist_shard *shard,
+				struct objlist_cache_entry *entry)
+{
+	rb_erase(&entry->node, &shard->root);
+	shard->cache_size--;
 
-	rb_erase(&entry->node, root);
-	free(entry);
+	if (shard->nr_removed >= MAX_OBJLIST_TOMBSTONES)
+		objlist_cache_drop_tombstones(shard);
 
-	return 0;
+	entry->version = objlist_new_version(shard);
+	rb_insert(&shard->removed_root, entry, node, objlist_cache_cmp);
+	shard->nr_removed++;
 }
 
 void objlist_cache_remove(uint64_t oid)
 {
-	sd_write_lock(&obj_list_cache.lock);
-	if (!objlist_cache_rb_remove(&obj_list_cache.root, oid)) {
-		obj_list_cache.cache_size--;
-		obj_list_cache.tree_version++;
-	}
-	sd_rw_unlock(&obj_list_cache.lock);
+	struct objlist_shard *shard = oid_to_shard(oid);
+	struct objlist_cache_entry *entry, key = { .oid = oid };
+
+	sd_write_lock(&shard->lock);
+	entry = rb_search(&shard->root, &key, node, objlist_cache_cmp);
+	if (entry)
+		objlist_cache_erase(shard, entry);
+	sd_rw_unlock(&shard->lock);
 }
 
 int objlist_cache_insert(uint64_t oid)
 {
+	struct objlist_shard *shard = oid_to_shard(oid);
 	struct objlist_cache_entry *entry, *p;
 
-	entry = xzalloc(sizeof(*entry));
+	entry = xzalloc_tag(sizeof(*entry), MEM_OBJLIST);
 	entry->oid = oid;
 	rb_init_node(&entry->node);
 
-	sd_write_lock(&obj_list_cache.lock);
-	p = objlist_cache_rb_insert(&obj_list_cache.root, entry);
+	sd_write_lock(&shard->lock);
+	p = objlist_cache_rb_insert(&shard->root, entry);
 	if (p)
-		free(entry);
+		free_tag(entry, MEM_OBJLIST);
 	else {
-		obj_list_cache.cache_size++;
-		obj_list_cache.tree_version++;
+		shard->cache_size++;
+		entry->version = objlist_new_version(shard);
+
+		p = rb_search(&shard->removed_root, entry, node,
+			      objlist_cache_cmp);
+		if (p) {
+			rb_erase(&p->node, &shard->removed_root);
+			shard->nr_removed--;
+			free_tag(p, MEM_OBJLIST);
+		}
 	}
-	sd_rw_unlock(&obj_list_cache.lock);
+	sd_rw_unlock(&shard->lock);
 
 	return 0;
 }
 
-int get_obj_list(const struct sd_req *hdr, struct sd_rsp *rsp, void *data)
+/* Append the oids of the shard to buf, which has room for len oids */
+static int copy_shard(struct objlist_shard *shard, uint64_t *buf, size_t len,
+		      size_t *nr_oids)
 {
-	int nr = 0, ret = SD_RES_SUCCESS;
 	struct objlist_cache_entry *entry;
-	uint64_t *newbuf = NULL;
+	int nr = 0, ret = SD_RES_SUCCESS;
+	uint64_t *newbuf;
 
 	/* first try getting the cached buffer with only a read lock held */
-	sd_read_lock(&obj_list_cache.lock);
-	if (obj_list_cache.tree_version == obj_list_cache.buf_version)
+	sd_read_lock(&shard->lock);
+	if (shard->version == shard->buf_version)
 		goto ready;
 
 	/* if that fails grab a write lock for the usually necessary update */
-	sd_rw_unlock(&obj_list_cache.lock);
-	sd_write_lock(&obj_list_cache.lock);
-	if (obj_list_cache.tree_version == obj_list_cache.buf_version)
+	sd_rw_unlock(&shard->lock);
+	sd_write_lock(&shard->lock);
+	if (shard->version == shard->buf_version)
 		goto ready;
 
-	/* Update obj_list_cache.buf indirectly to keep previous pointer */
-	newbuf = realloc(obj_list_cache.buf,
-			 obj_list_cache.cache_size * sizeof(uint64_t));
+	/* Update shard->buf indirectly to keep previous pointer */
+	newbuf = realloc_tag(shard->buf, shard->cache_size * sizeof(uint64_t),
+			     MEM_OBJLIST);
 	if (!newbuf && errno == ENOMEM) {
 		sd_err("Failed to allocate memory for object list");
 		ret = SD_RES_NO_MEM;
 		goto out;
 	}
 
-	obj_list_cache.buf_version = obj_list_cache.tree_version;
-	obj_list_cache.buf = newbuf;
+	shard->buf_version = shard->version;
+	shard->buf = newbuf;
 
-	rb_for_each_entry(entry, &obj_list_cache.root, node) {
-		obj_list_cache.buf[nr++] = entry->oid;
+	rb_for_each_entry(entry, &shard->root, node) {
+		shard->buf[nr++] = entry->oid;
 	}
 
 ready:
-	if (hdr->data_length < obj_list_cache.cache_size * sizeof(uint64_t)) {
-		sd_err("GET_OBJ_LIST buffer too small");
+	if (len - *nr_oids < shard->cache_size) {
 		ret = SD_RES_BUFFER_SMALL;
 		goto out;
 	}
 
-	rsp->data_length = obj_list_cache.cache_size * sizeof(uint64_t);
-	memcpy(data, obj_list_cache.buf, rsp->data_length);
-
+	memcpy(buf + *nr_oids, shard->buf, shard->cache_size * sizeof(*buf));
+	*nr_oids += shard->cache_size;
 out:
-	sd_rw_unlock(&obj_list_cache.lock);
+	sd_rw_unlock(&shard->lock);
 	return ret;
 }
 
+/* The number of the oids in the cache */
+size_t objlist_cache_nr(void)
+{
+	size_t nr = 0;
+
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++) {
+		struct objlist_shard *shard = obj_list_cache.shards + i;
+
+		sd_read_lock(&shard->lock);
+		nr += shard->cache_size;
+		sd_rw_unlock(&shard->lock);
+	}
+
+	return nr;
+}
+
+int get_obj_list(const struct sd_req *hdr, struct sd_rsp *rsp, void *data)
+{
+	size_t len = hdr->data_length / sizeof(uint64_t), nr = 0;
+	int ret;
+
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++) {
+		ret = copy_shard(obj_list_cache.shards + i, data, len, &nr);
+		if (ret == SD_RES_BUFFER_SMALL)
+			sd_err("GET_OBJ_LIST buffer too small");
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+
+	rsp->data_length = nr * sizeof(uint64_t);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Append the oids of root changed since version to buf, which has room for len
+ * oids.  Returns the number of the oids, or -1 if they don't fit in.
+ */
+static int copy_changes(struct rb_root *root, uint64_t version,
+			uint64_t *buf, size_t len)
+{
+	struct objlist_cache_entry *entry;
+	int nr = 0;
+
+	rb_for_each_entry(entry, root, node) {
+		if (entry->version <= version)
+			continue;
+		if (nr == len)
+			return -1;
+		buf[nr++] = entry->oid;
+	}
+
+	return nr;
+}
+
+/*
+ * Collect the inserted oids since version into buf and the removed ones into
+ * removed, which grows as needed.  Returns SD_RES_SUCCESS, SD_RES_BUFFER_SMALL,
+ * or SD_RES_NO_TAG if the changes are not known any more.
+ */
+static int collect_changes(uint64_t version, uint64_t *buf, size_t len,
+			   size_t *nr_inserted, uint64_t **removed,
+			   size_t *nr_removed)
+{
+	size_t size = 0;
+
+	*nr_inserted = *nr_removed = 0;
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++) {
+		struct objlist_shard *shard = obj_list_cache.shards + i;
+		int nr;
+
+		sd_read_lock(&shard->lock);
+		if (version < shard->min_version) {
+			sd_rw_unlock(&shard->lock);
+			return SD_RES_NO_TAG;
+		}
+
+		nr = copy_changes(&shard->root, version, buf + *nr_inserted,
+				  len - *nr_inserted);
+		if (nr < 0) {
+			sd_rw_unlock(&shard->lock);
+			return SD_RES_BUFFER_SMALL;
+		}
+		*nr_inserted += nr;
+
+		if (size < *nr_removed + shard->nr_removed) {
+			size = *nr_removed + shard->nr_removed;
+			*removed = xrealloc(*removed, size * sizeof(uint64_t));
+		}
+		*nr_removed += copy_changes(&shard->removed_root, version,
+					    *removed + *nr_removed,
+					    size - *nr_removed);
+		sd_rw_unlock(&shard->lock);
+	}
+
+	if (len - *nr_inserted < *nr_removed)
+		return SD_RES_BUFFER_SMALL;
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Reply the changes since the list the requester has cached, or the whole list
+ * if the changes are not known
+ */
+int get_obj_list_delta(const struct sd_req *hdr, struct sd_rsp *rsp, void *data)
+{
+	uint64_t version = hdr->objlist.version, generation, *removed = NULL;
+	size_t len = hdr->data_length / sizeof(uint64_t), nr_ins, nr_rem;
+	int ret;
+
+retry:
+	generation = uatomic_read(&obj_list_cache.generation);
+	/*
+	 * Read the version before walking the shards, the changes we see are
+	 * at least as new as it
+	 */
+	rsp->objlist.generation = generation;
+	rsp->objlist.version = uatomic_read(&obj_list_cache.tree_version);
+
+	if (hdr->objlist.generation != generation ||
+	    version > rsp->objlist.version)
+		goto full;
+
+	ret = collect_changes(version, data, len, &nr_ins, &removed, &nr_rem);
+	if (ret == SD_RES_NO_TAG)
+		goto full;
+	if (ret == SD_RES_SUCCESS)
+		memcpy((uint64_t *)data + nr_ins, removed,
+		       nr_rem * sizeof(uint64_t));
+	free(removed);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* formatted while we were walking the shards */
+	if (uatomic_read(&obj_list_cache.generation) != generation) {
+		removed = NULL;
+		goto retry;
+	}
+
+	rsp->objlist.full = 0;
+	rsp->objlist.nr_removed = nr_rem;
+	rsp->data_length = (nr_ins + nr_rem) * sizeof(uint64_t);
+	sd_debug("%zu inserted and %zu removed since %"PRIu64, nr_ins, nr_rem,
+		 version);
+
+	return SD_RES_SUCCESS;
+full:
+	free(removed);
+	rsp->objlist.full = 1;
+	rsp->objlist.nr_removed = 0;
+	/* the list can be newer than the version, it's harmless */
+	return get_obj_list(hdr, rsp, data);
+}
+
+static void delete_vid_entries(struct objlist_shard *shard, uint32_t vid)
+{
+	struct objlist_cache_entry *entry;
+
+	sd_write_lock(&shard->lock);
+	rb_for_each_entry(entry, &shard->root, node) {
+		if (oid_to_vid(entry->oid) != vid)
+			continue;
+
+		/* VDI objects cannot be removed even after we delete images. */
+		if (is_vdi_obj(entry->oid))
+			continue;
+
+		sd_debug("delete object entry %016" PRIx64, entry->oid);
+		objlist_cache_erase(shard, entry);
+	}
+	sd_rw_unlock(&shard->lock);
+}
+
 static void objlist_deletion_work(struct work *work)
 {
 	struct objlist_deletion_work *ow =
 		container_of(work, struct objlist_deletion_work, work);
-	struct objlist_cache_entry *entry;
-	uint32_t vid = ow->vid, entry_vid;
+	uint32_t vid = ow->vid;
 
 	/*
 	 * Before reclaiming the cache belonging to the VDI just deleted,
@@ -163,21 +435,9 @@ static void objlist_deletion_work(struct work *work)
 		return;
 	}
 
-	sd_write_lock(&obj_list_cache.lock);
-	rb_for_each_entry(entry, &obj_list_cache.root, node) {
-		entry_vid = oid_to_vid(entry->oid);
-		if (entry_vid != vid)
-			continue;
-
-		/* VDI objects cannot be removed even after we delete images. */
-		if (is_vdi_obj(entry->oid))
-			continue;
-
-		sd_debug("delete object entry %016" PRIx64, entry->oid);
-		rb_erase(&entry->node, &obj_list_cache.root);
-		free(entry);
-	}
-	sd_rw_unlock(&obj_list_cache.lock);
+	/* the data objects of vid and the shard of all the others */
+	delete_vid_entries(oid_to_shard(vid_to_data_oid(vid, 0)), vid);
+	delete_vid_entries(obj_list_cache.shards + NR_OBJLIST_SHARDS - 1, vid);
 }
 
 static void objlist_deletion_done(struct work *work)
@@ -210,15 +470,25 @@ int objlist_cache_cleanup(uint32_t vid)
 
 void objlist_cache_format(void)
 {
-	sd_write_lock(&obj_list_cache.lock);
-	rb_destroy(&obj_list_cache.root, struct objlist_cache_entry, node);
-	INIT_RB_ROOT(&obj_list_cache.root);
-	obj_list_cache.tree_version = 1;
-	obj_list_cache.buf_version = 0;
-	if (NULL != obj_list_cache.buf) {
-		free(obj_list_cache.buf);
-		obj_list_cache.buf = NULL;
+	/* take all the locks so that nobody sees a half formatted cache */
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++)
+		sd_write_lock(&obj_list_cache.shards[i].lock);
+
+	uatomic_set(&obj_list_cache.tree_version, 1);
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++) {
+		struct objlist_shard *shard = obj_list_cache.shards + i;
+
+		objlist_cache_destroy(&shard->root);
+		INIT_RB_ROOT(&shard->root);
+		shard->version = 1;
+		shard->buf_version = 0;
+		free_tag(shard->buf, MEM_OBJLIST);
+		shard->buf = NULL;
+		shard->cache_size = 0;
+		objlist_cache_drop_tombstones(shard);
 	}
-	obj_list_cache.cache_size = 0;
-	sd_rw_unlock(&obj_list_cache.lock);
+	uatomic_set(&obj_list_cache.generation, new_generation());
+
+	for (int i = 0; i < NR_OBJLIST_SHARDS; i++)
+		sd_rw_unlock(&obj_list_cache.shards[i].lock);
 }
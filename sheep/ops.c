@@ -11,6 +11,7 @@
 
 #include "sheep_priv.h"
 #include "trace/trace.h"
+#include "memscan.h"
 
 enum sd_op_type {
 	SD_OP_TYPE_CLUSTER = 1, /* cluster operations */
@@ -51,6 +52,15 @@ struct sd_op_template {
 	int (*process_work)(struct request *req);
 	int (*process_main)(const struct sd_req *req, struct sd_rsp *rsp,
 			    void *data, const struct sd_node *sender);
+
+	/*
+	 * If type is SD_OP_TYPE_CLUSTER and process_work() is NULL,
+	 * process_prepare() is called in a worker thread on the local node
+	 * before the operation is broadcast, and its result is passed to
+	 * process_main() as with process_work().  It doesn't block the
+	 * cluster, so other cluster operations can run at the same time.
+	 */
+	int (*process_prepare)(struct request *req);
 };
 
 /*
@@ -94,6 +104,7 @@ static int cluster_new_vdi(struct request *req)
 		.store_policy = hdr->vdi.store_policy,
 		.nr_copies = hdr->vdi.copies,
 		.block_size_shift = hdr->vdi.block_size_shift,
+		.flags = hdr->vdi.flags,
 		.time = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000,
 	};
 
@@ -112,6 +123,14 @@ static int cluster_new_vdi(struct request *req)
 	if (hdr->data_length != SD_MAX_VDI_LEN)
 		return SD_RES_INVALID_PARMS;
 
+	/* snapshots and clones are stored like their base */
+	if (iocb.base_vid)
+		iocb.flags |= get_vdi_flags(iocb.base_vid);
+#ifndef HAVE_ZSTD
+	if (iocb.flags & SD_INODE_COMPRESS)
+		return SD_RES_NO_SUPPORT;
+#endif
+
 	if (iocb.create_snapshot)
 		ret = vdi_snapshot(&iocb, &vid);
 	else
@@ -121,6 +140,15 @@ static int cluster_new_vdi(struct request *req)
 	rsp->vdi.copies = iocb.nr_copies;
 	rsp->vdi.block_size_shift = iocb.block_size_shift;
 
+	/*
+	 * Reserve the id for the next creation in the same cluster batch, which
+	 * runs before post_cluster_new_vdi() of this one
+	 */
+	if (ret == SD_RES_SUCCESS) {
+		atomic_set_bit(vid, sys->vdi_inuse);
+		vdi_lookup_cache_drop(iocb.name);
+	}
+
 	return ret;
 }
 
@@ -136,8 +164,11 @@ static int post_cluster_new_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 		node_to_str(sender));
 
 	sd_debug("done %d %lx", ret, nr);
-	if (ret == SD_RES_SUCCESS)
+	if (ret == SD_RES_SUCCESS) {
 		atomic_set_bit(nr, sys->vdi_inuse);
+		/* the working vdi of the name may have become a snapshot */
+		vdi_lookup_cache_drop(name);
+	}
 
 	return ret;
 }
@@ -163,11 +194,17 @@ static int cluster_del_vdi(struct request *req)
 		.data_len = data_len,
 		.snapid = hdr->vdi.snapid,
 	};
+	int ret;
 
 	if (vdi_init_tag(&iocb.tag, req->data, data_len) < 0)
 		return SD_RES_INVALID_PARMS;
 
-	return vdi_delete(&iocb, req);
+	ret = vdi_delete(&iocb, req);
+	/* for the next lookup in the same cluster batch */
+	if (ret == SD_RES_SUCCESS)
+		vdi_lookup_cache_drop(iocb.name);
+
+	return ret;
 }
 
 struct cache_deletion_work {
@@ -175,6 +212,22 @@ struct cache_deletion_work {
 	struct work work;
 };
 
+static void cache_delete_work(struct work *work)
+{
+	struct cache_deletion_work *dw =
+		container_of(work, struct cache_deletion_work, work);
+
+	object_cache_delete(dw->vid);
+}
+
+static void cache_delete_done(struct work *work)
+{
+	struct cache_deletion_work *dw =
+		container_of(work, struct cache_deletion_work, work);
+
+	free(dw);
+}
+
 static int post_cluster_del_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 				void *data, const struct sd_node *sender)
 {
@@ -189,6 +242,18 @@ static int post_cluster_del_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 	if (ret == SD_RES_SUCCESS) {
 		atomic_set_bit(vid, sys->vdi_deleted);
 		vdi_mark_deleted(vid);
+		vdi_lookup_cache_drop(name);
+		precopy_delete(vid);
+		vdi_io_stat_drop(vid);
+
+		if (sys->enable_object_cache) {
+			struct cache_deletion_work *dw = xzalloc(sizeof(*dw));
+
+			dw->vid = vid;
+			dw->work.fn = cache_delete_work;
+			dw->work.done = cache_delete_done;
+			queue_work(sys->deletion_wqueue, &dw->work);
+		}
 
 		if (sys->cinfo.flags & SD_CLUSTER_FLAG_RECYCLE_VID)
 			run_vid_gc(vid);
@@ -232,22 +297,6 @@ static int cluster_get_vdi_info(struct request *req)
 	return ret;
 }
 
-static int remove_epoch(uint32_t epoch)
-{
-	int ret;
-	char path[PATH_MAX];
-
-	sd_debug("remove epoch %"PRIu32, epoch);
-	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
-	ret = unlink(path);
-	if (ret && errno != ENOENT) {
-		sd_err("failed to remove %s: %m", path);
-		return SD_RES_EIO;
-	}
-
-	return SD_RES_SUCCESS;
-}
-
 static int get_vnodes(struct vnode_info *vinfo, int *nr_vnodes)
 {
 	int ret;
@@ -320,10 +369,18 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	sys->cinfo.ctime = req->cluster.ctime;
 	set_cluster_config(&sys->cinfo);
 
+	/*
+	 * The flags decide the placement (nr_probes, vnode strategy and disk
+	 * mode), so route with a vnode info built from the new ones
+	 */
+	if (vinfo)
+		set_vnode_info(alloc_vnode_info(&vinfo->nroot));
+
 	for (i = 1; i <= latest_epoch; i++)
-		remove_epoch(i);
+		remove_epoch_log(i);
 
 	memset(sys->vdi_inuse, 0, sizeof(sys->vdi_inuse));
+	vdi_lookup_cache_clear();
 	memset(sys->vdi_deleted, 0, sizeof(sys->vdi_deleted));
 	clean_vdi_state();
 	objlist_cache_format();
@@ -408,12 +465,34 @@ static int cluster_get_vdi_attr(struct request *req)
 	rsp->vdi.attr_id = attrid;
 	rsp->vdi.copies = get_vdi_copy_number(vid);
 
+	/*
+	 * The request data is notified to the other nodes when we unblock.
+	 * They need only the key of a created or deleted attribute, so don't
+	 * send the whole attribute.
+	 */
+	if (ret == SD_RES_SUCCESS &&
+	    hdr->flags & (SD_FLAG_CMD_CREAT | SD_FLAG_CMD_DEL)) {
+		char key[SD_MAX_VDI_ATTR_KEY_LEN];
+
+		pstrcpy(key, sizeof(key), vattr->key);
+		strcpy(req->data, key);
+		req->rq.data_length = strlen(key) + 1;
+	} else
+		req->rq.data_length = 0;
+
 	return ret;
 }
 
-static int local_release_vdi(struct request *req)
+/* 'data' is the key of the attribute, see cluster_get_vdi_attr() */
+static int post_cluster_get_vdi_attr(const struct sd_req *req,
+				     struct sd_rsp *rsp, void *data,
+				     const struct sd_node *sender)
 {
-	return SD_RES_SUCCESS;
+	if (rsp->result == SD_RES_SUCCESS && req->data_length &&
+	    req->flags & (SD_FLAG_CMD_CREAT | SD_FLAG_CMD_DEL))
+		qos_invalidate(data);
+
+	return rsp->result;
 }
 
 static int local_get_store_list(struct request *req)
@@ -448,6 +527,13 @@ static int local_get_vdi_copies(const struct sd_req *req, struct sd_rsp *rsp,
 	return fill_vdi_state_list(req, rsp, data);
 }
 
+static int local_get_vdi_state_delta(const struct sd_req *req,
+				     struct sd_rsp *rsp, void *data,
+				     const struct sd_node *sender)
+{
+	return get_vdi_state_delta(req, rsp, data);
+}
+
 static int local_stat_sheep(struct request *req)
 {
 	struct sd_rsp *rsp = &req->rp;
@@ -499,6 +585,8 @@ static int local_stat_cluster(struct request *req)
 			elog->nr_copies = sys->cinfo.nr_copies;
 			elog->copy_policy = sys->cinfo.copy_policy;
 			elog->flags = sys->cinfo.flags;
+			elog->nosync = sys->nosync;
+			elog->writeback_window = sys->writeback_window;
 			pstrcpy(elog->drv_name, STORE_LEN,
 				(char *)sys->cinfo.default_store);
 		}
@@ -548,6 +636,11 @@ static int local_get_obj_list(struct request *req)
 	return get_obj_list(&req->rq, &req->rp, req->data);
 }
 
+static int local_get_obj_list_delta(struct request *req)
+{
+	return get_obj_list_delta(&req->rq, &req->rp, req->data);
+}
+
 static int local_get_epoch(struct request *req)
 {
 	uint32_t epoch = req->rq.obj.tgt_epoch;
@@ -637,7 +730,7 @@ static int cluster_force_recover_main(const struct sd_req *req,
 		rb_insert(&nroot, &nodes[i], rb, node_cmp);
 
 	vnode_info = get_vnode_info();
-	old_vnode_info = alloc_vnode_info(&nroot);
+	old_vnode_info = alloc_vnode_info_from(vnode_info, &nroot);
 	start_recovery(vnode_info, old_vnode_info, true, false);
 	put_vnode_info(vnode_info);
 	put_vnode_info(old_vnode_info);
@@ -674,14 +767,19 @@ static int cluster_notify_vdi_add(const struct sd_req *req, struct sd_rsp *rsp,
 			      get_vdi_copy_number(req->vdi_state.old_vid),
 			      true, req->vdi_state.copy_policy,
 			      get_vdi_block_size_shift(req->vdi_state.old_vid),
-			      0);
+			      0, get_vdi_flags(req->vdi_state.old_vid));
 
 	if (req->vdi_state.set_bitmap)
 		atomic_set_bit(req->vdi_state.new_vid, sys->vdi_inuse);
 
 	add_vdi_state(req->vdi_state.new_vid, req->vdi_state.copies, false,
 		      req->vdi_state.copy_policy,
-		      req->vdi_state.block_size_shift, req->vdi_state.old_vid);
+		      req->vdi_state.block_size_shift, req->vdi_state.old_vid,
+		      req->vdi_state.flags);
+
+	if (req->vdi_state.old_vid)
+		precopy_snapshot(req->vdi_state.old_vid,
+				 req->vdi_state.new_vid);
 
 	return SD_RES_SUCCESS;
 }
@@ -777,7 +875,8 @@ static int cluster_alter_vdi_copy(const struct sd_req *req, struct sd_rsp *rsp,
 	uint32_t block_size_shift = req->vdi_state.block_size_shift;
 	struct vnode_info *vinfo;
 
-	add_vdi_state(vid, nr_copies, false, 0, block_size_shift, 0);
+	add_vdi_state(vid, nr_copies, false, 0, block_size_shift, 0,
+		      get_vdi_flags(vid));
 
 	vinfo = get_vnode_info();
 	start_recovery(vinfo, vinfo, false, false);
@@ -862,61 +961,409 @@ static int local_get_hash(struct request *request)
 				  rsp->hash.digest);
 }
 
+static int local_get_hashes(struct request *request)
+{
+	struct sd_req *req = &request->rq;
+	struct sd_obj_hash *hashes = request->data;
+	int nr = req->data_length / sizeof(*hashes);
+	bool crc = req->flags & SD_FLAG_CMD_CRC32C;
+
+	if (crc ? !sd_store->get_crc32c : !sd_store->get_hash)
+		return SD_RES_NO_SUPPORT;
+
+	if (req->data_length % sizeof(*hashes))
+		return SD_RES_INVALID_PARMS;
+
+	for (int i = 0; i < nr; i++) {
+		uint32_t c = 0;
+
+		if (!crc) {
+			hashes[i].result = sd_store->get_hash(hashes[i].oid,
+							req->obj.tgt_epoch,
+							hashes[i].digest);
+			continue;
+		}
+		hashes[i].result = sd_store->get_crc32c(hashes[i].oid,
+							req->obj.tgt_epoch,
+							&c);
+		memset(hashes[i].digest, 0, sizeof(hashes[i].digest));
+		memcpy(hashes[i].digest, &c, sizeof(c));
+	}
+	request->rp.data_length = req->data_length;
+	if (crc)
+		request->rp.flags |= SD_FLAG_CMD_CRC32C;
+
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_block_hash(struct request *request)
+{
+	struct sd_req *req = &request->rq;
+	struct sd_rsp *rsp = &request->rp;
+	uint32_t nr_blocks;
+	int ret;
+
+	if (!sd_store->get_block_hash)
+		return SD_RES_NO_SUPPORT;
+
+	nr_blocks = DIV_ROUND_UP(get_store_objsize(req->obj.oid),
+				 SD_HASH_BLOCK_SIZE);
+	if (req->data_length != nr_blocks * SHA1_DIGEST_SIZE)
+		return SD_RES_INVALID_PARMS;
+
+	ret = sd_store->get_block_hash(req->obj.oid, req->obj.tgt_epoch,
+				       request->data);
+	if (ret == SD_RES_SUCCESS)
+		rsp->data_length = req->data_length;
+
+	return ret;
+}
+
 static int local_sd_stat(const struct sd_req *req, struct sd_rsp *rsp,
 			 void *data, const struct sd_node *sender)
 {
+	int nr;
+
+	if (req->data_length < sizeof(struct sd_stat))
+		return SD_RES_INVALID_PARMS;
+
 	memcpy(data, &sys->stat, sizeof(struct sd_stat));
+	mempool_stat(((struct sd_stat *)data)->pool);
 	rsp->data_length = sizeof(struct sd_stat);
+
+	if (req->stat.flags & SD_STAT_LATENCY) {
+		nr = (req->data_length - sizeof(struct sd_stat)) /
+			sizeof(struct sd_latency_stat);
+		nr = latency_stat((struct sd_latency_stat *)
+				  ((char *)data + sizeof(struct sd_stat)), nr);
+		rsp->data_length += nr * sizeof(struct sd_latency_stat);
+		return SD_RES_SUCCESS;
+	}
+
+	if (req->stat.flags & SD_STAT_VDI) {
+		nr = (req->data_length - sizeof(struct sd_stat)) /
+			sizeof(struct sd_vdi_io_stat);
+		nr = vdi_io_stat((struct sd_vdi_io_stat *)
+				 ((char *)data + sizeof(struct sd_stat)), nr);
+		rsp->data_length += nr * sizeof(struct sd_vdi_io_stat);
+		return SD_RES_SUCCESS;
+	}
+
+	nr = (req->data_length - sizeof(struct sd_stat)) /
+		sizeof(struct sd_sockfd_stat);
+	if (nr) {
+		nr = sockfd_cache_stat((struct sd_sockfd_stat *)
+				       ((char *)data + sizeof(struct sd_stat)),
+				       nr);
+		rsp->data_length += nr * sizeof(struct sd_sockfd_stat);
+	}
+
 	return SD_RES_SUCCESS;
 }
 
-/* Return SD_RES_INVALID_PARMS to ask client not to send flush req again */
+/*
+ * Return SD_RES_INVALID_PARMS to ask client not to send flush req again if
+ * there is no object cache to flush and the writes are durable already
+ */
 static int local_flush_vdi(struct request *req)
 {
-	return SD_RES_INVALID_PARMS;
+	int ret = SD_RES_SUCCESS;
+
+	if (!sys->enable_object_cache && !sys->writeback_window)
+		return SD_RES_INVALID_PARMS;
+
+	if (sys->enable_object_cache)
+		ret = object_cache_flush_vdi(oid_to_vid(req->rq.obj.oid));
+	if (ret == SD_RES_SUCCESS && sys->writeback_window)
+		ret = writeback_sync_nodes(req->vinfo);
+
+	return ret;
+}
+
+static int local_sync_peer(struct request *req)
+{
+	return writeback_sync();
+}
+
+/*
+ * The discards of a vdi are batched.  The first one becomes the leader of a
+ * batch and reads the inode, and the ones which come meanwhile join the batch
+ * and wait.  The leader clears their indexes in one update of the inode and
+ * the objects are removed later on deletion_wqueue.  The leaders of a vdi are
+ * serialized by the discard_vdi_locks, which also lets the next batch grow.
+ */
+#define NR_DISCARD_VDI_LOCKS 64
+
+struct discard_batch {
+	struct list_node list;
+	uint32_t vid;
+	uint32_t *idxs;
+	int nr_idxs;
+	int refcnt;
+	bool done;
+	int result;
+	struct sd_cond cond;
+};
+
+static LIST_HEAD(discard_batches);
+static struct sd_mutex discard_lock = SD_MUTEX_INITIALIZER;
+static struct sd_mutex discard_vdi_locks[NR_DISCARD_VDI_LOCKS] = {
+	[0 ... NR_DISCARD_VDI_LOCKS - 1] = SD_MUTEX_INITIALIZER
+};
+
+/* the discarded objects to remove, protected by discard_lock */
+static uint64_t *discarded_oids;
+static size_t nr_discarded_oids;
+
+/* Called with discard_lock held */
+static void put_discard_batch(struct discard_batch *batch)
+{
+	if (--batch->refcnt)
+		return;
+	sd_destroy_cond(&batch->cond);
+	free(batch->idxs);
+	free(batch);
+}
+
+static int idx_cmp(const void *a, const void *b)
+{
+	return intcmp(*(const uint32_t *)a, *(const uint32_t *)b);
+}
+
+static int discard_update_inode(struct sd_inode *inode, uint32_t vid,
+				struct discard_batch *batch)
+{
+	uint32_t *idxs = batch->idxs, data_vid;
+	int nr = 0, nr_cleared = 0, ret = SD_RES_SUCCESS;
+	uint64_t *oids = xmalloc(batch->nr_idxs * sizeof(*oids));
+	bool *cleared = xzalloc(batch->nr_idxs * sizeof(*cleared));
+
+	xqsort(idxs, batch->nr_idxs, idx_cmp);
+	for (int i = 0; i < batch->nr_idxs; i++) {
+		/* if vid in idx is not exist, we don't need to remove it */
+		data_vid = sd_inode_get_vid(inode, idxs[i]);
+		if (!data_vid)
+			continue;
+		sd_inode_set_vid(inode, idxs[i], 0);
+		cleared[i] = true;
+		nr_cleared++;
+		/* the object of the parent is still used by the parent */
+		if (data_vid == vid)
+			oids[nr++] = vid_to_data_oid(vid, idxs[i]);
+	}
+
+	if (inode->store_policy == 0) {
+		/* write each run of the cleared indexes at once */
+		for (int i = 0, j; i < batch->nr_idxs; i = j) {
+			for (j = i + 1; j < batch->nr_idxs && cleared[i] &&
+				     cleared[j] && idxs[j] == idxs[j - 1] + 1;
+			     j++)
+				;
+			if (!cleared[i])
+				continue;
+			ret = sd_write_object(vid_to_vdi_oid(vid),
+					      (char *)(inode->data_vdi_id +
+						       idxs[i]),
+					      (j - i) * sizeof(uint32_t),
+					      SD_INODE_HEADER_SIZE +
+					      idxs[i] * sizeof(uint32_t),
+					      false);
+			if (ret != SD_RES_SUCCESS)
+				break;
+		}
+	} else if (nr_cleared)
+		/* the btree inode is written as a whole */
+		ret = sd_inode_write(inode, 0, false, false);
+	free(cleared);
+
+	/*
+	 * Remove the objects only if we have updated inode successfully, but
+	 * don't wait for it.
+	 */
+	if (ret == SD_RES_SUCCESS && nr) {
+		sd_mutex_lock(&discard_lock);
+		discarded_oids = xrealloc(discarded_oids,
+					  (nr_discarded_oids + nr) *
+					  sizeof(*oids));
+		memcpy(discarded_oids + nr_discarded_oids, oids,
+		       nr * sizeof(*oids));
+		nr_discarded_oids += nr;
+		sd_mutex_unlock(&discard_lock);
+	}
+	free(oids);
+
+	return ret;
 }
 
 static int local_discard_obj(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
-	uint32_t vid = oid_to_vid(oid), tmp_vid;
-	int ret, idx = data_oid_to_idx(oid);
-	struct sd_inode *inode = xmalloc(sizeof(struct sd_inode));
+	uint32_t vid = oid_to_vid(oid);
+	struct sd_mutex *vdi_lock = discard_vdi_locks +
+		vid % NR_DISCARD_VDI_LOCKS;
+	struct discard_batch *batch = NULL, *b;
+	struct sd_inode *inode;
+	int ret;
 
 	sd_debug("%016"PRIx64, oid);
+
+	sd_mutex_lock(&discard_lock);
+	list_for_each_entry(b, &discard_batches, list) {
+		if (b->vid == vid) {
+			batch = b;
+			break;
+		}
+	}
+	if (batch) {
+		batch->idxs = xrealloc(batch->idxs, (batch->nr_idxs + 1) *
+				       sizeof(*batch->idxs));
+		batch->idxs[batch->nr_idxs++] = data_oid_to_idx(oid);
+		batch->refcnt++;
+		while (!batch->done)
+			sd_cond_wait(&batch->cond, &discard_lock);
+		ret = batch->result;
+		put_discard_batch(batch);
+		sd_mutex_unlock(&discard_lock);
+		return ret;
+	}
+
+	batch = xzalloc(sizeof(*batch));
+	batch->vid = vid;
+	batch->idxs = xmalloc(sizeof(*batch->idxs));
+	batch->idxs[batch->nr_idxs++] = data_oid_to_idx(oid);
+	batch->refcnt = 1;
+	sd_cond_init(&batch->cond);
+	list_add_tail(&batch->list, &discard_batches);
+	sd_mutex_unlock(&discard_lock);
+
+	sd_mutex_lock(vdi_lock);
+	inode = xmalloc(sizeof(struct sd_inode));
 	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
 			     sizeof(struct sd_inode), 0);
-	if (ret != SD_RES_SUCCESS)
-		goto out;
 
-	tmp_vid = sd_inode_get_vid(inode, idx);
-	/* if vid in idx is not exist, we don't need to remove it */
-	if (tmp_vid) {
-		sd_inode_set_vid(inode, idx, 0);
-		ret = sd_inode_write_vid(inode, idx, vid, 0, 0, false, false);
-		if (ret != SD_RES_SUCCESS)
-			goto out;
-		if (sd_remove_object(oid) != SD_RES_SUCCESS)
-			sd_err("failed to remove %016"PRIx64, oid);
-	}
-	/*
-	 * Return success even if sd_remove_object fails because we have updated
-	 * inode successfully.
-	 */
-out:
+	/* the discards from now on go to the next batch */
+	sd_mutex_lock(&discard_lock);
+	list_del(&batch->list);
+	sd_mutex_unlock(&discard_lock);
+
+	if (ret == SD_RES_SUCCESS)
+		ret = discard_update_inode(inode, vid, batch);
+	sd_mutex_unlock(vdi_lock);
 	free(inode);
+	if (batch->nr_idxs > 1)
+		sd_debug("discarded %d objects of %"PRIx32, batch->nr_idxs,
+			 vid);
+
+	sd_mutex_lock(&discard_lock);
+	batch->result = ret;
+	batch->done = true;
+	sd_cond_broadcast(&batch->cond);
+	put_discard_batch(batch);
+	sd_mutex_unlock(&discard_lock);
+
 	return ret;
 }
 
+struct discard_removal_work {
+	struct work work;
+	uint64_t *oids;
+	size_t nr_oids;
+};
+
+static bool discard_removal_running;
+
+static void discard_removal_work_fn(struct work *work)
+{
+	struct discard_removal_work *rw =
+		container_of(work, struct discard_removal_work, work);
+
+	/* sd_remove_object() tells the failures */
+	for (size_t i = 0; i < rw->nr_oids; i++)
+		sd_remove_object(rw->oids[i]);
+}
+
+static void queue_discard_removal(void);
+
+static void discard_removal_done(struct work *work)
+{
+	struct discard_removal_work *rw =
+		container_of(work, struct discard_removal_work, work);
+
+	free(rw->oids);
+	free(rw);
+	discard_removal_running = false;
+	queue_discard_removal();
+}
+
+static main_fn void queue_discard_removal(void)
+{
+	struct discard_removal_work *rw;
+
+	if (discard_removal_running)
+		return;
+
+	rw = xzalloc(sizeof(*rw));
+	sd_mutex_lock(&discard_lock);
+	rw->oids = discarded_oids;
+	rw->nr_oids = nr_discarded_oids;
+	discarded_oids = NULL;
+	nr_discarded_oids = 0;
+	sd_mutex_unlock(&discard_lock);
+	if (!rw->nr_oids) {
+		free(rw);
+		return;
+	}
+
+	rw->work.fn = discard_removal_work_fn;
+	rw->work.done = discard_removal_done;
+	queue_work(sys->deletion_wqueue, &rw->work);
+	discard_removal_running = true;
+}
+
+static int local_discard_obj_main(const struct sd_req *req,
+				  struct sd_rsp *rsp, void *data,
+				  const struct sd_node *sender)
+{
+	queue_discard_removal();
+	return rsp->result;
+}
+
+static int local_hydrate_vdi(struct request *req)
+{
+	return vdi_hydrate(oid_to_vid(req->rq.obj.oid));
+}
+
+static int local_convert_vdi(struct request *req)
+{
+	return vdi_convert(oid_to_vid(req->rq.convert.oid),
+			   req->rq.convert.rate);
+}
+
+static int local_get_inode_summaries(struct request *req)
+{
+	return get_inode_summaries(&req->rq, &req->rp, req->data);
+}
+
 static int local_flush_and_del(struct request *req)
 {
 	return SD_RES_SUCCESS;
 }
 
+/* The data is the name of the tracer, optionally followed by its options */
 static int local_trace_enable(const struct sd_req *req, struct sd_rsp *rsp,
 			      void *data, const struct sd_node *sender)
 {
-	return trace_enable(data);
+	char *name = data, *opts = NULL;
+	size_t len;
+
+	if (!req->data_length || name[req->data_length - 1] != '\0')
+		return SD_RES_INVALID_PARMS;
+
+	len = strlen(name) + 1;
+	if (len < req->data_length)
+		opts = name + len;
+
+	return trace_enable(name, opts);
 }
 
 static int local_trace_disable(const struct sd_req *req, struct sd_rsp *rsp,
@@ -948,6 +1395,21 @@ static int local_trace_read_buf(struct request *request)
 	return SD_RES_SUCCESS;
 }
 
+#ifdef HAVE_TRACE
+static int local_trace_profile(struct request *request)
+{
+	struct sd_req *req = &request->rq;
+	struct sd_rsp *rsp = &request->rp;
+	int nr;
+
+	nr = profile_stat(request->data,
+			  req->data_length / sizeof(struct trace_profile_item));
+	rsp->data_length = nr * sizeof(struct trace_profile_item);
+
+	return SD_RES_SUCCESS;
+}
+#endif
+
 static int local_kill_node(const struct sd_req *req, struct sd_rsp *rsp,
 			   void *data, const struct sd_node *sender)
 {
@@ -964,7 +1426,102 @@ static int peer_remove_obj(struct request *req)
 
 	objlist_cache_remove(oid);
 
-	return sd_store->remove_object(oid, ec_index);
+	return cow_remove_object(oid, ec_index, req->vinfo);
+}
+
+/* Remove the replicated objects of req->vec, the missing ones are skipped */
+static int peer_remove_objs(struct request *req)
+{
+	int ret;
+
+	for (uint32_t i = 0; i < req->rq.vec.nr; i++) {
+		uint64_t oid = req->vec[i].oid;
+
+		objlist_cache_remove(oid);
+		ret = cow_remove_object(oid, 0, req->vinfo);
+		if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ)
+			return ret;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * The recovery asks for the map of a sparse object with SD_FLAG_CMD_COW and
+ * room for it after the data.  It gets the raw data, followed by the map if
+ * the response has SD_FLAG_CMD_COW too.
+ */
+static int peer_read_raw_obj(struct request *req, struct siocb *iocb)
+{
+	struct sd_req *hdr = &req->rq;
+	struct sd_rsp *rsp = &req->rp;
+	struct cow_map *map;
+	int ret;
+
+	if (hdr->data_length < sizeof(*map))
+		return SD_RES_INVALID_PARMS;
+
+	iocb->length = hdr->data_length - sizeof(*map);
+	ret = sd_store->read(hdr->obj.oid, iocb);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	rsp->data_length = iocb->length;
+	map = (struct cow_map *)((char *)req->data + iocb->length);
+	switch (cow_get_map(hdr->obj.oid, iocb, map)) {
+	case 0:
+		break;
+	case 1:
+		rsp->flags |= SD_FLAG_CMD_COW;
+		rsp->data_length = hdr->data_length;
+		break;
+	default:
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Send only the data extents of the response of req which the store found,
+ * followed by the rest of the data, if it's smaller, see SD_FLAG_CMD_SPARSE
+ */
+static void peer_pack_sparse(struct request *req, struct sd_extents *e)
+{
+	struct sd_rsp *rsp = &req->rp;
+	uint32_t len = rsp->data_length, plen;
+	char *packed, *p;
+
+	if (!e->length || e->length > len)
+		return;
+	if (e->length < len) {
+		/* the map of a sparse copy-on-write object */
+		if (e->nr == SD_MAX_EXTENTS)
+			return;
+		e->ext[e->nr].offset = e->length;
+		e->ext[e->nr++].length = len - e->length;
+		e->length = len;
+	}
+
+	plen = sd_extents_size(e->nr);
+	for (int i = 0; i < e->nr; i++)
+		plen += e->ext[i].length;
+	if (plen >= len)
+		return;
+
+	packed = xmalloc(plen);
+	memcpy(packed, e, sd_extents_size(e->nr));
+	p = packed + sd_extents_size(e->nr);
+	for (int i = 0; i < e->nr; i++) {
+		memcpy(p, (char *)req->data + e->ext[i].offset,
+		       e->ext[i].length);
+		p += e->ext[i].length;
+	}
+	memcpy(req->data, packed, plen);
+	free(packed);
+
+	rsp->data_length = plen;
+	rsp->flags |= SD_FLAG_CMD_SPARSE;
 }
 
 int peer_read_obj(struct request *req)
@@ -974,6 +1531,7 @@ int peer_read_obj(struct request *req)
 	int ret;
 	uint32_t epoch = hdr->epoch;
 	struct siocb iocb;
+	struct sd_extents extents = { 0 };
 
 	if (sys->gateway_only)
 		return SD_RES_NO_OBJ;
@@ -986,20 +1544,67 @@ int peer_read_obj(struct request *req)
 	iocb.ec_index = hdr->obj.ec_index;
 	iocb.copy_policy = hdr->obj.copy_policy;
 	iocb.wildcard = !!(hdr->flags & SD_FLAG_CMD_WILDCARD);
+	if (hdr->opcode == SD_OP_READ_PEER && (hdr->flags & SD_FLAG_CMD_SPARSE))
+		iocb.extents = &extents;
+	if (hdr->flags & SD_FLAG_CMD_COW) {
+		ret = peer_read_raw_obj(req, &iocb);
+		goto out;
+	}
+
 	ret = sd_store->read(hdr->obj.oid, &iocb);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
+	/* the recovery must not wait for the parent of a sparse object */
+	if (!(hdr->flags & SD_FLAG_CMD_RECOVERY)) {
+		ret = cow_fill(hdr->obj.oid, &iocb);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
 	rsp->data_length = hdr->data_length;
 out:
+	if (ret == SD_RES_SUCCESS) {
+		if (iocb.extents)
+			peer_pack_sparse(req, iocb.extents);
+		wire_compress_rsp(req);
+	}
 	return ret;
 }
 
-static int peer_write_obj(struct request *req)
+/* Read the ranges of req->vec into the request data one after another */
+static int peer_read_objs(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
-	struct siocb iocb = { };
-	uint64_t oid = hdr->obj.oid;
+	struct siocb iocb = { 0 };
+	char *buf = req->data;
+	int ret;
+
+	if (sys->gateway_only)
+		return SD_RES_NO_OBJ;
+
+	iocb.epoch = hdr->epoch;
+	for (uint32_t i = 0; i < hdr->vec.nr; i++) {
+		iocb.buf = buf;
+		iocb.length = req->vec[i].length;
+		iocb.offset = req->vec[i].offset;
+		ret = sd_store->read(req->vec[i].oid, &iocb);
+		if (ret == SD_RES_SUCCESS)
+			ret = cow_fill(req->vec[i].oid, &iocb);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		buf += iocb.length;
+	}
+
+	req->rp.data_length = hdr->vec.rlen;
+	return SD_RES_SUCCESS;
+}
+
+static int peer_write_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct siocb iocb = { };
+	uint64_t oid = hdr->obj.oid;
 
 	iocb.epoch = hdr->epoch;
 	iocb.buf = req->data;
@@ -1008,7 +1613,29 @@ static int peer_write_obj(struct request *req)
 	iocb.ec_index = hdr->obj.ec_index;
 	iocb.copy_policy = hdr->obj.copy_policy;
 
-	return sd_store->write(oid, &iocb);
+	return coalesce_write(oid, &iocb, req->vinfo);
+}
+
+/* Write the ranges which follow req->vec in the request data one by one */
+static int peer_write_objs(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct siocb iocb = { 0 };
+	char *buf = (char *)req->data + sizeof(*req->vec) * hdr->vec.nr;
+	int ret;
+
+	iocb.epoch = hdr->epoch;
+	for (uint32_t i = 0; i < hdr->vec.nr; i++) {
+		iocb.buf = buf;
+		iocb.length = req->vec[i].length;
+		iocb.offset = req->vec[i].offset;
+		ret = cow_write(req->vec[i].oid, &iocb, req->vinfo);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		buf += iocb.length;
+	}
+
+	return SD_RES_SUCCESS;
 }
 
 static int peer_create_and_write_obj(struct request *req)
@@ -1023,6 +1650,13 @@ static int peer_create_and_write_obj(struct request *req)
 	iocb.copy_policy = hdr->obj.copy_policy;
 	iocb.offset = hdr->obj.offset;
 
+	if (hdr->flags & SD_FLAG_CMD_COW)
+		return cow_create_and_write(hdr->obj.oid, &iocb,
+					    hdr->obj.cow_oid,
+					    hdr->obj.cow_generation);
+	if (hdr->flags & SD_FLAG_CMD_EXCL)
+		return cow_create_excl(hdr->obj.oid, &iocb);
+
 	return sd_store->create_and_write(hdr->obj.oid, &iocb);
 }
 
@@ -1054,6 +1688,84 @@ static int local_set_loglevel(struct request *req)
 	return SD_RES_SUCCESS;
 }
 
+static int local_get_wq_info(const struct sd_req *req, struct sd_rsp *rsp,
+			     void *data, const struct sd_node *sender)
+{
+	int nr = req->data_length / sizeof(struct sd_wq_info);
+	struct work_queue_stat *st = xcalloc(nr, sizeof(*st));
+	struct sd_wq_info *info = data;
+
+	nr = work_queue_stat(st, nr);
+	memset(info, 0, nr * sizeof(*info));
+	for (int i = 0; i < nr; i++) {
+		pstrcpy(info[i].name, sizeof(info[i].name), st[i].name);
+		info[i].nr_threads = st[i].nr_threads;
+		info[i].min_threads = st[i].min_threads;
+		info[i].max_threads = st[i].max_threads;
+		info[i].target = st[i].target;
+		info[i].nr_queued = st[i].nr_queued;
+		info[i].dynamic = st[i].tc == WQ_DYNAMIC;
+		info[i].stealing = st[i].stealing;
+		info[i].rate = st[i].rate;
+		info[i].service_time = st[i].service_time;
+		info[i].wait_time = st[i].wait_time;
+	}
+	rsp->data_length = nr * sizeof(*info);
+	free(st);
+
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_wq_stat(const struct sd_req *req, struct sd_rsp *rsp,
+			     void *data, const struct sd_node *sender)
+{
+	int nr = req->data_length / sizeof(struct sd_wq_stat);
+
+	nr = work_queue_hist(data, nr);
+	rsp->data_length = nr * sizeof(struct sd_wq_stat);
+
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_mem_stat(const struct sd_req *req, struct sd_rsp *rsp,
+			      void *data, const struct sd_node *sender)
+{
+	if (req->data_length < sizeof(struct sd_mem_stat) * SD_NR_MEM_TAGS)
+		return SD_RES_BUFFER_SMALL;
+
+	memtag_stat(data);
+	rsp->data_length = sizeof(struct sd_mem_stat) * SD_NR_MEM_TAGS;
+
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_heat(const struct sd_req *req, struct sd_rsp *rsp,
+			  void *data, const struct sd_node *sender)
+{
+	if (sys->gateway_only)
+		return SD_RES_NO_SUPPORT;
+
+	rsp->data_length = heat_get_info(data, req->data_length);
+
+	return SD_RES_SUCCESS;
+}
+
+static int local_set_wq_limits(const struct sd_req *req, struct sd_rsp *rsp,
+			       void *data, const struct sd_node *sender)
+{
+	struct sd_wq_info *info = data;
+
+	if (req->data_length < sizeof(*info))
+		return SD_RES_INVALID_PARMS;
+
+	info->name[sizeof(info->name) - 1] = '\0';
+	if (set_work_queue_limits(info->name, info->min_threads,
+				  info->max_threads) < 0)
+		return SD_RES_INVALID_PARMS;
+
+	return SD_RES_SUCCESS;
+}
+
 static int local_oid_exist(struct request *req)
 {
 	uint64_t oid = req->rq.obj.oid;
@@ -1097,8 +1809,10 @@ static int local_oids_exist(const struct sd_req *req, struct sd_rsp *rsp,
 static int local_cluster_info(const struct sd_req *req, struct sd_rsp *rsp,
 			      void *data, const struct sd_node *sender)
 {
-	memcpy(data, &sys->cinfo, sizeof(sys->cinfo));
-	rsp->data_length = sizeof(sys->cinfo);
+	/* only the nodes in use, the observers poll it */
+	rsp->data_length = offsetof(struct cluster_info, nodes) +
+		sizeof(sys->cinfo.nodes[0]) * sys->cinfo.nr_nodes;
+	memcpy(data, &sys->cinfo, rsp->data_length);
 	return SD_RES_SUCCESS;
 }
 
@@ -1128,30 +1842,102 @@ static inline int local_nfs_delete(struct request *req)
 
 #endif
 
-static bool is_zero_ledger(uint32_t *ledger)
+#ifdef HAVE_VHOST
+
+static int local_vhost_create(struct request *req)
 {
-	for (int i = 0; i < SD_LEDGER_OBJ_SIZE / sizeof(uint32_t); i++)
-		if (ledger[i])
-			return false;
+	return vhost_create(req->rq.vdi.base_vdi_id, req->data);
+}
 
-	return true;
+static int local_vhost_start(const struct sd_req *req, struct sd_rsp *rsp,
+			     void *data, const struct sd_node *sender)
+{
+	if (rsp->result != SD_RES_SUCCESS)
+		return rsp->result;
+
+	return vhost_start(req->vdi.base_vdi_id);
 }
 
-int peer_decref_object(struct request *req)
+static int local_vhost_delete(const struct sd_req *req, struct sd_rsp *rsp,
+			      void *data, const struct sd_node *sender)
 {
-	struct sd_req *hdr = &req->rq;
+	return vhost_delete(data);
+}
+
+#endif
+
+static bool is_zero_ledger(uint32_t *ledger)
+{
+	return is_zero_buffer(ledger, SD_LEDGER_OBJ_SIZE);
+}
+
+/*
+ * Ledger updates
+ *
+ * The read-modify-write of a ledger object is serialized by a lock hashed
+ * from its oid.  The decrefs waiting for the lock of the same ledger are put
+ * on the pending list of the lock, and the one which gets the lock applies
+ * all of them in a single read-modify-write, so the waiters find their
+ * decref done when they get the lock in turn.
+ */
+#define NR_LEDGER_LOCKS 64
+
+struct ledger_decref {
+	struct list_node list;
+	uint64_t ledger_oid;
+	uint32_t generation;
+	uint32_t count;
+	uint32_t nr;
+	bool done;
 	int ret;
-	uint32_t epoch = hdr->epoch;
-	uint64_t ledger_oid = hdr->ref.oid;
-	uint64_t data_oid = ledger_oid_to_data_oid(ledger_oid);
-	uint32_t generation = hdr->ref.generation;
-	uint32_t count = hdr->ref.count;
-	uint32_t *ledger = NULL;
-	bool exist = false, locked;
-	static struct sd_mutex lock = SD_MUTEX_INITIALIZER;
+};
+
+static struct ledger_lock {
+	struct sd_mutex lock;		/* serializes the update of ledgers */
+	struct sd_mutex pending_lock;	/* protects pending */
+	struct list_head pending;
+} ledger_locks[NR_LEDGER_LOCKS];
+
+static pthread_once_t ledger_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_ledger_locks(void)
+{
+	for (int i = 0; i < NR_LEDGER_LOCKS; i++) {
+		sd_init_mutex(&ledger_locks[i].lock);
+		sd_init_mutex(&ledger_locks[i].pending_lock);
+		INIT_LIST_HEAD(&ledger_locks[i].pending);
+	}
+}
 
-	sd_debug("%016" PRIx64 ", %" PRIu32 ", %" PRIu32 ", %" PRIu32,
-		 ledger_oid, epoch, generation, count);
+/* Move the pending decrefs of 'ledger_oid' to 'batch' */
+static void get_pending_decrefs(struct ledger_lock *ll, uint64_t ledger_oid,
+				struct list_head *batch)
+{
+	struct ledger_decref *d;
+
+	sd_mutex_lock(&ll->pending_lock);
+	list_for_each_entry(d, &ll->pending, list) {
+		if (d->ledger_oid != ledger_oid)
+			continue;
+		list_del(&d->list);
+		list_add_tail(&d->list, batch);
+	}
+	sd_mutex_unlock(&ll->pending_lock);
+}
+
+/*
+ * Apply the decrefs of 'batch' to the ledger in one read-modify-write.
+ * Return true if the ledger became zero, i.e. the data object has to be
+ * reclaimed.
+ */
+static bool apply_decrefs(struct request *req, uint64_t ledger_oid,
+			  struct list_head *batch, int *ret)
+{
+	uint32_t epoch = req->rq.epoch;
+	uint32_t *ledger = NULL;
+	struct ledger_decref *d;
+	bool exist = false, reclaim = false;
+	int nr = 0;
 
 	ledger = xvalloc(SD_LEDGER_OBJ_SIZE);
 	memset(ledger, 0, SD_LEDGER_OBJ_SIZE);
@@ -1162,121 +1948,138 @@ int peer_decref_object(struct request *req)
 		.length = SD_LEDGER_OBJ_SIZE,
 	};
 
-	/* we don't allow concurrent updates to the ledger objects */
-	sd_mutex_lock(&lock);
-	locked = true;
-
-	ret = sd_store->read(ledger_oid, &iocb);
-	switch (ret) {
+	*ret = sd_store->read(ledger_oid, &iocb);
+	switch (*ret) {
 	case SD_RES_SUCCESS:
 		exist = true;
 		break;
 	case SD_RES_NO_OBJ:
 		/* initialize ledger */
 		ledger[0] = 1;
+		*ret = SD_RES_SUCCESS;
 		break;
 	default:
 		sd_err("failed to read ledger object %016"PRIx64": %s",
-		       ledger_oid, sd_strerror(ret));
+		       ledger_oid, sd_strerror(*ret));
 		goto out;
 	}
 
-	ledger[generation]--;
-	ledger[generation + 1] += count;
+	list_for_each_entry(d, batch, list) {
+		ledger[d->generation] -= d->nr;
+		ledger[d->generation + 1] += d->count;
+		nr++;
+	}
+	if (nr > 1)
+		sd_debug("%d decrefs of %016"PRIx64" at once", nr, ledger_oid);
 
 	if (is_zero_ledger(ledger)) {
-		struct sd_node *nodes[SD_MAX_COPIES];
-		int nr_copies;
-
-		nr_copies = get_obj_copy_number(ledger_oid,
-						req->vinfo->nr_zones);
-		memset(nodes, 0, sizeof(nodes));
-
 		/* reclaim object */
 		if (exist) {
 			objlist_cache_remove(ledger_oid);
-			ret = sd_store->remove_object(ledger_oid, -1);
-			if (ret != SD_RES_SUCCESS) {
-				sd_err("error %s", sd_strerror(ret));
-				goto out;
-			}
-		}
-		sd_mutex_unlock(&lock);
-		locked = false;
-
-		oid_to_nodes(ledger_oid, &req->vinfo->vroot, nr_copies,
-			     (const struct sd_node **)nodes);
-
-		if (!node_cmp(&sys->this_node, nodes[0])) {
-			/* only first one node needs to remove the object */
-			ret = sd_remove_object(data_oid);
-			if (ret != SD_RES_SUCCESS) {
-				sd_err("error %s", sd_strerror(ret));
+			*ret = sd_store->remove_object(ledger_oid, -1);
+			if (*ret != SD_RES_SUCCESS) {
+				sd_err("error %s", sd_strerror(*ret));
 				goto out;
 			}
 		}
+		reclaim = true;
 	} else {
 		/* update ledger */
 		if (exist)
-			ret = sd_store->write(ledger_oid, &iocb);
+			*ret = sd_store->write(ledger_oid, &iocb);
 		else
-			ret = sd_store->create_and_write(ledger_oid, &iocb);
+			*ret = sd_store->create_and_write(ledger_oid, &iocb);
 
-		if (ret != SD_RES_SUCCESS)
+		if (*ret != SD_RES_SUCCESS)
 			sd_err("failed to update ledger object %016"PRIx64": %s",
-			       ledger_oid, sd_strerror(ret));
+			       ledger_oid, sd_strerror(*ret));
 	}
 out:
-	if (locked)
-		sd_mutex_unlock(&lock);
 	free(ledger);
+	return reclaim;
+}
+
+int peer_decref_object(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	int ret;
+	uint64_t ledger_oid = hdr->ref.oid;
+	uint64_t data_oid = ledger_oid_to_data_oid(ledger_oid);
+	struct ledger_decref self = {
+		.ledger_oid = ledger_oid,
+		.generation = hdr->ref.generation,
+		.count = hdr->ref.count,
+		.nr = hdr->ref.nr ?: 1,
+	}, *d;
+	struct ledger_lock *ll;
+	LIST_HEAD(batch);
+	bool reclaim;
+
+	sd_debug("%016" PRIx64 ", %" PRIu32 ", %" PRIu32 ", %" PRIu32 ", %"
+		 PRIu32, ledger_oid, hdr->epoch, self.generation, self.count,
+		 self.nr);
+
+	pthread_once(&ledger_locks_once, init_ledger_locks);
+	ll = &ledger_locks[sd_hash_oid(ledger_oid) % NR_LEDGER_LOCKS];
+
+	sd_mutex_lock(&ll->pending_lock);
+	list_add_tail(&self.list, &ll->pending);
+	sd_mutex_unlock(&ll->pending_lock);
+
+	/* we don't allow concurrent updates to the ledger objects */
+	sd_mutex_lock(&ll->lock);
+	if (self.done) {
+		/* done by the previous holder of the lock */
+		sd_mutex_unlock(&ll->lock);
+		return self.ret;
+	}
+
+	get_pending_decrefs(ll, ledger_oid, &batch);
+	reclaim = apply_decrefs(req, ledger_oid, &batch, &ret);
+	list_for_each_entry(d, &batch, list) {
+		list_del(&d->list);
+		d->ret = ret;
+		d->done = true;
+	}
+	sd_mutex_unlock(&ll->lock);
+
+	if (reclaim) {
+		struct sd_node *nodes[SD_MAX_COPIES];
+		int nr_copies;
+
+		nr_copies = get_obj_copy_number(ledger_oid,
+						req->vinfo->nr_zones);
+		memset(nodes, 0, sizeof(nodes));
+		vinfo_oid_to_nodes(req->vinfo, ledger_oid, nr_copies,
+			     (const struct sd_node **)nodes);
+
+		if (!node_cmp(&sys->this_node, nodes[0])) {
+			/* only first one node needs to remove the object */
+			ret = sd_remove_object(data_oid);
+			if (ret != SD_RES_SUCCESS)
+				sd_err("error %s", sd_strerror(ret));
+		}
+	}
 
 	return ret;
 }
 
 static int local_repair_replica(struct request *req)
 {
-	int ret;
 	struct node_id nid;
-	struct sd_req hdr;
-	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	struct siocb iocb = { 0 };
-	uint64_t oid = req->rq.forw.oid;
-	size_t rlen = get_store_objsize(oid);
-	void *buf = xvalloc(rlen);
-
-	sd_init_req(&hdr, SD_OP_READ_PEER);
-	hdr.epoch = req->rq.epoch;
-	hdr.data_length = rlen;
-	hdr.obj.oid = oid;
 
 	memcpy(nid.addr, req->rq.forw.addr, sizeof(nid.addr));
 	nid.port = req->rq.forw.port;
-	ret = sheep_exec_req(&nid, &hdr, buf);
-	if (ret == SD_RES_SUCCESS) {
-		sd_debug("read object %016"PRIx64" from %s successfully, "
-				"try saving to local", oid,
-				addr_to_str(nid.addr, nid.port));
-		iocb.epoch = req->rq.epoch;
-		iocb.length = rsp->data_length;
-		iocb.offset = rsp->obj.offset;
-		iocb.buf = buf;
-		ret = sd_store->create_and_write(oid, &iocb);
-		if (ret != SD_RES_SUCCESS)
-			sd_err("failed to write object %016"PRIx64
-					" to local", oid);
-	} else {
-		sd_err("failed to read object %016"PRIx64
-				" from %s: %s", oid,
-				addr_to_str(nid.addr, nid.port),
-				sd_strerror(ret));
-	}
 
-	free(buf);
-	return ret;
+	return repair_replica_from(&nid, req->rq.forw.oid, req->rq.epoch);
 }
 
-static int cluster_lock_vdi_work(struct request *req)
+static int local_check_objects(struct request *req)
+{
+	return check_local_objects(req);
+}
+
+static int cluster_lock_vdi_prepare(struct request *req)
 {
 	if (!(sys->cinfo.flags & SD_CLUSTER_FLAG_USE_LOCK)) {
 		sd_debug("vdi lock is disabled");
@@ -1395,25 +2198,34 @@ static int local_get_cluster_default(const struct sd_req *req,
 	return SD_RES_SUCCESS;
 }
 
-static int cluster_inode_coherence(const struct sd_req *req,
-				   struct sd_rsp *rsp, void *data,
-				   const struct sd_node *sender)
+static int local_inode_coherence(const struct sd_req *req,
+				 struct sd_rsp *rsp, void *data,
+				 const struct sd_node *sender)
 {
+	struct node_id nid;
+
+	/* sent directly by the participant, not through the cluster driver */
+	memset(&nid, 0, sizeof(nid));
+	memcpy(nid.addr, req->inode_coherence.addr, sizeof(nid.addr));
+	nid.port = req->inode_coherence.port;
+
 	sd_debug("inode coherence: %s %"PRIx32" from %s",
 		 req->inode_coherence.validate ? "validate" : "invalidate",
-		 req->inode_coherence.vid, node_to_str(sender));
+		 req->inode_coherence.vid, node_id_to_str(&nid));
 
 	return inode_coherence_update(req->inode_coherence.vid,
-			       !!req->inode_coherence.validate, &sender->nid);
+				      !!req->inode_coherence.validate, &nid);
 }
 
 static int local_get_recovery(struct request *req)
 {
 	struct recovery_throttling rthrottling;
+	uint32_t len = min(req->rq.data_length,
+			   (uint32_t)sizeof(rthrottling));
 
 	rthrottling = get_recovery();
-	memcpy(req->data, &rthrottling, sizeof(rthrottling));
-	req->rp.data_length = sizeof(rthrottling);
+	memcpy(req->data, &rthrottling, len);
+	req->rp.data_length = len;
 
 	return SD_RES_SUCCESS;
 }
@@ -1422,9 +2234,12 @@ static int local_set_recovery(struct request *req)
 {
 	struct recovery_throttling *rthrottling;
 
-	rthrottling = xmalloc(sizeof(struct recovery_throttling));
+	rthrottling = xzalloc(sizeof(struct recovery_throttling));
 
-	memcpy(rthrottling, req->data, sizeof(struct recovery_throttling));
+	/* old dog doesn't send the bandwidth fields */
+	memcpy(rthrottling, req->data,
+	       min(req->rq.data_length,
+		   (uint32_t)sizeof(struct recovery_throttling)));
 	set_recovery(rthrottling);
 
 	free(rthrottling);
@@ -1509,6 +2324,7 @@ static struct sd_op_template sd_ops[] = {
 		.name = "GET_VDI_ATTR",
 		.type = SD_OP_TYPE_CLUSTER,
 		.process_work = cluster_get_vdi_attr,
+		.process_main = post_cluster_get_vdi_attr,
 	},
 
 	[SD_OP_FORCE_RECOVER] = {
@@ -1563,14 +2379,13 @@ static struct sd_op_template sd_ops[] = {
 	[SD_OP_LOCK_VDI] = {
 		.name = "LOCK_VDI",
 		.type = SD_OP_TYPE_CLUSTER,
-		.process_work = cluster_lock_vdi_work,
+		.process_prepare = cluster_lock_vdi_prepare,
 		.process_main = cluster_lock_vdi_main,
 	},
 
 	[SD_OP_RELEASE_VDI] = {
 		.name = "RELEASE_VDI",
 		.type = SD_OP_TYPE_CLUSTER,
-		.process_work = local_release_vdi,
 		.process_main = cluster_release_vdi_main,
 	},
 
@@ -1609,12 +2424,6 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = cluster_alter_vdi_copy,
 	},
 
-	[SD_OP_INODE_COHERENCE] = {
-		.name = "INODE_COHERENCE",
-		.type = SD_OP_TYPE_CLUSTER,
-		.process_main = cluster_inode_coherence,
-	},
-
 	/* local operations */
 
 	[SD_OP_GET_STORE_LIST] = {
@@ -1645,6 +2454,13 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_get_vdi_copies,
 	},
 
+	[SD_OP_GET_VDI_STATE_DELTA] = {
+		.name = "GET_VDI_STATE_DELTA",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_get_vdi_state_delta,
+	},
+
 	[SD_OP_GET_NODE_LIST] = {
 		.name = "GET_NODE_LIST",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1677,6 +2493,12 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_get_obj_list,
 	},
 
+	[SD_OP_GET_OBJ_LIST_DELTA] = {
+		.name = "GET_OBJ_LIST_DELTA",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_obj_list_delta,
+	},
+
 	[SD_OP_GET_EPOCH] = {
 		.name = "GET_EPOCH",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1689,10 +2511,35 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_flush_vdi,
 	},
 
+	[SD_OP_SYNC_PEER] = {
+		.name = "SYNC_PEER",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_sync_peer,
+	},
+
 	[SD_OP_DISCARD_OBJ] = {
 		.name = "DISCARD_OBJ",
 		.type = SD_OP_TYPE_LOCAL,
 		.process_work = local_discard_obj,
+		.process_main = local_discard_obj_main,
+	},
+
+	[SD_OP_HYDRATE_VDI] = {
+		.name = "HYDRATE_VDI",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_hydrate_vdi,
+	},
+
+	[SD_OP_CONVERT_VDI] = {
+		.name = "CONVERT_VDI",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_convert_vdi,
+	},
+
+	[SD_OP_GET_INODE_SUMMARIES] = {
+		.name = "GET_INODE_SUMMARIES",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_inode_summaries,
 	},
 
 	[SD_OP_FLUSH_DEL_CACHE] = {
@@ -1729,6 +2576,15 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_trace_read_buf,
 	},
 
+#ifdef HAVE_TRACE
+	[SD_OP_TRACE_PROFILE] = {
+		.name = "TRACE_PROFILE",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_work = local_trace_profile,
+	},
+#endif
+
 	[SD_OP_KILL_NODE] = {
 		.name = "KILL_NODE",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1763,6 +2619,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_get_hash,
 	},
 
+	[SD_OP_GET_HASHES] = {
+		.name = "GET_HASHES",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_hashes,
+	},
+
+	[SD_OP_GET_BLOCK_HASH] = {
+		.name = "GET_BLOCK_HASH",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_block_hash,
+	},
+
 	[SD_OP_STAT] = {
 		.name = "STAT",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1783,6 +2651,40 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_set_loglevel,
 	},
 
+	[SD_OP_GET_WQ_INFO] = {
+		.name = "GET_WQ_INFO",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_get_wq_info,
+	},
+
+	[SD_OP_GET_WQ_STAT] = {
+		.name = "GET_WQ_STAT",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_get_wq_stat,
+	},
+
+	[SD_OP_GET_MEM_STAT] = {
+		.name = "GET_MEM_STAT",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_get_mem_stat,
+	},
+
+	[SD_OP_GET_HEAT] = {
+		.name = "GET_HEAT",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_get_heat,
+	},
+
+	[SD_OP_SET_WQ_LIMITS] = {
+		.name = "SET_WQ_LIMITS",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_set_wq_limits,
+	},
+
 	[SD_OP_EXIST] =  {
 		.name = "EXIST",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1820,12 +2722,39 @@ static struct sd_op_template sd_ops[] = {
 	},
 #endif
 
+#ifdef HAVE_VHOST
+	[SD_OP_VHOST_CREATE] = {
+		.name = "VHOST_CREATE",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_vhost_create,
+		.process_main = local_vhost_start,
+	},
+
+	[SD_OP_VHOST_DELETE] = {
+		.name = "VHOST_DELETE",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_vhost_delete,
+	},
+#endif
+
 	[SD_OP_REPAIR_REPLICA] = {
 		.name = "REPAIR_REPLICA",
 		.type = SD_OP_TYPE_LOCAL,
 		.process_work = local_repair_replica,
 	},
 
+	[SD_OP_CHECK_OBJECTS] = {
+		.name = "CHECK_OBJECTS",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_check_objects,
+	},
+
+	[SD_OP_INODE_COHERENCE] = {
+		.name = "INODE_COHERENCE",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_main = local_inode_coherence,
+	},
+
 	[SD_OP_VDI_STATE_CHECKPOINT_CTL] = {
 		.name = "VDI_STATE_CHECKPOINT_CTL",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1864,18 +2793,36 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = gateway_read_obj,
 	},
 
+	[SD_OP_READ_OBJS] = {
+		.name = "READ_OBJS",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_read_objs,
+	},
+
 	[SD_OP_WRITE_OBJ] = {
 		.name = "WRITE_OBJ",
 		.type = SD_OP_TYPE_GATEWAY,
 		.process_work = gateway_write_obj,
 	},
 
+	[SD_OP_WRITE_OBJS] = {
+		.name = "WRITE_OBJS",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_write_objs,
+	},
+
 	[SD_OP_REMOVE_OBJ] = {
 		.name = "REMOVE_OBJ",
 		.type = SD_OP_TYPE_GATEWAY,
 		.process_work = gateway_remove_obj,
 	},
 
+	[SD_OP_REMOVE_OBJS] = {
+		.name = "REMOVE_OBJS",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_remove_objs,
+	},
+
 	[SD_OP_DECREF_OBJ] = {
 		.name = "DECREF_OBJ",
 		.type = SD_OP_TYPE_GATEWAY,
@@ -1895,18 +2842,36 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = peer_read_obj,
 	},
 
+	[SD_OP_READ_PEERS] = {
+		.name = "READ_PEERS",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_read_objs,
+	},
+
 	[SD_OP_WRITE_PEER] = {
 		.name = "WRITE_PEER",
 		.type = SD_OP_TYPE_PEER,
 		.process_work = peer_write_obj,
 	},
 
+	[SD_OP_WRITE_PEER_BATCH] = {
+		.name = "WRITE_PEER_BATCH",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_write_objs,
+	},
+
 	[SD_OP_REMOVE_PEER] = {
 		.name = "REMOVE_PEER",
 		.type = SD_OP_TYPE_PEER,
 		.process_work = peer_remove_obj,
 	},
 
+	[SD_OP_REMOVE_PEERS] = {
+		.name = "REMOVE_PEERS",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_remove_objs,
+	},
+
 	[SD_OP_DECREF_PEER] = {
 		.name = "DECREF_PEER",
 		.type = SD_OP_TYPE_PEER,
@@ -1979,6 +2944,11 @@ bool has_process_work(const struct sd_op_template *op)
 	return op != NULL && !!op->process_work;
 }
 
+bool has_process_prepare(const struct sd_op_template *op)
+{
+	return op != NULL && !!op->process_prepare;
+}
+
 bool has_process_main(const struct sd_op_template *op)
 {
 	return op != NULL && !!op->process_main;
@@ -1992,8 +2962,13 @@ void do_process_work(struct work *work)
 	sd_debug("%x, %016" PRIx64", %"PRIu32, req->rq.opcode, req->rq.obj.oid,
 		 req->rq.epoch);
 
+	request_stage(req, REQ_STAGE_WORK);
+	/* the peer I/O of the recovery of the other nodes */
+	if (req->rq.flags & SD_FLAG_CMD_RECOVERY)
+		set_io_class(IO_CLASS_RECOVERY);
 	if (req->op->process_work)
 		ret = req->op->process_work(req);
+	request_stage(req, REQ_STAGE_WORK_END);
 
 	if (ret != SD_RES_SUCCESS) {
 		sd_debug("failed: %x, %016" PRIx64" , %u, %s", req->rq.opcode,
@@ -2003,6 +2978,17 @@ void do_process_work(struct work *work)
 	req->rp.result = ret;
 }
 
+void do_process_prepare(struct work *work)
+{
+	struct request *req = container_of(work, struct request, work);
+	int ret = req->op->process_prepare(req);
+
+	if (ret != SD_RES_SUCCESS)
+		sd_debug("failed: %s, %s", op_name(req->op), sd_strerror(ret));
+
+	req->rp.result = ret;
+}
+
 int do_process_main(const struct sd_op_template *op, const struct sd_req *req,
 		    struct sd_rsp *rsp, void *data,
 		    const struct sd_node *sender)
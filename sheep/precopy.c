@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Background pre-copy of the hot objects after a snapshot
+ *
+ * A snapshot makes the working vdi read-only, so the first write of the new
+ * working vdi to each object pays a copy-on-write in gateway_handle_cow().
+ * With '-S' each gateway counts the writes to the data objects it serves, and
+ * when a vdi is snapshotted, it copies the objects of the old working vdi
+ * into the new one in the background, the most written first and at a
+ * throttled rate.  The foreground writes then rarely hit the copy-on-write.
+ *
+ * The copies are created by SD_FLAG_CMD_EXCL, see cow_create_excl(), so they
+ * never replace an object which a foreground copy-on-write made meanwhile.
+ * The inode is left to the client, which is the only one updating the data
+ * vdi ids and thus the reference counts: its next copy-on-write request to a
+ * copied object is turned into a plain write by gateway_handle_cow(), after
+ * which it sets the vdi id as usual.  The copies which the client never
+ * wrote are removed at the next snapshot or the deletion of the vdi.  They
+ * are forgotten if this sheep restarts in the meantime, and then left as
+ * garbage.
+ *
+ * Only the replicated objects written through this gateway, and not through
+ * the object cache, are tracked, so '-S' should be given to all the sheep
+ * serving clients.
+ */
+
+#include "sheep_priv.h"
+
+/* seconds to wait for the new inode, written after the notification */
+#define PRECOPY_INODE_WAIT 10
+
+struct precopy_entry {
+	struct rb_node rb;
+	uint64_t oid;
+	uint32_t hits;
+};
+
+struct precopy_work {
+	struct work work;
+	uint32_t old_vid;
+	uint32_t new_vid;
+	/* the objects to copy, the hottest first */
+	int nr_objs;
+	struct precopy_entry *objs;
+	/* the unused copies of old_vid to remove */
+	int nr_copies;
+	uint64_t *copies;
+};
+
+static struct work_queue *precopy_wq;
+static uint64_t precopy_bandwidth;
+static uint32_t precopy_max_objects;
+
+/* the write counts of the data objects and the unused copies */
+static struct rb_root heat_root = RB_ROOT;
+static struct rb_root copied_root = RB_ROOT;
+static size_t nr_heats;
+static struct sd_mutex precopy_lock = SD_MUTEX_INITIALIZER;
+
+static int precopy_entry_cmp(const struct precopy_entry *a,
+			     const struct precopy_entry *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+static int precopy_hits_cmp(const struct precopy_entry *a,
+			    const struct precopy_entry *b)
+{
+	return -intcmp(a->hits, b->hits);
+}
+
+/* Halve the counts so that the objects which are no longer written drop out */
+static void heat_age(void)
+{
+	struct precopy_entry *e;
+
+	rb_for_each_entry(e, &heat_root, rb) {
+		e->hits /= 2;
+		if (e->hits)
+			continue;
+		rb_erase(&e->rb, &heat_root);
+		free(e);
+		nr_heats--;
+	}
+}
+
+void precopy_account(const struct request *req, uint64_t oid)
+{
+	struct precopy_entry key = { .oid = oid }, *e;
+
+	/* the requests of sheep itself are not the client's */
+	if (!precopy_wq || (req->rq.flags & SD_FLAG_CMD_FWD) ||
+	    !cow_supported(oid))
+		return;
+
+	sd_mutex_lock(&precopy_lock);
+	e = rb_search(&heat_root, &key, rb, precopy_entry_cmp);
+	if (e) {
+		if (e->hits < UINT32_MAX)
+			e->hits++;
+		goto out;
+	}
+
+	if (nr_heats >= precopy_max_objects)
+		heat_age();
+	if (nr_heats >= precopy_max_objects)
+		goto out;
+
+	e = xzalloc(sizeof(*e));
+	e->oid = oid;
+	e->hits = 1;
+	rb_insert(&heat_root, e, rb, precopy_entry_cmp);
+	nr_heats++;
+out:
+	sd_mutex_unlock(&precopy_lock);
+}
+
+/* Return true if the background pre-copy made oid, which is now in use */
+bool precopy_consume(uint64_t oid)
+{
+	struct precopy_entry key = { .oid = oid }, *e;
+
+	if (!precopy_wq)
+		return false;
+
+	sd_mutex_lock(&precopy_lock);
+	e = rb_search(&copied_root, &key, rb, precopy_entry_cmp);
+	if (e)
+		rb_erase(&e->rb, &copied_root);
+	sd_mutex_unlock(&precopy_lock);
+
+	free(e);
+	return !!e;
+}
+
+static void precopy_add_copied(uint64_t oid)
+{
+	struct precopy_entry *e = xzalloc(sizeof(*e));
+
+	e->oid = oid;
+	sd_mutex_lock(&precopy_lock);
+	if (rb_insert(&copied_root, e, rb, precopy_entry_cmp))
+		free(e);
+	sd_mutex_unlock(&precopy_lock);
+}
+
+static void precopy_throttle(uint64_t start, uint64_t bytes)
+{
+	uint64_t expected, elapsed;
+
+	expected = (double)bytes * 1000000000 / precopy_bandwidth;
+	elapsed = clock_get_time() - start;
+	if (expected > elapsed)
+		usleep((expected - elapsed) / 1000);
+}
+
+/* The new inode is written by the snapshotting sheep after notifying us */
+static int wait_inode(uint32_t vid, struct sd_inode *inode)
+{
+	int ret;
+
+	for (int i = 0; i < PRECOPY_INODE_WAIT; i++) {
+		ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+				     SD_INODE_HEADER_SIZE, 0);
+		if (ret != SD_RES_NO_OBJ)
+			return ret;
+		sleep(1);
+	}
+
+	return SD_RES_NO_OBJ;
+}
+
+/*
+ * Remove the copies which the client didn't write until the next snapshot
+ * or the deletion.  Nobody writes the vdi any more, so nobody starts using
+ * them.
+ */
+static void precopy_purge(uint32_t vid, const uint64_t *copies, int nr)
+{
+	for (int i = 0; i < nr; i++) {
+		uint32_t idx = data_oid_to_idx(copies[i]), data_vid;
+		int ret;
+
+		ret = sd_read_object(vid_to_vdi_oid(vid), (char *)&data_vid,
+				     sizeof(data_vid), data_vid_offset(idx));
+		if (ret != SD_RES_SUCCESS || data_vid == vid)
+			continue;
+
+		sd_debug("remove the unused copy %016"PRIx64, copies[i]);
+		ret = sd_remove_object(copies[i]);
+		if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ)
+			sd_err("failed to remove %016"PRIx64", %s", copies[i],
+			       sd_strerror(ret));
+	}
+}
+
+static int precopy_obj(uint32_t old_vid, uint32_t new_vid, uint32_t idx,
+		       char *buf, size_t len)
+{
+	uint64_t oid = vid_to_data_oid(new_vid, idx);
+	uint32_t data_vid;
+	struct sd_req hdr;
+	int ret;
+
+	ret = sd_read_object(vid_to_vdi_oid(new_vid), (char *)&data_vid,
+			     sizeof(data_vid), data_vid_offset(idx));
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* copied by a foreground write already */
+	if (data_vid != old_vid)
+		return SD_RES_OID_EXIST;
+
+	ret = sd_read_object(vid_to_data_oid(old_vid, idx), buf, len, 0);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_EXCL | SD_FLAG_CMD_FWD;
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	ret = exec_local_req(&hdr, buf);
+	if (ret == SD_RES_SUCCESS)
+		precopy_add_copied(oid);
+
+	return ret;
+}
+
+static void precopy_worker(struct work *work)
+{
+	struct precopy_work *pw = container_of(work, struct precopy_work, work);
+	struct sd_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
+	uint64_t start, bytes = 0;
+	int ret, nr_copied = 0;
+	size_t len;
+	char *buf;
+
+	if (pw->new_vid) {
+		ret = wait_inode(pw->new_vid, inode);
+		if (ret != SD_RES_SUCCESS) {
+			sd_info("no pre-copy for %"PRIx32", %s", pw->new_vid,
+				sd_strerror(ret));
+			goto out;
+		}
+	}
+
+	precopy_purge(pw->old_vid, pw->copies, pw->nr_copies);
+
+	/* the vdis indexed by B-tree are placed out of cow_supported() */
+	if (!pw->nr_objs || inode->store_policy)
+		goto out;
+
+	len = get_objsize(vid_to_data_oid(pw->new_vid, 0),
+			  get_vdi_object_size(pw->new_vid));
+	buf = xvalloc(len);
+	start = clock_get_time();
+	for (int i = 0; i < pw->nr_objs; i++) {
+		uint32_t idx = data_oid_to_idx(pw->objs[i].oid);
+
+		ret = precopy_obj(pw->old_vid, pw->new_vid, idx, buf, len);
+		switch (ret) {
+		case SD_RES_SUCCESS:
+			nr_copied++;
+			bytes += len;
+			precopy_throttle(start, bytes);
+			break;
+		case SD_RES_OID_EXIST:
+			break;
+		case SD_RES_INVALID_PARMS:
+		case SD_RES_READONLY:
+		case SD_RES_NO_VDI:
+			/* not supported by the store, or snapshotted again */
+			sd_info("stop the pre-copy of %"PRIx32", %s",
+				pw->new_vid, sd_strerror(ret));
+			goto done;
+		default:
+			sd_err("failed to pre-copy %016"PRIx64", %s",
+			       vid_to_data_oid(pw->new_vid, idx),
+			       sd_strerror(ret));
+			break;
+		}
+	}
+done:
+	sd_info("%d of %d objects of %"PRIx32" pre-copied in %"PRIu64" sec",
+		nr_copied, pw->nr_objs, pw->new_vid,
+		(clock_get_time() - start) / 1000000000);
+	free(buf);
+out:
+	free(inode);
+}
+
+static void precopy_done(struct work *work)
+{
+	struct precopy_work *pw = container_of(work, struct precopy_work, work);
+
+	free(pw->objs);
+	free(pw->copies);
+	free(pw);
+}
+
+static void queue_precopy(uint32_t old_vid, uint32_t new_vid)
+{
+	struct precopy_work *pw = xzalloc(sizeof(*pw));
+	struct precopy_entry *e;
+	int nr_objs = 0, nr_copies = 0;
+
+	pw->old_vid = old_vid;
+	pw->new_vid = new_vid;
+
+	sd_mutex_lock(&precopy_lock);
+	rb_for_each_entry(e, &heat_root, rb)
+		if (oid_to_vid(e->oid) == old_vid)
+			nr_objs++;
+	rb_for_each_entry(e, &copied_root, rb)
+		if (oid_to_vid(e->oid) == old_vid)
+			nr_copies++;
+
+	pw->objs = xmalloc(sizeof(*pw->objs) * (nr_objs ?: 1));
+	pw->copies = xmalloc(sizeof(*pw->copies) * (nr_copies ?: 1));
+	rb_for_each_entry(e, &heat_root, rb) {
+		if (oid_to_vid(e->oid) != old_vid)
+			continue;
+		if (new_vid)
+			pw->objs[pw->nr_objs++] = *e;
+		rb_erase(&e->rb, &heat_root);
+		free(e);
+		nr_heats--;
+	}
+	rb_for_each_entry(e, &copied_root, rb) {
+		if (oid_to_vid(e->oid) != old_vid)
+			continue;
+		pw->copies[pw->nr_copies++] = e->oid;
+		rb_erase(&e->rb, &copied_root);
+		free(e);
+	}
+	sd_mutex_unlock(&precopy_lock);
+
+	if (!pw->nr_objs && !pw->nr_copies) {
+		precopy_done(&pw->work);
+		return;
+	}
+
+	xqsort(pw->objs, pw->nr_objs, precopy_hits_cmp);
+	sd_debug("pre-copy %d objects of %"PRIx32" into %"PRIx32", remove %d",
+		 pw->nr_objs, old_vid, new_vid, pw->nr_copies);
+
+	pw->work.fn = precopy_worker;
+	pw->work.done = precopy_done;
+	queue_work(precopy_wq, &pw->work);
+}
+
+/*
+ * Called on all the sheep when old_vid is snapshotted, or cloned, into
+ * new_vid.  The objects of old_vid written through us are copied into
+ * new_vid unless it doesn't refer to them.
+ */
+main_fn void precopy_snapshot(uint32_t old_vid, uint32_t new_vid)
+{
+	if (precopy_wq)
+		queue_precopy(old_vid, new_vid);
+}
+
+/*
+ * Called on all the sheep when vid is deleted.  It hasn't been snapshotted
+ * since our copies were made, so nobody else refers to them.
+ */
+main_fn void precopy_delete(uint32_t vid)
+{
+	if (precopy_wq)
+		queue_precopy(vid, 0);
+}
+
+int precopy_init(uint64_t bandwidth, uint32_t max_objects)
+{
+	precopy_bandwidth = bandwidth;
+	precopy_max_objects = max_objects;
+
+	/* one vdi after another, the throttling is per vdi */
+	precopy_wq = create_ordered_work_queue("precopy");
+	if (!precopy_wq)
+		return -1;
+
+	sd_info("pre-copy at %"PRIu64" bytes/sec, up to %"PRIu32" objects",
+		bandwidth, max_objects);
+	return 0;
+}
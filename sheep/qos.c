@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-vdi limits of the client I/O at the gateway
+ *
+ * The limits of a vdi are kept in its attribute "sheepdog.qos", for example
+ *
+ *   $ dog vdi setattr test sheepdog.qos "iops=500,bps=40M,burst=2000"
+ *
+ * where iops is the requests per second, bps the bytes per second and burst
+ * the milliseconds of them which may be saved up while the vdi is idle (1000
+ * by default).  A missing or zero limit means unlimited.
+ *
+ * Each gateway keeps a token bucket for every limited vdi it serves and
+ * checks the client requests of the data objects against it before they are
+ * queued to the gateway workers.  A request which finds the bucket empty is
+ * parked on the bucket, in the order of arrival, and a single tick timer
+ * refills the buckets and requeues the parked requests as the tokens come
+ * back.  The byte tokens may go below zero, so that a request larger than the
+ * burst still passes, and the debt is paid by the following requests.
+ *
+ * The data objects of a vdi may belong to its ancestors until they are
+ * copied on write, so the vid of each object is mapped to the bucket of the
+ * working vdi of its family, and the ancestors of the working vdi to the
+ * same bucket.  The mapping of each vid is looked up in the background the
+ * first time it is seen, and again after the attribute changes anywhere in
+ * the cluster, see qos_invalidate().  The requests pass unthrottled until the
+ * first lookup of their vid completes.
+ */
+
+#include "sheep_priv.h"
+#include "option.h"
+
+#define QOS_ATTR_KEY "sheepdog.qos"
+#define QOS_DEFAULT_BURST 1000	/* msec */
+#define QOS_TICK 10		/* msec */
+
+struct qos_limit {
+	uint32_t iops;
+	uint64_t bps;
+	uint32_t burst;
+};
+
+struct qos_bucket {
+	struct rb_node rb;
+	uint32_t vid;		/* the working vdi */
+	struct qos_limit limit;
+
+	double ops;		/* the tokens */
+	double bytes;
+	uint64_t last;		/* nsec of the last refill */
+
+	struct list_head parked;
+	struct list_node active_list;	/* on qos_active while parked */
+};
+
+/* which bucket the objects of a vid are charged to */
+struct qos_vid {
+	struct rb_node rb;
+	uint32_t vid;
+	uint32_t bucket_vid;	/* 0 for unlimited */
+	bool loading;
+	bool stale;
+};
+
+struct qos_load_work {
+	struct work work;
+	uint32_t vid;
+	int ret;
+	uint32_t working_vid;
+	struct qos_limit limit;
+};
+
+static struct work_queue *qos_wq;
+static struct rb_root qos_bucket_root = RB_ROOT;
+static struct rb_root qos_vid_root = RB_ROOT;
+static LIST_HEAD(qos_active);
+static struct timer qos_timer;
+static bool qos_timer_armed;
+
+static int qos_bucket_cmp(const struct qos_bucket *a,
+			  const struct qos_bucket *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static int qos_vid_cmp(const struct qos_vid *a, const struct qos_vid *b)
+{
+	return intcmp(a->vid, b->vid);
+}
+
+static struct qos_bucket *qos_bucket_lookup(uint32_t vid)
+{
+	struct qos_bucket key = { .vid = vid };
+
+	return rb_search(&qos_bucket_root, &key, rb, qos_bucket_cmp);
+}
+
+static struct qos_vid *qos_vid_lookup(uint32_t vid)
+{
+	struct qos_vid key = { .vid = vid };
+
+	return rb_search(&qos_vid_root, &key, rb, qos_vid_cmp);
+}
+
+static struct qos_vid *qos_vid_get(uint32_t vid)
+{
+	struct qos_vid *v = qos_vid_lookup(vid);
+
+	if (!v) {
+		v = xzalloc(sizeof(*v));
+		v->vid = vid;
+		rb_insert(&qos_vid_root, v, rb, qos_vid_cmp);
+	}
+	return v;
+}
+
+static double qos_max_ops(const struct qos_bucket *b)
+{
+	return max((double)b->limit.iops * b->limit.burst / 1000, 1.0);
+}
+
+static double qos_max_bytes(const struct qos_bucket *b)
+{
+	return max((double)b->limit.bps * b->limit.burst / 1000, 1.0);
+}
+
+static void qos_refill(struct qos_bucket *b, uint64_t now)
+{
+	double sec = (double)(now - b->last) / 1000000000;
+
+	b->last = now;
+	b->ops = min(b->ops + b->limit.iops * sec, qos_max_ops(b));
+	b->bytes = min(b->bytes + b->limit.bps * sec, qos_max_bytes(b));
+}
+
+/* the number of the data objects and the bytes of a client request */
+static bool qos_request_cost(const struct request *req, uint32_t *vid,
+			     uint32_t *nr, uint32_t *len)
+{
+	const struct sd_req *hdr = &req->rq;
+	uint64_t oid;
+
+	if (req->local || hdr->flags & SD_FLAG_CMD_FWD)
+		return false;
+
+	switch (hdr->opcode) {
+	case SD_OP_READ_OBJ:
+	case SD_OP_WRITE_OBJ:
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		oid = hdr->obj.oid;
+		*nr = 1;
+		*len = hdr->data_length;
+		break;
+	case SD_OP_READ_OBJS:
+		oid = req->vec[0].oid;
+		*nr = hdr->vec.nr;
+		*len = hdr->vec.rlen;
+		break;
+	case SD_OP_WRITE_OBJS:
+		oid = req->vec[0].oid;
+		*nr = hdr->vec.nr;
+		*len = hdr->data_length - hdr->vec.nr * sizeof(*req->vec);
+		break;
+	default:
+		return false;
+	}
+
+	if (!is_data_obj(oid))
+		return false;
+
+	*vid = oid_to_vid(oid);
+	return true;
+}
+
+static bool qos_admit(struct qos_bucket *b, const struct request *req)
+{
+	uint32_t vid, nr = 0, len = 0;
+
+	qos_request_cost(req, &vid, &nr, &len);
+
+	if (b->limit.iops && b->ops < 1)
+		return false;
+	if (b->limit.bps && b->bytes <= 0)
+		return false;
+
+	if (b->limit.iops)
+		b->ops -= nr;
+	if (b->limit.bps)
+		b->bytes -= len;
+	return true;
+}
+
+static void qos_arm_timer(void)
+{
+	if (qos_timer_armed)
+		return;
+	qos_timer_armed = true;
+	add_timer(&qos_timer, QOS_TICK);
+}
+
+/* requeue the parked requests which the tokens allow */
+static void qos_release(struct qos_bucket *b)
+{
+	struct request *req;
+
+	qos_refill(b, clock_get_time());
+	list_for_each_entry(req, &b->parked, request_list) {
+		if (!qos_admit(b, req))
+			break;
+		list_del(&req->request_list);
+		req->qos_admitted = true;
+		requeue_request(req);
+	}
+
+	if (list_empty(&b->parked) && list_linked(&b->active_list))
+		list_del(&b->active_list);
+}
+
+static void qos_tick(void *data)
+{
+	struct qos_bucket *b;
+
+	qos_timer_armed = false;
+	list_for_each_entry(b, &qos_active, active_list)
+		qos_release(b);
+
+	if (!list_empty(&qos_active))
+		qos_arm_timer();
+}
+
+static int qos_parse_limit(const char *value, struct qos_limit *limit)
+{
+	char buf[256], *saveptr = NULL, *p;
+	uint64_t n;
+
+	pstrcpy(buf, sizeof(buf), value);
+	memset(limit, 0, sizeof(*limit));
+	limit->burst = QOS_DEFAULT_BURST;
+
+	for (p = strtok_r(buf, ", \t\n", &saveptr); p;
+	     p = strtok_r(NULL, ", \t\n", &saveptr)) {
+		char *v = strchr(p, '=');
+
+		if (!v)
+			return -1;
+		*v++ = '\0';
+
+		if (option_parse_size(v, &n) < 0)
+			return -1;
+
+		if (!strcmp(p, "iops"))
+			limit->iops = min(n, (uint64_t)UINT32_MAX);
+		else if (!strcmp(p, "bps"))
+			limit->bps = n;
+		else if (!strcmp(p, "burst"))
+			limit->burst = n ? min(n, (uint64_t)UINT32_MAX) :
+				QOS_DEFAULT_BURST;
+		else
+			return -1;
+	}
+
+	return 0;
+}
+
+static int qos_read_limit(const char *name, uint64_t create_time,
+			  struct qos_limit *limit)
+{
+	struct sheepdog_vdi_attr *vattr;
+	uint32_t attrid, len;
+	int ret;
+
+	vattr = xzalloc(sizeof(*vattr));
+	pstrcpy(vattr->name, sizeof(vattr->name), name);
+	pstrcpy(vattr->key, sizeof(vattr->key), QOS_ATTR_KEY);
+
+	ret = get_vdi_attr(vattr, SD_ATTR_OBJ_SIZE, sd_hash_vdi(name), &attrid,
+			   create_time, false, false, false);
+	if (ret == SD_RES_NO_OBJ) {
+		/* no limits */
+		memset(limit, 0, sizeof(*limit));
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = sd_read_object(vid_to_attr_oid(sd_hash_vdi(name), attrid),
+			     (char *)vattr, SD_ATTR_OBJ_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	len = min(vattr->value_len, SD_MAX_VDI_ATTR_VALUE_LEN - 1);
+	vattr->value[len] = '\0';
+	if (qos_parse_limit(vattr->value, limit) < 0) {
+		sd_err("invalid %s of %s, %s", QOS_ATTR_KEY, name,
+		       vattr->value);
+		memset(limit, 0, sizeof(*limit));
+	}
+out:
+	free(vattr);
+	return ret;
+}
+
+static void qos_load_work(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	char name[SD_MAX_VDI_LEN];
+	struct vdi_iocb iocb = {};
+	struct vdi_info info = {};
+
+	lw->ret = sd_read_object(vid_to_vdi_oid(lw->vid), name, sizeof(name), 0);
+	if (lw->ret != SD_RES_SUCCESS)
+		return;
+	name[sizeof(name) - 1] = '\0';
+
+	iocb.name = name;
+	iocb.tag = "";
+	lw->ret = vdi_lookup(&iocb, &info);
+	if (lw->ret != SD_RES_SUCCESS)
+		return;
+
+	lw->working_vid = info.vid;
+	lw->ret = qos_read_limit(name, info.create_time, &lw->limit);
+}
+
+static void qos_map(uint32_t vid, uint32_t bucket_vid)
+{
+	struct qos_vid *v = qos_vid_get(vid);
+
+	v->bucket_vid = bucket_vid;
+	v->stale = false;
+}
+
+static main_fn void qos_load_done(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	struct qos_vid *v = qos_vid_lookup(lw->vid);
+	struct qos_bucket *b;
+	uint32_t vid;
+
+	v->loading = false;
+	if (lw->ret != SD_RES_SUCCESS) {
+		/* leave the vid unlimited, and retry when it is seen again */
+		sd_debug("failed to look up %" PRIx32 ", %s", lw->vid,
+			 sd_strerror(lw->ret));
+		v->stale = true;
+		goto out;
+	}
+
+	b = qos_bucket_lookup(lw->working_vid);
+	if (!lw->limit.iops && !lw->limit.bps) {
+		qos_map(lw->vid, 0);
+		if (b) {
+			/* let the parked requests go */
+			b->limit = lw->limit;
+			qos_release(b);
+		}
+		goto out;
+	}
+
+	if (!b) {
+		b = xzalloc(sizeof(*b));
+		b->vid = lw->working_vid;
+		b->limit = lw->limit;
+		b->ops = qos_max_ops(b);
+		b->bytes = qos_max_bytes(b);
+		b->last = clock_get_time();
+		INIT_LIST_HEAD(&b->parked);
+		INIT_LIST_NODE(&b->active_list);
+		rb_insert(&qos_bucket_root, b, rb, qos_bucket_cmp);
+	} else {
+		qos_refill(b, clock_get_time());
+		b->limit = lw->limit;
+		b->ops = min(b->ops, qos_max_ops(b));
+		b->bytes = min(b->bytes, qos_max_bytes(b));
+	}
+	sd_info("%" PRIx32 ": %" PRIu32 " iops, %" PRIu64 " bytes/sec, "
+		"burst %" PRIu32 " msec", b->vid, b->limit.iops, b->limit.bps,
+		b->limit.burst);
+
+	qos_map(lw->vid, b->vid);
+	for (vid = b->vid; vid; vid = get_vdi_parent(vid))
+		qos_map(vid, b->vid);
+out:
+	free(lw);
+}
+
+static void qos_load(struct qos_vid *v)
+{
+	struct qos_load_work *lw;
+
+	if (v->loading)
+		return;
+
+	lw = xzalloc(sizeof(*lw));
+	lw->vid = v->vid;
+	lw->work.fn = qos_load_work;
+	lw->work.done = qos_load_done;
+	v->loading = true;
+	queue_work(qos_wq, &lw->work);
+}
+
+/*
+ * Park the request if its vdi has run out of the tokens.  Returns true if the
+ * request is parked, in which case it is requeued later.
+ */
+main_fn bool qos_throttle(struct request *req)
+{
+	struct qos_bucket *b;
+	struct qos_vid *v;
+	uint32_t vid, nr, len;
+
+	if (req->qos_admitted) {
+		req->qos_admitted = false;
+		return false;
+	}
+
+	if (!qos_wq || !qos_request_cost(req, &vid, &nr, &len))
+		return false;
+
+	v = qos_vid_lookup(vid);
+	if (!v) {
+		v = qos_vid_get(vid);
+		v->stale = true;
+	}
+	if (v->stale)
+		qos_load(v);
+
+	if (!v->bucket_vid)
+		return false;
+	b = qos_bucket_lookup(v->bucket_vid);
+	if (!b)
+		return false;
+
+	if (list_empty(&b->parked)) {
+		qos_refill(b, clock_get_time());
+		if (qos_admit(b, req))
+			return false;
+	}
+
+	list_add_tail(&req->request_list, &b->parked);
+	if (!list_linked(&b->active_list))
+		list_add_tail(&b->active_list, &qos_active);
+	qos_arm_timer();
+	return true;
+}
+
+/* The limits of some vdi changed, look up all the vids again */
+main_fn void qos_invalidate(const char *key)
+{
+	struct qos_vid *v;
+
+	if (strcmp(key, QOS_ATTR_KEY) != 0)
+		return;
+
+	rb_for_each_entry(v, &qos_vid_root, rb)
+		v->stale = true;
+}
+
+int qos_init(void)
+{
+	qos_wq = create_ordered_work_queue("qos");
+	if (!qos_wq)
+		return -1;
+
+	qos_timer.callback = qos_tick;
+	return 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Readahead of the sequential readers at the gateway
+ *
+ * The gateway tracks the client reads of the data objects of each vdi.  After
+ * RA_TRIGGER reads which continue where the previous one ended, in the same
+ * object or at the start of the next one, the stream is sequential and the
+ * next objects are read in the background into the readahead buffer.  The
+ * window starts with one object and doubles every time the stream enters a
+ * new object, up to the window given with '-a'.  A read which doesn't follow
+ * the stream resets it and drops the prefetched objects of the vdi.
+ *
+ * The buffer is bounded by the size given with '-a' and the least recently
+ * used objects are evicted first.  A write to an object on this gateway drops
+ * its prefetched copy when the write is queued and again when it completes,
+ * see readahead_note_write().  A prefetch still in flight then can't be
+ * dropped, so it's checked against gateway_write_gen() when it's served, and
+ * discarded if a write was issued or done since its read started.  The
+ * readers of an object being prefetched wait for it.
+ */
+
+#include "sheep_priv.h"
+
+#define RA_TRIGGER	4
+#define RA_NR_STREAMS	256
+
+struct ra_stream {
+	uint32_t vid;
+	uint64_t last_idx;
+	uint32_t last_end;
+	uint32_t nr_seq;
+	uint32_t window;
+	uint64_t next_idx;	/* the first object not prefetched yet */
+};
+
+struct ra_object {
+	struct list_node list;	/* ordered by the last use */
+	uint64_t oid;
+	uint32_t length;
+	uint32_t gen;
+	bool ready;
+	void *buf;
+};
+
+struct ra_work {
+	struct work work;
+	struct ra_object *obj;
+};
+
+static struct sd_mutex ra_lock = SD_MUTEX_INITIALIZER;
+static struct sd_cond ra_cond = SD_COND_INITIALIZER;
+static struct ra_stream streams[RA_NR_STREAMS];
+static LIST_HEAD(ra_objects);
+static uint64_t ra_bytes;
+
+static uint32_t ra_max_window;
+static uint64_t ra_max_bytes;
+static struct work_queue *ra_wq;
+
+static struct ra_object *ra_lookup(uint64_t oid)
+{
+	struct ra_object *obj;
+
+	list_for_each_entry(obj, &ra_objects, list)
+		if (obj->oid == oid)
+			return obj;
+
+	return NULL;
+}
+
+static void ra_free(struct ra_object *obj)
+{
+	list_del(&obj->list);
+	ra_bytes -= obj->length;
+	free(obj->buf);
+	free(obj);
+}
+
+/* Make room for 'len' bytes, returns false if the in-flight ones fill it */
+static bool ra_reserve(uint32_t len)
+{
+	struct ra_object *obj, *lru;
+
+	while (ra_bytes + len > ra_max_bytes) {
+		lru = NULL;
+		list_for_each_entry(obj, &ra_objects, list)
+			if (obj->ready)
+				lru = obj;
+		if (!lru)
+			return false;
+		ra_free(lru);
+	}
+
+	return true;
+}
+
+/* Drop the prefetched objects of 'vid' after its stream is broken */
+static void ra_drop(uint32_t vid)
+{
+	struct ra_object *obj;
+
+	list_for_each_entry(obj, &ra_objects, list)
+		if (obj->ready && oid_to_vid(obj->oid) == vid)
+			ra_free(obj);
+}
+
+static void ra_work_fn(struct work *work)
+{
+	struct ra_work *rw = container_of(work, struct ra_work, work);
+	struct ra_object *obj = rw->obj;
+	struct sd_req hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_READ_OBJ);
+	hdr.data_length = obj->length;
+	hdr.obj.oid = obj->oid;
+	ret = exec_local_req(&hdr, obj->buf);
+
+	sd_mutex_lock(&ra_lock);
+	obj->ready = true;
+	if (ret != SD_RES_SUCCESS) {
+		sd_debug("%016"PRIx64", %s", obj->oid, sd_strerror(ret));
+		ra_free(obj);
+	}
+	sd_cond_broadcast(&ra_cond);
+	sd_mutex_unlock(&ra_lock);
+}
+
+static void ra_work_done(struct work *work)
+{
+	struct ra_work *rw = container_of(work, struct ra_work, work);
+
+	free(rw);
+}
+
+/* Called with ra_lock held */
+static void ra_prefetch(uint32_t vid, uint64_t idx, struct list_head *works)
+{
+	uint64_t oid = vid_to_data_oid(vid, idx);
+	uint32_t len = get_vdi_object_size(vid);
+	struct ra_object *obj;
+	struct ra_work *rw;
+
+	if (ra_lookup(oid) || !ra_reserve(len))
+		return;
+
+	obj = xzalloc(sizeof(*obj));
+	obj->oid = oid;
+	obj->length = len;
+	obj->gen = gateway_write_gen(oid);
+	obj->buf = xvalloc(len);
+	list_add(&obj->list, &ra_objects);
+	ra_bytes += len;
+
+	rw = xzalloc(sizeof(*rw));
+	rw->obj = obj;
+	rw->work.fn = ra_work_fn;
+	rw->work.done = ra_work_done;
+	list_add_tail(&rw->work.w_list, works);
+}
+
+/* Called with ra_lock held */
+static void ra_update_stream(uint64_t oid, uint32_t offset, uint32_t length,
+			     struct list_head *works)
+{
+	uint32_t vid = oid_to_vid(oid);
+	uint64_t idx = data_oid_to_idx(oid), end;
+	struct ra_stream *s = streams + vid % RA_NR_STREAMS;
+	bool new_obj = idx != s->last_idx;
+
+	if (s->vid != vid) {
+		memset(s, 0, sizeof(*s));
+		s->vid = vid;
+	} else if ((idx == s->last_idx && offset == s->last_end) ||
+		   (idx == s->last_idx + 1 && offset == 0))
+		s->nr_seq++;
+	else if (s->nr_seq) {
+		sd_debug("stream of %"PRIx32" broken at %"PRIu64, vid, idx);
+		s->nr_seq = 0;
+		s->window = 0;
+		s->next_idx = 0;
+		ra_drop(vid);
+	}
+	s->last_idx = idx;
+	s->last_end = offset + length;
+
+	if (s->nr_seq < RA_TRIGGER)
+		return;
+
+	if (!s->window)
+		s->window = 1;
+	else if (new_obj)
+		s->window = min(s->window * 2, ra_max_window);
+
+	end = idx + s->window;
+	for (uint64_t i = max(s->next_idx, idx + 1);
+	     i <= end && i < MAX_DATA_OBJS; i++)
+		ra_prefetch(vid, i, works);
+	s->next_idx = max(s->next_idx, end + 1);
+}
+
+/*
+ * Serve the client read 'req' of a data object from the readahead buffer if
+ * it's there, and prefetch the following objects if the read continues a
+ * sequential stream.  Returns true if the read is done.
+ */
+bool readahead_read(struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	struct ra_object *obj;
+	struct ra_work *rw;
+	LIST_HEAD(works);
+	bool hit = false;
+
+	if (!ra_wq)
+		return false;
+
+	sd_mutex_lock(&ra_lock);
+	while ((obj = ra_lookup(hdr->obj.oid)) && !obj->ready)
+		sd_cond_wait(&ra_cond, &ra_lock);
+	if (obj) {
+		if (obj->gen != gateway_write_gen(obj->oid))
+			ra_free(obj);
+		else if (hdr->obj.offset + hdr->data_length <= obj->length) {
+			memcpy(req->data, (char *)obj->buf + hdr->obj.offset,
+			       hdr->data_length);
+			req->rp.data_length = hdr->data_length;
+			list_move(&obj->list, &ra_objects);
+			hit = true;
+		}
+	}
+	ra_update_stream(hdr->obj.oid, hdr->obj.offset, hdr->data_length,
+			 &works);
+	sd_mutex_unlock(&ra_lock);
+
+	list_for_each_entry(rw, &works, work.w_list) {
+		list_del(&rw->work.w_list);
+		queue_work(ra_wq, &rw->work);
+	}
+
+	return hit;
+}
+
+/* Drop the prefetched copy of 'oid', which is being or was just written */
+main_fn void readahead_note_write(uint64_t oid)
+{
+	struct ra_object *obj;
+
+	if (!ra_wq)
+		return;
+
+	sd_mutex_lock(&ra_lock);
+	obj = ra_lookup(oid);
+	if (obj && obj->ready)
+		ra_free(obj);
+	sd_mutex_unlock(&ra_lock);
+}
+
+int readahead_init(uint32_t window, uint64_t size)
+{
+	ra_max_window = window;
+	ra_max_bytes = size;
+
+	ra_wq = create_work_queue("readahead", WQ_DYNAMIC);
+	if (!ra_wq)
+		return -1;
+	/* the prefetches are gateway reads */
+	set_work_queue_blocking(ra_wq);
+
+	sd_info("readahead window %"PRIu32", buffer %"PRIu64, window, size);
+	return 0;
+}
@@ -30,6 +30,10 @@ struct recovery_list_work {
 
 	uint64_t count;
 	uint64_t *oids;
+
+	/* for the wildcard recovery, see find_wildcard_holders() */
+	uint64_t *holder_oids;
+	uint16_t *holders;
 };
 
 /* for recovering objects */
@@ -44,6 +48,23 @@ struct recovery_obj_work {
 	uint8_t local_sha1[SHA1_DIGEST_SIZE];
 
 	bool wildcard;
+
+	/* for the caps of the recovery window, see pick_next_object() */
+	struct list_node inflight_list;
+	const struct sd_node *src;
+	const char *dir;
+};
+
+struct token_bucket {
+	int64_t tokens;		/* bytes, can be negative */
+	uint64_t time;		/* of the last refill in nsec */
+};
+
+/* the token bucket of each source node */
+struct recovery_link {
+	struct node_id nid;
+	struct token_bucket bucket;
+	struct rb_node rb;
 };
 
 /*
@@ -79,7 +100,26 @@ struct recovery_info {
 	uint64_t queue_work_interval;
 	bool throttling;
 
+	/* ->oids[done, next) being recovered, i.e. the recovery window */
+	struct list_head inflight_list;
+	uint32_t max_inflight;
+	uint32_t max_per_node;
+	uint32_t max_per_disk;
+
+	/* bandwidth limits, see recovery_bucket_ready() */
+	struct token_bucket bucket;
+	struct rb_root link_root;
+	bool bucket_timer;
+	uint64_t rate;			/* adapted ->bandwidth */
+	uint64_t adapt_time;
+	uint64_t adapt_latency;
+	uint64_t adapt_nr;
+
 	bool wildcard;
+	/* ->holders[i] holds ->holder_oids[i] in its working directory */
+	uint64_t *holder_oids;
+	uint16_t *holders;
+	const struct sd_node **holder_nodes;	/* of ->cur_vinfo */
 
 	bool cancel;		/* for avoiding disk full by recovery */
 };
@@ -94,6 +134,31 @@ static main_thread(struct recovery_info *) current_rinfo;
 
 static void queue_recovery_work(struct recovery_info *rinfo);
 static void free_recovery_obj_work(struct recovery_obj_work *row);
+static void recover_next_objects(struct recovery_info *rinfo);
+static void add_recovery_timer(struct recovery_timer *t, unsigned int mseconds);
+
+/* Defaults of struct recovery_window */
+#define DEFAULT_RECOVERY_INFLIGHT_PER_DISK	4
+#define DEFAULT_RECOVERY_PER_NODE		8
+#define DEFAULT_RECOVERY_PER_DISK		4
+
+/* How far pick_next_object() looks ahead for an object under the caps */
+#define RECOVERY_LOOKAHEAD	64
+
+/* Retry interval when the bandwidth is exhausted, in msec */
+#define RECOVERY_BUCKET_WAIT	100
+
+/* Period and steps of adapting the bandwidth to the gateway latency */
+#define RECOVERY_ADAPT_PERIOD	(UINT64_C(1000000000))	/* nsec */
+#define RECOVERY_RATE_STEPS	16
+
+/* Number of the oids in one SD_OP_OIDS_EXIST of the wildcard recovery */
+#define RECOVERY_EXIST_BATCH	4096
+
+#define NO_HOLDER		UINT16_MAX
+
+/* A vdi with I/O through any gateway within this is recovered early */
+#define RECOVERY_RECENT_IO	600	/* sec */
 
 /* Dynamically grown list buffer default as 4M (2T storage) */
 #define DEFAULT_LIST_BUFFER_SIZE (UINT64_C(1) << 22)
@@ -135,9 +200,16 @@ rollback:
 	if (rinfo->vinfo_array[*epoch] == NULL) {
 		sd_mutex_lock(&rinfo->vinfo_lock);
 		if (rinfo->vinfo_array[*epoch] == NULL) {
+			struct vnode_info *base = cur;
+
+			/* the next epoch likely has the same members */
+			if (*epoch + 1 < rinfo->max_epoch &&
+			    rinfo->vinfo_array[*epoch + 1])
+				base = rinfo->vinfo_array[*epoch + 1];
 			for (int i = 0; i < nr_nodes; i++)
 				rb_insert(&nroot, &nodes[i], rb, node_cmp);
-			rinfo->vinfo_array[*epoch] = alloc_vnode_info(&nroot);
+			rinfo->vinfo_array[*epoch] =
+				share_vnode_info_from(base, &nroot, nr_nodes);
 		}
 		sd_mutex_unlock(&rinfo->vinfo_lock);
 	}
@@ -192,7 +264,7 @@ static void *read_erasure_object(uint64_t oid, uint8_t idx,
 {
 	struct sd_req hdr;
 	unsigned rlen = get_store_objsize(oid);
-	void *buf = xvalloc(rlen);
+	void *buf = xpool_zalloc(rlen);
 	struct recovery_work *rw = &row->base;
 	struct vnode_info *old = grab_vnode_info(rw->old_vinfo), *new_old;
 	uint32_t epoch = rw->epoch, tgt_epoch = rw->tgt_epoch;
@@ -209,7 +281,7 @@ again:
 		else
 			goto rollback;
 	}
-	node = oid_to_node(oid, &old->vroot, idx);
+	node = vinfo_oid_to_node(old, oid, idx);
 	sd_debug("%016"PRIx64" epoch %"PRIu32" tgt %"PRIu32" idx %d, %s",
 		 oid, epoch, tgt_epoch, idx, node_to_str(node));
 	if (invalid_node(node, rw->cur_vinfo))
@@ -227,7 +299,7 @@ again:
 	case SD_RES_SUCCESS:
 		goto done;
 	case SD_RES_OLD_NODE_VER:
-		free(buf);
+		pool_free(buf, rlen);
 		buf = NULL;
 		row->stop = true;
 		break;
@@ -237,7 +309,7 @@ rollback:
 					      rw->cur_vinfo, true);
 		if (!new_old) {
 			sd_warn("can not read %016"PRIx64" idx %d", oid, idx);
-			free(buf);
+			pool_free(buf, rlen);
 			buf = NULL;
 			goto done;
 		}
@@ -250,6 +322,97 @@ done:
 	return buf;
 }
 
+/*
+ * Rebuild the object from the stale local replica at row->local_epoch, reading
+ * from node only the SD_HASH_BLOCK_SIZE blocks whose digest differs.
+ *
+ * An error makes the caller fall back on copying the whole object, e.g. when
+ * node is an old sheep which doesn't support SD_OP_GET_BLOCK_HASH.
+ */
+static int recover_object_delta(struct recovery_obj_work *row,
+				const struct sd_node *node, uint32_t tgt_epoch)
+{
+	uint64_t oid = row->oid;
+	uint32_t epoch = row->base.epoch;
+	uint32_t rlen = get_store_objsize(oid);
+	uint32_t nr_blocks = DIV_ROUND_UP(rlen, SD_HASH_BLOCK_SIZE);
+	uint32_t hlen = nr_blocks * SHA1_DIGEST_SIZE, nr_changed = 0;
+	uint8_t *local = xmalloc(hlen), *remote = xmalloc(hlen);
+	char *buf = xpool_alloc(rlen);
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct siocb iocb = { 0 };
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_GET_BLOCK_HASH);
+	hdr.data_length = hlen;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = tgt_epoch;
+	ret = sheep_exec_req(&node->nid, &hdr, remote);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	if (rsp->data_length != hlen) {
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+
+	iocb.epoch = row->local_epoch;
+	iocb.buf = buf;
+	iocb.length = rlen;
+	ret = sd_store->read(oid, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	get_buffer_block_sha1((unsigned char *)buf, rlen, SD_HASH_BLOCK_SIZE,
+			      local);
+
+	for (uint32_t i = 0, start; i < nr_blocks; ) {
+		uint32_t offset, end;
+
+		if (!memcmp(local + i * SHA1_DIGEST_SIZE,
+			    remote + i * SHA1_DIGEST_SIZE, SHA1_DIGEST_SIZE)) {
+			i++;
+			continue;
+		}
+
+		/* read the run of the changed blocks at once */
+		for (start = i; i < nr_blocks; i++)
+			if (!memcmp(local + i * SHA1_DIGEST_SIZE,
+				    remote + i * SHA1_DIGEST_SIZE,
+				    SHA1_DIGEST_SIZE))
+				break;
+		offset = start * SD_HASH_BLOCK_SIZE;
+		end = i * SD_HASH_BLOCK_SIZE;
+		if (end > rlen)
+			end = rlen;
+
+		sd_init_req(&hdr, SD_OP_READ_PEER);
+		hdr.epoch = epoch;
+		hdr.flags = SD_FLAG_CMD_RECOVERY;
+		hdr.data_length = end - offset;
+		hdr.obj.oid = oid;
+		hdr.obj.tgt_epoch = tgt_epoch;
+		hdr.obj.offset = offset;
+		ret = sheep_exec_req(&node->nid, &hdr, buf + offset);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		nr_changed += i - start;
+	}
+
+	sd_debug("%016"PRIx64" is rebuilt from the replica at epoch %"PRIu32
+		 ", %"PRIu32"/%"PRIu32" blocks copied", oid, row->local_epoch,
+		 nr_changed, nr_blocks);
+
+	iocb.epoch = epoch;
+	iocb.length = rlen;
+	iocb.offset = 0;
+	ret = sd_store->create_and_write(oid, &iocb);
+out:
+	pool_free(buf, rlen);
+	free(remote);
+	free(local);
+	return ret;
+}
+
 /*
  * Read object from targeted node and store it in the local node.
  *
@@ -286,6 +449,12 @@ static int recover_object_from(struct recovery_obj_work *row,
 			if (ret == SD_RES_SUCCESS)
 				return ret;
 		} else {
+			/* the delta doesn't carry the map of a sparse object */
+			if (!node_is_local(node) && !cow_supported(oid) &&
+			    recover_object_delta(row, node, tgt_epoch)
+			    == SD_RES_SUCCESS)
+				return SD_RES_SUCCESS;
+
 			/* Non-identical, bury the mind */
 			row->local_epoch = 0;
 		}
@@ -298,15 +467,22 @@ static int recover_object_from(struct recovery_obj_work *row,
 		return SD_RES_NO_OBJ;
 	}
 
+	/* leave room for the map of a sparse copy-on-write object */
 	rlen = get_store_objsize(oid);
-	buf = xvalloc(rlen);
+	if (cow_supported(oid))
+		rlen += sizeof(struct cow_map);
+	buf = xpool_alloc(rlen);
 
 	/* recover from remote replica */
 	sd_init_req(&hdr, SD_OP_READ_PEER);
 	hdr.epoch = epoch;
-	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	hdr.flags = SD_FLAG_CMD_RECOVERY | SD_FLAG_CMD_SPARSE;
 	if (wildcard)
 		hdr.flags |= SD_FLAG_CMD_WILDCARD;
+	if (cow_supported(oid))
+		hdr.flags |= SD_FLAG_CMD_COW;
+	if (wire_compress_with(node))
+		hdr.flags |= SD_FLAG_CMD_ZSTD;
 	hdr.data_length = rlen;
 	hdr.obj.oid = oid;
 	hdr.obj.tgt_epoch = tgt_epoch;
@@ -314,48 +490,89 @@ static int recover_object_from(struct recovery_obj_work *row,
 	ret = sheep_exec_req(&node->nid, &hdr, buf);
 	if (ret == SD_RES_SUCCESS) {
 		iocb.epoch = epoch;
-		iocb.length = rsp->data_length;
+		iocb.length = min(rsp->data_length,
+				  (uint32_t)get_store_objsize(oid));
 		iocb.offset = rsp->obj.offset;
 		iocb.buf = buf;
+		if (rsp->flags & SD_FLAG_CMD_COW)
+			iocb.cow = (struct cow_map *)((char *)buf +
+						      iocb.length);
 		ret = sd_store->create_and_write(oid, &iocb);
 	}
 
-	free(buf);
+	pool_free(buf, rlen);
 	return ret;
 }
 
+/* Distance from this node, for the choice of the recovery source */
+static int source_distance(const struct sd_node *node)
+{
+	if (node_is_local(node))
+		return 0;
+	if (node->zone == sys->this_node.zone)
+		return 1;
+	return 2;
+}
+
+/*
+ * Fill nodes with the valid holders of oid in old, nearest first: this node,
+ * the nodes in the same zone, and then the others.  The nodes at the same
+ * distance are rotated by the hash of oid, so that the objects are read from
+ * all of them rather than from whichever comes first in the ring.
+ */
+static int recovery_sources(uint64_t oid, struct vnode_info *old,
+			    struct vnode_info *cur,
+			    const struct sd_node **nodes)
+{
+	const struct sd_node *near[3][SD_MAX_COPIES];
+	int nr_near[3] = { 0 }, nr_copies, nr = 0;
+	uint64_t hval = sd_hash_oid(oid);
+
+	nr_copies = get_obj_copy_number(oid, old->nr_zones);
+	for (int i = 0; i < nr_copies; i++) {
+		const struct sd_node *node = vinfo_oid_to_node(old, oid, i);
+		int d;
+
+		if (invalid_node(node, cur))
+			continue;
+
+		d = source_distance(node);
+		near[d][nr_near[d]++] = node;
+	}
+
+	for (int d = 0; d < ARRAY_SIZE(near); d++)
+		for (int i = 0; i < nr_near[d]; i++)
+			nodes[nr++] = near[d][(i + hval) % nr_near[d]];
+
+	return nr;
+}
+
 static int recover_object_from_replica(struct recovery_obj_work *row,
 				       struct vnode_info *old,
 				       uint32_t tgt_epoch)
 {
 	uint64_t oid = row->oid;
 	uint32_t epoch = row->base.epoch;
-	int nr_copies, ret = SD_RES_SUCCESS, start = 0;
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	int nr_nodes, ret = SD_RES_SUCCESS;
 	bool fully_replicated = true;
 
-	nr_copies = get_obj_copy_number(oid, old->nr_zones);
-
-	/* find local node first to try to recover from local */
-	for (int i = 0; i < nr_copies; i++) {
-		const struct sd_vnode *vnode;
+	nr_nodes = recovery_sources(oid, old, row->base.cur_vinfo, nodes);
 
-		vnode = oid_to_vnode(oid, &old->vroot, i);
+	/* the source chosen by pick_next_object() goes first */
+	for (int i = 1; row->src && i < nr_nodes; i++) {
+		const struct sd_node *node = nodes[i];
 
-		if (vnode_is_local(vnode)) {
-			start = i;
-			break;
-		}
+		if (node_cmp(node, row->src))
+			continue;
+		memmove(nodes + 1, nodes, sizeof(nodes[0]) * i);
+		nodes[0] = node;
+		break;
 	}
 
 	/* Let's do a breadth-first search */
-	for (int i = 0; i < nr_copies; i++) {
-		const struct sd_node *node;
-		int idx = (i + start) % nr_copies;
-
-		node = oid_to_node(oid, &old->vroot, idx);
-
-		if (invalid_node(node, row->base.cur_vinfo))
-			continue;
+	for (int i = 0; i < nr_nodes; i++) {
+		const struct sd_node *node = nodes[i];
 
 		ret = recover_object_from(row, node, tgt_epoch, false);
 		switch (ret) {
@@ -396,7 +613,17 @@ static int recover_object_wildcard(struct recovery_obj_work *row,
 	bool fully_replicated = true;
 	struct sd_node *n;
 
+	/* the node which answered first that it has the object */
+	if (row->src) {
+		ret = recover_object_from(row, row->src, tgt_epoch, true);
+		if (ret == SD_RES_SUCCESS || ret == SD_RES_OLD_NODE_VER)
+			return ret;
+	}
+
 	rb_for_each_entry(n, &old->nroot, rb) {
+		if (row->src && !node_cmp(n, row->src))
+			continue;
+
 		sd_info("doing wildcard recovery: at epoch %u, object %016"PRIx64
 			", from %s", tgt_epoch, oid, node_to_str(n));
 
@@ -485,19 +712,153 @@ out:
 	return ret;
 }
 
+#ifndef HAVE_ACCELIO
+
+struct strip_read {
+	int idx;
+	const struct node_id *nid;
+	struct sockfd *sfd;
+	struct sd_req hdr;
+	void *buf;
+};
+
+/*
+ * Request the strips of 'oid' not in 'skip' from the nodes of the previous
+ * epoch at once, and take the first 'need' of them to respond, so a slow node
+ * doesn't hold up the rebuild.  The connections with the responses left
+ * unread are closed.  Returns the number of the strips read into bufs[] and
+ * idxs[]; the caller reads the missing ones one by one, with the rollback of
+ * read_erasure_object().
+ */
+static int fetch_erasure_strips(uint64_t oid, struct recovery_obj_work *row,
+				int edp, const bool *skip, int need,
+				uint8_t **bufs, int *idxs)
+{
+	struct recovery_work *rw = &row->base;
+	struct vnode_info *old = grab_vnode_info(rw->old_vinfo);
+	unsigned rlen = get_store_objsize(oid);
+	struct strip_read reads[SD_MAX_COPIES];
+	struct pollfd pfd[SD_MAX_COPIES];
+	int nr = 0, nr_done = 0, i, ret;
+
+	if (old->nr_zones < edp)
+		goto out;
+
+	for (i = 0; i < edp; i++) {
+		const struct sd_node *node;
+		struct strip_read *r = reads + nr;
+
+		if (skip[i])
+			continue;
+		node = vinfo_oid_to_node(old, oid, i);
+		if (invalid_node(node, rw->cur_vinfo))
+			continue;
+
+		r->idx = i;
+		r->nid = &node->nid;
+		r->sfd = sockfd_cache_get(r->nid);
+		if (!r->sfd)
+			continue;
+
+		sd_init_req(&r->hdr, SD_OP_READ_PEER);
+		r->hdr.epoch = rw->epoch;
+		r->hdr.flags = SD_FLAG_CMD_RECOVERY;
+		r->hdr.data_length = rlen;
+		r->hdr.obj.oid = oid;
+		r->hdr.obj.tgt_epoch = rw->tgt_epoch;
+		r->hdr.obj.ec_index = i;
+		if (send_req(r->sfd->fd, &r->hdr, NULL, 0, sheep_need_retry,
+			     r->hdr.epoch, MAX_RETRY_COUNT)) {
+			sockfd_cache_del(r->nid, r->sfd);
+			continue;
+		}
+		r->buf = xpool_zalloc(rlen);
+		pfd[nr].fd = r->sfd->fd;
+		pfd[nr].events = POLLIN;
+		nr++;
+	}
+
+	while (nr_done < need && !row->stop) {
+		ret = poll(pfd, nr, MAX_POLLTIME * 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		for (i = 0; i < nr && nr_done < need; i++) {
+			struct strip_read *r = reads + i;
+			struct sd_rsp *rsp = (struct sd_rsp *)&r->hdr;
+
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+
+			/* ignored by poll() from now on */
+			pfd[i].fd = -1;
+			if (recv_rsp(r->sfd->fd, rsp, r->buf, rlen,
+				     sheep_need_retry, r->hdr.epoch,
+				     MAX_RETRY_COUNT)) {
+				sockfd_cache_del(r->nid, r->sfd);
+				r->sfd = NULL;
+				continue;
+			}
+			sockfd_cache_put(r->nid, r->sfd);
+			r->sfd = NULL;
+
+			if (rsp->result == SD_RES_OLD_NODE_VER) {
+				row->stop = true;
+				break;
+			}
+			if (rsp->result != SD_RES_SUCCESS)
+				continue;
+
+			bufs[nr_done] = r->buf;
+			idxs[nr_done] = r->idx;
+			r->buf = NULL;
+			nr_done++;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (reads[i].sfd)
+			sockfd_cache_drop(reads[i].nid, reads[i].sfd);
+		pool_free(reads[i].buf, rlen);
+	}
+	sd_debug("%016"PRIx64" %d/%d strips from %d requests", oid, nr_done,
+		 need, nr);
+out:
+	put_vnode_info(old);
+	return nr_done;
+}
+
+#else
+
+static int fetch_erasure_strips(uint64_t oid, struct recovery_obj_work *row,
+				int edp, const bool *skip, int need,
+				uint8_t **bufs, int *idxs)
+{
+	return 0;
+}
+
+#endif
+
+/*
+ * With LRC the strip is rebuilt from the rest of its local group if they are
+ * all there, otherwise from any 'd' strips as with Reed-Solomon.
+ */
 static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 				    struct recovery_obj_work *row)
 {
 	int len = get_store_objsize(oid);
-	char *lost = xvalloc(len);
-	int i, j;
+	char *lost = xpool_zalloc(len);
+	int i, j = 0, nr_set;
 	uint8_t policy = get_vdi_copy_policy(oid_to_vid(oid));
 	uint32_t object_size = get_vdi_object_size(oid_to_vid(oid));
 	int ed = 0, edp;
 	edp = ec_policy_to_dp(policy, &ed, NULL);
-	struct fec *ctx = ec_init(ed, edp);
+	struct fec *ctx = ec_init_policy(policy);
 	uint8_t *bufs[ed];
-	int idxs[ed];
+	int idxs[ed], set[edp];
+	bool skip[edp];
 
 	for (i = 0; i < ed; i++) {
 		bufs[i] = NULL;
@@ -505,8 +866,30 @@ static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 	}
 
 	/* Prepare replica */
-	for (i = 0, j = 0; i < edp && j < ed; i++) {
-		if (i == idx)
+	nr_set = ec_repair_set(ctx, idx, NULL, set);
+	if (nr_set) {
+		for (i = 0; i < edp; i++)
+			skip[i] = true;
+		for (i = 0; i < nr_set; i++)
+			skip[set[i]] = false;
+		j = fetch_erasure_strips(oid, row, edp, skip, nr_set, bufs,
+					 idxs);
+		if (j == nr_set)
+			goto decode;
+		if (row->stop)
+			goto fail;
+	}
+
+	for (i = 0; i < edp; i++)
+		skip[i] = i == idx;
+	for (i = 0; i < j; i++)
+		skip[idxs[i]] = true;
+	j += fetch_erasure_strips(oid, row, edp, skip, ed - j, bufs + j,
+				  idxs + j);
+	for (i = 0; i < j; i++)
+		skip[idxs[i]] = true;
+	for (i = 0; i < edp && j < ed && !row->stop; i++) {
+		if (skip[i])
 			continue;
 		bufs[j] = read_erasure_object(oid, i, row);
 		if (row->stop)
@@ -515,18 +898,20 @@ static void *rebuild_erasure_object(uint64_t oid, uint8_t idx,
 			continue;
 		idxs[j++] = i;
 	}
-	if (j != ed) {
-		free(lost);
-		lost = NULL;
-		goto out;
-	}
-
+	if (j != ed)
+		goto fail;
+decode:
 	/* Rebuild the lost replica */
-	ec_decode_buffer(ctx, bufs, idxs, lost, idx, object_size);
+	if (ec_repair_buffer(ctx, bufs, idxs, j, lost, idx, object_size) == 0)
+		goto out;
+	sd_err("failed to decode %016"PRIx64" strip %d", oid, idx);
+fail:
+	pool_free(lost, len);
+	lost = NULL;
 out:
 	ec_destroy(ctx);
 	for (i = 0; i < ed; i++)
-		free(bufs[i]);
+		pool_free(bufs[i], len);
 	return lost;
 }
 
@@ -538,7 +923,7 @@ uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid)
 		return SD_MAX_COPIES;
 
 	for (idx = 0; idx < m; idx++) {
-		const struct sd_node *n = oid_to_node(oid, &vinfo->vroot, idx);
+		const struct sd_node *n = vinfo_oid_to_node(vinfo, oid, idx);
 		if (node_is_local(n))
 			return idx;
 	}
@@ -588,7 +973,7 @@ static int recover_erasure_object(struct recovery_obj_work *row)
 	iocb.buf = buf;
 	iocb.ec_index = idx;
 	ret = sd_store->create_and_write(oid, &iocb);
-	free(buf);
+	pool_free(buf, iocb.length);
 out:
 	return ret;
 }
@@ -679,10 +1064,284 @@ static inline void direct_queue_recovery_work(uint64_t oid)
 	queue_work(sys->recovery_wqueue, &rw->work);
 }
 
+/*
+ * Refill the bucket at rate bytes per second, up to a quarter second worth of
+ * tokens.  Returns true if there are tokens to spend.
+ */
+static bool token_bucket_ready(struct token_bucket *tb, uint64_t rate,
+			       uint64_t now)
+{
+	int64_t burst = max(rate / 4, (uint64_t)SD_DATA_OBJ_SIZE);
+
+	if (!rate)
+		return true;
+
+	if (tb->time) {
+		tb->tokens += (double)rate * (now - tb->time) / 1000000000;
+		if (tb->tokens > burst)
+			tb->tokens = burst;
+	} else
+		tb->tokens = burst;
+	tb->time = now;
+
+	return tb->tokens > 0;
+}
+
+/*
+ * Multiplicative decrease of the rate when the average latency of the gateway
+ * requests exceeds the target, additive increase otherwise
+ */
+static void adapt_recovery_rate(struct recovery_info *rinfo, uint64_t now)
+{
+	uint64_t bandwidth = sys->rthrottling.bandwidth;
+	uint32_t target = sys->rthrottling.latency_target;
+	uint64_t latency = sys->stat.r.gway_total_latency;
+	uint64_t nr = sys->stat.r.gway_total_nr - sys->stat.r.gway_active_nr;
+	uint64_t step = bandwidth / RECOVERY_RATE_STEPS;
+
+	if (!target || !bandwidth) {
+		rinfo->rate = bandwidth;
+		return;
+	}
+
+	if (now - rinfo->adapt_time < RECOVERY_ADAPT_PERIOD)
+		return;
+
+	if (rinfo->adapt_time && nr > rinfo->adapt_nr) {
+		uint64_t avg = (latency - rinfo->adapt_latency) /
+			(nr - rinfo->adapt_nr);
+
+		if (avg > target)
+			rinfo->rate = max(rinfo->rate / 4 * 3, step);
+		else
+			rinfo->rate = min(rinfo->rate + step, bandwidth);
+		sd_debug("gateway latency %"PRIu64" usec, recovery rate %"
+			 PRIu64" bytes/s", avg, rinfo->rate);
+	} else if (!rinfo->adapt_time || nr == rinfo->adapt_nr)
+		/* no client I/O to protect */
+		rinfo->rate = min(rinfo->rate + step, bandwidth);
+
+	rinfo->adapt_time = now;
+	rinfo->adapt_latency = latency;
+	rinfo->adapt_nr = nr;
+}
+
+static void recover_next_objects_timer(void *arg)
+{
+	struct recovery_info *rinfo = main_thread_get(current_rinfo);
+
+	if (!rinfo || rinfo->state != RW_RECOVER_OBJ)
+		return;
+
+	rinfo->bucket_timer = false;
+	if (!rinfo->throttling)
+		recover_next_objects(rinfo);
+}
+
+/* Try again a bit later when the bandwidth is exhausted */
+static void wait_recovery_bucket(struct recovery_info *rinfo)
+{
+	static struct recovery_timer rt = {
+		.callback = recover_next_objects_timer,
+		.data = &rt,
+	};
+
+	if (rinfo->bucket_timer)
+		return;
+
+	rinfo->bucket_timer = true;
+	add_recovery_timer(&rt, RECOVERY_BUCKET_WAIT);
+}
+
+static int recovery_link_cmp(const struct recovery_link *a,
+			     const struct recovery_link *b)
+{
+	return node_id_cmp(&a->nid, &b->nid);
+}
+
+static struct token_bucket *get_link_bucket(struct recovery_info *rinfo,
+					    const struct sd_node *src)
+{
+	struct recovery_link *link, key = { .nid = src->nid };
+
+	link = rb_search(&rinfo->link_root, &key, rb, recovery_link_cmp);
+	if (!link) {
+		link = xzalloc(sizeof(*link));
+		link->nid = src->nid;
+		rb_insert(&rinfo->link_root, link, rb, recovery_link_cmp);
+	}
+
+	return &link->bucket;
+}
+
+/* Whether the total bandwidth allows to recover another object */
+static bool recovery_bucket_ready(struct recovery_info *rinfo, uint64_t now)
+{
+	adapt_recovery_rate(rinfo, now);
+	return token_bucket_ready(&rinfo->bucket, rinfo->rate, now);
+}
+
+static bool recovery_link_ready(struct recovery_info *rinfo,
+				const struct sd_node *src, uint64_t now)
+{
+	uint64_t rate = sys->rthrottling.link_bandwidth;
+
+	if (!src || !rate)
+		return true;
+
+	return token_bucket_ready(get_link_bucket(rinfo, src), rate, now);
+}
+
+static void charge_recovery_buckets(struct recovery_info *rinfo,
+				    const struct sd_node *src, uint64_t oid)
+{
+	uint32_t size = get_store_objsize(oid);
+
+	if (rinfo->rate)
+		rinfo->bucket.tokens -= size;
+	if (src && sys->rthrottling.link_bandwidth)
+		get_link_bucket(rinfo, src)->tokens -= size;
+}
+
+/* The number of the objects in flight which are read from 'node' */
+static int recovery_source_load(struct recovery_info *rinfo,
+				const struct sd_node *node)
+{
+	struct recovery_obj_work *row;
+	int nr = 0;
+
+	list_for_each_entry(row, &rinfo->inflight_list, inflight_list) {
+		if (row->src && !node_cmp(row->src, node))
+			nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * The node which recover_object_from_replica() should read oid from first: the
+ * least loaded of the nearest holders.  NULL if it's recovered locally or the
+ * source is not known in advance.
+ */
+static const struct sd_node *recovery_source(struct recovery_info *rinfo,
+					     uint64_t oid)
+{
+	const struct sd_node *nodes[SD_MAX_COPIES], *best = NULL;
+	int nr_nodes, load, best_load = INT_MAX;
+	uint64_t *p;
+
+	if (rinfo->wildcard) {
+		p = xbsearch(&oid, rinfo->holder_oids,
+			     rinfo->holder_oids ? rinfo->count : 0, obj_cmp);
+		if (!p || rinfo->holders[p - rinfo->holder_oids] == NO_HOLDER)
+			return NULL;
+		return rinfo->holder_nodes[rinfo->holders[p -
+							  rinfo->holder_oids]];
+	}
+	if (is_erasure_oid(oid))
+		return NULL;
+
+	nr_nodes = recovery_sources(oid, rinfo->old_vinfo, rinfo->cur_vinfo,
+				    nodes);
+	if (!nr_nodes || node_is_local(nodes[0]))
+		return NULL;
+
+	for (int i = 0; i < nr_nodes; i++) {
+		if (source_distance(nodes[i]) != source_distance(nodes[0]))
+			break;
+
+		load = recovery_source_load(rinfo, nodes[i]);
+		if (load < best_load) {
+			best = nodes[i];
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+static bool recovery_slot_available(struct recovery_info *rinfo,
+				    const struct sd_node *src, const char *dir)
+{
+	struct recovery_obj_work *row;
+	uint32_t nr_src = 0, nr_dir = 0;
+
+	list_for_each_entry(row, &rinfo->inflight_list, inflight_list) {
+		if (src && row->src && !node_cmp(row->src, src))
+			nr_src++;
+		if (row->dir == dir)
+			nr_dir++;
+	}
+
+	return (!src || nr_src < rinfo->max_per_node) &&
+		nr_dir < rinfo->max_per_disk;
+}
+
+/*
+ * Move the first object in the next RECOVERY_LOOKAHEAD ones whose source node
+ * and local disk still have a free slot, and whose source node has bandwidth
+ * left, to ->oids[next].  The bandwidth of the object is charged in advance.
+ *
+ * Returns false if there is no such object; one of the objects in flight will
+ * try again when it's recovered, or a timer when the bandwidth is exhausted.
+ * The slots are not checked when the window is empty, so the recovery never
+ * stalls.
+ */
+static bool pick_next_object(struct recovery_info *rinfo)
+{
+	uint64_t end = rinfo->next + RECOVERY_LOOKAHEAD, now = clock_get_time();
+	bool empty = list_empty(&rinfo->inflight_list);
+
+	if (!recovery_bucket_ready(rinfo, now)) {
+		wait_recovery_bucket(rinfo);
+		return false;
+	}
+
+	if (end > rinfo->count)
+		end = rinfo->count;
+
+	for (uint64_t i = rinfo->next; i < end; i++) {
+		uint64_t oid = rinfo->oids[i];
+		const struct sd_node *src = recovery_source(rinfo, oid);
+
+		if (!empty &&
+		    !recovery_slot_available(rinfo, src, md_get_object_dir(oid)))
+			continue;
+
+		if (!recovery_link_ready(rinfo, src, now))
+			continue;
+
+		charge_recovery_buckets(rinfo, src, oid);
+		rinfo->oids[i] = rinfo->oids[rinfo->next];
+		rinfo->oids[rinfo->next] = oid;
+		return true;
+	}
+
+	/* all the candidates wait for the bandwidth of their links */
+	if (empty || sys->rthrottling.link_bandwidth)
+		wait_recovery_bucket(rinfo);
+
+	return false;
+}
+
+/* Recover the object a client is waiting for ahead of the others */
+static void promote_recovery_object(struct recovery_info *rinfo, uint64_t *p)
+{
+	uint64_t oid = *p;
+
+	sd_debug("promote %016"PRIx64" in the recovery list", oid);
+
+	*p = rinfo->oids[rinfo->next];
+	rinfo->oids[rinfo->next] = oid;
+	queue_recovery_work(rinfo);
+	rinfo->next++;
+}
+
 main_fn bool oid_in_recovery(uint64_t oid)
 {
 	struct recovery_info *rinfo = main_thread_get(current_rinfo);
 	struct vnode_info *cur;
+	uint64_t *p;
 
 	if (!node_in_recovery())
 		return false;
@@ -728,9 +1387,15 @@ main_fn bool oid_in_recovery(uint64_t oid)
 		 *
 		 * FIXME: do we need more efficient yet complex data structure?
 		 */
-		if (xlfind(&oid, rinfo->oids + rinfo->next,
-			   rinfo->count - rinfo->next + 1, oid_cmp))
-			break;
+		p = xlfind(&oid, rinfo->oids + rinfo->next,
+			   rinfo->count - rinfo->next, oid_cmp);
+		if (p) {
+			if (rinfo->suspended)
+				break;
+			/* a client is waiting for it, recover it right now */
+			promote_recovery_object(rinfo, p);
+			return true;
+		}
 
 		/*
 		 * Newly created object after prepare_object_list() might not be
@@ -758,7 +1423,9 @@ static void free_recovery_list_work(struct recovery_list_work *rlw)
 {
 	put_vnode_info(rlw->base.cur_vinfo);
 	put_vnode_info(rlw->base.old_vinfo);
-	free(rlw->oids);
+	free_tag(rlw->oids, MEM_RECOVERY);
+	free_tag(rlw->holder_oids, MEM_RECOVERY);
+	free_tag(rlw->holders, MEM_RECOVERY);
 	free(rlw);
 }
 
@@ -771,14 +1438,18 @@ static void free_recovery_obj_work(struct recovery_obj_work *row)
 
 static void free_recovery_info(struct recovery_info *rinfo)
 {
+	rb_destroy(&rinfo->link_root, struct recovery_link, rb);
 	put_vnode_info(rinfo->cur_vinfo);
 	put_vnode_info(rinfo->old_vinfo);
-	free(rinfo->oids);
+	free_tag(rinfo->oids, MEM_RECOVERY);
+	free_tag(rinfo->holder_oids, MEM_RECOVERY);
+	free_tag(rinfo->holders, MEM_RECOVERY);
+	free_tag(rinfo->holder_nodes, MEM_RECOVERY);
 	for (int i = 0; i < rinfo->max_epoch; i++)
 		put_vnode_info(rinfo->vinfo_array[i]);
-	free(rinfo->vinfo_array);
+	free_tag(rinfo->vinfo_array, MEM_RECOVERY);
 	sd_destroy_mutex(&rinfo->vinfo_lock);
-	free(rinfo);
+	free_tag(rinfo, MEM_RECOVERY);
 }
 
 /* Return true if next recovery work is queued. */
@@ -857,25 +1528,39 @@ static inline void finish_recovery(struct recovery_info *rinfo)
 	sd_debug("recovery complete: new epoch %"PRIu32, recovered_epoch);
 }
 
-static void recover_next_object(struct recovery_info *rinfo)
+/* Return true if the next object is queued. */
+static bool recover_next_object(struct recovery_info *rinfo)
 {
 	if (run_next_rw())
-		return;
+		return false;
 
 	if (sys->cinfo.disable_recovery) {
 		sd_debug("suspended");
 		rinfo->suspended = true;
 		/* suspend until resume_suspended_recovery() is called */
-		return;
+		return false;
 	}
 
 	/* no more objects to be recovered */
 	if (rinfo->next >= rinfo->count)
-		return;
+		return false;
+
+	if (!pick_next_object(rinfo))
+		return false;
 
 	/* Try recover next object */
 	queue_recovery_work(rinfo);
 	rinfo->next++;
+	return true;
+}
+
+/* Fill the recovery window up to ->max_inflight objects */
+static void recover_next_objects(struct recovery_info *rinfo)
+{
+	/* rinfo can be freed by run_next_rw() when false is returned */
+	while (rinfo->next - rinfo->done < rinfo->max_inflight &&
+	       recover_next_object(rinfo))
+		;
 }
 
 void resume_suspended_recovery(void)
@@ -884,44 +1569,40 @@ void resume_suspended_recovery(void)
 
 	if (rinfo && rinfo->suspended) {
 		rinfo->suspended = false;
-		recover_next_object(rinfo);
+		if (rinfo->throttling)
+			recover_next_object(rinfo);
+		else
+			recover_next_objects(rinfo);
 	}
 }
 
-static void recovery_timer_handler(int fd, int events, void *data)
+/* A pending call of a recovery timer */
+struct recovery_timer_call {
+	struct timer timer;
+	struct recovery_timer *rt;
+};
+
+static void recovery_timer_fn(void *data)
 {
-	struct recovery_timer *t = data;
-	uint64_t val;
+	struct recovery_timer_call *call = data;
+	struct recovery_timer *t = call->rt;
 
-	if (read(fd, &val, sizeof(val)) < 0)
-		return;
+	free(call);
 	t->callback(t->data);
-	unregister_event(fd);
-	close(fd);
 }
 
+/*
+ * Every call runs the callback once, so 't' is added to the timer wheel
+ * through a timer of its own.
+ */
 static void add_recovery_timer(struct recovery_timer *t, unsigned int mseconds)
 {
-	struct itimerspec it;
-	int tfd;
-
-	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-	if (tfd < 0) {
-		sd_err("timerfd_create: %m");
-		return;
-	}
-
-	memset(&it, 0, sizeof(it));
-	it.it_value.tv_sec = mseconds / 1000;
-	it.it_value.tv_nsec = (mseconds % 1000) * 1000000;
-
-	if (timerfd_settime(tfd, 0, &it, NULL) < 0) {
-		sd_err("timerfd_settime: %m");
-		return;
-	}
+	struct recovery_timer_call *call = xzalloc(sizeof(*call));
 
-	if (register_event(tfd, recovery_timer_handler, t) < 0)
-		sd_err("failed to register timer fd");
+	call->timer.callback = recovery_timer_fn;
+	call->timer.data = call;
+	call->rt = t;
+	add_timer(&call->timer, mseconds);
 }
 
 static void recover_next_object_delay(void *arg)
@@ -982,6 +1663,8 @@ static void recover_object_main(struct work *work)
 						     base);
 	struct recovery_info *rinfo = main_thread_get(current_rinfo);
 
+	list_del(&row->inflight_list);
+
 	/* ->oids[done, next] is out of order since finish order is random */
 	if (rinfo->oids[rinfo->done] != row->oid) {
 		uint64_t *p = xlfind(&row->oid, rinfo->oids + rinfo->done,
@@ -1009,7 +1692,7 @@ static void recover_object_main(struct work *work)
 		goto finish_recovery;
 
 	if (!rinfo->throttling && !sys->rthrottling.throttling)
-		recover_next_object(rinfo);
+		recover_next_objects(rinfo);
 	else if (!rinfo->throttling && sys->rthrottling.throttling) {
 		static struct recovery_timer rt = {
 			.callback = recover_next_object_delay,
@@ -1046,7 +1729,10 @@ static void finish_object_list(struct work *work)
 	 *    this node. Speedy recovery not only improve data reliability but
 	 *    also cause less writing blocking on the lost data.
 	 *
-	 * We choose md_nr_disks() * 2 threads for recovery, no rationale.
+	 * Without throttling, up to ->max_inflight objects are recovered at
+	 * once, with at most ->max_per_node of them read from the same node
+	 * and ->max_per_disk of them written to the same local disk.  With
+	 * throttling, we choose md_nr_disks() * 2 threads, no rationale.
 	 */
 	uint32_t nr_threads = md_nr_disks() * 2;
 
@@ -1059,6 +1745,21 @@ static void finish_object_list(struct work *work)
 	rinfo->count = rlw->count;
 	rinfo->oids = rlw->oids;
 	rlw->oids = NULL;
+	if (rlw->holder_oids) {
+		struct sd_node *n;
+		int i = 0;
+
+		rinfo->holder_oids = rlw->holder_oids;
+		rinfo->holders = rlw->holders;
+		rlw->holder_oids = NULL;
+		rlw->holders = NULL;
+		/* in the order of the nodes queried */
+		rinfo->holder_nodes = xmalloc_tag(sizeof(*rinfo->holder_nodes) *
+						  rinfo->cur_vinfo->nr_nodes,
+						  MEM_RECOVERY);
+		rb_for_each_entry(n, &rinfo->cur_vinfo->nroot, rb)
+			rinfo->holder_nodes[i++] = n;
+	}
 	free_recovery_list_work(rlw);
 
 	if (run_next_rw())
@@ -1069,23 +1770,165 @@ static void finish_object_list(struct work *work)
 		return;
 	}
 
+	if (!rinfo->throttling) {
+		recover_next_objects(rinfo);
+		return;
+	}
+
 	for (uint32_t i = 0; i < nr_threads; i++) {
-		if (rinfo->throttling) {
-			static struct recovery_timer rt = {
-				.callback = recover_next_object_delay,
-				.data = &rt,
-			};
-			add_recovery_timer(&rt, rinfo->queue_work_interval);
-		} else
-			recover_next_object(rinfo);
+		static struct recovery_timer rt = {
+			.callback = recover_next_object_delay,
+			.data = &rt,
+		};
+		add_recovery_timer(&rt, rinfo->queue_work_interval);
 	}
+}
 
-	return;
+/*
+ * The object lists of the other nodes as of their SD_OP_GET_OBJ_LIST_DELTA
+ * version, so that only the changes are transferred on the next epoch.  Only
+ * the list preparation work accesses them.
+ */
+struct objlist_peer {
+	struct node_id nid;
+	uint64_t generation;
+	uint64_t version;
+	uint64_t *oids;		/* sorted */
+	size_t nr_oids;
+	struct rb_node rb;
+};
+
+static struct rb_root objlist_peer_root = RB_ROOT;
+
+static int objlist_peer_cmp(const struct objlist_peer *a,
+			    const struct objlist_peer *b)
+{
+	return node_id_cmp(&a->nid, &b->nid);
 }
 
-/* Fetch the object list from all the nodes in the cluster */
-static uint64_t *fetch_object_list(struct sd_node *e, uint32_t epoch,
-				   size_t *nr_oids)
+static void free_objlist_peer(struct objlist_peer *peer)
+{
+	rb_erase(&peer->rb, &objlist_peer_root);
+	free(peer->oids);
+	free(peer);
+}
+
+static struct objlist_peer *get_objlist_peer(const struct node_id *nid)
+{
+	struct objlist_peer *peer, key = { .nid = *nid };
+
+	peer = rb_search(&objlist_peer_root, &key, rb, objlist_peer_cmp);
+	if (peer)
+		return peer;
+
+	peer = xzalloc(sizeof(*peer));
+	peer->nid = *nid;
+	rb_insert(&objlist_peer_root, peer, rb, objlist_peer_cmp);
+	return peer;
+}
+
+/* Forget the lists of the nodes which are not in vinfo any more */
+static void prune_objlist_peers(struct vnode_info *vinfo)
+{
+	struct objlist_peer *peer;
+	struct sd_node key;
+
+	rb_for_each_entry(peer, &objlist_peer_root, rb) {
+		key.nid = peer->nid;
+		if (!rb_search(&vinfo->nroot, &key, rb, node_cmp))
+			free_objlist_peer(peer);
+	}
+}
+
+/* Merge the sorted inserted oids into the sorted list, skipping the removed */
+static void apply_object_list_delta(struct objlist_peer *peer,
+				    const uint64_t *ins, size_t nr_ins,
+				    const uint64_t *rem, size_t nr_rem)
+{
+	uint64_t *oids = xmalloc((peer->nr_oids + nr_ins) * sizeof(uint64_t));
+	size_t i = 0, j = 0, k = 0, nr = 0;
+
+	while (i < peer->nr_oids || j < nr_ins) {
+		uint64_t oid;
+
+		if (j == nr_ins || (i < peer->nr_oids && peer->oids[i] < ins[j]))
+			oid = peer->oids[i++];
+		else {
+			if (i < peer->nr_oids && peer->oids[i] == ins[j])
+				i++;
+			oid = ins[j++];
+		}
+
+		while (k < nr_rem && rem[k] < oid)
+			k++;
+		if (k < nr_rem && rem[k] == oid)
+			continue;
+		oids[nr++] = oid;
+	}
+
+	free(peer->oids);
+	peer->oids = oids;
+	peer->nr_oids = nr;
+}
+
+/*
+ * Bring the cached list of e up to date with SD_OP_GET_OBJ_LIST_DELTA.  Returns
+ * SD_RES_NO_SUPPORT if e is an old sheep.
+ */
+static int update_object_list(struct sd_node *e, uint32_t epoch,
+			      struct objlist_peer *peer)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	size_t buf_size = list_buffer_size, nr, nr_rem;
+	uint64_t *buf = xmalloc(buf_size);
+	int ret;
+
+retry:
+	sd_init_req(&hdr, SD_OP_GET_OBJ_LIST_DELTA);
+	hdr.data_length = buf_size;
+	hdr.epoch = epoch;
+	hdr.objlist.generation = peer->generation;
+	hdr.objlist.version = peer->version;
+	ret = sheep_exec_req(&e->nid, &hdr, buf);
+
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		break;
+	case SD_RES_BUFFER_SMALL:
+		buf_size *= 2;
+		buf = xrealloc(buf, buf_size);
+		goto retry;
+	default:
+		free(buf);
+		return ret;
+	}
+
+	nr = rsp->data_length / sizeof(uint64_t);
+	if (rsp->objlist.full) {
+		free(peer->oids);
+		peer->oids = buf;
+		peer->nr_oids = nr;
+	} else {
+		nr_rem = rsp->objlist.nr_removed;
+		if (nr_rem > nr) {
+			free(buf);
+			return SD_RES_INVALID_PARMS;
+		}
+		apply_object_list_delta(peer, buf, nr - nr_rem, buf + nr - nr_rem,
+					nr_rem);
+		sd_debug("%zu changes from %s", nr,
+			 addr_to_str(e->nid.addr, e->nid.port));
+		free(buf);
+	}
+	peer->generation = rsp->objlist.generation;
+	peer->version = rsp->objlist.version;
+
+	return SD_RES_SUCCESS;
+}
+
+static uint64_t *fetch_full_object_list(struct sd_node *e, uint32_t epoch,
+					size_t *nr_oids)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
@@ -1122,6 +1965,25 @@ retry:
 	return buf;
 }
 
+/* Fetch the object list from all the nodes in the cluster */
+static uint64_t *fetch_object_list(struct sd_node *e, uint32_t epoch,
+				   size_t *nr_oids)
+{
+	struct objlist_peer *peer = get_objlist_peer(&e->nid);
+	uint64_t *buf;
+
+	if (update_object_list(e, epoch, peer) != SD_RES_SUCCESS) {
+		free_objlist_peer(peer);
+		return fetch_full_object_list(e, epoch, nr_oids);
+	}
+
+	*nr_oids = peer->nr_oids;
+	buf = xmalloc(peer->nr_oids * sizeof(uint64_t));
+	memcpy(buf, peer->oids, peer->nr_oids * sizeof(uint64_t));
+	sd_debug("%zu", *nr_oids);
+	return buf;
+}
+
 /* Screen out objects that don't belong to this node */
 static void screen_object_list(struct recovery_list_work *rlw,
 			       uint64_t *oids, size_t nr_oids)
@@ -1139,7 +2001,7 @@ static void screen_object_list(struct recovery_list_work *rlw,
 
 		nr_objs = get_obj_copy_number(oids[i], rw->cur_vinfo->nr_zones);
 
-		oid_to_vnodes(oids[i], &rw->cur_vinfo->vroot, nr_objs, vnodes);
+		vinfo_oid_to_vnodes(rw->cur_vinfo, oids[i], nr_objs, vnodes);
 		for (j = 0; j < nr_objs; j++) {
 			if (!vnode_is_local(vnodes[j]))
 				continue;
@@ -1148,8 +2010,9 @@ static void screen_object_list(struct recovery_list_work *rlw,
 			/* enlarge the list buffer if full */
 			if (rlw->count == list_buffer_size / sizeof(uint64_t)) {
 				list_buffer_size *= 2;
-				rlw->oids = xrealloc(rlw->oids,
-						     list_buffer_size);
+				rlw->oids = xrealloc_tag(rlw->oids,
+							 list_buffer_size,
+							 MEM_RECOVERY);
 			}
 			break;
 		}
@@ -1158,6 +2021,320 @@ static void screen_object_list(struct recovery_list_work *rlw,
 	xqsort(rlw->oids, rlw->count, obj_cmp);
 }
 
+/*
+ * Drop the replicated objects which are stored here already, local being the
+ * object list of this node.  A reweight or a change of the vnodes moves only
+ * a small part of the objects, so most of the objects of this node stay in
+ * place and needn't go through the recovery queue.  The erasure coded ones
+ * are kept since the local strip may have another index now.
+ */
+static void skip_local_objects(struct recovery_list_work *rlw,
+			       uint64_t *local, size_t nr_local)
+{
+	uint64_t nr = 0;
+
+	xqsort(local, nr_local, obj_cmp);
+	for (uint64_t i = 0; i < rlw->count; i++) {
+		uint64_t oid = rlw->oids[i];
+
+		if (!is_erasure_oid(oid) &&
+		    xbsearch(&oid, local, nr_local, obj_cmp))
+			continue;
+		rlw->oids[nr++] = oid;
+	}
+
+	sd_info("%"PRIu64" objects to recover, %"PRIu64" in place", nr,
+		rlw->count - nr);
+	rlw->count = nr;
+}
+
+/*
+ * Take the answer of the node idx to SD_OP_OIDS_EXIST for the n oids: the
+ * ones it has are held by it unless another node answered before
+ */
+static void set_holders(int result, const uint64_t *missing, int nr_missing,
+			const uint64_t *oids, int n, uint16_t *holders,
+			uint16_t idx)
+{
+	if (result != SD_RES_SUCCESS && result != SD_RES_NO_OBJ)
+		return;
+	if (result == SD_RES_SUCCESS)
+		nr_missing = 0;
+
+	/* the missing oids come in the order of the query */
+	for (int i = 0, j = 0; i < n; i++) {
+		if (j < nr_missing && missing[j] == oids[i]) {
+			j++;
+			continue;
+		}
+		if (holders[i] == NO_HOLDER)
+			holders[i] = idx;
+	}
+}
+
+#ifndef HAVE_ACCELIO
+
+struct exist_query {
+	const struct sd_node *node;
+	struct sockfd *sfd;
+	struct sd_req hdr;
+	uint64_t *buf;
+};
+
+/* Ask all the other nodes at once which of the n oids they have */
+static void query_holders(const struct sd_node *nodes, int nr_nodes,
+			  uint32_t epoch, const uint64_t *oids, int n,
+			  uint16_t *holders)
+{
+	struct exist_query *qs = xcalloc(nr_nodes, sizeof(*qs));
+	struct pollfd *pfd = xcalloc(nr_nodes, sizeof(*pfd));
+	uint32_t len = sizeof(uint64_t) * n;
+	int i, nr = 0, nr_done = 0, ret;
+
+	for (i = 0; i < nr_nodes; i++) {
+		struct exist_query *q = qs + nr;
+
+		if (node_is_local(nodes + i))
+			continue;
+
+		q->node = nodes + i;
+		q->sfd = sockfd_cache_get(&q->node->nid);
+		if (!q->sfd)
+			continue;
+
+		sd_init_req(&q->hdr, SD_OP_OIDS_EXIST);
+		q->hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+		q->hdr.epoch = epoch;
+		q->hdr.data_length = len;
+		if (send_req(q->sfd->fd, &q->hdr, (void *)oids, len,
+			     sheep_need_retry, epoch, MAX_RETRY_COUNT)) {
+			sockfd_cache_del(&q->node->nid, q->sfd);
+			continue;
+		}
+		q->buf = xmalloc(len);
+		pfd[nr].fd = q->sfd->fd;
+		pfd[nr].events = POLLIN;
+		nr++;
+	}
+
+	while (nr_done < nr) {
+		ret = poll(pfd, nr, MAX_POLLTIME * 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			struct exist_query *q = qs + i;
+			struct sd_rsp *rsp = (struct sd_rsp *)&q->hdr;
+
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+
+			/* ignored by poll() from now on */
+			pfd[i].fd = -1;
+			nr_done++;
+			if (recv_rsp(q->sfd->fd, rsp, q->buf, len,
+				     sheep_need_retry, epoch,
+				     MAX_RETRY_COUNT)) {
+				sockfd_cache_del(&q->node->nid, q->sfd);
+				q->sfd = NULL;
+				continue;
+			}
+			sockfd_cache_put(&q->node->nid, q->sfd);
+			q->sfd = NULL;
+
+			set_holders(rsp->result, q->buf,
+				    rsp->data_length / sizeof(uint64_t), oids,
+				    n, holders, q->node - nodes);
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (qs[i].sfd)
+			sockfd_cache_drop(&qs[i].node->nid, qs[i].sfd);
+		free(qs[i].buf);
+	}
+	free(qs);
+	free(pfd);
+}
+
+#else
+
+static void query_holders(const struct sd_node *nodes, int nr_nodes,
+			  uint32_t epoch, const uint64_t *oids, int n,
+			  uint16_t *holders)
+{
+	uint64_t *buf = xmalloc(sizeof(uint64_t) * n);
+
+	for (int i = 0; i < nr_nodes; i++) {
+		struct sd_req hdr;
+		struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+		int ret;
+
+		if (node_is_local(nodes + i))
+			continue;
+
+		memcpy(buf, oids, sizeof(uint64_t) * n);
+		sd_init_req(&hdr, SD_OP_OIDS_EXIST);
+		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_PIGGYBACK;
+		hdr.epoch = epoch;
+		hdr.data_length = sizeof(uint64_t) * n;
+		ret = sheep_exec_req(&nodes[i].nid, &hdr, buf);
+		set_holders(ret, buf, rsp->data_length / sizeof(uint64_t),
+			    oids, n, holders, i);
+	}
+	free(buf);
+}
+
+#endif
+
+/*
+ * Find a node which has each object to recover in its working directory, in
+ * batches of RECOVERY_EXIST_BATCH oids sent to all the nodes at once, so that
+ * the wildcard recovery reads it from there first instead of asking the
+ * nodes one after another.  The objects which only sit in the stale
+ * directories are not found, and are searched for as before.
+ */
+static void find_wildcard_holders(struct recovery_list_work *rlw,
+				  const struct sd_node *nodes, int nr_nodes)
+{
+	uint64_t nr_found = 0;
+
+	if (!rlw->count || nr_nodes > NO_HOLDER)
+		return;
+
+	rlw->holder_oids = xmalloc_tag(sizeof(uint64_t) * rlw->count,
+				       MEM_RECOVERY);
+	memcpy(rlw->holder_oids, rlw->oids, sizeof(uint64_t) * rlw->count);
+	xqsort(rlw->holder_oids, rlw->count, obj_cmp);
+	rlw->holders = xmalloc_tag(sizeof(uint16_t) * rlw->count, MEM_RECOVERY);
+	memset(rlw->holders, 0xff, sizeof(uint16_t) * rlw->count);
+
+	for (uint64_t i = 0; i < rlw->count; i += RECOVERY_EXIST_BATCH) {
+		int n = min(rlw->count - i, (uint64_t)RECOVERY_EXIST_BATCH);
+
+		if (uatomic_read(&next_rinfo))
+			return;
+		query_holders(nodes, nr_nodes, rlw->base.epoch,
+			      rlw->holder_oids + i, n, rlw->holders + i);
+	}
+
+	for (uint64_t i = 0; i < rlw->count; i++)
+		if (rlw->holders[i] != NO_HOLDER)
+			nr_found++;
+	sd_info("%"PRIu64" of %"PRIu64" objects found for the wildcard "
+		"recovery", nr_found, rlw->count);
+}
+
+static int vid_cmp(const uint32_t *a, const uint32_t *b)
+{
+	return intcmp(*a, *b);
+}
+
+/*
+ * The sorted vids with I/O through the gateway of any of the nodes in the last
+ * RECOVERY_RECENT_IO seconds, all the vids served by an old sheep
+ */
+static uint32_t *fetch_active_vids(const struct sd_node *nodes, int nr_nodes,
+				   size_t *nr_vids)
+{
+	size_t len = sizeof(struct sd_stat) +
+		sizeof(struct sd_vdi_io_stat) * SD_MAX_VDI_IO_STATS, nr = 0;
+	char *buf = xmalloc(len);
+	uint32_t *vids = NULL;
+
+	for (int i = 0; i < nr_nodes; i++) {
+		struct sd_req hdr;
+		struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+		const struct sd_vdi_io_stat *st;
+		uint32_t rlen, nr_st;
+
+		sd_init_req(&hdr, SD_OP_STAT);
+		hdr.data_length = len;
+		hdr.stat.flags = SD_STAT_VDI;
+		if (sheep_exec_req(&nodes[i].nid, &hdr, buf) != SD_RES_SUCCESS)
+			continue;
+
+		/* old sheep doesn't know SD_STAT_VDI and reports the sockfds */
+		rlen = rsp->data_length - sizeof(struct sd_stat);
+		if (rsp->data_length <= sizeof(struct sd_stat) ||
+		    rlen % sizeof(*st))
+			continue;
+
+		st = (const struct sd_vdi_io_stat *)
+			(buf + sizeof(struct sd_stat));
+		nr_st = rlen / sizeof(*st);
+		vids = xrealloc(vids, sizeof(*vids) * (nr + nr_st));
+		for (uint32_t j = 0; j < nr_st; j++)
+			if (st[j].idle < RECOVERY_RECENT_IO)
+				vids[nr++] = st[j].vid;
+	}
+	free(buf);
+
+	xqsort(vids, nr, vid_cmp);
+	*nr_vids = nr;
+	return vids;
+}
+
+enum recovery_prio {
+	RECOVERY_PRIO_META,	/* inodes, btree index objects and ledgers */
+	RECOVERY_PRIO_ACTIVE,	/* the objects of the vdis with recent I/O */
+	RECOVERY_PRIO_REST,
+	NR_RECOVERY_PRIOS,
+};
+
+static enum recovery_prio recovery_prio(uint64_t oid, const uint32_t *vids,
+					size_t nr_vids)
+{
+	uint32_t vid = oid_to_vid(oid);
+
+	if (is_vdi_obj(oid) || is_vdi_btree_obj(oid) || is_ledger_object(oid))
+		return RECOVERY_PRIO_META;
+	if (xbsearch(&vid, vids, nr_vids, vid_cmp))
+		return RECOVERY_PRIO_ACTIVE;
+	return RECOVERY_PRIO_REST;
+}
+
+/*
+ * Order the list by the priority of the objects, each priority in the oid
+ * order.  A vm stalls as long as its inode is missing even if its data are
+ * mostly in place, so the objects needed to access any vdi go first, then the
+ * ones of the vdis in use.
+ */
+static void prioritize_objects(struct recovery_list_work *rlw,
+			       const struct sd_node *nodes, int nr_nodes)
+{
+	uint64_t start[NR_RECOVERY_PRIOS] = {}, *oids;
+	uint8_t *prio;
+	uint32_t *vids;
+	size_t nr_vids;
+
+	if (!rlw->count)
+		return;
+
+	vids = fetch_active_vids(nodes, nr_nodes, &nr_vids);
+	prio = xmalloc(rlw->count);
+	for (uint64_t i = 0; i < rlw->count; i++) {
+		prio[i] = recovery_prio(rlw->oids[i], vids, nr_vids);
+		if (prio[i] + 1 < NR_RECOVERY_PRIOS)
+			start[prio[i] + 1]++;
+	}
+	sd_info("%"PRIu64" metadata and %"PRIu64" active objects first",
+		start[RECOVERY_PRIO_ACTIVE], start[RECOVERY_PRIO_REST]);
+	for (int i = 1; i < NR_RECOVERY_PRIOS; i++)
+		start[i] += start[i - 1];
+
+	oids = xmalloc(sizeof(*oids) * rlw->count);
+	memcpy(oids, rlw->oids, sizeof(*oids) * rlw->count);
+	for (uint64_t i = 0; i < rlw->count; i++)
+		rlw->oids[start[prio[i]]++] = oids[i];
+
+	free(oids);
+	free(prio);
+	free(vids);
+}
+
 static int vnode_to_node_idx(struct sd_vnode *vnode, int nr_nodes,
 			     struct sd_node *nodes)
 {
@@ -1217,7 +2394,7 @@ static bool check_diskfull_possibility(uint32_t epoch, struct vnode_info *vinfo,
 			}
 			rb_insert(&seen_objects, key, node, seen_object_cmp);
 
-			oid_to_vnodes(oids[j], &vinfo->vroot, nr_objs, vnodes);
+			vinfo_oid_to_vnodes(vinfo, oids[j], nr_objs, vnodes);
 
 			for (int k = 0; k < nr_objs; k++) {
 				int node_idx = vnode_to_node_idx(
@@ -1273,7 +2450,8 @@ static void prepare_object_list(struct work *work)
 						      base);
 	int nr_nodes = rw->cur_vinfo->nr_nodes;
 	int start = random() % nr_nodes, i, end = nr_nodes;
-	uint64_t *oids;
+	uint64_t *oids, *local = NULL;
+	size_t nr_local = 0;
 	struct sd_node *nodes;
 
 	if (node_is_gateway_only())
@@ -1281,6 +2459,7 @@ static void prepare_object_list(struct work *work)
 
 	sd_debug("%u", rw->epoch);
 	wait_get_vdis_done();
+	prune_objlist_peers(rw->cur_vinfo);
 
 	nodes = xmalloc(sizeof(struct sd_node) * nr_nodes);
 	nodes_to_buffer(&rw->cur_vinfo->nroot, nodes);
@@ -1310,7 +2489,11 @@ again:
 		if (!oids)
 			continue;
 		screen_object_list(rlw, oids, nr_oids);
-		free(oids);
+		if (node_is_local(node)) {
+			local = oids;
+			nr_local = nr_oids;
+		} else
+			free(oids);
 	}
 
 	if (start != 0) {
@@ -1319,8 +2502,13 @@ again:
 		goto again;
 	}
 
+	skip_local_objects(rlw, local, nr_local);
+	prioritize_objects(rlw, nodes, nr_nodes);
+	if (rw->rinfo->wildcard)
+		find_wildcard_holders(rlw, nodes, nr_nodes);
 	sd_debug("%"PRIu64, rlw->count);
 out:
+	free(local);
 	free(nodes);
 }
 
@@ -1329,18 +2517,27 @@ int start_recovery(struct vnode_info *cur_vinfo, struct vnode_info *old_vinfo,
 {
 	struct recovery_info *rinfo;
 
-	rinfo = xzalloc(sizeof(struct recovery_info));
+	rinfo = xzalloc_tag(sizeof(struct recovery_info), MEM_RECOVERY);
 	rinfo->state = RW_PREPARE_LIST;
 	rinfo->epoch = sys->cinfo.epoch;
 	rinfo->tgt_epoch = epoch_lifted ? sys->cinfo.epoch - 1 :
 		sys->cinfo.epoch;
 	rinfo->count = 0;
 	rinfo->max_epoch = sys->cinfo.epoch;
-	rinfo->vinfo_array = xzalloc(sizeof(struct vnode_info *) *
-				     rinfo->max_epoch);
+	rinfo->vinfo_array = xzalloc_tag(sizeof(struct vnode_info *) *
+					 rinfo->max_epoch, MEM_RECOVERY);
 	rinfo->max_exec_count = sys->rthrottling.max_exec_count;
 	rinfo->queue_work_interval = sys->rthrottling.queue_work_interval;
 	rinfo->throttling = sys->rthrottling.throttling;
+	INIT_LIST_HEAD(&rinfo->inflight_list);
+	rinfo->max_inflight = sys->rwindow.max_inflight ?:
+		md_nr_disks() * DEFAULT_RECOVERY_INFLIGHT_PER_DISK;
+	rinfo->max_per_node = sys->rwindow.max_per_node ?:
+		DEFAULT_RECOVERY_PER_NODE;
+	rinfo->max_per_disk = sys->rwindow.max_per_disk ?:
+		DEFAULT_RECOVERY_PER_DISK;
+	INIT_RB_ROOT(&rinfo->link_root);
+	rinfo->rate = sys->rthrottling.bandwidth;
 	sd_init_mutex(&rinfo->vinfo_lock);
 	if (epoch_lifted)
 		rinfo->notify_complete = true; /* Reweight or node recovery */
@@ -1388,7 +2585,7 @@ static void queue_recovery_work(struct recovery_info *rinfo)
 	switch (rinfo->state) {
 	case RW_PREPARE_LIST:
 		rlw = xzalloc(sizeof(*rlw));
-		rlw->oids = xmalloc(list_buffer_size);
+		rlw->oids = xmalloc_tag(list_buffer_size, MEM_RECOVERY);
 
 		rw = &rlw->base;
 		rw->work.fn = prepare_object_list;
@@ -1398,6 +2595,9 @@ static void queue_recovery_work(struct recovery_info *rinfo)
 		row = xzalloc(sizeof(*row));
 		row->oid = rinfo->oids[rinfo->next];
 		row->wildcard = rinfo->wildcard;
+		row->src = recovery_source(rinfo, row->oid);
+		row->dir = md_get_object_dir(row->oid);
+		list_add_tail(&row->inflight_list, &rinfo->inflight_list);
 
 		rw = &row->base;
 		rw->work.fn = recover_object_work;
@@ -1449,6 +2649,9 @@ void set_recovery(struct recovery_throttling *rthrottling)
 		sys->rthrottling.throttling = true;
 	else
 		sys->rthrottling.throttling = false;
+	sys->rthrottling.bandwidth = rthrottling->bandwidth;
+	sys->rthrottling.link_bandwidth = rthrottling->link_bandwidth;
+	sys->rthrottling.latency_target = rthrottling->latency_target;
 }
 
 struct recovery_throttling get_recovery(void)
@@ -32,8 +32,11 @@ static bool is_access_local(struct request *req, uint64_t oid)
 	int nr_copies;
 	int i;
 
-	nr_copies = get_req_copy_number(req);
-	oid_to_vnodes(oid, &req->vinfo->vroot, nr_copies, obj_vnodes);
+	if (req->vec)
+		nr_copies = get_obj_copy_number(oid, req->vinfo->nr_zones);
+	else
+		nr_copies = get_req_copy_number(req);
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		if (vnode_is_local(obj_vnodes[i]))
 			return true;
@@ -86,17 +89,58 @@ static void io_op_done(struct work *work)
  *      4. Object requested doesn't exist and is being recovered
  *         In this case, we put the request into wait queue of receiver and when
  *         we recover an object we try to wake up the request on this oid.
+ *
+ * The requests of the last two cases are hashed by the oid, so the recovery of
+ * an object only looks at the requests which may wait for it.
  */
 static inline void sleep_on_wait_queue(struct request *req)
 {
 	list_add_tail(&req->request_list, &sys->req_wait_queue);
 }
 
+static inline struct list_head *oid_wait_queue(uint64_t oid)
+{
+	return &sys->req_oid_wait_queue[sd_hash_oid(oid) % NR_REQ_WAIT_HASH];
+}
+
+static inline void sleep_on_oid_wait_queue(struct request *req)
+{
+	list_add_tail(&req->request_list, oid_wait_queue(req->local_oid));
+}
+
+/*
+ * Bump the read generation of the objects modified by the gateway request
+ * 'req' and drop their prefetched copies.  It's done both when the request
+ * is queued and when it completes, so that neither a read issued while it's
+ * in flight nor one issued after it is acked shares a read or gets a
+ * prefetch which may have seen the old data.
+ */
+static void note_gateway_write(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+
+	if (hdr->opcode == SD_OP_READ_OBJ || hdr->opcode == SD_OP_READ_OBJS)
+		return;
+
+	if (req->vec)
+		for (uint32_t i = 0; i < hdr->vec.nr; i++) {
+			gateway_note_write(req->vec[i].oid);
+			readahead_note_write(req->vec[i].oid);
+		}
+	else {
+		gateway_note_write(hdr->obj.oid);
+		readahead_note_write(hdr->obj.oid);
+	}
+}
+
 static void gateway_op_done(struct work *work)
 {
 	struct request *req = container_of(work, struct request, work);
 	struct sd_req *hdr = &req->rq;
 
+	if (req->fwd_async && !gateway_forward_finish(req))
+		return;
+
 	switch (req->rp.result) {
 	case SD_RES_OLD_NODE_VER:
 		if (req->rp.epoch > sys->cinfo.epoch) {
@@ -104,6 +148,7 @@ static void gateway_op_done(struct work *work)
 			 * Gateway of this node is expected to process this
 			 * request later when epoch is lifted.
 			 */
+			observe_kick();
 			sleep_on_wait_queue(req);
 			return;
 		}
@@ -116,9 +161,12 @@ static void gateway_op_done(struct work *work)
 		sd_debug("retrying failed I/O request op %s result %x epoch %"
 			 PRIu32 ", sys epoch %" PRIu32, op_name(req->op),
 			 req->rp.result, req->rq.epoch, sys->cinfo.epoch);
+		/* a peer may have left */
+		if (req->rp.result == SD_RES_NETWORK_ERROR)
+			observe_kick();
 		goto retry;
 	case SD_RES_EIO:
-		if (is_access_local(req, hdr->obj.oid)) {
+		if (hdr->obj.oid && is_access_local(req, hdr->obj.oid)) {
 			sd_err("leaving sheepdog cluster");
 			leave_cluster();
 			goto retry;
@@ -131,6 +179,7 @@ static void gateway_op_done(struct work *work)
 		break;
 	}
 
+	note_gateway_write(req);
 	put_request(req);
 	return;
 retry:
@@ -199,12 +248,33 @@ static bool request_in_recovery(struct request *req)
 
 	if (oid_in_recovery(req->local_oid)) {
 		sd_debug("%016"PRIx64" wait on oid", req->local_oid);
-		sleep_on_wait_queue(req);
+		sleep_on_oid_wait_queue(req);
 		return true;
 	}
 	return false;
 }
 
+/*
+ * A vectored request waits for the first of its objects being recovered, and
+ * checks the rest again when it is woken up.  The gateway cares only about the
+ * objects it reads locally.
+ */
+static bool obj_vec_in_recovery(struct request *req, bool local_only)
+{
+	for (uint32_t i = 0; i < req->rq.vec.nr; i++) {
+		uint64_t oid = req->vec[i].oid;
+
+		if (local_only && !is_access_local(req, oid))
+			continue;
+		req->local_oid = oid;
+		if (request_in_recovery(req))
+			return true;
+	}
+	req->local_oid = 0;
+
+	return false;
+}
+
 /* Wakeup requests because of epoch mismatch */
 void wakeup_requests_on_epoch(void)
 {
@@ -246,9 +316,10 @@ void wakeup_requests_on_epoch(void)
 void wakeup_requests_on_oid(uint64_t oid)
 {
 	struct request *req;
+	struct list_head *wq = oid_wait_queue(oid);
 	LIST_HEAD(pending_list);
 
-	list_splice_init(&sys->req_wait_queue, &pending_list);
+	list_splice_init(wq, &pending_list);
 
 	list_for_each_entry(req, &pending_list, request_list) {
 		if (req->local_oid != oid)
@@ -256,7 +327,7 @@ void wakeup_requests_on_oid(uint64_t oid)
 		sd_debug("retry %016" PRIx64, req->local_oid);
 		del_requeue_request(req);
 	}
-	list_splice_init(&pending_list, &sys->req_wait_queue);
+	list_splice_init(&pending_list, wq);
 }
 
 void wakeup_all_requests(void)
@@ -265,6 +336,9 @@ void wakeup_all_requests(void)
 	LIST_HEAD(pending_list);
 
 	list_splice_init(&sys->req_wait_queue, &pending_list);
+	for (int i = 0; i < NR_REQ_WAIT_HASH; i++)
+		list_splice_tail_init(&sys->req_oid_wait_queue[i],
+				      &pending_list);
 
 	list_for_each_entry(req, &pending_list, request_list) {
 		sd_debug("%016"PRIx64, req->rq.obj.oid);
@@ -274,12 +348,19 @@ void wakeup_all_requests(void)
 
 static void queue_peer_request(struct request *req)
 {
+	struct work_queue *wq = NULL;
+
 	req->local_oid = req->rq.obj.oid;
 	if (req->local_oid) {
 		if (check_request_epoch(req) < 0)
 			return;
 		if (request_in_recovery(req))
 			return;
+	} else if (req->vec) {
+		if (check_request_epoch(req) < 0)
+			return;
+		if (obj_vec_in_recovery(req, false))
+			return;
 	}
 
 	if (req->rq.flags & SD_FLAG_CMD_RECOVERY)
@@ -288,10 +369,16 @@ static void queue_peer_request(struct request *req)
 	req->work.fn = do_process_work;
 	req->work.done = io_op_done;
 
-	if (req->rq.opcode == SD_OP_REMOVE_PEER)
+	if (req->rq.opcode == SD_OP_REMOVE_PEER ||
+	    req->rq.opcode == SD_OP_REMOVE_PEERS) {
 		queue_work(sys->remove_peer_wqueue, &req->work);
-	else
-		queue_work(sys->peer_wqueue, &req->work);
+		return;
+	}
+
+	/* the requests of a single object wait only for its own disk */
+	if (req->local_oid)
+		wq = md_get_peer_wqueue(req->local_oid);
+	queue_work(wq ?: sys->peer_wqueue, &req->work);
 }
 
 /*
@@ -303,31 +390,54 @@ static void queue_peer_request(struct request *req)
  * strip and parity strips. For non-strict mode, we allow to write successfully
  * only if the data are written fully with 4 nodes alive.
  */
-static bool has_enough_zones(struct request *req)
+static bool oid_has_enough_zones(struct request *req, uint64_t oid)
 {
-	uint64_t oid = req->rq.obj.oid;
-
 	return req->vinfo->nr_zones >= get_vdi_copy_number(oid_to_vid(oid));
 }
 
+static bool has_enough_zones(struct request *req)
+{
+	switch (req->rq.opcode) {
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+	case SD_OP_WRITE_OBJ:
+		return oid_has_enough_zones(req, req->rq.obj.oid);
+	case SD_OP_WRITE_OBJS:
+		for (uint32_t i = 0; i < req->rq.vec.nr; i++)
+			if (!oid_has_enough_zones(req, req->vec[i].oid))
+				return false;
+		return true;
+	default:
+		return true;
+	}
+}
+
 static void queue_gateway_request(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 
-	if (is_access_local(req, hdr->obj.oid))
-		req->local_oid = hdr->obj.oid;
+	if (qos_throttle(req))
+		return;
 
-	if (req->local_oid)
-		if (request_in_recovery(req))
+	/* the reads issued from now on don't share the older ones */
+	note_gateway_write(req);
+
+	if (req->vec) {
+		if (obj_vec_in_recovery(req, true))
 			return;
+	} else {
+		if (is_access_local(req, hdr->obj.oid))
+			req->local_oid = hdr->obj.oid;
+
+		if (req->local_oid)
+			if (request_in_recovery(req))
+				return;
+	}
 
-	if (RB_EMPTY_ROOT(&req->vinfo->vroot)) {
+	if (!req->vinfo->nr_vnodes) {
 		sd_err("there is no living nodes");
 		goto end_request;
 	}
 	if (sys->cinfo.flags & SD_CLUSTER_FLAG_STRICT &&
-	    (hdr->opcode == SD_OP_CREATE_AND_WRITE_OBJ ||
-	     hdr->opcode == SD_OP_WRITE_OBJ) &&
 	    !has_enough_zones(req)) {
 		sd_err("not enough zones available");
 		goto end_request;
@@ -336,7 +446,7 @@ static void queue_gateway_request(struct request *req)
 	req->work.fn = do_process_work;
 	req->work.done = gateway_op_done;
 
-	if (hdr->opcode == SD_OP_REMOVE_OBJ)
+	if (hdr->opcode == SD_OP_REMOVE_OBJ || hdr->opcode == SD_OP_REMOVE_OBJS)
 		queue_work(sys->remove_wqueue, &req->work);
 	else if (hdr->flags & SD_FLAG_CMD_FWD)
 		queue_work(sys->gateway_fwd_wqueue, &req->work);
@@ -357,13 +467,37 @@ static void queue_local_request(struct request *req)
 	queue_work(sys->io_wqueue, &req->work);
 }
 
+/* Count the objects of the peer I/O of the workload in their heat */
+static main_fn void heat_request(const struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+
+	if (sys->gateway_only || (hdr->flags & SD_FLAG_CMD_RECOVERY))
+		return;
+
+	switch (hdr->opcode) {
+	case SD_OP_READ_PEER:
+	case SD_OP_WRITE_PEER:
+	case SD_OP_CREATE_AND_WRITE_PEER:
+		heat_access(hdr->obj.oid);
+		break;
+	case SD_OP_READ_PEERS:
+	case SD_OP_WRITE_PEER_BATCH:
+		for (uint32_t i = 0; i < hdr->vec.nr; i++)
+			heat_access(req->vec[i].oid);
+		break;
+	}
+}
+
 static main_fn inline void stat_request_begin(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 
 	req->stat = true;
+	req->stat_time = clock_get_time();
 
 	if (is_peer_op(req->op)) {
+		heat_request(req);
 		sys->stat.r.peer_total_nr++;
 		sys->stat.r.peer_active_nr++;
 		if (hdr->flags & SD_FLAG_CMD_WRITE)
@@ -375,11 +509,17 @@ static main_fn inline void stat_request_begin(struct request *req)
 		case SD_OP_READ_PEER:
 			sys->stat.r.peer_total_read_nr++;
 			break;
+		case SD_OP_READ_PEERS:
+			sys->stat.r.peer_total_read_nr++;
+			sys->stat.r.peer_total_tx += hdr->vec.rlen;
+			break;
 		case SD_OP_WRITE_PEER:
 		case SD_OP_CREATE_AND_WRITE_PEER:
+		case SD_OP_WRITE_PEER_BATCH:
 			sys->stat.r.peer_total_write_nr++;
 			break;
 		case SD_OP_REMOVE_PEER:
+		case SD_OP_REMOVE_PEERS:
 			sys->stat.r.peer_total_remove_nr++;
 			break;
 		}
@@ -395,8 +535,13 @@ static main_fn inline void stat_request_begin(struct request *req)
 		case SD_OP_READ_OBJ:
 			sys->stat.r.gway_total_read_nr++;
 			break;
+		case SD_OP_READ_OBJS:
+			sys->stat.r.gway_total_read_nr++;
+			sys->stat.r.gway_total_tx += hdr->vec.rlen;
+			break;
 		case SD_OP_WRITE_OBJ:
 		case SD_OP_CREATE_AND_WRITE_OBJ:
+		case SD_OP_WRITE_OBJS:
 			sys->stat.r.gway_total_write_nr++;
 			break;
 		case SD_OP_DISCARD_OBJ:
@@ -410,19 +555,207 @@ static main_fn inline void stat_request_begin(struct request *req)
 	}
 }
 
+/*
+ * Latencies of the finished requests by opcode, of the gateway ones and of the
+ * peer ones.  They are only touched in the main thread, so need no lock.
+ */
+static struct sd_latency_stat *latency_stats[2][256];
+
+static main_fn void stat_latency(uint8_t opcode, bool peer, uint64_t usec)
+{
+	struct sd_latency_stat *lat = latency_stats[peer][opcode];
+
+	if (!lat) {
+		lat = xzalloc(sizeof(*lat));
+		pstrcpy(lat->name, sizeof(lat->name),
+			op_name(get_sd_op(opcode)));
+		lat->opcode = opcode;
+		lat->peer = peer;
+		latency_stats[peer][opcode] = lat;
+	}
+
+	lat->nr++;
+	lat->total += usec;
+	lat->max = max(lat->max, usec);
+	lat->buckets[latency_to_bucket(usec)]++;
+}
+
+/* Fill the latencies of the opcodes used so far, return the number of them */
+main_fn int latency_stat(struct sd_latency_stat *stat, int max)
+{
+	int nr = 0;
+
+	for (int i = 0; i < ARRAY_SIZE(latency_stats); i++)
+		for (int j = 0; j < ARRAY_SIZE(latency_stats[i]); j++) {
+			if (!latency_stats[i][j])
+				continue;
+			if (nr == max)
+				return nr;
+			stat[nr++] = *latency_stats[i][j];
+		}
+
+	return nr;
+}
+
+/*
+ * I/O of the vdis through this gateway, by vid.  Only touched in the main
+ * thread like the latencies.
+ */
+struct vdi_io_entry {
+	struct rb_node node;
+	struct sd_vdi_io_stat st;
+	time_t last_io;
+};
+
+static struct rb_root vdi_io_root = RB_ROOT;
+
+static int vdi_io_cmp(const struct vdi_io_entry *a,
+		      const struct vdi_io_entry *b)
+{
+	return intcmp(a->st.vid, b->st.vid);
+}
+
+static main_fn void stat_vdi_io(const struct request *req, uint64_t usec)
+{
+	const struct sd_req *hdr = &req->rq;
+	struct vdi_io_entry key, *entry;
+	uint64_t oid = hdr->obj.oid, len;
+	bool write;
+
+	switch (hdr->opcode) {
+	case SD_OP_READ_OBJ:
+		write = false;
+		len = hdr->data_length;
+		break;
+	case SD_OP_READ_OBJS:
+		write = false;
+		len = hdr->vec.rlen;
+		break;
+	case SD_OP_WRITE_OBJ:
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		write = true;
+		len = hdr->data_length;
+		break;
+	case SD_OP_WRITE_OBJS:
+		write = true;
+		len = hdr->data_length - sizeof(*req->vec) * hdr->vec.nr;
+		break;
+	default:
+		return;
+	}
+
+	/* the objects of a vector belong to one vdi in practice */
+	if (is_obj_vec_req(hdr))
+		oid = req->vec ? req->vec[0].oid : 0;
+	if (!oid)
+		return;
+
+	key.st.vid = oid_to_vid(oid);
+	entry = rb_search(&vdi_io_root, &key, node, vdi_io_cmp);
+	if (!entry) {
+		entry = xzalloc(sizeof(*entry));
+		entry->st.vid = key.st.vid;
+		rb_insert(&vdi_io_root, entry, node, vdi_io_cmp);
+	}
+
+	entry->last_io = time(NULL);
+	if (write) {
+		entry->st.nr_write++;
+		entry->st.write_bytes += len;
+		entry->st.write_latency += usec;
+	} else {
+		entry->st.nr_read++;
+		entry->st.read_bytes += len;
+		entry->st.read_latency += usec;
+	}
+}
+
+/* Fill the I/O of the vdis served so far, return the number of them */
+main_fn int vdi_io_stat(struct sd_vdi_io_stat *stat, int max)
+{
+	struct vdi_io_entry *entry;
+	time_t now = time(NULL);
+	int nr = 0;
+
+	rb_for_each_entry(entry, &vdi_io_root, node) {
+		time_t idle = max(now - entry->last_io, (time_t)0);
+
+		if (nr == max)
+			break;
+		stat[nr] = entry->st;
+		stat[nr++].idle = min(idle, (time_t)UINT32_MAX);
+	}
+
+	return nr;
+}
+
+/* Forget the I/O of the deleted vdi vid */
+main_fn void vdi_io_stat_drop(uint32_t vid)
+{
+	struct vdi_io_entry key = { .st.vid = vid }, *entry;
+
+	entry = rb_search(&vdi_io_root, &key, node, vdi_io_cmp);
+	if (!entry)
+		return;
+	rb_erase(&entry->node, &vdi_io_root);
+	free(entry);
+}
+
 static main_fn inline void stat_request_end(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
+	uint64_t usec;
 
 	if (!req->stat)
 		return;
 
-	if (is_peer_op(req->op))
+	usec = (clock_get_time() - req->stat_time) / 1000;
+	if (is_peer_op(req->op)) {
 		sys->stat.r.peer_active_nr--;
-	else if (is_gateway_op(req->op))
-		sys->stat.r.gway_active_nr--;
-	else if (hdr->opcode == SD_OP_FLUSH_VDI)
+		stat_latency(hdr->opcode, true, usec);
+	} else if (is_gateway_op(req->op) || hdr->opcode == SD_OP_FLUSH_VDI) {
 		sys->stat.r.gway_active_nr--;
+		sys->stat.r.gway_total_latency += usec;
+		stat_latency(hdr->opcode, false, usec);
+		stat_vdi_io(req, usec);
+	}
+}
+
+/* Check the vector of a vectored request and copy it out of the data */
+static int obj_vec_init(struct request *req)
+{
+	const struct sd_req *hdr = &req->rq;
+	const struct sd_obj_vec *vec = req->data;
+	size_t vlen = sizeof(*vec) * hdr->vec.nr;
+	bool write = hdr->opcode == SD_OP_WRITE_OBJS ||
+		hdr->opcode == SD_OP_WRITE_PEER_BATCH;
+	/* the vector of a remove carries the oids only */
+	bool remove = hdr->opcode == SD_OP_REMOVE_OBJS ||
+		hdr->opcode == SD_OP_REMOVE_PEERS;
+	uint64_t len = 0;
+
+	if (hdr->obj.oid || !hdr->vec.nr || hdr->vec.nr > SD_MAX_OBJ_VEC ||
+	    !(hdr->flags & SD_FLAG_CMD_WRITE) || hdr->data_length < vlen ||
+	    req->data_length < hdr->vec.rlen)
+		return SD_RES_INVALID_PARMS;
+
+	for (uint32_t i = 0; i < hdr->vec.nr; i++) {
+		if (!vec[i].oid || (remove ? vec[i].length : !vec[i].length))
+			return SD_RES_INVALID_PARMS;
+		/* the gateway handles the erasure coded objects one by one */
+		if (is_peer_op(req->op) && is_erasure_oid(vec[i].oid))
+			return SD_RES_INVALID_PARMS;
+		len += vec[i].length;
+	}
+	if (write || remove ?
+	    (hdr->vec.rlen || len != hdr->data_length - vlen) :
+	    (len != hdr->vec.rlen || vlen != hdr->data_length))
+		return SD_RES_INVALID_PARMS;
+
+	req->vec = xmalloc(vlen);
+	memcpy(req->vec, vec, vlen);
+
+	return SD_RES_SUCCESS;
 }
 
 void queue_request(struct request *req)
@@ -454,6 +787,12 @@ void queue_request(struct request *req)
 		goto done;
 	}
 
+	if (is_obj_vec_req(hdr) && !req->vec) {
+		rsp->result = obj_vec_init(req);
+		if (rsp->result != SD_RES_SUCCESS)
+			goto done;
+	}
+
 	sd_debug("%s, %d", op_name(req->op), sys->cinfo.status);
 
 	switch (sys->cinfo.status) {
@@ -476,7 +815,9 @@ void queue_request(struct request *req)
 		break;
 	}
 
-	req->vinfo = get_vnode_info();
+	/* the local requests are freed by the worker which issued them */
+	req->vinfo = req->local ? get_vnode_info() : get_req_vnode_info();
+	request_stage(req, REQ_STAGE_QUEUE);
 	stat_request_begin(req);
 	if (is_peer_op(req->op)) {
 		queue_peer_request(req);
@@ -503,7 +844,10 @@ done:
 void requeue_request(struct request *req)
 {
 	if (req->vinfo) {
-		put_vnode_info(req->vinfo);
+		if (req->local)
+			put_vnode_info(req->vinfo);
+		else
+			put_req_vnode_info(req->vinfo);
 		req->vinfo = NULL;
 	}
 	stat_request_end(req);
@@ -511,6 +855,8 @@ void requeue_request(struct request *req)
 }
 
 static void clear_client_info(struct client_info *ci);
+static int client_tx_on(struct client_info *ci);
+static int client_rx_on(struct client_info *ci);
 
 static struct request *alloc_local_request(void *data, int data_length)
 {
@@ -532,6 +878,7 @@ static struct request *alloc_local_request(void *data, int data_length)
 static void free_local_request(struct request *req)
 {
 	put_vnode_info(req->vinfo);
+	free(req->vec);
 	free(req);
 }
 
@@ -655,20 +1002,20 @@ struct request *alloc_request(struct client_info *ci, uint32_t data_length)
 {
 	struct request *req;
 
-	req = zalloc(sizeof(struct request));
+	req = pool_zalloc(sizeof(struct request));
 	if (!req)
 		return NULL;
 
 	if (data_length) {
-		int ret;
-
 		req->data_length = data_length;
-		ret = posix_memalign((void **)&req->data, getpagesize(), data_length);
-		if (ret) {
-			free(req);
+		req->data = pool_alloc(data_length);
+		if (!req->data) {
+			pool_free(req, sizeof(struct request));
 			return NULL;
 		}
+		memtag_account(MEM_REQUEST, data_length);
 	}
+	memtag_account(MEM_REQUEST, sizeof(struct request));
 
 	req->ci = ci;
 	refcount_inc(&ci->refcnt);
@@ -680,14 +1027,36 @@ struct request *alloc_request(struct client_info *ci, uint32_t data_length)
 	return req;
 }
 
+static void admission_release(struct request *req);
+
 void free_request(struct request *req)
 {
 	uatomic_dec(&sys->nr_outstanding_reqs);
+	admission_release(req);
 
 	refcount_dec(&req->ci->refcnt);
-	put_vnode_info(req->vinfo);
-	free(req->data);
-	free(req);
+	put_req_vnode_info(req->vinfo);
+	free(req->vec);
+	switch (req->ci->type) {
+#ifdef HAVE_ACCELIO
+	case CLIENT_INFO_TYPE_XIO:
+		/* the data of the xio clients is in the registered memory */
+		sd_xio_buf_free(req->data);
+		break;
+#endif
+#ifdef HAVE_VHOST
+	case CLIENT_INFO_TYPE_VHOST:	/* in the guest memory */
+#endif
+	case CLIENT_INFO_TYPE_SHM:	/* in the ring of the client */
+		break;
+	default:
+		if (req->data)
+			memtag_account(MEM_REQUEST, -(ssize_t)req->data_length);
+		pool_free(req->data, req->data_length);
+		break;
+	}
+	memtag_account(MEM_REQUEST, -(ssize_t)sizeof(struct request));
+	pool_free(req, sizeof(struct request));
 }
 
 main_fn void put_request(struct request *req)
@@ -697,10 +1066,17 @@ main_fn void put_request(struct request *req)
 	if (refcount_dec(&req->refcnt) > 0)
 		return;
 
+	request_stage(req, REQ_STAGE_DONE);
 	stat_request_end(req);
 
 	if (req->local)
 		eventfd_xwrite(req->local_req_efd, 1);
+#ifdef HAVE_VHOST
+	else if (ci->type == CLIENT_INFO_TYPE_VHOST)
+		vhost_request_done(req);
+#endif
+	else if (ci->type == CLIENT_INFO_TYPE_SHM)
+		shm_request_done(req);
 	else {
 		if (ci->conn.dead) {
 			/*
@@ -716,9 +1092,9 @@ main_fn void put_request(struct request *req)
 
 			switch (ci->type) {
 			case CLIENT_INFO_TYPE_DEFAULT:
-				if (ci->tx_req == NULL)
+				if (list_empty(&ci->tx_reqs))
 					/* There is no request being sent. */
-					if (conn_tx_on(&ci->conn)) {
+					if (client_tx_on(ci)) {
 						sd_err("switch on sending flag"
 						       " failure, connection"
 						       " maybe closed");
@@ -759,21 +1135,42 @@ static void rx_work(struct work *work)
 	struct connection *conn = &ci->conn;
 	struct sd_req hdr;
 	struct request *req;
-
-	ret = do_read(conn->fd, &hdr, sizeof(hdr), NULL, 0, UINT32_MAX);
+	uint64_t start = clock_get_time();
+	uint32_t len;
+
+	if (conn->unix_sock) {
+		ret = do_read_fds(conn->fd, &hdr, sizeof(hdr), ci->rx_fds,
+				  SD_SHM_NR_FDS);
+		ci->nr_rx_fds = max(ret, 0);
+		ret = ret < 0;
+	} else
+		ret = do_read(conn->fd, &hdr, sizeof(hdr), NULL, 0,
+			      UINT32_MAX);
 	if (ret) {
 		sd_debug("failed to read a header");
 		conn->dead = true;
 		return;
 	}
 
-	req = alloc_request(ci, hdr.data_length);
+	/* only SD_OP_SHM_ATTACH takes fds */
+	if (ci->nr_rx_fds && hdr.opcode != SD_OP_SHM_ATTACH) {
+		for (int i = 0; i < ci->nr_rx_fds; i++)
+			close(ci->rx_fds[i]);
+		ci->nr_rx_fds = 0;
+	}
+
+	/* a vectored read returns more data than it receives */
+	len = hdr.data_length;
+	if (is_obj_vec_req(&hdr))
+		len = max(len, hdr.vec.rlen);
+	req = alloc_request(ci, len);
 	if (!req) {
 		sd_err("failed to allocate request");
 		conn->dead = true;
 		return;
 	}
 	ci->rx_req = req;
+	req->stage_time[REQ_STAGE_RX] = start;
 
 	/* use le_to_cpu */
 	memcpy(&req->rq, &hdr, sizeof(req->rq));
@@ -784,12 +1181,95 @@ static void rx_work(struct work *work)
 		if (ret) {
 			sd_err("failed to read data");
 			conn->dead = true;
+		} else if ((hdr.flags & SD_FLAG_CMD_ZSTD_DATA) &&
+			   wire_decompress_req(req) < 0) {
+			/* the sender forgets that we take zstd data */
+			conn->dead = true;
 		}
 	}
 
 	tracepoint(request, rx_work, conn->fd, work, req, hdr.opcode);
 }
 
+/*
+ * Admission control
+ *
+ * The gateway requests read from the client connections are counted from
+ * rx_main() until they are freed, that is, until their responses are sent.
+ * When the ones of a connection or of the whole node exceed the limits given
+ * with '-A', the receiving from the connection isn't switched on again after
+ * the current request, so the client is pushed back by TCP instead of the
+ * queues and the buffers growing without bound.  The paused connections are
+ * resumed as the outstanding requests are freed.
+ *
+ * The peer requests aren't counted nor throttled; holding them back could
+ * deadlock the gateways of two nodes waiting for each other.
+ */
+static uint32_t nr_admitted_reqs;
+static uint64_t admitted_bytes;
+static LIST_HEAD(paused_clients);
+
+static inline bool over_limit(uint64_t n, uint64_t limit)
+{
+	return limit && n >= limit;
+}
+
+static bool node_overloaded(void)
+{
+	return over_limit(nr_admitted_reqs, sys->admission.reqs) ||
+		over_limit(admitted_bytes, sys->admission.bytes);
+}
+
+static bool client_overloaded(const struct client_info *ci)
+{
+	return over_limit(ci->nr_outstanding, sys->admission.client_reqs) ||
+		over_limit(ci->outstanding_bytes, sys->admission.client_bytes);
+}
+
+static main_fn void admission_charge(struct request *req)
+{
+	const struct sd_op_template *op = get_sd_op(req->rq.opcode);
+	struct client_info *ci = req->ci;
+
+	if (!op || !is_gateway_op(op))
+		return;
+
+	req->rx_charged = true;
+	ci->nr_outstanding++;
+	ci->outstanding_bytes += req->data_length;
+	nr_admitted_reqs++;
+	admitted_bytes += req->data_length;
+}
+
+static main_fn void admission_release(struct request *req)
+{
+	struct client_info *ci = req->ci;
+
+	if (!req->rx_charged)
+		return;
+
+	ci->nr_outstanding--;
+	ci->outstanding_bytes -= req->data_length;
+	nr_admitted_reqs--;
+	admitted_bytes -= req->data_length;
+
+	if (list_empty(&paused_clients) || node_overloaded())
+		return;
+
+	list_for_each_entry(ci, &paused_clients, paused_list) {
+		/* the dead ones are removed by clear_client_info() */
+		if (ci->conn.dead || client_overloaded(ci))
+			continue;
+
+		sd_debug("resume %s:%d", ci->conn.ipstr, ci->conn.port);
+		list_del(&ci->paused_list);
+		ci->rx_paused = false;
+		if (client_rx_on(ci))
+			sd_err("switch on receiving flag failure, "
+			       "connection maybe closed");
+	}
+}
+
 static void rx_main(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
@@ -808,10 +1288,31 @@ static void rx_main(struct work *work)
 		return;
 	}
 
-	if (conn_rx_on(&ci->conn))
+	admission_charge(req);
+	if (node_overloaded() || client_overloaded(ci)) {
+		sd_debug("pause %s:%d, %"PRIu32" requests, %"PRIu64" bytes",
+			 ci->conn.ipstr, ci->conn.port, ci->nr_outstanding,
+			 ci->outstanding_bytes);
+		ci->rx_paused = true;
+		list_add_tail(&ci->paused_list, &paused_clients);
+	} else if (client_rx_on(ci))
 		sd_err("switch on receiving flag failure, "
 				"connection maybe closed");
 
+	if (req->rq.opcode == SD_OP_HEARTBEAT) {
+		/* the failure detector of the peer times the main loop */
+		req->rp.result = SD_RES_SUCCESS;
+		put_request(req);
+		return;
+	}
+
+	if (req->rq.opcode == SD_OP_SHM_ATTACH) {
+		/* not an operation, the ring belongs to the connection */
+		req->rp.result = shm_attach(ci);
+		put_request(req);
+		return;
+	}
+
 	if (is_logging_op(get_sd_op(req->rq.opcode))) {
 		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, data=%s",
 			req,
@@ -830,62 +1331,174 @@ static void rx_main(struct work *work)
 	queue_request(req);
 }
 
+/*
+ * MSG_ZEROCOPY pins the pages instead of copying them, but costs a completion
+ * round trip which we wait for before freeing the data, so use it only for
+ * the large payloads like the whole object reads
+ */
+#define ZEROCOPY_MIN_LEN (256 * 1024)
+
+/* The max number of the responses tx_work sends in one go */
+#define TX_BATCH 32
+
+static void pick_tx_reqs(struct client_info *ci)
+{
+	struct request *req;
+	int n = 0;
+
+	sd_assert(list_empty(&ci->tx_reqs));
+	list_for_each_entry(req, &ci->done_reqs, request_list) {
+		if (n++ == TX_BATCH)
+			break;
+		list_move_tail(&req->request_list, &ci->tx_reqs);
+	}
+}
+
+/*
+ * Send all the responses picked for the connection with as few sendmsg()
+ * calls as possible; QEMU keeps many requests in flight on one connection,
+ * and most of the responses are just a header.  The large ones go out with
+ * MSG_ZEROCOPY separately.
+ */
 static void tx_work(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
 					      tx_work);
-	int ret;
 	struct connection *conn = &ci->conn;
-	struct sd_rsp rsp;
-	struct request *req = ci->tx_req;
-	void *data = NULL;
+	struct sd_rsp rsps[TX_BATCH];
+	struct iovec iov[TX_BATCH * 2];
+	struct request *req;
+	int ret = 0, nr = 0, nr_iov = 0;
+
+	list_for_each_entry(req, &ci->tx_reqs, request_list) {
+		struct sd_rsp *rsp = rsps + nr++;
+
+		/* use cpu_to_le */
+		memcpy(rsp, &req->rp, sizeof(*rsp));
+
+		rsp->epoch = sys->cinfo.epoch;
+		rsp->opcode = req->rq.opcode;
+		rsp->id = req->rq.id;
+		if ((req->rq.flags & SD_FLAG_CMD_ZSTD) && wire_supported())
+			rsp->flags |= SD_FLAG_CMD_ZSTD;
 
-	/* use cpu_to_le */
-	memcpy(&rsp, &req->rp, sizeof(rsp));
+		if (conn->zerocopy && rsp->data_length >= ZEROCOPY_MIN_LEN) {
+			bool copied = false;
 
-	rsp.epoch = sys->cinfo.epoch;
-	rsp.opcode = req->rq.opcode;
-	rsp.id = req->rq.id;
+			if (nr_iov) {
+				ret = send_reqs(conn->fd, iov, nr_iov, true);
+				nr_iov = 0;
+				if (ret != 0)
+					break;
+			}
+
+			ret = send_req_zerocopy(conn, (struct sd_req *)rsp,
+						req->data, rsp->data_length,
+						&copied);
+			if (copied) {
+				sd_debug("zerocopy isn't effective for %s:%d",
+					 conn->ipstr, conn->port);
+				conn->zerocopy = false;
+			}
+			if (ret != 0)
+				break;
+			continue;
+		}
 
-	if (rsp.data_length)
-		data = req->data;
+		iov[nr_iov].iov_base = rsp;
+		iov[nr_iov++].iov_len = sizeof(*rsp);
+		if (rsp->data_length) {
+			iov[nr_iov].iov_base = req->data;
+			iov[nr_iov++].iov_len = rsp->data_length;
+		}
+	}
 
-	ret = send_req(conn->fd, (struct sd_req *)&rsp, data, rsp.data_length,
-		       NULL, 0, UINT32_MAX);
+	if (ret == 0 && nr_iov)
+		ret = send_reqs(conn->fd, iov, nr_iov, false);
 	if (ret != 0) {
 		sd_err("failed to send a request");
 		conn->dead = true;
 	}
 
-	tracepoint(request, tx_work, conn->fd, work, req);
+	list_for_each_entry(req, &ci->tx_reqs, request_list) {
+		request_stage(req, REQ_STAGE_TX);
+		tracepoint(request, tx_work, conn->fd, work, req);
+	}
+}
+
+static const char * const request_stage_names[NR_REQ_STAGES] = {
+	[REQ_STAGE_RX] = "rx",
+	[REQ_STAGE_QUEUE] = "queue",
+	[REQ_STAGE_WORK] = "work",
+	[REQ_STAGE_FORWARD] = "forward",
+	[REQ_STAGE_REPLY] = "reply",
+	[REQ_STAGE_WORK_END] = "work_end",
+	[REQ_STAGE_DONE] = "done",
+	[REQ_STAGE_TX] = "tx",
+};
+
+/*
+ * Log when each stage of a slow request was reached, in usec since it was
+ * received, to tell the network, the disks and the queues apart
+ */
+static main_fn void log_request_stages(const struct request *req)
+{
+	const uint64_t *t = req->stage_time;
+	char buf[256];
+	uint64_t ms;
+	int len = 0;
+
+	tracepoint(request, stages, req, req->rq.opcode, req->rq.obj.oid,
+		   req->rq.epoch, req->rq.id, sys->this_node.nid.port, t);
+
+	if (!sys->slow_request_ms || !t[REQ_STAGE_RX] || !t[REQ_STAGE_TX])
+		return;
+
+	ms = (t[REQ_STAGE_TX] - t[REQ_STAGE_RX]) / 1000000;
+	if (ms < sys->slow_request_ms)
+		return;
+
+	for (int i = REQ_STAGE_RX + 1; i < NR_REQ_STAGES; i++)
+		if (t[i])
+			len += snprintf(buf + len, sizeof(buf) - len,
+					" %s +%"PRIu64, request_stage_names[i],
+					(t[i] - t[REQ_STAGE_RX]) / 1000);
+
+	sd_warn("slow request %s %016"PRIx64", %"PRIu64" ms:%s",
+		op_name(req->op), req->rq.obj.oid, ms, buf);
 }
 
 static void tx_main(struct work *work)
 {
 	struct client_info *ci = container_of(work, struct client_info,
 					      tx_work);
-
-	tracepoint(request, tx_main, ci->conn.fd, work, ci->tx_req);
+	struct request *req;
 
 	refcount_dec(&ci->refcnt);
 
-	if (is_logging_op(ci->tx_req->op)) {
-		sd_info("req=%p, fd=%d, client=%s:%d, op=%s, result=%02X",
-			ci->tx_req,
-			ci->conn.fd,
-			ci->conn.ipstr,
-			ci->conn.port,
-			op_name(ci->tx_req->op),
-			ci->tx_req->rp.result);
-	} else {
-		sd_debug("%d, %s:%d",
-			 ci->conn.fd,
-			 ci->conn.ipstr,
-			 ci->conn.port);
-	}
+	list_for_each_entry(req, &ci->tx_reqs, request_list) {
+		tracepoint(request, tx_main, ci->conn.fd, work, req);
+		log_request_stages(req);
+
+		if (is_logging_op(req->op)) {
+			sd_info("req=%p, fd=%d, client=%s:%d, op=%s, "
+				"result=%02X",
+				req,
+				ci->conn.fd,
+				ci->conn.ipstr,
+				ci->conn.port,
+				op_name(req->op),
+				req->rp.result);
+		} else {
+			sd_debug("%d, %s:%d",
+				 ci->conn.fd,
+				 ci->conn.ipstr,
+				 ci->conn.port);
+		}
 
-	free_request(ci->tx_req);
-	ci->tx_req = NULL;
+		list_del(&req->request_list);
+		free_request(req);
+	}
 
 	if (ci->conn.dead) {
 		clear_client_info(ci);
@@ -893,15 +1506,23 @@ static void tx_main(struct work *work)
 	}
 
 	if (!list_empty(&ci->done_reqs))
-		if (conn_tx_on(&ci->conn))
+		if (client_tx_on(ci))
 			sd_err("switch on sending flag failure, "
 					"connection maybe closed");
 }
 
+static void reactor_destroy_client(struct client_info *ci);
+static void reactor_del_client(struct client_info *ci);
+
 static void destroy_client(struct client_info *ci)
 {
 	sd_debug("connection from: %s:%d", ci->conn.ipstr, ci->conn.port);
+	shm_detach(ci);
+	if (ci->reactor)
+		return reactor_destroy_client(ci);
+
 	close(ci->conn.fd);
+	sd_destroy_mutex(&ci->lock);
 	free(ci);
 }
 
@@ -913,12 +1534,23 @@ static void clear_client_info(struct client_info *ci)
 
 	sd_debug("connection seems to be dead");
 
+	if (ci->rx_paused) {
+		list_del(&ci->paused_list);
+		ci->rx_paused = false;
+	}
+
 	list_for_each_entry(req, &ci->done_reqs, request_list) {
 		list_del(&req->request_list);
 		free_request(req);
 	}
 
-	unregister_event(ci->conn.fd);
+	if (list_linked(&ci->client_list))
+		list_del(&ci->client_list);
+
+	if (ci->reactor)
+		reactor_del_client(ci);
+	else
+		unregister_event(ci->conn.fd);
 
 	sd_debug("refcnt:%d, fd:%d, %s:%d", refcount_read(&ci->refcnt),
 		 ci->conn.fd, ci->conn.ipstr, ci->conn.port);
@@ -929,6 +1561,11 @@ static void clear_client_info(struct client_info *ci)
 	destroy_client(ci);
 }
 
+/* the connections of the clients and the peers, for the handover */
+static LIST_HEAD(client_list);
+/* the receiving is held for the handover, see freeze_clients() */
+static bool clients_frozen;
+
 static struct client_info *create_client(int fd)
 {
 	struct client_info *ci;
@@ -962,8 +1599,11 @@ static struct client_info *create_client(int fd)
 	ci->conn.fd = fd;
 	ci->conn.events = EPOLLIN;
 	refcount_set(&ci->refcnt, 0);
+	sd_init_mutex(&ci->lock);
 
 	INIT_LIST_HEAD(&ci->done_reqs);
+	INIT_LIST_HEAD(&ci->tx_reqs);
+	list_add_tail(&ci->client_list, &client_list);
 
 	tracepoint(request, create_client, fd);
 
@@ -976,7 +1616,8 @@ static void client_handler(int fd, int events, void *data)
 
 	sd_debug("%x, %d", events, ci->conn.dead);
 
-	if (events & (EPOLLERR | EPOLLHUP))
+	if ((events & EPOLLHUP) ||
+	    ((events & EPOLLERR) && conn_error(&ci->conn)))
 		ci->conn.dead = true;
 	/*
 	 * Although dead is true, ci might not be freed immediately
@@ -1011,10 +1652,7 @@ static void client_handler(int fd, int events, void *data)
 			return;
 		}
 
-		sd_assert(ci->tx_req == NULL);
-		ci->tx_req = list_first_entry(&ci->done_reqs, struct request,
-					      request_list);
-		list_del(&ci->tx_req->request_list);
+		pick_tx_reqs(ci);
 
 		/*
 		 * Increment refcnt so that the client_info isn't freed while
@@ -1028,12 +1666,321 @@ static void client_handler(int fd, int events, void *data)
 	}
 }
 
+/*
+ * Reactor threads
+ *
+ * With '-w reactor=N', the client connections are spread over N reactor
+ * threads, each of which polls its connections with its own epoll instance
+ * and dispatches their rx_work and tx_work.  The requests are still queued,
+ * executed and completed in the main thread, so the changes of the global
+ * state (epoch, vinfo) stay serialized there; the main thread is just freed
+ * from polling the hundreds of client connections.
+ *
+ * The connections are registered with EPOLLONESHOT and conn.events, protected
+ * by ci->lock, tells which directions are armed.  The reactor takes the
+ * direction it got the event on off conn.events before dispatching the work,
+ * and the main thread arms it again when the work is done.  For the tx
+ * direction, the main thread picks tx_reqs before arming it.
+ *
+ * epoll_wait() of a reactor may return a connection which the main thread has
+ * just removed, so the client_info of a dead connection is freed by its
+ * reactor after it finishes the current batch of events.
+ */
+
+#define REACTOR_NR_EVENTS 128
+
+struct reactor {
+	int epfd;
+	/* the main thread wakes up the reactor to free the dead clients */
+	int efd;
+	struct sd_mutex lock;
+	struct list_head dead_list;
+};
+
+static struct reactor *reactors;
+static int nr_reactors;
+
+/* Called with ci->lock held */
+static int reactor_arm(struct client_info *ci)
+{
+	struct epoll_event ev = {
+		.events = ci->conn.events | EPOLLONESHOT,
+		.data.ptr = ci,
+	};
+
+	return epoll_ctl(ci->reactor->epfd, EPOLL_CTL_MOD, ci->conn.fd, &ev);
+}
+
+static int reactor_add_client(struct client_info *ci)
+{
+	static int next;
+	struct reactor *r = reactors + next++ % nr_reactors;
+	struct epoll_event ev = {
+		.events = ci->conn.events | EPOLLONESHOT,
+		.data.ptr = ci,
+	};
+
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, ci->conn.fd, &ev) < 0) {
+		sd_err("failed to add a client to the reactor, %m");
+		return -1;
+	}
+	ci->reactor = r;
+
+	return 0;
+}
+
+static void reactor_del_client(struct client_info *ci)
+{
+	bool tx_armed;
+
+	sd_mutex_lock(&ci->lock);
+	tx_armed = ci->conn.events & EPOLLOUT;
+	ci->conn.events = 0;
+	epoll_ctl(ci->reactor->epfd, EPOLL_CTL_DEL, ci->conn.fd, NULL);
+	sd_mutex_unlock(&ci->lock);
+
+	/* tx_reqs weren't dispatched yet, nobody else will free them */
+	if (tx_armed) {
+		struct request *req;
+
+		list_for_each_entry(req, &ci->tx_reqs, request_list) {
+			list_del(&req->request_list);
+			free_request(req);
+		}
+	}
+}
+
+static void reactor_destroy_client(struct client_info *ci)
+{
+	struct reactor *r = ci->reactor;
+
+	sd_mutex_lock(&r->lock);
+	list_add_tail(&ci->dead_list, &r->dead_list);
+	sd_mutex_unlock(&r->lock);
+
+	eventfd_xwrite(r->efd, 1);
+}
+
+static int reactor_rx_on(struct client_info *ci)
+{
+	int ret;
+
+	sd_mutex_lock(&ci->lock);
+	ci->conn.events |= EPOLLIN;
+	ret = reactor_arm(ci);
+	sd_mutex_unlock(&ci->lock);
+
+	return ret;
+}
+
+static int reactor_tx_on(struct client_info *ci)
+{
+	int ret;
+
+	pick_tx_reqs(ci);
+
+	sd_mutex_lock(&ci->lock);
+	ci->conn.events |= EPOLLOUT;
+	ret = reactor_arm(ci);
+	sd_mutex_unlock(&ci->lock);
+
+	return ret;
+}
+
+static int reactor_rx_off(struct client_info *ci)
+{
+	int ret;
+
+	sd_mutex_lock(&ci->lock);
+	ci->conn.events &= ~EPOLLIN;
+	ret = reactor_arm(ci);
+	sd_mutex_unlock(&ci->lock);
+
+	return ret;
+}
+
+static int client_rx_on(struct client_info *ci)
+{
+	if (clients_frozen) {
+		/* switched on by thaw_clients() */
+		ci->rx_held = true;
+		return 0;
+	}
+
+	if (ci->reactor)
+		return reactor_rx_on(ci);
+	return conn_rx_on(&ci->conn);
+}
+
+static int client_rx_off(struct client_info *ci)
+{
+	if (ci->reactor)
+		return reactor_rx_off(ci);
+	return conn_rx_off(&ci->conn);
+}
+
+static int client_tx_on(struct client_info *ci)
+{
+	if (ci->reactor)
+		return reactor_tx_on(ci);
+	return conn_tx_on(&ci->conn);
+}
+
+static void reactor_client_handler(struct client_info *ci, uint32_t events)
+{
+	uint32_t todo;
+
+	/* the zerocopy completions raise EPOLLERR too */
+	if ((events & EPOLLERR) && !conn_error(&ci->conn))
+		events &= ~EPOLLERR;
+
+	sd_mutex_lock(&ci->lock);
+	/* the error is noticed by the dispatched work */
+	if (events & (EPOLLERR | EPOLLHUP))
+		events |= EPOLLIN | EPOLLOUT;
+	todo = events & ci->conn.events;
+	ci->conn.events &= ~todo;
+	if (ci->conn.events && reactor_arm(ci))
+		sd_err("failed to rearm the client, %m");
+	/* refcnt prevents the client_info from being freed by the works */
+	if (todo & EPOLLIN)
+		refcount_inc(&ci->refcnt);
+	if (todo & EPOLLOUT)
+		refcount_inc(&ci->refcnt);
+	sd_mutex_unlock(&ci->lock);
+
+	if (todo & EPOLLIN) {
+		ci->rx_work.fn = rx_work;
+		ci->rx_work.done = rx_main;
+		tracepoint(request, queue_request, ci->conn.fd, &ci->rx_work,
+			   1);
+		queue_work(sys->net_wqueue, &ci->rx_work);
+	}
+
+	if (todo & EPOLLOUT) {
+		ci->tx_work.fn = tx_work;
+		ci->tx_work.done = tx_main;
+		tracepoint(request, queue_request, ci->conn.fd, &ci->tx_work,
+			   0);
+		queue_work(sys->net_wqueue, &ci->tx_work);
+	}
+}
+
+static void *reactor_routine(void *arg)
+{
+	struct reactor *r = arg;
+	struct epoll_event events[REACTOR_NR_EVENTS];
+	struct client_info *ci;
+	LIST_HEAD(dead_list);
+	int nr, i;
+
+	while (true) {
+		nr = event_wait(r->epfd, events, ARRAY_SIZE(events), -1);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("epoll_wait failed: %m");
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (events[i].data.ptr) {
+				reactor_client_handler(events[i].data.ptr,
+						       events[i].events);
+				continue;
+			}
+
+			eventfd_xread(r->efd);
+			sd_mutex_lock(&r->lock);
+			list_splice_tail_init(&r->dead_list, &dead_list);
+			sd_mutex_unlock(&r->lock);
+		}
+
+		/* epoll_wait() can't return the removed clients from now on */
+		list_for_each_entry(ci, &dead_list, dead_list) {
+			list_del(&ci->dead_list);
+			close(ci->conn.fd);
+			sd_destroy_mutex(&ci->lock);
+			free(ci);
+		}
+	}
+
+	return NULL;
+}
+
+int init_reactors(int nr)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	int i, ret;
+
+	reactors = xzalloc(sizeof(*reactors) * nr);
+	for (i = 0; i < nr; i++) {
+		struct reactor *r = reactors + i;
+		sd_thread_t thread;
+
+		r->epfd = epoll_create1(EPOLL_CLOEXEC);
+		r->efd = eventfd(0, EFD_NONBLOCK);
+		if (r->epfd < 0 || r->efd < 0) {
+			sd_err("failed to create the reactor, %m");
+			return -1;
+		}
+		sd_init_mutex(&r->lock);
+		INIT_LIST_HEAD(&r->dead_list);
+
+		/* the eventfd is the only member with NULL data.ptr */
+		ev.data.ptr = NULL;
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->efd, &ev) < 0) {
+			sd_err("failed to add the reactor eventfd, %m");
+			return -1;
+		}
+
+		ret = sd_thread_create_with_idx("reactor", &thread,
+						reactor_routine, r);
+		if (ret) {
+			sd_err("failed to create the reactor thread, %s",
+			       strerror(ret));
+			return -1;
+		}
+	}
+	nr_reactors = nr;
+	sd_info("%d reactor threads for the client connections", nr);
+
+	return 0;
+}
+
+/* Poll the connection fd, which is closed on failure */
+static int add_client(int fd, bool is_inet_socket)
+{
+	struct client_info *ci;
+	int ret;
+
+	ci = create_client(fd);
+	if (!ci) {
+		close(fd);
+		return -1;
+	}
+
+	if (is_inet_socket && set_zerocopy(fd) == 0)
+		ci->conn.zerocopy = true;
+	ci->conn.unix_sock = !is_inet_socket;
+
+	if (nr_reactors)
+		ret = reactor_add_client(ci);
+	else
+		ret = register_event(fd, client_handler, ci);
+	if (ret) {
+		list_del(&ci->client_list);
+		destroy_client(ci);
+		return -1;
+	}
+
+	return 0;
+}
+
 static void listen_handler(int listen_fd, int events, void *data)
 {
 	struct sockaddr_storage from;
 	socklen_t namesize;
 	int fd, ret;
-	struct client_info *ci;
 	bool is_inet_socket = *(bool *)data;
 
 	if (sys->cinfo.status == SD_STATUS_SHUTDOWN) {
@@ -1055,19 +2002,11 @@ static void listen_handler(int listen_fd, int events, void *data)
 			close(fd);
 			return;
 		}
+		set_busy_poll_sock(fd);
 	}
 
-	ci = create_client(fd);
-	if (!ci) {
-		close(fd);
+	if (add_client(fd, is_inet_socket) < 0)
 		return;
-	}
-
-	ret = register_event(fd, client_handler, ci);
-	if (ret) {
-		destroy_client(ci);
-		return;
-	}
 
 	sd_debug("accepted a new connection: %d", fd);
 }
@@ -1076,6 +2015,7 @@ static LIST_HEAD(listening_fd_list);
 
 struct listening_fd {
 	int fd;
+	bool is_inet_socket;
 	struct list_node list;
 };
 
@@ -1085,9 +2025,10 @@ static int create_listen_port_fn(int fd, void *data)
 
 	new_fd = xzalloc(sizeof(*new_fd));
 	new_fd->fd = fd;
+	new_fd->is_inet_socket = *(bool *)data;
 	list_add_tail(&new_fd->list, &listening_fd_list);
 
-	return register_event(fd, listen_handler, data);
+	return register_event(fd, listen_handler, &new_fd->is_inet_socket);
 }
 
 void unregister_listening_fds(void)
@@ -1157,10 +2098,75 @@ void local_request_init(void)
 	register_event(sys->local_req_efd, local_req_handler, NULL);
 }
 
+/* Take the answer of the node to SD_FLAG_CMD_ZSTD, see wire.c */
+static int exec_req_zstd(const struct node_id *nid, struct sd_rsp *rsp,
+			 void *buf, uint32_t size)
+{
+	int len;
+
+	sockfd_cache_set_zstd(nid, rsp->flags & SD_FLAG_CMD_ZSTD);
+	rsp->flags &= ~SD_FLAG_CMD_ZSTD;
+	if (rsp->result != SD_RES_SUCCESS ||
+	    !(rsp->flags & SD_FLAG_CMD_ZSTD_DATA))
+		return rsp->result;
+
+	len = wire_decompress(buf, rsp->data_length, size);
+	if (len < 0)
+		return SD_RES_NETWORK_ERROR;
+	rsp->data_length = len;
+	rsp->flags &= ~SD_FLAG_CMD_ZSTD_DATA;
+
+	return SD_RES_SUCCESS;
+}
+
+/* Expand the data extents of the sparse response into buf of size bytes */
+static int exec_req_sparse(struct sd_rsp *rsp, void *buf, uint32_t size)
+{
+	uint32_t len = rsp->data_length;
+	struct sd_extents *e;
+	const char *p, *end;
+
+	if (rsp->result != SD_RES_SUCCESS ||
+	    !(rsp->flags & SD_FLAG_CMD_SPARSE))
+		return rsp->result;
+
+	e = xmalloc(len);
+	memcpy(e, buf, len);
+	if (len < sd_extents_size(0) || e->nr > SD_MAX_EXTENTS ||
+	    len < sd_extents_size(e->nr) || e->length > size)
+		goto broken;
+
+	memset(buf, 0, e->length);
+	p = (char *)e + sd_extents_size(e->nr);
+	end = (char *)e + len;
+	for (int i = 0; i < e->nr; i++) {
+		const struct sd_extent *ext = e->ext + i;
+
+		if (ext->offset > e->length ||
+		    ext->length > e->length - ext->offset ||
+		    ext->length > end - p)
+			goto broken;
+		memcpy((char *)buf + ext->offset, p, ext->length);
+		p += ext->length;
+	}
+
+	rsp->data_length = e->length;
+	rsp->flags &= ~SD_FLAG_CMD_SPARSE;
+	free(e);
+	return SD_RES_SUCCESS;
+broken:
+	sd_err("broken sparse response of %"PRIu32" bytes", len);
+	free(e);
+	return SD_RES_NETWORK_ERROR;
+}
+
 worker_fn int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr,
 			     void *buf)
 {
 	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+	bool zstd = hdr->flags & SD_FLAG_CMD_ZSTD;
+	bool sparse = hdr->flags & SD_FLAG_CMD_SPARSE;
+	uint32_t size = hdr->data_length;
 	int ret;
 
 #ifndef HAVE_ACCELIO
@@ -1203,6 +2209,10 @@ worker_fn int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr,
 				op_name(get_sd_op(hdr->opcode)));
 
 #endif
+	if (zstd)
+		ret = exec_req_zstd(nid, rsp, buf, size);
+	if (sparse && ret == SD_RES_SUCCESS)
+		ret = exec_req_sparse(rsp, buf, size);
 	return ret;
 }
 
@@ -1210,3 +2220,104 @@ bool sheep_need_retry(uint32_t epoch)
 {
 	return sys_epoch() == epoch;
 }
+
+/*
+ * Hold the receiving from all the connections after their current requests,
+ * and stop accepting new ones, for the handover
+ */
+main_fn void freeze_clients(void)
+{
+	struct client_info *ci;
+
+	clients_frozen = true;
+	unregister_listening_fds();
+	list_for_each_entry(ci, &client_list, client_list) {
+		bool armed;
+
+		if (ci->reactor)
+			sd_mutex_lock(&ci->lock);
+		armed = ci->conn.events & EPOLLIN;
+		if (ci->reactor)
+			sd_mutex_unlock(&ci->lock);
+
+		/* the others are switched on by rx_main() or the admission */
+		if (armed && !ci->conn.dead) {
+			client_rx_off(ci);
+			ci->rx_held = true;
+		}
+	}
+}
+
+main_fn void thaw_clients(void)
+{
+	struct listening_fd *fd;
+	struct client_info *ci;
+
+	clients_frozen = false;
+	list_for_each_entry(fd, &listening_fd_list, list)
+		register_event(fd->fd, listen_handler, &fd->is_inet_socket);
+	list_for_each_entry(ci, &client_list, client_list) {
+		if (!ci->rx_held)
+			continue;
+		ci->rx_held = false;
+		if (client_rx_on(ci))
+			sd_err("switch on receiving flag failure, "
+			       "connection maybe closed");
+	}
+}
+
+/* Whether the frozen connections have no requests nor responses left */
+main_fn bool clients_drained(void)
+{
+	struct client_info *ci;
+
+	list_for_each_entry(ci, &client_list, client_list)
+		if (refcount_read(&ci->refcnt) || !list_empty(&ci->done_reqs) ||
+		    !list_empty(&ci->tx_reqs))
+			return false;
+
+	return true;
+}
+
+/*
+ * Fill fds with the listening sockets and the connections which can be handed
+ * over, up to max of them.  Returns the number of them.
+ */
+main_fn int get_handover_fds(struct handover_fd *fds, int max)
+{
+	struct listening_fd *fd;
+	struct client_info *ci;
+	int nr = 0;
+
+	list_for_each_entry(fd, &listening_fd_list, list) {
+		if (nr == max)
+			return nr;
+		fds[nr].fd = fd->fd;
+		fds[nr].listen = true;
+		fds[nr].is_inet_socket = fd->is_inet_socket;
+		nr++;
+	}
+
+	list_for_each_entry(ci, &client_list, client_list) {
+		/* the rings of the local clients stay with this process */
+		if (ci->conn.dead || ci->shm)
+			continue;
+		if (nr == max)
+			return nr;
+		fds[nr].fd = ci->conn.fd;
+		fds[nr].listen = false;
+		fds[nr].is_inet_socket = !ci->conn.unix_sock;
+		nr++;
+	}
+
+	return nr;
+}
+
+/* Take over the listening socket or the connection fd of the old sheep */
+int adopt_handover_fd(const struct handover_fd *fd)
+{
+	if (!fd->listen)
+		return add_client(fd->fd, fd->is_inet_socket);
+
+	return create_listen_port_fn(fd->fd, (void *)&fd->is_inet_socket);
+}
@@ -15,6 +15,7 @@
 #include "sheep_priv.h"
 #include "trace/trace.h"
 #include "option.h"
+#include "numa.h"
 
 #ifdef HAVE_ACCELIO
 #include "xio.h"
@@ -34,6 +35,12 @@ static const char bind_help[] =
 "This tries to teach sheep listen to all the NICs available. It can be useful\n"
 "when you want sheep to response dog without specified address and port.\n";
 
+static const char blockdev_help[] =
+"Example:\n\t$ sheep -B /dev/nvme0n1p1 ...\n"
+"This keeps the objects of the raw store on the given block device, without\n"
+"a file system, when the cluster is formatted with 'dog cluster format -b raw'.\n"
+"Everything on the device is lost at format.\n";
+
 static const char ioaddr_help[] =
 "Example:\n\t$ sheep -i host=192.168.1.1,port=7002 ...\n"
 "This tries to add a dedicated IO NIC of 192.168.1.1:7002 to transfer data.\n"
@@ -44,15 +51,27 @@ static const char journal_help[] =
 "\tsize=: size of the journal in megabyes\n"
 "\tdir=: path to the location of the journal (default: $STORE)\n"
 "\tskip: if specified, skip the recovery at startup\n"
+"\tgroup: if specified, batch concurrent writes and sync them together\n"
 "\nExample:\n\t$ sheep -j dir=/journal,size=1G\n"
 "This tries to use /journal as the journal storage of the size 1G\n";
 
+static const char cache_help[] =
+"Available arguments:\n"
+"\tsize=: size of the object cache (default: 0, disabled)\n"
+"\tdir=: path to the location of the object cache (default: $STORE/cache)\n"
+"\twritethrough: forward writes to the replicas before completing them\n"
+"\nExample:\n\t$ sheep -C dir=/ssd/cache,size=64G ...\n"
+"This tries to cache data objects of the VDIs accessed in the cache mode on\n"
+"/ssd/cache, using up to 64GB.\n";
+
 #ifdef HAVE_HTTP
 static const char http_help[] =
 "Available arguments:\n"
 "\thost=: specify a host to communicate with http server (default: localhost)\n"
 "\tport=: specify a port to communicate with http server (default: 8000)\n"
 "\tbuffer=: specify buffer size for http request (default: 32M)\n"
+"\tdepth=: specify number of buffers in flight per request (default: 2)\n"
+"\tmode=: fastcgi (default) or native, to serve HTTP/1.1 without a web server\n"
 "\tswift: enable swift API\n"
 "Example:\n\t$ sheep -r host=localhost,port=7001,buffer=64M,swift ...\n"
 "This tries to enable Swift API and use localhost:7001 to\n"
@@ -89,7 +108,8 @@ static const char log_help[] =
 "\tdir=: path to the location of sheep.log\n"
 "\tlevel=: log level of sheep.log\n"
 "\tformat=: log format type\n"
-"\tdst=: log destination type\n\n"
+"\tdst=: log destination type\n"
+"\tslow=: log the stages of the requests slower than this (ms)\n\n"
 "if dir is not specified, use metastore directory\n\n"
 "Available log levels:\n"
 "  Level      Description\n"
@@ -117,22 +137,189 @@ static const char recovery_help[] =
 "Available arguments:\n"
 "\tmax=: object recovery process maximum count of each interval\n"
 "\tinterval=: object recovery interval time (millisec)\n"
-"Example:\n\t$ sheep -R max=50,interval=1000 ...\n";
+"\tinflight=: maximum number of objects recovered in parallel\n"
+"\t           (default: 4 per disk)\n"
+"\tnode=: maximum number of them read from the same node (default: 8)\n"
+"\tdisk=: maximum number of them written to the same disk (default: 4)\n"
+"\tbandwidth=: total recovery bandwidth per second (default: unlimited)\n"
+"\tlink=: recovery bandwidth from each node per second (default: unlimited)\n"
+"\tlatency=: lower the bandwidth while the latency of the gateway requests\n"
+"\t          exceeds this (usec, default: disabled)\n"
+"\tpurge=: stale objects removed per second after the recovery\n"
+"\t        (default: 1000)\n"
+"Example:\n\t$ sheep -R max=50,interval=1000 ...\n"
+"\t$ sheep -R inflight=64,node=16 ...\n"
+"\t$ sheep -R bandwidth=200M,link=50M,latency=20000 ...\n"
+"\t$ sheep -R purge=5000 ...\n";
+
+static const char admission_help[] =
+"Available arguments:\n"
+"\treqs=: outstanding gateway requests of this sheep (default: unlimited)\n"
+"\tbytes=: outstanding bytes of them (default: unlimited)\n"
+"\tclient_reqs=: outstanding requests of each connection\n"
+"\t              (default: unlimited)\n"
+"\tclient_bytes=: outstanding bytes of each connection (default: unlimited)\n"
+"Example:\n\t$ sheep -A reqs=4096,bytes=1G,client_reqs=256 ...\n"
+"When a limit is hit, this sheep stops reading the requests from the\n"
+"connection until its outstanding requests are served.  The requests from\n"
+"the other sheep aren't limited.\n";
+
+static const char metrics_help[] =
+"Available arguments:\n"
+"\thost=: address to listen on (default: all the addresses)\n"
+"\tport=: port to listen on (default: 9180)\n"
+"Example:\n\t$ sheep -m port=9180 ...\n"
+"This sheep answers GET /metrics with its request counters and latencies,\n"
+"its work queues, its connections to the other sheep, the progress of the\n"
+"recovery, its disks and its journal in the Prometheus text format.\n";
+
+static const char readahead_help[] =
+"Available arguments:\n"
+"\twindow=: maximum number of the objects prefetched ahead of a stream\n"
+"\t         (default: 8, 0 disables the readahead)\n"
+"\tsize=: size of the readahead buffer (default: 64M)\n"
+"Example:\n\t$ sheep -a window=16,size=256M ...\n"
+"The gateway detects the sequential readers of each vdi and reads the next\n"
+"objects in the background, so that the readers don't pay a round trip\n"
+"for every object.  Not effective with the object cache.\n";
+
+static const char md_weight_help[] =
+"Available arguments:\n"
+"\tinterval=: update the weights every this seconds (default: 60)\n"
+"\tmin=: the minimum weight of a disk in percent (default: 25)\n"
+"Example:\n\t$ sheep -M interval=300,min=10 ...\n"
+"This spreads the objects over the disks of this sheep by their space\n"
+"weighted by their measured latency and throughput, instead of the space\n"
+"alone.  Not supported in the disk mode.\n";
+
+static const char hugepages_help[] =
+"Available arguments:\n"
+"\tsize=: size of the huge page arena (default: 1G)\n"
+"\tprefault=: fault the whole arena in at startup if 1 (default: 0)\n"
+"Example:\n\t$ sheep -G size=4G,prefault=1 ...\n"
+"The object buffers of 512K and larger are carved out of huge pages, from\n"
+"hugetlbfs if enough of them are reserved, or else transparent ones, which\n"
+"saves the page faults and the TLB misses of the large I/O.  The arena is\n"
+"never given back to the system.\n";
+
+static const char writeback_help[] =
+"Available arguments:\n"
+"\twindow=: make the writes durable within this msec (default: 50)\n"
+"\tsize=: or once this size is written (default: 64M)\n"
+"Example:\n\t$ sheep -N window=100,size=128M ...\n"
+"The objects are written without O_DSYNC like with '-n', and are synced\n"
+"to the disks in the background within the window, so a power failure\n"
+"loses the writes of about the last window only.  A flush of a guest syncs\n"
+"all the nodes at once.  Give it to all the sheep.  Not supported by the\n"
+"log and the raw stores.\n";
+
+static const char observe_help[] =
+"Available arguments:\n"
+"\taddr=: the address of a sheep of the cluster\n"
+"\tport=: its port (default: 7000)\n"
+"\tinterval=: poll the membership every this msec (default: 1000)\n"
+"Example:\n\t$ sheep -o addr=192.168.1.1,interval=500 ...\n"
+"The sheep runs as a gateway which follows the membership of the cluster\n"
+"without joining it, so it takes no part in the epochs and any number of\n"
+"them can run next to the clients.  The cluster operations are sent to a\n"
+"member.  Implies '-g'.  The cluster driver isn't used, so it can't be used\n"
+"with '-r'.\n";
+
+static const char precopy_help[] =
+"Available arguments:\n"
+"\tbandwidth=: pre-copy bandwidth per second (default: 20M)\n"
+"\tmax=: maximum number of the objects whose writes are counted\n"
+"\t      (default: 65536)\n"
+"Example:\n\t$ sheep -S bandwidth=50M,max=100000 ...\n"
+"After a vdi is snapshotted, this copies the objects which were written\n"
+"the most through this sheep into the new working vdi in the background,\n"
+"so that the writes after the snapshot rarely pay the copy-on-write.\n"
+"Give it to all the sheep which serve the clients.  Not supported with\n"
+"the object cache, the journal, the erasure code and the tree, the log and\n"
+"the raw stores.\n";
+
+static const char dedup_help[] =
+"Available arguments:\n"
+"\tinterval=: scan the objects every this seconds (default: 3600)\n"
+"Example:\n\t$ sheep -d interval=600 ...\n"
+"This links the identical data objects of the snapshots on each disk of\n"
+"this sheep to one file.  The writable, sparse and erasure coded objects\n"
+"are left alone.  Not supported by the tree, the log and the raw stores.\n";
+
+static const char scrub_help[] =
+"Available arguments:\n"
+"\tbandwidth=: scrub bandwidth per second (default: 4M)\n"
+"\tinterval=: start a pass this seconds after the previous one\n"
+"\t           (default: 86400)\n"
+"Example:\n\t$ sheep -s bandwidth=10M,interval=604800 ...\n"
+"This reads the local objects in the background, repairs the ones which\n"
+"fail their checksums from the other replicas, and compares the replicas\n"
+"of the objects this sheep is the primary of.  The scrub slows down while\n"
+"the clients are busy and pauses during the recovery.  The erasure coded\n"
+"objects are left to 'dog vdi check'.\n";
+
+static const char hedged_read_help[] =
+"If a replica doesn't answer a read within its 95th percentile latency,\n"
+"estimated from its smoothed round trip time and the deviation of it, the\n"
+"read is sent to the next best replica as well and the first response is\n"
+"used.  This cuts the tail latency of the reads at the cost of some more\n"
+"reads.  Not effective with accelio.\n";
+
+static const char busy_poll_help[] =
+"Example:\n\t$ sheep -L 50 ...\n"
+"The event loops, the worker threads and the sockets poll for up to the\n"
+"given usec (1 to 10000) for the next event before they sleep, which\n"
+"trades CPU for the latency of the sleeps and the wakeups.  They fall\n"
+"back to sleeping when nothing comes within the window.  Raising the\n"
+"busy polling of the sockets over net.core.busy_read needs\n"
+"CAP_NET_ADMIN.\n";
+
+#ifdef HAVE_ZSTD
+static const char wire_compress_help[] =
+"Example:\n\t$ sheep -Z ...\n"
+"The object data read from and written to the sheep of the other zones is\n"
+"sent as zstd frames if they are built with zstd, which saves the bandwidth\n"
+"of the links between the zones at the cost of some CPU.  Useless if the\n"
+"zones share the same network.\n";
+#endif
+
+static const char takeover_help[] =
+"Example:\n\t$ sheep -T /store/sheep ...\n"
+"This takes over the listening sockets and the client connections of the\n"
+"sheep running on the same directory, e.g. to upgrade it.  The running\n"
+"sheep answers the requests it has read, passes the connections and exits,\n"
+"and this one serves them after it has joined the cluster.  Give it the\n"
+"options of the running sheep; the addresses it listens on are taken over.\n"
+"Not supported with accelio.\n";
 
 static const char vnodes_help[] =
 "Example:\n\t$ sheep -V 128\n"
 "\tset number of vnodes\n";
 
 static struct sd_option sheep_options[] = {
+	{'a', "readahead", true, "prefetch the objects of the sequential "
+	 "readers (default: window=8,size=64M)", readahead_help},
+	{'A', "admission", true, "limit the outstanding requests "
+	 "(default: disabled)", admission_help},
 	{'b', "bindaddr", true, "specify IP address of interface to listen on",
 	 bind_help},
+	{'B', "blockdev", true, "specify the block device of the raw store",
+	 blockdev_help},
 	{'c', "cluster", true,
 	 "specify the cluster driver (default: "DEFAULT_CLUSTER_DRIVER")",
 	 cluster_help},
+	{'C', "cache", true, "enable object cache on the gateway "
+	 "(default: disabled)", cache_help},
+	{'d', "dedup", true, "share the files of the identical read-only "
+	 "objects (default: disabled)", dedup_help},
 	{'D', "directio", false, "use direct IO for backend store"},
 	{'f', "foreground", false, "make the program run in foreground"},
 	{'g', "gateway", false, "make the program run as a gateway mode"},
+	{'G', "hugepages", true, "back the object buffers with huge pages "
+	 "(default: disabled)", hugepages_help},
 	{'h', "help", false, "display this help and exit"},
+	{'H', "hedged-read", false, "send a slow replica read to another "
+	 "replica as well", hedged_read_help},
 	{'i', "ioaddr", true, "use separate network card to handle IO requests"
 	 " (default: disabled)", ioaddr_help},
 	{'j', "journal", true, "use journal file to log all the write "
@@ -140,7 +327,18 @@ static struct sd_option sheep_options[] = {
 	{'l', "log", true,
 	 "specify the log level, the log directory and the log format"
 	 "(log level default: 6 [SDOG_INFO])", log_help},
+	{'L', "busy-poll", true, "busy-poll for the given usec before "
+	 "sleeping (default: disabled)", busy_poll_help},
+	{'m', "metrics", true, "serve the metrics for Prometheus over HTTP "
+	 "(default: disabled)", metrics_help},
+	{'M', "md-weight", true,
+	 "weight the local disks by their performance (default: disabled)",
+	 md_weight_help},
 	{'n', "nosync", false, "drop O_SYNC for write of backend"},
+	{'N', "writeback", true, "sync the writes in the background within a "
+	 "bounded window (default: disabled)", writeback_help},
+	{'o', "observe", true, "run as a gateway following the cluster "
+	 "without joining it (default: disabled)", observe_help},
 	{'p', "port", true, "specify the TCP port on which to listen "
 	 "(default: 7000)"},
 	{'P', "pidfile", true, "create a pid file"},
@@ -150,6 +348,12 @@ static struct sd_option sheep_options[] = {
 #endif
 	{'R', "recovery", true, "specify the recovery speed throttling",
 	 recovery_help},
+	{'s', "scrub", true, "scrub the local objects in the background "
+	 "(default: disabled)", scrub_help},
+	{'S', "precopy", true, "copy the hot objects in the background after "
+	 "snapshots (default: disabled)", precopy_help},
+	{'T', "takeover", false, "take over the connections of the running "
+	 "sheep", takeover_help},
 	{'u', "upgrade", false, "upgrade to the latest data layout"},
 	{'v', "version", false, "show the version"},
 	{'V', "vnodes", true, "set number of vnodes", vnodes_help},
@@ -162,6 +366,10 @@ static struct sd_option sheep_options[] = {
 	{'z', "zone", true,
 	 "specify the zone id (default: determined by listen address)",
 	 zone_help},
+#ifdef HAVE_ZSTD
+	{'Z', "wire-compress", false, "compress the object data sent to the "
+	 "other zones", wire_compress_help},
+#endif
 	{ 0, NULL, false, NULL },
 };
 
@@ -188,6 +396,8 @@ static void usage(int status)
 			       opt->desc);
 		}
 
+		printf("\nPATH is <meta dir>[,<disk>]..., the disks given as "
+		       "hot:<disk> form\nthe hot tier of the objects\n");
 		printf("\nTry '%s <option>', e.g., '%s -w', to get more detail "
 		       "about specific option\n", program_name, program_name);
 	}
@@ -340,11 +550,25 @@ static int log_dst_parser(const char *s)
 	return 0;
 }
 
+static int log_slow_parser(const char *s)
+{
+	char *p;
+	long ms = strtol(s, &p, 10);
+
+	if (s == p || *p || ms < 0 || ms > UINT32_MAX) {
+		sd_err("invalid slow request threshold: %s", s);
+		return -1;
+	}
+	sys->slow_request_ms = ms;
+	return 0;
+}
+
 static struct option_parser log_parsers[] = {
 	{ "level=", log_level_parser },
 	{ "dir=", log_dir_parser },
 	{ "format=", log_format_parser },
 	{ "dst=", log_dst_parser },
+	{ "slow=", log_slow_parser },
 	{ NULL, NULL },
 };
 
@@ -418,6 +642,36 @@ static int wq_async_parser(const char *s)
 	return 0;
 }
 
+static bool wq_steal;
+static int wq_steal_threads;
+static int wq_steal_parser(const char *s)
+{
+	wq_steal = true;
+	wq_steal_threads = atoi(s);
+	return 0;
+}
+
+static int wq_reactor_threads;
+static int wq_reactor_parser(const char *s)
+{
+	wq_reactor_threads = atoi(s);
+	return 0;
+}
+
+static int wq_disk_depth_parser(const char *s)
+{
+	md_set_io_depth(atoi(s));
+	return 0;
+}
+
+static bool wq_numa;
+static int wq_numa_parser(const char *s)
+{
+	wq_numa = !!atoi(s);
+	md_set_numa(wq_numa);
+	return 0;
+}
+
 static struct option_parser wq_parsers[] = {
 	{ "net=", wq_net_parser },
 	{ "gway=", wq_gway_parser },
@@ -429,6 +683,11 @@ static struct option_parser wq_parsers[] = {
 	{ "remove_peer=", wq_remove_peer_parser },
 	{ "recovery=", wq_recovery_parser },
 	{ "async=", wq_async_parser },
+	{ "steal=", wq_steal_parser },
+	{ "reactor=", wq_reactor_parser },
+	{ "disk_depth=", wq_disk_depth_parser },
+	{ "numa=", wq_numa_parser },
+	{ NULL, NULL },
 };
 
 static const char *io_addr, *io_pt;
@@ -464,6 +723,7 @@ static struct option_parser ionic_parsers[] = {
 
 static char jpath[PATH_MAX];
 static bool jskip;
+static bool jgroup;
 static uint64_t jsize;
 
 static int journal_dir_parser(const char *s)
@@ -491,10 +751,45 @@ static int journal_skip_parser(const char *s)
 	return 0;
 }
 
+static int journal_group_parser(const char *s)
+{
+	jgroup = true;
+	return 0;
+}
+
 static struct option_parser journal_parsers[] = {
 	{ "dir=", journal_dir_parser },
 	{ "size=", journal_size_parser },
 	{ "skip", journal_skip_parser },
+	{ "group", journal_group_parser },
+	{ NULL, NULL },
+};
+
+static char cache_path[PATH_MAX];
+static uint64_t cache_size;
+static bool cache_writethrough;
+
+static int cache_dir_parser(const char *s)
+{
+	snprintf(cache_path, sizeof(cache_path), "%s", s);
+	return 0;
+}
+
+static int cache_size_parser(const char *s)
+{
+	return option_parse_size(s, &cache_size);
+}
+
+static int cache_writethrough_parser(const char *s)
+{
+	cache_writethrough = true;
+	return 0;
+}
+
+static struct option_parser cache_parsers[] = {
+	{ "dir=", cache_dir_parser },
+	{ "size=", cache_size_parser },
+	{ "writethrough", cache_writethrough_parser },
 	{ NULL, NULL },
 };
 
@@ -512,9 +807,354 @@ static int queue_work_interval_parser(const char *s)
 	return 0;
 }
 
+static int recovery_inflight_parser(const char *s)
+{
+	sys->rwindow.max_inflight = strtol(s, NULL, 10);
+	return 0;
+}
+
+static int recovery_node_parser(const char *s)
+{
+	sys->rwindow.max_per_node = strtol(s, NULL, 10);
+	return 0;
+}
+
+static int recovery_disk_parser(const char *s)
+{
+	sys->rwindow.max_per_disk = strtol(s, NULL, 10);
+	return 0;
+}
+
+static int recovery_bandwidth_parser(const char *s)
+{
+	return option_parse_size(s, &sys->rthrottling.bandwidth);
+}
+
+static int recovery_link_parser(const char *s)
+{
+	return option_parse_size(s, &sys->rthrottling.link_bandwidth);
+}
+
+static int recovery_latency_parser(const char *s)
+{
+	sys->rthrottling.latency_target = strtol(s, NULL, 10);
+	return 0;
+}
+
+static int recovery_purge_parser(const char *s)
+{
+	sys->purge_rate = strtol(s, NULL, 10);
+	return 0;
+}
+
 static struct option_parser recovery_parsers[] = {
 	{ "max=", max_exec_count_parser },
 	{ "interval=", queue_work_interval_parser },
+	{ "inflight=", recovery_inflight_parser },
+	{ "node=", recovery_node_parser },
+	{ "disk=", recovery_disk_parser },
+	{ "bandwidth=", recovery_bandwidth_parser },
+	{ "link=", recovery_link_parser },
+	{ "latency=", recovery_latency_parser },
+	{ "purge=", recovery_purge_parser },
+	{ NULL, NULL },
+};
+
+static int admission_number(const char *s, uint32_t *n)
+{
+	char *p;
+	long v = strtol(s, &p, 10);
+
+	if (s == p || *p || v < 0 || v > UINT32_MAX) {
+		sd_err("invalid number of requests: %s", s);
+		return -1;
+	}
+	*n = v;
+	return 0;
+}
+
+static int admission_reqs_parser(const char *s)
+{
+	return admission_number(s, &sys->admission.reqs);
+}
+
+static int admission_bytes_parser(const char *s)
+{
+	return option_parse_size(s, &sys->admission.bytes);
+}
+
+static int admission_client_reqs_parser(const char *s)
+{
+	return admission_number(s, &sys->admission.client_reqs);
+}
+
+static int admission_client_bytes_parser(const char *s)
+{
+	return option_parse_size(s, &sys->admission.client_bytes);
+}
+
+static struct option_parser admission_parsers[] = {
+	{ "reqs=", admission_reqs_parser },
+	{ "bytes=", admission_bytes_parser },
+	{ "client_reqs=", admission_client_reqs_parser },
+	{ "client_bytes=", admission_client_bytes_parser },
+	{ NULL, NULL },
+};
+
+static uint32_t readahead_window = 8;
+static uint64_t readahead_size = 64 * 1024 * 1024;
+
+static int readahead_window_parser(const char *s)
+{
+	char *p;
+	long window = strtol(s, &p, 10);
+
+	if (s == p || *p || window < 0 || window > 1024) {
+		sd_err("invalid readahead window: %s", s);
+		return -1;
+	}
+	readahead_window = window;
+	return 0;
+}
+
+static int readahead_size_parser(const char *s)
+{
+	if (option_parse_size(s, &readahead_size) < 0)
+		return -1;
+	if (!readahead_size) {
+		sd_err("invalid readahead buffer size: %s", s);
+		return -1;
+	}
+	return 0;
+}
+
+static struct option_parser readahead_parsers[] = {
+	{ "window=", readahead_window_parser },
+	{ "size=", readahead_size_parser },
+	{ NULL, NULL },
+};
+
+static unsigned int md_weight_interval;
+static unsigned int md_min_weight = 25;
+
+static int md_weight_interval_parser(const char *s)
+{
+	char *p;
+	long interval = strtol(s, &p, 10);
+
+	if (s == p || *p || interval <= 0 || interval > UINT32_MAX / 1000) {
+		sd_err("invalid interval of the disk weights: %s", s);
+		return -1;
+	}
+	md_weight_interval = interval;
+	return 0;
+}
+
+static int md_min_weight_parser(const char *s)
+{
+	char *p;
+	long weight = strtol(s, &p, 10);
+
+	if (s == p || *p || weight <= 0 || weight > 100) {
+		sd_err("invalid minimum disk weight: %s", s);
+		return -1;
+	}
+	md_min_weight = weight;
+	return 0;
+}
+
+static struct option_parser md_weight_parsers[] = {
+	{ "interval=", md_weight_interval_parser },
+	{ "min=", md_min_weight_parser },
+	{ NULL, NULL },
+};
+
+static uint64_t precopy_bandwidth;
+static uint32_t precopy_max_objects = 65536;
+
+static int precopy_bandwidth_parser(const char *s)
+{
+	if (option_parse_size(s, &precopy_bandwidth) < 0)
+		return -1;
+	if (!precopy_bandwidth) {
+		sd_err("invalid pre-copy bandwidth: %s", s);
+		return -1;
+	}
+	return 0;
+}
+
+static int precopy_max_parser(const char *s)
+{
+	char *p;
+	long max = strtol(s, &p, 10);
+
+	if (s == p || *p || max <= 0 || max > UINT32_MAX) {
+		sd_err("invalid maximum number of the pre-copy objects: %s", s);
+		return -1;
+	}
+	precopy_max_objects = max;
+	return 0;
+}
+
+static struct option_parser precopy_parsers[] = {
+	{ "bandwidth=", precopy_bandwidth_parser },
+	{ "max=", precopy_max_parser },
+	{ NULL, NULL },
+};
+
+static uint64_t scrub_bandwidth;
+static uint32_t scrub_interval;
+
+static int scrub_bandwidth_parser(const char *s)
+{
+	if (option_parse_size(s, &scrub_bandwidth) < 0)
+		return -1;
+	if (!scrub_bandwidth) {
+		sd_err("invalid scrub bandwidth: %s", s);
+		return -1;
+	}
+	return 0;
+}
+
+static int scrub_interval_parser(const char *s)
+{
+	char *p;
+	long interval = strtol(s, &p, 10);
+
+	if (s == p || *p || interval <= 0 || interval > UINT32_MAX / 1000) {
+		sd_err("invalid scrub interval: %s", s);
+		return -1;
+	}
+	scrub_interval = interval;
+	return 0;
+}
+
+static struct option_parser scrub_parsers[] = {
+	{ "bandwidth=", scrub_bandwidth_parser },
+	{ "interval=", scrub_interval_parser },
+	{ NULL, NULL },
+};
+
+static uint64_t writeback_size;
+
+static int writeback_window_parser(const char *s)
+{
+	char *p;
+	long window = strtol(s, &p, 10);
+
+	if (s == p || *p || window <= 0 || window > 60000) {
+		sd_err("invalid write-back window: %s", s);
+		return -1;
+	}
+	sys->writeback_window = window;
+	return 0;
+}
+
+static int writeback_size_parser(const char *s)
+{
+	if (option_parse_size(s, &writeback_size) < 0)
+		return -1;
+	if (!writeback_size) {
+		sd_err("invalid write-back size: %s", s);
+		return -1;
+	}
+	return 0;
+}
+
+static struct option_parser writeback_parsers[] = {
+	{ "window=", writeback_window_parser },
+	{ "size=", writeback_size_parser },
+	{ NULL, NULL },
+};
+
+static struct node_id observe_seed = { .port = SD_LISTEN_PORT };
+static uint32_t observe_interval = 1000;
+
+static int observe_addr_parser(const char *s)
+{
+	if (!str_to_addr(s, observe_seed.addr)) {
+		sd_err("invalid address: %s", s);
+		return -1;
+	}
+	return 0;
+}
+
+static int observe_port_parser(const char *s)
+{
+	char *p;
+	long port = strtol(s, &p, 10);
+
+	if (s == p || *p || port <= 0 || port > UINT16_MAX) {
+		sd_err("invalid port: %s", s);
+		return -1;
+	}
+	observe_seed.port = port;
+	return 0;
+}
+
+static int observe_interval_parser(const char *s)
+{
+	char *p;
+	long interval = strtol(s, &p, 10);
+
+	if (s == p || *p || interval <= 0 || interval > 3600000) {
+		sd_err("invalid observe interval: %s", s);
+		return -1;
+	}
+	observe_interval = interval;
+	return 0;
+}
+
+static struct option_parser observe_parsers[] = {
+	{ "addr=", observe_addr_parser },
+	{ "port=", observe_port_parser },
+	{ "interval=", observe_interval_parser },
+	{ NULL, NULL },
+};
+
+static uint64_t hugepages_size;
+static bool hugepages_prefault;
+
+static int hugepages_size_parser(const char *s)
+{
+	if (option_parse_size(s, &hugepages_size) < 0)
+		return -1;
+	if (!hugepages_size) {
+		sd_err("invalid huge page arena size: %s", s);
+		return -1;
+	}
+	return 0;
+}
+
+static int hugepages_prefault_parser(const char *s)
+{
+	hugepages_prefault = !!atoi(s);
+	return 0;
+}
+
+static struct option_parser hugepages_parsers[] = {
+	{ "size=", hugepages_size_parser },
+	{ "prefault=", hugepages_prefault_parser },
+	{ NULL, NULL },
+};
+
+static uint32_t dedup_interval;
+
+static int dedup_interval_parser(const char *s)
+{
+	char *p;
+	long interval = strtol(s, &p, 10);
+
+	if (s == p || *p || interval <= 0 || interval > UINT32_MAX / 1000) {
+		sd_err("invalid deduplication interval: %s", s);
+		return -1;
+	}
+	dedup_interval = interval;
+	return 0;
+}
+
+static struct option_parser dedup_parsers[] = {
+	{ "interval=", dedup_interval_parser },
 	{ NULL, NULL },
 };
 
@@ -535,6 +1175,9 @@ static int create_work_queues(void)
 {
 	struct work_queue *util_wq;
 
+	if (wq_steal)
+		set_work_stealing(wq_steal_threads);
+
 	if (init_work_queue(get_nr_nodes))
 		return -1;
 
@@ -604,6 +1247,7 @@ static int create_work_queues(void)
 	sys->deletion_wqueue = create_ordered_work_queue("deletion");
 	sys->block_wqueue = create_ordered_work_queue("block");
 	sys->md_wqueue = create_ordered_work_queue("md");
+	sys->hydrate_wqueue = create_ordered_work_queue("hydrate");
 	if (wq_async_threads) {
 		sd_info("# of threads in async_req workqueue: %d", wq_async_threads);
 		sys->areq_wqueue = create_fixed_work_queue("async_req", wq_async_threads);
@@ -614,9 +1258,41 @@ static int create_work_queues(void)
 	if (!sys->gateway_wqueue || !sys->io_wqueue || !sys->recovery_wqueue ||
 	    !sys->deletion_wqueue || !sys->block_wqueue || !sys->md_wqueue ||
 	    !sys->areq_wqueue || !sys->peer_wqueue || !sys->reclaim_wqueue ||
-	    !sys->gateway_fwd_wqueue)
+	    !sys->gateway_fwd_wqueue || !sys->hydrate_wqueue)
 			return -1;
 
+	/* these wait for the peer I/O, keep them out of the work pool */
+	set_work_queue_blocking(sys->gateway_wqueue);
+	set_work_queue_blocking(sys->gateway_fwd_wqueue);
+	set_work_queue_blocking(sys->io_wqueue);
+	set_work_queue_blocking(sys->recovery_wqueue);
+	set_work_queue_blocking(sys->areq_wqueue);
+	if (sys->remove_wqueue)
+		set_work_queue_blocking(sys->remove_wqueue);
+
+	/* the background works yield to the I/O in the work-stealing pool */
+	set_work_queue_priority(sys->gateway_wqueue, WQ_PRIO_HIGH);
+	set_work_queue_priority(sys->gateway_fwd_wqueue, WQ_PRIO_HIGH);
+	set_work_queue_priority(sys->io_wqueue, WQ_PRIO_HIGH);
+	set_work_queue_priority(sys->peer_wqueue, WQ_PRIO_HIGH);
+	set_work_queue_priority(sys->recovery_wqueue, WQ_PRIO_LOW);
+	set_work_queue_priority(sys->reclaim_wqueue, WQ_PRIO_LOW);
+	set_work_queue_priority(sys->hydrate_wqueue, WQ_PRIO_LOW);
+	if (sys->remove_wqueue)
+		set_work_queue_priority(sys->remove_wqueue, WQ_PRIO_LOW);
+	if (sys->remove_peer_wqueue)
+		set_work_queue_priority(sys->remove_peer_wqueue, WQ_PRIO_LOW);
+
+	/* and share the disks by their I/O classes, see md_io_begin() */
+	set_work_queue_io_class(sys->recovery_wqueue, IO_CLASS_RECOVERY);
+	set_work_queue_io_class(sys->deletion_wqueue, IO_CLASS_DELETION);
+	if (sys->remove_peer_wqueue)
+		set_work_queue_io_class(sys->remove_peer_wqueue,
+					IO_CLASS_DELETION);
+	set_work_queue_io_class(sys->reclaim_wqueue, IO_CLASS_BACKGROUND);
+	set_work_queue_io_class(sys->hydrate_wqueue, IO_CLASS_BACKGROUND);
+	set_work_queue_io_class(sys->md_wqueue, IO_CLASS_BACKGROUND);
+
 	util_wq = create_ordered_work_queue("util");
 	if (!util_wq)
 		return -1;
@@ -796,6 +1472,10 @@ static void show_features(int feat) /* feat: 0; show cdrv only */
 		fprintf(stdout, " nfs");
 		have_feats = 1;
 #endif
+#ifdef HAVE_VHOST
+		fprintf(stdout, " vhost");
+		have_feats = 1;
+#endif
 #ifdef HAVE_DISKVNODES
 		fprintf(stdout, " diskvnodes");
 		have_feats = 1;
@@ -827,13 +1507,15 @@ int main(int argc, char **argv)
 	     *argp = NULL;
 	bool explicit_addr = false;
 	bool daemonize = true;
+	bool takeover = false;
 	int32_t nr_vnodes = -1;
 	int64_t zone = -1;
-	uint32_t max_dynamic_threads = 0;
+	uint32_t max_dynamic_threads = 0, busy_poll;
 	struct option *long_options;
 #ifdef HAVE_HTTP
 	const char *http_options = NULL;
 #endif
+	char *metrics_options = NULL;
 	static struct logger_user_info sheep_info;
 	struct stat logdir_st;
 	enum log_dst_type log_dst_type;
@@ -874,9 +1556,28 @@ int main(int argc, char **argv)
 			if (option_parse(optarg, ",", log_parsers) < 0)
 				exit(1);
 			break;
+		case 'm':
+			metrics_options = optarg;
+			break;
+		case 'G':
+			hugepages_size = 1024 * 1024 * 1024;
+			if (option_parse(optarg, ",", hugepages_parsers) < 0)
+				exit(1);
+			break;
 		case 'n':
 			sys->nosync = true;
 			break;
+		case 'N':
+			sys->writeback_window = 50;
+			writeback_size = 64 * 1024 * 1024;
+			if (option_parse(optarg, ",", writeback_parsers) < 0)
+				exit(1);
+			break;
+		case 'o':
+			sys->observer = true;
+			if (option_parse(optarg, ",", observe_parsers) < 0)
+				exit(1);
+			break;
 		case 'y':
 			if (!str_to_addr(optarg, sys->this_node.nid.addr)) {
 				sd_err("Invalid address: '%s'", optarg);
@@ -884,6 +1585,9 @@ int main(int argc, char **argv)
 			}
 			explicit_addr = true;
 			break;
+		case 'B':
+			sys->blockdev = optarg;
+			break;
 		case 'D':
 			sys->backend_dio = true;
 			break;
@@ -907,6 +1611,11 @@ int main(int argc, char **argv)
 			}
 			sys->this_node.zone = zone;
 			break;
+#ifdef HAVE_ZSTD
+		case 'Z':
+			sys->wire_compress = true;
+			break;
+#endif
 		case 'u':
 			sys->upgrade = true;
 			break;
@@ -958,6 +1667,10 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'C':
+			if (option_parse(optarg, ",", cache_parsers) < 0)
+				exit(1);
+			break;
 		case 'b':
 			if (!inetaddr_is_valid(optarg))
 				exit(1);
@@ -966,6 +1679,35 @@ int main(int argc, char **argv)
 		case 'h':
 			usage(0);
 			break;
+		case 'M':
+			md_weight_interval = 60;
+			if (option_parse(optarg, ",", md_weight_parsers) < 0)
+				exit(1);
+			break;
+		case 'd':
+			dedup_interval = 3600;
+			if (option_parse(optarg, ",", dedup_parsers) < 0)
+				exit(1);
+			break;
+		case 's':
+			scrub_bandwidth = 4 * 1024 * 1024;
+			scrub_interval = 86400;
+			if (option_parse(optarg, ",", scrub_parsers) < 0)
+				exit(1);
+			break;
+		case 'S':
+			precopy_bandwidth = 20 * 1024 * 1024;
+			if (option_parse(optarg, ",", precopy_parsers) < 0)
+				exit(1);
+			break;
+		case 'a':
+			if (option_parse(optarg, ",", readahead_parsers) < 0)
+				exit(1);
+			break;
+		case 'A':
+			if (option_parse(optarg, ",", admission_parsers) < 0)
+				exit(1);
+			break;
 		case 'R':
 			if (option_parse(optarg, ",", recovery_parsers) < 0)
 				exit(1);
@@ -998,6 +1740,25 @@ int main(int argc, char **argv)
 		case 'W':
 			wildcard_recovery = true;
 			break;
+		case 'T':
+#ifdef HAVE_ACCELIO
+			sd_err("taking over is not supported with accelio");
+			exit(1);
+#endif
+			takeover = true;
+			break;
+		case 'H':
+			sys->hedged_read = true;
+			break;
+		case 'L':
+			busy_poll = str_to_u32(optarg);
+			if (errno != 0 || busy_poll < 1 || busy_poll > 10000) {
+				sd_err("Invalid busy poll window '%s': must be "
+				       "an integer between 1 and 10000", optarg);
+				exit(1);
+			}
+			set_busy_poll(busy_poll);
+			break;
 		case 'w':
 			if (option_parse(optarg, ",", wq_parsers) < 0)
 				exit(1);
@@ -1025,6 +1786,25 @@ int main(int argc, char **argv)
 	sheep_info.port = port;
 	early_log_init(log_format, &sheep_info);
 
+	if (sys->observer) {
+		if (nr_vnodes > 0) {
+			sd_err("Options '-o' and '-V' can not be both specified");
+			exit(1);
+		}
+#ifdef HAVE_HTTP
+		if (http_options) {
+			sd_err("Options '-o' and '-r' can not be both specified");
+			exit(1);
+		}
+#endif
+		if (!memcmp(observe_seed.addr, (uint8_t [16]){},
+			    sizeof(observe_seed.addr))) {
+			sd_err("the address of the sheep to observe is missing");
+			exit(1);
+		}
+		nr_vnodes = 0;
+	}
+
 	if (nr_vnodes == 0) {
 		sys->gateway_only = true;
 		sys->disk_space = 0;
@@ -1093,6 +1873,9 @@ int main(int argc, char **argv)
 	if (daemonize && log_dst_type == LOG_DST_STDOUT)
 		daemonize = false;
 
+	if (takeover && handover_receive(dir) < 0)
+		exit(1);
+
 	if (lock_and_daemon(daemonize, dir)) {
 		free(argp);
 		goto cleanup_dir;
@@ -1109,6 +1892,15 @@ int main(int argc, char **argv)
 		goto cleanup_dir;
 	}
 
+	if (hugepages_size) {
+		ret = mempool_init_hugepages(hugepages_size,
+					     hugepages_prefault);
+		if (ret) {
+			free(argp);
+			goto cleanup_log;
+		}
+	}
+
 	ret = init_global_pathnames(dir, argp);
 	free(argp);
 	if (ret)
@@ -1126,12 +1918,15 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_log;
 
-	ret = create_listen_port(bindaddr, port);
+	if (takeover)
+		ret = handover_adopt_listeners();
+	else
+		ret = create_listen_port(bindaddr, port);
 	if (ret)
 		goto cleanup_log;
 
 #ifndef HAVE_ACCELIO
-	if (io_addr && create_listen_port(io_addr, io_port))
+	if (!takeover && io_addr && create_listen_port(io_addr, io_port))
 		goto cleanup_log;
 #else
 	if (io_addr) {
@@ -1152,7 +1947,13 @@ int main(int argc, char **argv)
 	}
 #endif
 
-	ret = init_unix_domain_socket(dir);
+	if (!takeover) {
+		ret = init_unix_domain_socket(dir);
+		if (ret)
+			goto cleanup_log;
+	}
+
+	ret = handover_init(dir);
 	if (ret)
 		goto cleanup_log;
 
@@ -1167,7 +1968,11 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_log;
 
-	ret = create_cluster(port, zone, nr_vnodes, explicit_addr);
+	if (sys->observer)
+		ret = observe_cluster(&observe_seed, observe_interval, port,
+				      explicit_addr);
+	else
+		ret = create_cluster(port, zone, nr_vnodes, explicit_addr);
 	if (ret) {
 		sd_err("failed to create sheepdog cluster");
 		goto cleanup_log;
@@ -1189,14 +1994,29 @@ int main(int argc, char **argv)
 		if (!strlen(jpath))
 			/* internal journal */
 			memcpy(jpath, dir, strlen(dir));
-		sd_debug("%s, %"PRIu64", %d", jpath, jsize, jskip);
-		ret = journal_file_init(jpath, jsize, jskip);
+		sd_debug("%s, %"PRIu64", %d, %d", jpath, jsize, jskip, jgroup);
+		ret = journal_file_init(jpath, jsize, jskip, jgroup);
 		if (ret)
 			goto cleanup_cluster;
 	}
 
 	init_fec();
 
+	/*
+	 * The threads inherit the affinity of the main thread, so bind it to
+	 * the node of the NIC before creating any, to keep the network I/O
+	 * and the buffers of the requests on one node.  The peer queues of
+	 * the disks are rebound to the node of their disk by md.
+	 */
+	if (wq_numa && numa_nodes() > 1) {
+		const uint8_t *addr = sys->this_node.nid.io_port ?
+			sys->this_node.nid.io_addr : sys->this_node.nid.addr;
+		int node = numa_node_of_addr(addr);
+
+		if (node >= 0 && numa_bind_thread(node) == 0)
+			sd_info("bound to the numa node %d of the nic", node);
+	}
+
 	/*
 	 * After this function, we are multi-threaded.
 	 *
@@ -1208,18 +2028,84 @@ int main(int argc, char **argv)
 	if (ret)
 		goto cleanup_journal;
 
+	if (wq_reactor_threads > 0) {
+		ret = init_reactors(wq_reactor_threads);
+		if (ret)
+			goto cleanup_journal;
+	}
+	if (takeover)
+		handover_adopt_clients();
+
 	ret = sockfd_init();
 	if (ret)
 		goto cleanup_journal;
 
+	ret = gateway_forward_init();
+	if (ret)
+		goto cleanup_journal;
+
+	ret = qos_init();
+	if (ret)
+		goto cleanup_journal;
+
+	if (readahead_window) {
+		ret = readahead_init(readahead_window, readahead_size);
+		if (ret)
+			goto cleanup_journal;
+	}
+
 	ret = init_store_driver(sys->gateway_only);
 	if (ret)
 		goto cleanup_journal;
 
+	if (precopy_bandwidth) {
+		ret = precopy_init(precopy_bandwidth, precopy_max_objects);
+		if (ret)
+			goto cleanup_journal;
+	}
+
+	if (sys->writeback_window) {
+		ret = writeback_init(writeback_size);
+		if (ret)
+			goto cleanup_journal;
+	}
+
+	if (dedup_interval && !sys->gateway_only) {
+		ret = dedup_init(dedup_interval);
+		if (ret)
+			goto cleanup_journal;
+	}
+
+	if (scrub_bandwidth && !sys->gateway_only) {
+		ret = scrub_init(scrub_bandwidth, scrub_interval);
+		if (ret)
+			goto cleanup_journal;
+	}
+
+	if (md_weight_interval && !sys->gateway_only)
+		md_start_perf_weight(md_weight_interval, md_min_weight);
+	if (!sys->gateway_only) {
+		md_start_tiering();
+		heat_init();
+	}
+
+	if (cache_size) {
+		if (!strlen(cache_path))
+			snprintf(cache_path, sizeof(cache_path), "%s/cache",
+				 dir);
+		ret = object_cache_init(cache_path, cache_size,
+					cache_writethrough);
+		if (ret)
+			goto cleanup_journal;
+	}
+
 	ret = trace_init();
 	if (ret)
 		goto cleanup_journal;
 
+	if (metrics_options && metrics_init(metrics_options) != 0)
+		goto cleanup_journal;
+
 	#ifdef HAVE_HTTP
 	if (http_options && http_init(http_options) != 0)
 		goto cleanup_journal;
@@ -1231,6 +2117,12 @@ int main(int argc, char **argv)
 		goto cleanup_journal;
 	#endif
 
+	#ifdef HAVE_VHOST
+	ret = vhost_init(dir);
+	if (ret)
+		goto cleanup_journal;
+	#endif
+
 	if (pid_file && (create_pidfile(pid_file) != 0)) {
 		sd_err("failed to pid file '%s' - %m", pid_file);
 		goto cleanup_journal;
@@ -1251,6 +2143,7 @@ int main(int argc, char **argv)
 
 	rc = 0;
 	sd_info("shutdown");
+	save_startup_state();
 
 cleanup_pid_file:
 	if (pid_file)
@@ -44,6 +44,8 @@
 #include "sockfd_cache.h"
 #include "fec.h"
 #include "common.h"
+#include "mempool.h"
+#include "shm_ring.h"
 
  /*
   * Functions that update global info must be called in the main
@@ -69,6 +71,10 @@ enum client_info_type {
 #ifdef HAVE_ACCELIO
 	CLIENT_INFO_TYPE_XIO,
 #endif
+#ifdef HAVE_VHOST
+	CLIENT_INFO_TYPE_VHOST,
+#endif
+	CLIENT_INFO_TYPE_SHM,
 };
 
 struct client_info {
@@ -79,13 +85,37 @@ struct client_info {
 	struct request *rx_req;
 	struct work rx_work;
 
-	struct request *tx_req;
+	/* the responses being sent by tx_work in one go */
+	struct list_head tx_reqs;
 	struct work tx_work;
 
 	struct list_head done_reqs;
 
 	refcnt_t refcnt;
 
+	/* the reactor polling the connection, NULL for the main event loop */
+	struct reactor *reactor;
+	/* protects conn.events of the connection polled by a reactor */
+	struct sd_mutex lock;
+	struct list_node dead_list;
+
+	/* the gateway requests read from the connection and not freed yet */
+	uint32_t nr_outstanding;
+	uint64_t outstanding_bytes;
+	/* the receiving is paused by the admission control */
+	bool rx_paused;
+	struct list_node paused_list;
+
+	/* the fds passed with the last header, for SD_OP_SHM_ATTACH */
+	int rx_fds[SD_SHM_NR_FDS];
+	int nr_rx_fds;
+	/* the shared memory ring attached to the connection */
+	struct shm_ring *shm;
+
+	struct list_node client_list;
+	/* the receiving is held by freeze_clients() */
+	bool rx_held;
+
 #ifdef HAVE_ACCELIO
 	struct xio_msg *xio_req;
 #endif
@@ -100,7 +130,10 @@ enum REQUST_STATUS {
 
 enum store_id {
 	PLAIN_STORE,
-	TREE_STORE
+	TREE_STORE,
+	LOG_STORE,
+	RAW_STORE,
+	URING_STORE
 };
 
 struct request_iocb {
@@ -109,6 +142,19 @@ struct request_iocb {
 	int result;
 };
 
+/* The stages of a request, logged if it takes over sys->slow_request_ms */
+enum request_stage {
+	REQ_STAGE_RX,		/* rx_work began to receive it */
+	REQ_STAGE_QUEUE,	/* queue_request() dispatched it */
+	REQ_STAGE_WORK,		/* a worker began to process it */
+	REQ_STAGE_FORWARD,	/* the gateway began to forward it */
+	REQ_STAGE_REPLY,	/* all the replicas replied to the gateway */
+	REQ_STAGE_WORK_END,	/* the worker finished */
+	REQ_STAGE_DONE,		/* put_request() released it */
+	REQ_STAGE_TX,		/* tx_work sent the response */
+	NR_REQ_STAGES,
+};
+
 struct request {
 	struct sd_req rq;
 	struct sd_rsp rp;
@@ -125,6 +171,8 @@ struct request {
 	refcnt_t refcnt;
 	bool local;
 	int local_req_efd;
+	bool qos_admitted; /* released by qos_throttle() */
+	bool rx_charged; /* counted by the admission control */
 
 	uint64_t local_oid;
 
@@ -133,6 +181,42 @@ struct request {
 	struct work work;
 	enum REQUST_STATUS status;
 	bool stat; /* true if this request is during stat */
+	uint64_t stat_time; /* when the stat began, for the gateway latency */
+
+	/* non-NULL while the replicas are being waited asynchronously */
+	struct fwd_async *fwd_async;
+
+	/* a copy of the vector of SD_OP_READ_OBJS and SD_OP_READ_PEERS */
+	struct sd_obj_vec *vec;
+
+	uint64_t stage_time[NR_REQ_STAGES]; /* nsec, zero if not reached */
+
+#ifdef HAVE_VHOST
+	struct vhost_io *vhost_io;
+#endif
+};
+
+static inline void request_stage(struct request *req,
+				 enum request_stage stage)
+{
+	req->stage_time[stage] = clock_get_time();
+}
+
+/* the limits of parallel object recovery, 0 means the default */
+struct recovery_window {
+	uint32_t max_inflight;	/* objects being recovered at once */
+	uint32_t max_per_node;	/* of them read from the same node */
+	uint32_t max_per_disk;	/* of them stored in the same local disk */
+};
+
+#define NR_REQ_WAIT_HASH 1024
+
+/* The limits of the outstanding gateway requests, zero is unlimited */
+struct admission_limits {
+	uint32_t reqs;
+	uint64_t bytes;
+	uint32_t client_reqs;
+	uint64_t client_bytes;
 };
 
 struct system_info {
@@ -154,13 +238,30 @@ struct system_info {
 
 	struct sd_mutex local_req_lock;
 	struct list_head local_req_queue;
+	/* the requests waiting for the epoch to change */
 	struct list_head req_wait_queue;
+	/* the requests waiting for their local_oid, hashed by it */
+	struct list_head req_oid_wait_queue[NR_REQ_WAIT_HASH];
 	int nr_outstanding_reqs;
+	struct admission_limits admission;
+	uint32_t slow_request_ms; /* zero disables the slow request log */
 
 	bool gateway_only;
+	/* a gateway following the cluster without joining it, see group.c */
+	bool observer;
+	/* send the slow replica reads to another replica as well */
+	bool hedged_read;
+	/* compress the object data sent between the zones */
+	bool wire_compress;
 	bool nosync;
+	/* msec to make the writes durable within, see writeback.c */
+	uint32_t writeback_window;
+	bool enable_object_cache;
 
 	struct recovery_throttling rthrottling;
+	struct recovery_window rwindow;
+	/* stale objects removed per second after the recovery */
+	uint32_t purge_rate;
 
 	struct work_queue *net_wqueue;
 	struct work_queue *gateway_wqueue;
@@ -176,35 +277,71 @@ struct system_info {
 	struct work_queue *block_wqueue;
 	struct work_queue *md_wqueue;
 	struct work_queue *areq_wqueue;
+	struct work_queue *hydrate_wqueue;
 #ifdef HAVE_HTTP
 	struct work_queue *http_wqueue;
 #endif
 
 	uatomic_bool use_journal;
 	bool backend_dio;
+	/* the block device of the raw store */
+	const char *blockdev;
 	/* upgrade data layout before starting service if necessary*/
 	bool upgrade;
 	struct sd_stat stat;
 };
 
+/*
+ * The classes of the disk I/O, the foreground first.  The work queues are
+ * tagged with them by set_work_queue_io_class(), see md_io_begin().
+ */
+enum io_class {
+	IO_CLASS_FOREGROUND,	/* the client I/O */
+	IO_CLASS_RECOVERY,
+	IO_CLASS_DELETION,
+	IO_CLASS_BACKGROUND,	/* scrubbing, dedup, compaction and the like */
+	NR_IO_CLASSES,
+};
+
+struct io_arbiter;
+
 struct disk {
 	struct rb_node rb;
 	char path[PATH_MAX];
 	uint64_t space;
+	int nr_vdisks;
+	uint32_t weight;	/* percentage of the space backed by vdisks */
+	bool hot;		/* a disk of the hot tier, e.g. an SSD */
+	struct rb_root *vroot;	/* the ring holding the vdisks */
+
+	/* I/O stats since the last update of the weights */
+	uint64_t nr_ios;
+	uint64_t io_bytes;
+	uint64_t io_time;	/* nsec */
+
+	/* rolling averages of the stats above */
+	uint64_t avg_latency;	/* nsec per I/O */
+	uint64_t avg_throughput;	/* bytes per second of I/O time */
+
+	struct io_arbiter *arb;	/* shares the queue depth among the classes */
 };
 
 struct vdisk {
 	struct rb_node rb;
-	const struct disk *disk;
+	struct disk *disk;
 	uint64_t hash;
 };
 
 struct md {
 	struct rb_root vroot;
+	struct rb_root hot_vroot;
 	struct rb_root root;
 	struct sd_rw_lock lock;
 	uint64_t space;
 	uint32_t nr_disks;
+	uint32_t nr_hot_disks;
+	unsigned int perf_interval;	/* sec, zero disables the weights */
+	uint32_t min_weight;
 };
 
 extern struct md md;
@@ -219,6 +356,41 @@ struct siocb {
 	uint8_t ec_index;
 	uint8_t copy_policy;
 	uint8_t wildcard;
+	/* create_and_write: the extent map of a sparse copy, see cow.c */
+	const struct cow_map *cow;
+	/*
+	 * read: the data extents of the range are recorded here if the store
+	 * knows them, its length is left zero otherwise
+	 */
+	struct sd_extents *extents;
+};
+
+/*
+ * The extents of the parent object which a sparse copy-on-write object
+ * holds, kept in the COWNAME xattr of the object file
+ */
+#define SD_COW_NR_EXTENTS 1024
+#define COWNAME "user.obj.cow"
+
+struct cow_map {
+	uint64_t parent_oid;
+	/* our reference to the parent object */
+	struct generation_reference ref;
+	DECLARE_BITMAP(bitmap, SD_COW_NR_EXTENTS);
+};
+
+/*
+ * The chunks of a compressed object, kept in the COMPRESSNAME xattr of the
+ * object file.  The chunk i is stored at i * chunk_size of the file, and len[i]
+ * is 0 if the chunk is a hole, chunk_size if it is stored as-is, and the
+ * length of its compressed frame otherwise.
+ */
+#define SD_COMPRESS_NR_CHUNKS 64
+#define COMPRESSNAME "user.obj.compress"
+
+struct compress_index {
+	uint32_t chunk_size;
+	uint32_t len[SD_COMPRESS_NR_CHUNKS];
 };
 
 /* This structure is used to pass parameters to vdi_* functions. */
@@ -234,6 +406,7 @@ struct vdi_iocb {
 	uint8_t store_policy;
 	uint8_t nr_copies;
 	uint8_t block_size_shift;
+	uint32_t flags;
 	uint64_t time;
 };
 
@@ -258,6 +431,10 @@ struct store_driver {
 	int (*format)(void);
 	int (*remove_object)(uint64_t oid, uint8_t ec_index);
 	int (*get_hash)(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+	/* SD_HASH_BLOCK_SIZE digests of the whole object, optional */
+	int (*get_block_hash)(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+	/* CRC32C of the whole object for the cheap checks, optional */
+	int (*get_crc32c)(uint64_t oid, uint32_t epoch, uint32_t *crc);
 	/* Operations in recovery */
 	int (*link)(uint64_t oid, uint32_t tgt_epoch);
 	int (*update_epoch)(uint32_t epoch);
@@ -266,6 +443,25 @@ struct store_driver {
 	int (*cleanup)(void);
 };
 
+/* cached fd of an object file, see store/fd_cache.c */
+struct object_fd {
+	uint64_t oid;
+	uint8_t ec_index;
+	int fd;
+	int flags;
+	char path[PATH_MAX];
+	int refcnt;
+	bool dead;
+	struct rb_node node;
+	struct list_node lru;
+};
+
+struct object_fd *object_fd_get(uint64_t oid, uint8_t ec_index,
+				const char *path, int flags, int *err);
+void object_fd_put(struct object_fd *ofd);
+void object_fd_invalidate(uint64_t oid, uint8_t ec_index);
+void object_fd_invalidate_dir(const char *dir);
+
 /* backend store */
 int peer_read_obj(struct request *req);
 int peer_decref_object(struct request *req);
@@ -281,6 +477,8 @@ int default_cleanup(void);
 int default_format(void);
 int default_remove_object(uint64_t oid, uint8_t ec_index);
 int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int default_get_block_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int default_get_crc32c(uint64_t oid, uint32_t epoch, uint32_t *crc);
 int default_purge_obj(void);
 
 int tree_init(void);
@@ -294,11 +492,16 @@ int tree_cleanup(void);
 int tree_format(void);
 int tree_remove_object(uint64_t oid, uint8_t ec_index);
 int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
+int tree_get_block_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1);
 int tree_purge_obj(void);
 
 int for_each_object_in_wd(int (*func)(uint64_t, const char *, uint32_t,
 				      uint8_t, struct vnode_info *, void *),
 			  bool, void *);
+int move_stale_objects_in_wd(bool (*stale)(uint64_t, uint8_t,
+					   struct vnode_info *),
+			     int (*move)(uint64_t, uint8_t, uint32_t),
+			     uint32_t tgt_epoch);
 int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 					 uint32_t epoch, uint8_t,
 					 struct vnode_info *, void *arg),
@@ -306,6 +509,11 @@ int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
 int for_each_obj_path(int (*func)(const char *path));
 size_t get_store_objsize(uint64_t oid);
 
+/* startup.c */
+int init_startup_state_path(const char *base_path);
+void save_startup_state(void);
+bool load_startup_state(void);
+
 extern struct list_head store_drivers;
 #define add_store_driver(driver)				\
 static void __attribute__((constructor)) add_ ## driver(void)	\
@@ -328,6 +536,9 @@ extern struct system_info *sys;
 extern struct store_driver *sd_store;
 extern char *obj_path;
 extern char *epoch_path;
+extern char *deletion_path;
+extern char *convert_path;
+extern char *oalloc_path;
 
 /* One should call this function to get sys->epoch outside main thread */
 static inline uint32_t sys_epoch(void)
@@ -341,12 +552,25 @@ static inline bool is_aligned_to_pagesize(void *p)
 }
 
 int create_listen_port(const char *bindaddr, int port);
+int init_reactors(int nr);
 #ifdef HAVE_ACCELIO
 int xio_create_listen_port(const char *bindaddr, int port, bool rdma);
 #endif
 int init_unix_domain_socket(const char *dir);
 void unregister_listening_fds(void);
 
+struct handover_fd {
+	int fd;
+	bool listen;
+	bool is_inet_socket;
+};
+
+void freeze_clients(void);
+void thaw_clients(void);
+bool clients_drained(void);
+int get_handover_fds(struct handover_fd *fds, int max);
+int adopt_handover_fd(const struct handover_fd *fd);
+
 int init_store_driver(bool is_gateway);
 int init_global_pathnames(const char *d, char *);
 int init_base_path(const char *dir);
@@ -360,18 +584,29 @@ int get_vdi_copy_number(uint32_t vid);
 int get_vdi_copy_policy(uint32_t vid);
 uint32_t get_vdi_object_size(uint32_t vid);
 uint8_t get_vdi_block_size_shift(uint32_t vid);
+uint8_t get_vdi_flags(uint32_t vid);
+int get_vdi_write_quorum(uint32_t vid);
+bool vdi_is_compressed(uint32_t vid);
+uint32_t get_vdi_parent(uint32_t vid);
 int get_obj_copy_number(uint64_t oid, int nr_zones);
 int get_req_copy_number(struct request *req);
 int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
-		  uint8_t, uint8_t block_size_shift, uint32_t parent_vid);
+		  uint8_t, uint8_t block_size_shift, uint32_t parent_vid,
+		  uint8_t flags);
 int add_vdi_state_unordered(uint32_t vid, int nr_copies, bool snapshot,
-		  uint8_t, uint8_t block_size_shift, uint32_t parent_vid);
+		  uint8_t, uint8_t block_size_shift, uint32_t parent_vid,
+		  uint8_t flags);
 int vdi_exist(uint32_t vid);
 int vdi_create(const struct vdi_iocb *iocb, uint32_t *new_vid);
 int vdi_snapshot(const struct vdi_iocb *iocb, uint32_t *new_vid);
 int vdi_delete(const struct vdi_iocb *iocb, struct request *req);
 void vdi_mark_deleted(uint32_t vid);
+int vdi_hydrate(uint32_t vid);
+int vdi_convert(uint32_t vid, uint32_t rate);
+main_fn void vdi_convert_resume(void);
 int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info);
+void vdi_lookup_cache_drop(const char *name);
+void vdi_lookup_cache_clear(void);
 void clean_vdi_state(void);
 int sd_delete_vdi(const char *name);
 int sd_lookup_vdi(const char *name, uint32_t *vid);
@@ -380,6 +615,12 @@ int sd_create_hyper_volume(const char *name, uint32_t *vdi_id);
 bool vdi_lock(uint32_t vid, const struct node_id *owner, int type);
 bool vdi_unlock(uint32_t vid, const struct node_id *owner, int type);
 void apply_vdi_lock_state(struct vdi_state *vs);
+int get_vdi_state_delta(const struct sd_req *hdr, struct sd_rsp *rsp,
+			void *data);
+bool get_vdi_state_compact(uint32_t vid, struct vdi_state_compact *vs);
+int get_inode_summaries(const struct sd_req *hdr, struct sd_rsp *rsp,
+			void *data);
+uint64_t get_vdi_state_generation(void);
 void create_vdi_state_checkpoint(int epoch);
 int get_vdi_state_checkpoint(int epoch, uint32_t vid, void *data);
 void free_vdi_state_checkpoint(int epoch);
@@ -408,8 +649,16 @@ int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
 
 struct vnode_info *grab_vnode_info(struct vnode_info *vnode_info);
 struct vnode_info *get_vnode_info(void);
+void set_vnode_info(struct vnode_info *vinfo);
 void put_vnode_info(struct vnode_info *vinfo);
+struct vnode_info *get_req_vnode_info(void);
+void put_req_vnode_info(struct vnode_info *vinfo);
 struct vnode_info *alloc_vnode_info(const struct rb_root *);
+struct vnode_info *alloc_vnode_info_from(const struct vnode_info *base,
+					 const struct rb_root *);
+struct vnode_info *share_vnode_info_from(struct vnode_info *base,
+					 const struct rb_root *nroot,
+					 int nr_nodes);
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch,
 					struct vnode_info *cur_vinfo);
 int get_nodes_epoch(uint32_t epoch, struct vnode_info *cur_vinfo,
@@ -427,15 +676,28 @@ void resume_suspended_recovery(void);
 int create_cluster(int port, int64_t zone, int nr_vnodes,
 		   bool explicit_addr);
 int leave_cluster(void);
+int observe_cluster(const struct node_id *seed, uint32_t interval, int port,
+		    bool explicit_addr);
+void observe_kick(void);
+void observe_forward(struct request *req);
 
 void queue_cluster_request(struct request *req);
 
 int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create);
+ssize_t store_pread(uint64_t oid, int fd, void *buf, size_t len, off_t off);
+ssize_t store_pwrite(uint64_t oid, int fd, const void *buf, size_t len,
+		     off_t off);
 int err_to_sderr(const char *path, uint64_t oid, int err);
+int open_object_file(const char *path, const char *tmp_path, int flags,
+		     bool *anon);
+int install_object_file(int fd, bool anon, const char *path,
+			const char *tmp_path);
 int discard(int fd, uint64_t start, uint32_t end);
 bool store_id_match(enum store_id id);
+void purge_stale_objects(const char *stale_dir);
 
 int update_epoch_log(uint32_t epoch, struct sd_node *nodes, size_t nr_nodes);
+int remove_epoch_log(uint32_t epoch);
 int inc_and_log_epoch(void);
 
 extern char *config_path;
@@ -460,7 +722,9 @@ uint32_t get_latest_epoch(void);
 void init_config_path(const char *base_path);
 int init_node_config_file(void);
 int init_config_file(void);
+size_t objlist_cache_nr(void);
 int get_obj_list(const struct sd_req *, struct sd_rsp *, void *);
+int get_obj_list_delta(const struct sd_req *, struct sd_rsp *, void *);
 int objlist_cache_cleanup(uint32_t vid);
 void objlist_cache_format(void);
 
@@ -482,7 +746,7 @@ int sd_read_object_fwd(uint64_t oid, char *data, unsigned int datalen,
 		   uint64_t offset);
 int sd_remove_object(uint64_t oid);
 int sd_dec_object_refcnt(uint64_t data_oid, uint32_t generation,
-			 uint32_t refcnt);
+			 uint32_t refcnt, uint32_t nr);
 
 struct request_iocb *local_req_init(void);
 int exec_local_req(struct sd_req *rq, void *data);
@@ -497,6 +761,9 @@ void objlist_cache_remove(uint64_t oid);
 void put_request(struct request *req);
 void get_request(struct request *req);
 void requeue_request(struct request *req);
+int latency_stat(struct sd_latency_stat *stat, int max);
+int vdi_io_stat(struct sd_vdi_io_stat *stat, int max);
+void vdi_io_stat_drop(uint32_t vid);
 
 int sheep_bnode_writer(uint64_t oid, void *mem, unsigned int len,
 		       uint64_t offset, uint32_t flags, int copies,
@@ -515,8 +782,10 @@ bool is_gateway_op(const struct sd_op_template *op);
 bool is_force_op(const struct sd_op_template *op);
 bool is_logging_op(const struct sd_op_template *op);
 bool has_process_work(const struct sd_op_template *op);
+bool has_process_prepare(const struct sd_op_template *op);
 bool has_process_main(const struct sd_op_template *op);
 void do_process_work(struct work *work);
+void do_process_prepare(struct work *work);
 int do_process_main(const struct sd_op_template *op, const struct sd_req *req,
 		    struct sd_rsp *rsp, void *data,
 		    const struct sd_node *sender);
@@ -547,10 +816,28 @@ static inline bool is_sparse_object(uint64_t oid)
 
 /* gateway operations */
 int gateway_read_obj(struct request *req);
+main_fn void gateway_note_write(uint64_t oid);
+uint32_t gateway_write_gen(uint64_t oid);
+int gateway_read_objs(struct request *req);
+int gateway_write_objs(struct request *req);
 int gateway_write_obj(struct request *req);
 int gateway_create_and_write_obj(struct request *req);
 int gateway_remove_obj(struct request *req);
+int gateway_remove_objs(struct request *req);
 int gateway_decref_object(struct request *req);
+int gateway_forward_request(struct request *req);
+int gateway_handle_cow(struct request *req);
+int gateway_forward_init(void);
+bool gateway_forward_finish(struct request *req);
+
+/* object_cache */
+int object_cache_init(const char *path, uint64_t size, bool writethrough);
+bool bypass_object_cache_oid(const struct request *req, uint64_t oid);
+bool bypass_object_cache(const struct request *req);
+int object_cache_handle_request(struct request *req);
+int object_cache_flush_vdi(uint32_t vid);
+void object_cache_drop(uint64_t oid);
+void object_cache_delete(uint32_t vid);
 
 bool is_erasure_oid(uint64_t oid);
 uint8_t local_ec_index(struct vnode_info *vinfo, uint64_t oid);
@@ -579,12 +866,20 @@ int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *data);
 bool sheep_need_retry(uint32_t epoch);
 
 /* journal_file.c */
-int journal_file_init(const char *path, size_t size, bool skip);
+int journal_file_init(const char *path, size_t size, bool skip, bool group);
 void clean_journal_file(const char *p);
 int
 journal_write_store(uint64_t oid, const char *buf, size_t size, off_t, bool);
 int journal_remove_object(uint64_t oid);
 
+struct journal_state {
+	size_t half_size;
+	size_t half_used;	/* by the half the head is in */
+	uint64_t next_seq;
+	bool checkpointing;
+};
+void journal_get_state(struct journal_state *st);
+
 /* md.c */
 bool md_add_disk(const char *path, bool);
 uint64_t md_init_space(void);
@@ -597,6 +892,190 @@ int md_plug_disks(char *disks);
 int md_unplug_disks(char *disks);
 uint64_t md_get_size(uint64_t *used);
 uint32_t md_nr_disks(void);
+uint64_t md_io_begin(uint64_t oid, uint8_t ec_index);
+void md_account_io(uint64_t oid, uint8_t ec_index, uint32_t len,
+		   uint64_t start);
+void md_set_io_depth(unsigned int depth);
+void md_set_numa(bool enable);
+main_fn struct work_queue *md_get_peer_wqueue(uint64_t oid);
+void md_start_perf_weight(unsigned int interval, unsigned int min_weight);
+void md_tier_new_object(uint64_t oid, uint8_t ec_index);
+void md_start_tiering(void);
+
+/* cow.c */
+bool cow_supported(uint64_t oid);
+uint32_t cow_extent_size(uint64_t oid);
+int cow_read_map(const char *path, struct cow_map *map);
+int cow_create_file(const char *path, const char *buf, size_t len,
+		    const struct cow_map *map);
+int cow_create_and_write(uint64_t oid, const struct siocb *iocb,
+			 uint64_t parent_oid, uint32_t generation);
+int cow_write(uint64_t oid, const struct siocb *iocb,
+	      struct vnode_info *vinfo);
+int cow_fill(uint64_t oid, const struct siocb *iocb);
+int cow_get_map(uint64_t oid, const struct siocb *iocb, struct cow_map *map);
+int cow_remove_object(uint64_t oid, uint8_t ec_index,
+		      struct vnode_info *vinfo);
+void cow_hash_map(const char *path, uint8_t *sha1);
+int cow_create_excl(uint64_t oid, const struct siocb *iocb);
+
+/* compress.c */
+#ifdef HAVE_ZSTD
+bool compress_enabled(uint64_t oid);
+bool compress_check(uint64_t oid, const char *path);
+int compress_create(uint64_t oid, int fd, const char *path,
+		    const struct siocb *iocb);
+int compress_read(uint64_t oid, int fd, const char *path,
+		  const struct siocb *iocb);
+int compress_write(uint64_t oid, int fd, const char *path,
+		   const struct siocb *iocb, bool sync);
+int compress_copy_file(uint64_t oid, const char *old, const char *new);
+#else
+static inline bool compress_enabled(uint64_t oid)
+{
+	return false;
+}
+
+static inline bool compress_check(uint64_t oid, const char *path)
+{
+	return false;
+}
+
+static inline int compress_create(uint64_t oid, int fd, const char *path,
+				  const struct siocb *iocb)
+{
+	return SD_RES_NO_SUPPORT;
+}
+
+static inline int compress_read(uint64_t oid, int fd, const char *path,
+				const struct siocb *iocb)
+{
+	return SD_RES_NO_SUPPORT;
+}
+
+static inline int compress_write(uint64_t oid, int fd, const char *path,
+				 const struct siocb *iocb, bool sync)
+{
+	return SD_RES_NO_SUPPORT;
+}
+
+static inline int compress_copy_file(uint64_t oid, const char *old,
+				     const char *new)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+/* wire.c */
+#ifdef HAVE_ZSTD
+bool wire_compress_with(const struct sd_node *n);
+void *wire_compress(const void *buf, uint32_t len, uint32_t *clen);
+int wire_decompress(void *buf, uint32_t len, uint32_t size);
+void wire_compress_rsp(struct request *req);
+int wire_decompress_req(struct request *req);
+
+static inline bool wire_supported(void)
+{
+	return true;
+}
+#else
+static inline bool wire_compress_with(const struct sd_node *n)
+{
+	return false;
+}
+
+static inline void *wire_compress(const void *buf, uint32_t len,
+				  uint32_t *clen)
+{
+	return NULL;
+}
+
+static inline int wire_decompress(void *buf, uint32_t len, uint32_t size)
+{
+	return -1;
+}
+
+static inline void wire_compress_rsp(struct request *req)
+{
+}
+
+static inline int wire_decompress_req(struct request *req)
+{
+	return -1;
+}
+
+static inline bool wire_supported(void)
+{
+	return false;
+}
+#endif
+
+/* checksum.c */
+bool csum_enabled(void);
+bool csum_check(int fd);
+int csum_create(uint64_t oid, int fd, const struct siocb *iocb);
+int csum_write(uint64_t oid, int fd, const char *path,
+	       const struct siocb *iocb);
+int csum_update(uint64_t oid, int fd, uint32_t offset, uint32_t len);
+int csum_read(uint64_t oid, int fd, const char *path,
+	      const struct siocb *iocb);
+bool csum_get_crc32c(uint64_t oid, const char *path, uint32_t *crc);
+bool csum_get_sha1(uint64_t oid, const char *path, uint8_t *sha1,
+		   uint32_t *version);
+void csum_set_sha1(uint64_t oid, const char *path, const uint8_t *sha1,
+		   uint32_t version);
+int csum_copy(const char *old, const char *new);
+
+/* writeback.c */
+int writeback_init(uint64_t size);
+void writeback_written(uint32_t len);
+int writeback_sync(void);
+int writeback_sync_nodes(const struct vnode_info *vinfo);
+
+/* Whether the object writes are made durable before they return */
+static inline bool sync_writes(void)
+{
+	return !sys->nosync && !sys->writeback_window;
+}
+
+/* dedup.c */
+int dedup_init(uint32_t interval);
+int dedup_begin_write(uint64_t oid, const char *path);
+void dedup_end_write(void);
+
+/* precopy.c */
+int precopy_init(uint64_t bandwidth, uint32_t max_objects);
+void precopy_account(const struct request *req, uint64_t oid);
+main_fn void precopy_snapshot(uint32_t old_vid, uint32_t new_vid);
+main_fn void precopy_delete(uint32_t vid);
+bool precopy_consume(uint64_t oid);
+
+/* handover.c */
+int handover_init(const char *dir);
+int handover_receive(const char *dir);
+int handover_adopt_listeners(void);
+void handover_adopt_clients(void);
+
+/* check.c */
+int repair_replica_from(const struct node_id *src, uint64_t oid,
+			uint32_t epoch);
+int check_local_objects(struct request *req);
+int scrub_init(uint64_t bandwidth, uint32_t interval);
+
+/* qos.c */
+int qos_init(void);
+main_fn bool qos_throttle(struct request *req);
+main_fn void qos_invalidate(const char *key);
+
+/* readahead.c */
+int readahead_init(uint32_t window, uint64_t size);
+bool readahead_read(struct request *req);
+void readahead_note_write(uint64_t oid);
+
+/* coalesce.c */
+int coalesce_write(uint64_t oid, const struct siocb *iocb,
+		   struct vnode_info *vinfo);
 
 static inline bool is_stale_path(const char *path)
 {
@@ -629,6 +1108,29 @@ int nfs_create(const char *name);
 int nfs_delete(const char *name);
 #endif
 
+/* vhost.c */
+#ifdef HAVE_VHOST
+int vhost_init(const char *dir);
+int vhost_create(uint32_t vid, const char *name);
+int vhost_start(uint32_t vid);
+int vhost_delete(const char *name);
+void vhost_request_done(struct request *req);
+#endif
+
+/* shm.c */
+int shm_attach(struct client_info *ci);
+void shm_detach(struct client_info *ci);
+void shm_request_done(struct request *req);
+
+/* metrics.c */
+int metrics_init(char *options);
+
+/* heat.c */
+void heat_access(uint64_t oid);
+uint32_t heat_estimate(uint64_t oid);
+uint32_t heat_get_info(void *buf, uint32_t len);
+void heat_init(void);
+
 extern bool wildcard_recovery;
 
 struct request *alloc_request(struct client_info *ci, uint32_t data_length);
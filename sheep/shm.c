@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Shared memory rings of the local clients, see shm_ring.h
+ *
+ * SD_OP_SHM_ATTACH is answered by rx_main() on the unix domain socket which
+ * passed the fds of the ring.  The requests of the ring are queued like the
+ * ones read from a socket, but with their data in the slots of the ring, and
+ * their own client_info so that put_request() hands them back here instead
+ * of to the socket.
+ *
+ * The sheep never trusts the ring: the memfd must be sealed against resizing,
+ * the requests are copied out of it, and a slot which is out of range or
+ * already in flight is dropped.  The mapping is kept until the requests in
+ * flight finish after the client went away.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sheep_priv.h"
+#include "shm_ring.h"
+
+struct shm_ring {
+	struct client_info ci;	/* of the requests of the ring */
+	struct sd_shm_ring *ring;
+	size_t size;
+	uint32_t nr_slots;
+	uint32_t slot_size;
+	int sq_efd;
+	int cq_efd;
+
+	uint32_t sq_head;
+	uint32_t cq_tail;
+	bool busy[SD_SHM_MAX_SLOTS];
+	uint32_t nr_inflight;
+	bool detached;
+};
+
+static void shm_free(struct shm_ring *sr)
+{
+	munmap(sr->ring, sr->size);
+	free(sr);
+}
+
+static uint32_t shm_slot_of(const struct shm_ring *sr, const void *data)
+{
+	size_t off = (const char *)data - (const char *)sr->ring;
+
+	return (off - SD_SHM_DATA_OFFSET) / sr->slot_size;
+}
+
+main_fn void shm_request_done(struct request *req)
+{
+	struct shm_ring *sr = container_of(req->ci, struct shm_ring, ci);
+	struct sd_shm_ring *ring = sr->ring;
+	uint32_t slot = shm_slot_of(sr, req->data);
+
+	if (!sr->detached) {
+		struct sd_rsp *rsp = &ring->slots[slot].rsp;
+
+		memcpy(rsp, &req->rp, sizeof(*rsp));
+		rsp->epoch = sys->cinfo.epoch;
+		rsp->opcode = req->rq.opcode;
+		rsp->id = req->rq.id;
+
+		ring->cq[sr->cq_tail % sr->nr_slots] = slot;
+		cmm_smp_wmb();
+		uatomic_set(&ring->cq_tail, ++sr->cq_tail);
+		eventfd_write(sr->cq_efd, 1);
+	}
+
+	sr->busy[slot] = false;
+	free_request(req);
+	if (--sr->nr_inflight == 0 && sr->detached)
+		shm_free(sr);
+}
+
+static void shm_submit(struct shm_ring *sr, uint32_t slot)
+{
+	struct request *req;
+	uint32_t len;
+
+	if (slot >= sr->nr_slots || sr->busy[slot]) {
+		sd_err("invalid slot %"PRIu32, slot);
+		return;
+	}
+
+	req = alloc_request(&sr->ci, 0);
+	if (!req) {
+		sd_err("failed to allocate request");
+		return;
+	}
+	req->stage_time[REQ_STAGE_RX] = clock_get_time();
+	sr->busy[slot] = true;
+	sr->nr_inflight++;
+
+	memcpy(&req->rq, &sr->ring->slots[slot].req, sizeof(req->rq));
+	req->data = sd_shm_slot_data(sr->ring, slot, sr->slot_size);
+	req->data_length = req->rq.data_length;
+
+	len = req->rq.data_length;
+	if (is_obj_vec_req(&req->rq) || len > sr->slot_size) {
+		req->rp.result = SD_RES_INVALID_PARMS;
+		put_request(req);
+		return;
+	}
+
+	queue_request(req);
+}
+
+static void shm_submit_handler(int fd, int events, void *data)
+{
+	struct shm_ring *sr = data;
+	struct sd_shm_ring *ring = sr->ring;
+	eventfd_t val;
+	uint32_t tail;
+
+	eventfd_read(fd, &val);
+
+	tail = uatomic_read(&ring->sq_tail);
+	cmm_smp_rmb();
+	if (tail - sr->sq_head > sr->nr_slots) {
+		sd_err("invalid submission queue, %"PRIu32" - %"PRIu32, tail,
+		       sr->sq_head);
+		return;
+	}
+
+	while (sr->sq_head != tail) {
+		uint32_t slot = ring->sq[sr->sq_head++ % sr->nr_slots];
+
+		uatomic_set(&ring->sq_head, sr->sq_head);
+		shm_submit(sr, slot);
+	}
+}
+
+static void close_rx_fds(struct client_info *ci)
+{
+	for (int i = 0; i < ci->nr_rx_fds; i++)
+		close(ci->rx_fds[i]);
+	ci->nr_rx_fds = 0;
+}
+
+/* Map the ring passed with SD_OP_SHM_ATTACH on the connection 'ci' */
+main_fn int shm_attach(struct client_info *ci)
+{
+	struct sd_shm_ring *ring;
+	struct shm_ring *sr;
+	struct stat st;
+	uint32_t nr_slots, slot_size;
+	int memfd = ci->rx_fds[0], seals, ret = SD_RES_INVALID_PARMS;
+
+	if (ci->nr_rx_fds != SD_SHM_NR_FDS || ci->shm) {
+		sd_err("no fds or already attached");
+		goto out;
+	}
+
+	/*
+	 * The client could truncate an unsealed memfd while it's mapped and
+	 * the sheep would take SIGBUS on the next access of the ring.
+	 */
+	seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || (seals & SD_SHM_SEALS) != SD_SHM_SEALS) {
+		sd_err("the ring isn't sealed");
+		goto out;
+	}
+
+	if (fstat(memfd, &st) < 0 || st.st_size < sizeof(*ring)) {
+		sd_err("invalid ring");
+		goto out;
+	}
+	ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    memfd, 0);
+	if (ring == MAP_FAILED) {
+		sd_err("failed to map the ring, %m");
+		ret = SD_RES_NO_MEM;
+		goto out;
+	}
+
+	nr_slots = ring->nr_slots;
+	slot_size = ring->slot_size;
+	if (ring->magic != SD_SHM_MAGIC || !nr_slots ||
+	    nr_slots > SD_SHM_MAX_SLOTS || !slot_size ||
+	    sd_shm_size(nr_slots, slot_size) > st.st_size) {
+		sd_err("invalid ring, %"PRIu32" slots of %"PRIu32" bytes",
+		       nr_slots, slot_size);
+		munmap(ring, st.st_size);
+		goto out;
+	}
+
+	sr = xzalloc(sizeof(*sr));
+	sr->ring = ring;
+	sr->size = st.st_size;
+	sr->nr_slots = nr_slots;
+	sr->slot_size = slot_size;
+	sr->sq_efd = ci->rx_fds[1];
+	sr->cq_efd = ci->rx_fds[2];
+	sr->sq_head = uatomic_read(&ring->sq_tail);
+	sr->cq_tail = sr->sq_head;
+	ring->sq_head = sr->sq_head;
+	ring->cq_tail = sr->cq_tail;
+
+	sr->ci.type = CLIENT_INFO_TYPE_SHM;
+	sr->ci.conn.fd = -1;
+	pstrcpy(sr->ci.conn.ipstr, sizeof(sr->ci.conn.ipstr), "shm");
+	refcount_set(&sr->ci.refcnt, 0);
+	INIT_LIST_HEAD(&sr->ci.done_reqs);
+	INIT_LIST_HEAD(&sr->ci.tx_reqs);
+
+	if (register_event(sr->sq_efd, shm_submit_handler, sr) < 0) {
+		munmap(ring, st.st_size);
+		free(sr);
+		ret = SD_RES_SYSTEM_ERROR;
+		goto out;
+	}
+
+	/* the eventfds are the ring's now */
+	close(memfd);
+	ci->nr_rx_fds = 0;
+	ci->shm = sr;
+	sd_info("%"PRIu32" slots of %"PRIu32" bytes", nr_slots, slot_size);
+	return SD_RES_SUCCESS;
+out:
+	close_rx_fds(ci);
+	return ret;
+}
+
+/* Called when the connection 'ci' is destroyed */
+main_fn void shm_detach(struct client_info *ci)
+{
+	struct shm_ring *sr = ci->shm;
+
+	close_rx_fds(ci);
+	if (!sr)
+		return;
+
+	unregister_event(sr->sq_efd);
+	close(sr->sq_efd);
+	close(sr->cq_efd);
+	sr->detached = true;
+	ci->shm = NULL;
+	if (!sr->nr_inflight)
+		shm_free(sr);
+}
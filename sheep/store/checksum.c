@@ -0,0 +1,448 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checksums of the object files
+ *
+ * In a cluster formatted with SD_CLUSTER_FLAG_CHECKSUM, the CRC32C of each
+ * block of an object is kept in the CSUMNAME xattr of its file.  It is computed
+ * when the object is created and updated by every write, which rereads the
+ * partially written blocks.  The reads verify the blocks they cover and fail
+ * with SD_RES_EIO on a mismatch, so the gateway reads another replica instead
+ * of returning corrupted data.
+ *
+ * The CRC32C of the whole object is combined from the ones of the blocks, and
+ * the SHA1 digest of the object is cached in the xattr until the next write,
+ * so SD_OP_GET_HASH(ES) and the recovery only read the metadata.  These checks
+ * trust the xattr; a corruption of the data is found by its next read.
+ *
+ * A write and the update of the checksums are atomic to the reads of the same
+ * object, but not to a crash: the blocks written just before it fail to
+ * verify, and the object is read and repaired from the other replicas.  The
+ * journal replay updates the checksums of the blocks it writes.
+ *
+ * The sparse copy-on-write objects and the compressed ones, whose frames have
+ * their own checksums, are left alone.  The objects created before the flag
+ * was set have no xattr and aren't verified.
+ */
+
+#include "sheep_priv.h"
+#include "crc32c.h"
+
+#define CSUMNAME "user.obj.csum"
+#define SD_CSUM_MAX_BLOCKS 256
+#define NR_CSUM_LOCKS 64
+
+struct csum_index {
+	uint32_t block_size;
+	/* bumped by each write, the digest is valid if it was taken at it */
+	uint32_t version;
+	uint32_t sha1_version;
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	uint32_t crc[SD_CSUM_MAX_BLOCKS];
+};
+
+/* serialize the writes of the same object with its reads */
+static struct sd_rw_lock csum_locks[NR_CSUM_LOCKS] = {
+	[0 ... NR_CSUM_LOCKS - 1] = SD_RW_LOCK_INITIALIZER
+};
+
+static struct sd_rw_lock *get_lock(uint64_t oid)
+{
+	return &csum_locks[sd_hash_oid(oid) % NR_CSUM_LOCKS];
+}
+
+/* the blocks are as small as possible with at most SD_CSUM_MAX_BLOCKS */
+static uint32_t get_block_size(size_t objsize)
+{
+	uint32_t size = SD_HASH_BLOCK_SIZE;
+
+	while (DIV_ROUND_UP(objsize, size) > SD_CSUM_MAX_BLOCKS)
+		size <<= 1;
+
+	return size;
+}
+
+static size_t index_size(uint32_t nr_blocks)
+{
+	return offsetof(struct csum_index, crc) + nr_blocks * sizeof(uint32_t);
+}
+
+/* Whether the new objects get checksums */
+bool csum_enabled(void)
+{
+	return sys->cinfo.flags & SD_CLUSTER_FLAG_CHECKSUM;
+}
+
+/*
+ * Whether the object file of fd has checksums.  This doesn't touch the file
+ * unless the cluster keeps them.
+ */
+bool csum_check(int fd)
+{
+	if (!(sys->cinfo.flags & SD_CLUSTER_FLAG_CHECKSUM))
+		return false;
+
+	return fgetxattr(fd, CSUMNAME, NULL, 0) > 0;
+}
+
+/*
+ * Read the index of the object file fd, or path if fd is -1.  Return the number
+ * of blocks, or -1 and set errno.
+ */
+static int read_index(uint64_t oid, int fd, const char *path,
+		      struct csum_index *idx)
+{
+	size_t objsize = get_store_objsize(oid);
+	uint32_t size = get_block_size(objsize);
+	uint32_t nr = DIV_ROUND_UP(objsize, size);
+	ssize_t ret;
+
+	if (fd < 0)
+		ret = getxattr(path, CSUMNAME, idx, sizeof(*idx));
+	else
+		ret = fgetxattr(fd, CSUMNAME, idx, sizeof(*idx));
+
+	if (ret < 0)
+		return -1;
+	if (ret != index_size(nr) || idx->block_size != size) {
+		sd_err("broken checksums of %016"PRIx64, oid);
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return nr;
+}
+
+static int write_index(int fd, const char *path, const struct csum_index *idx,
+		       uint32_t nr)
+{
+	if (fd < 0)
+		return setxattr(path, CSUMNAME, idx, index_size(nr), 0);
+	return fsetxattr(fd, CSUMNAME, idx, index_size(nr), 0);
+}
+
+/* Add len zero bytes to crc */
+static uint32_t crc_zero(uint32_t crc, size_t len)
+{
+	static const char zero[SD_HASH_BLOCK_SIZE];
+
+	while (len) {
+		size_t n = min(len, sizeof(zero));
+
+		crc = crc32c(crc, zero, n);
+		len -= n;
+	}
+
+	return crc;
+}
+
+/* The byte range of the block i */
+static void block_range(uint64_t oid, const struct csum_index *idx,
+			uint32_t i, uint32_t *start, uint32_t *end)
+{
+	*start = i * idx->block_size;
+	*end = min((size_t)*start + idx->block_size, get_store_objsize(oid));
+}
+
+/*
+ * Set the checksums of a new object, written from iocb to the file fd with
+ * zero elsewhere.  Return -1 and set errno on failure.
+ */
+int csum_create(uint64_t oid, int fd, const struct siocb *iocb)
+{
+	struct csum_index idx = {
+		.block_size = get_block_size(get_store_objsize(oid)),
+		.version = 1,
+	};
+	uint32_t nr = DIV_ROUND_UP(get_store_objsize(oid), idx.block_size);
+	uint32_t end = iocb->offset + iocb->length;
+
+	for (uint32_t i = 0; i < nr; i++) {
+		uint32_t bs, be, s, e;
+		uint32_t crc = 0;
+
+		block_range(oid, &idx, i, &bs, &be);
+		s = max(iocb->offset, bs);
+		s = min(s, be);
+		e = max(end, bs);
+		e = min(e, be);
+		crc = crc_zero(crc, s - bs);
+		crc = crc32c(crc, (char *)iocb->buf + s - iocb->offset, e - s);
+		idx.crc[i] = crc_zero(crc, be - e);
+	}
+
+	return write_index(fd, NULL, &idx, nr);
+}
+
+static int pread_full(uint64_t oid, int fd, void *buf, size_t count,
+		      off_t offset)
+{
+	ssize_t ret = store_pread(oid, fd, buf, count, offset);
+
+	if (ret == count)
+		return 0;
+	if (ret >= 0)
+		errno = EBADMSG;
+	return -1;
+}
+
+/* Recompute the checksums of the blocks of fd in [offset, offset + len) */
+static int update_blocks(uint64_t oid, int fd, struct csum_index *idx,
+			 const char *buf, uint32_t offset, uint32_t len)
+{
+	uint32_t end = offset + len;
+	char *tmp = NULL;
+	int ret = 0;
+
+	for (uint32_t i = offset / idx->block_size;
+	     i < DIV_ROUND_UP(end, idx->block_size); i++) {
+		uint32_t bs, be;
+
+		block_range(oid, idx, i, &bs, &be);
+		if (buf && offset <= bs && be <= end) {
+			idx->crc[i] = crc32c(0, buf + bs - offset, be - bs);
+			continue;
+		}
+
+		/* the partially written blocks are read again */
+		if (!tmp)
+			tmp = xvalloc(idx->block_size);
+		if (pread_full(oid, fd, tmp, be - bs, bs) < 0) {
+			ret = -1;
+			break;
+		}
+		idx->crc[i] = crc32c(0, tmp, be - bs);
+	}
+
+	free(tmp);
+	return ret;
+}
+
+/*
+ * The errors are converted after the lock is released, since the handling of
+ * a broken disk waits for the moves of md.c.  A mismatch is EBADMSG, which
+ * isn't a failure of the disk.
+ */
+static int to_sderr(uint64_t oid, const char *path, int err)
+{
+	if (err == EBADMSG)
+		return SD_RES_EIO;
+	return err_to_sderr(path, oid, err);
+}
+
+/* Write iocb to the object file fd and update its checksums */
+int csum_write(uint64_t oid, int fd, const char *path,
+	       const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = get_lock(oid);
+	struct csum_index idx;
+	int nr, err = 0;
+
+	sd_write_lock(lock);
+	nr = read_index(oid, fd, path, &idx);
+	if (nr < 0)
+		goto err;
+
+	if (store_pwrite(oid, fd, iocb->buf, iocb->length, iocb->offset) !=
+	    iocb->length)
+		goto err;
+	if (update_blocks(oid, fd, &idx, iocb->buf, iocb->offset,
+			  iocb->length) < 0)
+		goto err;
+	idx.version++;
+	if (write_index(fd, path, &idx, nr) < 0)
+		goto err;
+	goto out;
+err:
+	err = errno;
+	sd_err("failed to write %s, %m", path);
+out:
+	sd_rw_unlock(lock);
+	return err ? to_sderr(oid, path, err) : SD_RES_SUCCESS;
+}
+
+/*
+ * Recompute the checksums of [offset, offset + len) of fd after a write which
+ * bypassed csum_write(), if it has them.  Return -1 and set errno on failure.
+ */
+int csum_update(uint64_t oid, int fd, uint32_t offset, uint32_t len)
+{
+	struct sd_rw_lock *lock = get_lock(oid);
+	struct csum_index idx;
+	int nr, ret = 0;
+
+	sd_write_lock(lock);
+	nr = read_index(oid, fd, NULL, &idx);
+	if (nr < 0) {
+		if (errno != ENODATA)
+			ret = -1;
+		goto out;
+	}
+
+	ret = update_blocks(oid, fd, &idx, NULL, offset, len);
+	if (ret == 0) {
+		idx.version++;
+		ret = write_index(fd, NULL, &idx, nr);
+	}
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+/* Read iocb from the object file fd and verify the blocks it covers */
+int csum_read(uint64_t oid, int fd, const char *path,
+	      const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = get_lock(oid);
+	uint32_t first, last, start, end, off = iocb->offset;
+	struct csum_index idx;
+	char *buf = iocb->buf;
+	int err = 0;
+
+	if (!iocb->length)
+		return SD_RES_SUCCESS;
+
+	sd_read_lock(lock);
+	if (read_index(oid, fd, path, &idx) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	first = off / idx.block_size;
+	last = DIV_ROUND_UP(off + iocb->length, idx.block_size) - 1;
+	start = first * idx.block_size;
+	end = min((size_t)(last + 1) * idx.block_size,
+		  get_store_objsize(oid));
+
+	/* a partial block is read whole into a bounce buffer */
+	if (start != off || end != off + iocb->length)
+		buf = xvalloc(end - start);
+
+	if (pread_full(oid, fd, buf, end - start, start) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	for (uint32_t i = first; i <= last; i++) {
+		uint32_t bs, be;
+
+		block_range(oid, &idx, i, &bs, &be);
+		if (crc32c(0, buf + bs - start, be - bs) != idx.crc[i]) {
+			sd_err("checksum mismatch in the block %"PRIu32" of %s",
+			       i, path);
+			err = EBADMSG;
+			goto out;
+		}
+	}
+
+	if (buf != iocb->buf)
+		memcpy(iocb->buf, buf + off - start, iocb->length);
+out:
+	sd_rw_unlock(lock);
+	if (buf != iocb->buf)
+		free(buf);
+	return err ? to_sderr(oid, path, err) : SD_RES_SUCCESS;
+}
+
+/*
+ * Get the CRC32C of the whole object file at path from the ones of its blocks.
+ * Return false if it has no checksums.
+ */
+bool csum_get_crc32c(uint64_t oid, const char *path, uint32_t *crc)
+{
+	struct sd_rw_lock *lock = get_lock(oid);
+	struct csum_index idx;
+	int nr;
+
+	if (!(sys->cinfo.flags & SD_CLUSTER_FLAG_CHECKSUM))
+		return false;
+
+	sd_read_lock(lock);
+	nr = read_index(oid, -1, path, &idx);
+	sd_rw_unlock(lock);
+	if (nr < 0)
+		return false;
+
+	*crc = 0;
+	for (uint32_t i = 0; i < nr; i++) {
+		uint32_t bs, be;
+
+		block_range(oid, &idx, i, &bs, &be);
+		*crc = crc32c_combine(*crc, idx.crc[i], be - bs);
+	}
+
+	return true;
+}
+
+/*
+ * Get the cached SHA1 digest of the object file at path.  Return true if it is
+ * valid, otherwise set version for csum_set_sha1() after computing it, or to
+ * zero if the file has no checksums.
+ */
+bool csum_get_sha1(uint64_t oid, const char *path, uint8_t *sha1,
+		   uint32_t *version)
+{
+	struct sd_rw_lock *lock = get_lock(oid);
+	struct csum_index idx;
+	bool cached = false;
+
+	*version = 0;
+	if (!(sys->cinfo.flags & SD_CLUSTER_FLAG_CHECKSUM))
+		return false;
+
+	sd_read_lock(lock);
+	if (read_index(oid, -1, path, &idx) < 0)
+		goto out;
+
+	if (idx.sha1_version == idx.version) {
+		memcpy(sha1, idx.sha1, SHA1_DIGEST_SIZE);
+		cached = true;
+	} else
+		*version = idx.version;
+out:
+	sd_rw_unlock(lock);
+	return cached;
+}
+
+/* Cache the SHA1 digest of path unless it was written after version */
+void csum_set_sha1(uint64_t oid, const char *path, const uint8_t *sha1,
+		   uint32_t version)
+{
+	struct sd_rw_lock *lock = get_lock(oid);
+	struct csum_index idx;
+	int nr;
+
+	sd_write_lock(lock);
+	nr = read_index(oid, -1, path, &idx);
+	if (nr < 0 || idx.version != version)
+		goto out;
+
+	memcpy(idx.sha1, sha1, SHA1_DIGEST_SIZE);
+	idx.sha1_version = version;
+	if (write_index(-1, path, &idx, nr) < 0)
+		sd_err("failed to cache the digest of %016"PRIx64", %m", oid);
+out:
+	sd_rw_unlock(lock);
+}
+
+/* Copy the checksums of the object file old to new, for moving it */
+int csum_copy(const char *old, const char *new)
+{
+	struct csum_index idx;
+	ssize_t len;
+
+	len = getxattr(old, CSUMNAME, &idx, sizeof(idx));
+	if (len < 0)
+		return errno == ENODATA ? 0 : -1;
+
+	return setxattr(new, CSUMNAME, &idx, len, 0);
+}
@@ -16,15 +16,124 @@
 
 char *obj_path;
 char *epoch_path;
+char *deletion_path;
+char *convert_path;
+char *oalloc_path;
 
 struct store_driver *sd_store;
 LIST_HEAD(store_drivers);
 
 #define sector_algined(x) ({ ((x) & (SECTOR_SIZE - 1)) == 0; })
 
-static inline bool iocb_is_aligned(const struct siocb *iocb)
+/*
+ * Direct object I/O
+ *
+ * With 'sheep -D', all the I/O of the data objects is O_DIRECT, so the object
+ * files are opened with the same flags every time and fd_cache.c keeps them.
+ * store_pread() and store_pwrite() take the buffers and the ranges which are
+ * not aligned to sectors through a bounce buffer of the mempool, and a write
+ * which starts or ends in the middle of a sector reads the sector, patches it
+ * and writes it back.  Only such writes take a lock of dio_locks, since two of
+ * them may patch the same sector at once.
+ */
+#define DIO_HASH_BITS 10
+#define DIO_HASH_SIZE (1U << DIO_HASH_BITS)
+
+static struct sd_mutex dio_locks[DIO_HASH_SIZE];
+
+static void __attribute__((constructor)) init_dio_locks(void)
+{
+	for (int i = 0; i < DIO_HASH_SIZE; i++)
+		sd_init_mutex(dio_locks + i);
+}
+
+static inline bool object_dio(uint64_t oid)
+{
+	return sys->backend_dio && is_data_obj(oid);
+}
+
+static inline bool dio_aligned(const void *buf, size_t len, off_t off)
+{
+	return sector_algined((unsigned long)buf) && sector_algined(len) &&
+		sector_algined(off);
+}
+
+/* The pool gives page aligned buffers from BLOCK_SIZE on */
+static inline size_t bounce_size(size_t len)
+{
+	return max(len, (size_t)BLOCK_SIZE);
+}
+
+/* Like xpread(), for the object file fd of oid */
+ssize_t store_pread(uint64_t oid, int fd, void *buf, size_t len, off_t off)
+{
+	off_t start = round_down(off, SECTOR_SIZE);
+	size_t size = round_up(off + len, SECTOR_SIZE) - start;
+	ssize_t ret;
+	char *tmp;
+
+	if (!object_dio(oid) || dio_aligned(buf, len, off))
+		return xpread(fd, buf, len, off);
+
+	tmp = xpool_alloc(bounce_size(size));
+	ret = xpread(fd, tmp, size, start);
+	if (ret > 0) {
+		/* short at the end of the file */
+		ret = max(ret - (off - start), (ssize_t)0);
+		ret = min(ret, (ssize_t)len);
+		memcpy(buf, tmp + off - start, ret);
+	}
+	pool_free(tmp, bounce_size(size));
+
+	return ret;
+}
+
+/* Read the sector at off into buf, zeroing what is past the end of the file */
+static int read_sector(int fd, char *buf, off_t off)
 {
-	return  sector_algined(iocb->offset) && sector_algined(iocb->length);
+	ssize_t ret = xpread(fd, buf, SECTOR_SIZE, off);
+
+	if (ret < 0)
+		return -1;
+	memset(buf + ret, 0, SECTOR_SIZE - ret);
+	return 0;
+}
+
+/* Like xpwrite(), for the object file fd of oid */
+ssize_t store_pwrite(uint64_t oid, int fd, const void *buf, size_t len,
+		     off_t off)
+{
+	off_t start = round_down(off, SECTOR_SIZE),
+	      end = round_up(off + len, SECTOR_SIZE);
+	size_t size = end - start;
+	struct sd_mutex *lock = NULL;
+	ssize_t ret = -1;
+	char *tmp;
+
+	if (!object_dio(oid) || dio_aligned(buf, len, off))
+		return xpwrite(fd, buf, len, off);
+
+	tmp = xpool_alloc(bounce_size(size));
+	if (start != off || end != off + len) {
+		lock = dio_locks + hash_64(oid, DIO_HASH_BITS);
+		sd_mutex_lock(lock);
+		if (start != off && read_sector(fd, tmp, start) < 0)
+			goto out;
+		/* the head and the tail may be the same sector */
+		if (end != off + len && (start == off || size > SECTOR_SIZE) &&
+		    read_sector(fd, tmp + size - SECTOR_SIZE,
+				end - SECTOR_SIZE) < 0)
+			goto out;
+	}
+	memcpy(tmp + off - start, buf, len);
+	if (xpwrite(fd, tmp, size, start) == size)
+		ret = len;
+out:
+	if (lock)
+		sd_mutex_unlock(lock);
+	pool_free(tmp, bounce_size(size));
+
+	return ret;
 }
 
 int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create)
@@ -32,14 +141,11 @@ int prepare_iocb(uint64_t oid, const struct siocb *iocb, bool create)
 	int syncflag = create ? O_SYNC : O_DSYNC;
 	int flags = syncflag | O_RDWR;
 
-	if (uatomic_is_true(&sys->use_journal) || sys->nosync == true)
+	if (uatomic_is_true(&sys->use_journal) || !sync_writes())
 		flags &= ~syncflag;
 
-	if (sys->backend_dio && is_data_obj(oid) && iocb_is_aligned(iocb)) {
-		if (!is_aligned_to_pagesize(iocb->buf))
-			panic("Memory isn't aligned to pagesize %p, oid: %016"PRIx64, iocb->buf, oid);
+	if (object_dio(oid))
 		flags |= O_DIRECT;
-	}
 
 	if (create)
 		flags |= O_CREAT | O_EXCL;
@@ -83,6 +189,76 @@ int err_to_sderr(const char *path, uint64_t oid, int err)
 	}
 }
 
+/*
+ * A new object is written to an anonymous O_TMPFILE file in its directory and
+ * linked in place once complete, which saves the creation and the rename of
+ * the tmp file, and leaves nothing behind on a crash.  The file systems which
+ * don't support it write tmp_path and rename it instead.
+ *
+ * anon tells install_object_file() and the caller which way was taken.
+ */
+int open_object_file(const char *path, const char *tmp_path, int flags,
+		     bool *anon)
+{
+#ifdef O_TMPFILE
+	static bool tmpfile_is_supported = true;
+	char p[PATH_MAX];
+	int fd;
+
+	if (tmpfile_is_supported) {
+		pstrcpy(p, sizeof(p), path);
+		fd = open(dirname(p), (flags & ~(O_CREAT | O_EXCL)) | O_TMPFILE,
+			  sd_def_fmode);
+		if (fd >= 0) {
+			*anon = true;
+			return fd;
+		}
+		/* EISDIR if the kernel doesn't know O_TMPFILE */
+		if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+			return -1;
+		sd_info("O_TMPFILE is not supported, use tmp files");
+		tmpfile_is_supported = false;
+	}
+#endif
+	*anon = false;
+	return open(tmp_path, flags, sd_def_fmode);
+}
+
+/* Make the file fd opened by open_object_file() the object at path */
+int install_object_file(int fd, bool anon, const char *path,
+			const char *tmp_path)
+{
+	char proc[PATH_MAX];
+	int err;
+
+	if (!anon)
+		return rename(tmp_path, path);
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	if (linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0)
+		return 0;
+	if (errno != EEXIST)
+		return -1;
+
+	/* replace the older file like rename() */
+	if (linkat(AT_FDCWD, proc, AT_FDCWD, tmp_path, AT_SYMLINK_FOLLOW) < 0) {
+		/*
+		 * Another creation of the object is in progress, which writes
+		 * the same data, see default_create_and_write().
+		 */
+		if (errno == EEXIST)
+			return 0;
+		return -1;
+	}
+	if (rename(tmp_path, path) < 0) {
+		err = errno;
+		unlink(tmp_path);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
 int discard(int fd, uint64_t start, uint32_t end)
 {
 	int ret = xfallocate(fd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE,
@@ -98,11 +274,148 @@ int discard(int fd, uint64_t start, uint32_t end)
 	return ret;
 }
 
+#define DEFAULT_PURGE_RATE	1000
+#define PURGE_BATCH		64
+
+struct purge_stale_work {
+	struct work work;
+	char path[PATH_MAX];
+	uint32_t epoch;
+};
+
+/* The epoch of a stale object name "<oid>[_<ec index>].<epoch>" */
+static uint32_t stale_dentry_epoch(const char *name)
+{
+	const char *p = strrchr(name, '.');
+
+	return p ? strtoul(p + 1, NULL, 10) : 0;
+}
+
+static void purge_stale_work_fn(struct work *work)
+{
+	struct purge_stale_work *pw =
+		container_of(work, struct purge_stale_work, work);
+	uint64_t rate = sys->purge_rate ?: DEFAULT_PURGE_RATE, nr = 0;
+	uint64_t start = clock_get_time(), ahead;
+	char path[PATH_MAX];
+	struct dirent *d;
+	struct stat s;
+	DIR *dir;
+	int ret;
+
+	dir = opendir(pw->path);
+	if (!dir) {
+		if (errno != ENOENT)
+			sd_err("failed to open %s, %m", pw->path);
+		return;
+	}
+
+	while ((d = readdir(dir))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		/* moved here by a recovery after the purge was queued */
+		if (stale_dentry_epoch(d->d_name) > pw->epoch)
+			continue;
+
+		if (d->d_type == DT_DIR ||
+		    (d->d_type == DT_UNKNOWN &&
+		     fstatat(dirfd(dir), d->d_name, &s, 0) == 0 &&
+		     S_ISDIR(s.st_mode))) {
+			if (snprintf(path, sizeof(path), "%s/%s", pw->path,
+				     d->d_name) >= sizeof(path)) {
+				sd_err("too long path %s/%s", pw->path,
+				       d->d_name);
+				continue;
+			}
+			ret = rmdir_r(path);
+		} else
+			ret = unlinkat(dirfd(dir), d->d_name, 0);
+		if (ret < 0 && errno != ENOENT)
+			sd_err("failed to remove %s/%s, %m", pw->path,
+			       d->d_name);
+
+		/* sleep off what the batch took ahead of the rate */
+		if (++nr % PURGE_BATCH)
+			continue;
+		ahead = nr * 1000000000ULL / rate;
+		if (ahead > clock_get_time() - start)
+			usleep((ahead - (clock_get_time() - start)) / 1000);
+	}
+	closedir(dir);
+
+	sd_debug("removed %"PRIu64" stale objects of %s", nr, pw->path);
+}
+
+static void purge_stale_work_done(struct work *work)
+{
+	struct purge_stale_work *pw =
+		container_of(work, struct purge_stale_work, work);
+
+	free(pw);
+}
+
+/*
+ * Remove the stale objects in the directory stale_dir on reclaim_wqueue at
+ * sys->purge_rate objects per second, not to saturate the disk after the
+ * recovery.  Only the objects made stale up to the current epoch are removed.
+ */
+void purge_stale_objects(const char *stale_dir)
+{
+	struct purge_stale_work *pw = xzalloc(sizeof(*pw));
+
+	pstrcpy(pw->path, sizeof(pw->path), stale_dir);
+	pw->epoch = sys_epoch();
+	pw->work.fn = purge_stale_work_fn;
+	pw->work.done = purge_stale_work_done;
+	queue_work(sys->reclaim_wqueue, &pw->work);
+}
+
 bool store_id_match(enum store_id id)
 {
 	return (sd_store->id == id);
 }
 
+/*
+ * Epoch logs don't change once written, so the recently used ones are kept in
+ * memory, indexed by epoch.  The recovery walks back through the consecutive
+ * old epochs and used to read one file for each of them again and again.  The
+ * latest epoch is cached as well instead of scanning the epoch directory.
+ */
+#define EPOCH_CACHE_SIZE 64
+
+struct epoch_cache_entry {
+	uint32_t epoch; /* 0 if the slot is empty */
+	int nr_nodes;
+	time_t timestamp;
+	struct sd_node *nodes;
+};
+
+static struct epoch_cache_entry epoch_cache[EPOCH_CACHE_SIZE];
+static uint32_t latest_epoch;
+static bool latest_epoch_valid;
+static struct sd_mutex epoch_cache_lock = SD_MUTEX_INITIALIZER;
+
+static void epoch_cache_drop(struct epoch_cache_entry *e)
+{
+	free(e->nodes);
+	e->nodes = NULL;
+	e->epoch = 0;
+}
+
+/* Called with epoch_cache_lock held */
+static void epoch_cache_insert(uint32_t epoch, const struct sd_node *nodes,
+			       int nr_nodes, time_t timestamp)
+{
+	struct epoch_cache_entry *e = epoch_cache + epoch % EPOCH_CACHE_SIZE;
+
+	epoch_cache_drop(e);
+	e->nodes = xmalloc(sizeof(*nodes) * nr_nodes);
+	memcpy(e->nodes, nodes, sizeof(*nodes) * nr_nodes);
+	e->nr_nodes = nr_nodes;
+	e->timestamp = timestamp;
+	e->epoch = epoch;
+}
+
 int update_epoch_log(uint32_t epoch, struct sd_node *nodes, size_t nr_nodes)
 {
 	int ret, len, nodes_len;
@@ -131,18 +444,50 @@ int update_epoch_log(uint32_t epoch, struct sd_node *nodes, size_t nr_nodes)
 	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
 
 	ret = atomic_create_and_write(path, buf, len, true, false);
+	if (ret == 0) {
+		sd_mutex_lock(&epoch_cache_lock);
+		epoch_cache_insert(epoch, (struct sd_node *)buf, nr_nodes, t);
+		if (latest_epoch_valid && epoch > latest_epoch)
+			latest_epoch = epoch;
+		sd_mutex_unlock(&epoch_cache_lock);
+	}
 
 	free(buf);
 	return ret;
 }
 
-static int do_epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len,
-			     int *nr_nodes, time_t *timestamp)
+int remove_epoch_log(uint32_t epoch)
+{
+	int ret;
+	char path[PATH_MAX];
+	struct epoch_cache_entry *e = epoch_cache + epoch % EPOCH_CACHE_SIZE;
+
+	sd_debug("remove epoch %"PRIu32, epoch);
+	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
+	ret = unlink(path);
+
+	sd_mutex_lock(&epoch_cache_lock);
+	if (e->epoch == epoch)
+		epoch_cache_drop(e);
+	latest_epoch_valid = false;
+	sd_mutex_unlock(&epoch_cache_lock);
+
+	if (ret && errno != ENOENT) {
+		sd_err("failed to remove %s: %m", path);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int epoch_file_read(uint32_t epoch, struct sd_node **nodes,
+			   int *nr_nodes, time_t *timestamp)
 {
 	int fd, ret, buf_len;
 	char path[PATH_MAX];
 	struct stat epoch_stat;
 
+	*nodes = NULL;
 	snprintf(path, sizeof(path), "%s%08u", epoch_path, epoch);
 	fd = open(path, O_RDONLY);
 	if (fd < 0) {
@@ -162,12 +507,9 @@ static int do_epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len,
 		sd_err("invalid epoch %"PRIu32" log", epoch);
 		goto err;
 	}
-	if (len < buf_len) {
-		close(fd);
-		return SD_RES_BUFFER_SMALL;
-	}
 
-	ret = xread(fd, nodes, buf_len);
+	*nodes = xmalloc(buf_len);
+	ret = xread(fd, *nodes, buf_len);
 	if (ret < 0) {
 		sd_err("failed to read epoch %"PRIu32" log, %m", epoch);
 		goto err;
@@ -181,22 +523,69 @@ static int do_epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len,
 
 	*nr_nodes = ret / sizeof(struct sd_node);
 
-	if (timestamp) {
-		ret = xread(fd, timestamp, sizeof(*timestamp));
-		if (ret != sizeof(*timestamp)) {
-			sd_err("invalid epoch %"PRIu32" log", epoch);
-			goto err;
-		}
+	ret = xread(fd, timestamp, sizeof(*timestamp));
+	if (ret != sizeof(*timestamp)) {
+		sd_err("invalid epoch %"PRIu32" log", epoch);
+		goto err;
 	}
 
 	close(fd);
 	return SD_RES_SUCCESS;
 err:
+	free(*nodes);
+	*nodes = NULL;
 	if (fd >= 0)
 		close(fd);
 	return SD_RES_NO_TAG;
 }
 
+static int copy_epoch_log(const struct sd_node *src, int nr, time_t t,
+			  struct sd_node *nodes, int len, int *nr_nodes,
+			  time_t *timestamp)
+{
+	if (len < nr * sizeof(*src))
+		return SD_RES_BUFFER_SMALL;
+
+	memcpy(nodes, src, nr * sizeof(*src));
+	*nr_nodes = nr;
+	if (timestamp)
+		*timestamp = t;
+	return SD_RES_SUCCESS;
+}
+
+static int do_epoch_log_read(uint32_t epoch, struct sd_node *nodes, int len,
+			     int *nr_nodes, time_t *timestamp)
+{
+	struct epoch_cache_entry *e = epoch_cache + epoch % EPOCH_CACHE_SIZE;
+	struct sd_node *buf;
+	int ret, nr;
+	time_t t;
+
+	sd_mutex_lock(&epoch_cache_lock);
+	if (e->epoch == epoch) {
+		ret = copy_epoch_log(e->nodes, e->nr_nodes, e->timestamp, nodes,
+				     len, nr_nodes, timestamp);
+		sd_mutex_unlock(&epoch_cache_lock);
+		return ret;
+	}
+
+	/*
+	 * Read the file under the lock, or the epoch could be updated or
+	 * removed meanwhile and what we read would replace the newer entry.
+	 */
+	ret = epoch_file_read(epoch, &buf, &nr, &t);
+	if (ret != SD_RES_SUCCESS) {
+		sd_mutex_unlock(&epoch_cache_lock);
+		return ret;
+	}
+	epoch_cache_insert(epoch, buf, nr, t);
+	sd_mutex_unlock(&epoch_cache_lock);
+
+	ret = copy_epoch_log(buf, nr, t, nodes, len, nr_nodes, timestamp);
+	free(buf);
+	return ret;
+}
+
 int epoch_log_read(uint32_t epoch, struct sd_node *nodes,
 				int len, int *nr_nodes)
 {
@@ -209,7 +598,7 @@ int epoch_log_read_with_timestamp(uint32_t epoch, struct sd_node *nodes,
 	return do_epoch_log_read(epoch, nodes, len, nr_nodes, timestamp);
 }
 
-uint32_t get_latest_epoch(void)
+static uint32_t scan_latest_epoch(void)
 {
 	DIR *dir;
 	struct dirent *d;
@@ -236,6 +625,21 @@ uint32_t get_latest_epoch(void)
 	return epoch;
 }
 
+uint32_t get_latest_epoch(void)
+{
+	uint32_t epoch;
+
+	sd_mutex_lock(&epoch_cache_lock);
+	if (!latest_epoch_valid) {
+		latest_epoch = scan_latest_epoch();
+		latest_epoch_valid = true;
+	}
+	epoch = latest_epoch;
+	sd_mutex_unlock(&epoch_cache_lock);
+
+	return epoch;
+}
+
 int lock_base_dir(const char *d)
 {
 #define LOCK_PATH "/lock"
@@ -352,6 +756,39 @@ static int init_epoch_path(const char *base_path)
 	return xmkdir(epoch_path, sd_def_dmode);
 }
 
+/* The progress of the vdi deletions, see delete_objects() */
+static int init_deletion_path(const char *base_path)
+{
+#define DELETION_PATH "/deletion/"
+	int len = strlen(base_path) + strlen(DELETION_PATH) + 1;
+	deletion_path = xzalloc(len);
+	snprintf(deletion_path, len, "%s" DELETION_PATH, base_path);
+
+	return xmkdir(deletion_path, sd_def_dmode);
+}
+
+/* The progress of the vdi conversions, see vdi_convert() */
+static int init_convert_path(const char *base_path)
+{
+#define CONVERT_PATH "/convert/"
+	int len = strlen(base_path) + strlen(CONVERT_PATH) + 1;
+	convert_path = xzalloc(len);
+	snprintf(convert_path, len, "%s" CONVERT_PATH, base_path);
+
+	return xmkdir(convert_path, sd_def_dmode);
+}
+
+/* The allocation windows of the http data vdis, see oalloc.c */
+static int init_oalloc_path(const char *base_path)
+{
+#define OALLOC_PATH "/oalloc/"
+	int len = strlen(base_path) + strlen(OALLOC_PATH) + 1;
+	oalloc_path = xzalloc(len);
+	snprintf(oalloc_path, len, "%s" OALLOC_PATH, base_path);
+
+	return xmkdir(oalloc_path, sd_def_dmode);
+}
+
 /*
  * If the node is gateway, this function only finds the store driver.
  * Otherwise, this function initializes the backend store
@@ -452,9 +889,21 @@ int init_global_pathnames(const char *d, char *argp)
 	if (ret)
 		return ret;
 
+	ret = init_deletion_path(d);
+	if (ret)
+		return ret;
+
+	ret = init_convert_path(d);
+	if (ret)
+		return ret;
+
+	ret = init_oalloc_path(d);
+	if (ret)
+		return ret;
+
 	init_config_path(d);
 
-	return 0;
+	return init_startup_state_path(d);
 }
 
 static int __sd_write_object(uint64_t oid, char *data, unsigned int datalen,
@@ -473,6 +922,7 @@ static int __sd_write_object(uint64_t oid, char *data, unsigned int datalen,
 	hdr.obj.oid = oid;
 	hdr.obj.offset = offset;
 
+	sd_inode_invalidate_cache_oid(oid, true);
 	ret = exec_local_req(&hdr, data);
 	if (ret != SD_RES_SUCCESS)
 		sd_err("failed to write object %016" PRIx64 ", %s", oid,
@@ -506,6 +956,7 @@ static int __sd_read_object(uint64_t oid, char *data, unsigned int datalen,
 	hdr.obj.offset = offset;
 	hdr.flags = flags;
 
+	sd_inode_invalidate_cache_oid(oid, false);
 	ret = exec_local_req(&hdr, data);
 	if (ret != SD_RES_SUCCESS)
 		sd_err("failed to read object %016" PRIx64 ", %s", oid,
@@ -541,15 +992,16 @@ int sd_remove_object(uint64_t oid)
 	return ret;
 }
 
+/* Drop 'nr' references of 'generation', whose counts sum up to 'refcnt' */
 int sd_dec_object_refcnt(uint64_t data_oid, uint32_t generation,
-			 uint32_t refcnt)
+			 uint32_t refcnt, uint32_t nr)
 {
 	struct sd_req hdr;
 	int ret;
 	uint64_t ledger_oid = data_oid_to_ledger_oid(data_oid);
 
-	sd_debug("%016"PRIx64", %" PRId32 ", %" PRId32,
-		 data_oid, generation, refcnt);
+	sd_debug("%016"PRIx64", %" PRId32 ", %" PRId32 ", %" PRId32,
+		 data_oid, generation, refcnt, nr);
 
 	if (generation == 0 && refcnt == 0)
 		return sd_remove_object(data_oid);
@@ -558,6 +1010,7 @@ int sd_dec_object_refcnt(uint64_t data_oid, uint32_t generation,
 	hdr.ref.oid = ledger_oid;
 	hdr.ref.generation = generation;
 	hdr.ref.count = refcnt;
+	hdr.ref.nr = nr;
 	/*
 	 * decrements are always performed in the gateway threads, so it must
 	 * avoid the cyclic dependency of workqueue.
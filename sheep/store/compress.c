@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Transparent compression of the data objects
+ *
+ * The data objects of a vdi created with SD_INODE_COMPRESS are compressed with
+ * zstd in SD_COMPRESS_NR_CHUNKS chunks of the same size.  Each chunk keeps its
+ * place in the object file: its frame is written at the head of the slot and
+ * the rest of the slot is punched, so that the file is as large as the object
+ * but only takes the compressed size on the disk, and no space has to be
+ * managed when a chunk grows.  The index of the frame lengths is kept in the
+ * COMPRESSNAME xattr of the file.  A read decompresses only the chunks which
+ * cover it, and a write compresses only the chunks it touches, after reading
+ * the partially written ones.
+ *
+ * The index is updated after the chunks, and the frames have a checksum, so a
+ * crash in between makes the chunk fail to read instead of returning wrong
+ * data.  The I/O is done in whole blocks of aligned buffers, so O_DIRECT works
+ * as with the other objects.
+ *
+ * Only the replicated data objects on the plain layout are compressed.  The
+ * writes to the compressed objects skip the journal, which can't replay them,
+ * and the sparse copy-on-write objects are left as-is.  The recovery copies
+ * the data through the store driver, so a copy is compressed if its vdi is.
+ */
+
+#include <zstd.h>
+
+#include "sheep_priv.h"
+
+#define COMPRESS_LEVEL 3
+#define NR_COMPRESS_LOCKS 64
+
+/* serialize the writes of the same object with its reads */
+static struct sd_rw_lock compress_locks[NR_COMPRESS_LOCKS] = {
+	[0 ... NR_COMPRESS_LOCKS - 1] = SD_RW_LOCK_INITIALIZER
+};
+
+struct compress_ctx {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+};
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+
+static void free_ctx(void *p)
+{
+	struct compress_ctx *ctx = p;
+
+	ZSTD_freeCCtx(ctx->cctx);
+	ZSTD_freeDCtx(ctx->dctx);
+	free(ctx);
+}
+
+static void init_ctx_key(void)
+{
+	if (pthread_key_create(&ctx_key, free_ctx))
+		panic("failed to create the key of zstd contexts");
+}
+
+/* The contexts are per thread and freed when the worker thread exits */
+static struct compress_ctx *get_ctx(void)
+{
+	struct compress_ctx *ctx;
+
+	pthread_once(&ctx_once, init_ctx_key);
+	ctx = pthread_getspecific(ctx_key);
+	if (likely(ctx))
+		return ctx;
+
+	ctx = xzalloc(sizeof(*ctx));
+	ctx->cctx = ZSTD_createCCtx();
+	ctx->dctx = ZSTD_createDCtx();
+	if (!ctx->cctx || !ctx->dctx)
+		panic("failed to create zstd contexts");
+	ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel,
+			       COMPRESS_LEVEL);
+	ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_checksumFlag, 1);
+	pthread_setspecific(ctx_key, ctx);
+
+	return ctx;
+}
+
+static bool compress_supported(uint64_t oid)
+{
+	return is_data_obj(oid) && !is_erasure_oid(oid) &&
+		!store_id_match(TREE_STORE) && !store_id_match(LOG_STORE) &&
+		!store_id_match(RAW_STORE);
+}
+
+/* Whether the new objects of oid are stored compressed */
+bool compress_enabled(uint64_t oid)
+{
+	return compress_supported(oid) &&
+		!uatomic_is_true(&sys->use_journal) &&
+		(get_vdi_flags(oid_to_vid(oid)) & SD_INODE_COMPRESS);
+}
+
+/*
+ * Whether the object file at path is compressed.  This doesn't touch the file
+ * unless the vdi of oid is compressed.
+ */
+bool compress_check(uint64_t oid, const char *path)
+{
+	if (!compress_supported(oid) || !vdi_is_compressed(oid_to_vid(oid)))
+		return false;
+
+	return getxattr(path, COMPRESSNAME, NULL, 0) > 0;
+}
+
+static struct sd_rw_lock *get_lock(uint64_t oid)
+{
+	return &compress_locks[sd_hash_oid(oid) % NR_COMPRESS_LOCKS];
+}
+
+/*
+ * The helpers below return -1 and set errno on failure.  A broken index or
+ * frame is EBADMSG, which isn't a failure of the disk.
+ */
+static int to_sderr(uint64_t oid, const char *path, int err)
+{
+	if (err == EBADMSG)
+		return SD_RES_EIO;
+	return err_to_sderr(path, oid, err);
+}
+
+static int read_index(uint64_t oid, int fd, const char *path,
+		      struct compress_index *idx)
+{
+	ssize_t ret = fgetxattr(fd, COMPRESSNAME, idx, sizeof(*idx));
+
+	if (ret < 0)
+		return -1;
+	if (ret != sizeof(*idx) ||
+	    idx->chunk_size * SD_COMPRESS_NR_CHUNKS != get_store_objsize(oid))
+		goto broken;
+	for (int i = 0; i < SD_COMPRESS_NR_CHUNKS; i++)
+		if (idx->len[i] > idx->chunk_size)
+			goto broken;
+
+	return 0;
+broken:
+	sd_err("broken index of %s", path);
+	errno = EBADMSG;
+	return -1;
+}
+
+static int write_index(int fd, const struct compress_index *idx, bool sync)
+{
+	if (fsetxattr(fd, COMPRESSNAME, idx, sizeof(*idx), 0) < 0)
+		return -1;
+	if (sync && fsync(fd) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t count, off_t offset)
+{
+	ssize_t ret = xpread(fd, buf, count, offset);
+
+	if (ret == count)
+		return 0;
+	if (ret >= 0)
+		errno = EBADMSG;
+	return -1;
+}
+
+/* Read the chunk i into buf, tmp is for the frame */
+static int read_chunk(int fd, const char *path,
+		      const struct compress_index *idx, uint32_t i, char *buf,
+		      char *tmp)
+{
+	uint32_t size = idx->chunk_size, len = idx->len[i];
+	off_t off = (off_t)i * size;
+	size_t ret;
+
+	if (!len) {
+		memset(buf, 0, size);
+		return 0;
+	}
+	if (len == size)
+		return pread_full(fd, buf, size, off);
+
+	if (pread_full(fd, tmp, round_up(len, BLOCK_SIZE), off) < 0)
+		return -1;
+	ret = ZSTD_decompressDCtx(get_ctx()->dctx, buf, size, tmp, len);
+	if (ZSTD_isError(ret) || ret != size) {
+		sd_err("failed to decompress the chunk %"PRIu32" of %s, %s",
+		       i, path,
+		       ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "short");
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Store the chunk i from buf and set its length in idx, tmp is for the frame */
+static int write_chunk(int fd, struct compress_index *idx, uint32_t i,
+		       const char *buf, char *tmp)
+{
+	static bool punch_is_supported = true;
+	uint32_t size = idx->chunk_size, len = size, alen = size;
+	off_t off = (off_t)i * size;
+	uint64_t head = 0;
+	uint32_t nonzero = size;
+	size_t ret;
+
+	find_zero_blocks(buf, &head, &nonzero);
+	if (!nonzero) {
+		len = alen = 0;
+		goto punch;
+	}
+
+	ret = ZSTD_compress2(get_ctx()->cctx, tmp, size, buf, size);
+	if (!ZSTD_isError(ret) && round_up(ret, BLOCK_SIZE) < size) {
+		len = ret;
+		alen = round_up(len, BLOCK_SIZE);
+		memset(tmp + len, 0, alen - len);
+		buf = tmp;
+	}
+
+	if (xpwrite(fd, buf, alen, off) != alen)
+		return -1;
+punch:
+	/* a stale tail is never read, punching it only saves the space */
+	if (alen < size && punch_is_supported &&
+	    discard(fd, off + alen, off + size) < 0)
+		punch_is_supported = false;
+
+	idx->len[i] = len;
+	return 0;
+}
+
+/*
+ * Write the chunks of a new object from iocb to the empty file fd, whose object
+ * file is path.  The rest of the object is zero.
+ */
+int compress_create(uint64_t oid, int fd, const char *path,
+		    const struct siocb *iocb)
+{
+	uint32_t size = get_store_objsize(oid) / SD_COMPRESS_NR_CHUNKS;
+	uint32_t end = iocb->offset + iocb->length;
+	struct compress_index idx = { .chunk_size = size };
+	char *buf, *tmp;
+	int ret = SD_RES_SUCCESS;
+
+	if (xftruncate(fd, get_store_objsize(oid)) < 0)
+		return err_to_sderr(path, oid, errno);
+
+	buf = xvalloc(size);
+	tmp = xvalloc(size);
+	for (uint32_t i = iocb->offset / size; i < DIV_ROUND_UP(end, size);
+	     i++) {
+		uint32_t s = max(i * size, iocb->offset);
+		uint32_t e = min((i + 1) * size, end);
+
+		memset(buf, 0, size);
+		memcpy(buf + s - i * size, (char *)iocb->buf + s - iocb->offset,
+		       e - s);
+		if (write_chunk(fd, &idx, i, buf, tmp) < 0)
+			goto err;
+	}
+
+	/* the index must be there as soon as the object is */
+	if (write_index(fd, &idx, sync_writes()) < 0)
+		goto err;
+	goto out;
+err:
+	ret = to_sderr(oid, path, errno);
+out:
+	free(buf);
+	free(tmp);
+	return ret;
+}
+
+/*
+ * The errors are converted after the lock is released, since the handling of
+ * a broken disk waits for the moves of md.c, which take the lock.
+ */
+int compress_read(uint64_t oid, int fd, const char *path,
+		  const struct siocb *iocb)
+{
+	uint32_t size, end = iocb->offset + iocb->length;
+	struct sd_rw_lock *lock = get_lock(oid);
+	struct compress_index idx;
+	char *buf = NULL, *tmp = NULL;
+	int err = 0;
+
+	sd_read_lock(lock);
+	if (read_index(oid, fd, path, &idx) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	size = idx.chunk_size;
+	buf = xvalloc(size);
+	tmp = xvalloc(size);
+	for (uint32_t i = iocb->offset / size; i < DIV_ROUND_UP(end, size);
+	     i++) {
+		uint32_t s = max(i * size, iocb->offset);
+		uint32_t e = min((i + 1) * size, end);
+
+		if (read_chunk(fd, path, &idx, i, buf, tmp) < 0) {
+			err = errno;
+			goto out;
+		}
+		memcpy((char *)iocb->buf + s - iocb->offset,
+		       buf + s - i * size, e - s);
+	}
+out:
+	sd_rw_unlock(lock);
+	free(buf);
+	free(tmp);
+	return err ? to_sderr(oid, path, err) : SD_RES_SUCCESS;
+}
+
+int compress_write(uint64_t oid, int fd, const char *path,
+		   const struct siocb *iocb, bool sync)
+{
+	uint32_t size, end = iocb->offset + iocb->length;
+	struct sd_rw_lock *lock = get_lock(oid);
+	struct compress_index idx;
+	char *buf = NULL, *tmp = NULL;
+	int err = 0;
+
+	sd_write_lock(lock);
+	if (read_index(oid, fd, path, &idx) < 0)
+		goto err;
+
+	size = idx.chunk_size;
+	buf = xvalloc(size);
+	tmp = xvalloc(size);
+	for (uint32_t i = iocb->offset / size; i < DIV_ROUND_UP(end, size);
+	     i++) {
+		uint32_t s = max(i * size, iocb->offset);
+		uint32_t e = min((i + 1) * size, end);
+
+		/* the partially written chunks are read first */
+		if (e - s < size &&
+		    read_chunk(fd, path, &idx, i, buf, tmp) < 0)
+			goto err;
+		memcpy(buf + s - i * size, (char *)iocb->buf + s - iocb->offset,
+		       e - s);
+		if (write_chunk(fd, &idx, i, buf, tmp) < 0)
+			goto err;
+	}
+
+	if (write_index(fd, &idx, sync) < 0)
+		goto err;
+	goto out;
+err:
+	err = errno;
+out:
+	sd_rw_unlock(lock);
+	free(buf);
+	free(tmp);
+	return err ? to_sderr(oid, path, err) : SD_RES_SUCCESS;
+}
+
+/*
+ * Copy the compressed object at old to new like atomic_create_and_write(), for
+ * moving it to another disk.  The frames are copied as they are.
+ */
+int compress_copy_file(uint64_t oid, const char *old, const char *new)
+{
+	struct sd_rw_lock *lock = get_lock(oid);
+	char tmp_path[PATH_MAX], *buf;
+	struct compress_index idx;
+	int fd, new_fd, ret = -1;
+
+	fd = open(old, O_RDONLY);
+	if (fd < 0) {
+		sd_err("failed to open %s, %m", old);
+		return -1;
+	}
+
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", new);
+	new_fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, sd_def_fmode);
+	if (new_fd < 0) {
+		if (errno != EEXIST)
+			sd_err("failed to open temporal file %s, %m", tmp_path);
+		close(fd);
+		return -1;
+	}
+
+	sd_read_lock(lock);
+	if (read_index(oid, fd, old, &idx) < 0 ||
+	    xftruncate(new_fd, get_store_objsize(oid)) < 0)
+		goto err;
+
+	buf = xvalloc(idx.chunk_size);
+	for (uint32_t i = 0; i < SD_COMPRESS_NR_CHUNKS; i++) {
+		uint32_t alen = round_up(idx.len[i], BLOCK_SIZE);
+		off_t off = (off_t)i * idx.chunk_size;
+
+		if (pread_full(fd, buf, alen, off) < 0 ||
+		    xpwrite(new_fd, buf, alen, off) != alen) {
+			free(buf);
+			goto err;
+		}
+	}
+	free(buf);
+
+	if (write_index(new_fd, &idx, true) < 0)
+		goto err;
+	if (rename(tmp_path, new) < 0)
+		goto err;
+	ret = 0;
+	goto out;
+err:
+	sd_err("failed to copy %s to %s, %m", old, new);
+	unlink(tmp_path);
+out:
+	sd_rw_unlock(lock);
+	close(new_fd);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Copy-on-write at extent granularity
+ *
+ * The first write of a snapshot child to an object of its parent doesn't copy
+ * the whole parent object.  The gateway creates the child object with only
+ * the written range, rounded out to extents of 1/SD_COW_NR_EXTENTS of the
+ * object, and each replica records the extents it holds in the COWNAME xattr
+ * of the object file.  The peers fill the other extents from the parent
+ * object when they are read, and copy an extent from the parent before a
+ * partial write to it.  Once all the extents are written, the map is dropped
+ * and the object is an ordinary one.
+ *
+ * A sparse object holds its own reference to the parent object, taken by the
+ * gateway from the reference of the child inode, so that the parent object
+ * isn't reclaimed under it.  The first replica drops the reference when the
+ * map is dropped or the object is removed.
+ *
+ * Recovery copies the map along with the data and never reads the parent,
+ * which might be waiting for this very recovery.  Only the replicated data
+ * objects on the plain layout without the journal are made sparse, since the
+ * journal doesn't replay the maps.
+ */
+
+#include "sheep_priv.h"
+
+#define NR_COW_LOCKS 64
+
+/* serialize the map updates of the same object */
+static struct sd_mutex cow_locks[NR_COW_LOCKS] = {
+	[0 ... NR_COW_LOCKS - 1] = SD_MUTEX_INITIALIZER
+};
+
+bool cow_supported(uint64_t oid)
+{
+	return is_data_obj(oid) && !is_erasure_oid(oid) &&
+		data_oid_to_idx(oid) < SD_INODE_DATA_INDEX &&
+		!store_id_match(TREE_STORE) && !store_id_match(LOG_STORE) &&
+		!store_id_match(RAW_STORE);
+}
+
+uint32_t cow_extent_size(uint64_t oid)
+{
+	uint32_t object_size = get_vdi_object_size(oid_to_vid(oid));
+
+	return get_objsize(oid, object_size) / SD_COW_NR_EXTENTS;
+}
+
+static void get_cow_path(uint64_t oid, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/%016"PRIx64, md_get_object_dir(oid), oid);
+}
+
+/*
+ * Return 1 if the object file at path has a map, 0 if not, and -1 on error,
+ * e.g. ENOENT if there is no such file.
+ */
+int cow_read_map(const char *path, struct cow_map *map)
+{
+	ssize_t ret = getxattr(path, COWNAME, map, sizeof(*map));
+
+	if (ret == sizeof(*map))
+		return 1;
+	if (ret >= 0) {
+		sd_err("broken map of %s, %zd bytes", path, ret);
+		errno = EIO;
+		return -1;
+	}
+	if (errno == ENODATA || errno == ENOTSUP)
+		return 0;
+	if (errno != ENOENT)
+		sd_err("failed to get the map of %s, %m", path);
+
+	return -1;
+}
+
+/* Look up the map of the object file which sd_store->read() reads */
+int cow_get_map(uint64_t oid, const struct siocb *iocb, struct cow_map *map)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	if (!cow_supported(oid))
+		return 0;
+
+	get_cow_path(oid, path);
+	ret = cow_read_map(path, map);
+	if (ret >= 0 || errno != ENOENT)
+		return ret;
+
+	if (iocb->wildcard || (0 < iocb->epoch && iocb->epoch < sys_epoch())) {
+		md_get_stale_path(oid, iocb->epoch, 0, path);
+		ret = cow_read_map(path, map);
+	}
+
+	return ret;
+}
+
+static int set_map(uint64_t oid, const char *path, const struct cow_map *map)
+{
+	int fd, ret = SD_RES_SUCCESS;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return err_to_sderr(path, oid, errno);
+
+	if (fsetxattr(fd, COWNAME, map, sizeof(*map), 0) < 0) {
+		sd_err("failed to set the map of %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+	} else if (sync_writes() && fsync(fd) < 0) {
+		sd_err("failed to sync %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+	}
+
+	close(fd);
+	return ret;
+}
+
+/* Only one replica drops the reference of the map to the parent object */
+static void put_parent(uint64_t oid, const struct cow_map *map,
+		       struct vnode_info *vinfo)
+{
+	const struct sd_node *nodes[SD_MAX_COPIES];
+	int ret;
+
+	vinfo_oid_to_nodes(vinfo, oid, 1, nodes);
+	if (!node_is_local(nodes[0]))
+		return;
+
+	ret = sd_dec_object_refcnt(map->parent_oid, map->ref.generation,
+				   map->ref.count, 1);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to put %016"PRIx64" of %016"PRIx64", %s",
+		       map->parent_oid, oid, sd_strerror(ret));
+}
+
+/*
+ * Create the sparse copy of parent_oid with the extents which iocb covers.
+ * 'generation' is of the reference to the parent which the gateway took for
+ * this object.
+ */
+int cow_create_and_write(uint64_t oid, const struct siocb *iocb,
+			 uint64_t parent_oid, uint32_t generation)
+{
+	uint32_t ext = cow_extent_size(oid);
+	struct siocb cow_iocb = *iocb;
+	struct cow_map map = {
+		.parent_oid = parent_oid,
+		.ref = { .generation = generation },
+	};
+
+	if (!cow_supported(oid) || uatomic_is_true(&sys->use_journal) ||
+	    !iocb->length || iocb->offset % ext || iocb->length % ext)
+		return SD_RES_INVALID_PARMS;
+
+	for (uint32_t i = 0; i < iocb->length / ext; i++)
+		set_bit(iocb->offset / ext + i, map.bitmap);
+	cow_iocb.cow = &map;
+
+	return sd_store->create_and_write(oid, &cow_iocb);
+}
+
+/* Copy the extent 'idx' of the parent into the object */
+static int fill_extent(uint64_t oid, const struct siocb *iocb,
+		       const struct cow_map *map, uint32_t idx)
+{
+	uint32_t ext = cow_extent_size(oid);
+	struct siocb fill = *iocb;
+	int ret;
+
+	fill.buf = xvalloc(ext);
+	fill.length = ext;
+	fill.offset = idx * ext;
+	ret = sd_read_object_fwd(map->parent_oid, fill.buf, ext, fill.offset);
+	if (ret == SD_RES_SUCCESS)
+		ret = sd_store->write(oid, &fill);
+	else
+		sd_err("failed to read %016"PRIx64" for %016"PRIx64", %s",
+		       map->parent_oid, oid, sd_strerror(ret));
+
+	free(fill.buf);
+	return ret;
+}
+
+/*
+ * Write to an object which may be sparse.  The partially written extents
+ * which we don't hold yet are copied from the parent first, and the map is
+ * updated after the write, so that a crash in between only loses the write
+ * which wasn't acknowledged yet.
+ */
+int cow_write(uint64_t oid, const struct siocb *iocb,
+	      struct vnode_info *vinfo)
+{
+	uint32_t ext, first, last, end = iocb->offset + iocb->length;
+	char path[PATH_MAX];
+	struct sd_mutex *lock;
+	struct cow_map map;
+	bool changed = false;
+	int ret;
+
+	if (!cow_supported(oid) || !iocb->length)
+		return sd_store->write(oid, iocb);
+
+	/* sparse objects are only made at creation */
+	get_cow_path(oid, path);
+	ret = cow_read_map(path, &map);
+	if (ret <= 0)
+		return ret < 0 && errno != ENOENT ? SD_RES_EIO :
+			sd_store->write(oid, iocb);
+
+	lock = &cow_locks[sd_hash_oid(oid) % NR_COW_LOCKS];
+	sd_mutex_lock(lock);
+	ret = cow_read_map(path, &map);
+	if (ret <= 0) {
+		/* the object was filled in the meantime */
+		sd_mutex_unlock(lock);
+		return ret < 0 && errno != ENOENT ? SD_RES_EIO :
+			sd_store->write(oid, iocb);
+	}
+
+	ext = cow_extent_size(oid);
+	first = iocb->offset / ext;
+	last = DIV_ROUND_UP(end, ext) - 1;
+	if (iocb->offset % ext && !test_bit(first, map.bitmap)) {
+		ret = fill_extent(oid, iocb, &map, first);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		set_bit(first, map.bitmap);
+		changed = true;
+	}
+	if (end % ext && !test_bit(last, map.bitmap)) {
+		ret = fill_extent(oid, iocb, &map, last);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	ret = sd_store->write(oid, iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	for (uint32_t i = first; i <= last; i++) {
+		if (!test_bit(i, map.bitmap)) {
+			set_bit(i, map.bitmap);
+			changed = true;
+		}
+	}
+	if (!changed)
+		goto out;
+
+	if (find_next_zero_bit(map.bitmap, SD_COW_NR_EXTENTS, 0) <
+	    SD_COW_NR_EXTENTS) {
+		ret = set_map(oid, path, &map);
+		goto out;
+	}
+
+	/* drop the map before the reference not to drop it twice */
+	sd_debug("%016"PRIx64" is filled", oid);
+	if (removexattr(path, COWNAME) < 0) {
+		sd_err("failed to remove the map of %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	put_parent(oid, &map, vinfo);
+out:
+	sd_mutex_unlock(lock);
+	return ret;
+}
+
+/* Read the extents of iocb which the object doesn't hold from the parent */
+int cow_fill(uint64_t oid, const struct siocb *iocb)
+{
+	uint32_t ext, i, last, end = iocb->offset + iocb->length;
+	struct cow_map map;
+	int ret;
+
+	ret = cow_get_map(oid, iocb, &map);
+	if (ret <= 0)
+		return ret < 0 ? SD_RES_EIO : SD_RES_SUCCESS;
+
+	/* the holes are filled from the parent */
+	if (iocb->extents)
+		iocb->extents->length = 0;
+
+	ext = cow_extent_size(oid);
+	last = DIV_ROUND_UP(end, ext);
+	for (i = iocb->offset / ext; i < last; ) {
+		uint32_t start, s, e;
+
+		if (test_bit(i, map.bitmap)) {
+			i++;
+			continue;
+		}
+
+		/* read the run of the missing extents at once */
+		for (start = i; i < last; i++)
+			if (test_bit(i, map.bitmap))
+				break;
+		s = max(start * ext, iocb->offset);
+		e = min(i * ext, end);
+		ret = sd_read_object_fwd(map.parent_oid,
+					 (char *)iocb->buf + s - iocb->offset,
+					 e - s, s);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to read %016"PRIx64" for %016"PRIx64
+			       ", %s", map.parent_oid, oid, sd_strerror(ret));
+			return ret;
+		}
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+int cow_remove_object(uint64_t oid, uint8_t ec_index,
+		      struct vnode_info *vinfo)
+{
+	char path[PATH_MAX];
+	struct cow_map map;
+	int ret, has_map = 0;
+
+	if (cow_supported(oid)) {
+		get_cow_path(oid, path);
+		has_map = cow_read_map(path, &map);
+	}
+
+	ret = sd_store->remove_object(oid, ec_index);
+	if (ret == SD_RES_SUCCESS && has_map > 0)
+		put_parent(oid, &map, vinfo);
+
+	return ret;
+}
+
+/* Mix the map of the object into sha1, so that equal digests mean equal maps */
+void cow_hash_map(const char *path, uint8_t *sha1)
+{
+	struct sha1_ctx c;
+	struct cow_map map;
+
+	if (cow_read_map(path, &map) <= 0)
+		return;
+
+	sha1_init(&c);
+	sha1_update(&c, sha1, SHA1_DIGEST_SIZE);
+	sha1_update(&c, (uint8_t *)&map, sizeof(map));
+	sha1_final(&c, sha1);
+}
+
+/*
+ * Create path with buf and the map like atomic_create_and_write(), for moving
+ * a sparse object to another disk
+ */
+int cow_create_file(const char *path, const char *buf, size_t len,
+		    const struct cow_map *map)
+{
+	char tmp_path[PATH_MAX];
+	int fd, ret = -1;
+
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_SYNC | O_EXCL, sd_def_fmode);
+	if (fd < 0) {
+		if (errno != EEXIST)
+			sd_err("failed to open temporal file %s, %m", tmp_path);
+		return -1;
+	}
+
+	if (xwrite(fd, buf, len) != len) {
+		sd_err("failed to write %s, %m", path);
+		goto err;
+	}
+	if (fsetxattr(fd, COWNAME, map, sizeof(*map), 0) < 0 ||
+	    fsync(fd) < 0) {
+		sd_err("failed to set the map of %s, %m", path);
+		goto err;
+	}
+	if (rename(tmp_path, path) < 0) {
+		sd_err("failed to rename %s, %m", path);
+		goto err;
+	}
+	ret = 0;
+	goto out;
+err:
+	unlink(tmp_path);
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Create the object with the whole data unless it exists already, for the
+ * background pre-copy of precopy.c.  The file is written unnamed and linked
+ * into place, so that it never replaces the copy which a foreground
+ * copy-on-write made in the meantime, nor is left half written on a crash.
+ */
+int cow_create_excl(uint64_t oid, const struct siocb *iocb)
+{
+	char path[PATH_MAX], fd_path[PATH_MAX];
+	const char *dir;
+	int fd, ret = SD_RES_SUCCESS;
+
+	if (!cow_supported(oid) || uatomic_is_true(&sys->use_journal) ||
+	    iocb->offset || iocb->length != get_store_objsize(oid))
+		return SD_RES_INVALID_PARMS;
+
+	md_tier_new_object(oid, iocb->ec_index);
+	dir = md_get_object_dir(oid);
+	get_cow_path(oid, path);
+	fd = open(dir, O_TMPFILE | O_WRONLY, sd_def_fmode);
+	if (fd < 0) {
+		sd_err("failed to create an unnamed file in %s, %m", dir);
+		if (errno == EOPNOTSUPP || errno == EISDIR)
+			return SD_RES_INVALID_PARMS;
+		return err_to_sderr(path, oid, errno);
+	}
+
+	if (compress_enabled(oid)) {
+		ret = compress_create(oid, fd, path, iocb);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	} else if (xpwrite(fd, iocb->buf, iocb->length, 0) != iocb->length ||
+		   (sync_writes() && fsync(fd) < 0)) {
+		sd_err("failed to write %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	if (linkat(AT_FDCWD, fd_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW) < 0) {
+		if (errno == EEXIST) {
+			sd_debug("%016"PRIx64" exists", oid);
+			ret = SD_RES_OID_EXIST;
+		} else {
+			sd_err("failed to link %s, %m", path);
+			ret = err_to_sderr(path, oid, errno);
+		}
+		goto out;
+	}
+	objlist_cache_insert(oid);
+out:
+	close(fd);
+	return ret;
+}
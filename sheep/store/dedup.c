@@ -0,0 +1,361 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Deduplication of the read-only objects
+ *
+ * The data objects of the snapshots are never written again, so the identical
+ * ones can share a file.  A low priority work scans the object directories of
+ * this sheep every 'interval' seconds, fingerprints the read-only data objects
+ * by the SHA1 which default_get_hash() caches in their xattr, and replaces the
+ * duplicates on the same disk with hard links to one file.  The link count of
+ * the file is its reference count: the removal of an object only drops its
+ * name, and the recovery and the stale directories move the names like the
+ * ones of the other files.  The candidates are compared byte by byte before
+ * they are linked.
+ *
+ * The read-only objects are still written by the repairs of 'dog vdi check',
+ * so their writes are serialized with the linking by dedup_lock, and get a
+ * file of their own first.
+ *
+ * The fingerprint index only lives during a scan, so there is nothing to
+ * recover after a crash.  The writable, sparse, compressed and erasure coded
+ * objects are left alone, and so is the tree store.
+ */
+
+#include <dirent.h>
+#include <sys/syscall.h>
+
+#include "sheep_priv.h"
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+struct dedup_entry {
+	struct rb_node rb;
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	uint64_t oid;
+	ino_t ino;
+};
+
+struct dedup_scan {
+	struct rb_root root;
+	const char *dir;
+	uint64_t nr_scanned;
+	uint64_t nr_linked;
+	uint64_t saved;
+};
+
+static struct sd_mutex dedup_lock = SD_MUTEX_INITIALIZER;
+static uint32_t dedup_interval;
+static struct work_queue *dedup_wq;
+static struct timer dedup_timer;
+static struct work dedup_work;
+
+/* the disks, copied out of md not to hold its lock during the scan */
+static char **dedup_dirs;
+static int nr_dedup_dirs;
+
+static int dedup_entry_cmp(const struct dedup_entry *a,
+			   const struct dedup_entry *b)
+{
+	return memcmp(a->sha1, b->sha1, SHA1_DIGEST_SIZE);
+}
+
+static ssize_t read_file(const char *path, char *buf, size_t len)
+{
+	int fd = open(path, O_RDONLY);
+	ssize_t ret;
+
+	if (fd < 0)
+		return -1;
+
+	ret = xpread(fd, buf, len, 0);
+	close(fd);
+	return ret;
+}
+
+static bool same_content(const char *a, const char *b, size_t len)
+{
+	char *abuf = xvalloc(len), *bbuf = xvalloc(len);
+	ssize_t alen = read_file(a, abuf, len);
+	bool ret;
+
+	ret = alen >= 0 && read_file(b, bbuf, len) == alen &&
+		memcmp(abuf, bbuf, alen) == 0;
+
+	free(abuf);
+	free(bbuf);
+	return ret;
+}
+
+static int __link_object(const char *src_path, const char *path,
+			 const char *tmp_path, uint64_t oid)
+{
+	if (!same_content(src_path, path, get_store_objsize(oid))) {
+		sd_warn("%s and %s differ in spite of their SHA1", src_path,
+			path);
+		return -1;
+	}
+
+	if (link(src_path, tmp_path) < 0) {
+		if (errno == EMLINK)
+			return -EMLINK;
+		sd_err("failed to link %s to %s, %m", tmp_path, src_path);
+		return -1;
+	}
+
+	if (syscall(SYS_renameat2, AT_FDCWD, tmp_path, AT_FDCWD, path,
+		    RENAME_EXCHANGE) < 0) {
+		if (errno != ENOENT)
+			sd_err("failed to exchange %s and %s, %m", tmp_path,
+			       path);
+		unlink(tmp_path);
+		return -1;
+	}
+	object_fd_invalidate(oid, 0);
+
+	/* the previous file of the object */
+	if (unlink(tmp_path) < 0)
+		sd_err("failed to unlink %s, %m", tmp_path);
+
+	return 0;
+}
+
+/*
+ * Replace the file of 'oid' with a link to the one of 'src'.  The files are
+ * exchanged, so an object which is removed in the meantime is not created
+ * again.  Return -EMLINK if the file of 'src' can't have more links.
+ */
+static int link_object(struct dedup_scan *ds, uint64_t src, uint64_t oid)
+{
+	char src_path[PATH_MAX], path[PATH_MAX], tmp_path[PATH_MAX];
+	int ret;
+
+	snprintf(src_path, sizeof(src_path), "%s/%016"PRIx64, ds->dir, src);
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, ds->dir, oid);
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.dedup.tmp", path) >=
+	    sizeof(tmp_path)) {
+		sd_err("too long path %s", path);
+		return -ENAMETOOLONG;
+	}
+
+	sd_mutex_lock(&dedup_lock);
+	ret = __link_object(src_path, path, tmp_path, oid);
+	sd_mutex_unlock(&dedup_lock);
+
+	return ret;
+}
+
+static void dedup_obj(struct dedup_scan *ds, uint64_t oid)
+{
+	struct dedup_entry *entry, *old;
+	char path[PATH_MAX];
+	struct cow_map map;
+	struct stat st;
+	int ret;
+
+	if (!is_data_obj(oid) || is_erasure_oid(oid) || !oid_is_readonly(oid))
+		return;
+
+	/*
+	 * the sparse objects refer to their parents, and the files of the
+	 * compressed ones aren't compared
+	 */
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, ds->dir, oid);
+	if (stat(path, &st) < 0 || cow_read_map(path, &map) != 0 ||
+	    compress_check(oid, path))
+		return;
+
+	entry = xzalloc(sizeof(*entry));
+	entry->oid = oid;
+	entry->ino = st.st_ino;
+	if (sd_store->get_hash(oid, sys_epoch(), entry->sha1) !=
+	    SD_RES_SUCCESS) {
+		free(entry);
+		return;
+	}
+	ds->nr_scanned++;
+
+	old = rb_insert(&ds->root, entry, rb, dedup_entry_cmp);
+	if (!old)
+		return;
+	free(entry);
+	if (old->ino == st.st_ino)
+		return;
+
+	ret = link_object(ds, old->oid, oid);
+	if (ret == 0) {
+		ds->nr_linked++;
+		ds->saved += st.st_blocks * 512;
+	} else if (ret == -EMLINK) {
+		/* the file is full of links, start another one */
+		old->oid = oid;
+		old->ino = st.st_ino;
+	}
+}
+
+/* Only the objects on the same disk can share a file */
+static void dedup_dir(struct dedup_scan *ds, const char *dir)
+{
+	struct dirent *d;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp) {
+		sd_err("failed to open %s, %m", dir);
+		return;
+	}
+
+	ds->dir = dir;
+	INIT_RB_ROOT(&ds->root);
+	while ((d = readdir(dp))) {
+		char *p;
+		uint64_t oid = strtoull(d->d_name, &p, 16);
+
+		/* skip the stale, erasure coded and temporary files */
+		if (p - d->d_name != 16 || *p)
+			continue;
+		dedup_obj(ds, oid);
+	}
+	closedir(dp);
+
+	rb_destroy(&ds->root, struct dedup_entry, rb);
+}
+
+/* Give the file of 'oid' at 'path' to the object alone */
+static int unshare_object(uint64_t oid, const char *path)
+{
+	char tmp_path[PATH_MAX], *buf = NULL;
+	int fd = -1, ret = SD_RES_SUCCESS;
+	struct stat st;
+
+	if (stat(path, &st) < 0 || st.st_nlink == 1)
+		return SD_RES_SUCCESS;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.dedup.tmp", path);
+	buf = xvalloc(st.st_size);
+	if (read_file(path, buf, st.st_size) != st.st_size) {
+		sd_err("failed to read %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, sd_def_fmode);
+	if (fd < 0 || xpwrite(fd, buf, st.st_size, 0) != st.st_size ||
+	    (sync_writes() && fsync(fd) < 0)) {
+		sd_err("failed to copy %s to %s, %m", path, tmp_path);
+		ret = err_to_sderr(path, oid, errno);
+		unlink(tmp_path);
+		goto out;
+	}
+
+	if (rename(tmp_path, path) < 0) {
+		sd_err("failed to rename %s to %s, %m", tmp_path, path);
+		ret = err_to_sderr(path, oid, errno);
+		unlink(tmp_path);
+		goto out;
+	}
+	object_fd_invalidate(oid, 0);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Called by the store drivers before a write to the read-only object 'oid'
+ * at 'path'.  dedup_end_write() must follow if this succeeds.
+ */
+int dedup_begin_write(uint64_t oid, const char *path)
+{
+	int ret;
+
+	sd_mutex_lock(&dedup_lock);
+	ret = unshare_object(oid, path);
+	if (ret != SD_RES_SUCCESS)
+		sd_mutex_unlock(&dedup_lock);
+
+	return ret;
+}
+
+void dedup_end_write(void)
+{
+	sd_mutex_unlock(&dedup_lock);
+}
+
+static int add_dedup_dir(const char *path)
+{
+	dedup_dirs = xrealloc(dedup_dirs,
+			      sizeof(*dedup_dirs) * (nr_dedup_dirs + 1));
+	dedup_dirs[nr_dedup_dirs++] = xstrdup(path);
+
+	return SD_RES_SUCCESS;
+}
+
+static void dedup_worker(struct work *work)
+{
+	struct dedup_scan ds = {};
+	uint64_t start = clock_get_time();
+
+	for (int i = 0; i < nr_dedup_dirs; i++)
+		free(dedup_dirs[i]);
+	nr_dedup_dirs = 0;
+	for_each_obj_path(add_dedup_dir);
+
+	for (int i = 0; i < nr_dedup_dirs; i++)
+		dedup_dir(&ds, dedup_dirs[i]);
+
+	if (ds.nr_linked)
+		sd_info("%"PRIu64" of %"PRIu64" objects deduplicated in "
+			"%"PRIu64" sec, %"PRIu64" MB saved", ds.nr_linked,
+			ds.nr_scanned, (clock_get_time() - start) / 1000000000,
+			ds.saved / 1024 / 1024);
+}
+
+static void dedup_done(struct work *work)
+{
+	add_timer(&dedup_timer, dedup_interval * 1000);
+}
+
+static void dedup_timer_fn(void *data)
+{
+	queue_work(dedup_wq, &dedup_work);
+}
+
+/* Called once the store is ready */
+int dedup_init(uint32_t interval)
+{
+	if (store_id_match(TREE_STORE) || store_id_match(LOG_STORE) ||
+	    store_id_match(RAW_STORE)) {
+		sd_err("the deduplication is not supported by the %s store",
+		       sd_store->name);
+		return -1;
+	}
+
+	dedup_wq = create_ordered_work_queue("dedup");
+	if (!dedup_wq)
+		return -1;
+	set_work_queue_priority(dedup_wq, WQ_PRIO_LOW);
+	set_work_queue_io_class(dedup_wq, IO_CLASS_BACKGROUND);
+
+	dedup_interval = interval;
+	dedup_work.fn = dedup_worker;
+	dedup_work.done = dedup_done;
+	dedup_timer.callback = dedup_timer_fn;
+	add_timer(&dedup_timer, dedup_interval * 1000);
+
+	sd_info("deduplicate the read-only objects every %"PRIu32" sec",
+		interval);
+	return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cache of open object files shared by the store drivers
+ *
+ * Object reads and writes used to stat(), open() and close() the object file
+ * for every request.  Instead, the fds are kept open and indexed by
+ * (oid, ec_index).  Each entry remembers the path and the open flags it was
+ * opened with; a lookup with a different path (md moved the object) drops the
+ * entry, and a lookup with different flags gets a private fd which is closed
+ * on put.
+ *
+ * The store drivers must invalidate the entry whenever the object file is
+ * replaced, moved or removed.
+ */
+
+#include "sheep_priv.h"
+
+#define MAX_CACHED_FDS	1024
+
+static struct rb_root fd_root = RB_ROOT;
+static LIST_HEAD(fd_lru);
+static int nr_cached_fds;
+static struct sd_mutex fd_lock = SD_MUTEX_INITIALIZER;
+
+static int object_fd_cmp(const struct object_fd *a, const struct object_fd *b)
+{
+	int ret = intcmp(a->oid, b->oid);
+
+	if (ret)
+		return ret;
+	return intcmp(a->ec_index, b->ec_index);
+}
+
+static void object_fd_release(struct object_fd *ofd)
+{
+	close(ofd->fd);
+	free(ofd);
+}
+
+/* Called with fd_lock held */
+static void object_fd_kill(struct object_fd *ofd)
+{
+	rb_erase(&ofd->node, &fd_root);
+	list_del(&ofd->lru);
+	nr_cached_fds--;
+	ofd->dead = true;
+	if (!ofd->refcnt)
+		object_fd_release(ofd);
+}
+
+/* Called with fd_lock held */
+static void object_fd_shrink(void)
+{
+	struct object_fd *ofd;
+
+	list_for_each_entry(ofd, &fd_lru, lru) {
+		if (nr_cached_fds < MAX_CACHED_FDS)
+			break;
+		if (!ofd->refcnt)
+			object_fd_kill(ofd);
+	}
+}
+
+static struct object_fd *alloc_object_fd(uint64_t oid, uint8_t ec_index,
+					 const char *path, int flags, int fd)
+{
+	struct object_fd *ofd = xzalloc(sizeof(*ofd));
+
+	ofd->oid = oid;
+	ofd->ec_index = ec_index;
+	ofd->fd = fd;
+	ofd->flags = flags;
+	ofd->refcnt = 1;
+	pstrcpy(ofd->path, sizeof(ofd->path), path);
+
+	return ofd;
+}
+
+/*
+ * Get the fd of the object file at 'path' opened with 'flags'
+ *
+ * The existence check of the store driver is done only when the object isn't
+ * cached.  Returns NULL and sets 'err' to a SD_RES_* code on failure.
+ */
+struct object_fd *object_fd_get(uint64_t oid, uint8_t ec_index,
+				const char *path, int flags, int *err)
+{
+	struct object_fd *ofd, *p, key = { .oid = oid, .ec_index = ec_index };
+	bool private = false;
+	int fd;
+
+	sd_mutex_lock(&fd_lock);
+	ofd = rb_search(&fd_root, &key, node, object_fd_cmp);
+	if (ofd) {
+		if (strcmp(ofd->path, path))
+			object_fd_kill(ofd);
+		else if (ofd->flags != flags)
+			private = true;
+		else {
+			ofd->refcnt++;
+			list_move_tail(&ofd->lru, &fd_lru);
+			sd_mutex_unlock(&fd_lock);
+			return ofd;
+		}
+	}
+	sd_mutex_unlock(&fd_lock);
+
+	/*
+	 * Make sure oid is in the right place because oid might be misplaced
+	 * in a wrong place, due to 'shutdown/restart with less/more disks' or
+	 * any bugs. We need call err_to_sderr() to return EIO if disk is broken
+	 */
+	if (!sd_store->exist(oid, ec_index)) {
+		*err = err_to_sderr(path, oid, ENOENT);
+		return NULL;
+	}
+
+	fd = open(path, flags, sd_def_fmode);
+	if (unlikely(fd < 0)) {
+		*err = err_to_sderr(path, oid, errno);
+		return NULL;
+	}
+
+	ofd = alloc_object_fd(oid, ec_index, path, flags, fd);
+	if (private) {
+		ofd->dead = true;
+		return ofd;
+	}
+
+	sd_mutex_lock(&fd_lock);
+	p = rb_insert(&fd_root, ofd, node, object_fd_cmp);
+	if (p) {
+		/* somebody else has cached it, keep ours private */
+		ofd->dead = true;
+	} else {
+		list_add_tail(&ofd->lru, &fd_lru);
+		nr_cached_fds++;
+		object_fd_shrink();
+	}
+	sd_mutex_unlock(&fd_lock);
+
+	return ofd;
+}
+
+void object_fd_put(struct object_fd *ofd)
+{
+	bool release;
+
+	sd_mutex_lock(&fd_lock);
+	release = !--ofd->refcnt && ofd->dead;
+	sd_mutex_unlock(&fd_lock);
+
+	if (release)
+		object_fd_release(ofd);
+}
+
+/* Must be called when the object file is replaced, moved or removed */
+void object_fd_invalidate(uint64_t oid, uint8_t ec_index)
+{
+	struct object_fd *ofd, key = { .oid = oid, .ec_index = ec_index };
+
+	sd_mutex_lock(&fd_lock);
+	ofd = rb_search(&fd_root, &key, node, object_fd_cmp);
+	if (ofd)
+		object_fd_kill(ofd);
+	sd_mutex_unlock(&fd_lock);
+}
+
+/* Drop all the cached fds under 'dir', or everything if 'dir' is NULL */
+void object_fd_invalidate_dir(const char *dir)
+{
+	struct object_fd *ofd;
+	size_t len = dir ? strlen(dir) : 0;
+
+	sd_mutex_lock(&fd_lock);
+	rb_for_each_entry(ofd, &fd_root, node) {
+		if (!dir || (!strncmp(ofd->path, dir, len) &&
+			     ofd->path[len] == '/'))
+			object_fd_kill(ofd);
+	}
+	sd_mutex_unlock(&fd_lock);
+}
@@ -0,0 +1,1103 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Log-structured store driver
+ *
+ * The plain and the tree stores keep an object per file, so a node with
+ * hundreds of millions of objects is bound by the inode and directory handling
+ * of the file system.  This driver appends the objects to large segment files
+ * in the LOG_DIR directory of each disk instead, and finds them with an index
+ * in memory.
+ *
+ * A record is a header block followed by the whole image of an object, which
+ * is as large as get_store_objsize() and sparse where it was never written.
+ * The writes to an object go to its image in place, so only the creations,
+ * the recovery and the compaction append to the log.  The header of a record
+ * is rewritten in place when its object is removed (LOG_DEAD) or becomes the
+ * stale copy of an epoch, and each (re)write of a header takes a new sequence
+ * number.  Rebuilding the index at startup scans the headers of the segments,
+ * and the record with the highest sequence number wins for each (oid,
+ * ec_index, epoch), so a crash between the append of a record and the update
+ * of the one it replaces is harmless.  A torn header is skipped by looking for
+ * the next valid one.
+ *
+ * The data of the removed records is punched out at once.  A low priority
+ * work compacts every LOG_COMPACT_INTERVAL seconds the full segments which
+ * are mostly garbage: it appends their live records again and removes the
+ * segment file.
+ *
+ * The objects stay in the log of the disk they were created on, so md doesn't
+ * rebalance them.  The copy-on-write, compression and deduplication features,
+ * which work on the object files, aren't supported.
+ */
+
+#include <dirent.h>
+#include <linux/falloc.h>
+
+#include "sheep_priv.h"
+#include "crc32c.h"
+
+#define LOG_DIR			".log"
+#define LOG_SEGMENT_SIZE	(UINT64_C(1) << 30)
+#define LOG_BLOCK_SIZE		4096 /* the header and the alignment of data */
+#define LOG_MAGIC		0x736c6f67
+#define LOG_COMPACT_RATIO	50 /* percentage of garbage to compact */
+#define LOG_COMPACT_INTERVAL	60 /* seconds */
+#define NR_LOG_LOCKS		64
+
+enum log_record_type {
+	LOG_OBJECT = 1,
+	LOG_DEAD,
+};
+
+struct log_record {
+	uint32_t magic;
+	uint32_t crc; /* CRC32C of the header with crc zeroed */
+	uint64_t seq;
+	uint64_t oid;
+	uint32_t epoch; /* of a stale copy, 0 for the object */
+	uint32_t length; /* of the image */
+	uint8_t type;
+	uint8_t ec_index;
+	uint8_t pad[6];
+};
+
+struct log_disk;
+
+struct log_segment {
+	struct list_node list;
+	struct log_disk *disk;
+	uint32_t id;
+	int fd;
+	uint64_t size; /* end of the last record */
+	uint64_t live; /* bytes of the records in the index */
+	int nr_pending; /* appends not in the index yet */
+};
+
+struct log_disk {
+	struct list_node list;
+	/* the disk, which holds LOG_DIR, with room for the segment names */
+	char path[PATH_MAX - sizeof("/" LOG_DIR "/01234567")];
+	struct list_head segments; /* ordered by id */
+	struct log_segment *active;
+};
+
+struct log_entry {
+	struct rb_node rb;
+	uint64_t oid;
+	uint32_t epoch;
+	uint8_t ec_index;
+	uint32_t length;
+	uint64_t seq;
+	struct log_segment *seg;
+	uint64_t offset; /* of the header */
+};
+
+/* log_lock protects the index, the disks and the segments */
+static struct sd_rw_lock log_lock = SD_RW_LOCK_INITIALIZER;
+static struct rb_root log_index = RB_ROOT;
+static LIST_HEAD(log_disks);
+static uint64_t log_seq;
+
+/* serialize the appends and the header updates with the I/O of an object */
+static struct sd_rw_lock log_obj_locks[NR_LOG_LOCKS] = {
+	[0 ... NR_LOG_LOCKS - 1] = SD_RW_LOCK_INITIALIZER
+};
+
+/* the compaction doesn't run across a format */
+static struct sd_mutex compact_lock = SD_MUTEX_INITIALIZER;
+static struct work_queue *compact_wq;
+static struct timer compact_timer;
+static struct work compact_work;
+
+static struct sd_rw_lock *get_obj_lock(uint64_t oid)
+{
+	return &log_obj_locks[sd_hash_oid(oid) % NR_LOG_LOCKS];
+}
+
+static uint8_t log_ec_index(uint64_t oid, uint8_t ec_index)
+{
+	return is_erasure_oid(oid) ? ec_index : 0;
+}
+
+static uint64_t record_size(uint32_t length)
+{
+	return LOG_BLOCK_SIZE + round_up(length, LOG_BLOCK_SIZE);
+}
+
+static int log_entry_cmp(const struct log_entry *a, const struct log_entry *b)
+{
+	int ret = intcmp(a->oid, b->oid);
+
+	if (ret)
+		return ret;
+	ret = intcmp(a->ec_index, b->ec_index);
+	if (ret)
+		return ret;
+	return intcmp(a->epoch, b->epoch);
+}
+
+/* Called with log_lock held */
+static struct log_entry *lookup_entry(uint64_t oid, uint8_t ec_index,
+				      uint32_t epoch)
+{
+	struct log_entry key = {
+		.oid = oid,
+		.ec_index = ec_index,
+		.epoch = epoch,
+	};
+
+	return rb_search(&log_index, &key, rb, log_entry_cmp);
+}
+
+static int to_sderr(int err)
+{
+	return err == ENOSPC ? SD_RES_NO_SPACE : SD_RES_EIO;
+}
+
+static void segment_path(const struct log_segment *seg, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/" LOG_DIR "/%08"PRIx32, seg->disk->path,
+		 seg->id);
+}
+
+static int write_header(struct log_segment *seg, uint64_t offset,
+			uint64_t oid, uint8_t ec_index, uint32_t epoch,
+			uint32_t length, uint8_t type, uint64_t *seq)
+{
+	struct log_record rec = {
+		.magic = LOG_MAGIC,
+		.seq = uatomic_add_return(&log_seq, 1),
+		.oid = oid,
+		.epoch = epoch,
+		.length = length,
+		.type = type,
+		.ec_index = ec_index,
+	};
+
+	rec.crc = crc32c(0, &rec, sizeof(rec));
+	if (xpwrite(seg->fd, &rec, sizeof(rec), offset) != sizeof(rec)) {
+		sd_err("failed to write the header of %016"PRIx64" in %08"
+		       PRIx32", %m", oid, seg->id);
+		return -1;
+	}
+	if (!sys->nosync && fdatasync(seg->fd) < 0) {
+		sd_err("failed to sync %08"PRIx32", %m", seg->id);
+		return -1;
+	}
+	if (seq)
+		*seq = rec.seq;
+	return 0;
+}
+
+/* Return false if there is no valid header at offset */
+static bool read_header(struct log_segment *seg, uint64_t offset,
+			struct log_record *rec)
+{
+	uint32_t crc;
+
+	if (xpread(seg->fd, rec, sizeof(*rec), offset) != sizeof(*rec))
+		return false;
+	if (rec->magic != LOG_MAGIC)
+		return false;
+
+	crc = rec->crc;
+	rec->crc = 0;
+	if (crc32c(0, rec, sizeof(*rec)) != crc)
+		return false;
+	rec->crc = crc;
+
+	return rec->type == LOG_OBJECT || rec->type == LOG_DEAD;
+}
+
+/* Kill the record of e, which is out of the index, and free its data */
+static void kill_record(const struct log_entry *e)
+{
+	uint64_t size = record_size(e->length);
+
+	if (write_header(e->seg, e->offset, e->oid, e->ec_index, e->epoch,
+			 e->length, LOG_DEAD, NULL) < 0)
+		return;
+	if (xfallocate(e->seg->fd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE,
+		       e->offset + LOG_BLOCK_SIZE, size - LOG_BLOCK_SIZE) < 0 &&
+	    errno != EOPNOTSUPP)
+		sd_err("failed to discard %016"PRIx64", %m", e->oid);
+}
+
+static struct log_segment *open_segment(struct log_disk *disk, uint32_t id,
+					bool create)
+{
+	struct log_segment *seg = xzalloc(sizeof(*seg));
+	char path[PATH_MAX];
+
+	seg->disk = disk;
+	seg->id = id;
+	segment_path(seg, path);
+	seg->fd = open(path, O_RDWR | (create ? O_CREAT | O_EXCL : 0),
+		       sd_def_fmode);
+	if (seg->fd < 0) {
+		sd_err("failed to open %s, %m", path);
+		free(seg);
+		return NULL;
+	}
+	list_add_tail(&seg->list, &disk->segments);
+
+	return seg;
+}
+
+static void close_segment(struct log_segment *seg, bool remove)
+{
+	char path[PATH_MAX];
+
+	if (remove) {
+		segment_path(seg, path);
+		if (unlink(path) < 0)
+			sd_err("failed to remove %s, %m", path);
+	}
+	list_del(&seg->list);
+	close(seg->fd);
+	free(seg);
+}
+
+/* Called with log_lock held */
+static struct log_segment *new_segment(struct log_disk *disk)
+{
+	struct log_segment *seg;
+	uint32_t id = 0;
+	char path[PATH_MAX];
+	int fd;
+
+	if (!list_empty(&disk->segments))
+		id = list_entry(disk->segments.n.prev, struct log_segment,
+				list)->id + 1;
+	seg = open_segment(disk, id, true);
+	if (!seg)
+		return NULL;
+
+	snprintf(path, sizeof(path), "%s/" LOG_DIR, disk->path);
+	fd = open(path, O_DIRECTORY | O_RDONLY);
+	if (fd >= 0) {
+		if (!sys->nosync && fsync(fd) < 0)
+			sd_err("failed to sync %s, %m", path);
+		close(fd);
+	}
+	disk->active = seg;
+
+	return seg;
+}
+
+/* Called with log_lock held */
+static struct log_disk *get_disk(const char *path, bool create)
+{
+	struct log_disk *disk;
+	char dir[PATH_MAX];
+
+	list_for_each_entry(disk, &log_disks, list) {
+		if (!strcmp(disk->path, path))
+			return disk;
+	}
+	if (!create)
+		return NULL;
+
+	if (strlen(path) >= sizeof(disk->path)) {
+		sd_err("%s is too long for the log store", path);
+		return NULL;
+	}
+	snprintf(dir, sizeof(dir), "%s/" LOG_DIR, path);
+	if (xmkdir(dir, sd_def_dmode) < 0) {
+		sd_err("failed to create %s, %m", dir);
+		return NULL;
+	}
+	disk = xzalloc(sizeof(*disk));
+	pstrcpy(disk->path, sizeof(disk->path), path);
+	INIT_LIST_HEAD(&disk->segments);
+	list_add_tail(&disk->list, &log_disks);
+
+	return disk;
+}
+
+/*
+ * Reserve the space of a record in the active segment of the disk of oid.
+ * The segment isn't compacted until end_append() is called.
+ */
+static struct log_segment *begin_append(uint64_t oid, uint32_t length,
+					uint64_t *offset)
+{
+	struct log_disk *disk;
+	struct log_segment *seg = NULL;
+
+	sd_write_lock(&log_lock);
+	disk = get_disk(md_get_object_dir(oid), true);
+	if (!disk)
+		goto out;
+
+	seg = disk->active;
+	if (!seg || seg->size + record_size(length) > LOG_SEGMENT_SIZE) {
+		seg = new_segment(disk);
+		if (!seg)
+			goto out;
+	}
+	*offset = seg->size;
+	seg->size += record_size(length);
+	seg->nr_pending++;
+out:
+	sd_rw_unlock(&log_lock);
+	return seg;
+}
+
+/*
+ * Put the appended record in the index, or drop it if seq is 0.  Return the
+ * entry it replaces, which the caller must kill and free.
+ */
+static struct log_entry *end_append(struct log_segment *seg, uint64_t offset,
+				    uint64_t oid, uint8_t ec_index,
+				    uint32_t epoch, uint32_t length,
+				    uint64_t seq)
+{
+	struct log_entry *e, *old = NULL;
+
+	sd_write_lock(&log_lock);
+	seg->nr_pending--;
+	if (!seq)
+		goto out;
+
+	e = xzalloc(sizeof(*e));
+	e->oid = oid;
+	e->ec_index = ec_index;
+	e->epoch = epoch;
+	e->length = length;
+	e->seq = seq;
+	e->seg = seg;
+	e->offset = offset;
+	old = rb_insert(&log_index, e, rb, log_entry_cmp);
+	if (old) {
+		rb_erase(&old->rb, &log_index);
+		old->seg->live -= record_size(old->length);
+		rb_insert(&log_index, e, rb, log_entry_cmp);
+	}
+	seg->live += record_size(length);
+out:
+	sd_rw_unlock(&log_lock);
+	return old;
+}
+
+/*
+ * Append a record of (oid, ec_index, epoch) whose image is len bytes of buf
+ * at offset off, zero elsewhere, and replace the older one.  Called with the
+ * write lock of the object held.
+ */
+static int append_record(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+			 uint32_t length, const void *buf, uint64_t off,
+			 uint32_t len)
+{
+	struct log_segment *seg;
+	struct log_entry *old;
+	uint64_t offset, seq = 0;
+	int ret = SD_RES_SUCCESS;
+
+	seg = begin_append(oid, length, &offset);
+	if (!seg)
+		return SD_RES_EIO;
+
+	if (len && xpwrite(seg->fd, buf, len, offset + LOG_BLOCK_SIZE + off)
+	    != len) {
+		sd_err("failed to write %016"PRIx64" to %08"PRIx32", %m", oid,
+		       seg->id);
+		ret = to_sderr(errno);
+	} else if (write_header(seg, offset, oid, ec_index, epoch, length,
+				LOG_OBJECT, &seq) < 0)
+		ret = to_sderr(errno);
+
+	old = end_append(seg, offset, oid, ec_index, epoch, length, seq);
+	if (old) {
+		kill_record(old);
+		free(old);
+	}
+	return ret;
+}
+
+/* Read len bytes at off of the image of e */
+static int read_image(const struct log_entry *e, void *buf, uint64_t off,
+		      uint32_t len)
+{
+	ssize_t size;
+
+	if (off + len > e->length) {
+		sd_err("out of range %016"PRIx64", %"PRIu64", %"PRIu32,
+		       e->oid, off, len);
+		return SD_RES_INVALID_PARMS;
+	}
+	size = xpread(e->seg->fd, buf, len, e->offset + LOG_BLOCK_SIZE + off);
+	if (size < 0) {
+		sd_err("failed to read %016"PRIx64" from %08"PRIx32", %m",
+		       e->oid, e->seg->id);
+		return SD_RES_EIO;
+	}
+	/* the zero tail of the last record may be past the end of file */
+	if (size < len)
+		memset((char *)buf + size, 0, len - size);
+	return SD_RES_SUCCESS;
+}
+
+/* Copy the entry of the object, which the caller reads without log_lock */
+static bool get_entry(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+		      struct log_entry *copy)
+{
+	struct log_entry *e;
+
+	sd_read_lock(&log_lock);
+	e = lookup_entry(oid, ec_index, epoch);
+	if (e)
+		*copy = *e;
+	sd_rw_unlock(&log_lock);
+
+	return e != NULL;
+}
+
+static bool logstore_exist(uint64_t oid, uint8_t ec_index)
+{
+	struct log_entry e;
+
+	return get_entry(oid, log_ec_index(oid, ec_index), 0, &e);
+}
+
+static int logstore_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	uint8_t ec_index = log_ec_index(oid, iocb->ec_index);
+	uint64_t offset = iocb->offset;
+	uint32_t len = iocb->length;
+	int ret;
+
+	sd_debug("%016"PRIx64, oid);
+
+	/* the zero blocks are left sparse */
+	find_zero_blocks(iocb->buf, &offset, &len);
+
+	sd_write_lock(lock);
+	ret = append_record(oid, ec_index, 0, get_store_objsize(oid),
+			    (char *)iocb->buf + offset - iocb->offset, offset,
+			    len);
+	sd_rw_unlock(lock);
+	if (ret == SD_RES_SUCCESS)
+		objlist_cache_insert(oid);
+
+	return ret;
+}
+
+static int logstore_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	int flags = prepare_iocb(oid, iocb, false), ret = SD_RES_SUCCESS;
+	struct log_entry e;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	sd_read_lock(lock);
+	if (!get_entry(oid, log_ec_index(oid, iocb->ec_index), 0, &e)) {
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+	if (iocb->offset + iocb->length > e.length) {
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+	if (xpwrite(e.seg->fd, iocb->buf, iocb->length,
+		    e.offset + LOG_BLOCK_SIZE + iocb->offset) != iocb->length) {
+		sd_err("failed to write %016"PRIx64" to %08"PRIx32", %m", oid,
+		       e.seg->id);
+		ret = to_sderr(errno);
+		goto out;
+	}
+	if ((flags & (O_DSYNC | O_SYNC)) && fdatasync(e.seg->fd) < 0) {
+		sd_err("failed to sync %08"PRIx32", %m", e.seg->id);
+		ret = SD_RES_EIO;
+	}
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+static int logstore_read(uint64_t oid, const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	uint8_t ec_index = log_ec_index(oid, iocb->ec_index);
+	struct log_entry e;
+	int ret;
+
+	sd_read_lock(lock);
+	/*
+	 * If the request is against the older epoch, try to read the stale
+	 * copy
+	 */
+	if (get_entry(oid, ec_index, 0, &e) ||
+	    (iocb->epoch > 0 && iocb->epoch < sys_epoch() &&
+	     get_entry(oid, ec_index, iocb->epoch, &e)))
+		ret = read_image(&e, iocb->buf, iocb->offset, iocb->length);
+	else
+		ret = SD_RES_NO_OBJ;
+	sd_rw_unlock(lock);
+
+	return ret;
+}
+
+static int logstore_remove_object(uint64_t oid, uint8_t ec_index)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	struct log_entry *e;
+
+	sd_write_lock(lock);
+	sd_write_lock(&log_lock);
+	e = lookup_entry(oid, log_ec_index(oid, ec_index), 0);
+	if (e) {
+		rb_erase(&e->rb, &log_index);
+		e->seg->live -= record_size(e->length);
+	}
+	sd_rw_unlock(&log_lock);
+
+	if (e) {
+		kill_record(e);
+		free(e);
+	}
+	sd_rw_unlock(lock);
+
+	return e ? SD_RES_SUCCESS : SD_RES_NO_OBJ;
+}
+
+/* Make the object (oid, ec_index) the stale copy of tgt_epoch */
+static int make_stale(uint64_t oid, uint8_t ec_index, uint32_t tgt_epoch)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	struct log_entry *e, *old = NULL;
+	int ret = SD_RES_SUCCESS;
+
+	sd_write_lock(lock);
+	sd_write_lock(&log_lock);
+	e = lookup_entry(oid, ec_index, 0);
+	if (!e) {
+		sd_rw_unlock(&log_lock);
+		goto out;
+	}
+	rb_erase(&e->rb, &log_index);
+	e->epoch = tgt_epoch;
+	old = rb_insert(&log_index, e, rb, log_entry_cmp);
+	if (old) {
+		rb_erase(&old->rb, &log_index);
+		old->seg->live -= record_size(old->length);
+		rb_insert(&log_index, e, rb, log_entry_cmp);
+	}
+	sd_rw_unlock(&log_lock);
+
+	if (write_header(e->seg, e->offset, oid, ec_index, tgt_epoch,
+			 e->length, LOG_OBJECT, &e->seq) < 0)
+		ret = SD_RES_EIO;
+	if (old) {
+		kill_record(old);
+		free(old);
+	}
+	sd_debug("moved object %016"PRIx64" to epoch %"PRIu32, oid,
+		 tgt_epoch);
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+static int logstore_link(uint64_t oid, uint32_t tgt_epoch)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	struct log_entry e;
+	void *buf;
+	int ret;
+
+	sd_debug("try link %016"PRIx64" from snapshot with epoch %d", oid,
+		 tgt_epoch);
+
+	sd_write_lock(lock);
+	/*
+	 * Recovery thread and main thread might try to recover the same
+	 * object
+	 */
+	if (get_entry(oid, 0, 0, &e)) {
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+	if (!get_entry(oid, 0, tgt_epoch, &e)) {
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+
+	buf = xvalloc(e.length);
+	ret = read_image(&e, buf, 0, e.length);
+	if (ret == SD_RES_SUCCESS)
+		ret = append_record(oid, 0, 0, e.length, buf, 0, e.length);
+	free(buf);
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+/* The keys of the entries, copied out of the index not to hold log_lock */
+static struct log_entry *get_entries(bool stale, size_t *nr)
+{
+	struct log_entry *e, *entries = NULL;
+	size_t n = 0;
+
+	sd_read_lock(&log_lock);
+	rb_for_each_entry(e, &log_index, rb) {
+		if (stale != (e->epoch != 0))
+			continue;
+		entries = xrealloc(entries, sizeof(*entries) * (n + 1));
+		entries[n++] = *e;
+	}
+	sd_rw_unlock(&log_lock);
+
+	*nr = n;
+	return entries;
+}
+
+/*
+ * For replicated object, if any of the replica belongs to this node, we
+ * consider it not stale.
+ *
+ * For erasure coded object, since every copy is unique and if it migrates to
+ * other node(index gets changed even it has some other copy belongs to it)
+ * because of hash ring changes, we consider it stale.
+ */
+static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
+{
+	uint32_t i, nr_copies;
+	const struct sd_vnode *v;
+	bool ret = true;
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+
+	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, obj_vnodes);
+	for (i = 0; i < nr_copies; i++) {
+		v = obj_vnodes[i];
+		if (vnode_is_local(v)) {
+			if (is_erasure_oid(oid)) {
+				if (i == ec_index)
+					ret = false;
+			} else {
+				ret = false;
+			}
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static int logstore_update_epoch(uint32_t epoch)
+{
+	struct vnode_info *vinfo = get_vnode_info();
+	struct log_entry *entries;
+	int ret = SD_RES_SUCCESS;
+	size_t nr;
+
+	sd_assert(epoch);
+	entries = get_entries(false, &nr);
+	for (size_t i = 0; i < nr && ret == SD_RES_SUCCESS; i++) {
+		if (oid_stale(entries[i].oid, entries[i].ec_index, vinfo))
+			ret = make_stale(entries[i].oid, entries[i].ec_index,
+					 epoch);
+	}
+	free(entries);
+	put_vnode_info(vinfo);
+
+	return ret;
+}
+
+static int logstore_purge_obj(void)
+{
+	uint32_t tgt_epoch = get_latest_epoch();
+	struct log_entry *entries;
+	int ret = SD_RES_SUCCESS;
+	size_t nr;
+
+	entries = get_entries(false, &nr);
+	for (size_t i = 0; i < nr && ret == SD_RES_SUCCESS; i++)
+		ret = make_stale(entries[i].oid, entries[i].ec_index,
+				 tgt_epoch);
+	free(entries);
+
+	return ret;
+}
+
+static int logstore_cleanup(void)
+{
+	struct log_entry *entries, *e;
+	size_t nr;
+
+	entries = get_entries(true, &nr);
+	for (size_t i = 0; i < nr; i++) {
+		struct sd_rw_lock *lock = get_obj_lock(entries[i].oid);
+
+		sd_write_lock(lock);
+		sd_write_lock(&log_lock);
+		e = lookup_entry(entries[i].oid, entries[i].ec_index,
+				 entries[i].epoch);
+		if (e) {
+			rb_erase(&e->rb, &log_index);
+			e->seg->live -= record_size(e->length);
+		}
+		sd_rw_unlock(&log_lock);
+		if (e) {
+			kill_record(e);
+			free(e);
+		}
+		sd_rw_unlock(lock);
+	}
+	free(entries);
+
+	return SD_RES_SUCCESS;
+}
+
+static int logstore_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	struct log_entry e;
+	void *buf = NULL;
+	int ret;
+
+	sd_read_lock(lock);
+	if (!get_entry(oid, 0, 0, &e) && !get_entry(oid, 0, epoch, &e)) {
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+
+	buf = xvalloc(e.length);
+	ret = read_image(&e, buf, 0, e.length);
+	if (ret == SD_RES_SUCCESS) {
+		get_buffer_sha1(buf, e.length, sha1);
+		sd_debug("the message digest of %016"PRIx64" at epoch %d is %s",
+			 oid, epoch, sha1_to_hex(sha1));
+	}
+	free(buf);
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+/* Called with compact_lock held */
+static void free_log(void)
+{
+	struct log_disk *disk;
+	struct log_segment *seg;
+
+	sd_write_lock(&log_lock);
+	rb_destroy(&log_index, struct log_entry, rb);
+	list_for_each_entry(disk, &log_disks, list) {
+		list_for_each_entry(seg, &disk->segments, list)
+			close_segment(seg, false);
+		list_del(&disk->list);
+		free(disk);
+	}
+	sd_rw_unlock(&log_lock);
+}
+
+static int purge_dir(const char *path)
+{
+	if (purge_directory(path) < 0)
+		return SD_RES_EIO;
+
+	return SD_RES_SUCCESS;
+}
+
+static int logstore_format(void)
+{
+	sd_debug("try get a clean store");
+	sd_mutex_lock(&compact_lock);
+	free_log();
+	sd_mutex_unlock(&compact_lock);
+
+	return for_each_obj_path(purge_dir);
+}
+
+/* Put the record of seg at offset in the index if it is the latest one */
+static void load_record(struct log_segment *seg, uint64_t offset,
+			const struct log_record *rec)
+{
+	struct log_entry *e = xzalloc(sizeof(*e)), *old;
+
+	e->oid = rec->oid;
+	e->ec_index = rec->ec_index;
+	e->epoch = rec->epoch;
+	e->length = rec->length;
+	e->seq = rec->seq;
+	e->seg = seg;
+	e->offset = offset;
+
+	old = rb_insert(&log_index, e, rb, log_entry_cmp);
+	if (old) {
+		if (old->seq > e->seq) {
+			free(e);
+			return;
+		}
+		rb_erase(&old->rb, &log_index);
+		old->seg->live -= record_size(old->length);
+		free(old);
+		rb_insert(&log_index, e, rb, log_entry_cmp);
+	}
+	seg->live += record_size(e->length);
+}
+
+static void load_segment(struct log_segment *seg)
+{
+	struct log_record rec;
+	struct stat st;
+	uint64_t offset = 0;
+
+	if (fstat(seg->fd, &st) < 0) {
+		sd_err("failed to stat %08"PRIx32", %m", seg->id);
+		return;
+	}
+
+	while (offset < st.st_size) {
+		if (!read_header(seg, offset, &rec)) {
+			/* a torn header or the tail of a crash */
+			offset += LOG_BLOCK_SIZE;
+			continue;
+		}
+		log_seq = max(log_seq, rec.seq);
+		if (rec.type == LOG_OBJECT)
+			load_record(seg, offset, &rec);
+		offset += record_size(rec.length);
+		seg->size = offset;
+	}
+}
+
+static int segment_id_cmp(const void *a, const void *b)
+{
+	return intcmp(*(const uint32_t *)a, *(const uint32_t *)b);
+}
+
+static int load_disk(const char *path)
+{
+	struct log_disk *disk = get_disk(path, true);
+	struct log_segment *seg;
+	uint32_t *ids = NULL;
+	size_t nr = 0;
+	struct dirent *d;
+	char dir[PATH_MAX];
+	DIR *dp;
+
+	if (!disk)
+		return SD_RES_EIO;
+
+	snprintf(dir, sizeof(dir), "%s/" LOG_DIR, path);
+	dp = opendir(dir);
+	if (!dp) {
+		sd_err("failed to open %s, %m", dir);
+		return SD_RES_EIO;
+	}
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		ids = xrealloc(ids, sizeof(*ids) * (nr + 1));
+		ids[nr++] = strtoul(d->d_name, NULL, 16);
+	}
+	closedir(dp);
+	qsort(ids, nr, sizeof(*ids), segment_id_cmp);
+
+	for (size_t i = 0; i < nr; i++) {
+		seg = open_segment(disk, ids[i], false);
+		if (!seg) {
+			free(ids);
+			return SD_RES_EIO;
+		}
+		load_segment(seg);
+		disk->active = seg;
+	}
+	free(ids);
+
+	return SD_RES_SUCCESS;
+}
+
+static void init_vdi_state(const struct log_entry *e)
+{
+	struct sd_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
+
+	if (read_image(e, inode, 0, SD_INODE_HEADER_SIZE) != SD_RES_SUCCESS) {
+		sd_err("failed to read inode header %016"PRIx64" %"PRIu32,
+		       e->oid, e->epoch);
+		goto out;
+	}
+	add_vdi_state_unordered(oid_to_vid(e->oid), inode->nr_copies,
+				vdi_is_snapshot(inode), inode->copy_policy,
+				inode->block_size_shift, inode->parent_vdi_id,
+				inode->flags);
+
+	if (inode->name[0] == '\0')
+		atomic_set_bit(oid_to_vid(e->oid), sys->vdi_deleted);
+
+	atomic_set_bit(oid_to_vid(e->oid), sys->vdi_inuse);
+out:
+	free(inode);
+}
+
+static bool need_compaction(const struct log_segment *seg)
+{
+	return seg != seg->disk->active && !seg->nr_pending &&
+		seg->live * 100 <= seg->size * (100 - LOG_COMPACT_RATIO);
+}
+
+/* Append the live records of seg again and remove it if they are all moved */
+static bool compact_segment(struct log_segment *seg)
+{
+	struct log_record rec;
+	struct log_entry e;
+	uint64_t offset = 0, off;
+	uint32_t len;
+	void *buf;
+	bool removed = false;
+	int ret;
+
+	while (offset < seg->size) {
+		if (!read_header(seg, offset, &rec)) {
+			offset += LOG_BLOCK_SIZE;
+			continue;
+		}
+
+		sd_write_lock(get_obj_lock(rec.oid));
+		if (rec.type == LOG_OBJECT &&
+		    get_entry(rec.oid, rec.ec_index, rec.epoch, &e) &&
+		    e.seg == seg && e.offset == offset) {
+			buf = xvalloc(e.length);
+			off = 0;
+			len = e.length;
+			ret = read_image(&e, buf, 0, len);
+			if (ret == SD_RES_SUCCESS) {
+				find_zero_blocks(buf, &off, &len);
+				ret = append_record(e.oid, e.ec_index, e.epoch,
+						    e.length,
+						    (char *)buf + off, off,
+						    len);
+			}
+			free(buf);
+			if (ret != SD_RES_SUCCESS) {
+				sd_rw_unlock(get_obj_lock(rec.oid));
+				sd_err("failed to move %016"PRIx64" out of %08"
+				       PRIx32, rec.oid, seg->id);
+				return false;
+			}
+		}
+		sd_rw_unlock(get_obj_lock(rec.oid));
+		offset += record_size(rec.length);
+	}
+
+	sd_write_lock(&log_lock);
+	if (seg->live == 0) {
+		sd_info("removed the segment %08"PRIx32" of %s", seg->id,
+			seg->disk->path);
+		close_segment(seg, true);
+		removed = true;
+	}
+	sd_rw_unlock(&log_lock);
+
+	return removed;
+}
+
+static void compact_worker(struct work *work)
+{
+	struct log_disk *disk;
+	struct log_segment *seg, *victim;
+
+	sd_mutex_lock(&compact_lock);
+	do {
+		victim = NULL;
+		sd_read_lock(&log_lock);
+		list_for_each_entry(disk, &log_disks, list) {
+			list_for_each_entry(seg, &disk->segments, list) {
+				if (need_compaction(seg)) {
+					victim = seg;
+					break;
+				}
+			}
+			if (victim)
+				break;
+		}
+		sd_rw_unlock(&log_lock);
+		/* give up until the next round if a segment stays */
+	} while (victim && compact_segment(victim));
+	sd_mutex_unlock(&compact_lock);
+}
+
+static void compact_done(struct work *work)
+{
+	add_timer(&compact_timer, LOG_COMPACT_INTERVAL * 1000);
+}
+
+static void compact_timer_fn(void *data)
+{
+	queue_work(compact_wq, &compact_work);
+}
+
+static int logstore_init(void)
+{
+	struct log_entry *e;
+	int ret;
+
+	sd_debug("use log store driver");
+	sd_mutex_lock(&compact_lock);
+	free_log();
+	sd_write_lock(&log_lock);
+	ret = for_each_obj_path(load_disk);
+	sd_rw_unlock(&log_lock);
+	sd_mutex_unlock(&compact_lock);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	rb_for_each_entry(e, &log_index, rb) {
+		objlist_cache_insert(e->oid);
+		if (is_vdi_obj(e->oid)) {
+			sd_debug("found the VDI object %016"PRIx64" epoch %"
+				 PRIu32, e->oid, e->epoch);
+			init_vdi_state(e);
+		}
+	}
+
+	if (!compact_wq) {
+		compact_wq = create_ordered_work_queue("log compaction");
+		if (!compact_wq)
+			return SD_RES_EIO;
+		set_work_queue_priority(compact_wq, WQ_PRIO_LOW);
+		compact_work.fn = compact_worker;
+		compact_work.done = compact_done;
+		compact_timer.callback = compact_timer_fn;
+		add_timer(&compact_timer, LOG_COMPACT_INTERVAL * 1000);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static struct store_driver log_store = {
+	.id = LOG_STORE,
+	.name = "log",
+	.init = logstore_init,
+	.exist = logstore_exist,
+	.create_and_write = logstore_create_and_write,
+	.write = logstore_write,
+	.read = logstore_read,
+	.link = logstore_link,
+	.update_epoch = logstore_update_epoch,
+	.cleanup = logstore_cleanup,
+	.format = logstore_format,
+	.remove_object = logstore_remove_object,
+	.get_hash = logstore_get_hash,
+	.purge_obj = logstore_purge_obj,
+};
+
+add_store_driver(log_store);
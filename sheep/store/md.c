@@ -12,13 +12,18 @@
  */
 
 #include "sheep_priv.h"
+#include "numa.h"
 
 #define MD_VDISK_SIZE ((uint64_t)1*1024*1024*16) /* 16M */
 
 #define NONE_EXIST_PATH "/all/disks/are/broken/,ps/əʌo7/!"
 
+/* The disks given as 'hot:<path>' make up the hot tier */
+#define MD_HOT_PREFIX "hot:"
+
 struct md md = {
 	.vroot = RB_ROOT,
+	.hot_vroot = RB_ROOT,
 	.root = RB_ROOT,
 	.lock = SD_RW_LOCK_INITIALIZER,
 };
@@ -34,9 +39,10 @@ static inline uint32_t nr_online_disks(void)
 	return nr;
 }
 
+/* Only 'weight' percent of the space of a slow disk is backed by vdisks */
 static inline int vdisk_number(const struct disk *disk)
 {
-	return DIV_ROUND_UP(disk->space, MD_VDISK_SIZE);
+	return DIV_ROUND_UP(disk->space / 100 * disk->weight, MD_VDISK_SIZE);
 }
 
 static int disk_cmp(const struct disk *d1, const struct disk *d2)
@@ -51,23 +57,42 @@ static int vdisk_cmp(const struct vdisk *d1, const struct vdisk *d2)
 
 static struct vdisk *vdisk_insert(struct vdisk *new)
 {
-	return rb_insert(&md.vroot, new, rb, vdisk_cmp);
+	return rb_insert(new->disk->vroot, new, rb, vdisk_cmp);
 }
 
 /* If v1_hash < hval <= v2_hash, then oid is resident in v2 */
-static struct vdisk *hval_to_vdisk(uint64_t hval)
+static struct vdisk *hval_to_vdisk(struct rb_root *root, uint64_t hval)
 {
 	struct vdisk dummy = { .hash = hval };
 
-	return rb_nsearch(&md.vroot, &dummy, rb, vdisk_cmp);
+	return rb_nsearch(root, &dummy, rb, vdisk_cmp);
+}
+
+static bool tier_is_hot(uint64_t oid);
+static void tier_load(void);
+static struct io_arbiter *io_arbiter_get(const char *path);
+
+/* Both the tiers are needed to move the objects between them */
+static inline bool tiering_enabled(void)
+{
+	return md.nr_hot_disks && md.nr_hot_disks < md.nr_disks;
+}
+
+static struct rb_root *oid_to_vroot(uint64_t oid)
+{
+	if (md.nr_hot_disks == md.nr_disks)
+		return &md.hot_vroot;
+	if (md.nr_hot_disks && tier_is_hot(oid))
+		return &md.hot_vroot;
+	return &md.vroot;
 }
 
 static struct vdisk *oid_to_vdisk(uint64_t oid)
 {
-	return hval_to_vdisk(sd_hash_oid(oid));
+	return hval_to_vdisk(oid_to_vroot(oid), sd_hash_oid(oid));
 }
 
-static void create_vdisks(const struct disk *disk)
+static void create_vdisks(struct disk *disk)
 {
 	uint64_t hval = sd_hash(disk->path, strlen(disk->path));
 	const struct sd_node *n = &sys->this_node;
@@ -78,10 +103,15 @@ static void create_vdisks(const struct disk *disk)
 		node_hval = sd_hash(&n->nid, offsetof(typeof(n->nid), io_addr));
 		hval = fnv_64a_64(node_hval, hval);
 		nr = DIV_ROUND_UP(disk->space, WEIGHT_MIN);
-		if (0 == n->nid.port)
+		if (0 == n->nid.port) {
+			disk->nr_vdisks = 0;
+			disk->vroot = &md.vroot;
 			return;
+		}
 	} else
 		nr = vdisk_number(disk);
+	disk->nr_vdisks = nr;
+	disk->vroot = disk->hot ? &md.hot_vroot : &md.vroot;
 
 	for (int i = 0; i < nr; i++) {
 		struct vdisk *v = xmalloc(sizeof(*v));
@@ -96,7 +126,7 @@ static void create_vdisks(const struct disk *disk)
 
 static inline void vdisk_free(struct vdisk *v)
 {
-	rb_erase(&v->rb, &md.vroot);
+	rb_erase(&v->rb, v->disk->vroot);
 	free(v);
 }
 
@@ -105,20 +135,18 @@ static void remove_vdisks(const struct disk *disk)
 	uint64_t hval = sd_hash(disk->path, strlen(disk->path));
 	const struct sd_node *n = &sys->this_node;
 	uint64_t node_hval;
-	int nr;
 
 	if (is_cluster_diskmode(&sys->cinfo)) {
 		node_hval = sd_hash(&n->nid, offsetof(typeof(n->nid), io_addr));
 		hval = fnv_64a_64(node_hval, hval);
-		nr = DIV_ROUND_UP(disk->space, WEIGHT_MIN);
-	} else
-		nr = vdisk_number(disk);
+	}
 
-	for (int i = 0; i < nr; i++) {
+	/* the vdisks were created with the weight of that time */
+	for (int i = 0; i < disk->nr_vdisks; i++) {
 		struct vdisk *v;
 
 		hval = sd_hash_next(hval);
-		v = hval_to_vdisk(hval);
+		v = hval_to_vdisk(disk->vroot, hval);
 		sd_assert(v->hash == hval);
 
 		vdisk_free(v);
@@ -184,18 +212,39 @@ static int64_t find_string_integer(const char *str, const char *delimiter)
 	return ret;
 }
 
-/* If cleanup is true, temporary objects will be removed */
-static int for_each_object_in_path(const char *path,
-				   int (*func)(uint64_t, const char *, uint32_t,
-					       uint8_t, struct vnode_info *,
-					       void *),
-				   bool cleanup, struct vnode_info *vinfo,
-				   void *arg)
+/* Most file systems tell the type in the dentry, which saves us a stat */
+static bool is_dir_dentry(const char *path, const struct dirent *d)
+{
+	char file_name[PATH_MAX];
+	struct stat s;
+
+	if (d->d_type != DT_UNKNOWN)
+		return d->d_type == DT_DIR;
+
+	snprintf(file_name, sizeof(file_name), "%s/%s", path, d->d_name);
+	if (stat(file_name, &s) < 0)
+		return false;
+	return S_ISDIR(s.st_mode);
+}
+
+/*
+ * If cleanup is true, temporary objects will be removed.
+ *
+ * The objects directly in path are passed to func only for slice 0.  Of the
+ * sub directories of the tree store, only every nr_slices-th one starting from
+ * slice is walked, so that several threads can share one disk.
+ */
+static int __for_each_object_in_path(const char *path,
+				     int (*func)(uint64_t, const char *,
+						 uint32_t, uint8_t,
+						 struct vnode_info *, void *),
+				     bool cleanup, struct vnode_info *vinfo,
+				     void *arg, int slice, int nr_slices)
 {
 	DIR *dir;
 	struct dirent *d;
 	uint64_t oid;
-	int ret = SD_RES_SUCCESS;
+	int ret = SD_RES_SUCCESS, nr_dirs = 0;
 	char file_name[PATH_MAX];
 
 	dir = opendir(path);
@@ -213,19 +262,21 @@ static int for_each_object_in_path(const char *path,
 			continue;
 
 		/* recursive call for tree store driver sub directories*/
-		if (store_id_match(TREE_STORE)) {
-			struct stat s;
+		if (store_id_match(TREE_STORE) && is_dir_dentry(path, d)) {
+			if (nr_dirs++ % nr_slices != slice)
+				continue;
 
 			snprintf(file_name, sizeof(file_name),
 				 "%s/%s", path, d->d_name);
-			stat(file_name, &s);
-			if (S_ISDIR(s.st_mode)) {
-				ret = for_each_object_in_path(file_name,
-					func, cleanup, vinfo, arg);
-				continue;
-			}
+			ret = __for_each_object_in_path(file_name, func,
+							cleanup, vinfo, arg,
+							0, 1);
+			continue;
 		}
 
+		if (slice != 0)
+			continue;
+
 		sd_debug("%s, %s", path, d->d_name);
 		oid = strtoull(d->d_name, NULL, 16);
 		if (oid == 0 || oid == ULLONG_MAX)
@@ -264,6 +315,17 @@ static int for_each_object_in_path(const char *path,
 	return ret;
 }
 
+static int for_each_object_in_path(const char *path,
+				   int (*func)(uint64_t, const char *, uint32_t,
+					       uint8_t, struct vnode_info *,
+					       void *),
+				   bool cleanup, struct vnode_info *vinfo,
+				   void *arg)
+{
+	return __for_each_object_in_path(path, func, cleanup, vinfo, arg, 0,
+					 1);
+}
+
 static uint64_t get_path_free_size(const char *path, uint64_t *used)
 {
 	struct statvfs fs;
@@ -339,6 +401,15 @@ broken_path:
 bool md_add_disk(const char *path, bool purge)
 {
 	struct disk *new;
+	bool hot = false;
+
+	if (!strncmp(path, MD_HOT_PREFIX, strlen(MD_HOT_PREFIX))) {
+		path += strlen(MD_HOT_PREFIX);
+		if (is_cluster_diskmode(&sys->cinfo))
+			sd_warn("no tiers in the disk mode, %s is cold", path);
+		else
+			hot = true;
+	}
 
 	if (path_to_disk(path)) {
 		sd_err("duplicate path %s", path);
@@ -350,9 +421,12 @@ bool md_add_disk(const char *path, bool purge)
 		return false;
 	}
 
-	new = xmalloc(sizeof(*new));
+	new = xzalloc(sizeof(*new));
 	pstrcpy(new->path, PATH_MAX, path);
 	trim_last_slash(new->path);
+	new->weight = 100;
+	new->hot = hot;
+	new->arb = io_arbiter_get(new->path);
 	new->space = init_path_space(new->path, purge);
 	if (!new->space) {
 		free(new);
@@ -363,17 +437,22 @@ bool md_add_disk(const char *path, bool purge)
 	rb_insert(&md.root, new, rb, disk_cmp);
 	md.space += new->space;
 	md.nr_disks++;
+	if (hot)
+		md.nr_hot_disks++;
 
-	sd_info("%s, vdisk nr %d, total disk %d", new->path, vdisk_number(new),
-		md.nr_disks);
+	sd_info("%s%s, vdisk nr %d, total disk %d", hot ? MD_HOT_PREFIX : "",
+		new->path, new->nr_vdisks, md.nr_disks);
 	return true;
 }
 
 static inline void md_remove_disk(struct disk *disk)
 {
 	sd_info("%s from multi-disk array", disk->path);
+	object_fd_invalidate_dir(disk->path);
 	rb_erase(&disk->rb, &md.root);
 	md.nr_disks--;
+	if (disk->hot)
+		md.nr_hot_disks--;
 	remove_vdisks(disk);
 	free(disk);
 }
@@ -406,73 +485,92 @@ const char *md_get_object_dir(uint64_t oid)
 }
 
 struct process_path_arg {
-	const char *path;
+	char path[PATH_MAX];
 	struct vnode_info *vinfo;
 	int (*func)(uint64_t oid, const char *, uint32_t, uint8_t,
 		    struct vnode_info *, void *arg);
 	bool cleanup;
 	void *opaque;
 	int result;
+	int slice;
+	int nr_slices;
 };
 
+/*
+ * The number of threads walking one disk of the tree store, each of them takes
+ * its share of the 256 hash directories.  The plain store has a single flat
+ * directory per disk.
+ */
+#define NR_TREE_SCAN_THREADS 8
+
 static void *thread_process_path(void *arg)
 {
 	int ret;
 	struct process_path_arg *parg = (struct process_path_arg *)arg;
 
-	ret = for_each_object_in_path(parg->path, parg->func, parg->cleanup,
-				      parg->vinfo, parg->opaque);
+	ret = __for_each_object_in_path(parg->path, parg->func, parg->cleanup,
+					parg->vinfo, parg->opaque, parg->slice,
+					parg->nr_slices);
 	if (ret != SD_RES_SUCCESS)
 		parg->result = ret;
 
 	return arg;
 }
 
-main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
-				      uint32_t epoch, uint8_t ec_index,
-				      struct vnode_info *vinfo, void *arg),
-				  bool cleanup, void *arg)
+/*
+ * Walk 'subdir' of every disk with nr_slices threads per disk.  Returns the
+ * error of a thread which failed, if any.  Called with md.lock held.
+ */
+static int for_each_object_in_disks(const char *subdir, int nr_slices,
+				    int (*func)(uint64_t oid, const char *path,
+						uint32_t epoch,
+						uint8_t ec_index,
+						struct vnode_info *vinfo,
+						void *arg),
+				    bool cleanup, struct vnode_info *vinfo,
+				    void *arg)
 {
 	int ret = SD_RES_SUCCESS;
 	const struct disk *disk;
 	struct process_path_arg *thread_args, *path_arg;
-	struct vnode_info *vinfo;
 	void *ret_arg;
 	sd_thread_t *thread_array;
 	int nr_thread = 0, idx = 0;
 
-	sd_read_lock(&md.lock);
-
 	rb_for_each_entry(disk, &md.root, rb) {
-		nr_thread++;
+		nr_thread += nr_slices;
 	}
 
 	thread_args = xmalloc(nr_thread * sizeof(struct process_path_arg));
 	thread_array = xmalloc(nr_thread * sizeof(sd_thread_t));
 
-	vinfo = get_vnode_info();
-
 	rb_for_each_entry(disk, &md.root, rb) {
-		thread_args[idx].path = disk->path;
-		thread_args[idx].vinfo = vinfo;
-		thread_args[idx].func = func;
-		thread_args[idx].cleanup = cleanup;
-		thread_args[idx].opaque = arg;
-		thread_args[idx].result = SD_RES_SUCCESS;
-		ret = sd_thread_create_with_idx("foreach wd",
+		for (int i = 0; i < nr_slices; i++) {
+			snprintf(thread_args[idx].path,
+				 sizeof(thread_args[idx].path), "%s%s",
+				 disk->path, subdir);
+			thread_args[idx].vinfo = vinfo;
+			thread_args[idx].func = func;
+			thread_args[idx].cleanup = cleanup;
+			thread_args[idx].opaque = arg;
+			thread_args[idx].result = SD_RES_SUCCESS;
+			thread_args[idx].slice = i;
+			thread_args[idx].nr_slices = nr_slices;
+			ret = sd_thread_create_with_idx("foreach wd",
 						thread_array + idx,
 						thread_process_path,
 						(void *)(thread_args + idx));
-		if (ret) {
-			/*
-			 * If we can't create enough threads to process
-			 * files, the data-consistent will be broken if
-			 * we continued.
-			 */
-			panic("Failed to create thread for path %s",
-			      disk->path);
+			if (ret) {
+				/*
+				 * If we can't create enough threads to process
+				 * files, the data-consistent will be broken if
+				 * we continued.
+				 */
+				panic("Failed to create thread for path %s",
+				      disk->path);
+			}
+			idx++;
 		}
-		idx++;
 	}
 
 	sd_debug("Create %d threads for all path", nr_thread);
@@ -489,34 +587,231 @@ main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
 		}
 	}
 
-	put_vnode_info(vinfo);
-	sd_rw_unlock(&md.lock);
+	ret = SD_RES_SUCCESS;
+	for (idx = 0; idx < nr_thread; idx++)
+		if (thread_args[idx].result != SD_RES_SUCCESS)
+			ret = thread_args[idx].result;
 
 	free(thread_args);
 	free(thread_array);
 	return ret;
 }
 
-int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
-					 uint32_t epoch, uint8_t,
-					 struct vnode_info *, void *arg),
-			     void *arg)
+main_fn int for_each_object_in_wd(int (*func)(uint64_t oid, const char *path,
+				      uint32_t epoch, uint8_t ec_index,
+				      struct vnode_info *vinfo, void *arg),
+				  bool cleanup, void *arg)
 {
-	int ret = SD_RES_SUCCESS;
-	char path[PATH_MAX];
+	struct vnode_info *vinfo;
+	int nr_slices = 1;
+
+	if (store_id_match(TREE_STORE))
+		nr_slices = NR_TREE_SCAN_THREADS;
+
+	sd_read_lock(&md.lock);
+	vinfo = get_vnode_info();
+	/* the failure of a disk is logged, the walk of the others counts */
+	for_each_object_in_disks("", nr_slices, func, cleanup, vinfo, arg);
+	put_vnode_info(vinfo);
+	sd_rw_unlock(&md.lock);
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * The number of threads renaming the stale objects of one disk.  The renames
+ * into .stale cross directories and serialize on the rename lock of the file
+ * system, so more threads than this only overlap the lookups.
+ */
+#define NR_STALE_MOVE_THREADS 4
+
+struct stale_object {
+	uint64_t oid;
+	uint8_t ec_index;
+};
+
+struct stale_scan_arg {
+	const char *path;
+	struct vnode_info *vinfo;
+	bool (*stale)(uint64_t oid, uint8_t ec_index, struct vnode_info *);
+	int slice;
+	int nr_slices;
+	struct stale_object *objs;
+	size_t nr_objs;
+	size_t max_objs;
+	int result;
+};
+
+struct stale_move_arg {
+	struct stale_scan_arg *scans; /* of the disk */
+	int nr_scans;
+	int (*move)(uint64_t oid, uint8_t ec_index, uint32_t tgt_epoch);
+	uint32_t tgt_epoch;
+	int idx;
+	int result;
+};
+
+static int collect_stale_object(uint64_t oid, const char *path,
+				uint32_t epoch, uint8_t ec_index,
+				struct vnode_info *vinfo, void *arg)
+{
+	struct stale_scan_arg *scan = arg;
+
+	if (!scan->stale(oid, ec_index, vinfo))
+		return SD_RES_SUCCESS;
+
+	if (scan->nr_objs == scan->max_objs) {
+		scan->max_objs = max(scan->max_objs * 2, (size_t)1024);
+		scan->objs = xrealloc(scan->objs,
+				      scan->max_objs * sizeof(*scan->objs));
+	}
+	scan->objs[scan->nr_objs].oid = oid;
+	scan->objs[scan->nr_objs].ec_index = ec_index;
+	scan->nr_objs++;
+
+	return SD_RES_SUCCESS;
+}
+
+static void *thread_scan_stale(void *arg)
+{
+	struct stale_scan_arg *scan = arg;
+
+	scan->result = __for_each_object_in_path(scan->path,
+						 collect_stale_object, false,
+						 scan->vinfo, scan, scan->slice,
+						 scan->nr_slices);
+	return arg;
+}
+
+static void *thread_move_stale(void *arg)
+{
+	struct stale_move_arg *mv = arg;
+	size_t k = 0;
+
+	for (int i = 0; i < mv->nr_scans; i++) {
+		const struct stale_scan_arg *scan = mv->scans + i;
+
+		for (size_t j = 0; j < scan->nr_objs; j++, k++) {
+			int ret;
+
+			if (k % NR_STALE_MOVE_THREADS != mv->idx)
+				continue;
+			ret = mv->move(scan->objs[j].oid,
+				       scan->objs[j].ec_index, mv->tgt_epoch);
+			if (ret != SD_RES_SUCCESS)
+				mv->result = ret;
+		}
+	}
+	return arg;
+}
+
+static void run_threads(const char *name, void *(*fn)(void *), void *args,
+			size_t arg_size, int nr)
+{
+	sd_thread_t *threads = xmalloc(nr * sizeof(*threads));
+
+	for (int i = 0; i < nr; i++)
+		if (sd_thread_create_with_idx(name, threads + i, fn,
+					      (char *)args + i * arg_size))
+			panic("Failed to create %s thread", name);
+	for (int i = 0; i < nr; i++)
+		if (sd_thread_join(threads[i], NULL))
+			sd_err("Failed to join %s thread", name);
+	free(threads);
+}
+
+/*
+ * Move the objects of the working directories which are stale for the current
+ * vnode_info to tgt_epoch.  All the disks are first scanned for the stale
+ * objects, with the same threads as for_each_object_in_wd(), and then each
+ * disk renames its own ones with NR_STALE_MOVE_THREADS threads.
+ */
+main_fn int move_stale_objects_in_wd(bool (*stale)(uint64_t, uint8_t,
+						   struct vnode_info *),
+				     int (*move)(uint64_t, uint8_t, uint32_t),
+				     uint32_t tgt_epoch)
+{
+	int ret = SD_RES_SUCCESS, nr_disks = 0, nr_slices = 1, idx = 0;
+	struct stale_scan_arg *scans;
+	struct stale_move_arg *moves;
 	const struct disk *disk;
+	struct vnode_info *vinfo;
+	size_t nr_stale = 0;
+
+	if (store_id_match(TREE_STORE))
+		nr_slices = NR_TREE_SCAN_THREADS;
 
 	sd_read_lock(&md.lock);
 	rb_for_each_entry(disk, &md.root, rb) {
-		snprintf(path, sizeof(path), "%s/.stale", disk->path);
-		ret = for_each_object_in_path(path, func, false, NULL, arg);
-		if (ret != SD_RES_SUCCESS)
-			break;
+		nr_disks++;
+	}
+	scans = xcalloc(nr_disks * nr_slices, sizeof(*scans));
+	moves = xcalloc(nr_disks * NR_STALE_MOVE_THREADS, sizeof(*moves));
+	vinfo = get_vnode_info();
+
+	rb_for_each_entry(disk, &md.root, rb) {
+		for (int i = 0; i < nr_slices; i++, idx++) {
+			scans[idx].path = disk->path;
+			scans[idx].vinfo = vinfo;
+			scans[idx].stale = stale;
+			scans[idx].slice = i;
+			scans[idx].nr_slices = nr_slices;
+			scans[idx].result = SD_RES_SUCCESS;
+		}
 	}
+	run_threads("scan stale", thread_scan_stale, scans, sizeof(*scans),
+		    nr_disks * nr_slices);
+
+	for (int d = 0; d < nr_disks; d++) {
+		for (int i = 0; i < NR_STALE_MOVE_THREADS; i++) {
+			idx = d * NR_STALE_MOVE_THREADS + i;
+			moves[idx].scans = scans + d * nr_slices;
+			moves[idx].nr_scans = nr_slices;
+			moves[idx].move = move;
+			moves[idx].tgt_epoch = tgt_epoch;
+			moves[idx].idx = i;
+			moves[idx].result = SD_RES_SUCCESS;
+		}
+	}
+	run_threads("move stale", thread_move_stale, moves, sizeof(*moves),
+		    nr_disks * NR_STALE_MOVE_THREADS);
+
+	for (idx = 0; idx < nr_disks * nr_slices; idx++) {
+		nr_stale += scans[idx].nr_objs;
+		if (scans[idx].result != SD_RES_SUCCESS) {
+			sd_err("%s, %s", scans[idx].path,
+			       sd_strerror(scans[idx].result));
+			ret = scans[idx].result;
+		}
+		free(scans[idx].objs);
+	}
+	for (idx = 0; idx < nr_disks * NR_STALE_MOVE_THREADS; idx++)
+		if (moves[idx].result != SD_RES_SUCCESS)
+			ret = moves[idx].result;
+	sd_debug("moved %zu stale objects to epoch %"PRIu32, nr_stale,
+		 tgt_epoch);
+
+	put_vnode_info(vinfo);
 	sd_rw_unlock(&md.lock);
+
+	free(scans);
+	free(moves);
 	return ret;
 }
 
+/* The stale directories are flat, so they are walked by a thread per disk */
+int for_each_object_in_stale(int (*func)(uint64_t oid, const char *path,
+					 uint32_t epoch, uint8_t,
+					 struct vnode_info *, void *arg),
+			     void *arg)
+{
+	int ret;
+
+	sd_read_lock(&md.lock);
+	ret = for_each_object_in_disks("/.stale", 1, func, false, NULL, arg);
+	sd_rw_unlock(&md.lock);
+	return ret;
+}
 
 int for_each_obj_path(int (*func)(const char *path))
 {
@@ -652,6 +947,7 @@ static int md_move_object(uint64_t oid, const char *old, const char *new)
 	int fd, ret = -1;
 	size_t sz = get_store_objsize(oid);
 	const bool sparse = is_sparse_object(oid);
+	struct cow_map map;
 
 	fd = open(old, O_RDONLY);
 	if (fd < 0) {
@@ -666,7 +962,21 @@ static int md_move_object(uint64_t oid, const char *old, const char *new)
 		goto out_close;
 	}
 
-	if (atomic_create_and_write(new, buf.buf, buf.len, false, sparse) < 0) {
+	/*
+	 * keep the index of a compressed object, the map of a sparse
+	 * copy-on-write object and the checksums of the others
+	 */
+	if (compress_check(oid, old))
+		ret = compress_copy_file(oid, old, new);
+	else if (cow_read_map(old, &map) > 0)
+		ret = cow_create_file(new, buf.buf, buf.len, &map);
+	else {
+		ret = atomic_create_and_write(new, buf.buf, buf.len, false,
+					      sparse);
+		if (ret == 0)
+			ret = csum_copy(old, new);
+	}
+	if (ret < 0) {
 		if (errno != EEXIST) {
 			sd_err("failed to create %s", new);
 			ret = -1;
@@ -763,6 +1073,8 @@ int md_get_stale_path(uint64_t oid, uint32_t epoch, uint8_t ec_index,
 	return SD_RES_NO_OBJ;
 }
 
+static void md_get_rebalance_state(struct md_rebalance_state *state);
+
 uint32_t md_get_info(struct sd_md_info *info)
 {
 	uint32_t ret = sizeof(*info);
@@ -781,12 +1093,17 @@ uint32_t md_get_info(struct sd_md_info *info)
 	}
 	info->nr = md.nr_disks;
 	sd_rw_unlock(&md.lock);
+	md_get_rebalance_state(&info->rebalance);
 	return ret;
 }
 
 static inline void md_del_disk(const char *path)
 {
-	struct disk *disk = path_to_disk(path);
+	struct disk *disk;
+
+	if (!strncmp(path, MD_HOT_PREFIX, strlen(MD_HOT_PREFIX)))
+		path += strlen(MD_HOT_PREFIX);
+	disk = path_to_disk(path);
 
 	if (!disk) {
 		sd_err("invalid path %s", path);
@@ -831,13 +1148,162 @@ void update_node_disks(void)
 }
 #endif
 
+/*
+ * Rebalance
+ *
+ * After plugging disks, only the objects whose vdisk changed have to move,
+ * and they stay on this node, so there is no need for a cluster recovery.
+ * The rebalance walks the disks once to count the objects and once more to
+ * move the misplaced ones, at most at the recovery bandwidth set by 'dog node
+ * recovery', MD_REBALANCE_BANDWIDTH by default.  The objects accessed in the
+ * meantime are moved by md_exist() as usual.
+ *
+ * The disk mode and the tree store, whose objects md_move_object() can't
+ * locate, still go through the recovery.
+ */
+#define MD_REBALANCE_BANDWIDTH (100ULL * 1024 * 1024)	/* bytes per sec */
+
+static struct md_rebalance_state rebalance_state;
+static struct work_queue *rebalance_wqueue;
+static struct work rebalance_work;
+/* only accessed in the main thread */
+static bool rebalance_running, rebalance_again;
+
+static uint64_t rebalance_start, rebalance_bytes;
+
+static void md_get_rebalance_state(struct md_rebalance_state *state)
+{
+	state->in_rebalance = uatomic_read(&rebalance_state.in_rebalance);
+	state->nr_total = uatomic_read(&rebalance_state.nr_total);
+	state->nr_scanned = uatomic_read(&rebalance_state.nr_scanned);
+	state->nr_moved = uatomic_read(&rebalance_state.nr_moved);
+}
+
+static int rebalance_count_obj(uint64_t oid, const char *path, uint32_t epoch,
+			       uint8_t ec_index, struct vnode_info *vinfo,
+			       void *arg)
+{
+	uatomic_inc(&rebalance_state.nr_total);
+	return SD_RES_SUCCESS;
+}
+
+static void rebalance_throttle(uint64_t bytes)
+{
+	uint64_t rate = sys->rthrottling.bandwidth ?: MD_REBALANCE_BANDWIDTH;
+	uint64_t expected, elapsed;
+
+	rebalance_bytes += bytes;
+	expected = (double)rebalance_bytes * 1000000000 / rate;
+	elapsed = clock_get_time() - rebalance_start;
+	if (expected > elapsed)
+		usleep((expected - elapsed) / 1000);
+}
+
+static int rebalance_obj(uint64_t oid, const char *path, uint32_t epoch,
+			 uint8_t ec_index, struct vnode_info *vinfo, void *arg)
+{
+	int ret = SD_RES_SUCCESS;
+	bool moved = false;
+
+	uatomic_inc(&rebalance_state.nr_scanned);
+
+	sd_read_lock(&md.lock);
+	if (!path_to_disk(path)) {
+		/* unplugged in the meantime, the recovery takes care of it */
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+	if (!strcmp(md_get_object_dir_nolock(oid), path))
+		goto out;
+
+	/* the object may have been moved or removed by somebody else */
+	moved = md_check_and_move(oid, 0, ec_index, path) == SD_RES_SUCCESS;
+out:
+	sd_rw_unlock(&md.lock);
+
+	if (moved) {
+		uatomic_inc(&rebalance_state.nr_moved);
+		rebalance_throttle(get_store_objsize(oid));
+	}
+	return ret;
+}
+
+static void md_rebalance(struct work *work)
+{
+	const struct disk *disk;
+	char (*paths)[PATH_MAX];
+	int nr = 0;
+
+	sd_read_lock(&md.lock);
+	paths = xmalloc(sizeof(*paths) * md.nr_disks);
+	rb_for_each_entry(disk, &md.root, rb)
+		pstrcpy(paths[nr++], PATH_MAX, disk->path);
+	sd_rw_unlock(&md.lock);
+
+	uatomic_set(&rebalance_state.nr_total, 0);
+	uatomic_set(&rebalance_state.nr_scanned, 0);
+	uatomic_set(&rebalance_state.nr_moved, 0);
+	uatomic_set(&rebalance_state.in_rebalance, 1);
+	rebalance_start = clock_get_time();
+	rebalance_bytes = 0;
+
+	for (int i = 0; i < nr; i++)
+		for_each_object_in_path(paths[i], rebalance_count_obj, false,
+					NULL, NULL);
+	for (int i = 0; i < nr; i++)
+		for_each_object_in_path(paths[i], rebalance_obj, false, NULL,
+					NULL);
+
+	uatomic_set(&rebalance_state.in_rebalance, 0);
+	sd_info("%"PRIu64" of %"PRIu64" objects moved in %"PRIu64" sec",
+		rebalance_state.nr_moved, rebalance_state.nr_scanned,
+		(clock_get_time() - rebalance_start) / 1000000000);
+	free(paths);
+}
+
+static void md_start_rebalance(void);
+
+static void md_rebalance_done(struct work *work)
+{
+	rebalance_running = false;
+	if (rebalance_again) {
+		/* the objects scanned before the last plug may be misplaced */
+		rebalance_again = false;
+		md_start_rebalance();
+	}
+}
+
+static void md_start_rebalance(void)
+{
+	if (rebalance_running) {
+		rebalance_again = true;
+		return;
+	}
+
+	if (!rebalance_wqueue)
+		rebalance_wqueue = create_ordered_work_queue("md rebalance");
+	rebalance_work.fn = md_rebalance;
+	rebalance_work.done = md_rebalance_done;
+	rebalance_running = true;
+	queue_work(rebalance_wqueue, &rebalance_work);
+}
+
+static inline bool can_rebalance(void)
+{
+	return !is_cluster_diskmode(&sys->cinfo) &&
+		!store_id_match(TREE_STORE) && !store_id_match(LOG_STORE) &&
+		!store_id_match(RAW_STORE);
+}
+
 static int do_plug_unplug(char *disks, bool plug)
 {
 	const char *path;
 	int old_nr, new_nr, ret = SD_RES_UNKNOWN;
+	bool tiering;
 
 	sd_write_lock(&md.lock);
 	old_nr = md.nr_disks;
+	tiering = tiering_enabled();
 	path = strtok(disks, ",");
 	do {
 		if (plug) {
@@ -854,13 +1320,20 @@ static int do_plug_unplug(char *disks, bool plug)
 		goto out;
 
 	ret = SD_RES_SUCCESS;
+	/* the objects of the hot disks would look misplaced otherwise */
+	tiering = !tiering && tiering_enabled();
 out:
 	sd_rw_unlock(&md.lock);
 
 	if (ret == SD_RES_SUCCESS) {
+		if (tiering)
+			tier_load();
 		if (new_nr > 0) {
 			update_node_disks();
-			kick_recover();
+			if (plug && can_rebalance())
+				md_start_rebalance();
+			else
+				kick_recover();
 		} else {
 			sd_warn("no disks plugged, going down");
 			leave_cluster();
@@ -900,3 +1373,674 @@ uint32_t md_nr_disks(void)
 {
 	return nr_online_disks();
 }
+
+/*
+ * Tiers
+ *
+ * The disks given as 'hot:<path>' form the hot tier, SSDs typically, and the
+ * others the cold one.  Each tier has its own ring of vdisks, and the objects
+ * in the hot set are placed on the hot ring, all the others on the cold one.
+ *
+ * New objects join the hot set as long as the hot tier is not full, and a
+ * cold object joins it after MD_PROMOTE_HITS I/Os, counted approximately in
+ * a small table indexed by the hash of the oid.  Every MD_TIER_INTERVAL, the
+ * hits of the hot objects are halved, and if the hot tier is used more than
+ * MD_TIER_LOW_MARK, the objects without hits since the last run leave the
+ * hot set and are moved to the cold tier.  No object is promoted while the
+ * usage is above MD_TIER_HIGH_MARK.
+ *
+ * Like for the weights, a promoted object is moved to the hot tier by
+ * md_move_object() when it is accessed next.  The hot set only lives in
+ * memory and is rebuilt from the contents of the hot disks at startup.
+ */
+#define MD_PROMOTE_HITS 4
+#define MD_COLD_HITS_SLOTS 4096
+#define MD_TIER_INTERVAL 60	/* sec */
+#define MD_TIER_LOW_MARK 75	/* percent */
+#define MD_TIER_HIGH_MARK 90	/* percent */
+
+struct hot_obj {
+	struct rb_node rb;
+	uint64_t oid;
+	uint8_t ec_index;
+	uint32_t hits;		/* since the hits were halved */
+};
+
+static struct rb_root hot_root = RB_ROOT;
+static struct sd_rw_lock hot_lock = SD_RW_LOCK_INITIALIZER;
+static uint32_t nr_hot_objs;
+static uint32_t cold_hits[MD_COLD_HITS_SLOTS];
+static uatomic_bool hot_full;
+
+static struct timer md_tier_timer;
+static struct work md_tier_work;
+
+static int hot_obj_cmp(const struct hot_obj *a, const struct hot_obj *b)
+{
+	return intcmp(a->oid, b->oid);
+}
+
+static inline struct hot_obj *hot_lookup(uint64_t oid)
+{
+	struct hot_obj key = { .oid = oid };
+
+	return rb_search(&hot_root, &key, rb, hot_obj_cmp);
+}
+
+static bool tier_is_hot(uint64_t oid)
+{
+	bool hot;
+
+	sd_read_lock(&hot_lock);
+	hot = hot_lookup(oid) != NULL;
+	sd_rw_unlock(&hot_lock);
+
+	return hot;
+}
+
+static void hot_insert(uint64_t oid, uint8_t ec_index)
+{
+	struct hot_obj *new = xzalloc(sizeof(*new));
+
+	new->oid = oid;
+	new->ec_index = ec_index;
+
+	sd_write_lock(&hot_lock);
+	if (rb_insert(&hot_root, new, rb, hot_obj_cmp))
+		free(new);
+	else
+		nr_hot_objs++;
+	sd_rw_unlock(&hot_lock);
+}
+
+static void tier_access(uint64_t oid, uint8_t ec_index)
+{
+	struct hot_obj *h;
+	uint32_t *hits;
+
+	sd_read_lock(&hot_lock);
+	h = hot_lookup(oid);
+	if (h)
+		uatomic_inc(&h->hits);
+	sd_rw_unlock(&hot_lock);
+
+	if (h || uatomic_is_true(&hot_full))
+		return;
+
+	hits = cold_hits + sd_hash_oid(oid) % MD_COLD_HITS_SLOTS;
+	if (uatomic_add_return(hits, 1) < MD_PROMOTE_HITS)
+		return;
+
+	uatomic_set(hits, 0);
+	hot_insert(oid, ec_index);
+	sd_debug("promote %016"PRIx64, oid);
+}
+
+/*
+ * Called before creating an object.  An object which already exists on the
+ * cold tier, e.g. one recreated by recovery, is left there.
+ */
+void md_tier_new_object(uint64_t oid, uint8_t ec_index)
+{
+	if (!tiering_enabled() || uatomic_is_true(&hot_full) ||
+	    tier_is_hot(oid) || sd_store->exist(oid, ec_index))
+		return;
+
+	hot_insert(oid, ec_index);
+}
+
+static int tier_load_obj(uint64_t oid, const char *path, uint32_t epoch,
+			 uint8_t ec_index, struct vnode_info *vinfo, void *arg)
+{
+	hot_insert(oid, ec_index);
+	return SD_RES_SUCCESS;
+}
+
+/* Put the objects stored on the hot disks back in the hot set */
+static void tier_load(void)
+{
+	const struct disk *disk;
+
+	sd_read_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (disk->hot)
+			for_each_object_in_path(disk->path, tier_load_obj,
+						false, NULL, NULL);
+	}
+	sd_rw_unlock(&md.lock);
+
+	sd_info("%"PRIu32" objects on the hot tier", nr_hot_objs);
+}
+
+/* The used percentage of the hot tier */
+static uint32_t hot_tier_usage(void)
+{
+	const struct disk *disk;
+	uint64_t total = 0, avail = 0;
+	struct statvfs fs;
+
+	sd_read_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (!disk->hot)
+			continue;
+		if (statvfs(disk->path, &fs) < 0) {
+			sd_err("get disk %s space failed %m", disk->path);
+			continue;
+		}
+		total += (uint64_t)fs.f_frsize * fs.f_blocks;
+		avail += (uint64_t)fs.f_frsize * fs.f_bavail;
+	}
+	sd_rw_unlock(&md.lock);
+
+	return total ? (total - avail) * 100 / total : 0;
+}
+
+static void demote_object(const struct hot_obj *h)
+{
+	const struct disk *disk;
+	int ret = SD_RES_EIO;
+
+	/* the new location is on the cold ring now */
+	sd_read_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		if (!disk->hot)
+			continue;
+		ret = md_check_and_move(h->oid, 0, h->ec_index, disk->path);
+		if (ret == SD_RES_SUCCESS)
+			break;
+	}
+	sd_rw_unlock(&md.lock);
+
+	/* the object may have been removed in the meantime */
+	if (ret != SD_RES_SUCCESS)
+		sd_debug("%016"PRIx64" not found on the hot tier", h->oid);
+}
+
+static void md_update_tiers(struct work *work)
+{
+	struct hot_obj *h, **cold = NULL;
+	uint32_t usage, nr = 0;
+
+	if (!tiering_enabled())
+		return;
+
+	usage = hot_tier_usage();
+	if (usage >= MD_TIER_HIGH_MARK)
+		uatomic_set_true(&hot_full);
+	else
+		uatomic_set_false(&hot_full);
+
+	sd_write_lock(&hot_lock);
+	if (usage >= MD_TIER_LOW_MARK)
+		cold = xmalloc(sizeof(*cold) * nr_hot_objs);
+	rb_for_each_entry(h, &hot_root, rb) {
+		if (cold && !h->hits) {
+			rb_erase(&h->rb, &hot_root);
+			cold[nr++] = h;
+		} else
+			h->hits /= 2;
+	}
+	nr_hot_objs -= nr;
+	sd_rw_unlock(&hot_lock);
+
+	for (uint32_t i = 0; i < nr; i++) {
+		demote_object(cold[i]);
+		free(cold[i]);
+	}
+	free(cold);
+
+	if (nr)
+		sd_info("hot tier %"PRIu32"%% used, %"PRIu32" objects demoted",
+			usage, nr);
+}
+
+static void md_update_tiers_done(struct work *work)
+{
+	add_timer(&md_tier_timer, MD_TIER_INTERVAL * 1000);
+}
+
+static void md_tier_timer_fn(void *data)
+{
+	queue_work(sys->md_wqueue, &md_tier_work);
+}
+
+/* Called once the store is ready, the hot disks can be plugged later */
+void md_start_tiering(void)
+{
+	if (tiering_enabled())
+		tier_load();
+
+	md_tier_work.fn = md_update_tiers;
+	md_tier_work.done = md_update_tiers_done;
+	md_tier_timer.callback = md_tier_timer_fn;
+	add_timer(&md_tier_timer, MD_TIER_INTERVAL * 1000);
+}
+
+/*
+ * I/O classes
+ *
+ * The work queues of the foreground I/O, recovery, deletion and the
+ * background jobs all have their own threads, which compete for the same
+ * disks.  Each disk lets only md_io_depth I/Os in flight at once, and the
+ * rest wait in md_io_begin() for a slot, per class.  A freed slot goes to the
+ * waiting class with the least pass, which advances by the inverse of the
+ * weight of the class on each grant, so the classes share the disk in
+ * proportion to their weights while they are all busy (stride scheduling).
+ * Besides, a class other than the foreground may hold only its share of the
+ * depth, so the background work can never take all of it.
+ *
+ * The waiting recovery I/Os, mostly the whole object reads of the recovery of
+ * the other nodes, are granted in the order of their oids from the last one
+ * granted, wrapping around at the end (C-SCAN).  The objects of a vdi sit in
+ * the same directory in the order they were created, so the disk sweeps
+ * across them instead of seeking back and forth between the requesters.
+ *
+ * The arbiters outlive the disks, so that an I/O to an unplugged disk can
+ * still release its slot.  They are reused when the same path is plugged
+ * again.
+ *
+ * Each disk also has its own work queue of the peer requests, see
+ * md_get_peer_wqueue(), so that a slow or failing disk holds up only the
+ * threads serving it rather than all the ones of the node.
+ */
+#define MD_IO_DEPTH 32
+#define MD_PEER_THREADS 16U
+#define MD_IO_STRIDE 840	/* divisible by all the weights */
+
+static const unsigned int io_class_weight[NR_IO_CLASSES] = {
+	[IO_CLASS_FOREGROUND] = 8,
+	[IO_CLASS_RECOVERY] = 4,
+	[IO_CLASS_DELETION] = 2,
+	[IO_CLASS_BACKGROUND] = 1,
+};
+
+struct io_arbiter {
+	struct list_node list;
+	char path[PATH_MAX];
+
+	struct sd_mutex lock;
+	struct sd_cond cond[NR_IO_CLASSES];
+	unsigned int nr_inflight;
+	unsigned int inflight[NR_IO_CLASSES];
+	unsigned int waiting[NR_IO_CLASSES];
+	unsigned int granted[NR_IO_CLASSES];	/* to the waiters */
+	uint64_t pass[NR_IO_CLASSES];
+	uint64_t vtime;			/* the pass of the last grant */
+
+	struct list_head recovery_waiters;
+	uint64_t recovery_pos;		/* the oid of the last grant */
+
+	/* the peer requests to the disk, created on demand */
+	struct work_queue *wq;
+	char wq_name[16];
+};
+
+struct io_waiter {
+	struct list_node list;
+	uint64_t oid;
+	bool granted;
+};
+
+static LIST_HEAD(io_arbiters);
+static int nr_io_arbiters;
+static unsigned int md_io_depth = MD_IO_DEPTH;
+
+/* the slot taken by the I/O of this thread, see md_account_io() */
+static __thread struct io_arbiter *io_arb;
+static __thread int io_arb_class;
+
+void md_set_io_depth(unsigned int depth)
+{
+	md_io_depth = max(depth, 1U);
+}
+
+/* bind the peer queue of each disk to the numa node of the disk */
+static bool md_numa;
+
+void md_set_numa(bool enable)
+{
+	md_numa = enable;
+}
+
+/* Called at the init stage or under the write lock of md.lock */
+static struct io_arbiter *io_arbiter_get(const char *path)
+{
+	struct io_arbiter *arb;
+	int i;
+
+	list_for_each_entry(arb, &io_arbiters, list)
+		if (!strcmp(arb->path, path))
+			return arb;
+
+	arb = xzalloc(sizeof(*arb));
+	pstrcpy(arb->path, sizeof(arb->path), path);
+	snprintf(arb->wq_name, sizeof(arb->wq_name), "peer%d",
+		 nr_io_arbiters++);
+	sd_init_mutex(&arb->lock);
+	for (i = 0; i < NR_IO_CLASSES; i++)
+		sd_cond_init(&arb->cond[i]);
+	INIT_LIST_HEAD(&arb->recovery_waiters);
+	list_add_tail(&arb->list, &io_arbiters);
+
+	return arb;
+}
+
+static unsigned int io_class_depth(int class)
+{
+	return max(md_io_depth * io_class_weight[class] /
+		   io_class_weight[IO_CLASS_FOREGROUND], 1U);
+}
+
+static bool io_class_runnable(const struct io_arbiter *arb, int class)
+{
+	return arb->nr_inflight < md_io_depth &&
+		arb->inflight[class] < io_class_depth(class);
+}
+
+static void io_grant(struct io_arbiter *arb, int class)
+{
+	arb->nr_inflight++;
+	arb->inflight[class]++;
+	arb->vtime = arb->pass[class];
+	arb->pass[class] += MD_IO_STRIDE / io_class_weight[class];
+}
+
+static bool io_has_waiters(const struct io_arbiter *arb)
+{
+	for (int i = 0; i < NR_IO_CLASSES; i++)
+		if (arb->waiting[i] > arb->granted[i])
+			return true;
+	return false;
+}
+
+/* Grant the waiting recovery I/O next to the last one in the oid order */
+static void io_grant_recovery_waiter(struct io_arbiter *arb)
+{
+	struct io_waiter *w, *next = NULL, *first = NULL;
+
+	list_for_each_entry(w, &arb->recovery_waiters, list) {
+		if (!first || w->oid < first->oid)
+			first = w;
+		if (w->oid >= arb->recovery_pos &&
+		    (!next || w->oid < next->oid))
+			next = w;
+	}
+	if (!next)
+		next = first;
+
+	list_del(&next->list);
+	next->granted = true;
+	arb->recovery_pos = next->oid;
+	sd_cond_broadcast(&arb->cond[IO_CLASS_RECOVERY]);
+}
+
+/* Hand the free slots to the waiters, the least pass first */
+static void io_dispatch(struct io_arbiter *arb)
+{
+	while (arb->nr_inflight < md_io_depth) {
+		int i, class = -1;
+
+		for (i = 0; i < NR_IO_CLASSES; i++) {
+			if (arb->waiting[i] <= arb->granted[i] ||
+			    !io_class_runnable(arb, i))
+				continue;
+			if (class < 0 || arb->pass[i] < arb->pass[class])
+				class = i;
+		}
+		if (class < 0)
+			break;
+
+		io_grant(arb, class);
+		arb->granted[class]++;
+		if (class == IO_CLASS_RECOVERY)
+			io_grant_recovery_waiter(arb);
+		else
+			sd_cond_signal(&arb->cond[class]);
+	}
+}
+
+/*
+ * Wait for a slot of the disk of 'oid' for the I/O class of the current work,
+ * and return the time the I/O starts.  The slot is released by
+ * md_account_io().
+ */
+uint64_t md_io_begin(uint64_t oid, uint8_t ec_index)
+{
+	struct io_arbiter *arb = NULL;
+	int class = get_io_class();
+
+	if (is_main_thread())
+		return clock_get_time();
+
+	sd_read_lock(&md.lock);
+	if (likely(md.nr_disks))
+		arb = oid_to_vdisk(oid)->disk->arb;
+	sd_rw_unlock(&md.lock);
+	if (!arb)
+		return clock_get_time();
+
+	sd_mutex_lock(&arb->lock);
+	/* an idle class doesn't save up the passes */
+	if (!arb->waiting[class] && !arb->inflight[class])
+		arb->pass[class] = max(arb->pass[class], arb->vtime);
+
+	if (!io_has_waiters(arb) && io_class_runnable(arb, class)) {
+		io_grant(arb, class);
+		if (class == IO_CLASS_RECOVERY)
+			arb->recovery_pos = oid;
+	} else if (class == IO_CLASS_RECOVERY) {
+		struct io_waiter w = { .oid = oid };
+
+		list_add_tail(&w.list, &arb->recovery_waiters);
+		arb->waiting[class]++;
+		io_dispatch(arb);
+		while (!w.granted)
+			sd_cond_wait(&arb->cond[class], &arb->lock);
+		arb->granted[class]--;
+		arb->waiting[class]--;
+	} else {
+		arb->waiting[class]++;
+		io_dispatch(arb);
+		while (!arb->granted[class])
+			sd_cond_wait(&arb->cond[class], &arb->lock);
+		arb->granted[class]--;
+		arb->waiting[class]--;
+	}
+	sd_mutex_unlock(&arb->lock);
+
+	io_arb = arb;
+	io_arb_class = class;
+
+	return clock_get_time();
+}
+
+static void md_io_end(void)
+{
+	struct io_arbiter *arb = io_arb;
+
+	if (!arb)
+		return;
+	io_arb = NULL;
+
+	sd_mutex_lock(&arb->lock);
+	arb->nr_inflight--;
+	arb->inflight[io_arb_class]--;
+	io_dispatch(arb);
+	sd_mutex_unlock(&arb->lock);
+}
+
+/*
+ * The work queue of the peer requests to 'oid', the one of its disk, or NULL
+ * if there are no disks, e.g. on a gateway.
+ */
+main_fn struct work_queue *md_get_peer_wqueue(uint64_t oid)
+{
+	struct io_arbiter *arb = NULL;
+
+	sd_read_lock(&md.lock);
+	if (likely(md.nr_disks))
+		arb = oid_to_vdisk(oid)->disk->arb;
+	sd_rw_unlock(&md.lock);
+	if (!arb)
+		return NULL;
+
+	if (unlikely(!arb->wq)) {
+		arb->wq = create_fixed_work_queue(arb->wq_name,
+						  min(md_io_depth,
+						      MD_PEER_THREADS));
+		sd_info("%s for %s", arb->wq_name, arb->path);
+		if (md_numa && numa_nodes() > 1) {
+			int node = numa_node_of_path(arb->path);
+
+			set_work_queue_numa_node(arb->wq, node);
+			sd_info("%s on numa node %d", arb->wq_name, node);
+		}
+	}
+
+	return arb->wq;
+}
+
+/*
+ * Charge the I/O which started at 'start' to the disk of 'oid', for the
+ * performance weights of the disks, and release its slot taken by
+ * md_io_begin().
+ */
+void md_account_io(uint64_t oid, uint8_t ec_index, uint32_t len,
+		   uint64_t start)
+{
+	struct disk *disk;
+
+	md_io_end();
+
+	if (tiering_enabled())
+		tier_access(oid, ec_index);
+
+	if (!md.perf_interval)
+		return;
+
+	sd_read_lock(&md.lock);
+	if (likely(md.nr_disks)) {
+		disk = oid_to_vdisk(oid)->disk;
+		uatomic_inc(&disk->nr_ios);
+		uatomic_add(&disk->io_bytes, len);
+		uatomic_add(&disk->io_time, clock_get_time() - start);
+	}
+	sd_rw_unlock(&md.lock);
+}
+
+/*
+ * Performance weights
+ *
+ * By default the objects are spread over the disks in proportion to their
+ * space.  With 'sheep -M', the number of the vdisks of a disk is further
+ * scaled by its weight: the ratio of its average latency to the one of the
+ * fastest disk, or of its throughput to the one of the fastest disk, which
+ * ever is worse, but at least min_weight percent.  SSDs then get more
+ * objects than HDDs of the same size, and a degraded disk sheds load.
+ *
+ * The averages are updated every interval, and the vdisks are rebuilt only if
+ * a weight moved by MD_WEIGHT_STEP.  The misplaced objects are moved to their
+ * new disk by md_move_object() when they are accessed next, so the hot
+ * objects migrate first and the cold ones stay where they are until then.
+ */
+#define MD_WEIGHT_STEP 20	/* percent */
+#define MD_PERF_MIN_IOS 64	/* I/Os to update the averages of a disk */
+
+static struct timer md_perf_timer;
+static struct work md_perf_work;
+
+static void update_avg(uint64_t *avg, uint64_t val)
+{
+	*avg = *avg ? (*avg * 3 + val) / 4 : val;
+}
+
+/* A disk without stats yet, e.g. an idle one, keeps the full weight */
+static uint32_t disk_perf_weight(const struct disk *disk, uint64_t best_latency,
+				 uint64_t best_throughput)
+{
+	uint32_t weight = 100;
+
+	if (disk->avg_latency)
+		weight = min(weight, (uint32_t)(best_latency * 100 /
+						disk->avg_latency));
+	if (disk->avg_throughput)
+		weight = min(weight, (uint32_t)(disk->avg_throughput * 100 /
+						best_throughput));
+
+	return max(weight, md.min_weight);
+}
+
+static void md_update_weights(struct work *work)
+{
+	uint64_t best_latency = UINT64_MAX, best_throughput = 0;
+	struct disk *disk;
+	bool changed = false;
+
+	if (is_cluster_diskmode(&sys->cinfo))
+		/* the vdisks are a part of the cluster wide placement */
+		return;
+
+	sd_read_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		uint64_t nr = uatomic_xchg(&disk->nr_ios, 0);
+		uint64_t bytes = uatomic_xchg(&disk->io_bytes, 0);
+		uint64_t time = uatomic_xchg(&disk->io_time, 0);
+
+		if (nr >= MD_PERF_MIN_IOS && time) {
+			update_avg(&disk->avg_latency, time / nr);
+			update_avg(&disk->avg_throughput,
+				   (double)bytes * 1000000000 / time);
+		}
+		if (disk->avg_latency)
+			best_latency = min(best_latency, disk->avg_latency);
+		best_throughput = max(best_throughput, disk->avg_throughput);
+	}
+
+	rb_for_each_entry(disk, &md.root, rb) {
+		uint32_t weight = disk_perf_weight(disk, best_latency,
+						   best_throughput);
+
+		if (abs((int)weight - (int)disk->weight) >= MD_WEIGHT_STEP)
+			changed = true;
+	}
+	sd_rw_unlock(&md.lock);
+
+	if (!changed)
+		return;
+
+	/* only this work updates the averages, so the weights are the same */
+	sd_write_lock(&md.lock);
+	rb_for_each_entry(disk, &md.root, rb) {
+		remove_vdisks(disk);
+		disk->weight = disk_perf_weight(disk, best_latency,
+						best_throughput);
+		create_vdisks(disk);
+		sd_info("%s, weight %"PRIu32"%%, latency %"PRIu64" us, "
+			"throughput %"PRIu64" MB/s, vdisk nr %d", disk->path,
+			disk->weight, disk->avg_latency / 1000,
+			disk->avg_throughput / (1024 * 1024), disk->nr_vdisks);
+	}
+	sd_rw_unlock(&md.lock);
+}
+
+static void md_update_weights_done(struct work *work)
+{
+	add_timer(&md_perf_timer, md.perf_interval * 1000);
+}
+
+static void md_perf_timer_fn(void *data)
+{
+	queue_work(sys->md_wqueue, &md_perf_work);
+}
+
+/* Start weighting the disks by their performance every 'interval' seconds */
+void md_start_perf_weight(unsigned int interval, unsigned int min_weight)
+{
+	md.perf_interval = interval;
+	md.min_weight = min_weight;
+
+	md_perf_work.fn = md_update_weights;
+	md_perf_work.done = md_update_weights_done;
+	md_perf_timer.callback = md_perf_timer_fn;
+	add_timer(&md_perf_timer, interval * 1000);
+}
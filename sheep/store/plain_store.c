@@ -12,6 +12,7 @@
 #include <libgen.h>
 
 #include "sheep_priv.h"
+#include "crc32c.h"
 
 static int get_store_path(uint64_t oid, uint8_t ec_index, char *path)
 {
@@ -89,17 +90,23 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 	int flags = prepare_iocb(oid, iocb, false), fd,
 	    ret = SD_RES_SUCCESS;
 	char path[PATH_MAX];
+	struct object_fd *ofd;
 	ssize_t size;
 	uint32_t len = iocb->length;
-	uint64_t offset = iocb->offset;
+	uint64_t offset = iocb->offset, start;
 	static bool trim_is_supported = true;
+	bool readonly = oid_is_readonly(oid), compressed;
 
 	if (iocb->epoch < sys_epoch()) {
 		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
 		return SD_RES_OLD_NODE_VER;
 	}
 
-	if (uatomic_is_true(&sys->use_journal) &&
+	get_store_path(oid, iocb->ec_index, path);
+	/* the journal can't replay the writes to a compressed object */
+	compressed = compress_check(oid, path);
+
+	if (uatomic_is_true(&sys->use_journal) && !compressed &&
 	    unlikely(journal_write_store(oid, iocb->buf, iocb->length,
 					 iocb->offset, false))
 	    != SD_RES_SUCCESS) {
@@ -109,19 +116,31 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		sync();
 	}
 
-	get_store_path(oid, iocb->ec_index, path);
+	/* the file of a read-only object may be shared, see dedup.c */
+	if (unlikely(readonly)) {
+		ret = dedup_begin_write(oid, path);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
 
-	/*
-	 * Make sure oid is in the right place because oid might be misplaced
-	 * in a wrong place, due to 'shutdown/restart with less/more disks' or
-	 * any bugs. We need call err_to_sderr() to return EIO if disk is broken
-	 */
-	if (!default_exist(oid, iocb->ec_index))
-		return err_to_sderr(path, oid, ENOENT);
+	ofd = object_fd_get(oid, iocb->ec_index, path, flags, &ret);
+	if (unlikely(!ofd))
+		goto unlock;
+	fd = ofd->fd;
 
-	fd = open(path, flags, sd_def_fmode);
-	if (unlikely(fd < 0))
-		return err_to_sderr(path, oid, errno);
+	if (compressed) {
+		start = md_io_begin(oid, iocb->ec_index);
+		ret = compress_write(oid, fd, path, iocb, sync_writes());
+		md_account_io(oid, iocb->ec_index, len, start);
+		goto out;
+	}
+
+	if (csum_check(fd)) {
+		start = md_io_begin(oid, iocb->ec_index);
+		ret = csum_write(oid, fd, path, iocb);
+		md_account_io(oid, iocb->ec_index, len, start);
+		goto out;
+	}
 
 	if (trim_is_supported && is_sparse_object(oid)) {
 		if (default_trim(fd, oid, iocb, &offset, &len) < 0) {
@@ -131,7 +150,9 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		}
 	}
 
-	size = xpwrite(fd, iocb->buf, len, offset);
+	start = md_io_begin(oid, iocb->ec_index);
+	size = store_pwrite(oid, fd, iocb->buf, len, offset);
+	md_account_io(oid, iocb->ec_index, len, start);
 	if (unlikely(size != len)) {
 		sd_err("failed to write object %016"PRIx64", path=%s, offset=%"
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
@@ -140,7 +161,12 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		goto out;
 	}
 out:
-	close(fd);
+	if (ret == SD_RES_SUCCESS)
+		writeback_written(iocb->length);
+	object_fd_put(ofd);
+unlock:
+	if (unlikely(readonly))
+		dedup_end_write();
 	return ret;
 }
 
@@ -169,9 +195,7 @@ static int purge_stale_dir(const char *path)
 	char p[PATH_MAX];
 
 	snprintf(p, PATH_MAX, "%s/.stale", path);
-
-	if (purge_directory_async(p) < 0)
-		return SD_RES_EIO;
+	purge_stale_objects(p);
 
 	return SD_RES_SUCCESS;
 }
@@ -205,7 +229,8 @@ static int init_vdi_state(uint64_t oid, const char *wd, uint32_t epoch)
 	}
 	add_vdi_state_unordered(oid_to_vid(oid), inode->nr_copies,
 		      vdi_is_snapshot(inode), inode->copy_policy,
-		      inode->block_size_shift, inode->parent_vdi_id);
+		      inode->block_size_shift, inode->parent_vdi_id,
+		      inode->flags);
 
 	if (inode->name[0] == '\0')
 		atomic_set_bit(oid_to_vid(oid), sys->vdi_deleted);
@@ -245,17 +270,74 @@ int default_init(void)
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
+	if (load_startup_state())
+		return SD_RES_SUCCESS;
+
 	for_each_object_in_stale(init_objlist_and_vdi_bitmap, NULL);
 
 	return for_each_object_in_wd(init_objlist_and_vdi_bitmap, true, NULL);
 }
 
+/*
+ * Read only the data which the file holds in the range of iocb and zero the
+ * holes, recording the data extents in iocb->extents unless there are too
+ * many of them.  Falls back to reading the whole range if the file system
+ * can't tell the holes.
+ */
+static ssize_t read_data_extents(uint64_t oid, int fd,
+				 const struct siocb *iocb)
+{
+	struct sd_extents *e = iocb->extents;
+	off_t off = iocb->offset, end = off + iocb->length, data, hole;
+	char *buf = iocb->buf;
+	uint32_t nr = 0;
+
+	e->length = 0;
+	while (off < end) {
+		data = lseek(fd, off, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			data = end;	/* a hole up to the end of the file */
+		else if (data < 0)
+			goto fallback;
+		data = min(data, end);
+		memset(buf + off - iocb->offset, 0, data - off);
+		if (data == end)
+			break;
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			goto fallback;
+		hole = min(hole, end);
+		if (store_pread(oid, fd, buf + data - iocb->offset,
+				hole - data, data) < 0)
+			return -1;
+
+		if (nr < SD_MAX_EXTENTS) {
+			e->ext[nr].offset = data - iocb->offset;
+			e->ext[nr].length = hole - data;
+		}
+		nr++;
+		off = hole;
+	}
+
+	if (nr <= SD_MAX_EXTENTS) {
+		e->nr = nr;
+		e->length = iocb->length;
+	}
+	return iocb->length;
+fallback:
+	return store_pread(oid, fd, iocb->buf, iocb->length, iocb->offset);
+}
+
+/* verify is whether to check the checksums of the object, see checksum.c */
 static int default_read_from_path(uint64_t oid, const char *path,
-				  const struct siocb *iocb)
+				  const struct siocb *iocb, bool verify)
 {
 	int flags = prepare_iocb(oid, iocb, false), fd,
 	    ret = SD_RES_SUCCESS;
 	ssize_t size;
+	struct object_fd *ofd = NULL;
+	uint64_t start;
 
 	/*
 	 * Make sure oid is in the right place because oid might be misplaced
@@ -264,21 +346,45 @@ static int default_read_from_path(uint64_t oid, const char *path,
 	 *
 	 * For stale path, get_store_stale_path already does default_exist job.
 	 */
-	if (!is_stale_path(path) && !default_exist(oid, iocb->ec_index))
-		return err_to_sderr(path, oid, ENOENT);
-
-	fd = open(path, flags);
-	if (fd < 0)
-		return err_to_sderr(path, oid, errno);
+	if (is_stale_path(path)) {
+		fd = open(path, flags);
+		if (fd < 0)
+			return err_to_sderr(path, oid, errno);
+	} else {
+		ofd = object_fd_get(oid, iocb->ec_index, path, flags, &ret);
+		if (!ofd)
+			return ret;
+		fd = ofd->fd;
+	}
 
-	size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
+	start = md_io_begin(oid, iocb->ec_index);
+	if (compress_check(oid, path)) {
+		ret = compress_read(oid, fd, path, iocb);
+		md_account_io(oid, iocb->ec_index, iocb->length, start);
+		goto out;
+	}
+	if (verify && csum_check(fd)) {
+		ret = csum_read(oid, fd, path, iocb);
+		md_account_io(oid, iocb->ec_index, iocb->length, start);
+		goto out;
+	}
+	if (iocb->extents)
+		size = read_data_extents(oid, fd, iocb);
+	else
+		size = store_pread(oid, fd, iocb->buf, iocb->length,
+				   iocb->offset);
+	md_account_io(oid, iocb->ec_index, iocb->length, start);
 	if (size < 0) {
 		sd_err("failed to read object %016"PRIx64", path=%s, offset=%"
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
 		       iocb->offset, iocb->length, size);
 		ret = err_to_sderr(path, oid, errno);
 	}
-	close(fd);
+out:
+	if (ofd)
+		object_fd_put(ofd);
+	else
+		close(fd);
 	return ret;
 }
 
@@ -288,7 +394,7 @@ int default_read(uint64_t oid, const struct siocb *iocb)
 	char path[PATH_MAX];
 
 	get_store_path(oid, iocb->ec_index, path);
-	ret = default_read_from_path(oid, path, iocb);
+	ret = default_read_from_path(oid, path, iocb, true);
 
 	/*
 	 * If the request is against the older epoch, try to read from
@@ -298,7 +404,7 @@ int default_read(uint64_t oid, const struct siocb *iocb)
 	    (iocb->wildcard ||
 	     (0 < iocb->epoch && iocb->epoch < sys_epoch()))) {
 		get_store_stale_path(oid, iocb->epoch, iocb->ec_index, path);
-		ret = default_read_from_path(oid, path, iocb);
+		ret = default_read_from_path(oid, path, iocb, true);
 	}
 
 	return ret;
@@ -309,12 +415,14 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 	char path[PATH_MAX], tmp_path[PATH_MAX], *dir;
 	int flags = prepare_iocb(oid, iocb, true);
 	int ret, fd;
+	bool anon;
 	uint32_t len = iocb->length;
 	uint32_t object_size = 0;
 	size_t obj_size;
 	uint64_t offset = iocb->offset;
 
 	sd_debug("%016"PRIx64, oid);
+	md_tier_new_object(oid, iocb->ec_index);
 	get_store_path(oid, iocb->ec_index, path);
 	get_store_tmp_path(oid, iocb->ec_index, tmp_path);
 
@@ -328,7 +436,7 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		sync();
 	}
 
-	fd = open(tmp_path, flags, sd_def_fmode);
+	fd = open_object_file(path, tmp_path, flags, &anon);
 	if (fd < 0) {
 		if (errno == EEXIST) {
 			/*
@@ -346,6 +454,13 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		return err_to_sderr(path, oid, errno);
 	}
 
+	if (compress_enabled(oid) && !iocb->cow) {
+		ret = compress_create(oid, fd, path, iocb);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		goto install;
+	}
+
 	obj_size = get_store_objsize(oid);
 
 	trim_zero_blocks(iocb->buf, &offset, &len);
@@ -363,23 +478,41 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 		}
 	}
 
-	ret = xpwrite(fd, iocb->buf, len, offset);
+	ret = store_pwrite(oid, fd, iocb->buf, len, offset);
 	if (ret != len) {
 		sd_err("failed to write object. %m");
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
 
-	ret = rename(tmp_path, path);
+	if (!iocb->cow && csum_enabled() && csum_create(oid, fd, iocb) < 0) {
+		sd_err("failed to set the checksums of %s: %m", tmp_path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	/* the map must be there as soon as the object is */
+	if (iocb->cow &&
+	    (fsetxattr(fd, COWNAME, iocb->cow, sizeof(*iocb->cow), 0) < 0 ||
+	     (sync_writes() && fsync(fd) < 0))) {
+		sd_err("failed to set the map of %s: %m", tmp_path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+install:
+	ret = install_object_file(fd, anon, path, tmp_path);
 	if (ret < 0) {
-		sd_err("failed to rename %s to %s: %m", tmp_path, path);
+		sd_err("failed to install %s: %m", path);
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
+	/* the cached fd, if any, refers to the replaced file */
+	object_fd_invalidate(oid, iocb->ec_index);
 
 	close(fd);
 
-	if (uatomic_is_true(&sys->use_journal) || sys->nosync == true) {
+	writeback_written(iocb->length);
+	if (uatomic_is_true(&sys->use_journal) || !sync_writes()) {
 		objlist_cache_insert(oid);
 		return SD_RES_SUCCESS;
 	}
@@ -405,7 +538,7 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 	return SD_RES_SUCCESS;
 
 out:
-	if (unlink(tmp_path) != 0)
+	if (!anon && unlink(tmp_path) != 0)
 		sd_err("failed to unlink %s: %m", tmp_path);
 	close(fd);
 	return ret;
@@ -432,6 +565,7 @@ int default_link(uint64_t oid, uint32_t tgt_epoch)
 		sd_debug("failed to link from %s to %s, %m", stale_path, path);
 		return err_to_sderr(path, oid, errno);
 	}
+	object_fd_invalidate(oid, 0);
 out:
 	return SD_RES_SUCCESS;
 }
@@ -444,7 +578,8 @@ out:
  * other node(index gets changed even it has some other copy belongs to it)
  * because of hash ring changes, we consider it stale.
  */
-static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
+static bool oid_stale(uint64_t oid, uint8_t ec_index,
+		      struct vnode_info *vinfo)
 {
 	uint32_t i, nr_copies;
 	const struct sd_vnode *v;
@@ -452,7 +587,7 @@ static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
 	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
 
 	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
-	oid_to_vnodes(oid, &vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (vnode_is_local(v)) {
@@ -495,31 +630,29 @@ static int move_object_to_stale_dir(uint64_t oid, const char *wd,
 		       path);
 		return SD_RES_EIO;
 	}
+	object_fd_invalidate(oid, ec_index < SD_MAX_COPIES ? ec_index : 0);
 
 	sd_debug("moved object %016"PRIx64, oid);
 	return SD_RES_SUCCESS;
 }
 
-static int check_stale_objects(uint64_t oid, const char *wd, uint32_t epoch,
-			       uint8_t ec_index, struct vnode_info *vinfo,
-			       void *arg)
+static int move_stale_object(uint64_t oid, uint8_t ec_index,
+			     uint32_t tgt_epoch)
 {
-	if (oid_stale(oid, ec_index, vinfo))
-		return move_object_to_stale_dir(oid, wd, 0, ec_index,
-						NULL, arg);
-
-	return SD_RES_SUCCESS;
+	return move_object_to_stale_dir(oid, NULL, 0, ec_index, NULL,
+					&tgt_epoch);
 }
 
 int default_update_epoch(uint32_t epoch)
 {
 	sd_assert(epoch);
-	return for_each_object_in_wd(check_stale_objects, false, &epoch);
+	return move_stale_objects_in_wd(oid_stale, move_stale_object, epoch);
 }
 
 int default_format(void)
 {
 	sd_debug("try get a clean store");
+	object_fd_invalidate_dir(NULL);
 	return for_each_obj_path(purge_dir);
 }
 
@@ -531,6 +664,7 @@ int default_remove_object(uint64_t oid, uint8_t ec_index)
 		journal_remove_object(oid);
 
 	get_store_path(oid, ec_index, path);
+	object_fd_invalidate(oid, ec_index);
 
 	if (unlink(path) < 0) {
 		if (errno == ENOENT)
@@ -594,7 +728,7 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	int ret;
 	void *buf;
 	struct siocb iocb = {};
-	uint32_t length;
+	uint32_t length, version;
 	bool is_readonly_obj = oid_is_readonly(oid);
 	char path[PATH_MAX];
 
@@ -610,6 +744,11 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 		}
 	}
 
+	if (csum_get_sha1(oid, path, sha1, &version)) {
+		sd_debug("use cached sha1 digest %s", sha1_to_hex(sha1));
+		return SD_RES_SUCCESS;
+	}
+
 	length = get_store_objsize(oid);
 	ret = posix_memalign((void **)&buf, getpagesize(), length);
 	if (ret)
@@ -619,13 +758,14 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	iocb.buf = buf;
 	iocb.length = length;
 
-	ret = default_read_from_path(oid, path, &iocb);
+	ret = default_read_from_path(oid, path, &iocb, false);
 	if (ret != SD_RES_SUCCESS) {
 		free(buf);
 		return ret;
 	}
 
 	get_buffer_sha1(buf, length, sha1);
+	cow_hash_map(path, sha1);
 	free(buf);
 
 	sd_debug("the message digest of %016"PRIx64" at epoch %d is %s", oid,
@@ -633,7 +773,76 @@ int default_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 
 	if (is_readonly_obj)
 		set_object_sha1(path, sha1);
+	else if (version)
+		csum_set_sha1(oid, path, sha1, version);
+
+	return ret;
+}
+
+int default_get_block_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+{
+	struct cow_map map;
+	int ret;
+	void *buf;
+	struct siocb iocb = {};
+	uint32_t length;
+	char path[PATH_MAX];
+
+	ret = get_object_path(oid, epoch, path, sizeof(path));
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* the blocks alone can't rebuild a sparse object */
+	if (cow_read_map(path, &map) > 0)
+		return SD_RES_INVALID_PARMS;
+
+	length = get_store_objsize(oid);
+	buf = xpool_alloc(length);
+
+	iocb.epoch = epoch;
+	iocb.buf = buf;
+	iocb.length = length;
+
+	ret = default_read_from_path(oid, path, &iocb, false);
+	if (ret == SD_RES_SUCCESS)
+		get_buffer_block_sha1(buf, length, SD_HASH_BLOCK_SIZE, sha1);
+
+	pool_free(buf, length);
+	return ret;
+}
+
+int default_get_crc32c(uint64_t oid, uint32_t epoch, uint32_t *crc)
+{
+	struct cow_map map;
+	int ret;
+	void *buf;
+	struct siocb iocb = {};
+	uint32_t length;
+	char path[PATH_MAX];
+
+	ret = get_object_path(oid, epoch, path, sizeof(path));
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (csum_get_crc32c(oid, path, crc))
+		return SD_RES_SUCCESS;
+
+	length = get_store_objsize(oid);
+	buf = xpool_alloc(length);
+
+	iocb.epoch = epoch;
+	iocb.buf = buf;
+	iocb.length = length;
+
+	ret = default_read_from_path(oid, path, &iocb, false);
+	if (ret == SD_RES_SUCCESS) {
+		*crc = crc32c(0, buf, length);
+		/* the map of a sparse object counts, like cow_hash_map() */
+		if (cow_read_map(path, &map) > 0)
+			*crc = crc32c(*crc, &map, sizeof(map));
+	}
 
+	pool_free(buf, length);
 	return ret;
 }
 
@@ -659,6 +868,8 @@ static struct store_driver plain_store = {
 	.format = default_format,
 	.remove_object = default_remove_object,
 	.get_hash = default_get_hash,
+	.get_block_hash = default_get_block_hash,
+	.get_crc32c = default_get_crc32c,
 	.purge_obj = default_purge_obj,
 };
 
@@ -0,0 +1,959 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Raw block device store driver
+ *
+ * This driver keeps the objects on the block device given by 'sheep -B'
+ * without a file system.  The device starts with a superblock and a table of
+ * RAW_ENTRY_SIZE entries, one for each slot of the data area which follows.
+ * The slots are as large as the data objects of the cluster at format time;
+ * an object takes the contiguous slots it needs and is described by the entry
+ * of its first slot.  The table is loaded into memory at startup, and the
+ * allocation bitmap of the slots and the index of the objects are built from
+ * it.
+ *
+ * The data of a new object is written before its entry, and the entry of a
+ * removed object is cleared before its slots can be reused, so the table only
+ * points to written slots and the bitmap derived from it is consistent after
+ * a crash.  An entry is rewritten in place when its object becomes the stale
+ * copy of an epoch, and every write of an entry takes a new sequence number:
+ * if a crash leaves two entries of (oid, ec_index, epoch), the higher one wins
+ * and the other is freed at startup.
+ *
+ * The object I/O is direct when prepare_iocb() says so (sheep -D), through
+ * store_pread() and store_pwrite(), buffered otherwise.  The table blocks are
+ * always written directly.
+ */
+
+#include <linux/falloc.h>
+
+#include "sheep_priv.h"
+#include "crc32c.h"
+
+#define RAW_MAGIC		0x73726177
+#define RAW_VERSION		1
+#define RAW_BLOCK_SIZE		4096
+#define RAW_ENTRY_SIZE		32
+#define RAW_DATA_ALIGN		(UINT64_C(1) << 20)
+#define NR_RAW_LOCKS		64
+
+struct raw_super {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t nr_slots;
+	uint64_t table_offset;
+	uint64_t data_offset;
+	uint32_t crc; /* CRC32C of the superblock with crc zeroed */
+	uint32_t pad;
+};
+
+struct raw_entry {
+	uint64_t oid;
+	uint64_t seq;
+	uint32_t epoch; /* of a stale copy, 0 for the object */
+	uint32_t length; /* of the object */
+	uint16_t nr_slots; /* 0 if the slot isn't the first one of an object */
+	uint8_t ec_index;
+	uint8_t pad;
+	uint32_t crc; /* CRC32C of the entry with crc zeroed */
+};
+
+struct raw_object {
+	struct rb_node rb;
+	uint64_t oid;
+	uint32_t epoch;
+	uint8_t ec_index;
+	uint32_t slot;
+};
+
+static struct raw_super super;
+static int raw_fd = -1, raw_dio_fd = -1;
+
+/* raw_lock protects the index, the bitmap and the table in memory */
+static struct sd_rw_lock raw_lock = SD_RW_LOCK_INITIALIZER;
+static struct rb_root raw_index = RB_ROOT;
+static unsigned long *slot_bitmap;
+static struct raw_entry *table;
+static uint32_t next_slot;
+static uint64_t raw_seq;
+
+/* serializes the writes of the table blocks */
+static struct sd_mutex table_lock = SD_MUTEX_INITIALIZER;
+
+/* serialize the allocation and the entry updates with the I/O of an object */
+static struct sd_rw_lock raw_obj_locks[NR_RAW_LOCKS] = {
+	[0 ... NR_RAW_LOCKS - 1] = SD_RW_LOCK_INITIALIZER
+};
+
+static struct sd_rw_lock *get_obj_lock(uint64_t oid)
+{
+	return &raw_obj_locks[sd_hash_oid(oid) % NR_RAW_LOCKS];
+}
+
+static uint8_t raw_ec_index(uint64_t oid, uint8_t ec_index)
+{
+	return is_erasure_oid(oid) ? ec_index : 0;
+}
+
+static uint64_t slot_offset(uint32_t slot)
+{
+	return super.data_offset + (uint64_t)slot * super.slot_size;
+}
+
+static int raw_object_cmp(const struct raw_object *a,
+			  const struct raw_object *b)
+{
+	int ret = intcmp(a->oid, b->oid);
+
+	if (ret)
+		return ret;
+	ret = intcmp(a->ec_index, b->ec_index);
+	if (ret)
+		return ret;
+	return intcmp(a->epoch, b->epoch);
+}
+
+/* Called with raw_lock held */
+static struct raw_object *lookup_object(uint64_t oid, uint8_t ec_index,
+					uint32_t epoch)
+{
+	struct raw_object key = {
+		.oid = oid,
+		.ec_index = ec_index,
+		.epoch = epoch,
+	};
+
+	return rb_search(&raw_index, &key, rb, raw_object_cmp);
+}
+
+static uint32_t entry_crc(const struct raw_entry *e)
+{
+	struct raw_entry tmp = *e;
+
+	tmp.crc = 0;
+	return crc32c(0, &tmp, sizeof(tmp));
+}
+
+static bool entry_valid(const struct raw_entry *e)
+{
+	return e->nr_slots && e->crc == entry_crc(e);
+}
+
+/* Write the table block which holds the entry of slot to the device */
+static int write_entry(uint32_t slot)
+{
+	uint32_t per_block = RAW_BLOCK_SIZE / RAW_ENTRY_SIZE;
+	uint32_t first = slot - slot % per_block;
+	void *buf = xvalloc(RAW_BLOCK_SIZE);
+	int ret = 0;
+
+	memset(buf, 0, RAW_BLOCK_SIZE);
+	sd_mutex_lock(&table_lock);
+	sd_read_lock(&raw_lock);
+	memcpy(buf, table + first,
+	       min(per_block, super.nr_slots - first) * RAW_ENTRY_SIZE);
+	sd_rw_unlock(&raw_lock);
+
+	if (xpwrite(raw_dio_fd, buf, RAW_BLOCK_SIZE, super.table_offset +
+		    (uint64_t)first * RAW_ENTRY_SIZE) != RAW_BLOCK_SIZE ||
+	    (!sys->nosync && fdatasync(raw_dio_fd) < 0)) {
+		sd_err("failed to write the entry of the slot %"PRIu32", %m",
+		       slot);
+		ret = -1;
+	}
+	sd_mutex_unlock(&table_lock);
+	free(buf);
+
+	return ret;
+}
+
+/* Called with raw_lock held */
+static void set_entry(uint32_t slot, uint64_t oid, uint8_t ec_index,
+		      uint32_t epoch, uint32_t length, uint16_t nr_slots)
+{
+	struct raw_entry *e = table + slot;
+
+	memset(e, 0, sizeof(*e));
+	if (nr_slots) {
+		e->oid = oid;
+		e->seq = ++raw_seq;
+		e->epoch = epoch;
+		e->length = length;
+		e->nr_slots = nr_slots;
+		e->ec_index = ec_index;
+		e->crc = entry_crc(e);
+	}
+}
+
+static uint16_t slots_of(uint32_t length)
+{
+	return DIV_ROUND_UP(length, super.slot_size);
+}
+
+/* Find nr contiguous free slots and take them */
+static int alloc_slots(uint16_t nr, uint32_t *slot)
+{
+	uint32_t start, end, i, tries = 0;
+
+	sd_write_lock(&raw_lock);
+	start = next_slot;
+	while (tries < 2) {
+		start = find_next_zero_bit(slot_bitmap, super.nr_slots, start);
+		if (start + nr > super.nr_slots) {
+			/* wrap around once */
+			start = 0;
+			tries++;
+			continue;
+		}
+		end = find_next_bit(slot_bitmap, start + nr, start);
+		if (end >= start + nr) {
+			for (i = start; i < start + nr; i++)
+				set_bit(i, slot_bitmap);
+			next_slot = start + nr;
+			*slot = start;
+			sd_rw_unlock(&raw_lock);
+			return 0;
+		}
+		start = end;
+	}
+	sd_rw_unlock(&raw_lock);
+
+	sd_err("no %"PRIu16" free slots", nr);
+	return -1;
+}
+
+/* Called with raw_lock held */
+static void free_slots(uint32_t slot, uint16_t nr)
+{
+	for (uint32_t i = slot; i < slot + nr; i++)
+		clear_bit(i, slot_bitmap);
+}
+
+/* Let the device discard the slots of a removed object */
+static void discard_slots(uint32_t slot, uint16_t nr)
+{
+	if (xfallocate(raw_fd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE,
+		       slot_offset(slot), (uint64_t)nr * super.slot_size) < 0 &&
+	    errno != EOPNOTSUPP)
+		sd_err("failed to discard the slot %"PRIu32", %m", slot);
+}
+
+/* Zero len bytes at offset of the device, which may not support it */
+static int zero_range(uint64_t offset, uint64_t len)
+{
+	static bool zero_range_is_supported = true;
+	void *buf;
+	uint32_t n;
+
+	if (!len)
+		return 0;
+	if (zero_range_is_supported) {
+		if (xfallocate(raw_fd, FALLOC_FL_KEEP_SIZE |
+			       FALLOC_FL_ZERO_RANGE, offset, len) == 0)
+			return 0;
+		if (errno != EOPNOTSUPP)
+			return -1;
+		zero_range_is_supported = false;
+	}
+
+	buf = xzalloc(SD_DATA_OBJ_SIZE);
+	for (; len; offset += n, len -= n) {
+		n = min(len, (uint64_t)SD_DATA_OBJ_SIZE);
+		if (xpwrite(raw_fd, buf, n, offset) != n) {
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+static int to_sderr(int err)
+{
+	return err == ENOSPC ? SD_RES_NO_SPACE : SD_RES_EIO;
+}
+
+/* The fd to access the objects with flags from prepare_iocb() */
+static int get_fd(int flags)
+{
+	return (flags & O_DIRECT) ? raw_dio_fd : raw_fd;
+}
+
+static int sync_fd(int fd, int flags)
+{
+	if ((flags & (O_DSYNC | O_SYNC)) && fdatasync(fd) < 0) {
+		sd_err("failed to sync, %m");
+		return -1;
+	}
+	return 0;
+}
+
+/* Drop the object of slot from the table, which the caller took out */
+static void kill_object(struct raw_object *obj)
+{
+	uint16_t nr;
+
+	sd_write_lock(&raw_lock);
+	nr = table[obj->slot].nr_slots;
+	set_entry(obj->slot, 0, 0, 0, 0, 0);
+	sd_rw_unlock(&raw_lock);
+
+	/* the slots are reused only after the entry is cleared */
+	if (write_entry(obj->slot) < 0)
+		goto out;
+	discard_slots(obj->slot, nr);
+	sd_write_lock(&raw_lock);
+	free_slots(obj->slot, nr);
+	sd_rw_unlock(&raw_lock);
+out:
+	free(obj);
+}
+
+/*
+ * Store the object (oid, ec_index, epoch) whose data is len bytes of buf at
+ * off and zero elsewhere, and replace the older one.  Called with the write
+ * lock of the object held.
+ */
+static int store_object(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+			uint32_t length, const void *buf, uint64_t off,
+			uint32_t len, int flags)
+{
+	uint16_t nr = slots_of(length);
+	struct raw_object *obj, *old;
+	uint64_t start;
+	uint32_t slot;
+	int fd = get_fd(flags);
+
+	if (nr == 0 || alloc_slots(nr, &slot) < 0)
+		return SD_RES_NO_SPACE;
+	start = slot_offset(slot);
+
+	if (zero_range(start, off) < 0 ||
+	    zero_range(start + off + len, length - off - len) < 0 ||
+	    (len && store_pwrite(oid, fd, buf, len, start + off) != len) ||
+	    sync_fd(fd, O_DSYNC) < 0) {
+		sd_err("failed to write %016"PRIx64" to the slot %"PRIu32", %m",
+		       oid, slot);
+		goto err;
+	}
+
+	sd_write_lock(&raw_lock);
+	set_entry(slot, oid, ec_index, epoch, length, nr);
+	sd_rw_unlock(&raw_lock);
+	if (write_entry(slot) < 0)
+		goto err;
+
+	obj = xzalloc(sizeof(*obj));
+	obj->oid = oid;
+	obj->ec_index = ec_index;
+	obj->epoch = epoch;
+	obj->slot = slot;
+	sd_write_lock(&raw_lock);
+	old = rb_insert(&raw_index, obj, rb, raw_object_cmp);
+	if (old) {
+		rb_erase(&old->rb, &raw_index);
+		rb_insert(&raw_index, obj, rb, raw_object_cmp);
+	}
+	sd_rw_unlock(&raw_lock);
+	if (old)
+		kill_object(old);
+
+	return SD_RES_SUCCESS;
+err:
+	sd_write_lock(&raw_lock);
+	set_entry(slot, 0, 0, 0, 0, 0);
+	free_slots(slot, nr);
+	sd_rw_unlock(&raw_lock);
+	return to_sderr(errno);
+}
+
+/* Copy the slot and the length of the object out of the index */
+static bool get_object(uint64_t oid, uint8_t ec_index, uint32_t epoch,
+		       uint32_t *slot, uint32_t *length)
+{
+	struct raw_object *obj;
+
+	sd_read_lock(&raw_lock);
+	obj = lookup_object(oid, ec_index, epoch);
+	if (obj) {
+		*slot = obj->slot;
+		*length = table[obj->slot].length;
+	}
+	sd_rw_unlock(&raw_lock);
+
+	return obj != NULL;
+}
+
+static int read_slot(uint64_t oid, int fd, uint32_t slot, uint32_t length,
+		     void *buf, uint64_t off, uint32_t len)
+{
+	if (off + len > length)
+		return SD_RES_INVALID_PARMS;
+	if (store_pread(oid, fd, buf, len, slot_offset(slot) + off) != len) {
+		sd_err("failed to read the slot %"PRIu32", %m", slot);
+		return SD_RES_EIO;
+	}
+	return SD_RES_SUCCESS;
+}
+
+static bool raw_exist(uint64_t oid, uint8_t ec_index)
+{
+	uint32_t slot, length;
+
+	return get_object(oid, raw_ec_index(oid, ec_index), 0, &slot, &length);
+}
+
+static int raw_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	int flags = prepare_iocb(oid, iocb, true), ret;
+
+	sd_debug("%016"PRIx64, oid);
+
+	sd_write_lock(lock);
+	ret = store_object(oid, raw_ec_index(oid, iocb->ec_index), 0,
+			   get_store_objsize(oid), iocb->buf, iocb->offset,
+			   iocb->length, flags);
+	sd_rw_unlock(lock);
+	if (ret == SD_RES_SUCCESS)
+		objlist_cache_insert(oid);
+
+	return ret;
+}
+
+static int raw_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	int flags = prepare_iocb(oid, iocb, false), fd = get_fd(flags),
+	    ret = SD_RES_SUCCESS;
+	uint32_t slot, length;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	sd_read_lock(lock);
+	if (!get_object(oid, raw_ec_index(oid, iocb->ec_index), 0, &slot,
+			&length)) {
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+	if (iocb->offset + iocb->length > length) {
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+	if (store_pwrite(oid, fd, iocb->buf, iocb->length,
+			 slot_offset(slot) + iocb->offset) != iocb->length) {
+		sd_err("failed to write %016"PRIx64" to the slot %"PRIu32", %m",
+		       oid, slot);
+		ret = to_sderr(errno);
+		goto out;
+	}
+	if (sync_fd(fd, flags) < 0)
+		ret = SD_RES_EIO;
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+static int raw_read(uint64_t oid, const struct siocb *iocb)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	uint8_t ec_index = raw_ec_index(oid, iocb->ec_index);
+	int flags = prepare_iocb(oid, iocb, false), ret;
+	uint32_t slot, length;
+
+	sd_read_lock(lock);
+	/*
+	 * If the request is against the older epoch, try to read the stale
+	 * copy
+	 */
+	if (get_object(oid, ec_index, 0, &slot, &length) ||
+	    (iocb->epoch > 0 && iocb->epoch < sys_epoch() &&
+	     get_object(oid, ec_index, iocb->epoch, &slot, &length)))
+		ret = read_slot(oid, get_fd(flags), slot, length,
+				iocb->buf, iocb->offset, iocb->length);
+	else
+		ret = SD_RES_NO_OBJ;
+	sd_rw_unlock(lock);
+
+	return ret;
+}
+
+/* Take the object out of the index and drop it */
+static int remove_object(uint64_t oid, uint8_t ec_index, uint32_t epoch)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	struct raw_object *obj;
+
+	sd_write_lock(lock);
+	sd_write_lock(&raw_lock);
+	obj = lookup_object(oid, ec_index, epoch);
+	if (obj)
+		rb_erase(&obj->rb, &raw_index);
+	sd_rw_unlock(&raw_lock);
+	if (obj)
+		kill_object(obj);
+	sd_rw_unlock(lock);
+
+	return obj ? SD_RES_SUCCESS : SD_RES_NO_OBJ;
+}
+
+static int raw_remove_object(uint64_t oid, uint8_t ec_index)
+{
+	return remove_object(oid, raw_ec_index(oid, ec_index), 0);
+}
+
+/* Make the object (oid, ec_index) the stale copy of tgt_epoch */
+static int make_stale(uint64_t oid, uint8_t ec_index, uint32_t tgt_epoch)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	struct raw_object *obj, *old;
+	struct raw_entry *e;
+	int ret = SD_RES_SUCCESS;
+
+	sd_write_lock(lock);
+	sd_write_lock(&raw_lock);
+	obj = lookup_object(oid, ec_index, 0);
+	if (!obj) {
+		sd_rw_unlock(&raw_lock);
+		goto out;
+	}
+	rb_erase(&obj->rb, &raw_index);
+	obj->epoch = tgt_epoch;
+	old = rb_insert(&raw_index, obj, rb, raw_object_cmp);
+	if (old) {
+		rb_erase(&old->rb, &raw_index);
+		rb_insert(&raw_index, obj, rb, raw_object_cmp);
+	}
+	e = table + obj->slot;
+	set_entry(obj->slot, oid, ec_index, tgt_epoch, e->length, e->nr_slots);
+	sd_rw_unlock(&raw_lock);
+
+	if (write_entry(obj->slot) < 0)
+		ret = SD_RES_EIO;
+	if (old)
+		kill_object(old);
+	sd_debug("moved object %016"PRIx64" to epoch %"PRIu32, oid,
+		 tgt_epoch);
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+static int raw_link(uint64_t oid, uint32_t tgt_epoch)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	uint32_t slot, length;
+	void *buf;
+	int ret;
+
+	sd_debug("try link %016"PRIx64" from snapshot with epoch %d", oid,
+		 tgt_epoch);
+
+	sd_write_lock(lock);
+	/*
+	 * Recovery thread and main thread might try to recover the same
+	 * object
+	 */
+	if (get_object(oid, 0, 0, &slot, &length)) {
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+	if (!get_object(oid, 0, tgt_epoch, &slot, &length)) {
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+
+	buf = xvalloc(length);
+	ret = read_slot(oid, raw_dio_fd, slot, length, buf, 0, length);
+	if (ret == SD_RES_SUCCESS)
+		ret = store_object(oid, 0, 0, length, buf, 0, length,
+				   O_DIRECT);
+	free(buf);
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+/* The keys of the objects, copied out of the index not to hold raw_lock */
+static struct raw_object *get_objects(bool stale, size_t *nr)
+{
+	struct raw_object *obj, *objs = NULL;
+	size_t n = 0;
+
+	sd_read_lock(&raw_lock);
+	rb_for_each_entry(obj, &raw_index, rb) {
+		if (stale != (obj->epoch != 0))
+			continue;
+		objs = xrealloc(objs, sizeof(*objs) * (n + 1));
+		objs[n++] = *obj;
+	}
+	sd_rw_unlock(&raw_lock);
+
+	*nr = n;
+	return objs;
+}
+
+/*
+ * For replicated object, if any of the replica belongs to this node, we
+ * consider it not stale.
+ *
+ * For erasure coded object, since every copy is unique and if it migrates to
+ * other node(index gets changed even it has some other copy belongs to it)
+ * because of hash ring changes, we consider it stale.
+ */
+static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
+{
+	uint32_t i, nr_copies;
+	const struct sd_vnode *v;
+	bool ret = true;
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+
+	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, obj_vnodes);
+	for (i = 0; i < nr_copies; i++) {
+		v = obj_vnodes[i];
+		if (vnode_is_local(v)) {
+			if (is_erasure_oid(oid)) {
+				if (i == ec_index)
+					ret = false;
+			} else {
+				ret = false;
+			}
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static int raw_update_epoch(uint32_t epoch)
+{
+	struct vnode_info *vinfo = get_vnode_info();
+	struct raw_object *objs;
+	int ret = SD_RES_SUCCESS;
+	size_t nr;
+
+	sd_assert(epoch);
+	objs = get_objects(false, &nr);
+	for (size_t i = 0; i < nr && ret == SD_RES_SUCCESS; i++) {
+		if (oid_stale(objs[i].oid, objs[i].ec_index, vinfo))
+			ret = make_stale(objs[i].oid, objs[i].ec_index, epoch);
+	}
+	free(objs);
+	put_vnode_info(vinfo);
+
+	return ret;
+}
+
+static int raw_purge_obj(void)
+{
+	uint32_t tgt_epoch = get_latest_epoch();
+	struct raw_object *objs;
+	int ret = SD_RES_SUCCESS;
+	size_t nr;
+
+	objs = get_objects(false, &nr);
+	for (size_t i = 0; i < nr && ret == SD_RES_SUCCESS; i++)
+		ret = make_stale(objs[i].oid, objs[i].ec_index, tgt_epoch);
+	free(objs);
+
+	return ret;
+}
+
+static int raw_cleanup(void)
+{
+	struct raw_object *objs;
+	size_t nr;
+
+	objs = get_objects(true, &nr);
+	for (size_t i = 0; i < nr; i++)
+		remove_object(objs[i].oid, objs[i].ec_index, objs[i].epoch);
+	free(objs);
+
+	return SD_RES_SUCCESS;
+}
+
+static int raw_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+{
+	struct sd_rw_lock *lock = get_obj_lock(oid);
+	uint32_t slot, length;
+	void *buf;
+	int ret;
+
+	sd_read_lock(lock);
+	if (!get_object(oid, 0, 0, &slot, &length) &&
+	    !get_object(oid, 0, epoch, &slot, &length)) {
+		ret = SD_RES_NO_OBJ;
+		goto out;
+	}
+
+	buf = xvalloc(length);
+	ret = read_slot(oid, raw_dio_fd, slot, length, buf, 0, length);
+	if (ret == SD_RES_SUCCESS) {
+		get_buffer_sha1(buf, length, sha1);
+		sd_debug("the message digest of %016"PRIx64" at epoch %d is %s",
+			 oid, epoch, sha1_to_hex(sha1));
+	}
+	free(buf);
+out:
+	sd_rw_unlock(lock);
+	return ret;
+}
+
+static void close_device(void)
+{
+	sd_write_lock(&raw_lock);
+	rb_destroy(&raw_index, struct raw_object, rb);
+	free(slot_bitmap);
+	slot_bitmap = NULL;
+	free(table);
+	table = NULL;
+	sd_rw_unlock(&raw_lock);
+
+	if (raw_fd >= 0)
+		close(raw_fd);
+	if (raw_dio_fd >= 0)
+		close(raw_dio_fd);
+	raw_fd = raw_dio_fd = -1;
+}
+
+static int open_device(void)
+{
+	if (!sys->blockdev) {
+		sd_err("the raw store needs a block device, see 'sheep -B'");
+		return -1;
+	}
+
+	close_device();
+	raw_fd = open(sys->blockdev, O_RDWR);
+	raw_dio_fd = open(sys->blockdev, O_RDWR | O_DIRECT);
+	if (raw_fd < 0 || raw_dio_fd < 0) {
+		sd_err("failed to open %s, %m", sys->blockdev);
+		close_device();
+		return -1;
+	}
+	return 0;
+}
+
+static uint32_t super_crc(void)
+{
+	struct raw_super tmp = super;
+
+	tmp.crc = 0;
+	return crc32c(0, &tmp, sizeof(tmp));
+}
+
+static int raw_format(void)
+{
+	uint64_t size, table_size;
+	void *buf;
+	int ret = SD_RES_EIO;
+
+	sd_debug("try get a clean store");
+	if (open_device() < 0)
+		return SD_RES_EIO;
+
+	/* works for both the block devices and the regular files */
+	size = lseek(raw_fd, 0, SEEK_END);
+	if (size == (uint64_t)-1) {
+		sd_err("failed to get the size of %s, %m", sys->blockdev);
+		goto out;
+	}
+
+	memset(&super, 0, sizeof(super));
+	super.magic = RAW_MAGIC;
+	super.version = RAW_VERSION;
+	super.slot_size = SD_DATA_OBJ_SIZE;
+	if (sys->cinfo.block_size_shift)
+		super.slot_size = UINT32_C(1) << sys->cinfo.block_size_shift;
+	super.table_offset = RAW_BLOCK_SIZE;
+	if (size < super.table_offset + RAW_DATA_ALIGN + super.slot_size) {
+		sd_err("%s is too small", sys->blockdev);
+		goto out;
+	}
+	super.nr_slots = (size - super.table_offset - RAW_DATA_ALIGN) /
+		(super.slot_size + RAW_ENTRY_SIZE);
+	table_size = round_up((uint64_t)super.nr_slots * RAW_ENTRY_SIZE,
+			      RAW_BLOCK_SIZE);
+	super.data_offset = round_up(super.table_offset + table_size,
+				     RAW_DATA_ALIGN);
+	super.nr_slots = min((uint64_t)super.nr_slots,
+			     (size - super.data_offset) / super.slot_size);
+	super.crc = super_crc();
+
+	if (zero_range(super.table_offset, table_size) < 0) {
+		sd_err("failed to clear the table of %s, %m", sys->blockdev);
+		goto out;
+	}
+	buf = xvalloc(RAW_BLOCK_SIZE);
+	memset(buf, 0, RAW_BLOCK_SIZE);
+	memcpy(buf, &super, sizeof(super));
+	if (xpwrite(raw_dio_fd, buf, RAW_BLOCK_SIZE, 0) != RAW_BLOCK_SIZE ||
+	    fdatasync(raw_dio_fd) < 0)
+		sd_err("failed to write the superblock of %s, %m",
+		       sys->blockdev);
+	else
+		ret = SD_RES_SUCCESS;
+	free(buf);
+
+	sd_info("%s has %"PRIu32" slots of %"PRIu32" bytes", sys->blockdev,
+		super.nr_slots, super.slot_size);
+out:
+	close_device();
+	return ret;
+}
+
+/* Put the object of slot in the index if it is the latest one */
+static void load_entry(uint32_t slot)
+{
+	struct raw_entry *e = table + slot;
+	struct raw_object *obj, *old;
+
+	if (!entry_valid(e) || slot + e->nr_slots > super.nr_slots)
+		return;
+
+	obj = xzalloc(sizeof(*obj));
+	obj->oid = e->oid;
+	obj->ec_index = e->ec_index;
+	obj->epoch = e->epoch;
+	obj->slot = slot;
+	raw_seq = max(raw_seq, e->seq);
+
+	old = rb_insert(&raw_index, obj, rb, raw_object_cmp);
+	if (old) {
+		if (table[old->slot].seq > e->seq) {
+			free(obj);
+			return;
+		}
+		rb_erase(&old->rb, &raw_index);
+		free(old);
+		rb_insert(&raw_index, obj, rb, raw_object_cmp);
+	}
+}
+
+static void init_vdi_state(const struct raw_object *obj)
+{
+	struct sd_inode *inode = xvalloc(SD_INODE_HEADER_SIZE);
+
+	if (read_slot(obj->oid, raw_dio_fd, obj->slot, table[obj->slot].length,
+		      inode, 0, SD_INODE_HEADER_SIZE) != SD_RES_SUCCESS) {
+		sd_err("failed to read inode header %016"PRIx64" %"PRIu32,
+		       obj->oid, obj->epoch);
+		goto out;
+	}
+	add_vdi_state_unordered(oid_to_vid(obj->oid), inode->nr_copies,
+				vdi_is_snapshot(inode), inode->copy_policy,
+				inode->block_size_shift, inode->parent_vdi_id,
+				inode->flags);
+
+	if (inode->name[0] == '\0')
+		atomic_set_bit(oid_to_vid(obj->oid), sys->vdi_deleted);
+
+	atomic_set_bit(oid_to_vid(obj->oid), sys->vdi_inuse);
+out:
+	free(inode);
+}
+
+static int raw_init(void)
+{
+	uint64_t table_size;
+	struct raw_object *obj;
+	void *buf;
+
+	sd_debug("use raw store driver");
+	if (open_device() < 0)
+		return SD_RES_EIO;
+
+	buf = xvalloc(RAW_BLOCK_SIZE);
+	if (xpread(raw_dio_fd, buf, RAW_BLOCK_SIZE, 0) != RAW_BLOCK_SIZE) {
+		sd_err("failed to read the superblock of %s, %m",
+		       sys->blockdev);
+		free(buf);
+		goto err;
+	}
+	memcpy(&super, buf, sizeof(super));
+	free(buf);
+	if (super.magic != RAW_MAGIC || super.crc != super_crc() ||
+	    super.version != RAW_VERSION) {
+		sd_err("%s isn't formatted for the raw store", sys->blockdev);
+		goto err;
+	}
+
+	table_size = round_up((uint64_t)super.nr_slots * RAW_ENTRY_SIZE,
+			      RAW_BLOCK_SIZE);
+	table = xvalloc(table_size);
+	if (xpread(raw_dio_fd, table, table_size, super.table_offset) !=
+	    table_size) {
+		sd_err("failed to read the table of %s, %m", sys->blockdev);
+		goto err;
+	}
+
+	raw_seq = 0;
+	next_slot = 0;
+	slot_bitmap = xzalloc(BITS_TO_LONGS(super.nr_slots) * sizeof(long));
+	for (uint32_t i = 0; i < super.nr_slots; i++)
+		load_entry(i);
+
+	/* the losers of a crash are freed here, see the top of the file */
+	for (uint32_t i = 0; i < super.nr_slots; i++) {
+		struct raw_entry *e = table + i;
+
+		if (!e->nr_slots && !e->oid)
+			continue;
+		obj = entry_valid(e) ?
+			lookup_object(e->oid, e->ec_index, e->epoch) : NULL;
+		if (obj && obj->slot == i)
+			continue;
+		set_entry(i, 0, 0, 0, 0, 0);
+		if (write_entry(i) < 0)
+			goto err;
+	}
+
+	rb_for_each_entry(obj, &raw_index, rb) {
+		for (uint32_t i = 0; i < table[obj->slot].nr_slots; i++)
+			set_bit(obj->slot + i, slot_bitmap);
+		objlist_cache_insert(obj->oid);
+		if (is_vdi_obj(obj->oid)) {
+			sd_debug("found the VDI object %016"PRIx64" epoch %"
+				 PRIu32, obj->oid, obj->epoch);
+			init_vdi_state(obj);
+		}
+	}
+
+	return SD_RES_SUCCESS;
+err:
+	close_device();
+	return SD_RES_EIO;
+}
+
+static struct store_driver raw_store = {
+	.id = RAW_STORE,
+	.name = "raw",
+	.init = raw_init,
+	.exist = raw_exist,
+	.create_and_write = raw_create_and_write,
+	.write = raw_write,
+	.read = raw_read,
+	.link = raw_link,
+	.update_epoch = raw_update_epoch,
+	.cleanup = raw_cleanup,
+	.format = raw_format,
+	.remove_object = raw_remove_object,
+	.get_hash = raw_get_hash,
+	.purge_obj = raw_purge_obj,
+};
+
+add_store_driver(raw_store);
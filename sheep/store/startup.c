@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Startup state
+ *
+ * The plain and the tree stores build the object list cache and the vdi
+ * states at startup by walking all the objects and reading every inode
+ * header, which takes long on a large node.  On a clean exit, the sheep saves
+ * both to the startup_state file of its base directory instead, and the next
+ * start loads them if the file is intact and was saved at the latest epoch
+ * with the same store and the same object directories.  Otherwise the objects
+ * are walked as before.
+ *
+ * The file is removed as soon as it's loaded, so a crash after the start
+ * never reuses it, and nothing is saved while the recovery runs.  The objects
+ * are not supposed to be touched while the sheep is down.
+ */
+
+#include "sheep_priv.h"
+#include "crc32c.h"
+
+#define STARTUP_STATE_MAGIC 0x73647373	/* "sdss" */
+
+struct startup_state {
+	uint32_t magic;
+	uint32_t crc;		/* of what follows this field */
+	uint32_t epoch;
+	uint32_t paths_crc;	/* of the object directories */
+	char store[STORE_LEN];
+	uint32_t nr_vdis;
+	uint32_t __pad;
+	uint64_t nr_oids;
+	/* struct vdi_state_compact vdis[nr_vdis], uint64_t oids[nr_oids] */
+};
+
+static char *startup_state_path;
+static uint32_t paths_crc;
+
+int init_startup_state_path(const char *base_path)
+{
+#define STARTUP_STATE_PATH "/startup_state"
+	int len = strlen(base_path) + strlen(STARTUP_STATE_PATH) + 1;
+
+	startup_state_path = xzalloc(len);
+	snprintf(startup_state_path, len, "%s" STARTUP_STATE_PATH, base_path);
+
+	return 0;
+}
+
+static int crc_obj_path(const char *path)
+{
+	paths_crc = crc32c(paths_crc, path, strlen(path) + 1);
+	return SD_RES_SUCCESS;
+}
+
+static uint32_t get_paths_crc(void)
+{
+	paths_crc = ~0;
+	for_each_obj_path(crc_obj_path);
+	return paths_crc;
+}
+
+static uint32_t state_crc(const struct startup_state *ss, size_t len)
+{
+	size_t off = offsetof(struct startup_state, crc) + sizeof(ss->crc);
+
+	return crc32c(~0, (const char *)ss + off, len - off);
+}
+
+/* Called on a clean exit */
+void save_startup_state(void)
+{
+	struct startup_state *ss;
+	struct vdi_state_compact *vdis;
+	struct sd_req hdr;
+	struct sd_rsp rsp;
+	uint64_t *oids;
+	size_t nr, len;
+	uint32_t nr_vdis = 0;
+
+	if (sys->gateway_only ||
+	    !(store_id_match(PLAIN_STORE) || store_id_match(TREE_STORE) ||
+	      store_id_match(URING_STORE)))
+		return;
+	if (node_in_recovery()) {
+		sd_info("in recovery, the startup state is not saved");
+		return;
+	}
+
+	/* nothing comes in or goes away any more */
+	len = sizeof(*oids) * (objlist_cache_nr() + 1);
+	oids = xmalloc(len);
+	sd_init_req(&hdr, SD_OP_GET_OBJ_LIST);
+	hdr.data_length = len;
+	if (get_obj_list(&hdr, &rsp, oids) != SD_RES_SUCCESS) {
+		free(oids);
+		return;
+	}
+	nr = rsp.data_length / sizeof(*oids);
+
+	/* the vdis whose inodes are here, like the walk finds them */
+	vdis = xmalloc(sizeof(*vdis) * max(nr, (size_t)1));
+	for (size_t i = 0; i < nr; i++) {
+		uint32_t vid = oid_to_vid(oids[i]);
+
+		if (!is_vdi_obj(oids[i]) ||
+		    !get_vdi_state_compact(vid, vdis + nr_vdis))
+			continue;
+		vdis[nr_vdis].deleted = test_bit(vid, sys->vdi_deleted);
+		nr_vdis++;
+	}
+
+	len = sizeof(*ss) + sizeof(*vdis) * nr_vdis + sizeof(*oids) * nr;
+	ss = xzalloc(len);
+	ss->magic = STARTUP_STATE_MAGIC;
+	ss->epoch = get_latest_epoch();
+	ss->paths_crc = get_paths_crc();
+	pstrcpy(ss->store, sizeof(ss->store), sd_store->name);
+	ss->nr_vdis = nr_vdis;
+	ss->nr_oids = nr;
+	memcpy(ss + 1, vdis, sizeof(*vdis) * nr_vdis);
+	memcpy((char *)(ss + 1) + sizeof(*vdis) * nr_vdis, oids,
+	       sizeof(*oids) * nr);
+	ss->crc = state_crc(ss, len);
+
+	if (atomic_create_and_write(startup_state_path, (char *)ss, len, true,
+				    false) < 0)
+		sd_err("failed to save the startup state");
+	else
+		sd_info("saved %zu objects and %"PRIu32" vdis", nr, nr_vdis);
+
+	free(ss);
+	free(vdis);
+	free(oids);
+}
+
+static bool valid_startup_state(const struct startup_state *ss, size_t len)
+{
+	if (len < sizeof(*ss) || ss->magic != STARTUP_STATE_MAGIC)
+		return false;
+	if (len != sizeof(*ss) +
+	    sizeof(struct vdi_state_compact) * (uint64_t)ss->nr_vdis +
+	    sizeof(uint64_t) * ss->nr_oids) {
+		sd_warn("truncated startup state");
+		return false;
+	}
+	if (ss->crc != state_crc(ss, len)) {
+		sd_warn("broken startup state");
+		return false;
+	}
+	if (ss->epoch != get_latest_epoch()) {
+		sd_info("startup state of epoch %"PRIu32", latest %"PRIu32,
+			ss->epoch, get_latest_epoch());
+		return false;
+	}
+	if (strncmp(ss->store, sd_store->name, sizeof(ss->store)) ||
+	    ss->paths_crc != get_paths_crc()) {
+		sd_info("the store or the object directories changed");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Fill the object list cache and the vdi states from the startup state.
+ * Returns false if the objects have to be walked.
+ */
+bool load_startup_state(void)
+{
+	struct startup_state *ss = NULL;
+	const struct vdi_state_compact *vdis;
+	const uint64_t *oids;
+	struct stat st;
+	bool loaded = false;
+	int fd;
+
+	fd = open(startup_state_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_err("failed to open %s, %m", startup_state_path);
+		return false;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*ss))
+		goto out;
+
+	ss = xmalloc(st.st_size);
+	if (xread(fd, ss, st.st_size) != st.st_size ||
+	    !valid_startup_state(ss, st.st_size))
+		goto out;
+
+	/* a crash from now on must not find it */
+	if (unlink(startup_state_path) < 0) {
+		sd_err("failed to remove %s, %m", startup_state_path);
+		goto out;
+	}
+
+	vdis = (const struct vdi_state_compact *)(ss + 1);
+	for (uint32_t i = 0; i < ss->nr_vdis; i++) {
+		const struct vdi_state_compact *vs = vdis + i;
+
+		add_vdi_state_unordered(vs->vid, vs->nr_copies, vs->snapshot,
+					vs->copy_policy, vs->block_size_shift,
+					vs->parent_vid, vs->flags);
+		if (vs->deleted)
+			atomic_set_bit(vs->vid, sys->vdi_deleted);
+		atomic_set_bit(vs->vid, sys->vdi_inuse);
+	}
+
+	oids = (const uint64_t *)(vdis + ss->nr_vdis);
+	for (uint64_t i = 0; i < ss->nr_oids; i++)
+		objlist_cache_insert(oids[i]);
+
+	sd_info("loaded %"PRIu64" objects and %"PRIu32" vdis of epoch %"
+		PRIu32, ss->nr_oids, ss->nr_vdis, ss->epoch);
+	loaded = true;
+out:
+	close(fd);
+	free(ss);
+	if (!loaded) {
+		sd_info("walk the objects");
+		unlink(startup_state_path);
+	}
+	return loaded;
+}
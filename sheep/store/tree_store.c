@@ -104,9 +104,10 @@ int tree_write(uint64_t oid, const struct siocb *iocb)
 	int flags = prepare_iocb(oid, iocb, false), fd,
 	    ret = SD_RES_SUCCESS;
 	char path[PATH_MAX];
+	struct object_fd *ofd;
 	ssize_t size;
 	uint32_t len = iocb->length;
-	uint64_t offset = iocb->offset;
+	uint64_t offset = iocb->offset, start;
 	static bool trim_is_supported = true;
 
 	if (iocb->epoch < sys_epoch()) {
@@ -126,17 +127,17 @@ int tree_write(uint64_t oid, const struct siocb *iocb)
 
 	get_store_path(oid, iocb->ec_index, path);
 
-	/*
-	 * Make sure oid is in the right place because oid might be misplaced
-	 * in a wrong place, due to 'shutdown/restart with less/more disks' or
-	 * any bugs. We need call err_to_sderr() to return EIO if disk is broken
-	 */
-	if (!tree_exist(oid, iocb->ec_index))
-		return err_to_sderr(path, oid, ENOENT);
+	ofd = object_fd_get(oid, iocb->ec_index, path, flags, &ret);
+	if (unlikely(!ofd))
+		return ret;
+	fd = ofd->fd;
 
-	fd = open(path, flags, sd_def_fmode);
-	if (unlikely(fd < 0))
-		return err_to_sderr(path, oid, errno);
+	if (csum_check(fd)) {
+		start = md_io_begin(oid, iocb->ec_index);
+		ret = csum_write(oid, fd, path, iocb);
+		md_account_io(oid, iocb->ec_index, len, start);
+		goto out;
+	}
 
 	if (trim_is_supported && is_sparse_object(oid)) {
 		if (tree_trim(fd, oid, iocb, &offset, &len) < 0) {
@@ -146,7 +147,9 @@ int tree_write(uint64_t oid, const struct siocb *iocb)
 		}
 	}
 
-	size = xpwrite(fd, iocb->buf, len, offset);
+	start = md_io_begin(oid, iocb->ec_index);
+	size = store_pwrite(oid, fd, iocb->buf, len, offset);
+	md_account_io(oid, iocb->ec_index, len, start);
 	if (unlikely(size != len)) {
 		sd_err("failed to write object %016"PRIx64", path=%s, offset=%"
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
@@ -155,7 +158,9 @@ int tree_write(uint64_t oid, const struct siocb *iocb)
 		goto out;
 	}
 out:
-	close(fd);
+	if (ret == SD_RES_SUCCESS)
+		writeback_written(iocb->length);
+	object_fd_put(ofd);
 	return ret;
 }
 
@@ -207,9 +212,7 @@ static int purge_stale_dir(const char *path)
 	char p[PATH_MAX];
 
 	snprintf(p, PATH_MAX, "%s/.stale", path);
-
-	if (purge_directory_async(p) < 0)
-		return SD_RES_EIO;
+	purge_stale_objects(p);
 
 	return SD_RES_SUCCESS;
 }
@@ -243,7 +246,8 @@ static int init_vdi_state(uint64_t oid, const char *wd, uint32_t epoch)
 	}
 	add_vdi_state_unordered(oid_to_vid(oid), inode->nr_copies,
 		      vdi_is_snapshot(inode), inode->copy_policy,
-		      inode->block_size_shift, inode->parent_vdi_id);
+		      inode->block_size_shift, inode->parent_vdi_id,
+		      inode->flags);
 
 	if (inode->name[0] == '\0')
 		atomic_set_bit(oid_to_vid(oid), sys->vdi_deleted);
@@ -290,18 +294,23 @@ int tree_init(void)
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
+	if (load_startup_state())
+		return SD_RES_SUCCESS;
 
 	for_each_object_in_stale(init_objlist_and_vdi_bitmap, NULL);
 
 	return for_each_object_in_wd(init_objlist_and_vdi_bitmap, true, NULL);
 }
 
+/* verify is whether to check the checksums of the object, see checksum.c */
 static int tree_read_from_path(uint64_t oid, const char *path,
-				  const struct siocb *iocb)
+			       const struct siocb *iocb, bool verify)
 {
 	int flags = prepare_iocb(oid, iocb, false), fd,
 	    ret = SD_RES_SUCCESS;
 	ssize_t size;
+	struct object_fd *ofd = NULL;
+	uint64_t start;
 
 	/*
 	 * Make sure oid is in the right place because oid might be misplaced
@@ -310,21 +319,36 @@ static int tree_read_from_path(uint64_t oid, const char *path,
 	 *
 	 * For stale path, get_store_stale_path already does tree_exist job.
 	 */
-	if (!is_stale_path(path) && !tree_exist(oid, iocb->ec_index))
-		return err_to_sderr(path, oid, ENOENT);
-
-	fd = open(path, flags);
-	if (fd < 0)
-		return err_to_sderr(path, oid, errno);
+	if (is_stale_path(path)) {
+		fd = open(path, flags);
+		if (fd < 0)
+			return err_to_sderr(path, oid, errno);
+	} else {
+		ofd = object_fd_get(oid, iocb->ec_index, path, flags, &ret);
+		if (!ofd)
+			return ret;
+		fd = ofd->fd;
+	}
 
-	size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
+	start = md_io_begin(oid, iocb->ec_index);
+	if (verify && csum_check(fd)) {
+		ret = csum_read(oid, fd, path, iocb);
+		md_account_io(oid, iocb->ec_index, iocb->length, start);
+		goto out;
+	}
+	size = store_pread(oid, fd, iocb->buf, iocb->length, iocb->offset);
+	md_account_io(oid, iocb->ec_index, iocb->length, start);
 	if (size < 0) {
 		sd_err("failed to read object %016"PRIx64", path=%s, offset=%"
 		       PRId32", size=%"PRId32", result=%zd, %m", oid, path,
 		       iocb->offset, iocb->length, size);
 		ret = err_to_sderr(path, oid, errno);
 	}
-	close(fd);
+out:
+	if (ofd)
+		object_fd_put(ofd);
+	else
+		close(fd);
 	return ret;
 }
 
@@ -334,7 +358,7 @@ int tree_read(uint64_t oid, const struct siocb *iocb)
 	char path[PATH_MAX];
 
 	get_store_path(oid, iocb->ec_index, path);
-	ret = tree_read_from_path(oid, path, iocb);
+	ret = tree_read_from_path(oid, path, iocb, true);
 
 	/*
 	 * If the request is against the older epoch, try to read from
@@ -343,7 +367,7 @@ int tree_read(uint64_t oid, const struct siocb *iocb)
 	if (ret == SD_RES_NO_OBJ && iocb->epoch > 0 &&
 	    iocb->epoch < sys_epoch()) {
 		get_store_stale_path(oid, iocb->epoch, iocb->ec_index, path);
-		ret = tree_read_from_path(oid, path, iocb);
+		ret = tree_read_from_path(oid, path, iocb, true);
 	}
 
 	return ret;
@@ -354,12 +378,14 @@ int tree_create_and_write(uint64_t oid, const struct siocb *iocb)
 	char path[PATH_MAX], tmp_path[PATH_MAX], *dir;
 	int flags = prepare_iocb(oid, iocb, true);
 	int ret, fd;
+	bool anon;
 	uint32_t len = iocb->length;
 	uint32_t object_size = 0;
 	size_t obj_size;
 	uint64_t offset = iocb->offset;
 
 	sd_debug("%016"PRIx64, oid);
+	md_tier_new_object(oid, iocb->ec_index);
 	get_store_path(oid, iocb->ec_index, path);
 	get_store_tmp_path(oid, iocb->ec_index, tmp_path);
 
@@ -373,7 +399,7 @@ int tree_create_and_write(uint64_t oid, const struct siocb *iocb)
 		sync();
 	}
 
-	fd = open(tmp_path, flags, sd_def_fmode);
+	fd = open_object_file(path, tmp_path, flags, &anon);
 	if (fd < 0) {
 		if (errno == EEXIST) {
 			/*
@@ -408,23 +434,32 @@ int tree_create_and_write(uint64_t oid, const struct siocb *iocb)
 		}
 	}
 
-	ret = xpwrite(fd, iocb->buf, len, offset);
+	ret = store_pwrite(oid, fd, iocb->buf, len, offset);
 	if (ret != len) {
 		sd_err("failed to write object. %m");
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
 
-	ret = rename(tmp_path, path);
+	if (csum_enabled() && csum_create(oid, fd, iocb) < 0) {
+		sd_err("failed to set the checksums of %s: %m", tmp_path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	ret = install_object_file(fd, anon, path, tmp_path);
 	if (ret < 0) {
-		sd_err("failed to rename %s to %s: %m", tmp_path, path);
+		sd_err("failed to install %s: %m", path);
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
+	/* the cached fd, if any, refers to the replaced file */
+	object_fd_invalidate(oid, iocb->ec_index);
 
 	close(fd);
 
-	if (uatomic_is_true(&sys->use_journal) || sys->nosync == true) {
+	writeback_written(iocb->length);
+	if (uatomic_is_true(&sys->use_journal) || !sync_writes()) {
 		objlist_cache_insert(oid);
 		return SD_RES_SUCCESS;
 	}
@@ -450,7 +485,7 @@ int tree_create_and_write(uint64_t oid, const struct siocb *iocb)
 	return SD_RES_SUCCESS;
 
 out:
-	if (unlink(tmp_path) != 0)
+	if (!anon && unlink(tmp_path) != 0)
 		sd_err("failed to unlink %s: %m", tmp_path);
 	close(fd);
 	return ret;
@@ -485,6 +520,7 @@ int tree_link(uint64_t oid, uint32_t tgt_epoch)
 		sd_debug("failed to link from %s to %s, %m", stale_path, path);
 		return err_to_sderr(path, oid, errno);
 	}
+	object_fd_invalidate(oid, 0);
 out:
 	return SD_RES_SUCCESS;
 }
@@ -497,7 +533,8 @@ out:
  * other node(index gets changed even it has some other copy belongs to it)
  * because of hash ring changes, we consider it stale.
  */
-static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
+static bool oid_stale(uint64_t oid, uint8_t ec_index,
+		      struct vnode_info *vinfo)
 {
 	uint32_t i, nr_copies;
 	const struct sd_vnode *v;
@@ -505,7 +542,7 @@ static bool oid_stale(uint64_t oid, int ec_index, struct vnode_info *vinfo)
 	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
 
 	nr_copies = get_obj_copy_number(oid, vinfo->nr_zones);
-	oid_to_vnodes(oid, &vinfo->vroot, nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (vnode_is_local(v)) {
@@ -556,30 +593,28 @@ static int move_object_to_stale_dir(uint64_t oid, const char *wd,
 		       path);
 		return SD_RES_EIO;
 	}
+	object_fd_invalidate(oid, ec_index < SD_MAX_COPIES ? ec_index : 0);
 	sd_debug("moved object %016"PRIx64, oid);
 	return SD_RES_SUCCESS;
 }
 
-static int check_stale_objects(uint64_t oid, const char *wd, uint32_t epoch,
-			       uint8_t ec_index, struct vnode_info *vinfo,
-			       void *arg)
+static int move_stale_object(uint64_t oid, uint8_t ec_index,
+			     uint32_t tgt_epoch)
 {
-	if (oid_stale(oid, ec_index, vinfo))
-		return move_object_to_stale_dir(oid, wd, 0, ec_index,
-						NULL, arg);
-
-	return SD_RES_SUCCESS;
+	return move_object_to_stale_dir(oid, NULL, 0, ec_index, NULL,
+					&tgt_epoch);
 }
 
 int tree_update_epoch(uint32_t epoch)
 {
 	sd_assert(epoch);
-	return for_each_object_in_wd(check_stale_objects, false, &epoch);
+	return move_stale_objects_in_wd(oid_stale, move_stale_object, epoch);
 }
 
 int tree_format(void)
 {
 	sd_debug("try get a clean store");
+	object_fd_invalidate_dir(NULL);
 	return for_each_obj_path(purge_dir);
 }
 
@@ -591,6 +626,7 @@ int tree_remove_object(uint64_t oid, uint8_t ec_index)
 		journal_remove_object(oid);
 
 	get_store_path(oid, ec_index, path);
+	object_fd_invalidate(oid, ec_index);
 
 	if (unlink(path) < 0) {
 		if (errno == ENOENT)
@@ -664,7 +700,7 @@ int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	int ret;
 	void *buf = NULL;
 	struct siocb iocb = {};
-	uint32_t length;
+	uint32_t length, version;
 	bool is_readonly_obj = oid_is_readonly(oid);
 	char path[PATH_MAX];
 
@@ -680,6 +716,11 @@ int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 		}
 	}
 
+	if (csum_get_sha1(oid, path, sha1, &version)) {
+		sd_debug("use cached sha1 digest %s", sha1_to_hex(sha1));
+		return SD_RES_SUCCESS;
+	}
+
 	length = get_store_objsize(oid);
 	ret = posix_memalign((void **)&buf, getpagesize(), length);
 	if (ret)
@@ -689,7 +730,7 @@ int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 	iocb.buf = buf;
 	iocb.length = length;
 
-	ret = tree_read_from_path(oid, path, &iocb);
+	ret = tree_read_from_path(oid, path, &iocb, false);
 	if (ret != SD_RES_SUCCESS) {
 		free(buf);
 		return ret;
@@ -703,7 +744,36 @@ int tree_get_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
 
 	if (is_readonly_obj)
 		set_object_sha1(path, sha1);
+	else if (version)
+		csum_set_sha1(oid, path, sha1, version);
+
+	return ret;
+}
+
+int tree_get_block_hash(uint64_t oid, uint32_t epoch, uint8_t *sha1)
+{
+	int ret;
+	void *buf;
+	struct siocb iocb = {};
+	uint32_t length;
+	char path[PATH_MAX];
+
+	ret = get_object_path(oid, epoch, path, sizeof(path));
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	length = get_store_objsize(oid);
+	buf = xpool_alloc(length);
+
+	iocb.epoch = epoch;
+	iocb.buf = buf;
+	iocb.length = length;
+
+	ret = tree_read_from_path(oid, path, &iocb, false);
+	if (ret == SD_RES_SUCCESS)
+		get_buffer_block_sha1(buf, length, SD_HASH_BLOCK_SIZE, sha1);
 
+	pool_free(buf, length);
 	return ret;
 }
 
@@ -729,6 +799,7 @@ static struct store_driver tree_store = {
 	.format = tree_format,
 	.remove_object = tree_remove_object,
 	.get_hash = tree_get_hash,
+	.get_block_hash = tree_get_block_hash,
 	.purge_obj = tree_purge_obj,
 };
 
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2015 Nippon Telegraph and Telephone Corporation.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * io_uring store driver
+ *
+ * This driver uses the same on-disk layout as the plain store, so everything
+ * except reads and writes is delegated to the default_* functions.  It can
+ * take over the object directories of the plain store but of no other driver,
+ * and refuses to start on the directories of the tree store.  Reads and
+ * writes use the shared object fd cache and are submitted through a per thread
+ * io_uring instead of pread/pwrite().  Synchronous writes use RWF_DSYNC instead
+ * of opening the file with O_DSYNC.
+ *
+ * Requests which need O_DIRECT fall back on the plain store, as do the objects
+ * of the compressed vdis, the clusters which keep the checksums of the objects
+ * and a thread which fails to set up its ring (e.g. old kernels).
+ */
+
+#include <liburing.h>
+
+#include "sheep_priv.h"
+
+#define URING_QUEUE_DEPTH	8
+
+static __thread struct io_uring ring;
+static __thread int ring_state; /* 0: not yet, 1: ready, -1: unusable */
+
+static int get_store_path(uint64_t oid, uint8_t ec_index, char *path)
+{
+	if (is_erasure_oid(oid)) {
+		if (unlikely(ec_index >= SD_MAX_COPIES))
+			panic("invalid ec_index %d", ec_index);
+		return snprintf(path, PATH_MAX, "%s/%016"PRIx64"_%d",
+				md_get_object_dir(oid), oid, ec_index);
+	}
+
+	return snprintf(path, PATH_MAX, "%s/%016" PRIx64,
+			md_get_object_dir(oid), oid);
+}
+
+static bool uring_ready(void)
+{
+	int ret;
+
+	if (likely(ring_state))
+		return ring_state > 0;
+
+	ret = io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0);
+	if (ret < 0) {
+		sd_warn("failed to setup io_uring, %s. fall back on the plain"
+			" store for this thread", strerror(-ret));
+		ring_state = -1;
+		return false;
+	}
+
+	ring_state = 1;
+	return true;
+}
+
+/* Returns the number of transferred bytes or -errno */
+static ssize_t uring_rw(bool write, int fd, void *buf, size_t count,
+			off_t offset, bool dsync)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	size_t done = 0;
+	int ret;
+
+	while (done < count) {
+		sqe = io_uring_get_sqe(&ring);
+		if (unlikely(!sqe))
+			panic("no sqe available");
+
+		if (write) {
+			io_uring_prep_write(sqe, fd, (char *)buf + done,
+					    count - done, offset + done);
+			if (dsync)
+				sqe->rw_flags = RWF_DSYNC;
+		} else
+			io_uring_prep_read(sqe, fd, (char *)buf + done,
+					   count - done, offset + done);
+
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (unlikely(ret < 0))
+			return ret;
+
+		ret = io_uring_wait_cqe(&ring, &cqe);
+		if (unlikely(ret < 0))
+			return ret;
+		ret = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+
+		if (ret == -EINTR || ret == -EAGAIN)
+			continue;
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			/* EOF on read */
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+static int uring_write(uint64_t oid, const struct siocb *iocb)
+{
+	int flags = prepare_iocb(oid, iocb, false), ret = SD_RES_SUCCESS;
+	struct object_fd *ofd;
+	char path[PATH_MAX];
+	uint64_t start;
+	ssize_t size;
+	bool readonly;
+
+	if ((flags & O_DIRECT) || vdi_is_compressed(oid_to_vid(oid)) ||
+	    csum_enabled() || !uring_ready())
+		return default_write(oid, iocb);
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_debug("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	if (uatomic_is_true(&sys->use_journal) &&
+	    unlikely(journal_write_store(oid, iocb->buf, iocb->length,
+					 iocb->offset, false))
+	    != SD_RES_SUCCESS) {
+		sd_err("turn off journaling");
+		uatomic_set_false(&sys->use_journal);
+		flags |= O_DSYNC;
+		sync();
+	}
+
+	get_store_path(oid, iocb->ec_index, path);
+	/* the file of a read-only object may be shared, see dedup.c */
+	readonly = oid_is_readonly(oid);
+	if (unlikely(readonly)) {
+		ret = dedup_begin_write(oid, path);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+	ofd = object_fd_get(oid, iocb->ec_index, path, O_RDWR, &ret);
+	if (!ofd)
+		goto unlock;
+
+	start = md_io_begin(oid, iocb->ec_index);
+	size = uring_rw(true, ofd->fd, iocb->buf, iocb->length, iocb->offset,
+			flags & O_DSYNC);
+	md_account_io(oid, iocb->ec_index, iocb->length, start);
+	if (unlikely(size != iocb->length)) {
+		if (size < 0)
+			errno = -size;
+		sd_err("failed to write object %016"PRIx64", path=%s, offset=%"
+		       PRId32", size=%"PRId32", result=%zd, %m", oid, ofd->path,
+		       iocb->offset, iocb->length, size);
+		ret = err_to_sderr(ofd->path, oid, errno);
+	} else
+		writeback_written(iocb->length);
+
+	object_fd_put(ofd);
+unlock:
+	if (unlikely(readonly))
+		dedup_end_write();
+	return ret;
+}
+
+static int uring_read(uint64_t oid, const struct siocb *iocb)
+{
+	int flags = prepare_iocb(oid, iocb, false), ret = SD_RES_SUCCESS;
+	struct object_fd *ofd;
+	char path[PATH_MAX];
+	uint64_t start;
+	ssize_t size;
+
+	if ((flags & O_DIRECT) || vdi_is_compressed(oid_to_vid(oid)) ||
+	    csum_enabled() || !uring_ready())
+		return default_read(oid, iocb);
+
+	get_store_path(oid, iocb->ec_index, path);
+	ofd = object_fd_get(oid, iocb->ec_index, path, O_RDWR, &ret);
+	if (!ofd) {
+		/* let the plain store look for it in the stale directory */
+		if (ret == SD_RES_NO_OBJ)
+			return default_read(oid, iocb);
+		return ret;
+	}
+
+	start = md_io_begin(oid, iocb->ec_index);
+	size = uring_rw(false, ofd->fd, iocb->buf, iocb->length, iocb->offset,
+			false);
+	md_account_io(oid, iocb->ec_index, iocb->length, start);
+	if (size < 0) {
+		errno = -size;
+		sd_err("failed to read object %016"PRIx64", path=%s, offset=%"
+		       PRId32", size=%"PRId32", result=%zd, %m", oid, ofd->path,
+		       iocb->offset, iocb->length, size);
+		ret = err_to_sderr(ofd->path, oid, errno);
+	}
+
+	object_fd_put(ofd);
+	return ret;
+}
+
+/* The tree store keeps its objects in the subdirectories of 'path' */
+static int check_plain_layout(const char *path)
+{
+	char p[PATH_MAX];
+	struct stat st;
+
+	snprintf(p, PATH_MAX, "%s/meta", path);
+	if (stat(p, &st) == 0 && S_ISDIR(st.st_mode)) {
+		sd_err("%s has the layout of the tree store", path);
+		return SD_RES_NO_STORE;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int uring_init(void)
+{
+	int ret;
+
+	sd_debug("use io_uring store driver");
+	ret = for_each_obj_path(check_plain_layout);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	return default_init();
+}
+
+static struct store_driver uring_store = {
+	.id = URING_STORE,
+	.name = "uring",
+	.init = uring_init,
+	.exist = default_exist,
+	.create_and_write = default_create_and_write,
+	.write = uring_write,
+	.read = uring_read,
+	.link = default_link,
+	.update_epoch = default_update_epoch,
+	.cleanup = default_cleanup,
+	.format = default_format,
+	.remove_object = default_remove_object,
+	.get_hash = default_get_hash,
+	.get_block_hash = default_get_block_hash,
+	.get_crc32c = default_get_crc32c,
+	.purge_obj = default_purge_obj,
+};
+
+add_store_driver(uring_store);
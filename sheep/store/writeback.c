@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bounded write-back
+ *
+ * With 'sheep -N', the objects are written into the page cache without
+ * O_DSYNC like with '-n', and the flusher thread makes them durable with a
+ * syncfs() of every disk once the first write since the last sync is window
+ * msec old, or once size bytes have been written since then.  A power failure
+ * loses the acknowledged writes of about the last window, instead of what the
+ * kernel hasn't written back by itself.
+ *
+ * The syncs run in rounds, and a round covers the writes done before it
+ * starts.  SD_OP_SYNC_PEER asks for a round at once and waits for it, and the
+ * gateway sends it to all the nodes for SD_OP_FLUSH_VDI, so the flushes of
+ * the guests still make their writes durable.
+ */
+
+#include "sheep_priv.h"
+
+static uint64_t wb_size;
+static struct sd_mutex wb_lock = SD_MUTEX_INITIALIZER;
+/* the flusher waits on wb_cond, the syncs on wb_done_cond */
+static struct sd_cond wb_cond = SD_COND_INITIALIZER;
+static struct sd_cond wb_done_cond = SD_COND_INITIALIZER;
+static bool wb_urgent;
+static uint64_t nr_rounds_started, nr_rounds_done;
+static int wb_ret;		/* of the last round done */
+static int wb_sync_ret;
+
+/* updated without wb_lock by the writers */
+static uint64_t wb_dirty;	/* bytes written since the round started */
+static uint64_t wb_first;	/* msec, the first of them, zero if none */
+
+static inline uint64_t wb_now(void)
+{
+	return clock_get_time() / 1000000;
+}
+
+/* Called after len bytes of an object are written without O_DSYNC */
+void writeback_written(uint32_t len)
+{
+	uint64_t dirty;
+
+	if (!sys->writeback_window)
+		return;
+
+	dirty = uatomic_add_return(&wb_dirty, len);
+	/* wake the flusher up for the first write and for the size */
+	if (uatomic_cmpxchg(&wb_first, 0, wb_now()) == 0 ||
+	    (dirty >= wb_size && dirty - len < wb_size)) {
+		sd_mutex_lock(&wb_lock);
+		sd_cond_signal(&wb_cond);
+		sd_mutex_unlock(&wb_lock);
+	}
+}
+
+static int sync_dir(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || syncfs(fd) < 0) {
+		sd_err("failed to sync %s, %m", path);
+		wb_sync_ret = SD_RES_EIO;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	/* sync the other disks anyway */
+	return SD_RES_SUCCESS;
+}
+
+/* Wait until a round is due, called with wb_lock held */
+static void wait_round(void)
+{
+	uint64_t first, now;
+	struct timespec ts;
+
+	for (;;) {
+		first = uatomic_read(&wb_first);
+		now = wb_now();
+		if (wb_urgent || uatomic_read(&wb_dirty) >= wb_size ||
+		    (first && now >= first + sys->writeback_window))
+			return;
+
+		if (!first) {
+			sd_cond_wait(&wb_cond, &wb_lock);
+			continue;
+		}
+		/* clock_get_time() is of CLOCK_REALTIME like the wait */
+		first += sys->writeback_window;
+		ts.tv_sec = first / 1000;
+		ts.tv_nsec = (first % 1000) * 1000000;
+		pthread_cond_timedwait(&wb_cond.cond, &wb_lock.mutex, &ts);
+	}
+}
+
+static void *writeback_flusher(void *arg)
+{
+	uint64_t start;
+	int ret;
+
+	for (;;) {
+		sd_mutex_lock(&wb_lock);
+		wait_round();
+		wb_urgent = false;
+		nr_rounds_started++;
+		sd_mutex_unlock(&wb_lock);
+
+		/* the writes done after this are left to the next round */
+		uatomic_set(&wb_first, 0);
+		uatomic_set(&wb_dirty, 0);
+		start = wb_now();
+		wb_sync_ret = SD_RES_SUCCESS;
+		for_each_obj_path(sync_dir);
+		ret = wb_sync_ret;
+		sd_debug("synced in %"PRIu64" msec", wb_now() - start);
+
+		sd_mutex_lock(&wb_lock);
+		nr_rounds_done = nr_rounds_started;
+		wb_ret = ret;
+		sd_cond_broadcast(&wb_done_cond);
+		sd_mutex_unlock(&wb_lock);
+	}
+
+	return NULL;
+}
+
+/* Make the writes done so far durable, returns the result of the round */
+int writeback_sync(void)
+{
+	uint64_t round;
+	int ret;
+
+	if (!sys->writeback_window || sys->gateway_only)
+		return SD_RES_SUCCESS;
+
+	sd_mutex_lock(&wb_lock);
+	/* the running round may have missed our writes */
+	round = nr_rounds_started + 1;
+	wb_urgent = true;
+	sd_cond_signal(&wb_cond);
+	while (nr_rounds_done < round)
+		sd_cond_wait(&wb_done_cond, &wb_lock);
+	/* a later round covers them as well */
+	ret = wb_ret;
+	sd_mutex_unlock(&wb_lock);
+
+	return ret;
+}
+
+#ifndef HAVE_ACCELIO
+
+/* Ask all the nodes for a sync at once, returns the first error */
+int writeback_sync_nodes(const struct vnode_info *vinfo)
+{
+	int nr_nodes = vinfo->nr_nodes, i, nr = 0, nr_done = 0, ret;
+	struct sockfd **sfds = xcalloc(nr_nodes, sizeof(*sfds));
+	const struct sd_node **nodes = xcalloc(nr_nodes, sizeof(*nodes));
+	struct pollfd *pfd = xcalloc(nr_nodes, sizeof(*pfd));
+	uint32_t epoch = sys_epoch();
+	int result = SD_RES_SUCCESS;
+	const struct sd_node *n;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+
+	rb_for_each_entry(n, &vinfo->nroot, rb) {
+		if (node_is_local(n))
+			continue;
+
+		sfds[nr] = sockfd_cache_get(&n->nid);
+		if (!sfds[nr]) {
+			result = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+		sd_init_req(&hdr, SD_OP_SYNC_PEER);
+		hdr.epoch = epoch;
+		if (send_req(sfds[nr]->fd, &hdr, NULL, 0, sheep_need_retry,
+			     epoch, MAX_RETRY_COUNT)) {
+			sockfd_cache_del(&n->nid, sfds[nr]);
+			sfds[nr] = NULL;
+			result = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+		nodes[nr] = n;
+		pfd[nr].fd = sfds[nr]->fd;
+		pfd[nr].events = POLLIN;
+		nr++;
+	}
+
+	/* meanwhile */
+	ret = writeback_sync();
+	if (ret != SD_RES_SUCCESS)
+		result = ret;
+
+	while (nr_done < nr) {
+		ret = poll(pfd, nr, MAX_POLLTIME * 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			result = SD_RES_NETWORK_ERROR;
+			break;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (pfd[i].fd < 0 || !pfd[i].revents)
+				continue;
+
+			/* ignored by poll() from now on */
+			pfd[i].fd = -1;
+			nr_done++;
+			if (recv_rsp(sfds[i]->fd, rsp, NULL, 0,
+				     sheep_need_retry, epoch,
+				     MAX_RETRY_COUNT)) {
+				sockfd_cache_del(&nodes[i]->nid, sfds[i]);
+				sfds[i] = NULL;
+				result = SD_RES_NETWORK_ERROR;
+				continue;
+			}
+			sockfd_cache_put(&nodes[i]->nid, sfds[i]);
+			sfds[i] = NULL;
+			if (rsp->result != SD_RES_SUCCESS)
+				result = rsp->result;
+		}
+	}
+
+	for (i = 0; i < nr; i++)
+		if (sfds[i])
+			sockfd_cache_drop(&nodes[i]->nid, sfds[i]);
+	free(sfds);
+	free(nodes);
+	free(pfd);
+
+	return result;
+}
+
+#else
+
+int writeback_sync_nodes(const struct vnode_info *vinfo)
+{
+	int result = writeback_sync(), ret;
+	const struct sd_node *n;
+	struct sd_req hdr;
+
+	rb_for_each_entry(n, &vinfo->nroot, rb) {
+		if (node_is_local(n))
+			continue;
+
+		sd_init_req(&hdr, SD_OP_SYNC_PEER);
+		ret = sheep_exec_req(&n->nid, &hdr, NULL);
+		if (ret != SD_RES_SUCCESS)
+			result = ret;
+	}
+
+	return result;
+}
+
+#endif
+
+/* Called once the store is ready */
+int writeback_init(uint64_t size)
+{
+	sd_thread_t t;
+	int ret;
+
+	if (sys->nosync) {
+		sd_err("the write-back can't be used with '-n'");
+		return -1;
+	}
+	/* a gateway only asks the others for the syncs */
+	if (sys->gateway_only)
+		return 0;
+	if (store_id_match(LOG_STORE) || store_id_match(RAW_STORE)) {
+		sd_err("the write-back is not supported by the %s store",
+		       sd_store->name);
+		return -1;
+	}
+
+	wb_size = size;
+
+	ret = sd_thread_create("writeback", &t, writeback_flusher, NULL);
+	if (ret) {
+		sd_err("failed to create the flusher, %s", strerror(ret));
+		return -1;
+	}
+
+	sd_info("sync the writes within %"PRIu32" msec or %"PRIu64" bytes",
+		sys->writeback_window, size);
+	return 0;
+}
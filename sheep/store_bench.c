@@ -0,0 +1,495 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of the store drivers
+ *
+ * store_bench drives a store driver directly, with no cluster, network or
+ * request queues in between, so that the backends and the file systems under
+ * them can be compared on their own.  The md disks are set up from PATH as
+ * sheep does, the driver is formatted and then the phases run in order, each
+ * by the given number of threads:
+ *
+ *   create_and_write  whole objects, each thread creating its share
+ *   write             writes of the block size into the objects
+ *   read              reads of the block size from the objects
+ *   get_hash          of each object
+ *   update_epoch      for a cluster without this node, so that every object
+ *                     is moved to the stale directories
+ *   link              of each object back from the stale directories
+ *
+ * The writes and reads go through the objects in order, or at random offsets
+ * with -r.  One line is printed per phase, in the "key=value" form of the
+ * micro-benchmarks in tests/unit/bench:
+ *
+ *   name=<phase> ops=<n> ops_per_sec=<n> [mb_per_sec=<MB/s>] avg_us=<usec>
+ *   p50_us=<usec> p99_us=<usec> p999_us=<usec> max_us=<usec>
+ *
+ * The latencies of update_epoch are those of the whole call.  The contents of
+ * PATH are destroyed.
+ */
+
+#include <getopt.h>
+#include <time.h>
+
+#include "sheep_priv.h"
+#include "option.h"
+
+static const char program_name[] = "store_bench";
+
+/* sheep.c is not linked, these are the globals it would have defined */
+static struct system_info __sys;
+struct system_info *sys = &__sys;
+LIST_HEAD(cluster_drivers);
+
+#define BENCH_SEED 0x5eed5eed5eed5eedULL
+#define BENCH_VID 0x123456
+#define BENCH_EPOCH 1
+
+static int nr_threads = 4;
+static uint64_t nr_objects = 1024, nr_ios = 65536, block_size = 4096;
+static bool random_io;
+
+enum bench_phase {
+	PHASE_CREATE,
+	PHASE_WRITE,
+	PHASE_READ,
+	PHASE_HASH,
+	PHASE_LINK,
+};
+
+struct bench_thread {
+	enum bench_phase phase;
+	int idx;
+	uint64_t seed;
+	char *buf;
+	int result;
+
+	uint64_t nr_ops;
+	uint64_t bytes;
+	uint64_t total;		/* usec */
+	uint64_t max;
+	uint64_t buckets[SD_NR_LATENCY_BUCKETS];
+};
+
+static uint64_t bench_rand(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t object_size(void)
+{
+	return UINT64_C(1) << sys->cinfo.block_size_shift;
+}
+
+static inline uint64_t bench_oid(uint64_t idx)
+{
+	return vid_to_data_oid(BENCH_VID, idx);
+}
+
+static void account_op(struct bench_thread *t, uint64_t start, uint64_t bytes)
+{
+	uint64_t lat = now_usec() - start;
+
+	t->nr_ops++;
+	t->bytes += bytes;
+	t->total += lat;
+	t->max = max(t->max, lat);
+	t->buckets[latency_to_bucket(lat)]++;
+}
+
+static int do_create(struct bench_thread *t)
+{
+	struct siocb iocb = {
+		.epoch = BENCH_EPOCH,
+		.buf = t->buf,
+		.length = object_size(),
+	};
+	int ret;
+
+	for (uint64_t i = t->idx; i < nr_objects; i += nr_threads) {
+		uint64_t start = now_usec();
+
+		ret = sd_store->create_and_write(bench_oid(i), &iocb);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		account_op(t, start, iocb.length);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * The sequential I/O of a thread goes through the objects of its share of
+ * create_and_write, block by block
+ */
+static void pick_block(struct bench_thread *t, uint64_t n, uint64_t *oid,
+		       uint32_t *offset)
+{
+	uint64_t nr_blocks = object_size() / block_size, i;
+
+	if (random_io) {
+		*oid = bench_oid(bench_rand(&t->seed) % nr_objects);
+		*offset = bench_rand(&t->seed) % nr_blocks * block_size;
+		return;
+	}
+
+	i = t->idx + n / nr_blocks * nr_threads;
+	*oid = bench_oid(i % nr_objects);
+	*offset = n % nr_blocks * block_size;
+}
+
+static int do_io(struct bench_thread *t)
+{
+	struct siocb iocb = {
+		.epoch = BENCH_EPOCH,
+		.buf = t->buf,
+		.length = block_size,
+	};
+	uint64_t nr = nr_ios / nr_threads + (t->idx < nr_ios % nr_threads), oid;
+	int ret;
+
+	for (uint64_t n = 0; n < nr; n++) {
+		uint64_t start = now_usec();
+
+		pick_block(t, n, &oid, &iocb.offset);
+		if (t->phase == PHASE_WRITE)
+			ret = sd_store->write(oid, &iocb);
+		else
+			ret = sd_store->read(oid, &iocb);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		account_op(t, start, block_size);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int do_hash_or_link(struct bench_thread *t)
+{
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+	int ret;
+
+	for (uint64_t i = t->idx; i < nr_objects; i += nr_threads) {
+		uint64_t start = now_usec();
+
+		if (t->phase == PHASE_HASH)
+			ret = sd_store->get_hash(bench_oid(i), BENCH_EPOCH,
+						 sha1);
+		else
+			ret = sd_store->link(bench_oid(i), BENCH_EPOCH);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		account_op(t, start, 0);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *t = arg;
+
+	switch (t->phase) {
+	case PHASE_CREATE:
+		t->result = do_create(t);
+		break;
+	case PHASE_WRITE:
+	case PHASE_READ:
+		t->result = do_io(t);
+		break;
+	case PHASE_HASH:
+	case PHASE_LINK:
+		t->result = do_hash_or_link(t);
+		break;
+	}
+
+	return NULL;
+}
+
+static void report(const char *name, const struct bench_thread *sum,
+		   uint64_t elapsed)
+{
+	uint64_t nr = sum->nr_ops;
+
+	elapsed = max(elapsed, (uint64_t)1);
+	printf("name=%s ops=%"PRIu64" ops_per_sec=%.1f", name, nr,
+	       (double)nr * 1000000 / elapsed);
+	if (sum->bytes)
+		printf(" mb_per_sec=%.1f", (double)sum->bytes / elapsed);
+	printf(" avg_us=%"PRIu64" p50_us=%"PRIu64" p99_us=%"PRIu64
+	       " p999_us=%"PRIu64" max_us=%"PRIu64"\n",
+	       nr ? sum->total / nr : 0,
+	       latency_percentile(sum->buckets, nr, sum->max, 50),
+	       latency_percentile(sum->buckets, nr, sum->max, 99),
+	       latency_percentile(sum->buckets, nr, sum->max, 99.9), sum->max);
+}
+
+static int run_phase(const char *name, enum bench_phase phase, char **bufs)
+{
+	struct bench_thread *threads = xcalloc(nr_threads, sizeof(*threads));
+	sd_thread_t *tids = xcalloc(nr_threads, sizeof(*tids));
+	struct bench_thread sum = {};
+	uint64_t start;
+	int ret = SD_RES_SUCCESS;
+
+	for (int i = 0; i < nr_threads; i++) {
+		threads[i].phase = phase;
+		threads[i].idx = i;
+		threads[i].seed = BENCH_SEED + i;
+		threads[i].buf = bufs[i];
+	}
+
+	start = now_usec();
+	for (int i = 0; i < nr_threads; i++)
+		if (sd_thread_create_with_idx("bench", tids + i,
+					      bench_thread_fn, threads + i))
+			panic("failed to create a thread");
+	for (int i = 0; i < nr_threads; i++)
+		sd_thread_join(tids[i], NULL);
+
+	for (int i = 0; i < nr_threads; i++) {
+		const struct bench_thread *t = threads + i;
+
+		if (t->result != SD_RES_SUCCESS) {
+			sd_err("%s failed, %s", name, sd_strerror(t->result));
+			ret = t->result;
+		}
+		sum.nr_ops += t->nr_ops;
+		sum.bytes += t->bytes;
+		sum.total += t->total;
+		sum.max = max(sum.max, t->max);
+		for (int j = 0; j < SD_NR_LATENCY_BUCKETS; j++)
+			sum.buckets[j] += t->buckets[j];
+	}
+	report(name, &sum, now_usec() - start);
+
+	free(tids);
+	free(threads);
+	return ret;
+}
+
+/* Move all the objects to the stale directories of BENCH_EPOCH */
+static int run_update_epoch(void)
+{
+	struct sd_node *n = xzalloc(sizeof(*n));
+	struct rb_root nroot = RB_ROOT;
+	struct bench_thread sum = {};
+	uint64_t start;
+	int ret;
+
+	str_to_addr("127.0.0.2", n->nid.addr);
+	n->nid.port = SD_LISTEN_PORT;
+	n->nr_vnodes = SD_DEFAULT_VNODES;
+	rb_insert(&nroot, n, rb, node_cmp);
+	set_vnode_info(alloc_vnode_info(&nroot));
+	free(n);
+
+	start = now_usec();
+	ret = sd_store->update_epoch(BENCH_EPOCH);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("update_epoch failed, %s", sd_strerror(ret));
+	else
+		account_op(&sum, start, 0);
+	report("update_epoch", &sum, now_usec() - start);
+
+	return ret;
+}
+
+static int init_store(char *path, const char *store)
+{
+	char *argp = strdup(path), *dir;
+	int ret;
+
+	/* path is left with the meta dir only */
+	if (init_base_path(strtok(path, ",")) < 0)
+		return -1;
+	dir = realpath(path, NULL);
+	if (!dir) {
+		sd_err("%m");
+		return -1;
+	}
+
+	ret = init_global_pathnames(dir, argp);
+	free(argp);
+	free(dir);
+	if (ret)
+		return -1;
+	md_init_space();
+
+	sd_store = find_store_driver(store);
+	if (!sd_store) {
+		sd_err("store %s not found", store);
+		return -1;
+	}
+	pstrcpy((char *)sys->cinfo.default_store,
+		sizeof(sys->cinfo.default_store), store);
+
+	ret = sd_store->format();
+	if (ret == SD_RES_SUCCESS)
+		ret = sd_store->init();
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to initialize the store, %s",
+		       sd_strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct sd_option bench_options[] = {
+	{'b', "block-size", true, "the size of the writes and the reads "
+	 "(default: 4K)"},
+	{'c', "count", true, "the number of the writes, and of the reads "
+	 "(default: 65536)"},
+	{'D', "directio", false, "use direct I/O for the store"},
+	{'h', "help", false, "display this help and exit"},
+	{'n', "nosync", false, "don't sync the writes"},
+	{'o', "objects", true, "the number of the objects (default: 1024)"},
+	{'r', "random", false, "write and read at random offsets"},
+	{'s', "store", true, "the store driver (default: plain)"},
+	{'t', "threads", true, "the number of the threads (default: 4)"},
+	{ 0, NULL, false, NULL },
+};
+
+static void usage(int status)
+{
+	struct sd_option *opt;
+
+	if (status) {
+		sd_err("Try '%s --help' for more information.", program_name);
+		exit(status);
+	}
+
+	printf("Benchmark of the store drivers of sheep\n"
+	       "Usage: %s [OPTION]... PATH\n"
+	       "Options:\n", program_name);
+	sd_for_each_option(opt, bench_options) {
+		printf("  -%c, --%-18s%s\n", opt->ch, opt->name, opt->desc);
+	}
+	printf("\nPATH is <meta dir>[,<disk>]... as of sheep, its contents are "
+	       "destroyed\n");
+	exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	const char *store = "plain", *short_options;
+	struct option *long_options;
+	char **bufs;
+	uint64_t seed = BENCH_SEED, val;
+	int ch, longindex, ret;
+
+	long_options = build_long_options(bench_options);
+	short_options = build_short_options(bench_options);
+	while ((ch = getopt_long(argc, argv, short_options, long_options,
+				 &longindex)) >= 0) {
+		switch (ch) {
+		case 'b':
+			if (option_parse_size(optarg, &block_size) < 0 ||
+			    !block_size)
+				usage(1);
+			break;
+		case 'c':
+			nr_ios = strtoull(optarg, NULL, 10);
+			break;
+		case 'D':
+			sys->backend_dio = true;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		case 'n':
+			sys->nosync = true;
+			break;
+		case 'o':
+			nr_objects = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			random_io = true;
+			break;
+		case 's':
+			store = optarg;
+			break;
+		case 't':
+			val = strtoull(optarg, NULL, 10);
+			if (val < 1 || val > 1024)
+				usage(1);
+			nr_threads = val;
+			break;
+		default:
+			usage(1);
+			break;
+		}
+	}
+	if (optind != argc - 1 || !nr_objects)
+		usage(1);
+
+	sys->cinfo.epoch = BENCH_EPOCH;
+	sys->cinfo.block_size_shift = SD_DEFAULT_BLOCK_SIZE_SHIFT;
+	sys->cinfo.flags |= SD_CLUSTER_FLAG_AUTO_VNODES;
+	str_to_addr("127.0.0.1", sys->this_node.nid.addr);
+	sys->this_node.nid.port = SD_LISTEN_PORT;
+	if (block_size > object_size()) {
+		sd_err("the block size is larger than the objects");
+		return 1;
+	}
+
+	init_fec();
+	if (init_event(4096) < 0 || init_work_queue(NULL) < 0) {
+		sd_err("failed to initialize the work queue");
+		return 1;
+	}
+	sys->md_wqueue = create_ordered_work_queue("md");
+	sys->reclaim_wqueue = create_ordered_work_queue("reclaim");
+
+	if (init_store(argv[optind], store) < 0)
+		return 1;
+
+	/* random data, so that no driver can take a shortcut on it */
+	bufs = xcalloc(nr_threads, sizeof(*bufs));
+	for (int i = 0; i < nr_threads; i++) {
+		uint64_t *buf = xvalloc(object_size());
+
+		for (size_t j = 0; j < object_size() / sizeof(*buf); j++)
+			buf[j] = bench_rand(&seed);
+		bufs[i] = (char *)buf;
+	}
+
+	ret = run_phase("create_and_write", PHASE_CREATE, bufs);
+	if (ret == SD_RES_SUCCESS && nr_ios)
+		ret = run_phase("write", PHASE_WRITE, bufs);
+	if (ret == SD_RES_SUCCESS && nr_ios)
+		ret = run_phase("read", PHASE_READ, bufs);
+	if (ret == SD_RES_SUCCESS)
+		ret = run_phase("get_hash", PHASE_HASH, bufs);
+	if (ret == SD_RES_SUCCESS)
+		ret = run_update_epoch();
+	if (ret == SD_RES_SUCCESS)
+		ret = run_phase("link", PHASE_LINK, bufs);
+
+	for (int i = 0; i < nr_threads; i++)
+		free(bufs[i]);
+	free(bufs);
+
+	return ret == SD_RES_SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Profile tracer
+ *
+ * Unlike the graph tracer, which pushes every entry and exit into the trace
+ * buffers, the profile tracer only counts the calls of each function and
+ * the time spent in them, in counters private to each thread.  It is cheap
+ * enough to be kept enabled under load:
+ *
+ *   dog trace enable "profile rate=100,func=sheep_do_op_work,func=..."
+ *
+ * 'func=' limits the tracing to the given functions, so only their mcount
+ * call sites are patched.  'rate=N' measures the time of 1 call out of N
+ * per thread; the calls themselves are always counted.  The counters are
+ * reset when the tracer is enabled and read by 'dog trace graph stat'.
+ */
+
+#include "trace.h"
+#include "option.h"
+
+struct profile_counter {
+	uint64_t nr_calls;
+	uint64_t nr_sampled;
+	uint64_t sampled_time;
+};
+
+struct profile_thread {
+	struct list_node list;
+	uint64_t tick;
+	struct {
+		const struct caller *caller;
+		uint64_t start;
+	} stack[SD_MAX_STACK_DEPTH];
+	struct profile_counter counters[];
+};
+
+static const struct caller *callers;
+static size_t nr_callers;
+
+static uint32_t sample_rate = 1;
+static bool *selected;
+static int nr_selected;
+
+static LIST_HEAD(thread_list);
+static struct sd_mutex thread_list_lock = SD_MUTEX_INITIALIZER;
+/* counters of the exited threads */
+static struct profile_counter *retired;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static __thread struct profile_thread *my_thread;
+
+static void profile_thread_destructor(void *arg)
+{
+	struct profile_thread *pt = arg;
+
+	sd_mutex_lock(&thread_list_lock);
+	list_del(&pt->list);
+	for (size_t i = 0; i < nr_callers; i++) {
+		retired[i].nr_calls += pt->counters[i].nr_calls;
+		retired[i].nr_sampled += pt->counters[i].nr_sampled;
+		retired[i].sampled_time += pt->counters[i].sampled_time;
+	}
+	sd_mutex_unlock(&thread_list_lock);
+
+	free(pt);
+	my_thread = NULL;
+}
+
+static void init_thread_key(void)
+{
+	if (pthread_key_create(&thread_key, profile_thread_destructor))
+		panic("failed to create the key of the profile tracer");
+}
+
+static struct profile_thread *get_profile_thread(void)
+{
+	if (likely(my_thread))
+		return my_thread;
+
+	pthread_once(&thread_once, init_thread_key);
+	my_thread = xzalloc(sizeof(*my_thread) +
+			    sizeof(my_thread->counters[0]) * nr_callers);
+	pthread_setspecific(thread_key, my_thread);
+
+	sd_mutex_lock(&thread_list_lock);
+	list_add(&my_thread->list, &thread_list);
+	sd_mutex_unlock(&thread_list_lock);
+
+	return my_thread;
+}
+
+static bool profile_filter(const struct caller *this_fn)
+{
+	return nr_selected == 0 || selected[this_fn - callers];
+}
+
+static void profile_enter(const struct caller *this_fn, int depth)
+{
+	struct profile_thread *pt;
+
+	/* another tracer may have patched the other sites */
+	if (!profile_filter(this_fn))
+		return;
+
+	pt = get_profile_thread();
+	pt->counters[this_fn - callers].nr_calls++;
+	if (++pt->tick % sample_rate)
+		return;
+
+	pt->stack[depth].caller = this_fn;
+	pt->stack[depth].start = clock_get_time();
+}
+
+static void profile_exit(const struct caller *this_fn, int depth)
+{
+	struct profile_thread *pt = my_thread;
+	struct profile_counter *c;
+
+	/* skip the calls which were not sampled or entered before enabling */
+	if (!pt || pt->stack[depth].caller != this_fn)
+		return;
+
+	c = pt->counters + (this_fn - callers);
+	c->nr_sampled++;
+	c->sampled_time += clock_get_time() - pt->stack[depth].start;
+	pt->stack[depth].caller = NULL;
+}
+
+static int rate_parser(const char *s)
+{
+	char *p;
+	long rate = strtol(s, &p, 10);
+
+	if (s == p || *p || rate < 1 || rate > UINT32_MAX) {
+		sd_err("invalid sample rate: %s", s);
+		return -1;
+	}
+	sample_rate = rate;
+	return 0;
+}
+
+static int func_parser(const char *s)
+{
+	for (size_t i = 0; i < nr_callers; i++) {
+		if (strcmp(callers[i].name, s) != 0)
+			continue;
+		if (!selected[i]) {
+			selected[i] = true;
+			nr_selected++;
+		}
+		return 0;
+	}
+
+	sd_err("no traceable function %s", s);
+	return -1;
+}
+
+static struct option_parser profile_parsers[] = {
+	{ "rate=", rate_parser },
+	{ "func=", func_parser },
+	{ NULL, NULL },
+};
+
+/* Called while the tracer is disabled, so nobody updates the counters */
+static int profile_setup(char *opts)
+{
+	struct profile_thread *pt;
+
+	if (!callers) {
+		callers = trace_get_callers(&nr_callers);
+		selected = xzalloc(sizeof(*selected) * nr_callers);
+		retired = xzalloc(sizeof(*retired) * nr_callers);
+	}
+
+	sample_rate = 1;
+	memset(selected, 0, sizeof(*selected) * nr_callers);
+	nr_selected = 0;
+	if (opts && *opts && option_parse(opts, ",", profile_parsers) < 0)
+		return -1;
+
+	sd_mutex_lock(&thread_list_lock);
+	list_for_each_entry(pt, &thread_list, list) {
+		memset(pt->counters, 0, sizeof(pt->counters[0]) * nr_callers);
+		memset(pt->stack, 0, sizeof(pt->stack));
+	}
+	memset(retired, 0, sizeof(*retired) * nr_callers);
+	sd_mutex_unlock(&thread_list_lock);
+
+	return 0;
+}
+
+/*
+ * Sum up the counters of all the threads into 'items' and return the number
+ * of the functions which were called, at most 'max'.
+ */
+int profile_stat(struct trace_profile_item *items, int max)
+{
+	struct profile_thread *pt;
+	int nr = 0;
+
+	sd_mutex_lock(&thread_list_lock);
+	for (size_t i = 0; i < nr_callers && nr < max; i++) {
+		struct trace_profile_item *item = items + nr;
+
+		memset(item, 0, sizeof(*item));
+		item->nr_calls = retired[i].nr_calls;
+		item->nr_sampled = retired[i].nr_sampled;
+		item->sampled_time = retired[i].sampled_time;
+		list_for_each_entry(pt, &thread_list, list) {
+			item->nr_calls += pt->counters[i].nr_calls;
+			item->nr_sampled += pt->counters[i].nr_sampled;
+			item->sampled_time += pt->counters[i].sampled_time;
+		}
+		if (!item->nr_calls)
+			continue;
+
+		pstrcpy(item->fname, sizeof(item->fname), callers[i].name);
+		nr++;
+	}
+	sd_mutex_unlock(&thread_list_lock);
+
+	return nr;
+}
+
+static struct tracer profile_tracer = {
+	.name = "profile",
+
+	.enter = profile_enter,
+	.exit = profile_exit,
+	.setup = profile_setup,
+	.filter = profile_filter,
+};
+
+tracer_register(profile_tracer);
@@ -88,16 +88,49 @@ void regist_tracer(struct tracer *tracer)
 	list_add_tail(&tracer->list, &tracers);
 }
 
-static void patch_all_sites(unsigned long addr)
+static void nop_all_sites(void)
 {
 	for (int i = 0; i < nr_callers; i++)
-		replace_call(callers[i].mcount, addr);
+		memcpy((void *)callers[i].mcount, NOP5, INSN_SIZE);
 }
 
-static void nop_all_sites(void)
+static bool site_wanted(const struct caller *caller)
 {
-	for (int i = 0; i < nr_callers; i++)
-		memcpy((void *)callers[i].mcount, NOP5, INSN_SIZE);
+	struct tracer *t;
+
+	list_for_each_entry(t, &tracers, list) {
+		if (!uatomic_is_true(&t->enabled))
+			continue;
+		if (!t->filter || t->filter(caller))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Point the mcount call sites of the functions which some enabled tracer
+ * wants to trace to trace_caller, and NOP the others.  Fewer patched sites
+ * means less overhead for tracers which are only interested in a few
+ * functions.
+ */
+static void update_sites(void)
+{
+	suspend_worker_threads();
+	for (int i = 0; i < nr_callers; i++) {
+		if (site_wanted(callers + i))
+			replace_call(callers[i].mcount,
+				     (unsigned long)trace_caller);
+		else
+			memcpy((void *)callers[i].mcount, NOP5, INSN_SIZE);
+	}
+	resume_worker_threads();
+}
+
+const struct caller *trace_get_callers(size_t *nr)
+{
+	*nr = nr_callers;
+	return callers;
 }
 
 /* the entry point of the function */
@@ -161,19 +194,6 @@ unsigned long trace_function_exit(void)
 	return trace_ret_stack[ret_stack_index].ret;
 }
 
-static size_t count_enabled_tracers(void)
-{
-	size_t nr = 0;
-	struct tracer *t;
-
-	list_for_each_entry(t, &tracers, list) {
-		if (uatomic_is_true(&t->enabled))
-			nr++;
-	}
-
-	return nr;
-}
-
 static struct tracer *find_tracer(const char *name)
 {
 	struct tracer *t;
@@ -186,7 +206,7 @@ static struct tracer *find_tracer(const char *name)
 	return NULL;
 }
 
-int trace_enable(const char *name)
+int trace_enable(const char *name, char *opts)
 {
 	struct tracer *tracer = find_tracer(name);
 
@@ -198,13 +218,19 @@ int trace_enable(const char *name)
 		return SD_RES_INVALID_PARMS;
 	}
 
-	uatomic_set_true(&tracer->enabled);
-
-	if (count_enabled_tracers() == 1) {
-		suspend_worker_threads();
-		patch_all_sites((unsigned long)trace_caller);
-		resume_worker_threads();
+	if (tracer->setup) {
+		if (tracer->setup(opts) < 0) {
+			sd_debug("invalid options for tracer %s, %s", name,
+				 opts);
+			return SD_RES_INVALID_PARMS;
+		}
+	} else if (opts && *opts) {
+		sd_debug("tracer %s takes no options", name);
+		return SD_RES_INVALID_PARMS;
 	}
+
+	uatomic_set_true(&tracer->enabled);
+	update_sites();
 	sd_debug("tracer %s enabled", tracer->name);
 
 	return SD_RES_SUCCESS;
@@ -223,11 +249,7 @@ int trace_disable(const char *name)
 	}
 
 	uatomic_set_false(&tracer->enabled);
-	if (count_enabled_tracers() == 0) {
-		suspend_worker_threads();
-		nop_all_sites();
-		resume_worker_threads();
-	}
+	update_sites();
 	sd_debug("tracer %s disabled", tracer->name);
 
 	return SD_RES_SUCCESS;
@@ -414,8 +436,8 @@ int trace_init(void)
 	nop_all_sites();
 
 #ifdef DEBUG
-	trace_enable("thread_checker");
-	trace_enable("loop_checker");
+	trace_enable("thread_checker", NULL);
+	trace_enable("loop_checker", NULL);
 #endif
 
 	nr_cpu = sysconf(_SC_NPROCESSORS_ONLN);
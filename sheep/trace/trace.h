@@ -20,6 +20,15 @@ struct tracer {
 	void (*enter)(const struct caller *this_fn, int depth);
 	void (*exit)(const struct caller *this_fn, int depth);
 
+	/*
+	 * Optional.  'setup' parses the options given to 'dog trace enable'
+	 * and is called before the tracer is enabled.  'filter' returns true
+	 * for the functions to be traced; all the functions are traced if it
+	 * is NULL.
+	 */
+	int (*setup)(char *opts);
+	bool (*filter)(const struct caller *this_fn);
+
 	/* internal use only */
 	uatomic_bool enabled;
 	int stack_depth;
@@ -39,20 +48,26 @@ unsigned long trace_function_exit(void);
 #ifdef HAVE_TRACE
   int trace_init(void);
   void regist_tracer(struct tracer *tracer);
-  int trace_enable(const char *name);
+  int trace_enable(const char *name, char *opts);
   int trace_disable(const char *name);
   size_t trace_status(char *buf);
   int trace_buffer_pop(void *buf, uint32_t len);
   void trace_buffer_push(int cpuid, struct trace_graph_item *item);
+  const struct caller *trace_get_callers(size_t *nr);
+
+/* profile.c */
+  int profile_stat(struct trace_profile_item *items, int max);
 
 #else
   static inline int trace_init(void) { return 0; }
-  static inline int trace_enable(const char *name) { return 0; }
+  static inline int trace_enable(const char *name, char *opts) { return 0; }
   static inline int trace_disable(const char *name) { return 0; }
   static inline size_t trace_status(char *buf) { return 0; }
   static inline int trace_buffer_pop(void *buf, uint32_t len) { return 0; }
   static inline void trace_buffer_push(
 	  int cpuid, struct trace_graph_item *item) { return; }
+  static inline int profile_stat(
+	  struct trace_profile_item *items, int max) { return 0; }
 
 #endif /* HAVE_TRACE */
 
@@ -96,6 +96,28 @@ TRACEPOINT_EVENT(
 		)
 	)
 
+/*
+ * The nsec when each of the NR_REQ_STAGES stages was reached, or zero.  A
+ * gateway forwards the oid, the epoch and the id of a request to the peers,
+ * so they tie the requests of the nodes together, and the port tells the
+ * nodes apart.
+ */
+TRACEPOINT_EVENT(
+	request,
+	stages,
+	TP_ARGS(const void *, _req, int, _op, uint64_t, _oid, uint32_t, _epoch,
+		uint32_t, _id, int, _port, const uint64_t *, _stages),
+	TP_FIELDS(
+		ctf_integer_hex(const void *, request, _req)
+		ctf_integer_hex(int, opcode, _op)
+		ctf_integer_hex(uint64_t, oid, _oid)
+		ctf_integer(uint32_t, epoch, _epoch)
+		ctf_integer(uint32_t, id, _id)
+		ctf_integer(int, port, _port)
+		ctf_array(uint64_t, stages, _stages, 8)
+		)
+	)
+
 #endif /* EVENT_TRACEPOINT_H */
 
 #include <lttng/tracepoint-event.h>
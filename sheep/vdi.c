@@ -18,6 +18,7 @@ struct vdi_state_entry {
 	bool snapshot;
 	bool deleted;
 	uint8_t copy_policy;
+	uint8_t flags;
 	uint32_t parent_vid;
 	struct rb_node node;
 
@@ -30,6 +31,10 @@ struct vdi_state_entry {
 	int nr_participants;
 	enum shared_lock_state participants_state[SD_MAX_COPIES];
 	struct node_id participants[SD_MAX_COPIES];
+	uint64_t lease_expire;		/* read lease of this node */
+	uint32_t coherence_gen;		/* bumped on every invalidation */
+
+	uint64_t version;		/* the last change, see vdi_state_touch() */
 
 	struct vdi_family_member *family_member;
 };
@@ -37,6 +42,52 @@ struct vdi_state_entry {
 static struct rb_root vdi_state_root = RB_ROOT;
 static struct sd_rw_lock vdi_state_lock = SD_RW_LOCK_INITIALIZER;
 
+/*
+ * Each entry remembers the version of its last change, so that
+ * get_vdi_state_delta() can tell the changes since any version.  The
+ * generation changes on every start and clean, so deltas never span them.
+ */
+static uint64_t vdi_state_version;
+static uint64_t vdi_state_generation;
+
+static void vdi_state_touch(struct vdi_state_entry *entry)
+{
+	if (unlikely(!vdi_state_generation))
+		vdi_state_generation = clock_get_time();
+	entry->version = ++vdi_state_version;
+}
+
+uint64_t get_vdi_state_generation(void)
+{
+	uint64_t generation;
+
+	sd_read_lock(&vdi_state_lock);
+	generation = vdi_state_generation;
+	sd_rw_unlock(&vdi_state_lock);
+
+	return generation;
+}
+
+/*
+ * Lock-free copy of the attributes of each vdi state which are read on every
+ * I/O (get_vdi_copy_number() and friends), packed into one word and indexed by
+ * vid.  The pages of the table are allocated on demand and never freed, so the
+ * readers only do atomic loads.  The writers hold vdi_state_lock.
+ */
+#define VDI_ATTR_PAGE_SHIFT	12
+#define VDI_ATTR_PAGE_SIZE	(1U << VDI_ATTR_PAGE_SHIFT)
+#define NR_VDI_ATTR_PAGES	(SD_NR_VDIS >> VDI_ATTR_PAGE_SHIFT)
+
+#define VDI_ATTR_VALID		(1U << 31)
+#define VDI_ATTR_SNAPSHOT	(1U << 30)
+#define VDI_ATTR_COMPRESS	(1U << 29)
+#define VDI_ATTR_QUORUM(a)	(((a) >> 24) & 0x1f)
+#define VDI_ATTR_COPY_POLICY(a)	(((a) >> 16) & 0xff)
+#define VDI_ATTR_BSS(a)		(((a) >> 8) & 0xff)
+#define VDI_ATTR_NR_COPIES(a)	((a) & 0xff)
+
+static uint32_t *vdi_attr_pages[NR_VDI_ATTR_PAGES];
+
 struct vdi_family_member {
 	uint32_t vid, parent_vid;
 	struct vdi_family_member *parent;
@@ -52,25 +103,36 @@ static LIST_HEAD(vdi_family_roots);
 static LIST_HEAD(vdi_family_temporal_orphans);
 static struct sd_mutex vdi_family_mutex = SD_MUTEX_INITIALIZER;
 
-static struct vdi_family_member *lookup_vdi_family_member(uint32_t vid,
-				  struct vdi_family_member *family_member)
+/*
+ * The family members indexed by vid, paged like vdi_attr_pages, so that the
+ * parent of a new vdi is found without walking the families.  Protected by
+ * vdi_family_mutex.
+ */
+static struct vdi_family_member **vdi_family_pages[NR_VDI_ATTR_PAGES];
+
+static struct vdi_family_member *lookup_vdi_family_member(uint32_t vid)
 {
-	/* FIXME: more effective data structure */
-	struct vdi_family_member *vdi;
+	struct vdi_family_member **page;
 
-	if (family_member->vid == vid)
-		return family_member;
+	page = vdi_family_pages[vid >> VDI_ATTR_PAGE_SHIFT];
+	if (!page)
+		return NULL;
 
-	list_for_each_entry(vdi, &family_member->child_list_head,
-			    child_list_node) {
-		struct vdi_family_member *ret;
+	return page[vid & (VDI_ATTR_PAGE_SIZE - 1)];
+}
 
-		ret = lookup_vdi_family_member(vid, vdi);
-		if (ret)
-			return ret;
-	}
+static void set_vdi_family_member(uint32_t vid,
+				  struct vdi_family_member *member)
+{
+	struct vdi_family_member ***slot;
 
-	return NULL;
+	slot = &vdi_family_pages[vid >> VDI_ATTR_PAGE_SHIFT];
+	if (!*slot) {
+		if (!member)
+			return;
+		*slot = xzalloc(sizeof(**slot) * VDI_ATTR_PAGE_SIZE);
+	}
+	(*slot)[vid & (VDI_ATTR_PAGE_SIZE - 1)] = member;
 }
 
 static void update_vdi_family(uint32_t parent_vid,
@@ -92,6 +154,7 @@ static void update_vdi_family(uint32_t parent_vid,
 		INIT_LIST_NODE(&new->child_list_node);
 
 		list_add_tail(&new->roots_list, &vdi_family_roots);
+		set_vdi_family_member(vid, new);
 
 		sd_debug("new vid %"PRIx32 " is added as a root VDI", vid);
 		goto out;
@@ -106,13 +169,12 @@ static void update_vdi_family(uint32_t parent_vid,
 	INIT_LIST_NODE(&new->roots_list);
 	INIT_LIST_HEAD(&new->child_list_head);
 	INIT_LIST_NODE(&new->child_list_node);
+	set_vdi_family_member(vid, new);
 
-	list_for_each_entry(vdi, &vdi_family_roots, roots_list) {
-		parent = lookup_vdi_family_member(parent_vid, vdi);
-		if (parent) {
-			new->parent = parent;
-			goto found;
-		}
+	parent = lookup_vdi_family_member(parent_vid);
+	if (parent) {
+		new->parent = parent;
+		goto found;
 	}
 
 	if (unordered) {
@@ -121,7 +183,8 @@ static void update_vdi_family(uint32_t parent_vid,
 
 		list_add_tail(&new->child_list_node,
 			      &vdi_family_temporal_orphans);
-		goto ret;
+		/* its own orphans can still be adopted by it */
+		goto out;
 	}
 
 	panic("parent VID: %"PRIx32" not found", parent_vid);
@@ -147,7 +210,6 @@ out:
 			 vid, vdi->vid);
 	}
 
-ret:
 	sd_mutex_unlock(&vdi_family_mutex);
 }
 
@@ -215,20 +277,69 @@ static struct vdi_state_entry *vdi_state_insert(struct rb_root *root,
 	return rb_insert(root, new, node, vdi_state_cmp);
 }
 
-static bool vid_is_snapshot(uint32_t vid)
+/* Returns 0 if vid has no state */
+static uint32_t vdi_attr_get(uint32_t vid)
 {
-	struct vdi_state_entry *entry;
+	uint32_t *page;
 
-	sd_read_lock(&vdi_state_lock);
-	entry = vdi_state_search(&vdi_state_root, vid);
-	sd_rw_unlock(&vdi_state_lock);
+	page = uatomic_read(&vdi_attr_pages[vid >> VDI_ATTR_PAGE_SHIFT]);
+	if (!page)
+		return 0;
+	cmm_smp_read_barrier_depends();
 
-	if (!entry) {
+	return uatomic_read(&page[vid & (VDI_ATTR_PAGE_SIZE - 1)]);
+}
+
+static void vdi_attr_set(uint32_t vid, uint32_t attr)
+{
+	uint32_t **slot = &vdi_attr_pages[vid >> VDI_ATTR_PAGE_SHIFT];
+
+	if (!*slot) {
+		uint32_t *page;
+
+		if (!attr)
+			return;
+		page = xzalloc(sizeof(uint32_t) * VDI_ATTR_PAGE_SIZE);
+		/* publish the page only after it is zeroed */
+		cmm_smp_wmb();
+		uatomic_set(slot, page);
+	}
+
+	uatomic_set(&(*slot)[vid & (VDI_ATTR_PAGE_SIZE - 1)], attr);
+}
+
+/* Called with vdi_state_lock held for write */
+static void vdi_attr_update(const struct vdi_state_entry *entry)
+{
+	vdi_attr_set(entry->vid, VDI_ATTR_VALID |
+		     (entry->snapshot ? VDI_ATTR_SNAPSHOT : 0) |
+		     (entry->flags & SD_INODE_COMPRESS ? VDI_ATTR_COMPRESS : 0) |
+		     (uint32_t)SD_INODE_QUORUM(entry->flags) << 24 |
+		     (uint32_t)entry->copy_policy << 16 |
+		     (uint32_t)entry->block_size_shift << 8 |
+		     (entry->nr_copies & 0xff));
+}
+
+static void vdi_attr_clear_all(void)
+{
+	for (int i = 0; i < NR_VDI_ATTR_PAGES; i++) {
+		if (!vdi_attr_pages[i])
+			continue;
+		for (int j = 0; j < VDI_ATTR_PAGE_SIZE; j++)
+			uatomic_set(&vdi_attr_pages[i][j], 0);
+	}
+}
+
+static bool vid_is_snapshot(uint32_t vid)
+{
+	uint32_t attr = vdi_attr_get(vid);
+
+	if (!attr) {
 		sd_err("No VDI entry for %" PRIx32 " found", vid);
 		return 0;
 	}
 
-	return entry->snapshot;
+	return attr & VDI_ATTR_SNAPSHOT;
 }
 
 bool oid_is_readonly(uint64_t oid)
@@ -242,74 +353,97 @@ bool oid_is_readonly(uint64_t oid)
 
 int get_vdi_copy_number(uint32_t vid)
 {
-	struct vdi_state_entry *entry;
-
-	sd_read_lock(&vdi_state_lock);
-	entry = vdi_state_search(&vdi_state_root, vid);
-	sd_rw_unlock(&vdi_state_lock);
+	uint32_t attr = vdi_attr_get(vid);
 
-	if (!entry) {
+	if (!attr) {
 		sd_alert("copy number for %" PRIx32 " not found, set %d", vid,
 			 sys->cinfo.nr_copies);
 		return sys->cinfo.nr_copies;
 	}
 
-	return entry->nr_copies;
+	return VDI_ATTR_NR_COPIES(attr);
 }
 
 int get_vdi_copy_policy(uint32_t vid)
 {
-	struct vdi_state_entry *entry;
-
-	sd_read_lock(&vdi_state_lock);
-	entry = vdi_state_search(&vdi_state_root, vid);
-	sd_rw_unlock(&vdi_state_lock);
+	uint32_t attr = vdi_attr_get(vid);
 
-	if (!entry) {
+	if (!attr) {
 		sd_alert("copy policy for %" PRIx32 " not found, set %d", vid,
 			 sys->cinfo.copy_policy);
 		return sys->cinfo.copy_policy;
 	}
 
-	return entry->copy_policy;
+	return VDI_ATTR_COPY_POLICY(attr);
 }
 
 uint32_t get_vdi_object_size(uint32_t vid)
 {
-	struct vdi_state_entry *entry;
-	uint32_t object_size;
-
-	sd_read_lock(&vdi_state_lock);
-	entry = vdi_state_search(&vdi_state_root, vid);
-	sd_rw_unlock(&vdi_state_lock);
+	uint32_t attr = vdi_attr_get(vid), object_size;
 
-	if (!entry) {
+	if (!attr) {
 		object_size = UINT32_C(1) << sys->cinfo.block_size_shift;
 		sd_alert("object_size for %" PRIx32 " not found, set %" PRIu32,
 			 vid, object_size);
 		return object_size;
 	}
 
-	object_size = UINT32_C(1) << entry->block_size_shift;
+	object_size = UINT32_C(1) << VDI_ATTR_BSS(attr);
 	return object_size;
 }
 
 uint8_t get_vdi_block_size_shift(uint32_t vid)
 {
-	struct vdi_state_entry *entry;
-
-	sd_read_lock(&vdi_state_lock);
-	entry = vdi_state_search(&vdi_state_root, vid);
-	sd_rw_unlock(&vdi_state_lock);
+	uint32_t attr = vdi_attr_get(vid);
 
-	if (!entry) {
+	if (!attr) {
 		sd_alert("block_size_shift for %" PRIx32
 			 " not found, set %" PRIu8, vid,
 			 sys->cinfo.block_size_shift);
 		return sys->cinfo.block_size_shift;
 	}
 
-	return entry->block_size_shift;
+	return VDI_ATTR_BSS(attr);
+}
+
+uint8_t get_vdi_flags(uint32_t vid)
+{
+	uint32_t attr = vdi_attr_get(vid);
+
+	return (attr & VDI_ATTR_COMPRESS ? SD_INODE_COMPRESS : 0) |
+		VDI_ATTR_QUORUM(attr) << SD_INODE_QUORUM_SHIFT;
+}
+
+/* The number of replicas a data write waits for, 0 for all of them */
+int get_vdi_write_quorum(uint32_t vid)
+{
+	return VDI_ATTR_QUORUM(vdi_attr_get(vid));
+}
+
+/* The vid which the vdi was snapshotted or cloned from, 0 for none */
+uint32_t get_vdi_parent(uint32_t vid)
+{
+	struct vdi_state_entry *entry;
+	uint32_t parent = 0;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (entry)
+		parent = entry->parent_vid;
+	sd_rw_unlock(&vdi_state_lock);
+
+	return parent;
+}
+
+/*
+ * The objects of a vdi whose state is unknown yet are treated as possibly
+ * compressed, so that they are looked at before being read raw.
+ */
+bool vdi_is_compressed(uint32_t vid)
+{
+	uint32_t attr = vdi_attr_get(vid);
+
+	return !attr || (attr & VDI_ATTR_COMPRESS);
 }
 
 int get_obj_copy_number(uint64_t oid, int nr_zones)
@@ -331,7 +465,7 @@ int get_req_copy_number(struct request *req)
 
 static int do_add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
 			    uint8_t cp, uint8_t block_size_shift,
-			    uint32_t parent_vid, bool unordered)
+			    uint32_t parent_vid, uint8_t flags, bool unordered)
 {
 	struct vdi_state_entry *entry, *old;
 	bool already_exists = false;
@@ -343,6 +477,7 @@ static int do_add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
 	entry->copy_policy = cp;
 	entry->block_size_shift = block_size_shift;
 	entry->parent_vid = parent_vid;
+	entry->flags = flags;
 
 	entry->lock_state = LOCK_STATE_UNLOCKED;
 	memset(&entry->owner, 0, sizeof(struct node_id));
@@ -370,6 +505,7 @@ static int do_add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
 		entry->snapshot = snapshot;
 		entry->copy_policy = cp;
 		entry->block_size_shift = block_size_shift;
+		entry->flags = flags;
 
 		if (parent_vid) {
 			if (!snapshot)
@@ -387,23 +523,27 @@ static int do_add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
 	if (sys->cinfo.flags & SD_CLUSTER_FLAG_RECYCLE_VID && !already_exists)
 		update_vdi_family(parent_vid, entry, unordered);
 
+	vdi_attr_update(entry);
+	vdi_state_touch(entry);
 	sd_rw_unlock(&vdi_state_lock);
 
 	return SD_RES_SUCCESS;
 }
 
 int add_vdi_state(uint32_t vid, int nr_copies, bool snapshot,
-		  uint8_t cp, uint8_t block_size_shift, uint32_t parent_vid)
+		  uint8_t cp, uint8_t block_size_shift, uint32_t parent_vid,
+		  uint8_t flags)
 {
 	return do_add_vdi_state(vid, nr_copies, snapshot, cp, block_size_shift,
-				parent_vid, false);
+				parent_vid, flags, false);
 }
 
 int add_vdi_state_unordered(uint32_t vid, int nr_copies, bool snapshot,
-		  uint8_t cp, uint8_t block_size_shift, uint32_t parent_vid)
+		  uint8_t cp, uint8_t block_size_shift, uint32_t parent_vid,
+		  uint8_t flags)
 {
 	return do_add_vdi_state(vid, nr_copies, snapshot, cp, block_size_shift,
-				parent_vid, true);
+				parent_vid, flags, true);
 }
 
 int fill_vdi_state_list(const struct sd_req *hdr,
@@ -427,6 +567,7 @@ int fill_vdi_state_list(const struct sd_req *hdr,
 		vs[last].deleted = entry->deleted;
 		vs[last].copy_policy = entry->copy_policy;
 		vs[last].block_size_shift = entry->block_size_shift;
+		vs[last].flags = entry->flags;
 		vs[last].lock_state = entry->lock_state;
 		vs[last].lock_owner = entry->owner;
 		vs[last].nr_participants = entry->nr_participants;
@@ -452,42 +593,148 @@ int fill_vdi_state_list(const struct sd_req *hdr,
 	return SD_RES_SUCCESS;
 }
 
-static struct vdi_state *fill_vdi_state_list_with_alloc(int *result_nr)
+static void fill_vdi_state_compact(const struct vdi_state_entry *entry,
+				   struct vdi_state_compact *vs)
 {
-	struct vdi_state *vs;
+	memset(vs, 0, sizeof(*vs));
+	vs->vid = entry->vid;
+	vs->nr_copies = entry->nr_copies;
+	vs->snapshot = entry->snapshot;
+	vs->deleted = entry->deleted;
+	vs->copy_policy = entry->copy_policy;
+	vs->block_size_shift = entry->block_size_shift;
+	vs->flags = entry->flags;
+	vs->parent_vid = entry->parent_vid;
+}
+
+/* Fill vs with the state of vid, returns false if it's unknown */
+bool get_vdi_state_compact(uint32_t vid, struct vdi_state_compact *vs)
+{
+	struct vdi_state_entry *entry;
+
+	sd_read_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (entry)
+		fill_vdi_state_compact(entry, vs);
+	sd_rw_unlock(&vdi_state_lock);
+
+	return entry != NULL;
+}
+
+/*
+ * Reply the vdi states changed since the version the requester has synced, or
+ * all of them if the changes are not known
+ */
+main_fn int get_vdi_state_delta(const struct sd_req *hdr, struct sd_rsp *rsp,
+				void *data)
+{
+	struct vdi_state_compact *vs = data;
 	struct vdi_state_entry *entry;
-	int i = 0, nr = 0;
+	uint64_t since = hdr->vdi_state_delta.version;
+	size_t nr = 0, len = hdr->data_length / sizeof(*vs);
+	int ret = SD_RES_SUCCESS;
 
 	sd_read_lock(&vdi_state_lock);
+	rsp->vdi_state_delta.generation = vdi_state_generation;
+	rsp->vdi_state_delta.version = vdi_state_version;
+	if (hdr->vdi_state_delta.generation != vdi_state_generation ||
+	    since > vdi_state_version)
+		since = 0;
+	rsp->vdi_state_delta.full = since == 0;
+
 	rb_for_each_entry(entry, &vdi_state_root, node) {
-		nr++;
+		if (entry->version <= since)
+			continue;
+
+		if (nr == len) {
+			ret = SD_RES_BUFFER_SMALL;
+			break;
+		}
+		fill_vdi_state_compact(entry, &vs[nr++]);
 	}
+	sd_rw_unlock(&vdi_state_lock);
+
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	rsp->data_length = nr * sizeof(*vs);
+	sd_debug("%zu vdi states changed since %"PRIu64, nr, since);
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Reply the summaries of the live vdis from hdr->summary.start on, as many as
+ * fit, with the object counts if hdr->summary.usage is set.  The vids come
+ * from the vdi states and the headers from the inodes, so a listing costs the
+ * client one round trip per page instead of one per vdi.
+ */
+int get_inode_summaries(const struct sd_req *hdr, struct sd_rsp *rsp,
+			void *data)
+{
+	struct sd_inode_summary *s = data;
+	struct vdi_state_entry *entry;
+	struct sd_inode *inode;
+	size_t nr_vids = 0, nr = 0, len = hdr->data_length / sizeof(*s);
+	uint32_t *vids, next = SD_NR_VDIS;
+	int ret;
+
+	if (!len)
+		return SD_RES_BUFFER_SMALL;
 
-	vs = xcalloc(nr, sizeof(*vs));
+	vids = xmalloc(sizeof(*vids) * len);
+	sd_read_lock(&vdi_state_lock);
 	rb_for_each_entry(entry, &vdi_state_root, node) {
-		vs[i].vid = entry->vid;
-		vs[i].nr_copies = entry->nr_copies;
-		vs[i].snapshot = entry->snapshot;
-		vs[i].deleted = entry->deleted;
-		vs[i].copy_policy = entry->copy_policy;
-		vs[i].block_size_shift = entry->block_size_shift;
-		vs[i].lock_state = entry->lock_state;
-		vs[i].lock_owner = entry->owner;
-		vs[i].nr_participants = entry->nr_participants;
-		for (int j = 0; j < vs[i].nr_participants; j++) {
-			vs[i].participants_state[j] =
-				entry->participants_state[j];
-			vs[i].participants[j] = entry->participants[j];
+		if (entry->vid < hdr->summary.start || entry->deleted ||
+		    test_bit(entry->vid, sys->vdi_deleted))
+			continue;
+		if (nr_vids == len) {
+			next = entry->vid;
+			break;
 		}
+		vids[nr_vids++] = entry->vid;
+	}
+	sd_rw_unlock(&vdi_state_lock);
 
-		sd_assert(i < nr);
-		i++;
+	/* for B-tree inode, we also need sd_index_header */
+	inode = xvalloc(hdr->summary.usage ? sizeof(*inode) :
+			SD_INODE_HEADER_SIZE + sizeof(struct sd_index_header));
+	for (size_t i = 0; i < nr_vids; i++) {
+		uint64_t oid = vid_to_vdi_oid(vids[i]);
+		uint32_t rlen;
+
+		ret = sd_read_object(oid, (char *)inode, SD_INODE_HEADER_SIZE +
+				     sizeof(struct sd_index_header), 0);
+		if (ret != SD_RES_SUCCESS) {
+			sd_err("failed to read inode of %"PRIx32", %s", vids[i],
+			       sd_strerror(ret));
+			continue;
+		}
+		sd_inode_summarize(inode, s + nr);
+
+		if (hdr->summary.usage) {
+			rlen = sd_inode_get_meta_size(inode, SD_INODE_SIZE);
+			ret = sd_read_object(oid, (char *)inode +
+					     SD_INODE_HEADER_SIZE, rlen,
+					     SD_INODE_HEADER_SIZE);
+			if (ret == SD_RES_SUCCESS)
+				sd_inode_stat(inode, &s[nr].my_objs,
+					      &s[nr].cow_objs);
+			else
+				sd_err("failed to read inode of %"PRIx32", %s",
+				       vids[i], sd_strerror(ret));
+		}
+		nr++;
 	}
+	free(inode);
+	free(vids);
 
-	sd_rw_unlock(&vdi_state_lock);
+	rsp->data_length = nr * sizeof(*s);
+	rsp->summary.next = next;
+	sd_debug("%zu vdis from %"PRIx32", next %"PRIx32, nr,
+		 hdr->summary.start, next);
 
-	*result_nr = nr;
-	return vs;
+	return SD_RES_SUCCESS;
 }
 
 static inline bool vdi_is_deleted(struct sd_inode *inode)
@@ -870,10 +1117,88 @@ void play_logged_vdi_ops(void)
 	}
 }
 
+/*
+ * Inode coherence of shared VDIs (iSCSI multipath) is kept with time bounded
+ * read leases instead of cluster-wide notifications.  Every participant
+ * tracks its own lease and its view of the other participants:
+ *
+ *  - A node can use its cached inode while its lease is valid and it isn't
+ *    invalidated.  After a refresh it takes a new lease and tells the other
+ *    participants, so that a writer knows it has to invalidate it again.
+ *
+ *  - A writer invalidates only the participants that may hold a lease.  It
+ *    keeps the ownership (MODIFIED) without any message until its own lease
+ *    expires.  If a holder can't be reached, the writer waits out the lease
+ *    of the holder instead.
+ */
+#define INODE_LEASE_PERIOD (5ULL * 1000000000) /* ns */
+
+static int own_participant(const struct vdi_state_entry *entry)
+{
+	for (int i = 0; i < entry->nr_participants; i++)
+		if (!node_id_cmp(&entry->participants[i], &sys->this_node.nid))
+			return i;
+
+	return -1;
+}
+
+static bool lease_is_valid(const struct vdi_state_entry *entry)
+{
+	return clock_get_monotonic() < entry->lease_expire;
+}
+
+static void wait_out_lease(uint64_t start)
+{
+	uint64_t now;
+
+	while ((now = clock_get_monotonic()) < start + INODE_LEASE_PERIOD)
+		usleep((start + INODE_LEASE_PERIOD - now) / 1000);
+}
+
+static int send_inode_coherence(const struct node_id *nid, uint32_t vid,
+				bool validate)
+{
+	struct sd_req hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_INODE_COHERENCE);
+	hdr.inode_coherence.vid = vid;
+	hdr.inode_coherence.validate = validate ? 1 : 0;
+	memcpy(hdr.inode_coherence.addr, sys->this_node.nid.addr,
+	       sizeof(hdr.inode_coherence.addr));
+	hdr.inode_coherence.port = sys->this_node.nid.port;
+
+	ret = sheep_exec_req(nid, &hdr, NULL);
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to %s VID: %"PRIx32" on %s, %s",
+		       validate ? "validate" : "invalidate", vid,
+		       node_id_to_str(nid), sd_strerror(ret));
+
+	return ret;
+}
+
+/*
+ * Send the coherence message to the participants and return false if some of
+ * them couldn't be reached
+ */
+static bool notify_participants(const struct node_id *peers, int nr,
+				uint32_t vid, bool validate)
+{
+	bool ok = true;
+
+	for (int i = 0; i < nr; i++)
+		if (send_inode_coherence(&peers[i], vid, validate) !=
+		    SD_RES_SUCCESS)
+			ok = false;
+
+	return ok;
+}
+
 worker_fn bool is_refresh_required(uint32_t vid)
 {
 	struct vdi_state_entry *entry;
 	bool ret = false;
+	int me;
 
 	sd_read_lock(&vdi_state_lock);
 	entry = vdi_state_search(&vdi_state_root, vid);
@@ -886,18 +1211,17 @@ worker_fn bool is_refresh_required(uint32_t vid)
 	if (entry->lock_state != LOCK_STATE_SHARED)
 		goto out;
 
-	for (int i = 0; i < entry->nr_participants; i++) {
-		if (node_id_cmp(&entry->participants[i], &sys->this_node.nid))
-			continue;
-
-		if (entry->participants_state[i] ==
-		    SHARED_LOCK_STATE_INVALIDATED)
-			ret = true;
+	me = own_participant(entry);
+	if (me < 0) {
+		sd_alert("this node isn't locking VID: %"PRIx32, vid);
 		goto out;
 	}
 
-	sd_alert("this node isn't locking VID: %"PRIx32, vid);
-
+	if (entry->participants_state[me] == SHARED_LOCK_STATE_INVALIDATED)
+		ret = true;
+	else if (entry->nr_participants > 1 && !lease_is_valid(entry))
+		/* we may have missed an invalidation while the lease expired */
+		ret = true;
 out:
 	sd_rw_unlock(&vdi_state_lock);
 
@@ -907,8 +1231,10 @@ out:
 worker_fn void validate_myself(uint32_t vid)
 {
 	struct vdi_state_entry *entry;
-	struct sd_req hdr;
-	int ret;
+	struct node_id peers[SD_MAX_COPIES];
+	uint64_t start = clock_get_monotonic();
+	uint32_t gen;
+	int me, nr = 0;
 
 	sd_read_lock(&vdi_state_lock);
 	entry = vdi_state_search(&vdi_state_root, vid);
@@ -921,34 +1247,47 @@ worker_fn void validate_myself(uint32_t vid)
 	if (entry->lock_state != LOCK_STATE_SHARED)
 		goto out;
 
-	for (int i = 0; i < entry->nr_participants; i++) {
-		if (node_id_cmp(&entry->participants[i], &sys->this_node.nid))
-			continue;
-
-		if (entry->participants_state[i] !=
-		    SHARED_LOCK_STATE_INVALIDATED)
-			goto out;
-
-		goto validate;
+	me = own_participant(entry);
+	if (me < 0) {
+		sd_alert("this node isn't locking VID: %"PRIx32, vid);
+		goto out;
 	}
 
-	sd_alert("this node isn't locking VID: %"PRIx32, vid);
-	goto out;
+	if (entry->participants_state[me] != SHARED_LOCK_STATE_INVALIDATED &&
+	    (entry->nr_participants == 1 || lease_is_valid(entry)))
+		goto out;
 
-validate:
+	for (int i = 0; i < entry->nr_participants; i++)
+		if (i != me)
+			memcpy(&peers[nr++], &entry->participants[i],
+			       sizeof(peers[0]));
+	gen = entry->coherence_gen;
 	sd_rw_unlock(&vdi_state_lock);
 
-	sd_init_req(&hdr, SD_OP_INODE_COHERENCE);
-	hdr.inode_coherence.vid = vid;
-	hdr.inode_coherence.validate = 1;
-	ret = sheep_exec_req(&sys->this_node.nid, &hdr, NULL);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to validate VID: %"PRIx32" by %s",
-		       vid, node_id_to_str(&sys->this_node.nid));
+	/*
+	 * A writer which doesn't know about our lease can't invalidate us.  It
+	 * has to renew its own lease first, so wait it out if it's unreachable.
+	 */
+	if (!notify_participants(peers, nr, vid, true)) {
+		wait_out_lease(start);
+		start = clock_get_monotonic();
 	}
 
-	return;
+	sd_write_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (!entry || entry->lock_state != LOCK_STATE_SHARED)
+		goto out;
+
+	me = own_participant(entry);
+	if (me < 0 || entry->coherence_gen != gen) {
+		sd_debug("VID: %"PRIx32" is invalidated during validation", vid);
+		goto out;
+	}
 
+	/* we don't know who holds a lease any more */
+	for (int i = 0; i < entry->nr_participants; i++)
+		entry->participants_state[i] = SHARED_LOCK_STATE_SHARED;
+	entry->lease_expire = start + INODE_LEASE_PERIOD;
 out:
 	sd_rw_unlock(&vdi_state_lock);
 }
@@ -956,8 +1295,10 @@ out:
 worker_fn void invalidate_other_nodes(uint32_t vid)
 {
 	struct vdi_state_entry *entry;
-	struct sd_req hdr;
-	int ret;
+	struct node_id peers[SD_MAX_COPIES];
+	uint64_t start = clock_get_monotonic();
+	uint32_t gen;
+	int me, nr = 0;
 
 	sd_read_lock(&vdi_state_lock);
 	entry = vdi_state_search(&vdi_state_root, vid);
@@ -970,35 +1311,45 @@ worker_fn void invalidate_other_nodes(uint32_t vid)
 	if (entry->lock_state != LOCK_STATE_SHARED)
 		goto out;
 
-	for (int i = 0; i < entry->nr_participants; i++) {
-		if (node_id_cmp(&entry->participants[i], &sys->this_node.nid))
-			continue;
-
-		if (entry->participants_state[i] !=
-		    SHARED_LOCK_STATE_MODIFIED)
-			goto invalidate;
-
-		/* already owned by myself */
+	me = own_participant(entry);
+	if (me < 0) {
+		sd_alert("this node isn't locking VID: %"PRIx32, vid);
 		goto out;
 	}
 
-	sd_alert("this node isn't locking VID: %"PRIx32, vid);
-	goto out;
+	/* already owned by myself */
+	if (entry->participants_state[me] == SHARED_LOCK_STATE_MODIFIED &&
+	    (entry->nr_participants == 1 || lease_is_valid(entry)))
+		goto out;
 
-invalidate:
+	/* only the participants which may hold a lease */
+	for (int i = 0; i < entry->nr_participants; i++)
+		if (i != me && entry->participants_state[i] !=
+		    SHARED_LOCK_STATE_INVALIDATED)
+			memcpy(&peers[nr++], &entry->participants[i],
+			       sizeof(peers[0]));
+	gen = entry->coherence_gen;
 	sd_rw_unlock(&vdi_state_lock);
 
-	sd_init_req(&hdr, SD_OP_INODE_COHERENCE);
-	hdr.inode_coherence.vid = vid;
-	hdr.inode_coherence.validate = 0;
-	ret = sheep_exec_req(&sys->this_node.nid, &hdr, NULL);
-	if (ret != SD_RES_SUCCESS) {
-		sd_err("failed to validate VID: %"PRIx32" by %s",
-		       vid, node_id_to_str(&sys->this_node.nid));
-	}
+	if (!notify_participants(peers, nr, vid, false))
+		wait_out_lease(clock_get_monotonic());
+
+	sd_write_lock(&vdi_state_lock);
+	entry = vdi_state_search(&vdi_state_root, vid);
+	if (!entry || entry->lock_state != LOCK_STATE_SHARED)
+		goto out;
 
-	return;
+	me = own_participant(entry);
+	if (me < 0 || entry->coherence_gen != gen) {
+		sd_debug("VID: %"PRIx32" is invalidated by another writer", vid);
+		goto out;
+	}
 
+	for (int i = 0; i < entry->nr_participants; i++)
+		entry->participants_state[i] = i == me ?
+			SHARED_LOCK_STATE_MODIFIED :
+			SHARED_LOCK_STATE_INVALIDATED;
+	entry->lease_expire = start + INODE_LEASE_PERIOD;
 out:
 	sd_rw_unlock(&vdi_state_lock);
 }
@@ -1007,8 +1358,7 @@ main_fn int inode_coherence_update(uint32_t vid, bool validate,
 				   const struct node_id *sender)
 {
 	struct vdi_state_entry *entry;
-	bool invalidated = false;
-	int ret = SD_RES_SUCCESS;
+	int ret = SD_RES_SUCCESS, me, idx = -1;
 
 	sd_write_lock(&vdi_state_lock);
 	entry = vdi_state_search(&vdi_state_root, vid);
@@ -1019,40 +1369,43 @@ main_fn int inode_coherence_update(uint32_t vid, bool validate,
 		goto out;
 	}
 
-	sd_assert(entry->lock_state == LOCK_STATE_SHARED);
+	if (entry->lock_state != LOCK_STATE_SHARED) {
+		ret = SD_RES_NO_VDI;
+		goto out;
+	}
 
-	if (validate) {
-		for (int i = 0; i < entry->nr_participants; i++) {
-			if (node_id_cmp(&entry->participants[i], sender)
-			    && entry->participants_state[i] ==
-			    SHARED_LOCK_STATE_INVALIDATED)
-				/*
-				 * don't validate other invalidated, they need
-				 * to validate by themselves
-				 */
-				continue;
+	for (int i = 0; i < entry->nr_participants; i++)
+		if (!node_id_cmp(&entry->participants[i], sender))
+			idx = i;
+	me = own_participant(entry);
 
-			entry->participants_state[i] = SHARED_LOCK_STATE_SHARED;
-		}
-	} else {
-		for (int i = 0; i < entry->nr_participants; i++) {
-			if (node_id_cmp(&entry->participants[i], sender))
-				entry->participants_state[i] =
-					SHARED_LOCK_STATE_INVALIDATED;
-			else {
-				entry->participants_state[i] =
-					SHARED_LOCK_STATE_MODIFIED;
-				invalidated = true;
-			}
-		}
+	if (idx < 0 || me < 0) {
+		sd_err("%s isn't participating in VID: %"PRIx32,
+		       node_id_to_str(idx < 0 ? sender : &sys->this_node.nid),
+		       vid);
+		ret = SD_RES_NO_VDI;
+		goto out;
+	}
 
-		if (!invalidated) {
-			sd_err("%s isn't participating in VID: %"PRIx32,
-			       node_id_to_str(sender), vid);
-			ret = SD_RES_NO_VDI;
-		}
+	if (validate) {
+		/* the sender holds a lease, invalidate it on our next write */
+		entry->participants_state[idx] = SHARED_LOCK_STATE_SHARED;
+		if (entry->participants_state[me] == SHARED_LOCK_STATE_MODIFIED)
+			entry->participants_state[me] =
+				SHARED_LOCK_STATE_SHARED;
+		goto out;
 	}
 
+	/* the B-tree of a shared hypervolume may have been updated elsewhere */
+	sd_inode_invalidate_cache(vid);
+
+	for (int i = 0; i < entry->nr_participants; i++)
+		if (entry->participants_state[i] == SHARED_LOCK_STATE_MODIFIED)
+			entry->participants_state[i] = SHARED_LOCK_STATE_SHARED;
+	entry->participants_state[idx] = SHARED_LOCK_STATE_MODIFIED;
+	entry->participants_state[me] = SHARED_LOCK_STATE_INVALIDATED;
+	entry->lease_expire = 0;
+	entry->coherence_gen++;
 out:
 	sd_rw_unlock(&vdi_state_lock);
 	return ret;
@@ -1088,6 +1441,7 @@ static struct sd_inode *alloc_inode(const struct vdi_iocb *iocb,
 	new->block_size_shift = find_next_bit(&block_size, BITS_PER_LONG, 0);
 	new->snap_id = new_snapid;
 	new->parent_vdi_id = iocb->base_vid;
+	new->flags = iocb->flags;
 	if (data_vdi_id)
 		sd_inode_copy_vdis(sheep_bnode_writer, sheep_bnode_reader,
 				   data_vdi_id, iocb->store_policy,
@@ -1481,10 +1835,100 @@ static int fill_vdi_info(unsigned long left, unsigned long right,
 	return ret;
 }
 
+/*
+ * Name to vid cache of the working vdis, so that vdi_lookup() doesn't read
+ * the inodes along the hash chain on every open.  The entries are dropped by
+ * the creation and the deletion of the vdis, which every node processes in
+ * the same order.
+ */
+struct vdi_lookup_entry {
+	struct rb_node node;
+	char name[SD_MAX_VDI_LEN];
+	uint32_t vid;
+	uint32_t snapid;
+	uint64_t create_time;
+};
+
+static struct rb_root vdi_lookup_root = RB_ROOT;
+static struct sd_rw_lock vdi_lookup_lock = SD_RW_LOCK_INITIALIZER;
+static uint64_t vdi_lookup_gen;	/* bumped whenever entries are dropped */
+
+static int vdi_lookup_cmp(const struct vdi_lookup_entry *a,
+			  const struct vdi_lookup_entry *b)
+{
+	return strncmp(a->name, b->name, sizeof(a->name));
+}
+
+static bool vdi_lookup_cache_get(const char *name, struct vdi_info *info,
+				 uint64_t *gen)
+{
+	struct vdi_lookup_entry key = {}, *entry;
+
+	pstrcpy(key.name, sizeof(key.name), name);
+
+	sd_read_lock(&vdi_lookup_lock);
+	entry = rb_search(&vdi_lookup_root, &key, node, vdi_lookup_cmp);
+	if (entry) {
+		info->vid = entry->vid;
+		info->snapid = entry->snapid;
+		info->create_time = entry->create_time;
+	}
+	*gen = vdi_lookup_gen;
+	sd_rw_unlock(&vdi_lookup_lock);
+
+	return entry != NULL;
+}
+
+static void vdi_lookup_cache_put(const char *name,
+				 const struct vdi_info *info, uint64_t gen)
+{
+	struct vdi_lookup_entry *entry;
+
+	entry = xzalloc(sizeof(*entry));
+	pstrcpy(entry->name, sizeof(entry->name), name);
+	entry->vid = info->vid;
+	entry->snapid = info->snapid;
+	entry->create_time = info->create_time;
+
+	sd_write_lock(&vdi_lookup_lock);
+	/* the vdi was created or deleted while we were reading the inodes */
+	if (gen != vdi_lookup_gen ||
+	    rb_insert(&vdi_lookup_root, entry, node, vdi_lookup_cmp))
+		free(entry);
+	sd_rw_unlock(&vdi_lookup_lock);
+}
+
+void vdi_lookup_cache_drop(const char *name)
+{
+	struct vdi_lookup_entry key = {}, *entry;
+
+	pstrcpy(key.name, sizeof(key.name), name);
+
+	sd_write_lock(&vdi_lookup_lock);
+	vdi_lookup_gen++;
+	entry = rb_search(&vdi_lookup_root, &key, node, vdi_lookup_cmp);
+	if (entry) {
+		rb_erase(&entry->node, &vdi_lookup_root);
+		free(entry);
+	}
+	sd_rw_unlock(&vdi_lookup_lock);
+}
+
+main_fn void vdi_lookup_cache_clear(void)
+{
+	sd_write_lock(&vdi_lookup_lock);
+	vdi_lookup_gen++;
+	rb_destroy(&vdi_lookup_root, struct vdi_lookup_entry, node);
+	sd_rw_unlock(&vdi_lookup_lock);
+}
+
 /* Return SUCCESS if we find targeted VDI specified by iocb and fill info */
 int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
 {
 	unsigned long left, right;
+	/* only the working vdis are cached */
+	bool cacheable = !vdi_has_tag(iocb);
+	uint64_t gen = 0;
 	int ret;
 
 	if (!(sys->cinfo.flags & SD_CLUSTER_FLAG_RECYCLE_VID)) {
@@ -1499,7 +1943,13 @@ int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
 		case SD_RES_SUCCESS:
 			break;
 		}
-		return fill_vdi_info(left, right, iocb, info);
+		if (cacheable && vdi_lookup_cache_get(iocb->name, info, &gen))
+			return SD_RES_SUCCESS;
+
+		ret = fill_vdi_info(left, right, iocb, info);
+		if (cacheable && ret == SD_RES_SUCCESS)
+			vdi_lookup_cache_put(iocb->name, info, gen);
+		return ret;
 	} else {
 		/*
 		 * Why is the below heavy fill_vdi_info_range() required?
@@ -1554,7 +2004,12 @@ int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
 
 		info->free_bit = find_next_zero_bit(sys->vdi_inuse,
 						    SD_NR_VDIS, 1);
+		if (cacheable && vdi_lookup_cache_get(iocb->name, info, &gen))
+			return SD_RES_SUCCESS;
+
 		ret = fill_vdi_info_range(1, SD_NR_VDIS, iocb, info);
+		if (cacheable && ret == SD_RES_SUCCESS)
+			vdi_lookup_cache_put(iocb->name, info, gen);
 		if (ret == SD_RES_NO_VDI && info->vid != 0) {
 			/*
 			 * handle a case like below:
@@ -1577,7 +2032,8 @@ int vdi_lookup(const struct vdi_iocb *iocb, struct vdi_info *info)
 }
 
 static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid,
-			  uint8_t copy_policy, uint8_t block_size_shift)
+			  uint8_t copy_policy, uint8_t block_size_shift,
+			  uint32_t flags)
 {
 	int ret;
 	struct sd_req hdr;
@@ -1589,6 +2045,7 @@ static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies, uint32_t old_vid,
 	hdr.vdi_state.set_bitmap = false;
 	hdr.vdi_state.copy_policy = copy_policy;
 	hdr.vdi_state.block_size_shift = block_size_shift;
+	hdr.vdi_state.flags = flags;
 
 	ret = exec_local_req(&hdr, NULL);
 	if (ret != SD_RES_SUCCESS)
@@ -1632,7 +2089,8 @@ int vdi_create(const struct vdi_iocb *iocb, uint32_t *new_vid)
 	*new_vid = info.free_bit;
 	ret = notify_vdi_add(*new_vid, iocb->nr_copies,
 			     iocb->base_vid == 0 ? info.vid : iocb->base_vid,
-			     iocb->copy_policy, iocb->block_size_shift);
+			     iocb->copy_policy, iocb->block_size_shift,
+			     iocb->flags);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -1670,7 +2128,8 @@ int vdi_snapshot(const struct vdi_iocb *iocb, uint32_t *new_vid)
 	sd_assert(info.snapid > 0);
 	*new_vid = info.free_bit;
 	ret = notify_vdi_add(*new_vid, iocb->nr_copies, info.vid,
-			     iocb->copy_policy, iocb->block_size_shift);
+			     iocb->copy_policy, iocb->block_size_shift,
+			     iocb->flags);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -1730,30 +2189,170 @@ static int notify_vdi_deletion(uint32_t vdi_id)
 
 struct delete_arg {
 	const struct sd_inode *inode;
-	uint32_t *nr_deleted;
+	uint32_t start;		/* the first index to delete */
+	uint64_t *oids;
+	uint32_t nr_oids;
+	uint32_t max_oids;
 };
 
 static void delete_cb(struct sd_index *idx, void *arg, int ignore)
 {
 	struct delete_arg *darg = (struct delete_arg *)arg;
 	uint64_t oid;
-	int ret;
 
-	if (idx->vdi_id) {
+	if (idx->vdi_id && idx->idx >= darg->start) {
 		oid = vid_to_data_oid(idx->vdi_id, idx->idx);
 		if (idx->vdi_id != darg->inode->vdi_id)
 			sd_debug("object %016" PRIx64 " is base's data, would"
 				 " not be deleted.", oid);
 		else {
-			ret = sd_remove_object(oid);
-			if (ret != SD_RES_SUCCESS)
-				sd_err("remove object %016" PRIx64 " fail, %d",
-				       oid, ret);
-			(*(darg->nr_deleted))++;
+			if (darg->nr_oids == darg->max_oids) {
+				darg->max_oids = darg->max_oids * 2 ?: 1024;
+				darg->oids = xrealloc(darg->oids,
+						      sizeof(*darg->oids) *
+						      darg->max_oids);
+			}
+			darg->oids[darg->nr_oids++] = oid;
 		}
 	}
 }
 
+/*
+ * Removal of the data objects of a hypervolume
+ *
+ * The objects are removed in rounds of DELETE_ROUND_OBJS by DELETE_INFLIGHT
+ * threads, each of them sending SD_OP_REMOVE_OBJS with SD_MAX_OBJ_VEC oids
+ * at a time, which the gateway fans out to the nodes in one request per node.
+ * After each round the next index to delete is saved in deletion_path, so
+ * that deleting the vdi again after a restart resumes from there.  The
+ * objects of a failed batch are removed one by one, and the progress stops
+ * being saved after a failure not to skip them on the next try.
+ */
+#define DELETE_ROUND_OBJS (SD_MAX_OBJ_VEC * 256)
+#define DELETE_INFLIGHT 8
+
+struct delete_round {
+	const uint64_t *oids;
+	uint32_t nr_oids;
+	uint32_t next;		/* the next oid to send */
+	bool failed;
+};
+
+static void get_deletion_path(uint32_t vid, char *path)
+{
+	snprintf(path, PATH_MAX, "%s%08"PRIx32, deletion_path, vid);
+}
+
+static uint32_t load_deletion_progress(uint32_t vid)
+{
+	char path[PATH_MAX];
+	uint32_t start = 0;
+	int fd;
+
+	get_deletion_path(vid, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (xread(fd, &start, sizeof(start)) != sizeof(start))
+		start = 0;
+	close(fd);
+
+	if (start)
+		sd_info("resume deleting %"PRIx32" from %"PRIu32, vid, start);
+	return start;
+}
+
+static void save_deletion_progress(uint32_t vid, uint32_t start)
+{
+	char path[PATH_MAX];
+
+	get_deletion_path(vid, path);
+	if (atomic_create_and_write(path, (char *)&start, sizeof(start),
+				    true, false) < 0)
+		sd_err("failed to save the progress of deleting %"PRIx32,
+		       vid);
+}
+
+static void remove_objs_one_by_one(const uint64_t *oids, uint32_t nr,
+				   bool *failed)
+{
+	int ret;
+
+	for (uint32_t i = 0; i < nr; i++) {
+		ret = sd_remove_object(oids[i]);
+		if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ)
+			*failed = true;
+	}
+}
+
+static void *delete_round_thread(void *arg)
+{
+	struct delete_round *round = arg;
+	struct sd_obj_vec vec[SD_MAX_OBJ_VEC] = {};
+	struct sd_req hdr;
+	uint32_t start, nr;
+	int ret;
+
+	while ((start = uatomic_add_return(&round->next, SD_MAX_OBJ_VEC) -
+		SD_MAX_OBJ_VEC) < round->nr_oids) {
+		nr = min(round->nr_oids - start, (uint32_t)SD_MAX_OBJ_VEC);
+		for (uint32_t i = 0; i < nr; i++)
+			vec[i].oid = round->oids[start + i];
+
+		sd_init_req(&hdr, SD_OP_REMOVE_OBJS);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.data_length = sizeof(vec[0]) * nr;
+		hdr.vec.nr = nr;
+		ret = exec_local_req(&hdr, vec);
+		if (ret != SD_RES_SUCCESS) {
+			sd_warn("failed to remove %"PRIu32" objects, %s", nr,
+				sd_strerror(ret));
+			remove_objs_one_by_one(round->oids + start, nr,
+					       &round->failed);
+		}
+	}
+
+	return NULL;
+}
+
+static bool delete_round(const uint64_t *oids, uint32_t nr)
+{
+	struct delete_round round = { .oids = oids, .nr_oids = nr };
+	sd_thread_t threads[DELETE_INFLIGHT];
+	int nr_threads = 0;
+
+	for (int i = 0; i < DELETE_INFLIGHT; i++) {
+		if (sd_thread_create("deletion", threads + i,
+				     delete_round_thread, &round))
+			break;
+		nr_threads++;
+	}
+
+	if (!nr_threads)
+		/* no threads, do it ourselves */
+		delete_round_thread(&round);
+	for (int i = 0; i < nr_threads; i++)
+		sd_thread_join(threads[i], NULL);
+
+	return !round.failed;
+}
+
+static void delete_objects(uint32_t vid, const uint64_t *oids, uint32_t nr)
+{
+	bool failed = false;
+	uint32_t n;
+
+	for (uint32_t i = 0; i < nr; i += n) {
+		n = min(nr - i, (uint32_t)DELETE_ROUND_OBJS);
+		if (!delete_round(oids + i, n))
+			failed = true;
+		if (!failed)
+			save_deletion_progress(vid,
+					data_oid_to_idx(oids[i + n - 1]) + 1);
+	}
+}
+
 static void delete_vdi_work(struct work *work)
 {
 	struct deletion_work *dw =
@@ -1798,8 +2397,14 @@ static void delete_vdi_work(struct work *work)
 		 * todo: generational reference counting is not supported by
 		 * hypervolume yet
 		 */
-		struct delete_arg arg = {inode, &nr_deleted};
+		struct delete_arg arg = { .inode = inode };
+
+		arg.start = load_deletion_progress(vdi_id);
 		sd_inode_index_walk(inode, delete_cb, &arg);
+		delete_objects(vdi_id, arg.oids, arg.nr_oids);
+		/* a resumed deletion has deleted objects too */
+		nr_deleted = arg.nr_oids ?: !!arg.start;
+		free(arg.oids);
 	}
 
 	if (vdi_is_deleted(inode))
@@ -1810,8 +2415,14 @@ static void delete_vdi_work(struct work *work)
 	memset((char *)inode + SD_INODE_HEADER_SIZE, 0,
 	       SD_INODE_SIZE - SD_INODE_HEADER_SIZE);
 
-	sd_write_object(vid_to_vdi_oid(vdi_id), (void *)inode,
-			sizeof(*inode), 0, false);
+	ret = sd_write_object(vid_to_vdi_oid(vdi_id), (void *)inode,
+			      sizeof(*inode), 0, false);
+	if (ret == SD_RES_SUCCESS && inode->store_policy) {
+		char path[PATH_MAX];
+
+		get_deletion_path(vdi_id, path);
+		unlink(path);
+	}
 
 	if (nr_deleted)
 		notify_vdi_deletion(vdi_id);
@@ -1882,6 +2493,376 @@ out:
 	return ret;
 }
 
+/*
+ * Hydration of the lazy clones
+ *
+ * 'dog vdi clone -l' makes a clone which shares all the objects of its parent
+ * like the usual clone, and then asks the gateway to copy them.  The objects
+ * are copied one by one in the background, and each entry of the inode is
+ * switched to the copy with SD_FLAG_CMD_EXCL, which the gateway applies only
+ * if the entry still refers to the parent.  The entries which the client
+ * wrote in the meantime keep the copy-on-write of the client, and the copy
+ * itself is created exclusively, so it never overwrites the client's one.
+ *
+ * The references of the parent are dropped by the switches as usual.  The
+ * clients which still read the parent's objects through their own copies of
+ * the inode can do so until the parent is deleted, too.
+ */
+struct hydrate_work {
+	struct work work;
+	uint32_t vid;
+	/* of a conversion, see vdi_convert() */
+	bool convert;
+	uint32_t rate;
+	uint32_t start;
+};
+
+/*
+ * Conversion of a vdi to another redundancy
+ *
+ * 'dog vdi convert' snapshots the vdi and creates its new working vdi with the
+ * new copy policy, so the policy of the vdi switches at once and the clients
+ * follow it to the new vid as after any snapshot.  The gateway then hydrates
+ * the new vdi at most 'rate' MB/s and deletes the snapshot, whose objects are
+ * no longer referenced by then.  The next index to copy is saved in
+ * convert_path every CONVERT_SAVE_OBJS objects, and the conversions left by a
+ * restart of the gateway are resumed from there.  The shared size of the vdi
+ * in 'dog vdi list' shows how much is left.
+ */
+#define CONVERT_SAVE_OBJS 64
+
+struct convert_progress {
+	uint32_t rate;
+	uint32_t next;
+};
+
+static void get_convert_path(uint32_t vid, char *path)
+{
+	snprintf(path, PATH_MAX, "%s%08"PRIx32, convert_path, vid);
+}
+
+static bool load_convert_progress(uint32_t vid, struct convert_progress *p)
+{
+	char path[PATH_MAX];
+	bool ret;
+	int fd;
+
+	get_convert_path(vid, path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	ret = xread(fd, p, sizeof(*p)) == sizeof(*p);
+	close(fd);
+	return ret;
+}
+
+static void save_convert_progress(uint32_t vid, uint32_t rate, uint32_t next)
+{
+	struct convert_progress p = { .rate = rate, .next = next };
+	char path[PATH_MAX];
+
+	get_convert_path(vid, path);
+	if (atomic_create_and_write(path, (char *)&p, sizeof(p), true,
+				    false) < 0)
+		sd_err("failed to save the progress of converting %"PRIx32,
+		       vid);
+}
+
+static void drop_convert_progress(uint32_t vid)
+{
+	char path[PATH_MAX];
+
+	get_convert_path(vid, path);
+	unlink(path);
+}
+
+/* Sleep as long as copying 'bytes' since 'start' takes at 'rate' MB/s */
+static void convert_throttle(uint64_t start, uint64_t bytes, uint32_t rate)
+{
+	uint64_t due, now = clock_get_time();
+
+	if (!rate)
+		return;
+
+	due = start + bytes * 1000000000 / ((uint64_t)rate << 20);
+	if (due > now)
+		usleep((due - now) / 1000);
+}
+
+/*
+ * Delete the snapshot 'vid' which a conversion left, the gateway drops the
+ * references of its objects when its entries are cleared
+ */
+static int convert_drop_snapshot(uint32_t vid)
+{
+	struct sd_inode *inode = xvalloc(sizeof(*inode));
+	char data[SD_MAX_VDI_LEN + SD_MAX_VDI_TAG_LEN] = {};
+	struct sd_req hdr;
+	uint32_t nr, n;
+	int ret;
+
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     sizeof(*inode), 0);
+	if (ret != SD_RES_SUCCESS || vdi_is_deleted(inode))
+		goto out;
+
+	if (strcmp(inode->tag, SD_CONVERT_TAG) != 0) {
+		sd_info("%"PRIx32" isn't left by a conversion, keep it", vid);
+		goto out;
+	}
+
+	nr = count_data_objs(inode);
+	for (uint32_t i = 0; i < nr; i += n) {
+		n = min(nr - i, (uint32_t)SD_MAX_OBJ_VEC);
+		memset(inode->data_vdi_id + i, 0, n * sizeof(uint32_t));
+
+		sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.data_length = n * sizeof(uint32_t);
+		hdr.obj.oid = vid_to_vdi_oid(vid);
+		hdr.obj.offset = data_vid_offset(i);
+		ret = exec_local_req(&hdr, inode->data_vdi_id + i);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	sd_init_req(&hdr, SD_OP_DEL_VDI);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(data);
+	hdr.vdi.snapid = inode->snap_id;
+	pstrcpy(data, SD_MAX_VDI_LEN, inode->name);
+	pstrcpy(data + SD_MAX_VDI_LEN, SD_MAX_VDI_TAG_LEN, inode->tag);
+	ret = exec_local_req(&hdr, data);
+out:
+	if (ret != SD_RES_SUCCESS)
+		sd_err("failed to delete %"PRIx32", %s", vid, sd_strerror(ret));
+	free(inode);
+	return ret;
+}
+
+static int hydrate_obj(uint32_t vid, uint32_t idx, char *buf, size_t len)
+{
+	uint32_t data_vid;
+	struct sd_req hdr;
+	int ret;
+
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)&data_vid,
+			     sizeof(data_vid), data_vid_offset(idx));
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	/* written by the client already */
+	if (!data_vid || data_vid == vid)
+		return SD_RES_OID_EXIST;
+
+	ret = sd_read_object(vid_to_data_oid(data_vid, idx), buf, len, 0);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_EXCL | SD_FLAG_CMD_FWD;
+	hdr.data_length = len;
+	hdr.obj.oid = vid_to_data_oid(vid, idx);
+	ret = exec_local_req(&hdr, buf);
+	/* the copy of an earlier attempt is switched now */
+	if (ret != SD_RES_SUCCESS && ret != SD_RES_OID_EXIST)
+		return ret;
+
+	sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+	hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_EXCL;
+	hdr.data_length = sizeof(vid);
+	hdr.obj.oid = vid_to_vdi_oid(vid);
+	hdr.obj.offset = data_vid_offset(idx);
+	return exec_local_req(&hdr, &vid);
+}
+
+static void hydrate_vdi_work(struct work *work)
+{
+	struct hydrate_work *hw = container_of(work, struct hydrate_work, work);
+	struct sd_inode *inode = xvalloc(sizeof(*inode));
+	uint64_t start = clock_get_time(), copied = 0;
+	int ret, nr_copied = 0, nr_failed = 0;
+	uint32_t idx, nr;
+	size_t len;
+	char *buf;
+
+	ret = sd_read_object(vid_to_vdi_oid(hw->vid), (char *)inode,
+			     sizeof(*inode), 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("failed to read the inode of %"PRIx32", %s", hw->vid,
+		       sd_strerror(ret));
+		goto out;
+	}
+
+	len = get_objsize(vid_to_data_oid(hw->vid, 0),
+			  get_vdi_object_size(hw->vid));
+	buf = xvalloc(len);
+	nr = count_data_objs(inode);
+	for (idx = hw->start; idx < nr; idx++) {
+		uint32_t data_vid = inode->data_vdi_id[idx];
+
+		if (hw->convert && idx % CONVERT_SAVE_OBJS == 0 && !nr_failed)
+			save_convert_progress(hw->vid, hw->rate, idx);
+
+		if (!data_vid || data_vid == hw->vid)
+			continue;
+
+		ret = hydrate_obj(hw->vid, idx, buf, len);
+		switch (ret) {
+		case SD_RES_SUCCESS:
+			nr_copied++;
+			copied += len;
+			if (hw->convert)
+				convert_throttle(start, copied, hw->rate);
+			break;
+		case SD_RES_OID_EXIST:
+			break;
+		case SD_RES_NO_VDI:
+		case SD_RES_READONLY:
+			/* deleted or snapshotted in the meantime */
+			sd_info("stop hydrating %"PRIx32", %s", hw->vid,
+				sd_strerror(ret));
+			goto done;
+		default:
+			sd_err("failed to hydrate %016"PRIx64", %s",
+			       vid_to_data_oid(hw->vid, idx), sd_strerror(ret));
+			nr_failed++;
+			break;
+		}
+	}
+done:
+	sd_info("%d objects of %"PRIx32" hydrated in %"PRIu64" sec, %d failed",
+		nr_copied, hw->vid, (clock_get_time() - start) / 1000000000,
+		nr_failed);
+	free(buf);
+
+	/* a failed conversion is resumed by the next restart */
+	if (hw->convert && !nr_failed) {
+		if (idx == nr &&
+		    convert_drop_snapshot(inode->parent_vdi_id) != SD_RES_SUCCESS)
+			goto out;
+		drop_convert_progress(hw->vid);
+		sd_info("conversion of %"PRIx32" %s", hw->vid,
+			idx == nr ? "done" : "stopped");
+	}
+out:
+	free(inode);
+}
+
+static void hydrate_vdi_done(struct work *work)
+{
+	struct hydrate_work *hw = container_of(work, struct hydrate_work, work);
+
+	free(hw);
+}
+
+static void queue_hydrate(uint32_t vid, bool convert, uint32_t rate,
+			  uint32_t start)
+{
+	struct hydrate_work *hw = xzalloc(sizeof(*hw));
+
+	hw->vid = vid;
+	hw->convert = convert;
+	hw->rate = rate;
+	hw->start = start;
+	hw->work.fn = hydrate_vdi_work;
+	hw->work.done = hydrate_vdi_done;
+	queue_work(sys->hydrate_wqueue, &hw->work);
+}
+
+/* the copies are created like the ones of the pre-copy, see cow.c */
+static bool can_hydrate(uint32_t vid, struct sd_inode *inode)
+{
+	return !vdi_is_deleted(inode) && !inode->snap_ctime &&
+		!inode->store_policy && cow_supported(vid_to_data_oid(vid, 0)) &&
+		!uatomic_is_true(&sys->use_journal);
+}
+
+/* Start copying the objects which the clone 'vid' shares with its parent */
+int vdi_hydrate(uint32_t vid)
+{
+	struct sd_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
+	int ret;
+
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (!can_hydrate(vid, inode)) {
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+
+	queue_hydrate(vid, false, 0, 0);
+out:
+	free(inode);
+	return ret;
+}
+
+/*
+ * Start converting the new working vdi 'vid' which 'dog vdi convert' created,
+ * or resume it with the new 'rate'
+ */
+int vdi_convert(uint32_t vid, uint32_t rate)
+{
+	struct sd_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
+	struct convert_progress p = {};
+	int ret;
+
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)inode,
+			     SD_INODE_HEADER_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (!can_hydrate(vid, inode) || !inode->parent_vdi_id ||
+	    inode->copy_policy == get_vdi_copy_policy(inode->parent_vdi_id)) {
+		ret = SD_RES_INVALID_PARMS;
+		goto out;
+	}
+
+	load_convert_progress(vid, &p);
+	save_convert_progress(vid, rate, p.next);
+	sd_info("convert %"PRIx32" from %"PRIu32", %"PRIu32" MB/s", vid,
+		p.next, rate);
+	queue_hydrate(vid, true, rate, p.next);
+out:
+	free(inode);
+	return ret;
+}
+
+/* Resume the conversions which this gateway ran before its restart */
+main_fn void vdi_convert_resume(void)
+{
+	static bool resumed;
+	struct convert_progress p;
+	struct dirent *d;
+	uint32_t vid;
+	char *end;
+	DIR *dir;
+
+	if (resumed || !convert_path)
+		return;
+	resumed = true;
+
+	dir = opendir(convert_path);
+	if (!dir)
+		return;
+
+	while ((d = readdir(dir))) {
+		vid = strtoul(d->d_name, &end, 16);
+		if (end == d->d_name || *end != '\0' ||
+		    !load_convert_progress(vid, &p))
+			continue;
+
+		sd_info("resume converting %"PRIx32" from %"PRIu32, vid,
+			p.next);
+		queue_hydrate(vid, true, p.rate, p.next);
+	}
+	closedir(dir);
+}
+
 void vdi_mark_deleted(uint32_t vid)
 {
 	struct vdi_state_entry *entry;
@@ -1894,6 +2875,7 @@ void vdi_mark_deleted(uint32_t vid)
 	}
 
 	entry->deleted = true;
+	vdi_state_touch(entry);
 out:
 	sd_rw_unlock(&vdi_state_lock);
 }
@@ -1994,6 +2976,7 @@ static void clean_family(struct vdi_family_member *member)
 	if (list_linked(&member->child_list_node))
 		list_del(&member->child_list_node);
 
+	set_vdi_family_member(member->vid, NULL);
 	if (!list_linked(&member->roots_list))
 		free(member);
 }
@@ -2005,6 +2988,8 @@ void clean_vdi_state(void)
 	sd_write_lock(&vdi_state_lock);
 	rb_destroy(&vdi_state_root, struct vdi_state_entry, node);
 	INIT_RB_ROOT(&vdi_state_root);
+	vdi_attr_clear_all();
+	vdi_state_generation = 0;
 	sd_rw_unlock(&vdi_state_lock);
 
 	sd_mutex_lock(&vdi_family_mutex);
@@ -2014,6 +2999,11 @@ void clean_vdi_state(void)
 		list_del(&member->roots_list);
 		free(member);
 	}
+	/* the index must not keep the orphans pointing to the freed entries */
+	list_for_each_entry(member, &vdi_family_temporal_orphans,
+			    child_list_node) {
+		clean_family(member);
+	}
 
 	sd_mutex_unlock(&vdi_family_mutex);
 }
@@ -2098,15 +3088,67 @@ out:
 	return ret;
 }
 
+/*
+ * The checkpoint keeps the compact states of all the vdis and the full states
+ * of the locked ones only, both sorted by vid.
+ */
 struct vdi_state_checkpoint {
-	int epoch, nr_vs;
-	struct vdi_state *vs;
+	int epoch, nr_vs, nr_locked;
+	struct vdi_state_compact *vs;
+	struct vdi_state *locked;
 
 	struct list_node list;
 };
 
 static LIST_HEAD(vdi_state_checkpoint_list);
 
+static void fill_vdi_state_checkpoint(struct vdi_state_checkpoint *checkpoint)
+{
+	struct vdi_state_entry *entry;
+	struct vdi_state *vs;
+	int nr = 0, nr_locked = 0;
+
+	sd_read_lock(&vdi_state_lock);
+	rb_for_each_entry(entry, &vdi_state_root, node) {
+		nr++;
+		if (entry->lock_state != LOCK_STATE_UNLOCKED)
+			nr_locked++;
+	}
+
+	checkpoint->vs = xcalloc(nr, sizeof(*checkpoint->vs));
+	checkpoint->locked = xcalloc(nr_locked, sizeof(*checkpoint->locked));
+	rb_for_each_entry(entry, &vdi_state_root, node) {
+		fill_vdi_state_compact(entry,
+				       &checkpoint->vs[checkpoint->nr_vs++]);
+		if (entry->lock_state == LOCK_STATE_UNLOCKED)
+			continue;
+
+		vs = &checkpoint->locked[checkpoint->nr_locked++];
+		vs->vid = entry->vid;
+		vs->lock_state = entry->lock_state;
+		vs->lock_owner = entry->owner;
+		vs->nr_participants = entry->nr_participants;
+		for (int j = 0; j < vs->nr_participants; j++) {
+			vs->participants_state[j] =
+				entry->participants_state[j];
+			vs->participants[j] = entry->participants[j];
+		}
+	}
+	sd_rw_unlock(&vdi_state_lock);
+}
+
+static int vdi_state_compact_cmp(const void *a, const void *b)
+{
+	return intcmp(((const struct vdi_state_compact *)a)->vid,
+		      ((const struct vdi_state_compact *)b)->vid);
+}
+
+static int vdi_state_locked_cmp(const void *a, const void *b)
+{
+	return intcmp(((const struct vdi_state *)a)->vid,
+		      ((const struct vdi_state *)b)->vid);
+}
+
 main_fn void create_vdi_state_checkpoint(int epoch)
 {
 	/*
@@ -2125,28 +3167,28 @@ main_fn void create_vdi_state_checkpoint(int epoch)
 
 	checkpoint = xzalloc(sizeof(*checkpoint));
 	checkpoint->epoch = epoch;
-	checkpoint->vs = fill_vdi_state_list_with_alloc(&checkpoint->nr_vs);
+	fill_vdi_state_checkpoint(checkpoint);
 	INIT_LIST_NODE(&checkpoint->list);
 	list_add_tail(&checkpoint->list, &vdi_state_checkpoint_list);
 
 	sd_debug("creating a checkpoint of vdi state at epoch %d succeed",
 		 epoch);
-	sd_debug("a number of vdi state: %d", checkpoint->nr_vs);
+	sd_debug("a number of vdi state: %d, locked: %d", checkpoint->nr_vs,
+		 checkpoint->nr_locked);
 }
 
 main_fn int get_vdi_state_checkpoint(int epoch, uint32_t vid, void *data)
 {
 	struct vdi_state_checkpoint *checkpoint;
-	struct vdi_state *vs;
+	struct vdi_state_compact ckey = { .vid = vid }, *c;
+	struct vdi_state key = { .vid = vid }, *locked, *vs = data;
 
 	list_for_each_entry(checkpoint, &vdi_state_checkpoint_list, list) {
 		if (checkpoint->epoch == epoch) {
-			for (int i = 0; i < checkpoint->nr_vs; i++) {
-				if (checkpoint->vs[i].vid == vid) {
-					vs = &checkpoint->vs[i];
-					goto found;
-				}
-			}
+			c = bsearch(&ckey, checkpoint->vs, checkpoint->nr_vs,
+				    sizeof(*c), vdi_state_compact_cmp);
+			if (c)
+				goto found;
 
 			sd_info("this node doesn't have a required entry of VID:"
 				" %"PRIx32" at epoch %d", vid, epoch);
@@ -2159,7 +3201,24 @@ main_fn int get_vdi_state_checkpoint(int epoch, uint32_t vid, void *data)
 	return SD_RES_AGAIN;
 
 found:
-	memcpy(data, vs, sizeof(*vs));
+	locked = bsearch(&key, checkpoint->locked, checkpoint->nr_locked,
+			 sizeof(*locked), vdi_state_locked_cmp);
+	if (locked)
+		memcpy(vs, locked, sizeof(*vs));
+	else
+		memset(vs, 0, sizeof(*vs));
+
+	vs->vid = c->vid;
+	vs->nr_copies = c->nr_copies;
+	vs->snapshot = c->snapshot;
+	vs->deleted = c->deleted;
+	vs->copy_policy = c->copy_policy;
+	vs->block_size_shift = c->block_size_shift;
+	vs->flags = c->flags;
+	vs->parent_vid = c->parent_vid;
+	if (!locked)
+		vs->lock_state = LOCK_STATE_UNLOCKED;
+
 	return SD_RES_SUCCESS;
 }
 
@@ -2171,6 +3230,7 @@ main_fn void free_vdi_state_checkpoint(int epoch)
 		if (checkpoint->epoch == epoch) {
 			list_del(&checkpoint->list);
 			free(checkpoint->vs);
+			free(checkpoint->locked);
 			free(checkpoint);
 
 			return;
@@ -2209,6 +3269,7 @@ static main_fn void do_vid_gc(struct vdi_family_member *member)
 	struct vdi_family_member *child;
 
 	rb_erase(&entry->node, &vdi_state_root);
+	vdi_attr_set(vid, 0);
 	free(entry);
 
 	list_for_each_entry(child, &member->child_list_head, child_list_node) {
@@ -2218,6 +3279,7 @@ static main_fn void do_vid_gc(struct vdi_family_member *member)
 	if (list_linked(&member->roots_list))
 		list_del(&member->roots_list);
 
+	set_vdi_family_member(vid, NULL);
 	free(member);
 
 	if (sd_store && sd_store->exist(oid, -1)) {
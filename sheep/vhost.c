@@ -0,0 +1,1389 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * vhost-user-blk backend
+ *
+ * "dog vhost create <vdi>" makes the sheep listen on <dir>/vhost/<vdi>.sock
+ * for a QEMU on the same host, which is started with e.g.
+ *
+ *   -object memory-backend-memfd,id=mem,size=4G,share=on
+ *   -numa node,memdev=mem
+ *   -chardev socket,id=vdi0,path=<dir>/vhost/<vdi>.sock
+ *   -device vhost-user-blk-pci,chardev=vdi0,num-queues=4
+ *
+ * QEMU shares the memory of the guest with the sheep, which reads the
+ * virtqueues of the guest directly.  A request is split at the object
+ * boundaries into gateway requests which are queued with queue_request() like
+ * the ones of a client connection, but whose data is read and written in
+ * place in the guest memory, so there is neither the socket hop nor the
+ * copies of the payload.
+ *
+ * The data vids of the vdi are kept in memory like the block driver of QEMU
+ * does.  The first write to an object of the vdi creates it, from the object
+ * of the parent if any, and then updates the inode, and the other requests to
+ * the object wait until it's done.  A write which finds the vdi snapshotted
+ * reloads the working vdi by its name and is retried on it.
+ *
+ * The messages which change the guest memory or stop a virtqueue wait until
+ * the requests being served finish, and the memory of a QEMU which went away
+ * is kept mapped until then.
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_ring.h>
+
+#include "sheep_priv.h"
+
+#define VHOST_MAX_QUEUES	8
+#define VHOST_MAX_REGIONS	8
+#define VHOST_MAX_SEGS		128	/* the descriptors of a request */
+#define VHOST_MAX_VRING_NUM	32768	/* the largest virtio queue size */
+#define VHOST_SECTOR_SHIFT	9
+#define VHOST_INODE_SIZE	offsetof(struct sd_inode, gref)
+
+enum vhost_user_request {
+	VHOST_USER_GET_FEATURES = 1,
+	VHOST_USER_SET_FEATURES = 2,
+	VHOST_USER_SET_OWNER = 3,
+	VHOST_USER_RESET_OWNER = 4,
+	VHOST_USER_SET_MEM_TABLE = 5,
+	VHOST_USER_SET_VRING_NUM = 8,
+	VHOST_USER_SET_VRING_ADDR = 9,
+	VHOST_USER_SET_VRING_BASE = 10,
+	VHOST_USER_GET_VRING_BASE = 11,
+	VHOST_USER_SET_VRING_KICK = 12,
+	VHOST_USER_SET_VRING_CALL = 13,
+	VHOST_USER_SET_VRING_ERR = 14,
+	VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+	VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+	VHOST_USER_GET_QUEUE_NUM = 17,
+	VHOST_USER_SET_VRING_ENABLE = 18,
+	VHOST_USER_GET_CONFIG = 24,
+	VHOST_USER_SET_CONFIG = 25,
+};
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_REPLY		0x4
+#define VHOST_USER_NEED_REPLY		0x8
+#define VHOST_USER_VRING_IDX_MASK	0xff
+#define VHOST_USER_VRING_NOFD		0x100
+
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+#define VHOST_USER_PROTOCOL_F_MQ	0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK	3
+#define VHOST_USER_PROTOCOL_F_CONFIG	9
+
+#define VHOST_FEATURES	((UINT64_C(1) << VIRTIO_F_VERSION_1) |		\
+			 (UINT64_C(1) << VHOST_USER_F_PROTOCOL_FEATURES) | \
+			 (UINT64_C(1) << VIRTIO_BLK_F_SEG_MAX) |	\
+			 (UINT64_C(1) << VIRTIO_BLK_F_BLK_SIZE) |	\
+			 (UINT64_C(1) << VIRTIO_BLK_F_FLUSH) |		\
+			 (UINT64_C(1) << VIRTIO_BLK_F_MQ))
+
+#define VHOST_PROTOCOL_FEATURES	((UINT64_C(1) << VHOST_USER_PROTOCOL_F_MQ) | \
+				 (UINT64_C(1) <<			\
+				  VHOST_USER_PROTOCOL_F_REPLY_ACK) |	\
+				 (UINT64_C(1) << VHOST_USER_PROTOCOL_F_CONFIG))
+
+struct vhost_user_region {
+	uint64_t guest_addr;
+	uint64_t size;
+	uint64_t user_addr;
+	uint64_t mmap_offset;
+};
+
+struct vhost_user_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+	union {
+		uint64_t u64;
+		struct {
+			uint32_t index;
+			uint32_t num;
+		} state;
+		struct {
+			uint32_t index;
+			uint32_t flags;
+			uint64_t desc_addr;
+			uint64_t used_addr;
+			uint64_t avail_addr;
+			uint64_t log_addr;
+		} addr;
+		struct {
+			uint32_t nregions;
+			uint32_t padding;
+			struct vhost_user_region regions[VHOST_MAX_REGIONS];
+		} memory;
+		struct {
+			uint32_t offset;
+			uint32_t size;
+			uint32_t flags;
+			uint8_t region[256];
+		} config;
+	} payload;
+
+	/* the file descriptors passed with the message, not on the wire */
+	int fds[VHOST_MAX_REGIONS];
+	int nr_fds;
+} __packed;
+
+#define VHOST_USER_HDR_SIZE offsetof(struct vhost_user_msg, payload)
+
+struct vhost_region {
+	uint64_t guest_addr;
+	uint64_t user_addr;
+	uint64_t size;
+	void *addr;		/* where it's mapped in the sheep */
+	void *mmap_addr;
+	size_t mmap_size;
+};
+
+struct vhost_vq {
+	struct vhost_dev *dev;
+	uint32_t num;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t last_avail_idx;
+	int kick_fd;
+	int call_fd;
+	bool enabled;
+};
+
+struct vhost_dev {
+	struct list_node list;
+	uint32_t vid;
+	char name[SD_MAX_VDI_LEN];
+	char path[PATH_MAX];
+	int listen_fd;
+	int fd;			/* the connection of QEMU, -1 if none */
+	uint32_t gen;		/* bumped on every connect and disconnect */
+	struct client_info *ci;
+
+	uint64_t features;
+	uint64_t protocol_features;
+	int nr_regions;
+	struct vhost_region regions[VHOST_MAX_REGIONS];
+	struct vhost_vq vqs[VHOST_MAX_QUEUES];
+
+	/* the header and the data vids of the vdi */
+	struct sd_inode *inode;
+	uint32_t object_size;
+
+	uint32_t nr_reqs;		/* the virtio requests being served */
+	struct list_head creates;	/* the objects being created */
+	struct list_head reload_ios;	/* the requests waiting for a reload */
+	bool reloading;
+
+	/* the message waiting for the requests to finish */
+	struct vhost_user_msg *deferred;
+
+	bool deleted;
+};
+
+/* A request of the guest */
+struct vhost_req {
+	struct vhost_vq *vq;
+	uint32_t gen;
+	uint16_t head;
+	uint32_t len;		/* the bytes written to the guest */
+	uint8_t *status;
+	int nr_pending;
+	uint8_t result;
+};
+
+enum vhost_io_stage {
+	VHOST_IO_RW,
+	VHOST_IO_CREATE,
+	VHOST_IO_UPDATE,	/* the inode update after VHOST_IO_CREATE */
+};
+
+/* A gateway request for a part of a vhost_req in one object */
+struct vhost_io {
+	struct vhost_req *vreq;
+	struct list_node list;
+	int type;		/* VIRTIO_BLK_T_IN, _OUT or _FLUSH */
+	enum vhost_io_stage stage;
+	uint64_t idx;
+	uint32_t offset;
+	uint32_t length;
+	void *buf;
+	uint32_t new_vid;	/* the data of VHOST_IO_UPDATE */
+};
+
+/* An object being created, the requests to it wait on 'ios' */
+struct vhost_create {
+	struct list_node list;
+	uint64_t idx;
+	struct list_head ios;
+};
+
+struct vhost_reload {
+	struct work work;
+	struct vhost_dev *dev;
+	struct sd_inode *inode;
+	int ret;
+};
+
+static LIST_HEAD(vhost_devs);
+static char vhost_dir[PATH_MAX];
+static struct work_queue *vhost_wqueue;
+
+/* the devices read by vhost_create() and not started yet */
+static LIST_HEAD(vhost_new_devs);
+static struct sd_mutex vhost_new_lock = SD_MUTEX_INITIALIZER;
+
+static void vhost_submit(struct vhost_dev *dev, struct vhost_io *io);
+static void vhost_msg_handler(int fd, int events, void *data);
+static void vhost_vq_process(struct vhost_vq *vq);
+
+/* The vid changes when the vdi is snapshotted, so look up by the name */
+static struct vhost_dev *vhost_find_dev(const char *name)
+{
+	struct vhost_dev *dev;
+
+	list_for_each_entry(dev, &vhost_devs, list)
+		if (!dev->deleted && !strcmp(dev->name, name))
+			return dev;
+
+	return NULL;
+}
+
+static void *gpa_to_va(struct vhost_dev *dev, uint64_t addr, uint64_t len)
+{
+	for (int i = 0; i < dev->nr_regions; i++) {
+		struct vhost_region *r = dev->regions + i;
+		uint64_t off = addr - r->guest_addr;
+
+		if (addr >= r->guest_addr && off < r->size &&
+		    len <= r->size - off)
+			return (char *)r->addr + off;
+	}
+
+	return NULL;
+}
+
+static void *uva_to_va(struct vhost_dev *dev, uint64_t addr, uint64_t len)
+{
+	for (int i = 0; i < dev->nr_regions; i++) {
+		struct vhost_region *r = dev->regions + i;
+		uint64_t off = addr - r->user_addr;
+
+		if (addr >= r->user_addr && off < r->size &&
+		    len <= r->size - off)
+			return (char *)r->addr + off;
+	}
+
+	return NULL;
+}
+
+static void vhost_unmap(struct vhost_dev *dev)
+{
+	for (int i = 0; i < dev->nr_regions; i++)
+		munmap(dev->regions[i].mmap_addr, dev->regions[i].mmap_size);
+	dev->nr_regions = 0;
+}
+
+static void close_msg_fds(struct vhost_user_msg *msg)
+{
+	for (int i = 0; i < msg->nr_fds; i++)
+		close(msg->fds[i]);
+	msg->nr_fds = 0;
+}
+
+static void vhost_reset_vq(struct vhost_dev *dev, struct vhost_vq *vq)
+{
+	memset(vq, 0, sizeof(*vq));
+	vq->dev = dev;
+	vq->kick_fd = -1;
+	vq->call_fd = -1;
+}
+
+static void vhost_stop_vq(struct vhost_vq *vq)
+{
+	if (vq->kick_fd >= 0) {
+		unregister_event(vq->kick_fd);
+		close(vq->kick_fd);
+		vq->kick_fd = -1;
+	}
+	vq->enabled = false;
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+}
+
+/* Push the request 'head' to the used ring and notify the guest */
+static void vhost_push_used(struct vhost_vq *vq, uint16_t head, uint32_t len)
+{
+	uint16_t idx = vq->used->idx;
+
+	vq->used->ring[idx % vq->num].id = head;
+	vq->used->ring[idx % vq->num].len = len;
+	cmm_smp_wmb();
+	uatomic_set(&vq->used->idx, idx + 1);
+	cmm_smp_mb();
+
+	if (vq->call_fd >= 0 &&
+	    !(uatomic_read(&vq->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT))
+		eventfd_write(vq->call_fd, 1);
+}
+
+static void vhost_free(struct vhost_dev *dev)
+{
+	sd_info("%s", dev->name);
+	list_del(&dev->list);
+	free(dev->ci);
+	free(dev->inode);
+	free(dev);
+}
+
+static void vhost_handle_msg(struct vhost_dev *dev, struct vhost_user_msg *msg);
+
+/* Called when the device has no request being served */
+static void vhost_idle(struct vhost_dev *dev)
+{
+	struct vhost_user_msg *msg = dev->deferred;
+
+	if (msg) {
+		dev->deferred = NULL;
+		vhost_handle_msg(dev, msg);
+		free(msg);
+		if (dev->fd >= 0 &&
+		    register_event(dev->fd, vhost_msg_handler, dev) < 0)
+			sd_err("failed to register %s", dev->name);
+		for (int i = 0; i < VHOST_MAX_QUEUES; i++)
+			vhost_vq_process(dev->vqs + i);
+		return;
+	}
+
+	if (dev->fd < 0) {
+		vhost_unmap(dev);
+		if (dev->deleted)
+			vhost_free(dev);
+	}
+}
+
+static void vhost_req_put(struct vhost_req *vreq)
+{
+	struct vhost_vq *vq = vreq->vq;
+	struct vhost_dev *dev = vq->dev;
+
+	if (--vreq->nr_pending > 0)
+		return;
+
+	/* the guest which sent it may have gone away */
+	if (vreq->gen == dev->gen && vq->used) {
+		if (vreq->status) {
+			*vreq->status = vreq->result;
+			vreq->len++;
+		}
+		vhost_push_used(vq, vreq->head, vreq->len);
+	}
+	free(vreq);
+
+	if (--dev->nr_reqs == 0)
+		vhost_idle(dev);
+}
+
+static struct vhost_create *vhost_find_create(struct vhost_dev *dev,
+					      uint64_t idx)
+{
+	struct vhost_create *cr;
+
+	list_for_each_entry(cr, &dev->creates, list)
+		if (cr->idx == idx)
+			return cr;
+
+	return NULL;
+}
+
+/* Resubmit the requests which waited for the creation of 'idx' */
+static void vhost_end_create(struct vhost_dev *dev, uint64_t idx)
+{
+	struct vhost_create *cr = vhost_find_create(dev, idx);
+	struct vhost_io *io;
+
+	list_del(&cr->list);
+	list_for_each_entry(io, &cr->ios, list) {
+		list_del(&io->list);
+		vhost_submit(dev, io);
+	}
+	free(cr);
+}
+
+static void vhost_reload_work(struct work *work)
+{
+	struct vhost_reload *rl = container_of(work, struct vhost_reload,
+					       work);
+	uint32_t vid;
+
+	rl->ret = sd_lookup_vdi(rl->dev->name, &vid);
+	if (rl->ret != SD_RES_SUCCESS)
+		return;
+
+	rl->inode = xvalloc(VHOST_INODE_SIZE);
+	rl->ret = sd_read_object(vid_to_vdi_oid(vid), (char *)rl->inode,
+				 VHOST_INODE_SIZE, 0);
+}
+
+static void vhost_reload_done(struct work *work)
+{
+	struct vhost_reload *rl = container_of(work, struct vhost_reload,
+					       work);
+	struct vhost_dev *dev = rl->dev;
+	struct vhost_io *io;
+	LIST_HEAD(ios);
+
+	if (rl->ret == SD_RES_SUCCESS) {
+		sd_info("%s, %"PRIx32" -> %"PRIx32, dev->name, dev->vid,
+			rl->inode->vdi_id);
+		free(dev->inode);
+		dev->inode = rl->inode;
+		dev->vid = rl->inode->vdi_id;
+	} else {
+		sd_err("failed to reload %s, %s", dev->name,
+		       sd_strerror(rl->ret));
+		free(rl->inode);
+	}
+	dev->reloading = false;
+	list_splice_init(&dev->reload_ios, &ios);
+
+	list_for_each_entry(io, &ios, list) {
+		list_del(&io->list);
+		if (rl->ret == SD_RES_SUCCESS)
+			vhost_submit(dev, io);
+		else {
+			struct vhost_req *vreq = io->vreq;
+
+			vreq->result = VIRTIO_BLK_S_IOERR;
+			free(io);
+			vhost_req_put(vreq);
+		}
+	}
+	free(rl);
+}
+
+/* The vdi was snapshotted, read the inode of the new working vdi */
+static void vhost_reload(struct vhost_dev *dev)
+{
+	struct vhost_reload *rl;
+
+	if (dev->reloading)
+		return;
+
+	dev->reloading = true;
+	rl = xzalloc(sizeof(*rl));
+	rl->dev = dev;
+	rl->work.fn = vhost_reload_work;
+	rl->work.done = vhost_reload_done;
+	queue_work(vhost_wqueue, &rl->work);
+}
+
+static void vhost_io_done(struct vhost_io *io, int ret)
+{
+	struct vhost_req *vreq = io->vreq;
+	struct vhost_dev *dev = vreq->vq->dev;
+
+	if (ret == SD_RES_READONLY && io->type == VIRTIO_BLK_T_OUT) {
+		vhost_reload(dev);
+		if (io->stage != VHOST_IO_RW)
+			vhost_end_create(dev, io->idx);
+		io->stage = VHOST_IO_RW;
+		list_add_tail(&io->list, &dev->reload_ios);
+		return;
+	}
+
+	switch (io->stage) {
+	case VHOST_IO_CREATE:
+		if (ret == SD_RES_SUCCESS) {
+			io->stage = VHOST_IO_UPDATE;
+			vhost_submit(dev, io);
+			return;
+		}
+		vhost_end_create(dev, io->idx);
+		break;
+	case VHOST_IO_UPDATE:
+		if (ret == SD_RES_SUCCESS)
+			sd_inode_set_vid(dev->inode, io->idx, io->new_vid);
+		vhost_end_create(dev, io->idx);
+		break;
+	default:
+		break;
+	}
+
+	if (ret != SD_RES_SUCCESS) {
+		sd_err("%s, %"PRIu64", %s", dev->name, io->idx,
+		       sd_strerror(ret));
+		vreq->result = VIRTIO_BLK_S_IOERR;
+	}
+	free(io);
+	vhost_req_put(vreq);
+}
+
+main_fn void vhost_request_done(struct request *req)
+{
+	struct vhost_io *io = req->vhost_io;
+	int ret = req->rp.result;
+
+	free_request(req);
+	vhost_io_done(io, ret);
+}
+
+static void vhost_queue(struct vhost_dev *dev, struct vhost_io *io,
+			const struct sd_req *hdr, void *data)
+{
+	struct request *req = alloc_request(dev->ci, 0);
+
+	if (!req) {
+		vhost_io_done(io, SD_RES_NO_MEM);
+		return;
+	}
+
+	req->rq = *hdr;
+	req->data = data;
+	req->data_length = hdr->data_length;
+	req->vhost_io = io;
+	queue_request(req);
+}
+
+static void vhost_submit(struct vhost_dev *dev, struct vhost_io *io)
+{
+	struct sd_inode *inode = dev->inode;
+	struct sd_req hdr;
+	uint32_t vid;
+
+	if (io->type == VIRTIO_BLK_T_FLUSH) {
+		sd_init_req(&hdr, SD_OP_FLUSH_VDI);
+		hdr.obj.oid = vid_to_vdi_oid(dev->vid);
+		vhost_queue(dev, io, &hdr, NULL);
+		return;
+	}
+
+	if (io->stage == VHOST_IO_UPDATE) {
+		io->new_vid = dev->vid;
+		sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+		hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_DIRECT;
+		hdr.data_length = sizeof(io->new_vid);
+		hdr.obj.oid = vid_to_vdi_oid(dev->vid);
+		hdr.obj.offset = SD_INODE_HEADER_SIZE +
+			sizeof(io->new_vid) * io->idx;
+		hdr.obj.copies = inode->nr_copies;
+		hdr.obj.copy_policy = inode->copy_policy;
+		vhost_queue(dev, io, &hdr, &io->new_vid);
+		return;
+	}
+
+	if (dev->reloading) {
+		list_add_tail(&io->list, &dev->reload_ios);
+		return;
+	}
+
+	if (vhost_find_create(dev, io->idx)) {
+		list_add_tail(&io->list,
+			      &vhost_find_create(dev, io->idx)->ios);
+		return;
+	}
+
+	vid = sd_inode_get_vid(inode, io->idx);
+	if (io->type == VIRTIO_BLK_T_IN) {
+		if (!vid) {
+			memset(io->buf, 0, io->length);
+			vhost_io_done(io, SD_RES_SUCCESS);
+			return;
+		}
+		sd_init_req(&hdr, SD_OP_READ_OBJ);
+		hdr.obj.oid = vid_to_data_oid(vid, io->idx);
+	} else if (vid == dev->vid) {
+		sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.obj.oid = vid_to_data_oid(vid, io->idx);
+	} else {
+		struct vhost_create *cr = xzalloc(sizeof(*cr));
+
+		cr->idx = io->idx;
+		INIT_LIST_HEAD(&cr->ios);
+		list_add(&cr->list, &dev->creates);
+
+		io->stage = VHOST_IO_CREATE;
+		sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		if (vid) {
+			hdr.flags |= SD_FLAG_CMD_COW;
+			hdr.obj.cow_oid = vid_to_data_oid(vid, io->idx);
+		}
+		hdr.obj.oid = vid_to_data_oid(dev->vid, io->idx);
+		hdr.obj.copies = inode->nr_copies;
+		hdr.obj.copy_policy = inode->copy_policy;
+	}
+	hdr.data_length = io->length;
+	hdr.obj.offset = io->offset;
+	vhost_queue(dev, io, &hdr, io->buf);
+}
+
+static void vhost_new_io(struct vhost_req *vreq, int type, uint64_t idx,
+			 uint32_t offset, uint32_t length, void *buf)
+{
+	struct vhost_io *io = xzalloc(sizeof(*io));
+
+	io->vreq = vreq;
+	io->type = type;
+	io->idx = idx;
+	io->offset = offset;
+	io->length = length;
+	io->buf = buf;
+
+	vreq->nr_pending++;
+	vhost_submit(vreq->vq->dev, io);
+}
+
+static void vhost_rw(struct vhost_req *vreq, int type, uint64_t sector,
+		     const struct iovec *iov, int nr_iov)
+{
+	struct vhost_dev *dev = vreq->vq->dev;
+	uint64_t size = dev->inode->vdi_size, offset, total = 0;
+
+	for (int i = 0; i < nr_iov; i++)
+		total += iov[i].iov_len;
+
+	offset = sector << VHOST_SECTOR_SHIFT;
+	if (sector > size >> VHOST_SECTOR_SHIFT || offset > size ||
+	    total > size - offset) {
+		sd_err("%s, %"PRIu64" bytes at %"PRIu64" is out of the vdi",
+		       dev->name, total, offset);
+		vreq->result = VIRTIO_BLK_S_IOERR;
+		return;
+	}
+
+	if (type == VIRTIO_BLK_T_IN)
+		vreq->len = total;
+
+	for (int i = 0; i < nr_iov; i++) {
+		char *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left) {
+			uint64_t idx = offset / dev->object_size;
+			uint32_t off = offset % dev->object_size;
+			uint32_t n = min(left, (size_t)dev->object_size - off);
+
+			vhost_new_io(vreq, type, idx, off, n, p);
+			p += n;
+			offset += n;
+			left -= n;
+		}
+	}
+}
+
+/* Take the first 'len' bytes of 'iov' into 'buf' */
+static int iov_pull(struct iovec *iov, int *nr_iov, void *buf, size_t len)
+{
+	int i = 0;
+
+	while (len) {
+		size_t n;
+
+		if (i == *nr_iov)
+			return -1;
+		n = min(len, iov[i].iov_len);
+		memcpy(buf, iov[i].iov_base, n);
+		buf = (char *)buf + n;
+		len -= n;
+		iov[i].iov_base = (char *)iov[i].iov_base + n;
+		iov[i].iov_len -= n;
+		if (!iov[i].iov_len)
+			i++;
+	}
+	*nr_iov -= i;
+	memmove(iov, iov + i, *nr_iov * sizeof(*iov));
+
+	return 0;
+}
+
+/* Map the descriptor chain starting at 'head', the indirect ones aren't used */
+static int vhost_map_desc(struct vhost_vq *vq, uint16_t head,
+			  struct iovec *iov)
+{
+	uint16_t i = head;
+	int nr = 0;
+
+	for (uint32_t count = 0; ; count++) {
+		struct vring_desc *d;
+
+		if (i >= vq->num || count >= vq->num || nr >= VHOST_MAX_SEGS)
+			return -1;
+
+		d = vq->desc + i;
+		if (d->flags & VRING_DESC_F_INDIRECT)
+			return -1;
+		iov[nr].iov_base = gpa_to_va(vq->dev, d->addr, d->len);
+		if (!iov[nr].iov_base)
+			return -1;
+		iov[nr++].iov_len = d->len;
+
+		if (!(d->flags & VRING_DESC_F_NEXT))
+			break;
+		i = d->next;
+	}
+
+	return nr;
+}
+
+static void vhost_get_id(struct vhost_req *vreq, const struct iovec *iov,
+			 int nr_iov)
+{
+	char id[VIRTIO_BLK_ID_BYTES + 1];
+	size_t len;
+
+	if (!nr_iov) {
+		vreq->result = VIRTIO_BLK_S_IOERR;
+		return;
+	}
+
+	snprintf(id, sizeof(id), "sheepdog-%"PRIx32, vreq->vq->dev->vid);
+	len = min(iov[0].iov_len, (size_t)VIRTIO_BLK_ID_BYTES);
+	strncpy(iov[0].iov_base, id, len);
+	vreq->len = len;
+}
+
+static void vhost_handle_req(struct vhost_vq *vq, uint16_t head)
+{
+	struct vhost_dev *dev = vq->dev;
+	struct iovec iov[VHOST_MAX_SEGS];
+	struct virtio_blk_outhdr hdr;
+	struct vhost_req *vreq;
+	struct iovec *last;
+	int nr_iov;
+
+	vreq = xzalloc(sizeof(*vreq));
+	vreq->vq = vq;
+	vreq->gen = dev->gen;
+	vreq->head = head;
+	vreq->nr_pending = 1;
+	vreq->result = VIRTIO_BLK_S_OK;
+	dev->nr_reqs++;
+
+	nr_iov = vhost_map_desc(vq, head, iov);
+	if (nr_iov < 0 || iov_pull(iov, &nr_iov, &hdr, sizeof(hdr)) < 0 ||
+	    !nr_iov) {
+		sd_err("%s, invalid request %"PRIu16, dev->name, head);
+		goto out;
+	}
+
+	/* the status is the last byte */
+	last = iov + nr_iov - 1;
+	if (!last->iov_len) {
+		sd_err("%s, no status of request %"PRIu16, dev->name, head);
+		goto out;
+	}
+	vreq->status = (uint8_t *)last->iov_base + last->iov_len - 1;
+	if (!--last->iov_len)
+		nr_iov--;
+
+	switch (hdr.type) {
+	case VIRTIO_BLK_T_IN:
+	case VIRTIO_BLK_T_OUT:
+		vhost_rw(vreq, hdr.type, hdr.sector, iov, nr_iov);
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		/* the writes are stable unless the object cache has them */
+		if (sys->enable_object_cache)
+			vhost_new_io(vreq, hdr.type, 0, 0, 0, NULL);
+		break;
+	case VIRTIO_BLK_T_GET_ID:
+		vhost_get_id(vreq, iov, nr_iov);
+		break;
+	default:
+		vreq->result = VIRTIO_BLK_S_UNSUPP;
+		break;
+	}
+out:
+	vhost_req_put(vreq);
+}
+
+static void vhost_vq_process(struct vhost_vq *vq)
+{
+	if (!vq->enabled || !vq->avail || vq->dev->deferred)
+		return;
+
+	while (vq->last_avail_idx != uatomic_read(&vq->avail->idx)) {
+		uint16_t head;
+
+		/* read the ring entry after the index */
+		cmm_smp_rmb();
+		head = vq->avail->ring[vq->last_avail_idx % vq->num];
+		vq->last_avail_idx++;
+		vhost_handle_req(vq, head);
+	}
+}
+
+static void vhost_kick_handler(int fd, int events, void *data)
+{
+	struct vhost_vq *vq = data;
+	uint64_t val;
+
+	if (read(fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		sd_err("failed to read kick fd: %m");
+
+	vhost_vq_process(vq);
+}
+
+static int vhost_set_mem_table(struct vhost_dev *dev,
+			       struct vhost_user_msg *msg)
+{
+	uint32_t nr = msg->payload.memory.nregions;
+
+	vhost_unmap(dev);
+	if (nr > VHOST_MAX_REGIONS || nr != msg->nr_fds) {
+		sd_err("%s, invalid memory table, %"PRIu32" regions, %d fds",
+		       dev->name, nr, msg->nr_fds);
+		return -1;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		struct vhost_user_region *ur = msg->payload.memory.regions + i;
+		struct vhost_region *r = dev->regions + i;
+
+		r->mmap_size = ur->size + ur->mmap_offset;
+		r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, msg->fds[i], 0);
+		if (r->mmap_addr == MAP_FAILED) {
+			sd_err("%s, failed to map the guest memory, %m",
+			       dev->name);
+			return -1;
+		}
+		r->guest_addr = ur->guest_addr;
+		r->user_addr = ur->user_addr;
+		r->size = ur->size;
+		r->addr = (char *)r->mmap_addr + ur->mmap_offset;
+		dev->nr_regions++;
+	}
+
+	return 0;
+}
+
+static int vhost_set_vring_num(struct vhost_dev *dev, struct vhost_vq *vq,
+			       struct vhost_user_msg *msg)
+{
+	uint32_t num = msg->payload.state.num;
+
+	/* the mapped rings were sized by the current num */
+	if (vq->desc) {
+		sd_err("%s, can't resize a vring in use", dev->name);
+		return -1;
+	}
+	if (!num || (num & (num - 1)) || num > VHOST_MAX_VRING_NUM) {
+		sd_err("%s, invalid vring size %"PRIu32, dev->name, num);
+		return -1;
+	}
+	vq->num = num;
+
+	return 0;
+}
+
+static int vhost_set_vring_addr(struct vhost_dev *dev, struct vhost_vq *vq,
+				struct vhost_user_msg *msg)
+{
+	uint32_t num = vq->num;
+
+	if (!num) {
+		sd_err("%s, the vring size isn't set", dev->name);
+		return -1;
+	}
+	vq->desc = uva_to_va(dev, msg->payload.addr.desc_addr,
+			     sizeof(struct vring_desc) * num);
+	vq->avail = uva_to_va(dev, msg->payload.addr.avail_addr,
+			      offsetof(struct vring_avail, ring[num]));
+	vq->used = uva_to_va(dev, msg->payload.addr.used_addr,
+			     offsetof(struct vring_used, ring[num]));
+	if (!vq->desc || !vq->avail || !vq->used) {
+		sd_err("%s, invalid vring address", dev->name);
+		vq->desc = NULL;
+		vq->avail = NULL;
+		vq->used = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int vhost_set_vring_kick(struct vhost_dev *dev, struct vhost_vq *vq,
+				struct vhost_user_msg *msg)
+{
+	if (vq->kick_fd >= 0) {
+		unregister_event(vq->kick_fd);
+		close(vq->kick_fd);
+		vq->kick_fd = -1;
+	}
+
+	if ((msg->payload.u64 & VHOST_USER_VRING_NOFD) || !msg->nr_fds) {
+		sd_err("%s, polling the vring isn't supported", dev->name);
+		return -1;
+	}
+
+	vq->kick_fd = msg->fds[0];
+	msg->nr_fds = 0;
+	if (register_event(vq->kick_fd, vhost_kick_handler, vq) < 0) {
+		close(vq->kick_fd);
+		vq->kick_fd = -1;
+		return -1;
+	}
+
+	/* the rings start enabled unless the protocol features are used */
+	if (!(dev->features & (UINT64_C(1) << VHOST_USER_F_PROTOCOL_FEATURES)))
+		vq->enabled = true;
+	vhost_vq_process(vq);
+
+	return 0;
+}
+
+static void vhost_get_config(struct vhost_dev *dev, struct vhost_user_msg *msg)
+{
+	struct virtio_blk_config cfg = {};
+	uint32_t off = msg->payload.config.offset;
+	uint32_t size = msg->payload.config.size;
+
+	cfg.capacity = dev->inode->vdi_size >> VHOST_SECTOR_SHIFT;
+	cfg.seg_max = VHOST_MAX_SEGS - 2;
+	cfg.blk_size = 1 << VHOST_SECTOR_SHIFT;
+	cfg.num_queues = VHOST_MAX_QUEUES;
+
+	if (size > sizeof(msg->payload.config.region))
+		size = sizeof(msg->payload.config.region);
+	memset(msg->payload.config.region, 0, size);
+	if (off < sizeof(cfg))
+		memcpy(msg->payload.config.region, (char *)&cfg + off,
+		       min(size, (uint32_t)sizeof(cfg) - off));
+	msg->size = offsetof(typeof(msg->payload.config), region) + size;
+}
+
+static struct vhost_vq *msg_vq(struct vhost_dev *dev, uint32_t index)
+{
+	index &= VHOST_USER_VRING_IDX_MASK;
+	if (index >= VHOST_MAX_QUEUES) {
+		sd_err("%s, invalid vring %"PRIu32, dev->name, index);
+		return NULL;
+	}
+
+	return dev->vqs + index;
+}
+
+static void vhost_send_reply(struct vhost_dev *dev, struct vhost_user_msg *msg)
+{
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+	if (xwrite(dev->fd, msg, VHOST_USER_HDR_SIZE + msg->size) < 0)
+		sd_err("%s, failed to reply, %m", dev->name);
+}
+
+static void vhost_handle_msg(struct vhost_dev *dev, struct vhost_user_msg *msg)
+{
+	struct vhost_vq *vq = NULL;
+	bool reply = false;
+	int ret = 0;
+
+	switch (msg->request) {
+	case VHOST_USER_SET_VRING_NUM:
+	case VHOST_USER_SET_VRING_ADDR:
+	case VHOST_USER_SET_VRING_BASE:
+	case VHOST_USER_GET_VRING_BASE:
+	case VHOST_USER_SET_VRING_ENABLE:
+		vq = msg_vq(dev, msg->payload.state.index);
+		break;
+	case VHOST_USER_SET_VRING_KICK:
+	case VHOST_USER_SET_VRING_CALL:
+	case VHOST_USER_SET_VRING_ERR:
+		vq = msg_vq(dev, msg->payload.u64);
+		break;
+	default:
+		break;
+	}
+
+	switch (msg->request) {
+	case VHOST_USER_GET_FEATURES:
+		msg->payload.u64 = VHOST_FEATURES;
+		msg->size = sizeof(msg->payload.u64);
+		reply = true;
+		break;
+	case VHOST_USER_SET_FEATURES:
+		dev->features = msg->payload.u64;
+		break;
+	case VHOST_USER_SET_OWNER:
+	case VHOST_USER_RESET_OWNER:
+	case VHOST_USER_SET_CONFIG:
+		break;
+	case VHOST_USER_SET_MEM_TABLE:
+		ret = vhost_set_mem_table(dev, msg);
+		break;
+	case VHOST_USER_SET_VRING_NUM:
+		ret = vq ? vhost_set_vring_num(dev, vq, msg) : -1;
+		break;
+	case VHOST_USER_SET_VRING_ADDR:
+		ret = vq ? vhost_set_vring_addr(dev, vq, msg) : -1;
+		break;
+	case VHOST_USER_SET_VRING_BASE:
+		if (vq)
+			vq->last_avail_idx = msg->payload.state.num;
+		else
+			ret = -1;
+		break;
+	case VHOST_USER_GET_VRING_BASE:
+		if (vq) {
+			vhost_stop_vq(vq);
+			msg->payload.state.num = vq->last_avail_idx;
+		}
+		msg->size = sizeof(msg->payload.state);
+		reply = true;
+		break;
+	case VHOST_USER_SET_VRING_KICK:
+		ret = vq ? vhost_set_vring_kick(dev, vq, msg) : -1;
+		break;
+	case VHOST_USER_SET_VRING_CALL:
+		if (!vq) {
+			ret = -1;
+			break;
+		}
+		if (vq->call_fd >= 0)
+			close(vq->call_fd);
+		vq->call_fd = -1;
+		if (!(msg->payload.u64 & VHOST_USER_VRING_NOFD) &&
+		    msg->nr_fds) {
+			vq->call_fd = msg->fds[0];
+			msg->nr_fds = 0;
+		}
+		break;
+	case VHOST_USER_SET_VRING_ERR:
+		break;
+	case VHOST_USER_GET_PROTOCOL_FEATURES:
+		msg->payload.u64 = VHOST_PROTOCOL_FEATURES;
+		msg->size = sizeof(msg->payload.u64);
+		reply = true;
+		break;
+	case VHOST_USER_SET_PROTOCOL_FEATURES:
+		dev->protocol_features = msg->payload.u64;
+		break;
+	case VHOST_USER_GET_QUEUE_NUM:
+		msg->payload.u64 = VHOST_MAX_QUEUES;
+		msg->size = sizeof(msg->payload.u64);
+		reply = true;
+		break;
+	case VHOST_USER_SET_VRING_ENABLE:
+		if (!vq) {
+			ret = -1;
+			break;
+		}
+		vq->enabled = msg->payload.state.num;
+		vhost_vq_process(vq);
+		break;
+	case VHOST_USER_GET_CONFIG:
+		vhost_get_config(dev, msg);
+		reply = true;
+		break;
+	default:
+		sd_err("%s, unsupported message %"PRIu32, dev->name,
+		       msg->request);
+		ret = -1;
+		break;
+	}
+	close_msg_fds(msg);
+
+	if (!reply && (msg->flags & VHOST_USER_NEED_REPLY)) {
+		msg->payload.u64 = ret ? 1 : 0;
+		msg->size = sizeof(msg->payload.u64);
+		reply = true;
+	}
+	if (reply)
+		vhost_send_reply(dev, msg);
+}
+
+static int vhost_recv_msg(int fd, struct vhost_user_msg *msg)
+{
+	char control[CMSG_SPACE(sizeof(msg->fds))];
+	struct iovec iov = {
+		.iov_base = msg,
+		.iov_len = VHOST_USER_HDR_SIZE,
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	msg->nr_fds = 0;
+	do {
+		ret = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	} while (ret < 0 && errno == EINTR);
+	if (ret != VHOST_USER_HDR_SIZE)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		msg->nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(msg->fds, CMSG_DATA(cmsg), msg->nr_fds * sizeof(int));
+	}
+
+	if (msg->size > sizeof(msg->payload) ||
+	    xread(fd, &msg->payload, msg->size) != msg->size) {
+		close_msg_fds(msg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The messages which wait for the requests being served */
+static bool vhost_need_idle(const struct vhost_user_msg *msg)
+{
+	return msg->request == VHOST_USER_SET_MEM_TABLE ||
+		msg->request == VHOST_USER_GET_VRING_BASE;
+}
+
+static void vhost_disconnect(struct vhost_dev *dev)
+{
+	if (dev->fd < 0)
+		return;
+
+	sd_info("%s", dev->name);
+	if (dev->deferred) {
+		close_msg_fds(dev->deferred);
+		free(dev->deferred);
+		dev->deferred = NULL;
+	} else
+		unregister_event(dev->fd);
+	close(dev->fd);
+	dev->fd = -1;
+	dev->gen++;
+
+	for (int i = 0; i < VHOST_MAX_QUEUES; i++) {
+		struct vhost_vq *vq = dev->vqs + i;
+
+		vhost_stop_vq(vq);
+		if (vq->call_fd >= 0)
+			close(vq->call_fd);
+		vq->call_fd = -1;
+	}
+
+	if (!dev->nr_reqs)
+		vhost_idle(dev);
+}
+
+static void vhost_msg_handler(int fd, int events, void *data)
+{
+	struct vhost_dev *dev = data;
+	struct vhost_user_msg msg;
+
+	if ((events & (EPOLLERR | EPOLLHUP)) || vhost_recv_msg(fd, &msg) < 0) {
+		vhost_disconnect(dev);
+		return;
+	}
+
+	if (vhost_need_idle(&msg) && dev->nr_reqs) {
+		/* the socket isn't read until vhost_idle() */
+		dev->deferred = xmalloc(sizeof(msg));
+		memcpy(dev->deferred, &msg, sizeof(msg));
+		unregister_event(fd);
+		return;
+	}
+
+	vhost_handle_msg(dev, &msg);
+}
+
+static void vhost_listen_handler(int listen_fd, int events, void *data)
+{
+	struct vhost_dev *dev = data;
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		sd_err("failed to accept a new connection: %m");
+		return;
+	}
+
+	if (dev->fd >= 0) {
+		sd_err("%s is already connected", dev->name);
+		close(fd);
+		return;
+	}
+
+	/* wait for the requests of the previous guest, if any */
+	if (dev->nr_reqs) {
+		sd_err("%s is still busy", dev->name);
+		close(fd);
+		return;
+	}
+
+	if (register_event(fd, vhost_msg_handler, dev) < 0) {
+		close(fd);
+		return;
+	}
+
+	dev->fd = fd;
+	dev->gen++;
+	dev->features = 0;
+	dev->protocol_features = 0;
+	for (int i = 0; i < VHOST_MAX_QUEUES; i++)
+		vhost_reset_vq(dev, dev->vqs + i);
+	sd_info("%s", dev->name);
+}
+
+static int vhost_listen_fn(int fd, void *data)
+{
+	struct vhost_dev *dev = data;
+
+	dev->listen_fd = fd;
+	return register_event(fd, vhost_listen_handler, dev);
+}
+
+/*
+ * Read the inode of 'vid' for the device, which is started by
+ * vhost_start() in the main thread.
+ */
+worker_fn int vhost_create(uint32_t vid, const char *name)
+{
+	struct vhost_dev *dev;
+	int ret;
+
+	if (!vhost_wqueue)
+		return SD_RES_INVALID_PARMS;
+
+	if (!*name || strchr(name, '/'))
+		return SD_RES_INVALID_PARMS;
+
+	dev = xzalloc(sizeof(*dev));
+	dev->inode = xvalloc(VHOST_INODE_SIZE);
+	ret = sd_read_object(vid_to_vdi_oid(vid), (char *)dev->inode,
+			     VHOST_INODE_SIZE, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+
+	if (vdi_is_snapshot(dev->inode) || dev->inode->store_policy) {
+		sd_err("%s, a snapshot or a hypervolume isn't supported", name);
+		ret = SD_RES_INVALID_PARMS;
+		goto err;
+	}
+
+	dev->vid = vid;
+	pstrcpy(dev->name, sizeof(dev->name), name);
+	dev->object_size = get_vdi_object_size(vid);
+
+	sd_mutex_lock(&vhost_new_lock);
+	list_add_tail(&dev->list, &vhost_new_devs);
+	sd_mutex_unlock(&vhost_new_lock);
+
+	return SD_RES_SUCCESS;
+err:
+	free(dev->inode);
+	free(dev);
+	return ret;
+}
+
+main_fn int vhost_start(uint32_t vid)
+{
+	struct vhost_dev *dev, *new = NULL;
+
+	sd_mutex_lock(&vhost_new_lock);
+	list_for_each_entry(dev, &vhost_new_devs, list)
+		if (dev->vid == vid) {
+			list_del(&dev->list);
+			new = dev;
+			break;
+		}
+	sd_mutex_unlock(&vhost_new_lock);
+
+	if (!new)
+		return SD_RES_NO_VDI;
+
+	if (vhost_find_dev(new->name)) {
+		free(new->inode);
+		free(new);
+		return SD_RES_VDI_EXIST;
+	}
+
+	dev = new;
+	dev->fd = -1;
+	dev->listen_fd = -1;
+	INIT_LIST_HEAD(&dev->creates);
+	INIT_LIST_HEAD(&dev->reload_ios);
+	for (int i = 0; i < VHOST_MAX_QUEUES; i++)
+		vhost_reset_vq(dev, dev->vqs + i);
+
+	dev->ci = xzalloc(sizeof(*dev->ci));
+	dev->ci->type = CLIENT_INFO_TYPE_VHOST;
+	dev->ci->conn.fd = -1;
+	refcount_set(&dev->ci->refcnt, 0);
+	INIT_LIST_HEAD(&dev->ci->done_reqs);
+	INIT_LIST_HEAD(&dev->ci->tx_reqs);
+
+	snprintf(dev->path, sizeof(dev->path), "%s/%s.sock", vhost_dir,
+		 dev->name);
+	if (strlen(dev->path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		sd_err("%s is too long for a unix socket", dev->path);
+		free(dev->ci);
+		free(dev->inode);
+		free(dev);
+		return SD_RES_INVALID_PARMS;
+	}
+	unlink(dev->path);
+	if (create_unix_domain_socket(dev->path, vhost_listen_fn, dev) < 0) {
+		free(dev->ci);
+		free(dev->inode);
+		free(dev);
+		return SD_RES_SYSTEM_ERROR;
+	}
+
+	list_add_tail(&dev->list, &vhost_devs);
+	sd_info("%s, %"PRIx32", %s", dev->name, vid, dev->path);
+
+	return SD_RES_SUCCESS;
+}
+
+main_fn int vhost_delete(const char *name)
+{
+	struct vhost_dev *dev = vhost_find_dev(name);
+
+	if (!dev)
+		return SD_RES_NO_VDI;
+
+	unregister_event(dev->listen_fd);
+	close(dev->listen_fd);
+	unlink(dev->path);
+
+	dev->deleted = true;
+	if (dev->fd >= 0)
+		vhost_disconnect(dev);
+	else if (!dev->nr_reqs)
+		vhost_free(dev);
+
+	return SD_RES_SUCCESS;
+}
+
+int vhost_init(const char *dir)
+{
+	snprintf(vhost_dir, sizeof(vhost_dir), "%s/vhost", dir);
+	if (xmkdir(vhost_dir, sd_def_dmode) < 0) {
+		sd_err("failed to create %s, %m", vhost_dir);
+		return -1;
+	}
+
+	vhost_wqueue = create_ordered_work_queue("vhost");
+	if (!vhost_wqueue)
+		return -1;
+
+	return 0;
+}
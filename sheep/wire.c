@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compression of the object data sent between the zones
+ *
+ * With '-Z', the replica reads, the recovery reads and the forwarded writes
+ * to a node of another zone carry SD_FLAG_CMD_ZSTD, which the node echoes in
+ * the response if it was built with zstd.  The echo is remembered in the
+ * sockfd cache of the node:
+ *
+ *  - a read which carries the flag can be answered with a zstd frame, which
+ *    the response marks with SD_FLAG_CMD_ZSTD_DATA
+ *  - a write is sent as a zstd frame marked with SD_FLAG_CMD_ZSTD_DATA only
+ *    to a node which has echoed the flag, so the first write to a node goes
+ *    out as-is
+ *
+ * A frame is sent only if it's smaller than the data.  The fast level is used
+ * since the links between the zones are the bottleneck, not the CPU; zstd
+ * emits the runs of zeros of the sparse objects as RLE blocks of a few bytes.
+ * A node which can't decompress a write drops the connection, which makes the
+ * sender forget the echo of the node.
+ */
+
+#include <zstd.h>
+
+#include "sheep_priv.h"
+
+#define WIRE_LEVEL 1
+/* not worth a frame below this */
+#define WIRE_MIN_LEN 4096
+
+struct wire_ctx {
+	ZSTD_CCtx *cctx;
+	ZSTD_DCtx *dctx;
+};
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+
+static void free_ctx(void *p)
+{
+	struct wire_ctx *ctx = p;
+
+	ZSTD_freeCCtx(ctx->cctx);
+	ZSTD_freeDCtx(ctx->dctx);
+	free(ctx);
+}
+
+static void init_ctx_key(void)
+{
+	if (pthread_key_create(&ctx_key, free_ctx))
+		panic("failed to create the key of zstd contexts");
+}
+
+static struct wire_ctx *get_ctx(void)
+{
+	struct wire_ctx *ctx;
+
+	pthread_once(&ctx_once, init_ctx_key);
+	ctx = pthread_getspecific(ctx_key);
+	if (likely(ctx))
+		return ctx;
+
+	ctx = xzalloc(sizeof(*ctx));
+	ctx->cctx = ZSTD_createCCtx();
+	ctx->dctx = ZSTD_createDCtx();
+	if (!ctx->cctx || !ctx->dctx)
+		panic("failed to create zstd contexts");
+	ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel, WIRE_LEVEL);
+	pthread_setspecific(ctx_key, ctx);
+
+	return ctx;
+}
+
+/* Whether the data sent to and read from n is compressed */
+bool wire_compress_with(const struct sd_node *n)
+{
+	return sys->wire_compress && n->zone != sys->this_node.zone;
+}
+
+/*
+ * Compress len bytes of buf.  Returns the frame in a buffer which the caller
+ * frees, or NULL if it isn't smaller than the data.
+ */
+void *wire_compress(const void *buf, uint32_t len, uint32_t *clen)
+{
+	void *frame;
+	size_t ret;
+
+	if (len < WIRE_MIN_LEN)
+		return NULL;
+
+	frame = xmalloc(len);
+	ret = ZSTD_compress2(get_ctx()->cctx, frame, len, buf, len);
+	if (ZSTD_isError(ret) || ret >= len) {
+		/* dstSize_tooSmall if it doesn't shrink */
+		free(frame);
+		return NULL;
+	}
+
+	*clen = ret;
+	return frame;
+}
+
+/*
+ * Decompress the frame of len bytes in buf into buf, which has room for size
+ * bytes.  Returns the length of the data, or -1 if the frame is broken.
+ */
+int wire_decompress(void *buf, uint32_t len, uint32_t size)
+{
+	void *frame = xmalloc(len);
+	size_t ret;
+
+	memcpy(frame, buf, len);
+	ret = ZSTD_decompressDCtx(get_ctx()->dctx, buf, size, frame, len);
+	free(frame);
+	if (ZSTD_isError(ret)) {
+		sd_err("broken frame, %s", ZSTD_getErrorName(ret));
+		return -1;
+	}
+
+	return ret;
+}
+
+/* Compress the data of the read response of req if it's asked for */
+void wire_compress_rsp(struct request *req)
+{
+	struct sd_rsp *rsp = &req->rp;
+	uint32_t clen;
+	void *frame;
+
+	if (req->rq.opcode != SD_OP_READ_PEER ||
+	    !(req->rq.flags & SD_FLAG_CMD_ZSTD))
+		return;
+
+	frame = wire_compress(req->data, rsp->data_length, &clen);
+	if (!frame)
+		return;
+
+	memcpy(req->data, frame, clen);
+	free(frame);
+	rsp->data_length = clen;
+	rsp->flags |= SD_FLAG_CMD_ZSTD_DATA;
+}
+
+/*
+ * Replace the compressed data of the received request req with the data.
+ * Returns -1 if the frame is broken.
+ */
+int wire_decompress_req(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	unsigned long long size;
+	void *data;
+	size_t ret;
+
+	size = ZSTD_getFrameContentSize(req->data, hdr->data_length);
+	if (size == ZSTD_CONTENTSIZE_ERROR ||
+	    size == ZSTD_CONTENTSIZE_UNKNOWN || size > UINT32_MAX) {
+		sd_err("invalid frame of %"PRIu32" bytes", hdr->data_length);
+		return -1;
+	}
+
+	data = pool_alloc(size);
+	if (!data)
+		return -1;
+	ret = ZSTD_decompressDCtx(get_ctx()->dctx, data, size, req->data,
+				  hdr->data_length);
+	if (ZSTD_isError(ret) || ret != size) {
+		sd_err("broken frame of %"PRIu32" bytes", hdr->data_length);
+		pool_free(data, size);
+		return -1;
+	}
+
+	pool_free(req->data, req->data_length);
+	req->data = data;
+	req->data_length = size;
+	hdr->data_length = size;
+	hdr->flags &= ~SD_FLAG_CMD_ZSTD_DATA;
+
+	return 0;
+}
@@ -16,9 +16,17 @@
 
 #include <libxio.h>
 
+/* The SGEs of a message, for the header and the payload */
+#define SD_XIO_MAX_IOV 16
+
 void sd_xio_init(void);
 void sd_xio_shutdown(void);
 
+void *sd_xio_buf_alloc(size_t len);
+void sd_xio_buf_free(void *addr);
+struct xio_mr *sd_xio_buf_mr(const void *addr);
+void sd_xio_assign_sglist(struct xio_iovec_ex *sglist, int nents, void *addr);
+
 int xio_exec_req(const struct node_id *nid, struct sd_req *hdr, void *data,
 		 bool (*need_retry)(uint32_t epoch), uint32_t epoch,
 		 uint32_t max_count);
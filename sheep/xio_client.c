@@ -27,9 +27,143 @@ struct xio_context *xio_get_main_ctx(void)
 	return main_ctx;
 }
 
+/*
+ * The pool of the registered memory for the payloads.  Registering memory
+ * with the HCA is expensive, so the buffers are kept on a free list of their
+ * power-of-two size class once registered.  The buffers in use are looked up
+ * by address to hand their memory region to accelio, which then does RDMA
+ * right from and to them instead of copying through its own buffers.
+ */
+#define XIO_BUF_MIN_SHIFT	12
+#define XIO_BUF_MAX_SHIFT	23 /* larger ones aren't pooled */
+#define XIO_BUF_MAX_FREE	32 /* per size class */
+
+struct xio_buf {
+	struct rb_node rb;
+	struct list_node list;
+	struct xio_reg_mem reg;
+	int shift;
+};
+
+static struct rb_root xio_bufs_in_use = RB_ROOT;
+static struct list_head xio_free_bufs[XIO_BUF_MAX_SHIFT + 1];
+static int nr_xio_free_bufs[XIO_BUF_MAX_SHIFT + 1];
+static struct sd_mutex xio_buf_lock = SD_MUTEX_INITIALIZER;
+
+static int xio_buf_cmp(const struct xio_buf *a, const struct xio_buf *b)
+{
+	return intcmp((uintptr_t)a->reg.addr, (uintptr_t)b->reg.addr);
+}
+
+static struct xio_buf *find_xio_buf(const void *addr)
+{
+	struct xio_buf key = { .reg.addr = (void *)addr };
+
+	return rb_search(&xio_bufs_in_use, &key, rb, xio_buf_cmp);
+}
+
+void *sd_xio_buf_alloc(size_t len)
+{
+	int shift = XIO_BUF_MIN_SHIFT;
+	struct xio_buf *buf = NULL;
+
+	while ((1UL << shift) < len)
+		shift++;
+
+	sd_mutex_lock(&xio_buf_lock);
+	if (shift <= XIO_BUF_MAX_SHIFT &&
+	    !list_empty(&xio_free_bufs[shift])) {
+		buf = list_first_entry(&xio_free_bufs[shift], struct xio_buf,
+				       list);
+		list_del(&buf->list);
+		nr_xio_free_bufs[shift]--;
+	}
+	sd_mutex_unlock(&xio_buf_lock);
+
+	if (!buf) {
+		buf = xzalloc(sizeof(*buf));
+		buf->shift = shift;
+		if (xio_mem_alloc(shift <= XIO_BUF_MAX_SHIFT ?
+				  1UL << shift : len, &buf->reg) < 0)
+			panic("failed to allocate registered memory, %s",
+			      xio_strerror(xio_errno()));
+	}
+
+	sd_mutex_lock(&xio_buf_lock);
+	rb_insert(&xio_bufs_in_use, buf, rb, xio_buf_cmp);
+	sd_mutex_unlock(&xio_buf_lock);
+
+	return buf->reg.addr;
+}
+
+void sd_xio_buf_free(void *addr)
+{
+	struct xio_buf *buf;
+
+	if (!addr)
+		return;
+
+	sd_mutex_lock(&xio_buf_lock);
+	buf = find_xio_buf(addr);
+	sd_assert(buf);
+	rb_erase(&buf->rb, &xio_bufs_in_use);
+	if (buf->shift <= XIO_BUF_MAX_SHIFT &&
+	    nr_xio_free_bufs[buf->shift] < XIO_BUF_MAX_FREE) {
+		list_add(&buf->list, &xio_free_bufs[buf->shift]);
+		nr_xio_free_bufs[buf->shift]++;
+		buf = NULL;
+	}
+	sd_mutex_unlock(&xio_buf_lock);
+
+	if (buf) {
+		xio_mem_free(&buf->reg);
+		free(buf);
+	}
+}
+
+/* The memory region of addr if it is a buffer of the pool, or NULL */
+struct xio_mr *sd_xio_buf_mr(const void *addr)
+{
+	struct xio_buf *buf;
+	struct xio_mr *mr = NULL;
+
+	sd_mutex_lock(&xio_buf_lock);
+	buf = find_xio_buf(addr);
+	if (buf)
+		mr = buf->reg.mr;
+	sd_mutex_unlock(&xio_buf_lock);
+
+	return mr;
+}
+
+/*
+ * Let the nents entries of sglist share one registered buffer, so that a
+ * payload of several SGEs is contiguous, or point them to the given one
+ */
+void sd_xio_assign_sglist(struct xio_iovec_ex *sglist, int nents, void *addr)
+{
+	size_t len = 0;
+	struct xio_mr *mr;
+
+	for (int i = 0; i < nents; i++)
+		len += sglist[i].iov_len;
+	if (!len)
+		return;
+
+	if (!addr)
+		addr = sd_xio_buf_alloc(len);
+	mr = sd_xio_buf_mr(addr);
+	for (int i = 0; i < nents; i++) {
+		sglist[i].iov_base = addr;
+		sglist[i].mr = mr;
+		addr = (char *)addr + sglist[i].iov_len;
+	}
+}
+
 struct client_data {
 	struct xio_context *ctx;
 	struct xio_msg *rsp;
+	void *data; /* to receive the payload */
 };
 
 static int client_on_response(struct xio_session *session,
@@ -96,21 +230,43 @@ static int on_session_event(struct xio_session *session,
 	return 0;
 }
 
+/* Receive into the buffer of the caller if it is registered */
+static void *registered_or_null(void *data)
+{
+	return data && sd_xio_buf_mr(data) ? data : NULL;
+}
+
 static int client_assign_data_in_buf(struct xio_msg *msg, void *cb_user_context)
 {
+	struct client_data *client_data =
+			(struct client_data *)cb_user_context;
 	struct xio_iovec_ex *sglist = vmsg_sglist(&msg->in);
-	struct xio_reg_mem in_xbuf;
 
 	sd_debug("assign buffer, msg vec len: %lu", sglist[0].iov_len);
-	if (!sglist[0].iov_len)
-		return 0;
+	sd_xio_assign_sglist(sglist, vmsg_sglist_nents(&msg->in),
+			     registered_or_null(client_data->data));
+
+	return 0;
+}
 
-	xio_mem_alloc(sglist[0].iov_len, &in_xbuf);
+/* Copy the payload of a response to data unless it was received there */
+static void copy_response_data(struct xio_msg *xrsp, void *data)
+{
+	struct xio_iovec_ex *isglist = vmsg_sglist(&xrsp->in);
+	int nents = vmsg_sglist_nents(&xrsp->in);
+	size_t total = 0;
 
-	sglist[0].iov_base = in_xbuf.addr;
-	sglist[0].mr = in_xbuf.mr;
+	if (!nents || isglist[0].iov_base == data)
+		return;
 
-	return 0;
+	for (int i = 0; i < nents; i++) {
+		memcpy((char *)data + total, isglist[i].iov_base,
+		       isglist[i].iov_len);
+		total += isglist[i].iov_len;
+	}
+	/* assigned by sd_xio_assign_sglist() */
+	if (isglist[0].mr)
+		sd_xio_buf_free(isglist[0].iov_base);
 }
 
 static struct xio_session_ops client_ses_ops = {
@@ -188,7 +344,8 @@ static void msg_prep_for_send(struct sd_req *hdr, struct sd_rsp *rsp,
 
 		osglist[0].iov_base = data;
 		osglist[0].iov_len = hdr->data_length;
-		osglist[0].mr = NULL;
+		/* sent without a copy if the data came in registered memory */
+		osglist[0].mr = sd_xio_buf_mr(data);
 	}
 
 	vmsg_sglist_set_nents(pimsg, 1);
@@ -206,21 +363,10 @@ static void msg_prep_for_send(struct sd_req *hdr, struct sd_rsp *rsp,
 
 static void msg_finalize(struct sd_req *hdr, void *data, struct xio_msg *xrsp)
 {
-	struct xio_vmsg *pimsg = &xrsp->in;
-	struct xio_iovec_ex *isglist = vmsg_sglist(pimsg);
-	int nents = vmsg_sglist_nents(pimsg);
-
 	sd_assert(xrsp->in.header.iov_len == sizeof(struct sd_rsp));
 	memcpy(hdr, xrsp->in.header.iov_base, sizeof(*hdr));
-	if (data) {
-		int total = 0;
-
-		for (int i = 0; i < nents; i++) {
-			memcpy((char *)data + total, isglist[i].iov_base,
-			       isglist[i].iov_len);
-			total += isglist[i].iov_len;
-		}
-	}
+	if (data)
+		copy_response_data(xrsp, data);
 
 	xio_release_response(xrsp);
 }
@@ -230,7 +376,7 @@ int xio_exec_req(const struct node_id *nid, struct sd_req *hdr, void *data,
 		 uint32_t max_count)
 {
 	struct xio_context *ctx = xio_context_create(NULL, 0, -1);
-	struct client_data cli = { .ctx = ctx };
+	struct client_data cli = { .ctx = ctx, .data = data };
 	struct xio_connection *conn = sd_xio_create_connection(ctx, nid, &cli);
 	struct xio_msg xreq;
 	struct sd_rsp rsp;
@@ -263,19 +409,10 @@ static int gw_client_on_response(struct xio_session *session,
 		(struct xio_forward_info_entry *)cb_user_context;
 	struct xio_forward_info *fi = fi_entry->fi;
 
-	struct xio_vmsg *pimsg = &rsp->in;
-	struct xio_iovec_ex *isglist = vmsg_sglist(pimsg);
-
-	int nents = vmsg_sglist_nents(pimsg), total = 0;
-
 	sd_debug("response on fi_entry %p", fi_entry);
 
-	for (int i = 0; i < nents; i++) {
-		memcpy((char *)fi_entry->buf + total,
-		       isglist[i].iov_base, isglist[i].iov_len);
-
-		total += isglist[i].iov_len;
-	}
+	copy_response_data(rsp, fi_entry->buf);
+	xio_release_response(rsp);
 
 	fi->nr_done++;
 	if (fi->nr_done == fi->nr_send)
@@ -284,12 +421,25 @@ static int gw_client_on_response(struct xio_session *session,
 	return 0;
 }
 
+static int gw_client_assign_data_in_buf(struct xio_msg *msg,
+					void *cb_user_context)
+{
+	struct xio_forward_info_entry *fi_entry =
+		(struct xio_forward_info_entry *)cb_user_context;
+	struct xio_iovec_ex *sglist = vmsg_sglist(&msg->in);
+
+	sd_xio_assign_sglist(sglist, vmsg_sglist_nents(&msg->in),
+			     registered_or_null(fi_entry->buf));
+
+	return 0;
+}
+
 static struct xio_session_ops gw_client_ses_ops = {
 	.on_session_event = on_session_event,
 	.on_session_established = NULL,
 	.on_msg = gw_client_on_response,
 	.on_msg_error = on_msg_error,
-	.assign_data_in_buf		= client_assign_data_in_buf,
+	.assign_data_in_buf		= gw_client_assign_data_in_buf,
 };
 
 struct xio_session *sd_xio_gw_create_session(struct xio_context *ctx,
@@ -362,9 +512,11 @@ void xio_init_main_ctx(void)
 
 void sd_xio_init(void)
 {
-	int xopt = 2;		/* hdr + body */
+	int xopt = SD_XIO_MAX_IOV;
 
 	xio_init();
+	for (int i = 0; i <= XIO_BUF_MAX_SHIFT; i++)
+		INIT_LIST_HEAD(&xio_free_bufs[i]);
 
 	xio_set_opt(NULL,
 		    XIO_OPTLEVEL_ACCELIO, XIO_OPTNAME_MAX_IN_IOVLEN,
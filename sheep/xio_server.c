@@ -45,12 +45,21 @@ static int server_on_request(struct xio_session *session,
 	sd_debug("on request: %p, %p, nents: %d", session, xio_req, nents);
 	hdr = xio_req->in.header.iov_base;
 
-	req = alloc_request(ci, hdr->data_length);
+	/*
+	 * The payload of any number of SGEs was received contiguously into a
+	 * registered buffer by server_assign_data_in_buf(), which the request
+	 * takes over.  The data to read is put in one as well, to be sent back
+	 * without a copy.
+	 */
+	req = alloc_request(ci, 0);
 	memcpy(&req->rq, hdr, sizeof(req->rq));
 
-	if (hdr->data_length && hdr->flags & SD_FLAG_CMD_WRITE) {
-		sd_assert(nents == 1);
-		req->data = sglist[0].iov_base;
+	if (hdr->data_length) {
+		req->data_length = hdr->data_length;
+		if (hdr->flags & SD_FLAG_CMD_WRITE && nents)
+			req->data = sglist[0].iov_base;
+		else
+			req->data = sd_xio_buf_alloc(hdr->data_length);
 	}
 
 	xio_req->in.header.iov_base  = NULL;
@@ -82,6 +91,7 @@ static struct client_info *xio_create_client(struct xio_session *session,
 	refcount_set(&ci->refcnt, 0);
 
 	INIT_LIST_HEAD(&ci->done_reqs);
+	INIT_LIST_HEAD(&ci->tx_reqs);
 
 	return ci;
 }
@@ -167,7 +177,7 @@ static void msg_prep_for_reply(struct sd_rsp *rsp,
 
 		sglist[0].iov_base = data;
 		sglist[0].iov_len = rsp->data_length;
-		sglist[0].mr = NULL;
+		sglist[0].mr = sd_xio_buf_mr(data);
 	}
 }
 
@@ -202,7 +212,6 @@ main_fn void xio_send_reply(struct client_info *ci)
 
 	xio_context_run_loop(xio_get_main_ctx(), XIO_INFINITE);
 
-	req->data = NULL;	/* the data is owned by xio */
 	free_request(req);
 }
 
@@ -217,14 +226,12 @@ static int server_on_send_response_complete(struct xio_session *session,
 static int server_assign_data_in_buf(struct xio_msg *msg, void *cb_user_context)
 {
 	struct xio_iovec_ex	*sglist = vmsg_sglist(&msg->in);
-	struct xio_reg_mem	in_xbuf;
+	int			nents = vmsg_sglist_nents(&msg->in);
 
-	sd_debug("assign buffer, msg vec len: %lu", sglist[0].iov_len);
+	sd_debug("assign buffer, msg vec len: %lu, nents: %d",
+		 sglist[0].iov_len, nents);
 
-	xio_mem_alloc(sglist[0].iov_len, &in_xbuf);
-
-	sglist[0].iov_base = in_xbuf.addr;
-	sglist[0].mr = in_xbuf.mr;
+	sd_xio_assign_sglist(sglist, nents, NULL);
 
 	return 0;
 }
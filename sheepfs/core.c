@@ -37,11 +37,13 @@ static int sheepfs_debug;
 static int sheepfs_fg;
 int sheepfs_page_cache;
 int sheepfs_object_cache;
+int sheepfs_volume_cache;
 char sdhost[32] = "127.0.0.1";
 int sdport = SD_LISTEN_PORT;
 
 static struct option const long_options[] = {
 	{"address", required_argument, NULL, 'a'},
+	{"volumecache", no_argument, NULL, 'c'},
 	{"debug", no_argument, NULL, 'd'},
 	{"help", no_argument, NULL, 'h'},
 	{"foreground", no_argument, NULL, 'f'},
@@ -51,7 +53,7 @@ static struct option const long_options[] = {
 	{NULL, 0, NULL, 0},
 };
 
-static const char *short_options = "a:dfhknp:";
+static const char *short_options = "a:cdfhknp:";
 
 static struct sheepfs_file_operation {
 	int (*read)(const char *path, char *buf, size_t size, off_t,
@@ -80,7 +82,8 @@ static struct sheepfs_file_operation {
 				config_sheep_info_write,
 				config_sheep_info_get_size },
 	[OP_VOLUME]         = { volume_read, volume_write, volume_get_size,
-				volume_sync, volume_open },
+				volume_sync, volume_open, NULL, NULL,
+				volume_release },
 #ifdef HAVE_HTTP
 	[OP_HTTP_ADDRESS]   = { http_address_read, http_address_write,
 				http_address_get_size },
@@ -353,6 +356,7 @@ static void usage(int inval)
 Usage: sheepfs [OPTION]... MOUNTPOINT\n\
 Options:\n\
   -a, --address           specify the sheep address (default: 127.0.0.1)\n\
+  -c, --volumecache       readahead and coalesce writes of volumes in sheepfs\n\
   -d, --debug             enable debug output (implies -f)\n\
   -f, --foreground        sheepfs run in the foreground\n\
   -k, --pagecache         use local kernel's page cache to access volume\n\
@@ -375,6 +379,9 @@ int main(int argc, char **argv)
 		case 'a':
 			memcpy(sdhost, optarg, strlen(optarg));
 			break;
+		case 'c':
+			sheepfs_volume_cache = true;
+			break;
 		case 'd':
 			sheepfs_debug = true;
 			break;
@@ -41,6 +41,33 @@
 
 /* #define DEBUG */
 
+/*
+ * Userspace volume cache, enabled by --volumecache
+ *
+ * Small sequential I/O, e.g. from log processing, is turned into a few large
+ * object requests:
+ *  - when a read starts where the previous one ended, we read ahead
+ *    VOLUME_READAHEAD bytes and serve the following reads from memory
+ *  - adjacent writes within one data object are coalesced in a write-back
+ *    buffer, which is written out when the next write isn't adjacent, when
+ *    the object is filled up, before an overlapping read and on fsync/close
+ *
+ * So the memory used is bounded to VOLUME_READAHEAD + SD_DATA_OBJ_SIZE per
+ * mounted volume.
+ */
+#define VOLUME_READAHEAD (1024 * 1024)
+
+struct volume_cache {
+	struct sd_mutex lock;
+	char *ra_buf;
+	uint64_t ra_start;
+	uint64_t ra_len;
+	uint64_t last_end; /* end of the previous read */
+	char *wb_buf;
+	uint64_t wb_start;
+	uint64_t wb_len;
+};
+
 struct vdi_inode {
 	struct rb_node rb;
 	uint32_t vid;
@@ -59,6 +86,7 @@ struct vdi_inode {
 	int socket_pool[SOCKET_POOL_SIZE];
 	uatomic_bool socket_in_use[SOCKET_POOL_SIZE];
 	unsigned socket_poll_adder;
+	struct volume_cache cache;
 };
 
 static struct rb_root vdi_inode_tree = RB_ROOT;
@@ -167,6 +195,7 @@ static int volume_rw_object(char *buf, uint64_t oid, size_t size,
 	hdr.obj.offset = off;
 	hdr.obj.cow_oid = cow_oid;
 	hdr.data_length = size;
+	sd_inode_invalidate_cache_oid(oid, rw != VOLUME_READ);
 	if (sheepfs_object_cache)
 		hdr.flags |= SD_FLAG_CMD_CACHE;
 
@@ -193,27 +222,13 @@ done:
 }
 
 /* Do sync read/write */
-static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
-			    off_t offset, int rw)
+static ssize_t volume_rw(uint32_t vid, char *buf, size_t size, off_t offset,
+			 int rw)
 {
-	uint32_t vid;
 	uint64_t oid;
 	unsigned long idx;
 	off_t start;
-	size_t len, ret, vdi_size, sz;
-
-	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
-		return -1;
-
-	if (shadow_file_getxattr(path, SH_SIZE_NAME, &vdi_size, SH_SIZE_SIZE)
-	    < 0)
-		return -1;
-
-	if (offset >= vdi_size)
-		return 0;
-
-	if (offset + size > vdi_size)
-		size = vdi_size - offset;
+	size_t len, ret, sz;
 
 	sz = size;
 	idx = offset / SD_DATA_OBJ_SIZE;
@@ -246,6 +261,172 @@ static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
 	return sz - size;
 }
 
+static inline bool range_overlap(uint64_t s1, uint64_t l1, uint64_t s2,
+				 uint64_t l2)
+{
+	return s1 < s2 + l2 && s2 < s1 + l1;
+}
+
+/* Caller must hold vdi->cache.lock */
+static int volume_cache_flush(struct vdi_inode *vdi)
+{
+	struct volume_cache *vc = &vdi->cache;
+
+	if (!vc->wb_len)
+		return 0;
+
+	/* keep the data buffered on failure, fsync will report it */
+	if (volume_rw(vdi->vid, vc->wb_buf, vc->wb_len, vc->wb_start,
+		      VOLUME_WRITE) != vc->wb_len)
+		return -1;
+
+	vc->wb_len = 0;
+	return 0;
+}
+
+static ssize_t volume_cache_read(struct vdi_inode *vdi, char *buf,
+				 size_t size, uint64_t offset,
+				 uint64_t vdi_size)
+{
+	struct volume_cache *vc = &vdi->cache;
+	ssize_t ret = size;
+	bool sequential;
+
+	sd_mutex_lock(&vc->lock);
+	if (range_overlap(vc->wb_start, vc->wb_len, offset, size) &&
+	    volume_cache_flush(vdi) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	sequential = offset == vc->last_end;
+	vc->last_end = offset + size;
+
+	if (vc->ra_len && offset >= vc->ra_start &&
+	    offset + size <= vc->ra_start + vc->ra_len) {
+		memcpy(buf, vc->ra_buf + offset - vc->ra_start, size);
+		goto out;
+	}
+
+	if (!sequential || size >= VOLUME_READAHEAD) {
+		sd_mutex_unlock(&vc->lock);
+		return volume_rw(vdi->vid, buf, size, offset, VOLUME_READ);
+	}
+
+	if (!vc->ra_buf)
+		vc->ra_buf = xmalloc(VOLUME_READAHEAD);
+	vc->ra_start = offset;
+	vc->ra_len = min(vdi_size - offset, (uint64_t)VOLUME_READAHEAD);
+	if (volume_rw(vdi->vid, vc->ra_buf, vc->ra_len, offset,
+		      VOLUME_READ) != vc->ra_len) {
+		vc->ra_len = 0;
+		ret = -1;
+		goto out;
+	}
+	memcpy(buf, vc->ra_buf, size);
+out:
+	sd_mutex_unlock(&vc->lock);
+	return ret;
+}
+
+static ssize_t volume_cache_write(struct vdi_inode *vdi, char *buf,
+				  size_t size, uint64_t offset)
+{
+	struct volume_cache *vc = &vdi->cache;
+	uint64_t idx = offset / SD_DATA_OBJ_SIZE;
+	uint64_t obj_end = (idx + 1) * SD_DATA_OBJ_SIZE;
+	ssize_t ret = size;
+
+	sd_mutex_lock(&vc->lock);
+	if (range_overlap(vc->ra_start, vc->ra_len, offset, size))
+		vc->ra_len = 0;
+
+	if (vc->wb_len && offset == vc->wb_start + vc->wb_len &&
+	    vc->wb_start / SD_DATA_OBJ_SIZE == idx && offset + size <= obj_end)
+		goto append;
+
+	if (volume_cache_flush(vdi) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	/* Nothing to coalesce if the write spans objects */
+	if (offset + size > obj_end || size == SD_DATA_OBJ_SIZE) {
+		ret = volume_rw(vdi->vid, buf, size, offset, VOLUME_WRITE);
+		goto out;
+	}
+
+	if (!vc->wb_buf)
+		vc->wb_buf = xmalloc(SD_DATA_OBJ_SIZE);
+	vc->wb_start = offset;
+append:
+	memcpy(vc->wb_buf + vc->wb_len, buf, size);
+	vc->wb_len += size;
+	if (vc->wb_start + vc->wb_len == obj_end && volume_cache_flush(vdi) < 0)
+		ret = -1;
+out:
+	sd_mutex_unlock(&vc->lock);
+	return ret;
+}
+
+static struct vdi_inode *vdi_inode_lookup(uint32_t vid)
+{
+	struct vdi_inode *vdi;
+
+	sd_read_lock(&vdi_inode_tree_lock);
+	vdi = vdi_inode_tree_search(vid);
+	sd_rw_unlock(&vdi_inode_tree_lock);
+
+	return vdi;
+}
+
+static int volume_cache_sync(uint32_t vid)
+{
+	struct vdi_inode *vdi = vdi_inode_lookup(vid);
+	int ret;
+
+	if (!vdi)
+		return -1;
+
+	sd_mutex_lock(&vdi->cache.lock);
+	ret = volume_cache_flush(vdi);
+	sd_mutex_unlock(&vdi->cache.lock);
+
+	return ret;
+}
+
+static ssize_t volume_do_rw(const char *path, char *buf, size_t size,
+			    off_t offset, int rw)
+{
+	struct vdi_inode *vdi;
+	uint32_t vid;
+	size_t vdi_size;
+
+	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
+		return -1;
+
+	if (shadow_file_getxattr(path, SH_SIZE_NAME, &vdi_size, SH_SIZE_SIZE)
+	    < 0)
+		return -1;
+
+	if (offset >= vdi_size)
+		return 0;
+
+	if (offset + size > vdi_size)
+		size = vdi_size - offset;
+
+	if (!sheepfs_volume_cache || size == 0)
+		return volume_rw(vid, buf, size, offset, rw);
+
+	vdi = vdi_inode_lookup(vid);
+	if (!vdi)
+		return -1;
+
+	if (rw == VOLUME_READ)
+		return volume_cache_read(vdi, buf, size, offset, vdi_size);
+	return volume_cache_write(vdi, buf, size, offset);
+}
+
 int sheepfs_bnode_writer(uint64_t oid, void *mem, unsigned int len,
 			 uint64_t offset, uint32_t flags, int copies,
 			 int copy_policy, bool create, bool direct)
@@ -337,6 +518,9 @@ int volume_sync(const char *path)
 	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
 		return -EIO;
 
+	if (sheepfs_volume_cache && volume_cache_sync(vid) < 0)
+		return -EIO;
+
 	if (sheepfs_object_cache && volume_do_sync(vid) < 0)
 		return -EIO;
 
@@ -350,6 +534,22 @@ int volume_open(const char *path, struct fuse_file_info *fi)
 	return 0;
 }
 
+int volume_release(const char *path, struct fuse_file_info *fi)
+{
+	uint32_t vid;
+
+	if (!sheepfs_volume_cache)
+		return 0;
+
+	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
+		return -EIO;
+
+	if (volume_cache_sync(vid) < 0)
+		return -EIO;
+
+	return 0;
+}
+
 static void destroy_socket_pool(int array[], int len)
 {
 	int i;
@@ -420,6 +620,7 @@ static int init_vdi_info(const char *entry, uint32_t *vid, size_t *size)
 
 	inode = xzalloc(sizeof(*inode));
 	inode->vid = *vid;
+	sd_init_mutex(&inode->cache.lock);
 	if (setup_socket_pool(inode->socket_pool, SOCKET_POOL_SIZE) < 0) {
 		sheepfs_pr("failed to setup socket pool\n");
 		goto err;
@@ -525,6 +726,9 @@ int volume_remove_entry(const char *entry)
 	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
 		return -1;
 
+	if (sheepfs_volume_cache && volume_cache_sync(vid) < 0)
+		return -1;
+
 	if (sheepfs_object_cache && volume_sync_and_delete(vid) < 0)
 		return -1;
 
@@ -541,6 +745,9 @@ int volume_remove_entry(const char *entry)
 	rb_erase(&vdi->rb, &vdi_inode_tree);
 	sd_rw_unlock(&vdi_inode_tree_lock);
 
+	sd_destroy_mutex(&vdi->cache.lock);
+	free(vdi->cache.ra_buf);
+	free(vdi->cache.wb_buf);
 	free(vdi->inode);
 	free(vdi);
 	shadow_file_delete(path);
@@ -88,6 +88,39 @@ static int build_node_array(struct sd_node *nodes)
 	return i;
 }
 
+static int nr_joined_sheep(void)
+{
+	int nr = 0;
+	struct sheep *s;
+
+	list_for_each_entry(s, &sheep_list_head, sheep_list) {
+		if (s->state == SHEEP_STATE_JOINED)
+			nr++;
+	}
+
+	return nr;
+}
+
+/* pick one of the joined sheep at random, NULL if there is none */
+static struct sheep *elect_joined_sheep(void)
+{
+	int nr = nr_joined_sheep(), i = 0;
+	struct sheep *s;
+
+	if (nr == 0)
+		return NULL;
+
+	nr = rand() % nr;
+	list_for_each_entry(s, &sheep_list_head, sheep_list) {
+		if (s->state != SHEEP_STATE_JOINED)
+			continue;
+		if (i++ == nr)
+			return s;
+	}
+
+	return NULL;
+}
+
 static struct sheep *find_sheep_by_nid(struct node_id *id)
 {
 	struct sheep *s;
@@ -233,6 +266,7 @@ static void sph_handle_join(struct sph_msg *msg, struct sheep *sheep)
 
 	struct sph_msg snd;
 	struct sph_msg_join *join;
+	struct sheep *elected;
 
 	if (state == SPH_STATE_JOINING) {
 		/* we have to trash opaque from the sheep */
@@ -260,16 +294,17 @@ static void sph_handle_join(struct sph_msg *msg, struct sheep *sheep)
 	}
 
 	sheep->node = join->new_node;
-	join->nr_nodes = build_node_array(join->nodes);
 
 	snd.type = SPH_SRV_MSG_NEW_NODE;
 	snd.body_len = msg->body_len;
 
-	/* elect one node from the already joined nodes */
-	if (join->nr_nodes > 0) {
-		struct sd_node *n = join->nodes + rand() % join->nr_nodes;
-		fd = find_sheep_by_nid(&n->nid)->fd;
-	}
+	/*
+	 * elect one node from the already joined nodes, it checks the joining
+	 * node against its own member list
+	 */
+	elected = elect_joined_sheep();
+	if (elected)
+		fd = elected->fd;
 
 	wbytes = writev2(fd, &snd, join, msg->body_len);
 	free(join);
@@ -293,7 +328,7 @@ static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 	ssize_t rbytes, wbytes;
 
 	char *opaque;
-	int opaque_len;
+	int opaque_len, nr_nodes;
 
 	struct sph_msg_join *join;
 	struct sheep *s, *joining_sheep;
@@ -322,20 +357,23 @@ static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 	memcpy(opaque, join->opaque, opaque_len);
 
 	sd_debug("length of opaque: %d", opaque_len);
+	/*
+	 * the joining sheep is in state SHEEP_STATE_CONNECTED, so it isn't
+	 * counted by nr_joined_sheep() and has to be appended by hand
+	 */
+	nr_nodes = nr_joined_sheep() + 1;
+
 	memset(&snd, 0, sizeof(snd));
 	snd.type = SPH_SRV_MSG_JOIN_REPLY;
-	snd.body_len = sizeof(struct sph_msg_join_reply) + opaque_len;
+	snd.body_len = sizeof(struct sph_msg_join_reply) +
+		nr_nodes * sizeof(struct sd_node) + opaque_len;
 
 	join_reply_body = xzalloc(snd.body_len);
 
 	join_reply_body->nr_nodes = build_node_array(join_reply_body->nodes);
-	/*
-	 * the below copy is required because joining sheep is in state
-	 * SHEEP_STATE_CONNECTED
-	 */
 	join_reply_body->nodes[join_reply_body->nr_nodes++] =
 		joining_sheep->node;
-	memcpy(join_reply_body->opaque, opaque, opaque_len);
+	memcpy(sph_join_reply_opaque(join_reply_body), opaque, opaque_len);
 
 	wbytes = writev2(joining_sheep->fd, &snd,
 			join_reply_body, snd.body_len);
@@ -348,15 +386,13 @@ static void sph_handle_accept(struct sph_msg *msg, struct sheep *sheep)
 		goto purge_current_sheep;
 	}
 
+	/* the other sheep know the members, send them only the new one */
 	snd.type = SPH_SRV_MSG_NEW_NODE_FINISH;
 	snd.body_len = sizeof(*join_node_finish) + opaque_len;
 
 	join_node_finish = xzalloc(snd.body_len);
 	join_node_finish->new_node = joining_sheep->node;
 	memcpy(join_node_finish->opaque, opaque, opaque_len);
-	join_node_finish->nr_nodes = build_node_array(join_node_finish->nodes);
-	join_node_finish->nodes[join_node_finish->nr_nodes++] =
-		joining_sheep->node;
 
 	list_for_each_entry(s, &sheep_list_head, sheep_list) {
 		if (s->state != SHEEP_STATE_JOINED)
@@ -0,0 +1,289 @@
+"""Concurrent load generator for SD_OP_* requests
+
+LoadGenerator opens many connections to a sheep and keeps a number of
+requests in flight on each of them, chosen at random from a profile of
+weighted operations.  Sheep answers the requests of a connection in any
+order, so the responses are matched with the requests by their ids.  The
+latency of each request is recorded from its send to its response.
+
+The operations are:
+    read          SD_OP_READ_OBJ of a data object of the connection
+    write         SD_OP_WRITE_OBJ of a data object of the connection
+    create        SD_OP_NEW_VDI of a new VDI
+    lock          SD_OP_LOCK_VDI and SD_OP_RELEASE_VDI of the VDI of the
+                  connection, in turn
+    get_vdi_info  SD_OP_GET_VDI_INFO of the VDI of the connection
+
+Each connection has a VDI of its own with a few data objects, made by
+setup().  A lock may find the VDI still locked, or a release find it not
+locked yet, when both are in flight; such results are counted as errors of
+the operation and do not stop the load.
+
+e.g. $ python load.py --connections 16 --depth 8 --requests 10000 \\
+         --profile read=4,write=2,lock=1,get_vdi_info=1
+"""
+
+import optparse
+import random
+import socket
+import struct
+import threading
+import time
+
+import proto
+import sheep
+
+
+OPS = ('read', 'write', 'create', 'lock', 'get_vdi_info')
+DEFAULT_PROFILE = {'read': 4, 'write': 2, 'create': 1, 'lock': 1,
+                   'get_vdi_info': 1}
+
+
+def ParseProfile(text):
+    profile = {}
+    for item in text.split(','):
+        (op, weight) = item.split('=')
+        if op not in OPS:
+            raise ValueError('unknown operation %s' % op)
+        profile[op] = int(weight)
+    return profile
+
+
+class LatencyRecorder(object):
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self.latencies = {}
+        self.errors = {}
+
+    def record(self, op, latency, result):
+        with self._lock:
+            self.latencies.setdefault(op, []).append(latency)
+            if result != proto.SD_RES_SUCCESS:
+                errors = self.errors.setdefault(op, {})
+                errors[result] = errors.get(result, 0) + 1
+
+    def summary(self, elapsed):
+        """Return a dict of the statistics of each operation, in usec"""
+        stats = {}
+        for op, latencies in self.latencies.items():
+            latencies = sorted(latencies)
+            nr = len(latencies)
+
+            def _percentile(p):
+                return latencies[min(nr - 1, int(nr * p / 100))] * 1000000
+
+            stats[op] = {
+                'ops': nr,
+                'ops_per_sec': nr / elapsed,
+                'errors': sum(self.errors.get(op, {}).values()),
+                'avg_us': sum(latencies) / nr * 1000000,
+                'p50_us': _percentile(50),
+                'p99_us': _percentile(99),
+                'p999_us': _percentile(99.9),
+                'max_us': latencies[-1] * 1000000,
+            }
+        return stats
+
+
+class LoadConnection(object):
+    UINT32_MAX = 2 ** 32
+
+    def __init__(self, generator, index):
+        self.generator = generator
+        self.index = index
+        self.vdiname = '%s%d' % (generator.vdi_prefix, index)
+        self.vid = 0
+        self.locked = False
+        self.nr_created = 0
+        self._conn = sheep.Connection(generator.host, generator.port)
+        self._seq_id = random.randint(1, self.UINT32_MAX - 1)
+        self._random = random.Random(generator.seed + index)
+        self._inflight = {}
+
+    def setup(self):
+        client = sheep.SheepdogClient(self.generator.host, self.generator.port)
+        self.vid = client.new_vdi(self.vdiname,
+                                  self.generator.nr_objects *
+                                  proto.SD_DATA_OBJ_SIZE)
+        data = '\0' * self.generator.block_size
+        for idx in range(self.generator.nr_objects):
+            client.create_and_write_obj(self._data_oid(idx), data, 0)
+
+    def _data_oid(self, idx):
+        return (self.vid << proto.VDI_SPACE_SHIFT) + idx
+
+    def _random_offset(self):
+        nr_blocks = proto.SD_DATA_OBJ_SIZE / self.generator.block_size
+        return self._random.randrange(nr_blocks) * self.generator.block_size
+
+    def _make_request(self, op):
+        req = sheep.Request()
+        if op == 'read':
+            req.opcode = proto.SD_OP_READ_OBJ
+            req.data_length = self.generator.block_size
+            req.obj.oid = self._data_oid(
+                self._random.randrange(self.generator.nr_objects))
+            req.obj.offset = self._random_offset()
+        elif op == 'write':
+            req.opcode = proto.SD_OP_WRITE_OBJ
+            req.flags = proto.SD_FLAG_CMD_WRITE
+            req.data = self.generator.payload
+            req.data_length = len(req.data)
+            req.obj.oid = self._data_oid(
+                self._random.randrange(self.generator.nr_objects))
+            req.obj.offset = self._random_offset()
+        elif op == 'create':
+            self.nr_created += 1
+            req.opcode = proto.SD_OP_NEW_VDI
+            req.flags = proto.SD_FLAG_CMD_WRITE
+            req.data_length = proto.SD_MAX_VDI_LEN
+            req.data = struct.pack('<256s', '%s-%d' % (self.vdiname,
+                                                       self.nr_created))
+            req.vdi.vdi_size = proto.SD_DATA_OBJ_SIZE
+        elif op == 'lock' and not self.locked:
+            self.locked = True
+            req.opcode = proto.SD_OP_LOCK_VDI
+            req.flags = proto.SD_FLAG_CMD_WRITE
+            req.data_length = proto.SD_MAX_VDI_LEN
+            req.data = struct.pack('<256s', self.vdiname)
+            req.vdi.type = proto.LOCK_TYPE_NORMAL
+        elif op == 'lock':
+            self.locked = False
+            op = 'release'
+            req.opcode = proto.SD_OP_RELEASE_VDI
+            req.vdi.base_vdi_id = self.vid
+            req.vdi.type = proto.LOCK_TYPE_NORMAL
+        elif op == 'get_vdi_info':
+            req.opcode = proto.SD_OP_GET_VDI_INFO
+            req.flags = proto.SD_FLAG_CMD_WRITE
+            req.data_length = 512
+            req.data = struct.pack('<256s256s', self.vdiname, '')
+        return (op, req)
+
+    def _send(self):
+        (op, req) = self._make_request(self.generator.choose(self._random))
+        self._seq_id = (self._seq_id + 1) % self.UINT32_MAX
+        req.id = self._seq_id
+        self._inflight[req.id] = (op, time.time())
+        self._conn.sendall(req.serialize())
+
+    def _receive(self):
+        rsp = sheep.Response(self._conn.recvall(sheep.Response.size))
+        if rsp.result == proto.SD_RES_SUCCESS:
+            self._conn.recvall(rsp.data_length)
+        (op, sent) = self._inflight.pop(rsp.id)
+        self.generator.recorder.record(op, time.time() - sent, rsp.result)
+
+    def run(self):
+        try:
+            while True:
+                while (len(self._inflight) < self.generator.depth and
+                       self.generator.take()):
+                    self._send()
+                if not self._inflight:
+                    break
+                self._receive()
+        except (socket.error, KeyError) as e:
+            self.generator.failures.append(e)
+
+
+class LoadGenerator(object):
+
+    def __init__(self, host='127.0.0.1', port=7000, nr_connections=8,
+                 depth=4, profile=None, block_size=4096, nr_objects=4,
+                 vdi_prefix='load', seed=0):
+        self.host = host
+        self.port = port
+        self.depth = depth
+        self.block_size = block_size
+        self.nr_objects = nr_objects
+        self.vdi_prefix = vdi_prefix
+        self.seed = seed
+        self.payload = '\xa5' * block_size
+        self.recorder = LatencyRecorder()
+        self.failures = []
+
+        self._ops = []
+        for op, weight in (profile or DEFAULT_PROFILE).items():
+            self._ops.extend([op] * weight)
+        self._lock = threading.Lock()
+        self._remaining = 0
+        self._deadline = None
+        self._connections = [LoadConnection(self, i)
+                             for i in range(nr_connections)]
+
+    def setup(self):
+        """Make the VDI and the data objects of each connection"""
+        for conn in self._connections:
+            conn.setup()
+
+    def choose(self, rand):
+        return rand.choice(self._ops)
+
+    def take(self):
+        with self._lock:
+            if self._deadline is not None:
+                return time.time() < self._deadline
+            if self._remaining == 0:
+                return False
+            self._remaining -= 1
+            return True
+
+    def run(self, nr_requests=None, duration=None):
+        """Send nr_requests requests, or send them for duration seconds
+
+        Return the statistics of each operation, see LatencyRecorder.
+        """
+        if duration is not None:
+            self._deadline = time.time() + duration
+        else:
+            self._remaining = nr_requests
+
+        threads = [threading.Thread(target=conn.run)
+                   for conn in self._connections]
+        start = time.time()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        return self.recorder.summary(time.time() - start)
+
+
+def PrintSummary(stats):
+    for op in sorted(stats):
+        s = stats[op]
+        print ('name=%s ops=%d ops_per_sec=%.0f errors=%d avg_us=%.0f '
+               'p50_us=%.0f p99_us=%.0f p999_us=%.0f max_us=%.0f' %
+               (op, s['ops'], s['ops_per_sec'], s['errors'], s['avg_us'],
+                s['p50_us'], s['p99_us'], s['p999_us'], s['max_us']))
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('-a', '--address', default='127.0.0.1')
+    parser.add_option('-p', '--port', type='int', default=7000)
+    parser.add_option('-c', '--connections', type='int', default=8)
+    parser.add_option('-q', '--depth', type='int', default=4,
+                      help='requests in flight on each connection')
+    parser.add_option('-n', '--requests', type='int', default=10000)
+    parser.add_option('-t', '--duration', type='float',
+                      help='run for seconds instead of a number of requests')
+    parser.add_option('-b', '--block-size', type='int', default=4096)
+    parser.add_option('-P', '--profile',
+                      help='weights of the operations, e.g. read=4,lock=1')
+    (opts, args) = parser.parse_args()
+
+    profile = None
+    if opts.profile:
+        profile = ParseProfile(opts.profile)
+    generator = LoadGenerator(opts.address, opts.port, opts.connections,
+                              opts.depth, profile, opts.block_size)
+    generator.setup()
+    PrintSummary(generator.run(opts.requests, opts.duration))
+    for e in generator.failures:
+        print ('connection failed: %s' % e)
+
+
+if __name__ == '__main__':
+    main()
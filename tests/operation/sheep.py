@@ -326,6 +326,34 @@ class SheepdogClient(object):
     def find_vdi(self, vdiname):
         return SheepdogVDI(self, self.find_inode(vdiname))
 
+    def new_vdi(self, vdiname, vdi_size, copies=0):
+        req = Request()
+        req.opcode = proto.SD_OP_NEW_VDI
+        req.flags = proto.SD_FLAG_CMD_WRITE
+        req.data_length = proto.SD_MAX_VDI_LEN
+        req.data = struct.pack('<256s', vdiname)
+        req.vdi.vdi_size = vdi_size
+        req.vdi.copies = copies
+        rsp = self._call(req)
+        return rsp.vdi.vdi_id
+
+    def lock_vdi(self, vdiname, lock_type=proto.LOCK_TYPE_NORMAL):
+        req = Request()
+        req.opcode = proto.SD_OP_LOCK_VDI
+        req.flags = proto.SD_FLAG_CMD_WRITE
+        req.data_length = proto.SD_MAX_VDI_LEN
+        req.data = struct.pack('<256s', vdiname)
+        req.vdi.type = lock_type
+        rsp = self._call(req)
+        return rsp.vdi.vdi_id
+
+    def release_vdi(self, vid, lock_type=proto.LOCK_TYPE_NORMAL):
+        req = Request()
+        req.opcode = proto.SD_OP_RELEASE_VDI
+        req.vdi.base_vdi_id = vid
+        req.vdi.type = lock_type
+        return self._call(req)
+
     def get_obj_list(self, data_length, epoch):
         req = Request()
         req.opcode = proto.SD_OP_GET_OBJ_LIST
@@ -0,0 +1,62 @@
+import unittest
+
+import time
+
+import fixture
+import load
+
+
+class ThreeNodesLoadTest(unittest.TestCase):
+    _NR_NODES = 3
+    _COPIES = 2
+    _ports = []
+    _disks = []
+
+    @classmethod
+    def setUpClass(clazz):
+        for i in range(clazz._NR_NODES):
+            t = fixture.CreateSheepdogDisk(1024 ** 3)
+            p = i + 7000
+            z = i + 1
+            fixture.StartSheep(t[1], port=p, zone=z)
+            clazz._ports.append(p)
+            clazz._disks.append(t)
+        time.sleep(2)
+
+    @classmethod
+    def tearDownClass(clazz):
+        fixture.ShutdownCluster()
+        time.sleep(2)
+        for t in clazz._disks:
+            fixture.DestroySheepdogDisk(t[0], t[1])
+
+    def setUp(self):
+        fixture.ForceFormatCluster(self.__class__._COPIES)
+
+    def testMixedLoad(self):
+        generator = load.LoadGenerator(nr_connections=8, depth=4)
+        generator.setup()
+        stats = generator.run(nr_requests=2000)
+        load.PrintSummary(stats)
+
+        self.assertEqual([], generator.failures)
+        self.assertEqual(2000, sum(s['ops'] for s in stats.values()))
+        for op in ('read', 'write', 'create', 'get_vdi_info'):
+            self.assertIn(op, stats)
+            self.assertEqual(0, stats[op]['errors'])
+
+    def testLookupLoad(self):
+        profile = load.ParseProfile('lock=1,get_vdi_info=1')
+        generator = load.LoadGenerator(nr_connections=16, depth=8,
+                                       profile=profile, vdi_prefix='lookup')
+        generator.setup()
+        stats = generator.run(duration=2)
+        load.PrintSummary(stats)
+
+        self.assertEqual([], generator.failures)
+        self.assertEqual(0, stats['get_vdi_info']['errors'])
+        self.assertIn('lock', stats)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2015 China Mobile Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Micro-benchmarks of the hot path primitives
+ *
+ * Every benchmark runs a fixed number of iterations with a fixed seed, so the
+ * results of two builds can be compared directly.  One line is printed per
+ * benchmark:
+ *
+ *   name=<benchmark> iterations=<n> ns_per_op=<nsec> [mb_per_sec=<MB/s>]
+ *
+ * The benchmarks to run can be selected by giving their names as arguments.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "sheep.h"
+#include "fec.h"
+#include "sha1.h"
+#include "net.h"
+#include "sockfd_cache.h"
+#include "work.h"
+#include "event.h"
+#include "memscan.h"
+
+#define BENCH_SEED 0x5eed5eed5eed5eedULL
+
+/* xorshift64*, good enough to pick oids and indexes */
+static uint64_t bench_rand(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t iterations, uint64_t nsec,
+		   uint64_t bytes_per_op)
+{
+	printf("name=%s iterations=%"PRIu64" ns_per_op=%.1f", name, iterations,
+	       (double)nsec / iterations);
+	if (bytes_per_op)
+		printf(" mb_per_sec=%.1f", (double)bytes_per_op * iterations *
+		       1000 / nsec);
+	printf("\n");
+}
+
+/* The placement of 3 copies on a cluster of 64 nodes in 8 zones */
+#define BENCH_NR_NODES 64
+#define BENCH_NR_ZONES 8
+#define OID_TO_VNODES_LOOPS 1000000
+
+static void bench_oid_to_vnodes(void)
+{
+	struct sd_node *nodes = xzalloc(sizeof(*nodes) * BENCH_NR_NODES);
+	struct rb_root nroot = RB_ROOT, vroot = RB_ROOT;
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	uint64_t seed = BENCH_SEED, start;
+
+	for (int i = 0; i < BENCH_NR_NODES; i++) {
+		str_to_addr("127.0.0.1", nodes[i].nid.addr);
+		nodes[i].nid.port = 7000 + i;
+		nodes[i].nr_vnodes = 128;
+		nodes[i].zone = i % BENCH_NR_ZONES;
+		rb_insert(&nroot, &nodes[i], rb, node_cmp);
+	}
+	nodes_to_vnodes(&nroot, &vroot);
+
+	start = now_nsec();
+	for (int i = 0; i < OID_TO_VNODES_LOOPS; i++) {
+		uint32_t vid = bench_rand(&seed) % SD_NR_VDIS;
+		uint64_t oid = vid_to_data_oid(vid, bench_rand(&seed) %
+					       MAX_DATA_OBJS);
+
+		oid_to_vnodes(oid, &vroot, 1, 3, vnodes);
+	}
+	report("oid_to_vnodes", OID_TO_VNODES_LOOPS, now_nsec() - start, 0);
+
+	rb_destroy(&vroot, struct sd_vnode, rb);
+	free(nodes);
+}
+
+/* B-tree nodes live in memory, indexed by the counter part of their oids */
+#define BENCH_MAX_BNODES 4096
+
+static void *bnodes[BENCH_MAX_BNODES];
+
+static int bench_bnode_writer(uint64_t oid, void *mem, unsigned int len,
+			      uint64_t offset, uint32_t flags, int copies,
+			      int copy_policy, bool create, bool direct)
+{
+	uint32_t idx = oid & (BENCH_MAX_BNODES - 1);
+
+	/* The inode itself is kept by the caller */
+	if (is_vdi_obj(oid))
+		return SD_RES_SUCCESS;
+
+	if (data_oid_to_idx(oid) >= BENCH_MAX_BNODES)
+		panic("too many B-tree nodes");
+	if (!bnodes[idx])
+		bnodes[idx] = xzalloc(SD_INODE_DATA_INDEX_SIZE);
+	memcpy((char *)bnodes[idx] + offset, mem, len);
+	return SD_RES_SUCCESS;
+}
+
+static int bench_bnode_reader(uint64_t oid, void **mem, unsigned int len,
+			      uint64_t offset)
+{
+	uint32_t idx = oid & (BENCH_MAX_BNODES - 1);
+
+	if (!bnodes[idx])
+		return SD_RES_NO_OBJ;
+
+	memcpy(*mem, (char *)bnodes[idx] + offset, len);
+	return SD_RES_SUCCESS;
+}
+
+#define INODE_GET_VID_LOOPS 1000000
+
+static void __bench_inode_get_vid(const char *name, uint8_t store_policy,
+				  uint32_t nr_objs)
+{
+	struct sd_inode *inode = xzalloc(sizeof(*inode));
+	uint64_t seed = BENCH_SEED, start;
+	uint32_t sum = 0;
+
+	inode->vdi_id = 1;
+	inode->store_policy = store_policy;
+	for (uint32_t i = 0; i < nr_objs; i++)
+		sd_inode_set_vid(inode, i, 1 + i % 7);
+
+	start = now_nsec();
+	for (int i = 0; i < INODE_GET_VID_LOOPS; i++)
+		sum += sd_inode_get_vid(inode, bench_rand(&seed) % nr_objs);
+	report(name, INODE_GET_VID_LOOPS, now_nsec() - start, 0);
+
+	if (!sum)
+		panic("no vid found");
+	sd_inode_invalidate_cache(inode->vdi_id);
+	free(inode);
+}
+
+static void bench_inode_get_vid(void)
+{
+	sd_inode_actor_init(bench_bnode_writer, bench_bnode_reader);
+
+	__bench_inode_get_vid("sd_inode_get_vid", 0, SD_INODE_DATA_INDEX);
+	__bench_inode_get_vid("sd_inode_get_vid_btree", 1, 1 << 16);
+
+	for (int i = 0; i < BENCH_MAX_BNODES; i++) {
+		free(bnodes[i]);
+		bnodes[i] = NULL;
+	}
+}
+
+/* Encode 4:2 stripes of a 4 MB data object, the default erasure code */
+#define EC_LOOPS 64
+
+static void bench_ec_encode(void)
+{
+	int d = 4, p = 2;
+	size_t len = SD_DATA_OBJ_SIZE / d;
+	struct fec *ctx = ec_init(d, d + p);
+	const uint8_t *ds[SD_EC_MAX_STRIP];
+	uint8_t *ps[SD_EC_MAX_STRIP];
+	uint64_t seed = BENCH_SEED, start;
+
+	for (int i = 0; i < d; i++) {
+		uint64_t *buf = xvalloc(len);
+
+		for (size_t j = 0; j < len / sizeof(*buf); j++)
+			buf[j] = bench_rand(&seed);
+		ds[i] = (uint8_t *)buf;
+	}
+	for (int i = 0; i < p; i++)
+		ps[i] = xvalloc(len);
+
+	start = now_nsec();
+	for (int i = 0; i < EC_LOOPS; i++)
+		ec_encode_buffer(ctx, ds, ps, len);
+	report("ec_encode", EC_LOOPS, now_nsec() - start, SD_DATA_OBJ_SIZE);
+
+	for (int i = 0; i < d; i++)
+		free((void *)ds[i]);
+	for (int i = 0; i < p; i++)
+		free(ps[i]);
+	ec_destroy(ctx);
+}
+
+#define SHA1_BUF_SIZE (64 * 1024)
+#define SHA1_LOOPS 4096
+
+static void bench_sha1(void)
+{
+	uint64_t *buf = xmalloc(SHA1_BUF_SIZE);
+	uint64_t seed = BENCH_SEED, start;
+	struct sha1_ctx c;
+	uint8_t sha1[SHA1_DIGEST_SIZE];
+
+	for (int i = 0; i < SHA1_BUF_SIZE / sizeof(*buf); i++)
+		buf[i] = bench_rand(&seed);
+
+	start = now_nsec();
+	for (int i = 0; i < SHA1_LOOPS; i++) {
+		sha1_init(&c);
+		sha1_update(&c, (uint8_t *)buf, SHA1_BUF_SIZE);
+		sha1_final(&c, sha1);
+	}
+	report("sha1_update", SHA1_LOOPS, now_nsec() - start, SHA1_BUF_SIZE);
+
+	free(buf);
+}
+
+/* A zero object, which the scans read through, as of a create of a hole */
+#define ZERO_BUF_SIZE SD_DATA_OBJ_SIZE
+#define ZERO_LOOPS 256
+
+static void bench_find_nonzero(void)
+{
+	uint8_t *buf = xzalloc(ZERO_BUF_SIZE);
+	uint64_t offset, start;
+	uint32_t len;
+
+	start = now_nsec();
+	for (int i = 0; i < ZERO_LOOPS; i++)
+		if (!is_zero_buffer(buf, ZERO_BUF_SIZE))
+			panic("the buffer is not zero");
+	report("find_nonzero", ZERO_LOOPS, now_nsec() - start, ZERO_BUF_SIZE);
+
+	start = now_nsec();
+	for (int i = 0; i < ZERO_LOOPS; i++) {
+		offset = 0;
+		len = ZERO_BUF_SIZE;
+		find_zero_blocks(buf, &offset, &len);
+	}
+	report("find_zero_blocks", ZERO_LOOPS, now_nsec() - start,
+	       ZERO_BUF_SIZE);
+
+	free(buf);
+}
+
+/* The cached connections are made to a local socket which never accepts */
+#define SOCKFD_CACHE_LOOPS 1000000
+
+static void bench_sockfd_cache(void)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	socklen_t sinlen = sizeof(sin);
+	struct node_id nid = {};
+	uint64_t start;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &sinlen) < 0)
+		panic("failed to listen on a local port, %m");
+
+	str_to_addr("127.0.0.1", nid.addr);
+	nid.port = ntohs(sin.sin_port);
+
+	start = now_nsec();
+	for (int i = 0; i < SOCKFD_CACHE_LOOPS; i++) {
+		struct sockfd *sfd = sockfd_cache_get(&nid);
+
+		if (!sfd)
+			panic("failed to get a cached connection");
+		sockfd_cache_put(&nid, sfd);
+	}
+	report("sockfd_cache_get_put", SOCKFD_CACHE_LOOPS, now_nsec() - start,
+	       0);
+
+	sockfd_cache_del_node(&nid);
+	close(fd);
+}
+
+/* Round trips of empty works, from queue_work() to their done callbacks */
+#define QUEUE_WORK_LOOPS 100000
+#define QUEUE_WORK_THREADS 4
+
+static int nr_works_done;
+
+static void bench_work_fn(struct work *work)
+{
+}
+
+static void bench_work_done(struct work *work)
+{
+	nr_works_done++;
+}
+
+static void bench_queue_work(void)
+{
+	struct work *works = xzalloc(sizeof(*works) * QUEUE_WORK_LOOPS);
+	struct work_queue *wq;
+	uint64_t start;
+
+	wq = create_fixed_work_queue("bench", QUEUE_WORK_THREADS);
+
+	start = now_nsec();
+	for (int i = 0; i < QUEUE_WORK_LOOPS; i++) {
+		works[i].fn = bench_work_fn;
+		works[i].done = bench_work_done;
+		queue_work(wq, works + i);
+	}
+	while (nr_works_done < QUEUE_WORK_LOOPS)
+		event_loop(-1);
+	report("queue_work", QUEUE_WORK_LOOPS, now_nsec() - start, 0);
+
+	free(works);
+}
+
+static const struct bench {
+	const char *name;
+	void (*fn)(void);
+} benches[] = {
+	{ "oid_to_vnodes", bench_oid_to_vnodes },
+	{ "sd_inode_get_vid", bench_inode_get_vid },
+	{ "ec_encode", bench_ec_encode },
+	{ "sha1_update", bench_sha1 },
+	{ "find_nonzero", bench_find_nonzero },
+	{ "sockfd_cache", bench_sockfd_cache },
+	{ "queue_work", bench_queue_work },
+};
+
+static bool selected(const char *name, int argc, char **argv)
+{
+	if (argc == 1)
+		return true;
+
+	for (int i = 1; i < argc; i++)
+		if (!strcmp(argv[i], name))
+			return true;
+
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	init_fec();
+	if (init_event(4096) < 0 || init_work_queue(NULL) < 0) {
+		fprintf(stderr, "failed to initialize the work queue\n");
+		return 1;
+	}
+
+	for (int i = 0; i < ARRAY_SIZE(benches); i++)
+		if (selected(benches[i].name, argc, argv))
+			benches[i].fn();
+
+	return 0;
+}
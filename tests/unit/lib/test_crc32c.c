@@ -0,0 +1,39 @@
+#include <stdlib.h>
+#include <unity.h>
+
+#include "crc32c.h"
+
+static void test_crc32c_check_value(void)
+{
+	TEST_ASSERT_EQUAL_HEX32(0, crc32c(0, NULL, 0));
+	TEST_ASSERT_EQUAL_HEX32(0xe3069283, crc32c(0, "123456789", 9));
+	/* the crc of discontiguous buffers */
+	TEST_ASSERT_EQUAL_HEX32(0xe3069283,
+				crc32c(crc32c(0, "1234", 4), "56789", 5));
+}
+
+static void test_crc32c_combine(void)
+{
+	static uint8_t buf[1 << 17];
+	uint32_t whole, head, tail;
+
+	for (size_t i = 0; i < sizeof(buf); i++)
+		buf[i] = random();
+	whole = crc32c(0, buf, sizeof(buf));
+
+	for (size_t off = 0; off <= sizeof(buf); off += 4093) {
+		head = crc32c(0, buf, off);
+		tail = crc32c(0, buf + off, sizeof(buf) - off);
+		TEST_ASSERT_EQUAL_HEX32(whole, crc32c_combine(head, tail,
+							sizeof(buf) - off));
+	}
+	TEST_ASSERT_EQUAL_HEX32(whole, crc32c_combine(whole, 0, 0));
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_crc32c_check_value);
+	RUN_TEST(test_crc32c_combine);
+	return UNITY_END();
+}
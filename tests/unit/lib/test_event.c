@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <unity.h>
+#include <cmock.h>
+
+#include "util.h"
+#include "event.h"
+
+/* define at sheep/sheep.c */
+#define EPOLL_SIZE 4096
+
+static int fired[8];
+static int nr_fired;
+
+static void timer_fn(void *data)
+{
+	fired[nr_fired++] = (int)(unsigned long)data;
+}
+
+static uint64_t now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wait_timers(int nr)
+{
+	while (nr_fired < nr)
+		event_loop(-1);
+}
+
+static void test_init_event(void)
+{
+	TEST_ASSERT_EQUAL_INT(0, init_event(EPOLL_SIZE));
+}
+
+static void test_timers_fire_in_order(void)
+{
+	struct timer t[3] = {
+		{ .callback = timer_fn, .data = (void *)2 },
+		{ .callback = timer_fn, .data = (void *)0 },
+		{ .callback = timer_fn, .data = (void *)1 },
+	};
+	uint64_t start = now_msec();
+
+	nr_fired = 0;
+	/* the last one is cascaded from the second level of the wheel */
+	add_timer(&t[0], 300);
+	add_timer(&t[1], 0);
+	add_timer(&t[2], 20);
+	wait_timers(3);
+
+	TEST_ASSERT_EQUAL_INT(0, fired[0]);
+	TEST_ASSERT_EQUAL_INT(1, fired[1]);
+	TEST_ASSERT_EQUAL_INT(2, fired[2]);
+	TEST_ASSERT_TRUE(now_msec() - start >= 300);
+}
+
+static void test_del_timer(void)
+{
+	struct timer t[2] = {
+		{ .callback = timer_fn, .data = (void *)0 },
+		{ .callback = timer_fn, .data = (void *)1 },
+	};
+
+	nr_fired = 0;
+	add_timer(&t[0], 10);
+	add_timer(&t[1], 30);
+	del_timer(&t[0]);
+	wait_timers(1);
+
+	TEST_ASSERT_EQUAL_INT(1, nr_fired);
+	TEST_ASSERT_EQUAL_INT(1, fired[0]);
+}
+
+static void test_add_pending_timer_reschedules_it(void)
+{
+	struct timer t[2] = {
+		{ .callback = timer_fn, .data = (void *)0 },
+		{ .callback = timer_fn, .data = (void *)1 },
+	};
+
+	nr_fired = 0;
+	add_timer(&t[0], 10);
+	add_timer(&t[1], 30);
+	add_timer(&t[0], 50);
+	wait_timers(2);
+
+	TEST_ASSERT_EQUAL_INT(2, nr_fired);
+	TEST_ASSERT_EQUAL_INT(1, fired[0]);
+	TEST_ASSERT_EQUAL_INT(0, fired[1]);
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+
+	RUN_TEST(test_init_event);
+	RUN_TEST(test_timers_fire_in_order);
+	RUN_TEST(test_del_timer);
+	RUN_TEST(test_add_pending_timer_reschedules_it);
+
+	return UNITY_END();
+}
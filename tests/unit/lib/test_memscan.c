@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#include "memscan.h"
+
+#define BUF_SIZE 4096
+
+static uint8_t a[BUF_SIZE], b[BUF_SIZE];
+
+static size_t ref_forward(const uint8_t *x, const uint8_t *y, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (x[i] != (y ? y[i] : 0))
+			break;
+	return i;
+}
+
+static size_t ref_backward(const uint8_t *x, const uint8_t *y, size_t len)
+{
+	size_t i;
+
+	for (i = len; i > 0; i--)
+		if (x[i - 1] != (y ? y[i - 1] : 0))
+			break;
+	return i;
+}
+
+/* every start and length around the widths of the vectors */
+static void check_ranges(void)
+{
+	for (size_t start = 0; start < 40; start += 3)
+		for (size_t len = 0; start + len <= BUF_SIZE; len += 61) {
+			const uint8_t *x = a + start, *y = b + start;
+
+			TEST_ASSERT_EQUAL(ref_forward(x, NULL, len),
+					  find_nonzero(x, len));
+			TEST_ASSERT_EQUAL(ref_backward(x, NULL, len),
+					  find_last_nonzero(x, len));
+			TEST_ASSERT_EQUAL(ref_forward(x, y, len),
+					  find_mismatch(x, y, len));
+			TEST_ASSERT_EQUAL(ref_backward(x, y, len),
+					  find_last_mismatch(x, y, len));
+			TEST_ASSERT_EQUAL(ref_forward(x, NULL, len) == len,
+					  is_zero_buffer(x, len));
+		}
+}
+
+static void test_memscan_zero(void)
+{
+	memset(a, 0, sizeof(a));
+	memset(b, 0, sizeof(b));
+	check_ranges();
+}
+
+static void test_memscan_single_byte(void)
+{
+	for (size_t pos = 0; pos < BUF_SIZE; pos += 97) {
+		memset(a, 0, sizeof(a));
+		memcpy(b, a, sizeof(b));
+		a[pos] = 0x80;
+		check_ranges();
+	}
+}
+
+static void test_memscan_random(void)
+{
+	for (size_t i = 0; i < BUF_SIZE; i++)
+		a[i] = b[i] = (i > 1000 && i < 3000) ? random() : 0;
+	b[1500] ^= 1;
+	b[2500] ^= 1;
+	check_ranges();
+}
+
+int main(int argc, char **argv)
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_memscan_zero);
+	RUN_TEST(test_memscan_single_byte);
+	RUN_TEST(test_memscan_random);
+	return UNITY_END();
+}
@@ -346,6 +346,7 @@ static size_t gen_many_vdisks(struct disk *disks, int idx)
 
 	snprintf(disks[0].path, sizeof(disks[0].path), "/%x", idx);
 	disks[0].space = MD_VDISK_SIZE * DATA_SIZE;
+	disks[0].weight = 100;
 
 	return 1;
 }
@@ -364,6 +365,7 @@ static size_t gen_many_disks_one_vdisk(struct disk *disks, int idx)
 		snprintf(disks[i].path, sizeof(disks[i].path),
 			 "/%x/%x", idx, i);
 		disks[i].space = MD_VDISK_SIZE;
+		disks[i].weight = 100;
 	}
 
 	return DATA_SIZE;
@@ -383,6 +385,7 @@ static size_t gen_many_disks_some_vdisks(struct disk *disks, int idx)
 		snprintf(disks[i].path, sizeof(disks[i].path),
 			 "/%x/%x", idx, i);
 		disks[i].space = MD_VDISK_SIZE * 4;
+		disks[i].weight = 100;
 	}
 
 	return DATA_SIZE / 4;
@@ -476,6 +479,34 @@ START_TEST(test_disks_update)
 }
 END_TEST
 
+START_TEST(test_disks_weight)
+{
+	size_t nr_vdisks;
+	size_t nr_vdisks_after;
+	struct disk disk;
+	struct vdisk vdisks[DATA_SIZE];
+	struct vdisk vdisks_after[DATA_SIZE];
+
+	gen_disks(&disk, 0);
+
+	INIT_RB_ROOT(&md.vroot);
+	create_vdisks(&disk);
+	nr_vdisks = get_vdisks_array(vdisks);
+
+	/* halve the weight, the disk keeps half of its vdisks */
+	remove_vdisks(&disk);
+	disk.weight = 50;
+	create_vdisks(&disk);
+	nr_vdisks_after = get_vdisks_array(vdisks_after);
+	ck_assert_int_eq(nr_vdisks_after, nr_vdisks / 2);
+	ck_assert(is_subset(vdisks, nr_vdisks, vdisks_after,
+			    nr_vdisks_after, vdisk_cmp));
+
+	remove_vdisks(&disk);
+	ck_assert(RB_EMPTY_ROOT(&md.vroot));
+}
+END_TEST
+
 static void gen_data_from_disks(double *data, int idx)
 {
 	struct disk *disks;
@@ -592,6 +623,7 @@ static Suite *test_suite(void)
 	tcase_add_test(tc_nodes5, test_nodes_update);
 	tcase_add_test(tc_nodes5, test_nodes_dispersion);
 	tcase_add_test(tc_disks1, test_disks_dispersion);
+	tcase_add_test(tc_disks1, test_disks_weight);
 	tcase_add_test(tc_disks2, test_disks_update);
 	tcase_add_test(tc_disks2, test_disks_dispersion);
 	tcase_add_test(tc_disks3, test_disks_update);
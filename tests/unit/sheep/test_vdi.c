@@ -30,9 +30,9 @@ void tearDown(void)
 static void test_vdi(void)
 {
 	struct system_info mock_sys = {0}; sys = &mock_sys;
-	add_vdi_state(1, 1, true, 0, 22, 0);
-	add_vdi_state(2, 1, true, 0, 22, 0);
-	add_vdi_state(3, 2, false, 0, 22, 0);
+	add_vdi_state(1, 1, true, 0, 22, 0, 0);
+	add_vdi_state(2, 1, true, 0, 22, 0, 0);
+	add_vdi_state(3, 2, false, 0, 22, 0, 0);
 	TEST_ASSERT_EQUAL_INT(1, get_vdi_copy_number(1));
 	TEST_ASSERT_EQUAL_INT(1, get_vdi_copy_number(2));
 	TEST_ASSERT_EQUAL_INT(2, get_vdi_copy_number(3));
@@ -51,7 +51,7 @@ static void test_fill_vdi_state_list_one(void)
 	const struct sd_req request = { .data_length = SIZE_VDI_STATE };
 	struct sd_rsp response = {0};
 	struct vdi_state state = {0};
-	add_vdi_state(1, 3, false, 0, 22, 0);
+	add_vdi_state(1, 3, false, 0, 22, 0, 0);
 	TEST_ASSERT_EQUAL_INT(SD_RES_SUCCESS, fill_vdi_state_list(&request, &response, &state));
 	TEST_ASSERT_EQUAL_UINT32(SIZE_VDI_STATE, response.data_length);
 	TEST_ASSERT_EQUAL_UINT32(1, state.vid);
@@ -69,7 +69,7 @@ static void test_fill_vdi_state_list_should_set_deleted(void)
 	const struct sd_req request = { .data_length = SIZE_VDI_STATE };
 	struct sd_rsp response = {0};
 	struct vdi_state state = {0};
-	add_vdi_state(1, 3, false, 0, 22, 0);
+	add_vdi_state(1, 3, false, 0, 22, 0, 0);
 	vdi_mark_deleted(1);
 	TEST_ASSERT_EQUAL_INT(SD_RES_SUCCESS, fill_vdi_state_list(&request, &response, &state));
 	TEST_ASSERT_EQUAL_UINT32(SIZE_VDI_STATE, response.data_length);
@@ -82,6 +82,23 @@ static void test_fill_vdi_state_list_should_set_deleted(void)
 	TEST_ASSERT_TRUE(state.deleted);
 }
 
+static void test_vdi_flags(void)
+{
+	const size_t SIZE_VDI_STATE = sizeof(struct vdi_state);
+	const struct sd_req request = { .data_length = SIZE_VDI_STATE };
+	struct sd_rsp response = {0};
+	struct vdi_state state = {0};
+	struct system_info mock_sys = {0}; sys = &mock_sys;
+	add_vdi_state(1, 3, false, 0, 22, 0, SD_INODE_COMPRESS);
+	TEST_ASSERT_EQUAL_UINT8(SD_INODE_COMPRESS, get_vdi_flags(1));
+	TEST_ASSERT_TRUE(vdi_is_compressed(1));
+	TEST_ASSERT_EQUAL_INT(SD_RES_SUCCESS, fill_vdi_state_list(&request, &response, &state));
+	TEST_ASSERT_EQUAL_UINT8(SD_INODE_COMPRESS, state.flags);
+	add_vdi_state(1, 3, true, 0, 22, 0, 0);
+	TEST_ASSERT_EQUAL_UINT8(0, get_vdi_flags(1));
+	TEST_ASSERT_FALSE(vdi_is_compressed(1));
+}
+
 int main(void)
 {
 	UNITY_BEGIN();
@@ -89,5 +106,6 @@ int main(void)
 	RUN_TEST(test_fill_vdi_state_list_empty);
 	RUN_TEST(test_fill_vdi_state_list_one);
 	RUN_TEST(test_fill_vdi_state_list_should_set_deleted);
+	RUN_TEST(test_vdi_flags);
 	return UNITY_END();
 }